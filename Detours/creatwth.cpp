@@ -328,6 +328,177 @@ static BOOL RecordExeRestore(HANDLE hProcess, HMODULE hModule, DETOUR_EXE_RESTOR
     return TRUE;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Cache of the import tables built by UpdateImports32/64.  For a given image
+// and set of DLLs the new import table is the same in every process, so when
+// enabled with DetourSetReuseImportPatches, the first process records it and
+// later processes running the same image get it replayed.
+//
+#define DETOUR_IMPORT_PATCH_CACHE_SIZE  8
+
+typedef struct _DETOUR_IMPORT_PATCH
+{
+    // The image (as told apart by its headers) and the DLLs being inserted.
+    WORD    wMagic;
+    DWORD   dwTimeDateStamp;
+    DWORD   dwCheckSum;
+    DWORD   cbImage;
+    DWORD   rvaImports;
+    DWORD   cbImports;
+    DWORD   nDlls;
+    PBYTE   pbDlls;         // The DLL names, each followed by its '\0'.
+    DWORD   cbDlls;
+
+    // The new import table, with the RVAs within it relative to the table.
+    PBYTE   pbTable;
+    DWORD   cbTable;
+    DWORD   rvaIat;         // IAT_DIRECTORY after the section scan (0 if none).
+    DWORD   cbIat;
+    DWORD   obLastBase;     // Where the table went last time, relative to the image.
+} DETOUR_IMPORT_PATCH, *PDETOUR_IMPORT_PATCH;
+
+static BOOL                 s_fReuseImportPatches = FALSE;
+static SRWLOCK              s_srwImportPatches = SRWLOCK_INIT;
+static DETOUR_IMPORT_PATCH  s_rImportPatches[DETOUR_IMPORT_PATCH_CACHE_SIZE];
+static DWORD                s_nNextImportPatch = 0;
+
+BOOL WINAPI DetourSetReuseImportPatches(_In_ BOOL fReuse)
+{
+    BOOL fPrevious = s_fReuseImportPatches;
+    s_fReuseImportPatches = fReuse;
+    return fPrevious;
+}
+
+// Moves the new DLLs' entries (the first nDlls descriptors) by obDelta.
+static VOID detour_relocate_import_table(PBYTE pbTable, DWORD nDlls, DWORD obDelta)
+{
+    PIMAGE_IMPORT_DESCRIPTOR piid = (PIMAGE_IMPORT_DESCRIPTOR)pbTable;
+    for (DWORD n = 0; n < nDlls; n++) {
+        piid[n].OriginalFirstThunk += obDelta;
+        piid[n].FirstThunk += obDelta;
+        piid[n].Name += obDelta;
+    }
+}
+
+static BOOL detour_import_patch_matches(const DETOUR_IMPORT_PATCH& ipp,
+                                        const DETOUR_IMPORT_PATCH& key,
+                                        LPCSTR *plpDlls)
+{
+    if (ipp.pbTable == NULL ||
+        ipp.wMagic != key.wMagic ||
+        ipp.dwTimeDateStamp != key.dwTimeDateStamp ||
+        ipp.dwCheckSum != key.dwCheckSum ||
+        ipp.cbImage != key.cbImage ||
+        ipp.rvaImports != key.rvaImports ||
+        ipp.cbImports != key.cbImports ||
+        ipp.nDlls != key.nDlls) {
+        return FALSE;
+    }
+
+    PBYTE pbDll = ipp.pbDlls;
+    PBYTE pbEnd = ipp.pbDlls + ipp.cbDlls;
+    for (DWORD n = 0; n < key.nDlls; n++) {
+        DWORD cb = (DWORD)strlen(plpDlls[n]) + 1;
+        if ((DWORD)(pbEnd - pbDll) < cb || memcmp(pbDll, plpDlls[n], cb) != 0) {
+            return FALSE;
+        }
+        pbDll += cb;
+    }
+    return pbDll == pbEnd;
+}
+
+// On a hit, fills in pipp with a copy of the cached entry, whose pbTable the
+// caller then owns (and pbDlls doesn't).
+static BOOL detour_find_import_patch(PDETOUR_IMPORT_PATCH pipp,
+                                     const DETOUR_IMPORT_PATCH& key,
+                                     LPCSTR *plpDlls)
+{
+    BOOL fFound = FALSE;
+
+    AcquireSRWLockShared(&s_srwImportPatches);
+    for (DWORD i = 0; i < DETOUR_IMPORT_PATCH_CACHE_SIZE; i++) {
+        if (detour_import_patch_matches(s_rImportPatches[i], key, plpDlls)) {
+            PBYTE pbTable = new BYTE [s_rImportPatches[i].cbTable];
+            if (pbTable != NULL) {
+                *pipp = s_rImportPatches[i];
+                CopyMemory(pbTable, pipp->pbTable, pipp->cbTable);
+                pipp->pbTable = pbTable;
+                pipp->pbDlls = NULL;
+                fFound = TRUE;
+            }
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&s_srwImportPatches);
+
+    return fFound;
+}
+
+// Records the import table that was just written at obBase, or only where it
+// went if we had it already.  Failure to do so is of no consequence.
+static VOID detour_save_import_patch(const DETOUR_IMPORT_PATCH& key,
+                                     LPCSTR *plpDlls,
+                                     PBYTE pbTable,
+                                     DWORD cbTable,
+                                     DWORD obBase,
+                                     DWORD rvaIat,
+                                     DWORD cbIat)
+{
+    AcquireSRWLockExclusive(&s_srwImportPatches);
+
+    PDETOUR_IMPORT_PATCH pipp = NULL;
+    for (DWORD i = 0; i < DETOUR_IMPORT_PATCH_CACHE_SIZE; i++) {
+        if (detour_import_patch_matches(s_rImportPatches[i], key, plpDlls)) {
+            pipp = &s_rImportPatches[i];
+            break;
+        }
+    }
+
+    if (pipp == NULL) {
+        DWORD cbDlls = 0;
+        for (DWORD n = 0; n < key.nDlls; n++) {
+            cbDlls += (DWORD)strlen(plpDlls[n]) + 1;
+        }
+
+        PBYTE pbNewTable = new BYTE [cbTable];
+        PBYTE pbNewDlls = new BYTE [cbDlls];
+        if (pbNewTable == NULL || pbNewDlls == NULL) {
+            delete[] pbNewTable;
+            delete[] pbNewDlls;
+            ReleaseSRWLockExclusive(&s_srwImportPatches);
+            return;
+        }
+
+        CopyMemory(pbNewTable, pbTable, cbTable);
+        detour_relocate_import_table(pbNewTable, key.nDlls, 0 - obBase);
+
+        PBYTE pbDll = pbNewDlls;
+        for (DWORD n = 0; n < key.nDlls; n++) {
+            DWORD cb = (DWORD)strlen(plpDlls[n]) + 1;
+            CopyMemory(pbDll, plpDlls[n], cb);
+            pbDll += cb;
+        }
+
+        // Round robin replacement; few packages launch more than a handful of images.
+        pipp = &s_rImportPatches[s_nNextImportPatch];
+        s_nNextImportPatch = (s_nNextImportPatch + 1) % DETOUR_IMPORT_PATCH_CACHE_SIZE;
+        delete[] pipp->pbTable;
+        delete[] pipp->pbDlls;
+
+        *pipp = key;
+        pipp->pbDlls = pbNewDlls;
+        pipp->cbDlls = cbDlls;
+        pipp->pbTable = pbNewTable;
+        pipp->cbTable = cbTable;
+        pipp->rvaIat = rvaIat;
+        pipp->cbIat = cbIat;
+    }
+    pipp->obLastBase = obBase;
+
+    ReleaseSRWLockExclusive(&s_srwImportPatches);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 #if DETOURS_32BIT
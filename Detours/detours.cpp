@@ -1002,8 +1002,9 @@ inline ULONG detour_is_code_filler(PBYTE pbCode)
 struct DETOUR_REGION
 {
     ULONG               dwSignature;
-    DETOUR_REGION *     pNext;  // Next region in list of regions.
-    DETOUR_TRAMPOLINE * pFree;  // List of free trampolines in this region.
+    DETOUR_REGION *     pNext;      // Next region in list of regions.
+    DETOUR_TRAMPOLINE * pFree;      // List of free trampolines in this region.
+    BOOL                fWritable;  // Made writable by the current transaction.
 };
 typedef DETOUR_REGION * PDETOUR_REGION;
 
@@ -1014,30 +1015,338 @@ const ULONG DETOUR_TRAMPOLINES_PER_REGION = (DETOUR_REGION_SIZE
 static PDETOUR_REGION s_pRegions = NULL;            // List of all regions.
 static PDETOUR_REGION s_pRegion = NULL;             // Default region.
 
-static DWORD detour_writable_trampoline_regions()
+// Regions only get made writable once a transaction allocates or frees one of
+// their trampolines, and only those get made executable again at the end of
+// it, rather than changing the protection of every region on every transaction.
+static BOOL detour_writable_trampoline_region(PDETOUR_REGION pRegion)
 {
-    // Mark all of the regions as writable.
-    for (PDETOUR_REGION pRegion = s_pRegions; pRegion != NULL; pRegion = pRegion->pNext) {
-        DWORD dwOld;
-        if (!VirtualProtect(pRegion, DETOUR_REGION_SIZE, PAGE_EXECUTE_READWRITE, &dwOld)) {
-            return GetLastError();
-        }
+    if (pRegion->fWritable) {
+        return TRUE;
     }
-    return NO_ERROR;
+
+    DWORD dwOld;
+    if (!VirtualProtect(pRegion, DETOUR_REGION_SIZE, PAGE_EXECUTE_READWRITE, &dwOld)) {
+        return FALSE;
+    }
+    pRegion->fWritable = TRUE;
+    return TRUE;
 }
 
 static void detour_runnable_trampoline_regions()
 {
     HANDLE hProcess = GetCurrentProcess();
 
-    // Mark all of the regions as executable.
+    // Mark the regions that the transaction changed as executable.
     for (PDETOUR_REGION pRegion = s_pRegions; pRegion != NULL; pRegion = pRegion->pNext) {
+        if (!pRegion->fWritable) {
+            continue;
+        }
+        pRegion->fWritable = FALSE;
+
         DWORD dwOld;
         VirtualProtect(pRegion, DETOUR_REGION_SIZE, PAGE_EXECUTE_READ, &dwOld);
         FlushInstructionCache(hProcess, pRegion, DETOUR_REGION_SIZE);
     }
 }
 
+// Each module that gets detoured remembers the region that its trampolines
+// last came from, which is where its next one gets looked for first.  Most
+// detours are of functions in a handful of modules, so this usually finds room
+// without walking the list of regions, and keeps each module's trampolines
+// together.  Modules are told apart by their address range, so looking one up
+// doesn't take a system call once a module has been seen.
+struct DETOUR_MODULE_REGION
+{
+    PBYTE               pbModuleLo;
+    PBYTE               pbModuleHi;
+    DWORD               dwTimeDateStamp;
+    PDETOUR_REGION      pRegion;
+};
+
+const ULONG DETOUR_MODULE_REGIONS = 16;
+static DETOUR_MODULE_REGION s_rModuleRegions[DETOUR_MODULE_REGIONS];
+static ULONG s_nModuleRegions = 0;
+
+static DETOUR_MODULE_REGION * detour_find_module_region(PBYTE pbTarget)
+{
+    for (ULONG n = 0; n < s_nModuleRegions; n++) {
+        if (pbTarget >= s_rModuleRegions[n].pbModuleLo && pbTarget < s_rModuleRegions[n].pbModuleHi) {
+            return &s_rModuleRegions[n];
+        }
+    }
+
+    // Not one that we've seen before, so find out which module it is.
+    MEMORY_BASIC_INFORMATION mbi;
+    ZeroMemory(&mbi, sizeof(mbi));
+    if (!VirtualQuery(pbTarget, &mbi, sizeof(mbi)) || mbi.Type != MEM_IMAGE) {
+        return NULL;
+    }
+
+    PBYTE pbModule = (PBYTE)mbi.AllocationBase;
+    PBYTE pbModuleHi = NULL;
+    DWORD dwTimeDateStamp = 0;
+    __try {
+        PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pbModule;
+        if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
+            return NULL;
+        }
+        PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)(pbModule + pDosHeader->e_lfanew);
+        if (pNtHeader->Signature != IMAGE_NT_SIGNATURE) {
+            return NULL;
+        }
+        pbModuleHi = pbModule + pNtHeader->OptionalHeader.SizeOfImage;
+        dwTimeDateStamp = pNtHeader->FileHeader.TimeDateStamp;
+    }
+#pragma prefast(suppress:28940, "A bad pointer means this probably isn't a PE header.")
+    __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+             EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return NULL;
+    }
+
+    // When the table is full, the oldest entry makes room.
+    ULONG n = s_nModuleRegions;
+    if (n == DETOUR_MODULE_REGIONS) {
+        MoveMemory(&s_rModuleRegions[0], &s_rModuleRegions[1],
+                   sizeof(s_rModuleRegions[0]) * (DETOUR_MODULE_REGIONS - 1));
+        n--;
+    }
+    else {
+        s_nModuleRegions++;
+    }
+
+    s_rModuleRegions[n].pbModuleLo = pbModule;
+    s_rModuleRegions[n].pbModuleHi = pbModuleHi;
+    s_rModuleRegions[n].dwTimeDateStamp = dwTimeDateStamp;
+    s_rModuleRegions[n].pRegion = NULL;
+    return &s_rModuleRegions[n];
+}
+
+static void detour_forget_module_region(PDETOUR_REGION pRegion)
+{
+    for (ULONG n = 0; n < s_nModuleRegions; n++) {
+        if (s_rModuleRegions[n].pRegion == pRegion) {
+            s_rModuleRegions[n].pRegion = NULL;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////// Prologue Cache.
+//
+// The processes of an application mostly detour the same functions of the
+// same builds of the same system DLLs, and each one disassembles the same
+// prologues to find out how much of them to move to the trampoline.  Most of
+// those prologues are position independent, i.e. get copied to the trampoline
+// as they are, and for those the outcome can be recorded: how many bytes get
+// copied and moved, and where the instructions start.  DetourGetPrologueCache
+// hands out what a process has recorded, and DetourSetPrologueCache lets
+// another process start from it, skipping the disassembler for any target
+// whose module (by its timestamp and size), RVA and bytes all match.
+//
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+
+const ULONG DETOUR_PROLOGUE_CACHE_SIGNATURE = 'Pptd';
+const ULONG DETOUR_PROLOGUE_RECORD_LIMIT = 1024;
+
+typedef struct _DETOUR_PROLOGUE
+{
+    // The target's module, as told apart by its headers, and where in it.
+    DWORD           dwTimeDateStamp;
+    DWORD           cbImage;
+    DWORD           rvaTarget;
+
+    BYTE            cbTarget;       // Bytes moved, including any filler.
+    BYTE            cbCode;         // Bytes copied to the trampoline.
+    BYTE            nAlign;
+    BYTE            bReserved;
+    _DETOUR_ALIGN   rAlign[8];
+    BYTE            rbTarget[32];   // The first cbTarget bytes of the target.
+} DETOUR_PROLOGUE, *PDETOUR_PROLOGUE;
+
+typedef struct _DETOUR_PROLOGUE_CACHE
+{
+    DWORD           dwSignature;
+    WORD            wMachine;
+    WORD            cbEntry;
+    DWORD           nEntries;       // Sorted by module, then RVA.
+    DETOUR_PROLOGUE rEntries[1];
+} DETOUR_PROLOGUE_CACHE, *PDETOUR_PROLOGUE_CACHE;
+
+#ifdef DETOURS_X64
+const WORD DETOUR_PROLOGUE_MACHINE = IMAGE_FILE_MACHINE_AMD64;
+#else
+const WORD DETOUR_PROLOGUE_MACHINE = IMAGE_FILE_MACHINE_I386;
+#endif
+
+static const DETOUR_PROLOGUE_CACHE *    s_pPrologueCache = NULL;
+static BOOL                             s_fRecordPrologues = FALSE;
+static PDETOUR_PROLOGUE                 s_pRecordedPrologues = NULL;
+static ULONG                            s_nRecordedPrologues = 0;
+
+static LONG detour_compare_prologues(const DETOUR_PROLOGUE *pLeft, const DETOUR_PROLOGUE *pRight)
+{
+    if (pLeft->dwTimeDateStamp != pRight->dwTimeDateStamp) {
+        return pLeft->dwTimeDateStamp < pRight->dwTimeDateStamp ? -1 : 1;
+    }
+    if (pLeft->cbImage != pRight->cbImage) {
+        return pLeft->cbImage < pRight->cbImage ? -1 : 1;
+    }
+    if (pLeft->rvaTarget != pRight->rvaTarget) {
+        return pLeft->rvaTarget < pRight->rvaTarget ? -1 : 1;
+    }
+    return 0;
+}
+
+// Fills in the key for the target, if it's in a module.
+static BOOL detour_prologue_key(PBYTE pbTarget, PDETOUR_PROLOGUE pKey)
+{
+    DETOUR_MODULE_REGION *pModule = detour_find_module_region(pbTarget);
+    if (pModule == NULL) {
+        return FALSE;
+    }
+
+    ZeroMemory(pKey, sizeof(*pKey));
+    pKey->dwTimeDateStamp = pModule->dwTimeDateStamp;
+    pKey->cbImage = (DWORD)(pModule->pbModuleHi - pModule->pbModuleLo);
+    pKey->rvaTarget = (DWORD)(pbTarget - pModule->pbModuleLo);
+    return TRUE;
+}
+
+static const DETOUR_PROLOGUE * detour_find_prologue(PBYTE pbTarget, const DETOUR_PROLOGUE *pKey)
+{
+    const DETOUR_PROLOGUE_CACHE *pCache = s_pPrologueCache;
+    if (pCache == NULL) {
+        return NULL;
+    }
+
+    ULONG nLo = 0;
+    ULONG nHi = pCache->nEntries;
+    while (nLo < nHi) {
+        ULONG nMid = nLo + (nHi - nLo) / 2;
+        const DETOUR_PROLOGUE *pEntry = &pCache->rEntries[nMid];
+        LONG nCompare = detour_compare_prologues(pEntry, pKey);
+        if (nCompare < 0) {
+            nLo = nMid + 1;
+        }
+        else if (nCompare > 0) {
+            nHi = nMid;
+        }
+        else {
+            // Someone else may have patched the target since.
+            if (memcmp(pEntry->rbTarget, pbTarget, pEntry->cbTarget) != 0) {
+                return NULL;
+            }
+            return pEntry;
+        }
+    }
+    return NULL;
+}
+
+static VOID detour_record_prologue(PDETOUR_PROLOGUE pKey,
+                                   PBYTE pbTarget,
+                                   ULONG cbTarget,
+                                   ULONG cbCode,
+                                   ULONG nAlign,
+                                   const _DETOUR_ALIGN *rAlign)
+{
+    if (!s_fRecordPrologues || cbTarget > sizeof(pKey->rbTarget) || nAlign > ARRAYSIZE(pKey->rAlign)) {
+        return;
+    }
+
+    if (s_pRecordedPrologues == NULL) {
+        s_pRecordedPrologues = new NOTHROW DETOUR_PROLOGUE [DETOUR_PROLOGUE_RECORD_LIMIT];
+        if (s_pRecordedPrologues == NULL) {
+            s_fRecordPrologues = FALSE;
+            return;
+        }
+    }
+
+    // Keep them sorted; each target is only recorded once.
+    ULONG n = 0;
+    for (; n < s_nRecordedPrologues; n++) {
+        LONG nCompare = detour_compare_prologues(&s_pRecordedPrologues[n], pKey);
+        if (nCompare == 0) {
+            return;
+        }
+        if (nCompare > 0) {
+            break;
+        }
+    }
+    if (s_nRecordedPrologues == DETOUR_PROLOGUE_RECORD_LIMIT) {
+        return;
+    }
+
+    MoveMemory(&s_pRecordedPrologues[n + 1], &s_pRecordedPrologues[n],
+               sizeof(DETOUR_PROLOGUE) * (s_nRecordedPrologues - n));
+    s_nRecordedPrologues++;
+
+    PDETOUR_PROLOGUE pEntry = &s_pRecordedPrologues[n];
+    *pEntry = *pKey;
+    pEntry->cbTarget = (BYTE)cbTarget;
+    pEntry->cbCode = (BYTE)cbCode;
+    pEntry->nAlign = (BYTE)nAlign;
+    CopyMemory(pEntry->rAlign, rAlign, sizeof(rAlign[0]) * nAlign);
+    CopyMemory(pEntry->rbTarget, pbTarget, cbTarget);
+}
+
+#endif // DETOURS_X86 || DETOURS_X64
+
+BOOL WINAPI DetourSetPrologueCache(_In_reads_bytes_opt_(cbCache) PVOID pvCache,
+                                   _In_ DWORD cbCache,
+                                   _In_ BOOL fRecord)
+{
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    const DETOUR_PROLOGUE_CACHE *pCache = (const DETOUR_PROLOGUE_CACHE *)pvCache;
+    if (pCache != NULL) {
+        if (cbCache < FIELD_OFFSET(DETOUR_PROLOGUE_CACHE, rEntries) ||
+            pCache->dwSignature != DETOUR_PROLOGUE_CACHE_SIGNATURE ||
+            pCache->wMachine != DETOUR_PROLOGUE_MACHINE ||
+            pCache->cbEntry != sizeof(DETOUR_PROLOGUE) ||
+            pCache->nEntries > (cbCache - FIELD_OFFSET(DETOUR_PROLOGUE_CACHE, rEntries))
+                               / sizeof(DETOUR_PROLOGUE)) {
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+        }
+    }
+
+    s_pPrologueCache = pCache;
+    s_fRecordPrologues = fRecord;
+    return TRUE;
+#else
+    (void)pvCache;
+    (void)cbCache;
+    (void)fRecord;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif
+}
+
+DWORD WINAPI DetourGetPrologueCache(_Out_writes_bytes_opt_(cbBuffer) PVOID pvBuffer,
+                                    _In_ DWORD cbBuffer)
+{
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    DWORD cbCache = FIELD_OFFSET(DETOUR_PROLOGUE_CACHE, rEntries) +
+        sizeof(DETOUR_PROLOGUE) * s_nRecordedPrologues;
+    if (pvBuffer == NULL || cbBuffer < cbCache) {
+        return cbCache;
+    }
+
+    PDETOUR_PROLOGUE_CACHE pCache = (PDETOUR_PROLOGUE_CACHE)pvBuffer;
+    pCache->dwSignature = DETOUR_PROLOGUE_CACHE_SIGNATURE;
+    pCache->wMachine = DETOUR_PROLOGUE_MACHINE;
+    pCache->cbEntry = sizeof(DETOUR_PROLOGUE);
+    pCache->nEntries = s_nRecordedPrologues;
+    if (s_nRecordedPrologues != 0) {
+        CopyMemory(pCache->rEntries, s_pRecordedPrologues,
+                   sizeof(DETOUR_PROLOGUE) * s_nRecordedPrologues);
+    }
+    return cbCache;
+#else
+    (void)pvBuffer;
+    (void)cbBuffer;
+    return 0;
+#endif
+}
+
 static PBYTE detour_alloc_round_down_to_region(PBYTE pbTry)
 {
     // WinXP64 returns free areas that aren't REGION aligned to 32-bit applications.
@@ -1163,6 +1472,12 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
     detour_find_jmp_bounds(pbTarget, &pLo, &pHi);
 
     PDETOUR_TRAMPOLINE pTrampoline = NULL;
+    DETOUR_MODULE_REGION *pModuleRegion = detour_find_module_region(pbTarget);
+
+    // Start with the region that the module's trampolines last came from.
+    if (pModuleRegion != NULL && pModuleRegion->pRegion != NULL) {
+        s_pRegion = pModuleRegion->pRegion;
+    }
 
     // Insure that there is a default region.
     if (s_pRegion == NULL && s_pRegions != NULL) {
@@ -1179,8 +1494,14 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
         if (pTrampoline < pLo || pTrampoline > pHi) {
             return NULL;
         }
+        if (!detour_writable_trampoline_region(s_pRegion)) {
+            return NULL;
+        }
         s_pRegion->pFree = (PDETOUR_TRAMPOLINE)pTrampoline->pbRemain;
         memset(pTrampoline, 0xcc, sizeof(*pTrampoline));
+        if (pModuleRegion != NULL) {
+            pModuleRegion->pRegion = s_pRegion;
+        }
         return pTrampoline;
     }
 
@@ -1234,6 +1555,7 @@ static PDETOUR_TRAMPOLINE detour_alloc_trampoline(PBYTE pbTarget)
         s_pRegion = (DETOUR_REGION*)pbTry;
         s_pRegion->dwSignature = DETOUR_REGION_SIGNATURE;
         s_pRegion->pFree = NULL;
+        s_pRegion->fWritable = TRUE;    // Allocated as PAGE_EXECUTE_READWRITE.
         s_pRegion->pNext = s_pRegions;
         s_pRegions = s_pRegion;
         DETOUR_TRACE(("  Allocated region %p..%p\n\n",
@@ -1259,6 +1581,11 @@ static void detour_free_trampoline(PDETOUR_TRAMPOLINE pTrampoline)
     PDETOUR_REGION pRegion = (PDETOUR_REGION)
         ((ULONG_PTR)pTrampoline & ~(ULONG_PTR)0xffff);
 
+    // If the region can't be written, the trampoline just stays allocated.
+    if (!detour_writable_trampoline_region(pRegion)) {
+        return;
+    }
+
     memset(pTrampoline, 0, sizeof(*pTrampoline));
     pTrampoline->pbRemain = (PBYTE)pRegion->pFree;
     pRegion->pFree = pTrampoline;
@@ -1297,6 +1624,7 @@ static void detour_free_unused_trampoline_regions()
         if (detour_is_region_empty(pRegion)) {
             *ppRegionBase = pRegion->pNext;
 
+            detour_forget_module_region(pRegion);
             VirtualFree(pRegion, 0, MEM_RELEASE);
             s_pRegion = NULL;
         }
@@ -1313,8 +1641,24 @@ struct DetourThread
 {
     DetourThread *      pNext;
     HANDLE              hThread;
+    BOOL                fOwned;     // From DetourUpdateAllThreads, which opened hThread
+                                    // and allocated the entry from a thread block.
 };
 
+// DetourUpdateAllThreads can't allocate from the heap once it has started
+// suspending threads, since any of them may be holding the heap's lock, so its
+// entries come from blocks straight from VirtualAlloc instead.
+struct DetourThreadBlock
+{
+    DetourThreadBlock * pNext;
+    ULONG               nUsed;
+    DetourThread        rThreads[1];
+};
+
+#define DETOUR_THREAD_BLOCK_SIZE    0x10000
+#define DETOUR_THREADS_PER_BLOCK    ((DETOUR_THREAD_BLOCK_SIZE - FIELD_OFFSET(DetourThreadBlock, rThreads)) \
+                                     / sizeof(DetourThread))
+
 struct DetourOperation
 {
     DetourOperation *   pNext;
@@ -1332,8 +1676,15 @@ static LONG                 s_nPendingThreadId      = 0; // Thread owning pendin
 static LONG                 s_nPendingError         = NO_ERROR;
 static PVOID *              s_ppPendingError        = NULL;
 static DetourThread *       s_pPendingThreads       = NULL;
+static DetourThreadBlock *  s_pPendingThreadBlocks  = NULL;
 static DetourOperation *    s_pPendingOperations    = NULL;
 
+// How long the last transaction kept other threads suspended, and how many.
+static LONGLONG             s_llSuspendStart        = 0;
+static ULONGLONG            s_nLastSuspendMicroseconds = 0;
+static DWORD                s_nPendingSuspendedThreads = 0;
+static DWORD                s_nLastSuspendedThreads = 0;
+
 //////////////////////////////////////////////////////////////////////////////
 //
 PVOID WINAPI DetourCodeFromPointer(_In_ PVOID pPointer,
@@ -1388,14 +1739,68 @@ _Benign_race_end_
 
     s_pPendingOperations = NULL;
     s_pPendingThreads = NULL;
+    s_pPendingThreadBlocks = NULL;
+    s_nPendingSuspendedThreads = 0;
     s_ppPendingError = NULL;
 
-    // Make sure the trampoline pages are writable.
-    s_nPendingError = detour_writable_trampoline_regions();
+    // Trampoline regions get made writable as the transaction needs them.
+    s_nPendingError = NO_ERROR;
 
     return s_nPendingError;
 }
 
+static VOID detour_resume_threads()
+{
+    // Resume all of the threads before freeing anything, so that none of them
+    // is still suspended while we take the heap's lock.
+    for (DetourThread *t = s_pPendingThreads; t != NULL; t = t->pNext) {
+        // There is nothing we can do if this fails.
+        ResumeThread(t->hThread);
+    }
+
+    if (s_nPendingSuspendedThreads != 0) {
+        LARGE_INTEGER llNow;
+        LARGE_INTEGER llFrequency;
+        QueryPerformanceCounter(&llNow);
+        QueryPerformanceFrequency(&llFrequency);
+        s_nLastSuspendMicroseconds = (ULONGLONG)(llNow.QuadPart - s_llSuspendStart) * 1000000
+            / (ULONGLONG)llFrequency.QuadPart;
+    }
+    else {
+        s_nLastSuspendMicroseconds = 0;
+    }
+    s_nLastSuspendedThreads = s_nPendingSuspendedThreads;
+    s_nPendingSuspendedThreads = 0;
+
+    for (DetourThread *t = s_pPendingThreads; t != NULL;) {
+        DetourThread *n = t->pNext;
+        if (t->fOwned) {
+            CloseHandle(t->hThread);
+        }
+        else {
+            delete t;
+        }
+        t = n;
+    }
+    s_pPendingThreads = NULL;
+
+    for (DetourThreadBlock *b = s_pPendingThreadBlocks; b != NULL;) {
+        DetourThreadBlock *n = b->pNext;
+        VirtualFree(b, 0, MEM_RELEASE);
+        b = n;
+    }
+    s_pPendingThreadBlocks = NULL;
+}
+
+static VOID detour_note_suspended_thread()
+{
+    if (s_nPendingSuspendedThreads++ == 0) {
+        LARGE_INTEGER llNow;
+        QueryPerformanceCounter(&llNow);
+        s_llSuspendStart = llNow.QuadPart;
+    }
+}
+
 LONG WINAPI DetourTransactionAbort()
 {
     if (s_nPendingThreadId != (LONG)GetCurrentThreadId()) {
@@ -1403,7 +1808,7 @@ LONG WINAPI DetourTransactionAbort()
     }
 
     // Restore all of the page permissions.
-    for (DetourOperation *o = s_pPendingOperations; o != NULL;) {
+    for (DetourOperation *o = s_pPendingOperations; o != NULL; o = o->pNext) {
         // We don't care if this fails, because the code is still accessible.
         DWORD dwOld;
         VirtualProtect(o->pbTarget, o->pTrampoline->cbRestore,
@@ -1415,26 +1820,20 @@ LONG WINAPI DetourTransactionAbort()
                 o->pTrampoline = NULL;
             }
         }
-
-        DetourOperation *n = o->pNext;
-        delete o;
-        o = n;
     }
-    s_pPendingOperations = NULL;
 
     // Make sure the trampoline pages are no longer writable.
     detour_runnable_trampoline_regions();
 
     // Resume any suspended threads.
-    for (DetourThread *t = s_pPendingThreads; t != NULL;) {
-        // There is nothing we can do if this fails.
-        ResumeThread(t->hThread);
+    detour_resume_threads();
 
-        DetourThread *n = t->pNext;
-        delete t;
-        t = n;
+    for (DetourOperation *o = s_pPendingOperations; o != NULL;) {
+        DetourOperation *n = o->pNext;
+        delete o;
+        o = n;
     }
-    s_pPendingThreads = NULL;
+    s_pPendingOperations = NULL;
     s_nPendingThreadId = 0;
 
     return NO_ERROR;
@@ -1689,7 +2088,7 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
 
     // Restore all of the page permissions and flush the icache.
     HANDLE hProcess = GetCurrentProcess();
-    for (o = s_pPendingOperations; o != NULL;) {
+    for (o = s_pPendingOperations; o != NULL; o = o->pNext) {
         // We don't care if this fails, because the code is still accessible.
         DWORD dwOld;
         VirtualProtect(o->pbTarget, o->pTrampoline->cbRestore, o->dwPerm, &dwOld);
@@ -1700,12 +2099,7 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
             o->pTrampoline = NULL;
             freed = true;
         }
-
-        DetourOperation *n = o->pNext;
-        delete o;
-        o = n;
     }
-    s_pPendingOperations = NULL;
 
     // Free any trampoline regions that are now unused.
     if (freed && !s_fRetainRegions) {
@@ -1715,16 +2109,15 @@ typedef ULONG_PTR DETOURS_EIP_TYPE;
     // Make sure the trampoline pages are no longer writable.
     detour_runnable_trampoline_regions();
 
-    // Resume any suspended threads.
-    for (t = s_pPendingThreads; t != NULL;) {
-        // There is nothing we can do if this fails.
-        ResumeThread(t->hThread);
+    // Resume any suspended threads, and only then free the operations.
+    detour_resume_threads();
 
-        DetourThread *n = t->pNext;
-        delete t;
-        t = n;
+    for (o = s_pPendingOperations; o != NULL;) {
+        DetourOperation *n = o->pNext;
+        delete o;
+        o = n;
     }
-    s_pPendingThreads = NULL;
+    s_pPendingOperations = NULL;
     s_nPendingThreadId = 0;
 
     if (pppFailedPointer != NULL) {
@@ -1769,10 +2162,145 @@ LONG WINAPI DetourUpdateThread(_In_ HANDLE hThread)
     }
 
     t->hThread = hThread;
+    t->fOwned = FALSE;
     t->pNext = s_pPendingThreads;
     s_pPendingThreads = t;
+    detour_note_suspended_thread();
+
+    return NO_ERROR;
+}
+
+typedef LONG (NTAPI *PF_NtGetNextThread)(HANDLE hProcess,
+                                         HANDLE hThread,
+                                         ACCESS_MASK nDesiredAccess,
+                                         ULONG nHandleAttributes,
+                                         ULONG nFlags,
+                                         PHANDLE phNewThread);
+
+static BOOL detour_is_pending_thread(DWORD nThreadId)
+{
+    for (DetourThread *t = s_pPendingThreads; t != NULL; t = t->pNext) {
+        if (GetThreadId(t->hThread) == nThreadId) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static DetourThread * detour_alloc_owned_thread()
+{
+    DetourThreadBlock *b = s_pPendingThreadBlocks;
+    if (b == NULL || b->nUsed == DETOUR_THREADS_PER_BLOCK) {
+        b = (DetourThreadBlock *)VirtualAlloc(NULL, DETOUR_THREAD_BLOCK_SIZE,
+                                              MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->pNext = s_pPendingThreadBlocks;
+        b->nUsed = 0;
+        s_pPendingThreadBlocks = b;
+    }
+    return &b->rThreads[b->nUsed++];
+}
+
+LONG WINAPI DetourUpdateAllThreads(VOID)
+{
+    LONG error;
+
+    // If any of the pending operations failed, then we don't need to do this.
+    if (s_nPendingError != NO_ERROR) {
+        return s_nPendingError;
+    }
+
+    static PF_NtGetNextThread s_pfNtGetNextThread = NULL;
+    if (s_pfNtGetNextThread == NULL) {
+        s_pfNtGetNextThread = (PF_NtGetNextThread)GetProcAddress(GetModuleHandleW(L"ntdll.dll"),
+                                                                 "NtGetNextThread");
+        if (s_pfNtGetNextThread == NULL) {
+            error = ERROR_PROC_NOT_FOUND;
+            goto fail;
+        }
+    }
+
+    {
+        const DWORD nSelf = GetCurrentThreadId();
+        const ACCESS_MASK nAccess = THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT |
+            THREAD_SET_CONTEXT | THREAD_QUERY_LIMITED_INFORMATION;
+
+        // Threads can start while we go, so keep going until a pass over the
+        // process's threads doesn't turn up any that aren't suspended yet.
+        // Since everything found so far is suspended, this converges quickly.
+        for (BOOL fFound = TRUE; fFound;) {
+            fFound = FALSE;
+
+            HANDLE hThread = NULL;
+            HANDLE hNext;
+            while (s_pfNtGetNextThread(GetCurrentProcess(), hThread, nAccess, 0, 0, &hNext) >= 0) {
+                if (hThread != NULL) {
+                    CloseHandle(hThread);
+                }
+                hThread = hNext;
+
+                DWORD nThreadId = GetThreadId(hThread);
+                if (nThreadId == nSelf || detour_is_pending_thread(nThreadId)) {
+                    continue;
+                }
+
+                DetourThread *t = detour_alloc_owned_thread();
+                if (t == NULL) {
+                    CloseHandle(hThread);
+                    error = ERROR_NOT_ENOUGH_MEMORY;
+                    goto fail;
+                }
+
+                if (SuspendThread(hThread) == (DWORD)-1) {
+                    // The thread may have exited since we found it.
+                    t->hThread = NULL;
+                    s_pPendingThreadBlocks->nUsed--;
+                    continue;
+                }
+
+                // The entry takes over the handle, so get a new one to go on.
+                if (!DuplicateHandle(GetCurrentProcess(), hThread, GetCurrentProcess(), &t->hThread,
+                                     0, FALSE, DUPLICATE_SAME_ACCESS)) {
+                    error = GetLastError();
+                    ResumeThread(hThread);
+                    CloseHandle(hThread);
+                    s_pPendingThreadBlocks->nUsed--;
+                    goto fail;
+                }
+
+                t->fOwned = TRUE;
+                t->pNext = s_pPendingThreads;
+                s_pPendingThreads = t;
+                detour_note_suspended_thread();
+                fFound = TRUE;
+            }
+
+            if (hThread != NULL) {
+                CloseHandle(hThread);
+            }
+        }
+    }
 
     return NO_ERROR;
+
+  fail:
+    s_nPendingError = error;
+    s_ppPendingError = NULL;
+    DETOUR_BREAK();
+    return error;
+}
+
+VOID WINAPI DetourGetLastSuspension(_Out_opt_ DWORD *pnThreads,
+                                    _Out_opt_ ULONGLONG *pnMicroseconds)
+{
+    if (pnThreads != NULL) {
+        *pnThreads = s_nLastSuspendedThreads;
+    }
+    if (pnMicroseconds != NULL) {
+        *pnMicroseconds = s_nLastSuspendMicroseconds;
+    }
 }
 
 ///////////////////////////////////////////////////////////// Transacted APIs.
@@ -1948,40 +2476,73 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
     }
 #endif
 
-    while (cbTarget < cbJump) {
-        PBYTE pbOp = pbSrc;
-        LONG lExtra = 0;
-
-        DETOUR_TRACE((" DetourCopyInstruction(%p,%p)\n",
-                      pbTrampoline, pbSrc));
-        pbSrc = (PBYTE)
-            DetourCopyInstruction(pbTrampoline, (PVOID*)&pbPool, pbSrc, NULL, &lExtra);
-        DETOUR_TRACE((" DetourCopyInstruction() = %p (%d bytes)\n",
-                      pbSrc, (int)(pbSrc - pbOp)));
-        pbTrampoline += (pbSrc - pbOp) + lExtra;
-        cbTarget = (LONG)(pbSrc - pbTarget);
-        pTrampoline->rAlign[nAlign].obTarget = cbTarget;
-        pTrampoline->rAlign[nAlign].obTrampoline = pbTrampoline - pTrampoline->rbCode;
-        nAlign++;
-
-        if (nAlign >= ARRAYSIZE(pTrampoline->rAlign)) {
-            break;
-        }
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    // A prologue that another process has already disassembled just gets
+    // copied; see DetourSetPrologueCache.
+    DETOUR_PROLOGUE prologueKey;
+    BOOL fPrologueKey = (s_pPrologueCache != NULL || s_fRecordPrologues) &&
+        detour_prologue_key(pbTarget, &prologueKey);
+    const DETOUR_PROLOGUE *pPrologue = fPrologueKey ? detour_find_prologue(pbTarget, &prologueKey) : NULL;
+    BOOL fPlainCopy = TRUE;
+    PBYTE pbPoolStart = pbPool;
+    if (pPrologue != NULL) {
+        CopyMemory(pbTrampoline, pbTarget, pPrologue->cbCode);
+        CopyMemory(pTrampoline->rAlign, pPrologue->rAlign, sizeof(pPrologue->rAlign[0]) * pPrologue->nAlign);
+        pbTrampoline += pPrologue->cbCode;
+        cbTarget = pPrologue->cbTarget;
+        pbSrc = pbTarget + cbTarget;
+        nAlign = pPrologue->nAlign;
+    }
+    else
+#endif
+    {
+        while (cbTarget < cbJump) {
+            PBYTE pbOp = pbSrc;
+            PBYTE pbCopy = pbTrampoline;
+            LONG lExtra = 0;
+
+            DETOUR_TRACE((" DetourCopyInstruction(%p,%p)\n",
+                          pbTrampoline, pbSrc));
+            pbSrc = (PBYTE)
+                DetourCopyInstruction(pbTrampoline, (PVOID*)&pbPool, pbSrc, NULL, &lExtra);
+            DETOUR_TRACE((" DetourCopyInstruction() = %p (%d bytes)\n",
+                          pbSrc, (int)(pbSrc - pbOp)));
+            pbTrampoline += (pbSrc - pbOp) + lExtra;
+            cbTarget = (LONG)(pbSrc - pbTarget);
+            pTrampoline->rAlign[nAlign].obTarget = cbTarget;
+            pTrampoline->rAlign[nAlign].obTrampoline = pbTrampoline - pTrampoline->rbCode;
+            nAlign++;
+
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+            // Anything that had to be relocated, e.g. a relative jump or a RIP
+            // relative operand, comes out different from the original.
+            if (lExtra != 0 || pbPool != pbPoolStart ||
+                memcmp(pbCopy, pbOp, pbSrc - pbOp) != 0) {
+                fPlainCopy = FALSE;
+            }
+#else
+            (void)pbCopy;
+#endif
 
-        if (detour_does_code_end_function(pbOp)) {
-            break;
-        }
-    }
+            if (nAlign >= ARRAYSIZE(pTrampoline->rAlign)) {
+                break;
+            }
 
-    // Consume, but don't duplicate padding if it is needed and available.
-    while (cbTarget < cbJump) {
-        LONG cFiller = detour_is_code_filler(pbSrc);
-        if (cFiller == 0) {
-            break;
+            if (detour_does_code_end_function(pbOp)) {
+                break;
+            }
         }
 
-        pbSrc += cFiller;
-        cbTarget = (LONG)(pbSrc - pbTarget);
+        // Consume, but don't duplicate padding if it is needed and available.
+        while (cbTarget < cbJump) {
+            LONG cFiller = detour_is_code_filler(pbSrc);
+            if (cFiller == 0) {
+                break;
+            }
+
+            pbSrc += cFiller;
+            cbTarget = (LONG)(pbSrc - pbTarget);
+        }
     }
 
 #if DETOUR_DEBUG
@@ -2033,6 +2594,13 @@ LONG WINAPI DetourAttachEx(_Inout_ PVOID *ppPointer,
     }
 #endif // !DETOURS_IA64
 
+#if defined(DETOURS_X86) || defined(DETOURS_X64)
+    if (pPrologue == NULL && fPrologueKey && fPlainCopy) {
+        detour_record_prologue(&prologueKey, pbTarget, cbTarget, pTrampoline->cbCode,
+                               nAlign, pTrampoline->rAlign);
+    }
+#endif
+
     pTrampoline->pbRemain = pbTarget + cbTarget;
     pTrampoline->pbDetour = (PBYTE)pDetour;
 
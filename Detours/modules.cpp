@@ -164,10 +164,14 @@ PDETOUR_SYM_INFO DetourLoadImageHlp(VOID)
     return pSymInfo;
 }
 
+static PBYTE detour_find_export(_In_ HMODULE hModule,
+                                _In_ PCSTR pszFunction,
+                                _Out_ BOOL *pfExported);
+
 PVOID WINAPI DetourFindFunction(_In_ PCSTR pszModule,
                                 _In_ PCSTR pszFunction)
 {
-    /////////////////////////////////////////////// First, try GetProcAddress.
+    ////////////////////////////////// First, try the module's export index.
     //
 #pragma prefast(suppress:28752, "We don't do the unicode conversion for LoadLibraryExA.")
     HMODULE hModule = LoadLibraryExA(pszModule, NULL, 0);
@@ -175,11 +179,19 @@ PVOID WINAPI DetourFindFunction(_In_ PCSTR pszModule,
         return NULL;
     }
 
-    PBYTE pbCode = (PBYTE)GetProcAddress(hModule, pszFunction);
+    BOOL fExported = FALSE;
+    PBYTE pbCode = detour_find_export(hModule, pszFunction, &fExported);
     if (pbCode) {
         return pbCode;
     }
 
+    // Forwarded exports (and ordinals) are left to GetProcAddress.  Either
+    // way, if the name is exported, the symbols have nothing more to offer.
+    pbCode = (PBYTE)GetProcAddress(hModule, pszFunction);
+    if (pbCode || fExported) {
+        return pbCode;
+    }
+
     ////////////////////////////////////////////////////// Then try ImageHelp.
     //
     DETOUR_TRACE(("DetourFindFunction(%hs, %hs)\n", pszModule, pszFunction));
@@ -477,6 +489,281 @@ static inline PBYTE RvaAdjust(_Pre_notnull_ PIMAGE_DOS_HEADER pDosHeader, _In_ D
     return NULL;
 }
 
+///////////////////////////////////////////////////////////// Export Index.
+//
+// Looking up an export by name takes a binary search of the module's sorted
+// name table, and enumerating exports used to search the ordinal table for each
+// function's name.  Instead, the first lookup in a module builds an index of its
+// exports: a hash table of its names, and each function's name.  The index is
+// kept for the most recent few modules, and told apart by their headers, so
+// that a different image loaded at the same address once the first unloads
+// gets an index of its own.
+//
+#define DETOUR_EXPORT_INDEX_CACHE_SIZE  16
+
+typedef struct _DETOUR_EXPORT_INDEX
+{
+    // The image, as told apart by its headers.
+    PBYTE   pbModule;
+    DWORD   dwTimeDateStamp;
+    DWORD   dwCheckSum;
+    DWORD   cbImage;
+
+    PIMAGE_EXPORT_DIRECTORY pExportDir;
+    PBYTE   pExportDirEnd;
+    DWORD   nBuckets;       // A power of two, at least twice NumberOfNames.
+    PDWORD  pnBuckets;      // Name index + 1 for each bucket, 0 when empty.
+    PDWORD  pnHashes;       // Hash of each bucket's name.
+    PDWORD  pnFuncNames;    // Name index + 1 for each function, 0 if unnamed.
+} DETOUR_EXPORT_INDEX, *PDETOUR_EXPORT_INDEX;
+
+static SRWLOCK              s_srwExportIndexes = SRWLOCK_INIT;
+static PDETOUR_EXPORT_INDEX s_rpExportIndexes[DETOUR_EXPORT_INDEX_CACHE_SIZE];
+static DWORD                s_nNextExportIndex = 0;
+
+static DWORD detour_hash_export_name(_In_ PCSTR pszName)
+{
+    // FNV-1a.
+    DWORD nHash = 2166136261u;
+    for (; *pszName; pszName++) {
+        nHash = (nHash ^ (BYTE)*pszName) * 16777619u;
+    }
+    return nHash;
+}
+
+static PIMAGE_NT_HEADERS detour_export_index_headers(_In_ PBYTE pbModule)
+{
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pbModule;
+    if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
+        return NULL;
+    }
+    PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)(pbModule + pDosHeader->e_lfanew);
+    if (pNtHeader->Signature != IMAGE_NT_SIGNATURE ||
+        pNtHeader->FileHeader.SizeOfOptionalHeader == 0) {
+        return NULL;
+    }
+    return pNtHeader;
+}
+
+static BOOL detour_export_index_matches(_In_ PDETOUR_EXPORT_INDEX pIndex,
+                                        _In_ PBYTE pbModule,
+                                        _In_ PIMAGE_NT_HEADERS pNtHeader)
+{
+    return pIndex != NULL &&
+        pIndex->pbModule == pbModule &&
+        pIndex->dwTimeDateStamp == pNtHeader->FileHeader.TimeDateStamp &&
+        pIndex->dwCheckSum == pNtHeader->OptionalHeader.CheckSum &&
+        pIndex->cbImage == pNtHeader->OptionalHeader.SizeOfImage;
+}
+
+static PDETOUR_EXPORT_INDEX detour_build_export_index(_In_ PBYTE pbModule,
+                                                      _In_ PIMAGE_NT_HEADERS pNtHeader)
+{
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pbModule;
+    PIMAGE_EXPORT_DIRECTORY pExportDir
+        = (PIMAGE_EXPORT_DIRECTORY)
+        RvaAdjust(pDosHeader,
+                  pNtHeader->OptionalHeader
+                  .DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
+    if (pExportDir == NULL) {
+        return NULL;
+    }
+
+    PDWORD pdwNames = (PDWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNames);
+    PWORD pwOrdinals = (PWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNameOrdinals);
+    DWORD nNames = (pdwNames != NULL && pwOrdinals != NULL) ? pExportDir->NumberOfNames : 0;
+    DWORD nFunctions = pExportDir->NumberOfFunctions;
+
+    DWORD nBuckets = 16;
+    while (nBuckets < nNames * 2) {
+        nBuckets *= 2;
+    }
+
+    SIZE_T cbIndex = sizeof(DETOUR_EXPORT_INDEX) +
+        (sizeof(DWORD) * 2 * (SIZE_T)nBuckets) + (sizeof(DWORD) * (SIZE_T)nFunctions);
+    PDETOUR_EXPORT_INDEX pIndex = (PDETOUR_EXPORT_INDEX)
+        HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, cbIndex);
+    if (pIndex == NULL) {
+        return NULL;
+    }
+
+    pIndex->pbModule = pbModule;
+    pIndex->dwTimeDateStamp = pNtHeader->FileHeader.TimeDateStamp;
+    pIndex->dwCheckSum = pNtHeader->OptionalHeader.CheckSum;
+    pIndex->cbImage = pNtHeader->OptionalHeader.SizeOfImage;
+    pIndex->pExportDir = pExportDir;
+    pIndex->pExportDirEnd = (PBYTE)pExportDir + pNtHeader->OptionalHeader
+        .DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
+    pIndex->nBuckets = nBuckets;
+    pIndex->pnBuckets = (PDWORD)(pIndex + 1);
+    pIndex->pnHashes = pIndex->pnBuckets + nBuckets;
+    pIndex->pnFuncNames = pIndex->pnHashes + nBuckets;
+
+    for (DWORD n = 0; n < nNames; n++) {
+        PCHAR pszName = (PCHAR)RvaAdjust(pDosHeader, pdwNames[n]);
+        if (pszName == NULL || pwOrdinals[n] >= nFunctions) {
+            continue;
+        }
+
+        DWORD nHash = detour_hash_export_name(pszName);
+        DWORD nBucket = nHash & (nBuckets - 1);
+        while (pIndex->pnBuckets[nBucket] != 0) {
+            nBucket = (nBucket + 1) & (nBuckets - 1);
+        }
+        pIndex->pnBuckets[nBucket] = n + 1;
+        pIndex->pnHashes[nBucket] = nHash;
+
+        // Same as the ordinal table search this replaces, the first name wins.
+        if (pIndex->pnFuncNames[pwOrdinals[n]] == 0) {
+            pIndex->pnFuncNames[pwOrdinals[n]] = n + 1;
+        }
+    }
+
+    return pIndex;
+}
+
+// Finds or builds the module's index.  Returns with s_srwExportIndexes held
+// shared when it returns an index.
+static PDETOUR_EXPORT_INDEX detour_acquire_export_index(_In_ PBYTE pbModule)
+{
+    PIMAGE_NT_HEADERS pNtHeader = detour_export_index_headers(pbModule);
+    if (pNtHeader == NULL) {
+        return NULL;
+    }
+
+    AcquireSRWLockShared(&s_srwExportIndexes);
+    for (DWORD n = 0; n < DETOUR_EXPORT_INDEX_CACHE_SIZE; n++) {
+        if (detour_export_index_matches(s_rpExportIndexes[n], pbModule, pNtHeader)) {
+            return s_rpExportIndexes[n];
+        }
+    }
+    ReleaseSRWLockShared(&s_srwExportIndexes);
+
+    PDETOUR_EXPORT_INDEX pIndex = detour_build_export_index(pbModule, pNtHeader);
+    if (pIndex == NULL) {
+        return NULL;
+    }
+
+    AcquireSRWLockExclusive(&s_srwExportIndexes);
+    BOOL fFound = FALSE;
+    for (DWORD n = 0; n < DETOUR_EXPORT_INDEX_CACHE_SIZE; n++) {
+        if (detour_export_index_matches(s_rpExportIndexes[n], pbModule, pNtHeader)) {
+            // Another thread got here first.
+            HeapFree(GetProcessHeap(), 0, pIndex);
+            pIndex = s_rpExportIndexes[n];
+            fFound = TRUE;
+            break;
+        }
+    }
+    if (!fFound) {
+        // Replaces either the index of a module that has since been unloaded,
+        // or the oldest one.
+        DWORD nSlot = s_nNextExportIndex;
+        for (DWORD n = 0; n < DETOUR_EXPORT_INDEX_CACHE_SIZE; n++) {
+            if (s_rpExportIndexes[n] != NULL && s_rpExportIndexes[n]->pbModule == pbModule) {
+                nSlot = n;
+                break;
+            }
+        }
+        if (nSlot == s_nNextExportIndex) {
+            s_nNextExportIndex = (s_nNextExportIndex + 1) % DETOUR_EXPORT_INDEX_CACHE_SIZE;
+        }
+        if (s_rpExportIndexes[nSlot] != NULL) {
+            HeapFree(GetProcessHeap(), 0, s_rpExportIndexes[nSlot]);
+        }
+        s_rpExportIndexes[nSlot] = pIndex;
+    }
+    ReleaseSRWLockExclusive(&s_srwExportIndexes);
+
+    // There's no downgrading an SRW lock, so look it up again.
+    AcquireSRWLockShared(&s_srwExportIndexes);
+    for (DWORD n = 0; n < DETOUR_EXPORT_INDEX_CACHE_SIZE; n++) {
+        if (detour_export_index_matches(s_rpExportIndexes[n], pbModule, pNtHeader)) {
+            return s_rpExportIndexes[n];
+        }
+    }
+    ReleaseSRWLockShared(&s_srwExportIndexes);
+    return NULL;
+}
+
+static PBYTE detour_find_export(_In_ HMODULE hModule,
+                                _In_ PCSTR pszFunction,
+                                _Out_ BOOL *pfExported)
+{
+    *pfExported = FALSE;
+
+    // Ordinals are left to GetProcAddress.
+    if (IS_INTRESOURCE(pszFunction)) {
+        return NULL;
+    }
+
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
+    PDETOUR_EXPORT_INDEX pIndex = NULL;
+    PBYTE pbCode = NULL;
+    __try {
+        pIndex = detour_acquire_export_index((PBYTE)hModule);
+        if (pIndex == NULL) {
+            return NULL;
+        }
+
+        PIMAGE_EXPORT_DIRECTORY pExportDir = pIndex->pExportDir;
+        PDWORD pdwFunctions = (PDWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfFunctions);
+        PDWORD pdwNames = (PDWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNames);
+        PWORD pwOrdinals = (PWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNameOrdinals);
+
+        DWORD nHash = detour_hash_export_name(pszFunction);
+        for (DWORD nBucket = nHash & (pIndex->nBuckets - 1);
+             pIndex->pnBuckets[nBucket] != 0;
+             nBucket = (nBucket + 1) & (pIndex->nBuckets - 1)) {
+
+            DWORD nName = pIndex->pnBuckets[nBucket] - 1;
+            if (pIndex->pnHashes[nBucket] != nHash ||
+                strcmp((PCHAR)RvaAdjust(pDosHeader, pdwNames[nName]), pszFunction) != 0) {
+                continue;
+            }
+
+            *pfExported = TRUE;
+            pbCode = (pdwFunctions != NULL)
+                ? (PBYTE)RvaAdjust(pDosHeader, pdwFunctions[pwOrdinals[nName]]) : NULL;
+
+            // if the pointer is in the export region, then it is a forwarder.
+            if (pbCode > (PBYTE)pExportDir && pbCode < pIndex->pExportDirEnd) {
+                pbCode = NULL;
+            }
+            break;
+        }
+    }
+    __except(GetExceptionCode() == EXCEPTION_ACCESS_VIOLATION ?
+             EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        pbCode = NULL;
+    }
+
+    if (pIndex != NULL) {
+        ReleaseSRWLockShared(&s_srwExportIndexes);
+    }
+
+#if defined(DETOURS_ARM)
+    if (pbCode != NULL) {
+        // GetProcAddress hands out Thumb2 function pointers, and so do we.
+        pbCode = (PBYTE)DETOURS_PBYTE_TO_PFUNC(pbCode);
+    }
+#endif
+    return pbCode;
+}
+
+PVOID WINAPI DetourFindExport(_In_opt_ HMODULE hModule,
+                              _In_ LPCSTR pszFunction)
+{
+    if (hModule == NULL) {
+        hModule = GetModuleHandleW(NULL);
+    }
+
+    BOOL fExported;
+    PBYTE pbCode = detour_find_export(hModule, pszFunction, &fExported);
+    SetLastError(pbCode != NULL ? NO_ERROR : ERROR_PROC_NOT_FOUND);
+    return pbCode;
+}
+
 BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                                    _In_opt_ PVOID pContext,
                                    _In_ PF_DETOUR_ENUMERATE_EXPORT_CALLBACK pfExport)
@@ -521,6 +808,21 @@ BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
         PDWORD pdwNames = (PDWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNames);
         PWORD pwOrdinals = (PWORD)RvaAdjust(pDosHeader, pExportDir->AddressOfNameOrdinals);
 
+        // Each function's name comes from the module's export index, rather
+        // than searching the ordinal table for it.  The lock can't be held
+        // while calling back, so this takes a copy of the names.
+        PDWORD pnFuncNames = NULL;
+        PDETOUR_EXPORT_INDEX pIndex = detour_acquire_export_index((PBYTE)pDosHeader);
+        if (pIndex != NULL) {
+            pnFuncNames = (PDWORD)HeapAlloc(GetProcessHeap(), 0,
+                                            sizeof(DWORD) * (SIZE_T)pExportDir->NumberOfFunctions + 1);
+            if (pnFuncNames != NULL) {
+                CopyMemory(pnFuncNames, pIndex->pnFuncNames,
+                           sizeof(DWORD) * (SIZE_T)pExportDir->NumberOfFunctions);
+            }
+            ReleaseSRWLockShared(&s_srwExportIndexes);
+        }
+
         for (DWORD nFunc = 0; nFunc < pExportDir->NumberOfFunctions; nFunc++) {
             PBYTE pbCode = (pdwFunctions != NULL)
                 ? (PBYTE)RvaAdjust(pDosHeader, pdwFunctions[nFunc]) : NULL;
@@ -531,11 +833,18 @@ BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                 pbCode = NULL;
             }
 
-            for (DWORD n = 0; n < pExportDir->NumberOfNames; n++) {
-                if (pwOrdinals[n] == nFunc) {
-                    pszName = (pdwNames != NULL)
-                        ? (PCHAR)RvaAdjust(pDosHeader, pdwNames[n]) : NULL;
-                    break;
+            if (pnFuncNames != NULL) {
+                if (pnFuncNames[nFunc] != 0 && pdwNames != NULL) {
+                    pszName = (PCHAR)RvaAdjust(pDosHeader, pdwNames[pnFuncNames[nFunc] - 1]);
+                }
+            }
+            else {
+                for (DWORD n = 0; n < pExportDir->NumberOfNames; n++) {
+                    if (pwOrdinals[n] == nFunc) {
+                        pszName = (pdwNames != NULL)
+                            ? (PCHAR)RvaAdjust(pDosHeader, pdwNames[n]) : NULL;
+                        break;
+                    }
                 }
             }
             ULONG nOrdinal = pExportDir->Base + nFunc;
@@ -544,6 +853,10 @@ BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                 break;
             }
         }
+
+        if (pnFuncNames != NULL) {
+            HeapFree(GetProcessHeap(), 0, pnFuncNames);
+        }
         SetLastError(NO_ERROR);
         return TRUE;
     }
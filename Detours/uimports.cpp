@@ -69,136 +69,185 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
     inh.BOUND_DIRECTORY.VirtualAddress = 0;
     inh.BOUND_DIRECTORY.Size = 0;
 
-    // Find the size of the mapped file.
-    DWORD dwSec = idh.e_lfanew +
-        FIELD_OFFSET(IMAGE_NT_HEADERS_XX, OptionalHeader) +
-        inh.FileHeader.SizeOfOptionalHeader;
-
-    for (i = 0; i < inh.FileHeader.NumberOfSections; i++) {
-        IMAGE_SECTION_HEADER ish;
-        ZeroMemory(&ish, sizeof(ish));
-
-        if (!ReadProcessMemory(hProcess, pbModule + dwSec + sizeof(ish) * i, &ish,
-                               sizeof(ish), &cbRead)
-            || cbRead < sizeof(ish)) {
-
-            DETOUR_TRACE(("ReadProcessMemory(ish@%p..%p) failed: %d\n",
-                          pbModule + dwSec + sizeof(ish) * i,
-                          pbModule + dwSec + sizeof(ish) * (i + 1),
-                          GetLastError()));
-            goto finish;
+    // If an earlier process running the same image got the same DLLs, reuse
+    // the import table that we built for it and skip straight to writing it.
+    DETOUR_IMPORT_PATCH key;
+    ZeroMemory(&key, sizeof(key));
+    key.wMagic = inh.OptionalHeader.Magic;
+    key.dwTimeDateStamp = inh.FileHeader.TimeDateStamp;
+    key.dwCheckSum = inh.OptionalHeader.CheckSum;
+    key.cbImage = inh.OptionalHeader.SizeOfImage;
+    key.rvaImports = inh.IMPORT_DIRECTORY.VirtualAddress;
+    key.cbImports = inh.IMPORT_DIRECTORY.Size;
+    key.nDlls = nDlls;
+
+    DETOUR_IMPORT_PATCH ipp;
+    ZeroMemory(&ipp, sizeof(ipp));
+    BOOL fReplay = s_fReuseImportPatches && detour_find_import_patch(&ipp, key, plpDlls);
+
+    PBYTE pbNewIid = NULL;
+    DWORD obBase = 0;
+    DWORD dwProtect = 0;
+    DWORD obStr = 0;
+
+    if (fReplay) {
+        DETOUR_TRACE(("Replaying import table of %d bytes.\n", ipp.cbTable));
+        pbNew = ipp.pbTable;
+        cbNew = ipp.cbTable;
+        obStr = cbNew;
+        if (inh.IAT_DIRECTORY.VirtualAddress == 0) {
+            inh.IAT_DIRECTORY.VirtualAddress = ipp.rvaIat;
+            inh.IAT_DIRECTORY.Size = ipp.cbIat;
         }
 
-        DETOUR_TRACE(("ish[%d] : va=%08x sr=%d\n", i, ish.VirtualAddress, ish.SizeOfRawData));
-
-        // If the file didn't have an IAT_DIRECTORY, we assign it...
-        if (inh.IAT_DIRECTORY.VirtualAddress == 0 &&
-            inh.IMPORT_DIRECTORY.VirtualAddress >= ish.VirtualAddress &&
-            inh.IMPORT_DIRECTORY.VirtualAddress < ish.VirtualAddress + ish.SizeOfRawData) {
-
-            inh.IAT_DIRECTORY.VirtualAddress = ish.VirtualAddress;
-            inh.IAT_DIRECTORY.Size = ish.SizeOfRawData;
+        // The table usually fits where it went last time, which saves the search.
+        pbNewIid = (PBYTE)VirtualAllocEx(hProcess, pbModule + ipp.obLastBase, cbNew,
+                                         MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (pbNewIid == NULL) {
+            pbNewIid = FindAndAllocateNearBase(hProcess, pbModule + ipp.obLastBase, cbNew);
         }
+        if (pbNewIid == NULL) {
+            DETOUR_TRACE(("FindAndAllocateNearBase failed.\n"));
+            goto finish;
+        }
+        obBase = (DWORD)(pbNewIid - pbModule);
+        detour_relocate_import_table(pbNew, nDlls, obBase);
     }
+    else {
+        // Find the size of the mapped file.
+        DWORD dwSec = idh.e_lfanew +
+            FIELD_OFFSET(IMAGE_NT_HEADERS_XX, OptionalHeader) +
+            inh.FileHeader.SizeOfOptionalHeader;
+
+        for (i = 0; i < inh.FileHeader.NumberOfSections; i++) {
+            IMAGE_SECTION_HEADER ish;
+            ZeroMemory(&ish, sizeof(ish));
+
+            if (!ReadProcessMemory(hProcess, pbModule + dwSec + sizeof(ish) * i, &ish,
+                                   sizeof(ish), &cbRead)
+                || cbRead < sizeof(ish)) {
+
+                DETOUR_TRACE(("ReadProcessMemory(ish@%p..%p) failed: %d\n",
+                              pbModule + dwSec + sizeof(ish) * i,
+                              pbModule + dwSec + sizeof(ish) * (i + 1),
+                              GetLastError()));
+                goto finish;
+            }
+
+            DETOUR_TRACE(("ish[%d] : va=%08x sr=%d\n", i, ish.VirtualAddress, ish.SizeOfRawData));
+
+            // If the file didn't have an IAT_DIRECTORY, we assign it...
+            if (inh.IAT_DIRECTORY.VirtualAddress == 0 &&
+                inh.IMPORT_DIRECTORY.VirtualAddress >= ish.VirtualAddress &&
+                inh.IMPORT_DIRECTORY.VirtualAddress < ish.VirtualAddress + ish.SizeOfRawData) {
+
+                inh.IAT_DIRECTORY.VirtualAddress = ish.VirtualAddress;
+                inh.IAT_DIRECTORY.Size = ish.SizeOfRawData;
+            }
+        }
 
-    DETOUR_TRACE(("     Imports: %p..%p\n",
-                  (DWORD_PTR)pbModule + inh.IMPORT_DIRECTORY.VirtualAddress,
-                  (DWORD_PTR)pbModule + inh.IMPORT_DIRECTORY.VirtualAddress +
-                  inh.IMPORT_DIRECTORY.Size));
-
-    DWORD nOldDlls = inh.IMPORT_DIRECTORY.Size / sizeof(IMAGE_IMPORT_DESCRIPTOR);
-    DWORD obRem = sizeof(IMAGE_IMPORT_DESCRIPTOR) * nDlls;
-    DWORD obOld = obRem + sizeof(IMAGE_IMPORT_DESCRIPTOR) * nOldDlls;
-    DWORD obTab = PadToDwordPtr(obOld);
-    DWORD obDll = obTab + sizeof(DWORD_XX) * 4 * nDlls;
-    DWORD obStr = obDll;
-    cbNew = obStr;
-    for (n = 0; n < nDlls; n++) {
-        cbNew += PadToDword((DWORD)strlen(plpDlls[n]) + 1);
-    }
-
-    _Analysis_assume_(cbNew >
-                      sizeof(IMAGE_IMPORT_DESCRIPTOR) * (nDlls + nOldDlls)
-                      + sizeof(DWORD_XX) * 4 * nDlls);
-    pbNew = new BYTE [cbNew];
-    if (pbNew == NULL) {
-        DETOUR_TRACE(("new BYTE [cbNew] failed.\n"));
-        goto finish;
-    }
-    ZeroMemory(pbNew, cbNew);
-
-    PBYTE pbBase = pbModule;
-    PBYTE pbNext = pbBase
-        + inh.OptionalHeader.BaseOfCode
-        + inh.OptionalHeader.SizeOfCode
-        + inh.OptionalHeader.SizeOfInitializedData
-        + inh.OptionalHeader.SizeOfUninitializedData;
-    if (pbBase < pbNext) {
-        pbBase = pbNext;
-    }
-    DETOUR_TRACE(("pbBase = %p\n", pbBase));
+        DETOUR_TRACE(("     Imports: %p..%p\n",
+                      (DWORD_PTR)pbModule + inh.IMPORT_DIRECTORY.VirtualAddress,
+                      (DWORD_PTR)pbModule + inh.IMPORT_DIRECTORY.VirtualAddress +
+                      inh.IMPORT_DIRECTORY.Size));
+
+        DWORD nOldDlls = inh.IMPORT_DIRECTORY.Size / sizeof(IMAGE_IMPORT_DESCRIPTOR);
+        DWORD obRem = sizeof(IMAGE_IMPORT_DESCRIPTOR) * nDlls;
+        DWORD obOld = obRem + sizeof(IMAGE_IMPORT_DESCRIPTOR) * nOldDlls;
+        DWORD obTab = PadToDwordPtr(obOld);
+        DWORD obDll = obTab + sizeof(DWORD_XX) * 4 * nDlls;
+        obStr = obDll;
+        cbNew = obStr;
+        for (n = 0; n < nDlls; n++) {
+            cbNew += PadToDword((DWORD)strlen(plpDlls[n]) + 1);
+        }
 
-    PBYTE pbNewIid = FindAndAllocateNearBase(hProcess, pbBase, cbNew);
-    if (pbNewIid == NULL) {
-        DETOUR_TRACE(("FindAndAllocateNearBase failed.\n"));
-        goto finish;
-    }
+        _Analysis_assume_(cbNew >
+                          sizeof(IMAGE_IMPORT_DESCRIPTOR) * (nDlls + nOldDlls)
+                          + sizeof(DWORD_XX) * 4 * nDlls);
+        pbNew = new BYTE [cbNew];
+        if (pbNew == NULL) {
+            DETOUR_TRACE(("new BYTE [cbNew] failed.\n"));
+            goto finish;
+        }
+        ZeroMemory(pbNew, cbNew);
+
+        PBYTE pbBase = pbModule;
+        PBYTE pbNext = pbBase
+            + inh.OptionalHeader.BaseOfCode
+            + inh.OptionalHeader.SizeOfCode
+            + inh.OptionalHeader.SizeOfInitializedData
+            + inh.OptionalHeader.SizeOfUninitializedData;
+        if (pbBase < pbNext) {
+            pbBase = pbNext;
+        }
+        DETOUR_TRACE(("pbBase = %p\n", pbBase));
 
-    PIMAGE_IMPORT_DESCRIPTOR piid = (PIMAGE_IMPORT_DESCRIPTOR)pbNew;
-    DWORD_XX *pt;
+        pbNewIid = FindAndAllocateNearBase(hProcess, pbBase, cbNew);
+        if (pbNewIid == NULL) {
+            DETOUR_TRACE(("FindAndAllocateNearBase failed.\n"));
+            goto finish;
+        }
 
-    DWORD obBase = (DWORD)(pbNewIid - pbModule);
-    DWORD dwProtect = 0;
+        PIMAGE_IMPORT_DESCRIPTOR piid = (PIMAGE_IMPORT_DESCRIPTOR)pbNew;
+        DWORD_XX *pt;
 
-    if (inh.IMPORT_DIRECTORY.VirtualAddress != 0) {
-        // Read the old import directory if it exists.
-        DETOUR_TRACE(("IMPORT_DIRECTORY perms=%x\n", dwProtect));
+        obBase = (DWORD)(pbNewIid - pbModule);
 
-        if (!ReadProcessMemory(hProcess,
-                               pbModule + inh.IMPORT_DIRECTORY.VirtualAddress,
-                               &piid[nDlls],
-                               nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR), &cbRead)
-            || cbRead < nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR)) {
+        if (inh.IMPORT_DIRECTORY.VirtualAddress != 0) {
+            // Read the old import directory if it exists.
+            DETOUR_TRACE(("IMPORT_DIRECTORY perms=%x\n", dwProtect));
 
-            DETOUR_TRACE(("ReadProcessMemory(imports) failed: %d\n", GetLastError()));
-            goto finish;
-        }
-    }
+            if (!ReadProcessMemory(hProcess,
+                                   pbModule + inh.IMPORT_DIRECTORY.VirtualAddress,
+                                   &piid[nDlls],
+                                   nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR), &cbRead)
+                || cbRead < nOldDlls * sizeof(IMAGE_IMPORT_DESCRIPTOR)) {
 
-    for (n = 0; n < nDlls; n++) {
-        HRESULT hrRet = StringCchCopyA((char*)pbNew + obStr, cbNew - obStr, plpDlls[n]);
-        if (FAILED(hrRet)) {
-            DETOUR_TRACE(("StringCchCopyA failed: %d\n", GetLastError()));
-            goto finish;
+                DETOUR_TRACE(("ReadProcessMemory(imports) failed: %d\n", GetLastError()));
+                goto finish;
+            }
         }
 
-        // After copying the string, we patch up the size "??" bits if any.
-        hrRet = ReplaceOptionalSizeA((char*)pbNew + obStr,
-                                     cbNew - obStr,
-                                     DETOURS_STRINGIFY(DETOURS_BITS_XX));
-        if (FAILED(hrRet)) {
-            DETOUR_TRACE(("ReplaceOptionalSizeA failed: %d\n", GetLastError()));
-            goto finish;
+        for (n = 0; n < nDlls; n++) {
+            HRESULT hrRet = StringCchCopyA((char*)pbNew + obStr, cbNew - obStr, plpDlls[n]);
+            if (FAILED(hrRet)) {
+                DETOUR_TRACE(("StringCchCopyA failed: %d\n", GetLastError()));
+                goto finish;
+            }
+
+            // After copying the string, we patch up the size "??" bits if any.
+            hrRet = ReplaceOptionalSizeA((char*)pbNew + obStr,
+                                         cbNew - obStr,
+                                         DETOURS_STRINGIFY(DETOURS_BITS_XX));
+            if (FAILED(hrRet)) {
+                DETOUR_TRACE(("ReplaceOptionalSizeA failed: %d\n", GetLastError()));
+                goto finish;
+            }
+
+            DWORD nOffset = obTab + (sizeof(DWORD_XX) * (4 * n));
+            piid[n].OriginalFirstThunk = obBase + nOffset;
+            pt = ((DWORD_XX*)(pbNew + nOffset));
+            pt[0] = IMAGE_ORDINAL_FLAG_XX + 1;
+            pt[1] = 0;
+
+            nOffset = obTab + (sizeof(DWORD_XX) * ((4 * n) + 2));
+            piid[n].FirstThunk = obBase + nOffset;
+            pt = ((DWORD_XX*)(pbNew + nOffset));
+            pt[0] = IMAGE_ORDINAL_FLAG_XX + 1;
+            pt[1] = 0;
+            piid[n].TimeDateStamp = 0;
+            piid[n].ForwarderChain = 0;
+            piid[n].Name = obBase + obStr;
+
+            obStr += PadToDword((DWORD)strlen(plpDlls[n]) + 1);
         }
+        _Analysis_assume_(obStr <= cbNew);
 
-        DWORD nOffset = obTab + (sizeof(DWORD_XX) * (4 * n));
-        piid[n].OriginalFirstThunk = obBase + nOffset;
-        pt = ((DWORD_XX*)(pbNew + nOffset));
-        pt[0] = IMAGE_ORDINAL_FLAG_XX + 1;
-        pt[1] = 0;
-
-        nOffset = obTab + (sizeof(DWORD_XX) * ((4 * n) + 2));
-        piid[n].FirstThunk = obBase + nOffset;
-        pt = ((DWORD_XX*)(pbNew + nOffset));
-        pt[0] = IMAGE_ORDINAL_FLAG_XX + 1;
-        pt[1] = 0;
-        piid[n].TimeDateStamp = 0;
-        piid[n].ForwarderChain = 0;
-        piid[n].Name = obBase + obStr;
-
-        obStr += PadToDword((DWORD)strlen(plpDlls[n]) + 1);
+        // Remember the IAT we found, for replaying this table later.
+        ipp.rvaIat = inh.IAT_DIRECTORY.VirtualAddress;
+        ipp.cbIat = inh.IAT_DIRECTORY.Size;
     }
-    _Analysis_assume_(obStr <= cbNew);
 
 #if 0
     for (i = 0; i < nDlls + nOldDlls; i++) {
@@ -244,11 +293,14 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
 
     inh.OptionalHeader.CheckSum = 0;
 
-    if (!WriteProcessMemory(hProcess, pbModule, &idh, sizeof(idh), NULL)) {
-        DETOUR_TRACE(("WriteProcessMemory(idh) failed: %d\n", GetLastError()));
-        goto finish;
+    // The DOS header itself never changes; only the first time round do we bother.
+    if (!fReplay) {
+        if (!WriteProcessMemory(hProcess, pbModule, &idh, sizeof(idh), NULL)) {
+            DETOUR_TRACE(("WriteProcessMemory(idh) failed: %d\n", GetLastError()));
+            goto finish;
+        }
+        DETOUR_TRACE(("WriteProcessMemory(idh:%p..%p)\n", pbModule, pbModule + sizeof(idh)));
     }
-    DETOUR_TRACE(("WriteProcessMemory(idh:%p..%p)\n", pbModule, pbModule + sizeof(idh)));
 
     if (!WriteProcessMemory(hProcess, pbModule + idh.e_lfanew, &inh, sizeof(inh), NULL)) {
         DETOUR_TRACE(("WriteProcessMemory(inh) failed: %d\n", GetLastError()));
@@ -264,6 +316,10 @@ static BOOL UPDATE_IMPORTS_XX(HANDLE hProcess,
         goto finish;
     }
 
+    if (s_fReuseImportPatches) {
+        detour_save_import_patch(key, plpDlls, pbNew, cbNew, obBase, ipp.rvaIat, ipp.cbIat);
+    }
+
     fSucceeded = TRUE;
     goto finish;
 }
@@ -0,0 +1,187 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Compiles config.json into config.psfc, which the PsfRuntime loads instead of parsing config.json. See readme.md for
+// usage, and PsfRuntime/CompiledConfig.h for the file format
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <rapidjson/encodedstream.h>
+#include <rapidjson/error/en.h>
+#include <rapidjson/memorystream.h>
+#include <rapidjson/reader.h>
+#include <psf_runtime.h>
+#include <utilities.h>
+#include <win32_error.h>
+
+#include "CompiledConfig.h"
+#include "JsonConfig.h"
+
+// JsonConfig.h allocates the DOM through the PsfRuntime's heap; the compiler doesn't load the PsfRuntime, and its DOM
+// lives for the rest of the (short) process anyway
+PSFAPI void* __stdcall PSFAllocate(std::size_t size) noexcept
+{
+    return std::malloc(size);
+}
+
+PSFAPI void __stdcall PSFFree(_In_opt_ void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+static std::vector<char> read_file(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("config.json could not be opened");
+    }
+
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// The same parse that the PsfRuntime does, encoding detection included, so that whatever it accepts, this does too
+static void parse_config_json(const std::vector<char>& contents, json_document& document)
+{
+    rapidjson::MemoryStream stream(contents.data(), contents.size());
+    rapidjson::AutoUTFInputStream<char32_t, rapidjson::MemoryStream> autoStream(stream);
+
+    rapidjson::GenericReader<rapidjson::AutoUTF<char32_t>, rapidjson::UTF8<>> reader;
+    auto result = reader.Parse<rapidjson::kParseValidateEncodingFlag>(autoStream, document);
+    if (result.IsError())
+    {
+        std::stringstream msgStream;
+        msgStream << "Error occurred when parsing config.json\n";
+        if (document.error_message().empty())
+        {
+            msgStream << "Error: " << rapidjson::GetParseError_En(result.Code()) << "\n";
+        }
+        else
+        {
+            msgStream << "Error: " << document.error_message() << "\n";
+        }
+        msgStream << "File Offest: " << result.Offset();
+        throw std::runtime_error(msgStream.str());
+    }
+    else if (!document.root())
+    {
+        throw std::runtime_error("config.json has no contents");
+    }
+}
+
+// Checks which of the names that the PsfRuntime tries for each fixup dll exist, relative to config.json's directory,
+// which becomes the package root. Entries that the PsfRuntime would fail on anyway are left out
+static compiled_config_dlls resolve_fixup_dlls(const psf::json_value& root, const std::filesystem::path& packageRoot)
+{
+    compiled_config_dlls result;
+    auto rootObj = root.try_as_object();
+    auto processes = rootObj ? rootObj->try_get("processes") : nullptr;
+    auto processesArr = processes ? processes->try_as_array() : nullptr;
+    if (!processesArr)
+    {
+        return result;
+    }
+
+    for (auto& processConfig : *processesArr)
+    {
+        try
+        {
+            auto fixups = processConfig.as_object().try_get("fixups");
+            if (!fixups)
+            {
+                continue;
+            }
+
+            for (auto& fixupConfig : fixups->as_array())
+            {
+                auto& dll = fixupConfig.as_object().get("dll").as_string();
+                auto path = packageRoot / dll.wide();
+
+                std::uint32_t flags = 0;
+                if (std::filesystem::is_regular_file(path))
+                {
+                    flags |= compiled_dll_as_given;
+                }
+
+                path.replace_extension();
+                if (std::filesystem::is_regular_file(std::filesystem::path(path).concat(L"32.dll")))
+                {
+                    flags |= compiled_dll_32;
+                }
+
+                if (std::filesystem::is_regular_file(std::filesystem::path(path).concat(L"64.dll")))
+                {
+                    flags |= compiled_dll_64;
+                }
+
+                result.emplace_back(std::string(dll.string()), flags);
+            }
+        }
+        catch (...)
+        {
+        }
+    }
+
+    return result;
+}
+
+// Written to a temporary name and then renamed, so that config.psfc is never seen half written
+static void write_file(const std::filesystem::path& path, const std::vector<std::uint8_t>& contents)
+{
+    auto tempPath = std::filesystem::path(path).concat(L".tmp");
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+        if (!file)
+        {
+            throw std::runtime_error("config.psfc could not be written");
+        }
+    }
+
+    if (!::MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        ::DeleteFileW(tempPath.c_str());
+        throw std::runtime_error("config.psfc could not be written");
+    }
+}
+
+int wmain(int argc, const wchar_t** argv) try
+{
+    if ((argc < 2) || (argc > 3))
+    {
+        std::wcerr << L"Usage: " << std::filesystem::path(argv[0]).filename().native() << L" <config.json> [<output>]\n";
+        std::wcerr << L"Compiles config.json into config.psfc. The output defaults to config.psfc next to config.json\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    auto configPath = std::filesystem::absolute(argv[1]);
+    auto outputPath = (argc == 3) ? std::filesystem::path(argv[2]) : configPath.parent_path() / L"config.psfc";
+
+    auto contents = read_file(configPath);
+    json_document document;
+    parse_config_json(contents, document);
+
+    auto dlls = resolve_fixup_dlls(*document.root(), configPath.parent_path());
+    auto hash = compiled_config_hash(contents.data(), contents.size());
+    auto compiled = compiled_config_writer().write(*document.root(), hash, std::move(dlls));
+    write_file(outputPath, compiled);
+
+    std::wcout << L"Compiled " << configPath.native() << L" to " << outputPath.native() << L"\n";
+    return ERROR_SUCCESS;
+}
+catch (std::exception& e)
+{
+    std::cerr << "ERROR: " << e.what() << "\n";
+    return win32_from_caught_exception();
+}
@@ -0,0 +1,169 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Edits the import table of executables in the package so that they import the PsfRuntime themselves, rather than the
+// PsfLauncher or CreateProcessFixup having to inject it. See readme.md for usage, and include/pre_injection.h for how
+// the edited executables get marked
+
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <windows.h>
+#include <detours.h>
+#include <fancy_handle.h>
+#include <pre_injection.h>
+#include <win32_error.h>
+
+using namespace std::literals;
+
+struct binary_closer
+{
+    void operator()(PDETOUR_BINARY binary) noexcept
+    {
+        ::DetourBinaryClose(binary);
+    }
+};
+using unique_binary = std::unique_ptr<DETOUR_BINARY, binary_closer>;
+
+static const char* runtime_dll_for_machine(WORD machine)
+{
+    switch (machine)
+    {
+    case IMAGE_FILE_MACHINE_I386:
+        return "PsfRuntime32.dll";
+
+    case IMAGE_FILE_MACHINE_AMD64:
+    case IMAGE_FILE_MACHINE_ARM64:
+        return "PsfRuntime64.dll";
+
+    default:
+        throw std::runtime_error("the executable's architecture is not supported");
+    }
+}
+
+static BOOL CALLBACK AddRuntimeByway(PVOID context, LPCSTR file, LPCSTR* outFile)
+{
+    // Called with a null 'file' once all of the existing byways have been seen, which is the chance to add one
+    auto& runtimeDll = *static_cast<const char**>(context);
+    if (!file && runtimeDll)
+    {
+        *outFile = std::exchange(runtimeDll, nullptr);
+    }
+
+    return TRUE;
+}
+
+static void edit_executable(const std::filesystem::path& path, bool remove)
+{
+    psf::image_file_info info;
+    unique_binary binary;
+    {
+        psf::unique_handle file(::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr));
+        if (!file)
+        {
+            throw_last_error("the executable could not be opened");
+        }
+
+        if (!psf::read_image_file_info(file.get(), info))
+        {
+            throw std::runtime_error("the file is not an executable");
+        }
+
+        ::SetFilePointer(file.get(), 0, nullptr, FILE_BEGIN);
+        binary.reset(::DetourBinaryOpen(file.get()));
+        if (!binary)
+        {
+            throw_last_error("the executable could not be read");
+        }
+    }
+
+    // Undoes any earlier edit first, so that running this again doesn't import the PsfRuntime twice
+    if (!::DetourBinaryResetImports(binary.get()))
+    {
+        throw_last_error("the executable's imports could not be reset");
+    }
+    ::DetourBinaryDeletePayload(binary.get(), psf::pre_injection_payload_guid);
+
+    if (!remove)
+    {
+        auto runtimeDll = runtime_dll_for_machine(info.machine);
+        if (!::DetourBinaryEditImports(binary.get(), &runtimeDll, AddRuntimeByway, nullptr, nullptr, nullptr))
+        {
+            throw_last_error("the executable's imports could not be edited");
+        }
+
+        psf::pre_injection_payload payload = { psf::pre_injection_payload_version, info.machine };
+        if (!::DetourBinarySetPayload(binary.get(), psf::pre_injection_payload_guid, &payload, sizeof(payload)))
+        {
+            throw_last_error("the executable could not be marked");
+        }
+    }
+
+    // Written to a temporary name and then renamed, so that the executable is never seen half written
+    auto tempPath = std::filesystem::path(path).concat(L".tmp");
+    {
+        psf::unique_handle file(::CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr));
+        if (!file)
+        {
+            throw_last_error("the edited executable could not be written");
+        }
+
+        if (!::DetourBinaryWrite(binary.get(), file.get()))
+        {
+            auto err = ::GetLastError();
+            file.reset();
+            ::DeleteFileW(tempPath.c_str());
+            throw_win32(err, "the edited executable could not be written");
+        }
+    }
+
+    if (!::MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        auto err = ::GetLastError();
+        ::DeleteFileW(tempPath.c_str());
+        throw_win32(err, "the edited executable could not be written");
+    }
+}
+
+int wmain(int argc, const wchar_t** argv) try
+{
+    auto remove = (argc > 1) && ((argv[1] == L"/remove"sv) || (argv[1] == L"-remove"sv));
+    auto first = remove ? 2 : 1;
+    if (argc <= first)
+    {
+        std::wcerr << L"Usage: " << std::filesystem::path(argv[0]).filename().native() << L" [/remove] <executable>...\n";
+        std::wcerr << L"Makes each executable import the PsfRuntime itself, or with /remove, undoes that\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    int result = ERROR_SUCCESS;
+    for (int i = first; i < argc; ++i)
+    {
+        auto path = std::filesystem::absolute(argv[i]);
+        try
+        {
+            edit_executable(path, remove);
+            std::wcout << (remove ? L"Restored " : L"Edited ") << path.native() << L"\n";
+        }
+        catch (std::exception& e)
+        {
+            std::wcerr << L"ERROR: " << path.native() << L": ";
+            std::cerr << e.what() << "\n";
+            result = win32_from_caught_exception();
+        }
+    }
+
+    return result;
+}
+catch (std::exception& e)
+{
+    std::cerr << "ERROR: " << e.what() << "\n";
+    return win32_from_caught_exception();
+}
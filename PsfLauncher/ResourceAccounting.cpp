@@ -0,0 +1,96 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// With the application's "resourceAccounting" configuration set, the application gets put in a job object of its own
+// before it starts running, and the job's accounting gets reported once the application exits: CPU time, peak commit,
+// I/O, and how many processes there were. Child processes end up in the same job without any help, since they inherit
+// job membership from their parent, so the numbers cover the whole process tree. They're written to the log, and as a
+// "ResourceAccounting" event from the same TraceLogging provider that the PsfRuntime uses for its startup timings.
+//
+// NOTE: The job only accounts; it doesn't limit anything. Processes that ask to break away from their job still can,
+//       and then don't get counted
+
+#include <cstdint>
+
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+#include <psf_runtime.h>
+
+TRACELOGGING_DEFINE_PROVIDER(
+    g_PsfLauncherProvider,
+    "Microsoft-Windows-PSFRuntime",
+    (0x7aa900a4, 0xff44, 0x4868, 0x8d, 0xad, 0x2d, 0x74, 0x5c, 0xff, 0x22, 0xeb));
+
+void Log(const char* fmt, ...);
+
+// Returns null if the job can't be created, in which case the application just runs without accounting
+HANDLE CreateAccountingJob() noexcept
+{
+    auto job = ::CreateJobObjectW(nullptr, nullptr);
+    if (!job)
+    {
+        Log("\tUnable to create the resource accounting job. Error=0x%x\n", ::GetLastError());
+        return nullptr;
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_BREAKAWAY_OK;
+    ::SetInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+    return job;
+}
+
+// Puts the (still suspended) application in the job, so that anything it starts ends up there too
+void AssignToAccountingJob(HANDLE job, HANDLE process) noexcept
+{
+    if (job && !::AssignProcessToJobObject(job, process))
+    {
+        Log("\tUnable to assign the application to the resource accounting job. Error=0x%x\n", ::GetLastError());
+    }
+}
+
+// NOTE: Children that are still running when the application exits are only counted up to this point
+void ReportJobAccounting(HANDLE job) noexcept
+{
+    if (!job)
+    {
+        return;
+    }
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting = {};
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    if (!::QueryInformationJobObject(job, JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting), nullptr) ||
+        !::QueryInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr))
+    {
+        Log("\tUnable to query the resource accounting job. Error=0x%x\n", ::GetLastError());
+        return;
+    }
+
+    // Times are in 100ns units
+    auto userMicroseconds = static_cast<std::uint64_t>(accounting.BasicInfo.TotalUserTime.QuadPart) / 10;
+    auto kernelMicroseconds = static_cast<std::uint64_t>(accounting.BasicInfo.TotalKernelTime.QuadPart) / 10;
+    Log("\tResource accounting: %u processes, %llu us user time, %llu us kernel time, %llu bytes peak commit (%llu bytes for a single process), %llu bytes read, %llu bytes written\n",
+        accounting.BasicInfo.TotalProcesses,
+        userMicroseconds,
+        kernelMicroseconds,
+        static_cast<std::uint64_t>(limits.PeakJobMemoryUsed),
+        static_cast<std::uint64_t>(limits.PeakProcessMemoryUsed),
+        accounting.IoInfo.ReadTransferCount,
+        accounting.IoInfo.WriteTransferCount);
+
+    TraceLoggingRegister(g_PsfLauncherProvider);
+    TraceLoggingWrite(g_PsfLauncherProvider,
+        "ResourceAccounting",
+        TraceLoggingWideString(::PSFQueryApplicationUserModelId(), "ApplicationUserModelId"),
+        TraceLoggingUInt32(accounting.BasicInfo.TotalProcesses, "Processes"),
+        TraceLoggingUInt64(userMicroseconds, "UserMicroseconds"),
+        TraceLoggingUInt64(kernelMicroseconds, "KernelMicroseconds"),
+        TraceLoggingUInt64(static_cast<std::uint64_t>(limits.PeakJobMemoryUsed), "PeakCommit"),
+        TraceLoggingUInt64(static_cast<std::uint64_t>(limits.PeakProcessMemoryUsed), "PeakProcessCommit"),
+        TraceLoggingUInt64(accounting.IoInfo.ReadOperationCount, "ReadOperations"),
+        TraceLoggingUInt64(accounting.IoInfo.ReadTransferCount, "ReadBytes"),
+        TraceLoggingUInt64(accounting.IoInfo.WriteOperationCount, "WriteOperations"),
+        TraceLoggingUInt64(accounting.IoInfo.WriteTransferCount, "WriteBytes"));
+    TraceLoggingUnregister(g_PsfLauncherProvider);
+}
@@ -0,0 +1,206 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Cold launches of large packages spend most of their time waiting on random reads of package files. With the
+// application's "startupProfile" configuration set to "record", the FileRedirectionFixup in the application records
+// which package files (and ranges of them) get read during startup (see startup_profile.h). On later launches, a thread
+// in the launcher reads the same ranges while the application is being created, with several overlapped reads in
+// flight at a time, so that the application's own reads come from the file cache. Package images get mapped and
+// prefetched with PrefetchVirtualMemory instead, since the loader maps them rather than reading them.
+//
+// NOTE: Nothing here can fail the launch; files that no longer exist (e.g. after a package update) are skipped
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+#include <fancy_handle.h>
+#include <startup_profile.h>
+#include <win32_error.h>
+
+void Log(const char* fmt, ...);
+
+constexpr std::size_t prefetch_slot_count = 8;
+constexpr DWORD prefetch_chunk_size = 256 * 1024;
+
+struct startup_profile_replay
+{
+    std::filesystem::path package_root;
+    std::filesystem::path profile_path;
+};
+
+static void prefetch_image(const std::filesystem::path& path)
+{
+    psf::unique_handle file(::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_EXECUTE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+    if (!file)
+    {
+        return;
+    }
+
+    // Mapped as an image so that the pages end up in the same section that the loader maps in the application
+    psf::unique_handle section(::CreateFileMappingW(file.get(), nullptr, PAGE_EXECUTE_READ | SEC_IMAGE, 0, 0, nullptr));
+    if (!section)
+    {
+        return;
+    }
+
+    auto view = ::MapViewOfFile(section.get(), FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, 0);
+    if (!view)
+    {
+        return;
+    }
+
+    // NOTE: SizeOfImage is at the same offset in the 32 and 64 bit optional headers
+    auto dosHeader = static_cast<const IMAGE_DOS_HEADER*>(view);
+    auto ntHeaders = reinterpret_cast<const IMAGE_NT_HEADERS*>(static_cast<const std::uint8_t*>(view) + dosHeader->e_lfanew);
+    WIN32_MEMORY_RANGE_ENTRY range{ view, ntHeaders->OptionalHeader.SizeOfImage };
+    ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+    ::UnmapViewOfFile(view);
+}
+
+static void prefetch_reads(const std::filesystem::path& packageRoot, const std::vector<psf::startup_profile_entry>& entries)
+{
+    std::unordered_map<std::wstring, psf::unique_handle> files;
+    auto buffer = static_cast<std::uint8_t*>(::VirtualAlloc(nullptr, prefetch_slot_count * prefetch_chunk_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (!buffer)
+    {
+        return;
+    }
+
+    // Each slot's event is signaled while the slot is free, so waiting for any of them gives us the next free slot
+    OVERLAPPED overlapped[prefetch_slot_count] = {};
+    HANDLE events[prefetch_slot_count] = {};
+    std::size_t slotCount = 0;
+    for (; slotCount < prefetch_slot_count; ++slotCount)
+    {
+        events[slotCount] = ::CreateEventW(nullptr, TRUE, TRUE, nullptr);
+        if (!events[slotCount])
+        {
+            break;
+        }
+        overlapped[slotCount].hEvent = events[slotCount];
+    }
+
+    for (auto& entry : entries)
+    {
+        if (entry.image || (slotCount == 0))
+        {
+            continue;
+        }
+
+        auto& file = files[entry.path];
+        if (!file)
+        {
+            file.reset(::CreateFileW((packageRoot / entry.path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr));
+            if (!file)
+            {
+                continue;
+            }
+        }
+
+        for (std::uint64_t offset = entry.offset; offset < entry.offset + entry.length; offset += prefetch_chunk_size)
+        {
+            auto wait = ::WaitForMultipleObjects(static_cast<DWORD>(slotCount), events, FALSE, INFINITE);
+            if (wait >= WAIT_OBJECT_0 + slotCount)
+            {
+                break;
+            }
+
+            auto slot = wait - WAIT_OBJECT_0;
+            auto length = static_cast<DWORD>(std::min<std::uint64_t>(prefetch_chunk_size, entry.offset + entry.length - offset));
+            overlapped[slot].Offset = static_cast<DWORD>(offset);
+            overlapped[slot].OffsetHigh = static_cast<DWORD>(offset >> 32);
+            if (!::ReadFile(file.get(), buffer + slot * prefetch_chunk_size, length, nullptr, &overlapped[slot]) &&
+                (::GetLastError() != ERROR_IO_PENDING))
+            {
+                // E.g. reading past the end of a file that has gotten smaller; the rest of the range won't work either
+                ::SetEvent(events[slot]);
+                break;
+            }
+        }
+    }
+
+    if (slotCount > 0)
+    {
+        // The reads must be done with the buffer (and the files) before they go away
+        ::WaitForMultipleObjects(static_cast<DWORD>(slotCount), events, TRUE, INFINITE);
+    }
+
+    for (std::size_t i = 0; i < slotCount; ++i)
+    {
+        ::CloseHandle(events[i]);
+    }
+    ::VirtualFree(buffer, 0, MEM_RELEASE);
+}
+
+static DWORD __stdcall StartupProfileReplayThread(void* parameter) noexcept try
+{
+    std::unique_ptr<startup_profile_replay> replay(static_cast<startup_profile_replay*>(parameter));
+
+    std::ifstream stream(replay->profile_path, std::ios::binary);
+    if (!stream)
+    {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    std::ostringstream contents;
+    contents << stream.rdbuf();
+    auto entries = psf::parse_startup_profile(contents.str());
+
+    // Images first; they're what the loader needs before any of the application's own code runs
+    for (auto& entry : entries)
+    {
+        if (entry.image)
+        {
+            prefetch_image(replay->package_root / entry.path);
+        }
+    }
+    prefetch_reads(replay->package_root, entries);
+
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+// Tells the FileRedirectionFixup in the application that's about to be created to record its startup profile. The
+// variable gets inherited by the application, which clears it for its own children
+void RecordStartupProfile(DWORD seconds)
+{
+    Log("\tRecording the startup profile for %u seconds\n", seconds);
+    ::SetEnvironmentVariableW(psf::startup_profile_record_variable, std::to_wstring(seconds).c_str());
+}
+
+// Starts reading what the executable's startup profile lists, if it has one, on a background thread. The thread is left
+// running; the launcher waits on the application anyway
+void ReplayStartupProfile(const std::filesystem::path& packageRoot, const std::filesystem::path& executable) noexcept try
+{
+    auto replay = std::make_unique<startup_profile_replay>();
+    replay->package_root = packageRoot;
+    replay->profile_path = psf::startup_profile_path(executable);
+    if (!std::filesystem::exists(replay->profile_path))
+    {
+        return;
+    }
+
+    Log("\tReplaying the startup profile %ls\n", replay->profile_path.c_str());
+    if (auto thread = ::CreateThread(nullptr, 0, StartupProfileReplayThread, replay.get(), 0, nullptr))
+    {
+        replay.release();
+        ::CloseHandle(thread);
+    }
+}
+catch (...)
+{
+    // The profile is only a hint
+}
@@ -0,0 +1,124 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// With the application's "warmStandby" configuration set, the launcher keeps one instance of the application started
+// ahead of time, waiting just before its entry point with all of its fixups loaded (see WarmStandby.cpp in the
+// PsfRuntime). A launch first tries to claim that instance and let it run, and only creates the application itself if
+// there isn't one. Either way, it then starts the standby for the next launch, once the application it's launching has
+// had the chance to get through its own startup.
+//
+// NOTE: The objects are named after the application id, so each application in the package has its own standby
+
+#include <filesystem>
+#include <string>
+
+#include <windows.h>
+#include <psf_constants.h>
+#include <psf_runtime.h>
+
+using namespace std::literals;
+
+void Log(const char* fmt, ...);
+
+static std::wstring warm_standby_name()
+{
+    return L"Local\\PsfWarmStandby_"s + ::PSFQueryApplicationId();
+}
+
+// Returns the standby instance's process handle once it's been told to carry on, or null if there isn't one waiting
+HANDLE ClaimWarmStandby() noexcept try
+{
+    auto name = warm_standby_name();
+    auto ready = ::OpenEventW(SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, (name + L"_Ready").c_str());
+    if (!ready)
+    {
+        return nullptr;
+    }
+
+    // The event is auto-reset, so a launcher that succeeds in waiting on it is the only one that has claimed the instance
+    HANDLE process = nullptr;
+    if (::WaitForSingleObject(ready, 0) == WAIT_OBJECT_0)
+    {
+        DWORD processId = 0;
+        if (auto instance = ::OpenFileMappingW(FILE_MAP_READ, FALSE, (name + L"_Instance").c_str()))
+        {
+            if (auto view = static_cast<const DWORD*>(::MapViewOfFile(instance, FILE_MAP_READ, 0, 0, sizeof(DWORD))))
+            {
+                processId = *view;
+                ::UnmapViewOfFile(view);
+            }
+            ::CloseHandle(instance);
+        }
+
+        auto go = ::OpenEventW(EVENT_MODIFY_STATE, FALSE, (name + L"_Go").c_str());
+        process = processId ? ::OpenProcess(SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId) : nullptr;
+        if (process && (::WaitForSingleObject(process, 0) != WAIT_TIMEOUT))
+        {
+            ::CloseHandle(process);
+            process = nullptr;
+        }
+
+        // The standby isn't the foreground process, so it needs our permission to bring its window to the front
+        if (process)
+        {
+            ::AllowSetForegroundWindow(processId);
+        }
+
+        if (process && go && ::SetEvent(go))
+        {
+            Log("\tHanded over to warm standby instance %u\n", processId);
+        }
+        else
+        {
+            Log("\tUnable to hand over to the warm standby instance. Error=0x%x\n", ::GetLastError());
+            if (process)
+            {
+                // Still waiting; leave it for the next launch
+                ::CloseHandle(process);
+                process = nullptr;
+                ::SetEvent(ready);
+            }
+        }
+
+        if (go)
+        {
+            ::CloseHandle(go);
+        }
+    }
+
+    ::CloseHandle(ready);
+    return process;
+}
+catch (...)
+{
+    return nullptr;
+}
+
+// Starts the standby instance for the next launch. Failing to only costs the next launch its head start
+void StartWarmStandby(const std::filesystem::path& exePath, std::wstring cmdLine, const wchar_t* workingDirectory, int cmdShow) noexcept try
+{
+    Log("\tStarting warm standby instance %ls\n", cmdLine.c_str());
+    ::SetEnvironmentVariableW(psf::warm_standby_variable, warm_standby_name().c_str());
+
+    STARTUPINFO startupInfo = { sizeof(startupInfo) };
+    startupInfo.dwFlags = STARTF_USESHOWWINDOW;
+    startupInfo.wShowWindow = static_cast<WORD>(cmdShow);
+
+    PROCESS_INFORMATION processInfo;
+    if (::PSFCreatePackageProcess(exePath.c_str(), cmdLine.data(), nullptr, nullptr, false, 0, nullptr, workingDirectory, &startupInfo, &processInfo))
+    {
+        ::CloseHandle(processInfo.hThread);
+        ::CloseHandle(processInfo.hProcess);
+    }
+    else
+    {
+        Log("\tUnable to start the warm standby instance. Error=0x%x\n", ::GetLastError());
+    }
+
+    ::SetEnvironmentVariableW(psf::warm_standby_variable, nullptr);
+}
+catch (...)
+{
+}
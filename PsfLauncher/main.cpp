@@ -5,11 +5,13 @@
 
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <sstream>
 
 #include <windows.h>
 #include <psf_constants.h>
+#include <psf_logging.h>
 #include <psf_runtime.h>
 #include <shellapi.h>
 #include <combaseapi.h>
@@ -17,7 +19,118 @@
 using namespace std::literals;
 
 // Forward declaration
-void LaunchMonitorInBackground(std::filesystem::path packageRoot, const wchar_t * executable, const wchar_t * arguments, bool wait, bool asadmin);
+void LaunchMonitorInBackground(std::filesystem::path packageRoot, const wchar_t * executable, const wchar_t * arguments, bool wait, bool asadmin, DWORD readyTimeout);
+
+// How long to wait for a monitor launched with 'asadmin' to signal that it's ready, when the configuration doesn't say.
+// Monitors that don't signal cost this much, the same as the fixed delay that this replaces
+constexpr DWORD default_admin_monitor_ready_timeout = 5000;
+
+// With the monitor's 'mode' set to 'after-idle', how long to wait for the application to go idle before starting the
+// monitor anyway
+constexpr DWORD monitor_after_idle_timeout = 10000;
+
+// The monitor's 'mode' says how its startup gets ordered against the application's: before it (so that the monitor sees
+// everything), alongside it, or once the application is up and waiting for input
+enum class monitor_mode
+{
+    before,
+    parallel,
+    after_idle,
+};
+
+struct monitor_launch
+{
+    std::filesystem::path package_root;
+    std::wstring executable;
+    std::wstring arguments;
+    bool wait = false;
+    bool asadmin = false;
+    DWORD ready_timeout = 0;
+};
+
+static DWORD __stdcall MonitorLaunchThread(void* parameter) noexcept
+{
+    std::unique_ptr<monitor_launch> launch(static_cast<monitor_launch*>(parameter));
+
+    // ShellExecuteEx (used for 'asadmin') expects COM to be initialized on the calling thread
+    auto hr = ::CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+    LaunchMonitorInBackground(launch->package_root, launch->executable.c_str(), launch->arguments.c_str(), launch->wait, launch->asadmin, launch->ready_timeout);
+    if (SUCCEEDED(hr))
+    {
+        ::CoUninitialize();
+    }
+    return ERROR_SUCCESS;
+}
+
+// Owns the thread that starts the monitor for the 'parallel' mode; the launcher doesn't exit until it's done, since that
+// would kill it partway through starting the monitor
+struct monitor_launch_thread
+{
+    HANDLE thread = nullptr;
+
+    monitor_launch_thread() = default;
+    monitor_launch_thread(const monitor_launch_thread&) = delete;
+    monitor_launch_thread& operator=(const monitor_launch_thread&) = delete;
+
+    ~monitor_launch_thread()
+    {
+        if (thread)
+        {
+            ::WaitForSingleObject(thread, INFINITE);
+            ::CloseHandle(thread);
+        }
+    }
+
+    void start(const monitor_launch& launch)
+    {
+        auto parameter = std::make_unique<monitor_launch>(launch);
+        thread = ::CreateThread(nullptr, 0, MonitorLaunchThread, parameter.get(), 0, nullptr);
+        if (thread)
+        {
+            parameter.release();
+        }
+        else
+        {
+            // Just start it here instead
+            MonitorLaunchThread(parameter.release());
+        }
+    }
+};
+
+static void LaunchMonitor(const monitor_launch& launch)
+{
+    Log("\tCreating the monitor: %ls", launch.executable.c_str());
+    LaunchMonitorInBackground(launch.package_root, launch.executable.c_str(), launch.arguments.c_str(), launch.wait, launch.asadmin, launch.ready_timeout);
+}
+
+// For the 'after-idle' mode, once the application has been created
+static void LaunchMonitorAfterIdle(const monitor_launch& launch, HANDLE process)
+{
+    if (process)
+    {
+        // NOTE: Fails right away for applications without a message loop (e.g. console applications)
+        ::WaitForInputIdle(process, monitor_after_idle_timeout);
+    }
+    LaunchMonitor(launch);
+}
+
+// See StartupProfile.cpp
+void RecordStartupProfile(DWORD seconds);
+void ReplayStartupProfile(const std::filesystem::path& packageRoot, const std::filesystem::path& executable) noexcept;
+
+constexpr DWORD default_startup_profile_record_seconds = 10;
+
+// See ResourceAccounting.cpp
+HANDLE CreateAccountingJob() noexcept;
+void AssignToAccountingJob(HANDLE job, HANDLE process) noexcept;
+void ReportJobAccounting(HANDLE job) noexcept;
+
+// See WarmStandby.cpp
+HANDLE ClaimWarmStandby() noexcept;
+void StartWarmStandby(const std::filesystem::path& exePath, std::wstring cmdLine, const wchar_t* workingDirectory, int cmdShow) noexcept;
+
+// How long the application gets to go idle before the next launch's standby instance starts competing with it
+constexpr DWORD warm_standby_start_delay = 10000;
 
 static inline bool check_suffix_if(iwstring_view str, iwstring_view suffix)
 {
@@ -31,28 +144,10 @@ static inline bool check_suffix_if(iwstring_view str, iwstring_view suffix)
 
 void Log(const char* fmt, ...)
 {
-    std::string str;
-    str.resize(256);
-
     va_list args;
     va_start(args, fmt);
-    std::size_t count = std::vsnprintf(str.data(), str.size() + 1, fmt, args);
-    assert(count >= 0);
+    psf::log_vprintf(fmt, args);
     va_end(args);
-
-    if (count > str.size())
-    {
-        str.resize(count);
-
-        va_list args2;
-        va_start(args2, fmt);
-        count = std::vsnprintf(str.data(), str.size() + 1, fmt, args2);
-        assert(count >= 0);
-        va_end(args2);
-    }
-
-    str.resize(count);
-    ::OutputDebugStringA(str.c_str());
 }
 void LogString(const char* name, const char* value)
 {
@@ -87,21 +182,50 @@ int launcher_main(PWSTR args, int cmdShow) noexcept try
     // Allow arguments to be specified in config.json now also.
     std::wstring cmdLine = L"\"" + exePath.filename().native() + L"\" " + exeArgString + L" " + args;
 
+    // NOTE: Declared before anything that can return so that the launcher always waits for it
+    monitor_launch_thread monitorThread;
+    monitor_launch monitorLaunch;
+    auto monitorMode = monitor_mode::before;
     if (monitor != nullptr )
     {
-        // A monitor is an optional additional program to run, such as the PSFShimMonitor. This program is run prior to the "main application".		
-        bool asadmin = false;
-        bool wait = false;
+        // A monitor is an optional additional program to run, such as the PSFShimMonitor. By default, this program is run prior to the "main application".		
         auto monitor_executable = monitor->try_get("executable");
         auto monitor_arguments = monitor->try_get("arguments");
         auto monitor_asadmin = monitor->try_get("asadmin");
         auto monitor_wait = monitor->try_get("wait");
+        auto monitor_readyTimeout = monitor->try_get("readyTimeout");
+        auto monitor_mode_value = monitor->try_get("mode");
+        monitorLaunch.package_root = packageRoot;
+        monitorLaunch.executable = monitor_executable->as_string().wide();
+        monitorLaunch.arguments = monitor_arguments->as_string().wide();
         if (monitor_asadmin)
-            asadmin = monitor_asadmin->as_boolean().get();
+            monitorLaunch.asadmin = monitor_asadmin->as_boolean().get();
         if (monitor_wait)
-            wait = monitor_wait->as_boolean().get();
-        Log("\tCreating the monitor: %ls", monitor_executable->as_string().wide());
-        LaunchMonitorInBackground(packageRoot, monitor_executable->as_string().wide(), monitor_arguments->as_string().wide(), wait, asadmin);
+            monitorLaunch.wait = monitor_wait->as_boolean().get();
+        monitorLaunch.ready_timeout = monitorLaunch.asadmin ? default_admin_monitor_ready_timeout : 0;
+        if (monitor_readyTimeout)
+            monitorLaunch.ready_timeout = monitor_readyTimeout->as_number().get<DWORD>();
+        if (monitor_mode_value)
+        {
+            auto mode = monitor_mode_value->as_string().wstring();
+            if (mode == L"parallel"sv)
+                monitorMode = monitor_mode::parallel;
+            else if (mode == L"after-idle"sv)
+                monitorMode = monitor_mode::after_idle;
+            else if (mode != L"before"sv)
+                throw_win32(ERROR_INVALID_PARAMETER, "Error: the monitor's mode must be one of \"before\", \"parallel\", or \"after-idle\"");
+        }
+
+        if (monitorMode == monitor_mode::before)
+        {
+            LaunchMonitor(monitorLaunch);
+        }
+        else if (monitorMode == monitor_mode::parallel)
+        {
+            // Neither waits on the other, so the launch takes as long as the slower of the two rather than both
+            Log("\tCreating the monitor in parallel: %ls", monitorLaunch.executable.c_str());
+            monitorThread.start(monitorLaunch);
+        }
     }
 
     // Fix-up for no working directory
@@ -124,38 +248,109 @@ int launcher_main(PWSTR args, int cmdShow) noexcept try
 
     if (check_suffix_if(exeName, L".exe"_isv))
     {
+        // A standby instance was started with the configured arguments only, so it can't stand in for a launch that
+        // adds arguments of its own
+        bool warmStandby = false;
+        if (auto warmStandbyValue = appConfig->try_get("warmStandby"))
+        {
+            warmStandby = warmStandbyValue->as_boolean().get();
+        }
+
+        PROCESS_INFORMATION processInfo = {};
+        if (warmStandby && (!args || !*args))
+        {
+            processInfo.hProcess = ClaimWarmStandby();
+        }
+
+        bool recordingStartupProfile = false;
+        if (auto startupProfile = appConfig->try_get("startupProfile"); startupProfile && !processInfo.hProcess)
+        {
+            auto& startupProfileObject = startupProfile->as_object();
+            auto modeValue = startupProfileObject.try_get("mode");
+            auto mode = modeValue ? modeValue->as_string().wstring() : L"replay"sv;
+            if (mode == L"record"sv)
+            {
+                DWORD seconds = default_startup_profile_record_seconds;
+                if (auto secondsValue = startupProfileObject.try_get("recordSeconds"))
+                {
+                    seconds = secondsValue->as_number().get<DWORD>();
+                }
+                RecordStartupProfile(seconds);
+                recordingStartupProfile = true;
+            }
+            else if (mode == L"replay"sv)
+            {
+                // Runs alongside the process creation below
+                ReplayStartupProfile(packageRoot, exePath);
+            }
+        }
+
+        // NOTE: A standby instance is already running, so it can't be put in a job before it starts anything
+        HANDLE accountingJob = nullptr;
+        if (auto accountingValue = appConfig->try_get("resourceAccounting");
+            accountingValue && accountingValue->as_boolean().get() && !processInfo.hProcess)
+        {
+            accountingJob = CreateAccountingJob();
+        }
+
         STARTUPINFO startupInfo = { sizeof(startupInfo) };
         startupInfo.dwFlags = STARTF_USESHOWWINDOW;
         startupInfo.wShowWindow = static_cast<WORD>(cmdShow);
 
-        Log("\tCreating process %ls", cmdLine.data());
-        // NOTE: PsfRuntime, which we dynamically link against, detours this call
-        PROCESS_INFORMATION processInfo;
-        if (!::CreateProcessW(
-            exePath.c_str(),
-            cmdLine.data(),
-            nullptr, nullptr, // Process/ThreadAttributes
-            true, // InheritHandles
-            0, // CreationFlags
-            nullptr, // Environment
-            dirStr ? (packageRoot / dirStr).c_str() : nullptr, // NOTE: extended-length path not supported
-            &startupInfo,
-            &processInfo))
+        // NOTE: The executable is in the package, so the PsfRuntime can inject itself without the detoured CreateProcess
+        //       having to find out where the executable is first
+        if (!processInfo.hProcess)
         {
-            std::wostringstream ss;
-            auto err{ ::GetLastError() };
-            // Remove the ".\r\n" that gets added to all messages
-            auto msg = widen(std::system_category().message(err));
-            msg.resize(msg.length() - 3);
-            ss << L"ERROR: Failed to create detoured process\n  Path: \"" << exeName << "\"\n  Error: " << msg << " (" << err << ")";
-            ::PSFReportError(ss.str().c_str());
-            return err;
+            Log("\tCreating process %ls", cmdLine.data());
+            if (!::PSFCreatePackageProcess(
+                exePath.c_str(),
+                cmdLine.data(),
+                nullptr, nullptr, // Process/ThreadAttributes
+                true, // InheritHandles
+                accountingJob ? CREATE_SUSPENDED : 0, // CreationFlags; suspended so that nothing it starts escapes the job
+                nullptr, // Environment
+                dirStr ? (packageRoot / dirStr).c_str() : nullptr, // NOTE: extended-length path not supported
+                &startupInfo,
+                &processInfo))
+            {
+                std::wostringstream ss;
+                auto err{ ::GetLastError() };
+                // Remove the ".\r\n" that gets added to all messages
+                auto msg = widen(std::system_category().message(err));
+                msg.resize(msg.length() - 3);
+                ss << L"ERROR: Failed to create detoured process\n  Path: \"" << exeName << "\"\n  Error: " << msg << " (" << err << ")";
+                ::PSFReportError(ss.str().c_str());
+                return err;
+            }
+
+            if (accountingJob)
+            {
+                AssignToAccountingJob(accountingJob, processInfo.hProcess);
+                ::ResumeThread(processInfo.hThread);
+            }
+        }
+
+        if (monitor && (monitorMode == monitor_mode::after_idle))
+        {
+            LaunchMonitorAfterIdle(monitorLaunch, processInfo.hProcess);
+        }
+
+        // NOTE: A standby instance wouldn't record anything worth keeping, since its startup is over long before it runs
+        if (warmStandby && !recordingStartupProfile)
+        {
+            ::WaitForInputIdle(processInfo.hProcess, warm_standby_start_delay);
+            StartWarmStandby(exePath, L"\"" + exePath.filename().native() + L"\" " + exeArgString + L" ", dirStr ? (packageRoot / dirStr).c_str() : nullptr, cmdShow);
         }
 
         // Propagate exit code to caller, in case they care
         switch (::WaitForSingleObject(processInfo.hProcess, INFINITE))
         {
         case WAIT_OBJECT_0:
+            if (accountingJob)
+            {
+                ReportJobAccounting(accountingJob);
+                ::CloseHandle(accountingJob);
+            }
             break; // Success case... handle at the end of main
 
         case WAIT_FAILED:
@@ -204,6 +399,11 @@ int launcher_main(PWSTR args, int cmdShow) noexcept try
         }
         else
         { 
+            if (monitor && (monitorMode == monitor_mode::after_idle))
+            {
+                LaunchMonitorAfterIdle(monitorLaunch, shex.hProcess);
+            }
+
             // Propagate exit code to caller, in case they care
             switch (::WaitForSingleObject(shex.hProcess, INFINITE))
             {
@@ -229,19 +429,52 @@ catch (...)
 }
 
 
-void LaunchMonitorInBackground(std::filesystem::path packageRoot, const wchar_t * executable, const wchar_t * arguments, bool wait, bool asadmin )
+// Monitors that trace the application (e.g. PsfMonitor) signal this event once their trace session is live, so that the
+// application doesn't get started before anything is listening. The name only depends on the package, since a monitor
+// started with 'asadmin' doesn't inherit anything from us, not even the environment
+static HANDLE CreateMonitorReadyEvent()
+{
+    std::wstring name = L"Local\\PsfMonitorReady_"s + PSFQueryPackageFullName();
+    HANDLE readyEvent = ::CreateEventW(nullptr, TRUE, FALSE, name.c_str());
+    if (readyEvent && (::GetLastError() == ERROR_ALREADY_EXISTS))
+    {
+        // Left over from a monitor that's still running from an earlier launch, which we don't want to take as ready
+        ::ResetEvent(readyEvent);
+    }
+    return readyEvent;
+}
+
+// Waits until the monitor is ready, the timeout passes, or (if given) the monitor exits, whichever comes first
+static void WaitForMonitorReady(HANDLE readyEvent, HANDLE monitorProcess, DWORD timeout)
+{
+    if (!readyEvent || (timeout == 0))
+    {
+        return;
+    }
+
+    HANDLE handles[] = { readyEvent, monitorProcess };
+    auto result = ::WaitForMultipleObjects(monitorProcess ? 2 : 1, handles, FALSE, timeout);
+    if (result == WAIT_OBJECT_0)
+    {
+        Log("\tMonitor is ready\n");
+    }
+    else if (result == WAIT_TIMEOUT)
+    {
+        Log("\tMonitor did not signal that it is ready within %u ms; continuing\n", timeout);
+    }
+}
+
+void LaunchMonitorInBackground(std::filesystem::path packageRoot, const wchar_t * executable, const wchar_t * arguments, bool wait, bool asadmin, DWORD readyTimeout)
 {
     std::wstring cmd = L"\"" + (packageRoot / executable).native() + L"\"";
+    HANDLE readyEvent = wait ? nullptr : CreateMonitorReadyEvent();
 
     if (asadmin)
     {
         // This happens when the program is requested for elevation.
         SHELLEXECUTEINFOW shExInfo = { 0 };
         shExInfo.cbSize = sizeof(shExInfo);
-        if (wait)
-            shExInfo.fMask = SEE_MASK_NOCLOSEPROCESS;
-        else
-            shExInfo.fMask = SEE_MASK_NOCLOSEPROCESS|SEE_MASK_WAITFORINPUTIDLE;  // make sure we wait a bit for the monitor to be running before continuing on.
+        shExInfo.fMask = SEE_MASK_NOCLOSEPROCESS;
         shExInfo.hwnd = 0;
         shExInfo.lpVerb = L"runas";                // Operation to perform
         shExInfo.lpFile = cmd.c_str();       // Application to start    
@@ -260,10 +493,11 @@ void LaunchMonitorInBackground(std::filesystem::path packageRoot, const wchar_t
             }
             else
             {
-                WaitForInputIdle(shExInfo.hProcess, 1000);
-                // Due to elevation, the process starts, relaunches, and the main process ends in under 1ms.
-                // So we'll just toss in an ugly sleep here for now.
-                Sleep(5000);
+                // Due to elevation, the process may start, relaunch itself, and exit in under 1ms, so its exit says
+                // nothing about whether the monitor is up
+                WaitForMonitorReady(readyEvent, nullptr, readyTimeout);
+                if (shExInfo.hProcess)
+                    CloseHandle(shExInfo.hProcess);
             }
         }
         else
@@ -301,10 +535,21 @@ void LaunchMonitorInBackground(std::filesystem::path packageRoot, const wchar_t
         {
             if (wait)
                 WaitForSingleObject(processInfo.hProcess, INFINITE);
+            else
+                WaitForMonitorReady(readyEvent, processInfo.hProcess, readyTimeout);
+            CloseHandle(processInfo.hThread);
+            CloseHandle(processInfo.hProcess);
         }
     }
+
+    if (readyEvent)
+    {
+        CloseHandle(readyEvent);
+    }
 }
 int __stdcall wWinMain(HINSTANCE, HINSTANCE, PWSTR args, int cmdShow)
 {
-    return launcher_main(args, cmdShow);
+    auto result = launcher_main(args, cmdShow);
+    psf::flush_log();
+    return result;
 }
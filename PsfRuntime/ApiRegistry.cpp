@@ -0,0 +1,91 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Tracing, per-API counters, and anything else that instruments the detours needs to tell the APIs apart, and used to
+// do so by name (e.g. by trimming __FUNCTION__). DECLARE_FIXUP and DECLARE_STRING_FIXUP now give each detour a constexpr
+// psf_api_info, which psf::attach_all registers here, and each distinct API gets the next index. APIs that several
+// fixups detour get registered once for each of them, and keep the index from the first time.
+//
+// NOTE: Ids are hashes, so two APIs could in theory share one. The API that registered first keeps the id, and the
+//       other one gets logged
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+#include <psf_runtime.h>
+#include <win32_error.h>
+
+void Log(const char* fmt, ...);
+
+struct registered_api
+{
+    std::string name;
+    psf_api_info info;
+};
+
+static std::mutex g_ApiRegistryMutex;
+static std::vector<std::unique_ptr<registered_api>> g_Apis;
+static std::unordered_map<std::uint32_t, std::uint32_t> g_ApiIndices;
+
+PSFAPI DWORD __stdcall PSFRegisterApis(_In_reads_(count) const psf_api_info* const* apis, std::size_t count) noexcept try
+{
+    std::lock_guard lock(g_ApiRegistryMutex);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto& api = *apis[i];
+        auto [itr, inserted] = g_ApiIndices.emplace(api.id, static_cast<std::uint32_t>(g_Apis.size()));
+        if (!inserted)
+        {
+            if (std::strcmp(g_Apis[itr->second]->info.name, api.name) != 0)
+            {
+                Log("\tAPI %s has the same id as %s, and won't be told apart from it\n", api.name, g_Apis[itr->second]->info.name);
+            }
+            continue;
+        }
+
+        try
+        {
+            auto entry = std::make_unique<registered_api>();
+            entry->name = api.name;
+            entry->info = { api.id, api.category, entry->name.c_str() };
+            g_Apis.push_back(std::move(entry));
+        }
+        catch (...)
+        {
+            g_ApiIndices.erase(itr);
+            throw;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+PSFAPI std::uint32_t __stdcall PSFQueryApiIndex(std::uint32_t id) noexcept
+{
+    std::lock_guard lock(g_ApiRegistryMutex);
+    auto itr = g_ApiIndices.find(id);
+    return (itr == g_ApiIndices.end()) ? psf_invalid_api_index : itr->second;
+}
+
+PSFAPI std::size_t __stdcall PSFQueryApis(_Out_writes_(capacity) const psf_api_info** apis, std::size_t capacity) noexcept
+{
+    std::lock_guard lock(g_ApiRegistryMutex);
+    for (std::size_t i = 0; (i < capacity) && (i < g_Apis.size()); ++i)
+    {
+        apis[i] = &g_Apis[i]->info;
+    }
+
+    return g_Apis.size();
+}
@@ -0,0 +1,696 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// config.psfc: config.json, compiled ahead of time by PsfConfigCompiler (see PsfConfigCompiler/readme.md) so that each
+// process can skip parsing JSON and compiling the "processes" patterns. It sits next to config.json, and only gets used
+// when it was compiled from config.json's exact contents; a missing, stale, or damaged file just means that config.json
+// gets parsed, same as always. The file is mapped read-only and is never copied: DOMs get built by replaying it through
+// the same handlers that rapidjson drives, and their strings point straight into the mapping. The layout is:
+//      compiled_config_header
+//      strings     UTF-8, each null terminated
+//      values      compiled_value[], each container before its children, starting with the root
+//      members     compiled_member[], each object's contiguous and sorted by key
+//      elements    std::uint32_t[], value indices, each array's contiguous
+//      processes   compiled_process[], one per "processes" entry
+//      patterns    the DFA tables of the "processes" patterns that compiled to one (see pattern_matcher::save)
+//      dlls        compiled_dll[], one per distinct fixup "dll", sorted by name
+// Everything is little endian and made up of fixed-size fields, so the same file works for 32-bit and 64-bit processes
+// alike. Records are read with memcpy rather than through pointers into the mapping, so nothing needs to be aligned
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <pattern_matcher.h>
+
+#include "JsonConfig.h"
+
+constexpr std::uint32_t compiled_config_magic = 0x43465350; // "PSFC"
+constexpr std::uint32_t compiled_config_version = 1;
+
+// Replaying recurses once per level, so the depth gets capped; config.json files are never anywhere near this deep
+constexpr std::uint16_t compiled_config_max_depth = 256;
+
+// FNV-1a, which is plenty to tell whether config.psfc was compiled from the config.json that's there now
+inline std::uint64_t compiled_config_hash(const void* data, std::size_t size) noexcept
+{
+    auto bytes = static_cast<const std::uint8_t*>(data);
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+struct compiled_config_section
+{
+    std::uint32_t offset; // From the start of the file
+    std::uint32_t count; // Of records, except for strings and patterns, which count bytes
+};
+
+struct compiled_config_header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t size; // Of the whole file
+    std::uint64_t source_hash; // compiled_config_hash of the config.json that was compiled
+    std::uint64_t checksum; // compiled_config_hash of everything after the header
+    compiled_config_section strings;
+    compiled_config_section values;
+    compiled_config_section members;
+    compiled_config_section elements;
+    compiled_config_section processes;
+    compiled_config_section patterns;
+    compiled_config_section dlls;
+};
+
+enum class compiled_value_type : std::uint8_t
+{
+    null,
+    false_value,
+    true_value,
+    signed_number,
+    unsigned_number,
+    float_number,
+    string,
+    object,
+    array,
+};
+
+struct compiled_value
+{
+    compiled_value_type type;
+    std::uint8_t reserved;
+    std::uint16_t depth; // The root is at depth zero, and every child is one deeper than its container
+    std::uint32_t first; // Strings: offset into strings; objects: first member; arrays: first element
+    std::uint64_t data; // Strings: length; containers: child count; numbers: their bits
+};
+static_assert(sizeof(compiled_value) == 16);
+
+struct compiled_member
+{
+    std::uint32_t key_offset;
+    std::uint32_t key_length;
+    std::uint32_t value;
+};
+
+// Patterns that std::wregex has to handle can't be saved, and neither can the "executable" of an entry that doesn't have
+// a valid one; either way, the entry's pattern gets compiled from config.json at runtime, same as without config.psfc
+enum class compiled_process_kind : std::uint32_t
+{
+    uncompiled,
+    compiled,
+};
+
+struct compiled_process
+{
+    compiled_process_kind kind;
+    std::uint32_t pattern_offset; // Into patterns
+    std::uint32_t pattern_size;
+};
+
+// Which of the paths that the PsfRuntime tries when loading a fixup dll exist under the package root: the "dll" value as
+// given, and the value with its extension replaced by "32.dll" or "64.dll"
+enum compiled_dll_flags : std::uint32_t
+{
+    compiled_dll_as_given = 0x01,
+    compiled_dll_32 = 0x02,
+    compiled_dll_64 = 0x04,
+};
+
+struct compiled_dll
+{
+    std::uint32_t name_offset;
+    std::uint32_t name_length;
+    std::uint32_t flags;
+};
+
+// A view of a config.psfc file that's been loaded into memory. The file comes from disk, so load checks every offset,
+// count, and string in it up front, leaving nothing that replaying it - or anything else - could trip over
+class compiled_config
+{
+public:
+
+    // Returns false if 'data' isn't a complete and consistent config.psfc that was compiled from config.json contents
+    // that hash to 'sourceHash'. 'data' must outlive both the compiled_config and any DOM built from it
+    bool load(const std::uint8_t* data, std::size_t size, std::uint64_t sourceHash) noexcept
+    {
+        m_data = nullptr;
+        if (size < sizeof(m_header))
+        {
+            return false;
+        }
+
+        std::memcpy(&m_header, data, sizeof(m_header));
+        if ((m_header.magic != compiled_config_magic) || (m_header.version != compiled_config_version) ||
+            (m_header.size != size) || (m_header.source_hash != sourceHash) ||
+            (m_header.checksum != compiled_config_hash(data + sizeof(m_header), size - sizeof(m_header))))
+        {
+            return false;
+        }
+
+        m_data = data;
+        if (!valid_section(m_header.strings, 1) || !valid_section(m_header.values, sizeof(compiled_value)) ||
+            !valid_section(m_header.members, sizeof(compiled_member)) ||
+            !valid_section(m_header.elements, sizeof(std::uint32_t)) ||
+            !valid_section(m_header.processes, sizeof(compiled_process)) || !valid_section(m_header.patterns, 1) ||
+            !valid_section(m_header.dlls, sizeof(compiled_dll)) || (m_header.values.count == 0) ||
+            !valid_values() || !valid_processes() || !valid_dlls())
+        {
+            m_data = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    std::uint64_t source_hash() const noexcept
+    {
+        return m_header.source_hash;
+    }
+
+    // The whole file, e.g. for handing it to a child process as is
+    const std::uint8_t* data() const noexcept
+    {
+        return m_data;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return static_cast<std::size_t>(m_header.size);
+    }
+
+    // Replays the DOM as rapidjson SAX events, stopping as soon as the handler does. Strings are passed with copy=false,
+    // since they live as long as the mapping does
+    template <typename Handler>
+    bool replay(Handler& handler) const
+    {
+        return replay_value(handler, 0);
+    }
+
+    // Loads the saved pattern of the 'index'th "processes" entry. Returns false, leaving the pattern to be compiled from
+    // config.json, if it wasn't saved
+    bool load_process_pattern(std::size_t index, psf::pattern_matcher& matcher) const
+    {
+        if (index >= m_header.processes.count)
+        {
+            return false;
+        }
+
+        auto process = record<compiled_process>(m_header.processes, index);
+        if (process.kind != compiled_process_kind::compiled)
+        {
+            return false;
+        }
+
+        auto begin = m_data + m_header.patterns.offset + process.pattern_offset;
+        auto end = begin + process.pattern_size;
+        return matcher.load(begin, end) && (begin == end);
+    }
+
+    // Zero if 'dll' isn't the "dll" of any fixup
+    std::uint32_t dll_flags(std::string_view dll) const noexcept
+    {
+        std::size_t lo = 0;
+        std::size_t hi = m_header.dlls.count;
+        while (lo < hi)
+        {
+            auto mid = lo + (hi - lo) / 2;
+            auto entry = record<compiled_dll>(m_header.dlls, mid);
+            auto name = string_at(entry.name_offset, entry.name_length);
+            if (name == dll)
+            {
+                return entry.flags;
+            }
+            else if (name < dll)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        return 0;
+    }
+
+private:
+
+    template <typename T>
+    T record(const compiled_config_section& section, std::size_t index) const noexcept
+    {
+        T result;
+        std::memcpy(&result, m_data + section.offset + index * sizeof(T), sizeof(T));
+        return result;
+    }
+
+    std::string_view string_at(std::uint32_t offset, std::size_t length) const noexcept
+    {
+        return std::string_view(reinterpret_cast<const char*>(m_data) + m_header.strings.offset + offset, length);
+    }
+
+    bool valid_section(const compiled_config_section& section, std::size_t recordSize) const noexcept
+    {
+        return (section.offset >= sizeof(m_header)) && (section.offset <= m_header.size) &&
+            (static_cast<std::uint64_t>(section.count) * recordSize <= m_header.size - section.offset);
+    }
+
+    bool valid_string(std::uint64_t offset, std::uint64_t length) const noexcept
+    {
+        return (offset < m_header.strings.count) && (length < m_header.strings.count - offset) &&
+            (m_data[m_header.strings.offset + offset + length] == '\0');
+    }
+
+    // The children of a container must come after it and be exactly one level deeper, which rules out cycles and bounds
+    // how deep replaying can recurse
+    bool valid_child(std::uint32_t child, std::uint32_t parent, const compiled_value& parentValue) const noexcept
+    {
+        return (child > parent) && (child < m_header.values.count) &&
+            (record<compiled_value>(m_header.values, child).depth == parentValue.depth + 1);
+    }
+
+    bool valid_values() const noexcept
+    {
+        for (std::uint32_t i = 0; i < m_header.values.count; ++i)
+        {
+            auto value = record<compiled_value>(m_header.values, i);
+            if ((value.depth > compiled_config_max_depth) || ((i == 0) && (value.depth != 0)))
+            {
+                return false;
+            }
+
+            switch (value.type)
+            {
+            case compiled_value_type::null:
+            case compiled_value_type::false_value:
+            case compiled_value_type::true_value:
+            case compiled_value_type::signed_number:
+            case compiled_value_type::unsigned_number:
+            case compiled_value_type::float_number:
+                break;
+
+            case compiled_value_type::string:
+                if (!valid_string(value.first, value.data))
+                {
+                    return false;
+                }
+                break;
+
+            case compiled_value_type::object:
+                if ((value.first > m_header.members.count) || (value.data > m_header.members.count - value.first))
+                {
+                    return false;
+                }
+
+                for (std::uint32_t j = 0; j < value.data; ++j)
+                {
+                    auto member = record<compiled_member>(m_header.members, value.first + j);
+                    if (!valid_string(member.key_offset, member.key_length) || !valid_child(member.value, i, value))
+                    {
+                        return false;
+                    }
+                }
+                break;
+
+            case compiled_value_type::array:
+                if ((value.first > m_header.elements.count) || (value.data > m_header.elements.count - value.first))
+                {
+                    return false;
+                }
+
+                for (std::uint32_t j = 0; j < value.data; ++j)
+                {
+                    if (!valid_child(record<std::uint32_t>(m_header.elements, value.first + j), i, value))
+                    {
+                        return false;
+                    }
+                }
+                break;
+
+            default:
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool valid_processes() const noexcept
+    {
+        for (std::uint32_t i = 0; i < m_header.processes.count; ++i)
+        {
+            auto process = record<compiled_process>(m_header.processes, i);
+            if (process.kind == compiled_process_kind::compiled)
+            {
+                if ((process.pattern_offset > m_header.patterns.count) ||
+                    (process.pattern_size > m_header.patterns.count - process.pattern_offset))
+                {
+                    return false;
+                }
+            }
+            else if (process.kind != compiled_process_kind::uncompiled)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Names must be strictly increasing for dll_flags' binary search
+    bool valid_dlls() const noexcept
+    {
+        std::string_view previous;
+        for (std::uint32_t i = 0; i < m_header.dlls.count; ++i)
+        {
+            auto dll = record<compiled_dll>(m_header.dlls, i);
+            if (!valid_string(dll.name_offset, dll.name_length))
+            {
+                return false;
+            }
+
+            auto name = string_at(dll.name_offset, dll.name_length);
+            if ((i > 0) && !(previous < name))
+            {
+                return false;
+            }
+
+            previous = name;
+        }
+
+        return true;
+    }
+
+    template <typename Handler>
+    bool replay_value(Handler& handler, std::uint32_t index) const
+    {
+        auto value = record<compiled_value>(m_header.values, index);
+        switch (value.type)
+        {
+        case compiled_value_type::null:
+            return handler.Null();
+
+        case compiled_value_type::false_value:
+            return handler.Bool(false);
+
+        case compiled_value_type::true_value:
+            return handler.Bool(true);
+
+        case compiled_value_type::signed_number:
+            return handler.Int64(static_cast<std::int64_t>(value.data));
+
+        case compiled_value_type::unsigned_number:
+            return handler.Uint64(value.data);
+
+        case compiled_value_type::float_number:
+        {
+            double number;
+            std::memcpy(&number, &value.data, sizeof(number));
+            return handler.Double(number);
+        }
+
+        case compiled_value_type::string:
+        {
+            auto str = string_at(value.first, static_cast<std::size_t>(value.data));
+            return handler.String(str.data(), static_cast<unsigned>(str.length()), false);
+        }
+
+        case compiled_value_type::object:
+            if (!handler.StartObject())
+            {
+                return false;
+            }
+
+            for (std::uint32_t i = 0; i < value.data; ++i)
+            {
+                auto member = record<compiled_member>(m_header.members, value.first + i);
+                auto key = string_at(member.key_offset, member.key_length);
+                if (!handler.Key(key.data(), static_cast<unsigned>(key.length()), false) ||
+                    !replay_value(handler, member.value))
+                {
+                    return false;
+                }
+            }
+
+            return handler.EndObject(static_cast<unsigned>(value.data));
+
+        case compiled_value_type::array:
+            if (!handler.StartArray())
+            {
+                return false;
+            }
+
+            for (std::uint32_t i = 0; i < value.data; ++i)
+            {
+                if (!replay_value(handler, record<std::uint32_t>(m_header.elements, value.first + i)))
+                {
+                    return false;
+                }
+            }
+
+            return handler.EndArray(static_cast<unsigned>(value.data));
+        }
+
+        // load makes sure that this can't happen
+        assert(false);
+        return false;
+    }
+
+    const std::uint8_t* m_data = nullptr;
+    compiled_config_header m_header = {};
+};
+
+// The fixup dlls that a compiled config describes, by "dll" value; see compiled_dll_flags
+using compiled_config_dlls = std::vector<std::pair<std::string, std::uint32_t>>;
+
+// Builds a config.psfc file from a DOM that a json_document built. Used by PsfConfigCompiler; the PsfRuntime only ever
+// reads these files
+class compiled_config_writer
+{
+public:
+
+    std::vector<std::uint8_t> write(const psf::json_value& root, std::uint64_t sourceHash, compiled_config_dlls dlls)
+    {
+        add_value(root, 0);
+        add_processes(root);
+
+        std::sort(dlls.begin(), dlls.end());
+        dlls.erase(std::unique(dlls.begin(), dlls.end(), [](auto& lhs, auto& rhs)
+        {
+            return lhs.first == rhs.first;
+        }), dlls.end());
+        for (auto& [name, flags] : dlls)
+        {
+            m_dlls.push_back(compiled_dll{ add_string(name), static_cast<std::uint32_t>(name.length()), flags });
+        }
+
+        compiled_config_header header = {};
+        header.magic = compiled_config_magic;
+        header.version = compiled_config_version;
+        header.source_hash = sourceHash;
+
+        std::vector<std::uint8_t> result(sizeof(header));
+        auto append = [&](compiled_config_section& section, const auto& records, std::size_t countDivisor)
+        {
+            auto size = records.size() * sizeof(records[0]);
+            check_size(result.size() + size);
+            section.offset = static_cast<std::uint32_t>(result.size());
+            section.count = static_cast<std::uint32_t>(size / countDivisor);
+            auto bytes = reinterpret_cast<const std::uint8_t*>(records.data());
+            result.insert(result.end(), bytes, bytes + size);
+        };
+        append(header.strings, m_strings, 1);
+        append(header.values, m_values, sizeof(compiled_value));
+        append(header.members, m_members, sizeof(compiled_member));
+        append(header.elements, m_elements, sizeof(std::uint32_t));
+        append(header.processes, m_processes, sizeof(compiled_process));
+        append(header.patterns, m_patterns, 1);
+        append(header.dlls, m_dlls, sizeof(compiled_dll));
+
+        header.size = result.size();
+        header.checksum = compiled_config_hash(result.data() + sizeof(header), result.size() - sizeof(header));
+        std::memcpy(result.data(), &header, sizeof(header));
+        return result;
+    }
+
+private:
+
+    static void check_size(std::size_t size)
+    {
+        if (size > (std::numeric_limits<std::uint32_t>::max)())
+        {
+            throw std::runtime_error("config.json is too large to compile");
+        }
+    }
+
+    std::uint32_t add_string(std::string_view str)
+    {
+        if (auto itr = m_stringOffsets.find(str); itr != m_stringOffsets.end())
+        {
+            return itr->second;
+        }
+
+        check_size(m_strings.size() + str.length() + 1);
+        auto offset = static_cast<std::uint32_t>(m_strings.size());
+        m_strings.insert(m_strings.end(), str.begin(), str.end());
+        m_strings.push_back('\0');
+        m_stringOffsets.emplace(str, offset);
+        return offset;
+    }
+
+    // NOTE: Children get added after their container's record and child arrays are reserved, so all of these get
+    //       accessed by index; the vectors reallocate as the children get added
+    std::uint32_t add_value(const psf::json_value& value, std::uint16_t depth)
+    {
+        if (depth > compiled_config_max_depth)
+        {
+            throw std::runtime_error("config.json is nested too deeply to compile");
+        }
+
+        check_size(m_values.size() + 1);
+        auto index = static_cast<std::uint32_t>(m_values.size());
+        m_values.emplace_back();
+
+        compiled_value result = {};
+        result.depth = depth;
+        switch (value.type())
+        {
+        case psf::json_type::null:
+            result.type = compiled_value_type::null;
+            break;
+
+        case psf::json_type::boolean:
+            result.type = value.as_boolean().get() ? compiled_value_type::true_value : compiled_value_type::false_value;
+            break;
+
+        case psf::json_type::number:
+        {
+            auto& number = static_cast<const json_number_impl&>(value.as_number()).value;
+            if (auto signedValue = std::get_if<std::int64_t>(&number))
+            {
+                result.type = compiled_value_type::signed_number;
+                result.data = static_cast<std::uint64_t>(*signedValue);
+            }
+            else if (auto unsignedValue = std::get_if<std::uint64_t>(&number))
+            {
+                result.type = compiled_value_type::unsigned_number;
+                result.data = *unsignedValue;
+            }
+            else
+            {
+                result.type = compiled_value_type::float_number;
+                std::memcpy(&result.data, &std::get<double>(number), sizeof(result.data));
+            }
+            break;
+        }
+
+        case psf::json_type::string:
+        {
+            unsigned length;
+            auto str = value.as_string().narrow(&length);
+            result.type = compiled_value_type::string;
+            result.first = add_string(std::string_view(str, length));
+            result.data = length;
+            break;
+        }
+
+        case psf::json_type::object:
+        {
+            auto& obj = static_cast<const json_object_impl&>(value.as_object());
+            check_size(m_members.size() + obj.member_count);
+            result.type = compiled_value_type::object;
+            result.first = static_cast<std::uint32_t>(m_members.size());
+            result.data = obj.member_count;
+            m_members.resize(m_members.size() + obj.member_count);
+            for (unsigned i = 0; i < obj.member_count; ++i)
+            {
+                auto& member = obj.members[i];
+                auto key = add_string(member.key);
+                auto child = add_value(*member.value, depth + 1);
+                m_members[result.first + i] =
+                    compiled_member{ key, static_cast<std::uint32_t>(member.key.length()), child };
+            }
+            break;
+        }
+
+        case psf::json_type::array:
+        {
+            auto& arr = static_cast<const json_array_impl&>(value.as_array());
+            check_size(m_elements.size() + arr.element_count);
+            result.type = compiled_value_type::array;
+            result.first = static_cast<std::uint32_t>(m_elements.size());
+            result.data = arr.element_count;
+            m_elements.resize(m_elements.size() + arr.element_count);
+            for (unsigned i = 0; i < arr.element_count; ++i)
+            {
+                auto child = add_value(*arr.elements[i], depth + 1);
+                m_elements[result.first + i] = child;
+            }
+            break;
+        }
+        }
+
+        m_values[index] = result;
+        return index;
+    }
+
+    void add_processes(const psf::json_value& root)
+    {
+        auto rootObj = root.try_as_object();
+        auto processes = rootObj ? rootObj->try_get("processes") : nullptr;
+        auto processesArr = processes ? processes->try_as_array() : nullptr;
+        if (!processesArr)
+        {
+            return;
+        }
+
+        for (auto& processConfig : *processesArr)
+        {
+            compiled_process process = {};
+            try
+            {
+                psf::pattern_matcher matcher(processConfig.as_object().get("executable").as_string().wstring());
+                if (matcher.compiled())
+                {
+                    auto offset = m_patterns.size();
+                    matcher.save(m_patterns);
+                    check_size(m_patterns.size());
+                    process.kind = compiled_process_kind::compiled;
+                    process.pattern_offset = static_cast<std::uint32_t>(offset);
+                    process.pattern_size = static_cast<std::uint32_t>(m_patterns.size() - offset);
+                }
+            }
+            catch (...)
+            {
+                // Left for the PsfRuntime to fail on, same as it would without config.psfc
+            }
+
+            m_processes.push_back(process);
+        }
+    }
+
+    std::vector<char> m_strings;
+    std::unordered_map<std::string_view, std::uint32_t> m_stringOffsets; // Keys point into the DOM and 'dlls'
+    std::vector<compiled_value> m_values;
+    std::vector<compiled_member> m_members;
+    std::vector<std::uint32_t> m_elements;
+    std::vector<compiled_process> m_processes;
+    std::vector<std::uint8_t> m_patterns;
+    std::vector<compiled_dll> m_dlls;
+};
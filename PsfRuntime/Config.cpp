@@ -3,28 +3,43 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
 #include <cctype>
+#include <cstring>
+#include <cwctype>
+#include <deque>
 #include <fstream>
 #include <iostream>
-#include <map>
+#include <limits>
 #include <memory>
-#include <regex>
+#include <mutex>
 #include <sstream>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <windows.h>
+#include <combaseapi.h>
+#include <KnownFolders.h>
+#include <ShlObj.h>
 #include <detours.h>
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <pattern_matcher.h>
 #include <rapidjson/reader.h>
 #include <rapidjson/error/en.h>
 #include <rapidjson/filereadstream.h>
 #include <psf_constants.h>
+#include <psf_logging.h>
 #include <psf_runtime.h>
 #include <psf_utils.h>
 #include <stringapiset.h>
 #include <utilities.h>
 
+#include "CompiledConfig.h"
 #include "Config.h"
+#include "ConfigHandlers.h"
 #include "JsonConfig.h"
 
 using namespace std::literals;
@@ -33,302 +48,627 @@ static std::wstring g_PackageFullName;
 static std::wstring g_ApplicationUserModelId;
 static std::wstring g_ApplicationId;
 static std::filesystem::path g_PackageRootPath;
+
+// The package root as PSFIsPackagePath compares against it (see package_path_root), without any trailing separators
+static std::wstring g_PackageRootPrefix;
+static bool g_PackageRootIsUnc = false;
 static std::filesystem::path g_CurrentExecutable;
 
-// The object that constructs the JSON DOM and holds the root
-static struct
+// The config.json DOM
+static json_document g_Config;
+
+// Cleared iff config.json sets "enableReportError" to false
+static bool g_EnableReportError = true;
+
+// Set iff config.json sets "liveCounters" to true
+static bool g_LiveCountersEnabled = false;
+
+// "applications" by id, for PSFQueryAppLaunchConfig. The keys point into the DOM
+static std::unordered_map<iwstring_view, const psf::json_object*, case_insensitive_hash<wchar_t>> g_Applications;
+
+// The config.psfc that g_Config was built from, if any
+static const compiled_config* g_CompiledConfig = nullptr;
+
+// The config that our parent process handed down to us, if any; see load_inherited_config
+static const compiled_config* g_InheritedConfig = nullptr;
+
+// Goes through psf_logging.h, so that the OutputDebugString calls happen on its background thread rather than ours
+void Log(const char* fmt, ...)
 {
-    bool on_value(std::unique_ptr<psf::json_value> value)
-    {
-        if (!state_stack.empty())
-        {
-            assert(root);
-            auto& current_value = state_stack.back();
-            switch (current_value.index())
-            {
-            case 0:
-            {
-                auto& map = std::get<0>(current_value)->values;
-                if (map.find(object_key) != map.end())
-                {
-                    error_message = "'" + object_key + "' already exists in map";
-                    return false;
-                }
+	va_list args;
+	va_start(args, fmt);
+	psf::log_vprintf(fmt, args);
+	va_end(args);
+}
+void LogString(const char* name, const char* value)
+{
+	Log("\t%s=%s\n", name, value);
+}
+void LogString(const char* name, const wchar_t* value)
+{
+	Log("\t%s=%ls\n", name, value);
+}
 
-                return std::get<0>(current_value)->values.emplace(std::move(object_key), std::move(value)).second;
-            }   break;
+void LogCountedStringW(const char* name, const wchar_t* value, std::size_t length)
+{
+	Log("\t%s=%.*ls\n", name, length, value);
+}
 
-            case 1:
-                std::get<1>(current_value)->values.emplace_back(std::move(value));
-                break;
-            }
-        }
-        else if (!root)
-        {
-            root = std::move(value);
-        }
-        else
-        {
-            error_message = "Can't have more than one root";
-            return false;
-        }
+static const psf::json_object* g_CurrentExeConfig = nullptr;
 
-        return true;
+struct view_deleter
+{
+    void operator()(void* view) const noexcept
+    {
+        ::UnmapViewOfFile(view);
+    }
+};
+using unique_view = std::unique_ptr<void, view_deleter>;
+
+// config.json gets mapped copy-on-write, so that parsing it in place never touches the file, and so that the strings in
+// the DOM can point into the mapping instead of being copied. Since the DOM is never freed, neither is the mapping.
+// In-place parsing only works when the file is already UTF-8, which the file nearly always is; UTF-16 and UTF-32 files
+// get transcoded through a stream instead, which means copying their strings, same as always
+template <typename Handler>
+static rapidjson::ParseResult parse_transcoded_config_json(const std::filesystem::path& path, Handler& handler)
+{
+#pragma warning(suppress:4996) // Nonsense warning; _wfopen is perfectly safe
+    auto file = _wfopen(path.c_str(), L"rb, ccs=UTF-8");
+    if (!file)
+    {
+        throw std::system_error(errno, std::generic_category(), "config.json could not be opened");
     }
 
-    bool Null()
+    char buffer[2048];
+    rapidjson::FileReadStream stream(file, buffer, std::size(buffer));
+    rapidjson::AutoUTFInputStream<char32_t, rapidjson::FileReadStream> autoStream(stream);
+
+    rapidjson::GenericReader<rapidjson::AutoUTF<char32_t>, rapidjson::UTF8<>> reader;
+    auto result = reader.Parse(autoStream, handler);
+    fclose(file);
+    return result;
+}
+
+// The length of the UTF-8 BOM at the start of 'data', if any, or -1 if 'data' looks like UTF-16 or UTF-32. The checks
+// are those that rapidjson's AutoUTFInputStream makes
+static int utf8_bom_length(const unsigned char* data, std::size_t size) noexcept
+{
+    if ((size >= 3) && (data[0] == 0xEF) && (data[1] == 0xBB) && (data[2] == 0xBF))
     {
-        return on_value(std::make_unique<json_null_impl>());
+        return 3;
     }
 
-    bool Bool(bool b)
+    // Byte order marks for UTF-16 and UTF-32 start with either FE FF, FF FE, or 00 00, and without one, JSON in either
+    // has a zero byte in its first four, since the first character is always ASCII
+    for (std::size_t i = 0; i < (std::min)(size, std::size_t{ 4 }); ++i)
     {
-        return on_value(std::make_unique<json_boolean_impl>(b));
+        if ((data[i] == 0x00) || (data[i] == 0xFE) || (data[i] == 0xFF))
+        {
+            return -1;
+        }
     }
 
-    bool Int(std::int64_t value)
+    return 0;
+}
+
+// A read-only view of a whole file. Null if the file is missing, empty, or can't be mapped for any other reason, since
+// all of the files that get mapped this way are optional
+struct mapped_file
+{
+    unique_view view;
+    std::size_t size = 0;
+
+    const std::uint8_t* data() const noexcept
     {
-        return on_value(std::make_unique<json_number_impl>(value));
+        return static_cast<const std::uint8_t*>(view.get());
     }
+};
 
-    bool Uint(std::uint64_t value)
+static mapped_file map_read_only(const std::filesystem::path& path) noexcept
+{
+    psf::unique_handle file(::CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER fileSize;
+    if (!file || !::GetFileSizeEx(file.get(), &fileSize) || (fileSize.QuadPart == 0) ||
+        (static_cast<std::uint64_t>(fileSize.QuadPart) > (std::numeric_limits<std::size_t>::max)()))
     {
-        return on_value(std::make_unique<json_number_impl>(value));
+        return {};
     }
 
-    bool Int64(std::int64_t value)
+    psf::unique_handle mapping(::CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping)
     {
-        return on_value(std::make_unique<json_number_impl>(value));
+        return {};
     }
 
-    bool Uint64(std::uint64_t value)
+    mapped_file result;
+    result.view.reset(::MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0));
+    result.size = result.view ? static_cast<std::size_t>(fileSize.QuadPart) : 0;
+    return result;
+}
+
+// The config.psfc files that have been loaded (see CompiledConfig.h). DOMs built from them point into their mappings,
+// so they're never unloaded. There's hardly ever more than one; another only gets loaded if config.json and config.psfc
+// both get replaced while the process is running, and PSFReloadDllConfig then gets called
+static std::mutex g_CompiledConfigsMutex;
+static std::deque<compiled_config> g_CompiledConfigs;
+
+// The config.psfc that was compiled from the current contents of config.json, or null if there isn't one, in which case
+// config.json needs parsing. Checking costs a single failed open when the package doesn't have a config.psfc; when it
+// does, config.json gets hashed rather than parsed
+static const compiled_config* find_compiled_config() noexcept try
+{
+    auto compiledPath = g_PackageRootPath / L"config.psfc";
+    if (::GetFileAttributesW(compiledPath.c_str()) == INVALID_FILE_ATTRIBUTES)
     {
-        return on_value(std::make_unique<json_number_impl>(value));
+        return nullptr;
     }
 
-    bool Double(double value)
+    auto source = map_read_only(g_PackageRootPath / L"config.json");
+    if (!source.view)
     {
-        return on_value(std::make_unique<json_number_impl>(value));
+        return nullptr;
     }
 
-    bool RawNumber(const char* /*str*/, rapidjson::SizeType /*length*/, bool /*copy*/)
+    auto sourceHash = compiled_config_hash(source.data(), source.size);
+    source.view.reset();
+
+    std::lock_guard lock(g_CompiledConfigsMutex);
+    for (auto& loaded : g_CompiledConfigs)
     {
-        // Provided only to satisfy compilation, but never called since we never pass kParseNumbersAsStringsFlag
-        // Consider: Update rapidjson to use if constexpr
-        assert(false);
-        return false;
+        if (loaded.source_hash() == sourceHash)
+        {
+            return &loaded;
+        }
     }
 
-    bool String(const char* str, rapidjson::SizeType length, [[maybe_unused]] bool copy)
+    auto file = map_read_only(compiledPath);
+    compiled_config config;
+    if (!file.view || !config.load(file.data(), file.size, sourceHash))
     {
-        // Caller should always own the memory
-        assert(copy);
-        return on_value(std::make_unique<json_string_impl>(std::string_view(str, length)));
+        return nullptr;
     }
 
-    bool StartObject()
+    auto& result = g_CompiledConfigs.emplace_back(config);
+    file.view.release();
+    return &result;
+}
+catch (...)
+{
+    return nullptr;
+}
+
+// Builds 'document' through 'handler', from 'compiled' when there is one, and otherwise from config.json
+template <typename Handler>
+static void parse_config_json(Handler& handler, const json_document& document, const compiled_config* compiled)
+{
+    if (compiled)
     {
-        // NOTE: We must call 'on_value' before appending to 'state_stack', otherwise we'll try and add the object as a
-        //       child of itself
-        auto obj = std::make_unique<json_object_impl>();
-        auto objPtr = obj.get();
-        auto result = on_value(std::move(obj));
-        if (result)
+        if (!compiled->replay(handler))
+        {
+            // config.psfc was compiled from a valid config.json, so this takes a handler that rejects what's in it
+            std::stringstream msgStream;
+            msgStream << "Error occurred when loading config.psfc\n";
+            msgStream << "Error: " << document.error_message();
+            throw std::runtime_error(msgStream.str());
+        }
+        else if (!document.root())
         {
-            state_stack.emplace_back(objPtr);
+            throw std::runtime_error("config.psfc has no contents");
         }
 
-        return result;
+        return;
     }
 
-    bool Key(const char* str, rapidjson::SizeType length, [[maybe_unused]] bool copy)
+    auto path = g_PackageRootPath / L"config.json";
+    psf::unique_handle file(::CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!file)
+    {
+        throw_last_error("config.json could not be opened");
+    }
+
+    LARGE_INTEGER fileSize;
+    check_win32_bool(::GetFileSizeEx(file.get(), &fileSize), "config.json could not be opened");
+    if (fileSize.QuadPart == 0)
+    {
+        // Mapping an empty file fails
+        throw std::runtime_error("config.json has no contents");
+    }
+    else if (static_cast<std::uint64_t>(fileSize.QuadPart) > (std::numeric_limits<std::size_t>::max)())
     {
-        // Caller should always own the memory
-        assert(copy);
-        assert(object_key.empty());
-        object_key.assign(str, length);
-        return true;
+        throw std::runtime_error("config.json is too large");
     }
 
-    bool EndObject([[maybe_unused]] rapidjson::SizeType memberCount)
+    psf::unique_handle mapping(::CreateFileMappingW(file.get(), nullptr, PAGE_WRITECOPY, 0, 0, nullptr));
+    if (!mapping)
     {
-#ifndef NDEBUG
-        assert(!state_stack.empty());
+        throw_last_error("config.json could not be mapped");
+    }
 
-        auto current = state_stack.back();
-        assert(current.index() == 0);
+    unique_view view(::MapViewOfFile(mapping.get(), FILE_MAP_COPY, 0, 0, 0));
+    if (!view)
+    {
+        throw_last_error("config.json could not be mapped");
+    }
 
-        auto ptr = std::get<0>(current);
-        assert(ptr->values.size() == memberCount);
-#endif
+    auto size = static_cast<std::size_t>(fileSize.QuadPart);
+    auto data = static_cast<char*>(view.get());
+    auto bomLength = utf8_bom_length(reinterpret_cast<const unsigned char*>(data), size);
 
-        state_stack.pop_back();
-        return true;
+    rapidjson::ParseResult result;
+    if (bomLength >= 0)
+    {
+        // NOTE: Copying the strings used to validate them as a side effect of transcoding, so ask for that explicitly
+        bounded_insitu_stream stream(data + bomLength, data + size);
+        rapidjson::Reader reader;
+        result = reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseValidateEncodingFlag>(stream, handler);
+    }
+    else
+    {
+        view.reset();
+        result = parse_transcoded_config_json(path, handler);
     }
 
-    bool StartArray()
+    if (result.IsError())
     {
-        // NOTE: We must call 'on_value' before appending to 'state_stack', otherwise we'll try and add the array as a
-        //       child of itself
-        auto arr = std::make_unique<json_array_impl>();
-        auto arrPtr = arr.get();
-        auto result = on_value(std::move(arr));
-        if (result)
+        std::stringstream msgStream;
+        msgStream << "Error occurred when parsing config.json\n";
+        if (document.error_message().empty())
         {
-            state_stack.emplace_back(arrPtr);
+            msgStream << "Error: " << rapidjson::GetParseError_En(result.Code()) << "\n";
         }
-
-        return result;
+        else
+        {
+            msgStream << "Error: " << document.error_message() << "\n";
+        }
+        msgStream << "File Offest: " << result.Offset();
+        throw std::runtime_error(msgStream.str());
     }
-
-    bool EndArray([[maybe_unused]] rapidjson::SizeType elementCount)
+    else if (!document.root())
     {
-#ifndef NDEBUG
-        assert(!state_stack.empty());
-
-        auto current = state_stack.back();
-        assert(current.index() == 1);
+        throw std::runtime_error("config.json has no contents");
+    }
 
-        auto ptr = std::get<1>(current);
-        assert(ptr->values.size() == elementCount);
-#endif
+    // The DOM now points into the mapping
+    view.release();
+}
 
-        state_stack.pop_back();
-        return true;
-    }
+// Only what the current process can use; see current_process_config_handler
+static void parse_current_process_config_json(json_document& document, const compiled_config* compiled)
+{
+    std::wstring currentExe = g_CurrentExecutable.stem().native();
+    current_process_config_handler handler(document, currentExe, compiled);
+    parse_config_json(handler, document, compiled);
+}
 
-    // Root of the tree, filled in by the first object/array/string, etc. encountered
-    std::unique_ptr<psf::json_value> root;
+// The whole of config.json, for the queries that can ask about any part of it. Most processes never make one, so it only
+// gets parsed on first use. The "processes" patterns get compiled at the same time, and lookups by executable name are
+// remembered, since the same few names tend to get asked about over and over (e.g. once per child process). When there's
+// a config.psfc, the patterns come precompiled from there
+struct process_matcher
+{
+    psf::pattern_matcher matcher;
 
-    // Since all we get are callbacks, we don't have the luxury of using stack memory to save state, so use the heap
-    // NOTE: Since we're immediately done processing strings, numbers, booleans, and null, we only need to save state
-    //       for objects and arrays
-    std::vector<std::variant<json_object_impl*, json_array_impl*>> state_stack;
-    std::string object_key;
+    // Null when the entry is unusable (e.g. its "executable" is missing or isn't a valid pattern). Lookups that get as
+    // far as such an entry fail, same as they did when each lookup went through the entries one by one
+    const psf::json_object* config = nullptr;
+};
 
-    // When non-empty, provides a more useful error message displayed to the user for invalid config.json files
-    std::string error_message;
+struct full_config
+{
+    json_document document;
+    std::vector<process_matcher> processes;
+    std::unordered_map<std::wstring, const psf::json_object*> exe_configs;
+};
 
-    bool enableReportError{ true };
-} g_JsonHandler;
+static std::mutex g_FullConfigMutex;
+static std::unique_ptr<full_config> g_FullConfig;
 
-void Log(const char* fmt, ...)
+// NOTE: Requires g_FullConfigMutex to be held
+static full_config& load_full_config()
 {
-	std::string str;
-	str.resize(256);
+    if (!g_FullConfig)
+    {
+        auto compiled = g_InheritedConfig ? g_InheritedConfig : find_compiled_config();
+        auto config = std::make_unique<full_config>();
+        parse_config_json(config->document, config->document, compiled);
 
-	va_list args;
-	va_start(args, fmt);
-	std::size_t count = std::vsnprintf(str.data(), str.size() + 1, fmt, args);
-	assert(count >= 0);
-	va_end(args);
+        try
+        {
+            if (auto processes = config->document.root()->as_object().try_get("processes"))
+            {
+                for (auto& processConfig : processes->as_array())
+                {
+                    auto& obj = processConfig.as_object();
+                    auto exe = obj.get("executable").as_string().wstring();
+
+                    psf::pattern_matcher matcher;
+                    if (!compiled || !compiled->load_process_pattern(config->processes.size(), matcher))
+                    {
+                        matcher.assign(exe);
+                    }
+                    config->processes.push_back(process_matcher{ std::move(matcher), &obj });
+                }
+            }
+        }
+        catch (...)
+        {
+            // Any entries after this one can never be reached
+            config->processes.push_back(process_matcher{});
+        }
 
-	if (count > str.size())
-	{
-		str.resize(count);
+        g_FullConfig = std::move(config);
+    }
 
-		va_list args2;
-		va_start(args2, fmt);
-		count = std::vsnprintf(str.data(), str.size() + 1, fmt, args2);
-		assert(count >= 0);
-		va_end(args2);
-	}
+    return *g_FullConfig;
+}
 
-	str.resize(count);
-	::OutputDebugStringA(str.c_str());
+static const psf::json_value* full_config_root()
+{
+    std::lock_guard lock(g_FullConfigMutex);
+    return load_full_config().document.root();
 }
-void LogString(const char* name, const char* value)
+
+static const psf::json_object* find_current_exe_config(const psf::json_value& root, bool log)
 {
-	Log("\t%s=%s\n", name, value);
+    auto currentExe = g_CurrentExecutable.stem();
+    if (auto processes = root.as_object().try_get("processes"))
+    {
+        for (auto& processConfig : processes->as_array())
+        {
+            auto& obj = processConfig.as_object();
+			auto exe = obj.get("executable").as_string().wstring();  
+            if (psf::pattern_matcher(exe).match(currentExe.native()))
+            {
+                if (log)
+                {
+		    LogCountedStringW("Processes config match", exe.data(), exe.length());
+                }
+                return &obj;
+            }
+            else if (log)
+            {
+                LogCountedStringW("Processes config notmatched", exe.data(), exe.length());
+            }
+        }
+    }
+
+    return nullptr;
 }
-void LogString(const char* name, const wchar_t* value)
+
+// Lookups used to go through "applications" in order, failing on the first entry that isn't an object with a string
+// "id", and the first of any duplicate ids won. The index keeps all of that by stopping at the first bad entry, and by
+// never replacing an id that's already there
+static void index_applications(const psf::json_value& root)
 {
-	Log("\t%s=%ls\n", name, value);
+    try
+    {
+        for (auto& app : root.as_object().get("applications").as_array())
+        {
+            auto& appObj = app.as_object();
+            auto appId = appObj.get("id").as_string().wstring();
+            g_Applications.emplace(iwstring_view(appId.data(), appId.length()), &appObj);
+        }
+    }
+    catch (...)
+    {
+    }
 }
 
-void LogCountedStringW(const char* name, const wchar_t* value, std::size_t length)
+void load_json()
 {
-	Log("\t%s=%.*ls\n", name, length, value);
+    g_CompiledConfig = g_InheritedConfig ? g_InheritedConfig : find_compiled_config();
+    parse_current_process_config_json(g_Config, g_CompiledConfig);
+
+    // Cache a pointer to the current executable's config, as we are most likely to reference that later
+    g_CurrentExeConfig = find_current_exe_config(*g_Config.root(), true);
+    index_applications(*g_Config.root());
+
+    // Permit ReportError disabling iff basic config.json parse succeeded
+    auto enableReportError = g_Config.root()->as_object().try_get("enableReportError");
+    if (enableReportError)
+    {
+        g_EnableReportError = enableReportError->as_boolean().get();
+    }
+
+    if (auto liveCounters = g_Config.root()->as_object().try_get("liveCounters"))
+    {
+        g_LiveCountersEnabled = liveCounters->as_boolean().get();
+    }
 }
 
-static const psf::json_object* g_CurrentExeConfig = nullptr;
+// When CreateProcessFixup injects the PsfRuntime into a child process, it also hands the child a Detours payload with
+// the package identity strings and the config, compiled (see CompiledConfig.h), so that the child doesn't have to query
+// the former or read config.json at all. Only children in the same package get one, so their identity is the parent's.
+// The config is the parent's config.psfc when it has one, and is otherwise compiled from the parent's DOM the first
+// time that a child gets created. NOTE: This means that children see config.json as it was when their parent loaded it
+// (or when the first child was created), which only makes a difference if config.json gets edited in place
+// {3A1D3F8E-6C57-4B0B-9E2A-8F4C5D7B9A10}
+constexpr GUID config_payload_id = { 0x3a1d3f8e, 0x6c57, 0x4b0b, { 0x9e, 0x2a, 0x8f, 0x4c, 0x5d, 0x7b, 0x9a, 0x10 } };
+
+// Followed by the strings, in this order and without null terminators, and then by the config. Sizes are fixed so that
+// the layout doesn't depend on the parent's architecture
+struct config_payload_header
+{
+    std::uint32_t package_full_name_length;
+    std::uint32_t application_user_model_id_length;
+    std::uint32_t application_id_length;
+    std::uint32_t package_root_path_length;
+    std::uint64_t config_source_hash;
+    std::uint64_t config_size;
+};
+
+static std::mutex g_ConfigPayloadMutex;
+static std::vector<std::uint8_t> g_ConfigPayload;
+
+static std::vector<std::uint8_t> make_config_payload()
+{
+    std::vector<std::uint8_t> compiled;
+    const std::uint8_t* config;
+    config_payload_header header = {};
+    if (g_CompiledConfig)
+    {
+        config = g_CompiledConfig->data();
+        header.config_size = g_CompiledConfig->size();
+        header.config_source_hash = g_CompiledConfig->source_hash();
+    }
+    else
+    {
+        // The child hands the payload's hash straight back to compiled_config::load, so there's nothing to hash here
+        compiled = compiled_config_writer().write(*full_config_root(), 0, {});
+        config = compiled.data();
+        header.config_size = compiled.size();
+    }
 
-void load_json()
+    const std::wstring* strings[] = { &g_PackageFullName, &g_ApplicationUserModelId, &g_ApplicationId, &g_PackageRootPath.native() };
+    header.package_full_name_length = static_cast<std::uint32_t>(g_PackageFullName.length());
+    header.application_user_model_id_length = static_cast<std::uint32_t>(g_ApplicationUserModelId.length());
+    header.application_id_length = static_cast<std::uint32_t>(g_ApplicationId.length());
+    header.package_root_path_length = static_cast<std::uint32_t>(g_PackageRootPath.native().length());
+
+    std::vector<std::uint8_t> result;
+    auto append = [&](const void* data, std::size_t size)
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        result.insert(result.end(), bytes, bytes + size);
+    };
+    append(&header, sizeof(header));
+    for (auto str : strings)
+    {
+        append(str->data(), str->length() * sizeof(wchar_t));
+    }
+    append(config, static_cast<std::size_t>(header.config_size));
+
+    if (result.size() > (std::numeric_limits<DWORD>::max)())
+    {
+        throw std::runtime_error("config is too large to share with child processes");
+    }
+
+    return result;
+}
+
+void ShareConfigWithChildProcess(HANDLE process) noexcept try
 {
-#pragma warning(suppress:4996) // Nonsense warning; _wfopen is perfectly safe
-    auto file = _wfopen((g_PackageRootPath / L"config.json").c_str(), L"rb, ccs=UTF-8");
-    if (!file)
+    std::lock_guard lock(g_ConfigPayloadMutex);
+    if (g_ConfigPayload.empty())
     {
-        throw std::system_error(errno, std::generic_category(), "config.json could not be opened");
+        g_ConfigPayload = make_config_payload();
     }
 
-    char buffer[2048];
-    rapidjson::FileReadStream stream(file, buffer, std::size(buffer));
-    rapidjson::AutoUTFInputStream<char32_t, rapidjson::FileReadStream> autoStream(stream);
+    if (!::DetourCopyPayloadToProcess(process, config_payload_id, g_ConfigPayload.data(), static_cast<DWORD>(g_ConfigPayload.size())))
+    {
+        Log("\tUnable to share config with child process err=0x%x\n", ::GetLastError());
+    }
+}
+catch (...)
+{
+    // The child will just read config.json itself
+}
 
-    rapidjson::GenericReader<rapidjson::AutoUTF<char32_t>, rapidjson::UTF8<>> reader;
-    auto result = reader.Parse(autoStream, g_JsonHandler);
-    fclose(file);
+// Returns false, leaving everything to be loaded from scratch, if there's no payload or it isn't valid. Payloads are
+// never freed, so the DOM can point into it, same as with a mapped config.psfc
+static bool load_inherited_config() noexcept try
+{
+    DWORD payloadSize = 0;
+    auto payload = static_cast<const std::uint8_t*>(::DetourFindPayloadEx(config_payload_id, &payloadSize));
+    config_payload_header header;
+    if (!payload || (payloadSize < sizeof(header)))
+    {
+        return false;
+    }
 
-    if (result.IsError())
+    std::memcpy(&header, payload, sizeof(header));
+    auto remaining = static_cast<std::uint64_t>(payloadSize - sizeof(header));
+    auto stringsSize = (static_cast<std::uint64_t>(header.package_full_name_length) + header.application_user_model_id_length +
+        header.application_id_length + header.package_root_path_length) * sizeof(wchar_t);
+    if ((stringsSize > remaining) || (header.config_size != remaining - stringsSize))
     {
-        std::stringstream msgStream;
-        msgStream << "Error occurred when parsing config.json\n";
-        if (g_JsonHandler.error_message.empty())
-        {
-            msgStream << "Error: " << rapidjson::GetParseError_En(result.Code()) << "\n";
-        }
-        else
-        {
-            msgStream << "Error: " << g_JsonHandler.error_message << "\n";
-        }
-        msgStream << "File Offest: " << result.Offset();
-        throw std::runtime_error(msgStream.str());
+        return false;
     }
-    else if (!g_JsonHandler.root)
+
+    auto next = payload + sizeof(header);
+    auto readString = [&](std::uint32_t length)
     {
-        throw std::runtime_error("config.json has no contents");
+        std::wstring result(length, L'\0');
+        std::memcpy(result.data(), next, length * sizeof(wchar_t));
+        next += length * sizeof(wchar_t);
+        return result;
+    };
+    auto packageFullName = readString(header.package_full_name_length);
+    auto applicationUserModelId = readString(header.application_user_model_id_length);
+    auto applicationId = readString(header.application_id_length);
+    auto packageRootPath = readString(header.package_root_path_length);
+
+    compiled_config config;
+    if (!config.load(next, static_cast<std::size_t>(header.config_size), header.config_source_hash))
+    {
+        return false;
     }
 
-    assert(g_JsonHandler.state_stack.empty());
+    {
+        std::lock_guard lock(g_CompiledConfigsMutex);
+        g_InheritedConfig = &g_CompiledConfigs.emplace_back(config);
+    }
 
-    // Cache a pointer to the current executable's config, as we are most likely to reference that later
-    auto currentExe = g_CurrentExecutable.stem();
-    if (auto processes = g_JsonHandler.root->as_object().try_get("processes"))
+    g_PackageFullName = std::move(packageFullName);
+    g_ApplicationUserModelId = std::move(applicationUserModelId);
+    g_ApplicationId = std::move(applicationId);
+    g_PackageRootPath = std::move(packageRootPath);
+    return true;
+}
+catch (...)
+{
+    return false;
+}
+
+// Reduces 'path' to the part of it that PSFIsPackagePath compares, i.e. "C:\foo" for "C:\foo", "\\?\C:\foo", "\\.\C:\foo",
+// and "\??\C:\foo", or "server\share\foo" (with 'unc' set) for "\\server\share\foo" and "\\?\UNC\server\share\foo"
+static std::wstring_view package_path_root(std::wstring_view path, bool& unc) noexcept
+{
+    unc = false;
+    if ((path.length() >= 4) && psf::is_path_separator(path[0]) && psf::is_path_separator(path[3]) &&
+        ((psf::is_path_separator(path[1]) && ((path[2] == L'?') || (path[2] == L'.'))) || ((path[1] == L'?') && (path[2] == L'?'))))
     {
-        for (auto& processConfig : processes->as_array())
+        path.remove_prefix(4);
+        if ((path.length() >= 4) && psf::path_equal(path.data(), L"UNC\\", 4))
         {
-            auto& obj = processConfig.as_object();
-			auto exe = obj.get("executable").as_string().wstring();  
-            if (!g_CurrentExeConfig && std::regex_match(currentExe.native(), std::wregex(exe.data(), exe.length())))
-            {
-                g_CurrentExeConfig = &obj; 
-		LogCountedStringW("Processes config match", exe.data(), exe.length());
-                break;
-            }
-            else if (!g_CurrentExeConfig)
-            {
-                LogCountedStringW("Processes config notmatched", exe.data(), exe.length());
-            }
+            path.remove_prefix(4);
+            unc = true;
         }
     }
-
-    // Permit ReportError disabling iff basic config.json parse succeeded
-    auto enableReportError = g_JsonHandler.root->as_object().try_get("enableReportError");
-    if (enableReportError)
+    else if ((path.length() >= 2) && psf::is_path_separator(path[0]) && psf::is_path_separator(path[1]))
     {
-        g_JsonHandler.enableReportError = enableReportError->as_boolean().get();
+        path.remove_prefix(2);
+        unc = true;
     }
+
+    return path;
 }
 
 void LoadConfig()
 {
     if (psf::is_packaged())
     {
-        g_PackageFullName = psf::current_package_full_name();
-        g_ApplicationUserModelId = psf::current_application_user_model_id();
-        g_ApplicationId = psf::application_id_from_application_user_model_id(g_ApplicationUserModelId);
-        g_PackageRootPath = psf::current_package_path();
+        if (!load_inherited_config())
+        {
+            g_PackageFullName = psf::current_package_full_name();
+            g_ApplicationUserModelId = psf::current_application_user_model_id();
+            g_ApplicationId = psf::application_id_from_application_user_model_id(g_ApplicationUserModelId);
+            g_PackageRootPath = psf::current_package_path();
+        }
         g_CurrentExecutable = psf::current_executable_path();
 
         LogCountedStringW("g_PackageFullName", g_PackageFullName.data(), g_PackageFullName.length());
@@ -344,6 +684,13 @@ void LoadConfig()
         std::terminate();
     }
 
+    auto packageRoot = package_path_root(g_PackageRootPath.native(), g_PackageRootIsUnc);
+    while (!packageRoot.empty() && psf::is_path_separator(packageRoot.back()))
+    {
+        packageRoot.remove_suffix(1);
+    }
+    g_PackageRootPrefix = packageRoot;
+
     load_json();
 }
 
@@ -367,17 +714,24 @@ const std::filesystem::path& PackageRootPath() noexcept
     return g_PackageRootPath;
 }
 
-// API definitions
-PSFAPI DWORD __stdcall PSFRegister(_Inout_ void** implFn, _In_ void* fixupFn) noexcept
+bool LiveCountersEnabled() noexcept
 {
-    return ::DetourAttach(implFn, fixupFn);
+    return g_LiveCountersEnabled;
 }
 
-PSFAPI DWORD __stdcall PSFUnregister(_Inout_ void** implFn, _In_ void* fixupFn) noexcept
+bool FixupDllNeedsArchitectureSuffix(std::string_view dll) noexcept
 {
-    return ::DetourDetach(implFn, fixupFn);
+    if (!g_CompiledConfig)
+    {
+        return false;
+    }
+
+    auto flags = g_CompiledConfig->dll_flags(dll);
+    auto suffixFlag = (sizeof(void*) == 4) ? compiled_dll_32 : compiled_dll_64;
+    return !(flags & compiled_dll_as_given) && (flags & suffixFlag);
 }
 
+// API definitions
 PSFAPI const wchar_t* __stdcall PSFQueryPackageFullName() noexcept
 {
     return g_PackageFullName.c_str();
@@ -398,26 +752,122 @@ PSFAPI const wchar_t* __stdcall PSFQueryPackageRootPath() noexcept
     return g_PackageRootPath.c_str();
 }
 
-PSFAPI const psf::json_value* __stdcall PSFQueryConfigRoot() noexcept
+PSFAPI BOOL __stdcall PSFIsPackagePath(_In_reads_(length) const wchar_t* path, std::size_t length) noexcept
 {
-    return g_JsonHandler.root.get();
+    bool unc;
+    auto root = package_path_root(std::wstring_view(path, length), unc);
+    auto& prefix = g_PackageRootPrefix;
+    return (unc == g_PackageRootIsUnc) &&
+        (root.length() >= prefix.length()) &&
+        psf::path_equal(root.data(), prefix.data(), prefix.length()) &&
+        ((root.length() == prefix.length()) || psf::is_path_separator(root[prefix.length()]));
 }
 
-PSFAPI const psf::json_object* __stdcall PSFQueryAppLaunchConfig(_In_ const wchar_t* applicationId, bool verbose) noexcept try
+// Known folder paths are cached for the lifetime of the process so that they only get resolved once, no matter how many
+// fixups ask for them. Resolving them requires shell32, which is expensive to load and which many processes never need
+// otherwise, so we only load it on the first query. Entries are never removed and std::deque doesn't move its elements,
+// so the returned strings remain valid. Failures are cached too; e.g. the x64 folders never resolve in 32-bit processes
+struct known_folder_entry
 {
-    for (auto& app : g_JsonHandler.root->as_object().get("applications").as_array())
+    GUID id;
+    std::wstring path; // Empty if the folder failed to resolve
+};
+
+static std::mutex g_KnownFoldersMutex;
+static std::deque<known_folder_entry> g_KnownFolders;
+
+// NOTE: CoTaskMemFree comes from combase, which shell32 loads anyway, so that the PsfRuntime itself doesn't import COM
+struct known_folder_functions
+{
+    HRESULT(__stdcall* get_known_folder_path)(REFKNOWNFOLDERID, DWORD, HANDLE, PWSTR*) = nullptr;
+    void(__stdcall* co_task_mem_free)(void*) = nullptr;
+};
+
+static std::wstring resolve_known_folder(const GUID& id)
+{
+    static const auto functions = []
     {
-        auto& appObj = app.as_object();
-        auto appId = appObj.get("id").as_string().wstring();
-	if (verbose)
-	{
-            LogCountedStringW("Compare against json id", appId.data(), appId.length());
+        known_folder_functions result;
+        auto shell32 = ::LoadLibraryExW(L"shell32.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+        auto combase = ::LoadLibraryExW(L"combase.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+        if (shell32 && combase)
+        {
+            result.get_known_folder_path = reinterpret_cast<decltype(result.get_known_folder_path)>(::GetProcAddress(shell32, "SHGetKnownFolderPath"));
+            result.co_task_mem_free = reinterpret_cast<decltype(result.co_task_mem_free)>(::GetProcAddress(combase, "CoTaskMemFree"));
         }
-	if (iwstring_view(appId.data(), appId.length()) == applicationId)
+        return result;
+    }();
+
+    PWSTR path;
+    if (!functions.get_known_folder_path || !functions.co_task_mem_free ||
+        FAILED(functions.get_known_folder_path(id, KF_FLAG_DEFAULT, nullptr, &path)))
+    {
+        return {};
+    }
+
+    // Same normalization as psf::known_folder: drive-absolute, upper case drive letter, and no trailing separator
+    std::wstring result = path;
+    functions.co_task_mem_free(path);
+    if (auto pathType = psf::path_type(result.c_str());
+        (pathType == psf::dos_path_type::root_local_device) || (pathType == psf::dos_path_type::local_device))
+    {
+        result.erase(0, 4);
+    }
+
+    if (!result.empty())
+    {
+        result[0] = std::towupper(result[0]);
+    }
+
+    while (!result.empty() && psf::is_path_separator(result.back()))
+    {
+        result.pop_back();
+    }
+
+    return result;
+}
+
+PSFAPI const wchar_t* __stdcall PSFQueryKnownFolderPath(_In_ const GUID& id) noexcept try
+{
+    std::lock_guard lock(g_KnownFoldersMutex);
+    auto itr = std::find_if(g_KnownFolders.begin(), g_KnownFolders.end(), [&](const known_folder_entry& entry)
+    {
+        return entry.id == id;
+    });
+
+    if (itr == g_KnownFolders.end())
+    {
+        auto path = resolve_known_folder(id);
+        itr = g_KnownFolders.insert(g_KnownFolders.end(), known_folder_entry{ id, std::move(path) });
+    }
+
+    return itr->path.empty() ? nullptr : itr->path.c_str();
+}
+catch (...)
+{
+    return nullptr;
+}
+
+PSFAPI const psf::json_value* __stdcall PSFQueryConfigRoot() noexcept try
+{
+    return full_config_root();
+}
+catch (...)
+{
+    return nullptr;
+}
+
+PSFAPI const psf::json_object* __stdcall PSFQueryAppLaunchConfig(_In_ const wchar_t* applicationId, bool verbose) noexcept try
+{
+    if (auto itr = g_Applications.find(applicationId); itr != g_Applications.end())
+    {
+        if (verbose)
         {
-            return &appObj;
+            LogCountedStringW("Matched json id", itr->first.data(), itr->first.length());
         }
+        return itr->second;
     }
+
     if (verbose)
     {
         Log("\tNo Matches");
@@ -464,21 +914,31 @@ static inline constexpr iwstring_view remove_suffix_if(iwstring_view str, iwstri
 PSFAPI const psf::json_object* __stdcall PSFQueryExeConfig(const wchar_t* executable) noexcept try
 {
     const auto exeName = remove_suffix_if(executable, L".exe"_isv);
-    if (auto processes = g_JsonHandler.root->as_object().try_get("processes"))
+    const std::wstring_view exeNameView(exeName.data(), exeName.length());
+
+    std::lock_guard lock(g_FullConfigMutex);
+    auto& config = load_full_config();
+    if (auto itr = config.exe_configs.find(std::wstring(exeNameView)); itr != config.exe_configs.end())
     {
-        for (auto& processConfig : processes->as_array())
-        {
-            auto& obj = processConfig.as_object();
-            auto exe = obj.get("executable").as_string().wstring();
+        return itr->second;
+    }
 
-            if (std::regex_match(exeName.begin(), exeName.end(), std::wregex(exe.data(), exe.length())))
-            {
-                return &obj;
-            }
+    const psf::json_object* result = nullptr;
+    for (auto& entry : config.processes)
+    {
+        if (!entry.config)
+        {
+            break;
+        }
+        else if (entry.matcher.match(exeNameView))
+        {
+            result = entry.config;
+            break;
         }
     }
 
-    return nullptr;
+    config.exe_configs.emplace(exeNameView, result);
+    return result;
 }
 catch (...)
 {
@@ -531,8 +991,48 @@ catch (...)
     return nullptr;
 }
 
+// The configurations of the fixups that load_fixups loaded, resolved once as each one gets loaded, so that fixups that
+// query their configuration don't walk the "fixups" array (and compare each of its names) every time. These only get
+// added to before any fixup gets initialized, so reading them doesn't need a lock
+struct fixup_config
+{
+    std::wstring name; // Without the ".dll" and architecture suffixes
+    const psf::json_value* config;
+};
+static std::vector<fixup_config> g_FixupConfigs;
+static std::unordered_map<HMODULE, const psf::json_value*> g_ModuleConfigs;
+
+std::wstring FixupName(const wchar_t* dll)
+{
+    auto name = remove_suffix_if(remove_suffix_if(dll, L".dll"_isv), psf::warch_string);
+    return std::wstring(name.data(), name.length());
+}
+
+void RegisterFixupConfig(HMODULE module, const wchar_t* dll, const psf::json_value* config)
+{
+    // NOTE: Same as find_config, the first entry for any given dll is the one that counts
+    auto name = remove_suffix_if(remove_suffix_if(dll, L".dll"_isv), psf::warch_string);
+    if (module)
+    {
+        g_ModuleConfigs.emplace(module, config);
+    }
+    if (std::none_of(g_FixupConfigs.begin(), g_FixupConfigs.end(), [&](auto& entry) { return iwstring_view(entry.name.data(), entry.name.length()) == name; }))
+    {
+        g_FixupConfigs.push_back(fixup_config{ std::wstring(name.data(), name.length()), config });
+    }
+}
+
 PSFAPI const psf::json_value* __stdcall PSFQueryDllConfig(const wchar_t* dll) noexcept try
 {
+    auto targetDll = remove_suffix_if(remove_suffix_if(dll, L".dll"_isv), psf::warch_string);
+    for (auto& entry : g_FixupConfigs)
+    {
+        if (targetDll == iwstring_view(entry.name.data(), entry.name.length()))
+        {
+            return entry.config;
+        }
+    }
+
     return find_config(g_CurrentExeConfig, dll);
 }
 catch (...)
@@ -540,9 +1040,37 @@ catch (...)
     return nullptr;
 }
 
+PSFAPI const psf::json_value* __stdcall PSFQueryModuleConfig(HMODULE module) noexcept try
+{
+    if (auto itr = g_ModuleConfigs.find(module); itr != g_ModuleConfigs.end())
+    {
+        return itr->second;
+    }
+
+    // E.g. a fixup that queries its configuration from its DllMain, before load_fixups gets to register it
+    return PSFQueryDllConfig(psf::get_module_path(module).filename().c_str());
+}
+catch (...)
+{
+    return nullptr;
+}
+
+// Documents parsed by PSFReloadDllConfig. Fixups hold onto pointers into these for as long as they please, so - like
+// every json_document - their memory is never freed. Reloads are rare enough that this doesn't add up to much
+PSFAPI const psf::json_value* __stdcall PSFReloadDllConfig(const wchar_t* dll) noexcept try
+{
+    json_document document;
+    parse_current_process_config_json(document, find_compiled_config());
+    return find_config(find_current_exe_config(*document.root(), false), dll);
+}
+catch (...)
+{
+    return nullptr;
+}
+
 PSFAPI void __stdcall PSFReportError(const wchar_t* error) noexcept
 {
-    if (!g_JsonHandler.enableReportError)
+    if (!g_EnableReportError)
     {
         return;
     }
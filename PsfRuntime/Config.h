@@ -6,11 +6,34 @@
 
 #include <filesystem>
 #include <string>
+#include <string_view>
+
+#include <windows.h>
+#include <psf_config.h>
 
 void LoadConfig();
 
+// Hands the current config down to a (suspended) child process in the package, so that its LoadConfig can skip reading
+// config.json. Best effort: if this fails, the child just loads config.json itself
+void ShareConfigWithChildProcess(HANDLE process) noexcept;
+
 // Globals set by `LoadConfig`, to avoid continuously querying them
 const std::wstring& PackageFullName() noexcept;
 const std::wstring& ApplicationUserModelId() noexcept;
 const std::wstring& ApplicationId() noexcept;
 const std::filesystem::path& PackageRootPath() noexcept;
+
+// Whether config.json asks for live counters to be published (see LiveCounters.cpp)
+bool LiveCountersEnabled() noexcept;
+
+// True when config.psfc says that the fixup dll 'dll' (as config.json names it) only exists with the current
+// architecture's suffix, e.g. as FooFixup64.dll rather than as FooFixup.dll, so that loading it as named can be skipped
+bool FixupDllNeedsArchitectureSuffix(std::string_view dll) noexcept;
+
+// The name that a fixup dll (as config.json names it) goes by, i.e. without its ".dll" and architecture suffixes
+std::wstring FixupName(const wchar_t* dll);
+
+// Pairs a fixup dll that load_fixups loaded (as config.json names it) with its configuration, which is what
+// PSFQueryDllConfig and PSFQueryModuleConfig then answer with for it. Must be called before any fixup gets initialized.
+// Fixups that came from a bundle pass a null 'module', since the bundle's module is shared by all of them
+void RegisterFixupConfig(HMODULE module, const wchar_t* dll, const psf::json_value* config);
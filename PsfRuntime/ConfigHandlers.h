@@ -0,0 +1,312 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The handler and the stream that Config.cpp parses config.json with. They live here, rather than in Config.cpp, so that
+// tests/benchmarks/ConfigLoadBenchmark can measure the same code that the PsfRuntime runs
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <pattern_matcher.h>
+#include <rapidjson/reader.h>
+#include <utilities.h>
+
+#include "CompiledConfig.h"
+#include "JsonConfig.h"
+
+// Sits between rapidjson and a json_document so that the document only gets built from what the current process can
+// use: the top-level values that the PsfRuntime reads itself, and of the "processes" array, only the first entry whose
+// "executable" matches. Everything else gets skipped over without being built, or allocated, at all. Since members can
+// come in any order, a "processes" entry gets built until its "executable" turns out not to match - usually right away,
+// since it's nearly always the first member - and is then thrown away. Entries without a (string) "executable" are kept
+// so that, same as with the full document, using them fails. When the events come from config.psfc, the entries'
+// patterns come precompiled from there too
+class current_process_config_handler
+{
+public:
+
+    current_process_config_handler(
+        json_document& document,
+        const std::wstring& currentExe,
+        const compiled_config* compiled) noexcept :
+        m_document(document),
+        m_currentExe(currentExe),
+        m_compiled(compiled)
+    {
+    }
+
+    bool Null()
+    {
+        return on_scalar([&] { return m_document.Null(); });
+    }
+
+    bool Bool(bool b)
+    {
+        return on_scalar([&] { return m_document.Bool(b); });
+    }
+
+    bool Int(std::int64_t value)
+    {
+        return on_scalar([&] { return m_document.Int(value); });
+    }
+
+    bool Uint(std::uint64_t value)
+    {
+        return on_scalar([&] { return m_document.Uint(value); });
+    }
+
+    bool Int64(std::int64_t value)
+    {
+        return on_scalar([&] { return m_document.Int64(value); });
+    }
+
+    bool Uint64(std::uint64_t value)
+    {
+        return on_scalar([&] { return m_document.Uint64(value); });
+    }
+
+    bool Double(double value)
+    {
+        return on_scalar([&] { return m_document.Double(value); });
+    }
+
+    bool RawNumber(const char* str, rapidjson::SizeType length, bool copy)
+    {
+        return on_scalar([&] { return m_document.RawNumber(str, length, copy); });
+    }
+
+    bool String(const char* str, rapidjson::SizeType length, bool copy)
+    {
+        auto isExecutable = m_nextIsExecutable;
+        return on_scalar([&]
+        {
+            if (isExecutable)
+            {
+                psf::pattern_matcher matcher;
+                if (!m_compiled || !m_compiled->load_process_pattern(m_process, matcher))
+                {
+                    matcher.assign(widen(std::string_view(str, length)));
+                }
+
+                if (matcher.match(m_currentExe))
+                {
+                    m_matched = true;
+                }
+                else
+                {
+                    m_rejectedProcess = true;
+                }
+            }
+
+            return m_document.String(str, length, copy);
+        });
+    }
+
+    bool StartObject()
+    {
+        return on_start([&] { return m_document.StartObject(); });
+    }
+
+    bool Key(const char* str, rapidjson::SizeType length, bool copy)
+    {
+        if (m_skippedDepth > 0)
+        {
+            return true;
+        }
+
+        std::string_view key(str, length);
+        if (m_depth == 1)
+        {
+            if ((key != "processes") && (key != "applications") && (key != "enableReportError") &&
+                (key != "liveCounters"))
+            {
+                m_skipNextValue = true;
+                return true;
+            }
+
+            m_inProcessesKey = (key == "processes");
+        }
+        else if (m_inProcess && (m_depth == 3))
+        {
+            if (m_rejectedProcess)
+            {
+                m_skipNextValue = true;
+                return true;
+            }
+
+            m_nextIsExecutable = (key == "executable");
+        }
+
+        return m_document.Key(str, length, copy);
+    }
+
+    bool EndObject(rapidjson::SizeType memberCount)
+    {
+        if (m_skippedDepth > 0)
+        {
+            --m_skippedDepth;
+            return true;
+        }
+
+        --m_depth;
+        if (m_inProcess && (m_depth == 2))
+        {
+            m_inProcess = false;
+            if (m_rejectedProcess)
+            {
+                m_document.discard_container();
+                return true;
+            }
+        }
+
+        // Members may have been skipped, so the count that rapidjson gives doesn't necessarily match
+        return m_document.EndObject(m_document.open_container_size());
+    }
+
+    bool StartArray()
+    {
+        return on_start([&] { return m_document.StartArray(); });
+    }
+
+    bool EndArray(rapidjson::SizeType elementCount)
+    {
+        if (m_skippedDepth > 0)
+        {
+            --m_skippedDepth;
+            return true;
+        }
+
+        --m_depth;
+        return m_document.EndArray(m_document.open_container_size());
+    }
+
+private:
+
+    template <typename Forward>
+    bool on_scalar(Forward&& forward)
+    {
+        m_nextIsExecutable = false;
+        if ((m_skippedDepth > 0) || std::exchange(m_skipNextValue, false))
+        {
+            return true;
+        }
+        else if (m_inProcessesKey && (m_depth == 2))
+        {
+            ++m_processCount;
+        }
+
+        return forward();
+    }
+
+    template <typename Forward>
+    bool on_start(Forward&& forward)
+    {
+        m_nextIsExecutable = false;
+        if (m_skippedDepth > 0)
+        {
+            ++m_skippedDepth;
+            return true;
+        }
+        else if (std::exchange(m_skipNextValue, false))
+        {
+            m_skippedDepth = 1;
+            return true;
+        }
+
+        // The root is at depth 1, "processes" at 2, and its entries at 3
+        if (m_inProcessesKey && (m_depth == 2))
+        {
+            if (m_matched)
+            {
+                m_skippedDepth = 1;
+                return true;
+            }
+
+            m_inProcess = true;
+            m_rejectedProcess = false;
+            m_process = m_processCount++;
+        }
+
+        ++m_depth;
+        return forward();
+    }
+
+    json_document& m_document;
+    const std::wstring& m_currentExe;
+    const compiled_config* m_compiled;
+
+    unsigned m_depth = 0;
+    unsigned m_skippedDepth = 0; // Non-zero while inside of a container that is being skipped
+    bool m_skipNextValue = false;
+
+    bool m_inProcessesKey = false; // The current top-level value is "processes"
+    bool m_inProcess = false; // Inside of an entry of "processes"
+    bool m_nextIsExecutable = false; // The next value is the current entry of "processes"'s "executable"
+    bool m_rejectedProcess = false; // The current entry of "processes" is for some other executable
+    bool m_matched = false; // An entry of "processes" has already matched
+    std::size_t m_process = 0; // The index of the current entry of "processes"
+    std::size_t m_processCount = 0; // How many entries of "processes" have been seen so far
+};
+
+// rapidjson's InsituStringStream, but bounded by the end of the buffer instead of by a null terminator, which a mapped
+// file doesn't have
+struct bounded_insitu_stream
+{
+    using Ch = char;
+
+    bounded_insitu_stream(Ch* begin, Ch* end) noexcept :
+        head(begin),
+        src(begin),
+        end(end)
+    {
+    }
+
+    // Read
+    Ch Peek() const noexcept
+    {
+        return (src != end) ? *src : '\0';
+    }
+
+    Ch Take() noexcept
+    {
+        return (src != end) ? *src++ : '\0';
+    }
+
+    std::size_t Tell() const noexcept
+    {
+        return static_cast<std::size_t>(src - head);
+    }
+
+    // Write
+    void Put(Ch c) noexcept
+    {
+        assert(dst && (dst < src));
+        *dst++ = c;
+    }
+
+    Ch* PutBegin() noexcept
+    {
+        return dst = src;
+    }
+
+    std::size_t PutEnd(Ch* begin) noexcept
+    {
+        return static_cast<std::size_t>(dst - begin);
+    }
+
+    void Flush() noexcept
+    {
+    }
+
+    Ch* head;
+    Ch* src;
+    Ch* end;
+    Ch* dst = nullptr;
+};
@@ -15,19 +15,25 @@
 //       does not make it easy to accomplish that at this time.
 //
 
+#include <mutex>
+#include <optional>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <windows.h>
 #include <detours.h>
 #include <psf_constants.h>
 #include <psf_framework.h>
+#include <psf_logging.h>
+#include <pre_injection.h>
 
 #include "Config.h"
 
 using namespace std::literals;
 
-void Log(const char* fmt, ...);
+void ShareSectionsWithChildProcess(HANDLE process) noexcept;
+bool InjectViaInjectionBroker(DWORD processId, PDETOUR_CREATE_PROCESS_ROUTINEW createProcess) noexcept;
 
 auto CreateProcessImpl = psf::detoured_string_function(&::CreateProcessA, &::CreateProcessW);
 
@@ -68,6 +74,156 @@ catch (...)
     return FALSE;
 }
 
+// What CreateProcessFixup does with a child process. None of it depends on anything but the child's executable, so it
+// only gets worked out the first time that a given executable gets launched; apps that launch the same helper over and
+// over again then only pay for a lookup
+enum class child_process_action
+{
+    skip, // The executable is outside of the package, so it won't be able to load the fixups, or (see below) its
+          // architecture is the other 64-bit one
+    inject, // DetourUpdateProcessWithDll does the job
+    pre_injected, // The executable imports the PsfRuntime itself (see pre_injection.h), so there's nothing to inject
+    use_helper, // DetourUpdateProcessWithDll doesn't work, i.e. the architecture differs, so PsfRunDll has to do it
+};
+
+static std::mutex g_ChildProcessActionsMutex;
+static std::unordered_map<iwstring, child_process_action, case_insensitive_hash<wchar_t>> g_ChildProcessActions;
+
+// An app that launches an endless variety of executables shouldn't grow this without bound; past this, new executables
+// are just worked out every time, same as they all used to be
+constexpr std::size_t max_child_process_actions = 256;
+
+static std::optional<child_process_action> cached_child_process_action(const iwstring& exePath)
+{
+    std::lock_guard lock(g_ChildProcessActionsMutex);
+    if (auto itr = g_ChildProcessActions.find(exePath); itr != g_ChildProcessActions.end())
+    {
+        return itr->second;
+    }
+
+    return std::nullopt;
+}
+
+static void cache_child_process_action(iwstring exePath, child_process_action action)
+{
+    std::lock_guard lock(g_ChildProcessActionsMutex);
+    if (g_ChildProcessActions.size() < max_child_process_actions)
+    {
+        g_ChildProcessActions.insert_or_assign(std::move(exePath), action);
+    }
+}
+
+static child_process_action package_child_process_action(const iwstring& exePath)
+{
+    psf::image_file_info info;
+    if (!psf::read_image_file_info(exePath.c_str(), info))
+    {
+        // Let Detours have a go at it, same as if we hadn't looked
+        return child_process_action::inject;
+    }
+
+    if (info.pre_injected)
+    {
+        return child_process_action::pre_injected;
+    }
+
+    // Detours only compares bitness, so it would have an x64 process load our ARM64 PsfRuntime64.dll or vice versa, and
+    // the child would fail to start. Neither architecture's PsfRunDll64 can help either, since each package only ships
+    // one of them under that name, so the child runs without the fixups rather than not at all
+    if ((info.machine != psf::image_machine) && (info.machine != IMAGE_FILE_MACHINE_I386) && (psf::image_machine != IMAGE_FILE_MACHINE_I386))
+    {
+        return child_process_action::skip;
+    }
+
+    return child_process_action::inject;
+}
+
+// Gets the PsfRuntime into a child process that was created suspended, as 'action' says, and then lets it run unless the
+// caller asked for it to stay suspended. If the PsfRuntime can't be injected, the process gets terminated and its
+// handles closed, and this fails with the last error set. 'action' is updated if it had to fall back on the helper
+static bool start_child_process(const PROCESS_INFORMATION& processInformation, DWORD creationFlags, child_process_action& action)
+{
+    if (action == child_process_action::pre_injected)
+    {
+        // The loader takes care of loading the PsfRuntime, but it can still use what we'd share with an injected one
+        ShareSectionsWithChildProcess(processInformation.hProcess);
+        ShareConfigWithChildProcess(processInformation.hProcess);
+    }
+    else if (action != child_process_action::skip)
+    {
+        // The target executable is in the package, so we _do_ want to fixup it
+        static const auto pathToPsfRuntime = (PackageRootPath() / psf::runtime_dll_name).string();
+        PCSTR targetDll = pathToPsfRuntime.c_str();
+        if ((action == child_process_action::inject) && ::DetourUpdateProcessWithDll(processInformation.hProcess, &targetDll, 1))
+        {
+            // NOTE: Children that need PsfRunDll have a different architecture, and so couldn't use our sections anyway.
+            //       They could use our config, but they're rare enough to leave them to read it themselves
+            ShareSectionsWithChildProcess(processInformation.hProcess);
+            ShareConfigWithChildProcess(processInformation.hProcess);
+        }
+        else
+        {
+            // We failed to detour the created process (or already know that we would). Assume that the failure was due to
+            // an architecture mis-match and have the injection broker do it, or failing that, a launch of PsfRunDll
+            if (!InjectViaInjectionBroker(processInformation.dwProcessId, CreateProcessImpl.wide) &&
+                !::DetourProcessViaHelperDllsW(processInformation.dwProcessId, 1, &targetDll, CreateProcessWithPsfRunDll))
+            {
+                // Could not detour the target process, so return failure
+                auto err = ::GetLastError();
+				PSF_LOG_ERROR("\tUnable to inject %ls into PID=%d err=0x%x\n",  psf::runtime_dll_name, processInformation.dwProcessId, err);
+                ::TerminateProcess(processInformation.hProcess, ~0u);
+                ::CloseHandle(processInformation.hProcess);
+                ::CloseHandle(processInformation.hThread);
+
+                ::SetLastError(err);
+                return false;
+            }
+
+            action = child_process_action::use_helper;
+        }
+    }
+
+	PSF_LOG_VERBOSE("\tInject %ls into PID=%d\n", psf::runtime_dll_name, processInformation.dwProcessId);
+
+    if ((creationFlags & CREATE_SUSPENDED) != CREATE_SUSPENDED)
+    {
+        // Caller did not want the process to start suspended
+        ::ResumeThread(processInformation.hThread);
+    }
+
+    return true;
+}
+
+// Fails with the last error set, after terminating the process and closing its handles, same as start_child_process
+static bool query_process_image_path(const PROCESS_INFORMATION& processInformation, iwstring& path)
+{
+    DWORD size = MAX_PATH;
+    path.resize(size - 1);
+    while (true)
+    {
+        if (::QueryFullProcessImageNameW(processInformation.hProcess, 0, path.data(), &size))
+        {
+            path.resize(size);
+            return true;
+        }
+        else if (auto err = ::GetLastError(); err == ERROR_INSUFFICIENT_BUFFER)
+        {
+            size *= 2;
+            path.resize(size - 1);
+        }
+        else
+        {
+            // Unexpected error
+            ::TerminateProcess(processInformation.hProcess, ~0u);
+            ::CloseHandle(processInformation.hProcess);
+            ::CloseHandle(processInformation.hThread);
+
+            ::SetLastError(err);
+            return false;
+        }
+    }
+}
+
 template <typename CharT>
 using startup_info_t = std::conditional_t<std::is_same_v<CharT, char>, STARTUPINFOA, STARTUPINFOW>;
 
@@ -109,76 +265,95 @@ BOOL WINAPI CreateProcessFixup(
     }
 
     iwstring path;
-    DWORD size = MAX_PATH;
-    path.resize(size - 1);
-    while (true)
+    if (!query_process_image_path(*processInformation, path))
     {
-        if (::QueryFullProcessImageNameW(processInformation->hProcess, 0, path.data(), &size))
-        {
-            path.resize(size);
-            break;
-        }
-        else if (auto err = ::GetLastError(); err == ERROR_INSUFFICIENT_BUFFER)
-        {
-            size *= 2;
-            path.resize(size - 1);
-        }
-        else
-        {
-            // Unexpected error
-            ::TerminateProcess(processInformation->hProcess, ~0u);
-            ::CloseHandle(processInformation->hProcess);
-            ::CloseHandle(processInformation->hThread);
+        return FALSE;
+    }
 
-            ::SetLastError(err);
-            return FALSE;
-        }
+    auto action = cached_child_process_action(path);
+    if (!action)
+    {
+        action = ::PSFIsPackagePath(path.data(), path.length()) ? package_child_process_action(path) : child_process_action::skip;
     }
 
-    // std::filesystem::path comparison doesn't seem to handle case-insensitivity or root-local device paths...
-    iwstring_view packagePath(PackageRootPath().native().c_str(), PackageRootPath().native().length());
-    iwstring_view exePath = path;
-    auto fixupPath = [](iwstring_view& p)
+    if (!start_child_process(*processInformation, creationFlags, *action))
     {
-        if ((p.length() >= 4) && (p.substr(0, 4) == LR"(\\?\)"_isv))
-        {
-            p = p.substr(4);
-        }
-    };
-    fixupPath(packagePath);
-    fixupPath(exePath);
+        return FALSE;
+    }
+
+    // Only remembered once it's worked, so that a failure doesn't stick
+    cache_child_process_action(std::move(path), *action);
 
-    if ((exePath.length() >= packagePath.length()) && (exePath.substr(0, packagePath.length()) == packagePath))
+    if (processInformation == &pi)
     {
-        // The target executable is in the package, so we _do_ want to fixup it
-        static const auto pathToPsfRuntime = (PackageRootPath() / psf::runtime_dll_name).string();
-        PCSTR targetDll = pathToPsfRuntime.c_str();
-        if (!::DetourUpdateProcessWithDll(processInformation->hProcess, &targetDll, 1))
-        {
-            // We failed to detour the created process. Assume that it the failure was due to an architecture mis-match
-            // and try the launch using PsfRunDll
-            if (!::DetourProcessViaHelperDllsW(processInformation->dwProcessId, 1, &targetDll, CreateProcessWithPsfRunDll))
-            {
-                // Could not detour the target process, so return failure
-                auto err = ::GetLastError();
-				Log("\tUnable to inject %ls into PID=%d err=0x%x\n",  psf::runtime_dll_name, processInformation->dwProcessId, err);
-                ::TerminateProcess(processInformation->hProcess, ~0u);
-                ::CloseHandle(processInformation->hProcess);
-                ::CloseHandle(processInformation->hThread);
+        ::CloseHandle(processInformation->hProcess);
+        ::CloseHandle(processInformation->hThread);
+    }
 
-                ::SetLastError(err);
-                return FALSE;
-            }
-        }
+    return TRUE;
+}
+catch (...)
+{
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+
+DECLARE_STRING_FIXUP(CreateProcessImpl, CreateProcessFixup);
+
+// API definitions
+PSFAPI BOOL __stdcall PSFCreatePackageProcess(
+    _In_opt_ LPCWSTR applicationName,
+    _Inout_opt_ LPWSTR commandLine,
+    _In_opt_ LPSECURITY_ATTRIBUTES processAttributes,
+    _In_opt_ LPSECURITY_ATTRIBUTES threadAttributes,
+    _In_ BOOL inheritHandles,
+    _In_ DWORD creationFlags,
+    _In_opt_ LPVOID environment,
+    _In_opt_ LPCWSTR currentDirectory,
+    _In_ LPSTARTUPINFOW startupInfo,
+    _Out_ LPPROCESS_INFORMATION processInformation) noexcept try
+{
+    // Unlike CreateProcessFixup, there's no need to check that the executable is in the package; the caller vouches for
+    // it. Where it is still matters for whether or not it imports the PsfRuntime itself
+    PROCESS_INFORMATION pi;
+    if (!processInformation)
+    {
+        processInformation = &pi;
     }
-	Log("\tInject %ls into PID=%d\n", psf::runtime_dll_name, processInformation->dwProcessId);
 
-    if ((creationFlags & CREATE_SUSPENDED) != CREATE_SUSPENDED)
+    if (!CreateProcessImpl(
+        applicationName,
+        commandLine,
+        processAttributes,
+        threadAttributes,
+        inheritHandles,
+        creationFlags | CREATE_SUSPENDED,
+        environment,
+        currentDirectory,
+        startupInfo,
+        processInformation))
     {
-        // Caller did not want the process to start suspended
-        ::ResumeThread(processInformation->hThread);
+        return FALSE;
     }
 
+    iwstring path;
+    if (!query_process_image_path(*processInformation, path))
+    {
+        return FALSE;
+    }
+
+    auto action = cached_child_process_action(path);
+    if (!action)
+    {
+        action = package_child_process_action(path);
+    }
+
+    if (!start_child_process(*processInformation, creationFlags, *action))
+    {
+        return FALSE;
+    }
+    cache_child_process_action(std::move(path), *action);
+
     if (processInformation == &pi)
     {
         ::CloseHandle(processInformation->hProcess);
@@ -192,5 +367,3 @@ catch (...)
     ::SetLastError(win32_from_caught_exception());
     return FALSE;
 }
-
-DECLARE_STRING_FIXUP(CreateProcessImpl, CreateProcessFixup);
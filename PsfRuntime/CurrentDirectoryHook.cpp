@@ -0,0 +1,42 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Fixups that resolve relative paths themselves (e.g. the FileRedirectionFixup normalizing every path it sees) would
+// like to remember what they resolved to, which is only valid for as long as the current directory stays the same. The
+// PsfRuntime intercepts SetCurrentDirectory[AW] and bumps a generation count each time that it succeeds, so that such
+// caches only need to compare the count instead of querying the current directory again.
+//
+// NOTE: Changes made by calling RtlSetCurrentDirectory_U directly go unnoticed. Nothing in the documented API surface
+//       does that other than SetCurrentDirectory itself
+
+#include <atomic>
+#include <cstdint>
+
+#include <windows.h>
+#include <psf_framework.h>
+
+// Starts at one so that zero never matches, for caches that start out zeroed
+static std::atomic<std::uint32_t> g_currentDirectoryGeneration{ 1 };
+
+auto SetCurrentDirectoryImpl = psf::detoured_string_function(&::SetCurrentDirectoryA, &::SetCurrentDirectoryW);
+
+template <typename CharT>
+BOOL WINAPI SetCurrentDirectoryFixup(_In_ const CharT* pathName) noexcept
+{
+    auto result = SetCurrentDirectoryImpl(pathName);
+    if (result)
+    {
+        // NOTE: Bumped after the change, so that a cached result from before it can never be stamped with the new count
+        g_currentDirectoryGeneration.fetch_add(1, std::memory_order_release);
+    }
+
+    return result;
+}
+DECLARE_STRING_FIXUP(SetCurrentDirectoryImpl, SetCurrentDirectoryFixup);
+
+PSFAPI const std::atomic<std::uint32_t>* __stdcall PSFQueryCurrentDirectoryGeneration() noexcept
+{
+    return &g_currentDirectoryGeneration;
+}
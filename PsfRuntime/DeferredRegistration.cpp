@@ -0,0 +1,234 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Committing a Detours transaction suspends and updates threads, flushes the instruction cache, and re-protects every
+// page that it touched, so doing so once per fixup adds up when there are several of them. Instead, the fixups' calls to
+// PSFRegister get recorded while they initialize, and are applied afterwards in as few transactions as possible.
+//
+// The one thing that can't go in the same transaction is a second detour of the same function: Detours builds each
+// trampoline from the function's code as it was when the transaction began, so the second detour would silently replace
+// the first instead of chaining to it. When a fixup detours a function that an earlier fixup in the same transaction
+// already does, the earlier fixups get committed first and the fixup starts the next transaction, which is the same order
+// that the detours would have been applied in with one transaction per fixup.
+//
+// Fixups whose "hookMode" is "iat" hook import tables instead (see ImportTableHooks.cpp), which doesn't take a
+// transaction, so each of them gets applied on its own, in between the transactions for the fixups around it.
+//
+// NOTE: Since nothing is detoured until all fixups have initialized, a fixup's PSFInitialize no longer runs with the
+//       detours of the fixups before it in place
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_set>
+
+#include <detour_transaction.h>
+#include <psf_runtime.h>
+
+#include "DeferredRegistration.h"
+#include "HandlerDispatch.h"
+#include "ModuleLoadRegistration.h"
+
+static deferred_registrations* g_activeRegistrations = nullptr;
+
+deferred_registrations::deferred_registrations()
+{
+    assert(!g_activeRegistrations);
+    g_activeRegistrations = this;
+}
+
+deferred_registrations::~deferred_registrations()
+{
+    assert(g_activeRegistrations == this);
+    g_activeRegistrations = nullptr;
+}
+
+deferred_registrations* deferred_registrations::active() noexcept
+{
+    return g_activeRegistrations;
+}
+
+void deferred_registrations::begin_fixup(hook_mode mode)
+{
+    m_handlerMarks.push_back(handler_registration_count());
+    m_moduleLoadMarks.push_back(module_load_registration_count());
+    m_modes.push_back(mode);
+    m_fixups.emplace_back();
+}
+
+void deferred_registrations::discard_fixup() noexcept
+{
+    assert(!m_fixups.empty());
+    m_fixups.pop_back();
+    m_modes.pop_back();
+
+    // Including the fixup's handlers, whose detours (if any) were among the registrations just dropped
+    discard_handler_registrations(m_handlerMarks.back());
+    m_handlerMarks.pop_back();
+    discard_module_load_registrations(m_moduleLoadMarks.back());
+    m_moduleLoadMarks.pop_back();
+}
+
+DWORD deferred_registrations::record(const psf_registration* registrations, std::size_t count) noexcept try
+{
+    if (m_fixups.empty())
+    {
+        // Not called from a fixup's PSFInitialize
+        return ERROR_INVALID_OPERATION;
+    }
+
+    // NOTE: Inserting a range either inserts all of it or, if it throws, none of it
+    auto& fixup = m_fixups.back();
+    fixup.insert(fixup.end(), registrations, registrations + count);
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return ERROR_OUTOFMEMORY;
+}
+
+DWORD deferred_registrations::erase(void** impl, void* detour) noexcept
+{
+    // Nothing has been attached yet, so the only thing that can be unregistered is something the same fixup registered
+    if (!m_fixups.empty())
+    {
+        auto& registrations = m_fixups.back();
+        auto itr = std::find_if(registrations.rbegin(), registrations.rend(), [&](const psf_registration& entry)
+        {
+            return (entry.implFn == impl) && (entry.fixupFn == detour);
+        });
+
+        if (itr != registrations.rend())
+        {
+            registrations.erase(std::next(itr).base());
+            return ERROR_SUCCESS;
+        }
+    }
+
+    return ERROR_INVALID_OPERATION;
+}
+
+std::size_t deferred_registrations::apply(std::size_t begin)
+{
+    assert(begin < m_fixups.size());
+
+    if (m_modes[begin] == hook_mode::import_table)
+    {
+        install_import_table_hooks(m_fixups[begin]);
+        return begin + 1;
+    }
+
+    auto limit = m_fixups.size();
+    while (true)
+    {
+        auto transaction = detours::transaction();
+        check_win32(::DetourUpdateThread(::GetCurrentThread()));
+
+        // Detours may skip past jumps (e.g. import thunks) to find the code to patch, so two different pointers can refer
+        // to the same function
+        std::unordered_set<void*> targets;
+        auto target = [](const psf_registration& entry)
+        {
+            return ::DetourCodeFromPointer(*entry.implFn, nullptr);
+        };
+
+        auto alreadyTargeted = [&](const psf_registration& entry)
+        {
+            return targets.find(target(entry)) != targets.end();
+        };
+
+        auto end = begin;
+        DWORD error = ERROR_SUCCESS;
+        for (; end < limit; ++end)
+        {
+            auto& registrations = m_fixups[end];
+            if ((m_modes[end] == hook_mode::import_table) || std::any_of(registrations.begin(), registrations.end(), alreadyTargeted))
+            {
+                break;
+            }
+
+            for (auto& entry : registrations)
+            {
+                targets.insert(target(entry));
+                error = ::DetourAttach(entry.implFn, entry.fixupFn);
+                if (error != ERROR_SUCCESS)
+                {
+                    break;
+                }
+            }
+
+            if (error != ERROR_SUCCESS)
+            {
+                break;
+            }
+        }
+
+        if (error == ERROR_SUCCESS)
+        {
+            transaction.commit();
+            return end;
+        }
+        else if (end == begin)
+        {
+            throw_win32(error, "Failed to apply a fixup's detours");
+        }
+
+        // A failed DetourAttach fails the entire transaction, so start over with only the fixups before this one. The
+        // failing fixup then gets the next transaction to itself, and fails in it
+        limit = end;
+    }
+}
+
+// API definitions
+PSFAPI DWORD __stdcall PSFRegister(_Inout_ void** implFn, _In_ void* fixupFn) noexcept
+{
+    psf_registration registration{ implFn, fixupFn };
+    return ::PSFRegisterBatch(&registration, 1);
+}
+
+PSFAPI DWORD __stdcall PSFUnregister(_Inout_ void** implFn, _In_ void* fixupFn) noexcept
+{
+    if (auto registrations = deferred_registrations::active())
+    {
+        return registrations->erase(implFn, fixupFn);
+    }
+    else if (remove_import_table_hook(implFn, fixupFn))
+    {
+        return ERROR_SUCCESS;
+    }
+
+    return ::DetourDetach(implFn, fixupFn);
+}
+
+PSFAPI DWORD __stdcall PSFRegisterBatch(_In_reads_(count) const psf_registration* registrations, std::size_t count) noexcept
+{
+    if (auto deferred = deferred_registrations::active())
+    {
+        return deferred->record(registrations, count);
+    }
+
+    // NOTE: Detours remembers the first failure and fails the commit with it, so there's no need to undo the attaches that
+    //       succeeded; none of them will take effect
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (auto error = ::DetourAttach(registrations[i].implFn, registrations[i].fixupFn))
+        {
+            return error;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterBatch(_In_reads_(count) const psf_registration* registrations, std::size_t count) noexcept
+{
+    DWORD result = ERROR_SUCCESS;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto error = ::PSFUnregister(registrations[i].implFn, registrations[i].fixupFn);
+        result = result ? result : error;
+    }
+
+    return result;
+}
@@ -0,0 +1,58 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <windows.h>
+#include <psf_runtime.h>
+
+#include "ImportTableHooks.h"
+
+// While an instance is alive, PSFRegister and PSFUnregister only record what the fixups ask for instead of calling
+// DetourAttach/DetourDetach. Registrations are grouped by fixup so that each fixup's detours either all get applied, or
+// none of them do. See DeferredRegistration.cpp
+class deferred_registrations
+{
+public:
+
+    deferred_registrations();
+    ~deferred_registrations();
+
+    deferred_registrations(const deferred_registrations&) = delete;
+    deferred_registrations& operator=(const deferred_registrations&) = delete;
+
+    // Registrations made from now on belong to the next fixup, and get applied as 'mode' says
+    void begin_fixup(hook_mode mode = hook_mode::inline_detour);
+
+    // Drops the registrations of the fixup that was most recently begun, e.g. because its PSFInitialize failed
+    void discard_fixup() noexcept;
+
+    std::size_t fixup_count() const noexcept
+    {
+        return m_fixups.size();
+    }
+
+    // Applies the registrations of as many fixups as fit in a single Detours transaction, starting with the one at
+    // index 'begin'. Fixups that hook import tables don't need a transaction, and get applied on their own. Returns the
+    // index just past the last fixup applied. Throws if the first fixup's registrations can't be applied, in which case
+    // none of them are
+    std::size_t apply(std::size_t begin);
+
+    // What PSFRegister and PSFUnregister do instead while registrations are being deferred
+    DWORD record(const psf_registration* registrations, std::size_t count) noexcept;
+    DWORD erase(void** impl, void* detour) noexcept;
+
+    // The instance that is currently alive, if any
+    static deferred_registrations* active() noexcept;
+
+private:
+
+    std::vector<std::vector<psf_registration>> m_fixups;
+    std::vector<hook_mode> m_modes;
+    std::vector<std::size_t> m_handlerMarks; // handler_registration_count() as of each fixup's begin_fixup
+    std::vector<std::size_t> m_moduleLoadMarks; // ... and module_load_registration_count()
+};
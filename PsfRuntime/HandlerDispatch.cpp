@@ -0,0 +1,156 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// When several fixups detour the same function, every call to it hops through each of their detours in turn, and most
+// of them do nothing more than check the arguments and call on to the next. Fixups that declare a handler instead (see
+// DECLARE_HANDLER) share a single detour per function: the first fixup to register a handler for it provides the detour,
+// and the handlers of the ones after it just get appended to its chain, which the detour walks in order.
+//
+// Chains are never freed, since there's no telling whether some thread is still walking one, and their slots are never
+// reused. Once a chain fills up, the next handler for the same function starts a new chain, detour and all, which then
+// runs in front of the full one.
+//
+// NOTE: Functions are identified by what Detours patches (see DetourCodeFromPointer) as of when the handler gets
+//       registered. Once a chain's detour has been committed, that's the detour's jump, so a handler registered after
+//       that starts a new chain rather than joining the existing one. In practice, handlers get registered while the
+//       fixups initialize, before anything has been committed (see DeferredRegistration.cpp)
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <detours.h>
+#include <psf_runtime.h>
+
+#include "HandlerDispatch.h"
+
+struct handler_target
+{
+    void* code; // Null once the chain's detour has been unregistered, so that no more handlers get added to it
+    void** implFn;
+    void* dispatcher;
+    psf_handler_chain* chain;
+    std::size_t count;
+};
+
+struct handler_registration
+{
+    handler_target* target;
+    std::size_t slot;
+};
+
+static std::mutex g_HandlersMutex;
+static std::deque<handler_target> g_HandlerTargets; // A deque so that pointers to its elements stay valid
+static std::vector<handler_registration> g_HandlerRegistrations;
+
+std::size_t handler_registration_count() noexcept
+{
+    std::lock_guard<std::mutex> lock(g_HandlersMutex);
+    return g_HandlerRegistrations.size();
+}
+
+void discard_handler_registrations(std::size_t count) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_HandlersMutex);
+    while (g_HandlerRegistrations.size() > count)
+    {
+        auto& registration = g_HandlerRegistrations.back();
+        registration.target->chain->handlers[registration.slot].store(nullptr, std::memory_order_release);
+        if (registration.slot == 0)
+        {
+            // The chain's detour gets discarded along with the rest of the fixup's registrations
+            registration.target->code = nullptr;
+        }
+
+        g_HandlerRegistrations.pop_back();
+    }
+}
+
+// API definitions
+PSFAPI DWORD __stdcall PSFRegisterHandler(
+    _Inout_ void** implFn,
+    _In_ void* dispatcher,
+    _In_ void* handler,
+    _Out_ psf_handler_chain** chain) noexcept try
+{
+    *chain = nullptr;
+    auto code = ::DetourCodeFromPointer(*implFn, nullptr);
+
+    std::lock_guard<std::mutex> lock(g_HandlersMutex);
+    g_HandlerRegistrations.reserve(g_HandlerRegistrations.size() + 1);
+
+    // Only the most recent chain for a function can have room left
+    auto itr = std::find_if(g_HandlerTargets.rbegin(), g_HandlerTargets.rend(), [&](const handler_target& target)
+    {
+        return target.code == code;
+    });
+
+    handler_target* target;
+    if ((itr != g_HandlerTargets.rend()) && (itr->count < psf_max_handlers))
+    {
+        target = &*itr;
+    }
+    else
+    {
+        if ((itr != g_HandlerTargets.rend()) && (itr->dispatcher == dispatcher))
+        {
+            // The same detour can't go in front of itself; this takes more than psf_max_handlers in the same fixup
+            return ERROR_NOT_ENOUGH_QUOTA;
+        }
+
+        auto newChain = new psf_handler_chain{};
+        g_HandlerTargets.push_back(handler_target{ nullptr, implFn, dispatcher, newChain, 0 });
+        if (auto error = ::PSFRegister(implFn, dispatcher))
+        {
+            g_HandlerTargets.pop_back();
+            delete newChain;
+            return error;
+        }
+
+        target = &g_HandlerTargets.back();
+        target->code = code;
+    }
+
+    auto slot = target->count++;
+    target->chain->handlers[slot].store(handler, std::memory_order_release);
+    g_HandlerRegistrations.push_back(handler_registration{ target, slot });
+
+    *chain = target->chain;
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return ERROR_OUTOFMEMORY;
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterHandler(_Inout_ void** implFn, _In_ void* dispatcher, _In_ void* handler) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_HandlersMutex);
+    for (auto itr = g_HandlerTargets.rbegin(); itr != g_HandlerTargets.rend(); ++itr)
+    {
+        auto& target = *itr;
+        for (std::size_t slot = 0; slot < target.count; ++slot)
+        {
+            if (target.chain->handlers[slot].load(std::memory_order_relaxed) != handler)
+            {
+                continue;
+            }
+
+            target.chain->handlers[slot].store(nullptr, std::memory_order_release);
+            if ((target.implFn != implFn) || (target.dispatcher != dispatcher) || !target.code)
+            {
+                return ERROR_SUCCESS;
+            }
+
+            // The detour belongs to the fixup that's going away. Any handlers still in the chain were registered by
+            // fixups after it, which get uninitialized (and unregister them) first
+            target.code = nullptr;
+            return ::PSFUnregister(implFn, dispatcher);
+        }
+    }
+
+    return ERROR_INVALID_OPERATION;
+}
@@ -0,0 +1,15 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+
+// How many PSFRegisterHandler calls have succeeded so far (minus those discarded), for use with
+// discard_handler_registrations
+std::size_t handler_registration_count() noexcept;
+
+// Undoes the handler registrations after the first 'count', e.g. because the fixup that made them failed to initialize.
+// Only meant for handlers whose detours haven't been committed yet, i.e. while registrations are being deferred
+void discard_handler_registrations(std::size_t count) noexcept;
@@ -0,0 +1,339 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// An inline detour patches the function itself, so every call to it goes through the detour, including the calls that
+// the system's own dlls make, which most fixes for an application never need to see, and each of which still pays for
+// the jump to the detour, and for whatever the detour does before deciding to call through. Attaching inline detours
+// also takes a Detours transaction, which suspends threads. A fixup configured with "hookMode": "iat" gets its
+// registrations applied to the import tables of the executable and of the dlls in the package instead: each of their
+// imports of the function is pointed at the fixup's function, and the fixup's 'implFn' is left pointing at the function
+// itself. Calls from everywhere else go straight to the function, and hooking an import is a single pointer-sized write,
+// which needs nothing suspended. Dlls in the package that load later get their imports hooked from the loader
+// notification in ModuleLoadRegistration.cpp, which arrives once the loader has bound the dll's imports, and before its
+// DllMain runs.
+//
+// An import gets recognized by what it points at: either the function that was registered, or the code that
+// DetourCodeFromPointer says that it leads to, since e.g. imports of kernel32!CreateFileW and of
+// api-ms-win-core-file-l1-1-0!CreateFileW both end up at kernelbase!CreateFileW. When several fixups hook the same
+// function this way, the imports point at the last of them, and each one's 'implFn' points at the one before it, which
+// chains them in configuration order, the same as inline detours of the same function. Inline detours of a hooked
+// function still see every call, after the import table hooks.
+//
+// NOTE: Only the imports get hooked. Calls through pointers from GetProcAddress, through delay-load imports, and from
+//       dlls outside of the package (e.g. a shell extension that the application loads) go to the function directly.
+//       The PsfRuntime and the fixup dlls keep their imports as they are
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+#include <psf_runtime.h>
+
+#include "ImportTableHooks.h"
+#include "ModuleLoadRegistration.h"
+
+struct import_table_hook
+{
+    void** impl_fn;
+    void* fixup_fn;
+};
+
+struct hooked_function
+{
+    void* function; // What the imports pointed at before any of them were hooked
+    void* code; // DetourCodeFromPointer(function)
+    std::vector<import_table_hook> hooks; // In the order installed. The imports point at the last one's fixup_fn
+    std::vector<void*> removed; // The fixup_fn of removed hooks, which imports may still point at until they're patched
+
+    void* outermost() const noexcept
+    {
+        return hooks.empty() ? function : hooks.back().fixup_fn;
+    }
+
+    bool is_hook(void* pointer) const noexcept
+    {
+        return std::any_of(hooks.begin(), hooks.end(), [&](const import_table_hook& hook) { return hook.fixup_fn == pointer; }) ||
+            (std::find(removed.begin(), removed.end(), pointer) != removed.end());
+    }
+};
+
+static std::mutex g_ImportHooksMutex;
+static std::list<hooked_function> g_HookedFunctions; // A list so that entries stay put as others get added
+static std::vector<HMODULE> g_HookedModules; // The modules whose imports get hooked and are currently loaded
+static bool g_LoadedModulesEnumerated = false;
+
+// Called with g_ImportHooksMutex held
+static hooked_function* hooked_function_of(void* pointer, void* code) noexcept
+{
+    for (auto& function : g_HookedFunctions)
+    {
+        if ((pointer == function.function) || function.is_hook(pointer))
+        {
+            return &function;
+        }
+    }
+
+    if (code)
+    {
+        for (auto& function : g_HookedFunctions)
+        {
+            if (code == function.code)
+            {
+                return &function;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+static BOOL CALLBACK import_file_callback(void* context, HMODULE file, const char*) noexcept
+{
+    // The entries for imports that haven't been bound (yet) don't point into any module
+    *static_cast<bool*>(context) = (file != nullptr);
+    return TRUE;
+}
+
+static BOOL CALLBACK import_function_callback(void* context, DWORD, const char*, void** slot) noexcept
+{
+    if (!slot || !*slot || !*static_cast<bool*>(context))
+    {
+        return TRUE;
+    }
+
+    auto function = hooked_function_of(*slot, nullptr);
+    if (!function)
+    {
+        function = hooked_function_of(nullptr, ::DetourCodeFromPointer(*slot, nullptr));
+    }
+
+    if (function && (*slot != function->outermost()))
+    {
+        // The import table is usually read-only once the loader is done with it
+        DWORD oldProtection;
+        if (::VirtualProtect(slot, sizeof(*slot), PAGE_READWRITE, &oldProtection))
+        {
+            ::InterlockedExchangePointer(slot, function->outermost());
+            ::VirtualProtect(slot, sizeof(*slot), oldProtection, &oldProtection);
+        }
+    }
+
+    return TRUE;
+}
+
+// Points each of the module's imports of a hooked function at its outermost hook, or back at the function itself once
+// it has none. Called with g_ImportHooksMutex held
+static void patch_imports(HMODULE module) noexcept
+{
+    bool bound = false;
+    ::DetourEnumerateImportsEx(module, &bound, import_file_callback, import_function_callback);
+}
+
+static bool hooks_imports_of(HMODULE module, const wchar_t* path, std::size_t length) noexcept
+{
+    if (module == ::GetModuleHandleW(nullptr))
+    {
+        return true;
+    }
+    else if (module == ::DetourGetContainingModule(reinterpret_cast<void*>(&install_import_table_hooks)))
+    {
+        return false;
+    }
+
+    // Fixup dlls, bundled or not, call the functions that they hook through their 'implFn' or not at all, which is no
+    // different from how they see inline detours of other fixups
+    return ::PSFIsPackagePath(path, length) &&
+        !::GetProcAddress(module, "PSFInitialize") && !::GetProcAddress(module, "PSFQueryBundledFixup");
+}
+
+using module_reference = std::unique_ptr<std::remove_pointer_t<HMODULE>, decltype(&::FreeLibrary)>;
+
+// The loaded modules whose imports get hooked. Each comes with a reference so that it stays loaded until it's been
+// added to g_HookedModules, after which the unload notification takes care of removing it again
+static std::vector<module_reference> loaded_modules_to_hook()
+{
+    std::vector<module_reference> result;
+    for (auto module = ::DetourEnumerateModules(nullptr); module; module = ::DetourEnumerateModules(module))
+    {
+        HMODULE pinned;
+        if (!::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<const wchar_t*>(module), &pinned))
+        {
+            // Unloaded in the meantime
+            continue;
+        }
+        module_reference reference(pinned, &::FreeLibrary);
+
+        std::wstring path(MAX_PATH, L'\0');
+        while (true)
+        {
+            auto length = ::GetModuleFileNameW(pinned, path.data(), static_cast<DWORD>(path.size()));
+            if (length < path.size())
+            {
+                path.resize(length);
+                break;
+            }
+            path.resize(path.size() * 2);
+        }
+
+        if (!path.empty() && hooks_imports_of(pinned, path.c_str(), path.length()))
+        {
+            result.push_back(std::move(reference));
+        }
+    }
+
+    return result;
+}
+
+void install_import_table_hooks(const std::vector<psf_registration>& registrations)
+{
+    if (registrations.empty())
+    {
+        return;
+    }
+
+    // Listen for module loads before looking at what's loaded, so that nothing can load without us seeing it
+    register_dll_notification();
+
+    std::size_t installed = 0;
+    try
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_ImportHooksMutex);
+            for (auto& registration : registrations)
+            {
+                auto function = hooked_function_of(*registration.implFn, ::DetourCodeFromPointer(*registration.implFn, nullptr));
+                if (!function)
+                {
+                    function = &g_HookedFunctions.emplace_back();
+                    function->function = *registration.implFn;
+                    function->code = ::DetourCodeFromPointer(*registration.implFn, nullptr);
+                }
+
+                function->hooks.push_back(import_table_hook{ registration.implFn, registration.fixupFn });
+                *registration.implFn = (function->hooks.size() > 1) ? function->hooks[function->hooks.size() - 2].fixup_fn : function->function;
+                ++installed;
+            }
+        }
+
+        // Only the first install needs to look at what's loaded; the loader notification keeps the list current after that
+        std::vector<module_reference> loadedModules;
+        if (!g_LoadedModulesEnumerated)
+        {
+            loadedModules = loaded_modules_to_hook();
+        }
+
+        std::lock_guard<std::mutex> lock(g_ImportHooksMutex);
+        for (auto& reference : loadedModules)
+        {
+            if (std::find(g_HookedModules.begin(), g_HookedModules.end(), reference.get()) == g_HookedModules.end())
+            {
+                g_HookedModules.push_back(reference.get());
+            }
+        }
+        g_LoadedModulesEnumerated = true;
+
+        for (auto module : g_HookedModules)
+        {
+            patch_imports(module);
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t i = installed; i-- > 0; )
+        {
+            remove_import_table_hook(registrations[i].implFn, registrations[i].fixupFn);
+        }
+        throw;
+    }
+}
+
+bool remove_import_table_hook(void** implFn, void* fixupFn) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_ImportHooksMutex);
+    for (auto function = g_HookedFunctions.begin(); function != g_HookedFunctions.end(); ++function)
+    {
+        auto& hooks = function->hooks;
+        auto itr = std::find_if(hooks.begin(), hooks.end(), [&](const import_table_hook& hook)
+        {
+            return (hook.impl_fn == implFn) && (hook.fixup_fn == fixupFn);
+        });
+
+        if (itr == hooks.end())
+        {
+            continue;
+        }
+
+        if (std::next(itr) != hooks.end())
+        {
+            // The next hook out calls this one, so it calls whatever this one did instead. The imports stay as they are
+            *std::next(itr)->impl_fn = *itr->impl_fn;
+            hooks.erase(itr);
+        }
+        else
+        {
+            hooks.erase(itr);
+            try
+            {
+                function->removed.push_back(fixupFn);
+            }
+            catch (...)
+            {
+                // Imports that still point at the hook don't get recognized, and keep calling it
+            }
+
+            for (auto module : g_HookedModules)
+            {
+                patch_imports(module);
+            }
+        }
+
+        if (hooks.empty())
+        {
+            g_HookedFunctions.erase(function);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void import_table_hooks_module_loaded(HMODULE module, const UNICODE_STRING& fullDllName) noexcept try
+{
+    {
+        std::lock_guard<std::mutex> lock(g_ImportHooksMutex);
+        if (g_HookedFunctions.empty())
+        {
+            return;
+        }
+    }
+
+    if (!hooks_imports_of(module, fullDllName.Buffer, fullDllName.Length / sizeof(wchar_t)))
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(g_ImportHooksMutex);
+    if (std::find(g_HookedModules.begin(), g_HookedModules.end(), module) == g_HookedModules.end())
+    {
+        g_HookedModules.push_back(module);
+    }
+    patch_imports(module);
+}
+catch (...)
+{
+    // The module's imports go to the functions directly
+}
+
+void import_table_hooks_module_unloaded(HMODULE module) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_ImportHooksMutex);
+    g_HookedModules.erase(std::remove(g_HookedModules.begin(), g_HookedModules.end(), module), g_HookedModules.end());
+}
@@ -0,0 +1,29 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <vector>
+
+#include <windows.h>
+#include <winternl.h>
+#include <psf_runtime.h>
+
+// How a fixup's registrations get applied, as chosen by its "hookMode"
+enum class hook_mode
+{
+    inline_detour, // "inline", the default: DetourAttach
+    import_table,  // "iat": the import tables of the executable and the package's dlls. See ImportTableHooks.cpp
+};
+
+// Hooks each of the registrations in the import tables of the modules that are loaded now, and of those that load later
+void install_import_table_hooks(const std::vector<psf_registration>& registrations);
+
+// Undoes install_import_table_hooks for one registration. Returns false if it isn't an import table hook, in which case
+// nothing is done
+bool remove_import_table_hook(void** implFn, void* fixupFn) noexcept;
+
+// Called from the loader notification (see ModuleLoadRegistration.cpp) for each module that loads or unloads
+void import_table_hooks_module_loaded(HMODULE module, const UNICODE_STRING& fullDllName) noexcept;
+void import_table_hooks_module_unloaded(HMODULE module) noexcept;
@@ -0,0 +1,305 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Injecting the PsfRuntime into a child process of the other architecture has to be done by a process of the child's
+// architecture. Detours does that by launching a helper (PsfRunDll, see CreateProcessHook.cpp) for every such child,
+// which roughly doubles the cost of creating it. Instead, the first such launch also starts an injection broker: a
+// PsfRunDll process of the other architecture that stays around, and injects into the children that it's asked to over
+// a named pipe. Later launches - from any process in the package - then just send it a request. The broker exits once
+// it's gone a while without any requests, and the next launch that needs it starts a new one.
+//
+// Anything that goes wrong with the broker just means falling back to the helper, same as before there was a broker.
+// NOTE: The pipe only accepts local clients, and its default security only lets the same user (or an administrator)
+//       connect with write access. The broker only ever injects its own PsfRuntime dll, so a client can ask it to do
+//       no more than the client could have done itself
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include <windows.h>
+#include <detours.h>
+#include <fancy_handle.h>
+#include <psf_constants.h>
+#include <psf_utils.h>
+
+#include "Config.h"
+
+void Log(const char* fmt, ...);
+
+// {9D3C2B5E-1F47-4A8C-B6E0-7A2E4C91D3F5}
+constexpr GUID injection_broker_payload_id = { 0x9d3c2b5e, 0x1f47, 0x4a8c, { 0xb6, 0xe0, 0x7a, 0x2e, 0x4c, 0x91, 0xd3, 0xf5 } };
+
+// How long the broker waits for a request before exiting, and for a connected client to send its request
+constexpr DWORD injection_broker_idle_timeout = 5 * 60 * 1000;
+constexpr DWORD injection_broker_request_timeout = 5 * 1000;
+
+struct injection_request
+{
+    std::uint32_t process_id;
+};
+
+struct injection_response
+{
+    std::uint32_t error;
+};
+
+// Brokers are per package, per session, and per architecture, the last of which is always the other one
+static const std::wstring& injection_broker_pipe_name()
+{
+    static const std::wstring name = []
+    {
+        DWORD sessionId = 0;
+        ::ProcessIdToSessionId(::GetCurrentProcessId(), &sessionId);
+        return LR"(\\.\pipe\PsfInjectionBroker_)" + PackageFullName() + L"_" + std::to_wstring(sessionId) + L"_" +
+            ((sizeof(void*) == 4) ? L"64" : L"32");
+    }();
+
+    return name;
+}
+
+// Set once a broker that we started never showed up, in which case we stop trying; presumably it can't be started at all
+static std::atomic<bool> g_InjectionBrokerUnavailable = false;
+static std::atomic<bool> g_InjectionBrokerLaunchPending = false;
+
+static void launch_injection_broker(PDETOUR_CREATE_PROCESS_ROUTINEW createProcess) noexcept try
+{
+    if (g_InjectionBrokerLaunchPending.exchange(true))
+    {
+        g_InjectionBrokerUnavailable = true;
+        return;
+    }
+
+    // PsfRunDll loads the other architecture's PsfRuntime and calls PsfInjectionBroker. The payload tells the PsfRuntime
+    // that it's a broker, so that it doesn't initialize, and which pipe to serve
+    auto runDllPath = PackageRootPath() / psf::wrun_dll_name;
+    auto cmdLine = std::wstring(psf::wrun_dll_name) + LR"( ")" + (PackageRootPath() / psf::other_runtime_dll_name).native() +
+        LR"(",PsfInjectionBroker)";
+
+    STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+    PROCESS_INFORMATION processInformation;
+    if (!createProcess(runDllPath.c_str(), cmdLine.data(), nullptr, nullptr, FALSE, CREATE_SUSPENDED, nullptr, nullptr,
+        &startupInfo, &processInformation))
+    {
+        g_InjectionBrokerUnavailable = true;
+        return;
+    }
+
+    psf::unique_handle process(processInformation.hProcess);
+    psf::unique_handle thread(processInformation.hThread);
+
+    auto& name = injection_broker_pipe_name();
+    if (!::DetourCopyPayloadToProcess(process.get(), injection_broker_payload_id, name.data(), static_cast<DWORD>(name.length() * sizeof(wchar_t))))
+    {
+        ::TerminateProcess(process.get(), ~0u);
+        g_InjectionBrokerUnavailable = true;
+        return;
+    }
+
+    ::ResumeThread(thread.get());
+}
+catch (...)
+{
+    g_InjectionBrokerUnavailable = true;
+}
+
+bool InjectViaInjectionBroker(DWORD processId, PDETOUR_CREATE_PROCESS_ROUTINEW createProcess) noexcept try
+{
+    if (g_InjectionBrokerUnavailable)
+    {
+        return false;
+    }
+
+    auto& name = injection_broker_pipe_name();
+    auto connect = [&]
+    {
+        // Identification only, so that whoever is on the other end can't impersonate us
+        return psf::unique_handle(::CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING,
+            SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, nullptr));
+    };
+
+    auto pipe = connect();
+    if (!pipe && (::GetLastError() == ERROR_PIPE_BUSY) && ::WaitNamedPipeW(name.c_str(), injection_broker_request_timeout))
+    {
+        pipe = connect();
+    }
+
+    if (!pipe)
+    {
+        if (::GetLastError() == ERROR_FILE_NOT_FOUND)
+        {
+            // This launch still has to use the helper, but the ones after it won't
+            launch_injection_broker(createProcess);
+        }
+
+        return false;
+    }
+
+    g_InjectionBrokerLaunchPending = false;
+
+    injection_request request = { processId };
+    injection_response response;
+    DWORD bytes;
+    if (!::WriteFile(pipe.get(), &request, sizeof(request), &bytes, nullptr) || (bytes != sizeof(request)) ||
+        !::ReadFile(pipe.get(), &response, sizeof(response), &bytes, nullptr) || (bytes != sizeof(response)))
+    {
+        return false;
+    }
+
+    if (response.error != ERROR_SUCCESS)
+    {
+        Log("\tInjection broker failed to inject into PID=%d err=0x%x\n", processId, response.error);
+        return false;
+    }
+
+    return true;
+}
+catch (...)
+{
+    return false;
+}
+
+// Only set in the broker itself, from the payload that launch_injection_broker gave it
+static std::wstring g_InjectionBrokerPipeName;
+
+bool IsInjectionBrokerProcess() noexcept try
+{
+    static const bool isBroker = []
+    {
+        DWORD size = 0;
+        auto payload = static_cast<const wchar_t*>(::DetourFindPayloadEx(injection_broker_payload_id, &size));
+        if (!payload || (size == 0))
+        {
+            return false;
+        }
+
+        g_InjectionBrokerPipeName.assign(payload, size / sizeof(wchar_t));
+        return true;
+    }();
+
+    return isBroker;
+}
+catch (...)
+{
+    return false;
+}
+
+// Waits for an overlapped operation on the pipe, giving up (and cancelling it) after 'timeout'
+static bool complete_overlapped(HANDLE pipe, OVERLAPPED& overlapped, BOOL started, DWORD timeout, DWORD* bytes = nullptr) noexcept
+{
+    if (!started && (::GetLastError() != ERROR_IO_PENDING))
+    {
+        return ::GetLastError() == ERROR_PIPE_CONNECTED;
+    }
+
+    if (::WaitForSingleObject(overlapped.hEvent, timeout) != WAIT_OBJECT_0)
+    {
+        ::CancelIo(pipe);
+        DWORD ignored;
+        ::GetOverlappedResult(pipe, &overlapped, &ignored, TRUE);
+        return false;
+    }
+
+    DWORD transferred;
+    if (!::GetOverlappedResult(pipe, &overlapped, &transferred, FALSE))
+    {
+        return false;
+    }
+
+    if (bytes)
+    {
+        *bytes = transferred;
+    }
+
+    return true;
+}
+
+static DWORD inject_for_client(const injection_request& request, const char* runtimePath) noexcept
+{
+    psf::unique_handle process(::OpenProcess(PROCESS_ALL_ACCESS, FALSE, request.process_id));
+    if (!process)
+    {
+        return ::GetLastError();
+    }
+
+    return ::DetourUpdateProcessWithDll(process.get(), &runtimePath, 1) ? ERROR_SUCCESS : ::GetLastError();
+}
+
+// The entry point that PsfRunDll calls in the broker process. Requests get served one at a time, since each one takes
+// next to no time; clients that find the pipe busy wait their turn
+extern "C" void CALLBACK PsfInjectionBroker(HWND, HINSTANCE instance, LPSTR, int) noexcept try
+{
+    if (!IsInjectionBrokerProcess())
+    {
+        return;
+    }
+
+    // The broker injects the PsfRuntime that it has loaded, which is the one with the architecture that its clients need
+    char runtimePath[MAX_PATH];
+    auto length = ::GetModuleFileNameA(instance, runtimePath, static_cast<DWORD>(std::size(runtimePath)));
+    if ((length == 0) || (length >= std::size(runtimePath)))
+    {
+        return;
+    }
+
+    // FILE_FLAG_FIRST_PIPE_INSTANCE makes sure that there's only ever one broker; if there's already another, we're done
+    psf::unique_handle pipe(::CreateNamedPipeW(
+        g_InjectionBrokerPipeName.c_str(),
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1,
+        sizeof(injection_response),
+        sizeof(injection_request),
+        0,
+        nullptr));
+    if (!pipe)
+    {
+        return;
+    }
+
+    psf::unique_handle event(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (!event)
+    {
+        return;
+    }
+
+    // We're likely to be asked to inject into the same few executables over and over
+    ::DetourSetReuseImportPatches(TRUE);
+
+    while (true)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = event.get();
+        ::ResetEvent(event.get());
+        if (!complete_overlapped(pipe.get(), overlapped, ::ConnectNamedPipe(pipe.get(), &overlapped), injection_broker_idle_timeout))
+        {
+            // Nobody has needed us in a while (or the pipe broke)
+            return;
+        }
+
+        injection_request request;
+        DWORD bytes = 0;
+        overlapped = {};
+        overlapped.hEvent = event.get();
+        ::ResetEvent(event.get());
+        if (complete_overlapped(pipe.get(), overlapped, ::ReadFile(pipe.get(), &request, sizeof(request), nullptr, &overlapped), injection_broker_request_timeout, &bytes) &&
+            (bytes == sizeof(request)))
+        {
+            injection_response response = { inject_for_client(request, runtimePath) };
+            overlapped = {};
+            overlapped.hEvent = event.get();
+            ::ResetEvent(event.get());
+            complete_overlapped(pipe.get(), overlapped, ::WriteFile(pipe.get(), &response, sizeof(response), nullptr, &overlapped), injection_broker_request_timeout);
+            ::FlushFileBuffers(pipe.get());
+        }
+
+        ::DisconnectNamedPipe(pipe.get());
+    }
+}
+catch (...)
+{
+}
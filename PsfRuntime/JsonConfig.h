@@ -2,13 +2,110 @@
 // Copyright (C) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
+//
+// The concrete types behind the config.json DOM. A document never changes once it's been parsed, so instead of giving
+// every node, string, and container an allocation of its own, all of them get carved out of large blocks on the PSF's
+// private heap. Each object's members are a single array sorted by key, each array's elements are a single array of
+// pointers, and each string is stored once, as UTF-8; the UTF-16 copy only gets made the first time it's asked for.
+// Strings that were parsed in place aren't even copied, and point into the caller's buffer instead.
+// NOTE: Fixups hold onto pointers into the DOM for as long as they please, so a document's memory is never freed, even
+//       when the json_document that built it is destroyed
 #pragma once
 
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
 #include <psf_config.h>
+#include <psf_runtime.h>
+#include <utilities.h>
+
+class json_arena
+{
+public:
+
+    // Large enough that even a big config.json only needs a handful of blocks
+    static constexpr std::size_t block_size = 64 * 1024;
+
+    json_arena() noexcept = default;
+    json_arena(const json_arena&) = delete;
+    json_arena& operator=(const json_arena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        assert(alignment <= MEMORY_ALLOCATION_ALIGNMENT);
+        auto offset = (m_used + alignment - 1) & ~(alignment - 1);
+        if (m_block && (offset <= block_size) && (size <= block_size - offset))
+        {
+            m_used = offset + size;
+            return m_block + offset;
+        }
+
+        // Anything too large to share a block (e.g. a long array) gets an allocation to itself, which leaves what's left
+        // of the current block for what comes after it
+        if (size > block_size / 4)
+        {
+            return checked_allocate(size);
+        }
+
+        m_block = static_cast<std::byte*>(checked_allocate(block_size));
+        m_used = size;
+        return m_block;
+    }
+
+    template <typename T>
+    T* allocate_array(std::size_t count)
+    {
+        static_assert(std::is_trivially_destructible_v<T>);
+        if (count > (std::numeric_limits<std::size_t>::max)() / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        static_assert(alignof(T) <= MEMORY_ALLOCATION_ALIGNMENT);
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // The copy is null terminated, but the terminator isn't part of the result
+    std::string_view copy_string(std::string_view str)
+    {
+        auto result = allocate_array<char>(str.length() + 1);
+        std::memcpy(result, str.data(), str.length());
+        result[str.length()] = '\0';
+        return { result, str.length() };
+    }
+
+private:
+
+    static void* checked_allocate(std::size_t size)
+    {
+        if (auto result = ::PSFAllocate(size))
+        {
+            return result;
+        }
+
+        throw std::bad_alloc();
+    }
+
+    std::byte* m_block = nullptr;
+    std::size_t m_used = 0;
+};
 
 struct json_null_impl : psf::json_null
 {
@@ -16,30 +113,88 @@ struct json_null_impl : psf::json_null
 
 struct json_string_impl : psf::json_string
 {
-    json_string_impl(std::string_view value) : narrow_string(value), wide_string(widen(value)) {}
+    // NOTE: 'value' must be null terminated and outlive the string, i.e. it should come from the document's arena
+    json_string_impl(std::string_view value) noexcept :
+        narrow_string(value.data()),
+        narrow_length(static_cast<unsigned>(value.length()))
+    {
+        assert(value.data()[value.length()] == '\0');
+    }
 
     virtual const char* narrow(_Out_opt_ unsigned* length) const noexcept override
     {
         if (length)
         {
-            *length = static_cast<unsigned>(narrow_string.length());
+            *length = narrow_length;
         }
 
-        return narrow_string.c_str();
+        return narrow_string;
     }
 
     virtual const wchar_t* wide(_Out_opt_ unsigned* length) const noexcept override
     {
+        auto result = wide_string.load(std::memory_order_acquire);
+        if (!result)
+        {
+            result = widen();
+            if (!result)
+            {
+                if (length)
+                {
+                    *length = 0;
+                }
+
+                return L"";
+            }
+        }
+
         if (length)
         {
-            *length = static_cast<unsigned>(wide_string.length());
+            *length = wide_length.load(std::memory_order_relaxed);
+        }
+
+        return result;
+    }
+
+    // Any number of threads may race to make the UTF-16 copy; the first one to finish wins and the rest throw theirs away.
+    // The UTF-8 came from rapidjson, so the only way for this to fail is to run out of memory, in which case the best
+    // that we can do without changing the interface is to hand out an empty string, and try again the next time.
+    // NOTE: A failure doesn't touch 'wide_length', since another thread may have already published a string to go with
+    //       it. Returns null if there's no string to hand out
+    const wchar_t* widen() const noexcept
+    {
+        psf::path_buffer buffer;
+        wchar_t* copy = nullptr;
+        if (::try_widen_into(std::string_view(narrow_string, narrow_length), buffer) == ERROR_SUCCESS)
+        {
+            copy = static_cast<wchar_t*>(::PSFAllocate((buffer.length() + 1) * sizeof(wchar_t)));
+        }
+
+        if (!copy)
+        {
+            return wide_string.load(std::memory_order_acquire);
         }
 
-        return wide_string.c_str();
+        std::memcpy(copy, buffer.data(), buffer.length() * sizeof(wchar_t));
+        copy[buffer.length()] = L'\0';
+
+        // The length is the same no matter which thread wins, so it's fine for every thread to store it
+        wide_length.store(static_cast<unsigned>(buffer.length()), std::memory_order_relaxed);
+
+        const wchar_t* expected = nullptr;
+        if (!wide_string.compare_exchange_strong(expected, copy, std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            ::PSFFree(copy);
+            return expected;
+        }
+
+        return copy;
     }
 
-    std::string narrow_string;
-    std::wstring wide_string;
+    const char* narrow_string;
+    unsigned narrow_length;
+    mutable std::atomic<const wchar_t*> wide_string = nullptr;
+    mutable std::atomic<unsigned> wide_length = 0;
 };
 
 struct json_number_impl : psf::json_number
@@ -93,128 +248,373 @@ struct json_boolean_impl : psf::json_boolean
 
 struct json_object_impl : psf::json_object
 {
-    using map_type = std::map<std::string, std::unique_ptr<psf::json_value>, std::less<>>;
-    using iterator_type = map_type::const_iterator;
+    struct member
+    {
+        std::string_view key; // Null terminated
+        json_value* value;
+    };
 
     virtual json_value* try_get(_In_ const char* key) const noexcept override
     {
-        if (auto itr = values.find(key); itr != values.end())
+        std::string_view target(key);
+        auto end = members + member_count;
+        auto itr = std::lower_bound(members, end, target, [](const member& entry, std::string_view value)
         {
-            return itr->second.get();
+            return entry.key < value;
+        });
+
+        if ((itr != end) && (itr->key == target))
+        {
+            return itr->value;
         }
 
         return nullptr;
     }
 
-    // We can elide allocations if the iterator fits within the size of a pointer (which should always be the case when
-    // building release)
-    static constexpr bool handle_requires_allocation = sizeof(iterator_type) > sizeof(enumeration_handle*);
-
+    // Members are contiguous, so the handle is just a pointer to the current member and enumeration never allocates
     virtual enumeration_handle* begin_enumeration(_Out_ enumeration_data* data) const noexcept override
     {
-        auto itr = values.begin();
-        if (itr == values.end())
+        if (member_count == 0)
         {
             *data = {};
             return nullptr;
         }
 
-        data->key = itr->first.c_str();
-        data->key_length = static_cast<unsigned>(itr->first.length());
-        data->value = itr->second.get();
+        return handle_from_member(members, data);
+    }
 
-        if constexpr (handle_requires_allocation)
+    virtual enumeration_handle* advance(_In_ enumeration_handle* handle, _Inout_ enumeration_data* data) const noexcept override
+    {
+        assert(handle);
+        auto next = reinterpret_cast<const member*>(handle) + 1;
+        if (next == members + member_count)
         {
-            return reinterpret_cast<enumeration_handle*>(new iterator_type(itr));
+            *data = {};
+            return nullptr;
         }
-        else
+
+        return handle_from_member(next, data);
+    }
+
+    virtual void cancel_enumeration(_In_ enumeration_handle*) const noexcept override
+    {
+    }
+
+    static enumeration_handle* handle_from_member(const member* entry, _Out_ enumeration_data* data) noexcept
+    {
+        data->key = entry->key.data();
+        data->key_length = static_cast<unsigned>(entry->key.length());
+        data->value = entry->value;
+        return reinterpret_cast<enumeration_handle*>(const_cast<member*>(entry));
+    }
+
+    // Sorted by key
+    const member* members = nullptr;
+    unsigned member_count = 0;
+};
+
+struct json_array_impl : psf::json_array
+{
+    virtual unsigned size() const noexcept override
+    {
+        return element_count;
+    }
+
+    virtual json_value* try_get_at(unsigned index) const noexcept override
+    {
+        if (index >= element_count)
         {
-            return handle_from_iterator(itr);
+            return nullptr;
         }
+
+        return elements[index];
     }
 
-    virtual enumeration_handle* advance(_In_ enumeration_handle* handle, _Inout_ enumeration_data* data) const noexcept override
+    psf::json_value* const* elements = nullptr;
+    unsigned element_count = 0;
+};
+
+// Builds the DOM from rapidjson's SAX events, i.e. this is a rapidjson Handler. E.g.:
+//      json_document document;
+//      auto result = reader.Parse(stream, document);
+// Containers only get their arrays of children once they've been closed and their size is known. Until then, their
+// children wait on a stack that is shared by all of the containers that are still open; since containers nest, the
+// children of the innermost one are always the ones at the top
+class json_document
+{
+public:
+
+    json_document() = default;
+    json_document(const json_document&) = delete;
+    json_document& operator=(const json_document&) = delete;
+
+    // Null until parsing succeeds
+    const psf::json_value* root() const noexcept
+    {
+        return m_root;
+    }
+
+    // When non-empty, provides a more useful error message displayed to the user for invalid config.json files
+    const std::string& error_message() const noexcept
+    {
+        return m_errorMessage;
+    }
+
+    bool Null()
+    {
+        return on_value(m_arena.make<json_null_impl>());
+    }
+
+    bool Bool(bool b)
+    {
+        return on_value(m_arena.make<json_boolean_impl>(b));
+    }
+
+    bool Int(std::int64_t value)
+    {
+        return on_value(m_arena.make<json_number_impl>(value));
+    }
+
+    bool Uint(std::uint64_t value)
+    {
+        return on_value(m_arena.make<json_number_impl>(value));
+    }
+
+    bool Int64(std::int64_t value)
+    {
+        return on_value(m_arena.make<json_number_impl>(value));
+    }
+
+    bool Uint64(std::uint64_t value)
+    {
+        return on_value(m_arena.make<json_number_impl>(value));
+    }
+
+    bool Double(double value)
+    {
+        return on_value(m_arena.make<json_number_impl>(value));
+    }
+
+    template <typename SizeType>
+    bool RawNumber(const char* /*str*/, SizeType /*length*/, bool /*copy*/)
+    {
+        // Provided only to satisfy compilation, but never called since we never pass kParseNumbersAsStringsFlag
+        // Consider: Update rapidjson to use if constexpr
+        assert(false);
+        return false;
+    }
+
+    template <typename SizeType>
+    bool String(const char* str, SizeType length, bool copy)
     {
-        auto& itr = iterator_from_handle(handle);
-        assert(itr != values.end());
+        return on_value(m_arena.make<json_string_impl>(keep_string(str, length, copy)));
+    }
 
-        ++itr;
-        if (itr == values.end())
+    bool StartObject()
+    {
+        // NOTE: We must call 'on_value' before appending to 'm_openContainers', otherwise we'll try and add the object as
+        //       a child of itself
+        auto obj = m_arena.make<json_object_impl>();
+        auto result = on_value(obj);
+        if (result)
         {
-            if constexpr (handle_requires_allocation)
-            {
-                delete &itr;
-            }
+            m_openContainers.push_back(open_container{ obj, m_pendingMembers.size() });
+        }
 
-            *data = {};
-            return nullptr;
+        return result;
+    }
+
+    template <typename SizeType>
+    bool Key(const char* str, SizeType length, bool copy)
+    {
+        assert(m_key.data() == nullptr);
+        m_key = keep_string(str, length, copy);
+        return true;
+    }
+
+    template <typename SizeType>
+    bool EndObject([[maybe_unused]] SizeType memberCount)
+    {
+        assert(!m_openContainers.empty());
+        auto current = m_openContainers.back();
+        assert(current.value->type() == psf::json_type::object);
+
+        auto first = m_pendingMembers.begin() + current.first_child;
+        auto count = static_cast<std::size_t>(m_pendingMembers.end() - first);
+        assert(count == memberCount);
+
+        std::sort(first, m_pendingMembers.end(), [](const json_object_impl::member& lhs, const json_object_impl::member& rhs)
+        {
+            return lhs.key < rhs.key;
+        });
+
+        auto duplicate = std::adjacent_find(first, m_pendingMembers.end(),
+            [](const json_object_impl::member& lhs, const json_object_impl::member& rhs)
+        {
+            return lhs.key == rhs.key;
+        });
+        if (duplicate != m_pendingMembers.end())
+        {
+            m_errorMessage = "'" + std::string(duplicate->key) + "' already exists in map";
+            return false;
         }
 
-        data->key = itr->first.c_str();
-        data->key_length = static_cast<unsigned>(itr->first.length());
-        data->value = itr->second.get();
+        auto obj = static_cast<json_object_impl*>(current.value);
+        auto members = m_arena.allocate_array<json_object_impl::member>(count);
+        std::copy(first, m_pendingMembers.end(), members);
+        obj->members = members;
+        obj->member_count = static_cast<unsigned>(count);
 
-        return handle_from_iterator(itr);
+        m_pendingMembers.erase(first, m_pendingMembers.end());
+        end_container();
+        return true;
     }
 
-    virtual void cancel_enumeration(_In_ enumeration_handle* handle) const noexcept override
+    bool StartArray()
     {
-        if constexpr (handle_requires_allocation)
+        // NOTE: We must call 'on_value' before appending to 'm_openContainers', otherwise we'll try and add the array as
+        //       a child of itself
+        auto arr = m_arena.make<json_array_impl>();
+        auto result = on_value(arr);
+        if (result)
         {
-            delete &iterator_from_handle(handle);
+            m_openContainers.push_back(open_container{ arr, m_pendingElements.size() });
         }
+
+        return result;
     }
 
-    iterator_type& iterator_from_handle(enumeration_handle*& handle) const noexcept
+    template <typename SizeType>
+    bool EndArray([[maybe_unused]] SizeType elementCount)
     {
-        assert(handle);
-        if constexpr (handle_requires_allocation)
+        assert(!m_openContainers.empty());
+        auto current = m_openContainers.back();
+        assert(current.value->type() == psf::json_type::array);
+
+        auto first = m_pendingElements.begin() + current.first_child;
+        auto count = static_cast<std::size_t>(m_pendingElements.end() - first);
+        assert(count == elementCount);
+
+        auto arr = static_cast<json_array_impl*>(current.value);
+        auto elements = m_arena.allocate_array<psf::json_value*>(count);
+        std::copy(first, m_pendingElements.end(), elements);
+        arr->elements = elements;
+        arr->element_count = static_cast<unsigned>(count);
+
+        m_pendingElements.erase(first, m_pendingElements.end());
+        end_container();
+        return true;
+    }
+
+    // How many children the innermost open container has so far
+    std::size_t open_container_size() const noexcept
+    {
+        assert(!m_openContainers.empty());
+        auto current = m_openContainers.back();
+        auto pending = (current.value->type() == psf::json_type::object) ? m_pendingMembers.size() : m_pendingElements.size();
+        return pending - current.first_child;
+    }
+
+    // Drops the innermost open container, along with everything in it, as if it had never been started, e.g. once it
+    // becomes clear that it isn't needed after all. Its memory stays in the arena
+    void discard_container() noexcept
+    {
+        assert(!m_openContainers.empty());
+        auto current = m_openContainers.back();
+        if (current.value->type() == psf::json_type::object)
         {
-            // Allocation means that the handle pointer is actually a pointer to a map iterator
-            return *reinterpret_cast<iterator_type*>(handle);
+            m_pendingMembers.resize(current.first_child);
         }
         else
         {
-            // No allocation means that the handle pointer _is_ the map iterator, e.g. as if it were a union
-            return reinterpret_cast<iterator_type&>(handle);
+            m_pendingElements.resize(current.first_child);
         }
-    }
+        m_openContainers.pop_back();
 
-    enumeration_handle* handle_from_iterator(iterator_type& itr) const noexcept
-    {
-        assert(itr != values.end());
-        if constexpr (handle_requires_allocation)
+        // The container itself is the most recent child of its parent
+        if (m_openContainers.empty())
+        {
+            m_root = nullptr;
+        }
+        else if (m_openContainers.back().value->type() == psf::json_type::object)
         {
-            // Allocation means that the handle pointer is actually a pointer to a map iterator
-            return reinterpret_cast<enumeration_handle*>(&itr);
+            m_pendingMembers.pop_back();
         }
         else
         {
-            // No allocation means that the handle pointer _is_ the map iterator, e.g. as if it were a union
-            // NOTE: We can reinterpret_cast a pointer to a reference, but not the other way around...
-            return *reinterpret_cast<enumeration_handle**>(&itr);
+            m_pendingElements.pop_back();
         }
     }
 
-    map_type values;
-};
+private:
 
-struct json_array_impl : psf::json_array
-{
-    virtual unsigned size() const noexcept override
+    // Strings that rapidjson doesn't ask us to copy were parsed in place, i.e. they're null terminated in memory that the
+    // caller keeps around for as long as the document is, so they can be used as they are
+    std::string_view keep_string(const char* str, std::size_t length, bool copy)
     {
-        return static_cast<unsigned>(values.size());
+        if (copy)
+        {
+            return m_arena.copy_string(std::string_view(str, length));
+        }
+
+        assert(str[length] == '\0');
+        return std::string_view(str, length);
     }
 
-    virtual json_value* try_get_at(unsigned index) const noexcept override
+    bool on_value(psf::json_value* value)
     {
-        if (index >= values.size())
+        if (!m_openContainers.empty())
         {
-            return nullptr;
+            assert(m_root);
+            if (m_openContainers.back().value->type() == psf::json_type::object)
+            {
+                assert(m_key.data() != nullptr);
+                m_pendingMembers.push_back(json_object_impl::member{ m_key, value });
+                m_key = {};
+            }
+            else
+            {
+                m_pendingElements.push_back(value);
+            }
+        }
+        else if (!m_root)
+        {
+            m_root = value;
+        }
+        else
+        {
+            m_errorMessage = "Can't have more than one root";
+            return false;
         }
 
-        return values[index].get();
+        return true;
     }
 
-    std::vector<std::unique_ptr<psf::json_value>> values;
+    void end_container() noexcept
+    {
+        m_openContainers.pop_back();
+        if (m_openContainers.empty())
+        {
+            // The document is complete, so stop holding onto the memory that was only needed to build it
+            m_pendingMembers = {};
+            m_pendingElements = {};
+            m_openContainers = {};
+        }
+    }
+
+    struct open_container
+    {
+        psf::json_value* value;
+        std::size_t first_child; // Index into m_pendingMembers or m_pendingElements, depending on the container's type
+    };
+
+    json_arena m_arena;
+    psf::json_value* m_root = nullptr;
+
+    std::vector<open_container> m_openContainers;
+    std::vector<json_object_impl::member> m_pendingMembers;
+    std::vector<psf::json_value*> m_pendingElements;
+    std::string_view m_key;
+
+    std::string m_errorMessage;
 };
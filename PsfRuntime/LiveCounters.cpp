@@ -0,0 +1,204 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Live counters are for dashboards that want to watch what the fixups of a running process are doing without the
+// process paying for anything per call. The fixups keep counting the way they already do (e.g. into per-thread blocks,
+// see FileRedirectionFixup's RedirectionTelemetry.cpp), and register a callback that writes their totals out. About once
+// a second, a thread pool timer calls every callback, with the entries pointing directly into a named section, so that
+// readers in other processes (e.g. PsfShimMonitor) only need to open the section by name and map it. The only
+// synchronization with readers is the sequence number in the header, which makes any update that they might have raced
+// with visible to them, so that they can retry.
+
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <psf_runtime.h>
+#include <psf_utils.h>
+#include <utilities.h>
+#include <win32_error.h>
+
+#include "Config.h"
+
+void Log(const char* fmt, ...);
+
+// Enough for every API of a few fixups; entries past that just don't get published
+constexpr std::size_t live_counter_capacity = 512;
+constexpr DWORD live_counter_period_ms = 1000;
+
+struct live_counters_source
+{
+    PSFLiveCountersProc callback;
+    void* context;
+    char fixup[sizeof(psf_live_counter_entry::fixup)];
+};
+
+// Held while the callbacks get called, so that unregistering waits for a call that's in progress
+static std::mutex g_LiveCountersMutex;
+static std::vector<live_counters_source> g_LiveCountersSources;
+static HANDLE g_LiveCountersSection = nullptr;
+static psf_live_counters_header* g_LiveCounters = nullptr;
+static PTP_TIMER g_LiveCountersTimer = nullptr;
+
+static psf_live_counter_entry* live_counter_entries() noexcept
+{
+    return reinterpret_cast<psf_live_counter_entry*>(reinterpret_cast<std::uint8_t*>(g_LiveCounters) + sizeof(psf_live_counters_header));
+}
+
+static void publish_live_counters() noexcept
+{
+    auto entries = live_counter_entries();
+    auto sequence = g_LiveCounters->sequence;
+    ::InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&g_LiveCounters->sequence), sequence + 1);
+
+    std::memset(entries, 0, live_counter_capacity * sizeof(psf_live_counter_entry));
+    std::size_t count = 0;
+    for (auto& source : g_LiveCountersSources)
+    {
+        auto remaining = live_counter_capacity - count;
+        if (remaining == 0)
+        {
+            break;
+        }
+
+        auto written = source.callback(source.context, entries + count, remaining);
+        written = (written < remaining) ? written : remaining;
+        for (std::size_t i = count; i < count + written; ++i)
+        {
+            std::memcpy(entries[i].fixup, source.fixup, sizeof(source.fixup));
+        }
+        count += written;
+    }
+
+    FILETIME now;
+    ::GetSystemTimeAsFileTime(&now);
+    g_LiveCounters->entry_count = static_cast<std::uint32_t>(count);
+    g_LiveCounters->update_time = (static_cast<std::uint64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+    ::InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&g_LiveCounters->sequence), sequence + 2);
+}
+
+static void CALLBACK LiveCountersTimerCallback(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER) noexcept
+{
+    std::lock_guard lock(g_LiveCountersMutex);
+    if (g_LiveCounters)
+    {
+        publish_live_counters();
+    }
+}
+
+// Called with g_LiveCountersMutex held, once the first source registers
+static void start_live_counters() noexcept
+{
+    constexpr auto size = sizeof(psf_live_counters_header) + live_counter_capacity * sizeof(psf_live_counter_entry);
+    auto name = L"Local\\PsfLiveCounters_" + std::to_wstring(::GetCurrentProcessId());
+    g_LiveCountersSection = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), name.c_str());
+    if (!g_LiveCountersSection)
+    {
+        Log("\tFailed to create the live counters section: %d\n", ::GetLastError());
+        return;
+    }
+
+    g_LiveCounters = static_cast<psf_live_counters_header*>(::MapViewOfFile(g_LiveCountersSection, FILE_MAP_WRITE, 0, 0, size));
+    if (!g_LiveCounters)
+    {
+        ::CloseHandle(g_LiveCountersSection);
+        g_LiveCountersSection = nullptr;
+        return;
+    }
+
+    // A new section is zeroed, so readers see no entries until the first update
+    g_LiveCounters->magic = psf_live_counters_magic;
+    g_LiveCounters->version = psf_live_counters_version;
+    g_LiveCounters->header_size = sizeof(psf_live_counters_header);
+    g_LiveCounters->entry_size = sizeof(psf_live_counter_entry);
+    g_LiveCounters->capacity = static_cast<std::uint32_t>(live_counter_capacity);
+    g_LiveCounters->process_id = ::GetCurrentProcessId();
+
+    g_LiveCountersTimer = ::CreateThreadpoolTimer(LiveCountersTimerCallback, nullptr, nullptr);
+    if (g_LiveCountersTimer)
+    {
+        // Relative due times are negative, in 100ns units. The window lets the timer coalesce with other timers
+        ULARGE_INTEGER dueTime;
+        dueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(live_counter_period_ms) * 10'000);
+        FILETIME fileDueTime{ dueTime.LowPart, dueTime.HighPart };
+        ::SetThreadpoolTimer(g_LiveCountersTimer, &fileDueTime, live_counter_period_ms, live_counter_period_ms / 10);
+    }
+}
+
+void UninitializeLiveCounters() noexcept
+{
+    // Like the fixups' own timers, we don't wait for the callback since we're called from within DllMain, but it checks
+    // for the view under the same lock that we clear it under
+    std::lock_guard lock(g_LiveCountersMutex);
+    if (g_LiveCountersTimer)
+    {
+        ::SetThreadpoolTimer(g_LiveCountersTimer, nullptr, 0, 0);
+    }
+
+    if (g_LiveCounters)
+    {
+        ::UnmapViewOfFile(g_LiveCounters);
+        g_LiveCounters = nullptr;
+    }
+
+    if (g_LiveCountersSection)
+    {
+        ::CloseHandle(g_LiveCountersSection);
+        g_LiveCountersSection = nullptr;
+    }
+
+    g_LiveCountersSources.clear();
+}
+
+PSFAPI DWORD __stdcall PSFRegisterLiveCounters(_In_ PSFLiveCountersProc callback, _In_opt_ void* context) noexcept try
+{
+    if (!LiveCountersEnabled())
+    {
+        return ERROR_SUCCESS;
+    }
+
+    live_counters_source source{ callback, context, {} };
+    HMODULE module;
+    if (::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+        reinterpret_cast<LPCWSTR>(callback), &module))
+    {
+        auto name = narrow(psf::get_module_path(module).stem().c_str());
+        name.copy(source.fixup, sizeof(source.fixup) - 1);
+    }
+
+    std::lock_guard lock(g_LiveCountersMutex);
+    g_LiveCountersSources.push_back(source);
+    if (!g_LiveCountersSection)
+    {
+        start_live_counters();
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterLiveCounters(_In_ PSFLiveCountersProc callback, _In_opt_ void* context) noexcept try
+{
+    std::lock_guard lock(g_LiveCountersMutex);
+    for (auto itr = g_LiveCountersSources.begin(); itr != g_LiveCountersSources.end(); ++itr)
+    {
+        if ((itr->callback == callback) && (itr->context == context))
+        {
+            g_LiveCountersSources.erase(itr);
+            return ERROR_SUCCESS;
+        }
+    }
+
+    return LiveCountersEnabled() ? ERROR_NOT_FOUND : ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
@@ -0,0 +1,218 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Memory accounting by module, for PSFQueryMemoryUsage. Each module that the PsfRuntime loads gets an entry, as does any
+// other module that allocates from the private heap, and PSFAllocate attributes each allocation to the entry of the
+// module that called it. Entries are never removed, since the fixups stay loaded until the process exits, so looking
+// one up is a scan of an array that only ever grows, without taking a lock. The rest of what a module costs comes from
+// its image - how big it is, and how many of its pages are private to the process - and from the callbacks that fixups
+// register for memory that the PsfRuntime can't see for itself.
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <windows.h>
+#include <psapi.h>
+#include <detours.h>
+#include <psf_runtime.h>
+#include <win32_error.h>
+
+#include "MemoryUsage.h"
+
+// Only a handful of modules ever allocate from the private heap. Allocations by the modules past this are unattributed
+constexpr std::size_t max_memory_usage_entries = 64;
+
+struct memory_usage_entry
+{
+    HMODULE module;
+    std::uintptr_t image_begin;
+    std::uintptr_t image_end;
+    std::atomic<std::uint64_t> heap_bytes;
+    std::atomic<std::uint64_t> heap_allocations;
+};
+
+struct memory_usage_source
+{
+    PSFMemoryUsageProc callback;
+    void* context;
+    HMODULE module;
+};
+
+// Entry zero is for memory that couldn't be attributed to a module. Entries are filled in under g_MemoryUsageMutex before
+// g_MemoryUsageEntryCount is incremented, so that looking them up doesn't need the lock
+static memory_usage_entry g_MemoryUsageEntries[max_memory_usage_entries] = {};
+static std::atomic<std::uint32_t> g_MemoryUsageEntryCount = 1;
+static std::mutex g_MemoryUsageMutex;
+
+// Held while the callbacks get called, so that unregistering waits for a call that's in progress
+static std::mutex g_MemoryUsageSourcesMutex;
+static std::vector<memory_usage_source> g_MemoryUsageSources;
+
+static std::uint32_t add_memory_usage_entry(HMODULE module) noexcept
+{
+    std::lock_guard lock(g_MemoryUsageMutex);
+    auto count = g_MemoryUsageEntryCount.load(std::memory_order_relaxed);
+    for (std::uint32_t i = 1; i < count; ++i)
+    {
+        // Another thread may have added it since we last looked
+        if (g_MemoryUsageEntries[i].module == module)
+        {
+            return i;
+        }
+    }
+
+    if (count == max_memory_usage_entries)
+    {
+        return 0;
+    }
+
+    auto& entry = g_MemoryUsageEntries[count];
+    entry.module = module;
+    entry.image_begin = reinterpret_cast<std::uintptr_t>(module);
+    entry.image_end = entry.image_begin + ::DetourGetModuleSize(module);
+    g_MemoryUsageEntryCount.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+std::uint32_t MemoryUsageEntry(const void* address) noexcept
+{
+    auto value = reinterpret_cast<std::uintptr_t>(address);
+    auto count = g_MemoryUsageEntryCount.load(std::memory_order_acquire);
+    for (std::uint32_t i = 1; i < count; ++i)
+    {
+        auto& entry = g_MemoryUsageEntries[i];
+        if ((value >= entry.image_begin) && (value < entry.image_end))
+        {
+            return i;
+        }
+    }
+
+    HMODULE module;
+    if (!::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+        static_cast<LPCWSTR>(address), &module))
+    {
+        return 0;
+    }
+
+    return add_memory_usage_entry(module);
+}
+
+void TrackMemoryUsage(HMODULE module) noexcept
+{
+    add_memory_usage_entry(module);
+}
+
+void AccountHeapUsage(std::uint32_t entry, std::int64_t bytes) noexcept
+{
+    auto& usage = g_MemoryUsageEntries[entry];
+    usage.heap_bytes.fetch_add(static_cast<std::uint64_t>(bytes), std::memory_order_relaxed);
+    usage.heap_allocations.fetch_add((bytes < 0) ? static_cast<std::uint64_t>(-1) : 1, std::memory_order_relaxed);
+}
+
+// Pages of the image that are in the working set but can't be shared with other processes, i.e. the ones that got
+// copied on write, which is where data that static initializers write to ends up
+static std::uint64_t private_image_bytes(const memory_usage_entry& entry)
+{
+    SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages((entry.image_end - entry.image_begin + info.dwPageSize - 1) / info.dwPageSize);
+    for (std::size_t i = 0; i < pages.size(); ++i)
+    {
+        pages[i].VirtualAddress = reinterpret_cast<void*>(entry.image_begin + i * info.dwPageSize);
+    }
+
+    if (pages.empty() || !::QueryWorkingSetEx(::GetCurrentProcess(), pages.data(), static_cast<DWORD>(pages.size() * sizeof(pages[0]))))
+    {
+        return 0;
+    }
+
+    std::uint64_t result = 0;
+    for (auto& page : pages)
+    {
+        if (page.VirtualAttributes.Valid && !page.VirtualAttributes.Shared)
+        {
+            result += info.dwPageSize;
+        }
+    }
+
+    return result;
+}
+
+PSFAPI std::size_t __stdcall PSFQueryMemoryUsage(_Out_writes_(capacity) psf_memory_usage* usage, std::size_t capacity) noexcept
+{
+    // The PsfRuntime always has an entry, whether or not it's allocated anything yet
+    MemoryUsageEntry(reinterpret_cast<const void*>(&PSFQueryMemoryUsage));
+
+    std::lock_guard lock(g_MemoryUsageSourcesMutex);
+    auto count = g_MemoryUsageEntryCount.load(std::memory_order_acquire);
+    for (std::uint32_t i = 0; (i < count) && (i < capacity); ++i)
+    {
+        auto& entry = g_MemoryUsageEntries[i];
+        auto& result = usage[i];
+        result.module = entry.module;
+        result.image_size = entry.image_end - entry.image_begin;
+        try
+        {
+            result.image_private_bytes = entry.module ? private_image_bytes(entry) : 0;
+        }
+        catch (...)
+        {
+            result.image_private_bytes = 0;
+        }
+        result.heap_bytes = entry.heap_bytes.load(std::memory_order_relaxed);
+        result.heap_allocations = entry.heap_allocations.load(std::memory_order_relaxed);
+
+        result.reported_bytes = 0;
+        for (auto& source : g_MemoryUsageSources)
+        {
+            if (source.module == entry.module)
+            {
+                result.reported_bytes += source.callback(source.context);
+            }
+        }
+    }
+
+    return count;
+}
+
+PSFAPI DWORD __stdcall PSFRegisterMemoryUsage(_In_ PSFMemoryUsageProc callback, _In_opt_ void* context) noexcept try
+{
+    // Callbacks in modules that can't be told apart count towards the unattributed entry, the same as their allocations
+    memory_usage_source source{ callback, context, nullptr };
+    if (auto entry = MemoryUsageEntry(reinterpret_cast<const void*>(callback)))
+    {
+        source.module = g_MemoryUsageEntries[entry].module;
+    }
+
+    std::lock_guard lock(g_MemoryUsageSourcesMutex);
+    g_MemoryUsageSources.push_back(source);
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterMemoryUsage(_In_ PSFMemoryUsageProc callback, _In_opt_ void* context) noexcept try
+{
+    std::lock_guard lock(g_MemoryUsageSourcesMutex);
+    for (auto itr = g_MemoryUsageSources.begin(); itr != g_MemoryUsageSources.end(); ++itr)
+    {
+        if ((itr->callback == callback) && (itr->context == context))
+        {
+            g_MemoryUsageSources.erase(itr);
+            return ERROR_SUCCESS;
+        }
+    }
+
+    return ERROR_NOT_FOUND;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
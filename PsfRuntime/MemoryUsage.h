@@ -0,0 +1,21 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+
+#include <windows.h>
+
+// Attributes memory to the modules that use it, for PSFQueryMemoryUsage. See MemoryUsage.cpp
+
+// The memory usage entry of the module that 'address' is in, which gets added if the module doesn't have one yet. Zero,
+// i.e. the entry for memory that couldn't be attributed, if 'address' isn't in a module or there are too many of them
+std::uint32_t MemoryUsageEntry(const void* address) noexcept;
+
+// Makes sure that a fixup has an entry, even if it never allocates from the private heap
+void TrackMemoryUsage(HMODULE module) noexcept;
+
+// Adds an allocation of 'bytes' from the private heap to the entry's totals, or removes it when 'bytes' is negative
+void AccountHeapUsage(std::uint32_t entry, std::int64_t bytes) noexcept;
@@ -0,0 +1,408 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Some fixups detour functions in modules that the application only loads later on, if ever (e.g. a plugin, or a dll
+// that only gets used for one feature). Rather than loading the module up front just to detour it, such detours get
+// registered with PSFRegisterOnModuleLoad, and are attached from a loader notification once the module loads, in a
+// single transaction per module. When the module unloads again, its detours get detached and wait for the next load.
+//
+// Registrations made while the fixups initialize are held until the fixups' other detours have been applied (see
+// DeferredRegistration.cpp), so that a fixup that fails to initialize never has any of its detours attached. Those whose
+// modules are already loaded by then get attached together, in one more transaction.
+//
+// By the time a module loads, the application has usually started threads of its own, any of which could be running
+// the code being patched. So unlike the transactions at startup, which only ever have the current thread to worry
+// about, these suspend every other thread for the commit (see detours::transaction::suspend_all_threads), and report
+// how long for, since that's time that the whole application stands still.
+//
+// NOTE: Loader notifications are delivered with the loader lock held, so the lock here is only ever held to claim
+//       registrations. Looking up modules and procedures, and the transactions themselves, happen outside of it
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <winternl.h>
+#include <detour_transaction.h>
+#include <psf_runtime.h>
+
+#include "DeferredRegistration.h"
+#include "ImportTableHooks.h"
+#include "ModuleLoadRegistration.h"
+#include "StartupTimings.h"
+
+// From the documentation for LdrRegisterDllNotification; these aren't in any SDK header
+constexpr ULONG LDR_DLL_NOTIFICATION_REASON_LOADED = 1;
+constexpr ULONG LDR_DLL_NOTIFICATION_REASON_UNLOADED = 2;
+
+struct LDR_DLL_NOTIFICATION_DATA
+{
+    ULONG Flags;
+    const UNICODE_STRING* FullDllName;
+    const UNICODE_STRING* BaseDllName;
+    void* DllBase;
+    ULONG SizeOfImage;
+};
+
+using LdrDllNotificationProc = void (CALLBACK*)(ULONG reason, const LDR_DLL_NOTIFICATION_DATA* data, void* context);
+using LdrRegisterDllNotificationProc = NTSTATUS (NTAPI*)(ULONG flags, LdrDllNotificationProc callback, void* context, void** cookie);
+using LdrUnregisterDllNotificationProc = NTSTATUS (NTAPI*)(void* cookie);
+
+struct module_load_registration
+{
+    std::wstring module_name;
+    std::string proc_name;
+    void** impl_fn;
+    void* fixup_fn;
+
+    bool held = false; // Registered while registrations were being deferred, and not yet released
+    HMODULE module = nullptr; // Non-null once claimed, i.e. while the detour is attached (or being attached)
+    bool attached = false;
+};
+
+static std::mutex g_ModuleLoadMutex;
+static std::list<module_load_registration> g_ModuleLoadRegistrations; // A list so that claimed entries stay put
+static void* g_DllNotificationCookie = nullptr;
+
+static bool module_name_equals(const std::wstring& name, const UNICODE_STRING& baseName) noexcept
+{
+    return ::CompareStringOrdinal(name.c_str(), static_cast<int>(name.length()), baseName.Buffer,
+        baseName.Length / sizeof(wchar_t), TRUE) == CSTR_EQUAL;
+}
+
+template <typename Predicate>
+static std::vector<module_load_registration*> claim(HMODULE module, Predicate&& predicate)
+{
+    std::vector<module_load_registration*> result;
+    std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+    for (auto& entry : g_ModuleLoadRegistrations)
+    {
+        if (!entry.held && !entry.module && predicate(entry))
+        {
+            result.push_back(&entry);
+            entry.module = module;
+        }
+    }
+
+    return result;
+}
+
+static void unclaim(const std::vector<module_load_registration*>& entries) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+    for (auto entry : entries)
+    {
+        entry->module = nullptr;
+        entry->attached = false;
+    }
+}
+
+// Resolves the claimed entries' procedures and attaches them, either in a transaction of our own or in whatever
+// transaction the caller has open. Entries whose procedure can't be found stay claimed, but don't get attached, so that
+// they're not looked for again until the module is reloaded
+static DWORD attach_claimed(const std::vector<module_load_registration*>& entries, bool ownTransaction)
+{
+    std::vector<module_load_registration*> attachable;
+    for (auto entry : entries)
+    {
+        if (auto proc = ::GetProcAddress(entry->module, entry->proc_name.c_str()))
+        {
+            *entry->impl_fn = reinterpret_cast<void*>(proc);
+            attachable.push_back(entry);
+        }
+    }
+
+    if (attachable.empty())
+    {
+        return ERROR_SUCCESS;
+    }
+
+    auto attachAll = [&]
+    {
+        for (auto entry : attachable)
+        {
+            if (auto error = ::DetourAttach(entry->impl_fn, entry->fixup_fn))
+            {
+                return error;
+            }
+        }
+
+        return static_cast<LONG>(ERROR_SUCCESS);
+    };
+
+    if (ownTransaction)
+    {
+        auto transaction = detours::transaction();
+        check_win32(attachAll());
+        transaction.suspend_all_threads();
+        transaction.commit();
+        ReportThreadSuspension(attachable.front()->module_name.c_str(), attachable.size());
+    }
+    else if (auto error = attachAll())
+    {
+        return error;
+    }
+
+    std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+    for (auto entry : attachable)
+    {
+        entry->attached = true;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static void CALLBACK DllNotification(ULONG reason, const LDR_DLL_NOTIFICATION_DATA* data, void*) noexcept try
+{
+    auto module = reinterpret_cast<HMODULE>(data->DllBase);
+    if (reason == LDR_DLL_NOTIFICATION_REASON_LOADED)
+    {
+        import_table_hooks_module_loaded(module, *data->FullDllName);
+
+        auto entries = claim(module, [&](const module_load_registration& entry)
+        {
+            return module_name_equals(entry.module_name, *data->BaseDllName);
+        });
+
+        if (!entries.empty())
+        {
+            try
+            {
+                attach_claimed(entries, true);
+            }
+            catch (...)
+            {
+                // Leave them for the next time that the module loads
+                unclaim(entries);
+            }
+        }
+    }
+    else if (reason == LDR_DLL_NOTIFICATION_REASON_UNLOADED)
+    {
+        import_table_hooks_module_unloaded(module);
+
+        std::vector<module_load_registration*> entries;
+        {
+            std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+            for (auto& entry : g_ModuleLoadRegistrations)
+            {
+                if (entry.module == module)
+                {
+                    entries.push_back(&entry);
+                }
+            }
+        }
+
+        if (entries.empty())
+        {
+            return;
+        }
+
+        // The module is about to go away, so there's nothing to do if this fails, other than to forget about it
+        try
+        {
+            auto transaction = detours::transaction();
+            for (auto entry : entries)
+            {
+                if (entry->attached)
+                {
+                    ::DetourDetach(entry->impl_fn, entry->fixup_fn);
+                }
+            }
+            transaction.suspend_all_threads();
+            transaction.commit();
+            ReportThreadSuspension(entries.front()->module_name.c_str(), entries.size());
+        }
+        catch (...)
+        {
+        }
+
+        unclaim(entries);
+    }
+}
+catch (...)
+{
+}
+
+void register_dll_notification() noexcept
+{
+    static std::once_flag once;
+    std::call_once(once, []
+    {
+        auto ntdll = ::GetModuleHandleW(L"ntdll.dll");
+        auto registerNotification = reinterpret_cast<LdrRegisterDllNotificationProc>(::GetProcAddress(ntdll, "LdrRegisterDllNotification"));
+        if (!registerNotification || !NT_SUCCESS(registerNotification(0, DllNotification, nullptr, &g_DllNotificationCookie)))
+        {
+            // Registrations for modules that are already loaded still work
+            g_DllNotificationCookie = nullptr;
+        }
+    });
+}
+
+// Claims each of the entries whose module is currently loaded. Anything that loads in the meantime gets claimed by the
+// notification instead
+static std::vector<module_load_registration*> claim_loaded(const std::vector<module_load_registration*>& candidates)
+{
+    std::vector<module_load_registration*> result;
+    for (auto candidate : candidates)
+    {
+        if (auto module = ::GetModuleHandleW(candidate->module_name.c_str()))
+        {
+            auto claimed = claim(module, [&](const module_load_registration& entry) { return &entry == candidate; });
+            result.insert(result.end(), claimed.begin(), claimed.end());
+        }
+    }
+
+    return result;
+}
+
+std::size_t module_load_registration_count() noexcept
+{
+    std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+    return g_ModuleLoadRegistrations.size();
+}
+
+void discard_module_load_registrations(std::size_t count) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+    while (g_ModuleLoadRegistrations.size() > count)
+    {
+        g_ModuleLoadRegistrations.pop_back();
+    }
+}
+
+void release_module_load_registrations() noexcept try
+{
+    std::vector<module_load_registration*> released;
+    {
+        std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+        for (auto& entry : g_ModuleLoadRegistrations)
+        {
+            if (entry.held)
+            {
+                entry.held = false;
+                released.push_back(&entry);
+            }
+        }
+    }
+
+    auto entries = claim_loaded(released);
+    if (entries.empty())
+    {
+        return;
+    }
+
+    try
+    {
+        attach_claimed(entries, true);
+    }
+    catch (...)
+    {
+        unclaim(entries);
+    }
+}
+catch (...)
+{
+}
+
+void UninitializeModuleLoadRegistrations() noexcept
+{
+    if (g_DllNotificationCookie)
+    {
+        auto ntdll = ::GetModuleHandleW(L"ntdll.dll");
+        if (auto unregisterNotification = reinterpret_cast<LdrUnregisterDllNotificationProc>(::GetProcAddress(ntdll, "LdrUnregisterDllNotification")))
+        {
+            unregisterNotification(g_DllNotificationCookie);
+        }
+        g_DllNotificationCookie = nullptr;
+    }
+}
+
+// API definitions
+PSFAPI DWORD __stdcall PSFRegisterOnModuleLoad(_In_reads_(count) const psf_lazy_registration* registrations, std::size_t count) noexcept try
+{
+    register_dll_notification();
+
+    auto held = deferred_registrations::active() != nullptr;
+    std::list<module_load_registration> added;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto& registration = registrations[i];
+        added.push_back(module_load_registration{ registration.moduleName, registration.procName, registration.implFn, registration.fixupFn, held });
+    }
+
+    // NOTE: Splicing keeps the elements where they are
+    std::vector<module_load_registration*> candidates;
+    for (auto& entry : added)
+    {
+        candidates.push_back(&entry);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+        g_ModuleLoadRegistrations.splice(g_ModuleLoadRegistrations.end(), added);
+    }
+
+    if (held)
+    {
+        // See release_module_load_registrations
+        return ERROR_SUCCESS;
+    }
+
+    auto entries = claim_loaded(candidates);
+    if (auto error = attach_claimed(entries, false))
+    {
+        // Anything that the notification claimed in the meantime is its business
+        unclaim(entries);
+        std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+        g_ModuleLoadRegistrations.remove_if([&](const module_load_registration& entry)
+        {
+            return !entry.module && (std::find(candidates.begin(), candidates.end(), &entry) != candidates.end());
+        });
+        return error;
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterOnModuleLoad(_In_reads_(count) const psf_lazy_registration* registrations, std::size_t count) noexcept
+{
+    DWORD result = ERROR_SUCCESS;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto& registration = registrations[i];
+
+        bool found = false;
+        bool attached = false;
+        {
+            std::lock_guard<std::mutex> lock(g_ModuleLoadMutex);
+            auto itr = std::find_if(g_ModuleLoadRegistrations.begin(), g_ModuleLoadRegistrations.end(), [&](const module_load_registration& entry)
+            {
+                return (entry.impl_fn == registration.implFn) && (entry.fixup_fn == registration.fixupFn);
+            });
+
+            if (itr != g_ModuleLoadRegistrations.end())
+            {
+                found = true;
+                attached = itr->attached;
+                g_ModuleLoadRegistrations.erase(itr);
+            }
+        }
+
+        // Same as PSFUnregister, i.e. in whatever transaction the caller has open
+        auto error = !found ? ERROR_INVALID_OPERATION :
+            attached ? ::PSFUnregister(registration.implFn, registration.fixupFn) : ERROR_SUCCESS;
+        result = result ? result : error;
+    }
+
+    return result;
+}
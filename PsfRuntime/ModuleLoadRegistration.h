@@ -0,0 +1,25 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+
+// How many PSFRegisterOnModuleLoad registrations there are so far, for use with discard_module_load_registrations
+std::size_t module_load_registration_count() noexcept;
+
+// Drops the registrations after the first 'count', e.g. because the fixup that made them failed to initialize. Only
+// meant for use while registrations are being deferred, since it doesn't detach anything
+void discard_module_load_registrations(std::size_t count) noexcept;
+
+// Attaches the registrations made while registrations were being deferred whose modules are already loaded, in a single
+// transaction, and starts watching for the rest. Called once the deferred registrations have been applied
+void release_module_load_registrations() noexcept;
+
+// Starts listening for module loads, if it hasn't already. Import table hooks (see ImportTableHooks.cpp) use the same
+// notification for the dlls that load after they're installed
+void register_dll_notification() noexcept;
+
+// Stops listening for module loads; called when the PsfRuntime unloads
+void UninitializeModuleLoadRegistrations() noexcept;
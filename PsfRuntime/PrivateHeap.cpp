@@ -0,0 +1,97 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The heap behind PSFAllocate/PSFFree. It gets created on first use, since the config.json DOM is built on it during
+// attach, and is never destroyed: fixups and static destructors can still be freeing memory as the dll unloads, and the
+// memory goes away with the process anyway. If the heap can't be created, allocations fall back to the process heap so
+// that the PSF still works, just without the separation. Each allocation counts against the module that called
+// PSFAllocate (see MemoryUsage.cpp), which gets recorded in a header in front of it.
+
+#include <atomic>
+#include <cstdint>
+#include <intrin.h>
+#include <limits>
+
+#include <windows.h>
+#include <psf_runtime.h>
+
+#include "MemoryUsage.h"
+
+#pragma intrinsic(_ReturnAddress)
+
+// The size of the alignment that HeapAlloc guarantees, so that the allocation that follows it is aligned the same
+struct alignas(MEMORY_ALLOCATION_ALIGNMENT) allocation_header
+{
+    std::uint32_t memory_usage_entry;
+};
+static_assert(sizeof(allocation_header) == MEMORY_ALLOCATION_ALIGNMENT);
+
+static std::atomic<std::uint64_t> g_HeapBytes = 0;
+static std::atomic<std::uint64_t> g_HeapAllocations = 0;
+
+static HANDLE create_private_heap() noexcept
+{
+    // NOTE: The low fragmentation heap can only be enabled on growable heaps, i.e. a maximum size of zero. Recent
+    //       versions of Windows enable it by default, so failing to set it isn't worth failing over
+    auto heap = ::HeapCreate(0, 0, 0);
+    if (!heap)
+    {
+        return ::GetProcessHeap();
+    }
+
+    ULONG lowFragmentationHeap = 2;
+    ::HeapSetInformation(heap, HeapCompatibilityInformation, &lowFragmentationHeap, sizeof(lowFragmentationHeap));
+    return heap;
+}
+
+static HANDLE private_heap() noexcept
+{
+    static const HANDLE heap = create_private_heap();
+    return heap;
+}
+
+PSFAPI void* __stdcall PSFAllocate(std::size_t size) noexcept
+{
+    if (size > (std::numeric_limits<std::size_t>::max)() - sizeof(allocation_header))
+    {
+        return nullptr;
+    }
+
+    auto heap = private_heap();
+    auto header = static_cast<allocation_header*>(::HeapAlloc(heap, 0, sizeof(allocation_header) + size));
+    if (!header)
+    {
+        return nullptr;
+    }
+
+    auto bytes = ::HeapSize(heap, 0, header);
+    header->memory_usage_entry = MemoryUsageEntry(_ReturnAddress());
+    AccountHeapUsage(header->memory_usage_entry, static_cast<std::int64_t>(bytes));
+    g_HeapBytes += bytes;
+    ++g_HeapAllocations;
+    return header + 1;
+}
+
+PSFAPI void __stdcall PSFFree(_In_opt_ void* ptr) noexcept
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    auto heap = private_heap();
+    auto header = static_cast<allocation_header*>(ptr) - 1;
+    auto bytes = ::HeapSize(heap, 0, header);
+    AccountHeapUsage(header->memory_usage_entry, -static_cast<std::int64_t>(bytes));
+    g_HeapBytes -= bytes;
+    --g_HeapAllocations;
+    ::HeapFree(heap, 0, header);
+}
+
+PSFAPI void __stdcall PSFQueryHeapUsage(_Out_ std::uint64_t* bytes, _Out_ std::uint64_t* allocations) noexcept
+{
+    *bytes = g_HeapBytes;
+    *allocations = g_HeapAllocations;
+}
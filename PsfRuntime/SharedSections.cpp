@@ -0,0 +1,212 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Fixups that build read-only data once and keep it in a section (e.g. a mapped cache file in the redirect root) can
+// publish that section here. When CreateProcessFixup injects the PsfRuntime into a child process of the package, it
+// duplicates every published section into the child with read-only access, and hands the child the handle values
+// through a Detours payload. The child's PsfRuntime picks those up during attach, so its fixups can map the parent's
+// data directly instead of opening, validating, or even rebuilding it. Child processes publish the sections that they
+// inherited too (unless a fixup replaces them), so grandchildren get them as well.
+//
+// The PsfRuntime shares one section of its own this way: the prologues that Detours has disassembled (see
+// DetourSetPrologueCache), which for the processes of a package are mostly those of the same functions in the same
+// builds of the same system dlls. It only gets created once the process starts its first child, and a child that
+// inherits one just passes it on.
+//
+// NOTE: Sections are identified by a GUID chosen by the fixup. A fixup must validate the contents of an inherited
+//       section the same way it would validate a file, since the parent may have been configured differently
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+#include <psf_runtime.h>
+
+void Log(const char* fmt, ...);
+
+// {6B0E5D4C-2F0A-4C36-9C43-6F6A3C2D8E71}
+constexpr GUID shared_section_payload_id = { 0x6b0e5d4c, 0x2f0a, 0x4c36, { 0x9c, 0x43, 0x6f, 0x6a, 0x3c, 0x2d, 0x8e, 0x71 } };
+
+// Handle values are always passed as 64-bit so that the layout doesn't depend on the parent's architecture
+struct shared_section_payload_entry
+{
+    GUID id;
+    std::uint64_t handle;
+    std::uint64_t size;
+};
+
+struct shared_section
+{
+    GUID id;
+    HANDLE handle;
+    std::uint64_t size;
+};
+
+// {3E8B1F62-7C4D-4A9E-B5D1-9A2F6C0E4B37}
+constexpr GUID prologue_cache_section_id = { 0x3e8b1f62, 0x7c4d, 0x4a9e, { 0xb5, 0xd1, 0x9a, 0x2f, 0x6c, 0x0e, 0x4b, 0x37 } };
+
+std::mutex g_SharedSectionsMutex;
+std::vector<shared_section> g_SharedSections;
+static bool g_PrologueCacheShared = false;
+
+void LoadInheritedSharedSections() noexcept try
+{
+    DWORD size = 0;
+    auto payload = static_cast<const shared_section_payload_entry*>(::DetourFindPayloadEx(shared_section_payload_id, &size));
+    if (!payload)
+    {
+        return;
+    }
+
+    std::lock_guard lock(g_SharedSectionsMutex);
+    for (DWORD i = 0; i < size / sizeof(shared_section_payload_entry); ++i)
+    {
+        g_SharedSections.push_back({ payload[i].id, reinterpret_cast<HANDLE>(static_cast<std::uintptr_t>(payload[i].handle)), payload[i].size });
+    }
+}
+catch (...)
+{
+    // Out of memory. The fixups will just do their own thing
+}
+
+void LoadInheritedPrologueCache() noexcept
+{
+    std::uint64_t size;
+    if (auto section = ::PSFQuerySharedSection(prologue_cache_section_id, &size); section && (size <= MAXDWORD))
+    {
+        // The view stays mapped for as long as the process runs, since Detours keeps using it. Detours validates the
+        // header, and each entry against the target's bytes before using it
+        if (auto view = ::MapViewOfFile(section, FILE_MAP_READ, 0, 0, static_cast<SIZE_T>(size)))
+        {
+            if (::DetourSetPrologueCache(view, static_cast<DWORD>(size), FALSE))
+            {
+                g_PrologueCacheShared = true;
+                return;
+            }
+            ::UnmapViewOfFile(view);
+        }
+    }
+
+    ::DetourSetPrologueCache(nullptr, 0, TRUE);
+}
+
+static void share_prologue_cache() noexcept
+{
+    if (g_PrologueCacheShared)
+    {
+        return;
+    }
+
+    // Some other thread may be in the middle of a transaction, and with it, of recording prologues. Starting one of our
+    // own keeps them out until we're done, and if that fails, there's always the next child
+    if (::DetourTransactionBegin() != NO_ERROR)
+    {
+        return;
+    }
+
+    auto size = ::DetourGetPrologueCache(nullptr, 0);
+    auto section = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, size, nullptr);
+    auto view = section ? ::MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size) : nullptr;
+    if (view)
+    {
+        ::DetourGetPrologueCache(view, size);
+        ::UnmapViewOfFile(view);
+    }
+    ::DetourTransactionAbort();
+
+    if (view && ::PSFPublishSharedSection(prologue_cache_section_id, section, size))
+    {
+        g_PrologueCacheShared = true;
+    }
+
+    if (section)
+    {
+        ::CloseHandle(section);
+    }
+}
+
+void ShareSectionsWithChildProcess(HANDLE process) noexcept try
+{
+    share_prologue_cache();
+
+    std::vector<shared_section_payload_entry> payload;
+    {
+        std::lock_guard lock(g_SharedSectionsMutex);
+        for (auto& section : g_SharedSections)
+        {
+            HANDLE childHandle;
+            if (::DuplicateHandle(::GetCurrentProcess(), section.handle, process, &childHandle, SECTION_MAP_READ | SECTION_QUERY, FALSE, 0))
+            {
+                payload.push_back({ section.id, reinterpret_cast<std::uintptr_t>(childHandle), section.size });
+            }
+        }
+    }
+
+    if (!payload.empty() &&
+        !::DetourCopyPayloadToProcess(process, shared_section_payload_id, payload.data(), static_cast<DWORD>(payload.size() * sizeof(payload[0]))))
+    {
+        // The handles stay open in the child until it exits, which is harmless
+        Log("\tUnable to share sections with child process err=0x%x\n", ::GetLastError());
+    }
+}
+catch (...)
+{
+    // Same as above
+}
+
+PSFAPI BOOL __stdcall PSFPublishSharedSection(_In_ const GUID& id, _In_ HANDLE section, std::uint64_t size) noexcept try
+{
+    // Hold onto our own read-only handle so that the caller is free to close theirs, and so that children can never get
+    // write access through us
+    HANDLE handle;
+    if (!::DuplicateHandle(::GetCurrentProcess(), section, ::GetCurrentProcess(), &handle, SECTION_MAP_READ | SECTION_QUERY, FALSE, 0))
+    {
+        return FALSE;
+    }
+
+    std::lock_guard lock(g_SharedSectionsMutex);
+    for (auto& existing : g_SharedSections)
+    {
+        if (existing.id == id)
+        {
+            // NOTE: Fixups may still have views of the old section mapped, which keep it alive on their own
+            ::CloseHandle(existing.handle);
+            existing.handle = handle;
+            existing.size = size;
+            return TRUE;
+        }
+    }
+
+    g_SharedSections.push_back({ id, handle, size });
+    return TRUE;
+}
+catch (...)
+{
+    ::SetLastError(ERROR_OUTOFMEMORY);
+    return FALSE;
+}
+
+PSFAPI HANDLE __stdcall PSFQuerySharedSection(_In_ const GUID& id, _Out_ std::uint64_t* size) noexcept try
+{
+    std::lock_guard lock(g_SharedSectionsMutex);
+    for (auto& section : g_SharedSections)
+    {
+        if (section.id == id)
+        {
+            *size = section.size;
+            return section.handle;
+        }
+    }
+
+    *size = 0;
+    return nullptr;
+}
+catch (...)
+{
+    *size = 0;
+    return nullptr;
+}
@@ -0,0 +1,137 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Timings of what the PsfRuntime does before the application's entry point runs, so that there are numbers to go by
+// when deciding what about startup is worth making faster. They're kept in a fixed array so that the pointers that
+// PSFQueryStartupTimings hands out stay valid, and are written once as a TraceLogging event, which costs next to
+// nothing when nobody is listening. Only the thread that initializes the PsfRuntime records timings, so the only
+// synchronization needed is for publishing new entries to PSFQueryStartupTimings callers.
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+#include <detours.h>
+#include <psf_runtime.h>
+
+#include "StartupTimings.h"
+
+TRACELOGGING_DEFINE_PROVIDER(
+    g_PsfRuntimeProvider,
+    "Microsoft-Windows-PSFRuntime",
+    (0x7aa900a4, 0xff44, 0x4868, 0x8d, 0xad, 0x2d, 0x74, 0x5c, 0xff, 0x22, 0xeb));
+
+// Enough for several dozen fixups; anything past that just doesn't get timed
+constexpr std::size_t max_startup_timings = 128;
+constexpr std::size_t no_startup_timing = ~static_cast<std::size_t>(0);
+
+static psf_startup_timing g_StartupTimings[max_startup_timings];
+static std::atomic<std::size_t> g_StartupTimingCount = 0;
+
+static std::int64_t query_performance_counter() noexcept
+{
+    LARGE_INTEGER value;
+    ::QueryPerformanceCounter(&value);
+    return value.QuadPart;
+}
+
+startup_timer::startup_timer(psf_startup_phase phase, const wchar_t* name) noexcept :
+    m_index(g_StartupTimingCount.load(std::memory_order_relaxed))
+{
+    if (m_index >= max_startup_timings)
+    {
+        m_index = no_startup_timing;
+        return;
+    }
+
+    auto& timing = g_StartupTimings[m_index];
+    timing.phase = phase;
+    timing.name = name;
+    timing.start = query_performance_counter();
+    timing.end = 0;
+    g_StartupTimingCount.store(m_index + 1, std::memory_order_release);
+}
+
+startup_timer::~startup_timer()
+{
+    if (m_index != no_startup_timing)
+    {
+        g_StartupTimings[m_index].end = query_performance_counter();
+    }
+}
+
+void ReportStartupTimings() noexcept try
+{
+    TraceLoggingRegister(g_PsfRuntimeProvider);
+    if (TraceLoggingProviderEnabled(g_PsfRuntimeProvider, 0, 0))
+    {
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency(&frequency);
+
+        // Microseconds, relative to the start of the first phase. Names are ';' separated, in the order of the phases
+        // that have one
+        auto count = g_StartupTimingCount.load(std::memory_order_acquire);
+        std::uint32_t phases[max_startup_timings];
+        std::int64_t offsets[max_startup_timings];
+        std::int64_t durations[max_startup_timings];
+        std::wstring names;
+        auto microseconds = [&](std::int64_t ticks) { return ticks * 1000000 / frequency.QuadPart; };
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto& timing = g_StartupTimings[i];
+            phases[i] = static_cast<std::uint32_t>(timing.phase);
+            offsets[i] = microseconds(timing.start - g_StartupTimings[0].start);
+            durations[i] = timing.end ? microseconds(timing.end - timing.start) : -1;
+            if (timing.name)
+            {
+                if (!names.empty())
+                {
+                    names += L';';
+                }
+                names += timing.name;
+            }
+        }
+
+        auto total = count ? microseconds(query_performance_counter() - g_StartupTimings[0].start) : 0;
+        TraceLoggingWrite(g_PsfRuntimeProvider,
+            "StartupTimings",
+            TraceLoggingWideString(::PSFQueryApplicationUserModelId(), "ApplicationUserModelId"),
+            TraceLoggingUInt32Array(phases, static_cast<UINT16>(count), "Phases"),
+            TraceLoggingInt64Array(offsets, static_cast<UINT16>(count), "Offsets"),
+            TraceLoggingInt64Array(durations, static_cast<UINT16>(count), "Durations"),
+            TraceLoggingWideString(names.c_str(), "Names"),
+            TraceLoggingInt64(total, "Total"));
+    }
+    TraceLoggingUnregister(g_PsfRuntimeProvider);
+}
+catch (...)
+{
+    TraceLoggingUnregister(g_PsfRuntimeProvider);
+}
+
+void ReportThreadSuspension(const wchar_t* name, std::size_t detours) noexcept
+{
+    DWORD threads;
+    ULONGLONG microseconds;
+    ::DetourGetLastSuspension(&threads, &microseconds);
+
+    TraceLoggingRegister(g_PsfRuntimeProvider);
+    TraceLoggingWrite(g_PsfRuntimeProvider,
+        "ThreadSuspension",
+        TraceLoggingWideString(::PSFQueryApplicationUserModelId(), "ApplicationUserModelId"),
+        TraceLoggingWideString(name, "Name"),
+        TraceLoggingUInt64(detours, "Detours"),
+        TraceLoggingUInt32(threads, "SuspendedThreads"),
+        TraceLoggingUInt64(microseconds, "Microseconds"));
+    TraceLoggingUnregister(g_PsfRuntimeProvider);
+}
+
+PSFAPI const psf_startup_timing* __stdcall PSFQueryStartupTimings(_Out_ std::size_t* count) noexcept
+{
+    *count = g_StartupTimingCount.load(std::memory_order_acquire);
+    return g_StartupTimings;
+}
@@ -0,0 +1,34 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+
+#include <windows.h>
+#include <psf_runtime.h>
+
+// Records how long the enclosing scope takes as a startup phase, for PSFQueryStartupTimings. Only to be used on the
+// thread that initializes the PsfRuntime, and only before the application's entry point runs. See StartupTimings.cpp
+class startup_timer
+{
+public:
+
+    startup_timer(psf_startup_phase phase, const wchar_t* name = nullptr) noexcept;
+    ~startup_timer();
+
+    startup_timer(const startup_timer&) = delete;
+    startup_timer& operator=(const startup_timer&) = delete;
+
+private:
+
+    std::size_t m_index;
+};
+
+// Writes the timings recorded so far as a single ETW event. Called once, right before the application's entry point
+void ReportStartupTimings() noexcept;
+
+// Writes how long the transaction that just committed kept the application's other threads suspended (see
+// DetourGetLastSuspension) as an ETW event. For transactions after startup, e.g. when a module loads
+void ReportThreadSuspension(const wchar_t* name, std::size_t detours) noexcept;
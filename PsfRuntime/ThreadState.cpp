@@ -0,0 +1,69 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The state behind every fixup's reentrancy guards and scratch arena (see psf_thread_state.h). Fixups used to each have
+// thread_local variables of their own for these, which meant that a call through several stacked fixups touched each of
+// their implicit TLS blocks, and no fixup could tell that another was in the middle of a call. The slot gets allocated
+// before DllMain runs, so that it's there for anything that gets called while we attach. States are allocated from the
+// private heap the first time that a thread asks for its state, and freed when the thread exits.
+//
+// NOTE: Anything that thread detach notifications of dlls after us call into creates the state again, which then
+//       leaks. Such calls are rare, and the state is small
+
+#include <cstring>
+
+#include <windows.h>
+#include <psf_runtime.h>
+
+static const DWORD g_ThreadStateSlot = ::TlsAlloc();
+
+PSFAPI DWORD __stdcall PSFQueryThreadStateSlot() noexcept
+{
+    return g_ThreadStateSlot;
+}
+
+PSFAPI psf_thread_state* __stdcall PSFQueryThreadState() noexcept
+{
+    if (g_ThreadStateSlot == TLS_OUT_OF_INDEXES)
+    {
+        return nullptr;
+    }
+
+    // NOTE: TlsGetValue clears the last error, which fixups need to hand back to their callers as it was
+    auto lastError = ::GetLastError();
+    auto state = static_cast<psf_thread_state*>(::TlsGetValue(g_ThreadStateSlot));
+    if (!state)
+    {
+        state = static_cast<psf_thread_state*>(::PSFAllocate(sizeof(psf_thread_state)));
+        if (state)
+        {
+            std::memset(state, 0, sizeof(*state));
+            if (!::TlsSetValue(g_ThreadStateSlot, state))
+            {
+                ::PSFFree(state);
+                state = nullptr;
+            }
+        }
+    }
+
+    ::SetLastError(lastError);
+    return state;
+}
+
+void FreeThreadState() noexcept
+{
+    if (g_ThreadStateSlot == TLS_OUT_OF_INDEXES)
+    {
+        return;
+    }
+
+    if (auto state = static_cast<psf_thread_state*>(::TlsGetValue(g_ThreadStateSlot)))
+    {
+        ::TlsSetValue(g_ThreadStateSlot, nullptr);
+        ::PSFFree(state->scratch_block);
+        ::PSFFree(state->lookup_memo);
+        ::PSFFree(state);
+    }
+}
@@ -0,0 +1,70 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A warm standby instance is one that the PsfLauncher starts ahead of time, for the next launch of the application to
+// use instead of starting one of its own. It goes through all of PsfRuntime initialization and loads its fixups like
+// any other instance, and then waits just before the application's entry point for a later launcher to hand over to it
+// (see WarmStandby.cpp in the PsfLauncher). Each launch is a new launcher process, so the hand over goes through named
+// objects: the standby signals "_Ready" once it's waiting, publishes its process id in "_Instance", and carries on once
+// a launcher has claimed it and signaled "_Go".
+//
+// NOTE: Nothing the application does of its own (e.g. showing a window) happens before the hand over
+
+#include <string>
+
+#include <windows.h>
+#include <psf_constants.h>
+
+void Log(const char* fmt, ...);
+
+void WaitForWarmStandbyHandOver() noexcept try
+{
+    wchar_t value[MAX_PATH];
+    auto length = ::GetEnvironmentVariableW(psf::warm_standby_variable, value, MAX_PATH);
+    if ((length == 0) || (length >= MAX_PATH))
+    {
+        return;
+    }
+
+    // Only the standby itself waits; the processes that it starts once it's running are just children
+    ::SetEnvironmentVariableW(psf::warm_standby_variable, nullptr);
+    std::wstring name = value;
+
+    // An instance that nobody asked for showing up is worse than there being no standby at all, so anything going wrong
+    // from here on ends the process. Auto-reset, so that only one launcher gets to claim the instance
+    auto ready = ::CreateEventW(nullptr, FALSE, FALSE, (name + L"_Ready").c_str());
+    if (!ready || (::GetLastError() == ERROR_ALREADY_EXISTS))
+    {
+        // Another standby instance is already waiting
+        Log("\tWarm standby instance already exists, or can't be created. Error=0x%x\n", ::GetLastError());
+        ::ExitProcess(ERROR_ALREADY_EXISTS);
+    }
+
+    auto go = ::CreateEventW(nullptr, FALSE, FALSE, (name + L"_Go").c_str());
+    auto instance = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(DWORD), (name + L"_Instance").c_str());
+    auto processId = instance ? static_cast<DWORD*>(::MapViewOfFile(instance, FILE_MAP_WRITE, 0, 0, sizeof(DWORD))) : nullptr;
+    if (!go || !processId)
+    {
+        Log("\tUnable to create the warm standby objects. Error=0x%x\n", ::GetLastError());
+        ::ExitProcess(::GetLastError());
+    }
+
+    *processId = ::GetCurrentProcessId();
+    ::UnmapViewOfFile(processId);
+
+    Log("\tWaiting as a warm standby instance\n");
+    ::SetEvent(ready);
+    ::WaitForSingleObject(go, INFINITE);
+    Log("\tHanded over to as a warm standby instance\n");
+
+    // Closing the objects lets the next standby create them again
+    ::CloseHandle(instance);
+    ::CloseHandle(go);
+    ::CloseHandle(ready);
+}
+catch (...)
+{
+    ::ExitProcess(ERROR_OUTOFMEMORY);
+}
@@ -0,0 +1,268 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Background work that the fixups want done (e.g. copying files ahead of time, or flushing what they've written) goes
+// to a single private thread pool, so that a process with several fixups doesn't end up with several sets of threads.
+// The pool gets created the first time that anything is submitted to it, with a callback environment for each priority.
+// Work goes in a cleanup group, which lets ShutdownWorkerPool cancel whatever hasn't started and wait for the rest in a
+// single call. Timers can't be in the group, since fixups close them individually (and possibly after the shutdown), so
+// they're tracked here instead, and whichever of PSFCloseTimer and ShutdownWorkerPool gets to a timer first closes it.
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <windows.h>
+#include <psf_runtime.h>
+#include <win32_error.h>
+
+// Enough to keep a few fixups' work going at once without the pool competing with the application for every processor
+constexpr DWORD max_worker_threads = 8;
+constexpr DWORD min_worker_threads = 2;
+
+struct psf_timer
+{
+    PSFWorkProc callback;
+    void* context;
+
+    // Null once closed by ShutdownWorkerPool. Guarded by g_WorkerPoolMutex
+    PTP_TIMER timer = nullptr;
+};
+
+struct work_item
+{
+    PSFWorkProc callback;
+    void* context;
+};
+
+// NOTE: Never held while waiting for callbacks, since those may submit more work, or set their own timer
+static std::mutex g_WorkerPoolMutex;
+static bool g_WorkerPoolShutDown = false;
+static PTP_POOL g_WorkerPool = nullptr;
+static PTP_CLEANUP_GROUP g_WorkerCleanupGroup = nullptr;
+static TP_CALLBACK_ENVIRON g_WorkEnvironments[3];
+static TP_CALLBACK_ENVIRON g_TimerEnvironments[3];
+static std::vector<psf_timer*> g_WorkerTimers;
+
+static constexpr TP_CALLBACK_PRIORITY callback_priorities[] =
+{
+    TP_CALLBACK_PRIORITY_HIGH,
+    TP_CALLBACK_PRIORITY_NORMAL,
+    TP_CALLBACK_PRIORITY_LOW,
+};
+
+// Called with g_WorkerPoolMutex held
+static DWORD ensure_worker_pool() noexcept
+{
+    if (g_WorkerPoolShutDown)
+    {
+        return ERROR_SHUTDOWN_IN_PROGRESS;
+    }
+    else if (g_WorkerPool)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    auto pool = ::CreateThreadpool(nullptr);
+    if (!pool)
+    {
+        return ::GetLastError();
+    }
+
+    auto group = ::CreateThreadpoolCleanupGroup();
+    if (!group)
+    {
+        auto err = ::GetLastError();
+        ::CloseThreadpool(pool);
+        return err;
+    }
+
+    auto processors = ::GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    ::SetThreadpoolThreadMaximum(pool, (std::min)((std::max)(processors, min_worker_threads), max_worker_threads));
+
+    for (std::size_t i = 0; i < std::size(callback_priorities); ++i)
+    {
+        ::InitializeThreadpoolEnvironment(&g_WorkEnvironments[i]);
+        ::SetThreadpoolCallbackPool(&g_WorkEnvironments[i], pool);
+        ::SetThreadpoolCallbackPriority(&g_WorkEnvironments[i], callback_priorities[i]);
+        ::SetThreadpoolCallbackCleanupGroup(&g_WorkEnvironments[i], group, nullptr);
+
+        ::InitializeThreadpoolEnvironment(&g_TimerEnvironments[i]);
+        ::SetThreadpoolCallbackPool(&g_TimerEnvironments[i], pool);
+        ::SetThreadpoolCallbackPriority(&g_TimerEnvironments[i], callback_priorities[i]);
+    }
+
+    g_WorkerPool = pool;
+    g_WorkerCleanupGroup = group;
+    return ERROR_SUCCESS;
+}
+
+static void close_timer(PTP_TIMER timer) noexcept
+{
+    ::SetThreadpoolTimer(timer, nullptr, 0, 0);
+    ::WaitForThreadpoolTimerCallbacks(timer, TRUE);
+    ::CloseThreadpoolTimer(timer);
+}
+
+void ShutdownWorkerPool() noexcept
+{
+    std::vector<PTP_TIMER> timers;
+    {
+        std::lock_guard lock(g_WorkerPoolMutex);
+        g_WorkerPoolShutDown = true;
+        if (!g_WorkerPool)
+        {
+            return;
+        }
+
+        for (auto timer : g_WorkerTimers)
+        {
+            timers.push_back(timer->timer);
+            timer->timer = nullptr;
+        }
+        g_WorkerTimers.clear();
+    }
+
+    // Nothing can get added to the pool anymore, so none of this needs the lock
+    for (auto timer : timers)
+    {
+        close_timer(timer);
+    }
+
+    // Work that hasn't started gets cancelled, which means that its work_item leaks. That's fine, since we're unloading
+    ::CloseThreadpoolCleanupGroupMembers(g_WorkerCleanupGroup, TRUE, nullptr);
+    ::CloseThreadpoolCleanupGroup(g_WorkerCleanupGroup);
+    ::CloseThreadpool(g_WorkerPool);
+    for (std::size_t i = 0; i < std::size(callback_priorities); ++i)
+    {
+        ::DestroyThreadpoolEnvironment(&g_WorkEnvironments[i]);
+        ::DestroyThreadpoolEnvironment(&g_TimerEnvironments[i]);
+    }
+
+    g_WorkerCleanupGroup = nullptr;
+    g_WorkerPool = nullptr;
+}
+
+static void CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE, PVOID context) noexcept
+{
+    std::unique_ptr<work_item> item(static_cast<work_item*>(context));
+    item->callback(item->context);
+}
+
+static void CALLBACK TimerCallback(PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER) noexcept
+{
+    auto timer = static_cast<psf_timer*>(context);
+    timer->callback(timer->context);
+}
+
+static std::size_t priority_index(psf_work_priority priority) noexcept
+{
+    auto index = static_cast<std::size_t>(priority);
+    return (index < std::size(callback_priorities)) ? index : static_cast<std::size_t>(psf_work_priority::normal);
+}
+
+PSFAPI DWORD __stdcall PSFSubmitWork(_In_ PSFWorkProc callback, _In_opt_ void* context, psf_work_priority priority) noexcept try
+{
+    auto item = std::make_unique<work_item>(work_item{ callback, context });
+
+    std::lock_guard lock(g_WorkerPoolMutex);
+    if (auto err = ensure_worker_pool())
+    {
+        return err;
+    }
+
+    if (!::TrySubmitThreadpoolCallback(WorkCallback, item.get(), &g_WorkEnvironments[priority_index(priority)]))
+    {
+        return ::GetLastError();
+    }
+
+    item.release();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+PSFAPI DWORD __stdcall PSFCreateTimer(
+    _In_ PSFWorkProc callback,
+    _In_opt_ void* context,
+    psf_work_priority priority,
+    _Outptr_ psf_timer** timer) noexcept try
+{
+    *timer = nullptr;
+    auto result = std::make_unique<psf_timer>(psf_timer{ callback, context });
+
+    std::lock_guard lock(g_WorkerPoolMutex);
+    if (auto err = ensure_worker_pool())
+    {
+        return err;
+    }
+
+    g_WorkerTimers.reserve(g_WorkerTimers.size() + 1);
+    result->timer = ::CreateThreadpoolTimer(TimerCallback, result.get(), &g_TimerEnvironments[priority_index(priority)]);
+    if (!result->timer)
+    {
+        return ::GetLastError();
+    }
+
+    g_WorkerTimers.push_back(result.get());
+    *timer = result.release();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+PSFAPI DWORD __stdcall PSFSetTimer(_In_ psf_timer* timer, DWORD dueTime, DWORD period) noexcept
+{
+    std::lock_guard lock(g_WorkerPoolMutex);
+    if (!timer->timer)
+    {
+        return ERROR_SHUTDOWN_IN_PROGRESS;
+    }
+
+    if (dueTime == INFINITE)
+    {
+        ::SetThreadpoolTimer(timer->timer, nullptr, 0, 0);
+        return ERROR_SUCCESS;
+    }
+
+    // Relative due times are negative, in 100ns units. The window lets the timer coalesce with other timers
+    ULARGE_INTEGER relativeDueTime;
+    relativeDueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(dueTime) * 10'000);
+    FILETIME fileDueTime{ relativeDueTime.LowPart, relativeDueTime.HighPart };
+    ::SetThreadpoolTimer(timer->timer, &fileDueTime, period, (period ? period : dueTime) / 10);
+    return ERROR_SUCCESS;
+}
+
+PSFAPI void __stdcall PSFCloseTimer(_In_opt_ psf_timer* timer) noexcept
+{
+    if (!timer)
+    {
+        return;
+    }
+
+    PTP_TIMER poolTimer;
+    {
+        std::lock_guard lock(g_WorkerPoolMutex);
+        poolTimer = std::exchange(timer->timer, nullptr);
+        if (poolTimer)
+        {
+            g_WorkerTimers.erase(std::find(g_WorkerTimers.begin(), g_WorkerTimers.end(), timer));
+        }
+    }
+
+    if (poolTimer)
+    {
+        close_timer(poolTimer);
+    }
+
+    delete timer;
+}
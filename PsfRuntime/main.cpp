@@ -4,20 +4,38 @@
 //-------------------------------------------------------------------------------------------------------
 
 #include <algorithm>
+#include <memory>
 #include <sstream>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <detour_transaction.h>
 #include <psf_framework.h>
+#include <psf_logging.h>
 #include <psf_runtime.h>
 
 #include "Config.h"
+#include "DeferredRegistration.h"
+#include "ImportTableHooks.h"
+#include "MemoryUsage.h"
+#include "ModuleLoadRegistration.h"
+#include "StartupTimings.h"
 
 void Log(const char* fmt, ...);
+void LoadInheritedSharedSections() noexcept;
+void LoadInheritedPrologueCache() noexcept;
+bool IsInjectionBrokerProcess() noexcept;
+void WaitForWarmStandbyHandOver() noexcept;
+void UninitializeLiveCounters() noexcept;
+void ShutdownWorkerPool() noexcept;
+void FreeThreadState() noexcept;
 
 struct loaded_fixup
 {
     HMODULE module_handle = nullptr;
     PSFUninitializeProc uninitialize = nullptr;
+    PSFProcessTerminatingProc process_terminating = nullptr; // Optional
 
     loaded_fixup() = default;
     loaded_fixup(const loaded_fixup&) = delete;
@@ -46,62 +64,192 @@ struct loaded_fixup
     {
         std::swap(module_handle, other.module_handle);
         std::swap(uninitialize, other.uninitialize);
+        std::swap(process_terminating, other.process_terminating);
     }
 };
 std::vector<loaded_fixup> loaded_fixups;
 
+// Loads 'dll' relative to the package root, first as named and then with the architecture suffix (e.g. FooFixup64.dll)
+static HMODULE load_fixup_dll(const psf::json_string& dll, std::filesystem::path& path)
+{
+    HMODULE module = nullptr;
+    path = PackageRootPath() / dll.wide();
+    startup_timer timer(psf_startup_phase::load_fixup, dll.wide());
+    if (!FixupDllNeedsArchitectureSuffix(dll.narrow()))
+    {
+        module = ::LoadLibraryW(path.c_str());
+    }
+
+    if (!module)
+    {
+        path.replace_extension();
+        path.concat((sizeof(void*) == 4) ? L"32.dll" : L"64.dll");
+        module = ::LoadLibraryW(path.c_str());
+
+        if (!module)
+        {
+            auto message = narrow(path.c_str());
+            throw_last_error(message.c_str());
+        }
+    }
+
+    TrackMemoryUsage(module);
+    return module;
+}
+
+// A fixup's "hookMode": "inline" (the default) or "iat" (see ImportTableHooks.cpp)
+static hook_mode fixup_hook_mode(const psf::json_object& fixupConfig)
+{
+    using namespace std::literals;
+
+    auto value = fixupConfig.try_get("hookMode");
+    if (!value)
+    {
+        return hook_mode::inline_detour;
+    }
+
+    auto mode = value->as_string().string();
+    if (mode == "inline"sv)
+    {
+        return hook_mode::inline_detour;
+    }
+    else if (mode == "iat"sv)
+    {
+        return hook_mode::import_table;
+    }
+
+    auto message = "Unknown hookMode \""s + std::string(mode) + "\" for " + fixupConfig.get("dll").as_string().narrow();
+    throw_win32(ERROR_INVALID_PARAMETER, message.c_str());
+}
+
 void load_fixups()
 {
     using namespace std::literals;
 
-    if (auto config = PSFQueryCurrentExeConfig())
+    auto config = PSFQueryCurrentExeConfig();
+    auto fixups = config ? config->try_get("fixups") : nullptr;
+    if (!fixups)
+    {
+        return;
+    }
+
+    // Fixups that are linked into the process's bundle come from it, and only the rest get loaded from their own dlls
+    // (see psf_bundled_fixup). Each fixup from the bundle holds a reference to it, so the one taken here only needs to
+    // last while the fixups load
+    std::unique_ptr<std::remove_pointer_t<HMODULE>, decltype(&::FreeLibrary)> bundle(nullptr, &::FreeLibrary);
+    PSFQueryBundledFixupProc queryBundledFixup = nullptr;
+    if (auto bundleValue = config->try_get("fixupBundle"))
+    {
+        std::filesystem::path path;
+        bundle.reset(load_fixup_dll(bundleValue->as_string(), path));
+        Log("\tInject into current process: %ls\n", path.c_str());
+
+        queryBundledFixup = reinterpret_cast<PSFQueryBundledFixupProc>(::GetProcAddress(bundle.get(), "PSFQueryBundledFixup"));
+        if (!queryBundledFixup)
+        {
+            auto message = "PSFQueryBundledFixup export not found in "s + narrow(path.c_str());
+            throw_win32(ERROR_PROC_NOT_FOUND, message.c_str());
+        }
+    }
+
+    // Load all of the dlls before initializing any of them so that a missing dll or export fails before anything has
+    // been detoured
+    std::vector<std::pair<PSFInitializeProc, PSFUninitializeProc>> procs;
+    std::vector<const wchar_t*> names;
+    std::vector<hook_mode> modes;
+    for (auto& fixupConfig : fixups->as_array())
     {
-        if (auto fixups = config->try_get("fixups"))
+        auto& fixup = loaded_fixups.emplace_back();
+        modes.push_back(fixup_hook_mode(fixupConfig.as_object()));
+
+        auto& dll = fixupConfig.as_object().get("dll").as_string();
+        psf_bundled_fixup bundledFixup;
+        if (queryBundledFixup && (queryBundledFixup(FixupName(dll.wide()).c_str(), &bundledFixup) == ERROR_SUCCESS))
         {
-            for (auto& fixupConfig : fixups->as_array())
+            if (!bundledFixup.initialize || !bundledFixup.uninitialize ||
+                !::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<const wchar_t*>(bundledFixup.initialize), &fixup.module_handle))
             {
-                auto& fixup = loaded_fixups.emplace_back();
-
-                auto path = PackageRootPath() / fixupConfig.as_object().get("dll").as_string().wide();
-                fixup.module_handle = ::LoadLibraryW(path.c_str());
-                if (!fixup.module_handle)
-                {
-                    path.replace_extension();
-                    path.concat((sizeof(void*) == 4) ? L"32.dll" : L"64.dll");
-                    fixup.module_handle = ::LoadLibraryW(path.c_str());
-
-                    if (!fixup.module_handle)
-                    {
-                        auto message = narrow(path.c_str());
-                        throw_last_error(message.c_str());
-                    }
-                }
-				Log("\tInject into current process: %ls\n", path.c_str());
-
-                auto initialize = reinterpret_cast<PSFInitializeProc>(::GetProcAddress(fixup.module_handle, "PSFInitialize"));
-                if (!initialize)
-                {
-                    auto message = "PSFInitialize export not found in "s + narrow(path.c_str());
-                    throw_win32(ERROR_PROC_NOT_FOUND, message.c_str());
-                }
-                auto uninitialize = reinterpret_cast<PSFUninitializeProc>(::GetProcAddress(fixup.module_handle, "PSFUninitialize"));
-                if (!uninitialize)
-                {
-                    auto message = "PSFUninitialize export not found in "s + narrow(path.c_str());
-                    throw_win32(ERROR_PROC_NOT_FOUND, message.c_str());
-                }
-
-                auto transaction = detours::transaction();
-                check_win32(::DetourUpdateThread(::GetCurrentThread()));
-
-                // Only set the uninitialize pointer if the transaction commits successfully since that's our cue to clean
-                // it up, which will attempt to call DetourDetach
-                check_win32(initialize());
-                transaction.commit();
-                fixup.uninitialize = uninitialize;
+                auto message = "Bundled fixup "s + dll.narrow() + " has no initialize or uninitialize function";
+                throw_win32(ERROR_PROC_NOT_FOUND, message.c_str());
             }
+
+            RegisterFixupConfig(nullptr, dll.wide(), fixupConfig.as_object().try_get("config"));
+            Log("\tInject into current process: %ls (bundled)\n", dll.wide());
+
+            fixup.process_terminating = bundledFixup.process_terminating;
+            procs.emplace_back(bundledFixup.initialize, bundledFixup.uninitialize);
+            names.push_back(dll.wide());
+            continue;
+        }
+
+        std::filesystem::path path;
+        fixup.module_handle = load_fixup_dll(dll, path);
+        RegisterFixupConfig(fixup.module_handle, dll.wide(), fixupConfig.as_object().try_get("config"));
+		Log("\tInject into current process: %ls\n", path.c_str());
+
+        auto initialize = reinterpret_cast<PSFInitializeProc>(::GetProcAddress(fixup.module_handle, "PSFInitialize"));
+        if (!initialize)
+        {
+            auto message = "PSFInitialize export not found in "s + narrow(path.c_str());
+            throw_win32(ERROR_PROC_NOT_FOUND, message.c_str());
+        }
+        auto uninitialize = reinterpret_cast<PSFUninitializeProc>(::GetProcAddress(fixup.module_handle, "PSFUninitialize"));
+        if (!uninitialize)
+        {
+            auto message = "PSFUninitialize export not found in "s + narrow(path.c_str());
+            throw_win32(ERROR_PROC_NOT_FOUND, message.c_str());
+        }
+
+        fixup.process_terminating = reinterpret_cast<PSFProcessTerminatingProc>(::GetProcAddress(fixup.module_handle, "PSFProcessTerminating"));
+
+        procs.emplace_back(initialize, uninitialize);
+        names.push_back(dll.wide());
+    }
+
+    // The fixups' detours only get recorded while they initialize, and then get applied together, rather than
+    // committing a transaction per fixup (see DeferredRegistration.cpp). A fixup that fails to initialize doesn't get
+    // any of its detours applied, but the ones before it still do, same as if they had each been committed on their own
+    deferred_registrations registrations;
+    DWORD initializeError = ERROR_SUCCESS;
+    for (std::size_t i = 0; i < procs.size(); ++i)
+    {
+        registrations.begin_fixup(modes[i]);
+        {
+            startup_timer timer(psf_startup_phase::initialize_fixup, names[i]);
+            initializeError = procs[i].first();
+        }
+
+        if (initializeError != ERROR_SUCCESS)
+        {
+            registrations.discard_fixup();
+            break;
+        }
+    }
+
+    // Only set the uninitialize pointer once the fixup's detours have been committed since that's our cue to clean it
+    // up, which will attempt to call DetourDetach
+    for (std::size_t applied = 0; applied < registrations.fixup_count(); )
+    {
+        std::size_t next;
+        {
+            startup_timer timer(psf_startup_phase::fixups_commit);
+            next = registrations.apply(applied);
+        }
+
+        for (; applied < next; ++applied)
+        {
+            loaded_fixups[applied].uninitialize = procs[applied].second;
         }
     }
+
+    // Fixups' detours of functions in modules that aren't loaded yet only get attached once their module loads, but the
+    // ones for modules that already are can go now (see ModuleLoadRegistration.cpp)
+    {
+        startup_timer timer(psf_startup_phase::module_load_commit);
+        release_module_load_registrations();
+    }
+
+    check_win32(initializeError);
 }
 
 void unload_fixups()
@@ -122,11 +270,45 @@ void unload_fixups()
     }
 }
 
+// When the process is terminating, every other thread is already gone and nothing is going to call into the fixups
+// again, so there's no point in detaching anything (each transaction of which would go through the motions of suspending
+// threads), nor in unloading the fixups. All that's left to do is to give the fixups that have something to flush (e.g.
+// telemetry) the chance to do so, in the same order that they'd otherwise get uninitialized
+void terminate_fixups() noexcept
+{
+    for (auto itr = loaded_fixups.rbegin(); itr != loaded_fixups.rend(); ++itr)
+    {
+        // Same as for 'uninitialize', fixups whose detours never got committed don't get called
+        if (itr->uninitialize && itr->process_terminating)
+        {
+            itr->process_terminating();
+        }
+
+        // Loader calls are pointless at this point, too
+        itr->module_handle = nullptr;
+    }
+}
+
 using EntryPoint_t = int (__stdcall*)();
 EntryPoint_t ApplicationEntryPoint = nullptr;
 static int __stdcall FixupEntryPoint() noexcept try
 {
-    load_fixups();
+    // Whether or not the fixups load, this is the end of startup
+    try
+    {
+        startup_timer timer(psf_startup_phase::load_fixups);
+        load_fixups();
+    }
+    catch (...)
+    {
+        ReportStartupTimings();
+        throw;
+    }
+
+    ReportStartupTimings();
+
+    // Everything that can be done ahead of time is done by now, so this is where a warm standby instance waits
+    WaitForWarmStandbyHandOver();
     return ApplicationEntryPoint();
 }
 catch (...)
@@ -136,16 +318,35 @@ catch (...)
 
 void attach()
 {
-    LoadConfig();
+    {
+        startup_timer timer(psf_startup_phase::load_config);
+        LoadConfig();
+    }
 
-    // Restore the contents of the in memory import table that DetourCreateProcessWithDll* modified
-    ::DetourRestoreAfterWith();
+    // Restore the contents of the in memory import table that DetourCreateProcessWithDll* modified. Executables that
+    // import us themselves (see pre_injection.h) have nothing to restore, since their edited table is the real one
+    {
+        startup_timer timer(psf_startup_phase::restore_after_with);
+        ::DetourRestoreAfterWith();
+    }
+
+    // Must happen before any fixups get loaded, since they may want to use what our parent process shared with us. The
+    // same goes for the prologue cache, which has to be in place before anything gets detoured
+    LoadInheritedSharedSections();
+    LoadInheritedPrologueCache();
+
+    // Child processes are mostly the same few executables, so the import table patch that injects us only needs to be
+    // worked out once for each of them
+    ::DetourSetReuseImportPatches(TRUE);
 
     auto transaction = detours::transaction();
     check_win32(::DetourUpdateThread(::GetCurrentThread()));
 
     // Call DetourAttach for all APIs that PsfRuntime detours
-    psf::attach_all();
+    {
+        startup_timer timer(psf_startup_phase::attach_all);
+        psf::attach_all();
+    }
 
     // We can't call LoadLibrary in DllMain, so hook the application's entry point and do initialization then
     ApplicationEntryPoint = reinterpret_cast<EntryPoint_t>(::DetourGetEntryPoint(nullptr));
@@ -155,13 +356,18 @@ void attach()
     }
     check_win32(::DetourAttach(reinterpret_cast<void**>(&ApplicationEntryPoint), FixupEntryPoint));
 
+    startup_timer timer(psf_startup_phase::attach_commit);
     transaction.commit();
 }
 
 void detach()
 {
-    // Unload in the reverse order as we initialized
+    // Background work may be running fixup code, so it has to be done before any fixup gets uninitialized. After that,
+    // unload in the reverse order as we initialized. The fixups have unregistered their live counters by now
+    ShutdownWorkerPool();
     unload_fixups();
+    UninitializeLiveCounters();
+    UninitializeModuleLoadRegistrations();
 
     auto transaction = detours::transaction();
     check_win32(::DetourUpdateThread(::GetCurrentThread()));
@@ -169,10 +375,11 @@ void detach()
     transaction.commit();
 }
 
-BOOL APIENTRY DllMain(HMODULE, DWORD reason, LPVOID) noexcept try
+BOOL APIENTRY DllMain(HMODULE, DWORD reason, LPVOID reserved) noexcept try
 {
-    // Per detours documentation, immediately return true if running in a helper process
-    if (::DetourIsHelperProcess())
+    // Per detours documentation, immediately return true if running in a helper process. The same goes for the injection
+    // broker (see InjectionBroker.cpp), which is a helper that sticks around
+    if (::DetourIsHelperProcess() || IsInjectionBrokerProcess())
     {
         return TRUE;
     }
@@ -192,7 +399,21 @@ BOOL APIENTRY DllMain(HMODULE, DWORD reason, LPVOID) noexcept try
         break;
 
     case DLL_PROCESS_DETACH:
-        detach();
+        // A non-null 'reserved' means that the process is terminating, and the log's background thread is gone
+        if (reserved)
+        {
+            terminate_fixups();
+        }
+        else
+        {
+            detach();
+        }
+
+        psf::flush_log(reserved != nullptr);
+        break;
+
+    case DLL_THREAD_DETACH:
+        FreeThreadState();
         break;
     }
 
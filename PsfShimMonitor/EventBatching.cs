@@ -0,0 +1,139 @@
+﻿//-------------------------------------------------------------------------------------------------------
+// Copyright (C) TMurgent Technologies. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// NOTE: PsfMonitor is a "procmon"-like display of events captured via the PSF TraceShim.
+//
+// The trace callbacks only add their events to the temp lists. A timer on the UI thread moves them into the model in
+// batches, so that the UI thread isn't asked to do anything per event. Only the newest MaxEventsInMemory events are kept
+// in the model; older ones get written out to a file in %TEMP% instead.
+
+using System;
+using System.Collections.Generic;
+using System.Collections.ObjectModel;  // ObservableCollection
+using System.IO;
+using System.Linq;
+using System.Windows;
+using System.Windows.Threading;  // DispatcherTimer
+
+namespace PsfMonitor
+{
+    public partial class MainWindow : Window
+    {
+        private const int EventFlushIntervalMilliseconds = 100;
+        private const int MaxEventsInMemory = 100000;
+        private const int EventsSpilledAtOnce = 10000;  // So that the filtered view only gets rebuilt every so often
+
+        private DispatcherTimer _EventFlushTimer = null;
+        private StreamWriter _SpillFile = null;
+        private string _SpillFilePath = null;
+        private int _SpilledEventCount = 0;
+
+        private void EventFlushTimer_Start()
+        {
+            _EventFlushTimer = new DispatcherTimer(DispatcherPriority.Background);
+            _EventFlushTimer.Interval = TimeSpan.FromMilliseconds(EventFlushIntervalMilliseconds);
+            _EventFlushTimer.Tick += EventFlushTimer_Tick;
+            _EventFlushTimer.Start();
+        }
+
+        private void EventFlushTimer_Stop()
+        {
+            if (_EventFlushTimer != null)
+            {
+                _EventFlushTimer.Stop();
+                _EventFlushTimer = null;
+            }
+            try
+            {
+                if (_SpillFile != null)
+                {
+                    _SpillFile.Dispose();
+                    _SpillFile = null;
+                }
+            }
+            catch
+            {
+                // this is code attempting to clean up.  Whatever got written out so far is still there.
+            }
+        }
+
+        private void EventFlushTimer_Tick(object sender, EventArgs e)
+        {
+            if (_OpenedSessionPath != null)
+            {
+                DiscardLiveEvents();
+                return;
+            }
+
+            List<EventItem> added = new List<EventItem>();
+            int collapsedBefore = _CollapsedEventCount;
+            FlushKernelControlBlocks();
+            FlushTraceEvents(added);
+            if (added.Count == 0)
+            {
+                if (_CollapsedEventCount != collapsedBefore)
+                {
+                    Update_Captured();
+                }
+                return;
+            }
+
+            if (_ModelEventItems.Count > MaxEventsInMemory)
+            {
+                SpillOldestEvents(_ModelEventItems.Count - MaxEventsInMemory + EventsSpilledAtOnce);
+                UpdateFilteredViewList();
+            }
+            else
+            {
+                AppendToFilteredViewList(added);
+            }
+        }
+
+        private void SpillOldestEvents(int count)
+        {
+            List<EventItem> spilled = _ModelEventItems.Take(count).ToList();
+            try
+            {
+                if (_SpillFile == null)
+                {
+                    _SpillFilePath = Path.Combine(Path.GetTempPath(), "PsfMonitor-" + System.Diagnostics.Process.GetCurrentProcess().Id.ToString() + ".tsv");
+                    _SpillFile = new StreamWriter(_SpillFilePath, false);
+                    _SpillFile.WriteLine("Index\tTimestamp\tProcessName\tProcessID\tThreadID\tEventSource\tEvent\tInputs\tResult\tOutputs\tCaller\tStart\tEnd\tCount\tLastTimestamp\tMinDuration\tMaxDuration\tTotalDuration");
+                }
+                foreach (EventItem ei in spilled)
+                {
+                    _SpillFile.WriteLine(string.Join("\t", ei.IndexAsText, ei.TimestampAsText, ei.ProcessName, ei.ProcessID.ToString(), ei.ThreadID.ToString(),
+                                                     ei.EventSource, ei.Event, SpillField(ei.Inputs), SpillField(ei.Result), SpillField(ei.Outputs),
+                                                     SpillField(ei.Caller), ei.Start.ToString(), ei.End.ToString(), ei.Count.ToString(), ei.LastTimestampAsText,
+                                                     ei.MinDuration.ToString(), ei.MaxDuration.ToString(), ei.TotalDuration.ToString()));
+                }
+                _SpillFile.Flush();
+                _SpilledEventCount += spilled.Count;
+            }
+            catch
+            {
+                // Not being able to write them out only means that they're gone from the display
+                _SpilledEventCount += spilled.Count;
+            }
+
+            _ModelEventItems = new ObservableCollection<EventItem>(_ModelEventItems.Skip(count));
+            RebuildEventIndexes();
+            ForgetRepeatRows(spilled);
+
+            // The search position is an index into the filtered view, which is about to be rebuilt
+            LastSearchIndex = -1;
+        }
+
+        // Multi-line fields (e.g. Inputs) stay on one line of the file
+        private static string SpillField(string field)
+        {
+            if (field == null)
+            {
+                return "";
+            }
+            return field.Replace("\r", "").Replace("\n", " | ").Replace("\t", " ");
+        }
+    }
+}
@@ -0,0 +1,178 @@
+﻿//-------------------------------------------------------------------------------------------------------
+// Copyright (C) TMurgent Technologies. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// NOTE: PsfMonitor is a "procmon"-like display of events captured via the PSF TraceShim.
+//
+// Indexes of the events in the model, kept up to date as events get added, so that neither the filters nor the search
+// have to look at the text of every event. Events are grouped by operation and by the kind of result that they had,
+// which is all that the event and result filters go by, so a filter change gets decided once per group and only the
+// groups that it changes get touched. Search goes through the words (runs of characters between separators such as
+// spaces, '\' and '=') of each event's text: any event that the search string is in has a word that the longest word
+// of the search string is in, so only the events with one of those words get compared in full.
+
+using System;
+using System.Collections.Generic;
+using System.Windows;
+
+namespace PsfMonitor
+{
+    public partial class MainWindow : Window
+    {
+        private Dictionary<string, List<EventItem>> _EventsByOperation = new Dictionary<string, List<EventItem>>();
+        private Dictionary<string, List<EventItem>> _EventsByResult = new Dictionary<string, List<EventItem>>();
+        private Dictionary<string, List<EventItem>> _EventsByWord = new Dictionary<string, List<EventItem>>();
+
+        private static readonly char[] WordSeparators = { ' ', '\t', '\r', '\n', '\\', '/', ':', '=', ',', ';', '|', '(', ')', '[', ']', '{', '}', '"', '\'', '<', '>' };
+
+        // The same distinctions that ApplyFilterResultToEventItem makes, so that every event in a group filters the same
+        private static string ResultFilterKey(string result)
+        {
+            if (result.StartsWith("Success"))
+            {
+                return "Success";
+            }
+            else if (result.StartsWith("Unknown") || result.StartsWith("Indeterminate"))
+            {
+                return "Indeterminate";
+            }
+            else if (result.StartsWith("Expected Failure"))
+            {
+                return "Expected Failure";
+            }
+            else if (result.StartsWith("Failure"))
+            {
+                return "Failure";
+            }
+            return "";
+        }
+
+        private static void AddToGroup<TKey>(Dictionary<TKey, List<EventItem>> index, TKey key, EventItem ei)
+        {
+            List<EventItem> group;
+            if (!index.TryGetValue(key, out group))
+            {
+                group = new List<EventItem>();
+                index.Add(key, group);
+            }
+            else if (group[group.Count - 1] == ei)
+            {
+                return;  // The same word more than once in the same event
+            }
+            group.Add(ei);
+        }
+
+        // Also for text that gets added to an event that's already in the model, e.g. a registry key's name. That event
+        // isn't necessarily the newest in the group, so it can end up in there twice, which searching doesn't mind
+        private void AddWordsToEventIndex(EventItem ei, string text)
+        {
+            if (text == null)
+            {
+                return;
+            }
+            foreach (string word in text.ToUpper().Split(WordSeparators, StringSplitOptions.RemoveEmptyEntries))
+            {
+                AddToGroup(_EventsByWord, word, ei);
+            }
+        }
+
+        // Called for each event as it gets added to the model, in the same order
+        private void AddToEventIndexes(EventItem ei)
+        {
+            AddToGroup(_EventsByOperation, ei.Event, ei);
+            AddToGroup(_EventsByResult, ResultFilterKey(ei.Result), ei);
+            AddWordsToEventIndex(ei, ei.Event);
+            AddWordsToEventIndex(ei, ei.Inputs);
+            AddWordsToEventIndex(ei, ei.Result);
+            AddWordsToEventIndex(ei, ei.Outputs);
+            AddWordsToEventIndex(ei, ei.Caller);
+        }
+
+        private void ClearEventIndexes()
+        {
+            _EventsByOperation.Clear();
+            _EventsByResult.Clear();
+            _EventsByWord.Clear();
+        }
+
+        // For whenever the model gets replaced as a whole (a session being opened, or the oldest events being spilled)
+        private void RebuildEventIndexes()
+        {
+            ClearEventIndexes();
+            foreach (EventItem ei in _ModelEventItems)
+            {
+                AddToEventIndexes(ei);
+            }
+        }
+
+        // Every event in a group filters the same, so each filter gets applied to the first event of each group, and only
+        // if that changes whether it's hidden, to the rest of the group. Both return whether any event changed
+        private bool ApplyFilterResultToEventGroups()
+        {
+            bool anychanged = false;
+            foreach (List<EventItem> group in _EventsByResult.Values)
+            {
+                EventItem first = group[0];
+                bool washidden = first.IsResultHidden;
+                ApplyFilterResultToEventItem(first);
+                if (first.IsResultHidden != washidden)
+                {
+                    foreach (EventItem ei in group)
+                    {
+                        ei.IsResultHidden = first.IsResultHidden;
+                    }
+                    anychanged = true;
+                }
+            }
+            return anychanged;
+        }
+
+        private bool ApplyFilterCategoryEventToEventGroups()
+        {
+            bool anychanged = false;
+            foreach (List<EventItem> group in _EventsByOperation.Values)
+            {
+                EventItem first = group[0];
+                bool washidden = first.IsEventCatHidden;
+                ApplyFilterCategoryEventToEventItem(first);
+                if (first.IsEventCatHidden != washidden)
+                {
+                    foreach (EventItem ei in group)
+                    {
+                        ei.IsEventCatHidden = first.IsEventCatHidden;
+                    }
+                    anychanged = true;
+                }
+            }
+            return anychanged;
+        }
+
+        // Null if every event needs comparing, i.e. when the search string is nothing but separators
+        private HashSet<EventItem> FindSearchCandidates(string search)
+        {
+            string longest = "";
+            foreach (string word in search.Split(WordSeparators, StringSplitOptions.RemoveEmptyEntries))
+            {
+                if (word.Length > longest.Length)
+                {
+                    longest = word;
+                }
+            }
+            if (longest.Length == 0)
+            {
+                return null;
+            }
+
+            HashSet<EventItem> candidates = new HashSet<EventItem>();
+            foreach (KeyValuePair<string, List<EventItem>> entry in _EventsByWord)
+            {
+                if (entry.Key.Contains(longest))
+                {
+                    candidates.UnionWith(entry.Value);
+                }
+            }
+            return candidates;
+        }
+    }
+}
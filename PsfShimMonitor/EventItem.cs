@@ -4,12 +4,15 @@
 //-------------------------------------------------------------------------------------------------------
 //
 // NOTE: Class to hold an event item sent from the PSF TraceShim vie ETW. This class is used for displaying data as part of a DataGrid.
+//       An item can stand for a run of identical events (see EventRepeats.cs), in which case it's the first of them, and
+//       Count, LastTimestamp and the duration statistics cover the whole run.
 
 using System;
+using System.ComponentModel;  // INotifyPropertyChanged
 
 namespace PsfMonitor
 {
-    public class EventItem
+    public class EventItem : INotifyPropertyChanged
     {
         // Event Data
         private int _Index;
@@ -26,6 +29,13 @@ namespace PsfMonitor
         private Int64 _Start = 0;
         private Int64 _End = 0;
 
+        // Repeat Data
+        private int _Count = 1;
+        private DateTime _LastTimestamp;
+        private Int64 _MinDuration = 0;
+        private Int64 _MaxDuration = 0;
+        private Int64 _TotalDuration = 0;
+
         // View Data
         private bool _IsResultHidden = false;
         private bool _IsEventCatHidden = false;
@@ -37,7 +47,9 @@ namespace PsfMonitor
         private string _EventIsResultClass = "Normal";
 
         // Access view for Event Data
+        public int Index { get { return _Index; } }
         public string IndexAsText { get { return _Index.ToString(); } }
+        public DateTime Timestamp { get { return _Timestamp; } }
         public string TimestampAsText { get { return _Timestamp.ToString(); } }
         public string ProcessName { get { return _ProcessName; } }
         public int ProcessID { get { return _ProcessID; } }
@@ -51,6 +63,50 @@ namespace PsfMonitor
         public Int64 Start {  get { return _Start; } }
         public Int64 End {  get { return _End; } }
         public Int64 Duration {  get { return _End - _Start; } }
+
+        // Access view for Repeat Data
+        public int Count { get { return _Count; } }
+        public DateTime LastTimestamp { get { return _LastTimestamp; } }
+        public string LastTimestampAsText { get { return _LastTimestamp.ToString(); } }
+        public Int64 MinDuration { get { return _MinDuration; } }
+        public Int64 MaxDuration { get { return _MaxDuration; } }
+        public Int64 TotalDuration { get { return _TotalDuration; } }
+        public Int64 AverageDuration { get { return _TotalDuration / _Count; } }
+
+        public event PropertyChangedEventHandler PropertyChanged;
+
+        // Folds an identical event that came after this one into it
+        public void AddRepeat(EventItem repeat)
+        {
+            _Count += repeat._Count;
+            if (repeat._LastTimestamp > _LastTimestamp)
+            {
+                _LastTimestamp = repeat._LastTimestamp;
+            }
+            _MinDuration = Math.Min(_MinDuration, repeat._MinDuration);
+            _MaxDuration = Math.Max(_MaxDuration, repeat._MaxDuration);
+            _TotalDuration += repeat._TotalDuration;
+        }
+
+        // Once per flush, rather than per AddRepeat, so that the view only updates each row once however many repeats it got
+        public void NotifyRepeatsChanged()
+        {
+            PropertyChangedEventHandler handler = PropertyChanged;
+            if (handler != null)
+            {
+                handler(this, new PropertyChangedEventArgs(null));
+            }
+        }
+
+        // For items read back from a saved session
+        public void SetRepeats(int count, DateTime lastTimestamp, Int64 minDuration, Int64 maxDuration, Int64 totalDuration)
+        {
+            _Count = count;
+            _LastTimestamp = lastTimestamp;
+            _MinDuration = minDuration;
+            _MaxDuration = maxDuration;
+            _TotalDuration = totalDuration;
+        }
   
         // Access view for View Data
         public bool IsResultHidden { get { return _IsResultHidden; } set { _IsResultHidden = value; } }
@@ -76,6 +132,21 @@ namespace PsfMonitor
 
         public string EventIsResultClass { get { return _EventIsResultClass; } set { _EventIsResultClass = value; } }
 
+        // Kernel registry events that only identify their key by its control block, until ApplyKeyName names it
+        public UInt64 KeyHandle { get; set; } = 0;
+
+        // Adds the key's name to the end of the Key line of the inputs
+        public void ApplyKeyName(string keyName)
+        {
+            int lineEnd = _Inputs.IndexOf('\n');
+            if (lineEnd < 0)
+            {
+                lineEnd = _Inputs.Length;
+            }
+            _Inputs = _Inputs.Insert(lineEnd, " (" + keyName + ")");
+            KeyHandle = 0;
+        }
+
         public EventItem(Microsoft.Diagnostics.Tracing.TraceEvent data, string inputs, string result, string outputs, string caller)
         {
             // CTOR Used for received kernel events
@@ -105,7 +176,7 @@ namespace PsfMonitor
                 _Outputs = outputs;
             if (caller != null)
                 _Caller = caller;
-
+            InitializeRepeats();
         }
         public EventItem(int index, Int64 start, Int64 end, DateTime timestamp, string processname, int processid, int threadid, string eventsource, string sevent, string inputs, string result, string outputs, string caller)
         {
@@ -135,6 +206,15 @@ namespace PsfMonitor
             _Outputs = outputs;
             if (caller != null)
                 _Caller = caller;
+            InitializeRepeats();
+        }
+
+        private void InitializeRepeats()
+        {
+            _LastTimestamp = _Timestamp;
+            _MinDuration = Duration;
+            _MaxDuration = Duration;
+            _TotalDuration = Duration;
         }
     }
 }
@@ -0,0 +1,134 @@
+﻿//-------------------------------------------------------------------------------------------------------
+// Copyright (C) TMurgent Technologies. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// NOTE: PsfMonitor is a "procmon"-like display of events captured via the PSF TraceShim.
+//
+// Applications stuck in a retry loop send the same event thousands of times over (e.g. the same failing RegOpenKey, or
+// GetFileAttributes of a missing file). While repeats are being collapsed, an event with the same process, source,
+// operation, inputs and result as one that came less than RepeatWindowSeconds before it gets folded into that one's row
+// instead of getting a row of its own: the row counts the events, and keeps the time of the last of them and their
+// durations' minimum, maximum and total. Events from different threads of the process collapse into the same row, which
+// keeps the first one's thread id, outputs and caller. Everything that the filters and the search go by is the same for
+// every event in a row, so a row shows or hides as a whole, and only the first event's text gets indexed.
+//
+// NOTE: Events that arrive while paused, and registry events that are still waiting for their key's name, are never
+//       collapsed. Turning collapsing off or on only changes what happens to the events that arrive from then on
+
+using System;
+using System.Collections.Generic;
+using System.Windows;
+
+namespace PsfMonitor
+{
+    public partial class MainWindow : Window
+    {
+        private const double RepeatWindowSeconds = 1.0;
+
+        private bool _CollapseRepeats = true;
+        private int _CollapsedEventCount = 0;
+
+        // The newest row for each kind of event, for as long as another of them would still fold into it
+        private Dictionary<EventItem, EventItem> _RepeatRows = new Dictionary<EventItem, EventItem>(new RepeatComparer());
+
+        private class RepeatComparer : IEqualityComparer<EventItem>
+        {
+            public bool Equals(EventItem x, EventItem y)
+            {
+                return x.ProcessID == y.ProcessID &&
+                       string.Equals(x.Event, y.Event, StringComparison.Ordinal) &&
+                       string.Equals(x.Inputs, y.Inputs, StringComparison.Ordinal) &&
+                       string.Equals(x.Result, y.Result, StringComparison.Ordinal) &&
+                       string.Equals(x.EventSource, y.EventSource, StringComparison.Ordinal);
+            }
+
+            public int GetHashCode(EventItem ei)
+            {
+                int hash = ei.ProcessID;
+                hash = (hash * 31) + ei.Event.GetHashCode();
+                hash = (hash * 31) + ei.Inputs.GetHashCode();
+                hash = (hash * 31) + ei.Result.GetHashCode();
+                return hash;
+            }
+        }
+
+        // Called from FlushTraceEvents for each event, once the filters have been applied to it. Returns whether the event
+        // got folded into an earlier row, in which case the row gets added to 'changed' and the event is not kept
+        private bool CollapseRepeat(EventItem ei, HashSet<EventItem> changed)
+        {
+            if (!_CollapseRepeats || ei.IsPauseHidden || ei.KeyHandle != 0)
+            {
+                return false;
+            }
+
+            EventItem row;
+            if (_RepeatRows.TryGetValue(ei, out row) &&
+                (ei.Timestamp - row.LastTimestamp).TotalSeconds < RepeatWindowSeconds)
+            {
+                row.AddRepeat(ei);
+                changed.Add(row);
+                _CollapsedEventCount++;
+                return true;
+            }
+
+            // Replaces the key too, rather than only the value, so that the old row isn't kept alive by it
+            _RepeatRows.Remove(ei);
+            _RepeatRows.Add(ei, ei);
+            return false;
+        }
+
+        // Called at the end of each flush, with the time of the newest event, so that the rows that nothing can fold into
+        // anymore don't get held onto
+        private void ExpireRepeatRows(DateTime newest)
+        {
+            List<EventItem> expired = new List<EventItem>();
+            foreach (EventItem row in _RepeatRows.Values)
+            {
+                if ((newest - row.LastTimestamp).TotalSeconds >= RepeatWindowSeconds)
+                {
+                    expired.Add(row);
+                }
+            }
+            foreach (EventItem row in expired)
+            {
+                _RepeatRows.Remove(row);
+            }
+        }
+
+        // For when rows leave the model (spilled), or, with null, when the model gets cleared or replaced
+        private void ForgetRepeatRows(ICollection<EventItem> removed)
+        {
+            if (removed == null)
+            {
+                _RepeatRows.Clear();
+                _CollapsedEventCount = 0;
+                return;
+            }
+
+            HashSet<EventItem> removedSet = new HashSet<EventItem>(removed);
+            List<EventItem> forgotten = new List<EventItem>();
+            foreach (EventItem row in _RepeatRows.Values)
+            {
+                if (removedSet.Contains(row))
+                {
+                    forgotten.Add(row);
+                }
+            }
+            foreach (EventItem row in forgotten)
+            {
+                _RepeatRows.Remove(row);
+            }
+        }
+
+        private void bCollapseRepeats_Click(object sender, RoutedEventArgs e)
+        {
+            _CollapseRepeats = !_CollapseRepeats;
+            bCollapseRepeats.Content = _CollapseRepeats ? "Keep Repeats" : "Collapse Repeats";
+            if (!_CollapseRepeats)
+            {
+                _RepeatRows.Clear();
+            }
+        }
+    }
+}
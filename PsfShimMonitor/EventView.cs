@@ -6,6 +6,7 @@
 // NOTE: PsfMonitor is a "procmon"-like display of events captured via the PSF TraceShim.
 
 
+using System.Collections.Generic;
 using System.Windows;
 using System.Collections.ObjectModel;  // ObservableCollection
 
@@ -35,9 +36,34 @@ namespace PsfMonitor
             Update_Captured();
         }
 
+        // New events only need adding to the end of the view, rather than it being rebuilt
+        void AppendToFilteredViewList(List<EventItem> added)
+        {
+            foreach (EventItem ei in added)
+            {
+                if (!ei.IsHidden)
+                {
+                    _FilteredEventItems.Add(ei);
+                }
+            }
+            Update_Captured();
+        }
+
         private void Update_Captured()
         {
             Captured.Text = _FilteredEventItems.Count.ToString() + " of " + _ModelEventItems.Count.ToString() + " Events";
+            if (_CollapsedEventCount > 0)
+            {
+                Captured.Text += " (" + _CollapsedEventCount.ToString() + " repeats collapsed)";
+            }
+            if (_OpenedSessionPath != null)
+            {
+                Captured.Text += " from " + _OpenedSessionPath + " (" + _LiveEventsDiscarded.ToString() + " live events not kept; Clear to resume)";
+            }
+            else if (_SpilledEventCount > 0)
+            {
+                Captured.Text += " (" + _SpilledEventCount.ToString() + " older in " + _SpillFilePath + ")";
+            }
             Other.Text = "Kernel Control Blocks=" + _KernelControlBlocks.Count.ToString();
         }
 
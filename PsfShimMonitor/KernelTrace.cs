@@ -9,8 +9,6 @@ using Microsoft.Diagnostics.Tracing;  // consumer
 using Microsoft.Diagnostics.Tracing.Parsers;
 using Microsoft.Diagnostics.Tracing.Session; // controller
 using System;
-using System.ComponentModel;  // backgroundworker
-using System.Threading;
 using System.Windows;
 using System.Collections.Generic;
 using System.Collections.ObjectModel;  // ObservableCollection
@@ -19,53 +17,31 @@ namespace PsfMonitor
 {
     public partial class MainWindow : Window
     {
-        public TraceEventSession TraceEventSession_ProcsKernel = null;
-        public bool rememberToDisableSession_ProcsKernel = false;
         public bool PleaseStopCollecting = false;
         public int FilterOnProcessId = -1;
 
-        public List<EventItem> _TKernelEventListItems = new List<EventItem>();
-        public Object _TKernelEventListsLock = new Object();
-
         Dictionary<UInt64, string> _KernelControlBlocks = new Dictionary<UInt64, string>();
         Dictionary<UInt64, string> _TempKernelControlBlocks = new Dictionary<UInt64, string>();
         public Object _TempKernelControlBlocksListLock = new object();
 
-        private const int MAX_KernelControlBlocks = 100000;
-
-        private void KernelTraceInBackground_Start()
-        {
-            if (kerneleventbgw == null)
-                kerneleventbgw = new BackgroundWorker();
-            else if (kerneleventbgw.IsBusy)
-                return;
-            else
-                kerneleventbgw = new BackgroundWorker();
-
-
-
-            // Do processing in the background
-            kerneleventbgw.WorkerSupportsCancellation = true;
-            kerneleventbgw.WorkerReportsProgress = true;
-            kerneleventbgw.DoWork += KernelTrace_DoWork;
-            kerneleventbgw.ProgressChanged += KernelTrace_ProgressChanged;
-            kerneleventbgw.RunWorkerCompleted += KernelTrace_RunWorkerCompleted;
-            kerneleventbgw.RunWorkerAsync();
-        } // ETWTraceInBackground_Start()
+        Dictionary<UInt64, List<EventItem>> _EventsAwaitingKernelControlBlocks = new Dictionary<UInt64, List<EventItem>>();
+        int _EventsAwaitingKernelControlBlocksCount = 0;
+        bool _KernelControlBlocksAppliedToPastEvents = false;
 
-        private void KernelTrace_DoWork(object sender, DoWorkEventArgs e)
-        {
-            BackgroundWorker worker = sender as BackgroundWorker;
-            Thread.CurrentThread.Name = "ETWReader";
+        private const int MAX_KernelControlBlocks = 100000;
+        private const int MAX_EventsAwaitingKernelControlBlocks = 100000;
 
-            EnableKernelTrace(worker);
-        }
+        public string TargetPackageFullName = null;
+        public bool IncludeDiskIO = Array.Exists(Environment.GetCommandLineArgs(), arg => string.Equals(arg, "/diskio", StringComparison.OrdinalIgnoreCase) ||
+                                                                                       string.Equals(arg, "-diskio", StringComparison.OrdinalIgnoreCase));
 
-        private void KernelTrace_ProgressChanged(object sender, ProgressChangedEventArgs e)
+        // Called from the flush timer, on the UI thread, before FlushTraceEvents, so that the registry events in the batch
+        // get the names of the control blocks that the kernel named since the last time
+        private void FlushKernelControlBlocks()
         {
             try
             {
-                lock (_TKernelEventListsLock) //_TempKernelControlBlocksListLock)
+                lock (_TEventListsLock)
                 {
                     if (_TempKernelControlBlocks.Count > 0)
                     {
@@ -90,24 +66,12 @@ namespace PsfMonitor
                         _TempKernelControlBlocks.Clear();
                     }
                 }
-                lock (_TKernelEventListsLock) 
-                {
-                    if (_TKernelEventListItems.Count > 0)
-                    {
-                        foreach (EventItem ei in _TKernelEventListItems)
-                        {
-                            AppplyFilterToEventItem(ei);
-                            if (IsPaused)
-                                ei.IsPauseHidden = true;
-                            ApplyPastKernelControlBlocksToRegistryEvent(ei);
-                            _ModelEventItems.Add(ei);
-                        }
-                        _TKernelEventListItems.Clear();
 
-                        UpdateFilteredViewList();
-                    }
-                    else
-                        EventsGrid.Items.Refresh();
+                // Events that are already showing don't tell the grid that their inputs changed
+                if (_KernelControlBlocksAppliedToPastEvents)
+                {
+                    _KernelControlBlocksAppliedToPastEvents = false;
+                    EventsGrid.Items.Refresh();
                 }
             }
             catch (Exception ex)
@@ -119,983 +83,974 @@ namespace PsfMonitor
             }
         }
 
-        private void KernelTrace_RunWorkerCompleted(object sender, RunWorkerCompletedEventArgs e)
-        {
-            Status.Text = "NonKernel";
-        }
-
+        // Registry events that only have the key's control block get its name once a KCB event has named it, which can be
+        // after the event. Those still waiting are kept by KCB, so that each gets named once, when the name turns up
         private void ApplyKernelControlBlockstoPastRegistryEvents(UInt64 keyName, string sValue)
         {
-            foreach (EventItem ei in _ModelEventItems)
+            List<EventItem> waiting;
+            if (_EventsAwaitingKernelControlBlocks.TryGetValue(keyName, out waiting))
             {
-                if (ei.EventSource != null &&
-                    ei.EventSource.StartsWith("Registry/"))
+                foreach (EventItem ei in waiting)
                 {
-                    if (ei.Inputs != null &&
-                        ei.Inputs.Contains("KeyName=\n") &&
-                        !ei.Inputs.Contains(")\nKeyName="))
-                    {
-                        if (ei.Inputs.Contains("Key=      \t" + keyName.ToString() + "\n"))
-                        {
-                            ei.Inputs.Replace("\nKeyName=", " (" + sValue + ")\nKeyName=");
-                        }
-                    }
+                    ei.ApplyKeyName(sValue);
+                    AddWordsToEventIndex(ei, sValue);
                 }
+                _EventsAwaitingKernelControlBlocks.Remove(keyName);
+                _EventsAwaitingKernelControlBlocksCount -= waiting.Count;
+                _KernelControlBlocksAppliedToPastEvents = true;
             }
         }
         private void ApplyPastKernelControlBlocksToRegistryEvent(EventItem ei)
         {
-            if (ei.Event != null &&
-                ei.Event.StartsWith("Registry/"))
+            if (ei.KeyHandle == 0)
+            {
+                return;
+            }
+
+            string name;
+            if (_KernelControlBlocks.TryGetValue(ei.KeyHandle, out name))
             {
-                if (ei.Inputs != null &&
-                    ei.Inputs.Contains("KeyName=\n") &&
-                    !ei.Inputs.Contains(")\nKeyName="))
+                ei.ApplyKeyName(name);
+            }
+            else if (_EventsAwaitingKernelControlBlocksCount < MAX_EventsAwaitingKernelControlBlocks)
+            {
+                List<EventItem> waiting;
+                if (!_EventsAwaitingKernelControlBlocks.TryGetValue(ei.KeyHandle, out waiting))
                 {
-                    string matchh = ei.Inputs.Substring(10, ei.Inputs.IndexOf('\n') - 8);
-                    foreach (UInt64 key in _KernelControlBlocks.Keys)
-                    {
-                        if (key.ToString().Equals(matchh))
-                        {
-                            ei.Inputs.Replace("\nKeyName=", " (" + _KernelControlBlocks[key] + ")\nKeyName=");                            
-                            break;
-                        }
-                    }
+                    waiting = new List<EventItem>();
+                    _EventsAwaitingKernelControlBlocks.Add(ei.KeyHandle, waiting);
                 }
+                waiting.Add(ei);
+                ++_EventsAwaitingKernelControlBlocksCount;
             }
         }
 
-        int TSM_ProcID;
-        void EnableKernelTrace(BackgroundWorker worker)
+        // The kernel provider can't be given a process filter, so the callback has to see every event on the
+        // machine. What it can do is throw away the ones from other processes before looking at anything else. The
+        // processes to keep are the package's: those started in it, and their children, found from the Process/Start
+        // events (and the Process/DCStart ones for the processes that were already running). Processes that TraceFixup
+        // events come from are kept as well. Outside of a package, there's nothing to follow until the first TraceFixup
+        // event, so until then everything is kept.
+        private bool IsKernelEventOfTarget(int pid)
         {
-            TSM_ProcID = System.Diagnostics.Process.GetCurrentProcess().Id;
-            using (TraceEventSession_ProcsKernel = new TraceEventSession(KernelTraceEventParser.KernelSessionName))
+            lock (_ProcIDsOfTargetLock)
             {
-                bool restarted = false;
-                TraceEventSession_ProcsKernel.StopOnDispose = true;
-                try
-                {
-                    restarted = TraceEventSession_ProcsKernel.EnableKernelProvider(   KernelTraceEventParser.Keywords.FileIOInit
-                                                                                      | KernelTraceEventParser.Keywords.FileIO
-                                                                                      | KernelTraceEventParser.Keywords.Registry
-                                                                                      | KernelTraceEventParser.Keywords.ImageLoad
-                                                                                      | KernelTraceEventParser.Keywords.Process
-                                                                                      
-                                                                                      | KernelTraceEventParser.Keywords.DiskFileIO
-                                                                                      | KernelTraceEventParser.Keywords.DiskIOInit
-                                                                                      | KernelTraceEventParser.Keywords.DiskIO
-                                                                                      // | KernelTraceEventParser.Keywords.NetworkTCPIP
-                                                                                      // | KernelTraceEventParser.Keywords.SystemCall
-                                                                                      // | KernelTraceEventParser.Keywords.Driver
-                                                                                        );
-                }
-                catch
+                if (ProcIDsOfTarget.Count == 0 && TargetPackageFullName == null)
                 {
-                    ;  // We should continue without the kernel provider. This is normal behavior in some situations, such as when elevation was not granted
+                    return true;
                 }
-                if (!restarted)
+                return ProcIDsOfTarget.Contains(pid);
+            }
+        }
+
+        private void TrackTargetProcessTree(TraceEvent data)
+        {
+            Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessTraceData process = data as Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessTraceData;
+            if (process == null ||
+                (process.Opcode != TraceEventOpcode.Start && process.Opcode != TraceEventOpcode.DataCollectionStart))
+            {
+                return;
+            }
+
+            string package = null;
+            if ((process.Flags & Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags.PackageFullName) != 0)
+            {
+                package = data.PayloadStringByName("PackageFullName");
+            }
+
+            if ((TargetPackageFullName != null && string.Equals(package, TargetPackageFullName, StringComparison.OrdinalIgnoreCase)) ||
+                IsPidInProdIDsList(process.ParentID))
+            {
+                AddToProcIDsList(process.ProcessID);
+            }
+            else
+            {
+                // Process ids get reused once a process has exited
+                RemoveFromProcIDsList(process.ProcessID);
+            }
+        }
+
+        int TSM_ProcID;
+        // The kernel events come through the same session as the TraceFixup's (see Eventbgw_DoWork), which on Windows 8 and
+        // later can have the kernel provider along with other providers. The kernel provider has to be the first one that
+        // gets enabled in the session
+        void EnableKernelEvents(TraceEventSession session)
+        {
+            TSM_ProcID = System.Diagnostics.Process.GetCurrentProcess().Id;
+            TargetPackageFullName = GetPackageFullName();
+            try
+            {
+                KernelTraceEventParser.Keywords keywords =   KernelTraceEventParser.Keywords.FileIOInit
+                                                           | KernelTraceEventParser.Keywords.FileIO
+                                                           | KernelTraceEventParser.Keywords.Registry
+                                                           | KernelTraceEventParser.Keywords.ImageLoad
+                                                           | KernelTraceEventParser.Keywords.Process
+                                                           // | KernelTraceEventParser.Keywords.NetworkTCPIP
+                                                           // | KernelTraceEventParser.Keywords.SystemCall
+                                                           // | KernelTraceEventParser.Keywords.Driver
+                                                           ;
+                // The disk events are the busiest of all, and mostly come from the system rather than the application
+                if (IncludeDiskIO)
                 {
-                    rememberToDisableSession_ProcsKernel = true;
+                    keywords |=   KernelTraceEventParser.Keywords.DiskFileIO
+                                | KernelTraceEventParser.Keywords.DiskIOInit
+                                | KernelTraceEventParser.Keywords.DiskIO;
                 }
-                try
-                {
-                    TraceEventSession_ProcsKernel.Source.Kernel.All +=
-                         delegate (TraceEvent data)
+                session.EnableKernelProvider(keywords);
+            }
+            catch
+            {
+                ;  // We should continue without the kernel provider. This is normal behavior in some situations, such as when elevation was not granted
+            }
+            try
+            {
+                session.Source.Kernel.All +=
+                     delegate (TraceEvent data)
+                     {
+                         if (!PleaseStopCollecting &&
+                             data.ProcessID != TSM_ProcID)
                          {
-                             if (!PleaseStopCollecting &&
-                                 data.ProcessID != TSM_ProcID)
+                             int pid = (int)data.ProcessID;
+                             TrackTargetProcessTree(data);
+                             if (IsKernelEventOfTarget(pid))
                              {
-                                 int pid = (int)data.ProcessID;
-                                 if (ProcIDsOfTarget.Count == 0 || IsPidInProdIDsList(pid))
+
+                                 if (!data.EventName.StartsWith("Thread/") &&
+                                     !data.EventName.StartsWith("Image/DC") &&
+                                     !data.EventName.StartsWith("Process/DC"))  // disposes of most of the chaff
                                  {
 
-                                     if (!data.EventName.StartsWith("Thread/") &&
-                                         !data.EventName.StartsWith("Image/DC") &&
-                                         !data.EventName.StartsWith("Process/DC"))  // disposes of most of the chaff
+                                     if (data.EventName.StartsWith("Process/Start"))
                                      {
-
-                                         if (data.EventName.StartsWith("Process/Start"))
+                                         // (int)ProcessID, (int)ParentID, ImageFileName, (unknown)PageDirectoryBase, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)Flags, (int)SessionID, (Int)ExitStatus, (ulong)UniqueProcessKey, CommandLine, PackageFullName, (string)ApplicationID
+                                         // ExitStatus would not be valid
+                                         try
                                          {
-                                             // (int)ProcessID, (int)ParentID, ImageFileName, (unknown)PageDirectoryBase, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)Flags, (int)SessionID, (Int)ExitStatus, (ulong)UniqueProcessKey, CommandLine, PackageFullName, (string)ApplicationID
-                                             // ExitStatus would not be valid
-                                             try
+                                             string inputs = "ImageFileName=\t" + data.PayloadStringByName("ImageFileName");
+                                             inputs += "\nSessionID=\t" + data.PayloadStringByName("SessionID");
+                                             inputs += "\nFlags=    \t" + Interpret_KernelProcessFlags((Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)data.PayloadByName("Flags"));
+                                             if (((Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)data.PayloadByName("Flags") & Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags.PackageFullName) != 0)
+                                                 inputs += "\nPackageFullName=\t" + data.PayloadStringByName("PackageFullName").ToString();
+                                             string appid = data.PayloadStringByName("ApplicationID");
+                                             if (appid != null && appid.Length > 0)
+                                                 inputs += "\nApplicationID=\t" + appid;
+                                             inputs += "\nParentID=\t" + data.PayloadStringByName("ParentID");
+                                             inputs += "\nCommandLine\t" + data.PayloadStringByName("CommandLine");
+
+                                             string outputs = "ProcessID=\t" + data.PayloadStringByName("ProcessID");
+                                             outputs += "\nUniqueProcessKey=\t" + data.PayloadStringByName("UniqueProcessKey");
+
+                                             EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                             lock (_TEventListsLock)
                                              {
-                                                 string inputs = "ImageFileName=\t" + data.PayloadStringByName("ImageFileName");
-                                                 inputs += "\nSessionID=\t" + data.PayloadStringByName("SessionID");
-                                                 inputs += "\nFlags=    \t" + Interpret_KernelProcessFlags((Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)data.PayloadByName("Flags"));
-                                                 if (((Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)data.PayloadByName("Flags") & Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags.PackageFullName) != 0)
-                                                     inputs += "\nPackageFullName=\t" + data.PayloadStringByName("PackageFullName").ToString();
-                                                 string appid = data.PayloadStringByName("ApplicationID");
-                                                 if (appid != null && appid.Length > 0)
-                                                     inputs += "\nApplicationID=\t" + appid;
-                                                 inputs += "\nParentID=\t" + data.PayloadStringByName("ParentID");
-                                                 inputs += "\nCommandLine\t" + data.PayloadStringByName("CommandLine");
-
-                                                 string outputs = "ProcessID=\t" + data.PayloadStringByName("ProcessID");
-                                                 outputs += "\nUniqueProcessKey=\t" + data.PayloadStringByName("UniqueProcessKey");
-
-                                                 EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                 lock (_TKernelEventListsLock)
-                                                 {
-                                                     _TKernelEventListItems.Add(ei);
-                                                 }
-                                                 worker.ReportProgress((int)data.EventIndex);
-                                             }
-                                             catch (Exception ex)
-                                             {
-                                                 // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                 // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                 // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                 throw ex;
+                                                 _TEventListItems.Add(ei);
                                              }
                                          }
-                                         else if (data.EventName.StartsWith("Process/Stop"))
+                                         catch (Exception ex)
                                          {
-                                             // (int)ProcessID, (int)ParentID, ImageFileName, (unknown)PageDirectoryBase, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)Flags, (int)SessionID, (Int)ExitStatus, (ulong)UniqueProcessKey, CommandLine, PackageFullName, (string)ApplicationID
-                                             // SessionID is always 0
-                                             try
-                                             {
-                                                 string inputs = "ImageFileName=\t" + data.PayloadStringByName("ImageFileName");
-                                                 inputs += "\nSessionID=\t" + data.PayloadStringByName("SessionID");
-                                                 inputs += "\nUniqueProcessKey=\t" + data.PayloadStringByName("UniqueProcessKey");
-                                                 inputs += "\nCommandLine\t" + data.PayloadStringByName("CommandLine");
+                                             // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                             // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                             // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                             throw ex;
+                                         }
+                                     }
+                                     else if (data.EventName.StartsWith("Process/Stop"))
+                                     {
+                                         // (int)ProcessID, (int)ParentID, ImageFileName, (unknown)PageDirectoryBase, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags)Flags, (int)SessionID, (Int)ExitStatus, (ulong)UniqueProcessKey, CommandLine, PackageFullName, (string)ApplicationID
+                                         // SessionID is always 0
+                                         try
+                                         {
+                                             string inputs = "ImageFileName=\t" + data.PayloadStringByName("ImageFileName");
+                                             inputs += "\nSessionID=\t" + data.PayloadStringByName("SessionID");
+                                             inputs += "\nUniqueProcessKey=\t" + data.PayloadStringByName("UniqueProcessKey");
+                                             inputs += "\nCommandLine\t" + data.PayloadStringByName("CommandLine");
 
-                                                 string outputs = "ExitStatus=\t" + data.PayloadStringByName("ExitStatus");
+                                             string outputs = "ExitStatus=\t" + data.PayloadStringByName("ExitStatus");
 
-                                                 EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                 lock (_TKernelEventListsLock)
-                                                 {
-                                                     _TKernelEventListItems.Add(ei);
-                                                 }
-                                                 worker.ReportProgress((int)data.EventIndex);
-                                             }
-                                             catch (Exception ex)
+                                             EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                             lock (_TEventListsLock)
                                              {
-                                                 // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                 // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                 // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                 throw ex;
+                                                 _TEventListItems.Add(ei);
                                              }
                                          }
-                                         else if (data.EventName.StartsWith("Image/Load"))
+                                         catch (Exception ex)
                                          {
-                                             try
-                                             {
-                                                 // (ulong)ImageBase, (int)ImageSize, (int)ImageChecksum, (System.DateTime)TimeDateStamp, (ulong)DefaultBase, (System.DateTime)BuildTime, FileName
-                                                 string inputs = "FileName=  \t" + data.PayloadStringByName("FileName");
-                                                 string outputs = "";
-
-                                                 EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                 lock (_TKernelEventListsLock)
-                                                 {
-                                                     _TKernelEventListItems.Add(ei);
-                                                 }
-                                                 worker.ReportProgress((int)data.EventIndex);
-
+                                             // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                             // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                             // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                             throw ex;
+                                         }
+                                     }
+                                     else if (data.EventName.StartsWith("Image/Load"))
+                                     {
+                                         try
+                                         {
+                                             // (ulong)ImageBase, (int)ImageSize, (int)ImageChecksum, (System.DateTime)TimeDateStamp, (ulong)DefaultBase, (System.DateTime)BuildTime, FileName
+                                             string inputs = "FileName=  \t" + data.PayloadStringByName("FileName");
+                                             string outputs = "";
 
-                                             }
-                                             catch (Exception ex)
+                                             EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                             lock (_TEventListsLock)
                                              {
-                                                 // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                 // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                 // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                 throw ex;
+                                                 _TEventListItems.Add(ei);
                                              }
+
+
                                          }
-                                         else if (data.EventName.StartsWith("Image/Unload"))
-                                         {
-                                             ; // ignore
-                                         }
-                                         else if (data.EventName.StartsWith("FileIOInit"))
+                                         catch (Exception ex)
                                          {
-                                             ;  // ignore for now
+                                             // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                             // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                             // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                             throw ex;
                                          }
-                                         else if (data.EventName.StartsWith("FileIO"))
+                                     }
+                                     else if (data.EventName.StartsWith("Image/Unload"))
+                                     {
+                                         ; // ignore
+                                     }
+                                     else if (data.EventName.StartsWith("FileIOInit"))
+                                     {
+                                         ;  // ignore for now
+                                     }
+                                     else if (data.EventName.StartsWith("FileIO"))
+                                     {
+                                         if (data.EventName.StartsWith("FileIO/Query")) // also catch QueryInfo
                                          {
-                                             if (data.EventName.StartsWith("FileIO/Query")) // also catch QueryInfo
-                                             {
-                                                 // FileIO/Query     (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, InfoClass, FileName
-                                                 // FileIO/QueryInfo (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, InfoClass, FileName
+                                             // FileIO/Query     (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, InfoClass, FileName
+                                             // FileIO/QueryInfo (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, InfoClass, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nExtraInfo=  \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
-                                                         string outputs = "FileObject=\t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         outputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nExtraInfo=  \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
+                                                     string outputs = "FileObject=\t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     outputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Create"))
-                                             {
-                                                 // Microsoft.Diagnostics.Tracing.Parsers.Kernel.[CreateDisposition,CreateOptions]
-                                                 ; // IntPtr, (ulong)FileObject, CreateOptions, CreateDisposition, (System.IO.FileAttributes)FileAttributes, (System.IO.FileShare)ShareAccess, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Create"))
+                                         {
+                                             // Microsoft.Diagnostics.Tracing.Parsers.Kernel.[CreateDisposition,CreateOptions]
+                                             ; // IntPtr, (ulong)FileObject, CreateOptions, CreateDisposition, (System.IO.FileAttributes)FileAttributes, (System.IO.FileShare)ShareAccess, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
+                                                     string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
+                                                     inputs += "\nCreateOptions=\t";
+                                                     inputs += Interpret_KernelFileCreateOptions((Microsoft.Diagnostics.Tracing.Parsers.Kernel.CreateOptions)data.PayloadByName("CreateOptions"));
+                                                     inputs += "\nCreateDisposition=";
+                                                     inputs += Interpret_KernelFileCreateDispositions((Microsoft.Diagnostics.Tracing.Parsers.Kernel.CreateDisposition)data.PayloadByName("CreateDispostion")); // Yes, Microsoft misspelled this one!
+                                                     //inputs += " (" + data.PayloadStringByName("CreateDispostion") + ")";  // Yes, Microsoft misspelled this one!
+                                                     inputs += "\nFileAttributes=\t";// + ((UInt32)data.PayloadByName("FileAttributes")).ToString("x");
+                                                     inputs += " (" + data.PayloadStringByName("FileAttributes") + ")";
+                                                     inputs += "\nShareAccess=\t"; //+ ((UInt32)data.PayloadByName("ShareAccess")).ToString("x");
+                                                     inputs += " (" + data.PayloadStringByName("ShareAccess") + ")";
+
+                                                     string outputs = "FileObject=\t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     outputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "" );
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
-                                                         inputs += "\nCreateOptions=\t";
-                                                         inputs += Interpret_KernelFileCreateOptions((Microsoft.Diagnostics.Tracing.Parsers.Kernel.CreateOptions)data.PayloadByName("CreateOptions"));
-                                                         inputs += "\nCreateDisposition=";
-                                                         inputs += Interpret_KernelFileCreateDispositions((Microsoft.Diagnostics.Tracing.Parsers.Kernel.CreateDisposition)data.PayloadByName("CreateDispostion")); // Yes, Microsoft misspelled this one!
-                                                         //inputs += " (" + data.PayloadStringByName("CreateDispostion") + ")";  // Yes, Microsoft misspelled this one!
-                                                         inputs += "\nFileAttributes=\t";// + ((UInt32)data.PayloadByName("FileAttributes")).ToString("x");
-                                                         inputs += " (" + data.PayloadStringByName("FileAttributes") + ")";
-                                                         inputs += "\nShareAccess=\t"; //+ ((UInt32)data.PayloadByName("ShareAccess")).ToString("x");
-                                                         inputs += " (" + data.PayloadStringByName("ShareAccess") + ")";
-
-                                                         string outputs = "FileObject=\t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         outputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "" );
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
-                                                     {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/FileCreate"))
-                                             {
-                                                 // FileIO/Close (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/FileCreate"))
+                                         {
+                                             // FileIO/Close (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "FileName=   \t" + data.PayloadStringByName("FileName");
-                                                         string outputs = "FileKey=   \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "FileName=   \t" + data.PayloadStringByName("FileName");
+                                                     string outputs = "FileKey=   \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Read"))
-                                             {
-                                                 // FileIO/Read Offset, (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (int)IoFlags, (int)IoSize, (long)IoOffset, IoFlags, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Read"))
+                                         {
+                                             // FileIO/Read Offset, (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (int)IoFlags, (int)IoSize, (long)IoOffset, IoFlags, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "IrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nIoFlags=    \t0x" + ((int)data.PayloadByName("IoFlags")).ToString("x");
-                                                         inputs += "\nOffset=     \t0x" + ((long)data.PayloadByName("Offset")).ToString("x");
-                                                         inputs += "\nIoSize=     \t0x" + ((int)data.PayloadByName("IoSize")).ToString("x");
+                                                     string inputs = "IrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nIoFlags=    \t0x" + ((int)data.PayloadByName("IoFlags")).ToString("x");
+                                                     inputs += "\nOffset=     \t0x" + ((long)data.PayloadByName("Offset")).ToString("x");
+                                                     inputs += "\nIoSize=     \t0x" + ((int)data.PayloadByName("IoSize")).ToString("x");
 
-                                                         string outputs = "FileObject=  \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     string outputs = "FileObject=  \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
 
 
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Write"))
-                                             {
-                                                 // FileIO/Write Offset, (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (int)IoSize, (long)IoOffset, (int)IoFlags, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Write"))
+                                         {
+                                             // FileIO/Write Offset, (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (int)IoSize, (long)IoOffset, (int)IoFlags, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
-                                                         inputs += "\nIrpPtr=     \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileObject  \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nIoFlags=    \t0x" + ((int)data.PayloadByName("IoFlags")).ToString("x");
-                                                         inputs += "\nOffset=     \t0x" + ((long)data.PayloadByName("Offset")).ToString("x");
-                                                         inputs += "\nIoSize=     \t0x" + ((int)data.PayloadByName("IoSize")).ToString("x");
-                                                         string outputs = "";
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
+                                                     inputs += "\nIrpPtr=     \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileObject  \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nIoFlags=    \t0x" + ((int)data.PayloadByName("IoFlags")).ToString("x");
+                                                     inputs += "\nOffset=     \t0x" + ((long)data.PayloadByName("Offset")).ToString("x");
+                                                     inputs += "\nIoSize=     \t0x" + ((int)data.PayloadByName("IoSize")).ToString("x");
+                                                     string outputs = "";
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Close"))
-                                             {
-                                                 // FileIO/Close (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Close"))
+                                         {
+                                             // FileIO/Close (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
-                                                         inputs += "\nIrpPtr=     \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         string outputs = "";
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "FileName=\t" + data.PayloadStringByName("FileName");
+                                                     inputs += "\nIrpPtr=     \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     string outputs = "";
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Cleanup"))
-                                             {
-                                                 // FileIO/Cleanup (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Cleanup"))
+                                         {
+                                             // FileIO/Cleanup (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "FileName= \t" + data.PayloadStringByName("FileName");
-                                                         inputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileObject=\t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "\nFileKey=   \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-
-                                                         string outputs = "";
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "FileName= \t" + data.PayloadStringByName("FileName");
+                                                     inputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileObject=\t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "\nFileKey=   \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+
+                                                     string outputs = "";
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/OperationEnd"))
-                                             {
-                                                 ;//FileIO/OperationEnd: (ulong)IrpPtr, (ulong)ExtraInfo, (int)NtStatus)))
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/OperationEnd"))
+                                         {
+                                             ;//FileIO/OperationEnd: (ulong)IrpPtr, (ulong)ExtraInfo, (int)NtStatus)))
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
 
-                                                         string inputs = "IrpPtr=      \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     string inputs = "IrpPtr=      \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
 
-                                                         string outputs = "NtStatus= \t0x" + ((int)data.PayloadByName("NtStatus")).ToString("x");
-                                                         outputs += "\nExtraInfo=    \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string outputs = "NtStatus= \t0x" + ((int)data.PayloadByName("NtStatus")).ToString("x");
+                                                     outputs += "\nExtraInfo=    \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/DirEnum"))
-                                             {
-                                                 // FileIO/DirEnum: (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (string)DirectoryName, (int)Length, (int)InfoClass, (int)FileIndex, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/DirEnum"))
+                                         {
+                                             // FileIO/DirEnum: (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (string)DirectoryName, (int)Length, (int)InfoClass, (int)FileIndex, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
 
-                                                         string inputs = "DirectoryName=" + data.PayloadStringByName("DirectoryName");
-                                                         inputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-
-                                                         string outputs = "FileName=\t" + data.PayloadStringByName("FileName");
-                                                         outputs += "\nFileIndex= \t0x" + ((int)data.PayloadByName("FileIndex")).ToString("x");
-                                                         outputs += "\nLength=    \t0x" + ((int)data.PayloadByName("Length")).ToString("x");
-                                                         outputs += "\nInfoClass= \t0x" + ((int)data.PayloadByName("InfoClass")).ToString("x");
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "DirectoryName=" + data.PayloadStringByName("DirectoryName");
+                                                     inputs += "\nIrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+
+                                                     string outputs = "FileName=\t" + data.PayloadStringByName("FileName");
+                                                     outputs += "\nFileIndex= \t0x" + ((int)data.PayloadByName("FileIndex")).ToString("x");
+                                                     outputs += "\nLength=    \t0x" + ((int)data.PayloadByName("Length")).ToString("x");
+                                                     outputs += "\nInfoClass= \t0x" + ((int)data.PayloadByName("InfoClass")).ToString("x");
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/SetInfo"))
-                                             {
-                                                 // FileIO/SetInfo:   (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, (int)InfoClass, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/SetInfo"))
+                                         {
+                                             // FileIO/SetInfo:   (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, (int)InfoClass, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
 
-                                                         string inputs = "IrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nExtraInfo=  \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
-                                                         inputs += "\nInfoClass=  \t0x" + ((int)data.PayloadByName("InfoClass")).ToString("x");
-                                                         inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
-
-                                                         string outputs = "";
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "IrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nExtraInfo=  \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
+                                                     inputs += "\nInfoClass=  \t0x" + ((int)data.PayloadByName("InfoClass")).ToString("x");
+                                                     inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
+
+                                                     string outputs = "";
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Rename"))
-                                             {
-                                                 // FileIO/Rename:    (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, (int)InfoClass, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Rename"))
+                                         {
+                                             // FileIO/Rename:    (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, (int)InfoClass, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "IrpPtr=   \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nExtraInfo=  \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
-                                                         inputs += "\nInfoClass=  \t0x" + ((int)data.PayloadByName("InfoClass")).ToString("x");
-                                                         inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
-
-                                                         string outputs = ""; 
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "IrpPtr=   \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "\nFileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nExtraInfo=  \t0x" + ((ulong)data.PayloadByName("ExtraInfo")).ToString("x");
+                                                     inputs += "\nInfoClass=  \t0x" + ((int)data.PayloadByName("InfoClass")).ToString("x");
+                                                     inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
+
+                                                     string outputs = ""; 
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Delete"))
-                                             {
-                                                 // FileIO/Delete:    (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Delete"))
+                                         {
+                                             // FileIO/Delete:    (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
 
-                                                         string inputs = "FileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
+                                                     string inputs = "FileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
 
-                                                         string outputs = "";
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string outputs = "";
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/FileDelete"))
-                                             {
-                                                 // FileIO/FileDelete:    (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/FileDelete"))
+                                         {
+                                             // FileIO/FileDelete:    (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
 
-                                                         string inputs = "FileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
+                                                     string inputs = "FileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nFileName=   \t" + data.PayloadStringByName("FileName");
 
-                                                         string outputs = "";
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string outputs = "";
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("FileIO/Flush"))
-                                             {
-                                                 // FileIO/Flush:    (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/Flush"))
+                                         {
+                                             // FileIO/Flush:    (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
 
-                                                         string inputs = "IrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
-                                                         inputs += "FileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
-                                                         inputs += "FileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-                                                         inputs += "\nFileName= \t" + data.PayloadStringByName("FileName");
-
-                                                         string outputs = "";
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "IrpPtr=    \t0x" + ((ulong)data.PayloadByName("IrpPtr")).ToString("x");
+                                                     inputs += "FileObject= \t0x" + ((ulong)data.PayloadByName("FileObject")).ToString("x");
+                                                     inputs += "FileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+                                                     inputs += "\nFileName= \t" + data.PayloadStringByName("FileName");
+
+                                                     string outputs = "";
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
-                                             }
-                                             else if (data.EventName.StartsWith("FileIO/DirNotify"))
-                                             {
-                                                 // FileIO/DirNotify: (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, DirectoryName, Length, InfoClass, FileIndex, FileName 
-                                             }
-                                             else if (data.EventName.StartsWith("FileIO/FSControl"))
-                                             {
-                                                 // FileIO/FSControl: (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, (int)InfoClass, FileName
-                                             }
-                                             else
-                                             {
-                                                 ;
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
                                          }
-                                         else if (data.EventName.StartsWith("File/"))
+                                         else if (data.EventName.StartsWith("FileIO/DirNotify"))
+                                         {
+                                             // FileIO/DirNotify: (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, DirectoryName, Length, InfoClass, FileIndex, FileName 
+                                         }
+                                         else if (data.EventName.StartsWith("FileIO/FSControl"))
+                                         {
+                                             // FileIO/FSControl: (ulong)IrpPtr, (ulong)FileObject, (ulong)FileKey, (ulong)ExtraInfo, (int)InfoClass, FileName
+                                         }
+                                         else
                                          {
                                              ;
                                          }
-                                         else if (data.EventName.StartsWith("Registry/"))
+                                     }
+                                     else if (data.EventName.StartsWith("File/"))
+                                     {
+                                         ;
+                                     }
+                                     else if (data.EventName.StartsWith("Registry/"))
+                                     {
+                                         if (data.EventName.StartsWith("Registry/KCBDelete") ||
+                                             data.EventName.StartsWith("Registry/KCBRundownEnd") ||
+                                             data.EventName.StartsWith("Registry/KCBCreate")
+                                             )
                                          {
-                                             if (data.EventName.StartsWith("Registry/KCBDelete") ||
-                                                 data.EventName.StartsWith("Registry/KCBRundownEnd") ||
-                                                 data.EventName.StartsWith("Registry/KCBCreate")
-                                                 )
+                                             UInt64 k = (UInt64)data.PayloadByName("KeyHandle");
+                                             string n = data.PayloadStringByName("KeyName");
+                                             lock (_TEventListsLock) 
                                              {
-                                                 UInt64 k = (UInt64)data.PayloadByName("KeyHandle");
-                                                 string n = data.PayloadStringByName("KeyName");
-                                                 bool added = false;
-                                                 lock (_TKernelEventListsLock) 
+                                                 try
                                                  {
-                                                     try
+                                                     string olds = null;
+                                                     _TempKernelControlBlocks.TryGetValue(k, out olds);
+                                                     if (olds == null)
                                                      {
-                                                         string olds = null;
-                                                         _TempKernelControlBlocks.TryGetValue(k, out olds);
-                                                         if (olds == null)
-                                                         {
-                                                             _TempKernelControlBlocks.Add(k, n);
-                                                             added = true;
-                                                         }
-                                                     }
-                                                     catch
-                                                     {
-                                                         /* expected exception when key exists */
+                                                         _TempKernelControlBlocks.Add(k, n);
                                                      }
                                                  }
-                                                 if (added)
-                                                     worker.ReportProgress((int)0);
+                                                 catch
+                                                 {
+                                                     /* expected exception when key exists */
+                                                 }
                                              }
-                                             //else if (data.EventName.StartsWith("Registry/KCBCreate"))
-                                             //{
-                                             //    ;
-                                             //}
-                                             else if (data.EventName.StartsWith("Registry/EnumerateValueKey"))
-                                             {
-                                                 // Registry/EnumerateValueKey: (int)Status, (ulong)KeyHandle, (double)ElapsedTimeMSec, (string)KeyName, (string)ValueName, (int)Index
+                                         }
+                                         //else if (data.EventName.StartsWith("Registry/KCBCreate"))
+                                         //{
+                                         //    ;
+                                         //}
+                                         else if (data.EventName.StartsWith("Registry/EnumerateValueKey"))
+                                         {
+                                             // Registry/EnumerateValueKey: (int)Status, (ulong)KeyHandle, (double)ElapsedTimeMSec, (string)KeyName, (string)ValueName, (int)Index
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "KeyHandle=\t0x" + ((ulong)data.PayloadByName("KeyHandle")).ToString("x");
-                                                         inputs += "\nKeyName=  \t" + data.PayloadStringByName("KeyName");
-                                                         inputs += "\nIndex=    \t0x" + ((int)data.PayloadByName("Index")).ToString("x");
-
-                                                         string outputs = "Status= \t" + data.PayloadStringByName("Status");
-                                                         outputs += "\nValueName=\t" + data.PayloadStringByName("ValueName");
-                                                         outputs += "\nElapsedTimeMS=\t" + ((double)data.PayloadByName("ElapsedTimeMSec")).ToString();
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "KeyHandle=\t0x" + ((ulong)data.PayloadByName("KeyHandle")).ToString("x");
+                                                     inputs += "\nKeyName=  \t" + data.PayloadStringByName("KeyName");
+                                                     inputs += "\nIndex=    \t0x" + ((int)data.PayloadByName("Index")).ToString("x");
+
+                                                     string outputs = "Status= \t" + data.PayloadStringByName("Status");
+                                                     outputs += "\nValueName=\t" + data.PayloadStringByName("ValueName");
+                                                     outputs += "\nElapsedTimeMS=\t" + ((double)data.PayloadByName("ElapsedTimeMSec")).ToString();
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else  // other registry
-                                             {
+                                         }
+                                         else  // other registry
+                                         {
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
-                                                 {
-                                                     string inputs = "Key=      \t" + data.PayloadStringByName("KeyHandle") +
-                                                                   "\nKeyName= \t" + data.PayloadStringByName("KeyName") +
-                                                                   "\nValueName=\t" + data.PayloadStringByName("ValueName");
-                                                     string outputs = "Status=" + data.PayloadStringByName("Status");
+                                             {
+                                                 string keyName = data.PayloadStringByName("KeyName");
+                                                 string inputs = "Key=      \t" + data.PayloadStringByName("KeyHandle") +
+                                                               "\nKeyName= \t" + keyName +
+                                                               "\nValueName=\t" + data.PayloadStringByName("ValueName");
+                                                 string outputs = "Status=" + data.PayloadStringByName("Status");
 
-                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                     lock (_TKernelEventListsLock)
-                                                     {
-                                                         _TKernelEventListItems.Add(ei);
-                                                     }
-                                                     worker.ReportProgress((int)data.EventIndex);
+                                                 EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                 if (string.IsNullOrEmpty(keyName))
+                                                 {
+                                                     // The key is only known by its control block
+                                                     ei.KeyHandle = (UInt64)data.PayloadByName("KeyHandle");
+                                                 }
+                                                 lock (_TEventListsLock)
+                                                 {
+                                                     _TEventListItems.Add(ei);
                                                  }
                                              }
                                          }
+                                     }
 
-                                         else if (data.EventName.StartsWith("EventTrace"))
-                                         {
-                                             // EventTrace/Extension
-                                             // EventTrace/EndExtension
-                                             // EventTrace/RundownComplete  // end of a previously running process
-                                             ; // ignore
-                                         }
+                                     else if (data.EventName.StartsWith("EventTrace"))
+                                     {
+                                         // EventTrace/Extension
+                                         // EventTrace/EndExtension
+                                         // EventTrace/RundownComplete  // end of a previously running process
+                                         ; // ignore
+                                     }
 
-                                         else if (data.EventName.StartsWith("DiskIOInit"))
+                                     else if (data.EventName.StartsWith("DiskIOInit"))
+                                     {
+                                         ;
+                                     }
+                                     else if (data.EventName.StartsWith("DiskIO"))
+                                     {
+                                         if (data.EventName.StartsWith("DiskIO/WriteInit"))
                                          {
+                                             // DiskIO/WriteInit:  (ulong)Irp                                                
                                              ;
                                          }
-                                         else if (data.EventName.StartsWith("DiskIO"))
+                                         else if (data.EventName.StartsWith("DiskIO/Write"))
                                          {
-                                             if (data.EventName.StartsWith("DiskIO/WriteInit"))
-                                             {
-                                                 // DiskIO/WriteInit:  (ulong)Irp                                                
-                                                 ;
-                                             }
-                                             else if (data.EventName.StartsWith("DiskIO/Write"))
-                                             {
-                                                 // DiskIO/Write:  (int)DiskNumber, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)IrpFlags, Priority, TransferSize, ByteOffset, (ulong)Irp, (double)ElapsedTimeMSec, DiskServiceTimeMSec, (ulong)FileKey, FileName
+                                             // DiskIO/Write:  (int)DiskNumber, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)IrpFlags, Priority, TransferSize, ByteOffset, (ulong)Irp, (double)ElapsedTimeMSec, DiskServiceTimeMSec, (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "DiskNumber=    \t0x" + ((int)data.PayloadByName("DiskNumber")).ToString("x");
-                                                         inputs += "\nIrpFlags=    \t" + Interpret_KernelFile_IrpFlags((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)data.PayloadByName("IrpFlags"));
-                                                         inputs += "\nPriority=    \t" + Interpret_KernelFile_Priority((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IOPriority)data.PayloadByName("Priority"));
-                                                         inputs += "\nTransferSize=\t0x" + ((int)data.PayloadByName("Priority")).ToString("x");
-                                                         inputs += "\nByteOffset=  \t0x" + ((long)data.PayloadByName("ByteOffset")).ToString("x");
-                                                         inputs += "\nIrp=      \t0x" + ((ulong)data.PayloadByName("Irp")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-
-                                                         string outputs = "ElapsedTimeMS=\t" + data.PayloadStringByName("ElapsedTimeMS");
-                                                         outputs += "\nDiskServiceTimeMS=\t" + data.PayloadStringByName("DiskServiceTimeMSec");
-
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "DiskNumber=    \t0x" + ((int)data.PayloadByName("DiskNumber")).ToString("x");
+                                                     inputs += "\nIrpFlags=    \t" + Interpret_KernelFile_IrpFlags((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)data.PayloadByName("IrpFlags"));
+                                                     inputs += "\nPriority=    \t" + Interpret_KernelFile_Priority((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IOPriority)data.PayloadByName("Priority"));
+                                                     inputs += "\nTransferSize=\t0x" + ((int)data.PayloadByName("Priority")).ToString("x");
+                                                     inputs += "\nByteOffset=  \t0x" + ((long)data.PayloadByName("ByteOffset")).ToString("x");
+                                                     inputs += "\nIrp=      \t0x" + ((ulong)data.PayloadByName("Irp")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+
+                                                     string outputs = "ElapsedTimeMS=\t" + data.PayloadStringByName("ElapsedTimeMS");
+                                                     outputs += "\nDiskServiceTimeMS=\t" + data.PayloadStringByName("DiskServiceTimeMSec");
+
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
-                                             else if (data.EventName.StartsWith("DiskIO/ReadInit"))
-                                             {
-                                                 // DiskIO/ReadInit: (ulong)Irp
-                                                 ;
-                                             }
-                                             else if (data.EventName.StartsWith("DiskIO/Read"))
-                                             {
-                                                 // DiskIO/Read:  (int)DiskNumber, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)IrpFlags, Priority, TransferSize, ByteOffset, (ulong)Irp, (double)ElapsedTimeMSec, DiskServiceTimeMSec, (ulong)FileKey, FileName
+                                         }
+                                         else if (data.EventName.StartsWith("DiskIO/ReadInit"))
+                                         {
+                                             // DiskIO/ReadInit: (ulong)Irp
+                                             ;
+                                         }
+                                         else if (data.EventName.StartsWith("DiskIO/Read"))
+                                         {
+                                             // DiskIO/Read:  (int)DiskNumber, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)IrpFlags, Priority, TransferSize, ByteOffset, (ulong)Irp, (double)ElapsedTimeMSec, DiskServiceTimeMSec, (ulong)FileKey, FileName
 #if DEBUG
-                                                 if (_ModelEventItems.Count < 10000)
+                                             if (_ModelEventItems.Count < 10000)
 #else
-                                                 if (FilterOnProcessId == pid)
+                                             if (FilterOnProcessId == pid)
 #endif
+                                             {
+                                                 try
                                                  {
-                                                     try
-                                                     {
-                                                         string inputs = "DiskNumber=    \t0x" + ((int)data.PayloadByName("DiskNumber")).ToString("x");
-                                                         inputs += "\nIrpFlags=    \t" + Interpret_KernelFile_IrpFlags((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)data.PayloadByName("IrpFlags"));
-                                                         inputs += "\nPriority=    \t" + Interpret_KernelFile_Priority((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IOPriority)data.PayloadByName("Priority"));
-                                                         inputs += "\nTransferSize= \t0x" + ((int)data.PayloadByName("Priority")).ToString("x");
-                                                         inputs += "\nByteOffset=   \t0x" + ((long)data.PayloadByName("ByteOffset")).ToString("x");
-                                                         inputs += "\nIrp=      \t0x" + ((ulong)data.PayloadByName("Irp")).ToString("x");
-                                                         inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
-
-                                                         string outputs = "ElapsedTimeMS=\t" + data.PayloadStringByName("ElapsedTimeMS");
-                                                         outputs += "\nDiskServiceTimeMS=\t" + data.PayloadStringByName("DiskServiceTimeMSec");
-
-
-                                                         EventItem ei = new EventItem(data, inputs, "", outputs, "");
-                                                         lock (_TKernelEventListsLock)
-                                                         {
-                                                             _TKernelEventListItems.Add(ei);
-                                                         }
-                                                         worker.ReportProgress((int)data.EventIndex);
-                                                     }
-                                                     catch (Exception ex)
+                                                     string inputs = "DiskNumber=    \t0x" + ((int)data.PayloadByName("DiskNumber")).ToString("x");
+                                                     inputs += "\nIrpFlags=    \t" + Interpret_KernelFile_IrpFlags((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)data.PayloadByName("IrpFlags"));
+                                                     inputs += "\nPriority=    \t" + Interpret_KernelFile_Priority((Microsoft.Diagnostics.Tracing.Parsers.Kernel.IOPriority)data.PayloadByName("Priority"));
+                                                     inputs += "\nTransferSize= \t0x" + ((int)data.PayloadByName("Priority")).ToString("x");
+                                                     inputs += "\nByteOffset=   \t0x" + ((long)data.PayloadByName("ByteOffset")).ToString("x");
+                                                     inputs += "\nIrp=      \t0x" + ((ulong)data.PayloadByName("Irp")).ToString("x");
+                                                     inputs += "\nFileKey=    \t0x" + ((ulong)data.PayloadByName("FileKey")).ToString("x");
+
+                                                     string outputs = "ElapsedTimeMS=\t" + data.PayloadStringByName("ElapsedTimeMS");
+                                                     outputs += "\nDiskServiceTimeMS=\t" + data.PayloadStringByName("DiskServiceTimeMSec");
+
+
+                                                     EventItem ei = new EventItem(data, inputs, "", outputs, "");
+                                                     lock (_TEventListsLock)
                                                      {
-                                                         // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                                                         // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                                                         // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                                                         throw ex;
+                                                         _TEventListItems.Add(ei);
                                                      }
                                                  }
-                                             }
-                                             else if (data.EventName.StartsWith("DiskIO/FlushInit"))
-                                             {
-                                                 // DiskIO/FlushInit: (ulong)Irp
-                                                 ;
-                                             }
-                                             else if (data.EventName.StartsWith("DiskIO/FlushBuffers"))
-                                             {
-                                                 // DiskIO/FlushBuffers: (int)DiskNumber, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)IrpFlags, (ulong)Irp, (double)ElapsedTimeMSec
-                                                 ;
-                                             }
-                                             else
-                                             {
-                                                 // DiskIo\DriverMajorFunctionCall
-                                                 // DiskIo\DriverMajorFunctionReturn
-                                                 // DiskIo\DriverCompleteRequest
-                                                 // DiskIo\DriverCompleteRequestReturn
-                                                 ; // ignore
+                                                 catch (Exception ex)
+                                                 {
+                                                     // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                                                     // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                                                     // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                                                     throw ex;
+                                                 }
                                              }
                                          }
-                                         else if (data.EventName.StartsWith("DiskFileIOInit"))
+                                         else if (data.EventName.StartsWith("DiskIO/FlushInit"))
                                          {
+                                             // DiskIO/FlushInit: (ulong)Irp
                                              ;
                                          }
-                                         else if (data.EventName.StartsWith("DiskFileIO"))
+                                         else if (data.EventName.StartsWith("DiskIO/FlushBuffers"))
                                          {
+                                             // DiskIO/FlushBuffers: (int)DiskNumber, (Microsoft.Diagnostics.Tracing.Parsers.Kernel.IrpFlags)IrpFlags, (ulong)Irp, (double)ElapsedTimeMSec
                                              ;
                                          }
                                          else
                                          {
-                                             ; // ignore;
+                                             // DiskIo\DriverMajorFunctionCall
+                                             // DiskIo\DriverMajorFunctionReturn
+                                             // DiskIo\DriverCompleteRequest
+                                             // DiskIo\DriverCompleteRequestReturn
+                                             ; // ignore
                                          }
-
+                                     }
+                                     else if (data.EventName.StartsWith("DiskFileIOInit"))
+                                     {
+                                         ;
+                                     }
+                                     else if (data.EventName.StartsWith("DiskFileIO"))
+                                     {
+                                         ;
                                      }
                                      else
                                      {
-                                         //[Process,Thread,Image]/DCStart  : THese are associated with previously running processes.
-                                         if (data.EventName.StartsWith("Image/DC"))
+                                         ; // ignore;
+                                     }
+
+                                 }
+                                 else
+                                 {
+                                     //[Process,Thread,Image]/DCStart  : THese are associated with previously running processes.
+                                     if (data.EventName.StartsWith("Image/DC"))
+                                     {
+                                         ///if (!data.PayloadByName("PID").ToString().Equals("0"))
                                          {
-                                             ///if (!data.PayloadByName("PID").ToString().Equals("0"))
-                                             {
-                                                 /// WaitingForEventStart_ProcsKernel = false;
-                                             }
-                                              ;
+                                             /// WaitingForEventStart_ProcsKernel = false;
                                          }
+                                          ;
                                      }
                                  }
-                             };
+                             }
                          };
-                }
-                catch (Exception ex)
-                {
-                    // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
-                    // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
-                    // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
-                    throw ex;  
-                }
-                TraceEventSession_ProcsKernel.Source.Process();   // note: this call is sychronous
-            }
-        }
-
-        void DisableKernelTrace()
-        {
-            try
-            {
-                if (kerneleventbgw != null)
-                {
-                    kerneleventbgw.CancelAsync();
-                    kerneleventbgw = null;
-                }
+                     };
             }
-            catch
-            {
-                // this is code attempting to clean up.  It should be allowed to continue to do so or a second launch
-                // may have issues.
-            }
-            try
-            {
-                if (TraceEventSession_ProcsKernel != null)
-                {
-                    TraceEventSession_ProcsKernel.Source.StopProcessing();
-                    TraceEventSession_ProcsKernel.Source.Dispose();
-                    TraceEventSession_ProcsKernel = null;
-                }
-            }
-            catch
+            catch (Exception ex)
             {
-                // this is code attempting to clean up.  It should be allowed to continue to do so or a second launch
-                // may have issues.
+                // While the author feels compelled allow the application to continue the processing in this case, as it is warranted in a debugging tool not used in production code,
+                // and further that applications should never just crash, it seems that it is important to code reviewers that blank catches not be used.  
+                // But at this low level we can't reasonably alert the user so we'll just let it crash. Don't blame me.
+                throw ex;  
             }
         }
+
         private string Interpret_KernelProcessFlags(Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags flags)
         {
             if ((flags & Microsoft.Diagnostics.Tracing.Parsers.Kernel.ProcessFlags.None) != 0)
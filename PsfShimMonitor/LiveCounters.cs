@@ -0,0 +1,297 @@
+﻿//-------------------------------------------------------------------------------------------------------
+// Copyright (C) TMurgent Technologies. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// NOTE: PsfMonitor is a "procmon"-like display of events captured via the PSF TraceShim.
+//
+// A view of the live counters that the PsfRuntime publishes in each process that config.json enables them for (see the
+// PsfRuntime readme, and psf_live_counters_header in psf_runtime.h for the layout). The sections of the package's
+// processes are read once a second, which costs the processes nothing since they only update them that often anyway.
+
+using System;
+using System.Collections.Generic;
+using System.IO.MemoryMappedFiles;
+using System.Text;
+using System.Windows;
+using System.Windows.Controls;
+using System.Windows.Threading;  // DispatcherTimer
+
+namespace PsfMonitor
+{
+    public class LiveCounterItem
+    {
+        public int ProcessID { get; set; }
+        public string Fixup { get; set; }
+        public string Api { get; set; }
+        public UInt64 Calls { get; set; }
+        public UInt64 CallsPerSecond { get; set; }
+        public UInt64 Value1 { get; set; }
+        public UInt64 Value2 { get; set; }
+        public UInt64 Value3 { get; set; }
+        public UInt64 Value4 { get; set; }
+        public string FixupP50 { get; set; }
+        public string FixupP99 { get; set; }
+        public string CallP50 { get; set; }
+        public string CallP99 { get; set; }
+    }
+
+    public class LiveCountersWindow : Window
+    {
+        // Must match psf_runtime.h
+        private const uint LiveCountersMagic = 0x43464c50;
+        private const uint LiveCountersVersion = 1;
+        private const int HeaderSequenceOffset = 32;
+        private const int HeaderMinimumSize = 48;
+        private const int EntryFixupLength = 32;
+        private const int EntryApiOffset = 32;
+        private const int EntryApiLength = 48;
+        private const int EntryCallsOffset = 80;
+        private const int EntryValuesOffset = 88;
+        private const int EntryValueCount = 4;
+        private const int EntryFixupLatencyOffset = 120;
+        private const int EntryCallLatencyOffset = 376;
+        private const int LatencyBucketCount = 32;
+        private const int EntryMinimumSize = 632;
+        private const int ReadAttempts = 4;
+
+        private Func<List<int>> _GetProcessIDs;
+        private DataGrid _Grid = new DataGrid();
+        private TextBlock _Status = new TextBlock();
+        private DispatcherTimer _PollTimer = null;
+        private Dictionary<string, UInt64> _PreviousCalls = new Dictionary<string, UInt64>();
+
+        public LiveCountersWindow(Func<List<int>> getProcessIDs)
+        {
+            _GetProcessIDs = getProcessIDs;
+            Title = "PsfMonitor Live Counters";
+            Width = 900;
+            Height = 400;
+
+            _Grid.AutoGenerateColumns = true;
+            _Grid.IsReadOnly = true;
+            _Grid.HeadersVisibility = DataGridHeadersVisibility.Column;
+            DockPanel.SetDock(_Status, Dock.Bottom);
+            DockPanel panel = new DockPanel();
+            panel.Children.Add(_Status);
+            panel.Children.Add(_Grid);
+            Content = panel;
+
+            _PollTimer = new DispatcherTimer(DispatcherPriority.Background);
+            _PollTimer.Interval = TimeSpan.FromSeconds(1);
+            _PollTimer.Tick += PollTimer_Tick;
+            _PollTimer.Start();
+            Closed += (sender, e) => _PollTimer.Stop();
+            Poll();
+        }
+
+        private void PollTimer_Tick(object sender, EventArgs e)
+        {
+            Poll();
+        }
+
+        private void Poll()
+        {
+            List<LiveCounterItem> items = new List<LiveCounterItem>();
+            int publishing = 0;
+            List<int> pids = _GetProcessIDs();
+            foreach (int pid in pids)
+            {
+                if (ReadProcessCounters(pid, items))
+                {
+                    publishing++;
+                }
+            }
+
+            Dictionary<string, UInt64> calls = new Dictionary<string, UInt64>();
+            foreach (LiveCounterItem item in items)
+            {
+                string key = item.ProcessID.ToString() + "|" + item.Fixup + "|" + item.Api;
+                UInt64 previous;
+                if (_PreviousCalls.TryGetValue(key, out previous) && previous <= item.Calls)
+                {
+                    item.CallsPerSecond = item.Calls - previous;
+                }
+                calls[key] = item.Calls;
+            }
+            _PreviousCalls = calls;
+
+            _Grid.ItemsSource = items;
+            _Status.Text = publishing.ToString() + " of " + pids.Count.ToString() + " processes publishing live counters. Values are up to each fixup; see its readme.";
+        }
+
+        // Returns false if the process doesn't publish live counters (e.g. they aren't enabled in config.json), or it
+        // was updating them every time we looked
+        private static bool ReadProcessCounters(int pid, List<LiveCounterItem> items)
+        {
+            try
+            {
+                using (MemoryMappedFile section = MemoryMappedFile.OpenExisting("Local\\PsfLiveCounters_" + pid.ToString(), MemoryMappedFileRights.Read))
+                using (MemoryMappedViewAccessor view = section.CreateViewAccessor(0, 0, MemoryMappedFileAccess.Read))
+                {
+                    if (view.Capacity < HeaderMinimumSize ||
+                        view.ReadUInt32(0) != LiveCountersMagic ||
+                        view.ReadUInt32(4) != LiveCountersVersion)
+                    {
+                        return false;
+                    }
+
+                    long headerSize = view.ReadUInt32(8);
+                    long entrySize = view.ReadUInt32(12);
+                    if (headerSize < HeaderMinimumSize || entrySize < EntryMinimumSize)
+                    {
+                        return false;
+                    }
+
+                    for (int attempt = 0; attempt < ReadAttempts; attempt++)
+                    {
+                        UInt64 sequence = view.ReadUInt64(HeaderSequenceOffset);
+                        if ((sequence & 1) != 0)
+                        {
+                            System.Threading.Thread.Sleep(1);
+                            continue;
+                        }
+
+                        long count = Math.Min(view.ReadUInt32(20), view.ReadUInt32(16));
+                        count = Math.Min(count, (view.Capacity - headerSize) / entrySize);
+                        List<LiveCounterItem> read = new List<LiveCounterItem>();
+                        for (long i = 0; i < count; i++)
+                        {
+                            read.Add(ReadEntry(view, pid, headerSize + i * entrySize));
+                        }
+
+                        if (view.ReadUInt64(HeaderSequenceOffset) == sequence)
+                        {
+                            items.AddRange(read);
+                            return true;
+                        }
+                    }
+                }
+            }
+            catch
+            {
+                // Most likely the process doesn't publish them, or has exited
+            }
+            return false;
+        }
+
+        private static LiveCounterItem ReadEntry(MemoryMappedViewAccessor view, int pid, long offset)
+        {
+            LiveCounterItem item = new LiveCounterItem();
+            item.ProcessID = pid;
+            item.Fixup = ReadString(view, offset, EntryFixupLength);
+            item.Api = ReadString(view, offset + EntryApiOffset, EntryApiLength);
+            item.Calls = view.ReadUInt64(offset + EntryCallsOffset);
+            UInt64[] values = new UInt64[EntryValueCount];
+            for (int i = 0; i < EntryValueCount; i++)
+            {
+                values[i] = view.ReadUInt64(offset + EntryValuesOffset + i * 8);
+            }
+            item.Value1 = values[0];
+            item.Value2 = values[1];
+            item.Value3 = values[2];
+            item.Value4 = values[3];
+
+            UInt64[] fixupLatency = ReadHistogram(view, offset + EntryFixupLatencyOffset);
+            UInt64[] callLatency = ReadHistogram(view, offset + EntryCallLatencyOffset);
+            item.FixupP50 = Percentile(fixupLatency, 50);
+            item.FixupP99 = Percentile(fixupLatency, 99);
+            item.CallP50 = Percentile(callLatency, 50);
+            item.CallP99 = Percentile(callLatency, 99);
+            return item;
+        }
+
+        private static string ReadString(MemoryMappedViewAccessor view, long offset, int length)
+        {
+            byte[] bytes = new byte[length];
+            view.ReadArray(offset, bytes, 0, length);
+            int end = Array.IndexOf(bytes, (byte)0);
+            return Encoding.UTF8.GetString(bytes, 0, end < 0 ? length : end);
+        }
+
+        private static UInt64[] ReadHistogram(MemoryMappedViewAccessor view, long offset)
+        {
+            UInt64[] buckets = new UInt64[LatencyBucketCount];
+            view.ReadArray(offset, buckets, 0, LatencyBucketCount);
+            return buckets;
+        }
+
+        // The upper bound of the bucket that the percentile falls into, since that's all the histogram knows. Bucket N > 0
+        // counts calls that took [2^(N-1), 2^N) nanoseconds
+        private static string Percentile(UInt64[] buckets, int percent)
+        {
+            UInt64 total = 0;
+            foreach (UInt64 count in buckets)
+            {
+                total += count;
+            }
+            if (total == 0)
+            {
+                return "";
+            }
+
+            UInt64 needed = (total * (UInt64)percent + 99) / 100;
+            UInt64 seen = 0;
+            for (int bucket = 0; bucket < buckets.Length; bucket++)
+            {
+                seen += buckets[bucket];
+                if (seen >= needed)
+                {
+                    if (bucket == 0)
+                    {
+                        return "0";
+                    }
+                    double nanoseconds = Math.Pow(2, bucket);
+                    if (nanoseconds < 1000)
+                    {
+                        return "<" + nanoseconds.ToString("0") + "ns";
+                    }
+                    if (nanoseconds < 1000000)
+                    {
+                        return "<" + (nanoseconds / 1000).ToString("0.#") + "us";
+                    }
+                    return "<" + (nanoseconds / 1000000).ToString("0.#") + "ms";
+                }
+            }
+            return "";
+        }
+    }
+
+    public partial class MainWindow : Window
+    {
+        private LiveCountersWindow _LiveCountersWindow = null;
+
+        private List<int> GetProcIDsOfTarget()
+        {
+            lock (_ProcIDsOfTargetLock)
+            {
+                return new List<int>(ProcIDsOfTarget);
+            }
+        }
+
+        private void bLiveCounters_Click(object sender, RoutedEventArgs e)
+        {
+            try
+            {
+                if (_LiveCountersWindow == null)
+                {
+                    _LiveCountersWindow = new LiveCountersWindow(GetProcIDsOfTarget);
+                    _LiveCountersWindow.Owner = this;
+                    _LiveCountersWindow.Closed += (s, args) => _LiveCountersWindow = null;
+                    _LiveCountersWindow.Show();
+                }
+                else
+                {
+                    _LiveCountersWindow.Activate();
+                }
+            }
+            catch (Exception ex)
+            {
+                if (MessageBox.Show(UnexpectedErrorPrompt, ProgramTitle, MessageBoxButton.OKCancel, MessageBoxImage.Error) == MessageBoxResult.Cancel)
+                {
+                    throw ex;
+                }
+            }
+        }
+    }
+}
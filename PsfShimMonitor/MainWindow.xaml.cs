@@ -14,6 +14,8 @@ using Microsoft.Diagnostics.Tracing;  // consumer
 using Microsoft.Diagnostics.Tracing.Session; // controller
 using System.ComponentModel;  // backgroundworker
 using System.Threading;
+using System.Runtime.InteropServices;  // GetCurrentPackageFullName
+using System.Text;
 
 
 namespace PsfMonitor
@@ -41,14 +43,20 @@ namespace PsfMonitor
 
         private bool IsPaused = false;
         private BackgroundWorker eventbgw = null;
-        private BackgroundWorker kerneleventbgw = null;
         public TraceEventSession myTraceEventSession = null;
         public Provider etwprovider = new Provider("Microsoft-Windows-PSFTrace",  new Guid(0x61F777A1, 0x1E59, 0x4BFC, 0xA6, 0x1A, 0xEF, 0x19, 0xC7, 0x16, 0xDD, 0xC0));
+
+        // The one session has both the TraceFixup's events and the kernel's, which at their busiest come in at tens of
+        // thousands a second. Bigger buffers mean fewer of them to fill and hand over, and enough of them to ride out the
+        // flush timer and the UI thread falling behind for a while, without the session dropping events
+        private const int SessionBufferSizeMB = 64;
+        private const int SessionBufferQuantumKB = 1024;
         public int EventCounter = 1;
         public bool EventTraceProviderEnablementResultCode, EventTraceProviderSourceResultCode;
         public int LastSearchIndex = -1;
         public string LastSearchString = "";
-        public List<int> ProcIDsOfTarget = new List<int>();
+        public HashSet<int> ProcIDsOfTarget = new HashSet<int>();
+        private Object _ProcIDsOfTargetLock = new Object();
 
         public const string ProgramTitle = "PSFMonitor";
         public const string UnexpectedErrorPrompt = "An unexpected error had occurred. Click Cancel to close program";
@@ -61,7 +69,7 @@ namespace PsfMonitor
             EventsGrid.ItemsSource = FilteredEventItems;
 
             ETWTraceInBackground_Start(etwprovider);
-            KernelTraceInBackground_Start();
+            EventFlushTimer_Start();
             Status.Text = "Listening";
             Update_Captured();
             Closing += Dispose;
@@ -70,6 +78,7 @@ namespace PsfMonitor
         public void Dispose(object sender, CancelEventArgs e)
         {           
             PleaseStopCollecting = true;
+            EventFlushTimer_Stop();
             try
             {
                 if (eventbgw != null)
@@ -98,7 +107,6 @@ namespace PsfMonitor
                 // this is code attempting to clean up.  It should be allowed to continue to do so or a second launch
                 // may have issues.
             }
-            DisableKernelTrace();
         }
 
         private void ETWTraceInBackground_Start(Provider etwp)
@@ -118,14 +126,57 @@ namespace PsfMonitor
             
             // Do processing in the background
             eventbgw.WorkerSupportsCancellation = true;
-            eventbgw.WorkerReportsProgress = true;
             eventbgw.DoWork += Eventbgw_DoWork;
-            eventbgw.ProgressChanged += Eventbgw_ProgressChanged;
             eventbgw.RunWorkerCompleted += Eventbgw_RunWorkerCompleted;
 
             eventbgw.RunWorkerAsync(etwp);
         } // ETWTraceInBackground_Start()
 
+        [DllImport("kernel32.dll", CharSet = CharSet.Unicode)]
+        static extern int GetCurrentPackageFullName(ref int packageFullNameLength, StringBuilder packageFullName);
+
+        // Null when the monitor isn't running in a package
+        private static string GetPackageFullName()
+        {
+            int length = 0;
+            GetCurrentPackageFullName(ref length, null);
+            if (length == 0)
+            {
+                return null;
+            }
+            StringBuilder name = new StringBuilder(length);
+            if (GetCurrentPackageFullName(ref length, name) != 0)
+            {
+                return null;
+            }
+            return name.ToString();
+        }
+
+        private void SignalLauncherReady()
+        {
+            // The PsfLauncher waits on this event (named after the package, since an elevated monitor inherits nothing
+            // from it) before starting the application, so that no events get missed. Not being packaged, or not being
+            // started by the launcher, just means that nobody is waiting.
+            try
+            {
+                string name = GetPackageFullName();
+                if (name == null)
+                {
+                    return;
+                }
+
+                EventWaitHandle readyEvent;
+                if (EventWaitHandle.TryOpenExisting("Local\\PsfMonitorReady_" + name, out readyEvent))
+                {
+                    readyEvent.Set();
+                    readyEvent.Dispose();
+                }
+            }
+            catch
+            {
+            }
+        } // SignalLauncherReady()
+
         private void Eventbgw_DoWork(object sender, DoWorkEventArgs e)
         {
             // This is the background thread
@@ -133,12 +184,23 @@ namespace PsfMonitor
             BackgroundWorker worker = sender as BackgroundWorker;
             Thread.CurrentThread.Name = "ETWReader";
 
+            // A single session, and so a single thread and a single set of buffers, for both the TraceFixup's events and the
+            // kernel's (see EnableKernelEvents). Both come out of the session in the one sequence, already merged and in order,
+            // so the callbacks only need to add them to the one list
             using (myTraceEventSession = new TraceEventSession(etwp.name, TraceEventSessionOptions.Create))
             {
                 myTraceEventSession.StopOnDispose = true;
+                myTraceEventSession.BufferSizeMB = SessionBufferSizeMB;
+                myTraceEventSession.BufferQuantumKB = SessionBufferQuantumKB;
+                EnableKernelEvents(myTraceEventSession);
                 myTraceEventSession.Source.Dynamic.All += delegate (TraceEvent data)           // Set Source (stream of events) from session.  
                 {                                                                    // Get dynamic parser (knows about EventSources) 
                                                                                      // Subscribe to all EventSource events
+                    if (data.ProviderGuid != etwp.guid)
+                    {
+                        return;  // The kernel's own events go to EnableKernelEvents' callback
+                    }
+
                     string operation = "";
                     string inputs = "";
                     string result = "";
@@ -234,7 +296,6 @@ namespace PsfMonitor
                         _TEventListItems.Add(ei);
                         AddToProcIDsList(data.ProcessID);
                     }
-                    worker.ReportProgress((int)data.EventIndex);
                 };
 
                 EventTraceProviderEnablementResultCode = myTraceEventSession.EnableProvider(etwp.guid);    
@@ -244,63 +305,82 @@ namespace PsfMonitor
                     myTraceEventSession.DisableProvider(etwp.guid);
                     EventTraceProviderEnablementResultCode = myTraceEventSession.EnableProvider(etwp.guid);
                 }
+                SignalLauncherReady();
                 EventTraceProviderSourceResultCode = myTraceEventSession.Source.Process();
             }
         } // Eventbgw_DoWork()
+        // The session's thread uses the list, checking it for every kernel event, and so does the live counters view
         private void AddToProcIDsList(int pid)
         {
-            foreach (int match in ProcIDsOfTarget)
+            lock (_ProcIDsOfTargetLock)
             {
-                if (match == pid)
-                {
-                    return;
-                }
+                ProcIDsOfTarget.Add(pid);
+            }
+        }
+        private void RemoveFromProcIDsList(int pid)
+        {
+            lock (_ProcIDsOfTargetLock)
+            {
+                ProcIDsOfTarget.Remove(pid);
             }
-            ProcIDsOfTarget.Add(pid);
         }
         private bool IsPidInProdIDsList(int pid)
         {
-            foreach (int match in ProcIDsOfTarget)
+            lock (_ProcIDsOfTargetLock)
             {
-                if (match == pid)
-                {
-                    return true;
-                }
+                return ProcIDsOfTarget.Contains(pid);
             }
-            return false;
         }
-        private void Eventbgw_ProgressChanged(object sender, ProgressChangedEventArgs e)
+        // Called from the flush timer, on the UI thread, with the events that the session collected since the last time, both
+        // the TraceFixup's and the kernel's, in the order that the session delivered them
+        private void FlushTraceEvents(List<EventItem> added)
         {
             try
             {
+                List<EventItem> batch;
+                HashSet<EventItem> changed = new HashSet<EventItem>();
                 lock (_TEventListsLock)
                 {
-                    if (_TEventListItems.Count > 0)
+                    if (_TEventListItems.Count == 0)
                     {
-                        foreach (EventItem ei in _TEventListItems)
-                        {
-                            if (FilterOnProcessId < 0)
-                            {
-                                FilterOnProcessId = ei.ProcessID;
-                            }
-                            AppplyFilterToEventItem(ei);
-                            if (IsPaused)
-                            {
-                                ei.IsPauseHidden = true;
-                            }
-                            _ModelEventItems.Add(ei);
-                        }
-                        _TEventListItems.Clear();
+                        return;
+                    }
+                    batch = _TEventListItems;
+                    _TEventListItems = new List<EventItem>();
+                }
 
-                        UpdateFilteredViewList();
+                foreach (EventItem ei in batch)
+                {
+                    if (FilterOnProcessId < 0 && string.Equals(ei.EventSource, etwprovider.name, StringComparison.Ordinal))
+                    {
+                        FilterOnProcessId = ei.ProcessID;
+                    }
+                    AppplyFilterToEventItem(ei);
+                    if (IsPaused)
+                    {
+                        ei.IsPauseHidden = true;
+                    }
+                    ApplyPastKernelControlBlocksToRegistryEvent(ei);
+                    if (CollapseRepeat(ei, changed))
+                    {
+                        continue;
                     }
+                    _ModelEventItems.Add(ei);
+                    AddToEventIndexes(ei);
+                    added.Add(ei);
+                }
+
+                foreach (EventItem row in changed)
+                {
+                    row.NotifyRepeatsChanged();
                 }
+                ExpireRepeatRows(batch[batch.Count - 1].Timestamp);
             }
             catch
             {
                 ;
             }
-        } // Eventbgw_ProgressChanged()
+        } // FlushTraceEvents()
 
         private void Eventbgw_RunWorkerCompleted(object sender, RunWorkerCompletedEventArgs e)
         {
@@ -630,15 +710,7 @@ namespace PsfMonitor
             {
                 if (_ModelEventItems != null)
                 {
-                    bool anychanged = false;
-                    foreach (EventItem ei in _ModelEventItems)
-                    {
-                        if (ApplyFilterResultToEventItem(ei))
-                        {
-                            anychanged = true;
-                        }
-                    }
-                    if (anychanged)
+                    if (ApplyFilterResultToEventGroups())
                     {
                         UpdateFilteredViewList();
                     }
@@ -658,15 +730,7 @@ namespace PsfMonitor
             {
                 if (_ModelEventItems != null)
                 {
-                    bool anychanged = false;
-                    foreach (EventItem ei in _ModelEventItems)
-                    {
-                        if (ApplyFilterCategoryEventToEventItem(ei))
-                        {
-                            anychanged = true;
-                        }
-                    }
-                    if (anychanged)
+                    if (ApplyFilterCategoryEventToEventGroups())
                     {
                         UpdateFilteredViewList();
                     }
@@ -689,8 +753,13 @@ namespace PsfMonitor
         {
             try
             {
+                CloseOpenedSession();
                 _ModelEventItems.Clear();
                 _FilteredEventItems.Clear();
+                ClearEventIndexes();
+                ForgetRepeatRows(null);
+                _EventsAwaitingKernelControlBlocks.Clear();
+                _EventsAwaitingKernelControlBlocksCount = 0;
                 EventsGrid.Items.Refresh();
                 Update_Captured();
                 LastSearchIndex = -1;
@@ -732,12 +801,19 @@ namespace PsfMonitor
                     nextfound = LastSearchIndex;
                 }
 
+                // Only the events that have a word with the search string's longest word in it can have the search string
+                HashSet<EventItem> candidates = (search.Length > 0) ? FindSearchCandidates(search) : null;
+
                 int index = 0;
                 foreach (EventItem ei in _FilteredEventItems)
                 {
                     if (search.Length > 0)
                     {
-                        if (ei.Event != null && ei.Event.ToUpper().Contains(search))
+                        if (candidates != null && !candidates.Contains(ei))
+                        {
+                            ei.IsHighlighted = false;
+                        }
+                        else if (ei.Event != null && ei.Event.ToUpper().Contains(search))
                         {
                             ei.IsHighlighted = true;
                         }
@@ -0,0 +1,367 @@
+﻿//-------------------------------------------------------------------------------------------------------
+// Copyright (C) TMurgent Technologies. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// NOTE: PsfMonitor is a "procmon"-like display of events captured via the PSF TraceShim.
+//
+// Sessions are saved column by column rather than event by event, so that reloading one is a handful of large reads
+// instead of parsing every event. Every string field (process name, event, inputs, result, ...) is stored as an index
+// into one table of distinct strings, which both keeps the file small, since nearly all of the values repeat, and
+// means that each distinct string only gets created once when the session is loaded, and is then shared by all of the
+// events that have it. The other fields are fixed width. The layout is:
+//
+//      "PSFMON\0\0"            magic
+//      int32                   version
+//      int32                   event count (N)
+//      int32                   string count, followed by the strings (as BinaryWriter writes them)
+//      int32[N]                Index
+//      int64[N]                Timestamp (DateTime.Ticks)
+//      int64[N] x 2            Start, End
+//      int32[N] x 2            ProcessID, ThreadID
+//      int32[N] x 7            ProcessName, EventSource, Event, Inputs, Result, Outputs, Caller, as string indexes
+//      int32[N]                Count, of the events collapsed into each row (see EventRepeats.cs)
+//      int64[N]                LastTimestamp (DateTime.Ticks)
+//      int64[N] x 3            MinDuration, MaxDuration, TotalDuration
+//
+// Version 1 files end after the string columns, and every event in them is a row of its own
+
+using System;
+using System.Collections.Generic;
+using System.Collections.ObjectModel;  // ObservableCollection
+using System.IO;
+using System.Text;
+using System.Windows;
+using System.Windows.Input;
+
+namespace PsfMonitor
+{
+    public static class SessionFile
+    {
+        public const string Extension = ".psfmon";
+        private static readonly byte[] Magic = Encoding.ASCII.GetBytes("PSFMON\0\0");
+        private const int Version = 2;
+        private const int StringColumnCount = 7;
+
+        public static void Write(string path, IList<EventItem> events)
+        {
+            int count = events.Count;
+            int[] index = new int[count];
+            long[] timestamp = new long[count];
+            long[] start = new long[count];
+            long[] end = new long[count];
+            int[] processID = new int[count];
+            int[] threadID = new int[count];
+            int[][] strings = new int[StringColumnCount][];
+            for (int column = 0; column < StringColumnCount; column++)
+            {
+                strings[column] = new int[count];
+            }
+            int[] repeatCount = new int[count];
+            long[] lastTimestamp = new long[count];
+            long[] minDuration = new long[count];
+            long[] maxDuration = new long[count];
+            long[] totalDuration = new long[count];
+
+            List<string> table = new List<string>();
+            Dictionary<string, int> tableIndexes = new Dictionary<string, int>();
+            Func<string, int> intern = (s) =>
+            {
+                s = s ?? "";
+                int id;
+                if (!tableIndexes.TryGetValue(s, out id))
+                {
+                    id = table.Count;
+                    table.Add(s);
+                    tableIndexes.Add(s, id);
+                }
+                return id;
+            };
+
+            for (int i = 0; i < count; i++)
+            {
+                EventItem ei = events[i];
+                index[i] = ei.Index;
+                timestamp[i] = ei.Timestamp.Ticks;
+                start[i] = ei.Start;
+                end[i] = ei.End;
+                processID[i] = ei.ProcessID;
+                threadID[i] = ei.ThreadID;
+                strings[0][i] = intern(ei.ProcessName);
+                strings[1][i] = intern(ei.EventSource);
+                strings[2][i] = intern(ei.Event);
+                strings[3][i] = intern(ei.Inputs);
+                strings[4][i] = intern(ei.Result);
+                strings[5][i] = intern(ei.Outputs);
+                strings[6][i] = intern(ei.Caller);
+                repeatCount[i] = ei.Count;
+                lastTimestamp[i] = ei.LastTimestamp.Ticks;
+                minDuration[i] = ei.MinDuration;
+                maxDuration[i] = ei.MaxDuration;
+                totalDuration[i] = ei.TotalDuration;
+            }
+
+            using (BinaryWriter writer = new BinaryWriter(new FileStream(path, FileMode.Create, FileAccess.Write, FileShare.None, 1 << 16), Encoding.UTF8))
+            {
+                writer.Write(Magic);
+                writer.Write(Version);
+                writer.Write(count);
+                writer.Write(table.Count);
+                foreach (string s in table)
+                {
+                    writer.Write(s);
+                }
+                WriteColumn(writer, index, sizeof(int));
+                WriteColumn(writer, timestamp, sizeof(long));
+                WriteColumn(writer, start, sizeof(long));
+                WriteColumn(writer, end, sizeof(long));
+                WriteColumn(writer, processID, sizeof(int));
+                WriteColumn(writer, threadID, sizeof(int));
+                foreach (int[] column in strings)
+                {
+                    WriteColumn(writer, column, sizeof(int));
+                }
+                WriteColumn(writer, repeatCount, sizeof(int));
+                WriteColumn(writer, lastTimestamp, sizeof(long));
+                WriteColumn(writer, minDuration, sizeof(long));
+                WriteColumn(writer, maxDuration, sizeof(long));
+                WriteColumn(writer, totalDuration, sizeof(long));
+            }
+        }
+
+        public static List<EventItem> Read(string path)
+        {
+            using (BinaryReader reader = new BinaryReader(new FileStream(path, FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 16), Encoding.UTF8))
+            {
+                byte[] magic = reader.ReadBytes(Magic.Length);
+                if (!IsMagic(magic))
+                {
+                    throw new InvalidDataException(path + " is not a saved PsfMonitor session.");
+                }
+                int version = reader.ReadInt32();
+                if (version != 1 && version != Version)
+                {
+                    throw new InvalidDataException(path + " was saved by a different version of PsfMonitor.");
+                }
+
+                int count = reader.ReadInt32();
+                int tableCount = reader.ReadInt32();
+                if (count < 0 || tableCount < 0)
+                {
+                    throw new InvalidDataException(path + " is corrupt.");
+                }
+                string[] table = new string[tableCount];
+                for (int i = 0; i < tableCount; i++)
+                {
+                    table[i] = reader.ReadString();
+                }
+
+                int[] index = ReadInt32Column(reader, count);
+                long[] timestamp = ReadInt64Column(reader, count);
+                long[] start = ReadInt64Column(reader, count);
+                long[] end = ReadInt64Column(reader, count);
+                int[] processID = ReadInt32Column(reader, count);
+                int[] threadID = ReadInt32Column(reader, count);
+                int[][] strings = new int[StringColumnCount][];
+                for (int column = 0; column < StringColumnCount; column++)
+                {
+                    strings[column] = ReadInt32Column(reader, count);
+                    foreach (int id in strings[column])
+                    {
+                        if ((uint)id >= (uint)tableCount)
+                        {
+                            throw new InvalidDataException(path + " is corrupt.");
+                        }
+                    }
+                }
+
+                int[] repeatCount = null;
+                long[] lastTimestamp = null, minDuration = null, maxDuration = null, totalDuration = null;
+                if (version >= 2)
+                {
+                    repeatCount = ReadInt32Column(reader, count);
+                    lastTimestamp = ReadInt64Column(reader, count);
+                    minDuration = ReadInt64Column(reader, count);
+                    maxDuration = ReadInt64Column(reader, count);
+                    totalDuration = ReadInt64Column(reader, count);
+                    foreach (int repeats in repeatCount)
+                    {
+                        if (repeats < 1)
+                        {
+                            throw new InvalidDataException(path + " is corrupt.");
+                        }
+                    }
+                }
+
+                List<EventItem> events = new List<EventItem>(count);
+                for (int i = 0; i < count; i++)
+                {
+                    EventItem ei = new EventItem(index[i], start[i], end[i], new DateTime(timestamp[i]),
+                                                 table[strings[0][i]], processID[i], threadID[i], table[strings[1][i]], table[strings[2][i]],
+                                                 table[strings[3][i]], table[strings[4][i]], table[strings[5][i]], table[strings[6][i]]);
+                    if (repeatCount != null)
+                    {
+                        ei.SetRepeats(repeatCount[i], new DateTime(lastTimestamp[i]), minDuration[i], maxDuration[i], totalDuration[i]);
+                    }
+                    events.Add(ei);
+                }
+                return events;
+            }
+        }
+
+        private static bool IsMagic(byte[] bytes)
+        {
+            if (bytes.Length != Magic.Length)
+            {
+                return false;
+            }
+            for (int i = 0; i < Magic.Length; i++)
+            {
+                if (bytes[i] != Magic[i])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        private static void WriteColumn(BinaryWriter writer, Array column, int elementSize)
+        {
+            byte[] bytes = new byte[column.Length * elementSize];
+            Buffer.BlockCopy(column, 0, bytes, 0, bytes.Length);
+            writer.Write(bytes);
+        }
+
+        private static byte[] ReadColumnBytes(BinaryReader reader, int count, int elementSize)
+        {
+            byte[] bytes = reader.ReadBytes(checked(count * elementSize));
+            if (bytes.Length != count * elementSize)
+            {
+                throw new EndOfStreamException();
+            }
+            return bytes;
+        }
+
+        private static int[] ReadInt32Column(BinaryReader reader, int count)
+        {
+            int[] column = new int[count];
+            Buffer.BlockCopy(ReadColumnBytes(reader, count, sizeof(int)), 0, column, 0, count * sizeof(int));
+            return column;
+        }
+
+        private static long[] ReadInt64Column(BinaryReader reader, int count)
+        {
+            long[] column = new long[count];
+            Buffer.BlockCopy(ReadColumnBytes(reader, count, sizeof(long)), 0, column, 0, count * sizeof(long));
+            return column;
+        }
+    }
+
+    public partial class MainWindow : Window
+    {
+        // Set while a saved session is being displayed instead of the live one
+        private string _OpenedSessionPath = null;
+        private int _LiveEventsDiscarded = 0;
+
+        private void bSave_Click(object sender, RoutedEventArgs e)
+        {
+            try
+            {
+                Microsoft.Win32.SaveFileDialog dialog = new Microsoft.Win32.SaveFileDialog();
+                dialog.Filter = "PsfMonitor sessions (*" + SessionFile.Extension + ")|*" + SessionFile.Extension;
+                dialog.DefaultExt = SessionFile.Extension;
+                if (dialog.ShowDialog(this) != true)
+                {
+                    return;
+                }
+
+                Cursor = Cursors.Wait;
+                try
+                {
+                    SessionFile.Write(dialog.FileName, _ModelEventItems);
+                }
+                finally
+                {
+                    Cursor = null;
+                }
+                if (_SpilledEventCount > 0)
+                {
+                    MessageBox.Show("The " + _SpilledEventCount.ToString() + " oldest events were not saved, since they are no longer in memory. They are in " + _SpillFilePath + ".",
+                                    ProgramTitle, MessageBoxButton.OK, MessageBoxImage.Information);
+                }
+            }
+            catch (Exception ex)
+            {
+                MessageBox.Show("Unable to save the session: " + ex.Message, ProgramTitle, MessageBoxButton.OK, MessageBoxImage.Error);
+            }
+        }
+
+        // Displays a saved session in place of the live one, until the list is cleared. Events that get captured in the
+        // meantime are not kept, and none of a saved session is spilled to disk, however large it is
+        private void bOpen_Click(object sender, RoutedEventArgs e)
+        {
+            try
+            {
+                Microsoft.Win32.OpenFileDialog dialog = new Microsoft.Win32.OpenFileDialog();
+                dialog.Filter = "PsfMonitor sessions (*" + SessionFile.Extension + ")|*" + SessionFile.Extension;
+                if (dialog.ShowDialog(this) != true)
+                {
+                    return;
+                }
+
+                List<EventItem> events;
+                Cursor = Cursors.Wait;
+                try
+                {
+                    events = SessionFile.Read(dialog.FileName);
+                    foreach (EventItem ei in events)
+                    {
+                        ApplyFilterResultToEventItem(ei);
+                        ApplyFilterCategoryEventToEventItem(ei);
+                    }
+                }
+                finally
+                {
+                    Cursor = null;
+                }
+
+                _OpenedSessionPath = dialog.FileName;
+                _LiveEventsDiscarded = 0;
+                _ModelEventItems = new ObservableCollection<EventItem>(events);
+                RebuildEventIndexes();
+                ForgetRepeatRows(null);
+                _EventsAwaitingKernelControlBlocks.Clear();
+                _EventsAwaitingKernelControlBlocksCount = 0;
+                LastSearchIndex = -1;
+                LastSearchString = "";
+                UpdateFilteredViewList();
+            }
+            catch (Exception ex)
+            {
+                MessageBox.Show("Unable to open the session: " + ex.Message, ProgramTitle, MessageBoxButton.OK, MessageBoxImage.Error);
+            }
+        }
+
+        // Called from the flush timer, instead of adding the new events to the model, while a saved session is displayed
+        private void DiscardLiveEvents()
+        {
+            int discarded = 0;
+            lock (_TEventListsLock)
+            {
+                discarded += _TEventListItems.Count;
+                _TEventListItems = new List<EventItem>();
+            }
+            if (discarded > 0)
+            {
+                _LiveEventsDiscarded += discarded;
+                Update_Captured();
+            }
+        }
+
+        private void CloseOpenedSession()
+        {
+            _OpenedSessionPath = null;
+            _LiveEventsDiscarded = 0;
+        }
+    }
+}
@@ -3,6 +3,8 @@ msbuild CentennialFixups.sln /p:platform=x86;configuration=debug
 msbuild CentennialFixups.sln /p:platform=x86;configuration=release
 msbuild CentennialFixups.sln /p:platform=x64;configuration=debug
 msbuild CentennialFixups.sln /p:platform=x64;configuration=release
+msbuild CentennialFixups.sln /p:platform=ARM64;configuration=debug
+msbuild CentennialFixups.sln /p:platform=ARM64;configuration=release
 msbuild CentennialFixups.sln /p:platform=AnyCPU;configuration=debug
 msbuild CentennialFixups.sln /p:platform=AnyCPU;configuration=release
 pushd tests
@@ -0,0 +1,347 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A LoadLibrary of a bare file name (e.g. "foo.dll") makes the loader try each directory of the search path in turn:
+// the package graph, the application's directory, System32, the Windows directory, the current directory, and then
+// every PATH entry, each of which is a failed open until it gets to the one that has the dll. The index is built once,
+// during PSFInitialize, from a walk of the package, so that the fixups can hand the loader the full path instead. Names
+// are resolved the way that the loader would resolve them, in the order of:
+//
+//      1.  The application's directory
+//      2.  The package root
+//      3.  The VFS folder that stands in for System32 for the process' architecture (i.e. VFS\SystemX64 or SystemX86)
+//      4.  Anywhere else in the package (or in the "searchFolders" of the configuration, if any)
+//
+// The first of these that has the name wins. The fourth is only a stand in for the PATH, so names found there more than
+// once, in different folders, are left to the loader, as are names that System32 or the Windows directory also have,
+// since the loader looks there before it gets to the PATH.
+//
+// NOTE: Whether a dll is one that the process can load (i.e. of the same architecture) is only checked for the ones that
+//       get asked for, the first time that they are. Names that the loader never searches for are left alone: already
+//       loaded modules, KnownDLLs, and API sets
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fancy_handle.h>
+#include <psf_constants.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "DllIndex.h"
+
+using namespace std::literals;
+
+enum class dll_location
+{
+    executable_directory,
+    package_root,
+    vfs_system,
+    package,
+};
+
+enum dll_state : std::uint8_t
+{
+    unchecked,
+    loadable,
+    not_loadable,
+};
+
+struct dll_entry
+{
+    std::wstring name;
+    std::wstring path;
+    dll_location location;
+    bool ambiguous = false;
+    std::atomic<std::uint8_t> state = dll_state::unchecked;
+
+    dll_entry(std::wstring_view name, std::wstring path, dll_location location) :
+        name(name),
+        path(std::move(path)),
+        location(location)
+    {
+    }
+};
+
+// Only ever added to during PSFInitialize, so lookups don't need to synchronize with anything. The keys point into the
+// entries' names, which a deque never moves
+static std::deque<dll_entry> g_dllEntries;
+static std::unordered_map<iwstring_view, dll_entry*, case_insensitive_hash<wchar_t>> g_dllIndex;
+static std::unordered_set<iwstring, case_insensitive_hash<wchar_t>> g_knownDlls;
+
+static void load_known_dlls()
+{
+    HKEY key;
+    if (::RegOpenKeyExW(HKEY_LOCAL_MACHINE, LR"(System\CurrentControlSet\Control\Session Manager\KnownDLLs)", 0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS)
+    {
+        return;
+    }
+
+    for (DWORD i = 0; ; ++i)
+    {
+        wchar_t valueName[256];
+        wchar_t data[MAX_PATH];
+        DWORD valueNameLength = static_cast<DWORD>(std::size(valueName));
+        DWORD dataSize = sizeof(data) - sizeof(wchar_t);
+        DWORD type;
+        auto err = ::RegEnumValueW(key, i, valueName, &valueNameLength, nullptr, &type, reinterpret_cast<BYTE*>(data), &dataSize);
+        if (err == ERROR_NO_MORE_ITEMS)
+        {
+            break;
+        }
+        else if ((err == ERROR_SUCCESS) && (type == REG_SZ))
+        {
+            data[dataSize / sizeof(wchar_t)] = L'\0';
+            g_knownDlls.emplace(data);
+        }
+    }
+
+    ::RegCloseKey(key);
+}
+
+static void add_dll(std::wstring_view name, std::wstring path, dll_location location)
+{
+    if (g_knownDlls.find(iwstring_view(name.data(), name.length())) != g_knownDlls.end())
+    {
+        return;
+    }
+
+    auto itr = g_dllIndex.find(iwstring_view(name.data(), name.length()));
+    if (itr == g_dllIndex.end())
+    {
+        auto& entry = g_dllEntries.emplace_back(name, std::move(path), location);
+        g_dllIndex.emplace(iwstring_view(entry.name.data(), entry.name.length()), &entry);
+    }
+    else if ((itr->second->location == dll_location::package) && (location == dll_location::package) &&
+        (iwstring_view(itr->second->path.c_str()) != iwstring_view(path.c_str())))
+    {
+        itr->second->ambiguous = true;
+    }
+
+    // Otherwise, an earlier location already has the name, and the loader would find that one first
+}
+
+static void add_dlls(const std::wstring& directory, dll_location location, const std::wstring& skippedDirectory = {})
+{
+    std::vector<std::wstring> pending;
+    pending.push_back(directory);
+    while (!pending.empty())
+    {
+        auto dir = std::move(pending.back());
+        pending.pop_back();
+
+        WIN32_FIND_DATAW findData;
+        auto findHandle = ::FindFirstFileExW(
+            (dir + L"\\*").c_str(),
+            FindExInfoBasic,
+            &findData,
+            FindExSearchNameMatch,
+            nullptr,
+            FIND_FIRST_EX_LARGE_FETCH);
+        if (findHandle == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+
+        do
+        {
+            std::wstring_view name = findData.cFileName;
+            if ((name == L".") || (name == L".."))
+            {
+                continue;
+            }
+
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                // Only the package wide walk goes into sub-directories; the others are single folders of the search path
+                auto path = dir + L'\\' + findData.cFileName;
+                if ((location == dll_location::package) && !(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+                    (iwstring_view(path.c_str()) != iwstring_view(skippedDirectory.c_str())))
+                {
+                    pending.push_back(std::move(path));
+                }
+            }
+            else if ((name.length() > 4) && (iwstring_view(name.data() + name.length() - 4, 4) == L".dll"_isv))
+            {
+                add_dll(name, dir + L'\\' + findData.cFileName, location);
+            }
+        } while (::FindNextFileW(findHandle, &findData));
+
+        ::FindClose(findHandle);
+    }
+}
+
+void InitializeDllIndex()
+{
+    load_known_dlls();
+
+    std::wstring packageRoot = ::PSFQueryPackageRootPath();
+    while (!packageRoot.empty() && ((packageRoot.back() == L'\\') || (packageRoot.back() == L'/')))
+    {
+        packageRoot.pop_back();
+    }
+
+#ifdef _WIN64
+    auto systemFolder = packageRoot + LR"(\VFS\SystemX64)";
+    auto otherSystemFolder = packageRoot + LR"(\VFS\SystemX86)";
+#else
+    auto systemFolder = packageRoot + LR"(\VFS\SystemX86)";
+    auto otherSystemFolder = packageRoot + LR"(\VFS\SystemX64)";
+#endif
+
+    add_dlls(psf::current_executable_path().parent_path().native(), dll_location::executable_directory);
+    add_dlls(packageRoot, dll_location::package_root);
+    add_dlls(systemFolder, dll_location::vfs_system);
+
+    std::vector<std::wstring> searchFolders;
+    if (auto config = ::PSFQueryCurrentDllConfig())
+    {
+        if (auto folders = config->as_object().try_get("searchFolders"))
+        {
+            for (auto& folder : folders->as_array())
+            {
+                searchFolders.push_back(packageRoot + L'\\' + folder.as_string().wide());
+            }
+        }
+    }
+
+    if (searchFolders.empty())
+    {
+        searchFolders.push_back(packageRoot);
+    }
+
+    // The loader would never look for the process' dlls in the other architecture's system folder, so neither do we
+    for (auto& folder : searchFolders)
+    {
+        add_dlls(folder, dll_location::package, otherSystemFolder);
+    }
+}
+
+static bool is_process_machine(const wchar_t* path) noexcept
+{
+    constexpr WORD processMachine = psf::image_machine;
+
+    psf::unique_handle file(::CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+    IMAGE_DOS_HEADER dosHeader;
+    DWORD bytesRead;
+    if (!file || !::ReadFile(file.get(), &dosHeader, sizeof(dosHeader), &bytesRead, nullptr) || (bytesRead != sizeof(dosHeader)) ||
+        (dosHeader.e_magic != IMAGE_DOS_SIGNATURE))
+    {
+        return false;
+    }
+
+    struct
+    {
+        DWORD signature;
+        IMAGE_FILE_HEADER fileHeader;
+    } ntHeader;
+    LARGE_INTEGER offset;
+    offset.QuadPart = dosHeader.e_lfanew;
+    if (!::SetFilePointerEx(file.get(), offset, nullptr, FILE_BEGIN) ||
+        !::ReadFile(file.get(), &ntHeader, sizeof(ntHeader), &bytesRead, nullptr) || (bytesRead != sizeof(ntHeader)))
+    {
+        return false;
+    }
+
+    return (ntHeader.signature == IMAGE_NT_SIGNATURE) && (ntHeader.fileHeader.Machine == processMachine);
+}
+
+static bool exists_in_directory(UINT (__stdcall *getDirectory)(wchar_t*, UINT), const std::wstring& name) noexcept
+{
+    wchar_t path[MAX_PATH];
+    auto length = getDirectory(path, MAX_PATH);
+    if ((length == 0) || (length + 1 + name.length() >= MAX_PATH))
+    {
+        return false;
+    }
+
+    path[length] = L'\\';
+    name.copy(path + length + 1, name.length());
+    path[length + 1 + name.length()] = L'\0';
+    return ::GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+static bool is_loadable(dll_entry& entry) noexcept
+{
+    auto state = entry.state.load(std::memory_order_relaxed);
+    if (state == dll_state::unchecked)
+    {
+        // Racing threads only end up checking the same file more than once
+        auto loadable = is_process_machine(entry.path.c_str());
+        if (loadable && (entry.location == dll_location::package))
+        {
+            loadable = !exists_in_directory(&::GetSystemDirectoryW, entry.name) &&
+                !exists_in_directory(&::GetWindowsDirectoryW, entry.name);
+        }
+
+        state = loadable ? dll_state::loadable : dll_state::not_loadable;
+        entry.state.store(state, std::memory_order_relaxed);
+    }
+
+    return state == dll_state::loadable;
+}
+
+const wchar_t* FindPackageDll(const wchar_t* name, DWORD loadFlags) noexcept try
+{
+    if (!name || g_dllIndex.empty())
+    {
+        return nullptr;
+    }
+
+    // Asking for System32 only means that the package's copy isn't wanted
+    constexpr DWORD searchFlags = LOAD_LIBRARY_SEARCH_DEFAULT_DIRS | LOAD_LIBRARY_SEARCH_APPLICATION_DIR | LOAD_LIBRARY_SEARCH_USER_DIRS;
+    if ((loadFlags & LOAD_LIBRARY_SEARCH_SYSTEM32) && !(loadFlags & searchFlags))
+    {
+        return nullptr;
+    }
+
+    std::wstring_view nameView = name;
+    if (nameView.empty() || (nameView.find_first_of(L"\\/:") != std::wstring_view::npos))
+    {
+        return nullptr;
+    }
+
+    iwstring_view prefix(name, (nameView.length() < 4) ? nameView.length() : 4);
+    if ((prefix == L"api-"_isv) || (prefix == L"ext-"_isv))
+    {
+        return nullptr;
+    }
+
+    // The loader appends ".dll" to names without an extension, and a trailing '.' means "no extension", which none of the
+    // indexed names are
+    std::wstring key;
+    if (nameView.find(L'.') == std::wstring_view::npos)
+    {
+        key.reserve(nameView.length() + 4);
+        key.assign(nameView);
+        key.append(L".dll");
+        nameView = key;
+    }
+
+    auto itr = g_dllIndex.find(iwstring_view(nameView.data(), nameView.length()));
+    if ((itr == g_dllIndex.end()) || itr->second->ambiguous)
+    {
+        return nullptr;
+    }
+
+    // A module by that name that's already loaded is the one that the loader gives back, wherever it came from
+    if (::GetModuleHandleW(name))
+    {
+        return nullptr;
+    }
+
+    return is_loadable(*itr->second) ? itr->second->path.c_str() : nullptr;
+}
+catch (...)
+{
+    return nullptr;
+}
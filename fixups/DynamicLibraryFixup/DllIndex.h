@@ -0,0 +1,13 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <windows.h>
+
+void InitializeDllIndex();
+
+// Gives back the full path of the package dll that a LoadLibrary of 'name' would load, or null if 'name' isn't a bare
+// file name, or it's one that we can't be sure the loader would resolve to the package's copy of (see DllIndex.cpp)
+const wchar_t* FindPackageDll(const wchar_t* name, DWORD loadFlags = 0) noexcept;
@@ -0,0 +1,18 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Collection of function pointers that will always point to (what we think are) the actual function implementations.
+// That is, impl::LoadLibrary will (presumably) call kernelbase!LoadLibraryA/W, even though we detour that call
+#pragma once
+
+#include <windows.h>
+
+#include <psf_framework.h>
+
+namespace impl
+{
+    inline auto LoadLibrary = psf::detoured_string_function(&::LoadLibraryA, &::LoadLibraryW);
+    inline auto LoadLibraryEx = psf::detoured_string_function(&::LoadLibraryExA, &::LoadLibraryExW);
+}
@@ -0,0 +1,47 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <utilities.h>
+
+#include "DllIndex.h"
+#include "FunctionImplementations.h"
+
+template <typename CharT>
+HMODULE __stdcall LoadLibraryFixup(_In_ const CharT* libFileName) noexcept
+{
+    try
+    {
+        if (auto path = FindPackageDll(widen_argument(libFileName).c_str()))
+        {
+            return impl::LoadLibrary(path);
+        }
+    }
+    catch (...)
+    {
+        // Fall back to letting the loader search for it
+    }
+
+    return impl::LoadLibrary(libFileName);
+}
+DECLARE_STRING_FIXUP(impl::LoadLibrary, LoadLibraryFixup);
+
+template <typename CharT>
+HMODULE __stdcall LoadLibraryExFixup(_In_ const CharT* libFileName, _Reserved_ HANDLE file, _In_ DWORD flags) noexcept
+{
+    try
+    {
+        if (auto path = FindPackageDll(widen_argument(libFileName).c_str(), flags))
+        {
+            return impl::LoadLibraryEx(path, file, flags);
+        }
+    }
+    catch (...)
+    {
+        // Fall back to letting the loader search for it
+    }
+
+    return impl::LoadLibraryEx(libFileName, file, flags);
+}
+DECLARE_STRING_FIXUP(impl::LoadLibraryEx, LoadLibraryExFixup);
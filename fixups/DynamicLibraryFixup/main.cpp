@@ -0,0 +1,42 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <psf_framework.h>
+
+#include "DllIndex.h"
+
+extern "C" {
+
+int __stdcall PSFInitialize() noexcept try
+{
+    // The index needs to be complete before the first detoured call, since names that it doesn't have go to the loader
+    InitializeDllIndex();
+    psf::attach_all();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+int __stdcall PSFUninitialize() noexcept try
+{
+    psf::detach_all();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+#ifdef _M_IX86
+#pragma comment(linker, "/EXPORT:PSFInitialize=_PSFInitialize@0")
+#pragma comment(linker, "/EXPORT:PSFUninitialize=_PSFUninitialize@0")
+#else
+#pragma comment(linker, "/EXPORT:PSFInitialize=PSFInitialize")
+#pragma comment(linker, "/EXPORT:PSFUninitialize=PSFUninitialize")
+#endif
+
+}
@@ -0,0 +1,175 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Chromium keeps its caches (e.g. "Cache", "Code Cache" and "GPUCache") in directories directly under the app's user
+// data directory, and hits them harder than anything else that an Electron app does on disk. Rather than have each of
+// those accesses go through generic redirection, this recognizes them with a single comparison against the user data
+// directory followed by one against the names of the cache directories, and sends them to a configured directory
+// instead, e.g. one that isn't roamed or backed up. The target directories all get created when the fixup initializes,
+// so that Chromium never needs to create them through us.
+
+#include <algorithm>
+#include <cwctype>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <windows.h>
+#include <dos_paths.h>
+#include <known_folders.h>
+#include <psf_framework.h>
+
+#include "CacheRedirection.h"
+
+using namespace std::literals;
+
+// Both without trailing separators. Empty when not configured
+static std::wstring g_cacheUserDataPath;
+static std::wstring g_cacheTargetPath;
+static std::vector<std::wstring> g_cacheDirectories;
+
+// Chromium's own caches, and the ones that Electron's Chromium adds on top of them
+constexpr std::wstring_view default_cache_directories[] =
+{
+    L"Cache"sv,
+    L"Code Cache"sv,
+    L"GPUCache"sv,
+    L"DawnCache"sv,
+    L"GrShaderCache"sv,
+    L"ShaderCache"sv,
+};
+
+static std::wstring expand_path(std::wstring_view path)
+{
+    std::wstring input(path);
+    std::wstring result(MAX_PATH, L'\0');
+    for (;;)
+    {
+        auto length = ::ExpandEnvironmentStringsW(input.c_str(), result.data(), static_cast<DWORD>(result.size()));
+        if (length == 0)
+        {
+            throw_last_error();
+        }
+        if (length <= result.size())
+        {
+            result.resize(length - 1);
+            break;
+        }
+        result.resize(length);
+    }
+
+    return psf::remove_trailing_path_separators(std::filesystem::absolute(result)).wstring();
+}
+
+static bool equals_ignore_case(std::wstring_view lhs, std::wstring_view rhs) noexcept
+{
+    return (lhs.length() == rhs.length()) &&
+        (::CompareStringOrdinal(lhs.data(), static_cast<int>(lhs.length()), rhs.data(), static_cast<int>(rhs.length()), TRUE) == CSTR_EQUAL);
+}
+
+// Separators are compared as separators, since Chromium sometimes builds paths with forward slashes
+static bool starts_with_path_ignore_case(std::wstring_view path, std::wstring_view prefix) noexcept
+{
+    if (path.length() < prefix.length())
+    {
+        return false;
+    }
+
+    for (std::size_t i = 0; i < prefix.length(); ++i)
+    {
+        if (psf::is_path_separator(prefix[i]))
+        {
+            if (!psf::is_path_separator(path[i]))
+            {
+                return false;
+            }
+        }
+        else if ((path[i] != prefix[i]) && (std::towlower(path[i]) != std::towlower(prefix[i])))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void InitializeCacheRedirection()
+{
+    auto config = ::PSFQueryCurrentDllConfig();
+    auto cacheConfig = config ? config->as_object().try_get("cacheRedirection") : nullptr;
+    if (!cacheConfig)
+    {
+        return;
+    }
+
+    auto& cacheObject = cacheConfig->as_object();
+    auto userDataPath = expand_path(cacheObject.get("userDataPath").as_string().wide());
+    auto targetPath = expand_path(cacheObject.get("targetPath").as_string().wide());
+
+    std::vector<std::wstring> directories;
+    if (auto directoriesValue = cacheObject.try_get("directories"))
+    {
+        for (auto& directory : directoriesValue->as_array())
+        {
+            directories.emplace_back(directory.as_string().wide());
+        }
+    }
+    else
+    {
+        directories.assign(std::begin(default_cache_directories), std::end(default_cache_directories));
+    }
+
+    // Best effort: a directory that can't be created here just gets created by Chromium later, through the redirection
+    for (auto& directory : directories)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(targetPath) / directory, ec);
+    }
+
+    g_cacheUserDataPath = std::move(userDataPath);
+    g_cacheTargetPath = std::move(targetPath);
+    g_cacheDirectories = std::move(directories);
+}
+
+bool RedirectCachePath(const wchar_t* path, std::wstring& result)
+{
+    if (g_cacheUserDataPath.empty())
+    {
+        return false;
+    }
+
+    std::wstring_view view(path);
+    if (starts_with_path_ignore_case(view, LR"(\\?\)"sv))
+    {
+        view.remove_prefix(4);
+    }
+
+    if ((view.length() <= g_cacheUserDataPath.length()) ||
+        !psf::is_path_separator(view[g_cacheUserDataPath.length()]) ||
+        !starts_with_path_ignore_case(view, g_cacheUserDataPath))
+    {
+        return false;
+    }
+
+    // The component right after the user data directory is what decides, e.g. "GPUCache" in "<userData>\GPUCache\data_0"
+    auto rest = view.substr(g_cacheUserDataPath.length() + 1);
+    auto componentLength = std::find_if(rest.begin(), rest.end(), [](wchar_t ch) { return psf::is_path_separator(ch); }) - rest.begin();
+    auto component = rest.substr(0, componentLength);
+    for (auto& directory : g_cacheDirectories)
+    {
+        if (equals_ignore_case(component, directory))
+        {
+            result.reserve(g_cacheTargetPath.length() + 1 + rest.length());
+            result = g_cacheTargetPath;
+            result += L'\\';
+            result += rest;
+            std::replace(result.begin() + g_cacheTargetPath.length(), result.end(), L'/', L'\\');
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,41 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <string>
+#include <utility>
+
+#include <utilities.h>
+
+// Reads the "cacheRedirection" configuration and creates the directories that the caches get redirected to
+void InitializeCacheRedirection();
+
+// Sets 'result' to where 'path' goes when it's in one of Chromium's cache directories under the app's user data
+// directory, and returns false, leaving 'result' alone, otherwise
+bool RedirectCachePath(const wchar_t* path, std::wstring& result);
+
+// A path argument of one of the detours, widened, and redirected if it's in a cache directory
+template <typename CharT>
+struct electron_path_argument
+{
+    decltype(widen_argument(std::declval<const CharT*>())) original;
+    std::wstring redirected;
+
+    const wchar_t* c_str() const noexcept
+    {
+        return redirected.empty() ? original.c_str() : redirected.c_str();
+    }
+};
+
+template <typename CharT>
+inline electron_path_argument<CharT> path_argument(const CharT* path)
+{
+    electron_path_argument<CharT> result{ widen_argument(path) };
+    if (result.original.c_str())
+    {
+        RedirectCachePath(result.original.c_str(), result.redirected);
+    }
+    return result;
+}
@@ -1,4 +1,5 @@
 #include "ElectronFixupForPartialTrustImpls.h"
+#include "CacheRedirection.h"
 
 #include "psf_framework.h"
 #include "reentrancy_guard.h"
@@ -7,7 +8,11 @@
 
 #include <Windows.h>
 #include <fileapifromapp.h>
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <type_traits>
 
 ///
 // detectPipe
@@ -15,16 +20,30 @@
 // - Checks for form: \\.\pipe\<token>
 // - Will only allow local pipes
 // - Will not look for local pipes using localhost or 127.0.0.1
-static bool detectPipe(std::wstring_view pipeName);
-static bool detectPipe(std::string_view  pipeName);
+// Nearly every CreateFile call is for an ordinary file, so this only looks at the first few characters of the argument
+// as given, without measuring or widening it
+template <typename CharT>
+static bool detectPipe(const CharT* pipeName) noexcept;
 
 ///
 // getLocalPipeName
-// Given an input string, prefixs the pipe path with a UWP accepted pipe path
+// Given an input string that detectPipe accepts, prefixs the pipe path with a UWP accepted pipe path
 //  - Converts path: \\.\pipe\<token>
 //               to: \\.\pipe\LOCAL\<token>
-static wide_argument_string_with_buffer getLocalPipeName(LPCWSTR pipeName);
-static wide_argument_string_with_buffer getLocalPipeName(LPCSTR  pipeName);
+// Chromium opens the same few IPC pipes over and over, so the names that get converted are remembered
+struct local_pipe_name
+{
+    const wchar_t* value = nullptr; // Either a remembered name, or 'buffer'
+    std::wstring buffer;
+
+    const wchar_t* c_str() const noexcept
+    {
+        return value ? value : buffer.c_str();
+    }
+};
+
+template <typename CharT>
+static local_pipe_name getLocalPipeName(const CharT* pipeName);
 
 template <typename CharT>
 HANDLE WINAPI CreateFileFixup(
@@ -40,14 +59,13 @@ HANDLE WINAPI CreateFileFixup(
     if (guard) 
     {
         // CreateFile also services pipes. Check if the input is a pipe first
-        auto newPipeName = getLocalPipeName(lpFileName);
-        if (newPipeName.c_str())
+        if (lpFileName && detectPipe(lpFileName))
         {
             // Pipes must use the native API
-            return impl::CreateFile(newPipeName.c_str(), dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
+            return impl::CreateFile(getLocalPipeName(lpFileName).c_str(), dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
         }
 
-        return CreateFileFromAppW(widen_argument(lpFileName).c_str(), dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
+        return CreateFileFromAppW(path_argument(lpFileName).c_str(), dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -63,7 +81,7 @@ BOOL WINAPI CreateDirectoryFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard) 
     {
-        return CreateDirectoryFromAppW(widen_argument(lpPathName).c_str(), lpSecurityAttributes);
+        return CreateDirectoryFromAppW(path_argument(lpPathName).c_str(), lpSecurityAttributes);
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -80,7 +98,7 @@ BOOL WINAPI CopyFileFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard)
     {
-        return CopyFileFromAppW(widen_argument(lpExistingFileName).c_str(), widen_argument(lpNewFileName).c_str(), bFailIfExists);
+        return CopyFileFromAppW(path_argument(lpExistingFileName).c_str(), path_argument(lpNewFileName).c_str(), bFailIfExists);
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -95,7 +113,7 @@ BOOL WINAPI DeleteFileFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard) 
     {
-        return DeleteFileFromAppW(widen_argument(lpFileName).c_str());
+        return DeleteFileFromAppW(path_argument(lpFileName).c_str());
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -126,7 +144,7 @@ HANDLE WINAPI FindFirstFileExFixup(
         }
 
         // If lpFindFileData was nullptr, we carry forward that error.
-        auto status = FindFirstFileExFromAppW(widen_argument(lpFileName).c_str(), fInfoLevelId, findData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
+        auto status = FindFirstFileExFromAppW(path_argument(lpFileName).c_str(), fInfoLevelId, findData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
 
         // Do the conversion from wide to narrow struct if required
         if ((lpFindFileData != nullptr) && (psf::is_ansi<CharT>) && status)
@@ -161,7 +179,7 @@ DWORD WINAPI GetFileAttributesFixup(
     if (guard) 
     {
         WIN32_FILE_ATTRIBUTE_DATA data;
-        GetFileAttributesExFromAppW(widen_argument(lpFileName).c_str(), GET_FILEEX_INFO_LEVELS::GetFileExInfoStandard, &data);
+        GetFileAttributesExFromAppW(path_argument(lpFileName).c_str(), GET_FILEEX_INFO_LEVELS::GetFileExInfoStandard, &data);
 
         return data.dwFileAttributes;
     }
@@ -180,7 +198,7 @@ BOOL WINAPI GetFileAttributesExFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard)
     {
-        return GetFileAttributesExFromAppW(widen_argument(lpFileName).c_str(), fInfoLevelId, lpFileInformation);
+        return GetFileAttributesExFromAppW(path_argument(lpFileName).c_str(), fInfoLevelId, lpFileInformation);
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -196,7 +214,7 @@ BOOL WINAPI MoveFileFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard)
     {
-        return MoveFileFromAppW(widen_argument(lpExistingFileName).c_str(), widen_argument(lpNewFileName).c_str());
+        return MoveFileFromAppW(path_argument(lpExistingFileName).c_str(), path_argument(lpNewFileName).c_str());
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -214,10 +232,12 @@ BOOL WINAPI MoveFileExFixup(
     if (guard)
     {
         // Try the native implementation first
-        if (!impl::MoveFileEx(lpExistingFileName, lpNewFileName, dwFlags))
+        auto existingFileName = path_argument(lpExistingFileName);
+        auto newFileName = path_argument(lpNewFileName);
+        if (!impl::MoveFileEx(existingFileName.c_str(), newFileName.c_str(), dwFlags))
         {
             // Attempt the move ignoring the dwFlags
-            return MoveFileFromAppW(widen_argument(lpExistingFileName).c_str(), widen_argument(lpNewFileName).c_str());
+            return MoveFileFromAppW(existingFileName.c_str(), newFileName.c_str());
         }
 
         // If we get here, the native implementation succeeded
@@ -236,7 +256,7 @@ BOOL WINAPI RemoveDirectoryFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard) 
     {
-        return RemoveDirectoryFromAppW(widen_argument(lpPathName).c_str());
+        return RemoveDirectoryFromAppW(path_argument(lpPathName).c_str());
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -259,10 +279,10 @@ BOOL WINAPI ReplaceFileFixup(
         // lpBackupFileName is not always included
         if (lpBackupFileName)
         {
-            return ReplaceFileFromAppW(widen_argument(lpReplacedFileName).c_str(), widen_argument(lpReplacementFileName).c_str(), widen_argument(lpBackupFileName).c_str(), dwReplaceFlags, lpExclude, lpReserved);
+            return ReplaceFileFromAppW(path_argument(lpReplacedFileName).c_str(), path_argument(lpReplacementFileName).c_str(), path_argument(lpBackupFileName).c_str(), dwReplaceFlags, lpExclude, lpReserved);
         }
 
-        return ReplaceFileFromAppW(widen_argument(lpReplacedFileName).c_str(), widen_argument(lpReplacementFileName).c_str(), nullptr, dwReplaceFlags, lpExclude, lpReserved);
+        return ReplaceFileFromAppW(path_argument(lpReplacedFileName).c_str(), path_argument(lpReplacementFileName).c_str(), nullptr, dwReplaceFlags, lpExclude, lpReserved);
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -278,7 +298,7 @@ BOOL WINAPI SetFileAttributesFixup(
     auto guard = g_reentrancyGuard.enter();
     if (guard) 
     {
-        return SetFileAttributesFromAppW(widen_argument(lpFileName).c_str(), dwFileAttributes);
+        return SetFileAttributesFromAppW(path_argument(lpFileName).c_str(), dwFileAttributes);
     }
 
     // If we have already fixed this function, fall back on the native call
@@ -297,6 +317,11 @@ HANDLE WINAPI CreateNamedPipeFixup(
     _In_ DWORD        nDefaultTimeOut,
     _In_opt_ LPSECURITY_ATTRIBUTES lpSecurityAttributes)
 {
+    if (!lpName || !detectPipe(lpName))
+    {
+        return impl::CreateNamedPipe(lpName, dwOpenMode, dwPipeMode, nMaxInstances, nOutBufferSize, nInBufferSize, nDefaultTimeOut, lpSecurityAttributes);
+    }
+
     return impl::CreateNamedPipe(getLocalPipeName(lpName).c_str(), dwOpenMode, dwPipeMode, nMaxInstances, nOutBufferSize, nInBufferSize, nDefaultTimeOut, lpSecurityAttributes);
 }
 DECLARE_STRING_FIXUP(impl::CreateNamedPipe, CreateNamedPipeFixup);
@@ -311,6 +336,11 @@ BOOL WINAPI CallNamedPipeFixup(
     _Out_ LPDWORD lpBytesRead,
     _In_  DWORD   nTimeOut)
 {
+    if (!lpNamedPipeName || !detectPipe(lpNamedPipeName))
+    {
+        return impl::CallNamedPipe(lpNamedPipeName, lpInBuffer, nInBufferSize, lpOutBuffer, nOutBufferSize, lpBytesRead, nTimeOut);
+    }
+
     return impl::CallNamedPipe(getLocalPipeName(lpNamedPipeName).c_str(), lpInBuffer, nInBufferSize, lpOutBuffer, nOutBufferSize, lpBytesRead, nTimeOut);
 }
 DECLARE_STRING_FIXUP(impl::CallNamedPipe, CallNamedPipeFixup);
@@ -320,68 +350,136 @@ BOOL WINAPI WaitNamedPipeFixup(
     _In_ const CharT* lpNamedPipeName,
     _In_ DWORD        nTimeOut)
 {
+    if (!lpNamedPipeName || !detectPipe(lpNamedPipeName))
+    {
+        return impl::WaitNamedPipe(lpNamedPipeName, nTimeOut);
+    }
+
     return impl::WaitNamedPipe(getLocalPipeName(lpNamedPipeName).c_str(), nTimeOut);
 }
 DECLARE_STRING_FIXUP(impl::WaitNamedPipe, WaitNamedPipeFixup);
 
 const static int uwpPipePrefixLen = 9;
-inline static wide_argument_string_with_buffer getLocalPipeName(LPCSTR pipeName)
+
+// Converted names are kept in a fixed size, open addressed table that's only ever added to, so that looking one up never
+// takes a lock. Once it's full, names that aren't in it just get converted every time
+constexpr std::size_t pipe_name_cache_size = 64;
+
+struct cached_pipe_name
 {
-    if (pipeName)
-    {
-        return getLocalPipeName(widen_argument(pipeName).c_str());
-    }
-    return wide_argument_string_with_buffer{};
-}
+    std::size_t hash;
+    std::wstring name; // As given, which for ANSI names is only ever ASCII
+    std::wstring localName;
+};
 
-static wide_argument_string_with_buffer getLocalPipeName(LPCWSTR pipeName)
+static std::atomic<const cached_pipe_name*> g_pipeNameCache[pipe_name_cache_size];
+
+// Returns false for ANSI names with anything other than ASCII in them, which aren't remembered since their characters
+// don't correspond to the wide ones one to one
+template <typename CharT>
+static bool hashPipeName(const CharT* pipeName, std::size_t& hash, std::size_t& length) noexcept
 {
-    if (pipeName)
+    // FNV-1a
+    hash = sizeof(std::size_t) == 8 ? 14695981039346656037ull : 2166136261u;
+    const std::size_t prime = sizeof(std::size_t) == 8 ? 1099511628211ull : 16777619u;
+    for (length = 0; pipeName[length]; ++length)
     {
-        if (detectPipe(pipeName))
+        auto ch = static_cast<std::make_unsigned_t<CharT>>(pipeName[length]);
+        if constexpr (psf::is_ansi<CharT>)
         {
-            std::wstring_view name(pipeName);
-            std::wostringstream formattedPipe;
-            // Stomp on the server name. In an app container, pipe name must be as follows
-            formattedPipe << R"(\\.\pipe\LOCAL\)" << name.substr(uwpPipePrefixLen);
-            return wide_argument_string_with_buffer{ formattedPipe.str() };
+            if (ch >= 0x80)
+            {
+                return false;
+            }
         }
+        hash = (hash ^ ch) * prime;
     }
 
-    // Not a valid pipe input so return empty string
-    return wide_argument_string_with_buffer();
+    return true;
 }
 
-inline static bool detectPipe(std::string_view pipeName)
+template <typename CharT>
+static bool isCachedPipeName(const cached_pipe_name& entry, std::size_t hash, const CharT* pipeName, std::size_t length) noexcept
 {
-    return detectPipe(widen(pipeName));
+    return (entry.hash == hash) && (entry.name.length() == length) &&
+        std::equal(entry.name.begin(), entry.name.end(), pipeName, [](wchar_t lhs, CharT rhs) { return lhs == static_cast<wchar_t>(rhs); });
 }
 
-static bool detectPipe(std::wstring_view pipeName)
+template <typename CharT>
+static local_pipe_name getLocalPipeName(const CharT* pipeName)
 {
-    // Verify that the name can even fit
-    if (pipeName.size() <= uwpPipePrefixLen)
+    std::size_t hash, length;
+    bool cacheable = hashPipeName(pipeName, hash, length);
+    if (cacheable)
     {
-        return false;
+        for (std::size_t i = 0; i < pipe_name_cache_size; ++i)
+        {
+            auto entry = g_pipeNameCache[(hash + i) % pipe_name_cache_size].load(std::memory_order_acquire);
+            if (!entry)
+            {
+                break;
+            }
+            if (isCachedPipeName(*entry, hash, pipeName, length))
+            {
+                return local_pipe_name{ entry->localName.c_str() };
+            }
+        }
     }
 
-    // Verify pipe path, makes assumptions on the input path as follows
-    auto pathType = psf::path_type(pipeName.data());
-    if ((pathType != psf::dos_path_type::local_device) &&
-        (pathType != psf::dos_path_type::root_local_device))
+    // Stomp on the server name. In an app container, pipe name must be as follows
+    local_pipe_name result;
+    result.buffer = LR"(\\.\pipe\LOCAL\)";
+    if constexpr (psf::is_ansi<CharT>)
     {
-        return false;
+        result.buffer += widen(std::string_view(pipeName + uwpPipePrefixLen, length - uwpPipePrefixLen));
+    }
+    else
+    {
+        result.buffer.append(pipeName + uwpPipePrefixLen, length - uwpPipePrefixLen);
     }
 
-    // Verify that the name after the path root is pipe/
-    if (((pipeName[4] != 'p') && (pipeName[4] != 'P')) ||
-        ((pipeName[5] != 'i') && (pipeName[5] != 'I')) ||
-        ((pipeName[6] != 'p') && (pipeName[6] != 'P')) ||
-        ((pipeName[7] != 'e') && (pipeName[7] != 'E')) ||
-        !psf::is_path_separator(pipeName[8]))
+    if (cacheable)
+    {
+        // NOTE: Entries live for as long as the process does, and an entry that loses the race for a slot is freed again
+        auto entry = new (std::nothrow) cached_pipe_name{ hash, std::wstring(pipeName, pipeName + length), result.buffer };
+        for (std::size_t i = 0; entry && (i < pipe_name_cache_size); ++i)
+        {
+            const cached_pipe_name* expected = nullptr;
+            auto& slot = g_pipeNameCache[(hash + i) % pipe_name_cache_size];
+            if (slot.compare_exchange_strong(expected, entry, std::memory_order_acq_rel))
+            {
+                return local_pipe_name{ entry->localName.c_str() };
+            }
+            if (isCachedPipeName(*expected, hash, pipeName, length))
+            {
+                break;
+            }
+        }
+        delete entry;
+    }
+
+    return result;
+}
+
+template <typename CharT>
+static bool detectPipe(const CharT* pipeName) noexcept
+{
+    // Checked one character at a time, so that a shorter name fails at its null terminator before anything past it is
+    // read. Root local device paths (\\?\) don't get normalized, so only allow forward slashes in local device ones
+    bool rootLocalDevice = (pipeName[0] == '\\') && (pipeName[1] == '\\') && (pipeName[2] == '?') && (pipeName[3] == '\\');
+    bool localDevice = psf::is_path_separator(pipeName[0]) && psf::is_path_separator(pipeName[1]) &&
+        (pipeName[2] == '.') && psf::is_path_separator(pipeName[3]);
+    if (!rootLocalDevice && !localDevice)
     {
         return false;
     }
 
-    return true;
+    // Verify that the name after the path root is pipe/, and that there's a name after that
+    auto lower = [](CharT ch) { return static_cast<CharT>(ch | 0x20); };
+    return (lower(pipeName[4]) == 'p') &&
+        (lower(pipeName[5]) == 'i') &&
+        (lower(pipeName[6]) == 'p') &&
+        (lower(pipeName[7]) == 'e') &&
+        psf::is_path_separator(pipeName[8]) &&
+        (pipeName[uwpPipePrefixLen] != '\0');
 }
@@ -3,7 +3,7 @@
 #include "psf_framework.h"
 #include "reentrancy_guard.h"
 
-inline thread_local psf::reentrancy_guard g_reentrancyGuard;
+inline psf::reentrancy_guard g_reentrancyGuard;
 
 namespace impl 
 {
@@ -1,5 +1,38 @@
 #include <Windows.h>
 
-// Define the fixup declarations here
-#define PSF_DEFINE_EXPORTS
 #include "psf_framework.h"
+#include "CacheRedirection.h"
+
+extern "C" {
+
+int __stdcall PSFInitialize() noexcept try
+{
+    // Before anything is detoured, so that creating the cache directories doesn't go through the fixup
+    InitializeCacheRedirection();
+    psf::attach_all();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+int __stdcall PSFUninitialize() noexcept try
+{
+    psf::detach_all();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+#ifdef _M_IX86
+#pragma comment(linker, "/EXPORT:PSFInitialize=_PSFInitialize@0")
+#pragma comment(linker, "/EXPORT:PSFUninitialize=_PSFUninitialize@0")
+#else
+#pragma comment(linker, "/EXPORT:PSFInitialize=PSFInitialize")
+#pragma comment(linker, "/EXPORT:PSFUninitialize=PSFUninitialize")
+#endif
+
+}
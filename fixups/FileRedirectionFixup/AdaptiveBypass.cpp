@@ -0,0 +1,146 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// In a package with several executables, the same configuration usually applies to all of them, yet most of them never
+// touch anything that it redirects. Each of their file calls still gets its path normalized and looked up before we can
+// tell that, for as long as the process runs. With the "adaptiveBypass" configuration, an API whose last "minimumCalls"
+// ShouldRedirect checks all came back without a match, each one either rejected without normalizing the path, or for a
+// path whose decision had already been made (i.e. the application has settled into its working set, and the specs match
+// none of it), stops checking: its fixup calls straight through to the real function, the same as it would have after
+// deciding not to redirect. An API that has had any of its paths match a spec never gets bypassed, since that's what
+// "never redirect" means, and whether or not the redirected file exists can change with every call. After a hot reload
+// every API starts over, since the new specs may match what the old ones didn't.
+//
+// Only the APIs whose fixups do nothing but redirect for the paths that don't match are eligible: the attribute queries
+// (the Win32 ones only if "attributeOverrides" is not configured, since they also apply those to package files), and
+// read-only CreateFile and CreateFile2 opens of existing files, which would otherwise only have checked for a redirected
+// copy. Everything that creates, modifies, or enumerates files keeps its fixup, so anything that does need redirecting
+// still ends up in the redirected location.
+//
+// NOTE: This is a heuristic, which is why it's off by default: once an API is bypassed, a path that it hasn't seen
+//       before and that the specs do match goes to the package instead, as though it wasn't configured. Streaks get
+//       counted without interlocked operations, the same as the telemetry counters, so concurrent calls may lose
+//       increments, which only ever delays the bypass. Matches are recorded separately, and are never lost
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+constexpr std::size_t bypass_api_count = static_cast<std::size_t>(telemetry_api::count);
+
+// NOTE: Cache line aligned so that calls to one API don't slow down calls to the others
+struct alignas(64) api_bypass_state
+{
+    bool eligible = false; // Only ever set during initialization
+    std::atomic<bool> bypassed = false;
+    std::atomic<bool> matched = false;
+    std::atomic<std::uint32_t> streak = 0;
+};
+
+static bool g_adaptiveBypassEnabled = false;
+static std::uint32_t g_adaptiveBypassMinimumCalls = 4096;
+static api_bypass_state g_apiBypassStates[bypass_api_count];
+
+void InitializeAdaptiveBypass(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    if (auto minimumCallsValue = config->try_get("minimumCalls"))
+    {
+        g_adaptiveBypassMinimumCalls = static_cast<std::uint32_t>(minimumCallsValue->as_number().get_unsigned());
+    }
+
+    auto eligibleApis = { telemetry_api::nt_query_attributes_file, telemetry_api::nt_query_full_attributes_file,
+        telemetry_api::create_file, telemetry_api::create_file2 };
+    for (auto api : eligibleApis)
+    {
+        g_apiBypassStates[static_cast<std::size_t>(api)].eligible = true;
+    }
+
+    if (!AttributeOverridesEnabled())
+    {
+        g_apiBypassStates[static_cast<std::size_t>(telemetry_api::get_file_attributes)].eligible = true;
+        g_apiBypassStates[static_cast<std::size_t>(telemetry_api::get_file_attributes_ex)].eligible = true;
+    }
+
+    g_adaptiveBypassEnabled = true;
+}
+
+bool HookBypassed(telemetry_api api) noexcept
+{
+    return g_adaptiveBypassEnabled && g_apiBypassStates[static_cast<std::size_t>(api)].bypassed.load(std::memory_order_relaxed);
+}
+
+void AdaptiveBypassObserved(telemetry_api api, redirect_check check) noexcept
+{
+    if (!g_adaptiveBypassEnabled)
+    {
+        return;
+    }
+
+    auto& state = g_apiBypassStates[static_cast<std::size_t>(api)];
+    if (!state.eligible || state.matched.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (check == redirect_check::match)
+    {
+        // NOTE: Pairs with the check below, which sets the flag before looking for a match; one of the two always sees
+        //       what the other did
+        state.matched.store(true);
+        state.bypassed.store(false);
+        return;
+    }
+    else if (check == redirect_check::new_miss)
+    {
+        if (state.streak.load(std::memory_order_relaxed) != 0)
+        {
+            state.streak.store(0, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    auto streak = state.streak.load(std::memory_order_relaxed) + 1;
+    state.streak.store(streak, std::memory_order_relaxed);
+    if ((streak >= g_adaptiveBypassMinimumCalls) && !state.bypassed.load(std::memory_order_relaxed))
+    {
+        state.bypassed.store(true);
+        if (state.matched.load())
+        {
+            state.bypassed.store(false);
+        }
+    }
+}
+
+void ResetAdaptiveBypass() noexcept
+{
+    if (!g_adaptiveBypassEnabled)
+    {
+        return;
+    }
+
+    // NOTE: Called once the new snapshot has been published, so every check from here on uses the new specs. A call
+    //       that saw its API as bypassed just before this is no different from one that was already underway
+    for (auto& state : g_apiBypassStates)
+    {
+        state.bypassed.store(false);
+        state.matched.store(false);
+        state.streak.store(0, std::memory_order_relaxed);
+    }
+}
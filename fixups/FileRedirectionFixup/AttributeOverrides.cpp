@@ -0,0 +1,406 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Files in the package can't be modified, so without any extra work, SetFileAttributes copies the package file to its
+// redirected location first, which for a large file is a lot of copying just to change a few flags. With the
+// "attributeOverrides" configuration, setting attributes on a package file that hasn't been copied yet records the new
+// attributes instead, and attribute queries and enumeration report them in place of the package file's own. Should
+// the file get copied later on (e.g. because it gets opened for write), the copy gets the recorded attributes and the
+// record goes away, so a read-only override still keeps the file from being written to.
+//
+// The overrides are kept the same way as tombstones are (see PackageFileTombstones.cpp): an open addressed hash table
+// in a file in the redirect root, keyed by the hash of the redirected path, that all of the package's processes map into
+// memory and update with interlocked operations, so it persists across launches and checking a path costs no disk
+// access. The table is a fixed size; once it's three quarters full, setting attributes goes back to copying the file.
+//
+// NOTE: Only the attributes that SetFileAttributes can change are overridden, and only for files. Directories still get
+//       copied, same as before
+
+#include <atomic>
+#include <cstdint>
+#include <cwctype>
+#include <memory>
+#include <string_view>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+using namespace std::literals;
+
+constexpr std::uint32_t override_file_magic = 0x4f415350; // "PSAO"
+constexpr std::uint32_t override_file_version = 1;
+constexpr std::uint32_t override_capacity = 16384; // Must be a power of two
+constexpr std::uint32_t override_max_count = override_capacity / 4 * 3;
+
+// Key values other than these are path hashes. Hashes that would collide with them get adjusted; see override_hash
+constexpr std::uint64_t empty_slot = 0;
+constexpr std::uint64_t removed_slot = 1;
+
+// What SetFileAttributes can change. Anything else in its argument gets the file copied like before
+constexpr DWORD overridable_attributes = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+    FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NORMAL | FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_OFFLINE |
+    FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
+struct override_slot
+{
+    std::atomic<std::uint64_t> key;
+
+    // Zero while the slot is being claimed or removed, which reads the same as there being no override
+    std::atomic<std::uint32_t> attributes;
+    std::uint32_t reserved;
+};
+static_assert(sizeof(override_slot) == 16);
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Slots are shared across processes, so they can't use a lock");
+
+struct override_file_header
+{
+    std::atomic<std::uint32_t> magic;
+    std::uint32_t version;
+    std::uint32_t capacity;
+    std::atomic<std::uint32_t> count; // Slots that are no longer empty, including removed ones
+};
+static_assert(sizeof(override_file_header) % alignof(override_slot) == 0);
+
+constexpr std::size_t override_file_size = sizeof(override_file_header) + override_capacity * sizeof(override_slot);
+
+override_file_header* g_overrideHeader = nullptr;
+override_slot* g_overrideSlots = nullptr;
+
+// Prefix of every redirected path, which hashes exclude, same as for the tombstones
+std::wstring g_overrideRedirectRoot;
+
+// The same hash as the tombstones use, so that enumeration can hash the directory once and each name as it comes by
+struct override_hash
+{
+    std::uint64_t value = 14695981039346656037ull;
+    bool pending_separator = false;
+
+    void add(std::wstring_view str) noexcept
+    {
+        for (auto ch : str)
+        {
+            if (psf::is_path_separator(ch))
+            {
+                pending_separator = true;
+                continue;
+            }
+
+            if (pending_separator)
+            {
+                mix(L'\\');
+                pending_separator = false;
+            }
+            mix(std::towupper(ch));
+        }
+    }
+
+    std::uint64_t slot_value() const noexcept
+    {
+        return (value > removed_slot) ? value : (value + 2);
+    }
+
+private:
+
+    void mix(wchar_t ch) noexcept
+    {
+        value ^= static_cast<std::uint16_t>(ch);
+        value *= 1099511628211ull;
+    }
+};
+
+bool AttributeOverridesEnabled() noexcept
+{
+    return g_overrideSlots != nullptr;
+}
+
+bool AttributeOverridesInUse() noexcept
+{
+    return g_overrideSlots && (g_overrideHeader->count.load(std::memory_order_relaxed) != 0);
+}
+
+// Returns false if the path isn't under the redirect root, in which case it can't have an override
+static bool hash_redirect_path(std::wstring_view redirectPath, override_hash& hash) noexcept
+{
+    auto& root = g_overrideRedirectRoot;
+    if ((redirectPath.length() < root.length()) ||
+        !psf::path_equal(redirectPath.data(), root.c_str(), root.length()) ||
+        ((redirectPath.length() > root.length()) && !psf::is_path_separator(redirectPath[root.length()])))
+    {
+        return false;
+    }
+
+    hash.add(redirectPath.substr(root.length()));
+    return true;
+}
+
+static override_slot* find_override(std::uint64_t value) noexcept
+{
+    for (std::uint32_t i = 0; i < override_capacity; ++i)
+    {
+        auto& slot = g_overrideSlots[(value + i) & (override_capacity - 1)];
+        auto key = slot.key.load(std::memory_order_acquire);
+        if (key == value)
+        {
+            return &slot;
+        }
+        else if (key == empty_slot)
+        {
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+static DWORD overlay_attributes(DWORD attributes, DWORD overrideAttributes) noexcept
+{
+    if (!overrideAttributes || (attributes == INVALID_FILE_ATTRIBUTES) || (attributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        return attributes;
+    }
+
+    // FILE_ATTRIBUTE_NORMAL only ever shows up on its own
+    auto result = (attributes & ~overridable_attributes) | (overrideAttributes & overridable_attributes & ~FILE_ATTRIBUTE_NORMAL);
+    return result ? result : FILE_ATTRIBUTE_NORMAL;
+}
+
+void InitializeAttributeOverrides(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    g_overrideRedirectRoot = LR"(\\?\)" + g_redirectRootPath.native();
+
+    // NOTE: Opened up front for the same reason as the tombstones: to see overrides that other processes add
+    EnsureRedirectRootExists();
+    auto path = g_redirectRootPath / L"PsfAttributes.bin";
+    psf::unique_handle file(impl::CreateFile(
+        path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER size;
+    if (!file || !::GetFileSizeEx(file.get(), &size) ||
+        ((size.QuadPart != 0) && (static_cast<std::uint64_t>(size.QuadPart) != override_file_size)))
+    {
+        return;
+    }
+
+    // NOTE: This extends a newly created file to its full size, filled with zeros, which is an empty table
+    psf::unique_handle mapping(impl::CreateFileMapping(
+        file.get(),
+        nullptr,
+        PAGE_READWRITE,
+        0,
+        static_cast<DWORD>(override_file_size),
+        static_cast<const wchar_t*>(nullptr)));
+    if (!mapping)
+    {
+        return;
+    }
+
+    // NOTE: The view is intentionally never unmapped, same as the tombstones'
+    auto view = ::MapViewOfFile(mapping.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, override_file_size);
+    if (!view)
+    {
+        return;
+    }
+
+    auto header = static_cast<override_file_header*>(view);
+    if (header->magic.load() == 0)
+    {
+        header->version = override_file_version;
+        header->capacity = override_capacity;
+        header->magic.store(override_file_magic);
+    }
+
+    if ((header->magic.load() != override_file_magic) ||
+        (header->version != override_file_version) ||
+        (header->capacity != override_capacity))
+    {
+        ::UnmapViewOfFile(view);
+        return;
+    }
+
+    g_overrideHeader = header;
+    g_overrideSlots = reinterpret_cast<override_slot*>(header + 1);
+}
+
+bool SetAttributeOverride(const wchar_t* redirectPath, DWORD attributes) noexcept
+{
+    override_hash hash;
+    if (!g_overrideSlots || !attributes || (attributes & ~overridable_attributes) || !hash_redirect_path(redirectPath, hash))
+    {
+        return false;
+    }
+
+    // Enumerations of the directory may have been cached with the file's old attributes
+    InvalidateDirectoryListings(redirectPath);
+
+    // A removed slot can be reused, but only once we know that the path isn't already further along
+    auto value = hash.slot_value();
+    override_slot* reusableSlot = nullptr;
+    for (std::uint32_t i = 0; i < override_capacity; ++i)
+    {
+        auto& slot = g_overrideSlots[(value + i) & (override_capacity - 1)];
+        auto current = slot.key.load(std::memory_order_acquire);
+        if (current == value)
+        {
+            slot.attributes.store(attributes);
+            return true;
+        }
+        else if (current == removed_slot)
+        {
+            if (!reusableSlot)
+            {
+                reusableSlot = &slot;
+            }
+            continue;
+        }
+        else if (current != empty_slot)
+        {
+            continue;
+        }
+
+        if (reusableSlot)
+        {
+            auto expected = removed_slot;
+            if (reusableSlot->key.compare_exchange_strong(expected, value) || (expected == value))
+            {
+                reusableSlot->attributes.store(attributes);
+                return true;
+            }
+            reusableSlot = nullptr;
+        }
+
+        if (g_overrideHeader->count.load() >= override_max_count)
+        {
+            return false;
+        }
+
+        auto expected = empty_slot;
+        if (slot.key.compare_exchange_strong(expected, value))
+        {
+            ++g_overrideHeader->count;
+            slot.attributes.store(attributes);
+            return true;
+        }
+        else if (expected == value)
+        {
+            slot.attributes.store(attributes);
+            return true;
+        }
+
+        // Lost a race for this slot; look at it again
+        --i;
+    }
+
+    return false;
+}
+
+DWORD OverrideAttributes(std::wstring_view redirectPath, DWORD attributes) noexcept
+{
+    override_hash hash;
+    if (!AttributeOverridesInUse() || !hash_redirect_path(redirectPath, hash))
+    {
+        return attributes;
+    }
+
+    auto slot = find_override(hash.slot_value());
+    return slot ? overlay_attributes(attributes, slot->attributes.load()) : attributes;
+}
+
+DWORD OverrideAttributes(std::wstring_view redirectDirectory, std::wstring_view name, DWORD attributes) noexcept
+{
+    override_hash hash;
+    if (!AttributeOverridesInUse() || (name == L"."sv) || (name == L".."sv) || !hash_redirect_path(redirectDirectory, hash))
+    {
+        return attributes;
+    }
+
+    hash.pending_separator = true;
+    hash.add(name);
+    auto slot = find_override(hash.slot_value());
+    return slot ? overlay_attributes(attributes, slot->attributes.load()) : attributes;
+}
+
+DWORD OverridePackageFileAttributes(const wchar_t* path, DWORD attributes) noexcept try
+{
+    if (!AttributeOverridesInUse() || (attributes == INVALID_FILE_ATTRIBUTES) || (attributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        return attributes;
+    }
+
+    auto lastError = ::GetLastError();
+    auto [shouldRedirect, redirectPath] = ShouldRedirect(path, redirect_flags::none);
+    auto result = shouldRedirect ? OverrideAttributes(redirectPath.native(), attributes) : attributes;
+    ::SetLastError(lastError);
+    return result;
+}
+catch (...)
+{
+    return attributes;
+}
+
+void RemoveAttributeOverride(const wchar_t* redirectPath) noexcept
+{
+    override_hash hash;
+    if (!AttributeOverridesInUse() || !hash_redirect_path(redirectPath, hash))
+    {
+        return;
+    }
+
+    // NOTE: The attributes get cleared first, so that a slot that gets reused right away never shows our attributes
+    auto value = hash.slot_value();
+    for (std::uint32_t i = 0; i < override_capacity; ++i)
+    {
+        auto& slot = g_overrideSlots[(value + i) & (override_capacity - 1)];
+        auto key = slot.key.load(std::memory_order_acquire);
+        if (key == empty_slot)
+        {
+            return;
+        }
+        else if (key == value)
+        {
+            slot.attributes.store(0);
+            auto expected = value;
+            slot.key.compare_exchange_strong(expected, removed_slot);
+        }
+    }
+}
+
+void TransferAttributeOverride(const wchar_t* redirectPath, const wchar_t* filePath) noexcept
+{
+    override_hash hash;
+    if (!AttributeOverridesInUse() || !hash_redirect_path(redirectPath, hash))
+    {
+        return;
+    }
+
+    auto slot = find_override(hash.slot_value());
+    if (auto attributes = slot ? slot->attributes.load() : 0)
+    {
+        auto lastError = ::GetLastError();
+        impl::SetFileAttributes(filePath, attributes);
+        RemoveAttributeOverride(redirectPath);
+        ::SetLastError(lastError);
+    }
+}
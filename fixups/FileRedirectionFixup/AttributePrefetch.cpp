@@ -0,0 +1,182 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Applications that query the attributes of one file in a directory tend to query its siblings next (e.g. probing a
+// plugin directory for the files that each plugin needs), and each of those queries is a trip to the file system, twice
+// over when the redirected location gets checked first. With the "attributeQueryThreshold" option of the directory
+// listing cache, a package directory that sees that many attribute queries gets enumerated once instead, redirected and
+// package side alike, and the queries after that are answered from its listing. The listing is the same one that
+// FindFirstFile uses (see DirectoryListingCache.cpp), so it gets invalidated the same way, too.
+//
+// NOTE: Only names that can be looked up in the listing as-is are answered from it. Anything that the file system would
+//       have to interpret first (short names, alternate data streams, trailing dots or spaces) still goes to it
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <dos_paths.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+using namespace std::literals;
+
+extern std::filesystem::path g_packageRootPath;
+
+std::shared_ptr<const directory_listing> build_directory_listing(
+    const wchar_t* redirectDirectory,
+    const wchar_t* packageDirectory,
+    FINDEX_INFO_LEVELS infoLevelId,
+    DWORD additionalFlags);
+
+// Bounds the number of directories that we count queries for. Forgetting the counts only delays the prefetch
+constexpr std::size_t max_counted_directories = 1024;
+
+std::uint32_t g_attributeQueryThreshold = 0;
+
+struct prefetched_directory
+{
+    std::uint32_t queries = 0;
+
+    // Set once the listing turns out not to stay cached (e.g. because the directory is too large, or keeps changing),
+    // since we'd otherwise enumerate the directory on every query
+    bool disabled = false;
+    bool built_last_query = false;
+
+    std::shared_ptr<const directory_listing> listing;
+    std::unordered_map<iwstring_view, const directory_listing_entry*, case_insensitive_hash<wchar_t>> names;
+};
+
+std::mutex g_prefetchMutex;
+std::unordered_map<iwstring, prefetched_directory, case_insensitive_hash<wchar_t>> g_prefetchedDirectories;
+
+void InitializeAttributePrefetch(const psf::json_object* config)
+{
+    if (!config || !DirectoryListingCacheEnabled())
+    {
+        return;
+    }
+
+    if (auto thresholdValue = config->try_get("attributeQueryThreshold"))
+    {
+        g_attributeQueryThreshold = static_cast<std::uint32_t>(thresholdValue->as_number().get_unsigned());
+    }
+}
+
+DWORD FindListedAttributes(const wchar_t* path, WIN32_FILE_ATTRIBUTE_DATA& data) noexcept try
+{
+    if ((g_attributeQueryThreshold == 0) || !path)
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    // Same as the listing cache itself, only directories in the package can be answered for
+    auto normalizedPath = NormalizePath(path);
+    auto& packageRoot = g_packageRootPath.native();
+    if (!normalizedPath.drive_absolute_path ||
+        !::PSFIsPackagePath(normalizedPath.full_path.c_str(), normalizedPath.full_path.length()))
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    // The parent directory comes from the components that normalizing found, unless they aren't known
+    auto parent = normalizedPath.parent();
+    std::wstring_view fullPath = normalizedPath.drive_absolute_path;
+    auto pos = parent.full_path.empty() ? psf::find_last_path_separator(fullPath) : parent.full_path.length();
+    if ((pos == std::wstring_view::npos) || (pos < packageRoot.length()))
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    auto name = fullPath.substr(pos + 1);
+    if (name.empty() || (name == L"."sv) || (name == L".."sv) || (name.find_first_of(L"*?:~\\") != std::wstring_view::npos) ||
+        (name.back() == L'.') || (name.back() == L' '))
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    std::wstring packageDir(fullPath.substr(0, pos));
+    auto redirectDir = RedirectedPath(DeVirtualizePath(parent.full_path.empty() ? NormalizePath(packageDir.c_str()) : std::move(parent)));
+    if (redirectDir.back() != L'\\')
+    {
+        redirectDir.push_back(L'\\');
+    }
+    packageDir.push_back(L'\\');
+
+    iwstring key(redirectDir.data(), redirectDir.length());
+    {
+        std::lock_guard lock(g_prefetchMutex);
+        if ((g_prefetchedDirectories.size() >= max_counted_directories) && (g_prefetchedDirectories.find(key) == g_prefetchedDirectories.end()))
+        {
+            g_prefetchedDirectories.clear();
+        }
+
+        auto& directory = g_prefetchedDirectories[key];
+        if (directory.disabled || (++directory.queries < g_attributeQueryThreshold))
+        {
+            return ERROR_NOT_SUPPORTED;
+        }
+    }
+
+    // NOTE: Building the listing reads both directories, so it happens without holding the lock. The listing doesn't
+    //       need short names, since we don't answer for them
+    auto built = false;
+    auto listing = GetDirectoryListing(redirectDir, true, {}, [&]()
+    {
+        built = true;
+        return build_directory_listing(redirectDir.c_str(), packageDir.c_str(), FindExInfoBasic, 0);
+    });
+
+    std::lock_guard lock(g_prefetchMutex);
+    auto& directory = g_prefetchedDirectories[key];
+    if (built && directory.built_last_query)
+    {
+        directory.disabled = true;
+    }
+    directory.built_last_query = built;
+
+    if (!listing || directory.disabled)
+    {
+        directory.listing.reset();
+        directory.names.clear();
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    if (directory.listing != listing)
+    {
+        directory.names.clear();
+        for (auto& entry : *listing)
+        {
+            directory.names.emplace(iwstring_view(entry.name.data(), entry.name.length()), &entry);
+        }
+        directory.listing = std::move(listing);
+    }
+
+    auto itr = directory.names.find(iwstring_view(name.data(), name.length()));
+    if (itr == directory.names.end())
+    {
+        // The listing has everything in the directory, and the directory exists, or there wouldn't be a listing
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    auto entry = itr->second;
+    data.dwFileAttributes = entry->attributes;
+    data.ftCreationTime = entry->creation_time;
+    data.ftLastAccessTime = entry->last_access_time;
+    data.ftLastWriteTime = entry->last_write_time;
+    data.nFileSizeHigh = static_cast<DWORD>(entry->size >> 32);
+    data.nFileSizeLow = static_cast<DWORD>(entry->size);
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return ERROR_NOT_SUPPORTED;
+}
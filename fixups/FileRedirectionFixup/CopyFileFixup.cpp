@@ -9,11 +9,15 @@
 template <typename CharT>
 BOOL __stdcall CopyFileFixup(_In_ const CharT* existingFileName, _In_ const CharT* newFileName, _In_ BOOL failIfExists) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::copy_file);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
+            auto wideExistingFileName = widen_argument(existingFileName);
+            auto wideNewFileName = widen_argument(newFileName);
+
             // NOTE: We don't want to copy either file in the event one/both exist. Copying the source file would be
             //       wasteful since it's not the file that we care about (nor do we need write permissions to it); we
             //       just need to know its redirect path so that we can copy the most up to date one. It wouldn't
@@ -23,14 +27,19 @@ BOOL __stdcall CopyFileFixup(_In_ const CharT* existingFileName, _In_ const Char
             //       manually fail out ourselves if 'failIfExists' is true and the file exists in the package, but
             //       that's arguably worse since we currently aren't handling the case where an application tries to
             //       delete a file in its package path.
-            auto [redirectSource, sourceRedirectPath] = ShouldRedirect(existingFileName, redirect_flags::check_file_presence);
-            auto [redirectDest, destRedirectPath] = ShouldRedirect(newFileName, redirect_flags::ensure_directory_structure);
+            auto [redirectSource, sourceRedirectPath] = ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::check_file_presence);
+            auto [redirectDest, destRedirectPath] = ShouldRedirect(wideNewFileName.c_str(), redirect_flags::ensure_directory_structure);
             if (redirectSource || redirectDest)
             {
-                return impl::CopyFile(
-                    redirectSource ? sourceRedirectPath.c_str() : widen_argument(existingFileName).c_str(),
-                    redirectDest ? destRedirectPath.c_str() : widen_argument(newFileName).c_str(),
+                auto result = impl::CopyFile(
+                    redirectSource ? sourceRedirectPath.c_str() : wideExistingFileName.c_str(),
+                    redirectDest ? destRedirectPath.c_str() : wideNewFileName.c_str(),
                     failIfExists);
+                if (result && redirectDest)
+                {
+                    RedirectedPathCreated(destRedirectPath.c_str());
+                }
+                return result;
             }
         }
     }
@@ -52,23 +61,32 @@ BOOL __stdcall CopyFileExFixup(
     _When_(cancel != NULL, _Pre_satisfies_(*cancel == FALSE)) _Inout_opt_ LPBOOL cancel,
     _In_ DWORD copyFlags) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::copy_file_ex);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
+            auto wideExistingFileName = widen_argument(existingFileName);
+            auto wideNewFileName = widen_argument(newFileName);
+
             // See note in CopyFileFixup for commentary on copy-on-read policy
-            auto [redirectSource, sourceRedirectPath] = ShouldRedirect(existingFileName, redirect_flags::check_file_presence);
-            auto [redirectDest, destRedirectPath] = ShouldRedirect(newFileName, redirect_flags::ensure_directory_structure);
+            auto [redirectSource, sourceRedirectPath] = ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::check_file_presence);
+            auto [redirectDest, destRedirectPath] = ShouldRedirect(wideNewFileName.c_str(), redirect_flags::ensure_directory_structure);
             if (redirectSource || redirectDest)
             {
-                return impl::CopyFileEx(
-                    redirectSource ? sourceRedirectPath.c_str() : widen_argument(existingFileName).c_str(),
-                    redirectDest ? destRedirectPath.c_str() : widen_argument(newFileName).c_str(),
+                auto result = impl::CopyFileEx(
+                    redirectSource ? sourceRedirectPath.c_str() : wideExistingFileName.c_str(),
+                    redirectDest ? destRedirectPath.c_str() : wideNewFileName.c_str(),
                     progressRoutine,
                     data,
                     cancel,
                     copyFlags);
+                if (result && redirectDest)
+                {
+                    RedirectedPathCreated(destRedirectPath.c_str());
+                }
+                return result;
             }
         }
     }
@@ -86,6 +104,7 @@ HRESULT __stdcall CopyFile2Fixup(
     _In_ PCWSTR newFileName,
     _In_opt_ COPYFILE2_EXTENDED_PARAMETERS* extendedParameters) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::copy_file2);
     auto guard = g_reentrancyGuard.enter();
     try
     {
@@ -96,10 +115,15 @@ HRESULT __stdcall CopyFile2Fixup(
             auto [redirectDest, destRedirectPath] = ShouldRedirect(newFileName, redirect_flags::ensure_directory_structure);
             if (redirectSource || redirectDest)
             {
-                return impl::CopyFile2(
+                auto result = impl::CopyFile2(
                     redirectSource ? sourceRedirectPath.c_str() : existingFileName,
                     redirectDest ? destRedirectPath.c_str() : newFileName,
                     extendedParameters);
+                if (SUCCEEDED(result) && redirectDest)
+                {
+                    RedirectedPathCreated(destRedirectPath.c_str());
+                }
+                return result;
             }
         }
     }
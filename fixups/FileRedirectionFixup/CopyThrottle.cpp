@@ -0,0 +1,262 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// When several of a package's processes start up at once, their copy-on-read copies can saturate the disk and starve
+// the application's own reads. The "copyThrottle" configuration moves copies of files at or above a size threshold off
+// of the calling thread and onto a single worker thread that runs in background mode, which lowers the priority of all
+// of its I/O. The calling thread waits for the copy to finish. Since the worker takes copies in the order that they
+// were requested, threads that all need large files get them in turn instead of fighting over the disk. Optionally, the
+// copies also share a bytes per second budget with the copies of every other process in the package, which is enforced
+// from the copy's progress routine.
+//
+// NOTE: The worker thread can't start running until the loader lock is released, so copies requested before then (or if
+//       the thread couldn't be created) are done on the calling thread, still subject to the budget
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+constexpr std::uint64_t default_copy_throttle_size_threshold = 1024 * 1024;
+
+// How far ahead of the budget copies are allowed to get before they have to wait, in microseconds
+constexpr std::int64_t copy_budget_burst = 250'000;
+
+// The time (in microseconds, using the system wide tick count as the time base) at which the budget will have caught up
+// with the bytes that have been copied so far. This lives in memory shared with the package's other processes, if we
+// can get it
+struct copy_budget
+{
+    std::atomic<std::int64_t> next_available;
+};
+
+struct throttled_copy
+{
+    const wchar_t* existing_file_name;
+    const wchar_t* new_file_name;
+    LPPROGRESS_ROUTINE progress_routine;
+    DWORD copy_flags;
+    std::uint64_t bytes_transferred = 0;
+
+    BOOL result = FALSE;
+    DWORD error = ERROR_SUCCESS;
+    bool completed = false;
+};
+
+bool g_copyThrottleEnabled = false;
+std::uint64_t g_copyThrottleSizeThreshold = default_copy_throttle_size_threshold;
+std::uint64_t g_copyThrottleBytesPerSecond = 0;
+
+copy_budget g_localCopyBudget;
+copy_budget* g_copyBudget = &g_localCopyBudget;
+
+std::mutex g_throttledCopyMutex;
+std::condition_variable g_throttledCopyQueued;
+std::condition_variable g_throttledCopyCompleted;
+std::deque<throttled_copy*> g_throttledCopies;
+bool g_throttledCopyWorkerRunning = false;
+bool g_throttledCopyWorkerStopping = false;
+
+static std::int64_t budget_timestamp() noexcept
+{
+    return static_cast<std::int64_t>(::GetTickCount64()) * 1000;
+}
+
+static void consume_copy_budget(std::uint64_t bytes) noexcept
+{
+    if (g_copyThrottleBytesPerSecond == 0)
+    {
+        return;
+    }
+
+    // Split the conversion so that it can't overflow
+    auto rate = g_copyThrottleBytesPerSecond;
+    auto cost = static_cast<std::int64_t>((bytes / rate) * 1'000'000 + (bytes % rate) * 1'000'000 / rate);
+
+    auto now = budget_timestamp();
+    auto current = g_copyBudget->next_available.load();
+    std::int64_t next;
+    do
+    {
+        next = (std::max)(current, now) + cost;
+    } while (!g_copyBudget->next_available.compare_exchange_weak(current, next));
+
+    if (auto delay = next - now - copy_budget_burst; delay > 0)
+    {
+        ::Sleep(static_cast<DWORD>((std::min<std::int64_t>)(delay / 1000, MAXDWORD - 1)));
+    }
+}
+
+static DWORD __stdcall ThrottledCopyProgress(
+    LARGE_INTEGER totalFileSize,
+    LARGE_INTEGER totalBytesTransferred,
+    LARGE_INTEGER streamSize,
+    LARGE_INTEGER streamBytesTransferred,
+    DWORD streamNumber,
+    DWORD callbackReason,
+    HANDLE sourceFile,
+    HANDLE destinationFile,
+    LPVOID data) noexcept
+{
+    auto copy = static_cast<throttled_copy*>(data);
+    auto transferred = static_cast<std::uint64_t>(totalBytesTransferred.QuadPart);
+    if (transferred > copy->bytes_transferred)
+    {
+        consume_copy_budget(transferred - copy->bytes_transferred);
+        copy->bytes_transferred = transferred;
+    }
+
+    if (copy->progress_routine)
+    {
+        return copy->progress_routine(
+            totalFileSize,
+            totalBytesTransferred,
+            streamSize,
+            streamBytesTransferred,
+            streamNumber,
+            callbackReason,
+            sourceFile,
+            destinationFile,
+            nullptr);
+    }
+
+    return PROGRESS_CONTINUE;
+}
+
+static void run_throttled_copy(throttled_copy& copy) noexcept
+{
+    copy.result = PipelinedCopyFile(
+        copy.existing_file_name,
+        copy.new_file_name,
+        &ThrottledCopyProgress,
+        &copy,
+        copy.copy_flags);
+    copy.error = copy.result ? ERROR_SUCCESS : ::GetLastError();
+}
+
+static DWORD __stdcall ThrottledCopyThread(void*) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+
+    // Background mode lowers the thread's I/O priority along with its CPU and memory priority
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    std::unique_lock lock(g_throttledCopyMutex);
+    g_throttledCopyWorkerRunning = true;
+    for (;;)
+    {
+        g_throttledCopyQueued.wait(lock, [] { return !g_throttledCopies.empty() || g_throttledCopyWorkerStopping; });
+        if (g_throttledCopies.empty())
+        {
+            g_throttledCopyWorkerRunning = false;
+            return ERROR_SUCCESS;
+        }
+
+        auto copy = g_throttledCopies.front();
+        g_throttledCopies.pop_front();
+
+        lock.unlock();
+        run_throttled_copy(*copy);
+        lock.lock();
+
+        copy->completed = true;
+        g_throttledCopyCompleted.notify_all();
+    }
+}
+
+bool ShouldThrottleCopy(std::uint64_t fileSize) noexcept
+{
+    return g_copyThrottleEnabled && (fileSize >= g_copyThrottleSizeThreshold);
+}
+
+BOOL ThrottledCopyFile(const wchar_t* existingFileName, const wchar_t* newFileName, LPPROGRESS_ROUTINE progressRoutine, DWORD copyFlags)
+{
+    throttled_copy copy{ existingFileName, newFileName, progressRoutine, copyFlags };
+    {
+        std::unique_lock lock(g_throttledCopyMutex);
+        if (g_throttledCopyWorkerRunning && !g_throttledCopyWorkerStopping)
+        {
+            g_throttledCopies.push_back(&copy);
+            g_throttledCopyQueued.notify_one();
+            g_throttledCopyCompleted.wait(lock, [&] { return copy.completed; });
+        }
+    }
+
+    if (!copy.completed)
+    {
+        run_throttled_copy(copy);
+    }
+
+    ::SetLastError(copy.error);
+    return copy.result;
+}
+
+void InitializeCopyThrottle(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    if (auto sizeThresholdValue = config->try_get("sizeThreshold"))
+    {
+        g_copyThrottleSizeThreshold = sizeThresholdValue->as_number().get_unsigned();
+    }
+
+    if (auto bytesPerSecondValue = config->try_get("bytesPerSecond"))
+    {
+        g_copyThrottleBytesPerSecond = bytesPerSecondValue->as_number().get_unsigned();
+    }
+
+    if (auto packageFullName = ::PSFQueryPackageFullName(); (g_copyThrottleBytesPerSecond != 0) && *packageFullName)
+    {
+        // NOTE: The view is intentionally never unmapped, same as the mapping handle is never closed; copies may be in
+        //       progress right up until the process exits
+        std::wstring name = L"Local\\PsfCopyThrottle_";
+        name += packageFullName;
+        auto mapping = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(copy_budget), name.c_str());
+        if (mapping)
+        {
+            if (auto view = ::MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(copy_budget)))
+            {
+                // Zero filled, which is a budget that has always been available
+                g_copyBudget = static_cast<copy_budget*>(view);
+            }
+            else
+            {
+                ::CloseHandle(mapping);
+            }
+        }
+    }
+
+    // NOTE: We never wait for this thread to exit. PSFUninitialize signals it to stop, but waiting on it from within
+    //       DllMain would deadlock on the loader lock
+    psf::unique_handle thread(::CreateThread(nullptr, 0, ThrottledCopyThread, nullptr, 0, nullptr));
+    g_copyThrottleEnabled = true;
+}
+
+void UninitializeCopyThrottle() noexcept
+{
+    {
+        std::lock_guard lock(g_throttledCopyMutex);
+        g_throttledCopyWorkerStopping = true;
+    }
+    g_throttledCopyQueued.notify_all();
+}
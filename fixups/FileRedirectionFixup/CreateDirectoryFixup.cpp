@@ -9,15 +9,22 @@
 template <typename CharT>
 BOOL __stdcall CreateDirectoryFixup(_In_ const CharT* pathName, _In_opt_ LPSECURITY_ATTRIBUTES securityAttributes) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::create_directory);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(pathName, redirect_flags::ensure_directory_structure);
+            auto widePathName = widen_argument(pathName);
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(widePathName.c_str(), redirect_flags::ensure_directory_structure);
             if (shouldRedirect)
             {
-                return impl::CreateDirectory(redirectPath.c_str(), securityAttributes);
+                auto result = impl::CreateDirectory(redirectPath.c_str(), securityAttributes);
+                if (result)
+                {
+                    RedirectedPathCreated(redirectPath.c_str());
+                }
+                return result;
             }
         }
     }
@@ -36,19 +43,27 @@ BOOL __stdcall CreateDirectoryExFixup(
     _In_ const CharT* newDirectory,
     _In_opt_ LPSECURITY_ATTRIBUTES securityAttributes) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::create_directory_ex);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto [redirectTemplate, redirectTemplatePath] = ShouldRedirect(templateDirectory, redirect_flags::check_file_presence);
-            auto [redirectDest, redirectDestPath] = ShouldRedirect(newDirectory, redirect_flags::ensure_directory_structure);
+            auto wideTemplateDirectory = widen_argument(templateDirectory);
+            auto wideNewDirectory = widen_argument(newDirectory);
+            auto [redirectTemplate, redirectTemplatePath] = ShouldRedirect(wideTemplateDirectory.c_str(), redirect_flags::check_file_presence);
+            auto [redirectDest, redirectDestPath] = ShouldRedirect(wideNewDirectory.c_str(), redirect_flags::ensure_directory_structure);
             if (redirectTemplate || redirectDest)
             {
-                return impl::CreateDirectoryEx(
-                    redirectTemplate ? redirectTemplatePath.c_str() : widen_argument(templateDirectory).c_str(),
-                    redirectDest ? redirectDestPath.c_str() : widen_argument(newDirectory).c_str(),
+                auto result = impl::CreateDirectoryEx(
+                    redirectTemplate ? redirectTemplatePath.c_str() : wideTemplateDirectory.c_str(),
+                    redirectDest ? redirectDestPath.c_str() : wideNewDirectory.c_str(),
                     securityAttributes);
+                if (result && redirectDest)
+                {
+                    RedirectedPathCreated(redirectDestPath.c_str());
+                }
+                return result;
             }
         }
     }
@@ -6,6 +6,134 @@
 #include "FunctionImplementations.h"
 #include "PathRedirection.h"
 
+// Any of these access rights imply that the caller may modify the file (or, in the case of DELETE, remove it), which
+// requires that we have a copy of it in the redirected location
+constexpr DWORD write_access_mask = GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED | FILE_WRITE_DATA | FILE_APPEND_DATA |
+    FILE_WRITE_EA | FILE_WRITE_ATTRIBUTES | DELETE | WRITE_DAC | WRITE_OWNER;
+
+struct create_file_redirect_info
+{
+    bool should_redirect = false;
+    std::filesystem::path redirect_path;
+    DWORD creation_disposition = 0;
+
+    // Set when we skip copying a package file that the call will overwrite. The call would have otherwise reported that
+    // the file already existed, so we need to do the same
+    bool report_already_exists = false;
+
+    // Set when the file should be opened through the delta overlay instead of being copied. See DeltaOverlay.cpp
+    bool use_delta_overlay = false;
+};
+
+// Copy-on-read is only necessary when the caller intends to read _and_ modify an existing file. Read-only opens of
+// package files that haven't been redirected yet are served directly from the package, and calls that are going to
+// discard the file's contents anyway skip the copy. Everything else keeps the copy-on-read behavior, unless the file is
+// large enough to go through the delta overlay instead
+static create_file_redirect_info ShouldRedirectCreateFile(
+    const wchar_t* fileName,
+    DWORD desiredAccess,
+    DWORD creationDisposition,
+    DWORD flagsAndAttributes)
+{
+    create_file_redirect_info result;
+    result.creation_disposition = creationDisposition;
+
+    auto writeIntent = (desiredAccess & write_access_mask) != 0;
+    auto discardsContents = (creationDisposition == CREATE_ALWAYS) || (creationDisposition == TRUNCATE_EXISTING);
+    auto opensExisting = (creationDisposition == OPEN_EXISTING) || (creationDisposition == OPEN_ALWAYS);
+    if (!discardsContents && !(opensExisting && !writeIntent))
+    {
+        if (opensExisting && DeltaOverlayEnabled())
+        {
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::ensure_directory_structure);
+            if (shouldRedirect &&
+                !RedirectedPathExists(redirectPath.c_str()) &&
+                !PackageFileDeleted(redirectPath.native()) &&
+                ShouldUseDeltaOverlay(fileName, redirectPath, desiredAccess, flagsAndAttributes))
+            {
+                result.should_redirect = true;
+                result.use_delta_overlay = true;
+                result.redirect_path = std::move(redirectPath);
+                return result;
+            }
+        }
+
+        // E.g. read-modify-write or CREATE_NEW, which needs to fail if the file exists in the package
+        auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::copy_on_read);
+        result.should_redirect = shouldRedirect;
+        result.redirect_path = std::move(redirectPath);
+        return result;
+    }
+
+    auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::none);
+    if (!shouldRedirect)
+    {
+        return result;
+    }
+    else if (RedirectedPathExists(redirectPath.c_str()))
+    {
+        // Already redirected, so there's nothing to copy and the directory structure already exists
+        result.should_redirect = true;
+        result.redirect_path = std::move(redirectPath);
+        return result;
+    }
+
+    // NOTE: A deleted package file is treated as though it doesn't exist, so it gets created in the redirected location
+    //       if the disposition allows for it, and the call fails otherwise
+    auto packageFileExists = !PackageFileDeleted(redirectPath.native()) && PackagePathExists(fileName);
+    if (opensExisting && packageFileExists)
+    {
+        if (ShouldUseDeltaOverlay(fileName, redirectPath, desiredAccess, flagsAndAttributes))
+        {
+            // The file has been modified through the delta overlay, but not yet materialized
+            result.should_redirect = true;
+            result.use_delta_overlay = true;
+            result.redirect_path = std::move(redirectPath);
+            return result;
+        }
+
+        // Read-only access to a file that only exists in the package, so open it there. If the application later opens
+        // the file for write, that call will copy it first
+        return result;
+    }
+
+    if ((creationDisposition == TRUNCATE_EXISTING) && packageFileExists)
+    {
+        // The package file would have been copied only to be immediately truncated; create an empty file instead
+        result.creation_disposition = CREATE_ALWAYS;
+    }
+    else if (creationDisposition == CREATE_ALWAYS)
+    {
+        result.report_already_exists = packageFileExists;
+    }
+
+    // NOTE: The decision is cached, so asking again just to create the directory structure is cheap
+    auto [shouldRedirectWithDirectories, redirectPathWithDirectories] = ShouldRedirect(fileName, redirect_flags::ensure_directory_structure);
+    result.should_redirect = shouldRedirectWithDirectories;
+    result.redirect_path = std::move(redirectPathWithDirectories);
+    return result;
+}
+
+// Read-only opens of existing files are the only ones that a bypassed API skips; anything that may write still needs to
+// go to the redirected location. See AdaptiveBypass.cpp
+static bool open_bypassed(telemetry_api api, DWORD desiredAccess, DWORD creationDisposition) noexcept
+{
+    return (creationDisposition == OPEN_EXISTING) && !(desiredAccess & write_access_mask) && HookBypassed(api);
+}
+
+// Files that get created in the memory target are marked temporary so that their data stays in the system cache instead
+// of getting written out to disk. See RedirectTargets.cpp
+static DWORD redirected_file_attributes(const std::filesystem::path& redirectPath, DWORD attributes) noexcept
+{
+    std::size_t rootLength;
+    if (RedirectTargetOfPath(redirectPath.native(), rootLength) == redirect_target::memory)
+    {
+        return (attributes & ~FILE_ATTRIBUTE_NORMAL) | FILE_ATTRIBUTE_TEMPORARY;
+    }
+
+    return attributes;
+}
+
 template <typename CharT>
 HANDLE __stdcall CreateFileFixup(
     _In_ const CharT* fileName,
@@ -16,17 +144,57 @@ HANDLE __stdcall CreateFileFixup(
     _In_ DWORD flagsAndAttributes,
     _In_opt_ HANDLE templateFile) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::create_file);
     auto guard = g_reentrancyGuard.enter();
     try
     {
-        if (guard)
+        if (guard && !open_bypassed(telemetry_api::create_file, desiredAccess, creationDisposition))
         {
-            // FUTURE: If 'creationDisposition' is something like 'CREATE_ALWAYS', we could get away with something
-            //         cheaper than copy-on-read, but we'd also need to be mindful of ensuring the correct error if so
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::copy_on_read);
-            if (shouldRedirect)
+            auto wideFileName = widen_argument(fileName);
+            auto redirectInfo = ShouldRedirectCreateFile(wideFileName.c_str(), desiredAccess, creationDisposition, flagsAndAttributes);
+            if (redirectInfo.use_delta_overlay)
+            {
+                auto result = OpenDeltaOverlay(
+                    wideFileName.c_str(),
+                    redirectInfo.redirect_path,
+                    desiredAccess,
+                    shareMode,
+                    securityAttributes,
+                    creationDisposition,
+                    flagsAndAttributes);
+                if ((result != INVALID_HANDLE_VALUE) || (::GetLastError() != ERROR_NOT_SUPPORTED))
+                {
+                    return result;
+                }
+
+                // The overlay can't be used for this file (e.g. the file system doesn't support sparse files)
+                ShouldRedirect(wideFileName.c_str(), redirect_flags::copy_on_read);
+            }
+
+            if (redirectInfo.should_redirect)
             {
-                return impl::CreateFile(redirectPath.c_str(), desiredAccess, shareMode, securityAttributes, creationDisposition, flagsAndAttributes, templateFile);
+                auto result = impl::CreateFile(
+                    redirectInfo.redirect_path.c_str(),
+                    desiredAccess,
+                    shareMode,
+                    securityAttributes,
+                    redirectInfo.creation_disposition,
+                    redirected_file_attributes(redirectInfo.redirect_path, flagsAndAttributes),
+                    templateFile);
+                if (result != INVALID_HANDLE_VALUE)
+                {
+                    RedirectedHandleOpened(result, redirectInfo.redirect_path);
+                    if (!(flagsAndAttributes & FILE_FLAG_DELETE_ON_CLOSE))
+                    {
+                        RedirectedPathCreated(redirectInfo.redirect_path.c_str());
+                    }
+
+                    if (redirectInfo.report_already_exists)
+                    {
+                        ::SetLastError(ERROR_ALREADY_EXISTS);
+                    }
+                }
+                return result;
             }
         }
     }
@@ -35,7 +203,12 @@ HANDLE __stdcall CreateFileFixup(
         // Fall back to assuming no redirection is necessary
     }
 
-    return impl::CreateFile(fileName, desiredAccess, shareMode, securityAttributes, creationDisposition, flagsAndAttributes, templateFile);
+    auto result = impl::CreateFile(fileName, desiredAccess, shareMode, securityAttributes, creationDisposition, flagsAndAttributes, templateFile);
+    if ((result != INVALID_HANDLE_VALUE) && StartupProfileRecording())
+    {
+        StartupProfileFileOpened(result, fileName);
+    }
+    return result;
 }
 DECLARE_STRING_FIXUP(impl::CreateFile, CreateFileFixup);
 
@@ -46,17 +219,67 @@ HANDLE __stdcall CreateFile2Fixup(
     _In_ DWORD creationDisposition,
     _In_opt_ LPCREATEFILE2_EXTENDED_PARAMETERS createExParams) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::create_file2);
     auto guard = g_reentrancyGuard.enter();
     try
     {
-        if (guard)
+        if (guard && !open_bypassed(telemetry_api::create_file2, desiredAccess, creationDisposition))
         {
-            // FUTURE: See comment in CreateFileFixup about using 'creationDisposition' to choose a potentially better
-            //         redirect flags value
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::copy_on_read);
-            if (shouldRedirect)
+            // See ShouldRedirectCreateFile for commentary on when we copy-on-read
+            auto flagsAndAttributes = createExParams ?
+                (createExParams->dwFileAttributes | createExParams->dwFileFlags | createExParams->dwSecurityQosFlags) : 0;
+            auto redirectInfo = ShouldRedirectCreateFile(fileName, desiredAccess, creationDisposition, flagsAndAttributes);
+            if (redirectInfo.use_delta_overlay)
+            {
+                auto result = OpenDeltaOverlay(
+                    fileName,
+                    redirectInfo.redirect_path,
+                    desiredAccess,
+                    shareMode,
+                    createExParams ? createExParams->lpSecurityAttributes : nullptr,
+                    creationDisposition,
+                    flagsAndAttributes);
+                if ((result != INVALID_HANDLE_VALUE) || (::GetLastError() != ERROR_NOT_SUPPORTED))
+                {
+                    return result;
+                }
+
+                // The overlay can't be used for this file (e.g. the file system doesn't support sparse files)
+                ShouldRedirect(fileName, redirect_flags::copy_on_read);
+            }
+
+            if (redirectInfo.should_redirect)
             {
-                return impl::CreateFile2(redirectPath.c_str(), desiredAccess, shareMode, creationDisposition, createExParams);
+                auto redirectExParams = createExParams;
+                CREATEFILE2_EXTENDED_PARAMETERS temporaryExParams;
+                auto attributes = createExParams ? createExParams->dwFileAttributes : FILE_ATTRIBUTE_NORMAL;
+                if (auto redirectAttributes = redirected_file_attributes(redirectInfo.redirect_path, attributes); redirectAttributes != attributes)
+                {
+                    temporaryExParams = createExParams ? *createExParams : CREATEFILE2_EXTENDED_PARAMETERS{ sizeof(temporaryExParams) };
+                    temporaryExParams.dwFileAttributes = redirectAttributes;
+                    redirectExParams = &temporaryExParams;
+                }
+
+                auto result = impl::CreateFile2(
+                    redirectInfo.redirect_path.c_str(),
+                    desiredAccess,
+                    shareMode,
+                    redirectInfo.creation_disposition,
+                    redirectExParams);
+                if (result != INVALID_HANDLE_VALUE)
+                {
+                    RedirectedHandleOpened(result, redirectInfo.redirect_path);
+                    if (!createExParams || !(createExParams->dwFileFlags & FILE_FLAG_DELETE_ON_CLOSE))
+                    {
+                        RedirectedPathCreated(redirectInfo.redirect_path.c_str());
+                    }
+
+                    if (redirectInfo.report_already_exists)
+                    {
+                        ::SetLastError(ERROR_ALREADY_EXISTS);
+                    }
+                }
+                return result;
             }
         }
     }
@@ -65,6 +288,11 @@ HANDLE __stdcall CreateFile2Fixup(
         // Fall back to assuming no redirection is necessary
     }
 
-    return impl::CreateFile2(fileName, desiredAccess, shareMode, creationDisposition, createExParams);
+    auto result = impl::CreateFile2(fileName, desiredAccess, shareMode, creationDisposition, createExParams);
+    if ((result != INVALID_HANDLE_VALUE) && StartupProfileRecording())
+    {
+        StartupProfileFileOpened(result, fileName);
+    }
+    return result;
 }
 DECLARE_FIXUP(impl::CreateFile2, CreateFile2Fixup);
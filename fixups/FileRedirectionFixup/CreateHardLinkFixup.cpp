@@ -12,25 +12,34 @@ BOOL __stdcall CreateHardLinkFixup(
     _In_ const CharT* existingFileName,
     _Reserved_ LPSECURITY_ATTRIBUTES securityAttributes) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::create_hard_link);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
+            auto wideFileName = widen_argument(fileName);
+            auto wideExistingFileName = widen_argument(existingFileName);
+
             // NOTE: We need to copy-on-read the existing file since the application may want to open the hard-link file
             //       for write in the future. As for the link file, we currently _don't_ copy-on-read it due to the fact
             //       that we don't handle file deletions as robustly as we could and CreateHardLink will fail if the
             //       link file already exists. I.e. we're giving the application the benefit of the doubt that, if they
             //       are trying to create a hard-link with the same path as a file inside the package, they had
             //       previously attempted to delete that file.
-            auto [redirectLink, redirectPath] = ShouldRedirect(fileName, redirect_flags::ensure_directory_structure);
-            auto [redirectTarget, redirectTargetPath] = ShouldRedirect(existingFileName, redirect_flags::copy_on_read);
+            auto [redirectLink, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::ensure_directory_structure);
+            auto [redirectTarget, redirectTargetPath] = ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::copy_on_read);
             if (redirectLink || redirectTarget)
             {
-                return impl::CreateHardLink(
-                    redirectLink ? redirectPath.c_str() : widen_argument(fileName).c_str(),
-                    redirectTarget ? redirectTargetPath.c_str() : widen_argument(existingFileName).c_str(),
+                auto result = impl::CreateHardLink(
+                    redirectLink ? redirectPath.c_str() : wideFileName.c_str(),
+                    redirectTarget ? redirectTargetPath.c_str() : wideExistingFileName.c_str(),
                     securityAttributes);
+                if (result && redirectLink)
+                {
+                    RedirectedPathCreated(redirectPath.c_str());
+                }
+                return result;
             }
         }
     }
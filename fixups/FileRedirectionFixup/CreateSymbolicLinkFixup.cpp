@@ -12,23 +12,31 @@ BOOLEAN __stdcall CreateSymbolicLinkFixup(
     _In_ const CharT* targetFileName,
     _In_ DWORD flags) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::create_symbolic_link);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto [redirectLink, redirectPath] = ShouldRedirect(symlinkFileName, redirect_flags::ensure_directory_structure);
-            auto [redirectTarget, redirectTargetPath] = ShouldRedirect(targetFileName, redirect_flags::copy_on_read);
+            auto wideSymlinkFileName = widen_argument(symlinkFileName);
+            auto wideTargetFileName = widen_argument(targetFileName);
+            auto [redirectLink, redirectPath] = ShouldRedirect(wideSymlinkFileName.c_str(), redirect_flags::ensure_directory_structure);
+            auto [redirectTarget, redirectTargetPath] = ShouldRedirect(wideTargetFileName.c_str(), redirect_flags::copy_on_read);
             if (redirectLink || redirectTarget)
             {
                 // NOTE: If the target is a directory, then ideally we would recursively copy its contents to its
                 //       redirected location (since future accesses may want to read/write to files that originated from
                 //       the package). However, doing so would be quite a bit of work, so we'll defer doing so until
                 //       later when we have evidence that this could be an issue.
-                return impl::CreateSymbolicLink(
-                    redirectLink ? redirectPath.c_str() : widen_argument(symlinkFileName).c_str(),
-                    redirectTarget ? redirectTargetPath.c_str() : widen_argument(targetFileName).c_str(),
+                auto result = impl::CreateSymbolicLink(
+                    redirectLink ? redirectPath.c_str() : wideSymlinkFileName.c_str(),
+                    redirectTarget ? redirectTargetPath.c_str() : wideTargetFileName.c_str(),
                     flags);
+                if (result && redirectLink)
+                {
+                    RedirectedPathCreated(redirectPath.c_str());
+                }
+                return result;
             }
         }
     }
@@ -9,30 +9,50 @@
 template <typename CharT>
 BOOL __stdcall DeleteFileFixup(_In_ const CharT* fileName) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::delete_file);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            // NOTE: This will only delete the redirected file. If the file previously existed in the package path, then
-            //       it will remain there and a later attempt to open, etc. the file will succeed. In the future, if
-            //       this proves to be an issue, we could maintain a collection of package files that have been
-            //       "deleted" and then just pretend like they've been deleted. Such a change would be rather large and
-            //       disruptful and probably fairly inefficient as it would impact virtually every code path, so we'll
-            //       put it off for now.
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::none);
+            auto wideFileName = widen_argument(fileName);
+
+            // NOTE: This can only delete the redirected file. If the file also exists in the package path, then it will
+            //       remain there, and unless tombstones are enabled (see PackageFileTombstones.cpp), a later attempt to
+            //       open, etc. the file will succeed.
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::none);
             if (shouldRedirect)
             {
-                if (!impl::PathExists(redirectPath.c_str()) && impl::PathExists(fileName))
+                if (!RedirectedPathExists(redirectPath.c_str()))
                 {
-                    // If the file does not exist in the redirected location, but does in the non-redirected location,
-                    // then we want to give the "illusion" that the delete succeeded
-                    return TRUE;
+                    if (PackageFileDeleted(redirectPath.native()))
+                    {
+                        ::SetLastError(ERROR_FILE_NOT_FOUND);
+                        return FALSE;
+                    }
+                    else if (PackagePathExists(wideFileName.c_str()))
+                    {
+                        // If the file does not exist in the redirected location, but does in the non-redirected
+                        // location, then we want to give the "illusion" that the delete succeeded
+                        AddPackageFileTombstone(redirectPath.c_str());
+                        RemoveAttributeOverride(redirectPath.c_str());
+                        return TRUE;
+                    }
                 }
-                else
+
+                auto result = impl::DeleteFile(redirectPath.c_str());
+                if (result)
                 {
-                    return impl::DeleteFile(redirectPath.c_str());
+                    RedirectedPathDeleted(redirectPath.c_str());
+                    auto lastError = ::GetLastError();
+                    if (PackagePathExists(wideFileName.c_str()))
+                    {
+                        AddPackageFileTombstone(redirectPath.c_str());
+                    }
+                    ::SetLastError(lastError);
                 }
+                InvalidateRedirectCache();
+                return result;
             }
         }
     }
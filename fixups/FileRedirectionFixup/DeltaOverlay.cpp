@@ -0,0 +1,1435 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Copy-on-read means that opening a package file for write first copies the entire file to the redirected location,
+// even if the application only ever changes a few bytes of it (e.g. appending a line to a log or updating a page of a
+// large database). When the "deltaOverlay" option is enabled, write opens of large package files instead create a
+// sparse "delta" file of the same size that only holds the ranges that have been written. Reads are served by merging
+// the package file with the delta, so the cost of opening the file is proportional to the number of bytes written
+// rather than the size of the file.
+//
+// The delta lives under the redirect root in a "$DeltaOverlay" directory next to a log of the written ranges, and the
+// handles returned to the application are handles to the delta file itself. Most of what an application can do with
+// the handle (e.g. querying its size, locking ranges, or setting its file pointer) therefore works without our help;
+// we only need to intervene when the application reads data that hasn't been written (ReadFile), when it writes data
+// or truncates the file (WriteFile, SetEndOfFile, SetFileInformationByHandle), and when the handle is used in a way
+// that bypasses ReadFile/WriteFile (CreateFileMapping, DuplicateHandle). In the latter case we fill in the unwritten
+// ranges from the package file before letting the call through. The exception is a read-only (or copy-on-write) mapping
+// of a file that hasn't been written to yet, which is the package file's data, so we map the package file instead and
+// only copy the file once a writable mapping asks for it.
+//
+// Once the last handle to the file is closed, the overlay is materialized on a background thread: the remaining
+// ranges get copied from the package file and the delta is renamed to the redirected path, at which point it becomes
+// a regular redirected file. If the process exits before that completes, the delta and its log are picked up again
+// the next time the file is opened.
+//
+// Overlapped I/O completes on its own time, through the application's event, completion port, or APC, so we can't
+// merge what it reads the way we do for synchronous reads. Instead, the ranges that an overlapped read or write covers
+// get copied from the package file into the delta first, after which the I/O itself goes to the delta as-is. Overlapped
+// opens (typically servers, which keep the file open for a long time) also start copying the rest of the file in the
+// background right away, so that their I/O soon stops needing our help at all.
+//
+// NOTE: Until the overlay is materialized, other processes and path-based APIs other than CreateFile (e.g.
+//       GetFileAttributesEx or FindFirstFile) see the package file. Opens that we can't service through the overlay
+//       (unbuffered I/O) fall back to copy-on-read. Views of a package file mapping don't see what gets
+//       written to the delta afterwards
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include <fancy_handle.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+// NOTE: Handles that we open for our own use need to bypass CloseHandleFixup, which would otherwise try to acquire
+//       locks that we might already be holding
+static BOOL __stdcall close_handle(HANDLE handle) noexcept
+{
+    return impl::CloseHandle(handle);
+}
+using unique_handle = std::unique_ptr<void, psf::handle_deleter<&close_handle>>;
+
+bool g_deltaOverlayEnabled = false;
+std::uint64_t g_deltaOverlayMinimumFileSize = 64 * 1024 * 1024;
+
+// Flags that imply I/O that doesn't go through ReadFile/WriteFile, or that we otherwise can't service
+constexpr DWORD unsupported_flags = FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE |
+    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT;
+
+constexpr DWORD read_access_mask = GENERIC_READ | GENERIC_ALL | MAXIMUM_ALLOWED | FILE_READ_DATA;
+constexpr DWORD write_access_mask = GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED | FILE_WRITE_DATA | FILE_APPEND_DATA;
+
+constexpr std::size_t materialize_chunk_size = 1024 * 1024;
+
+// The range log starts with a header followed by the redirected path (used to validate that the log belongs to the file
+// we think it does) and then a sequence of records, each of which is either a written range or a truncation
+constexpr std::uint32_t range_log_magic = 0x44465350; // "PSFD"
+constexpr std::uint64_t truncate_record = ~0ull;
+
+struct range_log_header
+{
+    std::uint32_t magic;
+    std::uint32_t path_length;
+};
+
+struct range_log_record
+{
+    std::uint64_t begin;
+    std::uint64_t end;
+};
+
+struct overlay_file
+{
+    // Guards everything below, as well as I/O against the delta that has to be kept consistent with modified_ranges
+    std::mutex mutex;
+
+    std::wstring redirect_path;
+    std::wstring delta_path;
+    std::wstring range_log_path;
+
+    unique_handle original;
+    unique_handle range_log;
+    std::uint64_t range_log_size = 0;
+    std::size_t range_log_records = 0;
+
+    // Disjoint, non-adjacent [begin, end) ranges of the delta that hold valid data. Anything below original_limit
+    // that's not covered by a range comes from the package file; everything at or above it comes from the delta
+    std::map<std::uint64_t, std::uint64_t> modified_ranges;
+    std::uint64_t original_limit = 0;
+
+    std::size_t open_handles = 0;
+    bool materializing = false;
+    bool filling = false;
+};
+
+struct overlay_handle_info
+{
+    std::shared_ptr<overlay_file> file;
+    DWORD desired_access;
+    bool overlapped;
+};
+
+// NOTE: Lock ordering is g_overlayMutex and then overlay_file::mutex
+std::shared_mutex g_overlayMutex;
+std::map<iwstring, std::shared_ptr<overlay_file>> g_overlayFiles;
+std::unordered_map<HANDLE, overlay_handle_info> g_overlayHandles;
+
+// Checked before anything else so that handle based functions don't pay for the overlay unless it's in use
+std::atomic<std::size_t> g_overlayHandleCount = 0;
+
+void InitializeDeltaOverlay(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"))
+    {
+        g_deltaOverlayEnabled = static_cast<bool>(enabledValue->as_boolean());
+    }
+
+    if (auto minimumFileSizeValue = config->try_get("minimumFileSize"))
+    {
+        g_deltaOverlayMinimumFileSize = minimumFileSizeValue->as_number().get_unsigned();
+    }
+}
+
+bool DeltaOverlayEnabled() noexcept
+{
+    return g_deltaOverlayEnabled;
+}
+
+static std::wstring overlay_directory()
+{
+    return LR"(\\?\)" + g_redirectRootPath.native() + LR"(\$DeltaOverlay)";
+}
+
+// The delta is named by a hash of the (case folded) redirected path so that its name is fixed across runs. The log
+// records the full path, so a collision only means that we fall back to copy-on-read
+static std::wstring overlay_base_path(const std::wstring& redirectPath)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (auto ch : redirectPath)
+    {
+        hash = (hash ^ static_cast<std::uint16_t>(std::towlower(ch))) * 1099511628211ull;
+    }
+
+    auto result = overlay_directory();
+    result.push_back(L'\\');
+    for (int shift = 60; shift >= 0; shift -= 4)
+    {
+        result.push_back(L"0123456789abcdef"[(hash >> shift) & 0xF]);
+    }
+
+    return result;
+}
+
+static OVERLAPPED overlapped_at(std::uint64_t offset) noexcept
+{
+    OVERLAPPED result = {};
+    result.Offset = static_cast<DWORD>(offset);
+    result.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    return result;
+}
+
+static void add_range(std::map<std::uint64_t, std::uint64_t>& ranges, std::uint64_t begin, std::uint64_t end)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    auto itr = ranges.upper_bound(begin);
+    if (itr != ranges.begin())
+    {
+        auto prev = std::prev(itr);
+        if (prev->second >= begin)
+        {
+            begin = prev->first;
+            end = (std::max)(end, prev->second);
+            itr = ranges.erase(prev);
+        }
+    }
+
+    while ((itr != ranges.end()) && (itr->first <= end))
+    {
+        end = (std::max)(end, itr->second);
+        itr = ranges.erase(itr);
+    }
+
+    ranges.emplace(begin, end);
+}
+
+static void clip_ranges(std::map<std::uint64_t, std::uint64_t>& ranges, std::uint64_t size)
+{
+    auto itr = ranges.lower_bound(size);
+    ranges.erase(itr, ranges.end());
+    if (!ranges.empty() && (ranges.rbegin()->second > size))
+    {
+        ranges.rbegin()->second = size;
+    }
+}
+
+static void apply_record(overlay_file& file, const range_log_record& record)
+{
+    if (record.begin == truncate_record)
+    {
+        file.original_limit = (std::min)(file.original_limit, record.end);
+        clip_ranges(file.modified_ranges, record.end);
+    }
+    else
+    {
+        add_range(file.modified_ranges, record.begin, record.end);
+    }
+}
+
+// 'overlappedHandle' is for writing through one of the application's handles that was opened for overlapped I/O. Setting
+// the low bit of the event keeps the completion from getting queued to the application's completion port, if any
+static bool write_at(HANDLE handle, std::uint64_t offset, const void* data, DWORD length, bool overlappedHandle = false) noexcept
+{
+    auto overlapped = overlapped_at(offset);
+    DWORD bytesWritten;
+    if (!overlappedHandle)
+    {
+        return impl::WriteFile(handle, data, length, &bytesWritten, &overlapped) && (bytesWritten == length);
+    }
+
+    unique_handle event(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (!event)
+    {
+        return false;
+    }
+
+    overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(event.get()) | 1);
+    if (!impl::WriteFile(handle, data, length, &bytesWritten, &overlapped) &&
+        ((::GetLastError() != ERROR_IO_PENDING) || !::GetOverlappedResult(handle, &overlapped, &bytesWritten, TRUE)))
+    {
+        return false;
+    }
+
+    return bytesWritten == length;
+}
+
+static bool write_range_log_header(HANDLE handle, const std::wstring& redirectPath, std::uint64_t& size) noexcept
+{
+    range_log_header header = { range_log_magic, static_cast<std::uint32_t>(redirectPath.length()) };
+    auto pathSize = static_cast<DWORD>(redirectPath.length() * sizeof(wchar_t));
+    if (!write_at(handle, 0, &header, sizeof(header)) || !write_at(handle, sizeof(header), redirectPath.data(), pathSize))
+    {
+        return false;
+    }
+
+    size = sizeof(header) + pathSize;
+    return true;
+}
+
+// Rewrites the log with only the records needed to reproduce the current state. The new log is written to the side and
+// then moved into place so that we never lose track of written ranges if we crash part way through
+static void compact_range_log(overlay_file& file)
+{
+    auto tempPath = file.range_log_path + L".tmp";
+    {
+        unique_handle temp(impl::CreateFile(tempPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!temp)
+        {
+            return;
+        }
+
+        std::vector<range_log_record> records;
+        records.reserve(file.modified_ranges.size() + 1);
+        records.push_back({ truncate_record, file.original_limit });
+        for (auto& [begin, end] : file.modified_ranges)
+        {
+            records.push_back({ begin, end });
+        }
+
+        std::uint64_t size;
+        auto recordsSize = static_cast<DWORD>(records.size() * sizeof(range_log_record));
+        if (!write_range_log_header(temp.get(), file.redirect_path, size) || !write_at(temp.get(), size, records.data(), recordsSize))
+        {
+            temp.reset();
+            impl::DeleteFile(tempPath.c_str());
+            return;
+        }
+
+        file.range_log_size = size + recordsSize;
+        file.range_log_records = records.size();
+    }
+
+    file.range_log.reset();
+    impl::MoveFileEx(tempPath.c_str(), file.range_log_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    file.range_log.reset(impl::CreateFile(file.range_log_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+}
+
+static void log_record(overlay_file& file, const range_log_record& record)
+{
+    apply_record(file, record);
+
+    // NOTE: The log is only needed to recover from the process exiting before the overlay gets materialized, so failing
+    //       to write it doesn't affect the current process
+    if (file.range_log && write_at(file.range_log.get(), file.range_log_size, &record, sizeof(record)))
+    {
+        file.range_log_size += sizeof(record);
+        if (++file.range_log_records > (2 * file.modified_ranges.size() + 4096))
+        {
+            compact_range_log(file);
+        }
+    }
+}
+
+enum class range_log_state
+{
+    valid,
+    invalid,    // Missing or unusable, in which case nothing was written to the delta that we need to keep
+    other_file, // The delta belongs to a different redirected path whose name hashes to the same value
+};
+
+static range_log_state load_range_log(overlay_file& file)
+{
+    file.range_log.reset(impl::CreateFile(file.range_log_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    LARGE_INTEGER size;
+    if (!file.range_log || !::GetFileSizeEx(file.range_log.get(), &size) || (size.QuadPart > MAXDWORD))
+    {
+        return range_log_state::invalid;
+    }
+
+    std::vector<std::uint8_t> contents(static_cast<std::size_t>(size.QuadPart));
+    DWORD bytesRead;
+    auto overlapped = overlapped_at(0);
+    if (!impl::ReadFile(file.range_log.get(), contents.data(), static_cast<DWORD>(contents.size()), &bytesRead, &overlapped) ||
+        (bytesRead != contents.size()) ||
+        (contents.size() < sizeof(range_log_header)))
+    {
+        return range_log_state::invalid;
+    }
+
+    range_log_header header;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    auto offset = sizeof(header) + header.path_length * sizeof(wchar_t);
+    if ((header.magic != range_log_magic) || (offset > contents.size()))
+    {
+        return range_log_state::invalid;
+    }
+
+    iwstring_view path(reinterpret_cast<const wchar_t*>(contents.data() + sizeof(header)), header.path_length);
+    if (path != iwstring_view(file.redirect_path.c_str(), file.redirect_path.length()))
+    {
+        return range_log_state::other_file;
+    }
+
+    // A partially written record at the end means that we crashed while writing it, in which case the write it describes
+    // never completed either. Drop it so that new records get appended in the right place
+    for (; offset + sizeof(range_log_record) <= contents.size(); offset += sizeof(range_log_record))
+    {
+        range_log_record record;
+        std::memcpy(&record, contents.data() + offset, sizeof(record));
+        apply_record(file, record);
+        ++file.range_log_records;
+    }
+
+    file.range_log_size = offset;
+    return range_log_state::valid;
+}
+
+static bool create_delta(overlay_file& file)
+{
+    impl::DeleteFile(file.delta_path.c_str());
+    impl::DeleteFile(file.range_log_path.c_str());
+
+    unique_handle delta(impl::CreateFile(
+        file.delta_path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!delta)
+    {
+        return false;
+    }
+
+    DWORD bytesReturned;
+    FILE_END_OF_FILE_INFO endOfFileInfo;
+    endOfFileInfo.EndOfFile.QuadPart = file.original_limit;
+    if (!::DeviceIoControl(delta.get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr) ||
+        !impl::SetFileInformationByHandle(delta.get(), FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+    {
+        return false;
+    }
+    delta.reset();
+
+    // NOTE: The log gets created last. A delta without a log hasn't been written to yet, so it's safe to start over
+    file.range_log.reset(impl::CreateFile(file.range_log_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr));
+    return file.range_log && write_range_log_header(file.range_log.get(), file.redirect_path, file.range_log_size);
+}
+
+static std::shared_ptr<overlay_file> create_overlay_file(const wchar_t* packagePath, const std::filesystem::path& redirectPath)
+{
+    auto file = std::make_shared<overlay_file>();
+    file->redirect_path = redirectPath.native();
+    file->delta_path = overlay_base_path(file->redirect_path);
+    file->range_log_path = file->delta_path + L".ranges";
+
+    file->original.reset(impl::CreateFile(packagePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    LARGE_INTEGER size;
+    if (!file->original || !::GetFileSizeEx(file->original.get(), &size))
+    {
+        return nullptr;
+    }
+    file->original_limit = size.QuadPart;
+
+    EnsureRedirectRootExists();
+    impl::CreateDirectory(overlay_directory().c_str(), nullptr);
+    auto state = impl::PathExists(file->delta_path.c_str()) ? load_range_log(*file) : range_log_state::invalid;
+    if (state == range_log_state::other_file)
+    {
+        return nullptr;
+    }
+    else if (state == range_log_state::invalid)
+    {
+        file->range_log.reset();
+        file->modified_ranges.clear();
+        file->range_log_records = 0;
+        file->original_limit = size.QuadPart;
+        if (!create_delta(*file))
+        {
+            file->range_log.reset();
+            impl::DeleteFile(file->delta_path.c_str());
+            impl::DeleteFile(file->range_log_path.c_str());
+            return nullptr;
+        }
+    }
+
+    return file;
+}
+
+static bool overlay_exists(const std::filesystem::path& redirectPath)
+{
+    {
+        std::shared_lock lock(g_overlayMutex);
+        if (g_overlayFiles.find(iwstring(redirectPath.c_str())) != g_overlayFiles.end())
+        {
+            return true;
+        }
+    }
+
+    // E.g. the process exited before a previous overlay got materialized
+    return impl::PathExists(overlay_base_path(redirectPath.native()).c_str());
+}
+
+bool ShouldUseDeltaOverlay(const wchar_t* packagePath, const std::filesystem::path& redirectPath, DWORD desiredAccess, DWORD flagsAndAttributes)
+{
+    if (!g_deltaOverlayEnabled || (flagsAndAttributes & unsupported_flags))
+    {
+        return false;
+    }
+
+    if (overlay_exists(redirectPath))
+    {
+        // Everyone needs to see the same contents, so even read-only opens go through the overlay
+        return true;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!(desiredAccess & write_access_mask) ||
+        !impl::GetFileAttributesEx(packagePath, GetFileExInfoStandard, &data) ||
+        (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        return false;
+    }
+
+    auto fileSize = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    return fileSize >= g_deltaOverlayMinimumFileSize;
+}
+
+static void start_background_fill(const std::shared_ptr<overlay_file>& file) noexcept;
+
+HANDLE OpenDeltaOverlay(
+    const wchar_t* packagePath,
+    const std::filesystem::path& redirectPath,
+    DWORD desiredAccess,
+    DWORD shareMode,
+    LPSECURITY_ATTRIBUTES securityAttributes,
+    DWORD creationDisposition,
+    DWORD flagsAndAttributes)
+{
+    std::unique_lock overlaysLock(g_overlayMutex);
+    auto& file = g_overlayFiles[iwstring(redirectPath.c_str())];
+    if (!file)
+    {
+        file = create_overlay_file(packagePath, redirectPath);
+        if (!file)
+        {
+            g_overlayFiles.erase(iwstring(redirectPath.c_str()));
+            ::SetLastError(ERROR_NOT_SUPPORTED);
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+
+    std::lock_guard fileLock(file->mutex);
+    auto result = impl::CreateFile(file->delta_path.c_str(), desiredAccess, shareMode, securityAttributes, OPEN_EXISTING, flagsAndAttributes, nullptr);
+    if (result == INVALID_HANDLE_VALUE)
+    {
+        // E.g. a sharing violation, which the application needs to see
+        return result;
+    }
+
+    try
+    {
+        g_overlayHandles.emplace(result, overlay_handle_info{ file, desiredAccess, (flagsAndAttributes & FILE_FLAG_OVERLAPPED) != 0 });
+    }
+    catch (...)
+    {
+        impl::CloseHandle(result);
+        throw;
+    }
+
+    ++file->open_handles;
+    ++g_overlayHandleCount;
+
+    if ((flagsAndAttributes & FILE_FLAG_OVERLAPPED) && !file->filling)
+    {
+        start_background_fill(file);
+    }
+
+    // The file exists in the package, so report the same thing that opening it there would have
+    ::SetLastError((creationDisposition == OPEN_ALWAYS) ? ERROR_ALREADY_EXISTS : ERROR_SUCCESS);
+    return result;
+}
+
+static bool find_overlay_handle(HANDLE handle, overlay_handle_info& info)
+{
+    if (g_overlayHandleCount == 0)
+    {
+        return false;
+    }
+
+    std::shared_lock lock(g_overlayMutex);
+    auto itr = g_overlayHandles.find(handle);
+    if (itr == g_overlayHandles.end())
+    {
+        return false;
+    }
+
+    info = itr->second;
+    return true;
+}
+
+// Copies everything that's still backed by the package file into the delta, one chunk at a time so that the
+// application isn't blocked for long if it's using the file at the same time
+static bool fill_from_original(overlay_file& file, HANDLE delta, bool stopIfReopened, bool overlappedHandle = false)
+{
+    auto buffer = std::make_unique<std::uint8_t[]>(materialize_chunk_size);
+    while (true)
+    {
+        std::lock_guard lock(file.mutex);
+        if (stopIfReopened && (file.open_handles > 0))
+        {
+            return false;
+        }
+
+        std::uint64_t begin = 0;
+        auto itr = file.modified_ranges.begin();
+        if ((itr != file.modified_ranges.end()) && (itr->first == 0))
+        {
+            begin = itr->second;
+            ++itr;
+        }
+
+        if (begin >= file.original_limit)
+        {
+            return true;
+        }
+
+        auto end = (std::min)({ (itr == file.modified_ranges.end()) ? file.original_limit : itr->first, file.original_limit, begin + materialize_chunk_size });
+        auto length = static_cast<DWORD>(end - begin);
+        auto overlapped = overlapped_at(begin);
+        DWORD bytesRead;
+        if (!impl::ReadFile(file.original.get(), buffer.get(), length, &bytesRead, &overlapped))
+        {
+            return false;
+        }
+
+        if (bytesRead < length)
+        {
+            // The package file is smaller than it was when the overlay was created. The delta only has zeros past here
+            file.original_limit = begin + bytesRead;
+        }
+
+        if (!write_at(delta, begin, buffer.get(), bytesRead, overlappedHandle))
+        {
+            return false;
+        }
+
+        add_range(file.modified_ranges, begin, begin + bytesRead);
+    }
+}
+
+// Same as fill_from_original, but only for [begin, end), and with the file's lock already held
+static bool fill_range(overlay_file& file, HANDLE delta, bool overlappedHandle, std::uint64_t begin, std::uint64_t end)
+{
+    std::unique_ptr<std::uint8_t[]> buffer;
+    for (auto offset = begin; offset < (std::min)(end, file.original_limit); )
+    {
+        auto itr = file.modified_ranges.upper_bound(offset);
+        if (itr != file.modified_ranges.begin())
+        {
+            auto prev = std::prev(itr);
+            if (prev->second > offset)
+            {
+                offset = prev->second;
+                continue;
+            }
+        }
+
+        auto segmentEnd = (std::min)({ (itr == file.modified_ranges.end()) ? end : itr->first, end, file.original_limit, offset + materialize_chunk_size });
+        auto length = static_cast<DWORD>(segmentEnd - offset);
+        if (!buffer)
+        {
+            buffer = std::make_unique<std::uint8_t[]>(materialize_chunk_size);
+        }
+
+        auto overlapped = overlapped_at(offset);
+        DWORD bytesRead;
+        if (!impl::ReadFile(file.original.get(), buffer.get(), length, &bytesRead, &overlapped))
+        {
+            return false;
+        }
+
+        if (bytesRead < length)
+        {
+            file.original_limit = offset + bytesRead;
+        }
+
+        if (!write_at(delta, offset, buffer.get(), bytesRead, overlappedHandle))
+        {
+            return false;
+        }
+
+        add_range(file.modified_ranges, offset, offset + bytesRead);
+        offset = segmentEnd;
+    }
+
+    return true;
+}
+
+static bool backed_by_original(const overlay_file& file, std::uint64_t begin, std::uint64_t end)
+{
+    end = (std::min)(end, file.original_limit);
+    if (begin >= end)
+    {
+        return false;
+    }
+
+    auto itr = file.modified_ranges.upper_bound(begin);
+    if (itr == file.modified_ranges.begin())
+    {
+        return true;
+    }
+
+    return std::prev(itr)->second < end;
+}
+
+// Called with the file's lock held, before overlapped I/O of [begin, end) gets handed to the delta
+static bool prepare_overlapped_io(HANDLE handle, const overlay_handle_info& info, std::uint64_t begin, std::uint64_t end)
+{
+    auto& file = *info.file;
+    if (!backed_by_original(file, begin, end))
+    {
+        return true;
+    }
+
+    if (info.desired_access & write_access_mask)
+    {
+        return fill_range(file, handle, true, begin, end);
+    }
+
+    unique_handle delta(impl::CreateFile(
+        file.delta_path.c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    return delta && fill_range(file, delta.get(), false, begin, end);
+}
+
+// Used before the application does something with a handle that bypasses ReadFile/WriteFile
+static void materialize_now(HANDLE handle, const overlay_handle_info& info)
+{
+    auto& file = *info.file;
+    unique_handle delta(impl::CreateFile(
+        file.delta_path.c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+
+    auto filled = false;
+    if (delta)
+    {
+        filled = fill_from_original(file, delta.get(), false);
+    }
+    else if (info.desired_access & write_access_mask)
+    {
+        // Most likely the application didn't share write access, so use its handle, being careful not to disturb its
+        // file pointer
+        LARGE_INTEGER position;
+        if (::SetFilePointerEx(handle, {}, &position, FILE_CURRENT))
+        {
+            filled = fill_from_original(file, handle, false, info.overlapped);
+            ::SetFilePointerEx(handle, position, nullptr, FILE_BEGIN);
+        }
+    }
+
+    if (filled)
+    {
+        // Writes through mapped views and duplicated handles won't be logged, so record that the delta now holds the
+        // entire file
+        std::lock_guard lock(file.mutex);
+        log_record(file, { 0, file.original_limit });
+    }
+}
+
+static void materialize(const std::shared_ptr<overlay_file>& file)
+{
+    auto finished = [&](bool renamed)
+    {
+        std::unique_lock overlaysLock(g_overlayMutex);
+        std::lock_guard lock(file->mutex);
+        file->materializing = false;
+        if ((file->open_handles > 0) && !renamed)
+        {
+            // Someone opened the file again; the next close will try again
+            return;
+        }
+
+        auto itr = g_overlayFiles.find(iwstring(file->redirect_path.c_str()));
+        if ((itr != g_overlayFiles.end()) && (itr->second == file))
+        {
+            g_overlayFiles.erase(itr);
+        }
+    };
+
+    {
+        unique_handle delta(impl::CreateFile(
+            file->delta_path.c_str(),
+            GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr));
+        if (!delta)
+        {
+            if (::GetLastError() == ERROR_FILE_NOT_FOUND)
+            {
+                // The application deleted the file through its handle
+                std::lock_guard lock(file->mutex);
+                file->range_log.reset();
+                impl::DeleteFile(file->range_log_path.c_str());
+            }
+
+            return finished(false);
+        }
+
+        if (!fill_from_original(*file, delta.get(), true))
+        {
+            return finished(false);
+        }
+    }
+
+    std::unique_lock overlaysLock(g_overlayMutex);
+    std::unique_lock lock(file->mutex);
+    if (file->open_handles > 0)
+    {
+        lock.unlock();
+        overlaysLock.unlock();
+        return finished(false);
+    }
+
+    // If the rename fails (e.g. the application still has a duplicated handle open), we forget about the overlay and
+    // pick the delta back up from disk the next time that the file gets opened
+    file->range_log.reset();
+    auto renamed = impl::MoveFileEx(file->delta_path.c_str(), file->redirect_path.c_str(), MOVEFILE_WRITE_THROUGH) != FALSE;
+    if (renamed)
+    {
+        impl::DeleteFile(file->range_log_path.c_str());
+        RedirectedPathCreated(file->redirect_path.c_str());
+    }
+
+    lock.unlock();
+    overlaysLock.unlock();
+    finished(renamed);
+}
+
+static void __stdcall MaterializeCallback(PTP_CALLBACK_INSTANCE, void* context) noexcept
+{
+    std::unique_ptr<std::shared_ptr<overlay_file>> file(static_cast<std::shared_ptr<overlay_file>*>(context));
+
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    try
+    {
+        materialize(*file);
+    }
+    catch (...)
+    {
+        // Best effort; the delta gets picked back up the next time that the file is opened
+    }
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+}
+
+static void __stdcall FillCallback(PTP_CALLBACK_INSTANCE, void* context) noexcept
+{
+    std::unique_ptr<std::shared_ptr<overlay_file>> file(static_cast<std::shared_ptr<overlay_file>*>(context));
+
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    try
+    {
+        // NOTE: If the application didn't share write access, overlapped I/O keeps copying ranges as it needs them
+        unique_handle delta(impl::CreateFile(
+            (*file)->delta_path.c_str(),
+            GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr));
+        if (delta)
+        {
+            fill_from_original(**file, delta.get(), false);
+        }
+    }
+    catch (...)
+    {
+        // Best effort; what's left gets copied when the overlay is materialized
+    }
+
+    {
+        std::lock_guard lock((*file)->mutex);
+        (*file)->filling = false;
+    }
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+}
+
+// Called with the file's lock held
+static void start_background_fill(const std::shared_ptr<overlay_file>& file) noexcept try
+{
+    auto context = std::make_unique<std::shared_ptr<overlay_file>>(file);
+    if (::TrySubmitThreadpoolCallback(FillCallback, context.get(), nullptr))
+    {
+        context.release();
+        file->filling = true;
+    }
+}
+catch (...)
+{
+    // Overlapped I/O copies the ranges that it needs either way
+}
+
+static std::shared_ptr<overlay_file> take_overlay_handle(HANDLE handle)
+{
+    if (g_overlayHandleCount == 0)
+    {
+        return nullptr;
+    }
+
+    std::unique_lock lock(g_overlayMutex);
+    auto itr = g_overlayHandles.find(handle);
+    if (itr == g_overlayHandles.end())
+    {
+        return nullptr;
+    }
+
+    auto result = std::move(itr->second.file);
+    g_overlayHandles.erase(itr);
+    --g_overlayHandleCount;
+    return result;
+}
+
+static void overlay_handle_closed(const std::shared_ptr<overlay_file>& file) noexcept
+{
+    auto err = ::GetLastError();
+
+    std::lock_guard lock(file->mutex);
+    if ((--file->open_handles == 0) && !file->materializing)
+    {
+        try
+        {
+            auto context = std::make_unique<std::shared_ptr<overlay_file>>(file);
+            if (::TrySubmitThreadpoolCallback(MaterializeCallback, context.get(), nullptr))
+            {
+                context.release();
+                file->materializing = true;
+            }
+        }
+        catch (...)
+        {
+            // Same as above; we'll try again on the next open
+        }
+    }
+
+    ::SetLastError(err);
+}
+
+static BOOL overlay_read(HANDLE handle, const overlay_handle_info& info, void* buffer, DWORD length, DWORD* bytesRead, OVERLAPPED* overlapped)
+{
+    auto& file = *info.file;
+    std::lock_guard lock(file.mutex);
+
+    LARGE_INTEGER position;
+    LARGE_INTEGER size;
+    if (overlapped)
+    {
+        position.LowPart = overlapped->Offset;
+        position.HighPart = overlapped->OffsetHigh;
+    }
+    else if (!::SetFilePointerEx(handle, {}, &position, FILE_CURRENT))
+    {
+        return FALSE;
+    }
+
+    if (!::GetFileSizeEx(handle, &size))
+    {
+        return FALSE;
+    }
+
+    std::uint64_t begin = position.QuadPart;
+    std::uint64_t end = (std::min)(begin + length, static_cast<std::uint64_t>(size.QuadPart));
+
+    // Figures out whether the data at 'offset' comes from the delta or the package file, and for how long
+    auto nextSegment = [&](std::uint64_t offset) -> std::pair<bool, std::uint64_t>
+    {
+        if (offset >= file.original_limit)
+        {
+            return { true, end };
+        }
+
+        auto itr = file.modified_ranges.upper_bound(offset);
+        if (itr != file.modified_ranges.begin())
+        {
+            auto prev = std::prev(itr);
+            if (prev->second > offset)
+            {
+                return { true, (std::min)(prev->second, end) };
+            }
+        }
+
+        auto segmentEnd = (itr == file.modified_ranges.end()) ? end : itr->first;
+        return { false, (std::min)({ segmentEnd, file.original_limit, end }) };
+    };
+
+    if ((begin >= end) || (nextSegment(begin) == std::make_pair(true, end)))
+    {
+        // Nothing to merge (or nothing to read at all), so the delta has the answer
+        return impl::ReadFile(handle, buffer, length, bytesRead, overlapped);
+    }
+
+    auto output = static_cast<std::uint8_t*>(buffer);
+    for (auto offset = begin; offset < end; )
+    {
+        auto [fromDelta, segmentEnd] = nextSegment(offset);
+        auto segmentLength = static_cast<DWORD>(segmentEnd - offset);
+        auto segmentOverlapped = overlapped_at(offset);
+        DWORD segmentBytesRead;
+        if (!impl::ReadFile(fromDelta ? handle : file.original.get(), output, segmentLength, &segmentBytesRead, &segmentOverlapped))
+        {
+            return FALSE;
+        }
+
+        // The package file can only come up short if it's changed since the overlay was created
+        std::fill(output + segmentBytesRead, output + segmentLength, std::uint8_t{ 0 });
+        output += segmentLength;
+        offset = segmentEnd;
+    }
+
+    auto totalBytesRead = static_cast<DWORD>(end - begin);
+    LARGE_INTEGER newPosition;
+    newPosition.QuadPart = end;
+    ::SetFilePointerEx(handle, newPosition, nullptr, FILE_BEGIN);
+
+    if (bytesRead)
+    {
+        *bytesRead = totalBytesRead;
+    }
+
+    if (overlapped)
+    {
+        overlapped->Internal = 0;
+        overlapped->InternalHigh = totalBytesRead;
+        if (overlapped->hEvent)
+        {
+            ::SetEvent(overlapped->hEvent);
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOL overlay_write(HANDLE handle, const overlay_handle_info& info, const void* buffer, DWORD length, DWORD* bytesWritten, OVERLAPPED* overlapped)
+{
+    auto& file = *info.file;
+    std::lock_guard lock(file.mutex);
+
+    DWORD written = 0;
+    if (!impl::WriteFile(handle, buffer, length, &written, overlapped))
+    {
+        return FALSE;
+    }
+
+    if (bytesWritten)
+    {
+        *bytesWritten = written;
+    }
+
+    auto err = ::GetLastError();
+    auto appendOnly = !(info.desired_access & (GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED | FILE_WRITE_DATA));
+    auto appendToEnd = overlapped && (overlapped->Offset == 0xFFFFFFFF) && (overlapped->OffsetHigh == 0xFFFFFFFF);
+
+    LARGE_INTEGER end;
+    if (overlapped && !appendToEnd)
+    {
+        end.LowPart = overlapped->Offset;
+        end.HighPart = overlapped->OffsetHigh;
+        end.QuadPart += written;
+    }
+    else if (appendOnly || appendToEnd)
+    {
+        ::GetFileSizeEx(handle, &end);
+    }
+    else
+    {
+        ::SetFilePointerEx(handle, {}, &end, FILE_CURRENT);
+    }
+
+    log_record(file, { end.QuadPart - written, static_cast<std::uint64_t>(end.QuadPart) });
+    ::SetLastError(err);
+    return TRUE;
+}
+
+// The overlapped I/O itself goes straight to the delta once these return true. Both fail with the last error set, same
+// as the I/O would have
+static bool before_overlapped_read(HANDLE handle, const overlay_handle_info& info, DWORD length, const OVERLAPPED* overlapped)
+{
+    if (!overlapped)
+    {
+        // The read fails without one anyway
+        return true;
+    }
+
+    auto& file = *info.file;
+    std::lock_guard lock(file.mutex);
+    std::uint64_t begin = (static_cast<std::uint64_t>(overlapped->OffsetHigh) << 32) | overlapped->Offset;
+    return prepare_overlapped_io(handle, info, begin, begin + length);
+}
+
+static bool before_overlapped_write(HANDLE handle, const overlay_handle_info& info, DWORD length, const OVERLAPPED* overlapped)
+{
+    // Appends land past anything that the package file backs, so there's nothing to do for them
+    auto appendOnly = !(info.desired_access & (GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED | FILE_WRITE_DATA));
+    if (!overlapped || appendOnly || ((overlapped->Offset == 0xFFFFFFFF) && (overlapped->OffsetHigh == 0xFFFFFFFF)))
+    {
+        return true;
+    }
+
+    // We don't get to see the write complete, so the range gets recorded up front. Copying what the package file has
+    // there first means that the delta is still right if the write fails
+    auto& file = *info.file;
+    std::lock_guard lock(file.mutex);
+    std::uint64_t begin = (static_cast<std::uint64_t>(overlapped->OffsetHigh) << 32) | overlapped->Offset;
+    if (!prepare_overlapped_io(handle, info, begin, begin + length))
+    {
+        return false;
+    }
+
+    log_record(file, { begin, begin + length });
+    return true;
+}
+
+// Called after an operation that may have changed the file's size. The caller is expected to hold the file's lock
+static void overlay_size_changed(HANDLE handle, overlay_file& file)
+{
+    // NOTE: Growing the file doesn't need to be recorded; anything past the original limit is read from the delta
+    LARGE_INTEGER size;
+    if (::GetFileSizeEx(handle, &size) && (static_cast<std::uint64_t>(size.QuadPart) < file.original_limit))
+    {
+        log_record(file, { truncate_record, static_cast<std::uint64_t>(size.QuadPart) });
+    }
+}
+
+BOOL __stdcall ReadFileFixup(
+    _In_ HANDLE file,
+    _Out_writes_bytes_opt_(numberOfBytesToRead) LPVOID buffer,
+    _In_ DWORD numberOfBytesToRead,
+    _Out_opt_ LPDWORD numberOfBytesRead,
+    _Inout_opt_ LPOVERLAPPED overlapped) noexcept try
+{
+    telemetry_scope telemetry(telemetry_api::read_file);
+    overlay_handle_info info;
+    if (find_overlay_handle(file, info) && (info.desired_access & read_access_mask))
+    {
+        if (info.overlapped)
+        {
+            return before_overlapped_read(file, info, numberOfBytesToRead, overlapped) &&
+                impl::ReadFile(file, buffer, numberOfBytesToRead, numberOfBytesRead, overlapped);
+        }
+
+        return overlay_read(file, info, buffer, numberOfBytesToRead, numberOfBytesRead, overlapped);
+    }
+
+    if (StartupProfileRecording())
+    {
+        // NOTE: Before the read, since a synchronous read moves the file pointer past what it reads
+        StartupProfileRead(file, numberOfBytesToRead, overlapped);
+    }
+
+    return impl::ReadFile(file, buffer, numberOfBytesToRead, numberOfBytesRead, overlapped);
+}
+catch (...)
+{
+    // NOTE: Falling back to reading the delta directly would silently return the wrong data
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+DECLARE_FIXUP(impl::ReadFile, ReadFileFixup);
+
+BOOL __stdcall WriteFileFixup(
+    _In_ HANDLE file,
+    _In_reads_bytes_opt_(numberOfBytesToWrite) LPCVOID buffer,
+    _In_ DWORD numberOfBytesToWrite,
+    _Out_opt_ LPDWORD numberOfBytesWritten,
+    _Inout_opt_ LPOVERLAPPED overlapped) noexcept try
+{
+    telemetry_scope telemetry(telemetry_api::write_file);
+    overlay_handle_info info;
+    if (find_overlay_handle(file, info))
+    {
+        if (info.overlapped)
+        {
+            return before_overlapped_write(file, info, numberOfBytesToWrite, overlapped) &&
+                impl::WriteFile(file, buffer, numberOfBytesToWrite, numberOfBytesWritten, overlapped);
+        }
+
+        return overlay_write(file, info, buffer, numberOfBytesToWrite, numberOfBytesWritten, overlapped);
+    }
+
+    return impl::WriteFile(file, buffer, numberOfBytesToWrite, numberOfBytesWritten, overlapped);
+}
+catch (...)
+{
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+DECLARE_FIXUP(impl::WriteFile, WriteFileFixup);
+
+// Only handles opened for overlapped I/O can be used with ReadFileEx and WriteFileEx
+BOOL __stdcall ReadFileExFixup(
+    _In_ HANDLE file,
+    _Out_writes_bytes_opt_(numberOfBytesToRead) LPVOID buffer,
+    _In_ DWORD numberOfBytesToRead,
+    _Inout_ LPOVERLAPPED overlapped,
+    _In_ LPOVERLAPPED_COMPLETION_ROUTINE completionRoutine) noexcept try
+{
+    telemetry_scope telemetry(telemetry_api::read_file_ex);
+    overlay_handle_info info;
+    if (find_overlay_handle(file, info) && (info.desired_access & read_access_mask) &&
+        !before_overlapped_read(file, info, numberOfBytesToRead, overlapped))
+    {
+        return FALSE;
+    }
+
+    return impl::ReadFileEx(file, buffer, numberOfBytesToRead, overlapped, completionRoutine);
+}
+catch (...)
+{
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+DECLARE_FIXUP(impl::ReadFileEx, ReadFileExFixup);
+
+BOOL __stdcall WriteFileExFixup(
+    _In_ HANDLE file,
+    _In_reads_bytes_opt_(numberOfBytesToWrite) LPCVOID buffer,
+    _In_ DWORD numberOfBytesToWrite,
+    _Inout_ LPOVERLAPPED overlapped,
+    _In_ LPOVERLAPPED_COMPLETION_ROUTINE completionRoutine) noexcept try
+{
+    telemetry_scope telemetry(telemetry_api::write_file_ex);
+    overlay_handle_info info;
+    if (find_overlay_handle(file, info) && !before_overlapped_write(file, info, numberOfBytesToWrite, overlapped))
+    {
+        return FALSE;
+    }
+
+    return impl::WriteFileEx(file, buffer, numberOfBytesToWrite, overlapped, completionRoutine);
+}
+catch (...)
+{
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+DECLARE_FIXUP(impl::WriteFileEx, WriteFileExFixup);
+
+BOOL __stdcall SetEndOfFileFixup(_In_ HANDLE file) noexcept try
+{
+    telemetry_scope telemetry(telemetry_api::set_end_of_file);
+    overlay_handle_info info;
+    if (!find_overlay_handle(file, info))
+    {
+        return impl::SetEndOfFile(file);
+    }
+
+    std::lock_guard lock(info.file->mutex);
+    if (!impl::SetEndOfFile(file))
+    {
+        return FALSE;
+    }
+
+    overlay_size_changed(file, *info.file);
+    return TRUE;
+}
+catch (...)
+{
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+DECLARE_FIXUP(impl::SetEndOfFile, SetEndOfFileFixup);
+
+BOOL __stdcall SetFileInformationByHandleFixup(
+    _In_ HANDLE file,
+    _In_ FILE_INFO_BY_HANDLE_CLASS fileInformationClass,
+    _In_reads_bytes_(bufferSize) LPVOID fileInformation,
+    _In_ DWORD bufferSize) noexcept try
+{
+    telemetry_scope telemetry(telemetry_api::set_file_information_by_handle);
+    overlay_handle_info info;
+    if (((fileInformationClass == FileEndOfFileInfo) || (fileInformationClass == FileAllocationInfo)) && find_overlay_handle(file, info))
+    {
+        std::lock_guard lock(info.file->mutex);
+        if (!impl::SetFileInformationByHandle(file, fileInformationClass, fileInformation, bufferSize))
+        {
+            return FALSE;
+        }
+
+        overlay_size_changed(file, *info.file);
+        return TRUE;
+    }
+
+    return impl::SetFileInformationByHandle(file, fileInformationClass, fileInformation, bufferSize);
+}
+catch (...)
+{
+    ::SetLastError(win32_from_caught_exception());
+    return FALSE;
+}
+DECLARE_FIXUP(impl::SetFileInformationByHandle, SetFileInformationByHandleFixup);
+
+// Returns null if the mapping needs to be of the delta instead
+template <typename CharT>
+static HANDLE map_original(
+    HANDLE handle,
+    const overlay_handle_info& info,
+    LPSECURITY_ATTRIBUTES fileMappingAttributes,
+    DWORD protect,
+    DWORD maximumSizeHigh,
+    DWORD maximumSizeLow,
+    const CharT* name)
+{
+    // The low byte is the page protection; the rest are SEC_* flags, which don't change whether the file gets written to
+    auto pageProtection = protect & 0xFF;
+    if ((pageProtection != PAGE_READONLY) && (pageProtection != PAGE_WRITECOPY))
+    {
+        return nullptr;
+    }
+
+    auto& file = *info.file;
+    std::lock_guard lock(file.mutex);
+    LARGE_INTEGER deltaSize, originalSize;
+    if (!file.original || !file.modified_ranges.empty() ||
+        !::GetFileSizeEx(handle, &deltaSize) || (static_cast<std::uint64_t>(deltaSize.QuadPart) != file.original_limit) ||
+        !::GetFileSizeEx(file.original.get(), &originalSize) || (static_cast<std::uint64_t>(originalSize.QuadPart) != file.original_limit))
+    {
+        return nullptr;
+    }
+
+    return impl::CreateFileMapping(file.original.get(), fileMappingAttributes, protect, maximumSizeHigh, maximumSizeLow, name);
+}
+
+template <typename CharT>
+HANDLE __stdcall CreateFileMappingFixup(
+    _In_ HANDLE file,
+    _In_opt_ LPSECURITY_ATTRIBUTES fileMappingAttributes,
+    _In_ DWORD protect,
+    _In_ DWORD maximumSizeHigh,
+    _In_ DWORD maximumSizeLow,
+    _In_opt_ const CharT* name) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::create_file_mapping);
+    try
+    {
+        overlay_handle_info info;
+        if (find_overlay_handle(file, info))
+        {
+            if (auto mapping = map_original(file, info, fileMappingAttributes, protect, maximumSizeHigh, maximumSizeLow, name))
+            {
+                return mapping;
+            }
+
+            materialize_now(file, info);
+        }
+    }
+    catch (...)
+    {
+        // Best effort; the mapping will see zeros wherever we failed to fill in the delta
+    }
+
+    return impl::CreateFileMapping(file, fileMappingAttributes, protect, maximumSizeHigh, maximumSizeLow, name);
+}
+DECLARE_STRING_FIXUP(impl::CreateFileMapping, CreateFileMappingFixup);
+
+BOOL __stdcall DuplicateHandleFixup(
+    _In_ HANDLE sourceProcessHandle,
+    _In_ HANDLE sourceHandle,
+    _In_ HANDLE targetProcessHandle,
+    _Outptr_ LPHANDLE targetHandle,
+    _In_ DWORD desiredAccess,
+    _In_ BOOL inheritHandle,
+    _In_ DWORD options) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::duplicate_handle);
+    std::shared_ptr<overlay_file> closedFile;
+    std::shared_ptr<const redirected_handle_info> redirected;
+    try
+    {
+        redirected = FindRedirectedHandle(sourceHandle);
+        if (redirected && (options & DUPLICATE_CLOSE_SOURCE))
+        {
+            RedirectedHandleClosed(sourceHandle);
+        }
+
+        overlay_handle_info info;
+        if ((::GetProcessId(sourceProcessHandle) == ::GetCurrentProcessId()) && find_overlay_handle(sourceHandle, info))
+        {
+            // We don't track the new handle, so it needs to see the complete file
+            materialize_now(sourceHandle, info);
+            if (options & DUPLICATE_CLOSE_SOURCE)
+            {
+                closedFile = take_overlay_handle(sourceHandle);
+            }
+        }
+    }
+    catch (...)
+    {
+        // Best effort, same as CreateFileMapping
+    }
+
+    auto result = impl::DuplicateHandle(sourceProcessHandle, sourceHandle, targetProcessHandle, targetHandle, desiredAccess, inheritHandle, options);
+    if (result && redirected && (::GetProcessId(targetProcessHandle) == ::GetCurrentProcessId()))
+    {
+        RedirectedHandleDuplicated(*targetHandle, std::move(redirected));
+    }
+
+    if (closedFile)
+    {
+        overlay_handle_closed(closedFile);
+    }
+
+    return result;
+}
+DECLARE_FIXUP(impl::DuplicateHandle, DuplicateHandleFixup);
+
+BOOL __stdcall CloseHandleFixup(_In_ HANDLE object) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::close_handle);
+
+    // NOTE: We need to stop tracking the handle before it's closed since the handle value can get reused immediately
+    RedirectedHandleClosed(object);
+    if (StartupProfileRecording())
+    {
+        StartupProfileHandleClosed(object);
+    }
+
+    std::shared_ptr<overlay_file> file;
+    try
+    {
+        file = take_overlay_handle(object);
+    }
+    catch (...)
+    {
+        // Only possible if we fail to acquire the lock, in which case there's not much else we can do
+    }
+
+    auto result = impl::CloseHandle(object);
+    if (file)
+    {
+        overlay_handle_closed(file);
+    }
+
+    return result;
+}
+DECLARE_FIXUP(impl::CloseHandle, CloseHandleFixup);
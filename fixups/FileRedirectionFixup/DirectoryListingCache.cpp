@@ -0,0 +1,341 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A process-wide cache of the merged (redirected + package) listings of package directories that get enumerated in
+// full, along with the parts of them that narrower enumerations ask for (e.g. only the directories, or only "*.dll")
+// once the full listing has been read. Plenty of applications enumerate the same plugin and resource directories over and over, and once the listing
+// is cached, doing so again is just a copy out of memory. The package side of a listing never changes, so listings
+// only need to be invalidated when something changes in the redirected directory. We learn about those changes in two
+// ways: our own fixups report them through the RedirectedPath* functions as they happen, and a ReadDirectoryChangesW
+// watch on the redirect root picks up everything else (e.g. child processes and changes to file sizes/attributes).
+//
+// NOTE: Listings are only cached while the watch is established. If the watch fails (e.g. because the redirect root
+//       got deleted), we stop caching, drop everything, and periodically try to re-establish it. We also never cache
+//       a listing if anything under the redirect root changed while we were reading it, since we may have missed that
+//       change. Keys are "\\?\" prefixed, just like what RedirectedPath returns
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <tuple>
+#include <utility>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+// Bound the memory that we hold onto. Directories larger than this are rarely enumerated more than once, and it's
+// cheaper to drop everything than to track what's been used least recently
+constexpr std::size_t max_cached_directory_entries = 4096;
+constexpr std::size_t max_total_cached_entries = 64 * 1024;
+
+// How long to wait before trying to re-establish the watch after it fails
+constexpr DWORD watch_retry_interval = 1000;
+
+std::atomic<bool> g_directoryListingCacheEnabled = false;
+std::atomic<bool> g_directoryListingWatchActive = false;
+
+// Incremented whenever anything under the redirect root changes (or might have)
+std::atomic<std::uint64_t> g_directoryListingGeneration = 0;
+
+// The key is the redirected directory, without a trailing separator, whether or not the listing omits short names, and
+// the filter that the listing was narrowed down to, if any. Keys for the same directory are next to each other
+using directory_listing_key = std::tuple<iwstring, bool, iwstring>;
+
+std::shared_mutex g_directoryListingMutex;
+std::map<directory_listing_key, std::shared_ptr<const directory_listing>> g_directoryListings;
+std::size_t g_directoryListingEntryCount = 0;
+iwstring g_directoryListingRoot;
+
+psf::unique_handle g_directoryListingWatcherStopEvent;
+
+static iwstring listing_key_path(std::wstring_view path)
+{
+    while (!path.empty() && psf::is_path_separator(path.back()))
+    {
+        path.remove_suffix(1);
+    }
+
+    iwstring result(path.data(), path.length());
+    for (auto& ch : result)
+    {
+        if (ch == L'/')
+        {
+            ch = L'\\';
+        }
+    }
+
+    return result;
+}
+
+static void clear_directory_listings() noexcept
+{
+    ++g_directoryListingGeneration;
+
+    std::unique_lock lock(g_directoryListingMutex);
+    g_directoryListings.clear();
+    g_directoryListingEntryCount = 0;
+}
+
+bool DirectoryListingCacheEnabled() noexcept
+{
+    return g_directoryListingCacheEnabled;
+}
+
+std::shared_ptr<const directory_listing> GetDirectoryListing(
+    const std::wstring& redirectDirectory,
+    bool basicInfo,
+    std::wstring_view filter,
+    const std::function<std::shared_ptr<const directory_listing>()>& buildListing)
+{
+    if (!g_directoryListingCacheEnabled || !g_directoryListingWatchActive)
+    {
+        return nullptr;
+    }
+
+    // NOTE: The watch only covers the redirect root, so directories that redirect to one of the other targets (see
+    //       RedirectTargets.cpp) could change without us knowing
+    auto path = listing_key_path(redirectDirectory);
+    if ((path.length() <= g_directoryListingRoot.length()) || (path[g_directoryListingRoot.length()] != L'\\') ||
+        (path.compare(0, g_directoryListingRoot.length(), g_directoryListingRoot) != 0))
+    {
+        return nullptr;
+    }
+
+    directory_listing_key key{ std::move(path), basicInfo, iwstring(filter.data(), filter.length()) };
+    {
+        std::shared_lock lock(g_directoryListingMutex);
+        if (auto itr = g_directoryListings.find(key); itr != g_directoryListings.end())
+        {
+            return itr->second;
+        }
+    }
+
+    // Anything that changes while we're building the listing bumps the generation _before_ removing listings, so if the
+    // generation is unchanged once we hold the lock, the listing is safe to cache
+    auto generation = g_directoryListingGeneration.load();
+    auto listing = buildListing ? buildListing() : nullptr;
+    if (!listing || (listing->size() > max_cached_directory_entries))
+    {
+        return listing;
+    }
+
+    std::unique_lock lock(g_directoryListingMutex);
+    if (g_directoryListingWatchActive && (generation == g_directoryListingGeneration))
+    {
+        if (g_directoryListingEntryCount + listing->size() > max_total_cached_entries)
+        {
+            g_directoryListings.clear();
+            g_directoryListingEntryCount = 0;
+        }
+
+        if (g_directoryListings.emplace(std::move(key), listing).second)
+        {
+            g_directoryListingEntryCount += listing->size();
+        }
+    }
+
+    return listing;
+}
+
+void InvalidateDirectoryListings(const wchar_t* redirectPath) noexcept
+{
+    if (!g_directoryListingCacheEnabled || !redirectPath)
+    {
+        return;
+    }
+
+    ++g_directoryListingGeneration;
+
+    // Callers typically return immediately after reporting the change, so preserve the error from the operation that
+    // was performed
+    auto lastError = ::GetLastError();
+    try
+    {
+        auto path = listing_key_path(redirectPath);
+
+        std::unique_lock lock(g_directoryListingMutex);
+        auto eraseListing = [](auto itr)
+        {
+            g_directoryListingEntryCount -= itr->second->size();
+            return g_directoryListings.erase(itr);
+        };
+
+        auto eraseDirectory = [&](const iwstring& directory)
+        {
+            auto itr = g_directoryListings.lower_bound({ directory, false, iwstring() });
+            while ((itr != g_directoryListings.end()) && (std::get<0>(itr->first) == directory))
+            {
+                itr = eraseListing(itr);
+            }
+        };
+
+        // The listing that holds the path, the path's own listing if it's a directory, and, in case the change was to
+        // a directory getting deleted or renamed, the listings of everything under it
+        if (auto pos = path.find_last_of(L'\\'); pos != iwstring::npos)
+        {
+            eraseDirectory(path.substr(0, pos));
+        }
+        eraseDirectory(path);
+
+        auto prefix = path + L'\\';
+        auto itr = g_directoryListings.lower_bound({ prefix, false, iwstring() });
+        while ((itr != g_directoryListings.end()) && (std::get<0>(itr->first).compare(0, prefix.length(), prefix) == 0))
+        {
+            itr = eraseListing(itr);
+        }
+    }
+    catch (...)
+    {
+        // Out of memory. We don't know what the path was, so drop everything
+        clear_directory_listings();
+    }
+    ::SetLastError(lastError);
+}
+
+static DWORD __stdcall DirectoryListingWatcher(void*) noexcept
+{
+    psf::unique_handle ioEvent(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (!ioEvent)
+    {
+        g_directoryListingCacheEnabled = false;
+        return ::GetLastError();
+    }
+
+    alignas(DWORD) std::byte buffer[16 * 1024];
+    for (;;)
+    {
+        // The redirect root may not exist yet, or it may have been deleted out from under us
+        psf::unique_handle directory(impl::CreateFile(
+            g_directoryListingRoot.c_str(),
+            FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+            nullptr));
+        while (directory)
+        {
+            OVERLAPPED overlapped = {};
+            overlapped.hEvent = ioEvent.get();
+            constexpr DWORD notifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE |
+                FILE_NOTIFY_CHANGE_CREATION;
+            if (!::ReadDirectoryChangesW(directory.get(), buffer, sizeof(buffer), TRUE, notifyFilter, nullptr, &overlapped, nullptr))
+            {
+                break;
+            }
+
+            // Changes made from here on out will be reported, so it's now safe to start caching
+            g_directoryListingWatchActive = true;
+
+            HANDLE handles[] = { g_directoryListingWatcherStopEvent.get(), ioEvent.get() };
+            if (::WaitForMultipleObjects(2, handles, FALSE, INFINITE) != (WAIT_OBJECT_0 + 1))
+            {
+                g_directoryListingWatchActive = false;
+                ::CancelIoEx(directory.get(), &overlapped);
+                DWORD ignored;
+                ::GetOverlappedResult(directory.get(), &overlapped, &ignored, TRUE);
+                return ERROR_SUCCESS;
+            }
+
+            DWORD bytes = 0;
+            if (!::GetOverlappedResult(directory.get(), &overlapped, &bytes, FALSE))
+            {
+                break;
+            }
+
+            if (bytes == 0)
+            {
+                // The notification buffer overflowed, so we don't know what changed
+                clear_directory_listings();
+                continue;
+            }
+
+            for (auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer); ; )
+            {
+                try
+                {
+                    std::wstring path(g_directoryListingRoot.c_str(), g_directoryListingRoot.length());
+                    path.push_back(L'\\');
+                    path.append(info->FileName, info->FileNameLength / sizeof(wchar_t));
+                    InvalidateDirectoryListings(path.c_str());
+                }
+                catch (...)
+                {
+                    clear_directory_listings();
+                }
+
+                if (!info->NextEntryOffset)
+                {
+                    break;
+                }
+                info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const std::byte*>(info) + info->NextEntryOffset);
+            }
+        }
+
+        // NOTE: Closing the directory handle lets a pending delete of the redirect root complete
+        g_directoryListingWatchActive = false;
+        directory.reset();
+        clear_directory_listings();
+
+        if (::WaitForSingleObject(g_directoryListingWatcherStopEvent.get(), watch_retry_interval) != WAIT_TIMEOUT)
+        {
+            return ERROR_SUCCESS;
+        }
+    }
+}
+
+void InitializeDirectoryListingCache(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    // The watcher needs something to watch
+    EnsureRedirectRootExists();
+    auto root = LR"(\\?\)" + g_redirectRootPath.native();
+    g_directoryListingRoot.assign(root.data(), root.length());
+
+    g_directoryListingWatcherStopEvent.reset(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (!g_directoryListingWatcherStopEvent)
+    {
+        return;
+    }
+
+    // NOTE: Nothing gets cached until the watcher thread has established its watch. We never wait for this thread to
+    //       exit. PSFUninitialize signals it to stop, but waiting on it from within DllMain would deadlock on the loader
+    //       lock
+    g_directoryListingCacheEnabled = true;
+    psf::unique_handle thread(::CreateThread(nullptr, 0, DirectoryListingWatcher, nullptr, 0, nullptr));
+    if (!thread)
+    {
+        g_directoryListingCacheEnabled = false;
+    }
+}
+
+void UninitializeDirectoryListingCache() noexcept
+{
+    g_directoryListingCacheEnabled = false;
+    g_directoryListingWatchActive = false;
+    if (g_directoryListingWatcherStopEvent)
+    {
+        ::SetEvent(g_directoryListingWatcherStopEvent.get());
+    }
+}
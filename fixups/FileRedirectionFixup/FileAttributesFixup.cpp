@@ -9,15 +9,49 @@
 template <typename CharT>
 DWORD __stdcall GetFileAttributesFixup(_In_ const CharT* fileName) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::get_file_attributes);
+    if (HookBypassed(telemetry_api::get_file_attributes))
+    {
+        return impl::GetFileAttributes(fileName);
+    }
+
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::check_file_presence);
+            auto wideFileName = widen_argument(fileName);
+
+            // The listing already has the redirected side merged in, so it goes first
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (auto err = FindListedAttributes(wideFileName.c_str(), data); err != ERROR_NOT_SUPPORTED)
+            {
+                ::SetLastError(err);
+                return (err == ERROR_SUCCESS) ? data.dwFileAttributes : INVALID_FILE_ATTRIBUTES;
+            }
+
+            // The presence check already queried the redirected file, so a hit doesn't need to query it again
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::check_file_presence, data);
             if (shouldRedirect)
             {
-                return impl::GetFileAttributes(redirectPath.c_str());
+                if (data.dwFileAttributes != INVALID_FILE_ATTRIBUTES)
+                {
+                    ::SetLastError(ERROR_SUCCESS);
+                }
+                return data.dwFileAttributes;
+            }
+
+            if (auto err = FindPackageMetadata(wideFileName.c_str(), data); err != ERROR_NOT_SUPPORTED)
+            {
+                ::SetLastError(err);
+                return (err == ERROR_SUCCESS) ?
+                    OverridePackageFileAttributes(wideFileName.c_str(), data.dwFileAttributes) :
+                    INVALID_FILE_ATTRIBUTES;
+            }
+
+            if (AttributeOverridesInUse())
+            {
+                return OverridePackageFileAttributes(wideFileName.c_str(), impl::GetFileAttributes(fileName));
             }
         }
     }
@@ -36,15 +70,75 @@ BOOL __stdcall GetFileAttributesExFixup(
     _In_ GET_FILEEX_INFO_LEVELS infoLevelId,
     _Out_writes_bytes_(sizeof(WIN32_FILE_ATTRIBUTE_DATA)) LPVOID fileInformation) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::get_file_attributes_ex);
+    if (HookBypassed(telemetry_api::get_file_attributes_ex))
+    {
+        return impl::GetFileAttributesEx(fileName, infoLevelId, fileInformation);
+    }
+
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::check_file_presence);
-            if (shouldRedirect)
+            auto wideFileName = widen_argument(fileName);
+            if ((infoLevelId == GetFileExInfoStandard) && fileInformation)
+            {
+                auto data = static_cast<WIN32_FILE_ATTRIBUTE_DATA*>(fileInformation);
+                if (auto err = FindListedAttributes(wideFileName.c_str(), *data); err != ERROR_NOT_SUPPORTED)
+                {
+                    ::SetLastError(err);
+                    return err == ERROR_SUCCESS;
+                }
+
+                // Same as GetFileAttributes, a hit gets answered with what the presence check queried
+                WIN32_FILE_ATTRIBUTE_DATA redirectData;
+                auto [shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::check_file_presence, redirectData);
+                if (shouldRedirect)
+                {
+                    if (redirectData.dwFileAttributes == INVALID_FILE_ATTRIBUTES)
+                    {
+                        return FALSE;
+                    }
+
+                    *data = redirectData;
+                    ::SetLastError(ERROR_SUCCESS);
+                    return TRUE;
+                }
+            }
+            else
+            {
+                auto [shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::check_file_presence);
+                if (shouldRedirect)
+                {
+                    return impl::GetFileAttributesEx(redirectPath.c_str(), infoLevelId, fileInformation);
+                }
+            }
+
+            if ((infoLevelId == GetFileExInfoStandard) && fileInformation)
             {
-                return impl::GetFileAttributesEx(redirectPath.c_str(), infoLevelId, fileInformation);
+                auto data = static_cast<WIN32_FILE_ATTRIBUTE_DATA*>(fileInformation);
+                if (auto err = FindPackageMetadata(wideFileName.c_str(), *data); err != ERROR_NOT_SUPPORTED)
+                {
+                    if (err == ERROR_SUCCESS)
+                    {
+                        data->dwFileAttributes = OverridePackageFileAttributes(wideFileName.c_str(), data->dwFileAttributes);
+                    }
+                    ::SetLastError(err);
+                    return err == ERROR_SUCCESS;
+                }
+            }
+
+            // Both info levels start with the attributes
+            if (AttributeOverridesInUse() && fileInformation)
+            {
+                auto result = impl::GetFileAttributesEx(fileName, infoLevelId, fileInformation);
+                if (result)
+                {
+                    auto data = static_cast<WIN32_FILE_ATTRIBUTE_DATA*>(fileInformation);
+                    data->dwFileAttributes = OverridePackageFileAttributes(wideFileName.c_str(), data->dwFileAttributes);
+                }
+                return result;
             }
         }
     }
@@ -60,12 +154,28 @@ DECLARE_STRING_FIXUP(impl::GetFileAttributesEx, GetFileAttributesExFixup);
 template <typename CharT>
 BOOL __stdcall SetFileAttributesFixup(_In_ const CharT* fileName, _In_ DWORD fileAttributes) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::set_file_attributes);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::copy_on_read);
+            auto wideFileName = widen_argument(fileName);
+
+            // A package file that hasn't been copied yet only needs its new attributes remembered (see
+            // AttributeOverrides.cpp). SetAttributeOverride turns down anything that it can't represent
+            if (AttributeOverridesEnabled())
+            {
+                auto [shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::none);
+                WIN32_FILE_ATTRIBUTE_DATA data;
+                if (shouldRedirect && !UnredirectedPackageFile(wideFileName.c_str(), redirectPath.c_str(), data).empty() &&
+                    SetAttributeOverride(redirectPath.c_str(), fileAttributes))
+                {
+                    return TRUE;
+                }
+            }
+
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::copy_on_read);
             if (shouldRedirect)
             {
                 return impl::SetFileAttributes(redirectPath.c_str(), fileAttributes);
@@ -9,13 +9,35 @@
 // the non-redirected directory, ignoring files that exist in the redirected directory. Note that this order is
 // important since it could be the case that a file gets copied to the redirected directory in the middle of enumeration
 // and we could otherwise return the same file twice.
-// NOTE: If we ever address the "delete package file" problem, we'll need to address that here, too
-
+// To avoid returning duplicate filenames, we remember the names returned by (1) and skip them when we see them again in
+// (2). This is done in memory, rather than checking for each file's existence in the redirected directory, which would
+// otherwise cost a file system call per file in the package directory. This is also what we want if a file gets copied
+// to the redirected directory after (1) has already passed it by, since then the only copy we return is the package one.
+// When the caller asks for every entry in a directory (by far the most common case), we read the directories a buffer at
+// a time with GetFileInformationByHandleEx instead of going through FindFirstFileEx/FindNextFile, and serve results out
+// of that buffer, leaving out the package directory's files when the caller only asked for directories. Any other
+// pattern is left to FindFirstFileEx, since the file system's wildcard matching is hard to get exactly right. When the
+// directory is in the package, the merged listing can additionally be cached for the rest of the process's lifetime
+// (see DirectoryListingCache.cpp), and the directories and simple patterns (e.g. "*.dll") that later enumerations ask
+// for get picked out of it once, and cached in turn, so that those enumerations only ever go through their matches.
+// Package files that have been deleted (see PackageFileTombstones.cpp) are skipped over the same way as the ones that
+// have been redirected.
+
+#include <algorithm>
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <functional>
+#include <iterator>
+#include <string_view>
+#include <unordered_set>
 
 #include <dos_paths.h>
 #include <fancy_handle.h>
 #include <psf_framework.h>
+#include <psf_heap.h>
 
 #include "FunctionImplementations.h"
 #include "PathRedirection.h"
@@ -35,22 +57,43 @@ struct find_deleter
 };
 using unique_find_handle = std::unique_ptr<void, find_deleter>;
 
-struct find_data
+template <typename CharT>
+using win32_find_data_t = std::conditional_t<psf::is_ansi<CharT>, WIN32_FIND_DATAA, WIN32_FIND_DATAW>;
+
+// NOTE: ANSI names come from the ANSI find functions, and are therefore in the ANSI code page
+static iwstring find_data_name(const char* fileName)
 {
-    // Redirected path directory so that we can avoid returning duplicate filenames. This value will be empty if the
-    // path does not exist/match any existing files at the start of the enumeration, for a slight optimization
-    std::wstring redirect_path;
+    auto result = widen(fileName, CP_ACP);
+    return iwstring(result.data(), result.length());
+}
 
-    // The first value is the find handle for the redirected path. The second is the find handle for the non-redirected
-    // path. The values are set to INVALID_HANDLE_VALUE as enumeration completes.
-    unique_find_handle find_handles[2];
+static iwstring find_data_name(const wchar_t* fileName)
+{
+    return iwstring(fileName);
+}
 
-    // We need to hold on to the results of FindFirstFile for find_handles[1]
-    WIN32_FIND_DATAW cached_data;
-};
+template <std::size_t DestSize>
+static DWORD copy_find_data_name(const wchar_t* from, char (&to)[DestSize]) noexcept
+{
+    // File names are nearly always ASCII, in which case we can skip the code page conversion
+    auto length = std::wcslen(from);
+    if (length < DestSize)
+    {
+        if (psf::ascii_narrow_prefix(from, length, to) == length)
+        {
+            to[length] = '\0';
+            return ERROR_SUCCESS;
+        }
+    }
 
-template <typename CharT>
-using win32_find_data_t = std::conditional_t<psf::is_ansi<CharT>, WIN32_FIND_DATAA, WIN32_FIND_DATAW>;
+    if (auto len = ::WideCharToMultiByte(CP_ACP, 0, from, -1, to, static_cast<int>(DestSize), nullptr, nullptr);
+        !len || (len > DestSize))
+    {
+        return ::GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
 
 DWORD copy_find_data(const WIN32_FIND_DATAW& from, WIN32_FIND_DATAA& to) noexcept
 {
@@ -63,19 +106,12 @@ DWORD copy_find_data(const WIN32_FIND_DATAW& from, WIN32_FIND_DATAA& to) noexcep
     to.dwReserved0 = from.dwReserved0;
     to.dwReserved1 = from.dwReserved1;
 
-    if (auto len = ::WideCharToMultiByte(CP_ACP, 0, from.cFileName, -1, to.cFileName, sizeof(to.cFileName), nullptr, nullptr);
-        !len || (len > sizeof(to.cFileName)))
+    if (auto err = copy_find_data_name(from.cFileName, to.cFileName))
     {
-        return ::GetLastError();
+        return err;
     }
 
-    if (auto len = ::WideCharToMultiByte(CP_ACP, 0, from.cAlternateFileName, -1, to.cAlternateFileName, sizeof(to.cAlternateFileName), nullptr, nullptr);
-        !len || (len > sizeof(to.cAlternateFileName)))
-    {
-        return ::GetLastError();
-    }
-
-    return ERROR_SUCCESS;
+    return copy_find_data_name(from.cAlternateFileName, to.cAlternateFileName);
 }
 
 DWORD copy_find_data(const WIN32_FIND_DATAW& from, WIN32_FIND_DATAW& to) noexcept
@@ -84,6 +120,532 @@ DWORD copy_find_data(const WIN32_FIND_DATAW& from, WIN32_FIND_DATAW& to) noexcep
     return ERROR_SUCCESS;
 }
 
+constexpr DWORD directory_batch_size = 16 * 1024;
+constexpr DWORD large_fetch_directory_batch_size = 64 * 1024;
+
+template <typename InfoT>
+static void fill_find_data(const InfoT& info, WIN32_FIND_DATAW& data) noexcept
+{
+    auto toFileTime = [](const LARGE_INTEGER& value) noexcept
+    {
+        return FILETIME{ value.LowPart, static_cast<DWORD>(value.HighPart) };
+    };
+
+    data.dwFileAttributes = info.FileAttributes;
+    data.ftCreationTime = toFileTime(info.CreationTime);
+    data.ftLastAccessTime = toFileTime(info.LastAccessTime);
+    data.ftLastWriteTime = toFileTime(info.LastWriteTime);
+    data.nFileSizeHigh = static_cast<DWORD>(info.EndOfFile.HighPart);
+    data.nFileSizeLow = info.EndOfFile.LowPart;
+
+    // For reparse points, the file system gives back the reparse tag in place of the EA size, which is what FindFirstFile
+    // reports in dwReserved0
+    data.dwReserved0 = (info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? info.EaSize : 0;
+    data.dwReserved1 = 0;
+
+    auto nameLength = (std::min)(info.FileNameLength / sizeof(wchar_t), std::size(data.cFileName) - 1);
+    std::memcpy(data.cFileName, info.FileName, nameLength * sizeof(wchar_t));
+    data.cFileName[nameLength] = L'\0';
+}
+
+// Reads all entries of a directory a buffer at a time and hands them out one at a time
+class directory_batch_reader
+{
+public:
+    // Returns false, with the last error set, if the directory could not be opened. With 'directoriesOnly', only the
+    // entries that are directories get returned
+    bool open(std::wstring directoryPath, FINDEX_INFO_LEVELS infoLevelId, DWORD additionalFlags, bool directoriesOnly = false)
+    {
+        // Our callers include the trailing separator, which needs to stay for volume roots (e.g. "C:\" or "\\?\C:\")
+        if ((directoryPath.length() > 1) && psf::is_path_separator(directoryPath.back()) &&
+            (directoryPath[directoryPath.length() - 2] != L':'))
+        {
+            directoryPath.pop_back();
+        }
+
+        m_directory.reset(impl::CreateFile(
+            directoryPath.c_str(),
+            FILE_LIST_DIRECTORY | SYNCHRONIZE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS,
+            nullptr));
+        if (!m_directory)
+        {
+            return false;
+        }
+
+        // Short names are the only thing that FindExInfoBasic leaves out, and querying them isn't free, so use the
+        // information class that doesn't include them when we can
+        m_infoClass = (infoLevelId == FindExInfoBasic) ? FileFullDirectoryInfo : FileIdBothDirectoryInfo;
+        m_bufferSize = (additionalFlags & FIND_FIRST_EX_LARGE_FETCH) ? large_fetch_directory_batch_size : directory_batch_size;
+        m_buffer = std::make_unique<std::uint64_t[]>(m_bufferSize / sizeof(std::uint64_t));
+        m_directoriesOnly = directoriesOnly;
+        return true;
+    }
+
+    // Returns false, with the last error set to ERROR_NO_MORE_FILES, once all entries have been returned
+    bool next(WIN32_FIND_DATAW& data)
+    {
+        // NOTE: Both information classes start out the same, up to and including the attributes, so the entries that
+        //       get skipped over never need to be looked at any further than that
+        const std::byte* entry;
+        for (;;)
+        {
+            if (!m_next)
+            {
+                if (!::GetFileInformationByHandleEx(m_directory.get(), m_infoClass, m_buffer.get(), m_bufferSize))
+                {
+                    return false;
+                }
+
+                m_next = reinterpret_cast<const std::byte*>(m_buffer.get());
+            }
+
+            entry = m_next;
+            auto& info = *reinterpret_cast<const FILE_FULL_DIR_INFO*>(entry);
+            m_next = info.NextEntryOffset ? (entry + info.NextEntryOffset) : nullptr;
+            if (!m_directoriesOnly || (info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                break;
+            }
+        }
+
+        if (m_infoClass == FileFullDirectoryInfo)
+        {
+            auto& info = *reinterpret_cast<const FILE_FULL_DIR_INFO*>(entry);
+            fill_find_data(info, data);
+            data.cAlternateFileName[0] = L'\0';
+        }
+        else
+        {
+            auto& info = *reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(entry);
+            fill_find_data(info, data);
+            auto shortNameLength = (std::min)(static_cast<std::size_t>(info.ShortNameLength) / sizeof(wchar_t), std::size(data.cAlternateFileName) - 1);
+            std::memcpy(data.cAlternateFileName, info.ShortName, shortNameLength * sizeof(wchar_t));
+            data.cAlternateFileName[shortNameLength] = L'\0';
+        }
+
+        return true;
+    }
+
+private:
+    psf::unique_handle m_directory;
+    FILE_INFO_BY_HANDLE_CLASS m_infoClass = FileIdBothDirectoryInfo;
+    DWORD m_bufferSize = 0;
+    std::unique_ptr<std::uint64_t[]> m_buffer; // Directory information must be 8-byte aligned
+    const std::byte* m_next = nullptr;
+    bool m_directoriesOnly = false;
+};
+
+static directory_listing_entry to_listing_entry(const WIN32_FIND_DATAW& data)
+{
+    directory_listing_entry result;
+    result.attributes = data.dwFileAttributes;
+    result.creation_time = data.ftCreationTime;
+    result.last_access_time = data.ftLastAccessTime;
+    result.last_write_time = data.ftLastWriteTime;
+    result.size = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    result.reserved0 = data.dwReserved0;
+    result.name = data.cFileName;
+    result.short_name = data.cAlternateFileName;
+    return result;
+}
+
+static void from_listing_entry(const directory_listing_entry& entry, WIN32_FIND_DATAW& data) noexcept
+{
+    data.dwFileAttributes = entry.attributes;
+    data.ftCreationTime = entry.creation_time;
+    data.ftLastAccessTime = entry.last_access_time;
+    data.ftLastWriteTime = entry.last_write_time;
+    data.nFileSizeHigh = static_cast<DWORD>(entry.size >> 32);
+    data.nFileSizeLow = static_cast<DWORD>(entry.size);
+    data.dwReserved0 = entry.reserved0;
+    data.dwReserved1 = 0;
+
+    // NOTE: The names came out of a WIN32_FIND_DATAW, so they're known to fit
+    std::memcpy(data.cFileName, entry.name.c_str(), (entry.name.length() + 1) * sizeof(wchar_t));
+    std::memcpy(data.cAlternateFileName, entry.short_name.c_str(), (entry.short_name.length() + 1) * sizeof(wchar_t));
+}
+
+// Reads the redirected directory and then the package directory in their entirety, leaving out package entries that
+// also exist in the redirected directory, i.e. the same sequence that FindFirstFile/FindNextFile return. Returns null
+// if either directory can't be read, in which case the caller should fall back to enumerating them the normal way
+std::shared_ptr<const directory_listing> build_directory_listing(
+    const wchar_t* redirectDirectory,
+    const wchar_t* packageDirectory,
+    FINDEX_INFO_LEVELS infoLevelId,
+    DWORD additionalFlags)
+{
+    auto result = std::make_shared<directory_listing>();
+    std::unordered_set<iwstring, case_insensitive_hash<wchar_t>> redirectedNames;
+    WIN32_FIND_DATAW data;
+
+    // The redirected directory usually doesn't exist
+    directory_batch_reader redirectReader;
+    if (redirectReader.open(redirectDirectory, infoLevelId, additionalFlags))
+    {
+        while (redirectReader.next(data))
+        {
+            redirectedNames.emplace(data.cFileName);
+            result->push_back(to_listing_entry(data));
+        }
+
+        if (::GetLastError() != ERROR_NO_MORE_FILES)
+        {
+            return nullptr;
+        }
+    }
+    else if (auto err = ::GetLastError(); (err != ERROR_FILE_NOT_FOUND) && (err != ERROR_PATH_NOT_FOUND))
+    {
+        return nullptr;
+    }
+
+    directory_batch_reader packageReader;
+    if (!packageReader.open(packageDirectory, infoLevelId, additionalFlags))
+    {
+        return nullptr;
+    }
+
+    while (packageReader.next(data))
+    {
+        if ((redirectedNames.find(data.cFileName) == redirectedNames.end()) &&
+            !PackageFileDeleted(redirectDirectory, data.cFileName))
+        {
+            data.dwFileAttributes = OverrideAttributes(redirectDirectory, data.cFileName, data.dwFileAttributes);
+            result->push_back(to_listing_entry(data));
+        }
+    }
+
+    if ((::GetLastError() != ERROR_NO_MORE_FILES) || result->empty())
+    {
+        return nullptr;
+    }
+
+    return result;
+}
+
+// A pattern with a single '*' that the listing cache can match the same way that the file system would, e.g. "*.dll" or
+// "data*". File systems match patterns against short names as well as long ones (e.g. "*.htm" also matches "page.html"
+// if its short name is "PAGE~1.HTM"), which we can do too, but FindFirstFileEx also turns some wildcards into their DOS
+// equivalents, which we don't try to. So patterns with a '?', a "." right before the '*' (e.g. "file.*" also matches
+// "file"), or a trailing '.' or ' ' (which get stripped from the path) are left to the file system. A '*' right before a
+// '.' (i.e. "*.dll") becomes a DOS star, which can't match past the last '.', but that's never different as long as the
+// rest of the pattern is literal, since the rest then has to match the last '.' of the name itself
+struct simple_find_pattern
+{
+    std::wstring_view prefix;
+    std::wstring_view suffix;
+
+    bool match(std::wstring_view name) const noexcept
+    {
+        return (name.length() >= prefix.length() + suffix.length()) &&
+            psf::path_equal(name.data(), prefix.data(), prefix.length()) &&
+            psf::path_equal(name.data() + name.length() - suffix.length(), suffix.data(), suffix.length());
+    }
+};
+
+static bool parse_simple_find_pattern(std::wstring_view pattern, simple_find_pattern& result) noexcept
+{
+    auto starPos = pattern.find(L'*');
+    if ((starPos == std::wstring_view::npos) || (pattern.find_first_of(L"*?<>\":|", starPos + 1) != std::wstring_view::npos) ||
+        (pattern.find_first_of(L"?<>\":|") < starPos) || ((starPos > 0) && (pattern[starPos - 1] == L'.')) ||
+        (pattern.back() == L'.') || (pattern.back() == L' '))
+    {
+        return false;
+    }
+
+    result.prefix = pattern.substr(0, starPos);
+    result.suffix = pattern.substr(starPos + 1);
+    return true;
+}
+
+// Picks the entries out of a full listing that an enumeration with the pattern (if any) and search operation would
+// have returned. The listing must have short names if there's a pattern
+static std::shared_ptr<const directory_listing> filter_directory_listing(
+    const directory_listing& listing,
+    const simple_find_pattern* pattern,
+    bool directoriesOnly,
+    bool basicInfo)
+{
+    auto result = std::make_shared<directory_listing>();
+    for (auto& entry : listing)
+    {
+        if ((directoriesOnly && !(entry.attributes & FILE_ATTRIBUTE_DIRECTORY)) ||
+            (pattern && !pattern->match(entry.name) && (entry.short_name.empty() || !pattern->match(entry.short_name))))
+        {
+            continue;
+        }
+
+        auto& match = result->emplace_back(entry);
+        if (basicInfo)
+        {
+            match.short_name.clear();
+        }
+    }
+
+    return result;
+}
+
+// One of the two directories being enumerated, read either through a find handle or a directory_batch_reader. A cached
+// listing already holds the merged contents of both directories
+struct find_source
+{
+    unique_find_handle find_handle;
+    std::unique_ptr<directory_batch_reader> batch_reader;
+    std::shared_ptr<const directory_listing> listing;
+    std::size_t listing_index = 0;
+
+    explicit operator bool() const noexcept
+    {
+        return find_handle || batch_reader || listing;
+    }
+
+    void reset() noexcept
+    {
+        find_handle.reset();
+        batch_reader.reset();
+        listing.reset();
+        listing_index = 0;
+    }
+
+    bool next_wide(WIN32_FIND_DATAW& data)
+    {
+        if (batch_reader)
+        {
+            return batch_reader->next(data);
+        }
+
+        if (listing_index == listing->size())
+        {
+            ::SetLastError(ERROR_NO_MORE_FILES);
+            return false;
+        }
+
+        from_listing_entry((*listing)[listing_index++], data);
+        return true;
+    }
+
+    template <typename FindDataT>
+    BOOL next(FindDataT* findFileData)
+    {
+        if (find_handle)
+        {
+            return impl::FindNextFile(find_handle.get(), findFileData);
+        }
+
+        if constexpr (std::is_same_v<FindDataT, WIN32_FIND_DATAW>)
+        {
+            return next_wide(*findFileData);
+        }
+        else
+        {
+            WIN32_FIND_DATAW data;
+            if (!next_wide(data))
+            {
+                return FALSE;
+            }
+
+            if (auto err = copy_find_data(data, *findFileData))
+            {
+                ::SetLastError(err);
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+    }
+};
+
+// Opens 'source' and reads the first entry into 'findData'. The first 'directoryLength' characters of 'searchPath' are
+// the directory, including the trailing separator. Returns false, with the last error set, if there are no matches. When
+// 'exactErrors' is false and the directory does not exist, we skip asking FindFirstFileEx for its (more precise) error.
+// With 'directoriesOnly', a batch reader leaves out everything other than directories, which FindExSearchLimitToDirectories
+// allows us to do (and which FindFirstFileEx may or may not do)
+static bool open_find_source(
+    find_source& source,
+    const std::wstring& searchPath,
+    std::size_t directoryLength,
+    bool useBatchReader,
+    bool exactErrors,
+    bool directoriesOnly,
+    FINDEX_INFO_LEVELS infoLevelId,
+    WIN32_FIND_DATAW* findData,
+    FINDEX_SEARCH_OPS searchOp,
+    LPVOID searchFilter,
+    DWORD additionalFlags)
+{
+    if (useBatchReader)
+    {
+        auto reader = std::make_unique<directory_batch_reader>();
+        if (reader->open(searchPath.substr(0, directoryLength), infoLevelId, additionalFlags, directoriesOnly))
+        {
+            if (reader->next(*findData))
+            {
+                source.batch_reader = std::move(reader);
+                return true;
+            }
+            else if (::GetLastError() == ERROR_NO_MORE_FILES)
+            {
+                // Only possible for the root of a volume, since every other directory has '.' and '..'
+                ::SetLastError(ERROR_FILE_NOT_FOUND);
+                return false;
+            }
+        }
+        else if (auto err = ::GetLastError(); !exactErrors && ((err == ERROR_FILE_NOT_FOUND) || (err == ERROR_PATH_NOT_FOUND)))
+        {
+            ::SetLastError(ERROR_PATH_NOT_FOUND);
+            return false;
+        }
+
+        // Either the path isn't a directory, the file system doesn't support the query, or something else we don't
+        // expect. Let FindFirstFileEx sort it out so that the caller sees the same error it would have otherwise
+    }
+
+    source.find_handle.reset(impl::FindFirstFileEx(searchPath.c_str(), infoLevelId, findData, searchOp, searchFilter, additionalFlags));
+    return static_cast<bool>(source.find_handle);
+}
+
+// NOTE: Applications can hold onto find handles for as long as they please, so the state behind them goes on the PSF's
+//       heap rather than the application's
+// Tells the find handles that we hand out apart from the ones that FindFirstFileEx returned as-is (e.g. because the
+// reentrancy guard was held at the time), without a call into the OS. Cleared once the handle gets closed
+constexpr std::uint64_t find_data_signature = 0x6174'6144'646e'6946; // "FindData"
+
+struct find_data : psf::heap_object
+{
+    // NOTE: Must come first. The OS's own find handles point to at least this much readable memory
+    std::uint64_t signature = find_data_signature;
+
+    // For keeping closed find handles in g_findDataPool
+    SLIST_ENTRY pool_entry;
+
+    // Names returned from the redirected path so that we can avoid returning duplicate filenames. This will be empty if
+    // the path does not exist/match any existing files at the start of the enumeration
+    std::unordered_set<iwstring, case_insensitive_hash<wchar_t>> redirected_names;
+
+    // The first value is the source for the redirected path. The second is the source for the non-redirected path. The
+    // values are reset as enumeration completes.
+    find_source sources[2];
+
+    // We need to hold on to the results of FindFirstFile for sources[1]
+    WIN32_FIND_DATAW cached_data;
+
+    // The redirected directory, including the trailing separator, for looking up tombstones of package files
+    std::wstring redirect_directory;
+
+    // Leaves the buffers that the members grew in place, so that the next enumeration can reuse them
+    void reset() noexcept
+    {
+        redirected_names.clear();
+        sources[0].reset();
+        sources[1].reset();
+        redirect_directory.clear();
+    }
+};
+
+// Applications that enumerate lots of small directories would otherwise allocate and free a find_data, along with the
+// buffers that its members grow, for each one of them. Closed find handles go on a lock-free list instead, and each
+// FindFirstFileEx takes one off of it if there is one
+constexpr USHORT max_pooled_find_data = 32;
+
+// Anything that grew larger than this is more likely to waste memory than to save an allocation
+constexpr std::size_t max_pooled_redirected_names = 256;
+constexpr std::size_t max_pooled_redirect_directory = 512;
+
+struct find_data_pool
+{
+    SLIST_HEADER head;
+
+    find_data_pool() noexcept
+    {
+        ::InitializeSListHead(&head);
+    }
+};
+static find_data_pool g_findDataPool;
+
+static void release_find_data(find_data* data) noexcept
+{
+    data->signature = 0;
+    if ((data->redirected_names.bucket_count() > max_pooled_redirected_names) ||
+        (data->redirect_directory.capacity() > max_pooled_redirect_directory) ||
+        (::QueryDepthSList(&g_findDataPool.head) >= max_pooled_find_data))
+    {
+        delete data;
+        return;
+    }
+
+    // NOTE: The depth check is racy, so the pool can end up a few entries over, which is harmless
+    data->reset();
+    ::InterlockedPushEntrySList(&g_findDataPool.head, &data->pool_entry);
+}
+
+struct find_data_releaser
+{
+    void operator()(find_data* data) noexcept
+    {
+        release_find_data(data);
+    }
+};
+using pooled_find_data = std::unique_ptr<find_data, find_data_releaser>;
+
+static pooled_find_data acquire_find_data()
+{
+    if (auto entry = ::InterlockedPopEntrySList(&g_findDataPool.head))
+    {
+        auto data = CONTAINING_RECORD(entry, find_data, pool_entry);
+        data->signature = find_data_signature;
+        return pooled_find_data(data);
+    }
+
+    return pooled_find_data(new find_data());
+}
+
+static find_data* as_find_data(HANDLE findHandle) noexcept
+{
+    if (!findHandle || (findHandle == INVALID_HANDLE_VALUE))
+    {
+        return nullptr;
+    }
+
+    auto data = reinterpret_cast<find_data*>(findHandle);
+    return (data->signature == find_data_signature) ? data : nullptr;
+}
+
+template <typename CharT>
+static bool package_file_deleted(const find_data& data, const CharT* fileName)
+{
+    if constexpr (psf::is_ansi<CharT>)
+    {
+        auto name = find_data_name(fileName);
+        return PackageFileDeleted(data.redirect_directory, std::wstring_view(name.data(), name.length()));
+    }
+    else
+    {
+        return PackageFileDeleted(data.redirect_directory, fileName);
+    }
+}
+
+// Package files report the attributes that were set on them without copying them, if any
+template <typename FindDataT>
+static void override_package_attributes(const find_data& data, FindDataT& findData)
+{
+    if (AttributeOverridesInUse())
+    {
+        auto name = find_data_name(findData.cFileName);
+        findData.dwFileAttributes = OverrideAttributes(
+            data.redirect_directory,
+            std::wstring_view(name.data(), name.length()),
+            findData.dwFileAttributes);
+    }
+}
+
+static bool is_package_directory(const normalized_path& path)
+{
+    return path.drive_absolute_path && ::PSFIsPackagePath(path.full_path.c_str(), path.full_path.length());
+}
+
 template <typename CharT>
 HANDLE __stdcall FindFirstFileExFixup(
     _In_ const CharT* fileName,
@@ -93,6 +655,7 @@ HANDLE __stdcall FindFirstFileExFixup(
     _Reserved_ LPVOID searchFilter,
     _In_ DWORD additionalFlags) noexcept try
 {
+    telemetry_scope telemetry(telemetry_api::find_first_file_ex);
     auto guard = g_reentrancyGuard.enter();
     if (!guard)
     {
@@ -103,7 +666,8 @@ HANDLE __stdcall FindFirstFileExFixup(
     auto path = widen(fileName, CP_ACP);
     normalized_path dir;
     const wchar_t* pattern = nullptr;
-    if (auto dirPos = path.find_last_of(LR"(\/)"); dirPos != std::wstring::npos)
+    std::size_t dirLength = 0;
+    if (auto dirPos = psf::find_last_path_separator(path); dirPos != std::wstring::npos)
     {
         // Special case for single separator at beginning of the path "/foo.txt"
         if (dirPos == 0)
@@ -119,6 +683,7 @@ HANDLE __stdcall FindFirstFileExFixup(
             path[dirPos] = separator;
         }
         pattern = path.c_str() + dirPos + 1;
+        dirLength = dirPos + 1;
     }
     else
     {
@@ -126,13 +691,89 @@ HANDLE __stdcall FindFirstFileExFixup(
         pattern = path.c_str();
     }
 
+    // Only read the directories ourselves when the caller asks for everything in them, or for all of their directories.
+    // Only directories in the package itself can be cached, since anywhere else (including virtualized paths that the OS
+    // merges with the native file system) can change without the change being visible to us. The cache also answers for
+    // simple patterns, and for FIND_FIRST_EX_ON_DISK_ENTRIES_ONLY once it has the listing, since answering from memory
+    // can't touch anything that isn't on disk
+    std::wstring_view patternView = pattern;
+    bool matchesEverything = (patternView == L"*") || (patternView == L"*.*");
+    bool directoriesOnly = (searchOp == FindExSearchLimitToDirectories);
+    bool onDiskEntriesOnly = (additionalFlags & FIND_FIRST_EX_ON_DISK_ENTRIES_ONLY) != 0;
+    bool plainSearch = (dirLength > 0) &&
+        ((infoLevelId == FindExInfoStandard) || (infoLevelId == FindExInfoBasic)) &&
+        ((searchOp == FindExSearchNameMatch) || directoriesOnly) &&
+        !searchFilter;
+    bool useBatchReader = plainSearch && matchesEverything && !onDiskEntriesOnly;
+    simple_find_pattern simplePattern;
+    bool useListingCache = plainSearch && (matchesEverything || parse_simple_find_pattern(patternView, simplePattern)) &&
+        DirectoryListingCacheEnabled() && is_package_directory(dir);
+
     dir = DeVirtualizePath(std::move(dir));
 
-    auto result = std::make_unique<find_data>();
-    result->redirect_path = RedirectedPath(dir);
-    if (result->redirect_path.back() != L'\\')
+    auto result = acquire_find_data();
+    auto redirectPath = RedirectedPath(dir);
+    if (redirectPath.back() != L'\\')
     {
-        result->redirect_path.push_back(L'\\');
+        redirectPath.push_back(L'\\');
+    }
+
+    if (useListingCache)
+    {
+        auto packageDir = path.substr(0, dirLength);
+        auto basicInfo = (infoLevelId == FindExInfoBasic);
+        auto getFullListing = [&](bool fullBasicInfo)
+        {
+            std::function<std::shared_ptr<const directory_listing>()> buildListing;
+            if (!onDiskEntriesOnly)
+            {
+                buildListing = [&]()
+                {
+                    return build_directory_listing(redirectPath.c_str(), packageDir.c_str(), fullBasicInfo ? FindExInfoBasic : FindExInfoStandard, additionalFlags);
+                };
+            }
+            return GetDirectoryListing(redirectPath, fullBasicInfo, {}, buildListing);
+        };
+
+        std::shared_ptr<const directory_listing> listing;
+        if (matchesEverything && !directoriesOnly)
+        {
+            listing = getFullListing(basicInfo);
+        }
+        else
+        {
+            // E.g. "/*.dll" for only the directories that match "*.dll". Narrowed listings get picked out of the full one
+            // the first time they're asked for, which needs the short names for matching patterns against
+            std::wstring filter(directoriesOnly ? L"/" : L"");
+            filter += matchesEverything ? std::wstring_view(L"*") : patternView;
+            listing = GetDirectoryListing(redirectPath, basicInfo, filter, [&]() -> std::shared_ptr<const directory_listing>
+            {
+                auto fullListing = getFullListing(basicInfo && matchesEverything);
+                return fullListing ?
+                    filter_directory_listing(*fullListing, matchesEverything ? nullptr : &simplePattern, directoriesOnly, basicInfo) :
+                    nullptr;
+            });
+        }
+
+        if (listing && listing->empty())
+        {
+            // Only possible for a narrowed listing
+            ::SetLastError(ERROR_FILE_NOT_FOUND);
+            return INVALID_HANDLE_VALUE;
+        }
+        else if (listing)
+        {
+            // The listing is already merged, so there's nothing left to de-duplicate
+            result->sources[1].listing = std::move(listing);
+            if (!result->sources[1].next(static_cast<win32_find_data_t<CharT>*>(findFileData)))
+            {
+                // NOTE: Last error set by copy_find_data
+                return INVALID_HANDLE_VALUE;
+            }
+
+            ::SetLastError(ERROR_SUCCESS);
+            return reinterpret_cast<HANDLE>(result.release());
+        }
     }
 
     [[maybe_unused]] auto ansiData = reinterpret_cast<WIN32_FIND_DATAA*>(findFileData);
@@ -140,17 +781,20 @@ HANDLE __stdcall FindFirstFileExFixup(
     WIN32_FIND_DATAW* findData = psf::is_ansi<CharT> ? &result->cached_data : wideData;
 
     // Open the redirected find handle
-    auto revertSize = result->redirect_path.length();
-    result->redirect_path += pattern;
-    result->find_handles[0].reset(impl::FindFirstFileEx(result->redirect_path.c_str(), infoLevelId, findData, searchOp, searchFilter, additionalFlags));
-    result->redirect_path.resize(revertSize);
+    auto redirectDirLength = redirectPath.length();
+    result->redirect_directory = redirectPath;
+    redirectPath += pattern;
+    // NOTE: Most redirected directories never get created, and the error only matters if the package directory also
+    //       doesn't match anything, in which case it's only used if it's ERROR_FILE_NOT_FOUND (see below)
+    open_find_source(result->sources[0], redirectPath, redirectDirLength, useBatchReader, false, false, infoLevelId, findData, searchOp, searchFilter, additionalFlags);
 
     // Some applications really care about the failure reason. Try and make this the best that we can, preferring
     // something like "file not found" over "path does not exist"
     auto initialFindError = ::GetLastError();
 
-    if (result->find_handles[0])
+    if (result->sources[0])
     {
+        result->redirected_names.insert(find_data_name(findData->cFileName));
         if constexpr (psf::is_ansi<CharT>)
         {
             if (copy_find_data(*findData, *ansiData))
@@ -165,19 +809,31 @@ HANDLE __stdcall FindFirstFileExFixup(
             assert(findData == wideData);
         }
     }
-    else
+
+    findData = (result->sources[0] || psf::is_ansi<CharT>) ? &result->cached_data : wideData;
+
+    // Open the non-redirected find handle. Only this one leaves out what isn't a directory, since the redirected names
+    // need to hide package entries of the same name whether or not they're directories
+    open_find_source(result->sources[1], path, dirLength, useBatchReader, true, directoriesOnly, infoLevelId, findData, searchOp, searchFilter, additionalFlags);
+    while (result->sources[1] && package_file_deleted(*result, findData->cFileName))
     {
-        // Path doesn't exist or match any files. We can safely get away without the redirected file exists check
-        result->redirect_path.clear();
+        if (!result->sources[1].next(findData))
+        {
+            auto err = ::GetLastError();
+            result->sources[1].reset();
+            ::SetLastError((err == ERROR_NO_MORE_FILES) ? ERROR_FILE_NOT_FOUND : err);
+        }
     }
 
-    findData = (result->find_handles[0] || psf::is_ansi<CharT>) ? &result->cached_data : wideData;
+    // NOTE: This also covers cached_data, for when FindNextFile gets to it
+    if (result->sources[1])
+    {
+        override_package_attributes(*result, *findData);
+    }
 
-    // Open the non-redirected find handle
-    result->find_handles[1].reset(impl::FindFirstFileEx(path.c_str(), infoLevelId, findData, searchOp, searchFilter, additionalFlags));
-    if (!result->find_handles[0])
+    if (!result->sources[0])
     {
-        if (!result->find_handles[1])
+        if (!result->sources[1])
         {
             // Neither path exists. The last error should still be set by FindFirstFileEx, but prefer the initial error
             // if it indicates that the redirected directory structure exists
@@ -220,6 +876,8 @@ DECLARE_STRING_FIXUP(impl::FindFirstFileEx, FindFirstFileExFixup);
 template <typename CharT>
 HANDLE __stdcall FindFirstFileFixup(_In_ const CharT* fileName, _Out_ win32_find_data_t<CharT>* findFileData) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::find_first_file);
+
     // For simplicity, just do what the OS appears to be doing and forward arguments on to FindFirstFileEx
     return FindFirstFileExFixup(fileName, FindExInfoStandard, findFileData, FindExSearchNameMatch, nullptr, 0);
 }
@@ -228,57 +886,39 @@ DECLARE_STRING_FIXUP(impl::FindFirstFile, FindFirstFileFixup);
 template <typename CharT>
 BOOL __stdcall FindNextFileFixup(_In_ HANDLE findFile, _Out_ win32_find_data_t<CharT>* findFileData) noexcept try
 {
-    auto guard = g_reentrancyGuard.enter();
-    if (!guard)
+    // NOTE: Checked first, so that handles that we didn't hand out cost nothing more than the check itself
+    auto data = as_find_data(findFile);
+    if (!data)
     {
         return impl::FindNextFile(findFile, findFileData);
     }
 
-    if (findFile == INVALID_HANDLE_VALUE)
+    telemetry_scope telemetry(telemetry_api::find_next_file);
+    auto guard = g_reentrancyGuard.enter();
+    if (!guard)
     {
-        ::SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
+        return impl::FindNextFile(findFile, findFileData);
     }
 
-    auto data = reinterpret_cast<find_data*>(findFile);
     auto redirectedFileExists = [&](auto filename)
     {
-        if (data->redirect_path.empty())
-        {
-            return false;
-        }
-
-        auto revertSize = data->redirect_path.length();
-
-        // NOTE: 'is_ansi' evaluation not inline due to the bug:
-        //       https://developercommunity.visualstudio.com/content/problem/324366/illegal-indirection-error-when-the-evaluation-of-i.html
-        constexpr bool is_ansi = psf::is_ansi<std::decay_t<decltype(*filename)>>;
-        if constexpr (is_ansi)
-        {
-            data->redirect_path += widen(filename);
-        }
-        else
-        {
-            data->redirect_path += filename;
-        }
-
-        auto result = impl::PathExists(data->redirect_path.c_str());
-        data->redirect_path.resize(revertSize);
-        return result;
+        return (!data->redirected_names.empty() && (data->redirected_names.count(find_data_name(filename)) != 0)) ||
+            package_file_deleted(*data, filename);
     };
 
-    if (data->find_handles[0])
+    if (data->sources[0])
     {
-        if (impl::FindNextFile(data->find_handles[0].get(), findFileData))
+        if (data->sources[0].next(findFileData))
         {
+            data->redirected_names.insert(find_data_name(findFileData->cFileName));
             return TRUE;
         }
         else if (::GetLastError() == ERROR_NO_MORE_FILES)
         {
-            data->find_handles[0].reset();
-            if (!data->find_handles[1])
+            data->sources[0].reset();
+            if (!data->sources[1])
             {
-                // NOTE: Last error scribbled over by closing find_handles[0]
+                // NOTE: Last error scribbled over by closing sources[0]
                 ::SetLastError(ERROR_NO_MORE_FILES);
                 return FALSE;
             }
@@ -302,13 +942,14 @@ BOOL __stdcall FindNextFileFixup(_In_ HANDLE findFile, _Out_ win32_find_data_t<C
         }
     }
 
-    while (data->find_handles[1])
+    while (data->sources[1])
     {
-        if (impl::FindNextFile(data->find_handles[1].get(), findFileData))
+        if (data->sources[1].next(findFileData))
         {
-            // Skip the file if it exists in the redirected path
+            // Skip the file if it exists in the redirected path or has been deleted
             if (!redirectedFileExists(findFileData->cFileName))
             {
+                override_package_attributes(*data, *findFileData);
                 ::SetLastError(ERROR_SUCCESS);
                 return TRUE;
             }
@@ -316,7 +957,7 @@ BOOL __stdcall FindNextFileFixup(_In_ HANDLE findFile, _Out_ win32_find_data_t<C
         }
         else if (::GetLastError() == ERROR_NO_MORE_FILES)
         {
-            data->find_handles[1].reset();
+            data->sources[1].reset();
             ::SetLastError(ERROR_NO_MORE_FILES);
             return FALSE;
         }
@@ -340,19 +981,14 @@ DECLARE_STRING_FIXUP(impl::FindNextFile, FindNextFileFixup);
 
 BOOL __stdcall FindCloseFixup(_Inout_ HANDLE findHandle) noexcept
 {
-    auto guard = g_reentrancyGuard.enter();
-    if (!guard)
+    auto data = as_find_data(findHandle);
+    if (!data)
     {
         return impl::FindClose(findHandle);
     }
 
-    if (findHandle == INVALID_HANDLE_VALUE)
-    {
-        ::SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
-    }
-
-    delete reinterpret_cast<find_data*>(findHandle);
+    telemetry_scope telemetry(telemetry_api::find_close);
+    release_find_data(data);
     ::SetLastError(ERROR_SUCCESS);
     return TRUE;
 }
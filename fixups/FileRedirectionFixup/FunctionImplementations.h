@@ -9,15 +9,100 @@
 // For example, CreateFileFixup could call kernelbase!CopyFileW, which could in turn call (the fixed) CreateFile again
 #pragma once
 
+#include <windows.h>
+#include <winternl.h>
+
 #include <reentrancy_guard.h>
 #include <psf_framework.h>
 
+// NOTE: Some structs/functions are missing from winternl.h, or are incomplete there. The namespace is to disambiguate
+namespace winternl
+{
+    // Only the values that we care about. The rest still get passed through as-is
+    enum FILE_INFORMATION_CLASS
+    {
+        FileRenameInformation = 10,
+        FileLinkInformation = 11,
+        FileDispositionInformation = 13,
+        FileDispositionInformationEx = 64,
+        FileRenameInformationEx = 65,
+        FileLinkInformationEx = 72,
+    };
+
+    struct FILE_BASIC_INFORMATION
+    {
+        LARGE_INTEGER CreationTime;
+        LARGE_INTEGER LastAccessTime;
+        LARGE_INTEGER LastWriteTime;
+        LARGE_INTEGER ChangeTime;
+        ULONG FileAttributes;
+    };
+
+    struct FILE_NETWORK_OPEN_INFORMATION
+    {
+        LARGE_INTEGER CreationTime;
+        LARGE_INTEGER LastAccessTime;
+        LARGE_INTEGER LastWriteTime;
+        LARGE_INTEGER ChangeTime;
+        LARGE_INTEGER AllocationSize;
+        LARGE_INTEGER EndOfFile;
+        ULONG FileAttributes;
+    };
+
+    // Shared by FileRenameInformation, FileLinkInformation, and their "Ex" variants, which replace the BOOLEAN with flags
+    struct FILE_RENAME_INFORMATION
+    {
+        union
+        {
+            BOOLEAN ReplaceIfExists;
+            ULONG Flags;
+        };
+        HANDLE RootDirectory;
+        ULONG FileNameLength;
+        WCHAR FileName[1];
+    };
+
+    struct FILE_DISPOSITION_INFORMATION
+    {
+        BOOLEAN DeleteFile;
+    };
+
+    struct FILE_DISPOSITION_INFORMATION_EX
+    {
+        ULONG Flags;
+    };
+    constexpr ULONG FILE_DISPOSITION_DELETE = 0x00000001;
+
+    NTSTATUS __stdcall NtQueryAttributesFile(POBJECT_ATTRIBUTES ObjectAttributes, FILE_BASIC_INFORMATION* FileInformation);
+
+    NTSTATUS __stdcall NtQueryFullAttributesFile(
+        POBJECT_ATTRIBUTES ObjectAttributes,
+        FILE_NETWORK_OPEN_INFORMATION* FileInformation);
+
+    NTSTATUS __stdcall NtSetInformationFile(
+        HANDLE FileHandle,
+        PIO_STATUS_BLOCK IoStatusBlock,
+        PVOID FileInformation,
+        ULONG Length,
+        FILE_INFORMATION_CLASS FileInformationClass);
+
+    // The functions in winternl.h are not included in any import lib and therefore must be manually loaded. ntdll is
+    // loaded into every process, so there's no need to load it ourselves
+    template <typename Func>
+    inline Func ntdll_function(const char* functionName) noexcept
+    {
+        return reinterpret_cast<Func>(::GetProcAddress(::GetModuleHandleW(L"ntdll.dll"), functionName));
+    }
+}
+
 // A much bigger hammer to avoid reentrancy. Still, the impl::* functions are good to have around to prevent the
 // unnecessary invocation of the fixup
-inline thread_local psf::reentrancy_guard g_reentrancyGuard;
+inline psf::reentrancy_guard g_reentrancyGuard;
 
 namespace impl
 {
+    inline auto CloseHandle = &::CloseHandle;
+
     inline auto CopyFile = psf::detoured_string_function(&::CopyFileA, &::CopyFileW);
     inline auto CopyFileEx = psf::detoured_string_function(&::CopyFileExA, &::CopyFileExW);
     inline auto CopyFile2 = &::CopyFile2;
@@ -28,12 +113,16 @@ namespace impl
     inline auto CreateFile = psf::detoured_string_function(&::CreateFileA, &::CreateFileW);
     inline auto CreateFile2 = &::CreateFile2;
 
+    inline auto CreateFileMapping = psf::detoured_string_function(&::CreateFileMappingA, &::CreateFileMappingW);
+
     inline auto CreateHardLink = psf::detoured_string_function(&::CreateHardLinkA, &::CreateHardLinkW);
 
     inline auto CreateSymbolicLink = psf::detoured_string_function(&::CreateSymbolicLinkA, &::CreateSymbolicLinkW);
 
     inline auto DeleteFile = psf::detoured_string_function(&::DeleteFileA, &::DeleteFileW);
 
+    inline auto DuplicateHandle = &::DuplicateHandle;
+
     inline auto FindClose = &::FindClose;
     inline auto FindFirstFile = psf::detoured_string_function(&::FindFirstFileA, &::FindFirstFileW);
     inline auto FindFirstFileEx = psf::detoured_string_function(&::FindFirstFileExA, &::FindFirstFileExW);
@@ -47,12 +136,25 @@ namespace impl
     inline auto MoveFile = psf::detoured_string_function(&::MoveFileA, &::MoveFileW);
     inline auto MoveFileEx = psf::detoured_string_function(&::MoveFileExA, &::MoveFileExW);
 
+    inline auto NtCreateFile = winternl::ntdll_function<decltype(&::NtCreateFile)>("NtCreateFile");
+    inline auto NtOpenFile = winternl::ntdll_function<decltype(&::NtOpenFile)>("NtOpenFile");
+    inline auto NtQueryAttributesFile = winternl::ntdll_function<decltype(&winternl::NtQueryAttributesFile)>("NtQueryAttributesFile");
+    inline auto NtQueryFullAttributesFile = winternl::ntdll_function<decltype(&winternl::NtQueryFullAttributesFile)>("NtQueryFullAttributesFile");
+    inline auto NtSetInformationFile = winternl::ntdll_function<decltype(&winternl::NtSetInformationFile)>("NtSetInformationFile");
+
+    inline auto ReadFile = &::ReadFile;
+    inline auto ReadFileEx = &::ReadFileEx;
+
     inline auto RemoveDirectory = psf::detoured_string_function(&::RemoveDirectoryA, &::RemoveDirectoryW);
 
     inline auto ReplaceFile = psf::detoured_string_function(&::ReplaceFileA, &::ReplaceFileW);
 
+    inline auto SetEndOfFile = &::SetEndOfFile;
     inline auto SetFileAttributes = psf::detoured_string_function(&::SetFileAttributesA, &::SetFileAttributesW);
+    inline auto SetFileInformationByHandle = &::SetFileInformationByHandle;
 
+    inline auto WriteFile = &::WriteFile;
+    inline auto WriteFileEx = &::WriteFileEx;
     inline auto WritePrivateProfileString = psf::detoured_string_function(&::WritePrivateProfileStringA, &::WritePrivateProfileStringW);
 
     // Most internal use of GetFileAttributes is to check to see if a file/directory exists, so provide a helper
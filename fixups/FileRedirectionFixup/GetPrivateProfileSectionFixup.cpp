@@ -14,14 +14,21 @@ DWORD __stdcall GetPrivateProfileSectionFixup(
     _In_ DWORD stringLength,
     _In_opt_ const CharT* fileName) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::get_private_profile_section);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto[shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::copy_on_read);
+            auto wideFileName = widen_argument(fileName);
+            auto[shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::copy_on_read | redirect_flags::private_profile);
             if (shouldRedirect)
             {
+                if (DWORD cachedResult; TryGetCachedPrivateProfileSection(redirectPath, appName, string, stringLength, cachedResult))
+                {
+                    return cachedResult;
+                }
+
                 if constexpr (psf::is_ansi<CharT>)
                 {
                     auto wideString = std::make_unique<wchar_t[]>(stringLength);
@@ -0,0 +1,240 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Every detour costs something to attach, and a trampoline, whether or not the application ever calls the function. The
+// "hooks" configuration lists the APIs (or groups of APIs) that the application actually uses, and only those get
+// attached. Functions that only make sense together with others - e.g. FindNextFile and FindClose without one of the
+// FindFirstFile variants, or the handle based functions that the delta overlay and the redirected handle table need -
+// can't be listed on their own; they get attached whenever anything else in their group is.
+//
+// Working out which APIs an application uses is what "learnPath" is for: with it, everything gets attached, and once the
+// fixup is uninitialized the APIs that saw any calls (according to the telemetry counters) get written to the file, in
+// the same form as the "enabled" list. Running the application through its scenarios in this mode gives the minimal list
+// to put in the configuration.
+//
+// NOTE: Calls made from inside another fixed API (e.g. the CreateFile calls that CopyFile makes) aren't counted by the
+//       telemetry, and so don't get learned. Those calls are for paths that have already been redirected, so leaving
+//       their hooks out doesn't change what gets redirected
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+struct hook_set
+{
+    const char* name; // Null for functions that can't be enabled on their own
+    const char* group;
+    telemetry_api api;
+    const void* targets[2];
+};
+
+static const hook_set g_hookSets[] =
+{
+    { "CopyFile", "copy", telemetry_api::copy_file, { &impl::CopyFile.ansi, &impl::CopyFile.wide } },
+    { "CopyFileEx", "copy", telemetry_api::copy_file_ex, { &impl::CopyFileEx.ansi, &impl::CopyFileEx.wide } },
+    { "CopyFile2", "copy", telemetry_api::copy_file2, { &impl::CopyFile2 } },
+
+    { "CreateDirectory", "directories", telemetry_api::create_directory, { &impl::CreateDirectory.ansi, &impl::CreateDirectory.wide } },
+    { "CreateDirectoryEx", "directories", telemetry_api::create_directory_ex, { &impl::CreateDirectoryEx.ansi, &impl::CreateDirectoryEx.wide } },
+    { "RemoveDirectory", "directories", telemetry_api::remove_directory, { &impl::RemoveDirectory.ansi, &impl::RemoveDirectory.wide } },
+
+    { "CreateFile", "files", telemetry_api::create_file, { &impl::CreateFile.ansi, &impl::CreateFile.wide } },
+    { "CreateFile2", "files", telemetry_api::create_file2, { &impl::CreateFile2 } },
+    { "NtCreateFile", "files", telemetry_api::nt_create_file, { &impl::NtCreateFile } },
+    { "NtOpenFile", "files", telemetry_api::nt_open_file, { &impl::NtOpenFile } },
+    { nullptr, "files", telemetry_api::read_file, { &impl::ReadFile } },
+    { nullptr, "files", telemetry_api::write_file, { &impl::WriteFile } },
+    { nullptr, "files", telemetry_api::read_file_ex, { &impl::ReadFileEx } },
+    { nullptr, "files", telemetry_api::write_file_ex, { &impl::WriteFileEx } },
+    { nullptr, "files", telemetry_api::set_end_of_file, { &impl::SetEndOfFile } },
+    { nullptr, "files", telemetry_api::create_file_mapping, { &impl::CreateFileMapping.ansi, &impl::CreateFileMapping.wide } },
+    { nullptr, "files", telemetry_api::duplicate_handle, { &impl::DuplicateHandle } },
+    { nullptr, "files", telemetry_api::close_handle, { &impl::CloseHandle } },
+    { nullptr, "files", telemetry_api::set_file_information_by_handle, { &impl::SetFileInformationByHandle } },
+
+    { "DeleteFile", "modify", telemetry_api::delete_file, { &impl::DeleteFile.ansi, &impl::DeleteFile.wide } },
+    { "MoveFile", "modify", telemetry_api::move_file, { &impl::MoveFile.ansi, &impl::MoveFile.wide } },
+    { "MoveFileEx", "modify", telemetry_api::move_file_ex, { &impl::MoveFileEx.ansi, &impl::MoveFileEx.wide } },
+    { "ReplaceFile", "modify", telemetry_api::replace_file, { &impl::ReplaceFile.ansi, &impl::ReplaceFile.wide } },
+    { "NtSetInformationFile", "modify", telemetry_api::nt_set_information_file, { &impl::NtSetInformationFile } },
+
+    { "CreateHardLink", "links", telemetry_api::create_hard_link, { &impl::CreateHardLink.ansi, &impl::CreateHardLink.wide } },
+    { "CreateSymbolicLink", "links", telemetry_api::create_symbolic_link, { &impl::CreateSymbolicLink.ansi, &impl::CreateSymbolicLink.wide } },
+
+    { "GetFileAttributes", "attributes", telemetry_api::get_file_attributes, { &impl::GetFileAttributes.ansi, &impl::GetFileAttributes.wide } },
+    { "GetFileAttributesEx", "attributes", telemetry_api::get_file_attributes_ex, { &impl::GetFileAttributesEx.ansi, &impl::GetFileAttributesEx.wide } },
+    { "SetFileAttributes", "attributes", telemetry_api::set_file_attributes, { &impl::SetFileAttributes.ansi, &impl::SetFileAttributes.wide } },
+    { "NtQueryAttributesFile", "attributes", telemetry_api::nt_query_attributes_file, { &impl::NtQueryAttributesFile } },
+    { "NtQueryFullAttributesFile", "attributes", telemetry_api::nt_query_full_attributes_file, { &impl::NtQueryFullAttributesFile } },
+
+    { "FindFirstFile", "enumeration", telemetry_api::find_first_file, { &impl::FindFirstFile.ansi, &impl::FindFirstFile.wide } },
+    { "FindFirstFileEx", "enumeration", telemetry_api::find_first_file_ex, { &impl::FindFirstFileEx.ansi, &impl::FindFirstFileEx.wide } },
+    { nullptr, "enumeration", telemetry_api::find_next_file, { &impl::FindNextFile.ansi, &impl::FindNextFile.wide } },
+    { nullptr, "enumeration", telemetry_api::find_close, { &impl::FindClose } },
+
+    { "GetPrivateProfileSection", "privateProfile", telemetry_api::get_private_profile_section, { &impl::GetPrivateProfileSection.ansi, &impl::GetPrivateProfileSection.wide } },
+    { "GetPrivateProfileString", "privateProfile", telemetry_api::get_private_profile_string, { &impl::GetPrivateProfileString.ansi, &impl::GetPrivateProfileString.wide } },
+    { "WritePrivateProfileString", "privateProfile", telemetry_api::write_private_profile_string, { &impl::WritePrivateProfileString.ansi, &impl::WritePrivateProfileString.wide } },
+};
+
+constexpr std::size_t hook_set_count = std::size(g_hookSets);
+
+// Empty means that everything is enabled, which is the default
+static std::vector<bool> g_enabledHookSets;
+static std::wstring g_hookLearnPath;
+
+static const hook_set* find_hook_set(const void* target) noexcept
+{
+    auto itr = std::find_if(std::begin(g_hookSets), std::end(g_hookSets), [&](const hook_set& set)
+    {
+        return std::find(std::begin(set.targets), std::end(set.targets), target) != std::end(set.targets);
+    });
+
+    return (itr != std::end(g_hookSets)) ? &*itr : nullptr;
+}
+
+bool IsHookEnabled(const void* target) noexcept
+{
+    if (g_enabledHookSets.empty())
+    {
+        return true;
+    }
+
+    // Anything missing from the table is something that there's no way to turn off
+    auto set = find_hook_set(target);
+    return !set || g_enabledHookSets[set - g_hookSets];
+}
+
+void InitializeHookSelection(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto learnPathValue = config->try_get("learnPath"))
+    {
+        std::filesystem::path learnPath(learnPathValue->as_string().wstring());
+        if (learnPath.is_relative())
+        {
+            learnPath = g_redirectRootPath / learnPath;
+        }
+
+        // Same as the telemetry's dumpPath; child processes usually share the configuration
+        auto path = learnPath.wstring();
+        constexpr std::wstring_view processIdToken = L"{processId}";
+        if (auto pos = path.find(processIdToken); pos != std::wstring::npos)
+        {
+            path.replace(pos, processIdToken.length(), std::to_wstring(::GetCurrentProcessId()));
+        }
+
+        // We're here to find out what gets used, so everything has to be attached
+        g_hookLearnPath = std::move(path);
+        return;
+    }
+
+    auto enabledValue = config->try_get("enabled");
+    if (!enabledValue)
+    {
+        return;
+    }
+
+    std::vector<bool> enabled(hook_set_count);
+    std::vector<const char*> enabledGroups;
+    for (auto& value : enabledValue->as_array())
+    {
+        auto name = value.as_string().string();
+        bool found = false;
+        for (std::size_t i = 0; i < hook_set_count; ++i)
+        {
+            auto& set = g_hookSets[i];
+            if (set.name && (name == set.name))
+            {
+                enabled[i] = true;
+                enabledGroups.push_back(set.group);
+                found = true;
+            }
+            else if (name == set.group)
+            {
+                enabled[i] = true;
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            throw std::runtime_error("Unknown API or API group in the \"hooks\" configuration: " + std::string(name));
+        }
+    }
+
+    // Functions that can't be enabled on their own come along with the rest of their group
+    for (std::size_t i = 0; i < hook_set_count; ++i)
+    {
+        if (!g_hookSets[i].name && std::any_of(enabledGroups.begin(), enabledGroups.end(), [&](const char* group)
+        {
+            return std::string_view(group) == g_hookSets[i].group;
+        }))
+        {
+            enabled[i] = true;
+        }
+    }
+
+    g_enabledHookSets = std::move(enabled);
+}
+
+void UninitializeHookSelection() noexcept try
+{
+    if (g_hookLearnPath.empty())
+    {
+        return;
+    }
+
+    auto called = CalledTelemetryApis();
+    std::string json = "{\"enabled\":[";
+    bool first = true;
+    for (auto& set : g_hookSets)
+    {
+        if (!set.name || (std::find(called.begin(), called.end(), set.api) == called.end()))
+        {
+            continue;
+        }
+
+        if (!first)
+        {
+            json += ',';
+        }
+        first = false;
+
+        json += '"';
+        json += set.name;
+        json += '"';
+    }
+    json += "]}";
+
+    EnsureRedirectRootExists();
+    auto file = impl::CreateFile(g_hookLearnPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    DWORD bytesWritten;
+    impl::WriteFile(file, json.data(), static_cast<DWORD>(json.length()), &bytesWritten, nullptr);
+    impl::CloseHandle(file);
+}
+catch (...)
+{
+    // Learning is best effort
+}
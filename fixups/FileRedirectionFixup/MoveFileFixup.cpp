@@ -6,28 +6,126 @@
 #include "FunctionImplementations.h"
 #include "PathRedirection.h"
 
+// A package file that got moved needs to stay gone from its old location
+static void TombstoneMovedPackageFile(const wchar_t* existingFileName, const std::filesystem::path& existingRedirectPath) noexcept
+{
+    auto lastError = ::GetLastError();
+    if (PackagePathExists(existingFileName))
+    {
+        AddPackageFileTombstone(existingRedirectPath.c_str());
+    }
+    ::SetLastError(lastError);
+}
+
+// Copy-on-read of a package file that's about to get moved to a redirected destination would copy it to its own
+// redirected location only to immediately rename it. Copying it straight to the destination instead gets the same
+// result with one less rename and one less file for the redirected path index to track. Returns false if the move should
+// go the usual way, e.g. because the file has already been copied or a redirected destination would need replacing
+static bool TryMovePackageFile(
+    const wchar_t* existingFileName,
+    const std::filesystem::path& existingRedirectPath,
+    const std::filesystem::path& destRedirectPath,
+    DWORD flags,
+    BOOL& result)
+{
+    if (flags & MOVEFILE_DELAY_UNTIL_REBOOT)
+    {
+        return false;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    auto packagePath = UnredirectedPackageFile(existingFileName, existingRedirectPath.c_str(), data);
+    if (packagePath.empty())
+    {
+        return false;
+    }
+
+    if (RedirectedPathExists(destRedirectPath.c_str()))
+    {
+        if (flags & MOVEFILE_REPLACE_EXISTING)
+        {
+            // CopyFileForRedirection never overwrites
+            return false;
+        }
+
+        ::SetLastError(ERROR_ALREADY_EXISTS);
+        result = FALSE;
+        return true;
+    }
+
+    result = CopyFileForRedirection(packagePath.c_str(), destRedirectPath.c_str(), nullptr);
+    if (!result)
+    {
+        // MoveFile reports ERROR_ALREADY_EXISTS where CopyFile would report ERROR_FILE_EXISTS
+        if (::GetLastError() == ERROR_FILE_EXISTS)
+        {
+            ::SetLastError(ERROR_ALREADY_EXISTS);
+        }
+        return true;
+    }
+
+    TransferAttributeOverride(existingRedirectPath.c_str(), destRedirectPath.c_str());
+    RedirectedPathCreated(destRedirectPath.c_str());
+    TombstoneMovedPackageFile(existingFileName, existingRedirectPath);
+    return true;
+}
+
 template <typename CharT>
 BOOL __stdcall MoveFileFixup(_In_ const CharT* existingFileName, _In_ const CharT* newFileName) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::move_file);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
+            auto wideExistingFileName = widen_argument(existingFileName);
+            auto wideNewFileName = widen_argument(newFileName);
+
             // NOTE: MoveFile needs delete access to the existing file, but since we won't have delete access to the
-            //       file if it is in the package, we copy-on-read it here. This is slightly wasteful since we're
-            //       copying it only for it to immediately get deleted, but that's simpler than trying to roll our own
+            //       file if it is in the package, we copy-on-read it here. When the destination is redirected too, the
+            //       package file gets copied straight there instead (see TryMovePackageFile); otherwise it's copied
+            //       only for it to immediately get deleted, but that's simpler than trying to roll our own
             //       implementation of MoveFile. And of course, the same limitation for deleting files applies here as
             //       well. Additionally, we don't copy-on-read the destination file for the same reason we don't do the
             //       same for CopyFile: we give the application the benefit of the doubt that they previously tried to
             //       delete the file if it exists in the package path.
-            auto [redirectExisting, existingRedirectPath] = ShouldRedirect(existingFileName, redirect_flags::copy_on_read);
-            auto [redirectDest, destRedirectPath] = ShouldRedirect(newFileName, redirect_flags::ensure_directory_structure);
+            auto [redirectExisting, existingRedirectPath] = ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::none);
+            auto [redirectDest, destRedirectPath] = ShouldRedirect(wideNewFileName.c_str(), redirect_flags::ensure_directory_structure);
+            if (redirectExisting && redirectDest)
+            {
+                BOOL result;
+                if (TryMovePackageFile(wideExistingFileName.c_str(), existingRedirectPath, destRedirectPath, 0, result))
+                {
+                    InvalidateRedirectCache();
+                    return result;
+                }
+            }
+
             if (redirectExisting || redirectDest)
             {
-                return impl::MoveFile(
-                    redirectExisting ? existingRedirectPath.c_str() : widen_argument(existingFileName).c_str(),
-                    redirectDest ? destRedirectPath.c_str() : widen_argument(newFileName).c_str());
+                if (redirectExisting)
+                {
+                    ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::copy_on_read);
+                }
+
+                auto result = impl::MoveFile(
+                    redirectExisting ? existingRedirectPath.c_str() : wideExistingFileName.c_str(),
+                    redirectDest ? destRedirectPath.c_str() : wideNewFileName.c_str());
+                if (redirectExisting)
+                {
+                    RedirectedPathChanged(existingRedirectPath.c_str());
+                    if (result)
+                    {
+                        TombstoneMovedPackageFile(wideExistingFileName.c_str(), existingRedirectPath);
+                    }
+                }
+                if (redirectDest)
+                {
+                    RedirectedPathChanged(destRedirectPath.c_str());
+                }
+                InvalidateRedirectCache();
+                return result;
             }
         }
     }
@@ -46,21 +144,53 @@ BOOL __stdcall MoveFileExFixup(
     _In_opt_ const CharT* newFileName,
     _In_ DWORD flags) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::move_file_ex);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            // See note in MoveFile for commentary on copy-on-read functionality (though we could do better by checking
-            // flags for MOVEFILE_REPLACE_EXISTING)
-            auto [redirectExisting, existingRedirectPath] = ShouldRedirect(existingFileName, redirect_flags::copy_on_read);
-            auto [redirectDest, destRedirectPath] = ShouldRedirect(newFileName, redirect_flags::ensure_directory_structure);
+            auto wideExistingFileName = widen_argument(existingFileName);
+            auto wideNewFileName = widen_argument(newFileName);
+
+            // See note in MoveFile for commentary on copy-on-read functionality
+            auto [redirectExisting, existingRedirectPath] = ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::none);
+            auto [redirectDest, destRedirectPath] = ShouldRedirect(wideNewFileName.c_str(), redirect_flags::ensure_directory_structure);
+            if (redirectExisting && redirectDest)
+            {
+                BOOL result;
+                if (TryMovePackageFile(wideExistingFileName.c_str(), existingRedirectPath, destRedirectPath, flags, result))
+                {
+                    InvalidateRedirectCache();
+                    return result;
+                }
+            }
+
             if (redirectExisting || redirectDest)
             {
-                return impl::MoveFileEx(
-                    redirectExisting ? existingRedirectPath.c_str() : widen_argument(existingFileName).c_str(),
-                    redirectDest ? destRedirectPath.c_str() : widen_argument(newFileName).c_str(),
+                if (redirectExisting)
+                {
+                    ShouldRedirect(wideExistingFileName.c_str(), redirect_flags::copy_on_read);
+                }
+
+                auto result = impl::MoveFileEx(
+                    redirectExisting ? existingRedirectPath.c_str() : wideExistingFileName.c_str(),
+                    redirectDest ? destRedirectPath.c_str() : wideNewFileName.c_str(),
                     flags);
+                if (redirectExisting)
+                {
+                    RedirectedPathChanged(existingRedirectPath.c_str());
+                    if (result && newFileName && !(flags & MOVEFILE_DELAY_UNTIL_REBOOT))
+                    {
+                        TombstoneMovedPackageFile(wideExistingFileName.c_str(), existingRedirectPath);
+                    }
+                }
+                if (redirectDest)
+                {
+                    RedirectedPathChanged(destRedirectPath.c_str());
+                }
+                InvalidateRedirectCache();
+                return result;
             }
         }
     }
@@ -0,0 +1,589 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// An alternative to the Win32 path fixups that redirects at the NT layer instead. Every file system API in kernelbase
+// (and plenty of things above it that we don't fix, e.g. CopyFile2's internals) eventually funnels through a handful of
+// ntdll functions, and by the time it gets there, the path has already been converted to a canonical "\??\C:\..." path.
+// Detouring these functions instead of the Win32 ones means fewer detours, one code path shared by everything, and no
+// need to widen or call GetFullPathName on the way in. When the "ntRedirection" option is enabled, the Win32 fixups that
+// these replace don't get attached (and vice versa); see ShouldAttachFixup.
+//
+// NOTE: Only absolute, drive-letter paths get redirected. Opens relative to a directory handle, by file id, or of UNC or
+//       device paths are left alone, as are paths under the redirect root. The latter also means that the threads that
+//       we start to maintain the redirect root don't need to worry about their own calls getting redirected. The
+//       enumeration and private profile fixups are Win32 only, so they remain attached in this mode. The delta overlay
+//       is only ever opened through the Win32 CreateFile fixups, so it has no effect in this mode
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <dos_paths.h>
+#include <path_buffer.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+bool g_ntRedirectionEnabled = false;
+
+// Any of these access rights imply that the caller may modify the file (or, in the case of DELETE, remove it), which
+// requires that we have a copy of it in the redirected location. See CreateFileFixup.cpp
+constexpr ACCESS_MASK nt_write_access_mask = GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED | FILE_WRITE_DATA |
+    FILE_APPEND_DATA | FILE_WRITE_EA | FILE_WRITE_ATTRIBUTES | DELETE | WRITE_DAC | WRITE_OWNER;
+
+// Converts an NT path to the root-local device path ("\\?\C:\...") that ShouldRedirect expects. Returns false for paths
+// that we don't redirect
+static bool dos_path_from_nt_path(std::wstring_view ntPath, psf::path_buffer& dosPath)
+{
+    constexpr std::wstring_view dos_devices_prefix = LR"(\??\)";
+    if ((ntPath.length() < dos_devices_prefix.length() + 3) || (ntPath.compare(0, dos_devices_prefix.length(), dos_devices_prefix) != 0))
+    {
+        return false;
+    }
+
+    auto drivePath = ntPath.substr(dos_devices_prefix.length());
+    auto driveLetter = drivePath[0] | 0x20;
+    if ((driveLetter < L'a') || (driveLetter > L'z') || (drivePath[1] != L':') || (drivePath[2] != L'\\'))
+    {
+        return false;
+    }
+
+    // Includes the roots of the other redirect targets (see RedirectTargets.cpp)
+    std::size_t rootLength;
+    RedirectTargetOfPath(drivePath, rootLength);
+    if (rootLength != 0)
+    {
+        return false;
+    }
+
+    dosPath.assign(LR"(\\?\)");
+    dosPath.append(drivePath);
+    return true;
+}
+
+static bool dos_path_from_object_attributes(const OBJECT_ATTRIBUTES* objectAttributes, psf::path_buffer& dosPath)
+{
+    if (!objectAttributes || objectAttributes->RootDirectory || !objectAttributes->ObjectName ||
+        !objectAttributes->ObjectName->Buffer)
+    {
+        return false;
+    }
+
+    auto& name = *objectAttributes->ObjectName;
+    return dos_path_from_nt_path(std::wstring_view(name.Buffer, name.Length / sizeof(wchar_t)), dosPath);
+}
+
+// A copy of the caller's OBJECT_ATTRIBUTES that names the redirected path instead
+struct redirected_object_attributes
+{
+    std::wstring nt_path;
+    UNICODE_STRING name;
+    OBJECT_ATTRIBUTES attributes;
+
+    // Returns false if the path is too long to be represented in a UNICODE_STRING
+    bool assign(const OBJECT_ATTRIBUTES& original, const std::filesystem::path& redirectPath)
+    {
+        // RedirectedPath gives back "\\?\" prefixed paths, which are "\??\" in the NT namespace
+        nt_path = redirectPath.native();
+        nt_path[1] = L'?';
+        if (nt_path.length() * sizeof(wchar_t) > 0xFFFC)
+        {
+            return false;
+        }
+
+        name.Length = static_cast<USHORT>(nt_path.length() * sizeof(wchar_t));
+        name.MaximumLength = static_cast<USHORT>(name.Length + sizeof(wchar_t));
+        name.Buffer = nt_path.data();
+
+        attributes = original;
+        attributes.ObjectName = &name;
+        return true;
+    }
+};
+
+struct nt_create_redirect_info
+{
+    bool should_redirect = false;
+    std::filesystem::path redirect_path;
+    ULONG create_disposition = 0;
+
+    // Set when we skip copying a package file that the call will overwrite. The call would have otherwise reported that
+    // it overwrote the file, so we need to do the same
+    bool report_overwritten = false;
+};
+
+// The same copy-on-read rules as ShouldRedirectCreateFile (CreateFileFixup.cpp), expressed in terms of NT dispositions
+static nt_create_redirect_info ShouldRedirectNtCreate(
+    const wchar_t* path,
+    ACCESS_MASK desiredAccess,
+    ULONG createDisposition,
+    ULONG createOptions)
+{
+    nt_create_redirect_info result;
+    result.create_disposition = createDisposition;
+
+    if ((createOptions & FILE_DIRECTORY_FILE) && (createDisposition == FILE_CREATE))
+    {
+        // CreateDirectory; see CreateDirectoryFixup
+        auto [shouldRedirect, redirectPath] = ShouldRedirect(path, redirect_flags::ensure_directory_structure);
+        result.should_redirect = shouldRedirect;
+        result.redirect_path = std::move(redirectPath);
+        return result;
+    }
+
+    auto writeIntent = ((desiredAccess & nt_write_access_mask) != 0) || (createOptions & FILE_DELETE_ON_CLOSE);
+    auto discardsContents = (createDisposition == FILE_SUPERSEDE) || (createDisposition == FILE_OVERWRITE) ||
+        (createDisposition == FILE_OVERWRITE_IF);
+    auto opensExisting = (createDisposition == FILE_OPEN) || (createDisposition == FILE_OPEN_IF);
+    if (!discardsContents && !(opensExisting && !writeIntent))
+    {
+        auto [shouldRedirect, redirectPath] = ShouldRedirect(path, redirect_flags::copy_on_read);
+        result.should_redirect = shouldRedirect;
+        result.redirect_path = std::move(redirectPath);
+        return result;
+    }
+
+    auto [shouldRedirect, redirectPath] = ShouldRedirect(path, redirect_flags::none);
+    if (!shouldRedirect)
+    {
+        return result;
+    }
+    else if (RedirectedPathExists(redirectPath.c_str()))
+    {
+        result.should_redirect = true;
+        result.redirect_path = std::move(redirectPath);
+        return result;
+    }
+
+    // NOTE: We hold the reentrancy guard, so this doesn't come back through NtQueryAttributesFileFixup
+    auto packageFileDeleted = PackageFileDeleted(redirectPath.native());
+    auto packageFileExists = !packageFileDeleted && PackagePathExists(path);
+    if (opensExisting && packageFileExists)
+    {
+        return result;
+    }
+
+    if (createDisposition == FILE_OVERWRITE)
+    {
+        // The package file would have been copied only to be immediately truncated; create an empty file instead.
+        // FILE_OVERWRITE fails if the file doesn't exist, which we've already checked. A deleted package file fails
+        // the same way once redirected
+        if (packageFileExists)
+        {
+            result.create_disposition = FILE_OVERWRITE_IF;
+        }
+        else if (!packageFileDeleted)
+        {
+            return result;
+        }
+    }
+    result.report_overwritten = packageFileExists;
+
+    auto [shouldRedirectWithDirectories, redirectPathWithDirectories] = ShouldRedirect(path, redirect_flags::ensure_directory_structure);
+    result.should_redirect = shouldRedirectWithDirectories;
+    result.redirect_path = std::move(redirectPathWithDirectories);
+    return result;
+}
+
+static void report_nt_create(
+    HANDLE fileHandle,
+    const nt_create_redirect_info& redirectInfo,
+    ULONG createDisposition,
+    ULONG createOptions,
+    PIO_STATUS_BLOCK ioStatusBlock) noexcept
+{
+    RedirectedHandleOpened(fileHandle, redirectInfo.redirect_path);
+    if (!(createOptions & FILE_DELETE_ON_CLOSE))
+    {
+        RedirectedPathCreated(redirectInfo.redirect_path.c_str());
+    }
+
+    if (redirectInfo.report_overwritten && (ioStatusBlock->Information == FILE_CREATED))
+    {
+        ioStatusBlock->Information = (createDisposition == FILE_SUPERSEDE) ? FILE_SUPERSEDED : FILE_OVERWRITTEN;
+    }
+}
+
+NTSTATUS __stdcall NtCreateFileFixup(
+    _Out_ PHANDLE fileHandle,
+    _In_ ACCESS_MASK desiredAccess,
+    _In_ POBJECT_ATTRIBUTES objectAttributes,
+    _Out_ PIO_STATUS_BLOCK ioStatusBlock,
+    _In_opt_ PLARGE_INTEGER allocationSize,
+    _In_ ULONG fileAttributes,
+    _In_ ULONG shareAccess,
+    _In_ ULONG createDisposition,
+    _In_ ULONG createOptions,
+    _In_opt_ PVOID eaBuffer,
+    _In_ ULONG eaLength) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::nt_create_file);
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        psf::path_buffer path;
+        if (guard && !(createOptions & FILE_OPEN_BY_FILE_ID) && dos_path_from_object_attributes(objectAttributes, path))
+        {
+            auto redirectInfo = ShouldRedirectNtCreate(path.c_str(), desiredAccess, createDisposition, createOptions);
+            redirected_object_attributes redirected;
+            if (redirectInfo.should_redirect && redirected.assign(*objectAttributes, redirectInfo.redirect_path))
+            {
+                auto result = impl::NtCreateFile(
+                    fileHandle,
+                    desiredAccess,
+                    &redirected.attributes,
+                    ioStatusBlock,
+                    allocationSize,
+                    fileAttributes,
+                    shareAccess,
+                    redirectInfo.create_disposition,
+                    createOptions,
+                    eaBuffer,
+                    eaLength);
+                if (NT_SUCCESS(result))
+                {
+                    report_nt_create(*fileHandle, redirectInfo, createDisposition, createOptions, ioStatusBlock);
+                }
+                return result;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to assuming no redirection is necessary
+    }
+
+    return impl::NtCreateFile(
+        fileHandle,
+        desiredAccess,
+        objectAttributes,
+        ioStatusBlock,
+        allocationSize,
+        fileAttributes,
+        shareAccess,
+        createDisposition,
+        createOptions,
+        eaBuffer,
+        eaLength);
+}
+DECLARE_FIXUP(impl::NtCreateFile, NtCreateFileFixup);
+
+NTSTATUS __stdcall NtOpenFileFixup(
+    _Out_ PHANDLE fileHandle,
+    _In_ ACCESS_MASK desiredAccess,
+    _In_ POBJECT_ATTRIBUTES objectAttributes,
+    _Out_ PIO_STATUS_BLOCK ioStatusBlock,
+    _In_ ULONG shareAccess,
+    _In_ ULONG openOptions) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::nt_open_file);
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        psf::path_buffer path;
+        if (guard && !(openOptions & FILE_OPEN_BY_FILE_ID) && dos_path_from_object_attributes(objectAttributes, path))
+        {
+            auto redirectInfo = ShouldRedirectNtCreate(path.c_str(), desiredAccess, FILE_OPEN, openOptions);
+            redirected_object_attributes redirected;
+            if (redirectInfo.should_redirect && redirected.assign(*objectAttributes, redirectInfo.redirect_path))
+            {
+                auto result = impl::NtOpenFile(fileHandle, desiredAccess, &redirected.attributes, ioStatusBlock, shareAccess, openOptions);
+                if (NT_SUCCESS(result))
+                {
+                    report_nt_create(*fileHandle, redirectInfo, FILE_OPEN, openOptions, ioStatusBlock);
+                }
+                return result;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to assuming no redirection is necessary
+    }
+
+    return impl::NtOpenFile(fileHandle, desiredAccess, objectAttributes, ioStatusBlock, shareAccess, openOptions);
+}
+DECLARE_FIXUP(impl::NtOpenFile, NtOpenFileFixup);
+
+// NtQueryAttributesFile and NtQueryFullAttributesFile back GetFileAttributes and GetFileAttributesEx respectively
+template <typename Func, typename InfoT>
+static NTSTATUS query_attributes(Func queryAttributes, POBJECT_ATTRIBUTES objectAttributes, InfoT* fileInformation) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        psf::path_buffer path;
+        if (guard && dos_path_from_object_attributes(objectAttributes, path))
+        {
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(path.c_str(), redirect_flags::check_file_presence);
+            redirected_object_attributes redirected;
+            if (shouldRedirect && redirected.assign(*objectAttributes, redirectPath))
+            {
+                return queryAttributes(&redirected.attributes, fileInformation);
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to assuming no redirection is necessary
+    }
+
+    return queryAttributes(objectAttributes, fileInformation);
+}
+
+NTSTATUS __stdcall NtQueryAttributesFileFixup(
+    _In_ POBJECT_ATTRIBUTES objectAttributes,
+    _Out_ winternl::FILE_BASIC_INFORMATION* fileInformation) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::nt_query_attributes_file);
+    if (HookBypassed(telemetry_api::nt_query_attributes_file))
+    {
+        return impl::NtQueryAttributesFile(objectAttributes, fileInformation);
+    }
+
+    return query_attributes(impl::NtQueryAttributesFile, objectAttributes, fileInformation);
+}
+DECLARE_FIXUP(impl::NtQueryAttributesFile, NtQueryAttributesFileFixup);
+
+NTSTATUS __stdcall NtQueryFullAttributesFileFixup(
+    _In_ POBJECT_ATTRIBUTES objectAttributes,
+    _Out_ winternl::FILE_NETWORK_OPEN_INFORMATION* fileInformation) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::nt_query_full_attributes_file);
+    if (HookBypassed(telemetry_api::nt_query_full_attributes_file))
+    {
+        return impl::NtQueryFullAttributesFile(objectAttributes, fileInformation);
+    }
+
+    return query_attributes(impl::NtQueryFullAttributesFile, objectAttributes, fileInformation);
+}
+DECLARE_FIXUP(impl::NtQueryFullAttributesFile, NtQueryFullAttributesFileFixup);
+
+// Gives back the path of an open file if it's under the redirect root, so that changes made through the handle can be
+// reported. Handles that we redirected are looked up in the handle table; anything else (e.g. a file that the application
+// opened in the redirect root itself) has to be queried, but this is only used for renames, links, and deletes, which
+// are rare enough that the query doesn't matter
+static bool redirected_path_from_handle(HANDLE file, psf::path_buffer& path) noexcept
+{
+    if (auto info = FindRedirectedHandle(file))
+    {
+        try
+        {
+            path.assign(info->redirect_path);
+            return true;
+        }
+        catch (...)
+        {
+            // Out of memory; fall back to querying the handle, which may not need to allocate
+        }
+    }
+
+    path.resize(path.capacity());
+    auto len = ::GetFinalPathNameByHandleW(file, path.data(), static_cast<DWORD>(path.length() + 1), FILE_NAME_NORMALIZED);
+    if (len > path.length())
+    {
+        try
+        {
+            path.resize(len);
+        }
+        catch (...)
+        {
+            return false;
+        }
+        len = ::GetFinalPathNameByHandleW(file, path.data(), static_cast<DWORD>(path.length() + 1), FILE_NAME_NORMALIZED);
+    }
+
+    if (!len || (len > path.length()))
+    {
+        return false;
+    }
+    path.resize(len);
+
+    // GetFinalPathNameByHandle gives back "\\?\" prefixed paths, which RedirectTargetOfPath allows for
+    std::size_t rootLength;
+    RedirectTargetOfPath(std::wstring_view(path.c_str(), len), rootLength);
+    return (rootLength != 0) && (len > rootLength);
+}
+
+NTSTATUS __stdcall NtSetInformationFileFixup(
+    _In_ HANDLE fileHandle,
+    _Out_ PIO_STATUS_BLOCK ioStatusBlock,
+    _In_reads_bytes_(length) PVOID fileInformation,
+    _In_ ULONG length,
+    _In_ winternl::FILE_INFORMATION_CLASS fileInformationClass) noexcept
+{
+    telemetry_scope telemetry(telemetry_api::nt_set_information_file);
+    auto isRename = (fileInformationClass == winternl::FileRenameInformation) ||
+        (fileInformationClass == winternl::FileRenameInformationEx);
+    auto isLink = (fileInformationClass == winternl::FileLinkInformation) ||
+        (fileInformationClass == winternl::FileLinkInformationEx);
+    auto isDisposition = (fileInformationClass == winternl::FileDispositionInformation) ||
+        (fileInformationClass == winternl::FileDispositionInformationEx);
+    if (!isRename && !isLink && !isDisposition)
+    {
+        // Nothing path related
+        return impl::NtSetInformationFile(fileHandle, ioStatusBlock, fileInformation, length, fileInformationClass);
+    }
+
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard && isDisposition)
+        {
+            // The file isn't removed until the last handle to it is closed, but we don't see that happen. Any later
+            // presence check that's wrong as a result would just end up looking at the package instead
+            auto deleting = (fileInformationClass == winternl::FileDispositionInformation) ?
+                (length >= sizeof(winternl::FILE_DISPOSITION_INFORMATION)) &&
+                    static_cast<const winternl::FILE_DISPOSITION_INFORMATION*>(fileInformation)->DeleteFile :
+                (length >= sizeof(winternl::FILE_DISPOSITION_INFORMATION_EX)) &&
+                    (static_cast<const winternl::FILE_DISPOSITION_INFORMATION_EX*>(fileInformation)->Flags & winternl::FILE_DISPOSITION_DELETE);
+            auto result = impl::NtSetInformationFile(fileHandle, ioStatusBlock, fileInformation, length, fileInformationClass);
+            psf::path_buffer path;
+            if (NT_SUCCESS(result) && deleting && redirected_path_from_handle(fileHandle, path))
+            {
+                RedirectedPathDeleted(path.c_str());
+                InvalidateRedirectCache();
+            }
+            return result;
+        }
+
+        constexpr auto nameOffset = offsetof(winternl::FILE_RENAME_INFORMATION, FileName);
+        auto info = static_cast<const winternl::FILE_RENAME_INFORMATION*>(fileInformation);
+        if (guard && (length >= nameOffset) && (info->FileNameLength <= length - nameOffset))
+        {
+            // The source was opened through NtCreateFile/NtOpenFile, which already took care of copy-on-read (renames and
+            // links open the source with DELETE and FILE_WRITE_ATTRIBUTES access respectively)
+            path_redirect_info target;
+            psf::path_buffer targetPath;
+            if (!info->RootDirectory &&
+                dos_path_from_nt_path(std::wstring_view(info->FileName, info->FileNameLength / sizeof(wchar_t)), targetPath))
+            {
+                target = ShouldRedirect(targetPath.c_str(), redirect_flags::ensure_directory_structure);
+            }
+
+            psf::path_buffer sourcePath;
+            auto sourceRedirected = isRename && redirected_path_from_handle(fileHandle, sourcePath);
+            if (target.should_redirect || sourceRedirected)
+            {
+                std::unique_ptr<std::byte[]> redirectedBuffer;
+                if (target.should_redirect)
+                {
+                    // "\\?\" becomes "\??\"
+                    auto ntPath = target.redirect_path.native();
+                    ntPath[1] = L'?';
+
+                    auto nameLength = ntPath.length() * sizeof(wchar_t);
+                    length = static_cast<ULONG>(nameOffset + nameLength);
+                    redirectedBuffer = std::make_unique<std::byte[]>((std::max)(static_cast<std::size_t>(length), sizeof(winternl::FILE_RENAME_INFORMATION)));
+
+                    auto redirectedInfo = reinterpret_cast<winternl::FILE_RENAME_INFORMATION*>(redirectedBuffer.get());
+                    redirectedInfo->Flags = info->Flags;
+                    redirectedInfo->RootDirectory = nullptr;
+                    redirectedInfo->FileNameLength = static_cast<ULONG>(nameLength);
+                    std::copy(ntPath.begin(), ntPath.end(), redirectedInfo->FileName);
+                    fileInformation = redirectedInfo;
+                }
+
+                auto result = impl::NtSetInformationFile(fileHandle, ioStatusBlock, fileInformation, length, fileInformationClass);
+                if (isRename)
+                {
+                    if (NT_SUCCESS(result))
+                    {
+                        RedirectedHandleRenamed(fileHandle, target.should_redirect ? target.redirect_path : std::filesystem::path{});
+                    }
+
+                    // See MoveFileExFixup
+                    if (sourceRedirected)
+                    {
+                        RedirectedPathChanged(sourcePath.c_str());
+                    }
+                    if (target.should_redirect)
+                    {
+                        RedirectedPathChanged(target.redirect_path.c_str());
+                    }
+                    InvalidateRedirectCache();
+                }
+                else if (NT_SUCCESS(result))
+                {
+                    RedirectedPathCreated(target.redirect_path.c_str());
+                }
+                return result;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to assuming no redirection is necessary
+    }
+
+    return impl::NtSetInformationFile(fileHandle, ioStatusBlock, fileInformation, length, fileInformationClass);
+}
+DECLARE_FIXUP(impl::NtSetInformationFile, NtSetInformationFileFixup);
+
+bool ShouldAttachFixup(const void* target) noexcept
+{
+    // The Win32 fixups that redirect paths, which the NT fixups replace
+    static const void* const win32Targets[] =
+    {
+        &impl::CopyFile.ansi, &impl::CopyFile.wide,
+        &impl::CopyFileEx.ansi, &impl::CopyFileEx.wide,
+        &impl::CopyFile2,
+        &impl::CreateDirectory.ansi, &impl::CreateDirectory.wide,
+        &impl::CreateDirectoryEx.ansi, &impl::CreateDirectoryEx.wide,
+        &impl::CreateFile.ansi, &impl::CreateFile.wide,
+        &impl::CreateFile2,
+        &impl::CreateHardLink.ansi, &impl::CreateHardLink.wide,
+        &impl::CreateSymbolicLink.ansi, &impl::CreateSymbolicLink.wide,
+        &impl::DeleteFile.ansi, &impl::DeleteFile.wide,
+        &impl::GetFileAttributes.ansi, &impl::GetFileAttributes.wide,
+        &impl::GetFileAttributesEx.ansi, &impl::GetFileAttributesEx.wide,
+        &impl::MoveFile.ansi, &impl::MoveFile.wide,
+        &impl::MoveFileEx.ansi, &impl::MoveFileEx.wide,
+        &impl::RemoveDirectory.ansi, &impl::RemoveDirectory.wide,
+        &impl::ReplaceFile.ansi, &impl::ReplaceFile.wide,
+        &impl::SetFileAttributes.ansi, &impl::SetFileAttributes.wide,
+    };
+
+    static const void* const ntTargets[] =
+    {
+        &impl::NtCreateFile,
+        &impl::NtOpenFile,
+        &impl::NtQueryAttributesFile,
+        &impl::NtQueryFullAttributesFile,
+        &impl::NtSetInformationFile,
+    };
+
+    auto contains = [&](auto& targets)
+    {
+        return std::find(std::begin(targets), std::end(targets), target) != std::end(targets);
+    };
+
+    if (!IsHookEnabled(target))
+    {
+        return false;
+    }
+
+    return g_ntRedirectionEnabled ? !contains(win32Targets) : !contains(ntTargets);
+}
+
+void InitializeNtRedirection(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"))
+    {
+        // Don't leave ourselves without any redirection if ntdll is missing something
+        g_ntRedirectionEnabled = static_cast<bool>(enabledValue->as_boolean()) && impl::NtCreateFile && impl::NtOpenFile &&
+            impl::NtQueryAttributesFile && impl::NtQueryFullAttributesFile && impl::NtSetInformationFile;
+    }
+}
@@ -0,0 +1,341 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Files in the package can't actually be deleted, so without any extra work, deleting one only deletes its redirected
+// copy (if any) and the package file shows up again on the next open, presence check, or enumeration. Tombstones fix
+// this by remembering which package files have been deleted so that they can be treated as if they don't exist, until
+// something gets created in their place.
+//
+// The tombstones are kept in a file in the redirect root so that they persist across launches and are shared by all of
+// the package's processes, which map the file into memory. The file holds an open addressed hash table of 64-bit
+// (case-insensitive) hashes of the redirected paths of deleted files, so that checking a path is a hash and a couple
+// of memory reads, with no disk access. Slots are only ever updated with interlocked operations, so processes don't
+// need to coordinate beyond that. The table is a fixed size; once it's three quarters full, further deletes of package
+// files go back to only deleting the redirected copy.
+//
+// NOTE: Since only hashes are stored, two paths with the same hash can't be told apart. With 64-bit hashes, this is
+//       extremely unlikely for the number of paths that the table can hold
+
+#include <atomic>
+#include <cstdint>
+#include <cwctype>
+#include <memory>
+#include <string_view>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+using namespace std::literals;
+
+constexpr std::uint32_t tombstone_file_magic = 0x42545350; // "PSTB"
+constexpr std::uint32_t tombstone_file_version = 1;
+constexpr std::uint32_t tombstone_capacity = 16384; // Must be a power of two
+constexpr std::uint32_t tombstone_max_count = tombstone_capacity / 4 * 3;
+
+// Slot values other than these are path hashes. Hashes that would collide with them get adjusted; see tombstone_hash
+constexpr std::uint64_t empty_slot = 0;
+constexpr std::uint64_t removed_slot = 1;
+
+using tombstone_slot = std::atomic<std::uint64_t>;
+static_assert(sizeof(tombstone_slot) == sizeof(std::uint64_t));
+static_assert(tombstone_slot::is_always_lock_free, "Slots are shared across processes, so they can't use a lock");
+
+struct tombstone_file_header
+{
+    std::atomic<std::uint32_t> magic;
+    std::uint32_t version;
+    std::uint32_t capacity;
+    std::atomic<std::uint32_t> count; // Slots that are no longer empty, including removed ones
+};
+static_assert(sizeof(tombstone_file_header) % alignof(tombstone_slot) == 0);
+
+constexpr std::size_t tombstone_file_size = sizeof(tombstone_file_header) + tombstone_capacity * sizeof(tombstone_slot);
+
+tombstone_file_header* g_tombstoneHeader = nullptr;
+tombstone_slot* g_tombstoneSlots = nullptr;
+
+// Prefix of every redirected path; see RedirectedPath. Hashes exclude it so that the table stays valid if the redirect
+// root's path would be spelled differently (e.g. a different drive letter case)
+std::wstring g_tombstoneRedirectRoot;
+
+// FNV-1a over the upper-cased path, with each run of path separators hashed as a single backslash and trailing
+// separators ignored. This makes "dir\" + "name" hash the same as "dir\name", so that enumeration can hash the directory
+// once and each name as it comes by
+struct tombstone_hash
+{
+    std::uint64_t value = 14695981039346656037ull;
+    bool pending_separator = false;
+
+    void add(std::wstring_view str) noexcept
+    {
+        for (auto ch : str)
+        {
+            if (psf::is_path_separator(ch))
+            {
+                pending_separator = true;
+                continue;
+            }
+
+            if (pending_separator)
+            {
+                mix(L'\\');
+                pending_separator = false;
+            }
+            mix(std::towupper(ch));
+        }
+    }
+
+    std::uint64_t slot_value() const noexcept
+    {
+        return (value > removed_slot) ? value : (value + 2);
+    }
+
+private:
+
+    void mix(wchar_t ch) noexcept
+    {
+        value ^= static_cast<std::uint16_t>(ch);
+        value *= 1099511628211ull;
+    }
+};
+
+static bool tombstones_in_use() noexcept
+{
+    return g_tombstoneSlots && (g_tombstoneHeader->count.load(std::memory_order_relaxed) != 0);
+}
+
+// Returns false if the path isn't under the redirect root, in which case it can't have a tombstone
+static bool hash_redirect_path(std::wstring_view redirectPath, tombstone_hash& hash) noexcept
+{
+    auto& root = g_tombstoneRedirectRoot;
+    if ((redirectPath.length() < root.length()) ||
+        !psf::path_equal(redirectPath.data(), root.c_str(), root.length()) ||
+        ((redirectPath.length() > root.length()) && !psf::is_path_separator(redirectPath[root.length()])))
+    {
+        return false;
+    }
+
+    hash.add(redirectPath.substr(root.length()));
+    return true;
+}
+
+static bool find_tombstone(std::uint64_t value) noexcept
+{
+    for (std::uint32_t i = 0; i < tombstone_capacity; ++i)
+    {
+        auto slot = g_tombstoneSlots[(value + i) & (tombstone_capacity - 1)].load(std::memory_order_acquire);
+        if (slot == value)
+        {
+            return true;
+        }
+        else if (slot == empty_slot)
+        {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+void InitializePackageFileTombstones(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    g_tombstoneRedirectRoot = LR"(\\?\)" + g_redirectRootPath.native();
+
+    // NOTE: Since tombstones are shared with other processes, the file is opened up front, even if this process never
+    //       deletes anything, so that we see tombstones that other processes add
+    EnsureRedirectRootExists();
+    auto path = g_redirectRootPath / L"PsfTombstones.bin";
+    psf::unique_handle file(impl::CreateFile(
+        path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER size;
+    if (!file || !::GetFileSizeEx(file.get(), &size) ||
+        ((size.QuadPart != 0) && (static_cast<std::uint64_t>(size.QuadPart) != tombstone_file_size)))
+    {
+        return;
+    }
+
+    // NOTE: This extends a newly created file to its full size, filled with zeros, which is an empty table. Every
+    //       process uses the same size, so it doesn't matter which one gets there first
+    psf::unique_handle mapping(impl::CreateFileMapping(
+        file.get(),
+        nullptr,
+        PAGE_READWRITE,
+        0,
+        static_cast<DWORD>(tombstone_file_size),
+        static_cast<const wchar_t*>(nullptr)));
+    if (!mapping)
+    {
+        return;
+    }
+
+    // NOTE: The view is intentionally never unmapped; other fixups may be looking up tombstones right up until the
+    //       process exits
+    auto view = ::MapViewOfFile(mapping.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, tombstone_file_size);
+    if (!view)
+    {
+        return;
+    }
+
+    auto header = static_cast<tombstone_file_header*>(view);
+    if (header->magic.load() == 0)
+    {
+        // Either a new file or another process is in the middle of initializing it. The values are the same either way
+        header->version = tombstone_file_version;
+        header->capacity = tombstone_capacity;
+        header->magic.store(tombstone_file_magic);
+    }
+
+    if ((header->magic.load() != tombstone_file_magic) ||
+        (header->version != tombstone_file_version) ||
+        (header->capacity != tombstone_capacity))
+    {
+        ::UnmapViewOfFile(view);
+        return;
+    }
+
+    g_tombstoneHeader = header;
+    g_tombstoneSlots = reinterpret_cast<tombstone_slot*>(header + 1);
+}
+
+bool PackageFileDeleted(std::wstring_view redirectPath) noexcept
+{
+    if (!tombstones_in_use())
+    {
+        return false;
+    }
+
+    tombstone_hash hash;
+    return hash_redirect_path(redirectPath, hash) && find_tombstone(hash.slot_value());
+}
+
+bool PackageFileDeleted(std::wstring_view redirectDirectory, std::wstring_view name) noexcept
+{
+    if (!tombstones_in_use() || (name == L"."sv) || (name == L".."sv))
+    {
+        return false;
+    }
+
+    tombstone_hash hash;
+    if (!hash_redirect_path(redirectDirectory, hash))
+    {
+        return false;
+    }
+
+    hash.pending_separator = true;
+    hash.add(name);
+    return find_tombstone(hash.slot_value());
+}
+
+bool AddPackageFileTombstone(const wchar_t* redirectPath) noexcept
+{
+    tombstone_hash hash;
+    if (!g_tombstoneSlots || !hash_redirect_path(redirectPath, hash))
+    {
+        return false;
+    }
+
+    // Enumerations of the directory may have been cached with the file in them
+    InvalidateDirectoryListings(redirectPath);
+
+    // A removed slot can be reused, but only once we know that the path isn't already further along
+    auto value = hash.slot_value();
+    tombstone_slot* reusableSlot = nullptr;
+    for (std::uint32_t i = 0; i < tombstone_capacity; ++i)
+    {
+        auto& slot = g_tombstoneSlots[(value + i) & (tombstone_capacity - 1)];
+        auto current = slot.load(std::memory_order_acquire);
+        if (current == value)
+        {
+            return true;
+        }
+        else if (current == removed_slot)
+        {
+            if (!reusableSlot)
+            {
+                reusableSlot = &slot;
+            }
+            continue;
+        }
+        else if (current != empty_slot)
+        {
+            continue;
+        }
+
+        if (reusableSlot)
+        {
+            // NOTE: If another process beats us to it, the path may end up in two slots. That's harmless, since lookups
+            //       stop at the first match and removal clears every match
+            auto expected = removed_slot;
+            if (reusableSlot->compare_exchange_strong(expected, value) || (expected == value))
+            {
+                return true;
+            }
+            reusableSlot = nullptr;
+        }
+
+        if (g_tombstoneHeader->count.load() >= tombstone_max_count)
+        {
+            return false;
+        }
+
+        auto expected = empty_slot;
+        if (slot.compare_exchange_strong(expected, value))
+        {
+            ++g_tombstoneHeader->count;
+            return true;
+        }
+        else if (expected == value)
+        {
+            return true;
+        }
+
+        // Lost a race for this slot; look at it again
+        --i;
+    }
+
+    return false;
+}
+
+void RemovePackageFileTombstone(const wchar_t* redirectPath) noexcept
+{
+    tombstone_hash hash;
+    if (!tombstones_in_use() || !hash_redirect_path(redirectPath, hash))
+    {
+        return;
+    }
+
+    auto value = hash.slot_value();
+    for (std::uint32_t i = 0; i < tombstone_capacity; ++i)
+    {
+        auto& slot = g_tombstoneSlots[(value + i) & (tombstone_capacity - 1)];
+        auto expected = value;
+        if (!slot.compare_exchange_strong(expected, removed_slot) && (expected == empty_slot))
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,469 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The package's files never change for a given version of an installed package, yet every attribute query and
+// existence check of a package file goes to the file system. The "packageIndex" configuration answers these from an
+// index of everything under the package root instead: a sorted table of relative paths, each with the same data that
+// GetFileAttributesEx would return. The index gets built once, by whichever process gets there first, on a background
+// thread, and is kept in a file in the redirect root that's named after the package full name, so a new version of the
+// package gets a new index. Every process after that maps the file read-only and binary searches it, with no I/O at all.
+// Child processes don't even open the file, since they can map the section that their parent already validated.
+//
+// NOTE: The index only answers for paths that are literally under the package root and that unambiguously name a single
+//       file; anything else (e.g. short names, alternate data streams, or any path while the index is still being
+//       built) is left to the file system. Packages registered from a loose folder can change underneath the index,
+//       which is why it isn't enabled by default
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+extern std::filesystem::path g_redirectRootPath;
+
+using namespace std::literals;
+
+constexpr std::uint32_t package_index_magic = 0x49505350; // "PSPI"
+constexpr std::uint32_t package_index_version = 1;
+
+struct package_index_header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t entry_count;
+    std::uint32_t string_length; // In characters
+    std::uint64_t file_size;
+};
+
+struct package_index_entry
+{
+    std::uint32_t path_offset; // In characters, from the start of the strings
+    std::uint32_t path_length;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+};
+
+// The file is laid out as the header, followed by the entries (sorted by path), followed by the paths, which are
+// relative to the package root and aren't null terminated
+struct package_index
+{
+    const package_index_entry* entries;
+    std::uint32_t entry_count;
+    const wchar_t* strings;
+};
+
+std::atomic<const package_index*> g_packageIndex = nullptr;
+std::filesystem::path g_packageIndexPath;
+
+static int compare_index_paths(std::wstring_view lhs, std::wstring_view rhs) noexcept
+{
+    // Same case folding that the file system uses, as best as we can tell from user mode
+    return ::CompareStringOrdinal(lhs.data(), static_cast<int>(lhs.length()), rhs.data(), static_cast<int>(rhs.length()), TRUE) - CSTR_EQUAL;
+}
+
+static const package_index_entry* find_index_entry(const package_index& index, std::wstring_view relativePath) noexcept
+{
+    auto end = index.entries + index.entry_count;
+    auto itr = std::lower_bound(index.entries, end, relativePath, [&](const package_index_entry& entry, std::wstring_view path)
+    {
+        return compare_index_paths({ index.strings + entry.path_offset, entry.path_length }, path) < 0;
+    });
+
+    if ((itr == end) || (compare_index_paths({ index.strings + itr->path_offset, itr->path_length }, relativePath) != 0))
+    {
+        return nullptr;
+    }
+
+    return itr;
+}
+
+// Returns an empty view if the index can't answer for the path
+static std::wstring_view index_relative_path(const wchar_t* path) noexcept
+{
+    auto& root = g_packageRootPath.native();
+    if (!::PSFIsPackagePath(path, std::wcslen(path)))
+    {
+        return {};
+    }
+
+    // The package root itself isn't in the index
+    auto relativePath = path + root.length();
+    if (!psf::is_path_separator(*relativePath))
+    {
+        return {};
+    }
+    ++relativePath;
+
+    // Only answer for paths that we know for sure the file system would compare the same way that we do. GetFullPathName
+    // already took care of forward slashes, "." and "..", and trailing dots and spaces for anything other than "\\?\"
+    // paths, but we still need to make sure
+    std::wstring_view result = relativePath;
+    if (psf::find_first_path_char<L'/', L':', L'~', L'*', L'?'>(result) != std::wstring_view::npos)
+    {
+        return {};
+    }
+
+    // NOTE: The end of the string counts as a separator, so a trailing separator gives an empty last component
+    for (std::size_t componentStart = 0; componentStart <= result.length(); )
+    {
+        auto componentEnd = (std::min)(psf::find_path_separator(result, componentStart), result.length());
+        auto component = result.substr(componentStart, componentEnd - componentStart);
+        if (component.empty() || (component == L".") || (component == L"..") ||
+            (component.back() == L'.') || (component.back() == L' '))
+        {
+            return {};
+        }
+        componentStart = componentEnd + 1;
+    }
+
+    return result;
+}
+
+DWORD FindPackageMetadata(const wchar_t* path, WIN32_FILE_ATTRIBUTE_DATA& data) noexcept try
+{
+    auto index = g_packageIndex.load(std::memory_order_acquire);
+    if (!index || !path)
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    auto normalizedPath = NormalizePath(path);
+    if (!normalizedPath.drive_absolute_path)
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    auto relativePath = index_relative_path(normalizedPath.drive_absolute_path);
+    if (relativePath.empty())
+    {
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    if (auto entry = find_index_entry(*index, relativePath))
+    {
+        data = entry->data;
+        return ERROR_SUCCESS;
+    }
+
+    // The index has everything, so the only question is which error the file system would have given back
+    auto pos = psf::find_last_path_separator(relativePath);
+    if (pos == std::wstring_view::npos)
+    {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    auto parent = find_index_entry(*index, relativePath.substr(0, pos));
+    return (parent && (parent->data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) ? ERROR_FILE_NOT_FOUND : ERROR_PATH_NOT_FOUND;
+}
+catch (...)
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+bool PackagePathExists(const wchar_t* path) noexcept
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    auto err = FindPackageMetadata(path, data);
+    return (err == ERROR_NOT_SUPPORTED) ? impl::PathExists(path) : (err == ERROR_SUCCESS);
+}
+
+// Child processes get the index from their parent through the PsfRuntime (see PSFQuerySharedSection) so that they don't
+// need to open the file at all
+// {A8C1F0E2-5B7D-4E0A-93B6-2F4D8C71E5A9}
+constexpr GUID package_index_section_id = { 0xa8c1f0e2, 0x5b7d, 0x4e0a, { 0x93, 0xb6, 0x2f, 0x4d, 0x8c, 0x71, 0xe5, 0xa9 } };
+
+static const package_index* map_package_index_section(HANDLE mapping, std::uint64_t size) noexcept try
+{
+    if (size < sizeof(package_index_header))
+    {
+        return nullptr;
+    }
+
+    auto view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        return nullptr;
+    }
+
+    // Don't trust anything about the file until we've checked that everything in it is in bounds
+    auto header = static_cast<const package_index_header*>(view);
+    auto entries = reinterpret_cast<const package_index_entry*>(header + 1);
+    auto strings = reinterpret_cast<const wchar_t*>(entries + header->entry_count);
+    auto valid = (header->magic == package_index_magic) &&
+        (header->version == package_index_version) &&
+        (header->file_size == size) &&
+        (header->file_size == sizeof(package_index_header) +
+            static_cast<std::uint64_t>(header->entry_count) * sizeof(package_index_entry) +
+            static_cast<std::uint64_t>(header->string_length) * sizeof(wchar_t));
+    for (std::uint32_t i = 0; valid && (i < header->entry_count); ++i)
+    {
+        valid = (static_cast<std::uint64_t>(entries[i].path_offset) + entries[i].path_length <= header->string_length);
+    }
+
+    if (!valid)
+    {
+        ::UnmapViewOfFile(view);
+        return nullptr;
+    }
+
+    // NOTE: The view is intentionally never unmapped (nor the index freed); other fixups may be looking up paths right
+    //       up until the process exits
+    return new package_index{ entries, header->entry_count, strings };
+}
+catch (...)
+{
+    return nullptr;
+}
+
+static const package_index* map_package_index() noexcept
+{
+    psf::unique_handle file(impl::CreateFile(
+        g_packageIndexPath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER size;
+    if (!file || !::GetFileSizeEx(file.get(), &size))
+    {
+        return nullptr;
+    }
+
+    psf::unique_handle mapping(impl::CreateFileMapping(file.get(), nullptr, PAGE_READONLY, 0, 0, static_cast<const wchar_t*>(nullptr)));
+    if (!mapping)
+    {
+        return nullptr;
+    }
+
+    auto result = map_package_index_section(mapping.get(), static_cast<std::uint64_t>(size.QuadPart));
+    if (result)
+    {
+        ::PSFPublishSharedSection(package_index_section_id, mapping.get(), static_cast<std::uint64_t>(size.QuadPart));
+    }
+
+    return result;
+}
+
+struct package_index_build_entry
+{
+    std::wstring path;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+};
+
+// Returns false if we couldn't enumerate everything, since an incomplete index would claim that files don't exist
+static bool enumerate_package(std::vector<package_index_build_entry>& entries)
+{
+    auto& root = g_packageRootPath.native();
+    std::vector<std::wstring> pending;
+    pending.emplace_back();
+    while (!pending.empty())
+    {
+        auto relativeDir = std::move(pending.back());
+        pending.pop_back();
+
+        auto pattern = relativeDir.empty() ? (root + L"\\*") : (root + L'\\' + relativeDir + L"\\*");
+        WIN32_FIND_DATAW findData;
+        auto findHandle = impl::FindFirstFileEx(
+            pattern.c_str(),
+            FindExInfoBasic,
+            &findData,
+            FindExSearchNameMatch,
+            nullptr,
+            FIND_FIRST_EX_LARGE_FETCH);
+        if (findHandle == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        do
+        {
+            std::wstring_view name = findData.cFileName;
+            if ((name == L".") || (name == L".."))
+            {
+                continue;
+            }
+
+            auto& entry = entries.emplace_back();
+            entry.path = relativeDir.empty() ? std::wstring(name) : (relativeDir + L'\\' + findData.cFileName);
+            entry.data.dwFileAttributes = findData.dwFileAttributes;
+            entry.data.ftCreationTime = findData.ftCreationTime;
+            entry.data.ftLastAccessTime = findData.ftLastAccessTime;
+            entry.data.ftLastWriteTime = findData.ftLastWriteTime;
+            entry.data.nFileSizeHigh = findData.nFileSizeHigh;
+            entry.data.nFileSizeLow = findData.nFileSizeLow;
+
+            if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                !(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            {
+                pending.push_back(entry.path);
+            }
+        } while (impl::FindNextFile(findHandle, &findData));
+
+        auto err = ::GetLastError();
+        impl::FindClose(findHandle);
+        if (err != ERROR_NO_MORE_FILES)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool build_package_index()
+{
+    std::vector<package_index_build_entry> entries;
+    if (!enumerate_package(entries))
+    {
+        return false;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const package_index_build_entry& lhs, const package_index_build_entry& rhs)
+    {
+        return compare_index_paths(lhs.path, rhs.path) < 0;
+    });
+
+    std::uint64_t stringLength = 0;
+    for (auto& entry : entries)
+    {
+        stringLength += entry.path.length();
+    }
+
+    if ((entries.size() > MAXDWORD) || (stringLength > MAXDWORD))
+    {
+        return false;
+    }
+
+    package_index_header header = {};
+    header.magic = package_index_magic;
+    header.version = package_index_version;
+    header.entry_count = static_cast<std::uint32_t>(entries.size());
+    header.string_length = static_cast<std::uint32_t>(stringLength);
+    header.file_size = sizeof(header) + entries.size() * sizeof(package_index_entry) + stringLength * sizeof(wchar_t);
+    if (header.file_size > MAXDWORD)
+    {
+        return false;
+    }
+
+    std::vector<std::uint8_t> contents(static_cast<std::size_t>(header.file_size));
+    std::memcpy(contents.data(), &header, sizeof(header));
+    auto indexEntries = reinterpret_cast<package_index_entry*>(contents.data() + sizeof(header));
+    auto strings = reinterpret_cast<wchar_t*>(indexEntries + entries.size());
+    std::uint32_t offset = 0;
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        auto& entry = entries[i];
+        indexEntries[i].path_offset = offset;
+        indexEntries[i].path_length = static_cast<std::uint32_t>(entry.path.length());
+        indexEntries[i].data = entry.data;
+        std::memcpy(strings + offset, entry.path.data(), entry.path.length() * sizeof(wchar_t));
+        offset += static_cast<std::uint32_t>(entry.path.length());
+    }
+
+    // Other processes may be building the index at the same time, so write it somewhere unique and then move it into
+    // place. Whoever loses the race maps the winner's copy, which is identical
+    EnsureRedirectRootExists();
+    auto tempPath = g_packageIndexPath.native() + L"." + std::to_wstring(::GetCurrentProcessId()) + L".tmp";
+    {
+        psf::unique_handle file(impl::CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file)
+        {
+            return false;
+        }
+
+        DWORD bytesWritten;
+        if (!impl::WriteFile(file.get(), contents.data(), static_cast<DWORD>(contents.size()), &bytesWritten, nullptr) ||
+            (bytesWritten != contents.size()))
+        {
+            file.reset();
+            impl::DeleteFile(tempPath.c_str());
+            return false;
+        }
+    }
+
+    if (!impl::MoveFileEx(tempPath.c_str(), g_packageIndexPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        // E.g. another process already has its copy mapped
+        impl::DeleteFile(tempPath.c_str());
+    }
+
+    return true;
+}
+
+static DWORD __stdcall PackageIndexBuildThread(void*) noexcept try
+{
+    // Everything here goes through impl::, but there's no reason for anything we call to get redirected either way
+    auto guard = g_reentrancyGuard.enter();
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    if (build_package_index())
+    {
+        if (auto index = map_package_index())
+        {
+            g_packageIndex.store(index, std::memory_order_release);
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    // Out of memory. We'll just keep going to the file system
+    return ERROR_OUTOFMEMORY;
+}
+
+void InitializePackageMetadataIndex(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    auto packageFullName = ::PSFQueryPackageFullName();
+    if (!*packageFullName)
+    {
+        return;
+    }
+
+    std::uint64_t sharedSize;
+    if (auto section = ::PSFQuerySharedSection(package_index_section_id, &sharedSize))
+    {
+        if (auto index = map_package_index_section(section, sharedSize))
+        {
+            g_packageIndex.store(index, std::memory_order_release);
+            return;
+        }
+    }
+
+    g_packageIndexPath = g_redirectRootPath / (L"PsfPackageIndex_"s + packageFullName + L".bin");
+    if (auto index = map_package_index())
+    {
+        g_packageIndex.store(index, std::memory_order_release);
+        return;
+    }
+
+    // NOTE: We never wait for this thread to exit; it doesn't take long, and waiting on it from within DllMain would
+    //       deadlock on the loader lock
+    psf::unique_handle thread(::CreateThread(nullptr, 0, PackageIndexBuildThread, nullptr, 0, nullptr));
+}
@@ -3,12 +3,25 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
-#include <regex>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <known_folders.h>
-#include <objbase.h>
+#include <pattern_matcher.h>
 #include <psf_framework.h>
+#include <scratch_arena.h>
 #include <utilities.h>
 
 #include "FunctionImplementations.h"
@@ -25,10 +38,27 @@ struct vfs_folder_mapping
     std::filesystem::path path;
     std::filesystem::path package_vfs_relative_path; // E.g. "Windows"
 };
+
+// Sorted (case-insensitively) by package_vfs_relative_path. None of the VFS folder names contain a path separator, so
+// the path component immediately following "VFS\" identifies the mapping, if any, and can be binary searched for
+// NOTE: Resolving these takes a dozen or so known folder lookups, so it's put off until the first path under the
+//       package's VFS folder needs to be de-virtualized. See initialize_vfs_folder_mappings
 std::vector<vfs_folder_mapping> g_vfsFolderMappings;
+std::once_flag g_vfsFolderMappingsInitialized;
+
+// The redirect root is created the first time that something gets created under it, rather than at startup, since most
+// processes never write to a redirected path
+std::atomic<bool> g_redirectRootCreated = false;
+
+static iwstring_view vfs_folder_name(const vfs_folder_mapping& mapping) noexcept
+{
+    auto& name = mapping.package_vfs_relative_path.native();
+    return iwstring_view(name.c_str(), name.length());
+}
 
 void InitializePaths()
 {
+    // NOTE: This runs within DllMain, so only do what's cheap. Everything else gets deferred until it's needed
     // For path comparison's sake - and the fact that std::filesystem::path doesn't handle (root-)local device paths all
     // that well - ensure that these paths are drive-absolute
     auto packageRootPath = ::PSFQueryPackageRootPath();
@@ -40,11 +70,21 @@ void InitializePaths()
     assert(psf::path_type(packageRootPath) == psf::dos_path_type::drive_absolute);
     g_packageRootPath = psf::remove_trailing_path_separators(packageRootPath);
     g_packageVfsRootPath = g_packageRootPath / L"VFS";
+}
 
-    // Ensure that the redirected root path exists
-    g_redirectRootPath = psf::known_folder(FOLDERID_LocalAppData) / L"VFS";
-    impl::CreateDirectory(g_redirectRootPath.c_str(), nullptr);
+void EnsureRedirectRootExists() noexcept
+{
+    if (!g_redirectRootCreated)
+    {
+        auto lastError = ::GetLastError();
+        impl::CreateDirectory(g_redirectRootPath.c_str(), nullptr);
+        g_redirectRootCreated = true;
+        ::SetLastError(lastError);
+    }
+}
 
+static void initialize_vfs_folder_mappings()
+{
     // Folder IDs and their desktop bridge packaged VFS location equivalents. Taken from:
     // https://docs.microsoft.com/en-us/windows/uwp/porting/desktop-to-uwp-behind-the-scenes
     //      System Location                 Redirected Location (Under [PackageRoot]\VFS)   Valid on architectures
@@ -62,27 +102,90 @@ void InitializePaths()
     //      FOLDERID_System\driverstore     AppVSystem32Driverstore                         x86, amd64
     //      FOLDERID_System\logfiles        AppVSystem32Logfiles                            x86, amd64
     //      FOLDERID_System\spool           AppVSystem32Spool                               x86, amd64
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_SystemX86), LR"(SystemX86)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_ProgramFilesX86), LR"(ProgramFilesX86)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_ProgramFilesCommonX86), LR"(ProgramFilesCommonX86)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_SystemX86), LR"(SystemX86)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_ProgramFilesX86), LR"(ProgramFilesX86)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_ProgramFilesCommonX86), LR"(ProgramFilesCommonX86)"sv });
 #if !_M_IX86
     // FUTURE: We may want to consider the possibility of a 32-bit application trying to reference "%windir%\sysnative\"
     //         in which case we'll have to get smarter about how we resolve paths
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System), LR"(SystemX64)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System), LR"(SystemX64)"sv });
     // FOLDERID_ProgramFilesX64* not supported for 32-bit applications
     // FUTURE: We may want to consider the possibility of a 32-bit process trying to access this path anyway. E.g. a
     //         32-bit child process of a 64-bit process that set the current directory
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_ProgramFilesX64), LR"(ProgramFilesX64)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_ProgramFilesCommonX64), LR"(ProgramFilesCommonX64)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_ProgramFilesX64), LR"(ProgramFilesX64)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_ProgramFilesCommonX64), LR"(ProgramFilesCommonX64)"sv });
 #endif
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_Windows), LR"(Windows)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_ProgramData), LR"(Common AppData)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System) / LR"(catroot)"sv, LR"(AppVSystem32Catroot)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System) / LR"(catroot2)"sv, LR"(AppVSystem32Catroot2)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System) / LR"(drivers\etc)"sv, LR"(AppVSystem32DriversEtc)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System) / LR"(driverstore)"sv, LR"(AppVSystem32Driverstore)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System) / LR"(logfiles)"sv, LR"(AppVSystem32Logfiles)"sv });
-    g_vfsFolderMappings.push_back(vfs_folder_mapping{ psf::known_folder(FOLDERID_System) / LR"(spool)"sv, LR"(AppVSystem32Spool)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_Windows), LR"(Windows)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_ProgramData), LR"(Common AppData)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System) / LR"(catroot)"sv, LR"(AppVSystem32Catroot)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System) / LR"(catroot2)"sv, LR"(AppVSystem32Catroot2)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System) / LR"(drivers\etc)"sv, LR"(AppVSystem32DriversEtc)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System) / LR"(driverstore)"sv, LR"(AppVSystem32Driverstore)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System) / LR"(logfiles)"sv, LR"(AppVSystem32Logfiles)"sv });
+    g_vfsFolderMappings.push_back(vfs_folder_mapping{ ::PSFQueryKnownFolder(FOLDERID_System) / LR"(spool)"sv, LR"(AppVSystem32Spool)"sv });
+
+    std::sort(g_vfsFolderMappings.begin(), g_vfsFolderMappings.end(), [](const vfs_folder_mapping& lhs, const vfs_folder_mapping& rhs)
+    {
+        return vfs_folder_name(lhs) < vfs_folder_name(rhs);
+    });
+}
+
+// Same format as IIDFromString accepts, i.e. "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}", which saves importing ole32 for it
+static bool try_parse_guid(std::wstring_view str, GUID& id) noexcept
+{
+    if ((str.length() != 38) || (str[0] != L'{') || (str[37] != L'}') ||
+        (str[9] != L'-') || (str[14] != L'-') || (str[19] != L'-') || (str[24] != L'-'))
+    {
+        return false;
+    }
+
+    std::uint64_t value = 0;
+    std::size_t digits = 0;
+    for (std::size_t i = 1; i < 37; ++i)
+    {
+        // The dashes were checked above. Anything else that isn't a digit, including a dash anywhere else, is invalid
+        auto ch = str[i];
+        if ((i == 9) || (i == 14) || (i == 19) || (i == 24))
+        {
+            continue;
+        }
+
+        std::uint64_t digit;
+        if ((ch >= L'0') && (ch <= L'9'))
+        {
+            digit = ch - L'0';
+        }
+        else if ((ch >= L'a') && (ch <= L'f'))
+        {
+            digit = ch - L'a' + 10;
+        }
+        else if ((ch >= L'A') && (ch <= L'F'))
+        {
+            digit = ch - L'A' + 10;
+        }
+        else
+        {
+            return false;
+        }
+
+        value = (value << 4) | digit;
+        switch (++digits)
+        {
+        case 8: id.Data1 = static_cast<unsigned long>(value); value = 0; break;
+        case 12: id.Data2 = static_cast<unsigned short>(value); value = 0; break;
+        case 16: id.Data3 = static_cast<unsigned short>(value); value = 0; break;
+        default:
+            // The last 16 digits are Data4, one byte per pair of digits
+            if ((digits > 16) && (digits % 2 == 0))
+            {
+                id.Data4[(digits - 18) / 2] = static_cast<unsigned char>(value);
+                value = 0;
+            }
+            break;
+        }
+    }
+
+    return digits == 32;
 }
 
 std::filesystem::path path_from_known_folder_string(std::wstring_view str)
@@ -130,7 +233,7 @@ std::filesystem::path path_from_known_folder_string(std::wstring_view str)
     }
     else if ((str.length() >= 38) && (str[0] == '{'))
     {
-        if (FAILED(::IIDFromString(str.data(), &id)))
+        if (!try_parse_guid(str, id))
         {
             return {};
         }
@@ -141,307 +244,1707 @@ std::filesystem::path path_from_known_folder_string(std::wstring_view str)
         return {};
     }
 
-    return psf::known_folder(id);
+    return ::PSFQueryKnownFolder(id);
 }
 
-struct path_redirection_spec
+// The collection of patterns associated with a single base path, grouped by shape so that the common cases can be
+// answered with a hash lookup or a string compare instead of evaluating each pattern in turn
+// NOTE: The string_views and pointers reference the specs of the owning redirection_snapshot, so those must not be
+//       modified once these sets have been constructed
+struct redirection_pattern_set
 {
-    std::filesystem::path base_path;
-    std::wregex pattern;
-};
+    bool match_all = false; // I.e. the pattern ".*"
+    std::unordered_set<std::wstring_view> exact;
+    std::vector<std::pair<std::size_t, std::unordered_set<std::wstring_view>>> suffixes; // Grouped by literal length
+    std::vector<std::wstring_view> prefixes;
+    std::vector<const path_redirection_spec*> general;
 
-std::vector<path_redirection_spec> g_redirectionSpecs;
+    bool empty() const noexcept
+    {
+        return !match_all && exact.empty() && suffixes.empty() && prefixes.empty() && general.empty();
+    }
 
-void InitializeConfiguration()
-{
-    if (auto rootConfig = ::PSFQueryCurrentDllConfig())
+    void add(const path_redirection_spec& spec)
     {
-        auto& rootObject = rootConfig->as_object();
-        if (auto pathsValue = rootObject.try_get("redirectedPaths"))
+        std::wstring_view literal = spec.literal;
+        switch (spec.shape)
         {
-            auto& redirectedPathsObject = pathsValue->as_object();
-            auto initializeRedirection = [](const std::filesystem::path& basePath, const psf::json_array& specs)
+        case psf::pattern_shape::exact:
+            exact.insert(literal);
+            break;
+
+        case psf::pattern_shape::prefix:
+            prefixes.push_back(literal);
+            break;
+
+        case psf::pattern_shape::suffix:
+            if (literal.empty())
             {
-                for (auto& spec : specs)
-                {
-                    auto& specObject = spec.as_object();
-                    auto path = psf::remove_trailing_path_separators(basePath / specObject.get("base").as_string().wstring());
-                    for (auto& pattern : specObject.get("patterns").as_array())
-                    {
-                        auto patternString = pattern.as_string().wstring();
+                match_all = true;
+                break;
+            }
 
-                        g_redirectionSpecs.emplace_back();
-                        g_redirectionSpecs.back().base_path = path;
-                        g_redirectionSpecs.back().pattern.assign(patternString.data(), patternString.length());
-                    }
-                }
-            };
+            if (auto itr = std::find_if(suffixes.begin(), suffixes.end(), [&](auto& group) { return group.first == literal.length(); });
+                itr != suffixes.end())
+            {
+                itr->second.insert(literal);
+            }
+            else
+            {
+                suffixes.emplace_back(literal.length(), std::unordered_set<std::wstring_view>{ literal });
+            }
+            break;
+
+        default:
+            general.push_back(&spec);
+            break;
+        }
+    }
+
+    bool match(const wchar_t* relativePath) const
+    {
+        std::wstring_view path = relativePath;
+        if (match_all && psf::pattern_wildcard_match(path))
+        {
+            return true;
+        }
 
-            if (auto packageRelativeValue = redirectedPathsObject.try_get("packageRelative"))
+        if (!exact.empty() && (exact.find(path) != exact.end()))
+        {
+            return true;
+        }
+
+        for (auto& [length, literals] : suffixes)
+        {
+            if ((path.length() >= length) &&
+                (literals.find(path.substr(path.length() - length)) != literals.end()) &&
+                psf::pattern_wildcard_match(path.substr(0, path.length() - length)))
             {
-                initializeRedirection(g_packageRootPath, packageRelativeValue->as_array());
+                return true;
             }
+        }
 
-            if (auto packageDriveRelativeValue = redirectedPathsObject.try_get("packageDriveRelative"))
+        for (auto& prefix : prefixes)
+        {
+            if ((path.substr(0, prefix.length()) == prefix) && psf::pattern_wildcard_match(path.substr(prefix.length())))
             {
-                initializeRedirection(g_packageRootPath.root_name(), packageDriveRelativeValue->as_array());
+                return true;
             }
+        }
 
-            if (auto knownFoldersValue = redirectedPathsObject.try_get("knownFolders"))
+        for (auto spec : general)
+        {
+            if (spec->pattern.match(relativePath))
             {
-                for (auto& knownFolderValue : knownFoldersValue->as_array())
-                {
-                    auto& knownFolderObject = knownFolderValue.as_object();
-                    auto path = path_from_known_folder_string(knownFolderObject.get("id").as_string().wstring());
-                    if (!path.empty())
-                    {
-                        initializeRedirection(path, knownFolderObject.get("relativePaths").as_array());
-                    }
-                }
+                return true;
             }
         }
-    }
-}
 
-bool path_relative_to(const wchar_t* path, const std::filesystem::path& basePath)
-{
-    return std::equal(basePath.native().begin(), basePath.native().end(), path, psf::path_compare{});
-}
+        return false;
+    }
+};
 
-template <typename CharT>
-normalized_path NormalizePathImpl(const CharT* path)
+// Case-insensitive trie of path components built from the base paths of the redirection specs. This lets us identify all
+// candidate specs for a path in a single walk rather than performing a prefix compare against every configured base
+// path. E.g. the base path "C:\Program Files\Contoso" gets represented as the node chain "C:" -> "Program Files" ->
+// "Contoso", with the spec's pattern stored on the last node, in the set for the spec's target
+struct redirection_spec_node
 {
-    normalized_path result;
+    std::wstring name;
+    redirection_pattern_set patterns[redirect_target_count];
+    bool has_patterns = false;
+    std::vector<redirection_spec_node> children;
 
-    auto pathType = psf::path_type(path);
-    if (pathType == psf::dos_path_type::root_local_device)
-    {
-        // Root-local device paths are a direct escape into the object manager, so don't normalize them
-        result.full_path = widen(path);
-    }
-    else if (pathType != psf::dos_path_type::unknown)
-    {
-        result.full_path = widen(psf::full_path(path));
-        pathType = psf::path_type(result.full_path.c_str());
-    }
-    else // unknown
+    const redirection_spec_node* try_get_child(std::wstring_view component) const noexcept
     {
-        return result;
-    }
+        for (auto& child : children)
+        {
+            if ((child.name.length() == component.length()) &&
+                psf::path_equal(component.data(), child.name.c_str(), component.length()))
+            {
+                return &child;
+            }
+        }
 
-    if (pathType == psf::dos_path_type::drive_absolute)
-    {
-        result.drive_absolute_path = result.full_path.data();
+        return nullptr;
     }
-    else if ((pathType == psf::dos_path_type::local_device) || (pathType == psf::dos_path_type::root_local_device))
+};
+
+// Most paths that applications use (system dlls, fonts, temp files, etc.) never come anywhere near a redirected path.
+// The prefilter rejects those without the cost of normalizing them (i.e. a GetFullPathName call), based off of the drive
+// and the first folder under it for every spec's base path, the latter kept as sorted hashes of their case-folded names.
+// The package's VFS folder gets added too, since paths under it de-virtualize to somewhere else entirely. Only plain
+// drive-absolute paths can be rejected: relative paths, UNC paths, and anything with a "." or ".." component (which
+// normalization could resolve to a different folder) still get normalized like before
+class redirection_prefilter
+{
+public:
+
+    void add(const std::filesystem::path& basePath) noexcept try
     {
-        auto candidatePath = result.full_path.data() + 4;
-        if (psf::path_type(candidatePath) == psf::dos_path_type::drive_absolute)
+        auto path = basePath.c_str();
+        auto drive = drive_index(path[0]);
+        if ((drive < 0) || (path[1] != L':') || (path[2] && !psf::is_path_separator(path[2])))
         {
-            result.drive_absolute_path = candidatePath;
+            // E.g. a known folder on a network share. Nothing can be rejected without normalizing it first
+            m_enabled = false;
+            return;
+        }
+
+        m_drives |= 1u << drive;
+        path += path[2] ? 3 : 2;
+        std::uint32_t hash;
+        if (!folder_hash(drive, path, hash))
+        {
+            m_wholeDrives |= 1u << drive;
+            return;
         }
+
+        m_folders.insert(std::lower_bound(m_folders.begin(), m_folders.end(), hash), hash);
     }
-    else if (pathType == psf::dos_path_type::unc_absolute)
+    catch (...)
     {
-        // We assume that UNC paths will never reference a path that we need to redirect. Note that this isn't perfect.
-        // E.g. "\\localhost\C$\foo\bar.txt" is the same path as "C:\foo\bar.txt"; we shall defer solving this problem
-        return result;
+        m_enabled = false;
     }
-    else
+
+    template <typename CharT>
+    bool may_match(const CharT* path) const noexcept
     {
-        // GetFullPathName did something odd...
-        assert(false);
-        return {};
+        if (!m_enabled)
+        {
+            return true;
+        }
+
+        if ((path[0] == '\\') && (path[1] == '\\') && ((path[2] == '?') || (path[2] == '.')) && (path[3] == '\\'))
+        {
+            path += 4;
+        }
+
+        auto drive = drive_index(path[0]);
+        if ((drive < 0) || (path[1] != ':') || !psf::is_path_separator(path[2]))
+        {
+            return true;
+        }
+
+        // NOTE: Normalization never changes the drive, even with ".." components
+        auto driveBit = 1u << drive;
+        if ((m_drives & driveBit) == 0)
+        {
+            return false;
+        }
+        else if (m_wholeDrives & driveBit)
+        {
+            return true;
+        }
+
+        path += 3;
+        std::uint32_t hash;
+        if (!folder_hash(drive, path, hash) || std::binary_search(m_folders.begin(), m_folders.end(), hash))
+        {
+            return true;
+        }
+
+        // "C:\Windows\..\Program Files" isn't under "C:\Windows"
+        for (; *path; ++path)
+        {
+            if ((path[0] == '.') && psf::is_path_separator(path[-1]))
+            {
+                return true;
+            }
+        }
+
+        return false;
     }
 
-    return result;
-}
+private:
 
-normalized_path NormalizePath(const char* path)
-{
-    return NormalizePathImpl(path);
-}
+    template <typename CharT>
+    static int drive_index(CharT ch) noexcept
+    {
+        if ((ch >= 'a') && (ch <= 'z'))
+        {
+            return ch - 'a';
+        }
+        else if ((ch >= 'A') && (ch <= 'Z'))
+        {
+            return ch - 'A';
+        }
 
-normalized_path NormalizePath(const wchar_t* path)
-{
-    return NormalizePathImpl(path);
-}
+        return -1;
+    }
 
-normalized_path DeVirtualizePath(normalized_path path)
-{
-    if (path.drive_absolute_path && path_relative_to(path.drive_absolute_path, g_packageVfsRootPath))
+    // Hashes the folder name that 'path' starts with, advancing 'path' past it. Returns false if the name can't be
+    // trusted to be the folder that the path normalizes to: it's empty (e.g. "C:\\Windows"), may get trimmed by
+    // normalization (trailing dots and spaces, which includes "." and ".."), or isn't ASCII in a narrow string, whose
+    // code page we don't know
+    template <typename CharT>
+    static bool folder_hash(int drive, const CharT*& path, std::uint32_t& hash) noexcept
     {
-        auto packageRelativePath = path.drive_absolute_path + g_packageVfsRootPath.native().length();
-        if (psf::is_path_separator(packageRelativePath[0]))
+        // FNV-1a
+        hash = 2166136261u ^ static_cast<std::uint32_t>(drive);
+        hash *= 16777619u;
+
+        auto begin = path;
+        for (; *path && !psf::is_path_separator(*path); ++path)
         {
-            ++packageRelativePath;
-            for (auto& mapping : g_vfsFolderMappings)
+            wchar_t ch;
+            if constexpr (psf::is_ansi<CharT>)
             {
-                if (path_relative_to(packageRelativePath, mapping.package_vfs_relative_path))
+                if (static_cast<unsigned char>(*path) >= 0x80)
                 {
-                    auto vfsRelativePath = packageRelativePath + mapping.package_vfs_relative_path.native().length();
-                    if (psf::is_path_separator(vfsRelativePath[0]))
-                    {
-                        ++vfsRelativePath;
-                    }
-                    else if (vfsRelativePath[0])
-                    {
-                        // E.g. AppVSystem32Catroot2, but matched with AppVSystem32Catroot. This is not the match we are
-                        // looking for
-                        continue;
-                    }
-
-                    // NOTE: We should have already validated that mapping.path is drive-absolute
-                    path.full_path = (mapping.path / vfsRelativePath).native();
-                    path.drive_absolute_path = path.full_path.data();
-                    break;
+                    return false;
                 }
+                ch = static_cast<wchar_t>(*path);
+            }
+            else
+            {
+                ch = *path;
             }
+
+            ch = (ch < 0x80) ? psf::details::ascii_fold(ch, false) : static_cast<wchar_t>(std::towlower(ch));
+            hash = (hash ^ ch) * 16777619u;
         }
-        // Otherwise a directory/file named something like "VFSx" for some non-path separator/null terminator 'x'
+
+        return (path != begin) && (path[-1] != '.') && (path[-1] != ' ');
     }
 
-    return path;
-}
+    bool m_enabled = true;
+    std::uint32_t m_drives = 0;
+    std::uint32_t m_wholeDrives = 0;
+    std::vector<std::uint32_t> m_folders;
+};
 
-std::wstring RedirectedPath(const normalized_path& deVirtualizedPath, bool ensureDirectoryStructure)
+// The redirection specs are immutable once built. When "hotReload" is enabled, a reload builds a new snapshot and swaps
+// it in, so ShouldRedirect never has to take a lock to read the specs. Readers announce themselves by incrementing the
+// counter for the current phase, which lets the reload thread know when nobody can still be using the snapshot it just
+// replaced: after the swap it flips the phase and waits for the readers of the old phase to drain
+struct redirection_snapshot : psf::heap_object
 {
-    auto result = LR"(\\?\)" + g_redirectRootPath.native();
+    std::uint32_t version = 0;
+    path_redirection_specs specs;
+    redirection_spec_node root;
+    redirection_prefilter prefilter;
 
-    // NTFS doesn't allow colons in filenames, so simplest thing is to just substitute something in; use a dollar sign
-    // similar to what's done for UNC paths
-    assert(psf::path_type(deVirtualizedPath.drive_absolute_path) == psf::dos_path_type::drive_absolute);
-    result.push_back(L'\\');
-    result.push_back(deVirtualizedPath.drive_absolute_path[0]);
-    result.push_back('$');
+    // Whether any of the specs has a target other than the redirect root
+    bool has_volatile_targets = false;
+};
 
-    auto remainingLength = deVirtualizedPath.full_path.length();
-    remainingLength -= (deVirtualizedPath.drive_absolute_path - deVirtualizedPath.full_path.c_str());
-    remainingLength -= 2;
-    std::wstring_view relativePath(deVirtualizedPath.drive_absolute_path + 2, remainingLength);
+std::atomic<const redirection_snapshot*> g_redirectionSnapshot = nullptr;
+std::atomic<bool> g_redirectionSnapshotReloadable = false;
+std::atomic<std::uint32_t> g_redirectionSnapshotPhase = 0;
+struct alignas(64) redirection_snapshot_reader_count
+{
+    std::atomic<std::uint32_t> value = 0;
+};
+redirection_snapshot_reader_count g_redirectionSnapshotReaders[2];
 
-    if (ensureDirectoryStructure)
+// Keeps the current snapshot alive for as long as it's in scope
+class redirection_snapshot_reader
+{
+public:
+
+    redirection_snapshot_reader() noexcept
     {
-        for (std::size_t pos = 0; pos < relativePath.length(); )
+        // Snapshots only ever get freed if they can be replaced, so otherwise there's nobody to announce ourselves to
+        if (g_redirectionSnapshotReloadable)
         {
-            [[maybe_unused]] auto dirResult = impl::CreateDirectory(result.c_str(), nullptr);
-#if _DEBUG
-            auto err = ::GetLastError();
-            assert(dirResult || (err == ERROR_ALREADY_EXISTS));
-#endif
-            auto nextPos = relativePath.find_first_of(LR"(\/)", pos + 1);
-            if (nextPos == relativePath.length())
+            // NOTE: If the phase changes in between, the reload thread may have already checked the counter that we
+            //       incremented, so start over with the new phase
+            for (;;)
             {
-                // Ignore trailing path separators. E.g. if the call is to CreateDirectory, we don't want it to "fail"
-                // with an "already exists" error
-                nextPos = std::wstring_view::npos;
+                auto phase = g_redirectionSnapshotPhase.load();
+                m_readers = &g_redirectionSnapshotReaders[phase % 2].value;
+                ++*m_readers;
+                if (g_redirectionSnapshotPhase.load() == phase)
+                {
+                    break;
+                }
+                --*m_readers;
             }
-
-            result += relativePath.substr(pos, nextPos - pos);
-            pos = nextPos;
         }
+
+        m_snapshot = g_redirectionSnapshot.load();
     }
-    else
+
+    ~redirection_snapshot_reader()
     {
-        result += relativePath;
+        if (m_readers)
+        {
+            --*m_readers;
+        }
     }
 
-    return result;
-}
+    redirection_snapshot_reader(const redirection_snapshot_reader&) = delete;
+    redirection_snapshot_reader& operator=(const redirection_snapshot_reader&) = delete;
 
-template <typename CharT>
-static path_redirect_info ShouldRedirectImpl(const CharT* path, redirect_flags flags)
-{
-    path_redirect_info result;
+    const redirection_snapshot* operator->() const noexcept
+    {
+        return m_snapshot;
+    }
 
-    if (!path)
+    const redirection_snapshot& operator*() const noexcept
     {
-        return result;
+        return *m_snapshot;
     }
 
-    auto normalizedPath = NormalizePath(path);
-    if (!normalizedPath.drive_absolute_path)
+    explicit operator bool() const noexcept
     {
-        // FUTURE: We could do better about canonicalising paths, but the cost/benefit doesn't make it worth it right now
-        return result;
+        return m_snapshot != nullptr;
     }
 
-    // To be consistent in where we redirect files, we need to map VFS paths to their non-package-relative equivalent
-    normalizedPath = DeVirtualizePath(std::move(normalizedPath));
+private:
+
+    std::atomic<std::uint32_t>* m_readers = nullptr;
+    const redirection_snapshot* m_snapshot = nullptr;
+};
 
-    // Figure out if this is something we need to redirect
-    for (auto& redirectSpec : g_redirectionSpecs)
+void VisitRedirectionSpecs(const std::function<void(const path_redirection_specs& specs, std::uint32_t version)>& fn)
+{
+    redirection_snapshot_reader snapshot;
+    if (snapshot)
     {
-        if (path_relative_to(normalizedPath.drive_absolute_path, redirectSpec.base_path))
-        {
-            auto relativePath = normalizedPath.drive_absolute_path + redirectSpec.base_path.native().length();
-            if (psf::is_path_separator(relativePath[0]))
-            {
-                ++relativePath;
-            }
-            else if (relativePath[0])
-            {
-                // Otherwise, just a substring match (e.g. we're trying to match against 'foo' but input was 'foobar')
-                continue;
-            }
-            // Otherwise exact match. Assume an implicit directory separator at the end (e.g. for matches to satisfy the
-            // first call to CreateDirectory
+        fn(snapshot->specs, snapshot->version);
+    }
+}
 
-            if (std::regex_match(relativePath, redirectSpec.pattern))
-            {
-                result.should_redirect = true;
-                break;
-            }
-        }
+static void publish_redirection_snapshot(std::unique_ptr<redirection_snapshot> snapshot)
+{
+    // NOTE: Only the initial load and the reload thread publish snapshots, and never at the same time
+    auto previous = g_redirectionSnapshot.exchange(snapshot.release());
+    if (!previous)
+    {
+        return;
     }
+    assert(g_redirectionSnapshotReloadable);
 
-    if (!result.should_redirect)
+    auto phase = g_redirectionSnapshotPhase++;
+    while (g_redirectionSnapshotReaders[phase % 2].value.load() != 0)
     {
-        return result;
+        ::Sleep(1);
     }
 
-    result.redirect_path = RedirectedPath(normalizedPath, flag_set(flags, redirect_flags::ensure_directory_structure));
+    delete previous;
+}
 
-    if (flag_set(flags, redirect_flags::check_file_presence) && !impl::PathExists(result.redirect_path.c_str()))
+// Returns the path component that starts at (or after any leading separators of) 'path' and advances 'path' to the
+// character immediately following it. An empty return value indicates that the end of the path was reached
+static std::wstring_view next_path_component(const wchar_t*& path) noexcept
+{
+    while (psf::is_path_separator(*path))
     {
-        result.should_redirect = false;
-        result.redirect_path.clear();
-        return result;
+        ++path;
+    }
+
+    auto begin = path;
+    while (*path && !psf::is_path_separator(*path))
+    {
+        ++path;
     }
 
-    if (flag_set(flags, redirect_flags::copy_file))
+    return { begin, static_cast<std::size_t>(path - begin) };
+}
+
+static void add_redirection_spec_node(redirection_snapshot& snapshot, const path_redirection_spec& spec)
+{
+    auto node = &snapshot.root;
+    auto path = spec.base_path.c_str();
+    for (auto component = next_path_component(path); !component.empty(); component = next_path_component(path))
     {
-        [[maybe_unused]] BOOL copyResult;
-        auto attr = impl::GetFileAttributes(normalizedPath.drive_absolute_path);
-        if ((attr & FILE_ATTRIBUTE_DIRECTORY) != FILE_ATTRIBUTE_DIRECTORY)
+        if (auto child = node->try_get_child(component))
         {
-            copyResult = impl::CopyFileEx(
-                normalizedPath.drive_absolute_path,
-                result.redirect_path.c_str(),
-                nullptr,
-                nullptr,
-                nullptr,
-                COPY_FILE_FAIL_IF_EXISTS | COPY_FILE_NO_BUFFERING);
+            node = const_cast<redirection_spec_node*>(child);
         }
         else
         {
-            copyResult = impl::CreateDirectoryEx(normalizedPath.drive_absolute_path, result.redirect_path.c_str(), nullptr);
+            node = &node->children.emplace_back();
+            node->name = component;
         }
-#if _DEBUG
-        auto err = ::GetLastError();
-        assert(copyResult || (err == ERROR_FILE_EXISTS) || (err == ERROR_PATH_NOT_FOUND) || (err == ERROR_FILE_NOT_FOUND) || (err == ERROR_ALREADY_EXISTS));
-#endif
     }
 
-    return result;
+    node->patterns[static_cast<std::size_t>(spec.target)].add(spec);
+    node->has_patterns = true;
 }
 
-path_redirect_info ShouldRedirect(const char* path, redirect_flags flags)
+// Builds the redirection specs from the fixup's configuration, or from the spec cache if it's enabled and up to date
+// How many paths a general pattern gets matched against before it's compiled to a DFA; until then, matching simulates
+// its NFA, so patterns that see little use never pay for the DFA. See pattern_matcher.h
+constexpr std::uint32_t default_pattern_compile_after = 8;
+std::uint32_t g_patternCompileAfter = default_pattern_compile_after;
+
+static std::unique_ptr<redirection_snapshot> load_redirection_snapshot(const psf::json_object* rootObject)
 {
-    return ShouldRedirectImpl(path, flags);
-}
+    static std::uint32_t nextVersion = 1;
 
-path_redirect_info ShouldRedirect(const wchar_t* path, redirect_flags flags)
+    auto snapshot = std::make_unique<redirection_snapshot>();
+    snapshot->version = nextVersion++;
+    if (!rootObject)
+    {
+        return snapshot;
+    }
+
+    const psf::json_object* specCacheConfig = nullptr;
+    if (auto specCacheValue = rootObject->try_get("redirectionSpecCache"))
+    {
+        specCacheConfig = &specCacheValue->as_object();
+    }
+
+    g_patternCompileAfter = default_pattern_compile_after;
+    if (auto compilationValue = rootObject->try_get("patternCompilation"))
+    {
+        if (auto compileAfterValue = compilationValue->as_object().try_get("compileAfter"))
+        {
+            g_patternCompileAfter = static_cast<std::uint32_t>(compileAfterValue->as_number().get_unsigned());
+        }
+    }
+
+    auto pathsValue = rootObject->try_get("redirectedPaths");
+    InitializeRedirectionSpecCache(specCacheConfig, pathsValue);
+    if (pathsValue && !LoadRedirectionSpecCache(snapshot->specs))
+    {
+        // Known folders that are identified by GUID may be redirected by the user, so the cache needs to check
+        // that they still resolve to the same path
+        std::vector<redirection_spec_cache_folder> cacheFolders;
+
+        auto& redirectedPathsObject = pathsValue->as_object();
+        auto initializeRedirection = [&](const std::filesystem::path& basePath, const psf::json_array& specs)
+        {
+            for (auto& spec : specs)
+            {
+                auto& specObject = spec.as_object();
+                auto path = psf::remove_trailing_path_separators(basePath / specObject.get("base").as_string().wstring());
+
+                auto target = redirect_target::persistent;
+                if (auto targetValue = specObject.try_get("target");
+                    targetValue && !TryParseRedirectTarget(targetValue->as_string().wstring(), target))
+                {
+                    throw std::runtime_error("Unknown target in the \"redirectedPaths\" configuration: " +
+                        std::string(targetValue->as_string().string()));
+                }
+
+                for (auto& pattern : specObject.get("patterns").as_array())
+                {
+                    auto patternString = pattern.as_string().wstring();
+
+                    auto& redirectSpec = snapshot->specs.emplace_back();
+                    redirectSpec.base_path = path;
+                    redirectSpec.target = target;
+
+                    auto [shape, literal] = psf::classify_pattern(patternString);
+                    redirectSpec.shape = shape;
+                    redirectSpec.literal = std::move(literal);
+                    if (shape == psf::pattern_shape::general)
+                    {
+                        redirectSpec.pattern.assign(patternString, g_patternCompileAfter);
+                        redirectSpec.source = patternString;
+                    }
+                }
+            }
+        };
+
+        if (auto packageRelativeValue = redirectedPathsObject.try_get("packageRelative"))
+        {
+            initializeRedirection(g_packageRootPath, packageRelativeValue->as_array());
+        }
+
+        if (auto packageDriveRelativeValue = redirectedPathsObject.try_get("packageDriveRelative"))
+        {
+            initializeRedirection(g_packageRootPath.root_name(), packageDriveRelativeValue->as_array());
+        }
+
+        if (auto knownFoldersValue = redirectedPathsObject.try_get("knownFolders"))
+        {
+            for (auto& knownFolderValue : knownFoldersValue->as_array())
+            {
+                auto& knownFolderObject = knownFolderValue.as_object();
+                auto id = knownFolderObject.get("id").as_string().wstring();
+                auto path = path_from_known_folder_string(id);
+                if (!id.empty() && (id[0] == L'{'))
+                {
+                    cacheFolders.push_back(redirection_spec_cache_folder{ std::wstring(id), path.native() });
+                }
+
+                if (!path.empty())
+                {
+                    initializeRedirection(path, knownFolderObject.get("relativePaths").as_array());
+                }
+            }
+        }
+
+        SaveRedirectionSpecCache(snapshot->specs, cacheFolders);
+    }
+
+    // NOTE: The trie references the specs, so they must all be in place before we start
+    for (auto& spec : snapshot->specs)
+    {
+        add_redirection_spec_node(*snapshot, spec);
+        snapshot->prefilter.add(spec.base_path);
+        snapshot->has_volatile_targets |= (spec.target != redirect_target::persistent);
+    }
+    snapshot->prefilter.add(g_packageVfsRootPath);
+
+    return snapshot;
+}
+
+void EnableRedirectionReload() noexcept
+{
+    g_redirectionSnapshotReloadable = true;
+}
+
+bool ReloadRedirectionConfiguration() noexcept try
+{
+    auto rootConfig = ::PSFReloadCurrentDllConfig();
+    if (!rootConfig)
+    {
+        // Most likely caught the file in the middle of being written. Keep what we have; the write that finishes it
+        // off will trigger another reload
+        return false;
+    }
+
+    publish_redirection_snapshot(load_redirection_snapshot(&rootConfig->as_object()));
+    ResetAdaptiveBypass();
+    return true;
+}
+catch (...)
+{
+    // E.g. an invalid pattern. Keep using the current configuration
+    return false;
+}
+
+void InitializeConfiguration()
+{
+    g_redirectRootPath = ::PSFQueryKnownFolder(FOLDERID_LocalAppData) / L"VFS";
+
+    const psf::json_object* rootObject = nullptr;
+    const psf::json_object* indexConfig = nullptr;
+    const psf::json_array* warmupConfig = nullptr;
+    const psf::json_object* deltaOverlayConfig = nullptr;
+    const psf::json_object* listingCacheConfig = nullptr;
+    const psf::json_object* profileCacheConfig = nullptr;
+    const psf::json_object* ntRedirectionConfig = nullptr;
+    const psf::json_object* telemetryConfig = nullptr;
+    const psf::json_object* hotReloadConfig = nullptr;
+    const psf::json_object* tombstonesConfig = nullptr;
+    const psf::json_object* attributeOverridesConfig = nullptr;
+    const psf::json_object* copyThrottleConfig = nullptr;
+    const psf::json_object* pipelinedCopyConfig = nullptr;
+    const psf::json_object* packageIndexConfig = nullptr;
+    const psf::json_object* hooksConfig = nullptr;
+    const psf::json_object* relativePathCacheConfig = nullptr;
+    const psf::json_object* wholeDirectoryCopyConfig = nullptr;
+    const psf::json_object* seedConfig = nullptr;
+    const psf::json_object* layoutConfig = nullptr;
+    const psf::json_object* targetsConfig = nullptr;
+    const psf::json_object* decisionSnapshotConfig = nullptr;
+    const psf::json_object* adaptiveBypassConfig = nullptr;
+    if (auto rootConfig = ::PSFQueryCurrentDllConfig())
+    {
+        rootObject = &rootConfig->as_object();
+        if (auto indexValue = rootObject->try_get("redirectedPathIndex"))
+        {
+            indexConfig = &indexValue->as_object();
+        }
+
+        if (auto warmupValue = rootObject->try_get("warmup"))
+        {
+            warmupConfig = &warmupValue->as_array();
+        }
+
+        if (auto deltaOverlayValue = rootObject->try_get("deltaOverlay"))
+        {
+            deltaOverlayConfig = &deltaOverlayValue->as_object();
+        }
+
+        if (auto listingCacheValue = rootObject->try_get("directoryListingCache"))
+        {
+            listingCacheConfig = &listingCacheValue->as_object();
+        }
+
+        if (auto profileCacheValue = rootObject->try_get("privateProfileCache"))
+        {
+            profileCacheConfig = &profileCacheValue->as_object();
+        }
+
+        if (auto ntRedirectionValue = rootObject->try_get("ntRedirection"))
+        {
+            ntRedirectionConfig = &ntRedirectionValue->as_object();
+        }
+
+        if (auto telemetryValue = rootObject->try_get("telemetry"))
+        {
+            telemetryConfig = &telemetryValue->as_object();
+        }
+
+        if (auto hotReloadValue = rootObject->try_get("hotReload"))
+        {
+            hotReloadConfig = &hotReloadValue->as_object();
+        }
+
+        if (auto tombstonesValue = rootObject->try_get("tombstones"))
+        {
+            tombstonesConfig = &tombstonesValue->as_object();
+        }
+
+        if (auto attributeOverridesValue = rootObject->try_get("attributeOverrides"))
+        {
+            attributeOverridesConfig = &attributeOverridesValue->as_object();
+        }
+
+        if (auto copyThrottleValue = rootObject->try_get("copyThrottle"))
+        {
+            copyThrottleConfig = &copyThrottleValue->as_object();
+        }
+
+        if (auto pipelinedCopyValue = rootObject->try_get("pipelinedCopy"))
+        {
+            pipelinedCopyConfig = &pipelinedCopyValue->as_object();
+        }
+
+        if (auto packageIndexValue = rootObject->try_get("packageIndex"))
+        {
+            packageIndexConfig = &packageIndexValue->as_object();
+        }
+
+        if (auto hooksValue = rootObject->try_get("hooks"))
+        {
+            hooksConfig = &hooksValue->as_object();
+        }
+
+        if (auto relativePathCacheValue = rootObject->try_get("relativePathCache"))
+        {
+            relativePathCacheConfig = &relativePathCacheValue->as_object();
+        }
+
+        if (auto wholeDirectoryCopyValue = rootObject->try_get("copyWholeDirectory"))
+        {
+            wholeDirectoryCopyConfig = &wholeDirectoryCopyValue->as_object();
+        }
+
+        if (auto seedValue = rootObject->try_get("seed"))
+        {
+            seedConfig = &seedValue->as_object();
+        }
+
+        if (auto layoutValue = rootObject->try_get("hashedLayout"))
+        {
+            layoutConfig = &layoutValue->as_object();
+        }
+
+        if (auto targetsValue = rootObject->try_get("redirectTargets"))
+        {
+            targetsConfig = &targetsValue->as_object();
+        }
+
+        if (auto decisionSnapshotValue = rootObject->try_get("decisionSnapshot"))
+        {
+            decisionSnapshotConfig = &decisionSnapshotValue->as_object();
+        }
+
+        if (auto adaptiveBypassValue = rootObject->try_get("adaptiveBypass"))
+        {
+            adaptiveBypassConfig = &adaptiveBypassValue->as_object();
+        }
+    }
+
+    // NOTE: Before anything can ask for a redirected path
+    InitializeRedirectLayout(layoutConfig);
+    InitializeRedirectTargets(targetsConfig);
+    publish_redirection_snapshot(load_redirection_snapshot(rootObject));
+    InitializeRedirectDecisionSnapshot(decisionSnapshotConfig);
+
+    InitializeRedirectRootSeed(seedConfig);
+    InitializeRedirectedPathIndex(indexConfig);
+    InitializeDeltaOverlay(deltaOverlayConfig);
+    InitializeDirectoryListingCache(listingCacheConfig);
+    InitializeAttributePrefetch(listingCacheConfig);
+    InitializePackageFileTombstones(tombstonesConfig);
+    InitializeAttributeOverrides(attributeOverridesConfig);
+    InitializePackageMetadataIndex(packageIndexConfig);
+    InitializePrivateProfileCache(profileCacheConfig);
+    InitializeRelativePathCache(relativePathCacheConfig);
+    InitializeNtRedirection(ntRedirectionConfig);
+    InitializeHookSelection(hooksConfig);
+    InitializeCopyThrottle(copyThrottleConfig);
+    InitializePipelinedCopy(pipelinedCopyConfig);
+    InitializeWholeDirectoryCopy(wholeDirectoryCopyConfig);
+    InitializeRedirectionTelemetry(telemetryConfig);
+    InitializeAdaptiveBypass(adaptiveBypassConfig);
+    InitializeRedirectionHotReload(hotReloadConfig);
+    InitializeRedirectionWarmup(warmupConfig);
+    InitializeStartupProfile();
+}
+
+bool path_relative_to(const wchar_t* path, const std::filesystem::path& basePath)
+{
+    // NOTE: 'path' may be shorter than 'basePath', so make sure that it's long enough before comparing in bulk
+    auto& base = basePath.native();
+    return (::wcsnlen(path, base.length()) == base.length()) && psf::path_equal(path, base.c_str(), base.length());
+}
+
+template <typename CharT>
+normalized_path NormalizePathImpl(const CharT* path) noexcept
+{
+    normalized_path result;
+
+    auto pathType = psf::path_type(path);
+    if (pathType == psf::dos_path_type::unknown)
+    {
+        return result;
+    }
+
+    // NOTE: This runs on virtually every call, so failures (e.g. invalid characters in a narrow path or a failure to
+    //       allocate for a really long path) get reported the same way as a path that can't be redirected rather than
+    //       through exceptions
+    const wchar_t* widePath;
+    [[maybe_unused]] psf::path_buffer wideBuffer;
+    if constexpr (psf::is_ansi<CharT>)
+    {
+        if (try_widen_into(path, wideBuffer) != ERROR_SUCCESS)
+        {
+            return result;
+        }
+        widePath = wideBuffer.c_str();
+    }
+    else
+    {
+        widePath = path;
+    }
+
+    // Relative and rooted paths resolve against the current directory, so what they resolve to can be remembered until it
+    // changes. The generation gets read first, so that a change made while normalizing leaves the result stale, never wrong
+    std::uint32_t generation = 0;
+    std::size_t length = 0;
+    if ((pathType == psf::dos_path_type::relative) || (pathType == psf::dos_path_type::rooted))
+    {
+        generation = RelativePathCacheGeneration();
+        if (generation)
+        {
+            length = std::wcslen(widePath);
+            if (FindCachedRelativePath(widePath, length, generation, result))
+            {
+                return result;
+            }
+        }
+    }
+
+    if (pathType == psf::dos_path_type::root_local_device)
+    {
+        // Root-local device paths are a direct escape into the object manager, so don't normalize them
+        if (!result.full_path.try_reserve(std::wcslen(widePath)))
+        {
+            return result;
+        }
+        result.full_path.assign(widePath);
+        result.hash = psf::path_hash(result.full_path, result.components);
+    }
+    else
+    {
+        psf::canonical_path_info info;
+        info.components = &result.components;
+        if (psf::try_canonicalize_into(widePath, result.full_path, info) != ERROR_SUCCESS)
+        {
+            return result;
+        }
+        pathType = info.type;
+        result.hash = info.hash;
+    }
+
+    if (pathType == psf::dos_path_type::drive_absolute)
+    {
+        result.drive_absolute_path = result.full_path.data();
+    }
+    else if ((pathType == psf::dos_path_type::local_device) || (pathType == psf::dos_path_type::root_local_device))
+    {
+        auto candidatePath = result.full_path.data() + 4;
+        if (psf::path_type(candidatePath) == psf::dos_path_type::drive_absolute)
+        {
+            result.drive_absolute_path = candidatePath;
+        }
+    }
+    else if (pathType == psf::dos_path_type::unc_absolute)
+    {
+        // We assume that UNC paths will never reference a path that we need to redirect. Note that this isn't perfect.
+        // E.g. "\\localhost\C$\foo\bar.txt" is the same path as "C:\foo\bar.txt"; we shall defer solving this problem
+        return result;
+    }
+    else
+    {
+        // GetFullPathName did something odd...
+        assert(false);
+        return {};
+    }
+
+    if (generation)
+    {
+        CacheRelativePath(widePath, length, generation, result);
+    }
+
+    return result;
+}
+
+normalized_path NormalizePath(const char* path) noexcept
+{
+    return NormalizePathImpl(path);
+}
+
+normalized_path NormalizePath(const wchar_t* path) noexcept
+{
+    return NormalizePathImpl(path);
+}
+
+normalized_path DeVirtualizePath(normalized_path path)
+{
+    if (path.drive_absolute_path && path_relative_to(path.drive_absolute_path, g_packageVfsRootPath))
+    {
+        std::call_once(g_vfsFolderMappingsInitialized, initialize_vfs_folder_mappings);
+
+        auto packageRelativePath = path.drive_absolute_path + g_packageVfsRootPath.native().length();
+        if (psf::is_path_separator(packageRelativePath[0]))
+        {
+            ++packageRelativePath;
+            auto folderNameEnd = packageRelativePath;
+            while (*folderNameEnd && !psf::is_path_separator(*folderNameEnd))
+            {
+                ++folderNameEnd;
+            }
+
+            // NOTE: Matching the whole component means that e.g. AppVSystem32Catroot2 can't match AppVSystem32Catroot
+            iwstring_view folderName(packageRelativePath, static_cast<std::size_t>(folderNameEnd - packageRelativePath));
+            auto itr = std::lower_bound(g_vfsFolderMappings.begin(), g_vfsFolderMappings.end(), folderName,
+                [](const vfs_folder_mapping& mapping, iwstring_view name) { return vfs_folder_name(mapping) < name; });
+            if ((itr != g_vfsFolderMappings.end()) && (vfs_folder_name(*itr) == folderName))
+            {
+                auto vfsRelativePath = folderNameEnd;
+                if (*vfsRelativePath)
+                {
+                    ++vfsRelativePath;
+                }
+
+                // NOTE: We should have already validated that mapping.path is drive-absolute
+                psf::path_buffer deVirtualizedPath(itr->path.native());
+                deVirtualizedPath.push_back(L'\\');
+                deVirtualizedPath.append(vfsRelativePath);
+                path.full_path = std::move(deVirtualizedPath);
+                path.drive_absolute_path = path.full_path.data();
+                path.hash = psf::path_hash(path.full_path, path.components);
+            }
+        }
+        // Otherwise a directory/file named something like "VFSx" for some non-path separator/null terminator 'x'
+    }
+
+    return path;
+}
+
+// Set of directories under the redirect root that we know exist, either because we created them or because we tried to
+// and they already did. This saves us from making one CreateDirectory call per path component each time a redirected
+// file gets created. The set gets cleared whenever anything gets deleted or moved through one of our fixups (see
+// InvalidateRedirectCache) since that may have taken a directory with it. Creation is serialized under its own lock so
+// that concurrent threads building the same directory chain don't each issue the same CreateDirectory calls
+// NOTE: Directories that the redirected path index covers go by the index instead (see ensure_indexed_directories), and
+//       never get added to the set
+std::shared_mutex g_redirectDirectoriesMutex;
+std::set<iwstring> g_redirectDirectories;
+std::mutex g_redirectDirectoryCreationMutex;
+
+static bool redirect_directory_exists(const iwstring& path)
+{
+    std::shared_lock lock(g_redirectDirectoriesMutex);
+    return g_redirectDirectories.find(path) != g_redirectDirectories.end();
+}
+
+// The part of EnsureDirectoryStructure for when the redirected path index covers 'directory', the deepest directory that
+// needs to exist, in which case the index already knows which of the directories exist: finding where to start creating
+// them costs no disk queries, and since deletes only take what they deleted out of the index, knowing about everything
+// else survives them. Returns false if the index doesn't cover it
+static bool ensure_indexed_directories(std::wstring_view redirectPath, const iwstring& directory, std::size_t firstPos)
+{
+    std::size_t indexedLength;
+    if (!RedirectedDirectoryIndexed(directory.c_str(), indexedLength))
+    {
+        return false;
+    }
+
+    // Like RedirectedPathExists, only misses get trusted, so confirm that the deepest directory still exists. If it's
+    // gone, its parents may well be, too, so create all of them
+    auto stale = false;
+    if (indexedLength == directory.length())
+    {
+        if (impl::PathExists(directory.c_str()))
+        {
+            return true;
+        }
+
+        RedirectedPathDeleted(directory.c_str());
+        indexedLength = 0;
+        stale = true;
+    }
+
+    std::lock_guard creationLock(g_redirectDirectoryCreationMutex);
+
+    // Another thread may have created the directories while we were waiting on the lock
+    if (!stale && RedirectedDirectoryIndexed(directory.c_str(), indexedLength) && (indexedLength == directory.length()))
+    {
+        return true;
+    }
+
+    auto pos = (indexedLength == 0) ? firstPos : psf::find_path_separator(redirectPath, indexedLength + 1);
+    std::size_t createdLength = 0;
+    iwstring created;
+    for (; pos != std::wstring_view::npos; pos = psf::find_path_separator(redirectPath, pos + 1))
+    {
+        created.assign(redirectPath.data(), pos);
+        if (!impl::CreateDirectory(created.c_str(), nullptr) && (::GetLastError() != ERROR_ALREADY_EXISTS))
+        {
+            // Leave it to whatever the caller does with the path to fail, but don't let the index believe that it exists
+            break;
+        }
+
+        createdLength = pos;
+    }
+
+    // Also adds the parents to the index
+    if (createdLength != 0)
+    {
+        created.resize(createdLength);
+        RedirectedPathCreated(created.c_str());
+    }
+
+    return true;
+}
+
+// Creates each directory leading up to the last component of the redirected path, starting with the drive folder
+// immediately under the redirect root (e.g. "%LOCALAPPDATA%\VFS\C$")
+// NOTE: A trailing path separator means that the last component gets created too. E.g. if the call is to
+//       CreateDirectory, it will then "fail" with an "already exists" error, which matches prior behavior
+static void EnsureDirectoryStructure(std::wstring_view redirectPath)
+{
+    std::size_t rootLength;
+    auto target = RedirectTargetOfPath(redirectPath, rootLength);
+    EnsureRedirectTargetRootExists(target);
+
+    auto firstPos = psf::find_path_separator(redirectPath, rootLength + 1);
+    if (firstPos == std::wstring_view::npos)
+    {
+        return;
+    }
+
+    auto lastPos = psf::find_last_path_separator(redirectPath);
+    iwstring directory(redirectPath.data(), lastPos);
+    if (ensure_indexed_directories(redirectPath, directory, firstPos))
+    {
+        return;
+    }
+
+    if (redirect_directory_exists(directory))
+    {
+        // Directories can get removed without us knowing (e.g. the user clearing out the redirect root), so confirm that
+        // the deepest one still exists. That's still only one call versus one per path component. If it's gone, we
+        // can't trust anything else we know either
+        if (impl::PathExists(directory.c_str()))
+        {
+            return;
+        }
+
+        std::unique_lock lock(g_redirectDirectoriesMutex);
+        g_redirectDirectories.clear();
+    }
+
+    std::lock_guard creationLock(g_redirectDirectoryCreationMutex);
+
+    // Find the deepest directory that we already know exists. Since we always create from the root down, all of its
+    // parents are known to exist, too
+    auto pos = lastPos;
+    while (true)
+    {
+        directory.resize(pos);
+        if (redirect_directory_exists(directory))
+        {
+            pos = psf::find_path_separator(redirectPath, pos + 1);
+            break;
+        }
+        else if (pos == firstPos)
+        {
+            break;
+        }
+
+        pos = psf::find_last_path_separator(redirectPath, pos - 1);
+    }
+
+    for (; pos != std::wstring_view::npos; pos = psf::find_path_separator(redirectPath, pos + 1))
+    {
+        directory.assign(redirectPath.data(), pos);
+        [[maybe_unused]] auto dirResult = impl::CreateDirectory(directory.c_str(), nullptr);
+#if _DEBUG
+        auto err = ::GetLastError();
+        assert(dirResult || (err == ERROR_ALREADY_EXISTS));
+#endif
+
+        std::unique_lock lock(g_redirectDirectoriesMutex);
+        g_redirectDirectories.insert(directory);
+    }
+
+    RedirectedPathCreated(directory.c_str());
+}
+
+// The length of the outermost configured base path that 'deVirtualizedPath' is under (or is), or zero if there's none
+static std::size_t outermost_base_path_length(const wchar_t* deVirtualizedPath) noexcept
+{
+    redirection_snapshot_reader snapshot;
+    if (!snapshot)
+    {
+        return 0;
+    }
+
+    auto node = &snapshot->root;
+    for (auto pos = deVirtualizedPath; ; )
+    {
+        auto component = next_path_component(pos);
+        if (component.empty())
+        {
+            return 0;
+        }
+
+        node = node->try_get_child(component);
+        if (!node)
+        {
+            return 0;
+        }
+        else if (node->has_patterns)
+        {
+            return pos - deVirtualizedPath;
+        }
+    }
+}
+
+static bool MatchesRedirectionSpec(const redirection_snapshot& snapshot, const wchar_t* deVirtualizedPath, redirect_target& target);
+
+static std::wstring redirected_path(const normalized_path& deVirtualizedPath, redirect_target target, bool ensureDirectoryStructure)
+{
+    auto result = LR"(\\?\)" + RedirectTargetRoot(target).native();
+
+    // With the hashed layout, the base path gets replaced by a single directory (see RedirectLayout.cpp)
+    if (HashedRedirectLayoutEnabled())
+    {
+        auto path = deVirtualizedPath.drive_absolute_path;
+        if (auto baseLength = outermost_base_path_length(path))
+        {
+            AppendRedirectLayoutDirectory(result, std::wstring_view(path, baseLength));
+            result += path + baseLength;
+            if (ensureDirectoryStructure)
+            {
+                EnsureDirectoryStructure(result);
+            }
+
+            return result;
+        }
+    }
+
+    // NTFS doesn't allow colons in filenames, so simplest thing is to just substitute something in; use a dollar sign
+    // similar to what's done for UNC paths
+    assert(psf::path_type(deVirtualizedPath.drive_absolute_path) == psf::dos_path_type::drive_absolute);
+    result.push_back(L'\\');
+    result.push_back(deVirtualizedPath.drive_absolute_path[0]);
+    result.push_back('$');
+
+    auto remainingLength = deVirtualizedPath.full_path.length();
+    remainingLength -= (deVirtualizedPath.drive_absolute_path - deVirtualizedPath.full_path.c_str());
+    remainingLength -= 2;
+    std::wstring_view relativePath(deVirtualizedPath.drive_absolute_path + 2, remainingLength);
+
+    result += relativePath;
+    if (ensureDirectoryStructure)
+    {
+        EnsureDirectoryStructure(result);
+    }
+
+    return result;
+}
+
+std::wstring RedirectedPath(const normalized_path& deVirtualizedPath, bool ensureDirectoryStructure)
+{
+    // Paths that don't match any of the specs (e.g. the parent of a base path, when it gets enumerated) go under the
+    // redirect root, the same as they would without any targets
+    auto target = redirect_target::persistent;
+    {
+        redirection_snapshot_reader snapshot;
+        if (snapshot && snapshot->has_volatile_targets)
+        {
+            MatchesRedirectionSpec(*snapshot, deVirtualizedPath.drive_absolute_path, target);
+        }
+    }
+
+    return redirected_path(deVirtualizedPath, target, ensureDirectoryStructure);
+}
+
+// ShouldRedirect gets called with the same few hundred paths over and over again, particularly during application
+// startup, so we cache the state that's independent of the flags argument, keyed off of the normalized path. To keep
+// the cache bounded, we hold two generations of entries: once the current generation fills up it becomes the previous
+// generation and the old previous generation is discarded. Lookups that hit in the previous generation get promoted
+struct redirect_cache_entry
+{
+    bool should_redirect = false;
+
+    // Only set if should_redirect is true
+    std::wstring redirect_path;
+    std::wstring deVirtualized_path;
+
+    // Set to the value of g_redirectCacheEpoch when we know that the redirected file/directory exists (i.e. copy-on-read
+    // has already been done). Any delete through one of our fixups bumps the epoch, invalidating all such knowledge
+    std::uint32_t exists_epoch = 0;
+
+    // The version of the redirection_snapshot that should_redirect was decided by. Entries from older versions are
+    // treated as misses once a reload swaps in a new snapshot
+    std::uint32_t snapshot_version = 0;
+};
+
+// ShouldRedirect's own copy of an entry only lives for the duration of the call, so it comes out of the scratch arena
+// rather than the heap. Misses still allocate, but hits - the vast majority of calls - don't
+struct scratch_redirect_cache_entry
+{
+    bool should_redirect = false;
+    psf::scratch_wstring redirect_path;
+    psf::scratch_wstring deVirtualized_path;
+    std::uint32_t exists_epoch = 0;
+    std::uint32_t snapshot_version = 0;
+
+    scratch_redirect_cache_entry& operator=(const redirect_cache_entry& other)
+    {
+        should_redirect = other.should_redirect;
+        redirect_path.assign(other.redirect_path);
+        deVirtualized_path.assign(other.deVirtualized_path);
+        exists_epoch = other.exists_epoch;
+        snapshot_version = other.snapshot_version;
+        return *this;
+    }
+
+    scratch_redirect_cache_entry& operator=(const redirect_memo& other)
+    {
+        should_redirect = other.should_redirect;
+        redirect_path.assign(other.redirect_path);
+        deVirtualized_path.assign(other.deVirtualized_path);
+        exists_epoch = other.exists_epoch;
+        snapshot_version = other.snapshot_version;
+        return *this;
+    }
+};
+
+// The map key is a view of the node's path so that lookups don't need to allocate. It carries the hash that
+// NormalizePath already computed so that none of the lookups need to hash the path again
+struct redirect_cache_key
+{
+    std::wstring_view path;
+    std::uint64_t hash;
+
+    bool operator==(const redirect_cache_key& other) const noexcept
+    {
+        return path == other.path;
+    }
+};
+
+struct redirect_cache_key_hash
+{
+    std::size_t operator()(const redirect_cache_key& key) const noexcept
+    {
+        return static_cast<std::size_t>(key.hash);
+    }
+};
+
+struct redirect_cache_node
+{
+    std::wstring normalized_path;
+    redirect_cache_entry entry;
+
+    // How many times it's been looked up, for the decision snapshot
+    std::atomic<std::uint32_t> hits = 0;
+};
+using redirect_cache_map = std::unordered_map<redirect_cache_key, std::unique_ptr<redirect_cache_node>, redirect_cache_key_hash>;
+
+constexpr std::size_t redirect_cache_generation_size = 2048;
+
+std::shared_mutex g_redirectCacheMutex;
+redirect_cache_map g_redirectCache;
+redirect_cache_map g_previousRedirectCache;
+std::atomic<std::uint32_t> g_redirectCacheEpoch = 1;
+std::atomic<std::uint64_t> g_redirectCacheHits = 0;
+std::atomic<std::uint64_t> g_redirectCacheMisses = 0;
+
+static bool try_get_cached_redirect(const redirect_cache_key& key, scratch_redirect_cache_entry& entry)
+{
+    {
+        std::shared_lock lock(g_redirectCacheMutex);
+        if (auto itr = g_redirectCache.find(key); itr != g_redirectCache.end())
+        {
+            entry = itr->second->entry;
+            itr->second->hits.fetch_add(1, std::memory_order_relaxed);
+            ++g_redirectCacheHits;
+            return true;
+        }
+    }
+
+    std::unique_lock lock(g_redirectCacheMutex);
+    if (auto itr = g_previousRedirectCache.find(key); itr != g_previousRedirectCache.end())
+    {
+        entry = itr->second->entry;
+        itr->second->hits.fetch_add(1, std::memory_order_relaxed);
+        auto node = g_previousRedirectCache.extract(itr);
+        if (g_redirectCache.size() >= redirect_cache_generation_size)
+        {
+            g_previousRedirectCache = std::move(g_redirectCache);
+            g_redirectCache.clear();
+        }
+        g_redirectCache.insert(std::move(node));
+
+        ++g_redirectCacheHits;
+        return true;
+    }
+
+    ++g_redirectCacheMisses;
+    return false;
+}
+
+static void cache_redirect(const redirect_cache_key& key, const redirect_cache_entry& entry)
+{
+    std::unique_lock lock(g_redirectCacheMutex);
+    if (g_redirectCache.size() >= redirect_cache_generation_size)
+    {
+        g_previousRedirectCache = std::move(g_redirectCache);
+        g_redirectCache.clear();
+    }
+
+    // NOTE: Another thread may have raced with us and inserted an entry first; their result is just as valid as ours,
+    //       unless it's left over from before a reload
+    if (auto itr = g_redirectCache.find(key); itr != g_redirectCache.end())
+    {
+        if (itr->second->entry.snapshot_version < entry.snapshot_version)
+        {
+            itr->second->entry = entry;
+        }
+        return;
+    }
+
+    auto node = std::make_unique<redirect_cache_node>(redirect_cache_node{ std::wstring(key.path), entry });
+    redirect_cache_key nodeKey{ node->normalized_path, key.hash };
+    g_redirectCache.emplace(nodeKey, std::move(node));
+}
+
+static void mark_cached_redirect_exists(const redirect_cache_key& key, std::uint32_t epoch)
+{
+    std::unique_lock lock(g_redirectCacheMutex);
+    if (auto itr = g_redirectCache.find(key); itr != g_redirectCache.end())
+    {
+        itr->second->entry.exists_epoch = epoch;
+    }
+}
+
+void InvalidateRedirectCache() noexcept
+{
+    {
+        std::unique_lock lock(g_redirectDirectoriesMutex);
+        g_redirectDirectories.clear();
+    }
+
+    // Wrap-around to zero would make "unknown" look valid; skip over it
+    if (++g_redirectCacheEpoch == 0)
+    {
+        ++g_redirectCacheEpoch;
+    }
+}
+
+redirect_cache_statistics RedirectCacheStatistics() noexcept
+{
+    return { g_redirectCacheHits.load(), g_redirectCacheMisses.load() };
+}
+
+void PreloadRedirectDecision(const redirect_decision& decision, std::uint32_t version)
+{
+    redirect_cache_entry entry;
+    entry.should_redirect = decision.should_redirect;
+    if (decision.should_redirect)
+    {
+        entry.redirect_path = decision.redirect_path;
+        entry.deVirtualized_path = decision.deVirtualized_path;
+    }
+    entry.snapshot_version = version;
+    cache_redirect(redirect_cache_key{ decision.normalized_path, psf::path_hash(decision.normalized_path) }, entry);
+}
+
+void VisitRedirectDecisions(std::uint32_t version, std::uint32_t minimumHits, const std::function<void(const redirect_decision&)>& fn)
+{
+    std::shared_lock lock(g_redirectCacheMutex);
+    for (auto cache : { &g_redirectCache, &g_previousRedirectCache })
+    {
+        for (auto& [key, node] : *cache)
+        {
+            if ((node->entry.snapshot_version == version) && (node->hits.load(std::memory_order_relaxed) >= minimumHits))
+            {
+                fn(redirect_decision{ node->normalized_path, node->entry.should_redirect, node->entry.redirect_path, node->entry.deVirtualized_path });
+            }
+        }
+    }
+}
+
+static bool MatchesRedirectionSpec(const redirection_snapshot& snapshot, const wchar_t* deVirtualizedPath, redirect_target& target)
+{
+    // Figure out if this is something we need to redirect. We walk the spec trie one path component at a time; any
+    // node along the way that has specs associated with it is a base path that the input is relative to. Where specs
+    // with different targets match, the most durable of them wins, so once something matches, only the targets that
+    // are more durable than it still need checking
+    bool matched = false;
+    auto candidateTargets = redirect_target_count;
+    auto node = &snapshot.root;
+    for (auto pos = deVirtualizedPath; ; )
+    {
+        auto component = next_path_component(pos);
+        if (component.empty())
+        {
+            return matched;
+        }
+
+        node = node->try_get_child(component);
+        if (!node)
+        {
+            // No configured base path starts with this prefix, so there's no reason to continue
+            return matched;
+        }
+
+        // NOTE: If this is the last component, then this is an exact match. Assume an implicit directory separator at
+        //       the end (e.g. for matches to satisfy the first call to CreateDirectory)
+        auto relativePath = pos;
+        if (psf::is_path_separator(relativePath[0]))
+        {
+            ++relativePath;
+        }
+
+        if (!node->has_patterns)
+        {
+            continue;
+        }
+
+        for (std::size_t i = 0; i < candidateTargets; ++i)
+        {
+            if (!node->patterns[i].empty() && node->patterns[i].match(relativePath))
+            {
+                target = static_cast<redirect_target>(i);
+                matched = true;
+                candidateTargets = i;
+                break;
+            }
+        }
+
+        if (matched && (target == redirect_target::persistent))
+        {
+            return true;
+        }
+    }
+}
+
+bool PathMatchesRedirectionSpec(const wchar_t* deVirtualizedPath)
+{
+    redirection_snapshot_reader snapshot;
+    redirect_target target;
+    return snapshot && MatchesRedirectionSpec(*snapshot, deVirtualizedPath, target);
+}
+
+// Copies that are currently in progress, keyed by redirected path. A thread that needs a file that another thread is in
+// the middle of copying (e.g. the warmup thread) waits for that copy to finish and shares its result rather than trying
+// to start its own, which would otherwise "succeed" with ERROR_FILE_EXISTS and go on to use a partially written file.
+// Copies by other processes are coordinated by CopyFileForRedirection
+struct copy_in_progress
+{
+    bool completed = false;
+    bool exists = false;
+};
+
+std::mutex g_copiesInProgressMutex;
+std::condition_variable g_copiesInProgressChanged;
+std::map<iwstring, std::shared_ptr<copy_in_progress>> g_copiesInProgress;
+std::atomic<int> g_copyOnReadWaiters = 0;
+
+int CopyOnReadWaiters() noexcept
+{
+    return g_copyOnReadWaiters;
+}
+
+// Returns true if the redirected file/directory is known to exist afterwards
+static bool CopyOnRead(const scratch_redirect_cache_entry& entry)
+{
+    // NOTE: Before this copy gets marked as in progress, since the rest of the directory includes this file
+    CopyWholeDirectory(entry.deVirtualized_path);
+
+    iwstring key(entry.redirect_path.c_str(), entry.redirect_path.length());
+    auto copy = std::make_shared<copy_in_progress>();
+    {
+        std::unique_lock lock(g_copiesInProgressMutex);
+        if (auto itr = g_copiesInProgress.find(key); itr != g_copiesInProgress.end())
+        {
+            auto other = itr->second;
+            ++g_copyOnReadWaiters;
+            g_copiesInProgressChanged.wait(lock, [&] { return other->completed; });
+            --g_copyOnReadWaiters;
+
+            return other->exists;
+        }
+
+        g_copiesInProgress.emplace(key, copy);
+    }
+
+    BOOL copyResult;
+    auto attr = impl::GetFileAttributes(entry.deVirtualized_path.c_str());
+    if ((attr & FILE_ATTRIBUTE_DIRECTORY) != FILE_ATTRIBUTE_DIRECTORY)
+    {
+        copyResult = CopyFileForRedirection(
+            entry.deVirtualized_path.c_str(),
+            entry.redirect_path.c_str(),
+            WarmupCopyProgressRoutine());
+    }
+    else
+    {
+        copyResult = impl::CreateDirectoryEx(entry.deVirtualized_path.c_str(), entry.redirect_path.c_str(), nullptr);
+    }
+
+    auto err = ::GetLastError();
+    assert(copyResult || (err == ERROR_FILE_EXISTS) || (err == ERROR_PATH_NOT_FOUND) || (err == ERROR_FILE_NOT_FOUND) ||
+        (err == ERROR_ALREADY_EXISTS) || (err == ERROR_REQUEST_ABORTED));
+    auto exists = copyResult || (err == ERROR_FILE_EXISTS) || (err == ERROR_ALREADY_EXISTS);
+    if (exists)
+    {
+        // NOTE: Before the path gets reported as created, which would discard the override
+        if (copyResult)
+        {
+            TransferAttributeOverride(entry.redirect_path.c_str(), entry.redirect_path.c_str());
+        }
+        RedirectedPathCreated(entry.redirect_path.c_str());
+    }
+
+    {
+        std::lock_guard lock(g_copiesInProgressMutex);
+        copy->completed = true;
+        copy->exists = exists;
+        g_copiesInProgress.erase(key);
+    }
+    g_copiesInProgressChanged.notify_all();
+
+    return exists;
+}
+
+std::wstring UnredirectedPackageFile(const wchar_t* path, const wchar_t* redirectPath, WIN32_FILE_ATTRIBUTE_DATA& data)
+{
+    if (RedirectedPathExists(redirectPath) || PackageFileDeleted(redirectPath))
+    {
+        return {};
+    }
+
+    {
+        // A copy that's in progress (e.g. by the warmup thread) would otherwise bring the file back once it completes
+        std::lock_guard lock(g_copiesInProgressMutex);
+        if (g_copiesInProgress.find(iwstring(redirectPath)) != g_copiesInProgress.end())
+        {
+            return {};
+        }
+    }
+
+    auto normalizedPath = DeVirtualizePath(NormalizePath(path));
+    if (!normalizedPath.drive_absolute_path)
+    {
+        return {};
+    }
+
+    auto err = FindPackageMetadata(path, data);
+    if (err == ERROR_NOT_SUPPORTED)
+    {
+        err = impl::GetFileAttributesEx(normalizedPath.drive_absolute_path, GetFileExInfoStandard, &data) ?
+            ERROR_SUCCESS : ::GetLastError();
+    }
+
+    if ((err != ERROR_SUCCESS) || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        return {};
+    }
+
+    return normalizedPath.drive_absolute_path;
+}
+
+static void memoize_redirect(
+    const wchar_t* path,
+    const redirect_memo_key& memoKey,
+    const scratch_redirect_cache_entry& entry,
+    const redirect_cache_key& cacheKey) noexcept
+{
+    redirect_memo memo;
+    memo.should_redirect = entry.should_redirect;
+    memo.exists_epoch = entry.exists_epoch;
+    memo.snapshot_version = entry.snapshot_version;
+    memo.hash = cacheKey.hash;
+    memo.normalized_path = cacheKey.path;
+    memo.redirect_path = entry.redirect_path;
+    memo.deVirtualized_path = entry.deVirtualized_path;
+    MemoizeRedirect(path, memoKey, memo);
+}
+
+// 'check' is only changed when the path needed matching against the specs, or matched
+static path_redirect_info ShouldRedirectImpl(
+    const wchar_t* path,
+    redirect_flags flags,
+    WIN32_FILE_ATTRIBUTE_DATA* redirectAttributes,
+    redirect_check& check)
+{
+    path_redirect_info result;
+
+    if (!path)
+    {
+        return result;
+    }
+
+    std::uint32_t snapshotVersion;
+    {
+        redirection_snapshot_reader snapshot;
+        if (!snapshot || !snapshot->prefilter.may_match(path))
+        {
+            // Not yet initialized, or can't possibly match any of the specs
+            return result;
+        }
+        snapshotVersion = snapshot->version;
+    }
+
+    psf::scratch_scope scratch;
+    scratch_redirect_cache_entry entry;
+    psf::path_buffer cachePath;
+    redirect_cache_key cacheKey{};
+
+    // Read the epoch before doing anything else so that a concurrent delete can only ever cause us to do more work
+    auto epoch = g_redirectCacheEpoch.load();
+
+    // The same thread asking about the same path again, which is the common case, doesn't need to normalize it again or
+    // take the redirect cache's lock
+    redirect_memo_key memoKey;
+    redirect_memo memo;
+    if (FindRedirectMemo(path, memoKey, memo) && (memo.snapshot_version == snapshotVersion))
+    {
+        entry = memo;
+        cachePath.assign(memo.normalized_path);
+        cacheKey = redirect_cache_key{ cachePath, memo.hash };
+    }
+    else
+    {
+        auto normalizedPath = NormalizePath(path);
+        if (!normalizedPath.drive_absolute_path)
+        {
+            // FUTURE: We could do better about canonicalising paths, but the cost/benefit doesn't make it worth it right now
+            return result;
+        }
+
+        // NOTE: We de-virtualize in place on a cache miss, so hold onto a copy of the path. This doesn't allocate unless
+        //       the path is longer than MAX_PATH
+        cachePath = normalizedPath.full_path;
+        cacheKey = redirect_cache_key{ cachePath, normalizedPath.hash };
+        auto cached = try_get_cached_redirect(cacheKey, entry);
+        {
+            // NOTE: Only hold onto the snapshot for as long as we need it; a reload can't free the old one until we let go
+            redirection_snapshot_reader snapshot;
+            if (!snapshot)
+            {
+                // Not yet initialized
+                return result;
+            }
+
+            if (!cached || (entry.snapshot_version != snapshot->version))
+            {
+                // To be consistent in where we redirect files, we need to map VFS paths to their non-package-relative
+                // equivalent
+                redirect_cache_entry newEntry;
+                newEntry.snapshot_version = snapshot->version;
+                normalizedPath = DeVirtualizePath(std::move(normalizedPath));
+                auto target = redirect_target::persistent;
+                newEntry.should_redirect = MatchesRedirectionSpec(*snapshot, normalizedPath.drive_absolute_path, target);
+                if (newEntry.should_redirect)
+                {
+                    newEntry.redirect_path = redirected_path(normalizedPath, target, false);
+                    newEntry.deVirtualized_path = normalizedPath.drive_absolute_path;
+                }
+
+                cache_redirect(cacheKey, newEntry);
+                entry = newEntry;
+                check = redirect_check::new_miss;
+            }
+        }
+
+        memoize_redirect(path, memoKey, entry, cacheKey);
+    }
+
+    if (!entry.should_redirect)
+    {
+        return result;
+    }
+    check = redirect_check::match;
+
+    result.should_redirect = true;
+    result.redirect_path = std::wstring_view(entry.redirect_path);
+
+    // Everything other than the private profile fixups reads the file from disk
+    if (!flag_set(flags, redirect_flags::private_profile))
+    {
+        FlushPrivateProfileWrites(entry.redirect_path);
+    }
+
+    // If the redirected file is already known to exist, then so does its directory structure and there's nothing to copy.
+    // We still confirm that it exists since it may have been removed without going through one of our fixups, but that's
+    // a single attribute query versus creating directories, querying the source, and attempting the copy. Presence
+    // checks on their own don't need it, since they do their own query
+    auto knownToExist = (entry.exists_epoch == epoch) &&
+        (flag_set(flags, redirect_flags::ensure_directory_structure) || flag_set(flags, redirect_flags::copy_file)) &&
+        impl::PathExists(entry.redirect_path.c_str());
+    if (flag_set(flags, redirect_flags::ensure_directory_structure) && !knownToExist)
+    {
+        EnsureDirectoryStructure(entry.redirect_path);
+    }
+
+    if (flag_set(flags, redirect_flags::check_file_presence) &&
+        !RedirectedPathExists(entry.redirect_path.c_str(), redirectAttributes))
+    {
+        // A deleted package file needs to stay deleted, which the (non-existent) redirected path takes care of
+        auto lastError = ::GetLastError();
+        if (!PackageFileDeleted(entry.redirect_path))
+        {
+            result.should_redirect = false;
+            result.redirect_path.clear();
+        }
+        ::SetLastError(lastError);
+        return result;
+    }
+
+    // NOTE: Once the redirected file is known to exist, it can't have a tombstone, since creating it removes it
+    if (flag_set(flags, redirect_flags::copy_file) && !knownToExist && !PackageFileDeleted(entry.redirect_path) &&
+        CopyOnRead(entry))
+    {
+        mark_cached_redirect_exists(cacheKey, epoch);
+        entry.exists_epoch = epoch;
+        memoize_redirect(path, memoKey, entry, cacheKey);
+    }
+
+    return result;
+}
+
+static path_redirect_info ShouldRedirectWithTelemetry(const wchar_t* path, redirect_flags flags, WIN32_FILE_ATTRIBUTE_DATA* redirectAttributes)
+{
+    auto check = redirect_check::settled_miss;
+    auto scope = CurrentTelemetryScope();
+    if (!scope)
+    {
+        return ShouldRedirectImpl(path, flags, redirectAttributes, check);
+    }
+
+    auto start = TelemetryTimestamp();
+    auto result = ShouldRedirectImpl(path, flags, redirectAttributes, check);
+    scope->should_redirect_completed(TelemetryTimestamp() - start, result.should_redirect);
+    AdaptiveBypassObserved(scope->api(), check);
+    return result;
+}
+
+path_redirect_info ShouldRedirect(const wchar_t* path, redirect_flags flags)
+{
+    return ShouldRedirectWithTelemetry(path, flags, nullptr);
+}
+
+path_redirect_info ShouldRedirect(const wchar_t* path, redirect_flags flags, WIN32_FILE_ATTRIBUTE_DATA& redirectAttributes)
 {
-    return ShouldRedirectImpl(path, flags);
+    return ShouldRedirectWithTelemetry(path, flags, &redirectAttributes);
 }
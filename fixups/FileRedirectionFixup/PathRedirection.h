@@ -4,7 +4,16 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <path_buffer.h>
+#include <psf_heap.h>
+#include <pattern_matcher.h>
 
 enum class redirect_flags
 {
@@ -13,6 +22,10 @@ enum class redirect_flags
     copy_file = 0x0002,
     check_file_presence = 0x0004,
 
+    // The caller is one of the private profile fixups, which read and write through the private profile cache, so any
+    // pending writes to the file don't need to be written to disk first
+    private_profile = 0x0008,
+
     copy_on_read = ensure_directory_structure | copy_file,
 };
 DEFINE_ENUM_FLAG_OPERATORS(redirect_flags);
@@ -29,9 +42,437 @@ struct path_redirect_info
     std::filesystem::path redirect_path;
 };
 
-path_redirect_info ShouldRedirect(const char* path, redirect_flags flags);
+// Where a redirection spec sends the paths that it matches. Everything goes to the redirect root (%LocalAppData%\VFS) by
+// default; the volatile targets are for files that don't need to survive the profile (caches, logs, temp files), so
+// that writing them doesn't cost what writing to a roamed or network-backed profile does. See RedirectTargets.cpp
+enum class redirect_target : std::uint8_t
+{
+    persistent,
+    local_temp,
+    memory,
+};
+constexpr std::size_t redirect_target_count = 3;
+
+struct path_redirection_spec
+{
+    std::filesystem::path base_path;
+    redirect_target target = redirect_target::persistent;
+
+    // Patterns that are simple literals (see psf::classify_pattern) don't need a compiled matcher; the literal string
+    // gets added to the owning node's redirection_pattern_set instead
+    psf::pattern_shape shape = psf::pattern_shape::general;
+    std::wstring literal;
+    psf::pattern_matcher pattern;
+
+    // The pattern as written in the configuration. Only set for general patterns
+    std::wstring source;
+};
+
+// The specs get built once (or once per reload) and live for as long as the process, so they go on the PSF's heap
+using path_redirection_specs = std::vector<path_redirection_spec, psf::heap_allocator<path_redirection_spec>>;
+
 path_redirect_info ShouldRedirect(const wchar_t* path, redirect_flags flags);
 
+// For the attribute fixups, which would otherwise query the redirected file a second time. With
+// redirect_flags::check_file_presence, whenever the path redirects, 'redirectAttributes' holds the redirected file's
+// attributes; when it doesn't exist there (i.e. a deleted package file), dwFileAttributes is INVALID_FILE_ATTRIBUTES and
+// the last error says why
+path_redirect_info ShouldRedirect(const wchar_t* path, redirect_flags flags, WIN32_FILE_ATTRIBUTE_DATA& redirectAttributes);
+
+// ShouldRedirect caches its decisions, including whether or not a file has already been copied to the redirected
+// location. Fixups that delete, move, or replace redirected files must call this afterwards so that we don't skip
+// copy-on-read for files that no longer exist there
+void InvalidateRedirectCache() noexcept;
+
+// The redirect root (%LocalAppData%\VFS) isn't created until something needs to be written under it. Anything that
+// creates files or directories there, or opens the root itself, must call this first
+void EnsureRedirectRootExists() noexcept;
+
+struct redirect_cache_statistics
+{
+    std::uint64_t hits;
+    std::uint64_t misses;
+};
+redirect_cache_statistics RedirectCacheStatistics() noexcept;
+
+// An in-memory index of what exists under the redirect root so that presence checks don't need to touch the disk. See
+// RedirectedPathIndex.cpp for more details. Fixups that create or delete files in the redirected location should
+// report it here; when the outcome isn't clear (e.g. a partially failed ReplaceFile), RedirectedPathChanged will
+// re-query the disk
+namespace psf
+{
+    struct json_array;
+    struct json_value;
+    struct json_object;
+}
+void InitializeRedirectedPathIndex(const psf::json_object* config);
+void UninitializeRedirectedPathIndex() noexcept;
+// When given 'attributes', the disk gets queried with GetFileAttributesEx instead, and they're filled in if it exists
+bool RedirectedPathExists(const wchar_t* redirectPath, WIN32_FILE_ATTRIBUTE_DATA* attributes = nullptr);
+void RedirectedPathCreated(const wchar_t* redirectPath) noexcept;
+void RedirectedPathDeleted(const wchar_t* redirectPath) noexcept;
+void RedirectedPathChanged(const wchar_t* redirectPath) noexcept;
+// Finds the deepest of the directories leading up to, and including, 'redirectDirectory' that the index has, without
+// confirming it against the disk. Its length goes in 'indexedLength', which is zero if the index has none of them. Returns
+// false if the index can't say (e.g. it's disabled, or the path isn't under the redirect root)
+bool RedirectedDirectoryIndexed(const wchar_t* redirectDirectory, std::size_t& indexedLength) noexcept;
+
+// Remembers which handles were opened through a redirected path so that handle based fixups don't need to query and
+// re-resolve the handle's path. See RedirectedHandleTable.cpp for more details. Fixups that open redirected files should
+// report the handle; CloseHandle and DuplicateHandle are taken care of by their fixups. An empty path passed to
+// RedirectedHandleRenamed means that the file is no longer under the redirect root
+struct redirected_handle_info
+{
+    std::wstring redirect_path;
+};
+void RedirectedHandleOpened(HANDLE handle, const std::filesystem::path& redirectPath) noexcept;
+void RedirectedHandleDuplicated(HANDLE targetHandle, std::shared_ptr<const redirected_handle_info> info) noexcept;
+void RedirectedHandleRenamed(HANDLE handle, const std::filesystem::path& redirectPath) noexcept;
+void RedirectedHandleClosed(HANDLE handle) noexcept;
+std::shared_ptr<const redirected_handle_info> FindRedirectedHandle(HANDLE handle) noexcept;
+
+// Optionally copies configured package files to the redirected location on a background thread at startup so that the
+// first write to them doesn't stall on the copy. See RedirectionWarmup.cpp for more details. A thread that needs a file
+// that is still being copied waits for that copy to finish; CopyOnReadWaiters reports how many threads are doing so
+void InitializeRedirectionWarmup(const psf::json_array* config);
+void UninitializeRedirectionWarmup() noexcept;
+LPPROGRESS_ROUTINE WarmupCopyProgressRoutine() noexcept;
+int CopyOnReadWaiters() noexcept;
+
+// Copies a package file to its redirected location, failing if it already exists. Picks the cheapest strategy that the
+// file's size and the underlying volumes allow, and makes sure that only one of the package's processes copies any given
+// file, with the file only showing up once it's complete (see RedirectedFileCopy.cpp); otherwise behaves like CopyFileEx
+BOOL CopyFileForRedirection(const wchar_t* existingFileName, const wchar_t* newFileName, LPPROGRESS_ROUTINE progressRoutine);
+
+// The same copy, without coordinating with the package's other processes. Only for destinations that they can't see yet
+BOOL CopyFileUncoordinated(const wchar_t* existingFileName, const wchar_t* newFileName, LPPROGRESS_ROUTINE progressRoutine);
+
+// Optionally copies a directory in the package to the redirected location as a whole when the redirected location doesn't
+// exist yet, e.g. on a fresh profile. See RedirectRootSeed.cpp for more details. Needs initializing before the redirected
+// path index, so that the index picks up the seeded paths
+void InitializeRedirectRootSeed(const psf::json_object* config);
+
+// The de-virtualized path of the package file that copy-on-read would copy to 'redirectPath', or empty if there's no
+// such file (e.g. it's already been copied, it's been deleted, or it's a directory), with its attributes in 'data'. For
+// fixups that would otherwise copy-on-read a package file only to immediately rename it, e.g. MoveFile and ReplaceFile
+std::wstring UnredirectedPackageFile(const wchar_t* path, const wchar_t* redirectPath, WIN32_FILE_ATTRIBUTE_DATA& data);
+
+// Optionally moves copies of large files onto a low I/O priority worker thread, with a bytes per second budget shared by
+// the package's processes. See CopyThrottle.cpp for more details. ThrottledCopyFile behaves like CopyFileEx
+void InitializeCopyThrottle(const psf::json_object* config);
+void UninitializeCopyThrottle() noexcept;
+bool ShouldThrottleCopy(std::uint64_t fileSize) noexcept;
+BOOL ThrottledCopyFile(const wchar_t* existingFileName, const wchar_t* newFileName, LPPROGRESS_ROUTINE progressRoutine, DWORD copyFlags);
+
+// Optionally copies large files that are on a different volume than where they're going with several overlapped reads
+// and writes in flight at once, rather than one after the other. See PipelinedCopy.cpp for more details.
+// PipelinedCopyFile behaves like CopyFileEx, which is what it uses for everything else
+void InitializePipelinedCopy(const psf::json_object* config);
+BOOL PipelinedCopyFile(
+    const wchar_t* existingFileName,
+    const wchar_t* newFileName,
+    LPPROGRESS_ROUTINE progressRoutine,
+    LPVOID data,
+    DWORD copyFlags);
+
+// Optionally copies the rest of the files in a configured package directory, several at a time, along with the first of
+// them that gets copied on read. See WholeDirectoryCopy.cpp for more details
+void InitializeWholeDirectoryCopy(const psf::json_object* config);
+void CopyWholeDirectory(std::wstring_view deVirtualizedPath) noexcept;
+
+// Optionally answers attribute queries and existence checks for package files from an index of the package's contents,
+// which is built once and shared by all of the package's processes. See PackageMetadataIndex.cpp for more details.
+// FindPackageMetadata returns ERROR_NOT_SUPPORTED if the index can't answer for the path, in which case the caller should
+// ask the file system. PackagePathExists does so itself
+void InitializePackageMetadataIndex(const psf::json_object* config);
+DWORD FindPackageMetadata(const wchar_t* path, WIN32_FILE_ATTRIBUTE_DATA& data) noexcept;
+bool PackagePathExists(const wchar_t* path) noexcept;
+
+// Optionally serves write opens of large package files from a sparse file that only holds the modified ranges instead
+// of copying the whole file up front. See DeltaOverlay.cpp for more details. OpenDeltaOverlay fails with
+// ERROR_NOT_SUPPORTED if the file can't be opened that way, in which case the caller should fall back to copy-on-read
+void InitializeDeltaOverlay(const psf::json_object* config);
+bool DeltaOverlayEnabled() noexcept;
+bool ShouldUseDeltaOverlay(const wchar_t* packagePath, const std::filesystem::path& redirectPath, DWORD desiredAccess, DWORD flagsAndAttributes);
+HANDLE OpenDeltaOverlay(
+    const wchar_t* packagePath,
+    const std::filesystem::path& redirectPath,
+    DWORD desiredAccess,
+    DWORD shareMode,
+    LPSECURITY_ATTRIBUTES securityAttributes,
+    DWORD creationDisposition,
+    DWORD flagsAndAttributes);
+
+// Optionally caches the merged (redirected + package) listings of package directories that get enumerated in full, so
+// that enumerating them again doesn't need to touch the disk. See DirectoryListingCache.cpp for more details. Listings
+// are invalidated as changes to the redirected location get reported to the RedirectedPath* functions above, as well as
+// by a watch on the redirect root. GetDirectoryListing returns null when the cache isn't usable, in which case the
+// caller should enumerate the directories itself; otherwise it returns the cached listing or the one built by
+// 'buildListing', which may in turn return null if the listing can't be built, or be empty to only use what's cached.
+// A non-empty 'filter' identifies a part of the listing (e.g. a pattern) that gets cached separately from the rest
+struct directory_listing_entry
+{
+    DWORD attributes;
+    FILETIME creation_time;
+    FILETIME last_access_time;
+    FILETIME last_write_time;
+    std::uint64_t size;
+    DWORD reserved0;
+    std::wstring name;
+    std::wstring short_name;
+};
+using directory_listing = std::vector<directory_listing_entry>;
+
+void InitializeDirectoryListingCache(const psf::json_object* config);
+void UninitializeDirectoryListingCache() noexcept;
+bool DirectoryListingCacheEnabled() noexcept;
+std::shared_ptr<const directory_listing> GetDirectoryListing(
+    const std::wstring& redirectDirectory,
+    bool basicInfo,
+    std::wstring_view filter,
+    const std::function<std::shared_ptr<const directory_listing>()>& buildListing);
+void InvalidateDirectoryListings(const wchar_t* redirectPath) noexcept;
+
+// Optionally answers attribute queries for files in package directories from the directory's cached listing, once the
+// directory has seen enough of them to be worth enumerating. See AttributePrefetch.cpp for more details. Same as
+// FindPackageMetadata, FindListedAttributes returns ERROR_NOT_SUPPORTED if the caller should ask the file system
+void InitializeAttributePrefetch(const psf::json_object* config);
+DWORD FindListedAttributes(const wchar_t* path, WIN32_FILE_ATTRIBUTE_DATA& data) noexcept;
+
+// Optionally remembers which package files have been deleted so that they stay deleted, even though the package file
+// itself can't be. See PackageFileTombstones.cpp for more details. Paths are the redirected paths of the package files.
+// PackageFileDeleted is cheap enough to call on every package file that a fixup is about to fall back to, and the
+// overload taking a directory and a name is meant for enumeration. Fixups that delete package files should call
+// AddPackageFileTombstone, which returns false if the delete couldn't be remembered; RedirectedPathCreated takes care
+// of removing the tombstone when something gets created in its place
+void InitializePackageFileTombstones(const psf::json_object* config);
+bool PackageFileDeleted(std::wstring_view redirectPath) noexcept;
+bool PackageFileDeleted(std::wstring_view redirectDirectory, std::wstring_view name) noexcept;
+bool AddPackageFileTombstone(const wchar_t* redirectPath) noexcept;
+void RemovePackageFileTombstone(const wchar_t* redirectPath) noexcept;
+
+// Optionally remembers the attributes that get set on package files that haven't been copied, instead of copying them.
+// See AttributeOverrides.cpp for more details. Paths are the redirected paths of the package files. SetAttributeOverride
+// returns false if the attributes can't be remembered, in which case the fixup should copy the file like normal. The
+// Override* functions return the attributes that should be reported in place of 'attributes', which came from the
+// package file, and OverridePackageFileAttributes takes the path that the caller asked for. CopyOnRead and the rename
+// fixups should call TransferAttributeOverride once the redirected file exists, and RedirectedPathCreated takes care of
+// removing the override when something gets created in its place
+void InitializeAttributeOverrides(const psf::json_object* config);
+bool AttributeOverridesEnabled() noexcept;
+bool AttributeOverridesInUse() noexcept;
+bool SetAttributeOverride(const wchar_t* redirectPath, DWORD attributes) noexcept;
+DWORD OverrideAttributes(std::wstring_view redirectPath, DWORD attributes) noexcept;
+DWORD OverrideAttributes(std::wstring_view redirectDirectory, std::wstring_view name, DWORD attributes) noexcept;
+DWORD OverridePackageFileAttributes(const wchar_t* path, DWORD attributes) noexcept;
+void RemoveAttributeOverride(const wchar_t* redirectPath) noexcept;
+void TransferAttributeOverride(const wchar_t* redirectPath, const wchar_t* filePath) noexcept;
+
+// Optionally answers GetPrivateProfileString/GetPrivateProfileSection reads of redirected INI files from memory. See
+// PrivateProfileCache.cpp for more details. The TryGet* functions return false when the read can't be answered from
+// the cache, in which case the caller should call the Win32 API like normal. Fixups that write to a redirected INI file
+// should first try TryDeferPrivateProfileWrite, and otherwise call InvalidatePrivateProfileCache after the write.
+// FlushPrivateProfileWrites writes out any deferred writes to the file; ShouldRedirect takes care of calling it unless
+// redirect_flags::private_profile is specified
+void InitializePrivateProfileCache(const psf::json_object* config);
+bool TryGetCachedPrivateProfileString(
+    const std::filesystem::path& redirectPath,
+    const char* appName,
+    const char* keyName,
+    const char* defaultString,
+    char* string,
+    DWORD stringLength,
+    DWORD& result);
+bool TryGetCachedPrivateProfileString(
+    const std::filesystem::path& redirectPath,
+    const wchar_t* appName,
+    const wchar_t* keyName,
+    const wchar_t* defaultString,
+    wchar_t* string,
+    DWORD stringLength,
+    DWORD& result);
+bool TryGetCachedPrivateProfileSection(
+    const std::filesystem::path& redirectPath,
+    const char* appName,
+    char* string,
+    DWORD stringLength,
+    DWORD& result);
+bool TryGetCachedPrivateProfileSection(
+    const std::filesystem::path& redirectPath,
+    const wchar_t* appName,
+    wchar_t* string,
+    DWORD stringLength,
+    DWORD& result);
+void InvalidatePrivateProfileCache(const std::filesystem::path& redirectPath) noexcept;
+bool TryDeferPrivateProfileWrite(
+    const std::filesystem::path& redirectPath,
+    const wchar_t* appName,
+    const wchar_t* keyName,
+    const wchar_t* string) noexcept;
+void FlushPrivateProfileWrites(std::wstring_view redirectPath) noexcept;
+
+// Optionally redirects at the NT layer (NtCreateFile, etc.) instead of at the Win32 layer. See NtRedirectionFixup.cpp
+void InitializeNtRedirection(const psf::json_object* config);
+
+// Optionally only attaches the fixups for the APIs that the application uses, and records which ones those are. See
+// HookSelection.cpp
+void InitializeHookSelection(const psf::json_object* config);
+void UninitializeHookSelection() noexcept;
+bool IsHookEnabled(const void* target) noexcept;
+
+// Records which package files get read from during startup, for the PsfLauncher to read ahead of later launches, when
+// the launcher asks for it. See StartupProfile.cpp for more details. The CreateFile, ReadFile, and CloseHandle fixups
+// report to the others only while StartupProfileRecording is true; they all preserve the last error
+void InitializeStartupProfile() noexcept;
+void UninitializeStartupProfile() noexcept;
+bool StartupProfileRecording() noexcept;
+void StartupProfileFileOpened(HANDLE file, const char* path) noexcept;
+void StartupProfileFileOpened(HANDLE file, const wchar_t* path) noexcept;
+void StartupProfileHandleClosed(HANDLE file) noexcept;
+void StartupProfileRead(HANDLE file, DWORD length, const OVERLAPPED* overlapped) noexcept;
+
+// Always-on, per-API call counts and latency histograms. See RedirectionTelemetry.cpp for more details. Each fixup
+// declares a telemetry_scope for its API as its first statement; ShouldRedirect and the redirected file copy attribute
+// their work to whichever scope is active on the calling thread. Scopes declared while another one is active (e.g. a
+// fixup that ends up calling another fixup) don't count as separate calls
+enum class telemetry_api : std::uint8_t
+{
+    close_handle,
+    copy_file,
+    copy_file_ex,
+    copy_file2,
+    create_directory,
+    create_directory_ex,
+    create_file,
+    create_file2,
+    create_file_mapping,
+    create_hard_link,
+    create_symbolic_link,
+    delete_file,
+    duplicate_handle,
+    find_close,
+    find_first_file,
+    find_first_file_ex,
+    find_next_file,
+    get_file_attributes,
+    get_file_attributes_ex,
+    get_private_profile_section,
+    get_private_profile_string,
+    move_file,
+    move_file_ex,
+    nt_create_file,
+    nt_open_file,
+    nt_query_attributes_file,
+    nt_query_full_attributes_file,
+    nt_set_information_file,
+    read_file,
+    read_file_ex,
+    remove_directory,
+    replace_file,
+    set_end_of_file,
+    set_file_attributes,
+    set_file_information_by_handle,
+    write_file,
+    write_file_ex,
+    write_private_profile_string,
+
+    count
+};
+
+class telemetry_scope
+{
+public:
+    explicit telemetry_scope(telemetry_api api) noexcept;
+    ~telemetry_scope();
+
+    telemetry_scope(const telemetry_scope&) = delete;
+    telemetry_scope& operator=(const telemetry_scope&) = delete;
+
+    // Called by ShouldRedirect and the copy-on-read copy, respectively
+    void should_redirect_completed(std::int64_t ticks, bool redirected) noexcept;
+    void file_copied(std::uint64_t bytes) noexcept;
+
+    telemetry_api api() const noexcept
+    {
+        return m_api;
+    }
+
+private:
+    struct thread_telemetry* m_telemetry = nullptr;
+    telemetry_api m_api;
+    std::int64_t m_start = 0;
+    std::int64_t m_shouldRedirectTicks = 0;
+};
+
+// The scope that is active on the current thread, if any
+telemetry_scope* CurrentTelemetryScope() noexcept;
+std::int64_t TelemetryTimestamp() noexcept;
+
+void InitializeRedirectionTelemetry(const psf::json_object* config);
+void UninitializeRedirectionTelemetry() noexcept;
+
+// The APIs that have been called at least once so far
+std::vector<telemetry_api> CalledTelemetryApis();
+
+// Optionally stops checking the paths of the APIs for which ShouldRedirect has settled into never matching anything. See
+// AdaptiveBypass.cpp for more details. ShouldRedirect reports each check it makes for the active telemetry scope's API,
+// and the eligible fixups call straight through to the real function while HookBypassed returns true for their API.
+// ResetAdaptiveBypass puts every API back to being checked, e.g. after a hot reload
+enum class redirect_check : std::uint8_t
+{
+    settled_miss, // No match, and no need to match against the specs (i.e. rejected up front, or already decided)
+    new_miss, // No match, but newly decided
+    match,
+};
+void InitializeAdaptiveBypass(const psf::json_object* config);
+bool HookBypassed(telemetry_api api) noexcept;
+void AdaptiveBypassObserved(telemetry_api api, redirect_check check) noexcept;
+void ResetAdaptiveBypass() noexcept;
+
+// Optionally saves the redirection specs - with base paths resolved and patterns compiled - to a file in the redirect
+// root so that later processes (e.g. child processes) can load them instead of parsing the configuration again. See
+// RedirectionSpecCache.cpp for more details. LoadRedirectionSpecCache returns false if the cache is disabled, missing,
+// or out of date, in which case the caller should build the specs and then call SaveRedirectionSpecCache
+struct redirection_spec_cache_folder
+{
+    std::wstring id;
+    std::wstring path;
+};
+void InitializeRedirectionSpecCache(const psf::json_object* config, const psf::json_value* redirectedPaths);
+bool LoadRedirectionSpecCache(path_redirection_specs& specs);
+void SaveRedirectionSpecCache(
+    const path_redirection_specs& specs,
+    const std::vector<redirection_spec_cache_folder>& folders) noexcept;
+
+// Optionally saves the redirect cache's most looked up decisions to a file in the redirect root, so that the next process
+// can preload them into its own cache during PSFInitialize. See RedirectDecisionSnapshot.cpp for more details
+struct redirect_decision
+{
+    std::wstring_view normalized_path; // The path as NormalizePath returns it, i.e. the redirect cache's key
+    bool should_redirect = false;
+    std::wstring_view redirect_path; // Only set if should_redirect is true
+    std::wstring_view deVirtualized_path;
+};
+void InitializeRedirectDecisionSnapshot(const psf::json_object* config);
+void SaveRedirectDecisionSnapshot() noexcept;
+
+// For the decision snapshot. VisitRedirectionSpecs calls 'fn' with the current specs and the version of the snapshot
+// that they belong to. PreloadRedirectDecision adds a decision to the redirect cache as if ShouldRedirect had made it
+// with that version of the specs, and VisitRedirectDecisions calls 'fn' for each of the cached decisions that were made
+// with that version and have been looked up at least 'minimumHits' times, with the cache locked
+void VisitRedirectionSpecs(const std::function<void(const path_redirection_specs& specs, std::uint32_t version)>& fn);
+void PreloadRedirectDecision(const redirect_decision& decision, std::uint32_t version);
+void VisitRedirectDecisions(std::uint32_t version, std::uint32_t minimumHits, const std::function<void(const redirect_decision&)>& fn);
+
+// Lets long running processes pick up changes to the redirection configuration without a relaunch. When enabled, a
+// background thread calls ReloadRedirectionConfiguration whenever config.json changes or the configured event gets
+// signaled. See RedirectionHotReload.cpp for more details. EnableRedirectionReload must be called before anything can
+// call ShouldRedirect for reloads to be allowed
+void InitializeRedirectionHotReload(const psf::json_object* config);
+void UninitializeRedirectionHotReload() noexcept;
+void EnableRedirectionReload() noexcept;
+bool ReloadRedirectionConfiguration() noexcept;
+
 struct normalized_path
 {
     // The full_path could either be:
@@ -39,21 +480,172 @@ struct normalized_path
     //      2.  A local device path. E.g. "\\.\C:\foo\bar.txt" or "\\.\COM1"
     //      3.  A root-local device path. E.g. "\\?\C:\foo\bar.txt" or "\\?\HarddiskVolume1\foo\bar.txt"
     //      4.  A UNC-absolute path. E.g. "\\server\share\foo\bar.txt"
-    // or empty if there was a failure
-    std::wstring full_path;
+    // or empty if there was a failure. This is called on virtually every file system call, so the path is kept in an
+    // inline buffer to avoid allocating unless the path is longer than MAX_PATH
+    psf::path_buffer full_path;
 
     // A pointer inside of full_path if the path explicitly uses a drive symbolic link at the root, otherwise nullptr.
     // Note that this isn't perfect; e.g. we don't handle scenarios such as "\\localhost\C$\foo\bar.txt"
     wchar_t* drive_absolute_path = nullptr;
+
+    // The psf::path_hash of full_path, computed as part of normalizing it so that e.g. cache lookups don't need to scan
+    // the path again, along with where each of its components ends (in full_path) and the hash of the path up to there
+    std::uint64_t hash = 0;
+    psf::path_components components;
+
+    normalized_path() = default;
+
+    normalized_path(const normalized_path& other) :
+        full_path(other.full_path),
+        drive_absolute_path(other.rebase(full_path)),
+        hash(other.hash),
+        components(other.components)
+    {
+    }
+
+    normalized_path(normalized_path&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    normalized_path& operator=(const normalized_path& other)
+    {
+        if (this != &other)
+        {
+            full_path = other.full_path;
+            drive_absolute_path = other.rebase(full_path);
+            hash = other.hash;
+            components = other.components;
+        }
+
+        return *this;
+    }
+
+    normalized_path& operator=(normalized_path&& other) noexcept
+    {
+        if (this != &other)
+        {
+            auto offset = other.drive_absolute_path ? (other.drive_absolute_path - other.full_path.data()) : -1;
+            full_path = std::move(other.full_path);
+            drive_absolute_path = (offset >= 0) ? (full_path.data() + offset) : nullptr;
+            hash = other.hash;
+            components = other.components;
+            other.drive_absolute_path = nullptr;
+        }
+
+        return *this;
+    }
+
+    // The directory that holds a drive-absolute path, made from the path's components rather than by normalizing it
+    // again. Empty, the same as a path that failed to normalize, for roots and other paths whose parent isn't known
+    normalized_path parent() const noexcept
+    {
+        normalized_path result;
+        auto length = full_path.length();
+        if (!drive_absolute_path || (drive_absolute_path != full_path.data()) || (length <= 3))
+        {
+            return result;
+        }
+
+        // A trailing separator belongs to the last component, e.g. the parent of "C:\foo\" is "C:\"
+        if (full_path.back() == L'\\')
+        {
+            --length;
+        }
+
+        auto parentLength = components.parent_length(length);
+        if ((parentLength == std::wstring_view::npos) || (parentLength < 2) || !result.full_path.try_reserve(parentLength + 1))
+        {
+            return result;
+        }
+
+        result.components = components;
+        std::uint64_t parentHash = 0;
+        result.components.truncate(parentLength, parentHash);
+        if (parentLength == 2)
+        {
+            // Roots keep their separator
+            ++parentLength;
+            parentHash = psf::details::path_hash_append(parentHash, L'\\');
+            result.components.push(2, components.hashes[0]);
+        }
+
+        result.full_path.assign(std::wstring_view(full_path.data(), parentLength));
+        result.drive_absolute_path = result.full_path.data();
+        result.hash = parentHash;
+        return result;
+    }
+
+private:
+    // Since the path may live inline, drive_absolute_path needs to get re-pointed at the new buffer on copy/move
+    wchar_t* rebase(psf::path_buffer& target) const noexcept
+    {
+        return drive_absolute_path ? (target.data() + (drive_absolute_path - full_path.data())) : nullptr;
+    }
 };
 
-normalized_path NormalizePath(const char* path);
-normalized_path NormalizePath(const wchar_t* path);
+normalized_path NormalizePath(const char* path) noexcept;
+normalized_path NormalizePath(const wchar_t* path) noexcept;
+
+// Optionally remembers what relative and rooted paths normalized to on each thread, for as long as the current directory
+// stays the same. RelativePathCacheGeneration is zero when the cache is disabled, and otherwise needs to be read before
+// normalizing the path that gets cached under it
+void InitializeRelativePathCache(const psf::json_object* config);
+std::uint32_t RelativePathCacheGeneration() noexcept;
+bool FindCachedRelativePath(const wchar_t* path, std::size_t length, std::uint32_t generation, normalized_path& result) noexcept;
+void CacheRelativePath(const wchar_t* path, std::size_t length, std::uint32_t generation, const normalized_path& result) noexcept;
+
+// Remembers the last couple of decisions that ShouldRedirect made on each thread, keyed by the path as it was given, so
+// that back-to-back calls on the same path only normalize it and look it up in the redirect cache once. See
+// RedirectMemo.cpp for more details. FindRedirectMemo fills in 'key' whether or not it finds anything, and MemoizeRedirect
+// takes the same 'key' for the same path, so that what gets remembered is keyed by what was read before normalizing it
+struct redirect_memo_key
+{
+    bool memoizable = false;
+    std::size_t length = 0;
+    std::uint32_t generation = 0;
+};
+
+struct redirect_memo
+{
+    bool should_redirect = false;
+    std::uint32_t exists_epoch = 0;
+    std::uint32_t snapshot_version = 0;
+
+    // The normalized path is what the decision is cached under in the redirect cache, along with its hash
+    std::uint64_t hash = 0;
+    std::wstring_view normalized_path;
+    std::wstring_view redirect_path;
+    std::wstring_view deVirtualized_path;
+};
+bool FindRedirectMemo(const wchar_t* path, redirect_memo_key& key, redirect_memo& memo) noexcept;
+void MemoizeRedirect(const wchar_t* path, const redirect_memo_key& key, const redirect_memo& memo) noexcept;
 
 // If the input path is relative to the VFS folder under the package path (e.g. "${PackageRoot}\VFS\SystemX64\foo.txt"),
 // then modifies that path to its virtualized equivalent (e.g. "C:\Windows\System32\foo.txt")
 normalized_path DeVirtualizePath(normalized_path path);
 
+// Optionally lays out the redirected location with a directory per base path, named after a hash of it, rather than
+// mirroring the full path. See RedirectLayout.cpp for more details. AppendRedirectLayoutDirectory appends the directory
+// for 'basePath' to 'redirectPath', which is expected to be the redirect root
+void InitializeRedirectLayout(const psf::json_object* config);
+bool HashedRedirectLayoutEnabled() noexcept;
+void AppendRedirectLayoutDirectory(std::wstring& redirectPath, std::wstring_view basePath);
+
+// The roots of the redirect targets other than persistent, whose root is the redirect root. See RedirectTargets.cpp for
+// more details. RedirectTargetOfPath tells which target a redirected path (with or without its "\\?\" prefix) is under,
+// and sets 'rootLength' to the length of that target's root within 'redirectPath'. Paths that aren't under any of the
+// roots are reported as persistent, with a 'rootLength' of zero
+void InitializeRedirectTargets(const psf::json_object* config);
+bool TryParseRedirectTarget(std::wstring_view name, redirect_target& target) noexcept;
+const std::filesystem::path& RedirectTargetRoot(redirect_target target) noexcept;
+void EnsureRedirectTargetRootExists(redirect_target target) noexcept;
+redirect_target RedirectTargetOfPath(std::wstring_view redirectPath, std::size_t& rootLength) noexcept;
+
 // Short-circuit to determine what the redirected path would be. No check to see if the path should be redirected is
-// performed.
+// performed, other than to find the target of the spec that it matches, if any, which otherwise defaults to persistent
 std::wstring RedirectedPath(const normalized_path& deVirtualizedPath, bool ensureDirectoryStructure = false);
+
+// Whether or not the (de-virtualized, drive-absolute) path matches any of the configured redirection specs. This is the
+// matching step of ShouldRedirect on its own, without any caching or copy-on-read, for benchmarking purposes
+bool PathMatchesRedirectionSpec(const wchar_t* deVirtualizedPath);
@@ -0,0 +1,415 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// When the package and the redirect root are on different volumes (e.g. the redirect root is on a profile VHD), neither
+// block cloning nor a rename applies, and CopyFileEx copies a large file by reading a chunk, then writing it, then
+// reading the next one, so that the copy takes as long as both devices' time combined. With the "pipelinedCopy" option,
+// copies of files at or above a size threshold that cross volumes instead keep several buffers in flight with overlapped
+// I/O: while one buffer's write goes to the destination, the rest are being read from the source, so that the copy runs
+// at the speed of whichever device is slower. The destination gets its full size allocated up front, which saves the
+// file system from growing it one write at a time and keeps it from fragmenting.
+//
+// The copy reports its progress to the progress routine the same way that CopyFileEx does, which is what the copy
+// throttle's budget and the warmup's priority changes go by, and fails with ERROR_REQUEST_ABORTED if the routine cancels.
+// Like with block cloning, what gets copied is the file's data, its timestamps, and the attributes that CopyFile keeps.
+//
+// NOTE: Alternate data streams, extended attributes, and anything else that only CopyFileEx knows how to copy aren't
+//       copied, which is fine for package files. Sparse, compressed, and encrypted files, and copies within the same
+//       volume (where CopyFileEx may be able to offload the copy to the storage) are left to CopyFileEx
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+#include <windows.h>
+
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+constexpr std::uint64_t default_pipelined_copy_size_threshold = 4 * 1024 * 1024;
+constexpr std::uint32_t default_pipelined_copy_buffer_size = 1024 * 1024;
+constexpr std::uint32_t default_pipelined_copy_buffer_count = 4;
+constexpr std::uint32_t max_pipelined_copy_buffer_count = 16;
+constexpr std::uint32_t max_pipelined_copy_buffer_size = 64 * 1024 * 1024;
+
+// Unbuffered I/O needs offsets and lengths that are multiples of the sector size, and buffers that are aligned to it.
+// This is larger than any sector, and the buffers come from VirtualAlloc, which aligns them to at least this much
+constexpr std::uint32_t pipelined_copy_alignment = 64 * 1024;
+
+bool g_pipelinedCopyEnabled = false;
+std::uint64_t g_pipelinedCopySizeThreshold = default_pipelined_copy_size_threshold;
+std::uint32_t g_pipelinedCopyBufferSize = default_pipelined_copy_buffer_size;
+std::uint32_t g_pipelinedCopyBufferCount = default_pipelined_copy_buffer_count;
+
+struct virtual_free
+{
+    void operator()(void* ptr) noexcept
+    {
+        ::VirtualFree(ptr, 0, MEM_RELEASE);
+    }
+};
+using unique_virtual_memory = std::unique_ptr<void, virtual_free>;
+
+struct pipelined_copy_buffer
+{
+    std::byte* data = nullptr;
+    std::uint64_t offset = 0;
+    psf::unique_handle event;
+
+    // The file that the buffer's read or write is outstanding on, if any
+    HANDLE pending_file = nullptr;
+    OVERLAPPED overlapped = {};
+};
+
+enum class pipelined_copy_result
+{
+    copied,
+    failed,         // The last error is set, and the destination has been deleted
+    not_supported,  // Nothing was done. The caller should copy with CopyFileEx
+};
+
+static std::uint64_t align_up(std::uint64_t value) noexcept
+{
+    return (value + pipelined_copy_alignment - 1) & ~static_cast<std::uint64_t>(pipelined_copy_alignment - 1);
+}
+
+static bool start_io(pipelined_copy_buffer& buffer, HANDLE file, bool write, DWORD length) noexcept
+{
+    buffer.overlapped = {};
+    buffer.overlapped.Offset = static_cast<DWORD>(buffer.offset);
+    buffer.overlapped.OffsetHigh = static_cast<DWORD>(buffer.offset >> 32);
+    buffer.overlapped.hEvent = buffer.event.get();
+
+    auto result = write ?
+        impl::WriteFile(file, buffer.data, length, nullptr, &buffer.overlapped) :
+        impl::ReadFile(file, buffer.data, length, nullptr, &buffer.overlapped);
+    if (!result && (::GetLastError() != ERROR_IO_PENDING))
+    {
+        return false;
+    }
+
+    buffer.pending_file = file;
+    return true;
+}
+
+static bool finish_io(pipelined_copy_buffer& buffer, DWORD& bytesTransferred) noexcept
+{
+    auto file = buffer.pending_file;
+    buffer.pending_file = nullptr;
+    return ::GetOverlappedResult(file, &buffer.overlapped, &bytesTransferred, TRUE) != FALSE;
+}
+
+static pipelined_copy_result pipelined_copy(
+    const wchar_t* existingFileName,
+    const wchar_t* newFileName,
+    LPPROGRESS_ROUTINE progressRoutine,
+    LPVOID data,
+    DWORD copyFlags) noexcept
+{
+    // The callers only ever copy to files that don't exist yet, which is all that this handles
+    if ((copyFlags & ~(COPY_FILE_FAIL_IF_EXISTS | COPY_FILE_NO_BUFFERING)) || !(copyFlags & COPY_FILE_FAIL_IF_EXISTS))
+    {
+        return pipelined_copy_result::not_supported;
+    }
+
+    DWORD ioFlags = FILE_FLAG_OVERLAPPED | ((copyFlags & COPY_FILE_NO_BUFFERING) ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+    psf::unique_handle source(impl::CreateFile(
+        existingFileName,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        ioFlags,
+        nullptr));
+    if (!source)
+    {
+        // CopyFileEx reports the error
+        return pipelined_copy_result::not_supported;
+    }
+
+    FILE_BASIC_INFO basicInfo;
+    FILE_STANDARD_INFO standardInfo;
+    DWORD sourceSerialNumber;
+    if (!::GetFileInformationByHandleEx(source.get(), FileBasicInfo, &basicInfo, sizeof(basicInfo)) ||
+        !::GetFileInformationByHandleEx(source.get(), FileStandardInfo, &standardInfo, sizeof(standardInfo)) ||
+        !::GetVolumeInformationByHandleW(source.get(), nullptr, 0, &sourceSerialNumber, nullptr, nullptr, nullptr, 0))
+    {
+        return pipelined_copy_result::not_supported;
+    }
+
+    auto fileSize = static_cast<std::uint64_t>(standardInfo.EndOfFile.QuadPart);
+    constexpr DWORD unsupportedAttributes = FILE_ATTRIBUTE_SPARSE_FILE | FILE_ATTRIBUTE_COMPRESSED | FILE_ATTRIBUTE_ENCRYPTED |
+        FILE_ATTRIBUTE_REPARSE_POINT;
+    if ((fileSize < g_pipelinedCopySizeThreshold) || (basicInfo.FileAttributes & unsupportedAttributes))
+    {
+        return pipelined_copy_result::not_supported;
+    }
+
+    // Everything that can fail without there being anything to clean up gets done before the destination exists
+    auto bufferSize = g_pipelinedCopyBufferSize;
+    auto chunkCount = (fileSize + bufferSize - 1) / bufferSize;
+    auto bufferCount = static_cast<std::uint32_t>((std::min<std::uint64_t>)(g_pipelinedCopyBufferCount, chunkCount));
+    unique_virtual_memory memory(::VirtualAlloc(nullptr, static_cast<SIZE_T>(bufferSize) * bufferCount, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    if (!memory)
+    {
+        return pipelined_copy_result::not_supported;
+    }
+
+    pipelined_copy_buffer buffers[max_pipelined_copy_buffer_count];
+    for (std::uint32_t i = 0; i < bufferCount; ++i)
+    {
+        buffers[i].data = static_cast<std::byte*>(memory.get()) + static_cast<std::size_t>(i) * bufferSize;
+        buffers[i].event.reset(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+        if (!buffers[i].event)
+        {
+            return pipelined_copy_result::not_supported;
+        }
+    }
+
+    // CREATE_NEW so that we fail the same way that COPY_FILE_FAIL_IF_EXISTS would
+    psf::unique_handle target(impl::CreateFile(
+        newFileName,
+        GENERIC_WRITE | DELETE,
+        0,
+        nullptr,
+        CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL | ioFlags,
+        nullptr));
+    if (!target)
+    {
+        auto err = ::GetLastError();
+        return ((err == ERROR_FILE_EXISTS) || (err == ERROR_ALREADY_EXISTS) || (err == ERROR_PATH_NOT_FOUND)) ?
+            pipelined_copy_result::failed : pipelined_copy_result::not_supported;
+    }
+
+    auto deleteTarget = [&]() noexcept
+    {
+        FILE_DISPOSITION_INFO dispositionInfo = { TRUE };
+        impl::SetFileInformationByHandle(target.get(), FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo));
+    };
+
+    DWORD targetSerialNumber;
+    if (!::GetVolumeInformationByHandleW(target.get(), nullptr, 0, &targetSerialNumber, nullptr, nullptr, nullptr, 0) ||
+        (targetSerialNumber == sourceSerialNumber))
+    {
+        deleteTarget();
+        return pipelined_copy_result::not_supported;
+    }
+
+    auto quiet = (progressRoutine == nullptr);
+    auto reportProgress = [&](std::uint64_t bytesCopied, DWORD reason) noexcept
+    {
+        if (quiet)
+        {
+            return true;
+        }
+
+        LARGE_INTEGER totalSize;
+        LARGE_INTEGER transferred;
+        totalSize.QuadPart = static_cast<LONGLONG>(fileSize);
+        transferred.QuadPart = static_cast<LONGLONG>(bytesCopied);
+        switch (progressRoutine(totalSize, transferred, totalSize, transferred, 1, reason, source.get(), target.get(), data))
+        {
+        case PROGRESS_CONTINUE:
+            return true;
+
+        case PROGRESS_QUIET:
+            quiet = true;
+            return true;
+
+        default:
+            // PROGRESS_STOP can't be resumed from here, so it gets treated the same as PROGRESS_CANCEL
+            ::SetLastError(ERROR_REQUEST_ABORTED);
+            return false;
+        }
+    };
+
+    // NOTE: Reads never go past the end of the file, but unbuffered ones need to cover all of its last sector
+    std::uint64_t nextRead = 0;
+    auto startRead = [&](pipelined_copy_buffer& buffer) noexcept
+    {
+        buffer.offset = nextRead * bufferSize;
+        ++nextRead;
+        auto length = (std::min<std::uint64_t>)(bufferSize, fileSize - buffer.offset);
+        return start_io(buffer, source.get(), false, static_cast<DWORD>((ioFlags & FILE_FLAG_NO_BUFFERING) ? align_up(length) : length));
+    };
+
+    std::uint64_t bytesCopied = 0;
+    auto finishWrite = [&](pipelined_copy_buffer& buffer) noexcept
+    {
+        DWORD bytesWritten;
+        if (!finish_io(buffer, bytesWritten))
+        {
+            return false;
+        }
+
+        bytesCopied += (std::min<std::uint64_t>)(bufferSize, fileSize - buffer.offset);
+        return reportProgress(bytesCopied, CALLBACK_CHUNK_FINISHED);
+    };
+
+    auto copyData = [&]() noexcept
+    {
+        // Allocating the whole file is where running out of disk space shows up, before anything gets written
+        FILE_ALLOCATION_INFO allocationInfo;
+        allocationInfo.AllocationSize.QuadPart = static_cast<LONGLONG>(align_up(fileSize));
+        if (!impl::SetFileInformationByHandle(target.get(), FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)) ||
+            !reportProgress(0, CALLBACK_STREAM_SWITCH))
+        {
+            return false;
+        }
+
+        for (std::uint32_t i = 0; i < bufferCount; ++i)
+        {
+            if (!startRead(buffers[i]))
+            {
+                return false;
+            }
+        }
+
+        // The buffer for each chunk is the one that the chunk before it is still being written from once its read
+        // completes. Each chunk's buffer gets reused for the next read that's needed as soon as its write completes,
+        // which it has had the whole of the next chunk's read to do
+        for (std::uint64_t chunk = 0; chunk < chunkCount; ++chunk)
+        {
+            auto& buffer = buffers[chunk % bufferCount];
+            DWORD bytesRead;
+            if (!finish_io(buffer, bytesRead))
+            {
+                return false;
+            }
+
+            auto length = (std::min<std::uint64_t>)(bufferSize, fileSize - buffer.offset);
+            if (bytesRead < length)
+            {
+                // The source got shorter after we started
+                ::SetLastError(ERROR_HANDLE_EOF);
+                return false;
+            }
+
+            if (!start_io(buffer, target.get(), true, static_cast<DWORD>((ioFlags & FILE_FLAG_NO_BUFFERING) ? align_up(length) : length)))
+            {
+                return false;
+            }
+
+            if (chunk > 0)
+            {
+                auto& previous = buffers[(chunk - 1) % bufferCount];
+                if (!finishWrite(previous) || ((nextRead < chunkCount) && !startRead(previous)))
+                {
+                    return false;
+                }
+            }
+        }
+
+        if (!finishWrite(buffers[(chunkCount - 1) % bufferCount]))
+        {
+            return false;
+        }
+
+        // Unbuffered writes of the last chunk went as far as the end of its last sector, and the allocation may have
+        // gone further than that
+        FILE_END_OF_FILE_INFO endOfFileInfo;
+        endOfFileInfo.EndOfFile.QuadPart = static_cast<LONGLONG>(fileSize);
+        if (!impl::SetFileInformationByHandle(target.get(), FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+        {
+            return false;
+        }
+
+        // Match what CopyFile preserves: timestamps and the "settable" attributes
+        constexpr DWORD copiedAttributes = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+            FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+        basicInfo.ChangeTime.QuadPart = 0;
+        basicInfo.FileAttributes &= copiedAttributes;
+        if (!basicInfo.FileAttributes)
+        {
+            basicInfo.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+        }
+
+        return impl::SetFileInformationByHandle(target.get(), FileBasicInfo, &basicInfo, sizeof(basicInfo)) != FALSE;
+    };
+
+    if (!copyData())
+    {
+        // Nothing can be left in flight once the buffers go away
+        auto err = ::GetLastError();
+        for (std::uint32_t i = 0; i < bufferCount; ++i)
+        {
+            if (auto file = buffers[i].pending_file)
+            {
+                DWORD bytesTransferred;
+                ::CancelIoEx(file, &buffers[i].overlapped);
+                finish_io(buffers[i], bytesTransferred);
+            }
+        }
+
+        deleteTarget();
+        ::SetLastError(err);
+        return pipelined_copy_result::failed;
+    }
+
+    return pipelined_copy_result::copied;
+}
+
+BOOL PipelinedCopyFile(
+    const wchar_t* existingFileName,
+    const wchar_t* newFileName,
+    LPPROGRESS_ROUTINE progressRoutine,
+    LPVOID data,
+    DWORD copyFlags)
+{
+    if (g_pipelinedCopyEnabled)
+    {
+        switch (pipelined_copy(existingFileName, newFileName, progressRoutine, data, copyFlags))
+        {
+        case pipelined_copy_result::copied:
+            return TRUE;
+
+        case pipelined_copy_result::failed:
+            return FALSE;
+
+        case pipelined_copy_result::not_supported:
+            break;
+        }
+    }
+
+    return impl::CopyFileEx(existingFileName, newFileName, progressRoutine, data, nullptr, copyFlags);
+}
+
+void InitializePipelinedCopy(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    if (auto sizeThresholdValue = config->try_get("sizeThreshold"))
+    {
+        g_pipelinedCopySizeThreshold = sizeThresholdValue->as_number().get_unsigned();
+    }
+
+    if (auto bufferSizeValue = config->try_get("bufferSize"))
+    {
+        // Kept small enough that all of the buffers together still fit in a 32-bit process's address space
+        auto bufferSize = (std::min<std::uint64_t>)(bufferSizeValue->as_number().get_unsigned(), max_pipelined_copy_buffer_size);
+        g_pipelinedCopyBufferSize = static_cast<std::uint32_t>((std::max<std::uint64_t>)(align_up(bufferSize), pipelined_copy_alignment));
+    }
+
+    if (auto buffersValue = config->try_get("buffers"))
+    {
+        // With only one buffer, each read would have to wait for the write before it
+        auto buffers = buffersValue->as_number().get_unsigned();
+        g_pipelinedCopyBufferCount = static_cast<std::uint32_t>(std::clamp<std::uint64_t>(buffers, 2, max_pipelined_copy_buffer_count));
+    }
+
+    g_pipelinedCopyEnabled = true;
+}
@@ -0,0 +1,983 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// GetPrivateProfileString and friends re-open and re-parse the INI file on every call, and legacy applications tend to
+// read hundreds of keys, one at a time, as they start up. When the "privateProfileCache" option is enabled, redirected
+// INI files are instead parsed once into a section/key index and reads are answered from memory. Before each read, we
+// compare the file's last write time and size with what they were when we parsed it, and re-parse if they changed.
+//
+// The parsing and lookup rules mirror the Win32 implementation: section and key names are case insensitive and have
+// surrounding white space removed, only the first occurrence of a section or key is used, lines starting with ';' are
+// comments, values have surrounding white space and matching quotes removed, and default strings have trailing spaces
+// removed. Files are either UTF-16 (with a byte order mark) or in the ANSI code page. Anything that we can't be sure
+// to answer the same way (e.g. a UTF-8 file, or a file that we fail to read) is left to the Win32 API.
+//
+// WritePrivateProfileString rewrites the whole file on every call, and settings dialogs tend to save dozens of keys in
+// a row. When "writeBehind" is also enabled, writes are instead applied to an in-memory copy of the file's lines, which
+// is what subsequent reads are answered from, and the file is written out with a single replace once no writes have
+// come in for "writeBehindDelay" milliseconds. Anything else that touches the file goes through ShouldRedirect first,
+// which writes it out before returning, as does PSFUninitialize.
+//
+// NOTE: Edits are made in place so that comments, blank lines, and everything else the application doesn't write stay
+//       as they were. Writes that we can't apply the same way that the Win32 API would (e.g. to a read-only file, or of
+//       characters that don't exist in an ANSI file's code page) write out any pending changes first and are then left
+//       to the Win32 API
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fancy_handle.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+// INI files larger than this are rare, and parsing them into memory isn't worth it
+constexpr std::uint64_t max_cached_profile_size = 4 * 1024 * 1024;
+constexpr std::size_t max_cached_profiles = 64;
+
+constexpr DWORD default_write_behind_delay = 1000;
+
+struct profile_key
+{
+    std::wstring name;
+    std::wstring value;
+    bool has_value = false; // I.e. the line had an '='
+};
+
+struct profile_section
+{
+    std::wstring name;
+    std::vector<profile_key> keys;
+    std::unordered_map<iwstring, std::size_t, case_insensitive_hash<wchar_t>> key_index;
+};
+
+struct profile_file
+{
+    FILETIME last_write_time;
+    std::uint64_t size;
+
+    // True when this was parsed from writes that haven't been written to disk yet, in which case the above are unused
+    bool pending_writes = false;
+
+    std::vector<profile_section> sections;
+    std::unordered_map<iwstring, std::size_t, case_insensitive_hash<wchar_t>> section_index;
+
+    const profile_section* find_section(std::wstring_view name) const
+    {
+        auto itr = section_index.find(iwstring(name.data(), name.length()));
+        return (itr == section_index.end()) ? nullptr : &sections[itr->second];
+    }
+};
+
+// The lines of a file that has writes which haven't been written to disk yet
+struct pending_profile
+{
+    std::filesystem::path path;
+    std::vector<std::wstring> lines;
+    bool unicode = false;
+};
+
+bool g_privateProfileCacheEnabled = false;
+
+std::shared_mutex g_privateProfileCacheMutex;
+std::map<iwstring, std::shared_ptr<const profile_file>> g_privateProfileCache;
+
+// NOTE: When both are needed, g_pendingProfileMutex is acquired before g_privateProfileCacheMutex
+std::atomic<bool> g_privateProfileWriteBehind = false;
+DWORD g_privateProfileWriteBehindDelay = default_write_behind_delay;
+PTP_TIMER g_pendingProfileTimer = nullptr;
+std::mutex g_pendingProfileMutex;
+std::map<iwstring, pending_profile> g_pendingProfiles;
+std::atomic<std::size_t> g_pendingProfileCount = 0;
+
+static constexpr bool is_profile_space(wchar_t ch) noexcept
+{
+    return (ch == L' ') || (ch == L'\t') || (ch == L'\r') || (ch == L'\v') || (ch == L'\f');
+}
+
+static std::wstring_view trim_profile_space(std::wstring_view str) noexcept
+{
+    while (!str.empty() && is_profile_space(str.front()))
+    {
+        str.remove_prefix(1);
+    }
+
+    while (!str.empty() && is_profile_space(str.back()))
+    {
+        str.remove_suffix(1);
+    }
+
+    return str;
+}
+
+static void parse_profile(std::wstring_view contents, profile_file& file)
+{
+    profile_section* section = nullptr;
+    while (!contents.empty())
+    {
+        auto lineEnd = contents.find(L'\n');
+        auto line = trim_profile_space(contents.substr(0, lineEnd));
+        contents.remove_prefix((lineEnd == std::wstring_view::npos) ? contents.length() : (lineEnd + 1));
+
+        if (line.empty())
+        {
+            continue;
+        }
+
+        if (line.front() == L'[')
+        {
+            // A missing ']' still starts a section; the name just extends to the end of the line
+            auto name = trim_profile_space(line.substr(1, line.find(L']') - 1));
+            section = &file.sections.emplace_back();
+            section->name = name;
+            file.section_index.emplace(iwstring(name.data(), name.length()), file.sections.size() - 1);
+            continue;
+        }
+
+        // Keys that come before the first section don't belong to anything and can't be read
+        if (!section || (line.front() == L';'))
+        {
+            continue;
+        }
+
+        auto& key = section->keys.emplace_back();
+        if (auto pos = line.find(L'='); pos != std::wstring_view::npos)
+        {
+            key.name = trim_profile_space(line.substr(0, pos));
+            key.value = trim_profile_space(line.substr(pos + 1));
+            key.has_value = true;
+        }
+        else
+        {
+            key.name = line;
+        }
+
+        section->key_index.emplace(iwstring(key.name.data(), key.name.length()), section->keys.size() - 1);
+    }
+}
+
+// Reads the contents of a file that's at most max_cached_profile_size bytes. Returns false if the file can't be read,
+// or if it isn't in a format that we know how to handle
+static bool read_profile_contents(HANDLE file, std::uint64_t size, std::wstring& contents, bool& unicode)
+{
+    if (size > max_cached_profile_size)
+    {
+        return false;
+    }
+
+    std::string bytes(static_cast<std::size_t>(size), '\0');
+    DWORD bytesRead;
+    if (!impl::ReadFile(file, bytes.data(), static_cast<DWORD>(bytes.size()), &bytesRead, nullptr) ||
+        (bytesRead != bytes.size()))
+    {
+        return false;
+    }
+
+    if ((bytes.size() >= 2) && (bytes[0] == '\xFF') && (bytes[1] == '\xFE'))
+    {
+        contents.assign((bytes.size() - 2) / sizeof(wchar_t), L'\0');
+        std::memcpy(contents.data(), bytes.data() + 2, contents.size() * sizeof(wchar_t));
+        unicode = true;
+    }
+    else if (((bytes.size() >= 2) && (bytes[0] == '\xFE') && (bytes[1] == '\xFF')) ||
+        ((bytes.size() >= 3) && (bytes[0] == '\xEF') && (bytes[1] == '\xBB') && (bytes[2] == '\xBF')))
+    {
+        // Big endian UTF-16 and UTF-8
+        return false;
+    }
+    else
+    {
+        contents = widen(bytes, CP_ACP);
+        unicode = false;
+    }
+
+    return true;
+}
+
+// Returns null if the file can't be read, or if it isn't in a format that we know how to handle
+static std::shared_ptr<const profile_file> load_profile(const std::filesystem::path& path)
+{
+    psf::unique_handle file(impl::CreateFile(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!file)
+    {
+        return nullptr;
+    }
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!::GetFileInformationByHandle(file.get(), &info))
+    {
+        return nullptr;
+    }
+
+    auto result = std::make_shared<profile_file>();
+    result->last_write_time = info.ftLastWriteTime;
+    result->size = (static_cast<std::uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+
+    std::wstring contents;
+    bool unicode;
+    if (!read_profile_contents(file.get(), result->size, contents, unicode))
+    {
+        return nullptr;
+    }
+
+    parse_profile(contents, *result);
+    return result;
+}
+
+// Drops everything that's been cached, other than files with pending writes, since those can't be re-read from disk.
+// The caller must hold g_privateProfileCacheMutex exclusively
+static void trim_profile_cache() noexcept
+{
+    for (auto itr = g_privateProfileCache.begin(); itr != g_privateProfileCache.end(); )
+    {
+        itr = itr->second->pending_writes ? std::next(itr) : g_privateProfileCache.erase(itr);
+    }
+}
+
+// Returns null if the read should be left to the Win32 API
+static std::shared_ptr<const profile_file> get_profile(const std::filesystem::path& path)
+{
+    iwstring key(path.native().c_str(), path.native().length());
+    std::shared_ptr<const profile_file> cached;
+    {
+        std::shared_lock lock(g_privateProfileCacheMutex);
+        if (auto itr = g_privateProfileCache.find(key); itr != g_privateProfileCache.end())
+        {
+            if (itr->second->pending_writes)
+            {
+                // What's on disk is out of date
+                return itr->second;
+            }
+            cached = itr->second;
+        }
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!impl::GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data))
+    {
+        return nullptr;
+    }
+
+    auto size = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    if (cached && (::CompareFileTime(&cached->last_write_time, &data.ftLastWriteTime) == 0) && (cached->size == size))
+    {
+        return cached;
+    }
+
+    std::shared_ptr<const profile_file> file;
+    try
+    {
+        file = load_profile(path);
+    }
+    catch (...)
+    {
+        // E.g. the file contains characters that aren't valid in the ANSI code page
+    }
+
+    std::unique_lock lock(g_privateProfileCacheMutex);
+    if (auto itr = g_privateProfileCache.find(key); (itr != g_privateProfileCache.end()) && itr->second->pending_writes)
+    {
+        // The file was written to while we were reading it
+        return itr->second;
+    }
+
+    if (!file)
+    {
+        g_privateProfileCache.erase(key);
+        return nullptr;
+    }
+
+    // If the file changed in between querying its attributes and opening it, then store what we read. The next read
+    // will see the mismatch and re-parse the file
+    if (g_privateProfileCache.size() >= max_cached_profiles)
+    {
+        trim_profile_cache();
+    }
+    g_privateProfileCache.insert_or_assign(std::move(key), file);
+    return file;
+}
+
+static std::optional<std::wstring_view> profile_section_name(std::wstring_view line) noexcept
+{
+    line = trim_profile_space(line);
+    if (line.empty() || (line.front() != L'['))
+    {
+        return std::nullopt;
+    }
+
+    return trim_profile_space(line.substr(1, line.find(L']') - 1));
+}
+
+static std::optional<std::wstring_view> profile_key_name(std::wstring_view line) noexcept
+{
+    line = trim_profile_space(line);
+    if (line.empty() || (line.front() == L'[') || (line.front() == L';'))
+    {
+        return std::nullopt;
+    }
+
+    return trim_profile_space(line.substr(0, line.find(L'=')));
+}
+
+static bool profile_names_equal(std::wstring_view lhs, std::wstring_view rhs) noexcept
+{
+    return iwstring_view(lhs.data(), lhs.length()) == iwstring_view(rhs.data(), rhs.length());
+}
+
+// Applies a single WritePrivateProfileString call to the lines of a file. A null key deletes the whole section and a
+// null value deletes the key
+static void apply_profile_write(std::vector<std::wstring>& lines, const wchar_t* appName, const wchar_t* keyName, const wchar_t* string)
+{
+    auto sectionBegin = std::find_if(lines.begin(), lines.end(), [&](const std::wstring& line)
+    {
+        auto name = profile_section_name(line);
+        return name && profile_names_equal(*name, appName);
+    });
+
+    if (sectionBegin == lines.end())
+    {
+        if (keyName && string)
+        {
+            lines.push_back(L"[" + std::wstring(appName) + L"]");
+            lines.push_back(std::wstring(keyName) + L"=" + string);
+        }
+        return;
+    }
+
+    auto sectionEnd = std::find_if(std::next(sectionBegin), lines.end(), [](const std::wstring& line)
+    {
+        return profile_section_name(line).has_value();
+    });
+
+    if (!keyName)
+    {
+        lines.erase(sectionBegin, sectionEnd);
+        return;
+    }
+
+    auto keyLine = std::find_if(std::next(sectionBegin), sectionEnd, [&](const std::wstring& line)
+    {
+        auto name = profile_key_name(line);
+        return name && profile_names_equal(*name, keyName);
+    });
+
+    if (keyLine != sectionEnd)
+    {
+        if (string)
+        {
+            *keyLine = std::wstring(keyName) + L"=" + string;
+        }
+        else
+        {
+            lines.erase(keyLine);
+        }
+        return;
+    }
+
+    if (string)
+    {
+        // New keys go after the last line of the section that isn't blank
+        auto insertPos = sectionEnd;
+        while ((std::prev(insertPos) != sectionBegin) && trim_profile_space(*std::prev(insertPos)).empty())
+        {
+            --insertPos;
+        }
+        lines.insert(insertPos, std::wstring(keyName) + L"=" + string);
+    }
+}
+
+static void arm_pending_profile_timer() noexcept
+{
+    // Relative due times are negative, in 100ns units
+    ULARGE_INTEGER dueTime;
+    dueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(g_privateProfileWriteBehindDelay) * 10000);
+    FILETIME dueFileTime = { dueTime.LowPart, dueTime.HighPart };
+    ::SetThreadpoolTimer(g_pendingProfileTimer, &dueFileTime, 0, 0);
+}
+
+// Writes a file's pending changes to disk by writing everything to a temporary file and then replacing the original
+// with it, so that nothing ever sees a partially written file. Returns false, and leaves the changes pending, if the
+// file can't be written. The caller must hold g_pendingProfileMutex
+static bool flush_pending_profile(std::map<iwstring, pending_profile>::iterator itr) noexcept try
+{
+    auto& pending = itr->second;
+
+    std::wstring contents;
+    for (auto& line : pending.lines)
+    {
+        contents += line;
+        contents += L"\r\n";
+    }
+
+    std::string bytes;
+    if (pending.unicode)
+    {
+        bytes.assign("\xFF\xFE");
+        bytes.append(reinterpret_cast<const char*>(contents.data()), contents.length() * sizeof(wchar_t));
+    }
+    else
+    {
+        bytes = narrow(contents, CP_ACP);
+    }
+
+    auto tempPath = pending.path.native() + L".psftmp";
+    {
+        psf::unique_handle file(impl::CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file)
+        {
+            return false;
+        }
+
+        DWORD bytesWritten;
+        if (!impl::WriteFile(file.get(), bytes.data(), static_cast<DWORD>(bytes.size()), &bytesWritten, nullptr) ||
+            (bytesWritten != bytes.size()))
+        {
+            file.reset();
+            impl::DeleteFile(tempPath.c_str());
+            return false;
+        }
+    }
+
+    // ReplaceFile keeps the original file's attributes and security descriptor, but requires that it exist
+    auto replaced = impl::PathExists(pending.path.c_str()) ?
+        impl::ReplaceFile(pending.path.c_str(), tempPath.c_str(), nullptr, REPLACEFILE_IGNORE_MERGE_ERRORS, nullptr, nullptr) :
+        impl::MoveFileEx(tempPath.c_str(), pending.path.c_str(), MOVEFILE_REPLACE_EXISTING);
+    if (!replaced)
+    {
+        impl::DeleteFile(tempPath.c_str());
+        return false;
+    }
+
+    RedirectedPathCreated(pending.path.c_str());
+    {
+        // The next read re-parses what we just wrote
+        std::unique_lock lock(g_privateProfileCacheMutex);
+        g_privateProfileCache.erase(itr->first);
+    }
+
+    g_pendingProfiles.erase(itr);
+    --g_pendingProfileCount;
+    return true;
+}
+catch (...)
+{
+    return false;
+}
+
+// Returns false, and leaves the changes pending, if any file couldn't be written. The caller must hold
+// g_pendingProfileMutex
+static bool flush_pending_profiles() noexcept
+{
+    bool result = true;
+    for (auto itr = g_pendingProfiles.begin(); itr != g_pendingProfiles.end(); )
+    {
+        auto next = std::next(itr);
+        result = flush_pending_profile(itr) && result;
+        itr = next;
+    }
+
+    return result;
+}
+
+static void __stdcall PendingProfileTimerCallback(PTP_CALLBACK_INSTANCE, void*, PTP_TIMER) noexcept
+{
+    std::lock_guard lock(g_pendingProfileMutex);
+    if (!flush_pending_profiles() && g_privateProfileWriteBehind)
+    {
+        // Try again later, e.g. if the file was temporarily locked by someone else
+        arm_pending_profile_timer();
+    }
+}
+
+void FlushPrivateProfileWrites(std::wstring_view redirectPath) noexcept try
+{
+    if (g_pendingProfileCount == 0)
+    {
+        return;
+    }
+
+    // Callers are about to perform an operation of their own on the file, so preserve the error from their caller
+    auto lastError = ::GetLastError();
+    iwstring key(redirectPath.data(), redirectPath.length());
+    std::lock_guard lock(g_pendingProfileMutex);
+    if (auto itr = g_pendingProfiles.find(key); itr != g_pendingProfiles.end())
+    {
+        flush_pending_profile(itr);
+    }
+    ::SetLastError(lastError);
+}
+catch (...)
+{
+    // Out of memory. The write will happen when the timer fires
+}
+
+// Loads the lines of a file so that writes can be applied to it. Returns false when the write should be left to the
+// Win32 API
+static bool load_pending_profile(const std::filesystem::path& path, pending_profile& pending)
+{
+    pending.path = path;
+
+    psf::unique_handle file(impl::CreateFile(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!file)
+    {
+        // The Win32 API creates the file if it doesn't exist, but can't create its directory. New files are ANSI
+        return (::GetLastError() == ERROR_FILE_NOT_FOUND) && impl::PathExists(path.parent_path().c_str());
+    }
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!::GetFileInformationByHandle(file.get(), &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_READONLY))
+    {
+        return false;
+    }
+
+    std::wstring contents;
+    auto size = (static_cast<std::uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    if (!read_profile_contents(file.get(), size, contents, pending.unicode))
+    {
+        return false;
+    }
+
+    std::wstring_view remaining = contents;
+    while (!remaining.empty())
+    {
+        auto lineEnd = remaining.find(L'\n');
+        auto line = remaining.substr(0, lineEnd);
+        if (!line.empty() && (line.back() == L'\r'))
+        {
+            line.remove_suffix(1);
+        }
+
+        pending.lines.emplace_back(line);
+        remaining.remove_prefix((lineEnd == std::wstring_view::npos) ? remaining.length() : (lineEnd + 1));
+    }
+
+    return true;
+}
+
+bool TryDeferPrivateProfileWrite(
+    const std::filesystem::path& redirectPath,
+    const wchar_t* appName,
+    const wchar_t* keyName,
+    const wchar_t* string) noexcept try
+{
+    if (!g_privateProfileWriteBehind)
+    {
+        return false;
+    }
+
+    iwstring key(redirectPath.native().c_str(), redirectPath.native().length());
+    std::lock_guard lock(g_pendingProfileMutex);
+    auto itr = g_pendingProfiles.find(key);
+
+    // A null section asks the Win32 API to flush its own cache
+    auto fallBack = [&]() noexcept
+    {
+        if (itr != g_pendingProfiles.end())
+        {
+            flush_pending_profile(itr);
+        }
+        return false;
+    };
+
+    if (!appName)
+    {
+        return fallBack();
+    }
+
+    pending_profile loaded;
+    auto& pending = (itr != g_pendingProfiles.end()) ? itr->second : loaded;
+    if ((itr == g_pendingProfiles.end()) && !load_pending_profile(redirectPath, loaded))
+    {
+        return false;
+    }
+
+    if (!pending.unicode)
+    {
+        // Throws if any of the strings can't be represented in the file's code page
+        for (auto str : { appName, keyName, string })
+        {
+            if (str)
+            {
+                narrow(str, CP_ACP);
+            }
+        }
+    }
+
+    auto lines = pending.lines;
+    apply_profile_write(lines, appName, keyName, string);
+
+    auto file = std::make_shared<profile_file>();
+    file->pending_writes = true;
+    std::wstring contents;
+    for (auto& line : lines)
+    {
+        contents += line;
+        contents += L'\n';
+    }
+    parse_profile(contents, *file);
+
+    pending.lines = std::move(lines);
+    if (itr == g_pendingProfiles.end())
+    {
+        g_pendingProfiles.emplace(key, std::move(loaded));
+        ++g_pendingProfileCount;
+    }
+
+    {
+        std::unique_lock cacheLock(g_privateProfileCacheMutex);
+        if (g_privateProfileCache.size() >= max_cached_profiles)
+        {
+            trim_profile_cache();
+        }
+        g_privateProfileCache.insert_or_assign(std::move(key), std::move(file));
+    }
+
+    arm_pending_profile_timer();
+    return true;
+}
+catch (...)
+{
+    // NOTE: Nothing gets modified until everything that can throw has succeeded, except for the final insert into the
+    //       cache, and only after the lines have already been updated. Either way, writing out what we've got keeps the
+    //       file consistent with what the Win32 API will see
+    FlushPrivateProfileWrites(redirectPath.native());
+    return false;
+}
+
+static std::wstring to_profile_wide(const char* str)
+{
+    return str ? widen(str, CP_ACP) : std::wstring{};
+}
+
+static std::wstring to_profile_wide(const wchar_t* str)
+{
+    return str ? std::wstring(str) : std::wstring{};
+}
+
+// Copies a single string, truncating it if necessary. Returns the number of characters copied, not including the null
+// terminator, same as GetPrivateProfileString
+template <typename CharT>
+static DWORD copy_profile_string(std::wstring_view value, CharT* string, DWORD stringLength)
+{
+    if (!string || (stringLength == 0))
+    {
+        return 0;
+    }
+
+    std::size_t length;
+    if constexpr (psf::is_ansi<CharT>)
+    {
+        auto narrowValue = narrow(value, CP_ACP);
+        length = (std::min)(narrowValue.length(), static_cast<std::size_t>(stringLength - 1));
+        std::memcpy(string, narrowValue.data(), length);
+    }
+    else
+    {
+        length = (std::min)(value.length(), static_cast<std::size_t>(stringLength - 1));
+        std::memcpy(string, value.data(), length * sizeof(wchar_t));
+    }
+
+    string[length] = CharT();
+    return static_cast<DWORD>(length);
+}
+
+// Copies a list of null terminated strings, followed by an additional null terminator. If everything doesn't fit, the
+// list is truncated (and is still double null terminated) and the return value is stringLength - 2, same as the Win32
+// API. Otherwise, returns the number of characters copied, not including the final null terminator
+template <typename CharT>
+static DWORD copy_profile_list(const std::vector<std::wstring>& values, CharT* string, DWORD stringLength)
+{
+    if (!string || (stringLength == 0))
+    {
+        return 0;
+    }
+
+    std::basic_string<CharT> list;
+    for (auto& value : values)
+    {
+        if constexpr (psf::is_ansi<CharT>)
+        {
+            list += narrow(value, CP_ACP);
+        }
+        else
+        {
+            list += value;
+        }
+        list.push_back(CharT());
+    }
+
+    if (list.length() < stringLength)
+    {
+        std::memcpy(string, list.data(), list.length() * sizeof(CharT));
+        string[list.length()] = CharT();
+        return static_cast<DWORD>(list.length());
+    }
+
+    if (stringLength == 1)
+    {
+        string[0] = CharT();
+        return 0;
+    }
+
+    std::memcpy(string, list.data(), (stringLength - 2) * sizeof(CharT));
+    string[stringLength - 2] = CharT();
+    string[stringLength - 1] = CharT();
+    return stringLength - 2;
+}
+
+// NOTE: Callers fall back to the Win32 API when these return false, which should also be the case if anything throws;
+//       letting the exception propagate would instead send the caller to the non-redirected file
+template <typename CharT>
+static bool try_get_cached_profile_string(
+    const std::filesystem::path& redirectPath,
+    const CharT* appName,
+    const CharT* keyName,
+    const CharT* defaultString,
+    CharT* string,
+    DWORD stringLength,
+    DWORD& result) noexcept try
+{
+    if (!g_privateProfileCacheEnabled)
+    {
+        return false;
+    }
+
+    auto file = get_profile(redirectPath);
+    if (!file)
+    {
+        return false;
+    }
+
+    auto defaultValue = to_profile_wide(defaultString);
+    while (!defaultValue.empty() && (defaultValue.back() == L' '))
+    {
+        defaultValue.pop_back();
+    }
+
+    if (!appName)
+    {
+        std::vector<std::wstring> names;
+        for (auto& section : file->sections)
+        {
+            names.push_back(section.name);
+        }
+
+        result = copy_profile_list(names, string, stringLength);
+        return true;
+    }
+
+    auto section = file->find_section(to_profile_wide(appName));
+    if (!keyName)
+    {
+        std::vector<std::wstring> names;
+        if (section)
+        {
+            for (auto& key : section->keys)
+            {
+                names.push_back(key.name);
+            }
+        }
+
+        // When there are no keys, the Win32 API gives back the default string instead of an empty list
+        result = names.empty() ? copy_profile_string(defaultValue, string, stringLength) : copy_profile_list(names, string, stringLength);
+        return true;
+    }
+
+    const profile_key* key = nullptr;
+    if (section)
+    {
+        if (auto itr = section->key_index.find(iwstring(to_profile_wide(keyName).c_str())); itr != section->key_index.end())
+        {
+            key = &section->keys[itr->second];
+        }
+    }
+
+    if (!key || !key->has_value)
+    {
+        result = copy_profile_string(defaultValue, string, stringLength);
+        return true;
+    }
+
+    std::wstring_view value = key->value;
+    if ((value.length() >= 2) && ((value.front() == L'"') || (value.front() == L'\'')) && (value.back() == value.front()))
+    {
+        value = value.substr(1, value.length() - 2);
+    }
+
+    result = copy_profile_string(value, string, stringLength);
+    return true;
+}
+catch (...)
+{
+    // The Win32 API is going to read the file from disk
+    FlushPrivateProfileWrites(redirectPath.native());
+    return false;
+}
+
+template <typename CharT>
+static bool try_get_cached_profile_section(
+    const std::filesystem::path& redirectPath,
+    const CharT* appName,
+    CharT* string,
+    DWORD stringLength,
+    DWORD& result) noexcept try
+{
+    if (!g_privateProfileCacheEnabled || !appName)
+    {
+        return false;
+    }
+
+    auto file = get_profile(redirectPath);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::vector<std::wstring> lines;
+    if (auto section = file->find_section(to_profile_wide(appName)))
+    {
+        for (auto& key : section->keys)
+        {
+            lines.push_back(key.has_value ? (key.name + L'=' + key.value) : key.name);
+        }
+    }
+
+    result = copy_profile_list(lines, string, stringLength);
+    return true;
+}
+catch (...)
+{
+    // The Win32 API is going to read the file from disk
+    FlushPrivateProfileWrites(redirectPath.native());
+    return false;
+}
+
+bool TryGetCachedPrivateProfileString(
+    const std::filesystem::path& redirectPath,
+    const char* appName,
+    const char* keyName,
+    const char* defaultString,
+    char* string,
+    DWORD stringLength,
+    DWORD& result)
+{
+    return try_get_cached_profile_string(redirectPath, appName, keyName, defaultString, string, stringLength, result);
+}
+
+bool TryGetCachedPrivateProfileString(
+    const std::filesystem::path& redirectPath,
+    const wchar_t* appName,
+    const wchar_t* keyName,
+    const wchar_t* defaultString,
+    wchar_t* string,
+    DWORD stringLength,
+    DWORD& result)
+{
+    return try_get_cached_profile_string(redirectPath, appName, keyName, defaultString, string, stringLength, result);
+}
+
+bool TryGetCachedPrivateProfileSection(
+    const std::filesystem::path& redirectPath,
+    const char* appName,
+    char* string,
+    DWORD stringLength,
+    DWORD& result)
+{
+    return try_get_cached_profile_section(redirectPath, appName, string, stringLength, result);
+}
+
+bool TryGetCachedPrivateProfileSection(
+    const std::filesystem::path& redirectPath,
+    const wchar_t* appName,
+    wchar_t* string,
+    DWORD stringLength,
+    DWORD& result)
+{
+    return try_get_cached_profile_section(redirectPath, appName, string, stringLength, result);
+}
+
+void InvalidatePrivateProfileCache(const std::filesystem::path& redirectPath) noexcept try
+{
+    if (g_privateProfileCacheEnabled)
+    {
+        iwstring key(redirectPath.native().c_str(), redirectPath.native().length());
+        std::unique_lock lock(g_privateProfileCacheMutex);
+        g_privateProfileCache.erase(key);
+    }
+}
+catch (...)
+{
+    // The next read re-validates the file's timestamp anyway
+}
+
+void InitializePrivateProfileCache(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"))
+    {
+        g_privateProfileCacheEnabled = static_cast<bool>(enabledValue->as_boolean());
+    }
+
+    if (auto delayValue = config->try_get("writeBehindDelay"))
+    {
+        g_privateProfileWriteBehindDelay = delayValue->as_number().get<DWORD>();
+    }
+
+    // Pending writes are only ever visible through the cache, so write-behind requires it
+    if (auto writeBehindValue = config->try_get("writeBehind");
+        g_privateProfileCacheEnabled && writeBehindValue && static_cast<bool>(writeBehindValue->as_boolean()))
+    {
+        g_pendingProfileTimer = ::CreateThreadpoolTimer(PendingProfileTimerCallback, nullptr, nullptr);
+        g_privateProfileWriteBehind = (g_pendingProfileTimer != nullptr);
+    }
+}
+
+void UninitializePrivateProfileCache() noexcept
+{
+    if (!g_privateProfileWriteBehind)
+    {
+        return;
+    }
+
+    // Writes from here on out go straight to the Win32 API. We don't wait for the timer's callback since we may be
+    // called from within DllMain, and during process exit the thread it runs on may have already been terminated while
+    // holding the lock, in which case there's nothing we can do
+    g_privateProfileWriteBehind = false;
+    ::SetThreadpoolTimer(g_pendingProfileTimer, nullptr, 0, 0);
+    if (std::unique_lock lock(g_pendingProfileMutex, std::try_to_lock); lock)
+    {
+        flush_pending_profiles();
+    }
+}
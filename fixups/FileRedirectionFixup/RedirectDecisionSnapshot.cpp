@@ -0,0 +1,348 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Whether or not ShouldRedirect redirects a path, and where to, depends only on the redirection specs and on where the
+// redirected files go, none of which change from one launch to the next. Yet every process starts out with an empty
+// redirect cache, so the paths that the application checks during startup all get matched against the specs again,
+// launch after launch. With the "decisionSnapshot" configuration, the cached decisions that got looked up at least
+// "minimumHits" times get saved to "PsfRedirectDecisions.<architecture>.bin" in the redirect root when the fixup
+// uninitializes (or the process terminates), and the next process maps that file and adds them to its redirect cache
+// during PSFInitialize, before the application's entry point runs. Its first check of each of those paths is then a
+// cache hit.
+//
+// The file is keyed by a hash of everything that the decisions are made from: the specs, as built (base paths
+// resolved, so a known folder that the user redirected changes the key), the package's full name and root, the
+// redirect root and the volatile targets' roots, the redirect layout, and the process architecture. A file with a
+// different key, version, or checksum is ignored, and gets replaced when this process saves its own.
+//
+// NOTE: Only the decisions get saved. Whether a redirected file exists (i.e. whether copy-on-read is done) still gets
+//       checked on disk by every process, the same as for any other cache miss. Decisions made after a hot reload belong
+//       to a different configuration, and don't get saved
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+extern std::filesystem::path g_redirectRootPath;
+
+constexpr std::uint32_t decision_snapshot_magic = 0x44525350; // "PSRD"
+constexpr std::uint32_t decision_snapshot_version = 1;
+
+// Half of a redirect cache generation, so that the preloaded decisions leave room for the ones they didn't cover
+constexpr std::uint32_t max_decision_snapshot_entries = 1024;
+constexpr std::uint64_t max_decision_snapshot_size = 4 * 1024 * 1024;
+
+#if defined(_M_IX86)
+constexpr std::wstring_view decision_snapshot_architecture = L"x86";
+#elif defined(_M_AMD64)
+constexpr std::wstring_view decision_snapshot_architecture = L"x64";
+#elif defined(_M_ARM64)
+constexpr std::wstring_view decision_snapshot_architecture = L"arm64";
+#else
+constexpr std::wstring_view decision_snapshot_architecture = L"unknown";
+#endif
+
+// Followed by 'count' decisions, each 16 bits of flags (only decision_redirects so far) and then the normalized path,
+// redirected path, and de-virtualized path, each a 32-bit length in characters followed by the characters, without a
+// terminator. Everything is a multiple of two bytes, so the strings can be read in place
+struct decision_snapshot_header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t key;
+    std::uint64_t checksum; // Of everything after the header
+    std::uint32_t count;
+    std::uint32_t reserved;
+};
+
+constexpr std::uint16_t decision_redirects = 0x0001;
+
+bool g_decisionSnapshotEnabled = false;
+std::uint32_t g_decisionSnapshotMinimumHits = 4;
+std::uint32_t g_decisionSnapshotSpecsVersion = 0;
+std::uint64_t g_decisionSnapshotKey = 0;
+std::wstring g_decisionSnapshotPath;
+
+static void hash_bytes(std::uint64_t& hash, const void* data, std::size_t size) noexcept
+{
+    auto bytes = static_cast<const std::uint8_t*>(data);
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+}
+
+static void hash_string(std::uint64_t& hash, std::wstring_view str) noexcept
+{
+    auto length = static_cast<std::uint32_t>(str.length());
+    hash_bytes(hash, &length, sizeof(length));
+    hash_bytes(hash, str.data(), str.length() * sizeof(wchar_t));
+}
+
+static std::uint64_t decision_snapshot_key(const path_redirection_specs& specs) noexcept
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    hash_bytes(hash, &decision_snapshot_version, sizeof(decision_snapshot_version));
+    hash_string(hash, decision_snapshot_architecture);
+    hash_string(hash, ::PSFQueryPackageFullName());
+    hash_string(hash, g_packageRootPath.native());
+    hash_string(hash, g_redirectRootPath.native());
+    hash_string(hash, RedirectTargetRoot(redirect_target::local_temp).native());
+    hash_string(hash, RedirectTargetRoot(redirect_target::memory).native());
+
+    auto hashedLayout = HashedRedirectLayoutEnabled();
+    hash_bytes(hash, &hashedLayout, sizeof(hashedLayout));
+
+    for (auto& spec : specs)
+    {
+        auto shape = static_cast<std::uint8_t>(spec.shape);
+        auto target = static_cast<std::uint8_t>(spec.target);
+        hash_string(hash, spec.base_path.native());
+        hash_bytes(hash, &shape, sizeof(shape));
+        hash_bytes(hash, &target, sizeof(target));
+        hash_string(hash, spec.literal);
+        hash_string(hash, spec.source);
+    }
+
+    return hash;
+}
+
+static bool read_string(const std::uint8_t*& data, const std::uint8_t* end, std::wstring_view& str) noexcept
+{
+    std::uint32_t length;
+    if (static_cast<std::size_t>(end - data) < sizeof(length))
+    {
+        return false;
+    }
+    std::memcpy(&length, data, sizeof(length));
+    data += sizeof(length);
+
+    if (length > static_cast<std::size_t>(end - data) / sizeof(wchar_t))
+    {
+        return false;
+    }
+
+    str = std::wstring_view(reinterpret_cast<const wchar_t*>(data), length);
+    data += length * sizeof(wchar_t);
+    return true;
+}
+
+static void append_string(std::vector<std::uint8_t>& data, std::wstring_view str)
+{
+    auto length = static_cast<std::uint32_t>(str.length());
+    auto offset = data.size();
+    data.resize(offset + sizeof(length) + str.length() * sizeof(wchar_t));
+    std::memcpy(data.data() + offset, &length, sizeof(length));
+    std::memcpy(data.data() + offset + sizeof(length), str.data(), str.length() * sizeof(wchar_t));
+}
+
+// Parses everything first, so that a file that turns out to be corrupt partway through adds nothing to the cache
+static void preload_decisions(const std::uint8_t* data, std::uint64_t size)
+{
+    if (size < sizeof(decision_snapshot_header))
+    {
+        return;
+    }
+
+    decision_snapshot_header header;
+    std::memcpy(&header, data, sizeof(header));
+    auto begin = data + sizeof(header);
+    auto end = data + size;
+
+    if ((header.magic != decision_snapshot_magic) || (header.version != decision_snapshot_version) ||
+        (header.key != g_decisionSnapshotKey) || (header.count > max_decision_snapshot_entries))
+    {
+        return;
+    }
+
+    std::uint64_t checksum = 14695981039346656037ull;
+    hash_bytes(checksum, begin, static_cast<std::size_t>(end - begin));
+    if (header.checksum != checksum)
+    {
+        return;
+    }
+
+    std::vector<redirect_decision> decisions(header.count);
+    for (auto& decision : decisions)
+    {
+        std::uint16_t flags;
+        if (static_cast<std::size_t>(end - begin) < sizeof(flags))
+        {
+            return;
+        }
+        std::memcpy(&flags, begin, sizeof(flags));
+        begin += sizeof(flags);
+        decision.should_redirect = (flags & decision_redirects) != 0;
+
+        if (!read_string(begin, end, decision.normalized_path) ||
+            !read_string(begin, end, decision.redirect_path) ||
+            !read_string(begin, end, decision.deVirtualized_path) ||
+            decision.normalized_path.empty())
+        {
+            return;
+        }
+    }
+
+    if (begin != end)
+    {
+        return;
+    }
+
+    for (auto& decision : decisions)
+    {
+        PreloadRedirectDecision(decision, g_decisionSnapshotSpecsVersion);
+    }
+}
+
+void InitializeRedirectDecisionSnapshot(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    if (auto minimumHitsValue = config->try_get("minimumHits"))
+    {
+        g_decisionSnapshotMinimumHits = static_cast<std::uint32_t>(minimumHitsValue->as_number().get_unsigned());
+    }
+
+    VisitRedirectionSpecs([](const path_redirection_specs& specs, std::uint32_t version)
+    {
+        g_decisionSnapshotKey = decision_snapshot_key(specs);
+        g_decisionSnapshotSpecsVersion = version;
+    });
+
+    g_decisionSnapshotPath = (g_redirectRootPath / L"PsfRedirectDecisions.").native();
+    g_decisionSnapshotPath += decision_snapshot_architecture;
+    g_decisionSnapshotPath += L".bin";
+    g_decisionSnapshotEnabled = true;
+
+    psf::unique_handle file(impl::CreateFile(
+        g_decisionSnapshotPath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER size;
+    if (!file || !::GetFileSizeEx(file.get(), &size) || (size.QuadPart <= 0) ||
+        (static_cast<std::uint64_t>(size.QuadPart) > max_decision_snapshot_size))
+    {
+        return;
+    }
+
+    psf::unique_handle mapping(impl::CreateFileMapping(file.get(), nullptr, PAGE_READONLY, 0, 0, static_cast<const wchar_t*>(nullptr)));
+    if (!mapping)
+    {
+        return;
+    }
+
+    auto view = ::MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        return;
+    }
+
+    try
+    {
+        preload_decisions(static_cast<const std::uint8_t*>(view), static_cast<std::uint64_t>(size.QuadPart));
+    }
+    catch (...)
+    {
+        // Whatever didn't get preloaded is decided the usual way
+    }
+    ::UnmapViewOfFile(view);
+}
+
+void SaveRedirectDecisionSnapshot() noexcept try
+{
+    if (!g_decisionSnapshotEnabled)
+    {
+        return;
+    }
+
+    // Only saved once per process, by whichever of uninitialize and process termination comes first
+    g_decisionSnapshotEnabled = false;
+
+    std::vector<std::uint8_t> data(sizeof(decision_snapshot_header));
+    std::uint32_t count = 0;
+    VisitRedirectDecisions(g_decisionSnapshotSpecsVersion, g_decisionSnapshotMinimumHits, [&](const redirect_decision& decision)
+    {
+        if (count < max_decision_snapshot_entries)
+        {
+            std::uint16_t flags = decision.should_redirect ? decision_redirects : 0;
+            auto offset = data.size();
+            data.resize(offset + sizeof(flags));
+            std::memcpy(data.data() + offset, &flags, sizeof(flags));
+            append_string(data, decision.normalized_path);
+            append_string(data, decision.redirect_path);
+            append_string(data, decision.deVirtualized_path);
+            ++count;
+        }
+    });
+
+    if (count == 0)
+    {
+        // Nothing worth replacing what another process may have saved
+        return;
+    }
+
+    decision_snapshot_header header = {};
+    header.magic = decision_snapshot_magic;
+    header.version = decision_snapshot_version;
+    header.key = g_decisionSnapshotKey;
+    header.count = count;
+    header.checksum = 14695981039346656037ull;
+    hash_bytes(header.checksum, data.data() + sizeof(header), data.size() - sizeof(header));
+    std::memcpy(data.data(), &header, sizeof(header));
+
+    // Written to a temporary name first and then renamed over the existing file, so that other processes never map half
+    // of one
+    EnsureRedirectRootExists();
+    auto tempPath = g_decisionSnapshotPath + L"." + std::to_wstring(::GetCurrentProcessId()) + L".psftmp";
+    {
+        psf::unique_handle file(impl::CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file)
+        {
+            return;
+        }
+
+        DWORD bytesWritten;
+        if (!impl::WriteFile(file.get(), data.data(), static_cast<DWORD>(data.size()), &bytesWritten, nullptr) ||
+            (bytesWritten != data.size()))
+        {
+            file.reset();
+            impl::DeleteFile(tempPath.c_str());
+            return;
+        }
+    }
+
+    if (!impl::MoveFileEx(tempPath.c_str(), g_decisionSnapshotPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        // Most likely another process has the file mapped right now. A later process will replace it
+        impl::DeleteFile(tempPath.c_str());
+    }
+}
+catch (...)
+{
+    // The snapshot is only an optimization
+}
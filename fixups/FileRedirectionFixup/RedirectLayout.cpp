@@ -0,0 +1,204 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// By default, the redirected location mirrors the full path of what gets redirected, e.g. "C:\Users\Alice\AppData\
+// Roaming\Contoso\settings.ini" gets redirected to "%LocalAppData%\VFS\C$\Users\Alice\AppData\Roaming\Contoso\
+// settings.ini". That makes every redirected path longer than the path it's for, and the first file that gets redirected
+// under a base path needs a directory created for each component of the base path. With the "hashedLayout"
+// configuration, everything under a configured base path goes in a single directory immediately under the redirect root
+// instead, named after a hash of the base path (e.g. "%LocalAppData%\VFS\$1F2E3D4C5B6A7988\settings.ini"), so redirected
+// paths are never more than a fixed length longer than their path relative to the base path, and only the directories
+// below the base path ever need creating. Everything below the base path is still laid out like the original, so
+// enumeration, renames, and everything else that works with directories work the same as they do for the mirrored
+// layout. Where a base path is under another one, the outermost of them decides, so that a directory and everything in
+// it always end up in the same place. Paths that aren't under any of the base paths (e.g. the parent of a base path,
+// when it gets enumerated) keep the mirrored layout.
+//
+// Since the hashes can't be turned back into paths, each one gets recorded in "PsfLayout.txt" in the redirect root, one
+// line per base path, the first time that this process redirects anything under it. The file only ever gets appended
+// to, and may list a base path more than once if several processes get to it at the same time.
+//
+// NOTE: The layout needs to stay the same for as long as anything has been redirected with it. Changing the layout,
+//       or adding a base path that's outside of an existing one, changes where the existing files would be found
+
+#include <cstdint>
+#include <cwctype>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+bool g_hashedRedirectLayout = false;
+
+// The hashes that are known to be in the layout index, once it's been read
+std::mutex g_layoutIndexMutex;
+bool g_layoutIndexLoaded = false;
+std::unordered_set<std::uint64_t> g_layoutIndexEntries;
+
+void InitializeRedirectLayout(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"))
+    {
+        g_hashedRedirectLayout = static_cast<bool>(enabledValue->as_boolean());
+    }
+}
+
+bool HashedRedirectLayoutEnabled() noexcept
+{
+    return g_hashedRedirectLayout;
+}
+
+// FNV-1a over the upper-cased path, with each run of path separators hashed as a single backslash and trailing
+// separators ignored, so that the spelling of the base path doesn't change where its files go
+static std::uint64_t base_path_hash(std::wstring_view basePath) noexcept
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    bool pendingSeparator = false;
+    for (auto ch : basePath)
+    {
+        if (psf::is_path_separator(ch))
+        {
+            pendingSeparator = true;
+            continue;
+        }
+
+        if (pendingSeparator)
+        {
+            hash = (hash ^ L'\\') * 1099511628211ull;
+            pendingSeparator = false;
+        }
+        hash = (hash ^ static_cast<std::uint16_t>(std::towupper(ch))) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// E.g. "$1F2E3D4C5B6A7988"
+static std::wstring layout_directory_name(std::uint64_t hash)
+{
+    std::wstring result(17, L'$');
+    for (int i = 16; i >= 1; --i, hash >>= 4)
+    {
+        result[i] = L"0123456789ABCDEF"[hash & 0xF];
+    }
+    return result;
+}
+
+// Called with g_layoutIndexMutex held
+static void load_layout_index(HANDLE file)
+{
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(file, &size) || (size.QuadPart == 0) || (size.QuadPart > 16 * 1024 * 1024))
+    {
+        return;
+    }
+
+    std::string contents(static_cast<std::size_t>(size.QuadPart), '\0');
+    DWORD bytesRead;
+    if (!impl::ReadFile(file, contents.data(), static_cast<DWORD>(contents.size()), &bytesRead, nullptr))
+    {
+        return;
+    }
+    contents.resize(bytesRead);
+
+    // Each line is the directory name, a tab, and the base path
+    for (std::size_t pos = 0; pos < contents.length(); )
+    {
+        auto end = contents.find('\n', pos);
+        if (end == std::string::npos)
+        {
+            end = contents.length();
+        }
+
+        if ((end - pos > 17) && (contents[pos] == '$') && (contents[pos + 17] == '\t'))
+        {
+            std::uint64_t hash = 0;
+            bool valid = true;
+            for (std::size_t i = pos + 1; valid && (i < pos + 17); ++i)
+            {
+                auto ch = contents[i];
+                auto digit = ((ch >= '0') && (ch <= '9')) ? (ch - '0') : ((ch >= 'A') && (ch <= 'F')) ? (ch - 'A' + 10) : -1;
+                valid = digit >= 0;
+                hash = (hash << 4) | static_cast<std::uint64_t>(digit & 0xF);
+            }
+
+            if (valid)
+            {
+                g_layoutIndexEntries.insert(hash);
+            }
+        }
+
+        pos = end + 1;
+    }
+}
+
+static void record_layout_directory(std::uint64_t hash, const std::wstring& name, std::wstring_view basePath) noexcept try
+{
+    std::lock_guard lock(g_layoutIndexMutex);
+    if (g_layoutIndexLoaded && (g_layoutIndexEntries.find(hash) != g_layoutIndexEntries.end()))
+    {
+        return;
+    }
+
+    EnsureRedirectRootExists();
+    auto path = g_redirectRootPath / L"PsfLayout.txt";
+    psf::unique_handle file(impl::CreateFile(
+        path.c_str(),
+        FILE_READ_DATA | FILE_APPEND_DATA | SYNCHRONIZE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!file)
+    {
+        // Don't keep trying for this base path. Anything appended later may duplicate what's already there, which is fine
+        g_layoutIndexLoaded = true;
+        g_layoutIndexEntries.insert(hash);
+        return;
+    }
+
+    if (!g_layoutIndexLoaded)
+    {
+        load_layout_index(file.get());
+        g_layoutIndexLoaded = true;
+    }
+
+    if (g_layoutIndexEntries.insert(hash).second)
+    {
+        auto line = narrow(name) + '\t' + narrow(basePath) + "\r\n";
+        DWORD bytesWritten;
+        impl::WriteFile(file.get(), line.data(), static_cast<DWORD>(line.length()), &bytesWritten, nullptr);
+    }
+}
+catch (...)
+{
+    // The index is only for people looking at the redirect root; nothing here reads it back other than to append to it
+}
+
+void AppendRedirectLayoutDirectory(std::wstring& redirectPath, std::wstring_view basePath)
+{
+    auto hash = base_path_hash(basePath);
+    auto name = layout_directory_name(hash);
+    record_layout_directory(hash, name, basePath);
+
+    redirectPath.push_back(L'\\');
+    redirectPath += name;
+}
@@ -0,0 +1,206 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Applications very commonly make several calls on the same path back-to-back, on the same thread (e.g.
+// GetFileAttributes, then CreateFile, then GetFileAttributesEx), and each of them used to normalize the path and look it
+// up in the redirect cache all over again, which takes its lock. Each thread now remembers the last couple of decisions
+// that ShouldRedirect made on it, keyed by the path exactly as it was given, in the block that the PsfRuntime keeps in
+// the thread's state for this (see psf_thread_state), so that the calls after the first don't touch anything that's
+// shared with other threads. Two entries are enough for calls that alternate between two paths (e.g. CopyFile).
+//
+// Entries are only as good as the snapshot version that they were decided by, which ShouldRedirect checks, and what they
+// know about the redirected file existing gets checked against the redirect cache's epoch, same as for the cache itself.
+// Relative and rooted paths resolve against the current directory, so they're only remembered along with the current
+// directory generation, i.e. when the "relativePathCache" option is set (see RelativePathCache.cpp).
+//
+// NOTE: The entries live in a block on the PSF's heap that the PsfRuntime frees along with the rest of the thread's
+//       state, so they can't own anything; everything that an entry has is copied into its buffer, and decisions that
+//       don't fit aren't remembered
+
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <string_view>
+
+#include <dos_paths.h>
+#include <psf_thread_state.h>
+
+#include "PathRedirection.h"
+
+constexpr std::size_t redirect_memo_size = 2;
+
+// Enough for the path as given, what it normalized to, the redirected path, and the de-virtualized path, all of typical
+// length. Longer ones aren't worth making every entry larger for
+constexpr std::size_t redirect_memo_buffer_length = 512;
+
+struct redirect_memo_entry
+{
+    // Zero for an entry that's empty
+    std::uint32_t path_length;
+    std::uint32_t generation;
+
+    bool should_redirect;
+    std::uint32_t exists_epoch;
+    std::uint32_t snapshot_version;
+    std::uint64_t hash;
+
+    // Each of the following starts where the one before it ends in 'buffer', which starts with the path itself
+    std::uint32_t normalized_length;
+    std::uint32_t redirect_length;
+    std::uint32_t deVirtualized_length;
+    wchar_t buffer[redirect_memo_buffer_length];
+};
+
+struct redirect_memo_block
+{
+    redirect_memo_entry entries[redirect_memo_size];
+
+    // The entry that was used last, which is the one that gets kept when a new decision needs one
+    std::uint32_t last_used;
+};
+
+// What claims the thread state's lookup memo for us, so that we can tell whether it's ours or another fixup's
+static const int g_redirectMemoOwner = 0;
+
+static redirect_memo_block* redirect_memo(bool create) noexcept
+{
+    auto state = psf::current_thread_state();
+    if (!state)
+    {
+        return nullptr;
+    }
+
+    if (state->lookup_memo_owner == &g_redirectMemoOwner)
+    {
+        return static_cast<redirect_memo_block*>(state->lookup_memo);
+    }
+    else if (!create || state->lookup_memo_owner)
+    {
+        return nullptr;
+    }
+
+    auto block = static_cast<redirect_memo_block*>(::PSFAllocate(sizeof(redirect_memo_block)));
+    if (block)
+    {
+        std::memset(block, 0, sizeof(*block));
+        state->lookup_memo = block;
+        state->lookup_memo_owner = &g_redirectMemoOwner;
+    }
+
+    return block;
+}
+
+bool FindRedirectMemo(const wchar_t* path, redirect_memo_key& key, redirect_memo& memo) noexcept
+{
+    // NOTE: Read the generation before normalizing, same as for the relative path cache, so that a change made while
+    //       normalizing leaves the memo stale, never wrong
+    key = {};
+    switch (psf::path_type(path))
+    {
+    case psf::dos_path_type::drive_absolute:
+    case psf::dos_path_type::local_device:
+    case psf::dos_path_type::root_local_device:
+        break;
+
+    case psf::dos_path_type::relative:
+    case psf::dos_path_type::rooted:
+        key.generation = RelativePathCacheGeneration();
+        if (!key.generation)
+        {
+            return false;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    key.length = std::wcslen(path);
+    if (key.length >= redirect_memo_buffer_length)
+    {
+        return false;
+    }
+    key.memoizable = true;
+
+    auto block = redirect_memo(false);
+    if (!block)
+    {
+        return false;
+    }
+
+    for (std::uint32_t i = 0; i < redirect_memo_size; ++i)
+    {
+        auto& entry = block->entries[i];
+        if ((entry.path_length == key.length) && (entry.generation == key.generation) &&
+            (std::wmemcmp(entry.buffer, path, key.length) == 0))
+        {
+            auto pos = entry.buffer + entry.path_length;
+            memo.should_redirect = entry.should_redirect;
+            memo.exists_epoch = entry.exists_epoch;
+            memo.snapshot_version = entry.snapshot_version;
+            memo.hash = entry.hash;
+            memo.normalized_path = std::wstring_view(pos, entry.normalized_length);
+            pos += entry.normalized_length;
+            memo.redirect_path = std::wstring_view(pos, entry.redirect_length);
+            pos += entry.redirect_length;
+            memo.deVirtualized_path = std::wstring_view(pos, entry.deVirtualized_length);
+            block->last_used = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// NOTE: 'memo' can't point into the memo itself, since the entry that it came from may be what gets replaced
+void MemoizeRedirect(const wchar_t* path, const redirect_memo_key& key, const redirect_memo& memo) noexcept
+{
+    if (!key.memoizable ||
+        (key.length + memo.normalized_path.length() + memo.redirect_path.length() + memo.deVirtualized_path.length() >
+            redirect_memo_buffer_length))
+    {
+        return;
+    }
+
+    auto block = redirect_memo(true);
+    if (!block)
+    {
+        return;
+    }
+
+    // The same path again (e.g. once it's known to exist) replaces its own entry, and anything else replaces the one that
+    // wasn't used last
+    auto index = (block->last_used + 1) % redirect_memo_size;
+    for (std::uint32_t i = 0; i < redirect_memo_size; ++i)
+    {
+        auto& entry = block->entries[i];
+        if ((entry.path_length == key.length) && (std::wmemcmp(entry.buffer, path, key.length) == 0))
+        {
+            index = i;
+            break;
+        }
+    }
+
+    auto& entry = block->entries[index];
+    entry.path_length = static_cast<std::uint32_t>(key.length);
+    entry.generation = key.generation;
+    entry.should_redirect = memo.should_redirect;
+    entry.exists_epoch = memo.exists_epoch;
+    entry.snapshot_version = memo.snapshot_version;
+    entry.hash = memo.hash;
+    entry.normalized_length = static_cast<std::uint32_t>(memo.normalized_path.length());
+    entry.redirect_length = static_cast<std::uint32_t>(memo.redirect_path.length());
+    entry.deVirtualized_length = static_cast<std::uint32_t>(memo.deVirtualized_path.length());
+
+    auto pos = entry.buffer;
+    std::wmemcpy(pos, path, key.length);
+    pos += key.length;
+    for (auto str : { memo.normalized_path, memo.redirect_path, memo.deVirtualized_path })
+    {
+        std::wmemcpy(pos, str.data(), str.length());
+        pos += str.length();
+    }
+    block->last_used = index;
+}
@@ -0,0 +1,232 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// On a profile that the application has never run in, everything it writes to gets copied to the redirected location one
+// file at a time, each with its own chain of directories, the first time it gets opened for write. Profiles that get
+// thrown away at every logon (e.g. non-persistent VDI) pay for that every time. With the "seed" configuration, a
+// directory in the package that has the same layout as the redirected location (e.g. a copy of the redirected location
+// taken from a profile that the application has already been run in) gets copied there as a whole instead, before any
+// of it is needed. The directories get created up front, and the files are then copied several at a time on the
+// PsfRuntime's worker threads (see PSFSubmitWork), with their extents cloned instead when the volume supports it, the
+// same as for copy-on-read (see RedirectedFileCopy.cpp).
+//
+// The copy goes to a staging directory next to the redirected location, which only gets renamed into place once all of
+// it is there, so that the application never sees half of a seed, and so that the package's processes don't need to
+// agree on who seeds: whoever gets their rename in first wins, and everyone else throws their copy away. Since this
+// happens before the redirected path index scans the redirected location, the seeded paths are in the index like any
+// other redirected path.
+//
+// NOTE: Only a redirected location that doesn't exist yet gets seeded, so that nothing the application has written ever
+//       gets overwritten. If anything about the seed fails, the redirected location gets built up one file at a time
+//       like normal
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dos_paths.h>
+#include <known_folders.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+extern std::filesystem::path g_redirectRootPath;
+
+constexpr std::uint32_t default_seed_copy_threads = 4;
+
+struct redirect_root_seed
+{
+    std::wstring source_root;
+    std::wstring staging_root;
+
+    // Relative to both roots, with a leading separator. Directories are listed after their parent
+    std::vector<std::wstring> directories;
+    std::vector<std::wstring> files;
+    std::atomic<std::size_t> next = 0;
+    std::atomic<bool> failed = false;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::uint32_t running = 0;
+};
+
+// Breadth first, so that each directory only gets listed once its parent has been
+static bool enumerate_seed(redirect_root_seed& seed)
+{
+    std::wstring directory;
+    for (std::size_t next = 0; ; directory = seed.directories[next++])
+    {
+        WIN32_FIND_DATAW findData;
+        auto findHandle = impl::FindFirstFileEx(
+            (seed.source_root + directory + L"\\*").c_str(),
+            FindExInfoBasic,
+            &findData,
+            FindExSearchNameMatch,
+            nullptr,
+            FIND_FIRST_EX_LARGE_FETCH);
+        if (findHandle == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        do
+        {
+            // NOTE: Reparse points don't belong in a seed, and following them could take us outside of it
+            std::wstring_view name = findData.cFileName;
+            if ((name == L".") || (name == L"..") || (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            {
+                continue;
+            }
+
+            auto path = directory + L'\\' + findData.cFileName;
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                seed.directories.push_back(std::move(path));
+            }
+            else
+            {
+                seed.files.push_back(std::move(path));
+            }
+        } while (impl::FindNextFile(findHandle, &findData));
+        impl::FindClose(findHandle);
+
+        if (next == seed.directories.size())
+        {
+            return true;
+        }
+    }
+}
+
+// Whatever did get copied. Files and directories that didn't get that far fail to be deleted, which is fine
+static void remove_staged_seed(const redirect_root_seed& seed) noexcept try
+{
+    for (auto& file : seed.files)
+    {
+        auto path = seed.staging_root + file;
+        impl::SetFileAttributes(path.c_str(), FILE_ATTRIBUTE_NORMAL);
+        impl::DeleteFile(path.c_str());
+    }
+
+    for (auto itr = seed.directories.rbegin(); itr != seed.directories.rend(); ++itr)
+    {
+        impl::RemoveDirectory((seed.staging_root + *itr).c_str());
+    }
+    impl::RemoveDirectory(seed.staging_root.c_str());
+}
+catch (...)
+{
+    // Leaves the staging directory behind, which doesn't get in anyone's way
+}
+
+static void copy_seed_files(redirect_root_seed& seed) noexcept
+{
+    for (auto i = seed.next++; (i < seed.files.size()) && !seed.failed; i = seed.next++)
+    {
+        try
+        {
+            auto& file = seed.files[i];
+            if (!CopyFileUncoordinated((seed.source_root + file).c_str(), (seed.staging_root + file).c_str(), nullptr))
+            {
+                seed.failed = true;
+            }
+        }
+        catch (...)
+        {
+            seed.failed = true;
+        }
+    }
+}
+
+static void __stdcall RedirectRootSeedCallback(void* context) noexcept
+{
+    auto& seed = *static_cast<redirect_root_seed*>(context);
+    copy_seed_files(seed);
+
+    // NOTE: Notified with the lock held, since the waiting thread destroys 'seed' as soon as it sees the count drop
+    std::lock_guard lock(seed.mutex);
+    --seed.running;
+    seed.finished.notify_all();
+}
+
+void InitializeRedirectRootSeed(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    auto threads = default_seed_copy_threads;
+    if (auto threadsValue = config->try_get("threads"))
+    {
+        threads = (std::max)(static_cast<std::uint32_t>(threadsValue->as_number().get_unsigned()), 1u);
+    }
+
+    auto sourcePath = psf::remove_trailing_path_separators((g_packageRootPath / config->get("path").as_string().wstring()).lexically_normal());
+    if (impl::GetFileAttributes(g_redirectRootPath.c_str()) != INVALID_FILE_ATTRIBUTES)
+    {
+        return;
+    }
+
+    // NOTE: The staging directory is on the same volume as the redirected location, so that the rename is atomic, and so
+    //       that block cloning works out the same as it would for copy-on-read
+    redirect_root_seed seed;
+    seed.source_root = LR"(\\?\)" + sourcePath.native();
+    seed.staging_root = LR"(\\?\)" + g_redirectRootPath.native() + L".seed-" + std::to_wstring(::GetCurrentProcessId());
+    if (!enumerate_seed(seed) || !impl::CreateDirectory(seed.staging_root.c_str(), nullptr))
+    {
+        // E.g. the seed isn't in the package, or a process with the same id died part way through seeding
+        return;
+    }
+
+    for (auto& directory : seed.directories)
+    {
+        if (!impl::CreateDirectory((seed.staging_root + directory).c_str(), nullptr))
+        {
+            remove_staged_seed(seed);
+            return;
+        }
+    }
+
+    // The calling thread works through the files too. The work is high priority, since nothing else can start until the
+    // seed is done
+    if (!seed.files.empty())
+    {
+        auto helpers = (std::min)(static_cast<std::size_t>(threads), seed.files.size()) - 1;
+        for (std::size_t i = 0; i < helpers; ++i)
+        {
+            std::lock_guard lock(seed.mutex);
+            if (::PSFSubmitWork(RedirectRootSeedCallback, &seed, psf_work_priority::high) != ERROR_SUCCESS)
+            {
+                break;
+            }
+            ++seed.running;
+        }
+
+        copy_seed_files(seed);
+
+        std::unique_lock lock(seed.mutex);
+        seed.finished.wait(lock, [&] { return seed.running == 0; });
+    }
+
+    // The rename fails if another of the package's processes got there first, or if the application started writing to
+    // the redirected location in the meantime
+    if (seed.failed || !impl::MoveFileEx(seed.staging_root.c_str(), (LR"(\\?\)" + g_redirectRootPath.native()).c_str(), 0))
+    {
+        remove_staged_seed(seed);
+    }
+}
@@ -0,0 +1,193 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Everything that gets redirected goes under %LocalAppData%\VFS by default, which is part of the user's profile. On
+// profiles that roam, or that live on a network-backed disk (e.g. an FSLogix profile container), every write there goes
+// to the profile store, including writes to the caches, logs, and temp files that applications keep under their install
+// directory and that nobody would miss. Each redirection spec can send what it matches to a "target" other than the
+// redirect root for that:
+//
+//  - "local-temp" goes under the user's temp directory (i.e. GetTempPath), in "PsfVFS\<package full name>", since that's
+//    what VDI solutions keep on the local machine (e.g. FSLogix with SetTempToLocalPath)
+//  - "memory" goes under the same temp directory, in "PsfVFS\<package full name>.memory", and the files that get created
+//    there are marked FILE_ATTRIBUTE_TEMPORARY, which keeps their data in the system cache for as long as there's memory
+//    to spare instead of writing it out to disk. Windows doesn't have a RAM-backed file system of its own, so for more
+//    than that, its root needs to be pointed at a RAM disk
+//
+// Both roots can be changed with the "redirectTargets" configuration. They get laid out the same as the redirect root
+// (see RedirectedPath), and like the redirect root, they only get created once something needs to be written there.
+// Where a path matches specs with different targets, the most durable of them wins, since losing a file that needed
+// keeping is worse than keeping one that didn't.
+//
+// NOTE: Enumerating a directory only looks in the redirected location for the directory's own target, so volatile
+//       targets are best given to whole directories (e.g. a pattern of ".*" under a "Cache" base path). Files that a
+//       volatile target gets from a directory that's redirected somewhere else don't show up when that directory is
+//       enumerated. The redirected path index, tombstones, and attribute overrides only cover the redirect root, so
+//       paths under the other roots always get checked on disk. Anything in a volatile target may go away at any time
+//       (e.g. disk cleanup, or a new session), after which the application sees the package's copy of the file again
+
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <dos_paths.h>
+#include <known_folders.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+using namespace std::literals;
+
+extern std::filesystem::path g_redirectRootPath;
+
+// Indexed by redirect_target. The persistent entry stays empty, since its root is g_redirectRootPath
+std::filesystem::path g_redirectTargetRootPaths[redirect_target_count];
+std::atomic<bool> g_redirectTargetRootsCreated[redirect_target_count] = {};
+
+static std::filesystem::path default_target_root(std::wstring_view suffix)
+{
+    wchar_t tempPath[MAX_PATH + 1];
+    auto length = ::GetTempPathW(static_cast<DWORD>(std::size(tempPath)), tempPath);
+    if (!length || (length >= std::size(tempPath)))
+    {
+        return {};
+    }
+
+    std::wstring result(tempPath, length);
+    result += L"PsfVFS\\";
+    result += ::PSFQueryPackageFullName();
+    result += suffix;
+    return result;
+}
+
+// E.g. "%TEMP%\Contoso" or "R:\PsfVFS"
+static std::filesystem::path configured_target_root(const psf::json_object& config, const char* key)
+{
+    auto value = config.try_get(key);
+    if (!value)
+    {
+        return {};
+    }
+
+    std::wstring configuredPath(value->as_string().wstring());
+    std::wstring expandedPath(MAX_PATH, L'\0');
+    auto length = ::ExpandEnvironmentStringsW(configuredPath.c_str(), expandedPath.data(), static_cast<DWORD>(expandedPath.size()));
+    if (length > expandedPath.size())
+    {
+        expandedPath.resize(length);
+        length = ::ExpandEnvironmentStringsW(configuredPath.c_str(), expandedPath.data(), length);
+    }
+    expandedPath.resize(length ? length - 1 : 0);
+
+    // Redirected paths get built by appending to the root, so it needs to be drive-absolute the same as the redirect root
+    if (psf::path_type(expandedPath.c_str()) != psf::dos_path_type::drive_absolute)
+    {
+        throw std::runtime_error("The \"redirectTargets\" " + std::string(key) + " root must be an absolute path: " + narrow(expandedPath));
+    }
+
+    return psf::remove_trailing_path_separators(std::filesystem::path(expandedPath).lexically_normal());
+}
+
+void InitializeRedirectTargets(const psf::json_object* config)
+{
+    auto localTempRoot = config ? configured_target_root(*config, "localTemp") : std::filesystem::path{};
+    auto memoryRoot = config ? configured_target_root(*config, "memory") : std::filesystem::path{};
+
+    // NOTE: Without a temp directory, the volatile targets fall back to the redirect root, which is where they'd have
+    //       gone without a target
+    g_redirectTargetRootPaths[static_cast<std::size_t>(redirect_target::local_temp)] =
+        !localTempRoot.empty() ? std::move(localTempRoot) : default_target_root(L""sv);
+    g_redirectTargetRootPaths[static_cast<std::size_t>(redirect_target::memory)] =
+        !memoryRoot.empty() ? std::move(memoryRoot) : default_target_root(L".memory"sv);
+}
+
+bool TryParseRedirectTarget(std::wstring_view name, redirect_target& target) noexcept
+{
+    if (name == L"persistent"sv)
+    {
+        target = redirect_target::persistent;
+    }
+    else if (name == L"local-temp"sv)
+    {
+        target = redirect_target::local_temp;
+    }
+    else if (name == L"memory"sv)
+    {
+        target = redirect_target::memory;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+const std::filesystem::path& RedirectTargetRoot(redirect_target target) noexcept
+{
+    auto& root = g_redirectTargetRootPaths[static_cast<std::size_t>(target)];
+    return root.empty() ? g_redirectRootPath : root;
+}
+
+void EnsureRedirectTargetRootExists(redirect_target target) noexcept try
+{
+    auto index = static_cast<std::size_t>(target);
+    if (g_redirectTargetRootPaths[index].empty())
+    {
+        EnsureRedirectRootExists();
+        return;
+    }
+    else if (g_redirectTargetRootsCreated[index])
+    {
+        return;
+    }
+
+    // Unlike the redirect root, the directories that the root is in (e.g. "%TEMP%\PsfVFS") may not exist yet either
+    auto lastError = ::GetLastError();
+    std::wstring_view root = g_redirectTargetRootPaths[index].native();
+    for (auto pos = psf::find_path_separator(root, 3); ; pos = psf::find_path_separator(root, pos + 1))
+    {
+        impl::CreateDirectory(std::wstring(root.substr(0, pos)).c_str(), nullptr);
+        if (pos == std::wstring_view::npos)
+        {
+            break;
+        }
+    }
+    g_redirectTargetRootsCreated[index] = true;
+    ::SetLastError(lastError);
+}
+catch (...)
+{
+    // Creating what's under the root fails the same way it would have otherwise
+}
+
+redirect_target RedirectTargetOfPath(std::wstring_view redirectPath, std::size_t& rootLength) noexcept
+{
+    std::size_t prefixLength = 0;
+    if ((redirectPath.length() >= 4) && (redirectPath.compare(0, 4, LR"(\\?\)"sv) == 0))
+    {
+        prefixLength = 4;
+    }
+
+    auto path = redirectPath.substr(prefixLength);
+    for (auto target : { redirect_target::local_temp, redirect_target::memory, redirect_target::persistent })
+    {
+        auto& root = RedirectTargetRoot(target).native();
+        if (!root.empty() && (path.length() >= root.length()) && psf::path_equal(path.data(), root.c_str(), root.length()) &&
+            ((path.length() == root.length()) || psf::is_path_separator(path[root.length()])))
+        {
+            rootLength = prefixLength + root.length();
+            return target;
+        }
+    }
+
+    rootLength = 0;
+    return redirect_target::persistent;
+}
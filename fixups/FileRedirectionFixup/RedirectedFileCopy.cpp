@@ -0,0 +1,340 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The copy for copy-on-read. Most files in a package are small, and copying them unbuffered costs more than it saves
+// since every read and write has to go all the way to the disk, so only files at or above a size threshold get copied
+// with COPY_FILE_NO_BUFFERING (which also keeps large copies from flushing everything else out of the cache). When the
+// source file and the redirect root live on the same volume and that volume supports block cloning (ReFS), we instead
+// clone the file's extents, which is a metadata-only operation whose cost doesn't depend on the size of the file.
+// Regular copies of large files may get throttled (see CopyThrottle.cpp), and when they cross volumes, pipelined (see
+// PipelinedCopy.cpp).
+//
+// Processes of the same package that need the same file at the same time would otherwise each read the whole source,
+// only for all but one of them to fail at the end, and could see the winner's partially written file in the meantime.
+// Copies are serialized per file by a named mutex in the session's namespace, and whoever gets it first copies to a
+// temporary file and renames that into place, so the redirected file only shows up once it's complete. Everyone else
+// finds the file already there once they get the mutex.
+//
+// NOTE: Block cloning only duplicates the file's primary data stream. Alternate data streams are not copied, which is
+//       fine for package files; if anything about the clone fails, we fall back to a regular copy
+
+#include <algorithm>
+#include <cstdint>
+#include <cwctype>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include <fancy_handle.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+using namespace std::literals;
+
+constexpr std::uint64_t unbuffered_copy_threshold = 8 * 1024 * 1024;
+
+// FSCTL_DUPLICATE_EXTENTS_TO_FILE requires the byte count to be less than 4GB and a multiple of the cluster size, which
+// is always a power of two no larger than this
+constexpr std::uint64_t max_clone_chunk_size = 1024 * 1024 * 1024;
+
+struct redirect_volume_info
+{
+    DWORD serial_number = 0;
+    bool supports_block_cloning = false;
+};
+
+static const redirect_volume_info& RedirectVolumeInfo() noexcept
+{
+    static const redirect_volume_info info = []() noexcept
+    {
+        redirect_volume_info result;
+
+        wchar_t volumePath[MAX_PATH + 1];
+        DWORD flags;
+        if (::GetVolumePathNameW(g_redirectRootPath.c_str(), volumePath, static_cast<DWORD>(std::size(volumePath))) &&
+            ::GetVolumeInformationW(volumePath, nullptr, 0, &result.serial_number, nullptr, &flags, nullptr, 0))
+        {
+            result.supports_block_cloning = (flags & FILE_SUPPORTS_BLOCK_REFCOUNTING) != 0;
+        }
+
+        return result;
+    }();
+
+    return info;
+}
+
+enum class clone_result
+{
+    cloned,
+    failed,         // E.g. the destination already exists; the last error is set and a regular copy would fail the same way
+    not_supported,  // The caller should fall back to a regular copy
+};
+
+static clone_result CloneFile(const wchar_t* existingFileName, const wchar_t* newFileName, std::uint64_t fileSize) noexcept
+{
+    // NOTE: The other redirect targets (see RedirectTargets.cpp) are usually on some other volume, and are only for
+    //       files that don't need keeping anyway
+    std::size_t rootLength;
+    auto& volumeInfo = RedirectVolumeInfo();
+    if (!volumeInfo.supports_block_cloning || (RedirectTargetOfPath(newFileName, rootLength) != redirect_target::persistent))
+    {
+        return clone_result::not_supported;
+    }
+
+    psf::unique_handle source(impl::CreateFile(
+        existingFileName,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!source)
+    {
+        return clone_result::not_supported;
+    }
+
+    DWORD serialNumber;
+    FILE_BASIC_INFO basicInfo;
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrityInfo;
+    DWORD bytesReturned;
+    if (!::GetVolumeInformationByHandleW(source.get(), nullptr, 0, &serialNumber, nullptr, nullptr, nullptr, 0) ||
+        (serialNumber != volumeInfo.serial_number) ||
+        !::GetFileInformationByHandleEx(source.get(), FileBasicInfo, &basicInfo, sizeof(basicInfo)) ||
+        !::DeviceIoControl(source.get(), FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &integrityInfo, sizeof(integrityInfo), &bytesReturned, nullptr))
+    {
+        return clone_result::not_supported;
+    }
+
+    // CREATE_NEW so that we fail the same way that COPY_FILE_FAIL_IF_EXISTS would
+    psf::unique_handle target(impl::CreateFile(
+        newFileName,
+        GENERIC_READ | GENERIC_WRITE | DELETE,
+        0,
+        nullptr,
+        CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    if (!target)
+    {
+        auto err = ::GetLastError();
+        return ((err == ERROR_FILE_EXISTS) || (err == ERROR_ALREADY_EXISTS) || (err == ERROR_PATH_NOT_FOUND)) ?
+            clone_result::failed : clone_result::not_supported;
+    }
+
+    auto cloneExtents = [&]() noexcept
+    {
+        if (basicInfo.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+        {
+            if (!::DeviceIoControl(target.get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr))
+            {
+                return false;
+            }
+        }
+
+        // The source and target must agree on whether or not they have integrity streams
+        FSCTL_SET_INTEGRITY_INFORMATION_BUFFER setIntegrityInfo = { integrityInfo.ChecksumAlgorithm, 0, integrityInfo.Flags };
+        if (!::DeviceIoControl(target.get(), FSCTL_SET_INTEGRITY_INFORMATION, &setIntegrityInfo, sizeof(setIntegrityInfo), nullptr, 0, &bytesReturned, nullptr))
+        {
+            return false;
+        }
+
+        FILE_END_OF_FILE_INFO endOfFileInfo;
+        endOfFileInfo.EndOfFile.QuadPart = fileSize;
+        if (!::SetFileInformationByHandle(target.get(), FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+        {
+            return false;
+        }
+
+        // The last chunk gets rounded up to a cluster boundary, which is allowed since the target's end of file has
+        // already been set to match the source's
+        std::uint64_t clusterSize = integrityInfo.ClusterSizeInBytes;
+        if (clusterSize == 0)
+        {
+            return false;
+        }
+
+        auto cloneSize = (fileSize + clusterSize - 1) & ~(clusterSize - 1);
+        for (std::uint64_t offset = 0; offset < cloneSize; offset += max_clone_chunk_size)
+        {
+            DUPLICATE_EXTENTS_DATA duplicateExtents = {};
+            duplicateExtents.FileHandle = source.get();
+            duplicateExtents.SourceFileOffset.QuadPart = offset;
+            duplicateExtents.TargetFileOffset.QuadPart = offset;
+            duplicateExtents.ByteCount.QuadPart = (std::min)(cloneSize - offset, max_clone_chunk_size);
+            if (!::DeviceIoControl(target.get(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &duplicateExtents, sizeof(duplicateExtents), nullptr, 0, &bytesReturned, nullptr))
+            {
+                return false;
+            }
+        }
+
+        // Match what CopyFile preserves: timestamps and the "settable" attributes
+        constexpr DWORD copiedAttributes = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+            FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+        basicInfo.ChangeTime.QuadPart = 0;
+        basicInfo.FileAttributes &= copiedAttributes;
+        if (!basicInfo.FileAttributes)
+        {
+            basicInfo.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+        }
+
+        return ::SetFileInformationByHandle(target.get(), FileBasicInfo, &basicInfo, sizeof(basicInfo)) != FALSE;
+    };
+
+    if (!cloneExtents())
+    {
+        // Don't leave a partial file behind; the fallback copy uses COPY_FILE_FAIL_IF_EXISTS
+        FILE_DISPOSITION_INFO dispositionInfo = { TRUE };
+        ::SetFileInformationByHandle(target.get(), FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo));
+        return clone_result::not_supported;
+    }
+
+    return clone_result::cloned;
+}
+
+BOOL CopyFileUncoordinated(const wchar_t* existingFileName, const wchar_t* newFileName, LPPROGRESS_ROUTINE progressRoutine)
+{
+    DWORD copyFlags = COPY_FILE_FAIL_IF_EXISTS;
+
+    std::uint64_t fileSize = 0;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (impl::GetFileAttributesEx(existingFileName, GetFileExInfoStandard, &data))
+    {
+        fileSize = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+        if (fileSize > 0)
+        {
+            switch (CloneFile(existingFileName, newFileName, fileSize))
+            {
+            case clone_result::cloned:
+                if (auto telemetry = CurrentTelemetryScope())
+                {
+                    telemetry->file_copied(fileSize);
+                }
+                return TRUE;
+
+            case clone_result::failed:
+                return FALSE;
+
+            case clone_result::not_supported:
+                break;
+            }
+        }
+
+        if (fileSize >= unbuffered_copy_threshold)
+        {
+            copyFlags |= COPY_FILE_NO_BUFFERING;
+        }
+    }
+
+    // If we failed to query the source, let CopyFileEx report the error
+    auto result = ShouldThrottleCopy(fileSize) ?
+        ThrottledCopyFile(existingFileName, newFileName, progressRoutine, copyFlags) :
+        PipelinedCopyFile(existingFileName, newFileName, progressRoutine, nullptr, copyFlags);
+    if (auto telemetry = CurrentTelemetryScope(); result && telemetry)
+    {
+        telemetry->file_copied(fileSize);
+    }
+    return result;
+}
+
+// FNV-1a over the upper-cased path; the result names both the mutex and the temporary file
+static std::wstring redirected_copy_id(const wchar_t* redirectPath)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (auto ch = redirectPath; *ch; ++ch)
+    {
+        hash ^= static_cast<std::uint16_t>(std::towupper(*ch));
+        hash *= 1099511628211ull;
+    }
+
+    wchar_t buffer[17];
+    for (int i = 15; i >= 0; --i, hash >>= 4)
+    {
+        buffer[i] = L"0123456789ABCDEF"[hash & 0xF];
+    }
+    buffer[16] = L'\0';
+    return buffer;
+}
+
+struct mutex_releaser
+{
+    void operator()(void* mutex) noexcept
+    {
+        ::ReleaseMutex(mutex);
+        ::CloseHandle(mutex);
+    }
+};
+using owned_mutex = std::unique_ptr<void, mutex_releaser>;
+
+BOOL CopyFileForRedirection(const wchar_t* existingFileName, const wchar_t* newFileName, LPPROGRESS_ROUTINE progressRoutine)
+{
+    auto packageFullName = ::PSFQueryPackageFullName();
+    if (!*packageFullName)
+    {
+        return CopyFileUncoordinated(existingFileName, newFileName, progressRoutine);
+    }
+
+    auto id = redirected_copy_id(newFileName);
+    auto mutexName = L"Local\\PsfCopyOnRead_"s + packageFullName + L"_" + id;
+    owned_mutex mutex;
+    if (auto handle = ::CreateMutexW(nullptr, FALSE, mutexName.c_str()))
+    {
+        // NOTE: An abandoned mutex still gives us ownership. Its previous owner died in the middle of the copy, which
+        //       left nothing behind other than (possibly) the temporary file, which gets deleted below
+        auto waitResult = ::WaitForSingleObject(handle, INFINITE);
+        if ((waitResult == WAIT_OBJECT_0) || (waitResult == WAIT_ABANDONED))
+        {
+            mutex.reset(handle);
+        }
+        else
+        {
+            ::CloseHandle(handle);
+        }
+    }
+
+    if (!mutex)
+    {
+        return CopyFileUncoordinated(existingFileName, newFileName, progressRoutine);
+    }
+
+    if (impl::GetFileAttributes(newFileName) != INVALID_FILE_ATTRIBUTES)
+    {
+        // Another process copied it while we were waiting
+        ::SetLastError(ERROR_FILE_EXISTS);
+        return FALSE;
+    }
+
+    // The temporary file needs to be on the same volume for the rename to be atomic
+    std::size_t rootLength;
+    auto tempDirectory = RedirectTargetRoot(RedirectTargetOfPath(newFileName, rootLength)) / L"PsfCopies";
+    auto tempPath = tempDirectory / (id + L".tmp");
+    if (!impl::CreateDirectory(tempDirectory.c_str(), nullptr) && (::GetLastError() != ERROR_ALREADY_EXISTS))
+    {
+        return CopyFileUncoordinated(existingFileName, newFileName, progressRoutine);
+    }
+    impl::DeleteFile(tempPath.c_str());
+
+    if (!CopyFileUncoordinated(existingFileName, tempPath.c_str(), progressRoutine))
+    {
+        return FALSE;
+    }
+
+    if (!impl::MoveFileEx(tempPath.c_str(), newFileName, 0))
+    {
+        // E.g. the application created the file itself in the meantime, which doesn't go through the mutex
+        auto err = ::GetLastError();
+        impl::DeleteFile(tempPath.c_str());
+        ::SetLastError(err);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,110 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Once a fixup hands the application a handle to a redirected file, nothing about the handle says that it was
+// redirected, and fixups for handle based functions would otherwise have to query the handle's path and re-resolve it.
+// This table maps handles from successful redirected opens to the redirected path so that they don't have to. Every
+// CloseHandle goes through here, so the table is a concurrent_cache, whose shards each have their own lock, to keep
+// unrelated threads from contending with each other. When nothing is being tracked, lookups and removals are a single
+// atomic load. The table is bounded, and an application that keeps more redirected handles open than it holds has the
+// ones that haven't been looked up in a while dropped. Fixups then query those handles for their path, the same as for
+// handles that never got redirected.
+//
+// NOTE: Handles closed without going through CloseHandle (e.g. NtClose) leave stale entries behind. These are replaced
+//       if the handle value gets reused by another redirected open, or get evicted eventually, but a lookup in between
+//       can give back the wrong path, so callers should treat the result as a hint about the file's location and not as
+//       proof of it
+
+#include <memory>
+
+#include <concurrent_cache.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+// Far more redirected files than applications keep open at once, while keeping what the table reserves up front small
+constexpr std::size_t redirected_handle_capacity = 1024;
+
+using redirected_handle_table = psf::concurrent_cache<HANDLE, std::shared_ptr<const redirected_handle_info>>;
+redirected_handle_table g_redirectedHandles(redirected_handle_capacity);
+
+void RedirectedHandleOpened(HANDLE handle, const std::filesystem::path& redirectPath) noexcept try
+{
+    if (!handle || (handle == INVALID_HANDLE_VALUE))
+    {
+        return;
+    }
+
+    // Callers return the handle immediately afterwards, so preserve the error from the open
+    auto lastError = ::GetLastError();
+    auto info = std::make_shared<redirected_handle_info>();
+    info->redirect_path = redirectPath.native();
+    g_redirectedHandles.insert_or_assign(handle, std::move(info));
+    ::SetLastError(lastError);
+}
+catch (...)
+{
+    // Out of memory. Handle based fixups will have to figure it out for themselves
+}
+
+void RedirectedHandleDuplicated(HANDLE targetHandle, std::shared_ptr<const redirected_handle_info> info) noexcept try
+{
+    auto lastError = ::GetLastError();
+    g_redirectedHandles.insert_or_assign(targetHandle, std::move(info));
+    ::SetLastError(lastError);
+}
+catch (...)
+{
+    // Same as above
+}
+
+void RedirectedHandleRenamed(HANDLE handle, const std::filesystem::path& redirectPath) noexcept try
+{
+    if (g_redirectedHandles.empty())
+    {
+        return;
+    }
+
+    // NOTE: Other handles to the same file still refer to the old path, same as if the rename had gone through them
+    if (redirectPath.empty())
+    {
+        // Renamed out of the redirect root
+        g_redirectedHandles.erase(handle);
+        return;
+    }
+
+    // Callers that found the old info keep it, so the new path goes in a copy of it
+    g_redirectedHandles.update(handle, [&](std::shared_ptr<const redirected_handle_info>& info)
+    {
+        auto renamed = std::make_shared<redirected_handle_info>(*info);
+        renamed->redirect_path = redirectPath.native();
+        info = std::move(renamed);
+    });
+}
+catch (...)
+{
+    // Out of memory; the entry is left pointing at the old path
+}
+
+void RedirectedHandleClosed(HANDLE handle) noexcept
+{
+    if (g_redirectedHandles.empty())
+    {
+        return;
+    }
+
+    g_redirectedHandles.erase(handle);
+}
+
+std::shared_ptr<const redirected_handle_info> FindRedirectedHandle(HANDLE handle) noexcept
+{
+    std::shared_ptr<const redirected_handle_info> result;
+    if (!g_redirectedHandles.empty())
+    {
+        g_redirectedHandles.try_get(handle, result);
+    }
+
+    return result;
+}
@@ -0,0 +1,1039 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// An in-memory index of the files and directories that exist under the redirect root. The vast majority of presence
+// checks against the redirect root are misses, so rather than probe the disk each time, we walk the redirect root once
+// at startup and then keep the index up to date as our own fixups create, copy, move, and delete files. Anything that
+// modifies the redirect root without going through this process (e.g. child processes) won't be reflected in the index
+// unless the "watchForChanges" option is set, in which case we additionally listen for ReadDirectoryChangesW
+// notifications and re-validate any path that's reported to have changed.
+//
+// Lookups are first run through a bloom filter of every path that's ever been added to the index. Checking it touches a
+// single cache line and needs no lock, so most misses never touch the index itself. The filter lives in memory shared
+// by all of the package's processes, each of which adds every path that it adds to its own index. Bits are never
+// cleared, so paths that get deleted (or that only exist in another process's index) can only ever cause the filter to
+// defer to the index, never the other way around.
+//
+// With the "changeJournal" option, the startup walk gets replaced by reading back the index that the previous process
+// saved to "PsfPathIndex.bin" in the redirect root, along with the update sequence number (USN) of the volume's change
+// journal that it was current as of. Only the journal records since then get read, and only the paths that they name
+// get re-validated against the disk, so startup costs the number of changes rather than the number of files. Records
+// only name the file and its parent directory's file id, so each parent gets opened by id to find out whether it's under
+// the redirect root, once per directory. If any of that isn't possible (e.g. no saved index, a volume without a journal,
+// or a journal that's since wrapped or been recreated), the redirect root gets walked like normal, and the result saved
+// for next time.
+//
+// NOTE: The index maintains the invariant that if a path is present, then so are all of its parent directories up to,
+//       but not including, the redirect root. Keys are "\\?\" prefixed, just like what RedirectedPath returns
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include <dos_paths.h>
+#include <fancy_handle.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+// Set once during initialization. Cleared if we ever fail to update the index (e.g. out of memory), in which case we
+// fall back to querying the disk since the index may no longer be accurate
+std::atomic<bool> g_redirectedPathIndexEnabled = false;
+
+std::shared_mutex g_redirectedPathIndexMutex;
+std::set<iwstring> g_redirectedPathIndex;
+iwstring g_redirectedPathIndexRoot;
+
+psf::unique_handle g_redirectedPathWatcherStopEvent;
+
+constexpr std::uint32_t path_filter_magic = 0x46505350; // "PSPF"
+constexpr std::uint32_t path_filter_version = 1;
+constexpr std::uint32_t path_filter_block_bits = 12;
+constexpr std::uint32_t path_filter_block_count = 1u << path_filter_block_bits; // 256KB, enough for ~200k paths
+constexpr std::uint32_t path_filter_hash_count = 7; // Bits set per path, each using 9 bits of the hash
+
+// A blocked bloom filter: each path maps to a single cache line sized block and sets bits only within it
+struct alignas(64) path_filter_block
+{
+    std::atomic<std::uint64_t> words[8];
+};
+static_assert(sizeof(path_filter_block) == 64);
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Blocks are shared across processes, so they can't use a lock");
+
+struct alignas(64) path_filter_header
+{
+    std::atomic<std::uint32_t> magic;
+    std::uint32_t version;
+    std::uint32_t block_count;
+};
+
+constexpr std::size_t path_filter_size = sizeof(path_filter_header) + path_filter_block_count * sizeof(path_filter_block);
+
+path_filter_block* g_pathFilterBlocks = nullptr;
+
+// FNV-1a over the path relative to the redirect root, folded the same way that iwstring compares characters so that
+// keys that the index considers equal always hash the same. The root is excluded so that processes whose redirect root
+// is spelled differently still agree
+static std::uint64_t path_filter_hash(const iwstring& key) noexcept
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (auto i = g_redirectedPathIndexRoot.length(); i < key.length(); ++i)
+    {
+        hash ^= static_cast<std::uint16_t>(std::tolower(key[i]));
+        hash *= 1099511628211ull;
+    }
+
+    // FNV's low bits are weak, and we consume all of them, so finish with a full avalanche
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static path_filter_block& path_filter_block_for(std::uint64_t hash) noexcept
+{
+    return g_pathFilterBlocks[(hash * 0x9e3779b97f4a7c15ull) >> (64 - path_filter_block_bits)];
+}
+
+static void path_filter_add(const iwstring& key) noexcept
+{
+    if (!g_pathFilterBlocks)
+    {
+        return;
+    }
+
+    auto hash = path_filter_hash(key);
+    auto& block = path_filter_block_for(hash);
+    for (std::uint32_t i = 0; i < path_filter_hash_count; ++i, hash >>= 9)
+    {
+        auto bit = hash & 511;
+        block.words[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_release);
+    }
+}
+
+static bool path_filter_may_contain(const iwstring& key) noexcept
+{
+    if (!g_pathFilterBlocks)
+    {
+        return true;
+    }
+
+    auto hash = path_filter_hash(key);
+    auto& block = path_filter_block_for(hash);
+    for (std::uint32_t i = 0; i < path_filter_hash_count; ++i, hash >>= 9)
+    {
+        auto bit = hash & 511;
+        if ((block.words[bit / 64].load(std::memory_order_acquire) & (1ull << (bit % 64))) == 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void initialize_path_filter() noexcept
+{
+    // Processes that aren't part of a package get a filter of their own
+    std::wstring name;
+    if (auto packageFullName = ::PSFQueryPackageFullName(); *packageFullName)
+    {
+        name = L"Local\\PsfRedirectedPathFilter_";
+        name += packageFullName;
+    }
+
+    // NOTE: The view is intentionally never unmapped, same as the mapping handle is never closed; lookups may happen
+    //       right up until the process exits
+    auto mapping = ::CreateFileMappingW(
+        INVALID_HANDLE_VALUE,
+        nullptr,
+        PAGE_READWRITE,
+        0,
+        static_cast<DWORD>(path_filter_size),
+        name.empty() ? nullptr : name.c_str());
+    if (!mapping)
+    {
+        return;
+    }
+
+    auto view = ::MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, path_filter_size);
+    if (!view)
+    {
+        ::CloseHandle(mapping);
+        return;
+    }
+
+    auto header = static_cast<path_filter_header*>(view);
+    if (header->magic.load() == 0)
+    {
+        // Either a new section or another process is in the middle of initializing it. The values are the same either
+        // way, and zero filled blocks are an empty filter
+        header->version = path_filter_version;
+        header->block_count = path_filter_block_count;
+        header->magic.store(path_filter_magic);
+    }
+
+    if ((header->magic.load() != path_filter_magic) ||
+        (header->version != path_filter_version) ||
+        (header->block_count != path_filter_block_count))
+    {
+        ::UnmapViewOfFile(view);
+        ::CloseHandle(mapping);
+        return;
+    }
+
+    g_pathFilterBlocks = reinterpret_cast<path_filter_block*>(header + 1);
+}
+
+static bool index_key(const wchar_t* path, iwstring& key)
+{
+    std::wstring_view view = path;
+    while (!view.empty() && psf::is_path_separator(view.back()))
+    {
+        view.remove_suffix(1);
+    }
+
+    key.assign(view.data(), view.length());
+    for (auto& ch : key)
+    {
+        if (ch == L'/')
+        {
+            ch = L'\\';
+        }
+    }
+
+    // We only track paths under the redirect root
+    auto rootLength = g_redirectedPathIndexRoot.length();
+    return (key.length() > rootLength + 1) &&
+        (key.compare(0, rootLength, g_redirectedPathIndexRoot) == 0) &&
+        (key[rootLength] == L'\\');
+}
+
+// NOTE: The following functions assume that the caller holds the lock exclusively
+static void index_insert(iwstring key)
+{
+    auto rootLength = g_redirectedPathIndexRoot.length();
+    while (key.length() > rootLength)
+    {
+        // NOTE: Lookups check the filter without holding the lock, so anything in the index must already be in the filter
+        path_filter_add(key);
+        if (!g_redirectedPathIndex.insert(key).second)
+        {
+            // Parent directories are guaranteed to already be present
+            break;
+        }
+
+        key.resize(key.find_last_of(L'\\'));
+    }
+}
+
+static void index_erase(const iwstring& key)
+{
+    g_redirectedPathIndex.erase(key);
+
+    auto prefix = key + L'\\';
+    auto itr = g_redirectedPathIndex.lower_bound(prefix);
+    while ((itr != g_redirectedPathIndex.end()) && (itr->compare(0, prefix.length(), prefix) == 0))
+    {
+        itr = g_redirectedPathIndex.erase(itr);
+    }
+}
+
+// Enumerates everything under the directory, without following reparse points
+static void scan_directory(iwstring directory, std::vector<iwstring>& paths)
+{
+    std::vector<iwstring> pending;
+    pending.push_back(std::move(directory));
+    while (!pending.empty())
+    {
+        auto dir = std::move(pending.back());
+        pending.pop_back();
+
+        auto pattern = dir + L"\\*";
+        WIN32_FIND_DATAW findData;
+        auto findHandle = impl::FindFirstFileEx(
+            pattern.c_str(),
+            FindExInfoBasic,
+            &findData,
+            FindExSearchNameMatch,
+            nullptr,
+            FIND_FIRST_EX_LARGE_FETCH);
+        if (findHandle == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+
+        do
+        {
+            std::wstring_view name = findData.cFileName;
+            if ((name == L".") || (name == L".."))
+            {
+                continue;
+            }
+
+            auto path = dir + L'\\';
+            path.append(name.data(), name.length());
+            if ((findData.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) == FILE_ATTRIBUTE_DIRECTORY)
+            {
+                pending.push_back(path);
+            }
+            paths.push_back(std::move(path));
+        } while (impl::FindNextFile(findHandle, &findData));
+
+        impl::FindClose(findHandle);
+    }
+}
+
+template <typename Func>
+static void update_index(const wchar_t* path, Func&& func) noexcept
+{
+    if (!path || !g_redirectedPathIndexEnabled)
+    {
+        return;
+    }
+
+    // Callers typically return immediately after updating the index, so preserve the error from the operation that
+    // was performed
+    auto lastError = ::GetLastError();
+    try
+    {
+        iwstring key;
+        if (index_key(path, key))
+        {
+            func(std::move(key));
+        }
+    }
+    catch (...)
+    {
+        // The index is now out of sync with the disk. Rather than try and recover, stop using it
+        g_redirectedPathIndexEnabled = false;
+    }
+    ::SetLastError(lastError);
+}
+
+static void refresh_path(iwstring key)
+{
+    // Query the disk outside of the lock; if the path is a directory, its contents may be new to us, too (e.g. it was
+    // moved in from outside of the redirect root)
+    std::vector<iwstring> children;
+    auto attr = impl::GetFileAttributes(key.c_str());
+    if ((attr != INVALID_FILE_ATTRIBUTES) &&
+        ((attr & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) == FILE_ATTRIBUTE_DIRECTORY))
+    {
+        scan_directory(key, children);
+    }
+
+    std::unique_lock lock(g_redirectedPathIndexMutex);
+    index_erase(key);
+    if (attr != INVALID_FILE_ATTRIBUTES)
+    {
+        index_insert(std::move(key));
+        for (auto& child : children)
+        {
+            path_filter_add(child);
+            g_redirectedPathIndex.insert(std::move(child));
+        }
+    }
+}
+
+static void rescan_index()
+{
+    std::vector<iwstring> paths;
+    scan_directory(g_redirectedPathIndexRoot, paths);
+
+    std::set<iwstring> index;
+    for (auto& path : paths)
+    {
+        path_filter_add(path);
+        index.insert(std::move(path));
+    }
+
+    std::unique_lock lock(g_redirectedPathIndexMutex);
+    g_redirectedPathIndex.swap(index);
+}
+
+// Not in older SDKs. Same as FSCTL_READ_USN_JOURNAL, but doesn't require the caller to be an administrator
+#ifndef FSCTL_READ_UNPRIVILEGED_USN_JOURNAL
+#define FSCTL_READ_UNPRIVILEGED_USN_JOURNAL CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 234, METHOD_NEITHER, FILE_ANY_ACCESS)
+#endif
+
+constexpr std::uint32_t path_snapshot_magic = 0x53495350; // "PSIS"
+constexpr std::uint32_t path_snapshot_version = 1;
+constexpr wchar_t path_snapshot_file_name[] = L"PsfPathIndex.bin";
+
+// Followed by 'count' paths relative to the redirect root, each a 16-bit length in characters followed by the
+// characters, without a terminator
+struct path_snapshot_header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t journal_id;
+    std::int64_t usn;
+    std::uint64_t count;
+};
+
+// Only changes to names matter to the index
+constexpr DWORD journal_reason_mask =
+    USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME;
+
+struct change_journal
+{
+    // The redirect root, which the journal gets queried through and which file ids get opened relative to
+    psf::unique_handle root;
+
+    // The redirect root as the file system spells it, which is what the paths of opened file ids start with
+    iwstring root_final_path;
+
+    USN_JOURNAL_DATA_V0 data;
+
+    // File ids of the directories that records were for, mapped to the index key for the directory, or to an empty
+    // string if the directory isn't under the redirect root or no longer exists
+    std::map<std::pair<std::uint64_t, std::uint64_t>, iwstring> directories;
+};
+
+static std::wstring final_path(HANDLE file)
+{
+    std::wstring result(MAX_PATH, L'\0');
+    auto length = ::GetFinalPathNameByHandleW(file, result.data(), static_cast<DWORD>(result.size()), FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+    if (length >= result.size())
+    {
+        result.resize(length);
+        length = ::GetFinalPathNameByHandleW(file, result.data(), length, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+    }
+
+    result.resize((length < result.size()) ? length : 0);
+    return result;
+}
+
+static bool open_change_journal(change_journal& journal)
+{
+    journal.root.reset(impl::CreateFile(
+        g_redirectedPathIndexRoot.c_str(),
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        nullptr));
+    if (!journal.root)
+    {
+        return false;
+    }
+
+    DWORD bytes;
+    if (!::DeviceIoControl(journal.root.get(), FSCTL_QUERY_USN_JOURNAL, nullptr, 0, &journal.data, sizeof(journal.data), &bytes, nullptr))
+    {
+        journal.root.reset();
+        return false;
+    }
+
+    auto rootPath = final_path(journal.root.get());
+    journal.root_final_path.assign(rootPath.data(), rootPath.length());
+    return !journal.root_final_path.empty();
+}
+
+static const iwstring& resolve_journal_directory(change_journal& journal, const FILE_ID_DESCRIPTOR& id)
+{
+    std::uint64_t parts[2] = {};
+    std::memcpy(parts, &id.ExtendedFileId, (id.Type == FileIdType) ? sizeof(id.FileId) : sizeof(id.ExtendedFileId));
+    auto [itr, inserted] = journal.directories.emplace(std::make_pair(parts[0], parts[1]), iwstring{});
+    if (!inserted)
+    {
+        return itr->second;
+    }
+
+    psf::unique_handle directory(::OpenFileById(
+        journal.root.get(),
+        const_cast<FILE_ID_DESCRIPTOR*>(&id),
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        FILE_FLAG_BACKUP_SEMANTICS));
+    if (!directory)
+    {
+        // Deleted since, in which case the record that deleted it (or one of its parents) covers everything under it
+        return itr->second;
+    }
+
+    auto path = final_path(directory.get());
+    auto rootLength = journal.root_final_path.length();
+    if ((path.length() >= rootLength) &&
+        (iwstring_view(path.data(), rootLength) == journal.root_final_path) &&
+        ((path.length() == rootLength) || (path[rootLength] == L'\\')))
+    {
+        itr->second = g_redirectedPathIndexRoot;
+        itr->second.append(path.data() + rootLength, path.length() - rootLength);
+    }
+
+    return itr->second;
+}
+
+// Collects the paths under the redirect root that the journal has name changes for, from 'usn' up to where the journal
+// was when it was opened
+static bool read_journal_changes(change_journal& journal, USN usn, std::set<iwstring>& changes)
+{
+    READ_USN_JOURNAL_DATA_V1 readData = {};
+    readData.StartUsn = usn;
+    readData.ReasonMask = journal_reason_mask;
+    readData.UsnJournalID = journal.data.UsnJournalID;
+    readData.MinMajorVersion = 2;
+    readData.MaxMajorVersion = 3;
+
+    auto snapshotPath = g_redirectedPathIndexRoot + L'\\' + path_snapshot_file_name;
+    DWORD ioctl = FSCTL_READ_UNPRIVILEGED_USN_JOURNAL;
+    alignas(USN) std::byte buffer[64 * 1024];
+    while (readData.StartUsn < journal.data.NextUsn)
+    {
+        DWORD bytes;
+        if (!::DeviceIoControl(journal.root.get(), ioctl, &readData, sizeof(readData), buffer, sizeof(buffer), &bytes, nullptr))
+        {
+            if ((ioctl == FSCTL_READ_UNPRIVILEGED_USN_JOURNAL) && (::GetLastError() == ERROR_INVALID_FUNCTION))
+            {
+                // Older versions of Windows only have the privileged version
+                ioctl = FSCTL_READ_USN_JOURNAL;
+                continue;
+            }
+
+            // E.g. ERROR_JOURNAL_ENTRY_DELETED if the journal wrapped in the meantime
+            return false;
+        }
+
+        if (bytes < sizeof(USN))
+        {
+            return false;
+        }
+
+        USN nextUsn;
+        std::memcpy(&nextUsn, buffer, sizeof(nextUsn));
+        for (DWORD offset = sizeof(USN); offset + sizeof(USN_RECORD_COMMON_HEADER) <= bytes; )
+        {
+            auto header = reinterpret_cast<const USN_RECORD_COMMON_HEADER*>(buffer + offset);
+            if ((header->RecordLength == 0) || (offset + header->RecordLength > bytes))
+            {
+                return false;
+            }
+
+            FILE_ID_DESCRIPTOR parentId = { sizeof(parentId) };
+            const wchar_t* name;
+            std::size_t nameLength;
+            if (header->MajorVersion == 2)
+            {
+                auto record = reinterpret_cast<const USN_RECORD_V2*>(header);
+                parentId.Type = FileIdType;
+                parentId.FileId.QuadPart = static_cast<LONGLONG>(record->ParentFileReferenceNumber);
+                name = reinterpret_cast<const wchar_t*>(reinterpret_cast<const std::byte*>(record) + record->FileNameOffset);
+                nameLength = record->FileNameLength / sizeof(wchar_t);
+            }
+            else if (header->MajorVersion == 3)
+            {
+                auto record = reinterpret_cast<const USN_RECORD_V3*>(header);
+                parentId.Type = ExtendedFileIdType;
+                parentId.ExtendedFileId = record->ParentFileReferenceNumber;
+                name = reinterpret_cast<const wchar_t*>(reinterpret_cast<const std::byte*>(record) + record->FileNameOffset);
+                nameLength = record->FileNameLength / sizeof(wchar_t);
+            }
+            else
+            {
+                return false;
+            }
+
+            if (auto& directory = resolve_journal_directory(journal, parentId); !directory.empty())
+            {
+                auto path = directory + L'\\';
+                path.append(name, nameLength);
+
+                // Saving the index shows up in the journal, too
+                if ((path.length() < snapshotPath.length()) || (iwstring_view(path.data(), snapshotPath.length()) != snapshotPath))
+                {
+                    changes.insert(std::move(path));
+                }
+            }
+
+            offset += header->RecordLength;
+        }
+
+        if (nextUsn <= readData.StartUsn)
+        {
+            break;
+        }
+        readData.StartUsn = nextUsn;
+    }
+
+    return true;
+}
+
+static bool load_path_snapshot(const change_journal& journal, std::vector<iwstring>& paths, USN& usn)
+{
+    auto snapshotPath = g_redirectedPathIndexRoot + L'\\' + path_snapshot_file_name;
+    psf::unique_handle file(impl::CreateFile(
+        snapshotPath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr));
+    LARGE_INTEGER size;
+    if (!file || !::GetFileSizeEx(file.get(), &size) || (size.QuadPart < static_cast<LONGLONG>(sizeof(path_snapshot_header))) ||
+        (size.QuadPart > MAXDWORD))
+    {
+        return false;
+    }
+
+    std::vector<std::byte> contents(static_cast<std::size_t>(size.QuadPart));
+    DWORD bytesRead;
+    if (!impl::ReadFile(file.get(), contents.data(), static_cast<DWORD>(contents.size()), &bytesRead, nullptr) ||
+        (bytesRead != contents.size()))
+    {
+        return false;
+    }
+
+    path_snapshot_header header;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    if ((header.magic != path_snapshot_magic) ||
+        (header.version != path_snapshot_version) ||
+        (header.journal_id != journal.data.UsnJournalID) ||
+        (header.usn < journal.data.FirstUsn) ||
+        (header.usn < journal.data.LowestValidUsn) ||
+        (header.usn > journal.data.NextUsn))
+    {
+        // Saved against a different journal, or one that's since wrapped past where the saved index was current as of
+        return false;
+    }
+
+    std::size_t offset = sizeof(header);
+    paths.reserve(static_cast<std::size_t>((std::min)(header.count, static_cast<std::uint64_t>(contents.size()))));
+    for (std::uint64_t i = 0; i < header.count; ++i)
+    {
+        std::uint16_t length;
+        if (offset + sizeof(length) > contents.size())
+        {
+            return false;
+        }
+        std::memcpy(&length, contents.data() + offset, sizeof(length));
+        offset += sizeof(length);
+
+        if ((length == 0) || (offset + length * sizeof(wchar_t) > contents.size()))
+        {
+            return false;
+        }
+
+        auto& path = paths.emplace_back(g_redirectedPathIndexRoot);
+        path.push_back(L'\\');
+        auto start = path.length();
+        path.resize(start + length);
+        std::memcpy(path.data() + start, contents.data() + offset, length * sizeof(wchar_t));
+        offset += length * sizeof(wchar_t);
+    }
+
+    usn = header.usn;
+    return offset == contents.size();
+}
+
+// Saves the index as of 'usn', which must be from before the index was populated, so that the next process reads back
+// every change that the index might not have seen
+static void save_path_snapshot(const change_journal& journal, USN usn) noexcept try
+{
+    path_snapshot_header header = { path_snapshot_magic, path_snapshot_version, journal.data.UsnJournalID, usn, 0 };
+    std::vector<std::byte> contents(sizeof(header));
+    {
+        std::shared_lock lock(g_redirectedPathIndexMutex);
+        auto rootLength = g_redirectedPathIndexRoot.length() + 1;
+        for (auto& path : g_redirectedPathIndex)
+        {
+            auto length = static_cast<std::uint16_t>(path.length() - rootLength);
+            if (path.length() - rootLength > 0xFFFF)
+            {
+                // Nothing can be this long. Leaving it out only means that the next process has to check the disk for it
+                continue;
+            }
+
+            auto offset = contents.size();
+            contents.resize(offset + sizeof(length) + length * sizeof(wchar_t));
+            std::memcpy(contents.data() + offset, &length, sizeof(length));
+            std::memcpy(contents.data() + offset + sizeof(length), path.data() + rootLength, length * sizeof(wchar_t));
+            ++header.count;
+        }
+    }
+    std::memcpy(contents.data(), &header, sizeof(header));
+
+    // Written next to the saved index and renamed over it, so that other processes never read half of one
+    auto snapshotPath = g_redirectedPathIndexRoot + L'\\' + path_snapshot_file_name;
+    auto tempPath = snapshotPath + L'.' + std::to_wstring(::GetCurrentProcessId()).c_str();
+    psf::unique_handle file(impl::CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (!file)
+    {
+        return;
+    }
+
+    DWORD bytesWritten;
+    auto written = impl::WriteFile(file.get(), contents.data(), static_cast<DWORD>(contents.size()), &bytesWritten, nullptr) &&
+        (bytesWritten == contents.size());
+    file.reset();
+    if (!written || !impl::MoveFileEx(tempPath.c_str(), snapshotPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        impl::DeleteFile(tempPath.c_str());
+    }
+}
+catch (...)
+{
+    // The next process walks the redirect root instead
+}
+
+static bool probe_path(const wchar_t* path, WIN32_FILE_ATTRIBUTE_DATA* attributes) noexcept
+{
+    if (!attributes)
+    {
+        return impl::PathExists(path);
+    }
+
+    if (!impl::GetFileAttributesEx(path, GetFileExInfoStandard, attributes))
+    {
+        attributes->dwFileAttributes = INVALID_FILE_ATTRIBUTES;
+        return false;
+    }
+
+    return true;
+}
+
+static bool index_miss(WIN32_FILE_ATTRIBUTE_DATA* attributes) noexcept
+{
+    if (attributes)
+    {
+        attributes->dwFileAttributes = INVALID_FILE_ATTRIBUTES;
+        ::SetLastError(ERROR_FILE_NOT_FOUND);
+    }
+
+    return false;
+}
+
+bool RedirectedPathExists(const wchar_t* path, WIN32_FILE_ATTRIBUTE_DATA* attributes)
+{
+    if (g_redirectedPathIndexEnabled)
+    {
+        iwstring key;
+        if (index_key(path, key))
+        {
+            if (!path_filter_may_contain(key))
+            {
+                return index_miss(attributes);
+            }
+
+            {
+                std::shared_lock lock(g_redirectedPathIndexMutex);
+                if (g_redirectedPathIndex.find(key) == g_redirectedPathIndex.end())
+                {
+                    return index_miss(attributes);
+                }
+            }
+
+            // Only trust the index for misses, which is the common case. Hits still get confirmed against the disk,
+            // since files may get removed from the redirect root without us knowing (e.g. the user clearing it out),
+            // and acting on a stale hit would mean failing calls that would have otherwise succeeded
+            if (probe_path(path, attributes))
+            {
+                return true;
+            }
+
+            auto lastError = ::GetLastError();
+            RedirectedPathDeleted(path);
+            ::SetLastError(lastError);
+            return false;
+        }
+    }
+
+    return probe_path(path, attributes);
+}
+
+bool RedirectedDirectoryIndexed(const wchar_t* directory, std::size_t& indexedLength) noexcept try
+{
+    indexedLength = 0;
+    iwstring key;
+    if (!g_redirectedPathIndexEnabled || !index_key(directory, key))
+    {
+        return false;
+    }
+
+    // Since parent directories are always present, the first one that's found is the deepest
+    auto rootLength = g_redirectedPathIndexRoot.length();
+    std::shared_lock lock(g_redirectedPathIndexMutex);
+    while (key.length() > rootLength)
+    {
+        if (path_filter_may_contain(key) && (g_redirectedPathIndex.find(key) != g_redirectedPathIndex.end()))
+        {
+            indexedLength = key.length();
+            break;
+        }
+
+        key.resize(key.find_last_of(L'\\'));
+    }
+
+    return true;
+}
+catch (...)
+{
+    return false;
+}
+
+void RedirectedPathCreated(const wchar_t* path) noexcept
+{
+    RemovePackageFileTombstone(path);
+    RemoveAttributeOverride(path);
+    InvalidateDirectoryListings(path);
+    update_index(path, [](iwstring key)
+    {
+        std::unique_lock lock(g_redirectedPathIndexMutex);
+        index_insert(std::move(key));
+    });
+}
+
+void RedirectedPathDeleted(const wchar_t* path) noexcept
+{
+    InvalidateDirectoryListings(path);
+    update_index(path, [](iwstring key)
+    {
+        std::unique_lock lock(g_redirectedPathIndexMutex);
+        index_erase(key);
+    });
+}
+
+void RedirectedPathChanged(const wchar_t* path) noexcept
+{
+    if (PackageFileDeleted(path))
+    {
+        auto lastError = ::GetLastError();
+        if (impl::PathExists(path))
+        {
+            RemovePackageFileTombstone(path);
+        }
+        ::SetLastError(lastError);
+    }
+
+    InvalidateDirectoryListings(path);
+    update_index(path, [](iwstring key)
+    {
+        refresh_path(std::move(key));
+    });
+}
+
+static DWORD __stdcall RedirectedPathWatcher(void* directoryHandle) noexcept
+{
+    psf::unique_handle directory(directoryHandle);
+    psf::unique_handle ioEvent(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (!ioEvent)
+    {
+        g_redirectedPathIndexEnabled = false;
+        return ::GetLastError();
+    }
+
+    alignas(DWORD) std::byte buffer[16 * 1024];
+    while (g_redirectedPathIndexEnabled)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = ioEvent.get();
+        constexpr DWORD notifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME;
+        if (!::ReadDirectoryChangesW(directory.get(), buffer, sizeof(buffer), TRUE, notifyFilter, nullptr, &overlapped, nullptr))
+        {
+            // Without notifications, the index can't be trusted
+            g_redirectedPathIndexEnabled = false;
+            return ::GetLastError();
+        }
+
+        HANDLE handles[] = { g_redirectedPathWatcherStopEvent.get(), ioEvent.get() };
+        if (::WaitForMultipleObjects(2, handles, FALSE, INFINITE) != (WAIT_OBJECT_0 + 1))
+        {
+            ::CancelIoEx(directory.get(), &overlapped);
+            DWORD ignored;
+            ::GetOverlappedResult(directory.get(), &overlapped, &ignored, TRUE);
+            return ERROR_SUCCESS;
+        }
+
+        DWORD bytes = 0;
+        if (!::GetOverlappedResult(directory.get(), &overlapped, &bytes, FALSE))
+        {
+            g_redirectedPathIndexEnabled = false;
+            return ::GetLastError();
+        }
+
+        if (bytes == 0)
+        {
+            // The notification buffer overflowed, so we don't know what changed. Re-scan everything
+            try
+            {
+                rescan_index();
+            }
+            catch (...)
+            {
+                g_redirectedPathIndexEnabled = false;
+            }
+            continue;
+        }
+
+        // NOTE: We don't trust the notification's action since it may be stale by the time we process it (e.g. a delete
+        //       followed by a create through one of our fixups). Instead, we re-validate the path against the disk
+        for (auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer); ; )
+        {
+            std::wstring path = g_redirectedPathIndexRoot.c_str();
+            path.push_back(L'\\');
+            path.append(info->FileName, info->FileNameLength / sizeof(wchar_t));
+            RedirectedPathChanged(path.c_str());
+
+            if (!info->NextEntryOffset)
+            {
+                break;
+            }
+            info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(reinterpret_cast<const std::byte*>(info) + info->NextEntryOffset);
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+void InitializeRedirectedPathIndex(const psf::json_object* config)
+{
+    bool enabled = true;
+    bool watchForChanges = false;
+    bool prefilter = true;
+    bool changeJournal = false;
+    if (config)
+    {
+        if (auto enabledValue = config->try_get("enabled"))
+        {
+            enabled = static_cast<bool>(enabledValue->as_boolean());
+        }
+
+        if (auto watchValue = config->try_get("watchForChanges"))
+        {
+            watchForChanges = static_cast<bool>(watchValue->as_boolean());
+        }
+
+        if (auto prefilterValue = config->try_get("prefilter"))
+        {
+            prefilter = static_cast<bool>(prefilterValue->as_boolean());
+        }
+
+        if (auto changeJournalValue = config->try_get("changeJournal"))
+        {
+            changeJournal = static_cast<bool>(changeJournalValue->as_boolean());
+        }
+    }
+
+    if (!enabled)
+    {
+        return;
+    }
+
+    auto root = LR"(\\?\)" + g_redirectRootPath.native();
+    g_redirectedPathIndexRoot.assign(root.data(), root.length());
+
+    if (prefilter)
+    {
+        initialize_path_filter();
+    }
+
+    // NOTE: Nothing queries the index until our functions are detoured, which happens after initialization completes,
+    //       so it's safe to enable the index before we've populated it. We do need it enabled early, however, so that
+    //       changes the watcher picks up while we're scanning aren't dropped
+    g_redirectedPathIndexEnabled = true;
+    try
+    {
+        // Start watching before we scan so that we don't miss any changes made in-between
+        if (watchForChanges)
+        {
+            EnsureRedirectRootExists();
+            g_redirectedPathWatcherStopEvent.reset(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+            psf::unique_handle directory(impl::CreateFile(
+                root.c_str(),
+                FILE_LIST_DIRECTORY,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                nullptr));
+            if (!g_redirectedPathWatcherStopEvent || !directory)
+            {
+                g_redirectedPathIndexEnabled = false;
+                return;
+            }
+
+            // NOTE: We never wait for this thread to exit. PSFUninitialize signals it to stop, but waiting on it from
+            //       within DllMain would deadlock on the loader lock
+            psf::unique_handle thread(::CreateThread(nullptr, 0, RedirectedPathWatcher, directory.get(), 0, nullptr));
+            if (!thread)
+            {
+                g_redirectedPathIndexEnabled = false;
+                return;
+            }
+            directory.release();
+        }
+
+        // NOTE: The changes are read up to where the journal was when it got opened, which is therefore what the index
+        //       is current as of once it's populated, however it got populated
+        std::vector<iwstring> paths;
+        std::set<iwstring> changes;
+        change_journal journal;
+        USN snapshotUsn;
+        auto fromSnapshot = changeJournal && open_change_journal(journal) &&
+            load_path_snapshot(journal, paths, snapshotUsn) && read_journal_changes(journal, snapshotUsn, changes);
+        if (!fromSnapshot)
+        {
+            paths.clear();
+            changes.clear();
+            scan_directory(g_redirectedPathIndexRoot, paths);
+        }
+
+        {
+            std::unique_lock lock(g_redirectedPathIndexMutex);
+            for (auto& path : paths)
+            {
+                path_filter_add(path);
+                g_redirectedPathIndex.insert(std::move(path));
+            }
+        }
+
+        // Sorted, so directories get refreshed before anything under them
+        for (auto& path : changes)
+        {
+            refresh_path(path);
+        }
+
+        if (journal.root && (!fromSnapshot || !changes.empty()))
+        {
+            save_path_snapshot(journal, journal.data.NextUsn);
+        }
+    }
+    catch (...)
+    {
+        // Not having the index isn't fatal; we'll just query the disk instead
+        g_redirectedPathIndexEnabled = false;
+    }
+}
+
+void UninitializeRedirectedPathIndex() noexcept
+{
+    g_redirectedPathIndexEnabled = false;
+    if (g_redirectedPathWatcherStopEvent)
+    {
+        ::SetEvent(g_redirectedPathWatcherStopEvent.get());
+    }
+}
@@ -0,0 +1,179 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Long running processes (e.g. kiosk applications) can pick up changes to "redirectedPaths" without being relaunched.
+// A background thread waits for config.json to change and/or for a named event to be signaled, and then parses the
+// configuration again and swaps in the new redirection specs. ShouldRedirect never takes a lock to read the specs, and
+// the old specs get freed once every call that was using them has returned; see redirection_snapshot in
+// PathRedirection.cpp. Only the redirection specs are reloaded. Everything else in the configuration keeps the
+// values it had at startup
+//
+// NOTE: Files that were already copied to the redirect root stay there, even if they no longer match any spec
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+
+// Changes to config.json tend to arrive as a burst of writes. Wait for things to settle down before reloading
+constexpr DWORD hot_reload_settle_time_ms = 250;
+
+psf::unique_handle g_hotReloadStopEvent;
+psf::unique_handle g_hotReloadEvent;
+HANDLE g_hotReloadChangeNotification = INVALID_HANDLE_VALUE;
+std::wstring g_hotReloadConfigPath;
+
+static FILETIME config_last_write_time() noexcept
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!impl::GetFileAttributesEx(g_hotReloadConfigPath.c_str(), GetFileExInfoStandard, &data))
+    {
+        return {};
+    }
+
+    return data.ftLastWriteTime;
+}
+
+static bool operator==(const FILETIME& lhs, const FILETIME& rhs) noexcept
+{
+    return (lhs.dwLowDateTime == rhs.dwLowDateTime) && (lhs.dwHighDateTime == rhs.dwHighDateTime);
+}
+
+static DWORD __stdcall RedirectionHotReloadThread(void*) noexcept
+{
+    // Reading config.json goes through CreateFile, which must not get redirected to some stale copy of the file
+    auto guard = g_reentrancyGuard.enter();
+
+    auto lastWriteTime = config_last_write_time();
+    constexpr DWORD no_index = MAXDWORD;
+    HANDLE handles[3] = { g_hotReloadStopEvent.get() };
+    DWORD handleCount = 1;
+    DWORD eventIndex = no_index;
+    DWORD changeIndex = no_index;
+    if (g_hotReloadEvent)
+    {
+        eventIndex = handleCount;
+        handles[handleCount++] = g_hotReloadEvent.get();
+    }
+    if (g_hotReloadChangeNotification != INVALID_HANDLE_VALUE)
+    {
+        changeIndex = handleCount;
+        handles[handleCount++] = g_hotReloadChangeNotification;
+    }
+
+    for (;;)
+    {
+        auto index = ::WaitForMultipleObjects(handleCount, handles, FALSE, INFINITE);
+        if (index == changeIndex)
+        {
+            do
+            {
+                if (!::FindNextChangeNotification(g_hotReloadChangeNotification))
+                {
+                    return ::GetLastError();
+                }
+
+                index = ::WaitForMultipleObjects(handleCount, handles, FALSE, hot_reload_settle_time_ms);
+            } while (index == changeIndex);
+
+            if (index == WAIT_TIMEOUT)
+            {
+                // The notification is for the whole package root, so it may well be for something other than
+                // config.json
+                auto writeTime = config_last_write_time();
+                if (writeTime == lastWriteTime)
+                {
+                    continue;
+                }
+                lastWriteTime = writeTime;
+                ReloadRedirectionConfiguration();
+                continue;
+            }
+        }
+
+        if (index != eventIndex)
+        {
+            // Either we've been asked to stop or the wait failed
+            return ERROR_SUCCESS;
+        }
+
+        ReloadRedirectionConfiguration();
+    }
+}
+
+void InitializeRedirectionHotReload(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    bool watchConfig = true;
+    if (auto watchValue = config->try_get("watchConfig"))
+    {
+        watchConfig = static_cast<bool>(watchValue->as_boolean());
+    }
+
+    if (auto eventNameValue = config->try_get("eventName"))
+    {
+        // Auto-reset events only wake a single waiter, so let each process have its own event
+        auto name = std::wstring(eventNameValue->as_string().wstring());
+        constexpr std::wstring_view processIdToken = L"{processId}";
+        if (auto pos = name.find(processIdToken); pos != std::wstring::npos)
+        {
+            name.replace(pos, processIdToken.length(), std::to_wstring(::GetCurrentProcessId()));
+        }
+
+        g_hotReloadEvent.reset(::CreateEventW(nullptr, FALSE, FALSE, name.c_str()));
+    }
+
+    if (watchConfig)
+    {
+        g_hotReloadConfigPath = (g_packageRootPath / L"config.json").native();
+        g_hotReloadChangeNotification = ::FindFirstChangeNotificationW(
+            g_packageRootPath.c_str(),
+            FALSE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE);
+    }
+
+    if (!g_hotReloadEvent && (g_hotReloadChangeNotification == INVALID_HANDLE_VALUE))
+    {
+        // Nothing to trigger a reload
+        return;
+    }
+
+    g_hotReloadStopEvent.reset(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (!g_hotReloadStopEvent)
+    {
+        return;
+    }
+
+    // NOTE: Nothing calls ShouldRedirect until our functions are detoured, which happens after initialization completes
+    EnableRedirectionReload();
+
+    // NOTE: We never wait for this thread to exit. PSFUninitialize signals it to stop, but waiting on it from within
+    //       DllMain would deadlock on the loader lock
+    psf::unique_handle thread(::CreateThread(nullptr, 0, RedirectionHotReloadThread, nullptr, 0, nullptr));
+}
+
+void UninitializeRedirectionHotReload() noexcept
+{
+    if (g_hotReloadStopEvent)
+    {
+        ::SetEvent(g_hotReloadStopEvent.get());
+    }
+}
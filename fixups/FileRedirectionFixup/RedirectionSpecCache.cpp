@@ -0,0 +1,466 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Building the redirection specs means resolving known folders and compiling every pattern, and every process that
+// loads the fixup does this again - including each of the helper processes that some packages spawn by the dozen. When
+// enabled, the first process to build the specs saves them (base paths resolved, DFA tables for compiled patterns) to a
+// file in the redirect root, and later processes map that file and load the specs from it instead.
+//
+// The file is keyed by a hash of everything that the specs are built from: the "redirectedPaths" configuration, the
+// package root path, and the process architecture (32-bit processes don't support the x64 known folders, and the DFA
+// tables are saved in the native byte order). A file with a different key, version, or checksum is ignored and gets
+// replaced once the specs have been rebuilt. Named known folders (System, Windows, etc.) can't be moved, but the user
+// can redirect known folders that are identified by GUID (e.g. Documents), so those get resolved again when loading
+// and any difference causes a rebuild.
+//
+// The specs are also shared with child processes through the PsfRuntime, so children never need to open the file.
+//
+// NOTE: Patterns that fall back to std::wregex, or that haven't been used enough to be compiled yet (see
+//       "patternCompilation"), can't be saved in compiled form, so their source is saved instead and they're parsed
+//       again when loading. Files are written to a temporary name and then renamed over the existing
+//       file, so concurrently starting processes never see a partially written file
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fancy_handle.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+extern std::filesystem::path g_redirectRootPath;
+extern std::uint32_t g_patternCompileAfter;
+std::filesystem::path path_from_known_folder_string(std::wstring_view str);
+
+constexpr std::uint32_t spec_cache_magic = 0x52465350; // "PSFR"
+constexpr std::uint32_t spec_cache_version = 2;
+
+// Sanity limit on the size of the file that we'll map; real configurations are a tiny fraction of this
+constexpr std::uint64_t max_spec_cache_size = 16 * 1024 * 1024;
+
+#if defined(_M_IX86)
+constexpr std::wstring_view spec_cache_architecture = L"x86";
+#elif defined(_M_AMD64)
+constexpr std::wstring_view spec_cache_architecture = L"x64";
+#elif defined(_M_ARM64)
+constexpr std::wstring_view spec_cache_architecture = L"arm64";
+#else
+constexpr std::wstring_view spec_cache_architecture = L"unknown";
+#endif
+
+struct spec_cache_header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t key;
+    std::uint64_t checksum; // Of everything after the header
+    std::uint32_t folder_count;
+    std::uint32_t spec_count;
+};
+
+bool g_specCacheEnabled = false;
+std::uint64_t g_specCacheKey = 0;
+std::wstring g_specCachePath;
+
+struct fnv1a_hash
+{
+    std::uint64_t value = 14695981039346656037ull;
+
+    void add(const void* data, std::size_t size) noexcept
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            value = (value ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+
+    template <typename CharT>
+    void add(std::basic_string_view<CharT> str) noexcept
+    {
+        auto length = static_cast<std::uint32_t>(str.length());
+        add(&length, sizeof(length));
+        add(str.data(), str.length() * sizeof(CharT));
+    }
+};
+
+static void hash_json(fnv1a_hash& hash, const psf::json_value& value)
+{
+    auto type = value.type();
+    hash.add(&type, sizeof(type));
+    switch (type)
+    {
+    case psf::json_type::string:
+        hash.add(value.as_string().string());
+        break;
+
+    case psf::json_type::number:
+    {
+        auto number = value.as_number().get_float();
+        hash.add(&number, sizeof(number));
+        break;
+    }
+
+    case psf::json_type::boolean:
+    {
+        auto boolean = value.as_boolean().get();
+        hash.add(&boolean, sizeof(boolean));
+        break;
+    }
+
+    case psf::json_type::object:
+        for (auto&& [key, child] : value.as_object())
+        {
+            hash.add(key);
+            hash_json(hash, child);
+        }
+        break;
+
+    case psf::json_type::array:
+    {
+        auto& array = value.as_array();
+        auto size = array.size();
+        hash.add(&size, sizeof(size));
+        for (auto& child : array)
+        {
+            hash_json(hash, child);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+static void append_bytes(std::vector<std::uint8_t>& data, const void* value, std::size_t size)
+{
+    auto bytes = static_cast<const std::uint8_t*>(value);
+    data.insert(data.end(), bytes, bytes + size);
+}
+
+static void append_string(std::vector<std::uint8_t>& data, std::wstring_view str)
+{
+    auto length = static_cast<std::uint32_t>(str.length());
+    append_bytes(data, &length, sizeof(length));
+    append_bytes(data, str.data(), str.length() * sizeof(wchar_t));
+}
+
+static bool read_bytes(const std::uint8_t*& data, const std::uint8_t* end, void* value, std::size_t size) noexcept
+{
+    if (static_cast<std::size_t>(end - data) < size)
+    {
+        return false;
+    }
+
+    std::memcpy(value, data, size);
+    data += size;
+    return true;
+}
+
+static bool read_string(const std::uint8_t*& data, const std::uint8_t* end, std::wstring& str)
+{
+    std::uint32_t length;
+    if (!read_bytes(data, end, &length, sizeof(length)) ||
+        (length > static_cast<std::size_t>(end - data) / sizeof(wchar_t)))
+    {
+        return false;
+    }
+
+    str.resize(length);
+    return read_bytes(data, end, str.data(), length * sizeof(wchar_t));
+}
+
+void InitializeRedirectionSpecCache(const psf::json_object* config, const psf::json_value* redirectedPaths)
+{
+    // NOTE: This gets called again for every reload of the configuration
+    g_specCacheEnabled = false;
+    if (!config || !redirectedPaths)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    fnv1a_hash hash;
+    hash.add(&spec_cache_version, sizeof(spec_cache_version));
+    hash.add(spec_cache_architecture);
+    hash.add(std::wstring_view(g_packageRootPath.native()));
+    hash_json(hash, *redirectedPaths);
+    g_specCacheKey = hash.value;
+
+    g_specCachePath = (g_redirectRootPath / L"PsfRedirectionSpecs.").native();
+    g_specCachePath += spec_cache_architecture;
+    g_specCachePath += L".bin";
+    g_specCacheEnabled = true;
+}
+
+static bool load_specs(const std::uint8_t* data, const std::uint8_t* end, path_redirection_specs& specs)
+{
+    spec_cache_header header;
+    if (!read_bytes(data, end, &header, sizeof(header)) ||
+        (header.magic != spec_cache_magic) ||
+        (header.version != spec_cache_version) ||
+        (header.key != g_specCacheKey))
+    {
+        return false;
+    }
+
+    fnv1a_hash checksum;
+    checksum.add(data, end - data);
+    if (checksum.value != header.checksum)
+    {
+        return false;
+    }
+
+    for (std::uint32_t i = 0; i < header.folder_count; ++i)
+    {
+        std::wstring id, path;
+        if (!read_string(data, end, id) || !read_string(data, end, path) ||
+            (path_from_known_folder_string(id).native() != path))
+        {
+            return false;
+        }
+    }
+
+    path_redirection_specs result;
+    result.reserve(header.spec_count);
+    for (std::uint32_t i = 0; i < header.spec_count; ++i)
+    {
+        auto& spec = result.emplace_back();
+
+        std::wstring basePath;
+        std::uint8_t shape;
+        std::uint8_t target;
+        if (!read_string(data, end, basePath) ||
+            !read_bytes(data, end, &shape, sizeof(shape)) ||
+            (shape > static_cast<std::uint8_t>(psf::pattern_shape::suffix)) ||
+            !read_bytes(data, end, &target, sizeof(target)) ||
+            (target >= redirect_target_count) ||
+            !read_string(data, end, spec.literal))
+        {
+            return false;
+        }
+
+        spec.base_path = std::move(basePath);
+        spec.shape = static_cast<psf::pattern_shape>(shape);
+        spec.target = static_cast<redirect_target>(target);
+        if (spec.shape == psf::pattern_shape::general)
+        {
+            std::uint8_t compiled;
+            if (!read_bytes(data, end, &compiled, sizeof(compiled)) || !read_string(data, end, spec.source))
+            {
+                return false;
+            }
+
+            if (compiled)
+            {
+                if (!spec.pattern.load(data, end))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                spec.pattern.assign(spec.source, g_patternCompileAfter);
+            }
+        }
+    }
+
+    if (data != end)
+    {
+        return false;
+    }
+
+    specs = std::move(result);
+    return true;
+}
+
+// Child processes get the specs from their parent through the PsfRuntime (see PSFQuerySharedSection) so that they don't
+// need to open the file at all. The key still gets checked, since the child may be configured differently
+// {3E9B7A14-C6D2-4F81-8B05-D17A4E6C2B93}
+constexpr GUID spec_cache_section_id = { 0x3e9b7a14, 0xc6d2, 0x4f81, { 0x8b, 0x05, 0xd1, 0x7a, 0x4e, 0x6c, 0x2b, 0x93 } };
+
+static bool load_specs_from_section(HANDLE mapping, std::uint64_t size, path_redirection_specs& specs)
+{
+    if ((size < sizeof(spec_cache_header)) || (size > max_spec_cache_size))
+    {
+        return false;
+    }
+
+    auto view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, static_cast<SIZE_T>(size));
+    if (!view)
+    {
+        return false;
+    }
+
+    bool result = false;
+    try
+    {
+        auto data = static_cast<const std::uint8_t*>(view);
+        result = load_specs(data, data + size, specs);
+    }
+    catch (...)
+    {
+        // E.g. a fallback pattern that no longer compiles. Rebuilding will report the error like it normally would
+    }
+
+    ::UnmapViewOfFile(view);
+    return result;
+}
+
+static void publish_spec_section(const std::vector<std::uint8_t>& data) noexcept
+{
+    auto size = static_cast<std::uint64_t>(data.size());
+    psf::unique_handle mapping(impl::CreateFileMapping(
+        INVALID_HANDLE_VALUE,
+        nullptr,
+        PAGE_READWRITE,
+        static_cast<DWORD>(size >> 32),
+        static_cast<DWORD>(size),
+        static_cast<const wchar_t*>(nullptr)));
+    if (!mapping)
+    {
+        return;
+    }
+
+    auto view = ::MapViewOfFile(mapping.get(), FILE_MAP_WRITE, 0, 0, data.size());
+    if (!view)
+    {
+        return;
+    }
+
+    std::memcpy(view, data.data(), data.size());
+    ::UnmapViewOfFile(view);
+    ::PSFPublishSharedSection(spec_cache_section_id, mapping.get(), size);
+}
+
+bool LoadRedirectionSpecCache(path_redirection_specs& specs)
+{
+    if (!g_specCacheEnabled)
+    {
+        return false;
+    }
+
+    std::uint64_t sharedSize;
+    if (auto section = ::PSFQuerySharedSection(spec_cache_section_id, &sharedSize);
+        section && load_specs_from_section(section, sharedSize, specs))
+    {
+        return true;
+    }
+
+    psf::unique_handle file(impl::CreateFile(
+        g_specCachePath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr));
+    LARGE_INTEGER size;
+    if (!file || !::GetFileSizeEx(file.get(), &size))
+    {
+        return false;
+    }
+
+    psf::unique_handle mapping(impl::CreateFileMapping(file.get(), nullptr, PAGE_READONLY, 0, 0, static_cast<const wchar_t*>(nullptr)));
+    if (!mapping || !load_specs_from_section(mapping.get(), static_cast<std::uint64_t>(size.QuadPart), specs))
+    {
+        return false;
+    }
+
+    ::PSFPublishSharedSection(spec_cache_section_id, mapping.get(), static_cast<std::uint64_t>(size.QuadPart));
+    return true;
+}
+
+void SaveRedirectionSpecCache(
+    const path_redirection_specs& specs,
+    const std::vector<redirection_spec_cache_folder>& folders) noexcept try
+{
+    if (!g_specCacheEnabled)
+    {
+        return;
+    }
+
+    EnsureRedirectRootExists();
+    std::vector<std::uint8_t> data(sizeof(spec_cache_header));
+    for (auto& folder : folders)
+    {
+        append_string(data, folder.id);
+        append_string(data, folder.path);
+    }
+
+    for (auto& spec : specs)
+    {
+        auto shape = static_cast<std::uint8_t>(spec.shape);
+        auto target = static_cast<std::uint8_t>(spec.target);
+        append_string(data, spec.base_path.native());
+        append_bytes(data, &shape, sizeof(shape));
+        append_bytes(data, &target, sizeof(target));
+        append_string(data, spec.literal);
+        if (spec.shape == psf::pattern_shape::general)
+        {
+            std::uint8_t compiled = spec.pattern.compiled() ? 1 : 0;
+            append_bytes(data, &compiled, sizeof(compiled));
+            append_string(data, spec.source);
+            if (compiled)
+            {
+                spec.pattern.save(data);
+            }
+        }
+    }
+
+    spec_cache_header header = {};
+    header.magic = spec_cache_magic;
+    header.version = spec_cache_version;
+    header.key = g_specCacheKey;
+    header.folder_count = static_cast<std::uint32_t>(folders.size());
+    header.spec_count = static_cast<std::uint32_t>(specs.size());
+
+    fnv1a_hash checksum;
+    checksum.add(data.data() + sizeof(header), data.size() - sizeof(header));
+    header.checksum = checksum.value;
+    std::memcpy(data.data(), &header, sizeof(header));
+
+    // Children get the specs from memory whether or not writing the file works out
+    publish_spec_section(data);
+
+    auto tempPath = g_specCachePath + L"." + std::to_wstring(::GetCurrentProcessId()) + L".psftmp";
+    {
+        psf::unique_handle file(impl::CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file)
+        {
+            return;
+        }
+
+        DWORD bytesWritten;
+        if (!impl::WriteFile(file.get(), data.data(), static_cast<DWORD>(data.size()), &bytesWritten, nullptr) ||
+            (bytesWritten != data.size()))
+        {
+            file.reset();
+            impl::DeleteFile(tempPath.c_str());
+            return;
+        }
+    }
+
+    if (!impl::MoveFileEx(tempPath.c_str(), g_specCachePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        // Most likely another process is reading the file right now. It'll get replaced by a later process
+        impl::DeleteFile(tempPath.c_str());
+    }
+}
+catch (...)
+{
+    // The cache is only an optimization
+}
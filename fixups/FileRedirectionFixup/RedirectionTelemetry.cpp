@@ -0,0 +1,470 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Per-API counters for how much work the fixup does and how long it takes. For each API we count the number of calls,
+// how many paths ShouldRedirect redirected, how many copy-on-read copies were made and how many bytes they copied, and
+// keep two latency histograms: one for ShouldRedirect (which includes any copy-on-read) and one for the remainder of
+// the call, which is almost entirely the forwarded call to the real API. Histogram buckets are powers of two: bucket 0
+// counts calls that took no measurable time, and bucket N > 0 counts calls that took [2^(N-1), 2^N) nanoseconds.
+//
+// These are always on, so they need to stay cheap. Each thread counts into its own block of counters, which only that
+// thread ever writes, so updating a counter is a plain (relaxed) load and store. Reading the counters takes a lock and
+// merges the blocks of every live thread with the totals of threads that have already exited. The counters can be read
+// through the PSFQueryRedirectionTelemetry export, get published as live counters when config.json asks for them (see
+// PSFRegisterLiveCounters), and optionally get written to a file when the fixup is uninitialized
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_redirectRootPath;
+
+constexpr std::size_t api_count = static_cast<std::size_t>(telemetry_api::count);
+constexpr std::size_t latency_bucket_count = 32;
+
+// Indexed by telemetry_api
+constexpr const char* telemetry_api_names[] =
+{
+    "CloseHandle",
+    "CopyFile",
+    "CopyFileEx",
+    "CopyFile2",
+    "CreateDirectory",
+    "CreateDirectoryEx",
+    "CreateFile",
+    "CreateFile2",
+    "CreateFileMapping",
+    "CreateHardLink",
+    "CreateSymbolicLink",
+    "DeleteFile",
+    "DuplicateHandle",
+    "FindClose",
+    "FindFirstFile",
+    "FindFirstFileEx",
+    "FindNextFile",
+    "GetFileAttributes",
+    "GetFileAttributesEx",
+    "GetPrivateProfileSection",
+    "GetPrivateProfileString",
+    "MoveFile",
+    "MoveFileEx",
+    "NtCreateFile",
+    "NtOpenFile",
+    "NtQueryAttributesFile",
+    "NtQueryFullAttributesFile",
+    "NtSetInformationFile",
+    "ReadFile",
+    "ReadFileEx",
+    "RemoveDirectory",
+    "ReplaceFile",
+    "SetEndOfFile",
+    "SetFileAttributes",
+    "SetFileInformationByHandle",
+    "WriteFile",
+    "WriteFileEx",
+    "WritePrivateProfileString",
+};
+static_assert(std::size(telemetry_api_names) == api_count);
+
+template <typename T>
+struct api_counters
+{
+    T calls{};
+    T redirected{};
+    T copies{};
+    T bytes_copied{};
+    std::array<T, latency_bucket_count> should_redirect_latency{};
+    std::array<T, latency_bucket_count> forwarded_latency{};
+};
+
+using api_totals = std::array<api_counters<std::uint64_t>, api_count>;
+
+struct thread_telemetry
+{
+    std::array<api_counters<std::atomic<std::uint64_t>>, api_count> apis;
+    thread_telemetry* previous = nullptr;
+    thread_telemetry* next = nullptr;
+};
+
+std::mutex g_telemetryMutex;
+thread_telemetry* g_telemetryThreads = nullptr;
+api_totals g_exitedThreadTelemetry;
+
+std::wstring g_telemetryDumpPath;
+
+// Frees the thread's counters when the thread exits, after adding them to the totals for exited threads
+struct thread_telemetry_registration
+{
+    thread_telemetry* telemetry = nullptr;
+
+    ~thread_telemetry_registration();
+};
+
+thread_local thread_telemetry_registration g_threadTelemetry;
+thread_local telemetry_scope* g_currentTelemetryScope = nullptr;
+
+static void increment(std::atomic<std::uint64_t>& counter, std::uint64_t value = 1) noexcept
+{
+    // Only the owning thread ever writes to its counters, so this doesn't need to be an interlocked operation
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+template <typename T>
+static void add_counters(api_counters<std::uint64_t>& totals, const api_counters<T>& counters) noexcept
+{
+    auto load = [](const auto& value) -> std::uint64_t
+    {
+        if constexpr (std::is_same_v<T, std::uint64_t>)
+        {
+            return value;
+        }
+        else
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    totals.calls += load(counters.calls);
+    totals.redirected += load(counters.redirected);
+    totals.copies += load(counters.copies);
+    totals.bytes_copied += load(counters.bytes_copied);
+    for (std::size_t i = 0; i < latency_bucket_count; ++i)
+    {
+        totals.should_redirect_latency[i] += load(counters.should_redirect_latency[i]);
+        totals.forwarded_latency[i] += load(counters.forwarded_latency[i]);
+    }
+}
+
+thread_telemetry_registration::~thread_telemetry_registration()
+{
+    if (!telemetry)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard lock(g_telemetryMutex);
+        for (std::size_t i = 0; i < api_count; ++i)
+        {
+            add_counters(g_exitedThreadTelemetry[i], telemetry->apis[i]);
+        }
+
+        (telemetry->previous ? telemetry->previous->next : g_telemetryThreads) = telemetry->next;
+        if (telemetry->next)
+        {
+            telemetry->next->previous = telemetry->previous;
+        }
+    }
+
+    delete telemetry;
+}
+
+static thread_telemetry* current_thread_telemetry() noexcept
+{
+    auto& registration = g_threadTelemetry;
+    if (!registration.telemetry)
+    {
+        auto telemetry = new (std::nothrow) thread_telemetry;
+        if (!telemetry)
+        {
+            // We'll try again on the next call
+            return nullptr;
+        }
+
+        std::lock_guard lock(g_telemetryMutex);
+        telemetry->next = g_telemetryThreads;
+        if (g_telemetryThreads)
+        {
+            g_telemetryThreads->previous = telemetry;
+        }
+        g_telemetryThreads = telemetry;
+        registration.telemetry = telemetry;
+    }
+
+    return registration.telemetry;
+}
+
+static api_totals telemetry_totals() noexcept
+{
+    std::lock_guard lock(g_telemetryMutex);
+    api_totals result = g_exitedThreadTelemetry;
+    for (auto telemetry = g_telemetryThreads; telemetry; telemetry = telemetry->next)
+    {
+        for (std::size_t i = 0; i < api_count; ++i)
+        {
+            add_counters(result[i], telemetry->apis[i]);
+        }
+    }
+
+    return result;
+}
+
+std::int64_t TelemetryTimestamp() noexcept
+{
+    LARGE_INTEGER value;
+    ::QueryPerformanceCounter(&value);
+    return value.QuadPart;
+}
+
+static std::size_t latency_bucket(std::int64_t ticks) noexcept
+{
+    static const auto ticksPerSecond = []
+    {
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency(&frequency);
+        return static_cast<std::uint64_t>(frequency.QuadPart);
+    }();
+
+    if (ticks <= 0)
+    {
+        return 0;
+    }
+
+    // Split the conversion so that it can't overflow
+    auto value = static_cast<std::uint64_t>(ticks);
+    auto nanoseconds = (value / ticksPerSecond) * 1'000'000'000 + (value % ticksPerSecond) * 1'000'000'000 / ticksPerSecond;
+
+    std::size_t bucket = 0;
+    for (; nanoseconds && (bucket < latency_bucket_count - 1); nanoseconds >>= 1)
+    {
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+telemetry_scope* CurrentTelemetryScope() noexcept
+{
+    return g_currentTelemetryScope;
+}
+
+telemetry_scope::telemetry_scope(telemetry_api api) noexcept :
+    m_api(api)
+{
+    if (g_currentTelemetryScope)
+    {
+        // Part of an outer call, which is what gets counted
+        return;
+    }
+
+    m_telemetry = current_thread_telemetry();
+    if (m_telemetry)
+    {
+        g_currentTelemetryScope = this;
+        m_start = TelemetryTimestamp();
+    }
+}
+
+telemetry_scope::~telemetry_scope()
+{
+    if (!m_telemetry)
+    {
+        return;
+    }
+
+    auto elapsed = TelemetryTimestamp() - m_start - m_shouldRedirectTicks;
+    auto& counters = m_telemetry->apis[static_cast<std::size_t>(m_api)];
+    increment(counters.calls);
+    increment(counters.forwarded_latency[latency_bucket(elapsed)]);
+    g_currentTelemetryScope = nullptr;
+}
+
+void telemetry_scope::should_redirect_completed(std::int64_t ticks, bool redirected) noexcept
+{
+    auto& counters = m_telemetry->apis[static_cast<std::size_t>(m_api)];
+    m_shouldRedirectTicks += ticks;
+    increment(counters.should_redirect_latency[latency_bucket(ticks)]);
+    if (redirected)
+    {
+        increment(counters.redirected);
+    }
+}
+
+void telemetry_scope::file_copied(std::uint64_t bytes) noexcept
+{
+    auto& counters = m_telemetry->apis[static_cast<std::size_t>(m_api)];
+    increment(counters.copies);
+    increment(counters.bytes_copied, bytes);
+}
+
+std::vector<telemetry_api> CalledTelemetryApis()
+{
+    auto totals = telemetry_totals();
+
+    std::vector<telemetry_api> result;
+    for (std::size_t i = 0; i < api_count; ++i)
+    {
+        if (totals[i].calls != 0)
+        {
+            result.push_back(static_cast<telemetry_api>(i));
+        }
+    }
+
+    return result;
+}
+
+// Only APIs that were called at least once are included, e.g.:
+//      {"processId":1234,"apis":[{"name":"CreateFile","calls":10,"redirected":4,"copies":1,"bytesCopied":4096,
+//          "shouldRedirectLatency":[0,0,...],"forwardedLatency":[0,0,...]}]}
+std::string RedirectionTelemetryJson()
+{
+    auto totals = telemetry_totals();
+
+    std::string result = "{\"processId\":";
+    result += std::to_string(::GetCurrentProcessId());
+    result += ",\"apis\":[";
+
+    auto appendHistogram = [&](const char* name, const std::array<std::uint64_t, latency_bucket_count>& histogram)
+    {
+        result += ",\"";
+        result += name;
+        result += "\":[";
+        for (std::size_t i = 0; i < latency_bucket_count; ++i)
+        {
+            if (i != 0)
+            {
+                result += ',';
+            }
+            result += std::to_string(histogram[i]);
+        }
+        result += ']';
+    };
+
+    bool first = true;
+    for (std::size_t i = 0; i < api_count; ++i)
+    {
+        auto& counters = totals[i];
+        if (counters.calls == 0)
+        {
+            continue;
+        }
+
+        if (!first)
+        {
+            result += ',';
+        }
+        first = false;
+
+        result += "{\"name\":\"";
+        result += telemetry_api_names[i];
+        result += "\",\"calls\":";
+        result += std::to_string(counters.calls);
+        result += ",\"redirected\":";
+        result += std::to_string(counters.redirected);
+        result += ",\"copies\":";
+        result += std::to_string(counters.copies);
+        result += ",\"bytesCopied\":";
+        result += std::to_string(counters.bytes_copied);
+        appendHistogram("shouldRedirectLatency", counters.should_redirect_latency);
+        appendHistogram("forwardedLatency", counters.forwarded_latency);
+        result += '}';
+    }
+
+    result += "]}";
+    return result;
+}
+
+// Live counter values are 'redirected', 'copies' and 'bytes_copied', in that order. ShouldRedirect's histogram is the
+// fixup's latency, and the forwarded one is the call's
+static std::size_t __stdcall RedirectionLiveCounters(void*, psf_live_counter_entry* entries, std::size_t capacity) noexcept
+{
+    auto totals = telemetry_totals();
+
+    std::size_t count = 0;
+    for (std::size_t i = 0; (i < api_count) && (count < capacity); ++i)
+    {
+        auto& counters = totals[i];
+        if (counters.calls == 0)
+        {
+            continue;
+        }
+
+        auto& entry = entries[count++];
+        std::string_view name = telemetry_api_names[i];
+        name.copy(entry.api, sizeof(entry.api) - 1);
+        entry.calls = counters.calls;
+        entry.values[0] = counters.redirected;
+        entry.values[1] = counters.copies;
+        entry.values[2] = counters.bytes_copied;
+        static_assert(latency_bucket_count == psf_live_counter_buckets);
+        std::copy(counters.should_redirect_latency.begin(), counters.should_redirect_latency.end(), entry.fixup_latency);
+        std::copy(counters.forwarded_latency.begin(), counters.forwarded_latency.end(), entry.call_latency);
+    }
+
+    return count;
+}
+
+void InitializeRedirectionTelemetry(const psf::json_object* config)
+{
+    // Does nothing unless config.json enables live counters
+    check_win32(::PSFRegisterLiveCounters(RedirectionLiveCounters, nullptr));
+
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto dumpPathValue = config->try_get("dumpPath"))
+    {
+        std::filesystem::path dumpPath(dumpPathValue->as_string().wstring());
+        if (dumpPath.is_relative())
+        {
+            dumpPath = g_redirectRootPath / dumpPath;
+        }
+
+        // Child processes usually share the configuration, so let them write to separate files
+        auto path = dumpPath.wstring();
+        constexpr std::wstring_view processIdToken = L"{processId}";
+        if (auto pos = path.find(processIdToken); pos != std::wstring::npos)
+        {
+            path.replace(pos, processIdToken.length(), std::to_wstring(::GetCurrentProcessId()));
+        }
+
+        g_telemetryDumpPath = std::move(path);
+    }
+}
+
+// Only when the fixup is uninitialized; when the process is terminating, the PsfRuntime's timer may have been stopped in
+// the middle of a call, and nothing reads the counters after that anyway
+void UninitializeRedirectionLiveCounters() noexcept
+{
+    ::PSFUnregisterLiveCounters(RedirectionLiveCounters, nullptr);
+}
+
+void UninitializeRedirectionTelemetry() noexcept try
+{
+    if (g_telemetryDumpPath.empty())
+    {
+        return;
+    }
+
+    EnsureRedirectRootExists();
+    auto json = RedirectionTelemetryJson();
+    auto file = impl::CreateFile(g_telemetryDumpPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    DWORD bytesWritten;
+    impl::WriteFile(file, json.data(), static_cast<DWORD>(json.length()), &bytesWritten, nullptr);
+    impl::CloseHandle(file);
+}
+catch (...)
+{
+    // Telemetry is best effort
+}
@@ -0,0 +1,198 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Copy-on-read happens on whatever thread first opens a file for write, which for large files can mean stalling the
+// application's UI thread for the duration of the copy. For applications whose set of written files is known up front,
+// the "warmup" configuration lists package files to copy to the redirected location ahead of time. This is done on a
+// background thread (low CPU and I/O priority) that gets started during PSFInitialize. Files go through the same
+// ShouldRedirect path that the fixups use, so files that don't get redirected are left alone and any other thread that
+// needs a file that's in the middle of being copied will wait for that copy to complete.
+//
+// NOTE: If another thread ends up waiting on the warmup thread, the warmup thread leaves background mode until it
+//       finishes the copy so that we don't make the application wait on a low priority copy
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <known_folders.h>
+#include <pattern_matcher.h>
+#include <psf_framework.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+
+struct warmup_spec
+{
+    std::filesystem::path base_path;
+    std::vector<psf::pattern_matcher> patterns;
+};
+
+std::atomic<bool> g_warmupStopping = false;
+
+thread_local bool t_isWarmupThread = false;
+thread_local bool t_inBackgroundMode = false;
+
+static DWORD __stdcall WarmupCopyProgress(
+    LARGE_INTEGER,
+    LARGE_INTEGER,
+    LARGE_INTEGER,
+    LARGE_INTEGER,
+    DWORD,
+    DWORD,
+    HANDLE,
+    HANDLE,
+    LPVOID) noexcept
+{
+    if (g_warmupStopping)
+    {
+        // CopyFileEx will delete the partially copied file
+        return PROGRESS_CANCEL;
+    }
+
+    if (t_inBackgroundMode && (CopyOnReadWaiters() > 0))
+    {
+        ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+        t_inBackgroundMode = false;
+    }
+
+    return PROGRESS_CONTINUE;
+}
+
+LPPROGRESS_ROUTINE WarmupCopyProgressRoutine() noexcept
+{
+    return t_isWarmupThread ? &WarmupCopyProgress : nullptr;
+}
+
+static void warmup_directory(const warmup_spec& spec)
+{
+    // Paths relative to the base path, which is what the patterns get matched against
+    std::vector<std::wstring> pending;
+    pending.emplace_back();
+    while (!pending.empty() && !g_warmupStopping)
+    {
+        auto relativeDir = std::move(pending.back());
+        pending.pop_back();
+
+        auto dir = relativeDir.empty() ? spec.base_path : (spec.base_path / relativeDir);
+        WIN32_FIND_DATAW findData;
+        auto findHandle = impl::FindFirstFileEx(
+            (dir / L"*").c_str(),
+            FindExInfoBasic,
+            &findData,
+            FindExSearchNameMatch,
+            nullptr,
+            FIND_FIRST_EX_LARGE_FETCH);
+        if (findHandle == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+
+        do
+        {
+            std::wstring_view name = findData.cFileName;
+            if ((name == L".") || (name == L".."))
+            {
+                continue;
+            }
+
+            auto relativePath = relativeDir.empty() ? std::wstring(name) : (relativeDir + L'\\' + findData.cFileName);
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                {
+                    pending.push_back(std::move(relativePath));
+                }
+                continue;
+            }
+
+            for (auto& pattern : spec.patterns)
+            {
+                if (pattern.match(relativePath))
+                {
+                    // Go through the same path that CreateFile would. The copy happens as a side effect
+                    ShouldRedirect((spec.base_path / relativePath).c_str(), redirect_flags::copy_on_read);
+
+                    // Restore background mode if some other thread had us leave it
+                    if (!t_inBackgroundMode)
+                    {
+                        t_inBackgroundMode = ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != FALSE;
+                    }
+                    break;
+                }
+            }
+        } while (!g_warmupStopping && impl::FindNextFile(findHandle, &findData));
+
+        impl::FindClose(findHandle);
+    }
+}
+
+static DWORD __stdcall WarmupThreadProc(void* data) noexcept try
+{
+    std::unique_ptr<std::vector<warmup_spec>> specs(static_cast<std::vector<warmup_spec>*>(data));
+
+    t_isWarmupThread = true;
+    t_inBackgroundMode = ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != FALSE;
+
+    // We're calling directly into the same code that our fixups use, so make sure that nothing we do gets redirected
+    // a second time
+    auto guard = g_reentrancyGuard.enter();
+    for (auto& spec : *specs)
+    {
+        if (g_warmupStopping)
+        {
+            break;
+        }
+
+        warmup_directory(spec);
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    // Warmup is only an optimization; anything it didn't get to will be copied on first use like normal
+    return win32_from_caught_exception();
+}
+
+void InitializeRedirectionWarmup(const psf::json_array* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    auto specs = std::make_unique<std::vector<warmup_spec>>();
+    for (auto& spec : *config)
+    {
+        auto& specObject = spec.as_object();
+        auto& warmupSpec = specs->emplace_back();
+        warmupSpec.base_path = psf::remove_trailing_path_separators(g_packageRootPath / specObject.get("base").as_string().wstring());
+        for (auto& pattern : specObject.get("patterns").as_array())
+        {
+            warmupSpec.patterns.emplace_back(pattern.as_string().wstring());
+        }
+    }
+
+    if (specs->empty())
+    {
+        return;
+    }
+
+    // NOTE: We never wait for this thread to exit. PSFUninitialize signals it to stop, but waiting on it from within
+    //       DllMain would deadlock on the loader lock
+    if (auto thread = ::CreateThread(nullptr, 0, WarmupThreadProc, specs.get(), 0, nullptr))
+    {
+        specs.release();
+        ::CloseHandle(thread);
+    }
+}
+
+void UninitializeRedirectionWarmup() noexcept
+{
+    g_warmupStopping = true;
+}
@@ -0,0 +1,130 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Applications that work relative to their current directory tend to pass the same handful of relative paths over and
+// over (e.g. "settings.ini" or "data\cache.bin"), and normalizing each of them means querying the current directory and
+// canonicalizing the result all over again. With the "relativePathCache" option, each thread remembers the last few
+// relative and rooted paths that it normalized, along with the current directory generation that the PsfRuntime keeps
+// (see PSFQueryCurrentDirectoryGeneration), so that the same path is only normalized again once the current directory
+// changes. The cache is per-thread so that looking it up doesn't need a lock, and it only gets allocated on the threads
+// that normalize relative paths to begin with.
+//
+// NOTE: Drive-relative paths (e.g. "C:foo") aren't cached, since they depend on the per-drive current directories,
+//       which live in environment variables (e.g. "=C:") that can change without SetCurrentDirectory getting called
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include <dos_paths.h>
+#include <psf_framework.h>
+
+#include "PathRedirection.h"
+
+// Longer inputs are rare enough in practice that it isn't worth making every entry larger for them
+constexpr std::size_t max_cached_relative_path_length = 128;
+constexpr std::size_t relative_path_cache_size = 8;
+static_assert((relative_path_cache_size & (relative_path_cache_size - 1)) == 0, "relative_path_cache_size must be a power of two");
+
+const std::atomic<std::uint32_t>* g_currentDirectoryGeneration = nullptr;
+
+struct relative_path_cache_entry
+{
+    // Zero (which the PsfRuntime never hands out) for an entry that's empty
+    std::uint32_t generation = 0;
+    std::uint32_t length = 0;
+    wchar_t path[max_cached_relative_path_length];
+    normalized_path result;
+};
+
+struct relative_path_cache : psf::heap_object
+{
+    relative_path_cache_entry entries[relative_path_cache_size];
+};
+
+thread_local std::unique_ptr<relative_path_cache> t_relativePathCache;
+
+void InitializeRelativePathCache(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    g_currentDirectoryGeneration = ::PSFQueryCurrentDirectoryGeneration();
+}
+
+std::uint32_t RelativePathCacheGeneration() noexcept
+{
+    return g_currentDirectoryGeneration ? g_currentDirectoryGeneration->load(std::memory_order_acquire) : 0;
+}
+
+static relative_path_cache_entry* find_entry(const wchar_t* path, std::size_t length, bool create) noexcept try
+{
+    if (length > max_cached_relative_path_length)
+    {
+        return nullptr;
+    }
+
+    auto& cache = t_relativePathCache;
+    if (!cache)
+    {
+        if (!create)
+        {
+            return nullptr;
+        }
+        cache = std::make_unique<relative_path_cache>();
+    }
+
+    auto hash = psf::path_hash(std::wstring_view(path, length));
+    return &cache->entries[static_cast<std::size_t>(hash ^ (hash >> 32)) & (relative_path_cache_size - 1)];
+}
+catch (...)
+{
+    return nullptr;
+}
+
+bool FindCachedRelativePath(const wchar_t* path, std::size_t length, std::uint32_t generation, normalized_path& result) noexcept try
+{
+    auto entry = find_entry(path, length, false);
+    if (!entry || (entry->generation != generation) || (entry->length != length) ||
+        (std::wmemcmp(entry->path, path, length) != 0))
+    {
+        return false;
+    }
+
+    result = entry->result;
+    return true;
+}
+catch (...)
+{
+    return false;
+}
+
+void CacheRelativePath(const wchar_t* path, std::size_t length, std::uint32_t generation, const normalized_path& result) noexcept try
+{
+    auto entry = find_entry(path, length, true);
+    if (!entry)
+    {
+        return;
+    }
+
+    // NOTE: Invalidated first, so that the entry never pairs the new path with the old result if copying it fails
+    entry->generation = 0;
+    entry->result = result;
+    entry->length = static_cast<std::uint32_t>(length);
+    std::wmemcpy(entry->path, path, length);
+    entry->generation = generation;
+}
+catch (...)
+{
+}
@@ -9,16 +9,19 @@
 template <typename CharT>
 BOOL __stdcall RemoveDirectoryFixup(_In_ const CharT* pathName) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::remove_directory);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
+            auto widePathName = widen_argument(pathName);
+
             // NOTE: See commentary in DeleteFileFixup for limitations on deleting files/directories
-            auto [shouldRedirect, redirectPath] = ShouldRedirect(pathName, redirect_flags::none);
+            auto [shouldRedirect, redirectPath] = ShouldRedirect(widePathName.c_str(), redirect_flags::none);
             if (shouldRedirect)
             {
-                if (!impl::PathExists(redirectPath.c_str()) && impl::PathExists(pathName))
+                if (!RedirectedPathExists(redirectPath.c_str()) && impl::PathExists(pathName))
                 {
                     // If the directory does not exist in the redirected location, but does in the non-redirected
                     // location, then we want to give the "illusion" that the delete succeeded
@@ -26,7 +29,13 @@ BOOL __stdcall RemoveDirectoryFixup(_In_ const CharT* pathName) noexcept
                 }
                 else
                 {
-                    return impl::RemoveDirectory(redirectPath.c_str());
+                    auto result = impl::RemoveDirectory(redirectPath.c_str());
+                    if (result)
+                    {
+                        RedirectedPathDeleted(redirectPath.c_str());
+                    }
+                    InvalidateRedirectCache();
+                    return result;
                 }
             }
         }
@@ -6,6 +6,73 @@
 #include "FunctionImplementations.h"
 #include "PathRedirection.h"
 
+// Same as for MoveFile, a replaced package file needs to stay gone from its old location
+static void TombstoneReplacementPackageFile(const wchar_t* replacementFileName, const std::filesystem::path& sourceRedirectPath) noexcept
+{
+    auto lastError = ::GetLastError();
+    if (PackagePathExists(replacementFileName))
+    {
+        AddPackageFileTombstone(sourceRedirectPath.c_str());
+    }
+    ::SetLastError(lastError);
+}
+
+// Save-by-rename (writing to a temporary file and then replacing the original with it) would otherwise copy-on-read the
+// package file being replaced only for all of its contents to immediately get thrown away. With no backup to produce,
+// renaming the replacement into place and carrying over what ReplaceFile preserves from the replaced file - its
+// attributes and creation time - gives the same result. Like ReplaceFile with REPLACEFILE_IGNORE_MERGE_ERRORS, failing
+// to carry those over doesn't fail the call. Returns false if the replace should go the usual way
+static bool TryReplacePackageFile(
+    const wchar_t* replacedFileName,
+    const std::filesystem::path& targetRedirectPath,
+    const wchar_t* replacementPath,
+    BOOL& result)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (UnredirectedPackageFile(replacedFileName, targetRedirectPath.c_str(), data).empty() ||
+        (data.dwFileAttributes & FILE_ATTRIBUTE_READONLY))
+    {
+        // ReplaceFile refuses to replace read-only files, so leave reporting that to it
+        return false;
+    }
+
+    result = impl::MoveFileEx(replacementPath, targetRedirectPath.c_str(), MOVEFILE_COPY_ALLOWED);
+    if (!result)
+    {
+        // What ReplaceFile reports when the replaced file is left untouched
+        auto err = ::GetLastError();
+        if ((err != ERROR_FILE_NOT_FOUND) && (err != ERROR_PATH_NOT_FOUND))
+        {
+            ::SetLastError(ERROR_UNABLE_TO_MOVE_REPLACEMENT);
+        }
+        return true;
+    }
+
+    auto file = impl::CreateFile(
+        targetRedirectPath.c_str(),
+        FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        ::SetFileTime(file, &data.ftCreationTime, nullptr, nullptr);
+        ::CloseHandle(file);
+    }
+
+    constexpr DWORD preservedAttributes =
+        FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+    if (auto attributes = data.dwFileAttributes & preservedAttributes)
+    {
+        impl::SetFileAttributes(targetRedirectPath.c_str(), attributes);
+    }
+
+    ::SetLastError(ERROR_SUCCESS);
+    return true;
+}
+
 template <typename CharT>
 BOOL __stdcall ReplaceFileFixup(
     _In_ const CharT* replacedFileName,
@@ -15,28 +82,84 @@ BOOL __stdcall ReplaceFileFixup(
     _Reserved_ LPVOID exclude,
     _Reserved_ LPVOID reserved) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::replace_file);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
+            auto wideReplacedFileName = widen_argument(replacedFileName);
+            auto wideReplacementFileName = widen_argument(replacementFileName);
+            auto wideBackupFileName = widen_argument(backupFileName);
+
             // NOTE: ReplaceFile will delete the "replacement file" (the file we're copying from), so therefore we need
             //       delete access to it, thus we copy-on-read it here. I.e. we're copying the file only for it to
             //       immediately get deleted. We could improve this in the future if we wanted, but that would
             //       effectively require that we re-write ReplaceFile, which we opt not to do right now. Also note that
-            //       this implies that we have the same file deletion limitation that we have for DeleteFile, etc.
-            auto [redirectTarget, targetRedirectPath] = ShouldRedirect(replacedFileName, redirect_flags::copy_on_read);
-            auto [redirectSource, sourceRedirectPath] = ShouldRedirect(replacementFileName, redirect_flags::copy_on_read);
-            auto [redirectBackup, backupRedirectPath] = ShouldRedirect(backupFileName, redirect_flags::ensure_directory_structure);
+            //       this implies that we have the same file deletion limitation that we have for DeleteFile, etc. The
+            //       replaced file only gets copied-on-read if it can't be replaced by a rename (see
+            //       TryReplacePackageFile)
+            auto [redirectTarget, targetRedirectPath] = ShouldRedirect(wideReplacedFileName.c_str(), redirect_flags::ensure_directory_structure);
+            auto [redirectSource, sourceRedirectPath] = ShouldRedirect(wideReplacementFileName.c_str(), redirect_flags::copy_on_read);
+            auto [redirectBackup, backupRedirectPath] = ShouldRedirect(wideBackupFileName.c_str(), redirect_flags::ensure_directory_structure);
+            if (redirectTarget && !backupFileName)
+            {
+                BOOL result;
+                if (TryReplacePackageFile(
+                    wideReplacedFileName.c_str(),
+                    targetRedirectPath,
+                    redirectSource ? sourceRedirectPath.c_str() : wideReplacementFileName.c_str(),
+                    result))
+                {
+                    if (result)
+                    {
+                        RedirectedPathCreated(targetRedirectPath.c_str());
+                        if (redirectSource)
+                        {
+                            RedirectedPathDeleted(sourceRedirectPath.c_str());
+                            TombstoneReplacementPackageFile(wideReplacementFileName.c_str(), sourceRedirectPath);
+                        }
+                    }
+                    InvalidateRedirectCache();
+                    return result;
+                }
+            }
+
             if (redirectTarget || redirectSource || redirectBackup)
             {
-                return impl::ReplaceFile(
-                    redirectTarget ? targetRedirectPath.c_str() : widen_argument(replacedFileName).c_str(),
-                    redirectSource ? sourceRedirectPath.c_str() : widen_argument(replacementFileName).c_str(),
-                    redirectBackup ? backupRedirectPath.c_str() : widen_argument(backupFileName).c_str(),
+                if (redirectTarget)
+                {
+                    ShouldRedirect(wideReplacedFileName.c_str(), redirect_flags::copy_on_read);
+                }
+
+                auto result = impl::ReplaceFile(
+                    redirectTarget ? targetRedirectPath.c_str() : wideReplacedFileName.c_str(),
+                    redirectSource ? sourceRedirectPath.c_str() : wideReplacementFileName.c_str(),
+                    redirectBackup ? backupRedirectPath.c_str() : wideBackupFileName.c_str(),
                     replaceFlags,
                     exclude,
                     reserved);
+
+                // NOTE: ReplaceFile can fail part way through, so rather than try and reason about what state each file
+                //       is in based off the error code, re-query the disk
+                if (redirectTarget)
+                {
+                    RedirectedPathChanged(targetRedirectPath.c_str());
+                }
+                if (redirectSource)
+                {
+                    RedirectedPathChanged(sourceRedirectPath.c_str());
+                    if (result)
+                    {
+                        TombstoneReplacementPackageFile(wideReplacementFileName.c_str(), sourceRedirectPath);
+                    }
+                }
+                if (redirectBackup)
+                {
+                    RedirectedPathChanged(backupRedirectPath.c_str());
+                }
+                InvalidateRedirectCache();
+                return result;
             }
         }
     }
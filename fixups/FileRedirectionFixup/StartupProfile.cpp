@@ -0,0 +1,298 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Records the application's startup profile (see startup_profile.h) when the PsfLauncher asks for it. For the first few
+// seconds after the fixup loads, the package files that get opened through CreateFile/CreateFile2 are remembered by
+// handle, and the ranges that ReadFile reads from them get appended to the profile in the order that they're read,
+// with adjacent reads of the same file merged together. Once the time is up (or the fixup gets uninitialized, if that
+// comes first) the package images that are loaded by then get put in front of the reads, and the profile gets written.
+//
+// NOTE: Reads that don't go through ReadFile (e.g. mapped files, or NtReadFile) aren't seen. Package images are the
+//       mapped files that matter the most for startup, which is why they're picked up from the loaded module list
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cwchar>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <psapi.h>
+
+#include <psf_framework.h>
+#include <psf_utils.h>
+#include <startup_profile.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+
+// Enough for the startup of large applications, while keeping the profile (and what the launcher reads) bounded
+constexpr std::size_t max_startup_profile_entries = 4096;
+
+// How far back to look for a read of the same file that a new read continues on from
+constexpr std::size_t startup_profile_merge_distance = 8;
+
+struct startup_profile_read
+{
+    std::size_t path_index;
+    std::uint64_t offset;
+    std::uint64_t length;
+};
+
+static std::atomic<bool> g_startupProfileRecording = false;
+static std::atomic<bool> g_startupProfileWritten = false;
+static std::filesystem::path g_startupProfilePath;
+static PTP_TIMER g_startupProfileTimer = nullptr;
+
+static std::mutex g_startupProfileMutex;
+static std::vector<std::wstring> g_startupProfilePaths;
+static std::unordered_map<HANDLE, std::size_t> g_startupProfileHandles;
+static std::vector<startup_profile_read> g_startupProfileReads;
+
+// The package relative path of 'path', or empty if it isn't a package file
+template <typename CharT>
+static std::wstring package_relative_path(const CharT* path)
+{
+    auto normalizedPath = NormalizePath(path);
+    auto& root = g_packageRootPath.native();
+    if (!normalizedPath.drive_absolute_path ||
+        !::PSFIsPackagePath(normalizedPath.full_path.c_str(), normalizedPath.full_path.length()) ||
+        (normalizedPath.drive_absolute_path[root.length()] != L'\\'))
+    {
+        return {};
+    }
+
+    return normalizedPath.drive_absolute_path + root.length() + 1;
+}
+
+static std::vector<psf::startup_profile_entry> startup_profile_images()
+{
+    std::vector<psf::startup_profile_entry> result;
+
+    std::vector<HMODULE> modules(256);
+    DWORD bytesNeeded;
+    while (::EnumProcessModules(::GetCurrentProcess(), modules.data(), static_cast<DWORD>(modules.size() * sizeof(HMODULE)), &bytesNeeded))
+    {
+        if (bytesNeeded <= modules.size() * sizeof(HMODULE))
+        {
+            modules.resize(bytesNeeded / sizeof(HMODULE));
+            break;
+        }
+        modules.resize(bytesNeeded / sizeof(HMODULE));
+    }
+
+    for (auto module : modules)
+    {
+        if (auto relativePath = package_relative_path(psf::get_module_path(module).c_str()); !relativePath.empty())
+        {
+            psf::startup_profile_entry entry;
+            entry.image = true;
+            entry.path = std::move(relativePath);
+            result.push_back(std::move(entry));
+        }
+    }
+
+    return result;
+}
+
+// Stops recording and writes out what has been recorded so far; only the first call does anything
+static void finish_startup_profile() noexcept try
+{
+    g_startupProfileRecording = false;
+    if (g_startupProfileWritten.exchange(true))
+    {
+        return;
+    }
+
+    auto entries = startup_profile_images();
+    {
+        std::lock_guard lock(g_startupProfileMutex);
+        for (auto& read : g_startupProfileReads)
+        {
+            psf::startup_profile_entry entry;
+            entry.offset = read.offset;
+            entry.length = read.length;
+            entry.path = g_startupProfilePaths[read.path_index];
+            entries.push_back(std::move(entry));
+        }
+
+        g_startupProfileHandles.clear();
+    }
+
+    auto contents = psf::format_startup_profile(entries);
+    impl::CreateDirectory(g_startupProfilePath.parent_path().c_str(), nullptr);
+    auto file = impl::CreateFile(g_startupProfilePath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    DWORD bytesWritten;
+    impl::WriteFile(file, contents.data(), static_cast<DWORD>(contents.length()), &bytesWritten, nullptr);
+    impl::CloseHandle(file);
+}
+catch (...)
+{
+    // The profile is only a hint; the next launch can record it again
+}
+
+static void __stdcall StartupProfileTimerCallback(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER) noexcept
+{
+    finish_startup_profile();
+}
+
+bool StartupProfileRecording() noexcept
+{
+    return g_startupProfileRecording.load(std::memory_order_relaxed);
+}
+
+template <typename CharT>
+static void startup_profile_file_opened(HANDLE file, const CharT* path) noexcept try
+{
+    auto relativePath = package_relative_path(path);
+    if (relativePath.empty())
+    {
+        return;
+    }
+
+    std::lock_guard lock(g_startupProfileMutex);
+    auto itr = std::find(g_startupProfilePaths.begin(), g_startupProfilePaths.end(), relativePath);
+    auto index = static_cast<std::size_t>(itr - g_startupProfilePaths.begin());
+    if (itr == g_startupProfilePaths.end())
+    {
+        g_startupProfilePaths.push_back(std::move(relativePath));
+    }
+    g_startupProfileHandles[file] = index;
+}
+catch (...)
+{
+}
+
+void StartupProfileFileOpened(HANDLE file, const char* path) noexcept
+{
+    auto err = ::GetLastError();
+    startup_profile_file_opened(file, path);
+    ::SetLastError(err);
+}
+
+void StartupProfileFileOpened(HANDLE file, const wchar_t* path) noexcept
+{
+    auto err = ::GetLastError();
+    startup_profile_file_opened(file, path);
+    ::SetLastError(err);
+}
+
+void StartupProfileHandleClosed(HANDLE file) noexcept
+{
+    std::lock_guard lock(g_startupProfileMutex);
+    g_startupProfileHandles.erase(file);
+}
+
+void StartupProfileRead(HANDLE file, DWORD length, const OVERLAPPED* overlapped) noexcept try
+{
+    auto err = ::GetLastError();
+    std::size_t pathIndex;
+    {
+        std::lock_guard lock(g_startupProfileMutex);
+        auto itr = g_startupProfileHandles.find(file);
+        if (itr == g_startupProfileHandles.end())
+        {
+            return;
+        }
+        pathIndex = itr->second;
+    }
+
+    std::uint64_t offset;
+    if (overlapped)
+    {
+        offset = (static_cast<std::uint64_t>(overlapped->OffsetHigh) << 32) | overlapped->Offset;
+    }
+    else
+    {
+        LARGE_INTEGER position;
+        if (!::SetFilePointerEx(file, LARGE_INTEGER{}, &position, FILE_CURRENT))
+        {
+            ::SetLastError(err);
+            return;
+        }
+        offset = static_cast<std::uint64_t>(position.QuadPart);
+    }
+    ::SetLastError(err);
+
+    std::lock_guard lock(g_startupProfileMutex);
+    auto begin = g_startupProfileReads.rbegin();
+    auto end = (g_startupProfileReads.size() > startup_profile_merge_distance) ? (begin + startup_profile_merge_distance) : g_startupProfileReads.rend();
+    for (auto itr = begin; itr != end; ++itr)
+    {
+        if ((itr->path_index == pathIndex) && (offset >= itr->offset) && (offset <= itr->offset + itr->length))
+        {
+            itr->length = std::max(itr->length, offset + length - itr->offset);
+            return;
+        }
+    }
+
+    if (g_startupProfileReads.size() < max_startup_profile_entries)
+    {
+        g_startupProfileReads.push_back(startup_profile_read{ pathIndex, offset, length });
+    }
+}
+catch (...)
+{
+}
+
+void InitializeStartupProfile() noexcept try
+{
+    wchar_t value[16];
+    auto length = ::GetEnvironmentVariableW(psf::startup_profile_record_variable, value, static_cast<DWORD>(std::size(value)));
+    if ((length == 0) || (length >= std::size(value)))
+    {
+        return;
+    }
+
+    // Only the process that the launcher started records; its children have profiles of their own to record
+    ::SetEnvironmentVariableW(psf::startup_profile_record_variable, nullptr);
+    auto seconds = std::wcstoul(value, nullptr, 10);
+    if (seconds == 0)
+    {
+        return;
+    }
+
+    g_startupProfilePath = psf::startup_profile_path(psf::current_executable_path());
+
+    g_startupProfileTimer = ::CreateThreadpoolTimer(StartupProfileTimerCallback, nullptr, nullptr);
+    if (!g_startupProfileTimer)
+    {
+        return;
+    }
+
+    // Relative due times are negative, in 100ns units
+    ULARGE_INTEGER dueTime;
+    dueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(seconds) * 10'000'000);
+    FILETIME fileDueTime{ dueTime.LowPart, dueTime.HighPart };
+    g_startupProfileRecording = true;
+    ::SetThreadpoolTimer(g_startupProfileTimer, &fileDueTime, 0, 0);
+}
+catch (...)
+{
+    // Not recording only costs the next launch its prefetch
+}
+
+void UninitializeStartupProfile() noexcept
+{
+    if (!g_startupProfileTimer)
+    {
+        return;
+    }
+
+    // Like the private profile cache, we don't wait for the timer's callback since we may be called from within DllMain.
+    // If it's already running, it's the one that writes the profile
+    ::SetThreadpoolTimer(g_startupProfileTimer, nullptr, 0, 0);
+    finish_startup_profile();
+}
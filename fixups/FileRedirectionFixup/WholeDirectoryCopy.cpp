@@ -0,0 +1,179 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Applications that keep their settings in a directory of their own tend to open every file in it for write, one after
+// the other, and each of those opens separately copies its file, checking the directory structure and opening both the
+// source and the destination on the application's thread. With the "copyWholeDirectory" configuration, the first file
+// in a listed directory that gets copied on read takes the rest of the directory's files along with it. They're copied
+// several at a time on the PsfRuntime's worker threads (see PSFSubmitWork) while the thread that needed the first file
+// waits, so the opens after that only ever find the redirected file already there. Each file still goes through the same
+// ShouldRedirect path that the fixups use, so files that don't get redirected, have been deleted, or have already been
+// copied are left alone, and copies that some other thread or process is already in the middle of are waited for rather
+// than started twice.
+//
+// NOTE: Only the files directly in a listed directory are copied. Subdirectories need to be listed themselves
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <dos_paths.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "PathRedirection.h"
+
+extern std::filesystem::path g_packageRootPath;
+
+constexpr std::uint32_t default_whole_directory_copy_threads = 4;
+
+struct whole_directory_copy
+{
+    std::vector<std::wstring> files;
+    std::atomic<std::size_t> next = 0;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::uint32_t running = 0;
+};
+
+std::uint32_t g_wholeDirectoryCopyThreads = default_whole_directory_copy_threads;
+
+// De-virtualized paths of the listed directories. Each one gets erased once its copy starts, so that it only ever gets
+// copied once per process
+std::mutex g_wholeDirectoryMutex;
+std::unordered_set<iwstring, case_insensitive_hash<wchar_t>> g_wholeDirectories;
+
+void InitializeWholeDirectoryCopy(const psf::json_object* config)
+{
+    if (!config)
+    {
+        return;
+    }
+
+    if (auto enabledValue = config->try_get("enabled"); !enabledValue || !static_cast<bool>(enabledValue->as_boolean()))
+    {
+        return;
+    }
+
+    if (auto threadsValue = config->try_get("threads"))
+    {
+        g_wholeDirectoryCopyThreads = (std::max)(static_cast<std::uint32_t>(threadsValue->as_number().get_unsigned()), 1u);
+    }
+
+    for (auto& directory : config->get("directories").as_array())
+    {
+        auto path = psf::remove_trailing_path_separators(g_packageRootPath / directory.as_string().wstring());
+        auto normalizedPath = DeVirtualizePath(NormalizePath(path.c_str()));
+        if (normalizedPath.drive_absolute_path)
+        {
+            g_wholeDirectories.emplace(normalizedPath.drive_absolute_path);
+        }
+    }
+}
+
+static void copy_directory_files(whole_directory_copy& copy) noexcept
+{
+    // We're calling directly into the same code that our fixups use, so make sure that nothing we do gets redirected a
+    // second time
+    auto guard = g_reentrancyGuard.enter();
+    for (auto i = copy.next++; i < copy.files.size(); i = copy.next++)
+    {
+        try
+        {
+            // The copy happens as a side effect
+            ShouldRedirect(copy.files[i].c_str(), redirect_flags::copy_on_read);
+        }
+        catch (...)
+        {
+            // Anything that doesn't get copied here gets copied on first use like normal
+        }
+    }
+}
+
+static void __stdcall WholeDirectoryCopyCallback(void* context) noexcept
+{
+    auto& copy = *static_cast<whole_directory_copy*>(context);
+    copy_directory_files(copy);
+
+    // NOTE: Notified with the lock held, since the waiting thread destroys 'copy' as soon as it sees the count drop
+    std::lock_guard lock(copy.mutex);
+    --copy.running;
+    copy.finished.notify_all();
+}
+
+void CopyWholeDirectory(std::wstring_view deVirtualizedPath) noexcept try
+{
+    auto pos = psf::find_last_path_separator(deVirtualizedPath);
+    if (pos == std::wstring_view::npos)
+    {
+        return;
+    }
+
+    std::wstring directory(deVirtualizedPath.substr(0, pos));
+    {
+        std::lock_guard lock(g_wholeDirectoryMutex);
+        if (g_wholeDirectories.empty() || (g_wholeDirectories.erase(iwstring(directory.data(), directory.length())) == 0))
+        {
+            return;
+        }
+    }
+
+    whole_directory_copy copy;
+    WIN32_FIND_DATAW findData;
+    auto findHandle = impl::FindFirstFileEx(
+        (directory + L"\\*").c_str(),
+        FindExInfoBasic,
+        &findData,
+        FindExSearchNameMatch,
+        nullptr,
+        FIND_FIRST_EX_LARGE_FETCH);
+    if (findHandle == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        if (!(findData.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)))
+        {
+            copy.files.push_back(directory + L'\\' + findData.cFileName);
+        }
+    } while (impl::FindNextFile(findHandle, &findData));
+    impl::FindClose(findHandle);
+    if (copy.files.empty())
+    {
+        return;
+    }
+
+    // The calling thread works through the files too, so a single file doesn't need any help. The work is high priority,
+    // since that thread waits for it
+    auto helpers = (std::min)(static_cast<std::size_t>(g_wholeDirectoryCopyThreads), copy.files.size()) - 1;
+    for (std::size_t i = 0; i < helpers; ++i)
+    {
+        std::lock_guard lock(copy.mutex);
+        if (::PSFSubmitWork(WholeDirectoryCopyCallback, &copy, psf_work_priority::high) != ERROR_SUCCESS)
+        {
+            break;
+        }
+        ++copy.running;
+    }
+
+    copy_directory_files(copy);
+
+    std::unique_lock lock(copy.mutex);
+    copy.finished.wait(lock, [&] { return copy.running == 0; });
+}
+catch (...)
+{
+    // Same as above, the files will get copied on first use like normal
+}
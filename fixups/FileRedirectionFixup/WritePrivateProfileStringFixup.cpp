@@ -13,16 +13,31 @@ BOOL __stdcall WritePrivateProfileStringFixup(
     _In_opt_ const CharT* string,
     _In_opt_ const CharT* fileName) noexcept
 {
+    telemetry_scope telemetry(telemetry_api::write_private_profile_string);
     auto guard = g_reentrancyGuard.enter();
     try
     {
         if (guard)
         {
-            auto[shouldRedirect, redirectPath] = ShouldRedirect(fileName, redirect_flags::copy_on_read);
+            auto wideFileName = widen_argument(fileName);
+            auto[shouldRedirect, redirectPath] = ShouldRedirect(wideFileName.c_str(), redirect_flags::copy_on_read | redirect_flags::private_profile);
             if (shouldRedirect)
             {
-                return impl::WritePrivateProfileStringW(widen_argument(appName).c_str(), widen_argument(keyName).c_str(),
-                    widen_argument(string).c_str(), redirectPath.c_str());
+                auto wideAppName = widen_argument(appName);
+                auto wideKeyName = widen_argument(keyName);
+                auto wideString = widen_argument(string);
+                if (TryDeferPrivateProfileWrite(redirectPath, wideAppName.c_str(), wideKeyName.c_str(), wideString.c_str()))
+                {
+                    return TRUE;
+                }
+
+                auto result = impl::WritePrivateProfileStringW(wideAppName.c_str(), wideKeyName.c_str(), wideString.c_str(), redirectPath.c_str());
+                InvalidatePrivateProfileCache(redirectPath);
+                if (result)
+                {
+                    RedirectedPathCreated(redirectPath.c_str());
+                }
+                return result;
             }
         }
     }
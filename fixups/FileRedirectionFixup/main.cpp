@@ -3,17 +3,33 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <string>
+
 #include <psf_framework.h>
 
 void InitializePaths();
 void InitializeConfiguration();
+bool ShouldAttachFixup(const void* target) noexcept;
+void UninitializeRedirectionWarmup() noexcept;
+void UninitializeRedirectedPathIndex() noexcept;
+void UninitializeDirectoryListingCache() noexcept;
+void UninitializePrivateProfileCache() noexcept;
+void UninitializeRedirectionLiveCounters() noexcept;
+void UninitializeRedirectionTelemetry() noexcept;
+void UninitializeHookSelection() noexcept;
+void UninitializeRedirectionHotReload() noexcept;
+void UninitializeCopyThrottle() noexcept;
+void UninitializeStartupProfile() noexcept;
+void SaveRedirectDecisionSnapshot() noexcept;
+std::string RedirectionTelemetryJson();
 
 extern "C" {
 
 int __stdcall PSFInitialize() noexcept try
 {
     InitializeConfiguration();
-    psf::attach_all();
+    psf::attach_all(ShouldAttachFixup);
     return ERROR_SUCCESS;
 }
 catch (...)
@@ -24,6 +40,56 @@ catch (...)
 int __stdcall PSFUninitialize() noexcept try
 {
     psf::detach_all();
+    UninitializeRedirectionHotReload();
+    UninitializeRedirectionWarmup();
+    UninitializeCopyThrottle();
+    UninitializeStartupProfile();
+    SaveRedirectDecisionSnapshot();
+    UninitializeRedirectedPathIndex();
+    UninitializeDirectoryListingCache();
+    UninitializePrivateProfileCache();
+    UninitializeHookSelection();
+    UninitializeRedirectionLiveCounters();
+    UninitializeRedirectionTelemetry();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+// The process is going away, so the detours can stay, and the background threads are already gone. That leaves what gets
+// written out on the way out
+void __stdcall PSFProcessTerminating() noexcept
+{
+    UninitializeStartupProfile();
+    SaveRedirectDecisionSnapshot();
+    UninitializePrivateProfileCache();
+    UninitializeHookSelection();
+    UninitializeRedirectionTelemetry();
+}
+
+// Gives back the fixup's telemetry counters as UTF-8 encoded JSON. On input, 'length' is the size of 'buffer' in bytes.
+// If the buffer is too small, 'length' is set to the required size (including the null terminator) and
+// ERROR_INSUFFICIENT_BUFFER is returned; otherwise 'length' is set to the length of the string, excluding the null
+// terminator. See RedirectionTelemetry.cpp for the format
+int __stdcall PSFQueryRedirectionTelemetry(_Out_writes_bytes_opt_(*length) char* buffer, _Inout_ DWORD* length) noexcept try
+{
+    if (!length)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    auto json = RedirectionTelemetryJson();
+    auto requiredLength = static_cast<DWORD>(json.length() + 1);
+    if (!buffer || (*length < requiredLength))
+    {
+        *length = requiredLength;
+        return ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    std::copy(json.c_str(), json.c_str() + requiredLength, buffer);
+    *length = requiredLength - 1;
     return ERROR_SUCCESS;
 }
 catch (...)
@@ -34,9 +100,13 @@ catch (...)
 #ifdef _M_IX86
 #pragma comment(linker, "/EXPORT:PSFInitialize=_PSFInitialize@0")
 #pragma comment(linker, "/EXPORT:PSFUninitialize=_PSFUninitialize@0")
+#pragma comment(linker, "/EXPORT:PSFProcessTerminating=_PSFProcessTerminating@0")
+#pragma comment(linker, "/EXPORT:PSFQueryRedirectionTelemetry=_PSFQueryRedirectionTelemetry@8")
 #else
 #pragma comment(linker, "/EXPORT:PSFInitialize=PSFInitialize")
 #pragma comment(linker, "/EXPORT:PSFUninitialize=PSFUninitialize")
+#pragma comment(linker, "/EXPORT:PSFProcessTerminating=PSFProcessTerminating")
+#pragma comment(linker, "/EXPORT:PSFQueryRedirectionTelemetry=PSFQueryRedirectionTelemetry")
 #endif
 
 BOOL __stdcall DllMain(HINSTANCE, DWORD reason, LPVOID) noexcept try
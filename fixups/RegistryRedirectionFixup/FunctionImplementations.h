@@ -0,0 +1,69 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Collection of function pointers that will always point to (what we think are) the actual function implementations.
+// That is, impl::RegOpenKeyEx will (presumably) call kernelbase!RegOpenKeyExA/W, even though we detour that call. The
+// overlay's own registry calls (e.g. on the backing hive, or on the real keys that reads fall through to) always go
+// through these
+#pragma once
+
+#include <windows.h>
+#include <winternl.h>
+
+#include <reentrancy_guard.h>
+#include <psf_framework.h>
+
+// NOTE: Some structs/functions are missing from winternl.h. The namespace is to disambiguate
+namespace winternl
+{
+    // Only the values that we care about
+    enum KEY_INFORMATION_CLASS
+    {
+        KeyNameInformation = 3,
+    };
+
+    struct KEY_NAME_INFORMATION
+    {
+        ULONG NameLength;
+        WCHAR Name[1];
+    };
+
+    NTSTATUS __stdcall NtQueryKey(
+        HANDLE KeyHandle,
+        KEY_INFORMATION_CLASS KeyInformationClass,
+        PVOID KeyInformation,
+        ULONG Length,
+        PULONG ResultLength);
+
+    // The functions in winternl.h are not included in any import lib and therefore must be manually loaded. ntdll is
+    // loaded into every process, so there's no need to load it ourselves
+    template <typename Func>
+    inline Func ntdll_function(const char* functionName) noexcept
+    {
+        return reinterpret_cast<Func>(::GetProcAddress(::GetModuleHandleW(L"ntdll.dll"), functionName));
+    }
+}
+
+// Registry functions call each other internally (e.g. RegCreateKeyEx opening the keys on its way), and those calls
+// shouldn't come back through the fixups
+inline psf::reentrancy_guard g_reentrancyGuard;
+
+namespace impl
+{
+    inline auto NtQueryKey = winternl::ntdll_function<decltype(&winternl::NtQueryKey)>("NtQueryKey");
+
+    inline auto RegCloseKey = &::RegCloseKey;
+    inline auto RegFlushKey = &::RegFlushKey;
+    inline auto RegLoadAppKey = &::RegLoadAppKeyW;
+
+    inline auto RegCreateKeyEx = psf::detoured_string_function(&::RegCreateKeyExA, &::RegCreateKeyExW);
+    inline auto RegDeleteValue = psf::detoured_string_function(&::RegDeleteValueA, &::RegDeleteValueW);
+    inline auto RegEnumKeyEx = psf::detoured_string_function(&::RegEnumKeyExA, &::RegEnumKeyExW);
+    inline auto RegEnumValue = psf::detoured_string_function(&::RegEnumValueA, &::RegEnumValueW);
+    inline auto RegGetValue = psf::detoured_string_function(&::RegGetValueA, &::RegGetValueW);
+    inline auto RegOpenKeyEx = psf::detoured_string_function(&::RegOpenKeyExA, &::RegOpenKeyExW);
+    inline auto RegQueryValueEx = psf::detoured_string_function(&::RegQueryValueExA, &::RegQueryValueExW);
+    inline auto RegSetValueEx = psf::detoured_string_function(&::RegSetValueExA, &::RegSetValueExW);
+}
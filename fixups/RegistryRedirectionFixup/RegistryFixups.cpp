@@ -0,0 +1,366 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The fixups only translate arguments for the overlay (see RegistryOverlay.cpp), which answers for redirected keys, and
+// the value cache (see RegistryValueCache.cpp), which answers for cached ones. Everything else goes to the registry as-is
+
+#include <type_traits>
+#include <vector>
+
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "RegistryOverlay.h"
+#include "RegistryValueCache.h"
+
+// NOTE: The ANSI registry functions use the active code page, not UTF-8
+inline wide_argument_string_with_buffer registry_argument(const char* str)
+{
+    return str ? wide_argument_string_with_buffer{ std::wstring_view(widen(str, CP_ACP)) } : wide_argument_string_with_buffer{};
+}
+
+inline wide_argument_string registry_argument(const wchar_t* str) noexcept
+{
+    return wide_argument_string{ str };
+}
+
+template <typename CharT>
+LSTATUS __stdcall RegOpenKeyExFixup(
+    _In_ HKEY key,
+    _In_opt_ const CharT* subKey,
+    _In_opt_ DWORD options,
+    _In_ REGSAM samDesired,
+    _Out_ PHKEY result) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            auto openResult = OpenRedirectedKey(key, registry_argument(subKey).c_str(), options, samDesired, false, nullptr, result, nullptr);
+            if (openResult.handled)
+            {
+                return openResult.status;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegOpenKeyEx(key, subKey, options, samDesired, result);
+}
+DECLARE_STRING_FIXUP(impl::RegOpenKeyEx, RegOpenKeyExFixup);
+
+template <typename CharT>
+LSTATUS __stdcall RegCreateKeyExFixup(
+    _In_ HKEY key,
+    _In_ const CharT* subKey,
+    _Reserved_ DWORD reserved,
+    _In_opt_ CharT* className,
+    _In_ DWORD options,
+    _In_ REGSAM samDesired,
+    _In_opt_ const LPSECURITY_ATTRIBUTES securityAttributes,
+    _Out_ PHKEY result,
+    _Out_opt_ LPDWORD disposition) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            auto openResult = OpenRedirectedKey(key, registry_argument(subKey).c_str(), options, samDesired, true, securityAttributes, result, disposition);
+            if (openResult.handled)
+            {
+                return openResult.status;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegCreateKeyEx(key, subKey, reserved, className, options, samDesired, securityAttributes, result, disposition);
+}
+DECLARE_STRING_FIXUP(impl::RegCreateKeyEx, RegCreateKeyExFixup);
+
+LSTATUS __stdcall RegCloseKeyFixup(_In_ HKEY key) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            auto closeResult = CloseRedirectedKey(key);
+            if (closeResult.handled)
+            {
+                return closeResult.status;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegCloseKey(key);
+}
+DECLARE_FIXUP(impl::RegCloseKey, RegCloseKeyFixup);
+
+template <typename CharT>
+LSTATUS __stdcall RegQueryValueExFixup(
+    _In_ HKEY key,
+    _In_opt_ const CharT* valueName,
+    _Reserved_ LPDWORD reserved,
+    _Out_opt_ LPDWORD type,
+    _Out_writes_bytes_to_opt_(*dataSize, *dataSize) LPBYTE data,
+    _When_(data == NULL, _Out_opt_) _When_(data != NULL, _Inout_opt_) LPDWORD dataSize) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    auto target = key;
+    try
+    {
+        if (guard)
+        {
+            constexpr bool ansi = std::is_same_v<CharT, char>;
+            auto wideName = registry_argument(valueName);
+            auto queryResult = QueryRedirectedValue(key, wideName.c_str(), ansi, type, data, dataSize);
+            if (!queryResult.handled && (queryResult.real_key == key))
+            {
+                queryResult = QueryCachedValue(key, wideName.c_str(), ansi, type, data, dataSize);
+            }
+
+            if (queryResult.handled)
+            {
+                return queryResult.status;
+            }
+            target = queryResult.real_key;
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegQueryValueEx(target, valueName, reserved, type, data, dataSize);
+}
+DECLARE_STRING_FIXUP(impl::RegQueryValueEx, RegQueryValueExFixup);
+
+template <typename CharT>
+static LSTATUS get_value(HKEY key, const CharT* valueName, DWORD flags, LPDWORD type, PVOID data, LPDWORD dataSize)
+{
+    constexpr bool ansi = std::is_same_v<CharT, char>;
+    auto wideName = registry_argument(valueName);
+    auto getResult = GetRedirectedValue(key, wideName.c_str(), flags, ansi, type, data, dataSize);
+    if (!getResult.handled && (getResult.real_key == key))
+    {
+        getResult = GetCachedValue(key, wideName.c_str(), flags, ansi, type, data, dataSize);
+    }
+
+    if (getResult.handled)
+    {
+        return getResult.status;
+    }
+
+    return impl::RegGetValue(getResult.real_key, static_cast<const CharT*>(nullptr), valueName, flags, type, data, dataSize);
+}
+
+template <typename CharT>
+LSTATUS __stdcall RegGetValueFixup(
+    _In_ HKEY key,
+    _In_opt_ const CharT* subKey,
+    _In_opt_ const CharT* valueName,
+    _In_ DWORD flags,
+    _Out_opt_ LPDWORD type,
+    _Out_writes_bytes_to_opt_(*dataSize, *dataSize) PVOID data,
+    _Inout_opt_ LPDWORD dataSize) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            if (!subKey || !*subKey)
+            {
+                return get_value(key, valueName, flags, type, data, dataSize);
+            }
+
+            // Same as RegGetValue itself, the subkey gets opened, queried, and closed again. It's only ours to answer for
+            // if the subkey is redirected (or below a redirected key), or cached
+            REGSAM view = 0;
+            if (flags & RRF_SUBKEY_WOW6464KEY) view |= KEY_WOW64_64KEY;
+            if (flags & RRF_SUBKEY_WOW6432KEY) view |= KEY_WOW64_32KEY;
+
+            HKEY subkeyHandle;
+            auto openResult = OpenRedirectedKey(key, registry_argument(subKey).c_str(), 0, KEY_QUERY_VALUE | view, false, nullptr, &subkeyHandle, nullptr);
+            if (openResult.handled)
+            {
+                if (openResult.status != ERROR_SUCCESS)
+                {
+                    return openResult.status;
+                }
+
+                auto result = get_value(subkeyHandle, valueName, flags & ~(RRF_SUBKEY_WOW6464KEY | RRF_SUBKEY_WOW6432KEY), type, data, dataSize);
+                CloseRedirectedKey(subkeyHandle);
+                return result;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegGetValue(key, subKey, valueName, flags, type, data, dataSize);
+}
+DECLARE_STRING_FIXUP(impl::RegGetValue, RegGetValueFixup);
+
+template <typename CharT>
+LSTATUS __stdcall RegSetValueExFixup(
+    _In_ HKEY key,
+    _In_opt_ const CharT* valueName,
+    _Reserved_ DWORD reserved,
+    _In_ DWORD type,
+    _In_reads_bytes_opt_(dataSize) CONST BYTE* data,
+    _In_ DWORD dataSize) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            overlay_result setResult;
+            if constexpr (std::is_same_v<CharT, char>)
+            {
+                // The overlay keeps strings the way that the registry does, i.e. as UTF-16
+                auto isString = (type == REG_SZ) || (type == REG_EXPAND_SZ) || (type == REG_MULTI_SZ);
+                if (isString && data && dataSize)
+                {
+                    auto source = reinterpret_cast<const char*>(data);
+                    auto length = ::MultiByteToWideChar(CP_ACP, 0, source, static_cast<int>(dataSize), nullptr, 0);
+                    std::vector<wchar_t> wide(length);
+                    ::MultiByteToWideChar(CP_ACP, 0, source, static_cast<int>(dataSize), wide.data(), length);
+                    setResult = SetRedirectedValue(key, registry_argument(valueName).c_str(), type,
+                        reinterpret_cast<const BYTE*>(wide.data()), static_cast<DWORD>(wide.size() * sizeof(wchar_t)));
+                }
+                else
+                {
+                    setResult = SetRedirectedValue(key, registry_argument(valueName).c_str(), type, data, dataSize);
+                }
+            }
+            else
+            {
+                setResult = SetRedirectedValue(key, valueName, type, data, dataSize);
+            }
+
+            if (setResult.handled)
+            {
+                return setResult.status;
+            }
+            CachedValueChanged(key, registry_argument(valueName).c_str());
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegSetValueEx(key, valueName, reserved, type, data, dataSize);
+}
+DECLARE_STRING_FIXUP(impl::RegSetValueEx, RegSetValueExFixup);
+
+template <typename CharT>
+LSTATUS __stdcall RegDeleteValueFixup(_In_ HKEY key, _In_opt_ const CharT* valueName) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            auto wideName = registry_argument(valueName);
+            auto deleteResult = DeleteRedirectedValue(key, wideName.c_str());
+            if (deleteResult.handled)
+            {
+                return deleteResult.status;
+            }
+            CachedValueChanged(key, wideName.c_str());
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegDeleteValue(key, valueName);
+}
+DECLARE_STRING_FIXUP(impl::RegDeleteValue, RegDeleteValueFixup);
+
+template <typename CharT>
+LSTATUS __stdcall RegEnumValueFixup(
+    _In_ HKEY key,
+    _In_ DWORD index,
+    _Out_writes_to_opt_(*valueNameLength, *valueNameLength + 1) CharT* valueName,
+    _Inout_ LPDWORD valueNameLength,
+    _Reserved_ LPDWORD reserved,
+    _Out_opt_ LPDWORD type,
+    _Out_writes_bytes_to_opt_(*dataSize, *dataSize) LPBYTE data,
+    _Inout_opt_ LPDWORD dataSize) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            constexpr bool ansi = std::is_same_v<CharT, char>;
+            auto enumResult = EnumRedirectedValue(key, index, ansi, valueName, valueNameLength, type, data, dataSize);
+            if (enumResult.handled)
+            {
+                return enumResult.status;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegEnumValue(key, index, valueName, valueNameLength, reserved, type, data, dataSize);
+}
+DECLARE_STRING_FIXUP(impl::RegEnumValue, RegEnumValueFixup);
+
+template <typename CharT>
+LSTATUS __stdcall RegEnumKeyExFixup(
+    _In_ HKEY key,
+    _In_ DWORD index,
+    _Out_writes_to_opt_(*nameLength, *nameLength + 1) CharT* name,
+    _Inout_ LPDWORD nameLength,
+    _Reserved_ LPDWORD reserved,
+    _Out_writes_to_opt_(*classLength, *classLength + 1) CharT* className,
+    _Inout_opt_ LPDWORD classLength,
+    _Out_opt_ PFILETIME lastWriteTime) noexcept
+{
+    auto guard = g_reentrancyGuard.enter();
+    try
+    {
+        if (guard)
+        {
+            constexpr bool ansi = std::is_same_v<CharT, char>;
+            auto enumResult = EnumRedirectedKey(key, index, ansi, name, nameLength, className, classLength, lastWriteTime);
+            if (enumResult.handled)
+            {
+                return enumResult.status;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Fall back to the registry
+    }
+
+    return impl::RegEnumKeyEx(key, index, name, nameLength, reserved, className, classLength, lastWriteTime);
+}
+DECLARE_STRING_FIXUP(impl::RegEnumKeyEx, RegEnumKeyExFixup);
@@ -0,0 +1,1192 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Packaged applications can read HKLM (merged with the package's own registry), but writes to it fail. The keys that
+// the configuration redirects get an overlay instead: writes go to an in-memory copy of the key, and reads get answered
+// from there before they fall through to the registry. The overlay is backed by an application hive (RegLoadAppKey) in
+// the user's local app data, which gets loaded once, while initializing, and written to in batches, a short while after
+// the first write that it hasn't seen yet. Values deleted through the overlay are kept as tombstones, so that the
+// registry's own values stay hidden across runs, too.
+//
+// Whether a key is redirected gets decided once, when it gets opened, by matching its path against the rules of the
+// configuration. Handles to redirected keys go into a table, so that the calls made on them only need to look the handle
+// up. While there aren't any, that's a single atomic load. The handle that the application gets is the registry's own
+// key (opened for read), if it has one, so that calls that the fixup doesn't know about still work on it. Keys that only
+// the overlay has get a handle of the hive's copy of the key instead.
+//
+// NOTE: The hive is shared by all of the package's processes, but each one only reads it once, so processes don't see
+//       each other's writes until they're restarted. When they write the same value, the last write wins
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sddl.h>
+
+#include <known_folders.h>
+#include <pattern_matcher.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "RegistryOverlay.h"
+#include "RegistryValueCache.h"
+
+using namespace std::literals;
+
+// A tombstone for a value that was deleted through the overlay: "PSFD"
+constexpr DWORD overlay_deleted_value_type = 0x44465350;
+
+constexpr DWORD overlay_flush_delay_ms = 2000;
+
+// Longest names that the registry allows, including the null terminator
+constexpr DWORD max_key_name_length = 256;
+constexpr DWORD max_value_name_length = 16384;
+
+constexpr NTSTATUS status_buffer_overflow = static_cast<NTSTATUS>(0x80000005);
+constexpr NTSTATUS status_buffer_too_small = static_cast<NTSTATUS>(0xC0000023);
+
+struct overlay_value
+{
+    DWORD type = REG_NONE;
+    std::vector<std::uint8_t> data;
+    bool deleted = false;
+    bool dirty = false;
+};
+
+struct overlay_key
+{
+    std::wstring path;
+    std::map<iwstring, overlay_value, std::less<>> values;
+    std::set<iwstring, std::less<>> subkeys;
+    bool dirty = false;
+};
+
+struct redirected_key
+{
+    std::wstring path;
+    HKEY real;              // The registry's key, if it has one
+    overlay_key* overlay;   // Null until something gets written to the key
+};
+
+static std::vector<key_rule> g_rules;
+static std::wstring g_currentUserSid;
+
+// Guards everything below it. Keys are never removed from the overlay, so pointers to them stay valid
+static std::shared_mutex g_overlayMutex;
+static std::unordered_map<iwstring, std::unique_ptr<overlay_key>, case_insensitive_hash<wchar_t>> g_overlayKeys;
+static std::unordered_map<HKEY, redirected_key> g_redirectedKeys;
+static std::atomic<std::size_t> g_redirectedKeyCount = 0;
+static std::vector<overlay_key*> g_dirtyKeys;
+
+// Guards the hive, so that it doesn't get closed in the middle of a flush
+static std::mutex g_flushMutex;
+static HKEY g_hive = nullptr;
+static PTP_TIMER g_flushTimer = nullptr;
+
+// Key paths are the short name of the root key, followed by the path from there, e.g. "HKLM\SOFTWARE\Contoso". The
+// WOW6432Node of the 32-bit view of the registry gets dropped, so that both views share the same overlay
+std::wstring CanonicalKeyPath(std::wstring_view path)
+{
+    std::vector<std::wstring_view> components;
+    while (!path.empty())
+    {
+        auto pos = path.find(L'\\');
+        auto component = path.substr(0, pos);
+        path = (pos == std::wstring_view::npos) ? L""sv : path.substr(pos + 1);
+        if (component.empty())
+        {
+            continue;
+        }
+
+        iwstring_view name(component.data(), component.length());
+        if (components.empty())
+        {
+            if ((name == L"HKEY_LOCAL_MACHINE"_isv) || (name == L"HKLM"_isv)) component = L"HKLM"sv;
+            else if ((name == L"HKEY_CURRENT_USER"_isv) || (name == L"HKCU"_isv)) component = L"HKCU"sv;
+            else if ((name == L"HKEY_CLASSES_ROOT"_isv) || (name == L"HKCR"_isv)) component = L"HKCR"sv;
+            else if ((name == L"HKEY_USERS"_isv) || (name == L"HKU"_isv)) component = L"HKU"sv;
+        }
+        else if (name == L"WOW6432Node"_isv)
+        {
+            auto isClassesRoot = (components.size() == 1) && (components[0] == L"HKCR"sv);
+            auto isSoftware = (components.size() == 2) && ((components[0] == L"HKLM"sv) || (components[0] == L"HKCU"sv)) &&
+                (iwstring_view(components[1].data(), components[1].length()) == L"SOFTWARE"_isv);
+            if (isClassesRoot || isSoftware)
+            {
+                continue;
+            }
+        }
+
+        components.push_back(component);
+    }
+
+    std::wstring result;
+    for (auto component : components)
+    {
+        if (!result.empty())
+        {
+            result.push_back(L'\\');
+        }
+        result.append(component);
+    }
+
+    return result;
+}
+
+std::vector<key_rule> LoadKeyRules(const psf::json_array& rulesConfig)
+{
+    std::vector<key_rule> result;
+    for (auto& ruleValue : rulesConfig)
+    {
+        auto& ruleObject = ruleValue.as_object();
+        auto& rule = result.emplace_back();
+        rule.key = CanonicalKeyPath(ruleObject.get("key").as_string().wstring());
+        if (auto patterns = ruleObject.try_get("patterns"))
+        {
+            for (auto& pattern : patterns->as_array())
+            {
+                rule.patterns.emplace_back(pattern.as_string().wstring());
+            }
+        }
+    }
+
+    return result;
+}
+
+bool MatchesKeyRules(const std::vector<key_rule>& rules, const std::wstring& path)
+{
+    for (auto& rule : rules)
+    {
+        auto length = rule.key.length();
+        if ((path.length() < length) || (iwstring_view(path.data(), length) != iwstring_view(rule.key.data(), length)) ||
+            ((path.length() > length) && (path[length] != L'\\')))
+        {
+            continue;
+        }
+
+        if (rule.patterns.empty())
+        {
+            return true;
+        }
+
+        std::wstring relativePath = (path.length() > length) ? path.substr(length + 1) : std::wstring();
+        std::transform(relativePath.begin(), relativePath.end(), relativePath.begin(), [](wchar_t ch) { return static_cast<wchar_t>(std::towlower(ch)); });
+        for (auto& pattern : rule.patterns)
+        {
+            if (pattern.match(relativePath))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool is_redirected_path(const std::wstring& path)
+{
+    return MatchesKeyRules(g_rules, path);
+}
+
+// The native name of a key, e.g. "\REGISTRY\MACHINE\SOFTWARE", in the form of the overlay's key paths
+static bool key_path_from_native(std::wstring_view name, std::wstring& path)
+{
+    constexpr auto machinePrefix = LR"(\REGISTRY\MACHINE)"_isv;
+    constexpr auto userPrefix = LR"(\REGISTRY\USER)"_isv;
+    iwstring_view nativeName(name.data(), name.length());
+    auto hasPrefix = [&](iwstring_view prefix)
+    {
+        return (nativeName.substr(0, prefix.length()) == prefix) &&
+            ((nativeName.length() == prefix.length()) || (nativeName[prefix.length()] == L'\\'));
+    };
+
+    if (hasPrefix(machinePrefix))
+    {
+        path = CanonicalKeyPath(L"HKLM" + std::wstring(name.substr(machinePrefix.length())));
+        return true;
+    }
+    else if (hasPrefix(userPrefix))
+    {
+        auto rest = name.substr(userPrefix.length());
+        auto userKey = L"\\" + g_currentUserSid;
+        iwstring_view restName(rest.data(), rest.length());
+        if (!g_currentUserSid.empty() && (restName.substr(0, userKey.length()) == iwstring_view(userKey.data(), userKey.length())) &&
+            ((rest.length() == userKey.length()) || (rest[userKey.length()] == L'\\')))
+        {
+            path = CanonicalKeyPath(L"HKCU" + std::wstring(rest.substr(userKey.length())));
+        }
+        else
+        {
+            path = CanonicalKeyPath(L"HKU" + std::wstring(rest));
+        }
+        return true;
+    }
+
+    return false;
+}
+
+bool NativeKeyName(HKEY key, std::wstring& name)
+{
+    if (!impl::NtQueryKey)
+    {
+        return false;
+    }
+
+    ULONG size = 512;
+    auto buffer = std::make_unique<std::uint8_t[]>(size);
+    auto status = impl::NtQueryKey(key, winternl::KeyNameInformation, buffer.get(), size, &size);
+    if ((status == status_buffer_overflow) || (status == status_buffer_too_small))
+    {
+        buffer = std::make_unique<std::uint8_t[]>(size);
+        status = impl::NtQueryKey(key, winternl::KeyNameInformation, buffer.get(), size, &size);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        return false;
+    }
+
+    auto info = reinterpret_cast<const winternl::KEY_NAME_INFORMATION*>(buffer.get());
+    name.assign(info->Name, info->NameLength / sizeof(wchar_t));
+    return true;
+}
+
+static bool key_path(HKEY key, std::wstring& path)
+{
+    if (key == HKEY_LOCAL_MACHINE) { path = L"HKLM"; return true; }
+    if (key == HKEY_CURRENT_USER) { path = L"HKCU"; return true; }
+    if (key == HKEY_CLASSES_ROOT) { path = L"HKCR"; return true; }
+    if (key == HKEY_USERS) { path = L"HKU"; return true; }
+
+    // Any other key handle is one that the application opened through something other than the overlay, and its path
+    // is only known to the kernel
+    std::wstring nativeName;
+    return NativeKeyName(key, nativeName) && key_path_from_native(nativeName, path);
+}
+
+static void CALLBACK FlushTimerCallback(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER) noexcept
+{
+    FlushRegistryOverlay();
+}
+
+// Called with g_overlayMutex held exclusively
+static void mark_dirty(overlay_key* key) noexcept
+{
+    if (key->dirty)
+    {
+        return;
+    }
+
+    key->dirty = true;
+    g_dirtyKeys.push_back(key);
+    if ((g_dirtyKeys.size() == 1) && g_flushTimer)
+    {
+        // Relative due times are negative, in 100ns units
+        ULARGE_INTEGER dueTime;
+        dueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(overlay_flush_delay_ms) * 10'000);
+        FILETIME fileDueTime{ dueTime.LowPart, dueTime.HighPart };
+        ::SetThreadpoolTimer(g_flushTimer, &fileDueTime, 0, overlay_flush_delay_ms / 10);
+    }
+}
+
+static overlay_key* find_overlay_key(const std::wstring& path)
+{
+    auto itr = g_overlayKeys.find(iwstring(path.data(), path.length()));
+    return (itr != g_overlayKeys.end()) ? itr->second.get() : nullptr;
+}
+
+// Called with g_overlayMutex held exclusively
+static overlay_key* create_overlay_key(const std::wstring& path)
+{
+    if (auto existing = find_overlay_key(path))
+    {
+        return existing;
+    }
+
+    auto key = std::make_unique<overlay_key>();
+    key->path = path;
+    auto result = key.get();
+    g_overlayKeys.emplace(iwstring(path.data(), path.length()), std::move(key));
+
+    // Enumerating the parent should find the new key, if the overlay answers for the parent, too
+    auto pos = path.rfind(L'\\');
+    if (pos != std::wstring::npos)
+    {
+        auto parentPath = path.substr(0, pos);
+        if (is_redirected_path(parentPath))
+        {
+            auto name = std::wstring_view(path).substr(pos + 1);
+            create_overlay_key(parentPath)->subkeys.emplace(name.data(), name.length());
+        }
+    }
+
+    // Keys that are already open get to see what gets written to the key through other handles
+    for (auto& [handle, entry] : g_redirectedKeys)
+    {
+        if (!entry.overlay && (iwstring_view(entry.path.c_str()) == iwstring_view(path.c_str())))
+        {
+            entry.overlay = result;
+        }
+    }
+
+    // So that the hive gets the key, even if nothing gets written to it
+    mark_dirty(result);
+    return result;
+}
+
+static const overlay_value* find_value(const overlay_key* key, const wchar_t* valueName) noexcept
+{
+    if (!key)
+    {
+        return nullptr;
+    }
+
+    auto itr = key->values.find(iwstring_view(valueName ? valueName : L""));
+    return (itr != key->values.end()) ? &itr->second : nullptr;
+}
+
+static bool is_string_type(DWORD type) noexcept
+{
+    return (type == REG_SZ) || (type == REG_EXPAND_SZ) || (type == REG_MULTI_SZ);
+}
+
+LSTATUS CopyOutValue(bool ansi, DWORD valueType, const std::vector<std::uint8_t>& value, DWORD* type, BYTE* data, DWORD* dataSize)
+{
+    auto wide = reinterpret_cast<const wchar_t*>(value.data());
+    auto wideLength = static_cast<int>(value.size() / sizeof(wchar_t));
+    auto convert = ansi && is_string_type(valueType) && (wideLength > 0);
+    auto requiredSize = convert ?
+        static_cast<DWORD>(::WideCharToMultiByte(CP_ACP, 0, wide, wideLength, nullptr, 0, nullptr, nullptr)) :
+        static_cast<DWORD>(value.size());
+
+    if (type)
+    {
+        *type = valueType;
+    }
+
+    if (!dataSize)
+    {
+        return data ? ERROR_INVALID_PARAMETER : ERROR_SUCCESS;
+    }
+
+    if (data && (*dataSize < requiredSize))
+    {
+        *dataSize = requiredSize;
+        return ERROR_MORE_DATA;
+    }
+
+    if (data)
+    {
+        if (convert)
+        {
+            ::WideCharToMultiByte(CP_ACP, 0, wide, wideLength, reinterpret_cast<char*>(data), static_cast<int>(requiredSize), nullptr, nullptr);
+        }
+        else if (requiredSize)
+        {
+            std::memcpy(data, value.data(), requiredSize);
+        }
+    }
+
+    *dataSize = requiredSize;
+    return ERROR_SUCCESS;
+}
+
+// Copies a name out the way that the enumeration functions do. The length is in characters, and includes the null
+// terminator going in, but not coming out
+static LSTATUS copy_out_name(bool ansi, std::wstring_view name, void* buffer, DWORD* length)
+{
+    if (!length)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (ansi)
+    {
+        auto narrowName = narrow(name, CP_ACP);
+        if (!buffer || (*length <= narrowName.length()))
+        {
+            return ERROR_MORE_DATA;
+        }
+
+        narrowName.copy(static_cast<char*>(buffer), narrowName.length());
+        static_cast<char*>(buffer)[narrowName.length()] = '\0';
+        *length = static_cast<DWORD>(narrowName.length());
+    }
+    else
+    {
+        if (!buffer || (*length <= name.length()))
+        {
+            return ERROR_MORE_DATA;
+        }
+
+        name.copy(static_cast<wchar_t*>(buffer), name.length());
+        static_cast<wchar_t*>(buffer)[name.length()] = L'\0';
+        *length = static_cast<DWORD>(name.length());
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static overlay_result fall_through(const redirected_key& entry) noexcept
+{
+    overlay_result result;
+    if (entry.real)
+    {
+        result.real_key = entry.real;
+    }
+    else
+    {
+        result.handled = true;
+        result.status = ERROR_FILE_NOT_FOUND;
+    }
+
+    return result;
+}
+
+static void load_hive_key(HKEY key, const std::wstring& path)
+{
+    overlay_key* node = nullptr;
+    if (!path.empty())
+    {
+        auto owned = std::make_unique<overlay_key>();
+        owned->path = path;
+        node = owned.get();
+        g_overlayKeys.emplace(iwstring(path.data(), path.length()), std::move(owned));
+
+        std::wstring name(max_value_name_length, L'\0');
+        std::vector<std::uint8_t> data;
+        for (DWORD i = 0; ; ++i)
+        {
+            DWORD nameLength = max_value_name_length;
+            DWORD type;
+            DWORD dataSize = 0;
+            if (impl::RegEnumValue(key, i, name.data(), &nameLength, nullptr, &type, nullptr, &dataSize) != ERROR_SUCCESS)
+            {
+                break;
+            }
+
+            data.resize(dataSize);
+            nameLength = max_value_name_length;
+            if (impl::RegEnumValue(key, i, name.data(), &nameLength, nullptr, &type, data.data(), &dataSize) != ERROR_SUCCESS)
+            {
+                break;
+            }
+
+            auto& value = node->values[iwstring(name.data(), nameLength)];
+            if (type == overlay_deleted_value_type)
+            {
+                value.deleted = true;
+            }
+            else
+            {
+                value.type = type;
+                value.data.assign(data.begin(), data.begin() + dataSize);
+            }
+        }
+    }
+
+    wchar_t subkeyName[max_key_name_length];
+    for (DWORD i = 0; ; ++i)
+    {
+        DWORD length = max_key_name_length;
+        if (impl::RegEnumKeyEx(key, i, subkeyName, &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+        {
+            break;
+        }
+
+        std::wstring_view subkey(subkeyName, length);
+        if (node)
+        {
+            node->subkeys.emplace(subkey.data(), subkey.length());
+        }
+
+        HKEY subkeyHandle;
+        if (impl::RegOpenKeyEx(key, subkeyName, 0, KEY_READ, &subkeyHandle) == ERROR_SUCCESS)
+        {
+            load_hive_key(subkeyHandle, path.empty() ? std::wstring(subkey) : (path + L'\\' + std::wstring(subkey)));
+            impl::RegCloseKey(subkeyHandle);
+        }
+    }
+}
+
+static std::wstring current_user_sid()
+{
+    HANDLE token;
+    if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_QUERY, &token))
+    {
+        return {};
+    }
+
+    std::wstring result;
+    std::uint8_t buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    DWORD size;
+    if (::GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &size))
+    {
+        wchar_t* sid;
+        if (::ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER*>(buffer)->User.Sid, &sid))
+        {
+            result = sid;
+            ::LocalFree(sid);
+        }
+    }
+
+    ::CloseHandle(token);
+    return result;
+}
+
+void InitializeRegistryOverlay()
+{
+    // Cached keys get matched by path, too, so this is needed even if nothing gets redirected
+    g_currentUserSid = current_user_sid();
+
+    auto config = ::PSFQueryCurrentDllConfig();
+    auto keysConfig = config ? config->as_object().try_get("redirectedKeys") : nullptr;
+    if (!keysConfig)
+    {
+        return;
+    }
+
+    g_rules = LoadKeyRules(keysConfig->as_array());
+
+    auto hivePath = ::PSFQueryKnownFolder(FOLDERID_LocalAppData) / L"RegistryRedirection.dat";
+    if (impl::RegLoadAppKey(hivePath.c_str(), &g_hive, KEY_ALL_ACCESS, 0, 0) != ERROR_SUCCESS)
+    {
+        // Without somewhere to keep the writes, redirecting keys would only lose them at exit, so leave them alone
+        g_hive = nullptr;
+        g_rules.clear();
+        return;
+    }
+
+    load_hive_key(g_hive, {});
+    g_flushTimer = ::CreateThreadpoolTimer(FlushTimerCallback, nullptr, nullptr);
+}
+
+void UninitializeRegistryOverlay() noexcept
+{
+    // We're called from within DllMain, so we don't wait for the timer's callback. It takes the same lock as we do
+    // before it touches the hive
+    if (g_flushTimer)
+    {
+        ::SetThreadpoolTimer(g_flushTimer, nullptr, 0, 0);
+    }
+
+    FlushRegistryOverlay();
+
+    std::lock_guard lock(g_flushMutex);
+    if (g_hive)
+    {
+        impl::RegCloseKey(g_hive);
+        g_hive = nullptr;
+    }
+}
+
+void FlushRegistryOverlay(bool processTerminating) noexcept try
+{
+    std::unique_lock flushLock(g_flushMutex, std::defer_lock);
+    if (processTerminating)
+    {
+        if (!flushLock.try_lock())
+        {
+            return;
+        }
+    }
+    else
+    {
+        flushLock.lock();
+    }
+
+    if (!g_hive)
+    {
+        return;
+    }
+
+    struct pending_key
+    {
+        std::wstring path;
+        std::vector<std::pair<std::wstring, overlay_value>> values;
+    };
+
+    std::vector<pending_key> pending;
+    {
+        std::unique_lock lock(g_overlayMutex, std::defer_lock);
+        if (processTerminating)
+        {
+            if (!lock.try_lock())
+            {
+                return;
+            }
+        }
+        else
+        {
+            lock.lock();
+        }
+
+        for (auto key : g_dirtyKeys)
+        {
+            auto& pendingKey = pending.emplace_back();
+            pendingKey.path = key->path;
+            for (auto& [name, value] : key->values)
+            {
+                if (value.dirty)
+                {
+                    pendingKey.values.emplace_back(std::wstring(name.data(), name.length()), value);
+                    value.dirty = false;
+                }
+            }
+            key->dirty = false;
+        }
+        g_dirtyKeys.clear();
+    }
+
+    // Writes that fail here are only lost from the hive. The overlay still has them for as long as the process runs
+    for (auto& pendingKey : pending)
+    {
+        HKEY key;
+        if (impl::RegCreateKeyEx(g_hive, pendingKey.path.c_str(), 0, nullptr, 0, KEY_SET_VALUE, nullptr, &key, nullptr) != ERROR_SUCCESS)
+        {
+            continue;
+        }
+
+        for (auto& [name, value] : pendingKey.values)
+        {
+            if (value.deleted)
+            {
+                impl::RegSetValueEx(key, name.c_str(), 0, overlay_deleted_value_type, nullptr, 0);
+            }
+            else
+            {
+                impl::RegSetValueEx(key, name.c_str(), 0, value.type, value.data.data(), static_cast<DWORD>(value.data.size()));
+            }
+        }
+
+        impl::RegCloseKey(key);
+    }
+
+    if (!pending.empty())
+    {
+        impl::RegFlushKey(g_hive);
+    }
+}
+catch (...)
+{
+    // Out of memory. Whatever didn't get written stays in memory
+}
+
+overlay_result OpenRedirectedKey(
+    HKEY key,
+    const wchar_t* subKey,
+    DWORD options,
+    REGSAM samDesired,
+    bool create,
+    LPSECURITY_ATTRIBUTES securityAttributes,
+    HKEY* result,
+    DWORD* disposition)
+{
+    overlay_result openResult;
+    openResult.real_key = key;
+    if ((g_rules.empty() && !RegistryValueCacheEnabled()) || !result)
+    {
+        return openResult;
+    }
+
+    std::wstring parentPath;
+    HKEY parentReal = key;
+    bool parentRedirected = false;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) != 0)
+    {
+        std::shared_lock lock(g_overlayMutex);
+        auto itr = g_redirectedKeys.find(key);
+        if (itr != g_redirectedKeys.end())
+        {
+            parentPath = itr->second.path;
+            parentReal = itr->second.real;
+            parentRedirected = true;
+        }
+    }
+
+    if (!parentRedirected && !key_path(key, parentPath))
+    {
+        return openResult;
+    }
+
+    auto path = (subKey && *subKey) ? CanonicalKeyPath(parentPath + L'\\' + subKey) : parentPath;
+    auto redirected = is_redirected_path(path);
+    if (!redirected && !parentRedirected)
+    {
+        // The registry's own key, but its values might be ones to cache
+        if (IsCachedKeyPath(path))
+        {
+            openResult.handled = true;
+            openResult.status = create ?
+                impl::RegCreateKeyEx(key, subKey, 0, nullptr, options, samDesired, securityAttributes, result, disposition) :
+                impl::RegOpenKeyEx(key, subKey, options, samDesired, result);
+            if (openResult.status == ERROR_SUCCESS)
+            {
+                CachedKeyOpened(*result, samDesired);
+            }
+        }
+        return openResult;
+    }
+
+    openResult.handled = true;
+    if (!redirected)
+    {
+        // Below a redirected key, but left out by the rule's patterns, so it's the registry's own key. Its parent might
+        // not exist outside of the overlay
+        if (!parentReal)
+        {
+            openResult.status = ERROR_FILE_NOT_FOUND;
+        }
+        else if (create)
+        {
+            openResult.status = impl::RegCreateKeyEx(parentReal, subKey, 0, nullptr, options, samDesired, securityAttributes, result, disposition);
+        }
+        else
+        {
+            openResult.status = impl::RegOpenKeyEx(parentReal, subKey, options, samDesired, result);
+        }
+        return openResult;
+    }
+
+    // Reads fall through to the registry's key, so it only needs to be readable
+    HKEY real = nullptr;
+    auto realStatus = ERROR_FILE_NOT_FOUND;
+    if (parentReal)
+    {
+        auto view = samDesired & (KEY_WOW64_32KEY | KEY_WOW64_64KEY);
+        realStatus = impl::RegOpenKeyEx(parentReal, subKey ? subKey : L"", 0, KEY_READ | view, &real);
+        if (realStatus != ERROR_SUCCESS)
+        {
+            real = nullptr;
+        }
+    }
+
+    std::unique_lock lock(g_overlayMutex);
+    auto overlay = find_overlay_key(path);
+    auto created = false;
+    if (!real && !overlay)
+    {
+        if (!create)
+        {
+            openResult.status = (realStatus == ERROR_ACCESS_DENIED) ? ERROR_ACCESS_DENIED : ERROR_FILE_NOT_FOUND;
+            return openResult;
+        }
+
+        overlay = create_overlay_key(path);
+        created = true;
+    }
+
+    auto handle = real;
+    if (!handle)
+    {
+        openResult.status = impl::RegCreateKeyEx(g_hive, path.c_str(), 0, nullptr, 0, KEY_ALL_ACCESS, nullptr, &handle, nullptr);
+        if (openResult.status != ERROR_SUCCESS)
+        {
+            return openResult;
+        }
+    }
+
+    g_redirectedKeys.insert_or_assign(handle, redirected_key{ std::move(path), real, overlay });
+    g_redirectedKeyCount.store(g_redirectedKeys.size(), std::memory_order_relaxed);
+
+    *result = handle;
+    if (disposition)
+    {
+        *disposition = created ? REG_CREATED_NEW_KEY : REG_OPENED_EXISTING_KEY;
+    }
+
+    openResult.status = ERROR_SUCCESS;
+    return openResult;
+}
+
+overlay_result CloseRedirectedKey(HKEY key)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (CachedKeyClosed(key))
+    {
+        result.handled = true;
+        result.status = impl::RegCloseKey(key);
+        return result;
+    }
+
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    {
+        std::unique_lock lock(g_overlayMutex);
+        if (g_redirectedKeys.erase(key) == 0)
+        {
+            return result;
+        }
+        g_redirectedKeyCount.store(g_redirectedKeys.size(), std::memory_order_relaxed);
+    }
+
+    result.handled = true;
+    result.status = impl::RegCloseKey(key);
+    return result;
+}
+
+overlay_result QueryRedirectedValue(HKEY key, const wchar_t* valueName, bool ansi, DWORD* type, BYTE* data, DWORD* dataSize)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    std::shared_lock lock(g_overlayMutex);
+    auto itr = g_redirectedKeys.find(key);
+    if (itr == g_redirectedKeys.end())
+    {
+        return result;
+    }
+
+    if (auto value = find_value(itr->second.overlay, valueName))
+    {
+        result.handled = true;
+        result.status = value->deleted ? ERROR_FILE_NOT_FOUND : CopyOutValue(ansi, value->type, value->data, type, data, dataSize);
+        return result;
+    }
+
+    return fall_through(itr->second);
+}
+
+static bool type_allowed(DWORD type, DWORD flags) noexcept
+{
+    if ((flags & RRF_RT_ANY) == RRF_RT_ANY)
+    {
+        return true;
+    }
+
+    switch (type)
+    {
+    case REG_NONE: return (flags & RRF_RT_REG_NONE) != 0;
+    case REG_SZ: return (flags & RRF_RT_REG_SZ) != 0;
+    case REG_EXPAND_SZ: return (flags & RRF_RT_REG_EXPAND_SZ) != 0;
+    case REG_BINARY: return (flags & RRF_RT_REG_BINARY) != 0;
+    case REG_DWORD: return (flags & RRF_RT_REG_DWORD) != 0;
+    case REG_MULTI_SZ: return (flags & RRF_RT_REG_MULTI_SZ) != 0;
+    case REG_QWORD: return (flags & RRF_RT_REG_QWORD) != 0;
+    }
+
+    return false;
+}
+
+LSTATUS CopyOutValueAs(DWORD flags, bool ansi, DWORD valueType, const std::vector<std::uint8_t>& value, DWORD* type, void* data, DWORD* dataSize)
+{
+    // Same as RegGetValue, expandable strings come back expanded (as REG_SZ) unless asked not to
+    auto valueData = &value;
+    std::vector<std::uint8_t> expanded;
+    if ((valueType == REG_EXPAND_SZ) && !(flags & RRF_NOEXPAND))
+    {
+        std::wstring source(reinterpret_cast<const wchar_t*>(value.data()), value.size() / sizeof(wchar_t));
+        auto length = ::ExpandEnvironmentStringsW(source.c_str(), nullptr, 0);
+        expanded.resize(length * sizeof(wchar_t));
+        ::ExpandEnvironmentStringsW(source.c_str(), reinterpret_cast<wchar_t*>(expanded.data()), length);
+        valueType = REG_SZ;
+        valueData = &expanded;
+    }
+
+    auto bufferSize = dataSize ? *dataSize : 0;
+    auto status = type_allowed(valueType, flags) ?
+        CopyOutValue(ansi, valueType, *valueData, type, static_cast<BYTE*>(data), dataSize) :
+        ERROR_UNSUPPORTED_TYPE;
+    if ((status != ERROR_SUCCESS) && (flags & RRF_ZEROONFAILURE) && data)
+    {
+        std::memset(data, 0, bufferSize);
+    }
+
+    return status;
+}
+
+overlay_result GetRedirectedValue(HKEY key, const wchar_t* valueName, DWORD flags, bool ansi, DWORD* type, void* data, DWORD* dataSize)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    std::shared_lock lock(g_overlayMutex);
+    auto itr = g_redirectedKeys.find(key);
+    if (itr == g_redirectedKeys.end())
+    {
+        return result;
+    }
+
+    auto value = find_value(itr->second.overlay, valueName);
+    if (!value)
+    {
+        return fall_through(itr->second);
+    }
+
+    result.handled = true;
+    if (value->deleted)
+    {
+        result.status = ERROR_FILE_NOT_FOUND;
+        return result;
+    }
+
+    result.status = CopyOutValueAs(flags, ansi, value->type, value->data, type, data, dataSize);
+    return result;
+}
+
+overlay_result SetRedirectedValue(HKEY key, const wchar_t* valueName, DWORD type, const BYTE* data, DWORD dataSize)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    std::unique_lock lock(g_overlayMutex);
+    auto itr = g_redirectedKeys.find(key);
+    if (itr == g_redirectedKeys.end())
+    {
+        return result;
+    }
+
+    auto& entry = itr->second;
+    if (!entry.overlay)
+    {
+        entry.overlay = create_overlay_key(entry.path);
+    }
+
+    auto& value = entry.overlay->values[iwstring(valueName ? valueName : L"")];
+    value.type = type;
+    value.data.assign(data, data + (data ? dataSize : 0));
+    value.deleted = false;
+    value.dirty = true;
+    mark_dirty(entry.overlay);
+
+    result.handled = true;
+    return result;
+}
+
+overlay_result DeleteRedirectedValue(HKEY key, const wchar_t* valueName)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    std::unique_lock lock(g_overlayMutex);
+    auto itr = g_redirectedKeys.find(key);
+    if (itr == g_redirectedKeys.end())
+    {
+        return result;
+    }
+
+    result.handled = true;
+    auto& entry = itr->second;
+    auto exists = false;
+    if (auto value = find_value(entry.overlay, valueName))
+    {
+        exists = !value->deleted;
+    }
+    else if (entry.real)
+    {
+        exists = impl::RegQueryValueEx(entry.real, valueName, nullptr, nullptr, nullptr, nullptr) == ERROR_SUCCESS;
+    }
+
+    if (!exists)
+    {
+        result.status = ERROR_FILE_NOT_FOUND;
+        return result;
+    }
+
+    if (!entry.overlay)
+    {
+        entry.overlay = create_overlay_key(entry.path);
+    }
+
+    auto& value = entry.overlay->values[iwstring(valueName ? valueName : L"")];
+    value.type = REG_NONE;
+    value.data.clear();
+    value.deleted = true;
+    value.dirty = true;
+    mark_dirty(entry.overlay);
+    return result;
+}
+
+overlay_result EnumRedirectedValue(
+    HKEY key,
+    DWORD index,
+    bool ansi,
+    void* valueName,
+    DWORD* valueNameLength,
+    DWORD* type,
+    BYTE* data,
+    DWORD* dataSize)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    std::shared_lock lock(g_overlayMutex);
+    auto itr = g_redirectedKeys.find(key);
+    if (itr == g_redirectedKeys.end())
+    {
+        return result;
+    }
+
+    // The overlay's values come first, followed by the registry's values that the overlay doesn't have
+    result.handled = true;
+    auto& entry = itr->second;
+    DWORD remaining = index;
+    if (entry.overlay)
+    {
+        for (auto& [name, value] : entry.overlay->values)
+        {
+            if (value.deleted)
+            {
+                continue;
+            }
+            else if (remaining-- == 0)
+            {
+                result.status = copy_out_name(ansi, std::wstring_view(name.data(), name.length()), valueName, valueNameLength);
+                if (result.status == ERROR_SUCCESS)
+                {
+                    result.status = CopyOutValue(ansi, value.type, value.data, type, data, dataSize);
+                }
+                return result;
+            }
+        }
+    }
+
+    if (!entry.real)
+    {
+        result.status = ERROR_NO_MORE_ITEMS;
+        return result;
+    }
+
+    std::wstring name(max_value_name_length, L'\0');
+    for (DWORD i = 0; ; ++i)
+    {
+        DWORD nameLength = max_value_name_length;
+        result.status = impl::RegEnumValue(entry.real, i, name.data(), &nameLength, nullptr, nullptr, nullptr, nullptr);
+        if (result.status != ERROR_SUCCESS)
+        {
+            return result;
+        }
+
+        if (find_value(entry.overlay, name.c_str()))
+        {
+            continue;
+        }
+        else if (remaining-- == 0)
+        {
+            result.status = ansi ?
+                impl::RegEnumValue(entry.real, i, static_cast<char*>(valueName), valueNameLength, nullptr, type, data, dataSize) :
+                impl::RegEnumValue(entry.real, i, static_cast<wchar_t*>(valueName), valueNameLength, nullptr, type, data, dataSize);
+            return result;
+        }
+    }
+}
+
+overlay_result EnumRedirectedKey(
+    HKEY key,
+    DWORD index,
+    bool ansi,
+    void* name,
+    DWORD* nameLength,
+    void* className,
+    DWORD* classLength,
+    FILETIME* lastWriteTime)
+{
+    overlay_result result;
+    result.real_key = key;
+    if (g_redirectedKeyCount.load(std::memory_order_relaxed) == 0)
+    {
+        return result;
+    }
+
+    std::shared_lock lock(g_overlayMutex);
+    auto itr = g_redirectedKeys.find(key);
+    if (itr == g_redirectedKeys.end())
+    {
+        return result;
+    }
+
+    // Same as for values, the overlay's subkeys come first
+    result.handled = true;
+    auto& entry = itr->second;
+    DWORD remaining = index;
+    if (entry.overlay && (remaining < entry.overlay->subkeys.size()))
+    {
+        auto& subkey = *std::next(entry.overlay->subkeys.begin(), remaining);
+        result.status = copy_out_name(ansi, std::wstring_view(subkey.data(), subkey.length()), name, nameLength);
+        if (className && classLength && *classLength)
+        {
+            if (ansi)
+            {
+                static_cast<char*>(className)[0] = '\0';
+            }
+            else
+            {
+                static_cast<wchar_t*>(className)[0] = L'\0';
+            }
+            *classLength = 0;
+        }
+        if (lastWriteTime)
+        {
+            *lastWriteTime = {};
+        }
+        return result;
+    }
+
+    if (!entry.real)
+    {
+        result.status = ERROR_NO_MORE_ITEMS;
+        return result;
+    }
+
+    remaining -= entry.overlay ? static_cast<DWORD>(entry.overlay->subkeys.size()) : 0;
+    wchar_t subkeyName[max_key_name_length];
+    for (DWORD i = 0; ; ++i)
+    {
+        DWORD length = max_key_name_length;
+        result.status = impl::RegEnumKeyEx(entry.real, i, subkeyName, &length, nullptr, nullptr, nullptr, nullptr);
+        if (result.status != ERROR_SUCCESS)
+        {
+            return result;
+        }
+
+        if (entry.overlay && (entry.overlay->subkeys.find(iwstring_view(subkeyName, length)) != entry.overlay->subkeys.end()))
+        {
+            continue;
+        }
+        else if (remaining-- == 0)
+        {
+            result.status = ansi ?
+                impl::RegEnumKeyEx(entry.real, i, static_cast<char*>(name), nameLength, nullptr, static_cast<char*>(className), classLength, lastWriteTime) :
+                impl::RegEnumKeyEx(entry.real, i, static_cast<wchar_t*>(name), nameLength, nullptr, static_cast<wchar_t*>(className), classLength, lastWriteTime);
+            return result;
+        }
+    }
+}
@@ -0,0 +1,91 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <windows.h>
+
+#include <pattern_matcher.h>
+#include <psf_config.h>
+
+// Keys that get matched by path, as configured by "redirectedKeys" and "cachedKeys" alike
+struct key_rule
+{
+    std::wstring key;
+    std::vector<psf::pattern_matcher> patterns; // Matched against the lower case path relative to 'key'
+};
+
+std::vector<key_rule> LoadKeyRules(const psf::json_array& rulesConfig);
+bool MatchesKeyRules(const std::vector<key_rule>& rules, const std::wstring& path);
+
+// Key paths are the short name of the root key, followed by the path from there, e.g. "HKLM\SOFTWARE\Contoso"
+std::wstring CanonicalKeyPath(std::wstring_view path);
+
+// The kernel's name of the key, e.g. "\REGISTRY\MACHINE\SOFTWARE\WOW6432Node\Contoso"
+bool NativeKeyName(HKEY key, std::wstring& name);
+
+// Copies a value out the way that RegQueryValueEx does, converting string values to the active code page for 'ansi'.
+// CopyOutValueAs does the same for RegGetValue, i.e. it also expands, filters by type, and zeroes on failure as 'flags'
+// asks for
+LSTATUS CopyOutValue(bool ansi, DWORD valueType, const std::vector<std::uint8_t>& value, DWORD* type, BYTE* data, DWORD* dataSize);
+LSTATUS CopyOutValueAs(DWORD flags, bool ansi, DWORD valueType, const std::vector<std::uint8_t>& value, DWORD* type, void* data, DWORD* dataSize);
+
+void InitializeRegistryOverlay();
+void UninitializeRegistryOverlay() noexcept;
+
+// Writes out whatever hasn't been written to the hive yet. When the process is terminating, other threads are already
+// gone, possibly in the middle of an update, so anything that can't be done without waiting on them is skipped
+void FlushRegistryOverlay(bool processTerminating = false) noexcept;
+
+// What a call on a key should do, once the overlay has had its say. If 'handled' is set, the overlay has answered the
+// call and 'status' is its result. Otherwise, the call goes to 'real_key', which is the caller's key for keys that aren't
+// redirected, or the registry's own key for redirected keys whose value the overlay doesn't have
+struct overlay_result
+{
+    bool handled = false;
+    LSTATUS status = ERROR_SUCCESS;
+    HKEY real_key = nullptr;
+};
+
+// NOTE: All names are wide. Value data is too, i.e. string values are always UTF-16, except that 'ansi' asks for
+//       them to be given back the way that the ANSI functions would (in the active code page)
+overlay_result OpenRedirectedKey(
+    HKEY key,
+    const wchar_t* subKey,
+    DWORD options,
+    REGSAM samDesired,
+    bool create,
+    LPSECURITY_ATTRIBUTES securityAttributes,
+    HKEY* result,
+    DWORD* disposition);
+overlay_result CloseRedirectedKey(HKEY key);
+
+overlay_result QueryRedirectedValue(HKEY key, const wchar_t* valueName, bool ansi, DWORD* type, BYTE* data, DWORD* dataSize);
+overlay_result GetRedirectedValue(HKEY key, const wchar_t* valueName, DWORD flags, bool ansi, DWORD* type, void* data, DWORD* dataSize);
+overlay_result SetRedirectedValue(HKEY key, const wchar_t* valueName, DWORD type, const BYTE* data, DWORD dataSize);
+overlay_result DeleteRedirectedValue(HKEY key, const wchar_t* valueName);
+
+overlay_result EnumRedirectedValue(
+    HKEY key,
+    DWORD index,
+    bool ansi,
+    void* valueName,
+    DWORD* valueNameLength,
+    DWORD* type,
+    BYTE* data,
+    DWORD* dataSize);
+overlay_result EnumRedirectedKey(
+    HKEY key,
+    DWORD index,
+    bool ansi,
+    void* name,
+    DWORD* nameLength,
+    void* className,
+    DWORD* classLength,
+    FILETIME* lastWriteTime);
@@ -0,0 +1,238 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The package's own registry (its Registry.dat) gets merged into the application's view of HKLM and HKCU, and reading
+// from it goes through the merge every time. Applications that read the same values over and over, e.g. a settings
+// lookup for every file that they open, pay for that on each call. The keys that the configuration lists as cached
+// answer RegQueryValueEx and RegGetValue from memory instead, after the first read of each value. The package's
+// registry can't change while the package is installed, so the cache never needs to be invalidated.
+//
+// Same as for redirected keys, whether a key is cached gets decided when it gets opened. Its values are cached by the
+// kernel's name of the key, so that handles to the same key share them, and the 32-bit and 64-bit views of it don't. A
+// value that isn't there is cached, too, since checking for optional values is as common as reading them.
+//
+// NOTE: Handles only leave the table when they're closed through RegCloseKey, so the cache assumes that the application
+//       doesn't close registry keys any other way (e.g. NtClose)
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "FunctionImplementations.h"
+#include "RegistryValueCache.h"
+
+struct cached_value
+{
+    LSTATUS status = ERROR_SUCCESS; // Either ERROR_SUCCESS or ERROR_FILE_NOT_FOUND
+    DWORD type = REG_NONE;
+    std::vector<std::uint8_t> data;
+};
+
+struct cached_key
+{
+    std::shared_mutex mutex;
+    std::map<iwstring, cached_value, std::less<>> values;
+};
+
+static std::vector<key_rule> g_cacheRules;
+
+// Guards everything below it. Keys are never removed from the cache, so pointers to them stay valid
+static std::shared_mutex g_cacheMutex;
+static std::unordered_map<iwstring, std::unique_ptr<cached_key>, case_insensitive_hash<wchar_t>> g_cachedKeys;
+static std::unordered_map<HKEY, cached_key*> g_cachedHandles;
+static std::atomic<std::size_t> g_cachedHandleCount = 0;
+
+void InitializeRegistryValueCache()
+{
+    auto config = ::PSFQueryCurrentDllConfig();
+    auto keysConfig = config ? config->as_object().try_get("cachedKeys") : nullptr;
+    if (keysConfig)
+    {
+        g_cacheRules = LoadKeyRules(keysConfig->as_array());
+    }
+}
+
+bool RegistryValueCacheEnabled() noexcept
+{
+    return !g_cacheRules.empty();
+}
+
+bool IsCachedKeyPath(const std::wstring& path)
+{
+    return MatchesKeyRules(g_cacheRules, path);
+}
+
+void CachedKeyOpened(HKEY key, REGSAM samDesired)
+{
+    // Without read access, there's nothing to cache, and the calls should fail the way that they would otherwise
+    if (!(samDesired & (KEY_QUERY_VALUE | MAXIMUM_ALLOWED | GENERIC_READ | GENERIC_ALL)))
+    {
+        return;
+    }
+
+    std::wstring name;
+    if (!NativeKeyName(key, name))
+    {
+        return;
+    }
+
+    std::unique_lock lock(g_cacheMutex);
+    auto& entry = g_cachedKeys[iwstring(name.data(), name.length())];
+    if (!entry)
+    {
+        entry = std::make_unique<cached_key>();
+    }
+
+    if (g_cachedHandles.insert_or_assign(key, entry.get()).second)
+    {
+        g_cachedHandleCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool CachedKeyClosed(HKEY key) noexcept
+{
+    if (g_cachedHandleCount.load(std::memory_order_relaxed) == 0)
+    {
+        return false;
+    }
+
+    std::unique_lock lock(g_cacheMutex);
+    if (g_cachedHandles.erase(key) == 0)
+    {
+        return false;
+    }
+
+    g_cachedHandleCount.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+static cached_key* find_cached_key(HKEY key)
+{
+    if (g_cachedHandleCount.load(std::memory_order_relaxed) == 0)
+    {
+        return nullptr;
+    }
+
+    std::shared_lock lock(g_cacheMutex);
+    auto itr = g_cachedHandles.find(key);
+    return (itr != g_cachedHandles.end()) ? itr->second : nullptr;
+}
+
+// Reads the value from the registry, the way that the overlay keeps values, i.e. with strings as UTF-16. Only answers
+// that can't change get cached; anything else (e.g. ERROR_ACCESS_DENIED) is left for the caller's own call to give back
+static bool read_value(HKEY key, const wchar_t* valueName, cached_value& value)
+{
+    DWORD size = 0;
+    auto status = impl::RegQueryValueEx(key, valueName, nullptr, &value.type, nullptr, &size);
+    while (status == ERROR_SUCCESS)
+    {
+        value.data.resize(size);
+        status = impl::RegQueryValueEx(key, valueName, nullptr, &value.type, value.data.data(), &size);
+        if (status == ERROR_SUCCESS)
+        {
+            value.data.resize(size);
+            break;
+        }
+        else if (status == ERROR_MORE_DATA)
+        {
+            status = ERROR_SUCCESS;
+        }
+    }
+
+    if (status == ERROR_FILE_NOT_FOUND)
+    {
+        value.type = REG_NONE;
+        value.data.clear();
+    }
+
+    value.status = status;
+    return (status == ERROR_SUCCESS) || (status == ERROR_FILE_NOT_FOUND);
+}
+
+// Looks the value up, reading it into the cache if this is the first time that it gets asked for, and hands it to
+// 'copyOut' while the key is locked
+template <typename CopyFunc>
+static overlay_result with_cached_value(HKEY key, const wchar_t* valueName, CopyFunc&& copyOut)
+{
+    overlay_result result;
+    result.real_key = key;
+    auto cachedKey = find_cached_key(key);
+    if (!cachedKey)
+    {
+        return result;
+    }
+
+    iwstring_view name(valueName ? valueName : L"");
+    {
+        std::shared_lock lock(cachedKey->mutex);
+        auto itr = cachedKey->values.find(name);
+        if (itr != cachedKey->values.end())
+        {
+            result.handled = true;
+            result.status = copyOut(itr->second);
+            return result;
+        }
+    }
+
+    cached_value value;
+    if (!read_value(key, valueName, value))
+    {
+        return result;
+    }
+
+    std::unique_lock lock(cachedKey->mutex);
+    auto itr = cachedKey->values.emplace(iwstring(name.data(), name.length()), std::move(value)).first;
+    result.handled = true;
+    result.status = copyOut(itr->second);
+    return result;
+}
+
+overlay_result QueryCachedValue(HKEY key, const wchar_t* valueName, bool ansi, DWORD* type, BYTE* data, DWORD* dataSize)
+{
+    return with_cached_value(key, valueName, [&](const cached_value& value)
+    {
+        return (value.status == ERROR_SUCCESS) ? CopyOutValue(ansi, value.type, value.data, type, data, dataSize) : value.status;
+    });
+}
+
+overlay_result GetCachedValue(HKEY key, const wchar_t* valueName, DWORD flags, bool ansi, DWORD* type, void* data, DWORD* dataSize)
+{
+    return with_cached_value(key, valueName, [&](const cached_value& value)
+    {
+        if (value.status == ERROR_SUCCESS)
+        {
+            return CopyOutValueAs(flags, ansi, value.type, value.data, type, data, dataSize);
+        }
+
+        if ((flags & RRF_ZEROONFAILURE) && data && dataSize)
+        {
+            std::memset(data, 0, *dataSize);
+        }
+        return value.status;
+    });
+}
+
+void CachedValueChanged(HKEY key, const wchar_t* valueName)
+{
+    if (auto cachedKey = find_cached_key(key))
+    {
+        std::unique_lock lock(cachedKey->mutex);
+        auto itr = cachedKey->values.find(iwstring_view(valueName ? valueName : L""));
+        if (itr != cachedKey->values.end())
+        {
+            cachedKey->values.erase(itr);
+        }
+    }
+}
@@ -0,0 +1,27 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <string>
+
+#include <windows.h>
+
+#include "RegistryOverlay.h"
+
+void InitializeRegistryValueCache();
+bool RegistryValueCacheEnabled() noexcept;
+
+// Whether the values of the key get cached, as decided by its path when it gets opened
+bool IsCachedKeyPath(const std::wstring& path);
+void CachedKeyOpened(HKEY key, REGSAM samDesired);
+bool CachedKeyClosed(HKEY key) noexcept;
+
+// Same as the overlay's functions (see RegistryOverlay.h), except that there's no 'real_key' to fall through to. A call
+// that isn't handled goes to the caller's key
+overlay_result QueryCachedValue(HKEY key, const wchar_t* valueName, bool ansi, DWORD* type, BYTE* data, DWORD* dataSize);
+overlay_result GetCachedValue(HKEY key, const wchar_t* valueName, DWORD flags, bool ansi, DWORD* type, void* data, DWORD* dataSize);
+
+// The cached keys are expected to be read-only, but in case one of them isn't, a write drops what the cache has
+void CachedValueChanged(HKEY key, const wchar_t* valueName);
@@ -0,0 +1,52 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <psf_framework.h>
+
+#include "RegistryOverlay.h"
+#include "RegistryValueCache.h"
+
+extern "C" {
+
+int __stdcall PSFInitialize() noexcept try
+{
+    InitializeRegistryOverlay();
+    InitializeRegistryValueCache();
+    psf::attach_all();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+int __stdcall PSFUninitialize() noexcept try
+{
+    psf::detach_all();
+    UninitializeRegistryOverlay();
+    return ERROR_SUCCESS;
+}
+catch (...)
+{
+    return win32_from_caught_exception();
+}
+
+// The process is going away, so the detours can stay, but the writes that haven't made it to the hive yet need to
+void __stdcall PSFProcessTerminating() noexcept
+{
+    FlushRegistryOverlay(true);
+}
+
+#ifdef _M_IX86
+#pragma comment(linker, "/EXPORT:PSFInitialize=_PSFInitialize@0")
+#pragma comment(linker, "/EXPORT:PSFUninitialize=_PSFUninitialize@0")
+#pragma comment(linker, "/EXPORT:PSFProcessTerminating=_PSFProcessTerminating@0")
+#else
+#pragma comment(linker, "/EXPORT:PSFInitialize=PSFInitialize")
+#pragma comment(linker, "/EXPORT:PSFUninitialize=PSFUninitialize")
+#pragma comment(linker, "/EXPORT:PSFProcessTerminating=PSFProcessTerminating")
+#endif
+
+}
@@ -0,0 +1,287 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Helpers for processing strings that are (most likely) ASCII several characters at a time. Nearly every path and
+// configuration string that we see is pure ASCII, so these are used as fast paths in front of the slower, per-character
+// implementations (and the Win32 code page conversion functions), which are still needed for everything else. SSE2 is
+// used on x86/x64 and NEON on ARM64; other architectures process one character at a time
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define PSF_ASCII_SSE2 1
+#include <emmintrin.h>
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define PSF_ASCII_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace psf
+{
+    static_assert(sizeof(wchar_t) == sizeof(std::uint16_t));
+
+    namespace details
+    {
+        inline constexpr wchar_t ascii_fold(wchar_t ch, bool foldSeparators) noexcept
+        {
+            if ((ch >= L'A') && (ch <= L'Z'))
+            {
+                return static_cast<wchar_t>(ch + (L'a' - L'A'));
+            }
+
+            return (foldSeparators && (ch == L'/')) ? L'\\' : ch;
+        }
+
+        inline unsigned count_trailing_zeros(unsigned value) noexcept
+        {
+            assert(value != 0);
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, value);
+            return index;
+#else
+            return static_cast<unsigned>(__builtin_ctz(value));
+#endif
+        }
+
+        // The index of the most significant bit that is set
+        inline unsigned highest_set_bit(unsigned value) noexcept
+        {
+            assert(value != 0);
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanReverse(&index, value);
+            return index;
+#else
+            return 31 - static_cast<unsigned>(__builtin_clz(value));
+#endif
+        }
+
+#if PSF_ASCII_NEON
+        // NEON has no equivalent to movemask, so masks built from it are 64 bits wide (see dos_paths.h)
+        inline unsigned count_trailing_zeros(std::uint64_t value) noexcept
+        {
+            assert(value != 0);
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, value);
+            return index;
+#else
+            return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+        }
+
+        inline unsigned highest_set_bit(std::uint64_t value) noexcept
+        {
+            assert(value != 0);
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanReverse64(&index, value);
+            return index;
+#else
+            return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+        }
+#endif
+    }
+
+    // Returns the length of the longest prefix of the first 'count' characters of 'lhs' and 'rhs' that are known to be
+    // equal after ASCII case folding (and, if FoldSeparators is true, after treating '/' and '\' as equal). Scanning
+    // stops at the first mismatch _or_ the first non-ASCII character, whichever comes first, so callers need to resolve
+    // the character at the returned index with their own comparison before continuing
+    template <bool FoldSeparators = false>
+    inline std::size_t ascii_iequal_prefix(const wchar_t* lhs, const wchar_t* rhs, std::size_t count) noexcept
+    {
+        std::size_t index = 0;
+
+#if PSF_ASCII_SSE2
+        const auto beforeUpperA = _mm_set1_epi16(L'A' - 1);
+        const auto afterUpperZ = _mm_set1_epi16(L'Z' + 1);
+        const auto caseBit = _mm_set1_epi16(0x20);
+        const auto nonAsciiBits = _mm_set1_epi16(static_cast<short>(0xFF80));
+        auto fold = [&](__m128i value) noexcept
+        {
+            // NOTE: The comparisons are signed, so anything at or above 0x8000 is never considered upper case
+            auto isUpper = _mm_and_si128(_mm_cmpgt_epi16(value, beforeUpperA), _mm_cmplt_epi16(value, afterUpperZ));
+            value = _mm_or_si128(value, _mm_and_si128(isUpper, caseBit));
+            if constexpr (FoldSeparators)
+            {
+                auto isSlash = _mm_cmpeq_epi16(value, _mm_set1_epi16(L'/'));
+                value = _mm_or_si128(_mm_andnot_si128(isSlash, value), _mm_and_si128(isSlash, _mm_set1_epi16(L'\\')));
+            }
+            return value;
+        };
+
+        for (; index + 8 <= count; index += 8)
+        {
+            auto left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + index));
+            auto right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + index));
+            auto isAscii = _mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(left, right), nonAsciiBits), _mm_setzero_si128());
+            auto isEqual = _mm_and_si128(_mm_cmpeq_epi16(fold(left), fold(right)), isAscii);
+
+            // Each character contributes two bits to the mask
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(isEqual));
+            if (mask != 0xFFFF)
+            {
+                return index + details::count_trailing_zeros(~mask) / 2;
+            }
+        }
+#elif PSF_ASCII_NEON
+        const auto upperA = vdupq_n_u16(L'A');
+        const auto letterCount = vdupq_n_u16(26);
+        const auto caseBit = vdupq_n_u16(0x20);
+        const auto nonAsciiBits = vdupq_n_u16(0xFF80);
+        auto fold = [&](uint16x8_t value) noexcept
+        {
+            auto isUpper = vcltq_u16(vsubq_u16(value, upperA), letterCount);
+            value = vorrq_u16(value, vandq_u16(isUpper, caseBit));
+            if constexpr (FoldSeparators)
+            {
+                value = vbslq_u16(vceqq_u16(value, vdupq_n_u16(L'/')), vdupq_n_u16(L'\\'), value);
+            }
+            return value;
+        };
+
+        for (; index + 8 <= count; index += 8)
+        {
+            auto left = vld1q_u16(reinterpret_cast<const std::uint16_t*>(lhs + index));
+            auto right = vld1q_u16(reinterpret_cast<const std::uint16_t*>(rhs + index));
+            auto isAscii = vceqq_u16(vandq_u16(vorrq_u16(left, right), nonAsciiBits), vdupq_n_u16(0));
+            auto isEqual = vandq_u16(vceqq_u16(fold(left), fold(right)), isAscii);
+            if (vminvq_u16(isEqual) != 0xFFFF)
+            {
+                // The loop below finds the exact position
+                break;
+            }
+        }
+#endif
+
+        for (; index < count; ++index)
+        {
+            auto left = lhs[index];
+            auto right = rhs[index];
+            if (((left | right) & 0xFF80) ||
+                (details::ascii_fold(left, FoldSeparators) != details::ascii_fold(right, FoldSeparators)))
+            {
+                break;
+            }
+        }
+
+        return index;
+    }
+
+    // Widens the longest pure-ASCII prefix of the first 'count' bytes of 'src' into 'dest', which must have room for at
+    // least 'count' characters. Returns the number of characters written, which is also the index of the first
+    // non-ASCII byte (or 'count' if there is none). ASCII has the same encoding in UTF-8 and in every ANSI code page, so
+    // callers only need to convert the remainder, if any, using the code page
+    inline std::size_t ascii_widen_prefix(const char* src, std::size_t count, wchar_t* dest) noexcept
+    {
+        std::size_t index = 0;
+
+#if PSF_ASCII_SSE2
+        for (; index + 16 <= count; index += 16)
+        {
+            auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + index));
+            if (auto mask = static_cast<unsigned>(_mm_movemask_epi8(bytes)))
+            {
+                // The mask holds the high bit of each byte; widen everything before the first one that's set
+                auto asciiCount = details::count_trailing_zeros(mask);
+                for (unsigned i = 0; i < asciiCount; ++i)
+                {
+                    dest[index + i] = static_cast<wchar_t>(src[index + i]);
+                }
+                return index + asciiCount;
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + index), _mm_unpacklo_epi8(bytes, _mm_setzero_si128()));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + index + 8), _mm_unpackhi_epi8(bytes, _mm_setzero_si128()));
+        }
+#elif PSF_ASCII_NEON
+        for (; index + 16 <= count; index += 16)
+        {
+            auto bytes = vld1q_u8(reinterpret_cast<const std::uint8_t*>(src + index));
+            if (vmaxvq_u8(bytes) >= 0x80)
+            {
+                // The loop below finds the exact position
+                break;
+            }
+
+            vst1q_u16(reinterpret_cast<std::uint16_t*>(dest + index), vmovl_u8(vget_low_u8(bytes)));
+            vst1q_u16(reinterpret_cast<std::uint16_t*>(dest + index + 8), vmovl_high_u8(bytes));
+        }
+#endif
+
+        for (; index < count; ++index)
+        {
+            auto ch = static_cast<unsigned char>(src[index]);
+            if (ch >= 0x80)
+            {
+                break;
+            }
+
+            dest[index] = static_cast<wchar_t>(ch);
+        }
+
+        return index;
+    }
+
+    // The inverse of ascii_widen_prefix: narrows the longest pure-ASCII prefix of the first 'count' characters of 'src'
+    // into 'dest', which must have room for at least 'count' bytes, and returns the number of bytes written
+    inline std::size_t ascii_narrow_prefix(const wchar_t* src, std::size_t count, char* dest) noexcept
+    {
+        std::size_t index = 0;
+
+#if PSF_ASCII_SSE2
+        const auto nonAsciiBits = _mm_set1_epi16(static_cast<short>(0xFF80));
+        for (; index + 16 <= count; index += 16)
+        {
+            auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + index));
+            auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + index + 8));
+            auto nonAscii = _mm_and_si128(_mm_or_si128(low, high), nonAsciiBits);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) != 0xFFFF)
+            {
+                // The loop below finds the exact position
+                break;
+            }
+
+            // Every value is below 0x80, so the saturating pack is just a truncation
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + index), _mm_packus_epi16(low, high));
+        }
+#elif PSF_ASCII_NEON
+        for (; index + 16 <= count; index += 16)
+        {
+            auto low = vld1q_u16(reinterpret_cast<const std::uint16_t*>(src + index));
+            auto high = vld1q_u16(reinterpret_cast<const std::uint16_t*>(src + index + 8));
+            if (vmaxvq_u16(vorrq_u16(low, high)) >= 0x80)
+            {
+                // The loop below finds the exact position
+                break;
+            }
+
+            vst1q_u8(reinterpret_cast<std::uint8_t*>(dest + index), vcombine_u8(vmovn_u16(low), vmovn_u16(high)));
+        }
+#endif
+
+        for (; index < count; ++index)
+        {
+            auto ch = src[index];
+            if (static_cast<std::uint16_t>(ch) >= 0x80)
+            {
+                break;
+            }
+
+            dest[index] = static_cast<char>(ch);
+        }
+
+        return index;
+    }
+}
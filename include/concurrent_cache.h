@@ -0,0 +1,342 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A bounded, thread-safe map for fixups that cache the results of expensive work (e.g. path decisions, attribute queries,
+// or per-handle state) across threads. Entries are spread over a number of shards by their hash, each with its own
+// reader-writer lock, so lookups only ever contend with writes to the same shard, and lookups of different keys mostly
+// don't contend at all. Once a shard is full, adding to it evicts an entry that hasn't been looked up since the clock
+// hand last passed it (i.e. CLOCK, which approximates least recently used without lookups having to write anything other
+// than a flag). Entries live on the PSF's private heap (see psf_heap.h). Use might look like:
+//      psf::concurrent_cache<std::wstring, DWORD> g_attributeCache(4096);
+//      DWORD attributes;
+//      if (!g_attributeCache.try_get(path, attributes))
+//      {
+//          attributes = ...;
+//          g_attributeCache.insert_or_assign(path, attributes);
+//      }
+// Hits, misses, and evictions are counted per shard, and fill_live_counter_entry turns them into a live counter entry
+// (see PSFRegisterLiveCounters). Caches that are usually empty can check 'empty' first, which doesn't take any locks.
+// NOTE: Values are copied out of the cache, so large values are best held through a std::shared_ptr, or read in place
+//       with visit. The callbacks that visit, update, and erase_if take get called with the shard's lock held, and so
+//       must not call back into the cache
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "psf_heap.h"
+#include "psf_runtime.h"
+
+namespace psf
+{
+    struct cache_statistics
+    {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t insertions = 0;
+        std::uint64_t evictions = 0;
+        std::size_t size = 0;
+    };
+
+    // For a fixup's PSFLiveCountersProc. 'calls' is the number of lookups, and the values are the hits, misses,
+    // evictions, and current size, in that order
+    inline void fill_live_counter_entry(std::string_view name, const cache_statistics& statistics, psf_live_counter_entry& entry) noexcept
+    {
+        name.copy(entry.api, sizeof(entry.api) - 1);
+        entry.calls = statistics.hits + statistics.misses;
+        entry.values[0] = statistics.hits;
+        entry.values[1] = statistics.misses;
+        entry.values[2] = statistics.evictions;
+        entry.values[3] = statistics.size;
+    }
+
+    template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+    class concurrent_cache
+    {
+    public:
+
+        static constexpr std::size_t default_shard_count = 16;
+
+        // The capacity gets split evenly between the shards, which get rounded up to a power of two, so the cache may
+        // hold slightly more than 'capacity' entries, and always holds at least one per shard
+        explicit concurrent_cache(std::size_t capacity, std::size_t shardCount = default_shard_count)
+        {
+            std::size_t count = 1;
+            while (count < shardCount)
+            {
+                count <<= 1;
+            }
+
+            m_shardMask = count - 1;
+            m_shardCapacity = (std::max)((capacity + count - 1) / count, std::size_t{ 1 });
+            m_shards = std::make_unique<cache_shard[]>(count);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                m_shards[i].entries.reserve(m_shardCapacity);
+                m_shards[i].clock.reserve(m_shardCapacity);
+            }
+        }
+
+        concurrent_cache(const concurrent_cache&) = delete;
+        concurrent_cache& operator=(const concurrent_cache&) = delete;
+
+        std::size_t capacity() const noexcept
+        {
+            return m_shardCapacity * (m_shardMask + 1);
+        }
+
+        // A single atomic load. Entries that another thread is adding or removing may or may not be counted yet
+        bool empty() const noexcept
+        {
+            return m_size.load(std::memory_order_relaxed) == 0;
+        }
+
+        // Copies the value out, if there is one
+        bool try_get(const Key& key, Value& value) const
+        {
+            return visit(key, [&](const Value& cachedValue)
+            {
+                value = cachedValue;
+            });
+        }
+
+        // Calls 'fn' with the value, if there is one, with the shard's lock held for read
+        template <typename Fn>
+        bool visit(const Key& key, Fn&& fn) const
+        {
+            auto hash = Hash{}(key);
+            auto& shard = shard_for(hash);
+
+            std::shared_lock lock(shard.mutex);
+            auto itr = shard.entries.find(key);
+            if (itr == shard.entries.end())
+            {
+                shard.misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // NOTE: Readers only ever set the flag, and only the clock hand clears it, with the lock held exclusively,
+            //       so there's nothing to order and relaxed is enough. Checked first to keep the cache line shared
+            if (!itr->second.referenced.load(std::memory_order_relaxed))
+            {
+                itr->second.referenced.store(true, std::memory_order_relaxed);
+            }
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+            fn(static_cast<const Value&>(itr->second.value));
+            return true;
+        }
+
+        // Calls 'fn' with the value, if there is one, with the shard's lock held exclusively, so that the value can be
+        // changed in place. Counts as a lookup of the entry
+        template <typename Fn>
+        bool update(const Key& key, Fn&& fn)
+        {
+            auto hash = Hash{}(key);
+            auto& shard = shard_for(hash);
+
+            std::unique_lock lock(shard.mutex);
+            auto itr = shard.entries.find(key);
+            if (itr == shard.entries.end())
+            {
+                return false;
+            }
+
+            itr->second.referenced.store(true, std::memory_order_relaxed);
+            fn(itr->second.value);
+            return true;
+        }
+
+        // New entries start out as not having been looked up, so an entry that never gets looked up is the first to go
+        void insert_or_assign(Key key, Value value)
+        {
+            auto hash = Hash{}(key);
+            auto& shard = shard_for(hash);
+
+            std::unique_lock lock(shard.mutex);
+            if (auto itr = shard.entries.find(key); itr != shard.entries.end())
+            {
+                itr->second.value = std::move(value);
+                return;
+            }
+
+            if (shard.clock.size() < m_shardCapacity)
+            {
+                auto itr = shard.entries.try_emplace(std::move(key), std::move(value)).first;
+                itr->second.clock_index = shard.clock.size();
+                shard.clock.push_back(&*itr);
+                m_size.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                // Each entry gets passed over at most once before its flag is clear, so this takes at most two laps
+                for (;; shard.hand = (shard.hand + 1) % shard.clock.size())
+                {
+                    auto victim = shard.clock[shard.hand];
+                    if (!victim->second.referenced.exchange(false, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+
+                shard.entries.erase(shard.entries.find(shard.clock[shard.hand]->first));
+                auto itr = shard.entries.try_emplace(std::move(key), std::move(value)).first;
+                itr->second.clock_index = shard.hand;
+                shard.clock[shard.hand] = &*itr;
+                shard.hand = (shard.hand + 1) % shard.clock.size();
+                shard.evictions.store(shard.evictions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+            shard.insertions.store(shard.insertions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        bool erase(const Key& key)
+        {
+            auto hash = Hash{}(key);
+            auto& shard = shard_for(hash);
+
+            std::unique_lock lock(shard.mutex);
+            auto itr = shard.entries.find(key);
+            if (itr == shard.entries.end())
+            {
+                return false;
+            }
+
+            erase_entry(shard, itr);
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // Removes every entry for which 'pred(key, value)' returns true, one shard at a time
+        template <typename Pred>
+        std::size_t erase_if(Pred&& pred)
+        {
+            std::size_t result = 0;
+            for (std::size_t i = 0; i <= m_shardMask; ++i)
+            {
+                auto& shard = m_shards[i];
+                std::unique_lock lock(shard.mutex);
+                for (auto itr = shard.entries.begin(); itr != shard.entries.end(); )
+                {
+                    if (pred(static_cast<const Key&>(itr->first), static_cast<const Value&>(itr->second.value)))
+                    {
+                        itr = erase_entry(shard, itr);
+                        ++result;
+                    }
+                    else
+                    {
+                        ++itr;
+                    }
+                }
+            }
+
+            m_size.fetch_sub(result, std::memory_order_relaxed);
+            return result;
+        }
+
+        void clear()
+        {
+            for (std::size_t i = 0; i <= m_shardMask; ++i)
+            {
+                auto& shard = m_shards[i];
+                std::unique_lock lock(shard.mutex);
+                m_size.fetch_sub(shard.entries.size(), std::memory_order_relaxed);
+                shard.entries.clear();
+                shard.clock.clear();
+                shard.hand = 0;
+            }
+        }
+
+        // Totals since the cache was created. Each shard is read separately, so the totals may be slightly out of step
+        // with one another while the cache is in use
+        cache_statistics statistics() const
+        {
+            cache_statistics result;
+            for (std::size_t i = 0; i <= m_shardMask; ++i)
+            {
+                auto& shard = m_shards[i];
+                result.hits += shard.hits.load(std::memory_order_relaxed);
+                result.misses += shard.misses.load(std::memory_order_relaxed);
+                result.insertions += shard.insertions.load(std::memory_order_relaxed);
+                result.evictions += shard.evictions.load(std::memory_order_relaxed);
+
+                std::shared_lock lock(shard.mutex);
+                result.size += shard.entries.size();
+            }
+
+            return result;
+        }
+
+    private:
+
+        struct entry
+        {
+            entry(Value&& initialValue) :
+                value(std::move(initialValue))
+            {
+            }
+
+            Value value;
+            std::size_t clock_index = 0;
+            mutable std::atomic<bool> referenced = false;
+        };
+
+        using map_type = std::unordered_map<Key, entry, Hash, KeyEqual, heap_allocator<std::pair<const Key, entry>>>;
+        using map_node = typename map_type::value_type;
+
+        // NOTE: Cache line aligned so that lookups in one shard don't slow down lookups in the ones next to it
+        struct alignas(64) cache_shard
+        {
+            mutable std::shared_mutex mutex;
+            map_type entries;
+
+            // The entries in the order that the clock hand visits them. Map nodes never move, so these stay valid until
+            // the entry gets erased
+            std::vector<map_node*, heap_allocator<map_node*>> clock;
+            std::size_t hand = 0;
+
+            mutable std::atomic<std::uint64_t> hits = 0;
+            mutable std::atomic<std::uint64_t> misses = 0;
+            std::atomic<std::uint64_t> insertions = 0;
+            std::atomic<std::uint64_t> evictions = 0;
+        };
+
+        cache_shard& shard_for(std::size_t hash) const noexcept
+        {
+            // The maps pick their buckets from the low bits of the hash, so the shard comes from the high bits instead
+            auto mixed = static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+            return m_shards[static_cast<std::size_t>(mixed >> 40) & m_shardMask];
+        }
+
+        // Called with the shard's lock held exclusively. The last entry in the clock takes the erased one's place
+        static typename map_type::iterator erase_entry(cache_shard& shard, typename map_type::iterator itr)
+        {
+            auto index = itr->second.clock_index;
+            auto last = shard.clock.back();
+            shard.clock[index] = last;
+            last->second.clock_index = index;
+            shard.clock.pop_back();
+            if (shard.hand >= shard.clock.size())
+            {
+                shard.hand = 0;
+            }
+
+            return shard.entries.erase(itr);
+        }
+
+        std::size_t m_shardMask = 0;
+        std::size_t m_shardCapacity = 0;
+        std::unique_ptr<cache_shard[]> m_shards;
+        std::atomic<std::size_t> m_size = 0;
+    };
+}
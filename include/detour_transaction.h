@@ -37,6 +37,15 @@ namespace detours
             }
         }
 
+        // Suspends every other thread in the process until the transaction completes, rather than just the ones passed
+        // to DetourUpdateThread, which is what it takes to safely patch code that the application may be running. Call
+        // this right before commit, after the DetourAttach/DetourDetach calls, to keep the threads suspended for as little
+        // time as possible
+        void suspend_all_threads()
+        {
+            check_win32(::DetourUpdateAllThreads());
+        }
+
         void commit()
         {
             assert(m_abort);
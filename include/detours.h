@@ -476,6 +476,9 @@ LONG WINAPI DetourTransactionCommit(VOID);
 LONG WINAPI DetourTransactionCommitEx(_Out_opt_ PVOID **pppFailedPointer);
 
 LONG WINAPI DetourUpdateThread(_In_ HANDLE hThread);
+LONG WINAPI DetourUpdateAllThreads(VOID);
+VOID WINAPI DetourGetLastSuspension(_Out_opt_ DWORD *pnThreads,
+                                    _Out_opt_ ULONGLONG *pnMicroseconds);
 
 LONG WINAPI DetourAttach(_Inout_ PVOID *ppPointer,
                          _In_ PVOID pDetour);
@@ -493,6 +496,11 @@ BOOL WINAPI DetourSetIgnoreTooSmall(_In_ BOOL fIgnore);
 BOOL WINAPI DetourSetRetainRegions(_In_ BOOL fRetain);
 PVOID WINAPI DetourSetSystemRegionLowerBound(_In_ PVOID pSystemRegionLowerBound);
 PVOID WINAPI DetourSetSystemRegionUpperBound(_In_ PVOID pSystemRegionUpperBound);
+BOOL WINAPI DetourSetPrologueCache(_In_reads_bytes_opt_(cbCache) PVOID pvCache,
+                                   _In_ DWORD cbCache,
+                                   _In_ BOOL fRecord);
+DWORD WINAPI DetourGetPrologueCache(_Out_writes_bytes_opt_(cbBuffer) PVOID pvBuffer,
+                                    _In_ DWORD cbBuffer);
 
 ////////////////////////////////////////////////////////////// Code Functions.
 //
@@ -517,6 +525,8 @@ ULONG WINAPI DetourGetModuleSize(_In_opt_ HMODULE hModule);
 BOOL WINAPI DetourEnumerateExports(_In_ HMODULE hModule,
                                    _In_opt_ PVOID pContext,
                                    _In_ PF_DETOUR_ENUMERATE_EXPORT_CALLBACK pfExport);
+PVOID WINAPI DetourFindExport(_In_opt_ HMODULE hModule,
+                              _In_ LPCSTR pszFunction);
 BOOL WINAPI DetourEnumerateImports(_In_opt_ HMODULE hModule,
                                    _In_opt_ PVOID pContext,
                                    _In_opt_ PF_DETOUR_IMPORT_FILE_CALLBACK pfImportFile,
@@ -744,6 +754,8 @@ BOOL WINAPI DetourUpdateProcessWithDllEx(_In_ HANDLE hProcess,
                                          _In_reads_(nDlls) LPCSTR *rlpDlls,
                                          _In_ DWORD nDlls);
 
+BOOL WINAPI DetourSetReuseImportPatches(_In_ BOOL fReuse);
+
 BOOL WINAPI DetourCopyPayloadToProcess(_In_ HANDLE hProcess,
                                        _In_ REFGUID rguid,
                                        _In_reads_bytes_(cbData) PVOID pvData,
@@ -4,12 +4,18 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cwctype>
 #include <string>
+#include <string_view>
 
 #include <windows.h>
 
+#include "ascii_simd.h"
+#include "path_buffer.h"
+
 namespace psf
 {
     template <typename CharT>
@@ -32,6 +38,129 @@ namespace psf
         }
     };
 
+    // Equivalent to std::equal(lhs, lhs + count, rhs, path_compare{}), but compares runs of ASCII characters several at a
+    // time. Both strings must have at least 'count' characters
+    inline bool path_equal(const wchar_t* lhs, const wchar_t* rhs, std::size_t count)
+    {
+        for (std::size_t index = 0; ; ++index)
+        {
+            index += ascii_iequal_prefix<true>(lhs + index, rhs + index, count - index);
+            if (index == count)
+            {
+                return true;
+            }
+            else if (!path_compare{}(lhs[index], rhs[index]))
+            {
+                return false;
+            }
+        }
+    }
+
+    namespace details
+    {
+        // Returns a mask with 'path_char_mask_stride' bits set for each of the 8 characters starting at 'str' that is
+        // equal to one of Chars, with the first character in the least significant bits
+#if PSF_ASCII_SSE2
+        using path_char_mask = unsigned;
+        inline constexpr unsigned path_char_mask_stride = 2;
+
+        template <wchar_t... Chars>
+        inline path_char_mask match_path_chars(const wchar_t* str) noexcept
+        {
+            auto value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str));
+            auto matches = _mm_setzero_si128();
+            ((matches = _mm_or_si128(matches, _mm_cmpeq_epi16(value, _mm_set1_epi16(static_cast<short>(Chars))))), ...);
+            return static_cast<unsigned>(_mm_movemask_epi8(matches));
+        }
+#elif PSF_ASCII_NEON
+        using path_char_mask = std::uint64_t;
+        inline constexpr unsigned path_char_mask_stride = 8;
+
+        template <wchar_t... Chars>
+        inline path_char_mask match_path_chars(const wchar_t* str) noexcept
+        {
+            auto value = vld1q_u16(reinterpret_cast<const std::uint16_t*>(str));
+            auto matches = vdupq_n_u16(0);
+            ((matches = vorrq_u16(matches, vceqq_u16(value, vdupq_n_u16(static_cast<std::uint16_t>(Chars))))), ...);
+
+            // Each lane is either all ones or all zeros, so narrowing them to bytes loses nothing
+            return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(matches)), 0);
+        }
+#endif
+    }
+
+    // Equivalent to str.find_first_of/find_last_of with Chars as the set of characters to search for, but checks eight
+    // characters at a time. Paths regularly get into the hundreds of characters, and these scans happen several times
+    // per call to a fixup, so it's worth it
+    template <wchar_t... Chars>
+    inline std::size_t find_first_path_char(std::wstring_view str, std::size_t pos = 0) noexcept
+    {
+        auto data = str.data();
+        auto count = str.length();
+#if PSF_ASCII_SSE2 || PSF_ASCII_NEON
+        for (; pos + 8 <= count; pos += 8)
+        {
+            if (auto mask = details::match_path_chars<Chars...>(data + pos))
+            {
+                return pos + details::count_trailing_zeros(mask) / details::path_char_mask_stride;
+            }
+        }
+#endif
+
+        for (; pos < count; ++pos)
+        {
+            if (((data[pos] == Chars) || ...))
+            {
+                return pos;
+            }
+        }
+
+        return std::wstring_view::npos;
+    }
+
+    template <wchar_t... Chars>
+    inline std::size_t find_last_path_char(std::wstring_view str, std::size_t pos = std::wstring_view::npos) noexcept
+    {
+        if (str.empty())
+        {
+            return std::wstring_view::npos;
+        }
+
+        // One past the last character to consider
+        auto data = str.data();
+        auto end = (std::min)(pos, str.length() - 1) + 1;
+#if PSF_ASCII_SSE2 || PSF_ASCII_NEON
+        for (; end >= 8; end -= 8)
+        {
+            if (auto mask = details::match_path_chars<Chars...>(data + end - 8))
+            {
+                return end - 8 + details::highest_set_bit(mask) / details::path_char_mask_stride;
+            }
+        }
+#endif
+
+        while (end > 0)
+        {
+            --end;
+            if (((data[end] == Chars) || ...))
+            {
+                return end;
+            }
+        }
+
+        return std::wstring_view::npos;
+    }
+
+    inline std::size_t find_path_separator(std::wstring_view str, std::size_t pos = 0) noexcept
+    {
+        return find_first_path_char<L'\\', L'/'>(str, pos);
+    }
+
+    inline std::size_t find_last_path_separator(std::wstring_view str, std::size_t pos = std::wstring_view::npos) noexcept
+    {
+        return find_last_path_char<L'\\', L'/'>(str, pos);
+    }
+
     enum class dos_path_type
     {
         unknown,
@@ -126,4 +255,375 @@ namespace psf
         buffer.resize(len);
         return buffer;
     }
+
+    namespace details
+    {
+        // Calls 'getString' (e.g. GetFullPathName or GetCurrentDirectory) into the buffer, growing it and trying again if
+        // the string doesn't fit
+        // NOTE: On success, these functions return the length of the string, not including the null terminator. If the
+        //       buffer is too small, they instead return the required size, _including_ the null terminator
+        template <typename CharT, std::size_t InlineCapacity, typename GetStringT>
+        inline DWORD try_win32_string_into(basic_path_buffer<CharT, InlineCapacity>& buffer, GetStringT&& getString) noexcept
+        {
+            buffer.resize(buffer.capacity());
+            DWORD len = getString(static_cast<DWORD>(buffer.length() + 1), buffer.data());
+            if (len > buffer.length())
+            {
+                if (!buffer.try_resize(len - 1))
+                {
+                    buffer.clear();
+                    return ERROR_OUTOFMEMORY;
+                }
+
+                len = getString(len, buffer.data());
+            }
+
+            if (!len || (len > buffer.length()))
+            {
+                // NOTE: The length can only grow in between calls if e.g. the current directory changed underneath us
+                auto err = len ? ERROR_BUFFER_OVERFLOW : ::GetLastError();
+                buffer.clear();
+                return err;
+            }
+
+            buffer.resize(len);
+            return ERROR_SUCCESS;
+        }
+    }
+
+    // Equivalent to full_path, but writes to the caller's buffer so that we avoid allocating in the common case, and
+    // reports errors - including a failure to allocate - through the return value instead of throwing. The buffer is
+    // left empty on failure
+    template <typename CharT, std::size_t InlineCapacity>
+    inline DWORD try_full_path_into(const CharT* path, basic_path_buffer<CharT, InlineCapacity>& buffer) noexcept
+    {
+        assert(path_type(path) != dos_path_type::root_local_device);
+        return details::try_win32_string_into(buffer, [&](DWORD length, CharT* data) noexcept
+        {
+            return get_full_path_name(path, length, data);
+        });
+    }
+
+    // Wrapper around GetCurrentDirectory with the same conventions as try_full_path_into
+    template <std::size_t InlineCapacity>
+    inline DWORD try_current_directory_into(basic_path_buffer<wchar_t, InlineCapacity>& buffer) noexcept
+    {
+        return details::try_win32_string_into(buffer, [](DWORD length, wchar_t* data) noexcept
+        {
+            return ::GetCurrentDirectoryW(length, data);
+        });
+    }
+
+    namespace details
+    {
+        // 64-bit FNV-1a, even on 32-bit architectures, rather than deal with two sets of constants
+        inline constexpr std::uint64_t path_hash_basis = 14695981039346656037ull;
+
+        inline constexpr std::uint64_t path_hash_append(std::uint64_t hash, wchar_t ch) noexcept
+        {
+            return (hash ^ static_cast<std::uint16_t>(ascii_fold(ch, false))) * 1099511628211ull;
+        }
+
+        inline bool ascii_iequals(std::wstring_view str, std::wstring_view lowerCase) noexcept
+        {
+            return (str.length() == lowerCase.length()) &&
+                (ascii_iequal_prefix(str.data(), lowerCase.data(), str.length()) == str.length());
+        }
+
+        // Whether GetFullPathName may turn a path with this name into a device path (e.g. "C:\foo\nul.txt" into
+        // "\\.\nul"). Which names this applies to, and where in the path, has changed between versions of Windows, so
+        // this errs on the side of matching too much
+        inline bool may_be_dos_device_name(std::wstring_view name) noexcept
+        {
+            if (name.length() < 3)
+            {
+                return false;
+            }
+
+            switch (ascii_fold(name[0], false))
+            {
+            case L'a': case L'c': case L'l': case L'n': case L'p':
+                break;
+            default:
+                return false;
+            }
+
+            // Everything from the extension (or stream) on is ignored, as are trailing spaces
+            name = name.substr(0, name.find_first_of(L".:"));
+            while (!name.empty() && (name.back() == L' '))
+            {
+                name.remove_suffix(1);
+            }
+
+            if (name.length() == 3)
+            {
+                return ascii_iequals(name, L"con") || ascii_iequals(name, L"prn") || ascii_iequals(name, L"aux") ||
+                    ascii_iequals(name, L"nul");
+            }
+            else if (name.length() == 4)
+            {
+                // NOTE: The superscript digits count too
+                auto digit = name[3];
+                auto isDigit = ((digit >= L'1') && (digit <= L'9')) ||
+                    (digit == L'\u00B9') || (digit == L'\u00B2') || (digit == L'\u00B3');
+                return isDigit && (ascii_iequals(name.substr(0, 3), L"com") || ascii_iequals(name.substr(0, 3), L"lpt"));
+            }
+
+            return ascii_iequals(name, L"conin$") || ascii_iequals(name, L"conout$");
+        }
+    }
+
+    // Hash of a path that ignores ASCII case, so that paths that compare equal - with or without regard to case - hash
+    // the same. It's 64 bits on every architecture, so that it can stand in for the path where collisions matter
+    inline std::uint64_t path_hash(std::wstring_view path) noexcept
+    {
+        auto hash = details::path_hash_basis;
+        for (auto ch : path)
+        {
+            hash = details::path_hash_append(hash, ch);
+        }
+
+        return hash;
+    }
+
+    // Where the components of a canonical path end, i.e. the offsets of its backslashes, along with the path_hash of the
+    // path up to each of them, which is the hash of that parent directory. E.g. "C:\foo\bar.txt" has offsets 2 and 6,
+    // with the hashes of "C:" and "C:\foo". Paths with more components than fit are left with 'complete' set to false,
+    // and only the first 'capacity' of their offsets
+    struct path_components
+    {
+        static constexpr std::size_t capacity = 32;
+
+        std::uint16_t count = 0;
+        bool complete = true;
+        std::uint16_t offsets[capacity];
+        std::uint64_t hashes[capacity];
+
+        void clear() noexcept
+        {
+            count = 0;
+            complete = true;
+        }
+
+        void push(std::size_t offset, std::uint64_t hash) noexcept
+        {
+            if ((count < capacity) && (offset <= 0xFFFF))
+            {
+                offsets[count] = static_cast<std::uint16_t>(offset);
+                hashes[count] = hash;
+                ++count;
+            }
+            else
+            {
+                complete = false;
+            }
+        }
+
+        // Drops the components that end at or past 'length', for a path that got truncated to it, and gives back the
+        // hash of what's left if it's known, i.e. if the path now ends right before one of the offsets
+        bool truncate(std::size_t length, std::uint64_t& hash) noexcept
+        {
+            while (count && (offsets[count - 1] >= length))
+            {
+                --count;
+                if (offsets[count] == length)
+                {
+                    hash = hashes[count];
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // The offset of the last backslash before 'length', i.e. where the parent directory of the path up to 'length'
+        // ends, or npos if there's none or it isn't known
+        std::size_t parent_length(std::size_t length) const noexcept
+        {
+            if (!complete)
+            {
+                return std::wstring_view::npos;
+            }
+
+            for (auto i = count; i > 0; --i)
+            {
+                if (offsets[i - 1] < length)
+                {
+                    return offsets[i - 1];
+                }
+            }
+
+            return std::wstring_view::npos;
+        }
+    };
+
+    // Equivalent to path_hash, but also fills in where the path's components end
+    inline std::uint64_t path_hash(std::wstring_view path, path_components& components) noexcept
+    {
+        components.clear();
+        auto hash = details::path_hash_basis;
+        for (std::size_t i = 0; i < path.length(); ++i)
+        {
+            if (path[i] == L'\\')
+            {
+                components.push(i, hash);
+            }
+            hash = details::path_hash_append(hash, path[i]);
+        }
+
+        return hash;
+    }
+
+    struct canonical_path_info
+    {
+        dos_path_type type = dos_path_type::unknown; // Of the resulting path
+        std::uint64_t hash = 0; // The path_hash of the resulting path
+        path_components* components = nullptr; // Optional; filled in for the resulting path if set
+    };
+
+    // Equivalent to try_full_path_into, but handles the common cases itself in a single pass: for drive-absolute,
+    // rooted, and relative paths made up of ordinary names, separators get unified and collapsed, "." and ".." get
+    // resolved, and the current directory gets applied, all while hashing the result. Anything that GetFullPathName has
+    // special rules for - UNC and device paths, drive-relative paths, names ending in dots or spaces, alternate data
+    // streams, and DOS device names - is left to GetFullPathName. The buffer is left empty on failure
+    template <std::size_t InlineCapacity>
+    inline DWORD try_canonicalize_into(
+        const wchar_t* path,
+        basic_path_buffer<wchar_t, InlineCapacity>& buffer,
+        canonical_path_info& info) noexcept
+    {
+        auto fallback = [&]() noexcept
+        {
+            auto err = try_full_path_into(path, buffer);
+            if (err == ERROR_SUCCESS)
+            {
+                info.type = path_type(buffer.c_str());
+                info.hash = info.components ? path_hash(buffer, *info.components) : path_hash(buffer);
+            }
+            return err;
+        };
+
+        // The part that gets copied as-is, and the part that gets resolved against it
+        std::wstring_view prefix;
+        const wchar_t* rest;
+        [[maybe_unused]] basic_path_buffer<wchar_t> currentDirectory;
+        auto type = path_type(path);
+        if (type == dos_path_type::drive_absolute)
+        {
+            prefix = std::wstring_view(path, 2);
+            rest = path + 3;
+        }
+        else if (((type == dos_path_type::rooted) || (type == dos_path_type::relative)) && *path)
+        {
+            // NOTE: The current directory is only read once, which is one less acquisition of the PEB lock than
+            //       GetFullPathName's query for the size of the buffer followed by the call to fill it in
+            if ((try_current_directory_into(currentDirectory) != ERROR_SUCCESS) ||
+                (path_type(currentDirectory.c_str()) != dos_path_type::drive_absolute))
+            {
+                return fallback();
+            }
+
+            prefix = currentDirectory;
+            rest = path;
+            if (type == dos_path_type::rooted)
+            {
+                prefix = prefix.substr(0, 2);
+                ++rest;
+            }
+        }
+        else
+        {
+            return fallback();
+        }
+
+        std::wstring_view remaining = rest;
+        if (!buffer.try_reserve(prefix.length() + 1 + remaining.length()))
+        {
+            buffer.clear();
+            return ERROR_OUTOFMEMORY;
+        }
+
+        path_components localComponents;
+        auto& components = info.components ? *info.components : localComponents;
+        components.clear();
+
+        auto hash = details::path_hash_basis;
+        auto append = [&](std::wstring_view str) noexcept
+        {
+            // NOTE: The buffer was already reserved for the longest possible result, so this doesn't allocate. The
+            //       current directory only ever has backslashes, so those are the only separators to look for
+            auto offset = buffer.length();
+            buffer.append(str);
+            for (std::size_t i = 0; i < str.length(); ++i)
+            {
+                if (str[i] == L'\\')
+                {
+                    components.push(offset + i, hash);
+                }
+                hash = details::path_hash_append(hash, str[i]);
+            }
+        };
+
+        // The root is always "X:\", with the separator normalized
+        buffer.clear();
+        append(prefix.substr(0, 2));
+        append(L"\\");
+        append(prefix.substr(std::min<std::size_t>(prefix.length(), 3)));
+
+        bool rehash = false;
+        for (std::size_t pos = 0; pos < remaining.length(); )
+        {
+            auto end = (std::min)(find_path_separator(remaining, pos), remaining.length());
+            auto component = remaining.substr(pos, end - pos);
+            pos = end + 1;
+
+            if (component.empty() || (component == L"."))
+            {
+                continue;
+            }
+            else if (component == L"..")
+            {
+                // Going above the root isn't an error; the root just stays the root. The hash goes back to that of the
+                // parent, which is where the separator's offset was recorded, so that the rest of the path can go on
+                // from there instead of hashing it all again at the end
+                auto separator = find_last_path_separator(buffer);
+                auto length = (separator <= 2) ? 3 : separator;
+                buffer.resize(length);
+                if (!components.truncate(length, hash))
+                {
+                    if ((length == 3) && components.count && (components.offsets[0] == 2))
+                    {
+                        hash = details::path_hash_append(components.hashes[0], L'\\');
+                    }
+                    else
+                    {
+                        rehash = true;
+                    }
+                }
+                continue;
+            }
+            else if ((component.back() == L'.') || (component.back() == L' ') ||
+                (component.find(L':') != std::wstring_view::npos) || details::may_be_dos_device_name(component))
+            {
+                buffer.clear();
+                return fallback();
+            }
+
+            if (buffer.back() != L'\\')
+            {
+                append(L"\\");
+            }
+            append(component);
+        }
+
+        // Trailing separators are preserved
+        if (!remaining.empty() && is_path_separator(remaining.back()) && (buffer.back() != L'\\'))
+        {
+            append(L"\\");
+        }
+
+        info.type = dos_path_type::drive_absolute;
+        info.hash = rehash ? path_hash(buffer, components) : hash;
+        return ERROR_SUCCESS;
+    }
 }
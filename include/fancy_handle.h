@@ -4,6 +4,8 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <memory>
+
 #include <windows.h>
 
 namespace psf
@@ -87,4 +89,6 @@ namespace psf
             }
         }
     };
+
+    using unique_handle = std::unique_ptr<void, handle_deleter<&::CloseHandle>>;
 }
@@ -0,0 +1,293 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A string type for file paths that stores short strings inline and only falls back to the heap when the string grows
+// beyond the inline capacity. The default capacity is MAX_PATH, so the vast majority of paths never allocate. This is
+// useful for code that runs on every file system call where the path is only needed temporarily. The interface is a
+// (small) subset of std::basic_string's; the contents are always null terminated
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include <windows.h>
+
+namespace psf
+{
+    template <typename CharT, std::size_t InlineCapacity = MAX_PATH>
+    class basic_path_buffer
+    {
+        static_assert(InlineCapacity > 0);
+
+    public:
+        using value_type = CharT;
+        using string_view_type = std::basic_string_view<CharT>;
+
+        basic_path_buffer() noexcept
+        {
+            m_inline[0] = CharT();
+        }
+
+        basic_path_buffer(string_view_type str) :
+            basic_path_buffer()
+        {
+            assign(str);
+        }
+
+        basic_path_buffer(const basic_path_buffer& other) :
+            basic_path_buffer()
+        {
+            assign(other);
+        }
+
+        basic_path_buffer(basic_path_buffer&& other) noexcept :
+            basic_path_buffer()
+        {
+            steal(other);
+        }
+
+        basic_path_buffer& operator=(const basic_path_buffer& other)
+        {
+            if (this != &other)
+            {
+                assign(other);
+            }
+
+            return *this;
+        }
+
+        basic_path_buffer& operator=(basic_path_buffer&& other) noexcept
+        {
+            if (this != &other)
+            {
+                steal(other);
+            }
+
+            return *this;
+        }
+
+        basic_path_buffer& operator=(string_view_type str)
+        {
+            assign(str);
+            return *this;
+        }
+
+        CharT* data() noexcept
+        {
+            return m_data;
+        }
+
+        const CharT* data() const noexcept
+        {
+            return m_data;
+        }
+
+        const CharT* c_str() const noexcept
+        {
+            return m_data;
+        }
+
+        std::size_t length() const noexcept
+        {
+            return m_length;
+        }
+
+        std::size_t size() const noexcept
+        {
+            return m_length;
+        }
+
+        // Number of characters that can be held without allocating, not including the null terminator
+        std::size_t capacity() const noexcept
+        {
+            return m_capacity;
+        }
+
+        bool empty() const noexcept
+        {
+            return m_length == 0;
+        }
+
+        bool is_inline() const noexcept
+        {
+            return m_data == m_inline;
+        }
+
+        CharT& operator[](std::size_t index) noexcept
+        {
+            assert(index <= m_length);
+            return m_data[index];
+        }
+
+        const CharT& operator[](std::size_t index) const noexcept
+        {
+            assert(index <= m_length);
+            return m_data[index];
+        }
+
+        CharT& back() noexcept
+        {
+            assert(m_length > 0);
+            return m_data[m_length - 1];
+        }
+
+        operator string_view_type() const noexcept
+        {
+            return string_view_type(m_data, m_length);
+        }
+
+        void clear() noexcept
+        {
+            m_length = 0;
+            m_data[0] = CharT();
+        }
+
+        void reserve(std::size_t count)
+        {
+            if (count > m_capacity)
+            {
+                grow(count);
+            }
+        }
+
+        // Equivalent to reserve and resize, but report a failure to allocate through the return value instead of
+        // throwing, leaving the buffer untouched
+        bool try_reserve(std::size_t count) noexcept
+        {
+            std::unique_ptr<CharT[]> previous;
+            return (count <= m_capacity) || try_grow(count, previous);
+        }
+
+        bool try_resize(std::size_t count, CharT ch = CharT()) noexcept
+        {
+            if (!try_reserve(count))
+            {
+                return false;
+            }
+
+            resize(count, ch);
+            return true;
+        }
+
+        // NOTE: Characters past the current length are filled with 'ch', same as std::basic_string::resize. This can be
+        //       used to expose a buffer to functions like GetFullPathName, then shrunk to the length that they return
+        void resize(std::size_t count, CharT ch = CharT())
+        {
+            reserve(count);
+            for (auto i = m_length; i < count; ++i)
+            {
+                m_data[i] = ch;
+            }
+
+            m_length = count;
+            m_data[m_length] = CharT();
+        }
+
+        void assign(string_view_type str)
+        {
+            m_length = 0;
+            append(str);
+        }
+
+        void append(string_view_type str)
+        {
+            // NOTE: 'str' may point into this buffer, so hold onto the old allocation (if any) until we're done copying
+            auto newLength = m_length + str.length();
+            std::unique_ptr<CharT[]> oldHeap;
+            if (newLength > m_capacity)
+            {
+                oldHeap = grow(newLength);
+            }
+
+            std::memmove(m_data + m_length, str.data(), str.length() * sizeof(CharT));
+            m_length = newLength;
+            m_data[m_length] = CharT();
+        }
+
+        void push_back(CharT ch)
+        {
+            reserve(m_length + 1);
+            m_data[m_length++] = ch;
+            m_data[m_length] = CharT();
+        }
+
+        basic_path_buffer& operator+=(string_view_type str)
+        {
+            append(str);
+            return *this;
+        }
+
+        basic_path_buffer& operator+=(CharT ch)
+        {
+            push_back(ch);
+            return *this;
+        }
+
+    private:
+        // Hands back the previous heap allocation, if any. Grows geometrically so that repeated appends don't each
+        // allocate. Returns false, leaving the buffer untouched, if the allocation fails
+        bool try_grow(std::size_t count, std::unique_ptr<CharT[]>& previous) noexcept
+        {
+            auto newCapacity = (std::max)(count, m_capacity * 2);
+            std::unique_ptr<CharT[]> buffer(new (std::nothrow) CharT[newCapacity + 1]);
+            if (!buffer)
+            {
+                return false;
+            }
+            std::memcpy(buffer.get(), m_data, (m_length + 1) * sizeof(CharT));
+
+            previous = std::exchange(m_heap, std::move(buffer));
+            m_data = m_heap.get();
+            m_capacity = newCapacity;
+            return true;
+        }
+
+        std::unique_ptr<CharT[]> grow(std::size_t count)
+        {
+            std::unique_ptr<CharT[]> result;
+            if (!try_grow(count, result))
+            {
+                throw std::bad_alloc();
+            }
+
+            return result;
+        }
+
+        void steal(basic_path_buffer& other) noexcept
+        {
+            if (other.is_inline())
+            {
+                m_heap.reset();
+                m_data = m_inline;
+                m_capacity = InlineCapacity - 1;
+                std::memcpy(m_inline, other.m_inline, (other.m_length + 1) * sizeof(CharT));
+            }
+            else
+            {
+                m_heap = std::move(other.m_heap);
+                m_data = m_heap.get();
+                m_capacity = other.m_capacity;
+            }
+            m_length = other.m_length;
+
+            other.m_data = other.m_inline;
+            other.m_capacity = InlineCapacity - 1;
+            other.clear();
+        }
+
+        CharT* m_data = m_inline;
+        std::size_t m_length = 0;
+        std::size_t m_capacity = InlineCapacity - 1;
+        std::unique_ptr<CharT[]> m_heap;
+        CharT m_inline[InlineCapacity];
+    };
+
+    using path_buffer = basic_path_buffer<wchar_t>;
+}
@@ -0,0 +1,1146 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A small regular expression engine for the (fairly limited) subset of ECMAScript syntax that config.json patterns
+// tend to use: literals, escapes, '.', bracket expressions, groups, alternation, and the '*', '+', '?', and '{n,m}'
+// quantifiers. Such patterns get compiled to a DFA so that matching is a single allocation-free pass over the input,
+// which is considerably cheaper than std::regex_match. Note that the semantics are those of std::regex_match, i.e. the
+// pattern must match the entire input. Patterns that use anything outside of this subset (back references,
+// assertions, character class escapes such as '\w', etc.) fall back to std::wregex so that behavior - including the
+// error raised for invalid patterns - stays identical to what it has always been.
+//
+// Building the DFA is by far the most expensive part of using a pattern, and it's wasted on patterns that end up matched
+// against few strings (or none), as most of a large configuration's patterns are in any one process. Patterns assigned
+// with a non-zero 'compileAfter' only get parsed up front; until they've been matched against that many strings,
+// matching simulates the NFA instead, which costs more per match but nothing to set up, and the match after that builds
+// the DFA and uses it from then on. Such a matcher can be shared between threads the same as any other: whichever match
+// reaches the limit builds the DFA, and the others keep simulating until it's ready.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace psf
+{
+    namespace details
+    {
+        using pattern_char_range = std::pair<wchar_t, wchar_t>;
+        using pattern_char_set = std::vector<pattern_char_range>;
+
+        constexpr wchar_t pattern_char_max = std::numeric_limits<wchar_t>::max();
+
+        // Limits past which we give up on compiling and defer to std::wregex
+        constexpr int pattern_max_repeat = 64;
+        constexpr std::size_t pattern_max_nfa_states = 4096;
+        constexpr std::size_t pattern_max_dfa_states = 1024;
+
+        struct pattern_node
+        {
+            enum class kind { empty, set, concat, alternate, repeat };
+
+            kind type = kind::empty;
+            pattern_char_set set;
+            std::vector<pattern_node> children;
+            int min = 1;
+            int max = 1; // -1 means unbounded
+        };
+
+        inline pattern_char_set pattern_complement(pattern_char_set set)
+        {
+            std::sort(set.begin(), set.end());
+
+            pattern_char_set result;
+            wchar_t next = 0;
+            bool done = false;
+            for (auto [lo, hi] : set)
+            {
+                if (done || (hi < next))
+                {
+                    continue;
+                }
+
+                if (lo > next)
+                {
+                    result.emplace_back(next, static_cast<wchar_t>(lo - 1));
+                }
+
+                if (hi == pattern_char_max)
+                {
+                    done = true;
+                }
+                else
+                {
+                    next = static_cast<wchar_t>(hi + 1);
+                }
+            }
+
+            if (!done)
+            {
+                result.emplace_back(next, pattern_char_max);
+            }
+
+            return result;
+        }
+
+        inline bool pattern_set_contains(const pattern_char_set& set, wchar_t ch) noexcept
+        {
+            return std::any_of(set.begin(), set.end(), [&](const pattern_char_range& range)
+            {
+                return (ch >= range.first) && (ch <= range.second);
+            });
+        }
+
+        // Recursive descent parser that produces a pattern_node tree. Any construct that we don't support - as well as
+        // any syntax error - marks the parse as failed, in which case the caller falls back to std::wregex
+        class pattern_parser
+        {
+        public:
+
+            pattern_parser(std::wstring_view pattern) noexcept :
+                m_pattern(pattern)
+            {
+            }
+
+            bool parse(pattern_node& result)
+            {
+                result = parse_alternate();
+                return !m_failed && (m_pos == m_pattern.length());
+            }
+
+        private:
+
+            bool at_end() const noexcept
+            {
+                return m_pos >= m_pattern.length();
+            }
+
+            wchar_t peek() const noexcept
+            {
+                return at_end() ? L'\0' : m_pattern[m_pos];
+            }
+
+            pattern_node fail() noexcept
+            {
+                m_failed = true;
+                m_pos = m_pattern.length();
+                return {};
+            }
+
+            pattern_node parse_alternate()
+            {
+                auto first = parse_concat();
+                if (peek() != L'|')
+                {
+                    return first;
+                }
+
+                pattern_node result;
+                result.type = pattern_node::kind::alternate;
+                result.children.push_back(std::move(first));
+                while (!m_failed && (peek() == L'|'))
+                {
+                    ++m_pos;
+                    result.children.push_back(parse_concat());
+                }
+
+                return result;
+            }
+
+            pattern_node parse_concat()
+            {
+                pattern_node result;
+                result.type = pattern_node::kind::concat;
+                while (!m_failed && !at_end() && (peek() != L'|') && (peek() != L')'))
+                {
+                    result.children.push_back(parse_repeat());
+                }
+
+                return result;
+            }
+
+            bool parse_number(int& value) noexcept
+            {
+                auto start = m_pos;
+                value = 0;
+                while ((peek() >= L'0') && (peek() <= L'9'))
+                {
+                    value = value * 10 + (peek() - L'0');
+                    if (value > pattern_max_repeat)
+                    {
+                        return false;
+                    }
+                    ++m_pos;
+                }
+
+                return m_pos != start;
+            }
+
+            pattern_node parse_repeat()
+            {
+                auto atom = parse_atom();
+                if (m_failed)
+                {
+                    return atom;
+                }
+
+                int min = 1;
+                int max = 1;
+                switch (peek())
+                {
+                case L'*': min = 0; max = -1; ++m_pos; break;
+                case L'+': min = 1; max = -1; ++m_pos; break;
+                case L'?': min = 0; max = 1; ++m_pos; break;
+                case L'{':
+                    ++m_pos;
+                    if (!parse_number(min))
+                    {
+                        return fail();
+                    }
+
+                    max = min;
+                    if (peek() == L',')
+                    {
+                        ++m_pos;
+                        max = -1;
+                        if ((peek() != L'}') && (!parse_number(max) || (max < min)))
+                        {
+                            return fail();
+                        }
+                    }
+
+                    if (peek() != L'}')
+                    {
+                        return fail();
+                    }
+                    ++m_pos;
+                    break;
+
+                default:
+                    return atom;
+                }
+
+                // Non-greedy quantifiers can't change the outcome of a full match
+                if (peek() == L'?')
+                {
+                    ++m_pos;
+                }
+
+                // ECMAScript does not allow consecutive quantifiers (e.g. "a**")
+                if ((peek() == L'*') || (peek() == L'+') || (peek() == L'?') || (peek() == L'{'))
+                {
+                    return fail();
+                }
+
+                pattern_node result;
+                result.type = pattern_node::kind::repeat;
+                result.min = min;
+                result.max = max;
+                result.children.push_back(std::move(atom));
+                return result;
+            }
+
+            static pattern_node make_set(pattern_char_set set)
+            {
+                pattern_node result;
+                result.type = pattern_node::kind::set;
+                result.set = std::move(set);
+                return result;
+            }
+
+            bool parse_hex(int digits, wchar_t& value) noexcept
+            {
+                unsigned result = 0;
+                for (int i = 0; i < digits; ++i)
+                {
+                    auto ch = peek();
+                    if ((ch >= L'0') && (ch <= L'9')) result = result * 16 + (ch - L'0');
+                    else if ((ch >= L'a') && (ch <= L'f')) result = result * 16 + (ch - L'a' + 10);
+                    else if ((ch >= L'A') && (ch <= L'F')) result = result * 16 + (ch - L'A' + 10);
+                    else return false;
+                    ++m_pos;
+                }
+
+                value = static_cast<wchar_t>(result);
+                return true;
+            }
+
+            // Parses the character following a '\', returning false for anything that does not represent a single
+            // character (e.g. '\d', '\b', back references, etc.)
+            bool parse_escaped_char(wchar_t& value) noexcept
+            {
+                if (at_end())
+                {
+                    return false;
+                }
+
+                auto ch = m_pattern[m_pos++];
+                switch (ch)
+                {
+                case L't': value = L'\t'; return true;
+                case L'n': value = L'\n'; return true;
+                case L'r': value = L'\r'; return true;
+                case L'f': value = L'\f'; return true;
+                case L'v': value = L'\v'; return true;
+                case L'0':
+                    value = L'\0';
+                    return (peek() < L'0') || (peek() > L'9');
+                case L'x': return parse_hex(2, value);
+                case L'u': return parse_hex(4, value);
+                }
+
+                // Identity escapes are only valid for non-word characters. Everything else (e.g. '\w', '\s', '\b', '\1')
+                // is either a class, an assertion, or a reference, none of which we support
+                if (((ch >= L'a') && (ch <= L'z')) || ((ch >= L'A') && (ch <= L'Z')) || ((ch >= L'0') && (ch <= L'9')) || (ch == L'_'))
+                {
+                    return false;
+                }
+
+                value = ch;
+                return true;
+            }
+
+            pattern_node parse_atom()
+            {
+                auto ch = m_pattern[m_pos++];
+                switch (ch)
+                {
+                case L'(':
+                {
+                    if (peek() == L'?')
+                    {
+                        // Only non-capturing groups are supported; lookahead assertions are not
+                        if ((m_pos + 1 >= m_pattern.length()) || (m_pattern[m_pos + 1] != L':'))
+                        {
+                            return fail();
+                        }
+                        m_pos += 2;
+                    }
+
+                    auto result = parse_alternate();
+                    if (m_failed || (peek() != L')'))
+                    {
+                        return fail();
+                    }
+                    ++m_pos;
+                    return result;
+                }
+
+                case L'[':
+                    return parse_bracket();
+
+                case L'.':
+                    return make_set(pattern_complement({ { L'\n', L'\n' }, { L'\r', L'\r' } }));
+
+                case L'\\':
+                {
+                    wchar_t value;
+                    if (!parse_escaped_char(value))
+                    {
+                        return fail();
+                    }
+                    return make_set({ { value, value } });
+                }
+
+                case L'^':
+                    // With full-match semantics, anchors are meaningless at the very beginning/end of the pattern and
+                    // are difficult to reason about anywhere else
+                    if (m_pos != 1)
+                    {
+                        return fail();
+                    }
+                    return {};
+
+                case L'$':
+                    if (!at_end())
+                    {
+                        return fail();
+                    }
+                    return {};
+
+                case L'*':
+                case L'+':
+                case L'?':
+                case L'{':
+                case L'}':
+                case L']':
+                case L')':
+                    return fail();
+                }
+
+                return make_set({ { ch, ch } });
+            }
+
+            bool parse_bracket_char(wchar_t& value) noexcept
+            {
+                if (at_end())
+                {
+                    return false;
+                }
+
+                auto ch = m_pattern[m_pos++];
+                if (ch == L'\\')
+                {
+                    // NOTE: '\b' means backspace inside of a bracket expression; just treat it as unsupported
+                    return parse_escaped_char(value);
+                }
+                else if ((ch == L'[') && ((peek() == L':') || (peek() == L'=') || (peek() == L'.')))
+                {
+                    // Character class names, equivalence classes, and collating symbols
+                    return false;
+                }
+
+                value = ch;
+                return true;
+            }
+
+            pattern_node parse_bracket()
+            {
+                bool negate = false;
+                if (peek() == L'^')
+                {
+                    negate = true;
+                    ++m_pos;
+                }
+
+                if (peek() == L']')
+                {
+                    // Empty set, which is valid, but not worth the complexity
+                    return fail();
+                }
+
+                pattern_char_set set;
+                while (peek() != L']')
+                {
+                    wchar_t lo;
+                    if (!parse_bracket_char(lo))
+                    {
+                        return fail();
+                    }
+
+                    wchar_t hi = lo;
+                    if ((peek() == L'-') && (m_pos + 1 < m_pattern.length()) && (m_pattern[m_pos + 1] != L']'))
+                    {
+                        ++m_pos;
+                        if (!parse_bracket_char(hi) || (hi < lo))
+                        {
+                            return fail();
+                        }
+                    }
+
+                    set.emplace_back(lo, hi);
+                }
+                ++m_pos;
+
+                return make_set(negate ? pattern_complement(std::move(set)) : std::move(set));
+            }
+
+            std::wstring_view m_pattern;
+            std::size_t m_pos = 0;
+            bool m_failed = false;
+        };
+
+        // Thompson NFA construction from the parsed pattern, used only as an intermediate step to building the DFA
+        class pattern_nfa_builder
+        {
+        public:
+
+            struct state
+            {
+                int set = -1; // Index into 'sets'; -1 indicates that 'next' and 'alt' are epsilon transitions
+                int next = -1;
+                int alt = -1;
+            };
+
+            bool build(const pattern_node& root)
+            {
+                auto [first, last] = emit(root);
+                start = first;
+                accept = last;
+                return !m_failed;
+            }
+
+            std::vector<state> states;
+            std::vector<pattern_char_set> sets;
+            int start = -1;
+            int accept = -1;
+
+        private:
+
+            using fragment = std::pair<int, int>;
+
+            int new_state(int set = -1)
+            {
+                if (states.size() >= pattern_max_nfa_states)
+                {
+                    m_failed = true;
+                }
+
+                states.push_back(state{ set });
+                return static_cast<int>(states.size() - 1);
+            }
+
+            fragment concat(fragment lhs, fragment rhs)
+            {
+                states[lhs.second].next = rhs.first;
+                return { lhs.first, rhs.second };
+            }
+
+            fragment emit(const pattern_node& node)
+            {
+                if (m_failed)
+                {
+                    // Keep going, but stop allocating the world
+                    auto s = static_cast<int>(states.size() - 1);
+                    return { s, s };
+                }
+
+                switch (node.type)
+                {
+                case pattern_node::kind::empty:
+                    break;
+
+                case pattern_node::kind::set:
+                {
+                    sets.push_back(node.set);
+                    auto s = new_state(static_cast<int>(sets.size() - 1));
+                    auto e = new_state();
+                    states[s].next = e;
+                    return { s, e };
+                }
+
+                case pattern_node::kind::concat:
+                {
+                    auto s = new_state();
+                    fragment result{ s, s };
+                    for (auto& child : node.children)
+                    {
+                        result = concat(result, emit(child));
+                    }
+                    return result;
+                }
+
+                case pattern_node::kind::alternate:
+                {
+                    auto result = emit(node.children[0]);
+                    for (std::size_t i = 1; i < node.children.size(); ++i)
+                    {
+                        auto rhs = emit(node.children[i]);
+                        auto s = new_state();
+                        auto e = new_state();
+                        states[s].next = result.first;
+                        states[s].alt = rhs.first;
+                        states[result.second].next = e;
+                        states[rhs.second].next = e;
+                        result = { s, e };
+                    }
+                    return result;
+                }
+
+                case pattern_node::kind::repeat:
+                {
+                    auto s = new_state();
+                    fragment result{ s, s };
+                    for (int i = 0; i < node.min; ++i)
+                    {
+                        result = concat(result, emit(node.children[0]));
+                    }
+
+                    if (node.max < 0)
+                    {
+                        auto child = emit(node.children[0]);
+                        auto loop = new_state();
+                        auto e = new_state();
+                        states[loop].next = child.first;
+                        states[loop].alt = e;
+                        states[child.second].next = loop;
+                        result = concat(result, { loop, e });
+                    }
+                    else
+                    {
+                        for (int i = node.min; i < node.max; ++i)
+                        {
+                            auto child = emit(node.children[0]);
+                            auto opt = new_state();
+                            auto e = new_state();
+                            states[opt].next = child.first;
+                            states[opt].alt = e;
+                            states[child.second].next = e;
+                            result = concat(result, { opt, e });
+                        }
+                    }
+                    return result;
+                }
+                }
+
+                auto s = new_state();
+                return { s, s };
+            }
+
+            bool m_failed = false;
+        };
+    }
+
+    class pattern_matcher
+    {
+    public:
+
+        pattern_matcher() = default;
+
+        explicit pattern_matcher(std::wstring_view pattern, std::uint32_t compileAfter = 0)
+        {
+            assign(pattern, compileAfter);
+        }
+
+        // With a 'compileAfter' of zero, the DFA gets built right away; otherwise, only once the pattern has been matched
+        // against that many strings
+        void assign(std::wstring_view pattern, std::uint32_t compileAfter = 0)
+        {
+            m_classBounds.clear();
+            m_transitions.clear();
+            m_accepting.clear();
+            m_fallback.reset();
+            m_lazy.reset();
+
+            if (compileAfter != 0)
+            {
+                auto lazy = std::make_unique<lazy_pattern>();
+                details::pattern_node root;
+                if (details::pattern_parser(pattern).parse(root) && lazy->nfa.build(root))
+                {
+                    lazy->source.assign(pattern);
+                    lazy->compile_after = compileAfter;
+                    m_lazy = std::move(lazy);
+                    return;
+                }
+            }
+            else if (compile(pattern))
+            {
+                return;
+            }
+
+            m_classBounds.clear();
+            m_transitions.clear();
+            m_accepting.clear();
+            m_fallback = std::make_unique<std::wregex>(pattern.data(), pattern.length());
+        }
+
+        // True if the pattern was compiled to a DFA; false if matching defers to std::wregex, or the DFA hasn't been
+        // built yet
+        bool compiled() const noexcept
+        {
+            if (m_lazy)
+            {
+                auto dfa = m_lazy->dfa.load(std::memory_order_acquire);
+                return dfa && dfa->compiled();
+            }
+
+            return !m_fallback;
+        }
+
+        bool match(const wchar_t* str) const
+        {
+            if (m_lazy)
+            {
+                return lazy_match(std::wstring_view(str));
+            }
+            else if (m_fallback)
+            {
+                return std::regex_match(str, *m_fallback);
+            }
+
+            auto state = start_state;
+            for (; *str; ++str)
+            {
+                state = m_transitions[state * m_classCount + char_class(*str)];
+                if (state == dead_state)
+                {
+                    return false;
+                }
+            }
+
+            return m_accepting[state];
+        }
+
+        bool match(std::wstring_view str) const
+        {
+            if (m_lazy)
+            {
+                return lazy_match(str);
+            }
+            else if (m_fallback)
+            {
+                return std::regex_match(str.begin(), str.end(), *m_fallback);
+            }
+
+            auto state = start_state;
+            for (auto ch : str)
+            {
+                state = m_transitions[state * m_classCount + char_class(ch)];
+                if (state == dead_state)
+                {
+                    return false;
+                }
+            }
+
+            return m_accepting[state];
+        }
+
+        // Support for persisting compiled patterns across processes. Only patterns that were compiled to a DFA can be
+        // saved. The tables are appended to 'data' in the native byte order, so they are only meaningful to a process
+        // of the same architecture
+        void save(std::vector<std::uint8_t>& data) const
+        {
+            assert(compiled());
+            if (m_lazy)
+            {
+                return m_lazy->dfa.load(std::memory_order_acquire)->save(data);
+            }
+
+            auto append = [&](const void* value, std::size_t size)
+            {
+                auto bytes = static_cast<const std::uint8_t*>(value);
+                data.insert(data.end(), bytes, bytes + size);
+            };
+            auto appendCount = [&](std::size_t count)
+            {
+                auto value = static_cast<std::uint32_t>(count);
+                append(&value, sizeof(value));
+            };
+
+            append(m_asciiClasses.data(), sizeof(m_asciiClasses));
+            appendCount(m_classBounds.size());
+            append(m_classBounds.data(), m_classBounds.size() * sizeof(wchar_t));
+            appendCount(m_transitions.size());
+            append(m_transitions.data(), m_transitions.size() * sizeof(std::uint16_t));
+            for (bool accepting : m_accepting)
+            {
+                data.push_back(accepting ? 1 : 0);
+            }
+        }
+
+        // Loads tables written by save, advancing 'data' past them. Returns false, leaving the matcher empty, if the
+        // tables are truncated or inconsistent; they come from a file on disk, so nothing about them can be trusted
+        bool load(const std::uint8_t*& data, const std::uint8_t* end)
+        {
+            m_classBounds.clear();
+            m_transitions.clear();
+            m_accepting.clear();
+            m_fallback.reset();
+            m_lazy.reset();
+            m_classCount = 0;
+
+            auto read = [&](void* value, std::size_t size)
+            {
+                if (static_cast<std::size_t>(end - data) < size)
+                {
+                    return false;
+                }
+
+                std::copy(data, data + size, static_cast<std::uint8_t*>(value));
+                data += size;
+                return true;
+            };
+            auto readCount = [&](std::size_t& count)
+            {
+                std::uint32_t value;
+                if (!read(&value, sizeof(value)))
+                {
+                    return false;
+                }
+
+                count = value;
+                return true;
+            };
+
+            std::size_t classCount, transitionCount;
+            if (!read(m_asciiClasses.data(), sizeof(m_asciiClasses)) || !readCount(classCount) ||
+                (classCount == 0) || (classCount > static_cast<std::size_t>(end - data) / sizeof(wchar_t)))
+            {
+                return fail_load();
+            }
+
+            m_classBounds.resize(classCount);
+            if (!read(m_classBounds.data(), classCount * sizeof(wchar_t)) || !readCount(transitionCount) ||
+                (transitionCount % classCount != 0) || (transitionCount > static_cast<std::size_t>(end - data) / sizeof(std::uint16_t)))
+            {
+                return fail_load();
+            }
+
+            m_transitions.resize(transitionCount);
+            auto stateCount = transitionCount / classCount;
+            if ((stateCount <= start_state) || (stateCount > details::pattern_max_dfa_states + 1) ||
+                !read(m_transitions.data(), transitionCount * sizeof(std::uint16_t)) ||
+                (static_cast<std::size_t>(end - data) < stateCount))
+            {
+                return fail_load();
+            }
+
+            for (std::size_t i = 0; i < stateCount; ++i)
+            {
+                m_accepting.push_back(*data++ != 0);
+            }
+
+            m_classCount = classCount;
+            auto validClass = [&](std::uint16_t cls) { return cls < classCount; };
+            auto validState = [&](std::uint16_t state) { return state < stateCount; };
+            if ((m_classBounds[0] != L'\0') ||
+                !std::is_sorted(m_classBounds.begin(), m_classBounds.end()) ||
+                !std::all_of(m_asciiClasses.begin(), m_asciiClasses.end(), validClass) ||
+                !std::all_of(m_transitions.begin(), m_transitions.end(), validState))
+            {
+                return fail_load();
+            }
+
+            return true;
+        }
+
+    private:
+
+        // The parsed pattern, for matchers that build their DFA once they've been used enough (see assign)
+        struct lazy_pattern
+        {
+            ~lazy_pattern()
+            {
+                delete dfa.load();
+            }
+
+            std::wstring source;
+            details::pattern_nfa_builder nfa;
+            std::uint32_t compile_after = 0;
+            std::atomic<std::uint32_t> matches = 0;
+            std::atomic<bool> compiling = false;
+            std::atomic<const pattern_matcher*> dfa = nullptr; // Only ever set to one that compiled
+        };
+
+        bool lazy_match(std::wstring_view str) const
+        {
+            auto& lazy = *m_lazy;
+            if (auto dfa = lazy.dfa.load(std::memory_order_acquire))
+            {
+                return dfa->match(str);
+            }
+
+            // NOTE: The count only decides when to compile, so losing the odd increment to a race doesn't matter
+            auto matches = lazy.matches.load(std::memory_order_relaxed) + 1;
+            lazy.matches.store(matches, std::memory_order_relaxed);
+            if ((matches > lazy.compile_after) && !lazy.compiling.exchange(true))
+            {
+                try
+                {
+                    auto dfa = std::make_unique<pattern_matcher>();
+                    if (dfa->compile(lazy.source))
+                    {
+                        lazy.dfa.store(dfa.release(), std::memory_order_release);
+                        return lazy.dfa.load(std::memory_order_relaxed)->match(str);
+                    }
+
+                    // Too many DFA states. Simulating the NFA is still cheaper than std::wregex, so keep doing that
+                }
+                catch (...)
+                {
+                    // Out of memory. Keep simulating the NFA
+                }
+            }
+
+            return simulate(lazy.nfa, str);
+        }
+
+        // A straightforward simulation of the NFA, one set of states per character
+        static bool simulate(const details::pattern_nfa_builder& nfa, std::wstring_view str)
+        {
+            std::vector<int> current;
+            std::vector<int> next;
+            std::vector<std::size_t> listed(nfa.states.size(), 0); // The step that last listed each state, if any
+            std::vector<int> pending;
+
+            std::size_t step = 1;
+            auto add = [&](std::vector<int>& list, int state)
+            {
+                pending.push_back(state);
+                while (!pending.empty())
+                {
+                    auto s = pending.back();
+                    pending.pop_back();
+                    if ((s < 0) || (listed[s] == step))
+                    {
+                        continue;
+                    }
+
+                    listed[s] = step;
+                    list.push_back(s);
+                    if (nfa.states[s].set < 0)
+                    {
+                        pending.push_back(nfa.states[s].alt);
+                        pending.push_back(nfa.states[s].next);
+                    }
+                }
+            };
+
+            add(current, nfa.start);
+            for (auto ch : str)
+            {
+                ++step;
+                next.clear();
+                for (auto s : current)
+                {
+                    auto& state = nfa.states[s];
+                    if ((state.set >= 0) && details::pattern_set_contains(nfa.sets[state.set], ch))
+                    {
+                        add(next, state.next);
+                    }
+                }
+
+                if (next.empty())
+                {
+                    return false;
+                }
+                current.swap(next);
+            }
+
+            return std::find(current.begin(), current.end(), nfa.accept) != current.end();
+        }
+
+        bool fail_load() noexcept
+        {
+            m_classBounds.clear();
+            m_transitions.clear();
+            m_accepting.clear();
+            m_classCount = 0;
+            return false;
+        }
+
+        static constexpr std::uint16_t dead_state = 0;
+        static constexpr std::uint16_t start_state = 1;
+
+        std::uint16_t char_class(wchar_t ch) const noexcept
+        {
+            if (static_cast<std::size_t>(ch) < m_asciiClasses.size())
+            {
+                return m_asciiClasses[static_cast<std::size_t>(ch)];
+            }
+
+            auto itr = std::upper_bound(m_classBounds.begin(), m_classBounds.end(), ch);
+            return static_cast<std::uint16_t>((itr - m_classBounds.begin()) - 1);
+        }
+
+        static void add_closure(const details::pattern_nfa_builder& nfa, int state, std::vector<int>& result)
+        {
+            if ((state < 0) || std::find(result.begin(), result.end(), state) != result.end())
+            {
+                return;
+            }
+
+            result.push_back(state);
+            if (nfa.states[state].set < 0)
+            {
+                add_closure(nfa, nfa.states[state].next, result);
+                add_closure(nfa, nfa.states[state].alt, result);
+            }
+        }
+
+        bool compile(std::wstring_view pattern)
+        {
+            details::pattern_node root;
+            if (!details::pattern_parser(pattern).parse(root))
+            {
+                return false;
+            }
+
+            details::pattern_nfa_builder nfa;
+            if (!nfa.build(root))
+            {
+                return false;
+            }
+
+            // Partition the character space into equivalence classes such that every character in a class behaves
+            // identically with respect to every set in the pattern. Each class is identified by its smallest character
+            m_classBounds.push_back(L'\0');
+            for (auto& set : nfa.sets)
+            {
+                for (auto [lo, hi] : set)
+                {
+                    m_classBounds.push_back(lo);
+                    if (hi != details::pattern_char_max)
+                    {
+                        m_classBounds.push_back(static_cast<wchar_t>(hi + 1));
+                    }
+                }
+            }
+            std::sort(m_classBounds.begin(), m_classBounds.end());
+            m_classBounds.erase(std::unique(m_classBounds.begin(), m_classBounds.end()), m_classBounds.end());
+            m_classCount = m_classBounds.size();
+
+            for (std::size_t i = 0; i < m_asciiClasses.size(); ++i)
+            {
+                auto itr = std::upper_bound(m_classBounds.begin(), m_classBounds.end(), static_cast<wchar_t>(i));
+                m_asciiClasses[i] = static_cast<std::uint16_t>((itr - m_classBounds.begin()) - 1);
+            }
+
+            // Subset construction. State 0 is the dead state (the empty set of NFA states) and state 1 is the start
+            std::map<std::vector<int>, std::uint16_t> stateIds;
+            std::vector<std::vector<int>> dfaStates;
+            auto add_state = [&](std::vector<int> nfaStates) -> std::uint16_t
+            {
+                std::sort(nfaStates.begin(), nfaStates.end());
+                if (auto itr = stateIds.find(nfaStates); itr != stateIds.end())
+                {
+                    return itr->second;
+                }
+
+                auto id = static_cast<std::uint16_t>(dfaStates.size());
+                m_accepting.push_back(std::find(nfaStates.begin(), nfaStates.end(), nfa.accept) != nfaStates.end());
+                stateIds.emplace(nfaStates, id);
+                dfaStates.push_back(std::move(nfaStates));
+                return id;
+            };
+
+            add_state({});
+            std::vector<int> startStates;
+            add_closure(nfa, nfa.start, startStates);
+            add_state(std::move(startStates));
+
+            for (std::size_t i = 0; i < dfaStates.size(); ++i)
+            {
+                if (dfaStates.size() > details::pattern_max_dfa_states)
+                {
+                    return false;
+                }
+
+                for (std::size_t cls = 0; cls < m_classCount; ++cls)
+                {
+                    std::vector<int> nextStates;
+                    for (auto nfaState : dfaStates[i])
+                    {
+                        auto& s = nfa.states[nfaState];
+                        if ((s.set >= 0) && details::pattern_set_contains(nfa.sets[s.set], m_classBounds[cls]))
+                        {
+                            add_closure(nfa, s.next, nextStates);
+                        }
+                    }
+
+                    m_transitions.push_back(add_state(std::move(nextStates)));
+                }
+            }
+
+            return true;
+        }
+
+        std::array<std::uint16_t, 128> m_asciiClasses = {};
+        std::vector<wchar_t> m_classBounds;
+        std::size_t m_classCount = 0;
+        std::vector<std::uint16_t> m_transitions;
+        std::vector<bool> m_accepting;
+
+        std::unique_ptr<std::wregex> m_fallback;
+        std::unique_ptr<lazy_pattern> m_lazy;
+    };
+
+    // Many patterns are nothing more than a literal string, optionally preceded or followed by ".*" (e.g. ".*\.log",
+    // "settings\.dat", or "logs\\.*"). Such patterns can be evaluated with simple string compares - or grouped into
+    // hash tables - rather than by running an automaton, so we identify them up front.
+    enum class pattern_shape
+    {
+        general,    // Anything else; must be evaluated by pattern_matcher
+        exact,      // E.g. "settings\.dat"
+        prefix,     // E.g. "logs\\.*", i.e. the literal followed by ".*"
+        suffix,     // E.g. ".*\.log", i.e. ".*" followed by the literal. Note that ".*" is a suffix with no literal
+    };
+
+    struct pattern_literal
+    {
+        pattern_shape shape = pattern_shape::general;
+        std::wstring literal;
+    };
+
+    namespace details
+    {
+        inline void flatten_pattern_concat(const pattern_node& node, std::vector<const pattern_node*>& result)
+        {
+            if (node.type == pattern_node::kind::concat)
+            {
+                for (auto& child : node.children)
+                {
+                    flatten_pattern_concat(child, result);
+                }
+            }
+            else if (node.type != pattern_node::kind::empty)
+            {
+                result.push_back(&node);
+            }
+        }
+
+        inline bool is_pattern_literal_char(const pattern_node& node) noexcept
+        {
+            return (node.type == pattern_node::kind::set) && (node.set.size() == 1) && (node.set[0].first == node.set[0].second);
+        }
+
+        inline bool is_pattern_wildcard(const pattern_node& node)
+        {
+            // I.e. ".*"
+            return (node.type == pattern_node::kind::repeat) && (node.min == 0) && (node.max < 0) &&
+                (node.children[0].type == pattern_node::kind::set) &&
+                (node.children[0].set == pattern_complement({ { L'\n', L'\n' }, { L'\r', L'\r' } }));
+        }
+    }
+
+    inline pattern_literal classify_pattern(std::wstring_view pattern)
+    {
+        pattern_literal result;
+
+        details::pattern_node root;
+        if (!details::pattern_parser(pattern).parse(root))
+        {
+            return result;
+        }
+
+        std::vector<const details::pattern_node*> nodes;
+        details::flatten_pattern_concat(root, nodes);
+
+        auto begin = nodes.begin();
+        auto end = nodes.end();
+        auto shape = pattern_shape::exact;
+        if ((begin != end) && details::is_pattern_wildcard(**begin))
+        {
+            shape = pattern_shape::suffix;
+            ++begin;
+        }
+        else if ((begin != end) && details::is_pattern_wildcard(**(end - 1)))
+        {
+            shape = pattern_shape::prefix;
+            --end;
+        }
+
+        for (; begin != end; ++begin)
+        {
+            if (!details::is_pattern_literal_char(**begin))
+            {
+                result.literal.clear();
+                return result;
+            }
+
+            result.literal.push_back((*begin)->set[0].first);
+        }
+
+        result.shape = shape;
+        return result;
+    }
+
+    // The wildcard portion of prefix/suffix patterns (".*") does not match line terminators
+    inline bool pattern_wildcard_match(std::wstring_view str) noexcept
+    {
+        return std::none_of(str.begin(), str.end(), [](wchar_t ch) { return (ch == L'\n') || (ch == L'\r'); });
+    }
+}
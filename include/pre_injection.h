@@ -0,0 +1,163 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Executables in the package can import the PsfRuntime themselves, so that the loader loads it like any other dll
+// rather than the PsfRuntime having to be injected into a suspended process (see PsfImportEditor). The import table gets
+// edited with Detours' DetourBinaryEditImports, which keeps the original table in a ".detour" section, and the payload
+// below goes in that same section to mark the executable as pre-injected. Since it isn't DETOUR_EXE_RESTORE_GUID, the
+// DetourRestoreAfterWith call in the PsfRuntime leaves the edited import table as it is, same as it should.
+//
+// Whoever is about to inject the PsfRuntime into a process can check the executable's file for the payload, which only
+// takes reading its headers and the ".detour" section, rather than the whole file as DetourBinaryOpen would
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <windows.h>
+#include <detours.h>
+
+namespace psf
+{
+    // {59CE3FB1-F76E-40EE-945A-90E2EB6CBC91}
+    inline constexpr GUID pre_injection_payload_guid =
+        { 0x59ce3fb1, 0xf76e, 0x40ee, { 0x94, 0x5a, 0x90, 0xe2, 0xeb, 0x6c, 0xbc, 0x91 } };
+
+    constexpr std::uint32_t pre_injection_payload_version = 1;
+
+    struct pre_injection_payload
+    {
+        std::uint32_t version;
+        std::uint16_t machine; // IMAGE_FILE_MACHINE_*, i.e. which architecture of the PsfRuntime gets imported
+        std::uint16_t reserved;
+    };
+
+    // The executable's ".detour" section is tiny unless something went and stored a lot more in it
+    constexpr DWORD max_pre_injection_section_size = 64 * 1024;
+
+    struct image_file_info
+    {
+        WORD machine = 0;
+        bool pre_injected = false;
+    };
+
+    namespace details
+    {
+        inline bool read_file_at(HANDLE file, std::uint64_t offset, void* buffer, DWORD size) noexcept
+        {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+            DWORD bytesRead;
+            return ::ReadFile(file, buffer, size, &bytesRead, &overlapped) && (bytesRead == size);
+        }
+    }
+
+    // Returns false if 'file' (which must be opened for synchronous reads) isn't an image
+    inline bool read_image_file_info(HANDLE file, image_file_info& info) noexcept try
+    {
+        info = {};
+
+        IMAGE_DOS_HEADER dosHeader;
+        if (!details::read_file_at(file, 0, &dosHeader, sizeof(dosHeader)) || (dosHeader.e_magic != IMAGE_DOS_SIGNATURE))
+        {
+            return false;
+        }
+
+        std::uint64_t offset = static_cast<DWORD>(dosHeader.e_lfanew);
+        DWORD signature;
+        IMAGE_FILE_HEADER fileHeader;
+        if (!details::read_file_at(file, offset, &signature, sizeof(signature)) || (signature != IMAGE_NT_SIGNATURE) ||
+            !details::read_file_at(file, offset + sizeof(signature), &fileHeader, sizeof(fileHeader)))
+        {
+            return false;
+        }
+        info.machine = fileHeader.Machine;
+
+        std::vector<IMAGE_SECTION_HEADER> sections(fileHeader.NumberOfSections);
+        offset += sizeof(signature) + sizeof(fileHeader) + fileHeader.SizeOfOptionalHeader;
+        if (!sections.empty() &&
+            !details::read_file_at(file, offset, sections.data(), static_cast<DWORD>(sections.size() * sizeof(sections[0]))))
+        {
+            return false;
+        }
+
+        for (auto& section : sections)
+        {
+            if ((std::memcmp(section.Name, ".detour", 8) != 0) || (section.SizeOfRawData < sizeof(DETOUR_SECTION_HEADER)) ||
+                (section.SizeOfRawData > max_pre_injection_section_size))
+            {
+                continue;
+            }
+
+            std::vector<std::uint8_t> data(section.SizeOfRawData);
+            if (!details::read_file_at(file, section.PointerToRawData, data.data(), section.SizeOfRawData))
+            {
+                return true;
+            }
+
+            // Same walk as DetourFindPayload, only bounded by what we read
+            DETOUR_SECTION_HEADER header;
+            std::memcpy(&header, data.data(), sizeof(header));
+            if ((header.cbHeaderSize < sizeof(header)) || (header.nSignature != DETOUR_SECTION_HEADER_SIGNATURE))
+            {
+                return true;
+            }
+
+            auto end = (std::min)(static_cast<std::size_t>(header.cbDataSize), data.size());
+            for (std::size_t pos = header.nDataOffset; pos + sizeof(DETOUR_SECTION_RECORD) <= end; )
+            {
+                DETOUR_SECTION_RECORD record;
+                std::memcpy(&record, data.data() + pos, sizeof(record));
+                if (record.cbBytes < sizeof(record))
+                {
+                    break;
+                }
+
+                if ((record.guid == pre_injection_payload_guid) && (record.cbBytes >= sizeof(record) + sizeof(pre_injection_payload)) &&
+                    (pos + record.cbBytes <= end))
+                {
+                    pre_injection_payload payload;
+                    std::memcpy(&payload, data.data() + pos + sizeof(record), sizeof(payload));
+                    info.pre_injected = (payload.version == pre_injection_payload_version) && (payload.machine == info.machine);
+                    return true;
+                }
+
+                pos += record.cbBytes;
+            }
+
+            return true;
+        }
+
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+
+    inline bool read_image_file_info(const wchar_t* path, image_file_info& info) noexcept
+    {
+        auto file = ::CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            info = {};
+            return false;
+        }
+
+        auto result = read_image_file_info(file, info);
+        ::CloseHandle(file);
+        return result;
+    }
+
+    inline bool is_pre_injected_executable(const wchar_t* path) noexcept
+    {
+        image_file_info info;
+        return read_image_file_info(path, info) && info.pre_injected;
+    }
+}
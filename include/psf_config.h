@@ -209,6 +209,8 @@ namespace psf
 
     struct json_string : details::json_value_base<json_string>
     {
+        // NOTE: Strings are stored as UTF-8, and only get converted to UTF-16 the first time that 'wide' is called for
+        //       them, so prefer 'narrow' wherever either would do. Both are safe to call from any number of threads
         virtual const char* narrow(_Out_opt_ unsigned* length = nullptr) const noexcept = 0;
         virtual const wchar_t* wide(_Out_opt_ unsigned* length = nullptr) const noexcept = 0;
 
@@ -4,6 +4,8 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <windows.h>
+
 namespace psf
 {
     // Detours will auto-rename from *32.dll to *64.dll and vice-versa when doing cross-architectures launches. It will
@@ -17,6 +19,9 @@ namespace psf
     constexpr char run_dll_name[] = "PsfRunDll64.exe";
     constexpr wchar_t wrun_dll_name[] = L"PsfRunDll64.exe";
 
+    // The PsfRuntime that PsfRunDll loads
+    constexpr wchar_t other_runtime_dll_name[] = L"PsfRuntime64.dll";
+
     constexpr char arch_string[] = "32";
     constexpr wchar_t warch_string[] = L"32";
 #else
@@ -27,7 +32,24 @@ namespace psf
     constexpr char run_dll_name[] = "PsfRunDll32.exe";
     constexpr wchar_t wrun_dll_name[] = L"PsfRunDll32.exe";
 
+    // The PsfRuntime that PsfRunDll loads
+    constexpr wchar_t other_runtime_dll_name[] = L"PsfRuntime32.dll";
+
     constexpr char arch_string[] = "64";
     constexpr wchar_t warch_string[] = L"64";
 #endif
+
+    // x64 and ARM64 binaries both go by the "64" names above, so telling them apart takes the machine in their headers
+#if defined(_M_IX86)
+    constexpr WORD image_machine = IMAGE_FILE_MACHINE_I386;
+#elif defined(_M_ARM64)
+    constexpr WORD image_machine = IMAGE_FILE_MACHINE_ARM64;
+#else
+    constexpr WORD image_machine = IMAGE_FILE_MACHINE_AMD64;
+#endif
+
+    // Set by the PsfLauncher, for a warm standby instance of the application that it's starting, to the base name of
+    // the objects that the instance gets handed over with: "<name>_Ready" and "<name>_Go" events, and an "<name>_Instance"
+    // mapping that holds the instance's process id. The PsfRuntime clears it once it has read it
+    constexpr wchar_t warm_standby_variable[] = L"PSF_WARM_STANDBY";
 }
@@ -5,11 +5,21 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
 #include <type_traits>
+#include <vector>
 
 #include <windows.h>
 
+#ifdef PSF_PROFILE_FIXUPS
+#include <intrin.h>
+#endif
+
 #include "psf_runtime.h"
+#include "reentrancy_guard.h"
 #include "win32_error.h"
 
 // Sections where the detour mappings are stored so that DllMain can enumerate through them
@@ -22,8 +32,220 @@
 #pragma section("psf$m", read)
 #pragma section("psf$z", read)
 
+// Same as above, but for the handlers declared with DECLARE_HANDLER and the detours declared with DECLARE_LAZY_FIXUP
+#pragma section("psfh$a", read)
+#pragma section("psfh$m", read)
+#pragma section("psfh$z", read)
+#pragma section("psfl$a", read)
+#pragma section("psfl$m", read)
+#pragma section("psfl$z", read)
+#pragma section("psfb$a", read)
+#pragma section("psfb$m", read)
+#pragma section("psfb$z", read)
+
+// Defining PSF_PROFILE_FIXUPS (before including this header, or for the whole project) makes DECLARE_FIXUP and
+// DECLARE_STRING_FIXUP wrap each detour in one that counts its calls and times one in every PSF_PROFILE_SAMPLE_RATE of
+// them. The counters get enumerated through the same section as the detours themselves; see for_each_detour_profile and,
+// with PSF_DEFINE_EXPORTS, the PSFQueryDetourProfiles export. Without it, nothing here changes
+#ifdef PSF_PROFILE_FIXUPS
+#ifndef PSF_PROFILE_SAMPLE_RATE
+#define PSF_PROFILE_SAMPLE_RATE 64
+#endif
+static_assert((PSF_PROFILE_SAMPLE_RATE & (PSF_PROFILE_SAMPLE_RATE - 1)) == 0, "PSF_PROFILE_SAMPLE_RATE must be a power of two");
+#endif
+
 namespace psf
 {
+#ifdef PSF_PROFILE_FIXUPS
+    // Times are in __rdtsc ticks, or QueryPerformanceCounter ticks on ARM64 (including ARM64EC, where __rdtsc is emulated)
+    struct detour_profile
+    {
+        const char* name;
+        std::atomic<std::uint64_t> calls = 0;
+        std::atomic<std::uint64_t> sampled_calls = 0;
+        std::atomic<std::uint64_t> sampled_ticks = 0;
+    };
+
+    namespace details
+    {
+        inline std::uint64_t profile_timestamp() noexcept
+        {
+#if (defined(_M_IX86) || defined(_M_X64)) && !defined(_M_ARM64EC)
+            return __rdtsc();
+#else
+            LARGE_INTEGER value;
+            ::QueryPerformanceCounter(&value);
+            return value.QuadPart;
+#endif
+        }
+
+        template <typename Func, typename R, typename... Args>
+        inline R profile_call(detour_profile& profile, Func detour, Args... args)
+        {
+            if ((profile.calls.fetch_add(1, std::memory_order_relaxed) & (PSF_PROFILE_SAMPLE_RATE - 1)) != 0)
+            {
+                return detour(args...);
+            }
+
+            // Counted before the call, so that a detour that never returns (e.g. ExitProcess) still gets accounted for
+            profile.sampled_calls.fetch_add(1, std::memory_order_relaxed);
+            auto start = profile_timestamp();
+            if constexpr (std::is_void_v<R>)
+            {
+                detour(args...);
+                profile.sampled_ticks.fetch_add(profile_timestamp() - start, std::memory_order_relaxed);
+            }
+            else
+            {
+                R result = detour(args...);
+                profile.sampled_ticks.fetch_add(profile_timestamp() - start, std::memory_order_relaxed);
+                return result;
+            }
+        }
+    }
+
+    // 'function' is a function with the same type as 'Detour' that counts calls to it in 'Profile'. Functions that this
+    // can't wrap, i.e. variadic ones, are left as is (and never get counted)
+    template <typename Func, Func Detour, detour_profile& Profile>
+    struct profiled_detour
+    {
+        static constexpr Func function = Detour;
+    };
+
+#define PSF_PROFILED_DETOUR(CallingConvention) \
+    template <typename R, typename... Args, R (CallingConvention* Detour)(Args...), detour_profile& Profile> \
+    struct profiled_detour<R (CallingConvention*)(Args...), Detour, Profile> \
+    { \
+        static R CallingConvention call(Args... args) \
+        { \
+            return details::profile_call<decltype(Detour), R, Args...>(Profile, Detour, args...); \
+        } \
+        static constexpr R (CallingConvention* function)(Args...) = &call; \
+    };
+
+    // Only x86 has more than one calling convention, and __fastcall/__vectorcall detours aren't worth supporting
+    PSF_PROFILED_DETOUR(__cdecl)
+#if defined(_M_IX86)
+    PSF_PROFILED_DETOUR(__stdcall)
+#endif
+#undef PSF_PROFILED_DETOUR
+#endif
+
+    namespace details
+    {
+        // The API that a detour named like "CreateFileFixup" detours is "CreateFile", plus 'suffix' (i.e. 'A' or 'W')
+        // for DECLARE_STRING_FIXUP's detours
+        template <std::size_t N>
+        struct api_name
+        {
+            char value[N + 1] = {};
+        };
+
+        template <std::size_t N>
+        constexpr api_name<N> make_api_name(const char (&detour)[N], char suffix) noexcept
+        {
+            constexpr char fixup[] = "Fixup";
+            constexpr std::size_t fixupLength = std::size(fixup) - 1;
+
+            api_name<N> result;
+            auto length = N - 1;
+            auto endsWithFixup = length > fixupLength;
+            for (std::size_t i = 0; endsWithFixup && (i < fixupLength); ++i)
+            {
+                endsWithFixup = detour[length - fixupLength + i] == fixup[i];
+            }
+
+            if (endsWithFixup)
+            {
+                length -= fixupLength;
+            }
+
+            for (std::size_t i = 0; i < length; ++i)
+            {
+                result.value[i] = detour[i];
+            }
+
+            if (suffix)
+            {
+                result.value[length] = suffix;
+            }
+
+            return result;
+        }
+
+        // FNV-1a, which is simple enough to be constexpr and spreads API names well enough for them not to collide
+        constexpr std::uint32_t api_id(const char* name) noexcept
+        {
+            std::uint32_t hash = 2166136261u;
+            for (; *name; ++name)
+            {
+                hash = (hash ^ static_cast<std::uint8_t>(*name)) * 16777619u;
+            }
+
+            return hash;
+        }
+
+        constexpr bool api_name_starts_with(const char* name, const char* prefix) noexcept
+        {
+            for (; *prefix; ++name, ++prefix)
+            {
+                if (*name != *prefix)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        constexpr bool api_name_contains(const char* name, const char* part) noexcept
+        {
+            for (; *name; ++name)
+            {
+                if (api_name_starts_with(name, part))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Goes by what the API is named, so e.g. the object manager's "NtOpenDirectoryObject" isn't a file API, but
+        // "CloseHandle" is, since it's the file APIs that detour it
+        constexpr psf_api_category api_category(const char* name) noexcept
+        {
+            if (api_name_starts_with(name, "Reg") || (api_name_starts_with(name, "Nt") && api_name_contains(name, "Key")))
+            {
+                return psf_api_category::registry;
+            }
+            else if (api_name_contains(name, "Process"))
+            {
+                return psf_api_category::process;
+            }
+            else if (api_name_contains(name, "Library") || api_name_contains(name, "DllDirector") ||
+                api_name_starts_with(name, "LoadModule"))
+            {
+                return psf_api_category::module;
+            }
+            else if (api_name_contains(name, "Object"))
+            {
+                return psf_api_category::other;
+            }
+
+            constexpr const char* fileParts[] = { "File", "Directory", "PrivateProfile", "NamedPipe", "HardLink", "SymbolicLink", "Handle", "FindClose" };
+            for (auto part : fileParts)
+            {
+                if (api_name_contains(name, part))
+                {
+                    return psf_api_category::file;
+                }
+            }
+
+            return psf_api_category::other;
+        }
+    }
+
     // Representation of the mapping from target function -> detoured function. This is used by DllMain when calling
     // DetourAttach/DetourDetach, updating the `Target` pointer as appropriate. In general, `DECLARE_PSF` should be
     // favored over constructing `fixup` objects directly
@@ -36,6 +258,10 @@ namespace psf
         Func& Target;
         Func Detour;
         bool Registered = false;
+        const psf_api_info* Api = nullptr;
+#ifdef PSF_PROFILE_FIXUPS
+        detour_profile* Profile = nullptr;
+#endif
     };
 
     namespace details
@@ -47,6 +273,10 @@ namespace psf
             void*& Target;
             void* Detour;
             bool Registered;
+            const psf_api_info* Api;
+#ifdef PSF_PROFILE_FIXUPS
+            detour_profile* Profile;
+#endif
         };
         static_assert(sizeof(detour_pair<void(*)()>) == sizeof(detour_function_pair));
 
@@ -58,31 +288,315 @@ namespace psf
         inline const auto fixups_end = &fixups_end_v;
     }
 
-    inline void attach_all()
+#ifdef PSF_PROFILE_FIXUPS
+    // Calls 'fn' with the profile of each of the module's detours, in no particular order
+    template <typename Func>
+    inline void for_each_detour_profile(Func&& fn)
     {
-        std::for_each(details::fixups_begin, details::fixups_end, [](details::detour_function_pair* target)
+        std::for_each(details::fixups_begin, details::fixups_end, [&](details::detour_function_pair* target)
+        {
+            if (target && target->Profile)
+            {
+                fn(static_cast<const detour_profile&>(*target->Profile));
+            }
+        });
+    }
+#endif
+
+    // Handlers are an alternative to detours for fixups that only sometimes need to do something with a call: all of the
+    // handlers for a function share a single detour of it (see psf_handler_chain), instead of each call going through
+    // every fixup's own detour. A handler has the same signature as the function it handles, plus a leading context
+    // argument, which it uses to pass on the calls that it doesn't handle. E.g.
+    //
+    //  auto CreateFileImpl = &::CreateFileW;
+    //
+    //  HANDLE CreateFileHandler(const psf::handler_context<decltype(CreateFileImpl)>& context, LPCWSTR fileName, ...)
+    //  {
+    //      if (!should_handle(fileName))
+    //      {
+    //          return context.next(fileName, ...);
+    //      }
+    //      ...
+    //      return context.original()(newFileName, ...);
+    //  }
+    //  DECLARE_HANDLER(CreateFileImpl, CreateFileHandler);
+    //
+    // Calls that a thread makes to the function from inside one of its handlers go straight to the function itself, so
+    // there's no need for a reentrancy guard. Outside of a handler, calling through the Impl pointer may still go through
+    // the function's handlers, including the fixup's own, since it's only the fixup that registered the first handler
+    // whose Impl pointer gets updated to point past the detour
+    template <typename Func>
+    class handler_context; // Only defined for the function pointer types that handlers can be declared for
+
+    namespace details
+    {
+        // The chain that the detour for 'Impl' walks, if it's the one that got registered
+        template <auto& Impl>
+        inline psf_handler_chain* handler_chain_v = nullptr;
+
+        template <typename Func, typename R, typename... Args>
+        class handler_context_base
         {
-            if (target && !target->Registered)
+        public:
+
+            using handler_type = R (*)(const handler_context<Func>&, Args...);
+
+            handler_context_base(const psf_handler_chain& chain, std::size_t index, Func original) noexcept :
+                m_chain(&chain),
+                m_index(index),
+                m_original(original)
+            {
+            }
+
+            // Calls the next handler, or the function itself if there are no more
+            R next(Args... args) const
+            {
+                for (auto index = m_index; index < psf_max_handlers; ++index)
+                {
+                    if (auto handler = m_chain->handlers[index].load(std::memory_order_acquire))
+                    {
+                        return reinterpret_cast<handler_type>(handler)(handler_context<Func>(*m_chain, index + 1, m_original), args...);
+                    }
+                }
+
+                return m_original(args...);
+            }
+
+            // The function itself, for handlers that handle the call and don't want the handlers after them to see it
+            Func original() const noexcept
+            {
+                return m_original;
+            }
+
+        private:
+
+            const psf_handler_chain* m_chain;
+            std::size_t m_index;
+            Func m_original;
+        };
+
+        template <typename Func, Func& Impl, typename R, typename... Args>
+        inline R dispatch(Args... args)
+        {
+            static reentrancy_guard reentrancyGuard;
+            auto guard = reentrancyGuard.enter();
+            auto chain = handler_chain_v<Impl>;
+            if (!guard || !chain)
+            {
+                return Impl(args...);
+            }
+
+            return handler_context<Func>(*chain, 0, Impl).next(args...);
+        }
+
+        struct handler_registration
+        {
+            void** Target;
+            void* Dispatcher;
+            void* Handler;
+            psf_handler_chain** Chain;
+            bool Registered;
+        };
+
+        inline __declspec(allocate("psfh$a")) handler_registration* const handlers_begin_v = nullptr;
+        inline __declspec(allocate("psfh$z")) handler_registration* const handlers_end_v = nullptr;
+
+        inline const auto handlers_begin = &handlers_begin_v + 1;
+        inline const auto handlers_end = &handlers_end_v;
+    }
+
+#define PSF_HANDLER_CONTEXT(CallingConvention) \
+    template <typename R, typename... Args> \
+    class handler_context<R (CallingConvention*)(Args...)> : \
+        public details::handler_context_base<R (CallingConvention*)(Args...), R, Args...> \
+    { \
+    public: \
+        using details::handler_context_base<R (CallingConvention*)(Args...), R, Args...>::handler_context_base; \
+        template <R (CallingConvention*& Impl)(Args...)> \
+        static R CallingConvention dispatch(Args... args) \
+        { \
+            return details::dispatch<R (CallingConvention*)(Args...), Impl, R, Args...>(args...); \
+        } \
+    };
+
+    PSF_HANDLER_CONTEXT(__cdecl)
+#if defined(_M_IX86)
+    PSF_HANDLER_CONTEXT(__stdcall)
+#endif
+#undef PSF_HANDLER_CONTEXT
+
+    namespace details
+    {
+        // Detours of functions in modules that may not be loaded yet; see PSFRegisterOnModuleLoad
+        struct lazy_detour
+        {
+            psf_lazy_registration Registration;
+            bool Registered;
+        };
+
+        inline __declspec(allocate("psfl$a")) lazy_detour* const lazy_fixups_begin_v = nullptr;
+        inline __declspec(allocate("psfl$z")) lazy_detour* const lazy_fixups_end_v = nullptr;
+
+        inline const auto lazy_fixups_begin = &lazy_fixups_begin_v + 1;
+        inline const auto lazy_fixups_end = &lazy_fixups_end_v;
+    }
+
+    // Only registers the fixups for which 'shouldAttach' returns true. It's given the address of the function pointer
+    // that the fixup detours (i.e. the first argument to DECLARE_FIXUP), which lets fixups that have alternative sets of
+    // detours choose between them at runtime. Everything gets registered with a single call to PSFRegisterBatch, except
+    // for handlers, which get registered one at a time after that (and for which 'shouldAttach' is given the address of
+    // the first argument to DECLARE_HANDLER the same way), and for DECLARE_LAZY_FIXUP's detours, which all get
+    // registered with a single call to PSFRegisterOnModuleLoad
+    template <typename Predicate>
+    inline void attach_all(Predicate&& shouldAttach)
+    {
+        std::vector<details::detour_function_pair*> targets;
+        std::vector<psf_registration> registrations;
+        std::vector<const psf_api_info*> apis;
+        std::for_each(details::fixups_begin, details::fixups_end, [&](details::detour_function_pair* target)
+        {
+            if (target && !target->Registered && shouldAttach(static_cast<const void*>(&target->Target)))
+            {
+                targets.push_back(target);
+                registrations.push_back(psf_registration{ &target->Target, target->Detour });
+                if (target->Api)
+                {
+                    apis.push_back(target->Api);
+                }
+            }
+        });
+
+        if (!registrations.empty())
+        {
+            // Registered first, so that the APIs have their indices before any of the detours can be called
+            check_win32(::PSFRegisterApis(apis.data(), apis.size()));
+            check_win32(::PSFRegisterBatch(registrations.data(), registrations.size()));
+            for (auto target : targets)
             {
-                check_win32(::PSFRegister(&target->Target, target->Detour));
                 target->Registered = true;
             }
+        }
+
+        std::for_each(details::handlers_begin, details::handlers_end, [&](details::handler_registration* entry)
+        {
+            if (entry && !entry->Registered && shouldAttach(static_cast<const void*>(entry->Target)))
+            {
+                check_win32(::PSFRegisterHandler(entry->Target, entry->Dispatcher, entry->Handler, entry->Chain));
+                entry->Registered = true;
+            }
         });
+
+        std::vector<details::lazy_detour*> lazyTargets;
+        std::vector<psf_lazy_registration> lazyRegistrations;
+        std::for_each(details::lazy_fixups_begin, details::lazy_fixups_end, [&](details::lazy_detour* target)
+        {
+            if (target && !target->Registered && shouldAttach(static_cast<const void*>(target->Registration.implFn)))
+            {
+                lazyTargets.push_back(target);
+                lazyRegistrations.push_back(target->Registration);
+            }
+        });
+
+        if (!lazyRegistrations.empty())
+        {
+            check_win32(::PSFRegisterOnModuleLoad(lazyRegistrations.data(), lazyRegistrations.size()));
+            for (auto target : lazyTargets)
+            {
+                target->Registered = true;
+            }
+        }
+    }
+
+    inline void attach_all()
+    {
+        attach_all([](const void*) { return true; });
     }
 
     inline void detach_all()
     {
+        // Best effort; ignore failures since there's not much we can do. That includes failing to allocate the batch, in
+        // which case everything gets unregistered one at a time instead
+        std::vector<psf_registration> registrations;
+        try
+        {
+            std::for_each(details::fixups_begin, details::fixups_end, [&](details::detour_function_pair* target)
+            {
+                if (target && target->Registered)
+                {
+                    registrations.push_back(psf_registration{ &target->Target, target->Detour });
+                }
+            });
+        }
+        catch (...)
+        {
+            registrations.clear();
+            std::for_each(details::fixups_begin, details::fixups_end, [](details::detour_function_pair* target)
+            {
+                if (target && target->Registered)
+                {
+                    ::PSFUnregister(&target->Target, target->Detour);
+                }
+            });
+        }
+
+        if (!registrations.empty())
+        {
+            ::PSFUnregisterBatch(registrations.data(), registrations.size());
+        }
+
         std::for_each(details::fixups_begin, details::fixups_end, [](details::detour_function_pair* target)
+        {
+            if (target)
+            {
+                target->Registered = false;
+            }
+        });
+
+        std::for_each(details::handlers_begin, details::handlers_end, [](details::handler_registration* entry)
+        {
+            if (entry && entry->Registered)
+            {
+                ::PSFUnregisterHandler(entry->Target, entry->Dispatcher, entry->Handler);
+                entry->Registered = false;
+            }
+        });
+
+        std::for_each(details::lazy_fixups_begin, details::lazy_fixups_end, [](details::lazy_detour* target)
         {
             if (target && target->Registered)
             {
-                // Best effort; ignore failures since there's not much we can do
-                ::PSFUnregister(&target->Target, target->Detour);
+                ::PSFUnregisterOnModuleLoad(&target->Registration, 1);
                 target->Registered = false;
             }
         });
     }
 
+    namespace details
+    {
+        // The fixups in a bundle, as declared with DECLARE_BUNDLED_FIXUP; see psf_bundled_fixup in psf_runtime.h
+        struct bundled_fixup
+        {
+            const wchar_t* Name;
+            psf_bundled_fixup Fixup;
+        };
+
+        inline __declspec(allocate("psfb$a")) bundled_fixup* const bundled_fixups_begin_v = nullptr;
+        inline __declspec(allocate("psfb$z")) bundled_fixup* const bundled_fixups_end_v = nullptr;
+
+        inline const auto bundled_fixups_begin = &bundled_fixups_begin_v + 1;
+        inline const auto bundled_fixups_end = &bundled_fixups_end_v;
+    }
+
+    // Gives back the bundled fixup named 'name', compared case insensitively, or null if the bundle doesn't have it
+    inline const psf_bundled_fixup* find_bundled_fixup(const wchar_t* name) noexcept
+    {
+        auto itr = std::find_if(details::bundled_fixups_begin, details::bundled_fixups_end, [&](details::bundled_fixup* entry)
+        {
+            return entry && (::CompareStringOrdinal(entry->Name, -1, name, -1, TRUE) == CSTR_EQUAL);
+        });
+        return (itr == details::bundled_fixups_end) ? nullptr : &(*itr)->Fixup;
+    }
+
     // Useful helper for determining if a function is ANSI, e.g. for simpler std::conditional_t arguments
     template <typename CharT>
     constexpr bool is_ansi = std::is_same_v<CharT, char>;
@@ -168,18 +682,107 @@ namespace psf
 #define PSF_LINKER_INCLUDE(Name) __pragma(comment(linker, "/include:" #Name))
 #endif
 
+// The identity of the API that a detour declared with DECLARE_FIXUP/DECLARE_STRING_FIXUP detours, as a constexpr
+// psf_api_info named e.g. 'CreateFileFixup_Api' (or 'CreateFileFixupAnsi_Api' and 'CreateFileFixupWide_Api'), which
+// gets registered with the PsfRuntime along with the detour
+#define PSF_DECLARE_API_INFO(DetouredFunc, Name, Suffix) \
+    static constexpr auto Name##_ApiName = psf::details::make_api_name(#DetouredFunc, Suffix); \
+    static constexpr psf_api_info Name##_Api{ psf::details::api_id(Name##_ApiName.value), \
+        psf::details::api_category(Name##_ApiName.value), Name##_ApiName.value };
+
+#ifndef PSF_PROFILE_FIXUPS
 #define DECLARE_FIXUP(TargetFunc, DetouredFunc) \
-    static psf::detour_pair<decltype(TargetFunc)> DetouredFunc##_Fixup{ TargetFunc, DetouredFunc }; \
+    PSF_DECLARE_API_INFO(DetouredFunc, DetouredFunc, '\0') \
+    static psf::detour_pair<decltype(TargetFunc)> DetouredFunc##_Fixup{ TargetFunc, DetouredFunc, false, &DetouredFunc##_Api }; \
     extern "C" __declspec(allocate("psf$m")) auto DetouredFunc##_Fixup_v = &DetouredFunc##_Fixup; \
     PSF_LINKER_INCLUDE(DetouredFunc##_Fixup_v)
 
 #define DECLARE_STRING_FIXUP(StringFunctions, DetouredFunc) \
-    static psf::detour_pair<decltype(StringFunctions.ansi)> DetouredFunc##Ansi_Fixup{ StringFunctions.ansi, DetouredFunc<char> }; \
-    static psf::detour_pair<decltype(StringFunctions.wide)> DetouredFunc##Wide_Fixup{ StringFunctions.wide, DetouredFunc<wchar_t> }; \
+    PSF_DECLARE_API_INFO(DetouredFunc, DetouredFunc##Ansi, 'A') \
+    PSF_DECLARE_API_INFO(DetouredFunc, DetouredFunc##Wide, 'W') \
+    static psf::detour_pair<decltype(StringFunctions.ansi)> DetouredFunc##Ansi_Fixup{ StringFunctions.ansi, DetouredFunc<char>, \
+        false, &DetouredFunc##Ansi_Api }; \
+    static psf::detour_pair<decltype(StringFunctions.wide)> DetouredFunc##Wide_Fixup{ StringFunctions.wide, DetouredFunc<wchar_t>, \
+        false, &DetouredFunc##Wide_Api }; \
     extern "C" __declspec(allocate("psf$m")) auto DetouredFunc##Ansi_Fixup_v = &DetouredFunc##Ansi_Fixup; \
     extern "C" __declspec(allocate("psf$m")) auto DetouredFunc##Wide_Fixup_v = &DetouredFunc##Wide_Fixup; \
     PSF_LINKER_INCLUDE(DetouredFunc##Ansi_Fixup_v) \
     PSF_LINKER_INCLUDE(DetouredFunc##Wide_Fixup_v)
+#else
+#define DECLARE_FIXUP(TargetFunc, DetouredFunc) \
+    PSF_DECLARE_API_INFO(DetouredFunc, DetouredFunc, '\0') \
+    static psf::detour_profile DetouredFunc##_Profile{ #DetouredFunc }; \
+    static psf::detour_pair<decltype(TargetFunc)> DetouredFunc##_Fixup{ TargetFunc, \
+        psf::profiled_detour<decltype(TargetFunc), DetouredFunc, DetouredFunc##_Profile>::function, false, \
+        &DetouredFunc##_Api, &DetouredFunc##_Profile }; \
+    extern "C" __declspec(allocate("psf$m")) auto DetouredFunc##_Fixup_v = &DetouredFunc##_Fixup; \
+    PSF_LINKER_INCLUDE(DetouredFunc##_Fixup_v)
+
+#define DECLARE_STRING_FIXUP(StringFunctions, DetouredFunc) \
+    PSF_DECLARE_API_INFO(DetouredFunc, DetouredFunc##Ansi, 'A') \
+    PSF_DECLARE_API_INFO(DetouredFunc, DetouredFunc##Wide, 'W') \
+    static psf::detour_profile DetouredFunc##Ansi_Profile{ #DetouredFunc "<char>" }; \
+    static psf::detour_profile DetouredFunc##Wide_Profile{ #DetouredFunc "<wchar_t>" }; \
+    static psf::detour_pair<decltype(StringFunctions.ansi)> DetouredFunc##Ansi_Fixup{ StringFunctions.ansi, \
+        psf::profiled_detour<decltype(StringFunctions.ansi), DetouredFunc<char>, DetouredFunc##Ansi_Profile>::function, false, \
+        &DetouredFunc##Ansi_Api, &DetouredFunc##Ansi_Profile }; \
+    static psf::detour_pair<decltype(StringFunctions.wide)> DetouredFunc##Wide_Fixup{ StringFunctions.wide, \
+        psf::profiled_detour<decltype(StringFunctions.wide), DetouredFunc<wchar_t>, DetouredFunc##Wide_Profile>::function, false, \
+        &DetouredFunc##Wide_Api, &DetouredFunc##Wide_Profile }; \
+    extern "C" __declspec(allocate("psf$m")) auto DetouredFunc##Ansi_Fixup_v = &DetouredFunc##Ansi_Fixup; \
+    extern "C" __declspec(allocate("psf$m")) auto DetouredFunc##Wide_Fixup_v = &DetouredFunc##Wide_Fixup; \
+    PSF_LINKER_INCLUDE(DetouredFunc##Ansi_Fixup_v) \
+    PSF_LINKER_INCLUDE(DetouredFunc##Wide_Fixup_v)
+#endif
+
+// NOTE: Handlers don't get profiled with PSF_PROFILE_FIXUPS, and neither does the detour that they share
+#define DECLARE_HANDLER(TargetFunc, HandlerFunc) \
+    static psf::details::handler_registration HandlerFunc##_Handler{ reinterpret_cast<void**>(&TargetFunc), \
+        reinterpret_cast<void*>(&psf::handler_context<decltype(TargetFunc)>::dispatch<TargetFunc>), \
+        reinterpret_cast<void*>(static_cast<psf::handler_context<decltype(TargetFunc)>::handler_type>(HandlerFunc)), \
+        &psf::details::handler_chain_v<TargetFunc> }; \
+    extern "C" __declspec(allocate("psfh$m")) auto HandlerFunc##_Handler_v = &HandlerFunc##_Handler; \
+    PSF_LINKER_INCLUDE(HandlerFunc##_Handler_v)
+
+// Detours 'ProcName' (a string) in 'ModuleName' (a wide string, e.g. L"user32.dll") once that module is loaded, which may
+// be long after the fixup initializes. 'TargetFunc' is null until then, and needs to be declared with the function's
+// type, e.g. 'decltype(&::MessageBoxW) MessageBoxImpl = nullptr;'. These aren't profiled with PSF_PROFILE_FIXUPS either
+#define DECLARE_LAZY_FIXUP(ModuleName, ProcName, TargetFunc, DetouredFunc) \
+    static psf::details::lazy_detour DetouredFunc##_LazyFixup{ { ModuleName, ProcName, reinterpret_cast<void**>(&TargetFunc), \
+        reinterpret_cast<void*>(static_cast<decltype(TargetFunc)>(DetouredFunc)) } }; \
+    extern "C" __declspec(allocate("psfl$m")) auto DetouredFunc##_LazyFixup_v = &DetouredFunc##_LazyFixup; \
+    PSF_LINKER_INCLUDE(DetouredFunc##_LazyFixup_v)
+
+// Adds a fixup to the bundle that the current dll is, under 'Name' (a wide string, e.g. L"FileRedirectionFixup"), which
+// is what the PsfRuntime then asks the bundle for when config.json lists a fixup dll of that name. 'ProcessTerminating' is
+// optional and can be nullptr. The fixups in a bundle share the module's DECLARE_FIXUP/DECLARE_HANDLER/DECLARE_LAZY_FIXUP
+// declarations, so psf::attach_all in one fixup's 'Initialize' would register every other fixup's detours along with its
+// own; bundled fixups need to either call PSFRegister for their own detours themselves, or only one of them can use those
+// macros. Defining PSF_DEFINE_BUNDLE_EXPORTS in a single translation unit exports PSFQueryBundledFixup for the bundle
+#define DECLARE_BUNDLED_FIXUP(Name, Initialize, Uninitialize, ProcessTerminating) \
+    static psf::details::bundled_fixup Initialize##_BundledFixup{ Name, { Initialize, Uninitialize, ProcessTerminating } }; \
+    extern "C" __declspec(allocate("psfb$m")) auto Initialize##_BundledFixup_v = &Initialize##_BundledFixup; \
+    PSF_LINKER_INCLUDE(Initialize##_BundledFixup_v)
+
+#ifdef PSF_DEFINE_BUNDLE_EXPORTS
+extern "C" int __stdcall PSFQueryBundledFixup(_In_ const wchar_t* name, _Out_ psf_bundled_fixup* fixup) noexcept
+{
+    auto bundledFixup = psf::find_bundled_fixup(name);
+    if (!bundledFixup)
+    {
+        return ERROR_NOT_FOUND;
+    }
+
+    *fixup = *bundledFixup;
+    return ERROR_SUCCESS;
+}
+
+#ifdef _M_IX86
+#pragma comment(linker, "/EXPORT:PSFQueryBundledFixup=_PSFQueryBundledFixup@8")
+#else
+#pragma comment(linker, "/EXPORT:PSFQueryBundledFixup=PSFQueryBundledFixup")
+#endif
+#endif
 
 #ifdef PSF_DEFINE_EXPORTS
 extern "C" {
@@ -212,5 +815,29 @@ catch (...)
 #pragma comment(linker, "/EXPORT:PSFUninitialize=PSFUninitialize")
 #endif
 
+#ifdef PSF_PROFILE_FIXUPS
+// Fills 'profiles' with up to 'capacity' of the fixup's detour profiles, and returns how many there are in total. Meant
+// to be found with GetProcAddress, since only fixups built with PSF_PROFILE_FIXUPS have it
+std::size_t __stdcall PSFQueryDetourProfiles(_Out_writes_(capacity) const psf::detour_profile** profiles, std::size_t capacity) noexcept
+{
+    std::size_t count = 0;
+    psf::for_each_detour_profile([&](const psf::detour_profile& profile)
+    {
+        if (count < capacity)
+        {
+            profiles[count] = &profile;
+        }
+        ++count;
+    });
+    return count;
+}
+
+#ifdef _M_IX86
+#pragma comment(linker, "/EXPORT:PSFQueryDetourProfiles=_PSFQueryDetourProfiles@8")
+#else
+#pragma comment(linker, "/EXPORT:PSFQueryDetourProfiles=PSFQueryDetourProfiles")
+#endif
+#endif
+
 }
 #endif
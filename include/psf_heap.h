@@ -0,0 +1,94 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Helpers for putting long-lived data on the PSF's private heap (see PSFAllocate in psf_runtime.h). heap_allocator is an
+// STL allocator for containers, and types that derive from heap_object get allocated there by 'new'. E.g.:
+//      struct my_cache : psf::heap_object
+//      {
+//          std::vector<entry, psf::heap_allocator<entry>> entries;
+//      };
+// NOTE: Class-specific operator new/delete are only found through the type being deleted, so a heap_object must be
+//       deleted through a pointer to a type that derives from heap_object, or that has a virtual destructor
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <string>
+
+#include "psf_runtime.h"
+
+namespace psf
+{
+    template <typename T>
+    struct heap_allocator
+    {
+        static_assert(alignof(T) <= MEMORY_ALLOCATION_ALIGNMENT);
+
+        using value_type = T;
+
+        heap_allocator() noexcept = default;
+
+        template <typename U>
+        heap_allocator(const heap_allocator<U>&) noexcept
+        {
+        }
+
+        T* allocate(std::size_t count)
+        {
+            if (count > (std::numeric_limits<std::size_t>::max)() / sizeof(T))
+            {
+                throw std::bad_array_new_length();
+            }
+
+            if (auto result = ::PSFAllocate(count * sizeof(T)))
+            {
+                return static_cast<T*>(result);
+            }
+
+            throw std::bad_alloc();
+        }
+
+        void deallocate(T* ptr, std::size_t) noexcept
+        {
+            ::PSFFree(ptr);
+        }
+
+        template <typename U>
+        bool operator==(const heap_allocator<U>&) const noexcept
+        {
+            return true;
+        }
+
+        template <typename U>
+        bool operator!=(const heap_allocator<U>&) const noexcept
+        {
+            return false;
+        }
+    };
+
+    struct heap_object
+    {
+        static void* operator new(std::size_t size)
+        {
+            if (auto result = ::PSFAllocate(size))
+            {
+                return result;
+            }
+
+            throw std::bad_alloc();
+        }
+
+        static void operator delete(void* ptr) noexcept
+        {
+            ::PSFFree(ptr);
+        }
+    };
+
+    template <typename CharT, typename Traits = std::char_traits<CharT>>
+    using basic_heap_string = std::basic_string<CharT, Traits, heap_allocator<CharT>>;
+    using heap_string = basic_heap_string<char>;
+    using heap_wstring = basic_heap_string<wchar_t>;
+}
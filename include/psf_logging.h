@@ -0,0 +1,423 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Logging that keeps OutputDebugString - which is very slow with a debugger or DbgView attached - off of the calling
+// thread. Each thread formats its messages into a ring buffer of its own, without taking any locks, and a background
+// thread drains all of the rings to the sink: OutputDebugString by default, or a file, or a callback (e.g. one that
+// writes ETW events). Use might look like:
+//      psf::log("\tInject into PID=%d\n", processId);
+//      PSF_LOG_VERBOSE("\tmatched %ls\n", pattern);
+// Messages from the same thread come out in order; messages from different threads can interleave differently than
+// they were logged. When a thread's ring is full, its messages get dropped (and are counted, and the count logged)
+// rather than having the thread wait.
+//
+// PSF_LOG_LEVEL selects which of the PSF_LOG_* macros do anything; the rest compile to nothing, arguments included. It
+// defaults to everything.
+// NOTE: Each module that includes this has its own rings and background thread, which holds a reference on the module
+//       so that it can't get unloaded out from under it. Call psf::flush_log on the way out (e.g. at DLL_PROCESS_DETACH)
+//       so that whatever is still buffered doesn't get lost
+#pragma once
+
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <windows.h>
+
+#define PSF_LOG_LEVEL_NONE      0
+#define PSF_LOG_LEVEL_ERROR     1
+#define PSF_LOG_LEVEL_INFO      2
+#define PSF_LOG_LEVEL_VERBOSE   3
+
+#ifndef PSF_LOG_LEVEL
+#define PSF_LOG_LEVEL PSF_LOG_LEVEL_VERBOSE
+#endif
+
+#if PSF_LOG_LEVEL >= PSF_LOG_LEVEL_ERROR
+#define PSF_LOG_ERROR(...) ::psf::log(__VA_ARGS__)
+#else
+#define PSF_LOG_ERROR(...) ((void)0)
+#endif
+
+#if PSF_LOG_LEVEL >= PSF_LOG_LEVEL_INFO
+#define PSF_LOG_INFO(...) ::psf::log(__VA_ARGS__)
+#else
+#define PSF_LOG_INFO(...) ((void)0)
+#endif
+
+#if PSF_LOG_LEVEL >= PSF_LOG_LEVEL_VERBOSE
+#define PSF_LOG_VERBOSE(...) ::psf::log(__VA_ARGS__)
+#else
+#define PSF_LOG_VERBOSE(...) ((void)0)
+#endif
+
+namespace psf
+{
+    // Gets called on the background thread with one message at a time, not null terminated
+    using log_callback = void (*)(const char* text, std::size_t length) noexcept;
+
+    namespace details
+    {
+        // Messages longer than a single record take up several consecutive ones
+        struct log_record
+        {
+            static constexpr std::size_t size = 256;
+            static constexpr std::size_t capacity = size - sizeof(std::uint16_t) * 2;
+
+            std::uint16_t length;
+            std::uint16_t more; // Non-zero if the message continues in the next record
+            char text[capacity];
+        };
+        static_assert(sizeof(log_record) == log_record::size);
+
+        // Single producer (the thread that owns it) and single consumer (whoever holds g_LogDrainLock)
+        struct log_ring
+        {
+            static constexpr std::uint32_t capacity = 128;
+
+            std::atomic<std::uint32_t> head = 0; // Records written; only the owner changes it
+            std::atomic<std::uint32_t> tail = 0; // Records consumed; only the drainer changes it
+            std::atomic<bool> owned = true;
+            log_ring* next = nullptr; // Never changes once the ring is in g_LogRings
+            log_record records[capacity];
+        };
+
+        // Rings are never freed; when a thread exits, its ring goes to the next thread that needs one
+        inline std::atomic<log_ring*> g_LogRings = nullptr;
+
+        inline SRWLOCK g_LogDrainLock = SRWLOCK_INIT;
+        inline std::atomic<std::uint32_t> g_LogDropped = 0;
+
+        enum class log_thread_state : std::uint32_t
+        {
+            not_started,
+            starting,
+            running,
+            failed, // Everything gets written synchronously instead
+        };
+        inline std::atomic<log_thread_state> g_LogThreadState = log_thread_state::not_started;
+        inline HANDLE g_LogWakeEvent = nullptr;
+
+        // How often the background thread checks the rings when nobody has woken it up
+        constexpr DWORD log_drain_interval = 50;
+
+        inline std::atomic<HANDLE> g_LogFile = nullptr;
+        inline std::atomic<log_callback> g_LogCallback = nullptr;
+
+        inline void write_log_message(const char* text, std::size_t length) noexcept
+        {
+            if (auto callback = g_LogCallback.load(std::memory_order_acquire))
+            {
+                callback(text, length);
+            }
+            else if (auto file = g_LogFile.load(std::memory_order_acquire))
+            {
+                DWORD written;
+                ::WriteFile(file, text, static_cast<DWORD>(length), &written, nullptr);
+            }
+            else
+            {
+                ::OutputDebugStringA(text);
+            }
+        }
+
+        // Only called with g_LogDrainLock held, so the buffer that messages get reassembled in can be shared
+        inline void drain_log_ring(log_ring& ring) noexcept
+        {
+            static char message[4096];
+            static std::size_t messageLength = 0;
+
+            auto head = ring.head.load(std::memory_order_acquire);
+            auto tail = ring.tail.load(std::memory_order_relaxed);
+            for (; tail != head; ++tail)
+            {
+                auto& record = ring.records[tail % log_ring::capacity];
+
+                // Anything that doesn't fit gets written in pieces
+                if (messageLength + record.length >= sizeof(message))
+                {
+                    message[messageLength] = '\0';
+                    write_log_message(message, messageLength);
+                    messageLength = 0;
+                }
+
+                std::memcpy(message + messageLength, record.text, record.length);
+                messageLength += record.length;
+                if (!record.more)
+                {
+                    message[messageLength] = '\0';
+                    write_log_message(message, messageLength);
+                    messageLength = 0;
+                }
+            }
+
+            ring.tail.store(tail, std::memory_order_release);
+        }
+
+        inline void drain_log() noexcept
+        {
+            for (auto ring = g_LogRings.load(std::memory_order_acquire); ring; ring = ring->next)
+            {
+                drain_log_ring(*ring);
+            }
+
+            if (auto dropped = g_LogDropped.exchange(0))
+            {
+                char text[64];
+                auto length = std::snprintf(text, sizeof(text), "PSF: %u log message(s) dropped\n", dropped);
+                write_log_message(text, static_cast<std::size_t>(length));
+            }
+        }
+
+        inline DWORD __stdcall log_thread_proc(void*) noexcept
+        {
+            while (true)
+            {
+                ::WaitForSingleObject(g_LogWakeEvent, log_drain_interval);
+                ::AcquireSRWLockExclusive(&g_LogDrainLock);
+                drain_log();
+                ::ReleaseSRWLockExclusive(&g_LogDrainLock);
+            }
+        }
+
+        // Returns false if messages have to be written synchronously
+        inline bool start_log_thread() noexcept
+        {
+            auto state = g_LogThreadState.load(std::memory_order_acquire);
+            if (state == log_thread_state::not_started)
+            {
+                auto expected = log_thread_state::not_started;
+                if (g_LogThreadState.compare_exchange_strong(expected, log_thread_state::starting))
+                {
+                    // The thread's code lives in this module, which therefore has to stay loaded for as long as it runs
+                    HMODULE module;
+                    g_LogWakeEvent = ::CreateEventW(nullptr, FALSE, FALSE, nullptr);
+                    auto thread = (g_LogWakeEvent && ::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+                        reinterpret_cast<LPCWSTR>(&log_thread_proc), &module)) ?
+                        ::CreateThread(nullptr, 0, &log_thread_proc, nullptr, 0, nullptr) : nullptr;
+                    if (thread)
+                    {
+                        ::CloseHandle(thread);
+                    }
+
+                    state = thread ? log_thread_state::running : log_thread_state::failed;
+                    g_LogThreadState.store(state, std::memory_order_release);
+                    return thread != nullptr;
+                }
+
+                state = expected;
+            }
+
+            // While another thread is busy starting it, messages can already go into the ring
+            return state != log_thread_state::failed;
+        }
+
+        inline void wake_log_thread() noexcept
+        {
+            // The event only gets created along with the thread
+            if (g_LogThreadState.load(std::memory_order_acquire) == log_thread_state::running)
+            {
+                ::SetEvent(g_LogWakeEvent);
+            }
+        }
+
+        struct log_ring_owner
+        {
+            log_ring* ring = nullptr;
+
+            ~log_ring_owner()
+            {
+                if (ring)
+                {
+                    ring->owned.store(false, std::memory_order_release);
+                }
+            }
+        };
+
+        inline log_ring* current_log_ring() noexcept
+        {
+            thread_local log_ring_owner owner;
+            if (owner.ring)
+            {
+                return owner.ring;
+            }
+
+            for (auto ring = g_LogRings.load(std::memory_order_acquire); ring; ring = ring->next)
+            {
+                bool expected = false;
+                if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    owner.ring = ring;
+                    return ring;
+                }
+            }
+
+            auto ring = new (std::nothrow) log_ring;
+            if (!ring)
+            {
+                return nullptr;
+            }
+
+            ring->next = g_LogRings.load(std::memory_order_relaxed);
+            while (!g_LogRings.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+
+            owner.ring = ring;
+            return ring;
+        }
+
+        // Expects text[length] to be '\0', for when it gets written synchronously
+        inline void log_message(const char* text, std::size_t length) noexcept
+        {
+            log_ring* ring = start_log_thread() ? current_log_ring() : nullptr;
+            if (!ring)
+            {
+                ::AcquireSRWLockExclusive(&g_LogDrainLock);
+                write_log_message(text, length);
+                ::ReleaseSRWLockExclusive(&g_LogDrainLock);
+                return;
+            }
+
+            auto recordCount = static_cast<std::uint32_t>((length + log_record::capacity - 1) / log_record::capacity);
+            recordCount = recordCount ? recordCount : 1;
+
+            auto head = ring->head.load(std::memory_order_relaxed);
+            auto used = head - ring->tail.load(std::memory_order_acquire);
+            if (recordCount > log_ring::capacity - used)
+            {
+                ++g_LogDropped;
+                wake_log_thread();
+                return;
+            }
+
+            for (std::uint32_t i = 0; i < recordCount; ++i)
+            {
+                auto& record = ring->records[(head + i) % log_ring::capacity];
+                auto count = (length < log_record::capacity) ? length : log_record::capacity;
+                std::memcpy(record.text, text, count);
+                record.length = static_cast<std::uint16_t>(count);
+                record.more = (i + 1 < recordCount);
+                text += count;
+                length -= count;
+            }
+
+            ring->head.store(head + recordCount, std::memory_order_release);
+
+            // Only bother the background thread before the ring gets close to full; otherwise it'll get to it soon enough
+            if (used + recordCount >= log_ring::capacity / 2)
+            {
+                wake_log_thread();
+            }
+        }
+    }
+
+    // Formats the message once on the stack, or on the heap if it's too long for that
+    inline void log_vprintf(const char* fmt, va_list args) noexcept
+    {
+        char buffer[512];
+        va_list argsCopy;
+        va_copy(argsCopy, args);
+        auto count = std::vsnprintf(buffer, sizeof(buffer), fmt, argsCopy);
+        va_end(argsCopy);
+        if (count < 0)
+        {
+            return;
+        }
+
+        if (static_cast<std::size_t>(count) < sizeof(buffer))
+        {
+            details::log_message(buffer, count);
+            return;
+        }
+
+        try
+        {
+            std::string str(count, '\0');
+            std::vsnprintf(str.data(), str.size() + 1, fmt, args);
+            details::log_message(str.c_str(), str.size());
+        }
+        catch (...)
+        {
+            // Out of memory; the truncated message is better than nothing
+            details::log_message(buffer, sizeof(buffer) - 1);
+        }
+    }
+
+    inline void log(const char* fmt, ...) noexcept
+    {
+        va_list args;
+        va_start(args, fmt);
+        log_vprintf(fmt, args);
+        va_end(args);
+    }
+
+    // For messages that are already formatted. Expects text[length] to be '\0'
+    inline void log_message(const char* text, std::size_t length) noexcept
+    {
+        details::log_message(text, length);
+    }
+
+    // Same conversion as OutputDebugStringW does it
+    inline void log_message(const wchar_t* text, std::size_t length) noexcept
+    {
+        char buffer[512];
+        auto count = ::WideCharToMultiByte(CP_ACP, 0, text, static_cast<int>(length), buffer, sizeof(buffer) - 1, nullptr, nullptr);
+        if (count > 0)
+        {
+            buffer[count] = '\0';
+            details::log_message(buffer, count);
+            return;
+        }
+
+        count = ::WideCharToMultiByte(CP_ACP, 0, text, static_cast<int>(length), nullptr, 0, nullptr, nullptr);
+        if (count > 0) try
+        {
+            std::string str(count, '\0');
+            ::WideCharToMultiByte(CP_ACP, 0, text, static_cast<int>(length), str.data(), count, nullptr, nullptr);
+            details::log_message(str.c_str(), str.size());
+        }
+        catch (...)
+        {
+        }
+    }
+
+    // Sends messages to a file instead of OutputDebugString, or back to it when null. The file must stay open for as
+    // long as it's used, including by messages logged before the switch that haven't made it out yet
+    inline void set_log_file(HANDLE file) noexcept
+    {
+        details::g_LogFile.store(file, std::memory_order_release);
+    }
+
+    // Takes precedence over the file, if any
+    inline void set_log_callback(log_callback callback) noexcept
+    {
+        details::g_LogCallback.store(callback, std::memory_order_release);
+    }
+
+    // Writes out everything that's been logged so far. When the process is terminating, the background thread may have
+    // been killed in the middle of draining, so the rings get drained regardless
+    inline void flush_log(bool processTerminating = false) noexcept
+    {
+        if (!::TryAcquireSRWLockExclusive(&details::g_LogDrainLock))
+        {
+            if (processTerminating)
+            {
+                details::drain_log();
+                return;
+            }
+
+            ::AcquireSRWLockExclusive(&details::g_LogDrainLock);
+        }
+
+        details::drain_log();
+        ::ReleaseSRWLockExclusive(&details::g_LogDrainLock);
+    }
+}
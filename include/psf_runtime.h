@@ -4,6 +4,12 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+
 #include <windows.h>
 
 #include "psf_config.h"
@@ -20,6 +26,200 @@
 using PSFInitializeProc = int (__stdcall *)() noexcept;
 using PSFUninitializeProc = int (__stdcall *)() noexcept;
 
+// Optional; called instead of PSFUninitialize when the process is terminating, at which point the fixup's detours stay
+// in place and the fixup doesn't get unloaded. Only meant for flushing whatever would otherwise be lost (e.g. telemetry)
+using PSFProcessTerminatingProc = void (__stdcall *)() noexcept;
+
+// A fixup bundle is a single dll that several fixups are linked into, so that a process that uses them loads (and
+// relocates, and initializes the CRT of) one dll instead of one per fixup. The process's "fixupBundle" names the bundle,
+// and the PsfRuntime then asks its PSFQueryBundledFixup export for each of the process's fixups by name, i.e. the "dll"
+// without its ".dll" and architecture suffixes, before falling back to loading the fixup's own dll. The export returns
+// ERROR_SUCCESS and fills in 'fixup', or ERROR_NOT_FOUND for a fixup that isn't in the bundle. See DECLARE_BUNDLED_FIXUP
+// in psf_framework.h
+struct psf_bundled_fixup
+{
+    PSFInitializeProc initialize;
+    PSFUninitializeProc uninitialize;
+    PSFProcessTerminatingProc process_terminating; // Optional
+};
+
+using PSFQueryBundledFixupProc = int (__stdcall *)(_In_ const wchar_t* name, _Out_ psf_bundled_fixup* fixup) noexcept;
+
+// The arguments to a single PSFRegister/PSFUnregister call, for use with PSFRegisterBatch/PSFUnregisterBatch
+struct psf_registration
+{
+    void** implFn;
+    void* fixupFn;
+};
+
+// What kind of resource a detoured API works with, so that instrumentation can group APIs without knowing each of them
+enum class psf_api_category : std::uint32_t
+{
+    other,
+    file,
+    registry,
+    process,
+    module,
+};
+
+// The identity of a detoured API, which DECLARE_FIXUP and DECLARE_STRING_FIXUP work out at compile time from the name of
+// the detour (see psf::details::make_api_name in psf_framework.h). The id is a hash of the name, so it's the same in
+// every fixup - and every process - that detours the API
+struct psf_api_info
+{
+    std::uint32_t id;
+    psf_api_category category;
+    const char* name; // E.g. "CreateFileW"
+};
+
+constexpr std::uint32_t psf_invalid_api_index = 0xFFFFFFFF;
+
+// Fixups that handle calls to the same function can share a single detour of it instead of each detouring it on their
+// own (see DECLARE_HANDLER in psf_framework.h, and HandlerDispatch.cpp). The detour calls the function's handlers in the
+// order that they were registered, which is the order the fixups appear in config.json, and each handler either handles
+// the call itself or passes it on to the next, the last of which is the function itself
+constexpr std::size_t psf_max_handlers = 16;
+
+struct psf_handler_chain
+{
+    // Entries are null once unregistered, and past the last handler registered
+    std::atomic<void*> handlers[psf_max_handlers];
+};
+
+// A detour of a function in a module that may not be loaded yet, for use with PSFRegisterOnModuleLoad. Once the module is
+// loaded, '*implFn' gets set to the result of GetProcAddress for 'procName' before being detoured
+struct psf_lazy_registration
+{
+    const wchar_t* moduleName; // The module's file name, e.g. L"user32.dll"
+    const char* procName;
+    void** implFn;
+    void* fixupFn;
+};
+
+enum class psf_startup_phase : std::uint32_t
+{
+    load_config,        // Reading config.json and the package's identity
+    restore_after_with, // DetourRestoreAfterWith
+    attach_all,         // The PsfRuntime's own DetourAttach calls
+    attach_commit,      // ... and committing them
+    load_fixup,         // A fixup's LoadLibrary. 'name' is the dll, as given in config.json
+    initialize_fixup,   // A fixup's PSFInitialize. 'name' is the same as for load_fixup
+    fixups_commit,      // Committing a transaction's worth of the fixups' detours
+    module_load_commit, // Attaching the fixups' PSFRegisterOnModuleLoad detours of modules that were already loaded
+    load_fixups,        // All of the above from load_fixup on, i.e. from the hooked entry point getting called until the
+                        // fixups are in place
+};
+
+struct psf_startup_timing
+{
+    psf_startup_phase phase;
+    const wchar_t* name; // Null, except where noted above
+    std::int64_t start;
+    std::int64_t end;
+};
+
+// The layout of the live counters section (see PSFRegisterLiveCounters), which is named "Local\PsfLiveCounters_<pid>",
+// for readers in other processes. It's a header followed by 'capacity' entries, of which the first 'entry_count' are in
+// use. The PsfRuntime rewrites it about once a second, and 'sequence' is odd while it's doing so: readers copy what
+// they need and only use the copy if 'sequence' was the same even value before and after. Readers must check 'magic'
+// and 'version', and use 'header_size' and 'entry_size' to find the entries, since later versions may add fields
+constexpr std::uint32_t psf_live_counters_magic = 0x43464c50; // "PLFC"
+constexpr std::uint32_t psf_live_counters_version = 1;
+constexpr std::size_t psf_live_counter_values = 4;
+constexpr std::size_t psf_live_counter_buckets = 32;
+
+struct psf_live_counters_header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint32_t entry_size;
+    std::uint32_t capacity;
+    std::uint32_t entry_count;
+    std::uint32_t process_id;
+    std::uint32_t reserved;
+    std::uint64_t sequence;
+    std::uint64_t update_time; // A FILETIME, as of the last update
+};
+
+struct psf_live_counter_entry
+{
+    char fixup[32]; // The fixup dll's file name, without the extension. Filled in by the PsfRuntime
+    char api[48];   // Null terminated, unless it takes up the whole array
+    std::uint64_t calls;
+    std::uint64_t values[psf_live_counter_values]; // Up to the fixup; see its readme for what they count
+
+    // Histograms of how long calls took, split into the time spent in the fixup and in the call it made on behalf of
+    // the caller. Bucket 0 counts calls that took no measurable time, and bucket N > 0 counts calls that took
+    // [2^(N-1), 2^N) nanoseconds. All zero when the fixup doesn't time its calls
+    std::uint64_t fixup_latency[psf_live_counter_buckets];
+    std::uint64_t call_latency[psf_live_counter_buckets];
+};
+
+// Writes up to 'capacity' entries' worth of counters, which are totals since the process started, and returns how many
+// it wrote. The entries are zeroed beforehand. Called on a thread pool thread, never concurrently with itself
+using PSFLiveCountersProc = std::size_t (__stdcall *)(_In_opt_ void* context, _Out_writes_(capacity) psf_live_counter_entry* entries, std::size_t capacity) noexcept;
+
+// What a module costs in memory, as reported by PSFQueryMemoryUsage. Each entry is for a module that the PsfRuntime
+// loaded (i.e. itself and the fixups), or that allocated from the private heap, with the first entry being for
+// allocations that couldn't be attributed to a module, which has a null 'module'
+struct psf_memory_usage
+{
+    HMODULE module;
+    std::uint64_t image_size;          // The module's size once loaded (see DetourGetModuleSize)
+    std::uint64_t image_private_bytes; // How much of the image is in the working set and not shared with other
+                                       // processes, e.g. data that static initializers wrote to
+    std::uint64_t heap_bytes;          // Currently allocated from the private heap by the module, in bytes...
+    std::uint64_t heap_allocations;    // ... and in allocations
+    std::uint64_t reported_bytes;      // The total of what the module's PSFMemoryUsageProc callbacks reported
+};
+
+// Returns how many bytes the fixup is holding on to that the PsfRuntime can't see for itself, e.g. caches that aren't
+// on the private heap. Called on whichever thread calls PSFQueryMemoryUsage
+using PSFMemoryUsageProc = std::uint64_t (__stdcall *)(_In_opt_ void* context) noexcept;
+
+// Which of the PsfRuntime's worker threads' queues a piece of background work goes in (see PSFSubmitWork). Work that a
+// thread is waiting on should be 'high', and work that nothing waits on (e.g. building an index ahead of time) 'low'
+enum class psf_work_priority : std::uint32_t
+{
+    high,
+    normal,
+    low,
+};
+
+// Background work and timer callbacks, called on one of the PsfRuntime's worker threads
+using PSFWorkProc = void (__stdcall *)(_In_opt_ void* context) noexcept;
+
+// A timer created by PSFCreateTimer, which only the PsfRuntime knows the contents of
+struct psf_timer;
+
+// How many reentrancy guards psf_thread_state keeps track of at once, which is far deeper than fixups ever nest
+constexpr std::size_t psf_max_entered_guards = 16;
+
+// What the PsfRuntime keeps for each thread on behalf of every fixup, in a single TLS slot (see PSFQueryThreadStateSlot),
+// so that stacked fixups share it rather than each having thread_local variables of their own. See psf_thread_state.h
+struct psf_thread_state
+{
+    // How many reentrancy guards (see reentrancy_guard.h) are entered on the thread, across all fixups, and which ones,
+    // innermost last. Guards entered past the first psf_max_entered_guards count towards 'depth', but aren't recorded
+    std::uint32_t depth;
+
+    // The thread's scratch arena (see scratch_arena.h). The block gets allocated with PSFAllocate the first time that it's
+    // needed, and is freed by the PsfRuntime, along with the rest of the state, when the thread exits
+    std::uint32_t scratch_scopes;
+    std::size_t scratch_used;
+    std::byte* scratch_block;
+
+    // A block for one fixup to remember the thread's last few lookups in (e.g. the File Redirection Fixup's decisions on
+    // its last few paths), whichever fixup claims it first by setting 'lookup_memo_owner' to something that's its own.
+    // It needs to be allocated with PSFAllocate and to be fine with getting freed as is, since the PsfRuntime frees it
+    // along with the rest of the state
+    const void* lookup_memo_owner;
+    void* lookup_memo;
+
+    const void* entered_guards[psf_max_entered_guards];
+};
+
 // PsfRuntime exports
 // NOTE: Unless stated otherwise, all memory returned is allocated by the PsfRuntime and remains valid so long as the
 //       dll is loaded.
@@ -29,6 +229,41 @@ extern "C" {
 PSFAPI DWORD __stdcall PSFRegister(_Inout_ void** implFn, _In_ void* fixupFn) noexcept;
 PSFAPI DWORD __stdcall PSFUnregister(_Inout_ void** implFn, _In_ void* fixupFn) noexcept;
 
+// Equivalent to a PSFRegister/PSFUnregister call per entry, but with a single call into the PsfRuntime, which lets it
+// book-keep the whole batch at once. On failure, PSFRegisterBatch fails the entire batch: either none of the entries
+// are registered or, since a failed DetourAttach fails the transaction, none of them will be committed. Unregistration
+// is best effort, so PSFUnregisterBatch attempts every entry and returns the first error, if any
+PSFAPI DWORD __stdcall PSFRegisterBatch(_In_reads_(count) const psf_registration* registrations, std::size_t count) noexcept;
+PSFAPI DWORD __stdcall PSFUnregisterBatch(_In_reads_(count) const psf_registration* registrations, std::size_t count) noexcept;
+
+// The APIs that the PsfRuntime and the fixups detour, as registered by psf::attach_all. Each distinct API (by id) gets
+// an index the first time that it's registered, which stays the same for as long as the process runs, so that
+// instrumentation can keep its per-API state in arrays rather than look APIs up by name. PSFQueryApiIndex returns
+// psf_invalid_api_index for APIs that haven't been registered, and PSFQueryApis fills 'apis' with up to 'capacity' of
+// them, in index order, and returns how many there are. Their names are copied, so they outlive the fixup's dll
+PSFAPI DWORD __stdcall PSFRegisterApis(_In_reads_(count) const psf_api_info* const* apis, std::size_t count) noexcept;
+PSFAPI std::uint32_t __stdcall PSFQueryApiIndex(std::uint32_t id) noexcept;
+PSFAPI std::size_t __stdcall PSFQueryApis(_Out_writes_(capacity) const psf_api_info** apis, std::size_t capacity) noexcept;
+
+// Adds 'handler' to the chain of handlers for the function that '*implFn' points to, and sets '*chain' to it. The first
+// handler for a function also registers 'dispatcher' - the detour that walks its chain - with PSFRegister, so the same
+// rules apply to it. PSFUnregisterHandler removes 'handler' again and, if it came with the chain's detour, unregisters
+// that too, after which any handlers left in the chain no longer get called
+PSFAPI DWORD __stdcall PSFRegisterHandler(
+    _Inout_ void** implFn,
+    _In_ void* dispatcher,
+    _In_ void* handler,
+    _Out_ psf_handler_chain** chain) noexcept;
+PSFAPI DWORD __stdcall PSFUnregisterHandler(_Inout_ void** implFn, _In_ void* dispatcher, _In_ void* handler) noexcept;
+
+// Registers detours of functions in modules that get loaded later on, if ever. The detours of modules that are already
+// loaded get registered the same as with PSFRegisterBatch, but with the rest left alone until their module loads, at
+// which point the PsfRuntime attaches them in a transaction of its own (and detaches them again if the module unloads).
+// Registrations are identified by 'implFn' and 'fixupFn', and PSFUnregisterOnModuleLoad unregisters them whether or not
+// they were ever attached
+PSFAPI DWORD __stdcall PSFRegisterOnModuleLoad(_In_reads_(count) const psf_lazy_registration* registrations, std::size_t count) noexcept;
+PSFAPI DWORD __stdcall PSFUnregisterOnModuleLoad(_In_reads_(count) const psf_lazy_registration* registrations, std::size_t count) noexcept;
+
 // Simplifications around the package query API from appmodel.h
 // NOTE: These functions are guaranteed to succeed as PsfRuntime will fail to load if they can't be set (e.g. when
 //       running outside of a package)
@@ -37,6 +272,55 @@ PSFAPI const wchar_t* __stdcall PSFQueryApplicationUserModelId() noexcept;
 PSFAPI const wchar_t* __stdcall PSFQueryApplicationId() noexcept;
 PSFAPI const wchar_t* __stdcall PSFQueryPackageRootPath() noexcept;
 
+// Whether 'path' is the package root or anything under it. The package root's drive-absolute, UNC, and (root-)local
+// device spellings (e.g. "C:\...", "\\?\C:\..." and "\\.\C:\...") all count, as do either of the path separators, but
+// the path isn't normalized first, so relative paths and paths with "." or ".." components need normalizing beforehand
+PSFAPI BOOL __stdcall PSFIsPackagePath(_In_reads_(length) const wchar_t* path, std::size_t length) noexcept;
+
+// Resolves a known folder the same way psf::known_folder does, but caches the result for the lifetime of the process so
+// that every fixup shares a single lookup. Returns null if the folder can't be resolved
+PSFAPI const wchar_t* __stdcall PSFQueryKnownFolderPath(_In_ const GUID& id) noexcept;
+
+// Fixups should prefer this over psf::known_folder, which asks shell32 each time. Throws if the folder can't be resolved
+inline std::filesystem::path PSFQueryKnownFolder(const GUID& id)
+{
+    auto path = PSFQueryKnownFolderPath(id);
+    if (!path)
+    {
+        throw std::runtime_error("Failed to get known folder path");
+    }
+
+    return path;
+}
+
+// Sections holding read-only data that child processes of the package can use instead of building it themselves. The
+// PsfRuntime keeps its own read-only duplicate of a published section, so the caller may close its handle afterwards,
+// and publishing again with the same id replaces the section. PSFQuerySharedSection returns null if nothing has been
+// published with the id, either by this process or by the parent that created it; the handle is owned by the PsfRuntime
+// and must not be closed. Data in sections from a parent process needs to be validated before it's used
+PSFAPI BOOL __stdcall PSFPublishSharedSection(_In_ const GUID& id, _In_ HANDLE section, std::uint64_t size) noexcept;
+PSFAPI HANDLE __stdcall PSFQuerySharedSection(_In_ const GUID& id, _Out_ std::uint64_t* size) noexcept;
+
+// A heap that's private to the PSF, so that data that lives for as long as the process does (e.g. the config.json DOM
+// or a fixup's caches) doesn't compete with - or fragment - the application's own heap. It uses the low fragmentation
+// heap, since nearly everything the PSF keeps around is small. PSFAllocate returns null on failure and PSFFree accepts
+// null. PSFQueryHeapUsage reports how many bytes are currently allocated from it, across how many allocations, for
+// memory accounting. See psf_heap.h for helpers to use the heap with the STL
+PSFAPI void* __stdcall PSFAllocate(std::size_t size) noexcept;
+PSFAPI void __stdcall PSFFree(_In_opt_ void* ptr) noexcept;
+PSFAPI void __stdcall PSFQueryHeapUsage(_Out_ std::uint64_t* bytes, _Out_ std::uint64_t* allocations) noexcept;
+
+// Memory accounting by module, for deciding what each fixup costs once loaded. Heap usage is attributed to the module
+// that called PSFAllocate, which is the fixup for the helpers in psf_heap.h. Fills 'usage' with up to 'capacity' entries,
+// and returns how many there are in total. Fixups can register callbacks for memory that isn't on the private heap, and
+// PSFUnregisterMemoryUsage waits for a call to 'callback' that's in progress
+PSFAPI std::size_t __stdcall PSFQueryMemoryUsage(_Out_writes_(capacity) psf_memory_usage* usage, std::size_t capacity) noexcept;
+PSFAPI DWORD __stdcall PSFRegisterMemoryUsage(_In_ PSFMemoryUsageProc callback, _In_opt_ void* context) noexcept;
+PSFAPI DWORD __stdcall PSFUnregisterMemoryUsage(_In_ PSFMemoryUsageProc callback, _In_opt_ void* context) noexcept;
+
+// The whole of config.json. Since the PsfRuntime only keeps the parts of it that the current process uses, the first
+// call to this - or to PSFQueryConfig/PSFQueryExeConfig, which can ask about any executable - parses the file again, in
+// full. The other queries don't need to
 PSFAPI const psf::json_value* __stdcall PSFQueryConfigRoot() noexcept;
 
 PSFAPI const psf::json_object* __stdcall PSFQueryAppLaunchConfig(_In_ const wchar_t* applicationId, bool verbose) noexcept;
@@ -49,11 +333,96 @@ PSFAPI const psf::json_object* __stdcall PSFQueryExeConfig(const wchar_t* execut
 PSFAPI const psf::json_object* __stdcall PSFQueryCurrentExeConfig() noexcept;
 PSFAPI const psf::json_value* __stdcall PSFQueryDllConfig(const wchar_t* dll) noexcept;
 
+// Same as PSFQueryDllConfig for the module's file name. The configurations of the fixups that the PsfRuntime loaded are
+// looked up by their module handle, without comparing any names
+PSFAPI const psf::json_value* __stdcall PSFQueryModuleConfig(HMODULE module) noexcept;
+
+// NOTE: The fixups in a bundle share its module, so each of them needs to be compiled with PSF_BUNDLED_FIXUP_NAME defined
+//       as its name (e.g. L"FileRedirectionFixup") for this to find its configuration rather than the bundle's
 inline const psf::json_value* PSFQueryCurrentDllConfig()
 {
-    return PSFQueryDllConfig(psf::current_module_path().filename().c_str());
+#ifdef PSF_BUNDLED_FIXUP_NAME
+    return PSFQueryDllConfig(PSF_BUNDLED_FIXUP_NAME);
+#else
+    return PSFQueryModuleConfig(psf::current_module());
+#endif
 }
 
+// Parses config.json again and gives back the dll's configuration from the new contents. The configuration returned by
+// PSFQueryDllConfig is left untouched, and the result remains valid for the lifetime of the process. Returns null when
+// the file can't be parsed or no configuration is set for the dll
+PSFAPI const psf::json_value* __stdcall PSFReloadDllConfig(const wchar_t* dll) noexcept;
+
+inline const psf::json_value* PSFReloadCurrentDllConfig()
+{
+#ifdef PSF_BUNDLED_FIXUP_NAME
+    return PSFReloadDllConfig(PSF_BUNDLED_FIXUP_NAME);
+#else
+    return PSFReloadDllConfig(psf::current_module_path().filename().c_str());
+#endif
+}
+
+// Where the PsfRuntime spent its time starting up, i.e. before the application's entry point ran. Phases are listed
+// in the order that they started, with 'start' and 'end' as QueryPerformanceCounter values; 'end' is zero while a phase
+// is still in progress. Entries are only added until the application's entry point is called, at which point they also
+// get written as a single "StartupTimings" ETW event from the Microsoft-Windows-PSFRuntime provider
+PSFAPI const psf_startup_timing* __stdcall PSFQueryStartupTimings(_Out_ std::size_t* count) noexcept;
+
+// Creates a process the same way that CreateProcessW does, with the PsfRuntime injected into it, for callers that know
+// that the executable is in the package (e.g. the PsfLauncher starting the application). This skips what the detoured
+// CreateProcess does to work out whether or not it's in the package. Executables that import the PsfRuntime themselves
+// (see pre_injection.h) don't get it injected a second time
+PSFAPI BOOL __stdcall PSFCreatePackageProcess(
+    _In_opt_ LPCWSTR applicationName,
+    _Inout_opt_ LPWSTR commandLine,
+    _In_opt_ LPSECURITY_ATTRIBUTES processAttributes,
+    _In_opt_ LPSECURITY_ATTRIBUTES threadAttributes,
+    _In_ BOOL inheritHandles,
+    _In_ DWORD creationFlags,
+    _In_opt_ LPVOID environment,
+    _In_opt_ LPCWSTR currentDirectory,
+    _In_ LPSTARTUPINFOW startupInfo,
+    _Out_ LPPROCESS_INFORMATION processInformation) noexcept;
+
+// A count that goes up each time that the current directory changes through SetCurrentDirectory, for fixups that cache
+// what relative paths resolve to. A cached result is only valid while the count is the same as it was before the path got
+// resolved. The count can be read for as long as the process runs
+PSFAPI const std::atomic<std::uint32_t>* __stdcall PSFQueryCurrentDirectoryGeneration() noexcept;
+
+// Live counters are totals that the PsfRuntime collects from the fixups that register a callback for them, about once a
+// second, and copies into a section (see psf_live_counters_header) that dashboards can poll without the process having
+// to do anything per call, e.g. write ETW events. Nothing gets collected unless config.json sets "liveCounters" to true
+// at the root, but registering succeeds either way. PSFUnregisterLiveCounters waits for a call to 'callback' that's in
+// progress, so the fixup has to unregister before whatever the callback uses goes away
+PSFAPI DWORD __stdcall PSFRegisterLiveCounters(_In_ PSFLiveCountersProc callback, _In_opt_ void* context) noexcept;
+PSFAPI DWORD __stdcall PSFUnregisterLiveCounters(_In_ PSFLiveCountersProc callback, _In_opt_ void* context) noexcept;
+
+// Fixups that need work done in the background share a single thread pool that the PsfRuntime owns, rather than each
+// creating threads of their own. Queued work runs in order of its priority, and then in the order it was submitted. The
+// pool gets shut down before any fixup is uninitialized: work that hasn't started by then never runs, whatever is
+// running gets waited for, and submitting fails with ERROR_SHUTDOWN_IN_PROGRESS from then on. Since the PsfRuntime waits
+// from within DllMain, callbacks must not wait on anything that needs the loader lock (e.g. LoadLibrary). When the
+// process is terminating, the worker threads are already gone, along with anything they were running
+PSFAPI DWORD __stdcall PSFSubmitWork(_In_ PSFWorkProc callback, _In_opt_ void* context, psf_work_priority priority) noexcept;
+
+// Timers call 'callback' on the same worker threads, once 'dueTime' milliseconds after PSFSetTimer, and then every
+// 'period' milliseconds if that's not zero. A 'dueTime' of INFINITE stops the timer. PSFCloseTimer stops the timer and
+// waits for a call to 'callback' that's in progress, so it must not be called from the callback itself. Timers must
+// still be closed after the pool has shut down (e.g. in PSFUninitialize), but never get called again by then
+PSFAPI DWORD __stdcall PSFCreateTimer(
+    _In_ PSFWorkProc callback,
+    _In_opt_ void* context,
+    psf_work_priority priority,
+    _Outptr_ psf_timer** timer) noexcept;
+PSFAPI DWORD __stdcall PSFSetTimer(_In_ psf_timer* timer, DWORD dueTime, DWORD period) noexcept;
+PSFAPI void __stdcall PSFCloseTimer(_In_opt_ psf_timer* timer) noexcept;
+
+// The TLS slot that holds each thread's psf_thread_state, or TLS_OUT_OF_INDEXES if the PsfRuntime couldn't get one. The
+// slot is null on threads that haven't asked for their state yet, i.e. until they first call PSFQueryThreadState, which
+// creates it. That only returns null if the state couldn't be allocated. Neither changes the thread's last error
+PSFAPI DWORD __stdcall PSFQueryThreadStateSlot() noexcept;
+PSFAPI psf_thread_state* __stdcall PSFQueryThreadState() noexcept;
+
 PSFAPI void __stdcall PSFReportError(const wchar_t* error) noexcept;
 
 }
@@ -0,0 +1,46 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Every fixup's reentrancy guards and scratch arena share the per-thread state that the PsfRuntime keeps in a single
+// TLS slot (see psf_thread_state in psf_runtime.h). Once a thread has its state, finding it is a single read of the
+// slot out of the thread's TEB, which is what TlsGetValue does too, only without the call or clearing the last error.
+// Threads that don't have their state yet, and slots that are past the ones in the TEB itself, go through the
+// PsfRuntime instead.
+#pragma once
+
+#include <atomic>
+
+#include <windows.h>
+#include <winternl.h>
+
+#include "psf_runtime.h"
+
+namespace psf
+{
+    namespace details
+    {
+        // One more than the slot, so that it's zero until this module first asks the PsfRuntime for it. This also
+        // keeps it zero when there's no slot at all, since TLS_OUT_OF_INDEXES is all ones
+        inline std::atomic<DWORD> thread_state_slot = 0;
+    }
+
+    inline psf_thread_state* current_thread_state() noexcept
+    {
+        auto slot = details::thread_state_slot.load(std::memory_order_relaxed) - 1;
+        if (slot < TLS_MINIMUM_AVAILABLE)
+        {
+            if (auto state = reinterpret_cast<TEB*>(::NtCurrentTeb())->TlsSlots[slot])
+            {
+                return static_cast<psf_thread_state*>(state);
+            }
+        }
+        else
+        {
+            details::thread_state_slot.store(::PSFQueryThreadStateSlot() + 1, std::memory_order_relaxed);
+        }
+
+        return ::PSFQueryThreadState();
+    }
+}
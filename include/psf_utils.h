@@ -42,7 +42,7 @@ namespace psf
         }
     }
 
-    inline std::filesystem::path current_module_path()
+    inline HMODULE current_module()
     {
         // NOTE: Since we're getting a handle to the current module, UNCHANGED_REFCOUNT flag is safe
         HMODULE moduleHandle;
@@ -54,7 +54,12 @@ namespace psf
             throw_last_error();
         }
 
-        return get_module_path(moduleHandle);
+        return moduleHandle;
+    }
+
+    inline std::filesystem::path current_module_path()
+    {
+        return get_module_path(current_module());
     }
 
     inline std::filesystem::path current_executable_path()
@@ -3,58 +3,62 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 //
-// Type that's useful to detect reentrancy. This can be useful at either global for function-static scope. Note however,
-// that either should be declared 'thread_local'. E.g. Use might look like:
+// Type that's useful to detect reentrancy, e.g. a fixup calling a function that it detours itself. Guards are entered
+// per-thread, through the state that the PsfRuntime keeps for every fixup (see psf_thread_state.h), so the guard itself
+// only serves as an identity and can be an ordinary global or function-static variable. E.g. Use might look like:
+//      psf::reentrancy_guard g_reentrancyGuard;
 //      void FooFixup()
 //      {
-//          thread_local psf::reentrancy_guard reentrancyGuard;
-//          auto guard = reentrancyGuard.enter();
+//          auto guard = g_reentrancyGuard.enter();
 //          if (guard) { /*fixup code here*/ }
 //          return FooImpl();
 //      }
+// NOTE: If the thread's state can't be allocated, every guard acts as though it were already entered, so that fixups
+//       call straight through rather than risk recursing
 #pragma once
 
-#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+#include "psf_thread_state.h"
 
 namespace psf
 {
     namespace details
     {
+        // Leaves the guard again once destroyed, if entering it was what created this. Converts to true in that case
         struct restore_on_exit
         {
-            restore_on_exit(bool& target, bool restoreValue) :
-                m_target(&target),
-                m_restoreValue(restoreValue)
+            restore_on_exit(psf_thread_state* state) noexcept :
+                m_state(state)
             {
             }
 
             restore_on_exit(const restore_on_exit&) = delete;
             restore_on_exit& operator=(const restore_on_exit&) = delete;
 
-            restore_on_exit(restore_on_exit&& other) :
-                m_target(other.m_target),
-                m_restoreValue(other.m_restoreValue)
+            restore_on_exit(restore_on_exit&& other) noexcept :
+                m_state(other.m_state)
             {
-                other.m_target = nullptr;
+                other.m_state = nullptr;
             }
 
             ~restore_on_exit()
             {
-                if (m_target)
+                if (m_state)
                 {
-                    *m_target = m_restoreValue;
+                    --m_state->depth;
                 }
             }
 
-            explicit operator bool()
+            explicit operator bool() const noexcept
             {
-                return !m_restoreValue;
+                return m_state != nullptr;
             }
 
         private:
 
-            bool* m_target;
-            bool m_restoreValue;
+            psf_thread_state* m_state;
         };
     }
 
@@ -62,14 +66,41 @@ namespace psf
     {
     public:
 
-        details::restore_on_exit enter()
+        constexpr reentrancy_guard() noexcept = default;
+        reentrancy_guard(const reentrancy_guard&) = delete;
+        reentrancy_guard& operator=(const reentrancy_guard&) = delete;
+
+        details::restore_on_exit enter() noexcept
         {
-            auto restoreValue = std::exchange(m_isReentrant, true);
-            return details::restore_on_exit{ m_isReentrant, restoreValue };
-        }
+            auto state = current_thread_state();
+            if (!state)
+            {
+                return details::restore_on_exit{ nullptr };
+            }
 
-    private:
+            auto recorded = (std::min)(static_cast<std::size_t>(state->depth), psf_max_entered_guards);
+            for (std::size_t i = 0; i < recorded; ++i)
+            {
+                if (state->entered_guards[i] == this)
+                {
+                    return details::restore_on_exit{ nullptr };
+                }
+            }
 
-        bool m_isReentrant = false;
+            if (recorded < psf_max_entered_guards)
+            {
+                state->entered_guards[recorded] = this;
+            }
+            ++state->depth;
+            return details::restore_on_exit{ state };
+        }
+
+        // How many guards are entered on the current thread, across all fixups, e.g. for telling whether a call came
+        // from within another fixup
+        static std::uint32_t depth() noexcept
+        {
+            auto state = current_thread_state();
+            return state ? state->depth : 0;
+        }
     };
 }
@@ -0,0 +1,192 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// A per-thread bump allocator for temporaries that only live for the duration of a single call, e.g. the strings that
+// a fixup builds while deciding what to do with a path. Allocations come out of a block that each thread allocates once
+// and then re-uses, so they don't touch the heap - or contend with the application's own use of it - at all. The block
+// is part of the state that the PsfRuntime keeps for the thread (see psf_thread_state.h), so stacked fixups share it rather
+// than each allocating one of their own. Memory is reclaimed in bulk when the enclosing scratch_scope exits; until then,
+// freeing memory only gives it back if it was the most recent allocation. Use might look like:
+//      void FooFixup()
+//      {
+//          psf::scratch_scope scratch;
+//          psf::scratch_wstring path = ...;
+//          ...
+//      }
+// NOTE: Anything allocated through scratch_allocator must be freed on the thread that allocated it, and must not
+//       outlive the scratch_scope that it was allocated in. That includes growing a string from an outer scope inside
+//       of a nested one. Allocations made outside of any scratch_scope, or that don't fit in what remains of the block,
+//       fall back to the heap, so correctness never depends on the block's size
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <string>
+
+#include "psf_thread_state.h"
+
+namespace psf
+{
+    // A view of the current thread's arena. If the thread's state can't be allocated, everything comes from the heap
+    class scratch_arena
+    {
+    public:
+
+        // Large enough for a handful of MAX_PATH-sized strings, even with a few levels of nesting
+        static constexpr std::size_t block_size = 16 * 1024;
+
+        static scratch_arena current() noexcept
+        {
+            return scratch_arena(current_thread_state());
+        }
+
+        // Returns null when the allocation should come from the heap instead
+        void* allocate(std::size_t size, std::size_t alignment) noexcept
+        {
+            if (!m_state || (m_state->scratch_scopes == 0))
+            {
+                return nullptr;
+            }
+
+            if (!m_state->scratch_block)
+            {
+                m_state->scratch_block = static_cast<std::byte*>(::PSFAllocate(block_size));
+                if (!m_state->scratch_block)
+                {
+                    return nullptr;
+                }
+            }
+
+            auto offset = (m_state->scratch_used + alignment - 1) & ~(alignment - 1);
+            if ((offset > block_size) || (size > block_size - offset))
+            {
+                return nullptr;
+            }
+
+            m_state->scratch_used = offset + size;
+            return m_state->scratch_block + offset;
+        }
+
+        // Returns false if the memory didn't come from the arena, in which case it came from the heap
+        bool deallocate(void* ptr, std::size_t size) noexcept
+        {
+            auto bytes = static_cast<std::byte*>(ptr);
+            auto block = m_state ? m_state->scratch_block : nullptr;
+            if (!block || (bytes < block) || (bytes >= block + block_size))
+            {
+                return false;
+            }
+
+            if (bytes + size == block + m_state->scratch_used)
+            {
+                m_state->scratch_used = bytes - block;
+            }
+
+            return true;
+        }
+
+    private:
+
+        friend class scratch_scope;
+
+        explicit scratch_arena(psf_thread_state* state) noexcept :
+            m_state(state)
+        {
+        }
+
+        psf_thread_state* m_state;
+    };
+
+    // Scopes nest, e.g. when a fixup calls a helper that opens its own scope (or a fixup stacked on top of it does),
+    // and each one only reclaims what was allocated after it was entered
+    class scratch_scope
+    {
+    public:
+
+        scratch_scope() noexcept :
+            m_arena(scratch_arena::current()),
+            m_mark(m_arena.m_state ? m_arena.m_state->scratch_used : 0)
+        {
+            if (m_arena.m_state)
+            {
+                ++m_arena.m_state->scratch_scopes;
+            }
+        }
+
+        ~scratch_scope()
+        {
+            if (m_arena.m_state)
+            {
+                --m_arena.m_state->scratch_scopes;
+                m_arena.m_state->scratch_used = m_mark;
+            }
+        }
+
+        scratch_scope(const scratch_scope&) = delete;
+        scratch_scope& operator=(const scratch_scope&) = delete;
+
+    private:
+
+        scratch_arena m_arena;
+        std::size_t m_mark;
+    };
+
+    template <typename T>
+    struct scratch_allocator
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t));
+
+        using value_type = T;
+
+        scratch_allocator() noexcept = default;
+
+        template <typename U>
+        scratch_allocator(const scratch_allocator<U>&) noexcept
+        {
+        }
+
+        T* allocate(std::size_t count)
+        {
+            if (count > (std::numeric_limits<std::size_t>::max)() / sizeof(T))
+            {
+                throw std::bad_array_new_length();
+            }
+
+            if (auto result = scratch_arena::current().allocate(count * sizeof(T), alignof(T)))
+            {
+                return static_cast<T*>(result);
+            }
+
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+
+        void deallocate(T* ptr, std::size_t count) noexcept
+        {
+            if (!scratch_arena::current().deallocate(ptr, count * sizeof(T)))
+            {
+                ::operator delete(ptr);
+            }
+        }
+
+        template <typename U>
+        bool operator==(const scratch_allocator<U>&) const noexcept
+        {
+            return true;
+        }
+
+        template <typename U>
+        bool operator!=(const scratch_allocator<U>&) const noexcept
+        {
+            return false;
+        }
+    };
+
+    template <typename CharT, typename Traits = std::char_traits<CharT>>
+    using basic_scratch_string = std::basic_string<CharT, Traits, scratch_allocator<CharT>>;
+    using scratch_string = basic_scratch_string<char>;
+    using scratch_wstring = basic_scratch_string<wchar_t>;
+}
@@ -0,0 +1,147 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The startup profile of an application is the ordered list of package files that it reads from (and the package
+// images that it has loaded) in the first few seconds after it starts. The FileRedirectionFixup records it when the
+// PsfLauncher asks it to, and on later launches the PsfLauncher reads the same ranges ahead of the application so that
+// they come from the file cache instead of the disk. Profiles live in %LocalAppData%\PsfStartupProfiles, one per
+// executable, and hold package relative paths so that they keep working across package updates. The format is UTF-8
+// text, one entry per line, with tab separated fields:
+//      psf-startup-profile 1
+//      image   <path>
+//      read    <offset>    <length>    <path>
+// Anything that doesn't parse makes the whole profile get ignored; it's only ever a hint
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "known_folders.h"
+#include "psf_runtime.h"
+#include "utilities.h"
+
+namespace psf
+{
+    // Set by the PsfLauncher, for the application that it's starting, to the number of seconds to record for. The
+    // FileRedirectionFixup clears it once it has read it so that the application's own child processes don't also record
+    constexpr wchar_t startup_profile_record_variable[] = L"PSF_STARTUP_PROFILE_RECORD";
+
+    constexpr std::string_view startup_profile_header = "psf-startup-profile 1";
+
+    struct startup_profile_entry
+    {
+        bool image = false;
+        std::uint64_t offset = 0;
+        std::uint64_t length = 0;
+        std::wstring path; // Relative to the package root
+    };
+
+    inline std::filesystem::path startup_profile_path(const std::filesystem::path& executable)
+    {
+        return ::PSFQueryKnownFolder(FOLDERID_LocalAppData) / L"PsfStartupProfiles" / (executable.stem().native() + L".profile");
+    }
+
+    inline std::string format_startup_profile(const std::vector<startup_profile_entry>& entries)
+    {
+        std::string result(startup_profile_header);
+        result += '\n';
+        for (auto& entry : entries)
+        {
+            if (entry.image)
+            {
+                result += "image\t";
+            }
+            else
+            {
+                result += "read\t";
+                result += std::to_string(entry.offset);
+                result += '\t';
+                result += std::to_string(entry.length);
+                result += '\t';
+            }
+
+            result += narrow(entry.path);
+            result += '\n';
+        }
+
+        return result;
+    }
+
+    inline std::vector<startup_profile_entry> parse_startup_profile(std::string_view text)
+    {
+        std::vector<startup_profile_entry> result;
+
+        auto nextField = [&](std::string_view& line)
+        {
+            auto pos = line.find('\t');
+            auto field = line.substr(0, pos);
+            line = (pos == std::string_view::npos) ? std::string_view{} : line.substr(pos + 1);
+            return field;
+        };
+
+        auto parseNumber = [](std::string_view field, std::uint64_t& value)
+        {
+            value = 0;
+            for (auto ch : field)
+            {
+                if ((ch < '0') || (ch > '9'))
+                {
+                    return false;
+                }
+                value = value * 10 + (ch - '0');
+            }
+            return !field.empty();
+        };
+
+        bool first = true;
+        while (!text.empty())
+        {
+            auto pos = text.find('\n');
+            auto line = text.substr(0, pos);
+            text = (pos == std::string_view::npos) ? std::string_view{} : text.substr(pos + 1);
+            if (!line.empty() && (line.back() == '\r'))
+            {
+                line.remove_suffix(1);
+            }
+
+            if (first)
+            {
+                if (line != startup_profile_header)
+                {
+                    return {};
+                }
+                first = false;
+                continue;
+            }
+            else if (line.empty())
+            {
+                continue;
+            }
+
+            startup_profile_entry entry;
+            auto kind = nextField(line);
+            if (kind == "image")
+            {
+                entry.image = true;
+            }
+            else if ((kind != "read") || !parseNumber(nextField(line), entry.offset) || !parseNumber(nextField(line), entry.length))
+            {
+                return {};
+            }
+
+            if (line.empty())
+            {
+                return {};
+            }
+            entry.path = widen(line);
+            result.push_back(std::move(entry));
+        }
+
+        return result;
+    }
+}
@@ -9,6 +9,11 @@
 #include <cassert>
 #include <cctype>
 #include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "ascii_simd.h"
+#include "path_buffer.h"
 
 #include "win32_error.h"
 
@@ -46,14 +51,31 @@ struct case_insensitive_char_traits : std::char_traits<CharT>
     static constexpr int compare(const char_type* lhs, const char_type* rhs, std::size_t count) noexcept
     {
         // NOTE: There's currently no wmemicmp/_wmemicmp function
-        char_type lc = 0, rc = 0;
-        for (; count && (lc == rc); --count)
+        while (count)
         {
-            lc = static_cast<char_type>(std::tolower(*lhs++));
-            rc = static_cast<char_type>(std::tolower(*rhs++));
+            if constexpr (std::is_same_v<char_type, wchar_t>)
+            {
+                // Most strings are pure ASCII, which we can compare several characters at a time
+                auto equalLength = psf::ascii_iequal_prefix(lhs, rhs, count);
+                lhs += equalLength;
+                rhs += equalLength;
+                count -= equalLength;
+                if (!count)
+                {
+                    break;
+                }
+            }
+
+            auto lc = static_cast<char_type>(std::tolower(*lhs++));
+            auto rc = static_cast<char_type>(std::tolower(*rhs++));
+            --count;
+            if (lc != rc)
+            {
+                return (lc < rc) ? -1 : 1;
+            }
         }
 
-        return (lc < rc) ? -1 : (lc > rc) ? 1 : 0;
+        return 0;
     }
 
     static constexpr const char_type* find(const char_type* str, std::size_t count, const char_type& ch) noexcept
@@ -89,6 +111,25 @@ using iwstring_view = basic_istring_view<wchar_t>;
 using iu16string_view = basic_istring_view<char16_t>;
 using iu32string_view = basic_istring_view<char32_t>;
 
+// Hash for case insensitive strings so that they can be used as keys in unordered containers. Characters are folded the
+// same way that case_insensitive_char_traits compares them (FNV-1a over the folded characters)
+template <typename CharT>
+struct case_insensitive_hash
+{
+    std::size_t operator()(basic_istring_view<CharT> str) const noexcept
+    {
+        constexpr bool is64Bit = sizeof(std::size_t) == 8;
+        std::size_t result = is64Bit ? static_cast<std::size_t>(14695981039346656037ull) : 2166136261u;
+        for (auto ch : str)
+        {
+            result ^= static_cast<std::size_t>(std::tolower(ch));
+            result *= is64Bit ? static_cast<std::size_t>(1099511628211ull) : 16777619u;
+        }
+
+        return result;
+    }
+};
+
 inline istring operator""_is(const char* str, std::size_t length) { return istring(str, length); }
 inline iwstring operator""_is(const wchar_t* str, std::size_t length) { return iwstring(str, length); }
 inline iu16string operator""_is(const char16_t* str, std::size_t length) { return iu16string(str, length); }
@@ -100,34 +141,93 @@ inline constexpr iu16string_view operator""_isv(const char16_t* str, std::size_t
 inline constexpr iu32string_view operator""_isv(const char32_t* str, std::size_t length) { return iu32string_view(str, length); }
 
 
-inline std::wstring widen(std::string_view str, UINT codePage = CP_UTF8)
+// ASCII is encoded the same way in UTF-8 and in the ANSI code pages, so the leading ASCII portion of a string can be
+// converted without going through MultiByteToWideChar/WideCharToMultiByte. Code pages like UTF-7 give some ASCII bytes
+// special meaning, so we limit the fast path to the code pages we know about
+inline constexpr bool is_ascii_compatible_code_page(UINT codePage) noexcept
 {
-    std::wstring result;
+    return (codePage == CP_UTF8) || (codePage == CP_ACP);
+}
+
+namespace psf
+{
+    namespace details
+    {
+        // The part of widen_into that comes after sizing the buffer to the length of 'str'. From there on, the buffer
+        // only ever shrinks, so nothing here can fail to allocate
+        template <typename BufferT>
+        inline DWORD widen_into_sized(std::string_view str, BufferT& buffer, UINT codePage) noexcept
+        {
+            // Nearly all strings we see are pure ASCII, in which case this is the only pass over the string we need
+            std::size_t asciiLength = 0;
+            if (is_ascii_compatible_code_page(codePage))
+            {
+                asciiLength = psf::ascii_widen_prefix(str.data(), str.length(), buffer.data());
+                if (asciiLength == str.length())
+                {
+                    return ERROR_SUCCESS;
+                }
+            }
+
+            // NOTE: Since we call MultiByteToWideChar with a non-negative input string size, the resulting string is
+            //       not null terminated, so we don't need to '+1' the size on input and '-1' the size on resize
+            auto size = ::MultiByteToWideChar(
+                codePage,
+                MB_ERR_INVALID_CHARS,
+                str.data() + asciiLength, static_cast<int>(str.length() - asciiLength),
+                buffer.data() + asciiLength, static_cast<int>(buffer.length() - asciiLength));
+            if (!size)
+            {
+                return ::GetLastError();
+            }
+
+            assert(asciiLength + static_cast<std::size_t>(size) <= buffer.length());
+            buffer.resize(asciiLength + size);
+            return ERROR_SUCCESS;
+        }
+    }
+}
+
+// Equivalent to widen, but writes to the caller's buffer (e.g. a std::wstring or psf::path_buffer) so that callers can
+// avoid allocating in the common case
+template <typename BufferT>
+inline void widen_into(std::string_view str, BufferT& buffer, UINT codePage = CP_UTF8)
+{
+    buffer.resize(0);
     if (str.empty())
     {
         // MultiByteToWideChar fails when given a length of zero
-        return result;
+        return;
     }
 
     // UTF-16 should occupy at most as many characters as UTF-8
-    result.resize(str.length());
+    buffer.resize(str.length());
+    check_win32(psf::details::widen_into_sized(str, buffer, codePage));
+}
 
-    // NOTE: Since we call MultiByteToWideChar with a non-negative input string size, the resulting string is not null
-    //       terminated, so we don't need to '+1' the size on input and '-1' the size on resize
-    if (auto size = ::MultiByteToWideChar(
-        codePage,
-        MB_ERR_INVALID_CHARS,
-        str.data(), static_cast<int>(str.length()),
-        result.data(), static_cast<int>(result.length())))
+// Equivalent to widen_into, but reports errors - including a failure to allocate - through the return value instead of
+// throwing, for code that runs on every call where exceptions aren't worth setting up for
+template <std::size_t InlineCapacity>
+inline DWORD try_widen_into(std::string_view str, psf::basic_path_buffer<wchar_t, InlineCapacity>& buffer, UINT codePage = CP_UTF8) noexcept
+{
+    buffer.clear();
+    if (str.empty())
     {
-        assert(static_cast<std::size_t>(size) <= result.length());
-        result.resize(size);
+        return ERROR_SUCCESS;
     }
-    else
+
+    if (!buffer.try_resize(str.length()))
     {
-        throw_last_error();
+        return ERROR_OUTOFMEMORY;
     }
 
+    return psf::details::widen_into_sized(str, buffer, codePage);
+}
+
+inline std::wstring widen(std::string_view str, UINT codePage = CP_UTF8)
+{
+    std::wstring result;
+    widen_into(str, result, codePage);
     return result;
 };
 
@@ -136,45 +236,62 @@ inline std::wstring widen(std::wstring str, UINT = CP_UTF8)
     return str;
 }
 
-inline std::string narrow(std::wstring_view str, UINT codePage = CP_UTF8)
+// Equivalent to narrow, but writes to the caller's buffer (e.g. a std::string or psf::basic_path_buffer<char>)
+template <typename BufferT>
+inline void narrow_into(std::wstring_view str, BufferT& buffer, UINT codePage = CP_UTF8)
 {
-    std::string result;
+    buffer.resize(0);
     if (str.empty())
     {
         // WideCharToMultiByte fails when given a length of zero
-        return result;
+        return;
     }
 
-    // UTF-8 can occupy more characters than an equivalent UTF-16 string. WideCharToMultiByte gives us the required
-    // size, so leverage it before we resize the buffer on the first pass of the loop
-    for (int size = 0; ; )
+    // When the string is pure ASCII, the result has the same length as the input and we only need the one pass
+    std::size_t asciiLength = 0;
+    if (is_ascii_compatible_code_page(codePage))
     {
-        // NOTE: Since we call WideCharToMultiByte with a non-negative input string size, the resulting string is not
-        //       null terminated, so we don't need to '+1' the size on input and '-1' the size on resize
-        size = ::WideCharToMultiByte(
-            codePage,
-            (codePage == CP_UTF8) ? WC_ERR_INVALID_CHARS : 0,
-            str.data(), static_cast<int>(str.length()),
-            result.data(), static_cast<int>(result.length()),
-            nullptr, nullptr);
-
-        if (size > 0)
+        buffer.resize(str.length());
+        asciiLength = psf::ascii_narrow_prefix(str.data(), str.length(), buffer.data());
+        if (asciiLength == str.length())
         {
-            auto finished = (static_cast<std::size_t>(size) <= result.length());
-            assert(finished ^ (result.length() == 0));
-            result.resize(size);
-
-            if (finished)
-            {
-                break;
-            }
-        }
-        else
-        {
-            throw_last_error();
+            return;
         }
     }
 
+    // UTF-8 can occupy more characters than an equivalent UTF-16 string, so ask WideCharToMultiByte for the required
+    // size of the non-ASCII remainder before converting it
+    // NOTE: Since we call WideCharToMultiByte with a non-negative input string size, the resulting string is not null
+    //       terminated, so we don't need to '+1' the size on input and '-1' the size on resize
+    auto remainder = str.substr(asciiLength);
+    auto flags = (codePage == CP_UTF8) ? WC_ERR_INVALID_CHARS : 0;
+    auto size = ::WideCharToMultiByte(
+        codePage,
+        flags,
+        remainder.data(), static_cast<int>(remainder.length()),
+        nullptr, 0,
+        nullptr, nullptr);
+    if (size <= 0)
+    {
+        throw_last_error();
+    }
+
+    buffer.resize(asciiLength + size);
+    if (!::WideCharToMultiByte(
+        codePage,
+        flags,
+        remainder.data(), static_cast<int>(remainder.length()),
+        buffer.data() + asciiLength, size,
+        nullptr, nullptr))
+    {
+        throw_last_error();
+    }
+}
+
+inline std::string narrow(std::wstring_view str, UINT codePage = CP_UTF8)
+{
+    std::string result;
+    narrow_into(str, result, codePage);
     return result;
 }
 
@@ -193,23 +310,61 @@ struct wide_argument_string
     }
 };
 
+// NOTE: The buffer is a psf::path_buffer, so widening a typical path argument doesn't allocate. Since 'value' points
+//       into the buffer, copies and moves need to re-point it
 struct wide_argument_string_with_buffer : wide_argument_string
 {
-    std::wstring buffer;
+    psf::path_buffer buffer;
 
     wide_argument_string_with_buffer() = default;
-    wide_argument_string_with_buffer(std::wstring str) :
-        buffer(std::move(str))
+    wide_argument_string_with_buffer(std::wstring_view str) :
+        buffer(str)
     {
         value = buffer.c_str();
     }
+
+    wide_argument_string_with_buffer(const char* str)
+    {
+        widen_into(str, buffer);
+        value = buffer.c_str();
+    }
+
+    wide_argument_string_with_buffer(const wide_argument_string_with_buffer& other) :
+        buffer(other.buffer)
+    {
+        value = other.value ? buffer.c_str() : nullptr;
+    }
+
+    wide_argument_string_with_buffer(wide_argument_string_with_buffer&& other) noexcept :
+        buffer(std::move(other.buffer))
+    {
+        value = std::exchange(other.value, nullptr) ? buffer.c_str() : nullptr;
+    }
+
+    wide_argument_string_with_buffer& operator=(const wide_argument_string_with_buffer& other)
+    {
+        buffer = other.buffer;
+        value = other.value ? buffer.c_str() : nullptr;
+        return *this;
+    }
+
+    wide_argument_string_with_buffer& operator=(wide_argument_string_with_buffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            buffer = std::move(other.buffer);
+            value = std::exchange(other.value, nullptr) ? buffer.c_str() : nullptr;
+        }
+
+        return *this;
+    }
 };
 
 inline wide_argument_string_with_buffer widen_argument(const char* str)
 {
     if (str)
     {
-        return wide_argument_string_with_buffer{ widen(str) };
+        return wide_argument_string_with_buffer{ str };
     }
     else
     {
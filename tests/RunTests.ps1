@@ -1,4 +1,8 @@
 
+# When BenchmarkIterations is non-zero, the FileSystemTest benchmarks get run instead of the tests. With -Parallel, the
+# test applications of different packages run side by side
+param([int]$BenchmarkIterations = 0, [switch]$Parallel)
+
 $global:failedTests = 0
 
 $pfxPath = "$PSScriptRoot\scenarios\signing\CentennialFixupsTestSigningCertificate.pfx"
@@ -31,14 +35,25 @@ function RunTest($Arch, $Config)
         Add-AppxPackage "$PSScriptRoot\scenarios\Appx\*.appx" | Out-Null
 
         # Finally, execute the actual test. Note that the architecture of the runner doesn't actually matter
-        . x64\Release\TestRunner.exe /onlyPrintSummary
+        if ($BenchmarkIterations)
+        {
+            . x64\Release\TestRunner.exe /onlyPrintSummary /benchmark:$BenchmarkIterations "/unpackaged:$PSScriptRoot\$Arch$Config\FileSystemTest.exe"
+        }
+        elseif ($Parallel)
+        {
+            . x64\Release\TestRunner.exe /onlyPrintSummary /parallel
+        }
+        else
+        {
+            . x64\Release\TestRunner.exe /onlyPrintSummary
+        }
         $global:failedTests += $LASTEXITCODE
     }
     finally
     {
         # Uninstall all packages on exit. Ideally Add-AppxPackage would give us back something that we could use here,
         # but alas we must hard-code it
-        $packagesToUninstall = @("ArchitectureTest", "CompositionTest", "FileSystemTest", "LongPathsTest", "WorkingDirectoryTest")
+        $packagesToUninstall = @("ArchitectureTest", "CompositionTest", "FileSystemTest", "LaunchTest", "LongPathsTest", "MemoryTest", "ScalingTest", "WorkingDirectoryTest")
         foreach ($pkg in $packagesToUninstall)
         {
             Get-AppxPackage $pkg | Remove-AppxPackage
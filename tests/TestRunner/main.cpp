@@ -3,19 +3,29 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
 #include <conio.h>
+#include <deque>
+#include <fstream>
 #include <fcntl.h>
 #include <io.h>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include <ShObjIdl.h>
+#include <TlHelp32.h>
 #include <wrl/client.h>
 
 #include <error_logging.h>
 #include <test_runner.h>
+#include <utilities.h>
 
 #include "message_pipe.h"
+#include "results_region.h"
 
 using namespace Microsoft::WRL;
 using namespace std::literals;
@@ -30,10 +40,54 @@ static constexpr const wchar_t* g_applications[] =
     L"CompositionTest_8wekyb3d8bbwe!Fixed",
     L"FileSystemTest_8wekyb3d8bbwe!Fixed",
     L"LongPathsTest_8wekyb3d8bbwe!Fixed",
+    L"MemoryTest_8wekyb3d8bbwe!Fixed",
+    L"ScalingTest_8wekyb3d8bbwe!Fixed",
     L"WorkingDirectoryTest_8wekyb3d8bbwe!Fixed"
 };
 
+// The setups to compare when running benchmarks, plus the benchmarks that only make sense with the fixups. The unpackaged
+// baseline is launched separately (see below)
+static constexpr const wchar_t* g_benchmarkApplications[] =
+{
+    L"ArchitectureTest_8wekyb3d8bbwe!Fixed32",
+    L"ArchitectureTest_8wekyb3d8bbwe!Fixed64",
+    L"FileSystemTest_8wekyb3d8bbwe!Fixed",
+    L"FileSystemTest_8wekyb3d8bbwe!NoFixups",
+    L"LongPathsTest_8wekyb3d8bbwe!Fixed",
+    L"ScalingTest_8wekyb3d8bbwe!Fixed"
+};
+
 bool g_onlyPrintSummary = false;
+std::wstring g_benchmarkIterations; // Non-empty when running benchmarks
+std::wstring g_unpackagedPath;      // Executable to run as the unpackaged baseline, if any
+std::size_t g_parallelCount = 0;    // Maximum number of test applications to run at once, when running them in parallel
+results_region* g_resultsRegion = nullptr;
+
+// With '/repeat:<count>', every test application gets run that many times, and the time of each test is the median of its
+// runs. Those times can be saved with '/saveTimings:<file>', and compared against with '/compareTimings:<file>', which
+// fails the tests that are slower than the saved times by more than '/slowerThreshold:<percent>'
+std::size_t g_repeatCount = 1;
+std::wstring g_saveTimingsPath;
+std::wstring g_compareTimingsPath;
+double g_slowerThreshold = 25;
+
+// Tests that are this fast only get compared when they've slowed down by more than this, too, since their times are
+// mostly noise
+constexpr double timing_noise_floor_ms = 1.0;
+
+LARGE_INTEGER g_tickFrequency;
+
+std::int64_t current_ticks() noexcept
+{
+    LARGE_INTEGER ticks;
+    ::QueryPerformanceCounter(&ticks);
+    return ticks.QuadPart;
+}
+
+double milliseconds_since(std::int64_t ticks) noexcept
+{
+    return (static_cast<double>(current_ticks() - ticks) * 1000.0) / static_cast<double>(g_tickFrequency.QuadPart);
+}
 
 DWORD CancelIOAndWait(HANDLE file, LPOVERLAPPED overlapped)
 {
@@ -55,6 +109,10 @@ struct test
 {
     std::string name;
     std::int32_t result = ERROR_CANCELLED;
+
+    // NOTE: Measured by us, from the test's begin message to its end message
+    std::int64_t begin_ticks = 0;
+    double milliseconds = 0;
 };
 
 struct test_app
@@ -68,11 +126,36 @@ struct test_app
     // NOTE: Missing tests deduced from (test_count - (success_count + failure_count))
 
     std::vector<test> tests;
+
+    // From just before the application gets launched until it has exited
+    std::int64_t launch_ticks = 0;
+    double milliseconds = 0;
+};
+
+struct benchmark_result
+{
+    std::string api;
+    benchmark_setup setup;
+    std::int32_t iterations;
+    double microseconds_per_call;
+
+    // NOTE: Points into the results region, which stays mapped for as long as we run. Null if the benchmark didn't
+    //       send one
+    const std::uint32_t* latency_histogram;
 };
 
 struct state
 {
-    std::vector<test_app> test_apps;
+    // NOTE: A deque so that the sessions' pointers stay valid as applications get added
+    std::deque<test_app> test_apps;
+    std::vector<benchmark_result> benchmark_results;
+};
+
+// The messages from one test application, which may come over more than one connection (e.g. when the application hands
+// the pipe to a child process for part of its tests)
+struct app_session
+{
+    test_app* app;
 
     // NOTE: Pointers (as opposed to '.back()' calls) to identify extraneous messages and/or missing messages
     test_app* active_app = nullptr;
@@ -81,20 +164,20 @@ struct state
 
 state g_state;
 
-void handle_message(const init_test_message* msg)
+void handle_message(app_session& session, const init_test_message* msg)
 {
-    if (g_state.active_app)
+    if (session.active_app)
     {
         // Caller should ensure that apps that don't send a 'cleanup' message are properly cleaned up, so this should
         // imply that the same app sent multiple 'init' messages
         std::wcout << error_text() << "ERROR: Application sent more than one init message\n";
         return;
     }
-    assert(!g_state.active_test);
+    assert(!session.active_test);
 
-    g_state.active_app = &g_state.test_apps.back();
-    g_state.active_app->name = msg->name;
-    g_state.active_app->test_count = msg->count;
+    session.active_app = session.app;
+    session.active_app->name = msg->name;
+    session.active_app->test_count = msg->count;
 
     if (!g_onlyPrintSummary)
     {
@@ -107,11 +190,11 @@ void handle_message(const init_test_message* msg)
     }
 }
 
-void cleanup_current_app(bool isForcedCleanup = false)
+void cleanup_current_app(app_session& session, bool isForcedCleanup = false)
 {
-    assert(g_state.active_app);
+    assert(session.active_app);
 
-    if (g_state.active_test)
+    if (session.active_test)
     {
         if (!isForcedCleanup)
         {
@@ -119,12 +202,12 @@ void cleanup_current_app(bool isForcedCleanup = false)
         }
 
         // Act like we got a failure message for the test and then continue cleanup as normal
-        ++g_state.active_app->failure_count;
-        g_state.active_test->result = ERROR_CANCELLED;
-        g_state.active_test = nullptr;
+        ++session.active_app->failure_count;
+        session.active_test->result = ERROR_CANCELLED;
+        session.active_test = nullptr;
     }
 
-    auto app = g_state.active_app;
+    auto app = session.active_app;
     auto blockedCount = (app->test_count - (app->success_count + app->failure_count));
     if (blockedCount)
     {
@@ -144,30 +227,30 @@ void cleanup_current_app(bool isForcedCleanup = false)
             "================================================================================\n";
     }
 
-    g_state.active_app = nullptr;
+    session.active_app = nullptr;
 }
 
-void handle_message([[maybe_unused]] const cleanup_test_message* msg)
+void handle_message(app_session& session, [[maybe_unused]] const cleanup_test_message* msg)
 {
-    if (!g_state.active_app)
+    if (!session.active_app)
     {
         std::wcout << error_text() << "ERROR: Application either sent multiple cleanup messages or didn't send an init message\n";
-        assert(!g_state.active_test);
+        assert(!session.active_test);
         return;
     }
 
-    cleanup_current_app();
+    cleanup_current_app(session);
 }
 
-void handle_message(const test_begin_message* msg)
+void handle_message(app_session& session, const test_begin_message* msg)
 {
-    if (!g_state.active_app)
+    if (!session.active_app)
     {
         std::wcout << error_text() << "ERROR: Unexpected test begin message\n";
         std::wcout << error_text() << "ERROR: Name is: " << error_info_text() << msg->name << "\n";
         return;
     }
-    else if (g_state.active_test)
+    else if (session.active_test)
     {
         std::wcout << error_text() << "ERROR: Test begin message received while another test was already running\n";
         std::wcout << error_text() << "ERROR: Name is: " << error_info_text() << msg->name << "\n";
@@ -181,32 +264,35 @@ void handle_message(const test_begin_message* msg)
         std::wcout << "--------------------------------------------------------------------------------\n";
     }
 
-    g_state.active_app->tests.push_back(test{ msg->name });
-    g_state.active_test = &g_state.active_app->tests.back();
+    session.active_app->tests.push_back(test{ msg->name });
+    session.active_test = &session.active_app->tests.back();
+    session.active_test->begin_ticks = current_ticks();
 }
 
-void handle_message(const test_end_message* msg)
+void handle_message(app_session& session, const test_end_message* msg)
 {
-    if (!g_state.active_app)
+    if (!session.active_app)
     {
         std::wcout << error_text() << "ERROR: Unexpected test end message\n";
         return;
     }
-    else if (!g_state.active_test)
+    else if (!session.active_test)
     {
         std::wcout << error_text() << "ERROR: Test end message received while no test was in progress\n";
         return;
     }
 
+    session.active_test->milliseconds = milliseconds_since(session.active_test->begin_ticks);
     if (!g_onlyPrintSummary)
     {
         std::wcout << "--------------------------------------------------------------------------------\n";
-        std::wcout << "Test End\n" << "Result: ";
+        std::wcout << "Test End\n" << "Duration: " << info_text() << session.active_test->milliseconds << " ms\n";
+        std::wcout << "Result: ";
     }
 
     if (msg->result)
     {
-        ++g_state.active_app->failure_count;
+        ++session.active_app->failure_count;
         if (!g_onlyPrintSummary)
         {
             std::wcout << error_text() << "FAILED\n";
@@ -216,7 +302,7 @@ void handle_message(const test_end_message* msg)
     }
     else
     {
-        ++g_state.active_app->success_count;
+        ++session.active_app->success_count;
         if (!g_onlyPrintSummary)
         {
             std::wcout << success_text() << "SUCCESS\n";
@@ -228,14 +314,14 @@ void handle_message(const test_end_message* msg)
         std::wcout << console::change_foreground(console::color::magenta) << "^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n";
     }
 
-    g_state.active_test->result = msg->result;
-    g_state.active_test = nullptr;
+    session.active_test->result = msg->result;
+    session.active_test = nullptr;
 }
 
-void handle_message(const test_trace_message* msg)
+void handle_message(app_session& session, const test_trace_message* msg)
 {
     // We shouldn't be trying to trace output while a test isn't running
-    if (!g_state.active_test || g_onlyPrintSummary)
+    if (!session.active_test || g_onlyPrintSummary)
     {
         return;
     }
@@ -247,160 +333,820 @@ void handle_message(const test_trace_message* msg)
     }
 }
 
-int wmain(int argc, const wchar_t** argv)
+void handle_message(app_session& session, const test_benchmark_message* msg)
 {
-    // Display UTF-16 correctly...
-    // NOTE: The CRT will assert if we try and use 'cout' with this set
-    _setmode(_fileno(stdout), _O_U16TEXT);
+    if (!session.active_test)
+    {
+        std::wcout << error_text() << "ERROR: Benchmark message received while no test was in progress\n";
+        std::wcout << error_text() << "ERROR: API is: " << error_info_text() << msg->api << "\n";
+        return;
+    }
 
-    for (int i = 1; i < argc; ++i)
+    if (!g_onlyPrintSummary)
     {
-        if (argv[i] == L"/onlyPrintSummary"sv)
+        std::wcout << "Benchmark:  " << info_text() << msg->api << "\n";
+        std::wcout << "Setup:      " << info_text() << benchmark_setup_name(msg->setup) << "\n";
+        std::wcout << "Iterations: " << info_text() << msg->iterations << "\n";
+        std::wcout << "Time:       " << info_text() << msg->microseconds_per_call << L" \u00b5s/call\n";
+        if (msg->latency_histogram)
         {
-            g_onlyPrintSummary = true;
+            std::wcout << "Latency:    " << info_text() << "p50 < " << benchmark_latency_percentile(msg->latency_histogram, 0.5) <<
+                L" \u00b5s, p99 < " << benchmark_latency_percentile(msg->latency_histogram, 0.99) << L" \u00b5s\n";
+        }
+    }
+
+    g_state.benchmark_results.push_back(
+        { msg->api.get(), msg->setup, msg->iterations, msg->microseconds_per_call, msg->latency_histogram.get() });
+}
+
+void handle_message(app_session& session, const test_message* msg);
+
+// The message itself is in the results region, where we read it without copying it
+void handle_message(app_session& session, const test_region_message* msg)
+{
+    auto regionMsg = g_resultsRegion ? g_resultsRegion->find_message(msg->offset) : nullptr;
+    if (!regionMsg || (regionMsg->type == test_message_type::region))
+    {
+        std::wcout << error_text() << "ERROR: Message does not point to a message in the results region\n";
+        return;
+    }
+
+    handle_message(session, regionMsg);
+}
+
+void handle_message(app_session& session, const test_message* msg)
+{
+    switch (msg->type)
+    {
+    case test_message_type::init:
+        handle_message(session, reinterpret_cast<const init_test_message*>(msg));
+        break;
+
+    case test_message_type::cleanup:
+        handle_message(session, reinterpret_cast<const cleanup_test_message*>(msg));
+        break;
+
+    case test_message_type::begin:
+        handle_message(session, reinterpret_cast<const test_begin_message*>(msg));
+        break;
+
+    case test_message_type::end:
+        handle_message(session, reinterpret_cast<const test_end_message*>(msg));
+        break;
+
+    case test_message_type::trace:
+        handle_message(session, reinterpret_cast<const test_trace_message*>(msg));
+        break;
+
+    case test_message_type::benchmark:
+        handle_message(session, reinterpret_cast<const test_benchmark_message*>(msg));
+        break;
+
+    case test_message_type::region:
+        handle_message(session, reinterpret_cast<const test_region_message*>(msg));
+        break;
+
+    default:
+        assert(false);
+    }
+}
+
+// Called once the test application has terminated and all of the data that it sent has been processed
+int finish_test_app(app_session& session, HANDLE process)
+{
+    session.app->milliseconds = milliseconds_since(session.app->launch_ticks);
+
+    DWORD exitCode;
+    if (!::GetExitCodeProcess(process, &exitCode))
+    {
+        return print_last_error("Failed to get process exit code");
+    }
+
+    if (!session.app->test_count)
+    {
+        assert(!session.active_app);
+        std::wcout << error_text() << "ERROR: Application terminated without sending an init message\n";
+    }
+    else if (session.active_app)
+    {
+        std::wcout << error_text() << "ERROR: Application terminated without sending a cleanup message\n";
+        cleanup_current_app(session, true);
+    }
+
+    if (!g_onlyPrintSummary)
+    {
+        std::wcout << "Process exited with code: " << info_text() << exitCode << "\n";
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Processes the messages that the test application sends until it terminates. Only returns an error for failures that
+// prevent us from running any further tests
+int run_test_app(message_pipe& pipe, test_app& app, DWORD pid)
+{
+    if (!g_onlyPrintSummary)
+    {
+        std::wcout << "Process created with process id: " << info_text() << pid << "\n";
+    }
+
+    unique_handle process(::OpenProcess(SYNCHRONIZE | PROCESS_QUERY_INFORMATION, false, pid));
+    if (!process)
+    {
+        return print_last_error("Failed to open process handle");
+    }
+
+    // NOTE: WaitForMultipleObjects will return the index of the first signalled handle in the array, so the
+    //       process handle must be last so that we process all data it sends back before continuing
+    HANDLE waitArray[2] = { pipe.wait_handle(), process.get() };
+
+    app_session session{ &app };
+    while (true)
+    {
+        auto waitResult = ::WaitForMultipleObjects(
+            static_cast<DWORD>(std::size(waitArray)),
+            waitArray,
+            false,
+            INFINITE);
+        if ((waitResult >= WAIT_OBJECT_0) && (waitResult < WAIT_ABANDONED_0))
+        {
+            auto index = waitResult - WAIT_OBJECT_0;
+            assert(index < std::size(waitArray));
+
+            if (index == 1)
+            {
+                // Process terminated
+                break;
+            }
+            else
+            {
+                pipe.on_signalled([&](const test_message* msg)
+                {
+                    handle_message(session, msg);
+                });
+            }
+        }
+        else if (waitResult == WAIT_FAILED)
+        {
+            return print_last_error("Failed to wait for process to send data or exit");
         }
         else
         {
-            std::wcout << error_text() << "ERROR: Unknown argument: " << error_info_text() << argv[i] << "\n";
-            return ERROR_INVALID_PARAMETER;
+            assert(false);
+            std::wcout << error_text() << "ERROR: Unexpected failure waiting for process to send data or exit\n";
+            return ERROR_ASSERTION_FAILURE;
         }
     }
 
-    if (auto hr = ::CoInitializeEx(nullptr, COINIT_MULTITHREADED); FAILED(hr))
+    assert(pipe.state() != pipe_state::connected);
+    return finish_test_app(session, process.get());
+}
+
+// With '/parallel', the test applications run side by side. Each connection gets its own instance of the pipe, and one
+// completion port services all of them, along with the notifications of the processes exiting. Applications from the
+// same package still run one after the other, since they share the package's state (e.g. its redirected files)
+void __stdcall unregister_wait(HANDLE wait)
+{
+    // NOTE: Waits for the callback to finish, if it's running
+    ::UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+}
+
+using unique_wait = std::unique_ptr<void, psf::handle_deleter<unregister_wait>>;
+
+struct parallel_app
+{
+    const wchar_t* aumid;
+    app_session session;
+
+    DWORD pid = 0;
+    unique_handle process;
+    unique_wait exit_wait;
+    HANDLE completion_port = nullptr;
+
+    // The application is done once it has exited, and none of its connections have data left for us. Until then, it
+    // holds onto 'exit_wait'
+    bool exited = false;
+    std::size_t connections = 0;
+};
+
+struct parallel_connection
+{
+    std::unique_ptr<message_pipe> pipe;
+    parallel_app* app = nullptr;
+    std::uint32_t connection_id = 0;
+};
+
+// Completion key for the process exit notifications. The pipes use their index in the list of connections
+static constexpr ULONG_PTR process_exit_key = static_cast<ULONG_PTR>(-1);
+
+void __stdcall on_process_exit(void* context, BOOLEAN)
+{
+    auto app = static_cast<parallel_app*>(context);
+    ::PostQueuedCompletionStatus(app->completion_port, 0, process_exit_key, reinterpret_cast<LPOVERLAPPED>(app));
+}
+
+DWORD parent_process_id(DWORD pid)
+{
+    unique_handle snapshot(::CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
+    if (!snapshot)
     {
-        return print_error(hr, "COM Initialization failed");
+        return 0;
     }
 
-    ComPtr<IApplicationActivationManager> activationManager;
-    if (auto hr = ::CoCreateInstance(CLSID_ApplicationActivationManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&activationManager));
-        FAILED(hr))
+    PROCESSENTRY32W entry = { sizeof(entry) };
+    for (auto found = ::Process32FirstW(snapshot.get(), &entry); found; found = ::Process32NextW(snapshot.get(), &entry))
     {
-        return print_error(hr, "Failed to activate ApplicationActivationManager");
+        if (entry.th32ProcessID == pid)
+        {
+            return entry.th32ParentProcessID;
+        }
     }
 
-    message_pipe pipe;
-    HANDLE waitArray[2] = { pipe.wait_handle() };
+    return 0;
+}
 
-    for (auto& aumid : g_applications)
+int run_test_apps_parallel(
+    IApplicationActivationManager* activationManager,
+    const std::vector<const wchar_t*>& applications,
+    const std::wstring& launchArgs,
+    std::size_t maxConcurrency)
+{
+    unique_handle completionPort(::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1));
+    if (!completionPort)
     {
-        if (!g_onlyPrintSummary)
+        return print_last_error("Failed to create I/O completion port");
+    }
+
+    // One more instance of the pipe than there are applications running, so that there's still one left to connect to
+    // when an application hands its connection to a child process
+    std::vector<parallel_connection> connections(maxConcurrency + 1);
+    for (std::size_t i = 0; i < connections.size(); ++i)
+    {
+        connections[i].pipe = std::make_unique<message_pipe>(completionPort.get(), static_cast<ULONG_PTR>(i));
+    }
+
+    std::vector<parallel_app> apps;
+    apps.reserve(applications.size());
+    for (auto aumid : applications)
+    {
+        g_state.test_apps.emplace_back();
+        auto& testApp = g_state.test_apps.back();
+        testApp.package_family_name.assign(aumid, std::wcschr(aumid, L'!'));
+        apps.push_back(parallel_app{ aumid, app_session{ &testApp } });
+        apps.back().completion_port = completionPort.get();
+    }
+
+    auto launch = [&](parallel_app& app)
+    {
+        auto& testApp = *app.session.app;
+        testApp.launch_ticks = current_ticks();
+        testApp.activation_result = activationManager->ActivateApplication(app.aumid, launchArgs.c_str(), AO_NONE, &app.pid);
+        if (FAILED(testApp.activation_result))
         {
-            std::wcout << "\nLaunching: " << info_text() << aumid << "\n";
+            std::wcout << error_text() << "ERROR: Failed to activate " << error_info_text() << app.aumid << "\n";
+            print_error(testApp.activation_result, "Failed to activate application");
+            return false;
         }
 
-        g_state.test_apps.emplace_back();
-        auto& currentApp = g_state.test_apps.back();
-        currentApp.package_family_name.assign(aumid, std::wcschr(aumid, L'!'));
+        app.process.reset(::OpenProcess(SYNCHRONIZE | PROCESS_QUERY_INFORMATION, false, app.pid));
+        if (!app.process)
+        {
+            throw_win32(print_last_error("Failed to open process handle"));
+        }
 
-        DWORD pid;
-        currentApp.activation_result = activationManager->ActivateApplication(aumid, L"/mode:test", AO_NONE, &pid);
-        if (FAILED(currentApp.activation_result))
+        HANDLE wait;
+        if (!::RegisterWaitForSingleObject(&wait, app.process.get(), on_process_exit, &app, INFINITE, WT_EXECUTEONLYONCE))
         {
-            print_error(currentApp.activation_result, "Failed to activate application");
+            throw_win32(print_last_error("Failed to wait for process to exit"));
         }
-        else
+        app.exit_wait.reset(wait);
+
+        return true;
+    };
+
+    std::size_t nextApp = 0;
+    std::size_t runningCount = 0;
+    std::vector<bool> started(apps.size());
+    auto launchPending = [&]()
+    {
+        for (std::size_t i = nextApp; (i < apps.size()) && (runningCount < maxConcurrency); ++i)
         {
-            if (!g_onlyPrintSummary)
+            if (started[i])
+            {
+                continue;
+            }
+
+            auto& testApp = *apps[i].session.app;
+            auto packageRunning = std::any_of(apps.begin(), apps.end(), [&](const parallel_app& other)
+            {
+                return other.exit_wait && (other.session.app->package_family_name == testApp.package_family_name);
+            });
+            if (packageRunning)
             {
-                std::wcout << "Process created with process id: " << info_text() << pid << "\n";
+                continue;
             }
 
-            unique_handle process(::OpenProcess(SYNCHRONIZE | PROCESS_QUERY_INFORMATION, false, pid));
-            if (!process)
+            started[i] = true;
+            if (launch(apps[i]))
             {
-                return print_last_error("Failed to open process handle");
+                ++runningCount;
             }
+        }
 
-            // NOTE: WaitForMultipleObjects will return the index of the first signalled handle in the array, so the
-            //       process handle must be last so that we process all data it sends back before continuing
-            waitArray[1] = process.get();
+        while ((nextApp < apps.size()) && started[nextApp])
+        {
+            ++nextApp;
+        }
+    };
 
-            while (true)
+    auto finish = [&](parallel_app& app)
+    {
+        app.exit_wait.reset();
+        --runningCount;
+        return finish_test_app(app.session, app.process.get());
+    };
+
+    // Messages only ever arrive after the connection's completion has been processed, so connections get assigned to
+    // applications as soon as they've connected. Child processes (see ArchitectureTest) count towards their parent
+    auto findApp = [&](DWORD pid) -> parallel_app*
+    {
+        for (auto candidate : { pid, parent_process_id(pid) })
+        {
+            for (auto& app : apps)
             {
-                auto waitResult = ::WaitForMultipleObjects(
-                    static_cast<DWORD>(std::size(waitArray)),
-                    waitArray,
-                    false,
-                    INFINITE);
-                if ((waitResult >= WAIT_OBJECT_0) && (waitResult < WAIT_ABANDONED_0))
+                if (app.exit_wait && candidate && (app.pid == candidate))
                 {
-                    auto index = waitResult - WAIT_OBJECT_0;
-                    assert(index < std::size(waitArray));
-
-                    if (index == 1)
-                    {
-                        // Process terminated
-                        break;
-                    }
-                    else
-                    {
-                        pipe.on_signalled([](const test_message* msg)
-                        {
-                            switch (msg->type)
-                            {
-                            case test_message_type::init:
-                                handle_message(reinterpret_cast<const init_test_message*>(msg));
-                                break;
-
-                            case test_message_type::cleanup:
-                                handle_message(reinterpret_cast<const cleanup_test_message*>(msg));
-                                break;
-
-                            case test_message_type::begin:
-                                handle_message(reinterpret_cast<const test_begin_message*>(msg));
-                                break;
-
-                            case test_message_type::end:
-                                handle_message(reinterpret_cast<const test_end_message*>(msg));
-                                break;
-
-                            case test_message_type::trace:
-                                handle_message(reinterpret_cast<const test_trace_message*>(msg));
-                                break;
-
-                            default:
-                                assert(false);
-                            }
-                        });
-                    }
+                    return &app;
                 }
-                else if (waitResult == WAIT_FAILED)
+            }
+        }
+
+        return nullptr;
+    };
+
+    launchPending();
+    while (runningCount)
+    {
+        DWORD bytesTransferred;
+        ULONG_PTR key;
+        LPOVERLAPPED overlapped;
+        if (!::GetQueuedCompletionStatus(completionPort.get(), &bytesTransferred, &key, &overlapped, INFINITE) && !overlapped)
+        {
+            return print_last_error("Failed to wait for processes to send data or exit");
+        }
+
+        if (key == process_exit_key)
+        {
+            auto& app = *reinterpret_cast<parallel_app*>(overlapped);
+            app.exited = true;
+            if (!app.connections)
+            {
+                if (auto err = finish(app))
                 {
-                    return print_last_error("Failed to wait for process to send data or exit");
+                    return err;
                 }
-                else
+                launchPending();
+            }
+            continue;
+        }
+
+        assert(key < connections.size());
+        auto& connection = connections[key];
+        connection.pipe->on_signalled([&](const test_message* msg)
+        {
+            if (connection.app)
+            {
+                handle_message(connection.app->session, msg);
+            }
+        });
+
+        if (connection.app &&
+            ((connection.pipe->state() != pipe_state::connected) || (connection.connection_id != connection.pipe->connection_id())))
+        {
+            // The client disconnected
+            auto& app = *connection.app;
+            connection.app = nullptr;
+            if ((--app.connections == 0) && app.exited)
+            {
+                if (auto err = finish(app))
                 {
-                    assert(false);
-                    std::wcout << error_text() << "ERROR: Unexpected failure waiting for process to send data or exit\n";
-                    return ERROR_ASSERTION_FAILURE;
+                    return err;
                 }
+                launchPending();
+            }
+        }
+
+        if ((connection.pipe->state() == pipe_state::connected) && (connection.connection_id != connection.pipe->connection_id()))
+        {
+            connection.connection_id = connection.pipe->connection_id();
+            connection.app = findApp(connection.pipe->client_process_id());
+            if (connection.app)
+            {
+                ++connection.app->connections;
+            }
+            else
+            {
+                std::wcout << error_text() << "ERROR: Connection from a process that isn't one of the test applications\n";
             }
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+std::wstring format_benchmark_time(const benchmark_result* result)
+{
+    if (!result)
+    {
+        return L"-";
+    }
 
-            assert(pipe.state() != pipe_state::connected);
+    std::wostringstream stream;
+    stream << std::fixed << std::setprecision(2) << result->microseconds_per_call;
+    return stream.str();
+}
 
-            DWORD exitCode;
-            if (!::GetExitCodeProcess(process.get(), &exitCode))
+std::wstring format_benchmark_ratio(const benchmark_result* result, const benchmark_result* baseline)
+{
+    if (!result || !baseline || (baseline->microseconds_per_call <= 0))
+    {
+        return L"-";
+    }
+
+    std::wostringstream stream;
+    stream << std::fixed << std::setprecision(2) << (result->microseconds_per_call / baseline->microseconds_per_call) << L"x";
+    return stream.str();
+}
+
+std::wstring format_benchmark_p99(const benchmark_result* result)
+{
+    if (!result || !result->latency_histogram)
+    {
+        return L"-";
+    }
+
+    std::wostringstream stream;
+    stream << std::fixed << std::setprecision(2) << benchmark_latency_percentile(result->latency_histogram, 0.99);
+    return stream.str();
+}
+
+// Lines up the results for each API across the setups. The overhead ratios are relative to the unpackaged baseline when
+// it was run, and relative to running with only PsfRuntime otherwise, which still isolates the cost of the fixups
+void print_benchmark_summary()
+{
+    std::vector<std::string> apis;
+    for (auto& result : g_state.benchmark_results)
+    {
+        if (std::find(apis.begin(), apis.end(), result.api) == apis.end())
+        {
+            apis.push_back(result.api);
+        }
+    }
+
+    auto find = [](const std::string& api, benchmark_setup setup) -> const benchmark_result*
+    {
+        for (auto& result : g_state.benchmark_results)
+        {
+            if ((result.api == api) && (result.setup == setup))
+            {
+                return &result;
+            }
+        }
+
+        return nullptr;
+    };
+
+    std::wcout << console::change_foreground(console::color::cyan) <<
+        "Benchmark Results (\u00b5s/call)\n" <<
+        std::left << std::setw(60) << L"API" <<
+        std::right << std::setw(10) << L"Fixups" << std::setw(10) << L"Runtime" << std::setw(12) << L"Unpackaged" <<
+        std::setw(12) << L"Fixups/Base" << std::setw(14) << L"Runtime/Base" << std::setw(12) << L"Fixups p99" << "\n";
+
+    for (auto& api : apis)
+    {
+        auto fixups = find(api, benchmark_setup::fixups);
+        auto runtimeOnly = find(api, benchmark_setup::runtime_only);
+        auto unpackaged = find(api, benchmark_setup::unpackaged);
+        auto baseline = unpackaged ? unpackaged : runtimeOnly;
+
+        std::wcout << console::change_foreground(console::color::dark_cyan) <<
+            std::left << std::setw(60) << api.c_str() <<
+            std::right << std::setw(10) << format_benchmark_time(fixups) << std::setw(10) << format_benchmark_time(runtimeOnly) <<
+            std::setw(12) << format_benchmark_time(unpackaged) <<
+            std::setw(12) << format_benchmark_ratio(fixups, baseline) <<
+            std::setw(14) << format_benchmark_ratio(unpackaged ? runtimeOnly : nullptr, baseline) <<
+            std::setw(12) << format_benchmark_p99(fixups) << "\n";
+    }
+
+    std::wcout << "\n";
+}
+
+// The median time of each test that passed, keyed by its package family name and name, separated by a tab
+std::map<std::string, double> median_test_times()
+{
+    std::map<std::string, std::vector<double>> samples;
+    for (auto& testApp : g_state.test_apps)
+    {
+        auto packageName = narrow(testApp.package_family_name);
+        for (auto& test : testApp.tests)
+        {
+            if (!test.result)
+            {
+                samples[packageName + "\t" + test.name].push_back(test.milliseconds);
+            }
+        }
+    }
+
+    std::map<std::string, double> result;
+    for (auto& [key, times] : samples)
+    {
+        std::sort(times.begin(), times.end());
+        auto middle = times.size() / 2;
+        result.emplace(key, (times.size() % 2) ? times[middle] : ((times[middle - 1] + times[middle]) / 2));
+    }
+
+    return result;
+}
+
+// The file has a line for each test, with its key (see above) and its time in milliseconds, separated by a tab
+int save_test_times(const std::wstring& path, const std::map<std::string, double>& times)
+{
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    for (auto& [key, milliseconds] : times)
+    {
+        file << key << "\t" << std::fixed << std::setprecision(3) << milliseconds << "\n";
+    }
+
+    if (!file)
+    {
+        std::wcout << error_text() << "ERROR: Failed to write test timings to " << error_info_text() << path << "\n";
+        return ERROR_WRITE_FAULT;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+int load_test_times(const std::wstring& path, std::map<std::string, double>& times)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::wcout << error_text() << "ERROR: Failed to open test timings file " << error_info_text() << path << "\n";
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        auto pos = line.rfind('\t');
+        if (pos == std::string::npos)
+        {
+            continue;
+        }
+
+        times.insert_or_assign(line.substr(0, pos), std::strtod(line.c_str() + pos + 1, nullptr));
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Prints the tests that got slower than the baseline allows, and returns how many of them there are
+int print_timing_regressions(const std::map<std::string, double>& times, const std::map<std::string, double>& baseline)
+{
+    std::wcout << console::change_foreground(console::color::cyan) << "Test Timings (median of " << g_repeatCount <<
+        " run(s), compared with " << g_compareTimingsPath << ")\n";
+
+    int regressionCount = 0;
+    for (auto& [key, milliseconds] : times)
+    {
+        auto itr = baseline.find(key);
+        if (itr == baseline.end())
+        {
+            continue;
+        }
+
+        auto limit = itr->second * (1 + (g_slowerThreshold / 100));
+        if ((milliseconds <= limit) || ((milliseconds - itr->second) <= timing_noise_floor_ms))
+        {
+            continue;
+        }
+
+        ++regressionCount;
+        auto name = widen(key);
+        name.replace(name.find(L'\t'), 1, L": ");
+        std::wcout << error_text() << "  SLOWER: " << console::change_foreground(console::color::dark_cyan) << name <<
+            " (" << std::fixed << std::setprecision(2) << itr->second << " ms -> " << milliseconds << " ms)\n";
+    }
+
+    if (!regressionCount)
+    {
+        std::wcout << success_text() << "  No tests are slower than " << g_slowerThreshold << "% over their baseline\n";
+    }
+
+    std::wcout << "\n";
+    return regressionCount;
+}
+
+int wmain(int argc, const wchar_t** argv)
+{
+    // Display UTF-16 correctly...
+    // NOTE: The CRT will assert if we try and use 'cout' with this set
+    _setmode(_fileno(stdout), _O_U16TEXT);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::wstring_view arg = argv[i];
+        if (arg == L"/onlyPrintSummary"sv)
+        {
+            g_onlyPrintSummary = true;
+        }
+        else if ((arg.substr(0, 11) == L"/benchmark:"sv) && (arg.length() > 11))
+        {
+            g_benchmarkIterations = arg.substr(11);
+        }
+        else if ((arg.substr(0, 12) == L"/unpackaged:"sv) && (arg.length() > 12))
+        {
+            g_unpackagedPath = arg.substr(12);
+        }
+        else if ((arg.substr(0, 8) == L"/repeat:"sv) && (arg.length() > 8))
+        {
+            g_repeatCount = std::wcstoul(argv[i] + 8, nullptr, 10);
+            if (!g_repeatCount)
             {
-                return print_last_error("Failed to get process exit code");
+                std::wcout << error_text() << "ERROR: Invalid repeat count: " << error_info_text() << argv[i] << "\n";
+                return ERROR_INVALID_PARAMETER;
             }
+        }
+        else if ((arg.substr(0, 13) == L"/saveTimings:"sv) && (arg.length() > 13))
+        {
+            g_saveTimingsPath = arg.substr(13);
+        }
+        else if ((arg.substr(0, 16) == L"/compareTimings:"sv) && (arg.length() > 16))
+        {
+            g_compareTimingsPath = arg.substr(16);
+        }
+        else if ((arg.substr(0, 17) == L"/slowerThreshold:"sv) && (arg.length() > 17))
+        {
+            g_slowerThreshold = std::wcstod(argv[i] + 17, nullptr);
+        }
+        else if (arg == L"/parallel"sv)
+        {
+            g_parallelCount = (std::max)(std::thread::hardware_concurrency(), 1u);
+        }
+        else if ((arg.substr(0, 10) == L"/parallel:"sv) && (arg.length() > 10))
+        {
+            g_parallelCount = std::wcstoul(argv[i] + 10, nullptr, 10);
+            if (!g_parallelCount)
+            {
+                std::wcout << error_text() << "ERROR: Invalid number of parallel applications: " << error_info_text() << argv[i] << "\n";
+                return ERROR_INVALID_PARAMETER;
+            }
+        }
+        else
+        {
+            std::wcout << error_text() << "ERROR: Unknown argument: " << error_info_text() << argv[i] << "\n";
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    // NOTE: Benchmarks running side by side would skew each other's times. Running tests in parallel also means that
+    //       their output would get interleaved, so only the summary gets printed
+    if (g_parallelCount && !g_benchmarkIterations.empty())
+    {
+        std::wcout << error_text() << "ERROR: /parallel can't be used together with /benchmark\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+    else if (((g_repeatCount > 1) || !g_saveTimingsPath.empty() || !g_compareTimingsPath.empty()) && !g_benchmarkIterations.empty())
+    {
+        std::wcout << error_text() << "ERROR: Test timings can't be used together with /benchmark, which times the APIs itself\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+    else if (g_parallelCount)
+    {
+        g_onlyPrintSummary = true;
+    }
+
+    std::map<std::string, double> baselineTimes;
+    if (!g_compareTimingsPath.empty())
+    {
+        if (auto err = load_test_times(g_compareTimingsPath, baselineTimes))
+        {
+            return err;
+        }
+    }
+
+    ::QueryPerformanceFrequency(&g_tickFrequency);
+
+    if (auto hr = ::CoInitializeEx(nullptr, COINIT_MULTITHREADED); FAILED(hr))
+    {
+        return print_error(hr, "COM Initialization failed");
+    }
+
+    // NOTE: Has to exist before any of the test processes look for it, which they do the first time that they need it
+    results_region resultsRegion;
+    g_resultsRegion = &resultsRegion;
+
+    ComPtr<IApplicationActivationManager> activationManager;
+    if (auto hr = ::CoCreateInstance(CLSID_ApplicationActivationManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&activationManager));
+        FAILED(hr))
+    {
+        return print_error(hr, "Failed to activate ApplicationActivationManager");
+    }
+
+    // NOTE: The benchmark applications measure, rather than test, so they're only run when asked for. The same goes for
+    //       the unpackaged baseline, which we can only launch when told where the executable is
+    std::vector<const wchar_t*> applications;
+    if (g_benchmarkIterations.empty())
+    {
+        applications.assign(std::begin(g_applications), std::end(g_applications));
+    }
+    else
+    {
+        applications.assign(std::begin(g_benchmarkApplications), std::end(g_benchmarkApplications));
+    }
 
-            if (!currentApp.test_count)
+    const auto launchArgs = g_benchmarkIterations.empty() ? L"/mode:test"s : (L"/mode:test /benchmark:" + g_benchmarkIterations);
+    // NOTE: Clients connect to whichever instance of the pipe is free, so this one can't exist while the parallel run
+    //       has its own
+    std::unique_ptr<message_pipe> pipe;
+    if (!g_parallelCount)
+    {
+        pipe = std::make_unique<message_pipe>();
+    }
+
+    for (std::size_t repetition = 0; repetition < g_repeatCount; ++repetition)
+    {
+        if (g_parallelCount)
+        {
+            if (auto err = run_test_apps_parallel(activationManager.Get(), applications, launchArgs, g_parallelCount))
             {
-                assert(!g_state.active_app);
-                std::wcout << error_text() << "ERROR: Application terminated without sending an init message\n";
+                return err;
             }
-            else if (g_state.active_app)
+
+            continue;
+        }
+
+        for (auto& aumid : applications)
+        {
+            if (!g_onlyPrintSummary)
             {
-                std::wcout << error_text() << "ERROR: Application terminated without sending a cleanup message\n";
-                cleanup_current_app(true);
+                std::wcout << "\nLaunching: " << info_text() << aumid << "\n";
+            }
+
+            g_state.test_apps.emplace_back();
+            auto& currentApp = g_state.test_apps.back();
+            currentApp.package_family_name.assign(aumid, std::wcschr(aumid, L'!'));
+
+            DWORD pid;
+            currentApp.launch_ticks = current_ticks();
+            currentApp.activation_result = activationManager->ActivateApplication(aumid, launchArgs.c_str(), AO_NONE, &pid);
+            if (FAILED(currentApp.activation_result))
+            {
+                print_error(currentApp.activation_result, "Failed to activate application");
+            }
+            else if (auto err = run_test_app(*pipe, currentApp, pid))
+            {
+                return err;
             }
 
             if (!g_onlyPrintSummary)
             {
-                std::wcout << "Process exited with code: " << info_text() << exitCode << "\n";
+                std::wcout << "\n\n";
             }
+        }
+    }
 
-            waitArray[1] = nullptr;
+    if (!g_benchmarkIterations.empty() && !g_unpackagedPath.empty())
+    {
+        if (!g_onlyPrintSummary)
+        {
+            std::wcout << "\nLaunching: " << info_text() << g_unpackagedPath << "\n";
+        }
+
+        g_state.test_apps.emplace_back();
+        auto& currentApp = g_state.test_apps.back();
+        currentApp.package_family_name = g_unpackagedPath;
+
+        auto cmdLine = L"\"" + g_unpackagedPath + L"\" " + launchArgs;
+        currentApp.launch_ticks = current_ticks();
+        STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+        PROCESS_INFORMATION processInfo;
+        if (!::CreateProcessW(g_unpackagedPath.c_str(), cmdLine.data(), nullptr, nullptr, false, 0, nullptr, nullptr, &startupInfo, &processInfo))
+        {
+            currentApp.activation_result = HRESULT_FROM_WIN32(::GetLastError());
+            print_error(currentApp.activation_result, "Failed to launch unpackaged application");
+        }
+        else
+        {
+            // NOTE: Holding onto the process handle until the process has been waited on keeps its id from being reused
+            currentApp.activation_result = S_OK;
+            unique_handle process(processInfo.hProcess);
+            ::CloseHandle(processInfo.hThread);
+
+            if (auto err = run_test_app(*pipe, currentApp, processInfo.dwProcessId))
+            {
+                return err;
+            }
         }
 
         if (!g_onlyPrintSummary)
@@ -432,6 +1178,13 @@ int wmain(int argc, const wchar_t** argv)
             std::wcout << error_text() << "FAILED!\n";
         }
 
+        if (SUCCEEDED(testApp.activation_result))
+        {
+            std::wcout << console::change_foreground(console::color::cyan) << "           Duration: " <<
+                console::change_foreground(console::color::dark_cyan) << std::fixed << std::setprecision(2) <<
+                testApp.milliseconds << " ms\n";
+        }
+
         if (testApp.test_count)
         {
             std::wcout << console::change_foreground(console::color::cyan) << "        Total Count: " <<
@@ -487,6 +1240,25 @@ int wmain(int argc, const wchar_t** argv)
         std::wcout << "\n";
     }
 
+    if (!g_state.benchmark_results.empty())
+    {
+        print_benchmark_summary();
+    }
+
+    if (!g_saveTimingsPath.empty() || !g_compareTimingsPath.empty())
+    {
+        auto times = median_test_times();
+        if (!g_compareTimingsPath.empty())
+        {
+            failureCount += print_timing_regressions(times, baselineTimes);
+        }
+
+        if (!g_saveTimingsPath.empty())
+        {
+            save_test_times(g_saveTimingsPath, times);
+        }
+    }
+
     std::wcout << "Overall Result: ";
     if (!failureCount)
     {
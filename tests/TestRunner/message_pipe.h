@@ -4,6 +4,7 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <cstdint>
 #include <memory>
 
 #include <error_logging.h>
@@ -23,20 +24,7 @@ public:
 
     message_pipe()
     {
-        m_buffer = std::make_unique<char[]>(m_bufferCapacity);
-        m_pipeHandle.reset(::CreateNamedPipeW(
-            test_runner_pipe_name,
-            PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
-            PIPE_TYPE_BYTE,
-            PIPE_UNLIMITED_INSTANCES,      // MaxInstances
-            2048,   // OutBufferSize
-            2048,   // InBufferSize
-            0,      // DefaultTimeOut (defaults to 50ms)
-            nullptr));
-        if (!m_pipeHandle)
-        {
-            throw_win32(print_last_error("Failed to create named pipe"));
-        }
+        CreatePipe();
 
         m_pipeEvent.reset(::CreateEventW(nullptr, true, false, nullptr));
         if (!m_pipeEvent)
@@ -49,6 +37,20 @@ public:
         InitiateConnection();
     }
 
+    // Completions get queued to the port instead of signalling an event. The caller calls 'on_signalled' for each one
+    // that has 'key' as its completion key
+    message_pipe(HANDLE completionPort, ULONG_PTR key)
+    {
+        CreatePipe();
+
+        if (!::CreateIoCompletionPort(m_pipeHandle.get(), completionPort, key, 0))
+        {
+            throw_win32(print_last_error("Failed to associate the pipe with the completion port"));
+        }
+
+        InitiateConnection();
+    }
+
     pipe_state state() const noexcept
     {
         return m_state;
@@ -59,18 +61,35 @@ public:
         return m_pipeEvent.get();
     }
 
+    // Changes every time that a client connects, so that callers can tell connections apart
+    std::uint32_t connection_id() const noexcept
+    {
+        return m_connectionId;
+    }
+
+    DWORD client_process_id() const noexcept
+    {
+        ULONG pid = 0;
+        return ::GetNamedPipeClientProcessId(m_pipeHandle.get(), &pid) ? pid : 0;
+    }
+
     template <typename Handler> // void(const test_message*)
     void on_signalled(Handler&& handler)
     {
-        ::ResetEvent(m_pipeEvent.get());
+        if (m_pipeEvent)
+        {
+            ::ResetEvent(m_pipeEvent.get());
+        }
 
         if (m_state == pipe_state::connecting)
         {
             m_state = pipe_state::connected;
+            ++m_connectionId;
             InitiateRead();
             return;
         }
-
+::CreateNamedPipeW(
+            test_runner_pipe_name,
         assert(m_state == pipe_state::connected);
         DWORD bytesRead;
         if (!::GetOverlappedResult(m_pipeHandle.get(), &m_overlapped, &bytesRead, false))
@@ -100,11 +119,39 @@ public:
             std::memmove(m_buffer.get(), msg, m_bufferSize);
         }
 
+        // Messages get decoded in place, so the buffer has to be able to hold the largest one
+        msg = reinterpret_cast<const test_message*>(m_buffer.get());
+        if ((m_bufferSize >= sizeof(test_message)) && (static_cast<DWORD>(msg->size) > m_bufferCapacity))
+        {
+            auto buffer = std::make_unique<char[]>(msg->size);
+            std::memcpy(buffer.get(), m_buffer.get(), m_bufferSize);
+            m_buffer = std::move(buffer);
+            m_bufferCapacity = msg->size;
+        }
+
         InitiateRead();
     }
 
 private:
 
+    void CreatePipe()
+    {
+        m_buffer = std::make_unique<char[]>(m_bufferCapacity);
+        m_pipeHandle.reset(::CreateNamedPipeW(
+            test_runner_pipe_name,
+            PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_BYTE,
+            PIPE_UNLIMITED_INSTANCES,      // MaxInstances
+            2048,   // OutBufferSize
+            static_cast<DWORD>(test_runner_batch_size * 4), // InBufferSize, so that the client isn't kept waiting on each batch
+            0,      // DefaultTimeOut (defaults to 50ms)
+            nullptr));
+        if (!m_pipeHandle)
+        {
+            throw_win32(print_last_error("Failed to create named pipe"));
+        }
+    }
+
     void InitiateConnection()
     {
         assert(m_state == pipe_state::disconnected);
@@ -122,6 +169,7 @@ private:
         case ERROR_PIPE_CONNECTED:
             // Client has already connected to the pipe
             m_state = pipe_state::connected;
+            ++m_connectionId;
             InitiateRead();
             break;
 
@@ -179,8 +227,10 @@ private:
     unique_handle m_pipeEvent;
     OVERLAPPED m_overlapped = {};
     pipe_state m_state = pipe_state::disconnected;
+    std::uint32_t m_connectionId = 0;
 
-    DWORD m_bufferCapacity = 2048;
+    // NOTE: Large enough for a full batch of trace messages (see 'test_runner_batch'), so that one read gets all of it
+    DWORD m_bufferCapacity = static_cast<DWORD>(test_runner_batch_size * 2);
     DWORD m_bufferSize = 0;
     std::unique_ptr<char[]> m_buffer;
 };
@@ -0,0 +1,79 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+
+#include <error_logging.h>
+#include <fancy_handle.h>
+#include <test_runner.h>
+
+// The region of shared memory that test processes place their largest messages in (see 'test_results_region_header').
+// It's created before any of them are launched, and stays mapped until we exit, so that we can keep pointing into it
+class results_region
+{
+public:
+
+    results_region()
+    {
+        m_mapping.reset(::CreateFileMappingW(
+            INVALID_HANDLE_VALUE,
+            nullptr,
+            PAGE_READWRITE,
+            0,
+            test_results_region_size,
+            test_results_region_name));
+        if (!m_mapping)
+        {
+            throw_win32(print_last_error("Failed to create the results region"));
+        }
+        else if (::GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            // Most likely another instance of the runner, which is already using it
+            throw_win32(print_error(ERROR_ALREADY_EXISTS, "Failed to create the results region"));
+        }
+
+        m_region = static_cast<test_results_region_header*>(
+            ::MapViewOfFile(m_mapping.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, test_results_region_size));
+        if (!m_region)
+        {
+            throw_win32(print_last_error("Failed to map the results region"));
+        }
+
+        m_region->size = test_results_region_size;
+        m_region->used = sizeof(test_results_region_header);
+    }
+
+    ~results_region()
+    {
+        ::UnmapViewOfFile(m_region);
+    }
+
+    results_region(const results_region&) = delete;
+    results_region& operator=(const results_region&) = delete;
+
+    // Returns null if 'offset' doesn't point to a complete message
+    const test_message* find_message(std::uint32_t offset) const noexcept
+    {
+        auto used = static_cast<std::uint32_t>(m_region->used);
+        if ((offset < sizeof(test_results_region_header)) || (offset > used) || ((used - offset) < sizeof(test_message)))
+        {
+            return nullptr;
+        }
+
+        auto msg = reinterpret_cast<const test_message*>(reinterpret_cast<const std::uint8_t*>(m_region) + offset);
+        if ((msg->size < static_cast<std::int32_t>(sizeof(test_message))) || (static_cast<std::uint32_t>(msg->size) > (used - offset)))
+        {
+            return nullptr;
+        }
+
+        return msg;
+    }
+
+private:
+
+    unique_handle m_mapping;
+    test_results_region_header* m_region = nullptr;
+};
@@ -0,0 +1,639 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Measures how loading the configuration scales with its size: the PsfRuntime parsing config.json (or replaying
+// config.psfc) into a DOM, looking up "processes" entries the way that PSFQueryExeConfig does, and the File Redirection
+// Fixup's InitializeConfiguration. Configurations of increasing size get generated, and each of them gets loaded by a
+// child process per format, so that each measures its peak memory from a clean slate, and so that the fixup, which
+// only initializes once per process, can be initialized again. See readme.md for the options.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <windows.h>
+#include <psapi.h>
+#include <fancy_handle.h>
+#include <pattern_matcher.h>
+#include <psf_runtime.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/error/en.h>
+#include <utilities.h>
+#include <win32_error.h>
+
+#include "CompiledConfig.h"
+#include "ConfigHandlers.h"
+#include "JsonConfig.h"
+#include "benchmark_harness.h"
+
+// Both live in the fixup, which would normally call them from its DllMain and PSFInitialize
+void InitializePaths();
+void InitializeConfiguration();
+
+constexpr std::uint32_t patterns_per_group = 10;
+
+enum class load_format
+{
+    json,           // All of config.json, the way that PSFQueryExeConfig and PSFQueryDllConfig load it
+    json_current,   // Only what the current process uses, the way that the PsfRuntime loads config.json at startup
+    psfc,           // json, from config.psfc
+    psfc_current,   // json_current, from config.psfc
+    fixup,          // The File Redirection Fixup's InitializeConfiguration, given the current process's fixup config
+};
+
+struct format_info
+{
+    load_format format;
+    const wchar_t* name;
+};
+
+constexpr format_info all_formats[] =
+{
+    { load_format::json, L"json" },
+    { load_format::json_current, L"json-current" },
+    { load_format::psfc, L"psfc" },
+    { load_format::psfc_current, L"psfc-current" },
+    { load_format::fixup, L"fixup" },
+};
+
+enum class grow_mode
+{
+    processes,
+    patterns,
+    both,
+};
+
+enum class match_position
+{
+    first,
+    middle,
+    last,
+};
+
+struct benchmark_options
+{
+    std::uint32_t steps = 6;
+    std::uint32_t processes = 8;
+    std::uint32_t patterns = 16;
+    grow_mode grow = grow_mode::both;
+    match_position match = match_position::last;
+    std::uint32_t iterations = 10;
+    std::uint64_t queries = 100'000;
+
+    // Set for the child processes, which each load the configuration in 'directory' one way
+    bool child = false;
+    load_format format = load_format::json;
+    std::wstring directory;
+};
+
+// A "processes" entry and the pattern that its "executable" compiled to, as load_full_config in Config.cpp builds them
+struct process_matcher
+{
+    psf::pattern_matcher matcher;
+    const psf::json_object* config = nullptr;
+};
+
+static void print_usage()
+{
+    std::printf(
+        "Usage: ConfigLoadBenchmark [options]\n"
+        "  --steps <n>         Number of configurations to generate, each larger than the one before (default 6)\n"
+        "  --processes <n>     Number of \"processes\" entries in the first configuration (default 8)\n"
+        "  --patterns <n>      Redirection patterns per entry in the first configuration (default 16)\n"
+        "  --grow <what>       What doubles with each step: processes, patterns, or both (default both)\n"
+        "  --match <where>     Where the current process's entry is: first, middle, or last (default last)\n"
+        "  --iterations <n>    Loads per configuration and format (default 10)\n"
+        "  --queries <n>       Executable lookups per configuration and format (default 100000)\n");
+}
+
+static bool parse_options(int argc, wchar_t** argv, benchmark_options& options)
+{
+    auto parsed = parse_benchmark_arguments(argc, argv, {}, [&](std::wstring_view arg, std::wstring_view value)
+    {
+        if (arg == L"--child")
+        {
+            auto itr = std::find_if(std::begin(all_formats), std::end(all_formats), [&](const format_info& info)
+            {
+                return value == info.name;
+            });
+            if (itr == std::end(all_formats))
+            {
+                return false;
+            }
+
+            options.child = true;
+            options.format = itr->format;
+        }
+        else if (arg == L"--directory")
+        {
+            options.directory = value;
+        }
+        else if (arg == L"--grow")
+        {
+            if (value == L"processes")
+            {
+                options.grow = grow_mode::processes;
+            }
+            else if (value == L"patterns")
+            {
+                options.grow = grow_mode::patterns;
+            }
+            else if (value == L"both")
+            {
+                options.grow = grow_mode::both;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (arg == L"--match")
+        {
+            if (value == L"first")
+            {
+                options.match = match_position::first;
+            }
+            else if (value == L"middle")
+            {
+                options.match = match_position::middle;
+            }
+            else if (value == L"last")
+            {
+                options.match = match_position::last;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (arg == L"--queries")
+        {
+            return parse_count(value.data(), options.queries);
+        }
+        else if (arg == L"--steps")
+        {
+            return parse_count(value.data(), options.steps);
+        }
+        else if (arg == L"--processes")
+        {
+            return parse_count(value.data(), options.processes);
+        }
+        else if (arg == L"--patterns")
+        {
+            return parse_count(value.data(), options.patterns);
+        }
+        else if (arg == L"--iterations")
+        {
+            return parse_count(value.data(), options.iterations);
+        }
+        else
+        {
+            return false;
+        }
+
+        return true;
+    });
+
+    return parsed && (!options.child || !options.directory.empty());
+}
+
+// Everything that gets loaded is on the heap and is never freed, so this only ever grows by what the loading took
+static std::size_t peak_private_bytes()
+{
+    PROCESS_MEMORY_COUNTERS counters = { sizeof(counters) };
+    check_win32_bool(::GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters)), "Failed to get the process's memory usage");
+    return counters.PeakPagefileUsage;
+}
+
+static std::wstring current_executable_name()
+{
+    std::wstring path(MAX_PATH, L'\0');
+    while (true)
+    {
+        auto length = ::GetModuleFileNameW(nullptr, path.data(), static_cast<DWORD>(path.size()));
+        if (length == 0)
+        {
+            throw_last_error("Failed to get the executable's path");
+        }
+        else if (length < path.size())
+        {
+            path.resize(length);
+            break;
+        }
+        path.resize(path.size() * 2);
+    }
+
+    // The PsfRuntime matches "processes" entries against the executable's name without its extension
+    return std::filesystem::path(path).stem().native();
+}
+
+// Patterns are grouped ten to a base directory, the same as in PathRedirectionBenchmark, and each entry gets its own
+// base directories so that the strings in different entries differ, as they do in real configurations
+static std::string generate_fixup_config(std::uint32_t entry, std::uint32_t patterns)
+{
+    std::string result = R"({"redirectedPaths":{"packageRelative":[)";
+    for (std::uint32_t group = 0; group * patterns_per_group < patterns; ++group)
+    {
+        if (group != 0)
+        {
+            result += ',';
+        }
+
+        result += R"({"base":"app)" + std::to_string(entry) + R"(\\group)" + std::to_string(group) + R"(","patterns":[)";
+        auto end = (std::min)(patterns, (group + 1) * patterns_per_group);
+        for (auto i = group * patterns_per_group; i < end; ++i)
+        {
+            if (i != group * patterns_per_group)
+            {
+                result += ',';
+            }
+            result += R"("(.*\\\\)?file)" + std::to_string(i) + R"(_[0-9]+\\.dat")";
+        }
+        result += "]}";
+    }
+    result += "]}}";
+    return result;
+}
+
+static std::uint32_t matching_entry(std::uint32_t processes, match_position match) noexcept
+{
+    switch (match)
+    {
+    case match_position::first:
+        return 0;
+    case match_position::middle:
+        return processes / 2;
+    default:
+        return processes - 1;
+    }
+}
+
+// Every entry of "processes" is for an executable named "App<n>", other than the one for the current process, and each
+// has an entry in "applications" to go with it
+static std::string generate_config(std::uint32_t processes, std::uint32_t patterns, match_position match, const std::wstring& currentExe)
+{
+    auto current = matching_entry(processes, match);
+    auto executable = [&](std::uint32_t entry)
+    {
+        return (entry == current) ? narrow(currentExe) : ("App" + std::to_string(entry));
+    };
+
+    std::string result = R"({"applications":[)";
+    for (std::uint32_t i = 0; i < processes; ++i)
+    {
+        if (i != 0)
+        {
+            result += ',';
+        }
+        result += R"({"id":"App)" + std::to_string(i) + R"(","executable":")" + executable(i) + R"(.exe"})";
+    }
+
+    result += R"(],"processes":[)";
+    for (std::uint32_t i = 0; i < processes; ++i)
+    {
+        if (i != 0)
+        {
+            result += ',';
+        }
+        result += R"({"executable":"^)" + executable(i) + R"($","fixups":[{"dll":"FileRedirectionFixup.dll","config":)";
+        result += generate_fixup_config(i, patterns);
+        result += "}]}";
+    }
+    result += "]}";
+    return result;
+}
+
+template <typename Container>
+static Container read_file(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open " + path.filename().string());
+    }
+
+    std::stringstream stream;
+    stream << file.rdbuf();
+    auto contents = stream.str();
+    return Container(contents.begin(), contents.end());
+}
+
+template <typename Container>
+static void write_file(const std::filesystem::path& path, const Container& contents)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+    if (!file)
+    {
+        throw std::runtime_error("Failed to write " + path.filename().string());
+    }
+}
+
+static std::vector<std::uint8_t> compile_config(const std::string& json)
+{
+    json_document document;
+    rapidjson::StringStream stream(json.c_str());
+    rapidjson::Reader reader;
+    if (auto result = reader.Parse(stream, document); result.IsError())
+    {
+        throw std::runtime_error(std::string("Failed to parse the generated configuration: ") + rapidjson::GetParseError_En(result.Code()));
+    }
+
+    return compiled_config_writer().write(*document.root(), compiled_config_hash(json.data(), json.size()), {});
+}
+
+// Kept alive for as long as the process runs, since the DOMs point into them
+static std::deque<std::string> g_jsonBuffers;
+static std::deque<compiled_config> g_compiledConfigs;
+static std::deque<json_document> g_documents;
+
+// Builds a DOM the same way that Config.cpp does, other than that config.json gets copied instead of mapped
+// copy-on-write, which the copy stands in for
+static json_document& load_document(
+    load_format format,
+    const std::string& json,
+    const std::vector<std::uint8_t>& psfc,
+    const std::wstring& currentExe,
+    std::vector<process_matcher>& processes)
+{
+    auto& document = g_documents.emplace_back();
+    const compiled_config* compiled = nullptr;
+    if ((format == load_format::psfc) || (format == load_format::psfc_current))
+    {
+        // When there's a config.psfc, config.json gets hashed to check that it's the config.psfc compiled from it
+        auto& config = g_compiledConfigs.emplace_back();
+        if (!config.load(psfc.data(), psfc.size(), compiled_config_hash(json.data(), json.size())))
+        {
+            throw std::runtime_error("Failed to load config.psfc");
+        }
+        compiled = &config;
+    }
+
+    bool succeeded;
+    if (format == load_format::json_current || format == load_format::psfc_current)
+    {
+        current_process_config_handler handler(document, currentExe, compiled);
+        if (compiled)
+        {
+            succeeded = compiled->replay(handler);
+        }
+        else
+        {
+            auto& buffer = g_jsonBuffers.emplace_back(json);
+            bounded_insitu_stream stream(buffer.data(), buffer.data() + buffer.size());
+            rapidjson::Reader reader;
+            succeeded = !reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseValidateEncodingFlag>(stream, handler).IsError();
+        }
+    }
+    else if (compiled)
+    {
+        succeeded = compiled->replay(document);
+    }
+    else
+    {
+        auto& buffer = g_jsonBuffers.emplace_back(json);
+        bounded_insitu_stream stream(buffer.data(), buffer.data() + buffer.size());
+        rapidjson::Reader reader;
+        succeeded = !reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseValidateEncodingFlag>(stream, document).IsError();
+    }
+
+    if (!succeeded || !document.root())
+    {
+        throw std::runtime_error("Failed to load the configuration: " + document.error_message());
+    }
+
+    // The full document gets its "processes" patterns compiled up front, and the current process's gets matched once
+    // more to find its entry, both the same as in Config.cpp
+    auto processesValue = document.root()->as_object().try_get("processes");
+    if ((format == load_format::json) || (format == load_format::psfc))
+    {
+        processes.clear();
+        for (auto& processConfig : processesValue->as_array())
+        {
+            auto& obj = processConfig.as_object();
+            psf::pattern_matcher matcher;
+            if (!compiled || !compiled->load_process_pattern(processes.size(), matcher))
+            {
+                matcher.assign(obj.get("executable").as_string().wstring());
+            }
+            processes.push_back(process_matcher{ std::move(matcher), &obj });
+        }
+    }
+    else
+    {
+        auto& entries = processesValue->as_array();
+        if ((entries.size() != 1) ||
+            !psf::pattern_matcher(entries.get_at(0).as_object().get("executable").as_string().wstring()).match(currentExe))
+        {
+            throw std::runtime_error("The current process's entry is missing from the configuration");
+        }
+    }
+
+    return document;
+}
+
+// PSFQueryExeConfig, without the cache of the names that it's been asked about, i.e. what the first lookup of each name
+// costs
+static const psf::json_object* query_exe_config(const std::vector<process_matcher>& processes, std::wstring_view executable)
+{
+    iwstring_view name(executable.data(), executable.length());
+    if ((name.length() >= 4) && (name.substr(name.length() - 4) == L".exe"_isv))
+    {
+        name.remove_suffix(4);
+    }
+
+    const std::wstring_view exeName(name.data(), name.length());
+    for (auto& entry : processes)
+    {
+        if (!entry.config)
+        {
+            break;
+        }
+        else if (entry.matcher.match(exeName))
+        {
+            return entry.config;
+        }
+    }
+
+    return nullptr;
+}
+
+static int run_child(const benchmark_options& options)
+{
+    auto currentExe = current_executable_name();
+    if (options.format == load_format::fixup)
+    {
+        InitializeBenchmarkRuntime(generate_fixup_config(matching_entry(options.processes, options.match), options.patterns));
+        InitializePaths();
+
+        auto startMemory = peak_private_bytes();
+        auto start = timestamp();
+        InitializeConfiguration();
+        auto end = timestamp();
+        // The fixup only initializes once per process, so there's no median
+        std::printf("%-16ls %12.3f %12s %12.1f %12s\n", L"fixup", elapsed_milliseconds(start, end), "-",
+            static_cast<double>(peak_private_bytes() - startMemory) / 1024, "-");
+        return 0;
+    }
+
+    std::filesystem::path directory = options.directory;
+    auto json = read_file<std::string>(directory / L"config.json");
+    std::vector<std::uint8_t> psfc;
+    if ((options.format == load_format::psfc) || (options.format == load_format::psfc_current))
+    {
+        psfc = read_file<std::vector<std::uint8_t>>(directory / L"config.psfc");
+    }
+
+    // The first load is the one that a process makes, with nothing warmed up yet, so it's reported on its own
+    std::vector<process_matcher> processes;
+    auto startMemory = peak_private_bytes();
+    auto start = timestamp();
+    load_document(options.format, json, psfc, currentExe, processes);
+    auto end = timestamp();
+    auto firstLoad = elapsed_milliseconds(start, end);
+    auto memory = static_cast<double>(peak_private_bytes() - startMemory) / 1024;
+
+    std::vector<double> loads;
+    for (std::uint32_t i = 0; i < options.iterations; ++i)
+    {
+        start = timestamp();
+        load_document(options.format, json, psfc, currentExe, processes);
+        loads.push_back(elapsed_milliseconds(start, timestamp()));
+    }
+    std::sort(loads.begin(), loads.end());
+
+    char queryNanoseconds[32] = "-";
+    if (!processes.empty())
+    {
+        // Every entry gets looked up by name, except for the current process's, and as many names get looked up that
+        // match no entry at all, which is the worst case
+        std::vector<std::wstring> names;
+        for (std::uint32_t i = 0; i < options.processes; ++i)
+        {
+            names.push_back(L"App" + std::to_wstring(i) + L".exe");
+            names.push_back(L"Other" + std::to_wstring(i) + L".exe");
+        }
+
+        std::size_t sink = 0;
+        start = timestamp();
+        for (std::uint64_t i = 0; i < options.queries; ++i)
+        {
+            sink += (query_exe_config(processes, names[i % names.size()]) != nullptr);
+        }
+        end = timestamp();
+        g_benchmarkSink += sink;
+
+        std::snprintf(queryNanoseconds, std::size(queryNanoseconds), "%.1f",
+            elapsed_milliseconds(start, end) * 1'000'000 / static_cast<double>(options.queries));
+    }
+
+    std::printf("%-16ls %12.3f %12.3f %12.1f %12s\n", std::find_if(std::begin(all_formats), std::end(all_formats),
+        [&](const format_info& info) { return info.format == options.format; })->name,
+        firstLoad, loads.empty() ? firstLoad : loads[loads.size() / 2], memory, queryNanoseconds);
+    return 0;
+}
+
+static void run_child_process(const std::wstring& commandLine)
+{
+    // The child writes its results to the same console or file, so anything buffered here has to go out first
+    std::fflush(stdout);
+
+    STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+    startupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.hStdInput = ::GetStdHandle(STD_INPUT_HANDLE);
+    startupInfo.hStdOutput = ::GetStdHandle(STD_OUTPUT_HANDLE);
+    startupInfo.hStdError = ::GetStdHandle(STD_ERROR_HANDLE);
+
+    auto mutableCommandLine = commandLine;
+    PROCESS_INFORMATION processInfo;
+    check_win32_bool(::CreateProcessW(nullptr, mutableCommandLine.data(), nullptr, nullptr, true, 0, nullptr, nullptr,
+        &startupInfo, &processInfo), "Failed to start a child process");
+    psf::unique_handle process(processInfo.hProcess);
+    psf::unique_handle thread(processInfo.hThread);
+
+    DWORD exitCode;
+    if ((::WaitForSingleObject(process.get(), INFINITE) != WAIT_OBJECT_0) || !::GetExitCodeProcess(process.get(), &exitCode))
+    {
+        throw_last_error("Failed to wait for a child process");
+    }
+    else if (exitCode != 0)
+    {
+        throw std::runtime_error("A child process failed with exit code " + std::to_string(exitCode));
+    }
+}
+
+static int run(const benchmark_options& options)
+{
+    wchar_t exePath[MAX_PATH + 1];
+    auto exePathLength = ::GetModuleFileNameW(nullptr, exePath, static_cast<DWORD>(std::size(exePath)));
+    if (!exePathLength || (exePathLength >= std::size(exePath)))
+    {
+        throw std::runtime_error("Failed to get the executable's path");
+    }
+
+    auto currentExe = current_executable_name();
+    auto scratchPath = std::filesystem::temp_directory_path() / L"PsfConfigLoadBenchmark";
+    std::printf("Iterations: %u, queries: %llu\n", options.iterations, static_cast<unsigned long long>(options.queries));
+
+    for (std::uint32_t step = 0; step < options.steps; ++step)
+    {
+        auto processes = (options.grow != grow_mode::patterns) ? (options.processes << step) : options.processes;
+        auto patterns = (options.grow != grow_mode::processes) ? (options.patterns << step) : options.patterns;
+
+        auto json = generate_config(processes, patterns, options.match, currentExe);
+        auto psfc = compile_config(json);
+        std::filesystem::create_directories(scratchPath);
+        write_file(scratchPath / L"config.json", json);
+        write_file(scratchPath / L"config.psfc", psfc);
+
+        std::printf("\nProcesses: %u, patterns per process: %u, config.json: %.1f KB, config.psfc: %.1f KB\n",
+            processes, patterns, static_cast<double>(json.size()) / 1024, static_cast<double>(psfc.size()) / 1024);
+        std::printf("%-16s %12s %12s %12s %12s\n", "Format", "first ms", "median ms", "peak KB", "query ns");
+
+        for (auto& info : all_formats)
+        {
+            std::wstring commandLine = L"\"" + std::wstring(exePath, exePathLength) + L"\" --child " + info.name +
+                L" --directory \"" + scratchPath.native() + L"\" --processes " + std::to_wstring(processes) +
+                L" --patterns " + std::to_wstring(patterns) + L" --match " +
+                ((options.match == match_position::first) ? L"first" : (options.match == match_position::middle) ? L"middle" : L"last") +
+                L" --iterations " + std::to_wstring(options.iterations) + L" --queries " + std::to_wstring(options.queries);
+            run_child_process(commandLine);
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(scratchPath, ec);
+    return 0;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+    benchmark_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    try
+    {
+        return options.child ? run_child(options) : run(options);
+    }
+    catch (std::exception& e)
+    {
+        std::printf("ERROR: %s\n", e.what());
+        return ERROR_UNHANDLED_EXCEPTION;
+    }
+}
@@ -0,0 +1,398 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Microbenchmarks for what a hooked call costs before a fixup does anything with it. MultiByteToWideChar gets detoured
+// the same ways that the MultiByteToWideCharTestFixup and CompositionTestFixup detour it - on their own, stacked, and as
+// handlers sharing a single detour - and for short strings that none of them fix up, so what's measured is Detours'
+// trampolines and psf_framework.h, and not the fixups. See readme.md for the options.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <exception>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+#include <detour_transaction.h>
+#include <psf_framework.h>
+
+#include "benchmark_harness.h"
+
+using MultiByteToWideChar_t = decltype(&::MultiByteToWideChar);
+using handler_context = psf::handler_context<MultiByteToWideChar_t>;
+
+struct benchmark_options
+{
+    std::uint32_t threads = (std::max)(std::thread::hardware_concurrency(), 1u);
+    std::uint64_t iterations = 10'000'000;
+    bool csv = false;
+};
+
+// The benchmark stands in for the PsfRuntime's thread state with a TLS slot of its own, so that the reentrancy guards
+// find it the same way that they do in a packaged process
+static const DWORD g_threadStateSlot = ::TlsAlloc();
+
+PSFAPI DWORD __stdcall PSFQueryThreadStateSlot() noexcept
+{
+    return g_threadStateSlot;
+}
+
+PSFAPI psf_thread_state* __stdcall PSFQueryThreadState() noexcept
+{
+    thread_local psf_thread_state state{};
+    if (g_threadStateSlot != TLS_OUT_OF_INDEXES)
+    {
+        ::TlsSetValue(g_threadStateSlot, &state);
+    }
+    return &state;
+}
+
+constexpr char expected_message[] = "This message should have been fixed";
+
+// Short enough that the conversion itself costs about as little as a call can, and never what the fixups fix up
+constexpr char benchmark_input[] = "Benchmark";
+constexpr int benchmark_input_length = static_cast<int>(std::size(benchmark_input) - 1);
+
+static bool is_expected_message(LPCCH multiByteStr, int multiByteLength) noexcept
+{
+    return (multiByteLength == static_cast<int>(std::size(expected_message) - 1)) &&
+        (std::strncmp(multiByteStr, expected_message, multiByteLength) == 0);
+}
+
+// What the MultiByteToWideCharTestFixup does: decides whether to fix up the call before passing it on
+template <typename Next>
+static int fix_message(Next&& next, UINT codePage, DWORD flags, LPCCH multiByteStr, int multiByteLength, LPWSTR wideCharStr, int wideCharLength)
+{
+    if (is_expected_message(multiByteStr, multiByteLength))
+    {
+        constexpr wchar_t fixedMessage[] = L"You've been fixed!";
+        constexpr int fixedLength = static_cast<int>(std::size(fixedMessage) - 1);
+        if (wideCharLength >= fixedLength)
+        {
+            std::wcsncpy(wideCharStr, fixedMessage, fixedLength);
+            return fixedLength;
+        }
+    }
+
+    return next(codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+}
+
+// What the CompositionTestFixup does: passes the call on first, and then decides whether to fix up its result
+template <typename Next>
+static int append_message(Next&& next, UINT codePage, DWORD flags, LPCCH multiByteStr, int multiByteLength, LPWSTR wideCharStr, int wideCharLength)
+{
+    auto result = next(codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+    if (is_expected_message(multiByteStr, multiByteLength) && (wideCharLength >= result))
+    {
+        constexpr wchar_t appendMessage[] = L" And you've been fixed again!";
+        constexpr int appendLength = static_cast<int>(std::size(appendMessage)) - 1;
+        if ((result + appendLength) <= wideCharLength)
+        {
+            std::wcsncpy(wideCharStr + result, appendMessage, appendLength);
+            result += appendLength;
+        }
+    }
+
+    return result;
+}
+
+// Each setup detours the function through pointers of its own, so that none of them depend on what the others left behind
+MultiByteToWideChar_t g_singleImpl = &::MultiByteToWideChar;
+MultiByteToWideChar_t g_stackedFixImpl = &::MultiByteToWideChar;
+MultiByteToWideChar_t g_stackedAppendImpl = &::MultiByteToWideChar;
+MultiByteToWideChar_t g_guardedFixImpl = &::MultiByteToWideChar;
+MultiByteToWideChar_t g_guardedAppendImpl = &::MultiByteToWideChar;
+MultiByteToWideChar_t g_fusedImpl = &::MultiByteToWideChar;
+
+// The guarded detours enter a reentrancy guard of their own the way that most of the real fixups do, and call straight
+// through if it's already entered
+template <MultiByteToWideChar_t& Impl, bool Guarded>
+int __stdcall FixMessageFixup(UINT codePage, DWORD flags, LPCCH multiByteStr, int multiByteLength, LPWSTR wideCharStr, int wideCharLength)
+{
+    if constexpr (Guarded)
+    {
+        static psf::reentrancy_guard reentrancyGuard;
+        auto guard = reentrancyGuard.enter();
+        if (!guard)
+        {
+            return Impl(codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+        }
+
+        return fix_message(Impl, codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+    }
+    else
+    {
+        return fix_message(Impl, codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+    }
+}
+
+template <MultiByteToWideChar_t& Impl, bool Guarded>
+int __stdcall AppendMessageFixup(UINT codePage, DWORD flags, LPCCH multiByteStr, int multiByteLength, LPWSTR wideCharStr, int wideCharLength)
+{
+    if constexpr (Guarded)
+    {
+        static psf::reentrancy_guard reentrancyGuard;
+        auto guard = reentrancyGuard.enter();
+        if (!guard)
+        {
+            return Impl(codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+        }
+
+        return append_message(Impl, codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+    }
+    else
+    {
+        return append_message(Impl, codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+    }
+}
+
+static int FixMessageHandler(const handler_context& context, UINT codePage, DWORD flags, LPCCH multiByteStr, int multiByteLength, LPWSTR wideCharStr, int wideCharLength)
+{
+    return fix_message([&](auto... args) { return context.next(args...); }, codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+}
+
+static int AppendMessageHandler(const handler_context& context, UINT codePage, DWORD flags, LPCCH multiByteStr, int multiByteLength, LPWSTR wideCharStr, int wideCharLength)
+{
+    return append_message([&](auto... args) { return context.next(args...); }, codePage, flags, multiByteStr, multiByteLength, wideCharStr, wideCharLength);
+}
+
+// Built the same way that PSFRegisterHandler builds it, with the handlers in the order that they get called
+static psf_handler_chain g_fusedChain{};
+
+struct detour_entry
+{
+    MultiByteToWideChar_t* impl;
+    void* fixup;
+};
+
+struct detour_setup
+{
+    const char* name;
+
+    // Attached one at a time and in order, the same as stacked fixups get attached by their own PSFRegisterBatch calls,
+    // so the last of them is the first to see each call
+    std::vector<detour_entry> detours;
+
+    // What the setup turns the expected message into, to make sure that the calls being measured really go through it
+    const wchar_t* expected_result;
+};
+
+static void attach(const detour_setup& setup)
+{
+    for (auto& entry : setup.detours)
+    {
+        auto transaction = detours::transaction();
+        check_win32(::DetourUpdateThread(::GetCurrentThread()));
+        check_win32(::DetourAttach(reinterpret_cast<void**>(entry.impl), entry.fixup));
+        transaction.commit();
+    }
+}
+
+static void detach(const detour_setup& setup)
+{
+    for (auto itr = setup.detours.rbegin(); itr != setup.detours.rend(); ++itr)
+    {
+        auto transaction = detours::transaction();
+        check_win32(::DetourUpdateThread(::GetCurrentThread()));
+        check_win32(::DetourDetach(reinterpret_cast<void**>(itr->impl), itr->fixup));
+        transaction.commit();
+    }
+}
+
+static bool verify(const detour_setup& setup)
+{
+    wchar_t buffer[128];
+    auto length = ::MultiByteToWideChar(CP_UTF8, 0, expected_message, static_cast<int>(std::size(expected_message) - 1), buffer, static_cast<int>(std::size(buffer)));
+    return std::wstring_view(buffer, (length > 0) ? static_cast<std::size_t>(length) : 0) == setup.expected_result;
+}
+
+// Returns the average time per call in nanoseconds, across all threads
+static double run_benchmark(const benchmark_options& options, std::uint32_t threadCount)
+{
+    benchmark_start_gate gate;
+    std::vector<std::int64_t> elapsed(threadCount);
+    auto worker = [&](std::uint32_t index)
+    {
+        wchar_t buffer[std::size(benchmark_input)];
+        std::size_t threadSink = 0;
+
+        // One call first so that the thread's state gets allocated before anything is measured
+        threadSink += ::MultiByteToWideChar(CP_UTF8, 0, benchmark_input, benchmark_input_length, buffer, static_cast<int>(std::size(buffer)));
+
+        gate.wait();
+        auto startTime = timestamp();
+        for (std::uint64_t i = 0; i < options.iterations; ++i)
+        {
+            threadSink += ::MultiByteToWideChar(CP_UTF8, 0, benchmark_input, benchmark_input_length, buffer, static_cast<int>(std::size(buffer)));
+        }
+        elapsed[index] = timestamp() - startTime;
+        g_benchmarkSink += threadSink;
+    };
+
+    std::vector<std::thread> threads;
+    for (std::uint32_t i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+
+    gate.release(threadCount);
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    double totalTime = 0;
+    for (auto time : elapsed)
+    {
+        totalTime += static_cast<double>(time);
+    }
+
+    auto totalCalls = static_cast<double>(options.iterations) * threadCount;
+    return totalTime * 1'000'000'000 / timestamp_frequency() / totalCalls;
+}
+
+static void print_usage()
+{
+    std::printf(
+        "Usage: DetourOverheadBenchmark [options]\n"
+        "  --threads <n>       Largest number of threads to call the function at once (default: one per processor)\n"
+        "  --iterations <n>    Calls per thread for each setup (default 10000000)\n"
+        "  --csv               Print the results as comma separated values\n");
+}
+
+static bool parse_options(int argc, wchar_t** argv, benchmark_options& options)
+{
+    return parse_benchmark_arguments(argc, argv, { L"--csv" }, [&](std::wstring_view arg, const wchar_t* value)
+    {
+        if (arg == L"--csv")
+        {
+            options.csv = true;
+            return true;
+        }
+        else if (arg == L"--threads")
+        {
+            return parse_count(value, options.threads);
+        }
+        else if (arg == L"--iterations")
+        {
+            return parse_count(value, options.iterations);
+        }
+
+        return false;
+    });
+}
+
+static int run(const benchmark_options& options)
+{
+    psf::details::handler_chain_v<g_fusedImpl> = &g_fusedChain;
+    g_fusedChain.handlers[0] = reinterpret_cast<void*>(&AppendMessageHandler);
+    g_fusedChain.handlers[1] = reinterpret_cast<void*>(&FixMessageHandler);
+
+    const std::vector<detour_setup> setups = {
+        { "No detour", {}, L"This message should have been fixed" },
+        { "Single detour", {
+            { &g_singleImpl, reinterpret_cast<void*>(&FixMessageFixup<g_singleImpl, false>) } },
+            L"You've been fixed!" },
+        { "Stacked detours", {
+            { &g_stackedFixImpl, reinterpret_cast<void*>(&FixMessageFixup<g_stackedFixImpl, false>) },
+            { &g_stackedAppendImpl, reinterpret_cast<void*>(&AppendMessageFixup<g_stackedAppendImpl, false>) } },
+            L"You've been fixed! And you've been fixed again!" },
+        { "Stacked detours with guards", {
+            { &g_guardedFixImpl, reinterpret_cast<void*>(&FixMessageFixup<g_guardedFixImpl, true>) },
+            { &g_guardedAppendImpl, reinterpret_cast<void*>(&AppendMessageFixup<g_guardedAppendImpl, true>) } },
+            L"You've been fixed! And you've been fixed again!" },
+        { "Fused handlers", {
+            { &g_fusedImpl, reinterpret_cast<void*>(&handler_context::dispatch<g_fusedImpl>) } },
+            L"You've been fixed! And you've been fixed again!" },
+    };
+
+    // 1, 2, 4, ... threads, and then the number asked for if that's not a power of two
+    std::vector<std::uint32_t> threadCounts;
+    for (std::uint32_t count = 1; count < options.threads; count *= 2)
+    {
+        threadCounts.push_back(count);
+    }
+    threadCounts.push_back(options.threads);
+
+    // Threads are the outer loop of the results, but each setup only gets attached once, and only while none of the
+    // benchmark's threads are running, so that Detours never needs to move one of them out of the code it's patching
+    std::vector<std::vector<double>> results(setups.size());
+    for (std::size_t i = 0; i < setups.size(); ++i)
+    {
+        attach(setups[i]);
+        if (!verify(setups[i]))
+        {
+            detach(setups[i]);
+            std::printf("ERROR: Calls don't go through the detours for \"%s\"\n", setups[i].name);
+            return ERROR_ASSERTION_FAILURE;
+        }
+
+        for (auto threadCount : threadCounts)
+        {
+            results[i].push_back(run_benchmark(options, threadCount));
+        }
+        detach(setups[i]);
+    }
+
+    if (options.csv)
+    {
+        std::printf("threads,setup,ns_per_call,overhead_ns\n");
+    }
+    else
+    {
+        std::printf("Iterations: %llu\n", static_cast<unsigned long long>(options.iterations));
+    }
+
+    for (std::size_t t = 0; t < threadCounts.size(); ++t)
+    {
+        if (!options.csv)
+        {
+            std::printf("\nThreads: %u\n%-36s %12s %12s\n", threadCounts[t], "Setup", "ns/call", "overhead");
+        }
+
+        // The overhead is relative to calling the function without any detours
+        auto baseline = results[0][t];
+        for (std::size_t i = 0; i < setups.size(); ++i)
+        {
+            if (options.csv)
+            {
+                std::printf("%u,%s,%.2f,%.2f\n", threadCounts[t], setups[i].name, results[i][t], results[i][t] - baseline);
+            }
+            else
+            {
+                std::printf("%-36s %12.2f %12.2f\n", setups[i].name, results[i][t], results[i][t] - baseline);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+    benchmark_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    try
+    {
+        return run(options);
+    }
+    catch (std::exception& e)
+    {
+        std::printf("ERROR: %s\n", e.what());
+        return ERROR_UNHANDLED_EXCEPTION;
+    }
+}
@@ -0,0 +1,467 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Launches the LaunchTest scenario's entry points over and over, and reports percentiles of when each phase of their
+// launch happened, from PsfLauncher's process getting created to the application's first window. The application works
+// out the times itself (see launch_timings.h), since most of them happen in processes that only exist for a moment.
+// Between cold launches, the standby list gets purged, so that the binaries get read from disk again. That takes the
+// "profile single process" privilege, which only elevated processes have. See readme.md for usage
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <windows.h>
+#include <winternl.h>
+#include <ShObjIdl.h>
+#include <wrl/client.h>
+#include <win32_error.h>
+
+#include <launch_timings.h>
+#include <test_runner.h>
+
+using namespace std::literals;
+using namespace Microsoft::WRL;
+
+// The LaunchTest entry points, from the least to the most that happens before the application's entry point
+static constexpr const wchar_t* g_defaultApplications[] =
+{
+    L"LaunchTest_8wekyb3d8bbwe!Direct",
+    L"LaunchTest_8wekyb3d8bbwe!NoFixups",
+    L"LaunchTest_8wekyb3d8bbwe!Fixed",
+    L"LaunchTest_8wekyb3d8bbwe!Traced",
+};
+
+// Long enough for a cold launch on a slow disk
+constexpr DWORD launch_timeout_milliseconds = 60 * 1000;
+
+constexpr auto phase_count = static_cast<std::size_t>(launch_phase::count);
+
+enum class launch_mode
+{
+    cold,
+    warm,
+};
+
+struct launch_options
+{
+    std::vector<std::wstring> applications;
+    int runs = 20;
+    bool cold = true;
+    bool warm = true;
+    std::filesystem::path csv;
+};
+
+// Milliseconds since the activation started, or nothing if the phase didn't happen
+using launch_run = std::array<std::optional<double>, phase_count>;
+
+struct launch_results
+{
+    std::wstring application;
+    launch_mode mode;
+    std::vector<launch_run> runs;
+};
+
+static const wchar_t* launch_mode_name(launch_mode mode)
+{
+    return (mode == launch_mode::cold) ? L"Cold" : L"Warm";
+}
+
+// SystemMemoryListInformation and the commands it takes, which winternl.h doesn't have
+constexpr auto system_memory_list_information = static_cast<SYSTEM_INFORMATION_CLASS>(80);
+constexpr int memory_flush_modified_list = 3;
+constexpr int memory_purge_standby_list = 4;
+
+using NtSetSystemInformationProc = NTSTATUS(NTAPI*)(SYSTEM_INFORMATION_CLASS, PVOID, ULONG);
+
+static bool enable_profile_privilege()
+{
+    HANDLE tokenHandle;
+    if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &tokenHandle))
+    {
+        return false;
+    }
+    unique_handle token(tokenHandle);
+
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    if (!::LookupPrivilegeValueW(nullptr, SE_PROF_SINGLE_PROCESS_NAME, &privileges.Privileges[0].Luid))
+    {
+        return false;
+    }
+
+    // NOTE: Succeeds without enabling anything when the token doesn't have the privilege, which only the last error says
+    return ::AdjustTokenPrivileges(token.get(), false, &privileges, sizeof(privileges), nullptr, nullptr) &&
+        (::GetLastError() == ERROR_SUCCESS);
+}
+
+// Writes out the modified pages, then drops everything on the standby list, i.e. the file contents that the system keeps
+// cached, so that the next launch reads the binaries from disk
+static void purge_standby_list()
+{
+    static auto setSystemInformation = reinterpret_cast<NtSetSystemInformationProc>(
+        ::GetProcAddress(::GetModuleHandleW(L"ntdll.dll"), "NtSetSystemInformation"));
+    if (!setSystemInformation)
+    {
+        throw_last_error("Failed to find NtSetSystemInformation");
+    }
+
+    for (auto command : { memory_flush_modified_list, memory_purge_standby_list })
+    {
+        if (auto status = setSystemInformation(system_memory_list_information, &command, sizeof(command)); !NT_SUCCESS(status))
+        {
+            std::ostringstream message;
+            message << "Failed to purge the standby list (NTSTATUS 0x" << std::hex << static_cast<std::uint32_t>(status) << ")";
+            throw std::runtime_error(message.str());
+        }
+    }
+}
+
+static std::int64_t query_performance_counter() noexcept
+{
+    LARGE_INTEGER value;
+    ::QueryPerformanceCounter(&value);
+    return value.QuadPart;
+}
+
+class launch_driver
+{
+public:
+
+    launch_driver()
+    {
+        m_section.reset(::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(launch_timings), launch_timings_section_name));
+        if (!m_section)
+        {
+            throw_last_error("Failed to create the launch timings section");
+        }
+
+        m_view = static_cast<launch_timings*>(::MapViewOfFile(m_section.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(launch_timings)));
+        if (!m_view)
+        {
+            throw_last_error("Failed to map the launch timings section");
+        }
+
+        m_readyEvent.reset(::CreateEventW(nullptr, false, false, launch_timings_event_name));
+        if (!m_readyEvent)
+        {
+            throw_last_error("Failed to create the launch timings event");
+        }
+
+        auto hr = ::CoCreateInstance(CLSID_ApplicationActivationManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&m_activationManager));
+        if (FAILED(hr))
+        {
+            throw_win32(hr, "Failed to activate ApplicationActivationManager");
+        }
+
+        ::QueryPerformanceFrequency(&m_frequency);
+    }
+
+    ~launch_driver()
+    {
+        ::UnmapViewOfFile(m_view);
+    }
+
+    // Launches the application and waits for it to exit, so that launches never overlap
+    launch_run launch(const std::wstring& aumid)
+    {
+        *m_view = {};
+        ::ResetEvent(m_readyEvent.get());
+
+        DWORD pid;
+        auto start = query_performance_counter();
+        auto hr = m_activationManager->ActivateApplication(aumid.c_str(), nullptr, AO_NONE, &pid);
+        if (FAILED(hr))
+        {
+            throw_win32(hr, "Failed to activate the application");
+        }
+
+        // NOTE: This is PsfLauncher, unless the application was launched directly. Either way, it's the last of the
+        //       launch's processes to exit
+        unique_handle process(::OpenProcess(SYNCHRONIZE, false, pid));
+        HANDLE handles[] = { m_readyEvent.get(), process.get() };
+        auto waitResult = ::WaitForMultipleObjects(process ? 2 : 1, handles, false, launch_timeout_milliseconds);
+        if (waitResult != WAIT_OBJECT_0)
+        {
+            throw std::runtime_error("The application exited or timed out without reporting its launch timings");
+        }
+
+        if (process && (::WaitForSingleObject(process.get(), launch_timeout_milliseconds) != WAIT_OBJECT_0))
+        {
+            throw std::runtime_error("The application didn't exit after reporting its launch timings");
+        }
+
+        launch_run result;
+        for (std::size_t i = 0; i < phase_count; ++i)
+        {
+            if (auto time = m_view->phases[i])
+            {
+                result[i] = static_cast<double>(time - start) * 1000.0 / m_frequency.QuadPart;
+            }
+        }
+
+        return result;
+    }
+
+private:
+
+    unique_handle m_section;
+    launch_timings* m_view = nullptr;
+    unique_handle m_readyEvent;
+    ComPtr<IApplicationActivationManager> m_activationManager;
+    LARGE_INTEGER m_frequency;
+};
+
+// Nearest rank, i.e. the smallest value that at least 'fraction' of the values are less than or equal to
+static double percentile(const std::vector<double>& sortedValues, double fraction)
+{
+    auto rank = static_cast<std::size_t>(std::ceil(fraction * sortedValues.size()));
+    return sortedValues[(std::max<std::size_t>)(rank, 1) - 1];
+}
+
+static void write_value(double value)
+{
+    std::wcout << std::setw(10) << value;
+}
+
+static void report(const launch_results& results)
+{
+    std::wcout << L"\n" << results.application << L" (" << launch_mode_name(results.mode) << L", " << results.runs.size() << L" runs)\n";
+    std::wcout << std::left << std::setw(26) << L"Phase" << std::right << std::setw(10) << L"Runs" << std::setw(10) << L"Min" <<
+        std::setw(10) << L"P50" << std::setw(10) << L"P90" << std::setw(10) << L"P99" << std::setw(10) << L"Max" <<
+        std::setw(12) << L"Step P50" << L"\n";
+
+    std::wcout << std::fixed << std::setprecision(2);
+    for (std::size_t i = 0; i < phase_count; ++i)
+    {
+        // The step is the time since the previous phase that the run has, i.e. how long this phase took
+        std::vector<double> offsets;
+        std::vector<double> steps;
+        for (auto& run : results.runs)
+        {
+            if (!run[i])
+            {
+                continue;
+            }
+
+            offsets.push_back(*run[i]);
+            auto previous = 0.0;
+            for (std::size_t j = i; j-- > 0; )
+            {
+                if (run[j])
+                {
+                    previous = *run[j];
+                    break;
+                }
+            }
+            steps.push_back(*run[i] - previous);
+        }
+
+        if (offsets.empty())
+        {
+            continue;
+        }
+
+        std::sort(offsets.begin(), offsets.end());
+        std::sort(steps.begin(), steps.end());
+        std::wcout << std::left << std::setw(26) << launch_phase_name(static_cast<launch_phase>(i)) << std::right <<
+            std::setw(10) << offsets.size();
+        write_value(offsets.front());
+        write_value(percentile(offsets, 0.5));
+        write_value(percentile(offsets, 0.9));
+        write_value(percentile(offsets, 0.99));
+        write_value(offsets.back());
+        std::wcout << std::setw(12) << percentile(steps, 0.5) << L"\n";
+    }
+}
+
+static void write_csv(const std::filesystem::path& path, const std::vector<launch_results>& allResults)
+{
+    std::wofstream csv(path);
+    if (!csv)
+    {
+        throw std::runtime_error("Unable to create " + path.string());
+    }
+
+    csv << L"application,mode,run";
+    for (std::size_t i = 0; i < phase_count; ++i)
+    {
+        csv << L"," << launch_phase_name(static_cast<launch_phase>(i));
+    }
+    csv << L"\n";
+
+    csv << std::fixed << std::setprecision(3);
+    for (auto& results : allResults)
+    {
+        for (std::size_t run = 0; run < results.runs.size(); ++run)
+        {
+            csv << results.application << L"," << launch_mode_name(results.mode) << L"," << run;
+            for (auto& time : results.runs[run])
+            {
+                csv << L",";
+                if (time)
+                {
+                    csv << *time;
+                }
+            }
+            csv << L"\n";
+        }
+    }
+}
+
+static void print_usage(const wchar_t* exe)
+{
+    std::wcerr << L"Usage: " << std::filesystem::path(exe).filename().native() << L" [options] [application user model id...]\n";
+    std::wcerr << L"Launches packaged applications over and over, and reports when each phase of their launch happened\n";
+    std::wcerr << L"    --runs <n>               Launch each application n times for each mode (default: 20)\n";
+    std::wcerr << L"    --mode cold|warm|both    Purge the standby list before each launch, or not (default: both)\n";
+    std::wcerr << L"    --csv <file>             Also write every launch's times to a file\n";
+}
+
+static bool parse_arguments(int argc, const wchar_t** argv, launch_options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::wstring_view arg = argv[i];
+        auto next = [&]() -> const wchar_t*
+        {
+            return (i + 1 < argc) ? argv[++i] : nullptr;
+        };
+
+        if (arg == L"--runs")
+        {
+            auto value = next();
+            options.runs = value ? std::wcstol(value, nullptr, 10) : 0;
+            if (options.runs <= 0)
+            {
+                return false;
+            }
+        }
+        else if (arg == L"--mode")
+        {
+            auto value = next();
+            if (!value || ((value != L"cold"sv) && (value != L"warm"sv) && (value != L"both"sv)))
+            {
+                return false;
+            }
+            options.cold = (value != L"warm"sv);
+            options.warm = (value != L"cold"sv);
+        }
+        else if (arg == L"--csv")
+        {
+            auto value = next();
+            if (!value)
+            {
+                return false;
+            }
+            options.csv = value;
+        }
+        else if (arg.substr(0, 2) == L"--"sv)
+        {
+            return false;
+        }
+        else
+        {
+            options.applications.emplace_back(arg);
+        }
+    }
+
+    if (options.applications.empty())
+    {
+        options.applications.assign(std::begin(g_defaultApplications), std::end(g_defaultApplications));
+    }
+
+    return true;
+}
+
+int wmain(int argc, const wchar_t** argv) try
+{
+    launch_options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (options.cold && !enable_profile_privilege())
+    {
+        std::wcerr << L"WARNING: Purging the standby list takes an elevated process; skipping cold launches\n";
+        options.cold = false;
+    }
+
+    if (!options.cold && !options.warm)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    if (auto hr = ::CoInitializeEx(nullptr, COINIT_MULTITHREADED); FAILED(hr))
+    {
+        throw_win32(hr, "COM Initialization failed");
+    }
+
+    launch_driver driver;
+    std::vector<launch_results> allResults;
+    for (auto& aumid : options.applications)
+    {
+        for (auto mode : { launch_mode::warm, launch_mode::cold })
+        {
+            if (((mode == launch_mode::cold) && !options.cold) || ((mode == launch_mode::warm) && !options.warm))
+            {
+                continue;
+            }
+
+            std::wcout << L"Launching " << aumid << L" (" << launch_mode_name(mode) << L")\n";
+            auto& results = allResults.emplace_back();
+            results.application = aumid;
+            results.mode = mode;
+
+            // One untimed launch first, so that the first warm launch isn't a cold one
+            if (mode == launch_mode::warm)
+            {
+                driver.launch(aumid);
+            }
+
+            for (int run = 0; run < options.runs; ++run)
+            {
+                if (mode == launch_mode::cold)
+                {
+                    purge_standby_list();
+                }
+
+                results.runs.push_back(driver.launch(aumid));
+            }
+        }
+    }
+
+    for (auto& results : allResults)
+    {
+        report(results);
+    }
+
+    if (!options.csv.empty())
+    {
+        write_csv(options.csv, allResults);
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (std::exception& e)
+{
+    std::wcout.flush();
+    std::cerr << "ERROR: " << e.what() << "\n";
+    return win32_from_caught_exception();
+}
@@ -0,0 +1,414 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Microbenchmarks for the File Redirection Fixup's path redirection. The fixup's sources are linked in directly - none
+// of its functions get detoured - so that each step of ShouldRedirect can be measured on its own, without packaging or
+// any of the disk access that the fixups themselves do. See readme.md for the options.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cwchar>
+#include <exception>
+#include <fstream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+#include <dos_paths.h>
+#include <psf_runtime.h>
+#include <utilities.h>
+
+#include "PathRedirection.h"
+#include "benchmark_harness.h"
+
+// Both live in the fixup, which would normally call them from its DllMain and PSFInitialize
+void InitializePaths();
+void InitializeConfiguration();
+
+constexpr std::uint32_t patterns_per_group = 10;
+
+struct benchmark_options
+{
+    std::uint32_t patterns = 100;
+    std::uint32_t depth = 4;
+    double hit_ratio = 0.1;
+    std::uint32_t threads = 1;
+    std::uint32_t paths = 1000;
+    std::uint64_t iterations = 1'000'000;
+    std::wstring config_path;
+    bool dump_config = false;
+};
+
+struct benchmark_path
+{
+    std::wstring wide;
+    std::string ansi;
+};
+
+struct benchmark_result
+{
+    double ns_per_op;
+    double allocations_per_op;
+};
+
+// Counts every allocation made by the thread, which is all that the benchmarked functions do with the heap
+thread_local std::uint64_t t_allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    ++t_allocations;
+    if (auto ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static void print_usage()
+{
+    std::printf(
+        "Usage: PathRedirectionBenchmark [options]\n"
+        "  --patterns <n>      Number of generated redirection patterns (default 100)\n"
+        "  --depth <n>         Directories between a pattern's base directory and the file (default 4)\n"
+        "  --hit-ratio <r>     Fraction of paths, from 0 to 1, that match a pattern (default 0.1)\n"
+        "  --paths <n>         Number of distinct paths to cycle through (default 1000)\n"
+        "  --threads <n>       Number of threads running each benchmark at once (default 1)\n"
+        "  --iterations <n>    Calls per thread for each benchmark (default 1000000)\n"
+        "  --config <file>     Use the fixup configuration in the UTF-8 encoded file instead of generating one\n"
+        "  --dump-config       Print the generated fixup configuration and exit\n");
+}
+
+static bool parse_options(int argc, wchar_t** argv, benchmark_options& options)
+{
+    return parse_benchmark_arguments(argc, argv, { L"--dump-config" }, [&](std::wstring_view arg, const wchar_t* value)
+    {
+        if (arg == L"--dump-config")
+        {
+            options.dump_config = true;
+            return true;
+        }
+        else if (arg == L"--config")
+        {
+            options.config_path = value;
+            return true;
+        }
+        else if (arg == L"--hit-ratio")
+        {
+            wchar_t* end;
+            options.hit_ratio = std::wcstod(value, &end);
+            return (*end == L'\0') && (options.hit_ratio >= 0) && (options.hit_ratio <= 1);
+        }
+        else if (arg == L"--iterations")
+        {
+            return parse_count(value, options.iterations);
+        }
+        else if (arg == L"--patterns")
+        {
+            return parse_count(value, options.patterns);
+        }
+        else if (arg == L"--depth")
+        {
+            return parse_count(value, options.depth);
+        }
+        else if (arg == L"--paths")
+        {
+            return parse_count(value, options.paths);
+        }
+        else if (arg == L"--threads")
+        {
+            return parse_count(value, options.threads);
+        }
+
+        return false;
+    });
+}
+
+// Patterns are grouped ten to a base directory, which is roughly the shape of real configurations: a few directories,
+// each with a handful of patterns. Pattern N matches files named "fileN_<digits>.dat" at any depth under its base
+static std::string generate_config(const benchmark_options& options)
+{
+    std::string result = R"({"redirectedPaths":{"packageRelative":[)";
+    for (std::uint32_t group = 0; group * patterns_per_group < options.patterns; ++group)
+    {
+        if (group != 0)
+        {
+            result += ',';
+        }
+
+        result += R"({"base":"bench\\group)" + std::to_string(group) + R"(","patterns":[)";
+        auto end = (std::min)(options.patterns, (group + 1) * patterns_per_group);
+        for (auto i = group * patterns_per_group; i < end; ++i)
+        {
+            if (i != group * patterns_per_group)
+            {
+                result += ',';
+            }
+            result += R"("(.*\\\\)?file)" + std::to_string(i) + R"(_[0-9]+\\.dat")";
+        }
+        result += "]}";
+    }
+    result += "]}}";
+    return result;
+}
+
+static std::string read_config(const std::wstring& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open configuration file");
+    }
+
+    std::stringstream stream;
+    stream << file.rdbuf();
+    auto result = stream.str();
+    if (result.compare(0, 3, "\xEF\xBB\xBF") == 0)
+    {
+        result.erase(0, 3);
+    }
+    return result;
+}
+
+// Paths that miss differ from the ones that hit only by their extension, so they get as far through the matching as
+// possible before failing, which is the worst case for misses
+static std::vector<benchmark_path> generate_paths(const benchmark_options& options, const std::wstring& root)
+{
+    std::vector<benchmark_path> result;
+    for (std::uint32_t i = 0; i < options.paths; ++i)
+    {
+        auto pattern = i % options.patterns;
+        auto hit = static_cast<std::uint64_t>((i + 1) * options.hit_ratio) > static_cast<std::uint64_t>(i * options.hit_ratio);
+
+        auto path = root + LR"(\bench\group)" + std::to_wstring(pattern / patterns_per_group);
+        for (std::uint32_t level = 0; level < options.depth; ++level)
+        {
+            path += LR"(\dir)" + std::to_wstring(level);
+        }
+        path += LR"(\file)" + std::to_wstring(pattern) + L'_' + std::to_wstring(i) + (hit ? L".dat" : L".txt");
+
+        // The paths are all ASCII, so the conversion is lossless for any code page
+        result.push_back(benchmark_path{ path, narrow(path, CP_ACP) });
+    }
+
+    // Mix the hits and misses together so that the branches aren't trivially predictable
+    std::shuffle(result.begin(), result.end(), std::mt19937(42));
+    return result;
+}
+
+template <typename Func>
+static benchmark_result run_benchmark(const benchmark_options& options, std::size_t count, Func&& func)
+{
+    // One pass over the inputs first so that one-time work (e.g. lazily initialized state) doesn't get measured
+    std::size_t sink = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        sink += func(i);
+    }
+    g_benchmarkSink += sink;
+
+    benchmark_start_gate gate;
+    std::vector<std::int64_t> elapsed(options.threads);
+    std::vector<std::uint64_t> allocations(options.threads);
+    auto worker = [&](std::uint32_t index)
+    {
+        gate.wait();
+
+        // Threads start at different points in the inputs so that they aren't all working on the same path at once
+        auto pos = (count / options.threads) * index;
+        std::size_t threadSink = 0;
+        auto startAllocations = t_allocations;
+        auto startTime = timestamp();
+        for (std::uint64_t i = 0; i < options.iterations; ++i)
+        {
+            threadSink += func(pos);
+            if (++pos == count)
+            {
+                pos = 0;
+            }
+        }
+        elapsed[index] = timestamp() - startTime;
+        allocations[index] = t_allocations - startAllocations;
+        g_benchmarkSink += threadSink;
+    };
+
+    std::vector<std::thread> threads;
+    for (std::uint32_t i = 0; i < options.threads; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+
+    gate.release(options.threads);
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    double totalTime = 0;
+    double totalAllocations = 0;
+    for (std::uint32_t i = 0; i < options.threads; ++i)
+    {
+        totalTime += static_cast<double>(elapsed[i]);
+        totalAllocations += static_cast<double>(allocations[i]);
+    }
+
+    auto totalOps = static_cast<double>(options.iterations) * options.threads;
+    return benchmark_result{
+        totalTime * 1'000'000'000 / timestamp_frequency() / totalOps,
+        totalAllocations / totalOps
+    };
+}
+
+static void print_result(const char* name, const benchmark_result& result)
+{
+    std::printf("%-36s %12.1f %12.2f\n", name, result.ns_per_op, result.allocations_per_op);
+}
+
+static int run(const benchmark_options& options)
+{
+    auto config = options.config_path.empty() ? generate_config(options) : read_config(options.config_path);
+    if (options.dump_config)
+    {
+        std::printf("%s\n", config.c_str());
+        return 0;
+    }
+
+    InitializeBenchmarkRuntime(config);
+    InitializePaths();
+    InitializeConfiguration();
+
+    std::wstring root = ::PSFQueryPackageRootPath();
+    auto paths = generate_paths(options, root);
+
+    // NormalizePath only falls back to GetFullPathName for unusual paths, so make sure that what it does on its own agrees
+    for (auto& path : paths)
+    {
+        if (std::wstring_view(NormalizePath(path.wide.c_str()).full_path) != psf::full_path(path.wide.c_str()))
+        {
+            std::printf("ERROR: NormalizePath and GetFullPathName disagree on %ls\n", path.wide.c_str());
+            return ERROR_ASSERTION_FAILURE;
+        }
+    }
+
+    // The same paths, only under the package's VFS folder, so that de-virtualization has something to do
+#if _M_IX86
+    auto vfsRoot = root + LR"(\VFS\ProgramFilesX86)";
+#else
+    auto vfsRoot = root + LR"(\VFS\ProgramFilesX64)";
+#endif
+    std::vector<normalized_path> vfsPaths;
+    std::vector<normalized_path> deVirtualizedPaths;
+    std::size_t hits = 0;
+    for (auto& path : paths)
+    {
+        vfsPaths.push_back(NormalizePath((vfsRoot + path.wide.substr(root.length())).c_str()));
+        deVirtualizedPaths.push_back(DeVirtualizePath(NormalizePath(path.wide.c_str())));
+        if (PathMatchesRedirectionSpec(deVirtualizedPaths.back().drive_absolute_path))
+        {
+            ++hits;
+        }
+    }
+
+    std::printf("Paths: %u (%.1f%% redirected), depth: %u, threads: %u, iterations: %llu\n\n",
+        options.paths,
+        static_cast<double>(hits) * 100 / static_cast<double>(paths.size()),
+        options.depth,
+        options.threads,
+        static_cast<unsigned long long>(options.iterations));
+    std::printf("%-36s %12s %12s\n", "Benchmark", "ns/op", "allocs/op");
+
+    print_result("NormalizePath (wide)", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return NormalizePath(paths[i].wide.c_str()).full_path.length();
+    }));
+
+    print_result("NormalizePath (ANSI)", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return NormalizePath(paths[i].ansi.c_str()).full_path.length();
+    }));
+
+    print_result("DeVirtualizePath", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return DeVirtualizePath(vfsPaths[i]).full_path.length();
+    }));
+
+    print_result("PathMatchesRedirectionSpec", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return static_cast<std::size_t>(PathMatchesRedirectionSpec(deVirtualizedPaths[i].drive_absolute_path));
+    }));
+
+    print_result("RedirectedPath", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return RedirectedPath(deVirtualizedPaths[i]).length();
+    }));
+
+    auto cacheBefore = RedirectCacheStatistics();
+    print_result("ShouldRedirect (wide)", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return static_cast<std::size_t>(ShouldRedirect(paths[i].wide.c_str(), redirect_flags::none).should_redirect);
+    }));
+
+    print_result("ShouldRedirect (ANSI)", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        return static_cast<std::size_t>(ShouldRedirect(paths[i].ansi.c_str(), redirect_flags::none).should_redirect);
+    }));
+
+    // More distinct paths than the redirect cache holds means that ShouldRedirect has to match most of them again
+    auto cacheAfter = RedirectCacheStatistics();
+    auto cacheHits = cacheAfter.hits - cacheBefore.hits;
+    auto cacheLookups = cacheHits + (cacheAfter.misses - cacheBefore.misses);
+
+    // Calls answered by the thread's memo never get as far as the redirect cache, so this comes after the hit rate
+    print_result("ShouldRedirect (same path)", run_benchmark(options, paths.size(), [&](std::size_t i)
+    {
+        std::size_t result = 0;
+        for (int call = 0; call < 3; ++call)
+        {
+            result += static_cast<std::size_t>(ShouldRedirect(paths[i].wide.c_str(), redirect_flags::none).should_redirect);
+        }
+        return result;
+    }));
+
+    std::printf("\nShouldRedirect cache hit rate: %.1f%%\n", cacheLookups ? (static_cast<double>(cacheHits) * 100 / static_cast<double>(cacheLookups)) : 0.0);
+    return 0;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+    benchmark_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    try
+    {
+        return run(options);
+    }
+    catch (std::exception& e)
+    {
+        std::printf("ERROR: %s\n", e.what());
+        return ERROR_UNHANDLED_EXCEPTION;
+    }
+}
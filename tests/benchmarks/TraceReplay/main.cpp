@@ -0,0 +1,793 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Replays the file and registry calls in a trace file from the TraceFixup's "raw" or "file" trace method, so that the
+// cost of a set of fixups can be measured against what a real application actually did, without the application. The
+// replay makes the same calls, with the same arguments, through the same exports, so run inside a package with
+// PsfLauncher and a config.json, they go through whatever fixups that configures. See readme.md for usage
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+#include <winternl.h>
+#include <win32_error.h>
+
+#include "..\..\fixups\TraceDecoder\TraceReader.h"
+
+using namespace std::literals;
+
+struct replay_options
+{
+    std::filesystem::path trace;
+    bool original_threads = false;
+    bool original_timing = false;
+    bool allow_writes = false;
+    int repeat = 1;
+    std::filesystem::path csv;
+    std::filesystem::path baseline;
+};
+
+struct api_stats
+{
+    std::uint64_t calls = 0;
+    std::uint64_t skipped = 0; // Would have modified something and --allow-writes wasn't given
+    std::uint64_t unresolved = 0; // Used a handle that the replay doesn't have
+    std::uint64_t mismatched = 0; // Succeeded where the recorded call failed, or the other way around
+    double recorded_us = 0; // Totals over the replayed calls
+    double replayed_us = 0;
+};
+
+using replay_stats = std::map<std::string, api_stats>;
+
+enum class replay_result
+{
+    replayed,
+    skipped,
+    unresolved,
+};
+
+struct replay_outcome
+{
+    replay_result result = replay_result::replayed;
+    bool failed = false;
+    std::int64_t ticks = 0;
+};
+
+static const trace_value* find_value(const trace_record& record, std::string_view name)
+{
+    auto itr = std::find_if(record.values.begin(), record.values.end(), [&](auto& value) { return value.name == name; });
+    return (itr == record.values.end()) ? nullptr : &*itr;
+}
+
+static std::uint64_t number_value(const trace_record& record, std::string_view name, std::uint64_t defaultValue = 0)
+{
+    auto value = find_value(record, name);
+    return value ? value->number() : defaultValue;
+}
+
+static bool is_wide(const trace_value* value)
+{
+    return value && (value->header->kind == raw_trace::value_kind::wide_string);
+}
+
+static std::string narrow_value(const trace_value& value)
+{
+    return std::string(reinterpret_cast<const char*>(value.payload), value.header->length);
+}
+
+static std::wstring wide_value(const trace_value& value)
+{
+    if (value.header->kind != raw_trace::value_kind::wide_string)
+    {
+        return widen(narrow_value(value), CP_ACP);
+    }
+    return std::wstring(reinterpret_cast<const wchar_t*>(value.payload), value.header->length / sizeof(wchar_t));
+}
+
+// Keys that RegOpenKeyEx and friends take without anyone having opened them. These are the same in every process
+static bool is_predefined_key(std::uint64_t value)
+{
+    auto low = static_cast<std::uint32_t>(value);
+    return (((value >> 32) == 0) || ((value >> 32) == 0xFFFFFFFF)) && (low >= 0x80000000) && (low <= 0x80000007);
+}
+
+// Maps the handles that recorded calls returned to the ones that the replay got back for the same calls, so that later
+// calls that were passed them can be given the replay's. A recorded handle value that comes back again means that the
+// application closed it in between, which the trace doesn't show; the replay closes its own then
+class handle_table
+{
+public:
+
+    handle_table() = default;
+    handle_table(const handle_table&) = delete;
+    handle_table& operator=(const handle_table&) = delete;
+
+    ~handle_table()
+    {
+        close_all();
+    }
+
+    void add_file(std::uint64_t recorded, HANDLE handle)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& entry = m_files[recorded];
+        if (entry)
+        {
+            ::CloseHandle(entry);
+        }
+        entry = handle;
+    }
+
+    void add_key(std::uint64_t recorded, HKEY key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& entry = m_keys[recorded];
+        if (entry)
+        {
+            ::RegCloseKey(entry);
+        }
+        entry = key;
+    }
+
+    // A recorded root of zero stays null
+    std::optional<HANDLE> file(std::uint64_t recorded)
+    {
+        if (!recorded)
+        {
+            return HANDLE{};
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto itr = m_files.find(recorded);
+        return (itr == m_files.end()) ? std::nullopt : std::optional<HANDLE>(itr->second);
+    }
+
+    std::optional<HKEY> key(std::uint64_t recorded)
+    {
+        if (is_predefined_key(recorded))
+        {
+            return reinterpret_cast<HKEY>(static_cast<ULONG_PTR>(static_cast<std::int32_t>(recorded)));
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto itr = m_keys.find(recorded);
+        return (itr == m_keys.end()) ? std::nullopt : std::optional<HKEY>(itr->second);
+    }
+
+    void close_all()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& entry : m_files)
+        {
+            ::CloseHandle(entry.second);
+        }
+        for (auto& entry : m_keys)
+        {
+            ::RegCloseKey(entry.second);
+        }
+        m_files.clear();
+        m_keys.clear();
+    }
+
+private:
+
+    std::mutex m_mutex;
+    std::unordered_map<std::uint64_t, HANDLE> m_files;
+    std::unordered_map<std::uint64_t, HKEY> m_keys;
+};
+
+constexpr DWORD write_access = GENERIC_WRITE | GENERIC_ALL | FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_EA |
+    FILE_WRITE_ATTRIBUTES | DELETE | WRITE_DAC | WRITE_OWNER;
+
+template <typename Func>
+static replay_outcome timed_call(Func&& func)
+{
+    LARGE_INTEGER start, end;
+    ::QueryPerformanceCounter(&start);
+    bool succeeded = func();
+    ::QueryPerformanceCounter(&end);
+    return replay_outcome{ replay_result::replayed, !succeeded, end.QuadPart - start.QuadPart };
+}
+
+static replay_outcome replay_create_file(const trace_record& record, handle_table& handles, const replay_options& options)
+{
+    auto path = find_value(record, "Path");
+    auto access = static_cast<DWORD>(number_value(record, "Access"));
+    auto share = static_cast<DWORD>(number_value(record, "Share"));
+    auto disposition = static_cast<DWORD>(number_value(record, "Disposition", OPEN_EXISTING));
+    auto isCreateFile2 = (record.name == "CreateFile2");
+    auto flagsAndAttributes = isCreateFile2 ?
+        static_cast<DWORD>(number_value(record, "Attributes") | number_value(record, "Flags") | number_value(record, "Security Quality of Service")) :
+        static_cast<DWORD>(number_value(record, "Flags and Attributes"));
+    if (!path)
+    {
+        return { replay_result::unresolved };
+    }
+
+    if (!options.allow_writes && ((disposition != OPEN_EXISTING) || (access & write_access) || (flagsAndAttributes & FILE_FLAG_DELETE_ON_CLOSE)))
+    {
+        return { replay_result::skipped };
+    }
+
+    HANDLE result = INVALID_HANDLE_VALUE;
+    replay_outcome outcome;
+    if (isCreateFile2)
+    {
+        auto widePath = wide_value(*path);
+        CREATEFILE2_EXTENDED_PARAMETERS params = { sizeof(params) };
+        params.dwFileAttributes = static_cast<DWORD>(number_value(record, "Attributes"));
+        params.dwFileFlags = static_cast<DWORD>(number_value(record, "Flags"));
+        params.dwSecurityQosFlags = static_cast<DWORD>(number_value(record, "Security Quality of Service"));
+        outcome = timed_call([&] { result = ::CreateFile2(widePath.c_str(), access, share, disposition, &params); return result != INVALID_HANDLE_VALUE; });
+    }
+    else if (is_wide(path))
+    {
+        auto widePath = wide_value(*path);
+        outcome = timed_call([&] { result = ::CreateFileW(widePath.c_str(), access, share, nullptr, disposition, flagsAndAttributes, nullptr); return result != INVALID_HANDLE_VALUE; });
+    }
+    else
+    {
+        auto narrowPath = narrow_value(*path);
+        outcome = timed_call([&] { result = ::CreateFileA(narrowPath.c_str(), access, share, nullptr, disposition, flagsAndAttributes, nullptr); return result != INVALID_HANDLE_VALUE; });
+    }
+
+    if (result != INVALID_HANDLE_VALUE)
+    {
+        if (auto recorded = number_value(record, "Handle"))
+        {
+            handles.add_file(recorded, result);
+        }
+        else
+        {
+            ::CloseHandle(result);
+        }
+    }
+
+    return outcome;
+}
+
+static replay_outcome replay_get_file_attributes(const trace_record& record)
+{
+    auto path = find_value(record, "Path");
+    if (!path)
+    {
+        return { replay_result::unresolved };
+    }
+
+    if (record.name == "GetFileAttributes")
+    {
+        if (is_wide(path))
+        {
+            auto widePath = wide_value(*path);
+            return timed_call([&] { return ::GetFileAttributesW(widePath.c_str()) != INVALID_FILE_ATTRIBUTES; });
+        }
+
+        auto narrowPath = narrow_value(*path);
+        return timed_call([&] { return ::GetFileAttributesA(narrowPath.c_str()) != INVALID_FILE_ATTRIBUTES; });
+    }
+
+    // GetFileExMaxInfoLevel is the only other level, and isn't valid to pass
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    auto level = static_cast<GET_FILEEX_INFO_LEVELS>(number_value(record, "Level", GetFileExInfoStandard));
+    if (is_wide(path))
+    {
+        auto widePath = wide_value(*path);
+        return timed_call([&] { return ::GetFileAttributesExW(widePath.c_str(), level, &data) != FALSE; });
+    }
+
+    auto narrowPath = narrow_value(*path);
+    return timed_call([&] { return ::GetFileAttributesExA(narrowPath.c_str(), level, &data) != FALSE; });
+}
+
+// Called through the exports, the same as the application would have, so that the fixups' detours see the calls
+static replay_outcome replay_nt_file(const trace_record& record, handle_table& handles, const replay_options& options)
+{
+    static auto ntdll = ::GetModuleHandleW(L"ntdll.dll");
+    static auto NtCreateFileImpl = reinterpret_cast<decltype(&::NtCreateFile)>(::GetProcAddress(ntdll, "NtCreateFile"));
+    static auto NtOpenFileImpl = reinterpret_cast<decltype(&::NtOpenFile)>(::GetProcAddress(ntdll, "NtOpenFile"));
+
+    auto isCreate = (record.name == "NtCreateFile");
+    auto path = find_value(record, "Path");
+    auto root = handles.file(number_value(record, "Root"));
+    if (!path || !root)
+    {
+        return { replay_result::unresolved };
+    }
+
+    auto access = static_cast<ACCESS_MASK>(number_value(record, "Access"));
+    auto share = static_cast<ULONG>(number_value(record, "Share"));
+    auto createOptions = static_cast<ULONG>(number_value(record, "Create Options"));
+    auto disposition = static_cast<ULONG>(number_value(record, "Creation Disposition", FILE_OPEN));
+    if (!options.allow_writes && ((isCreate && (disposition != FILE_OPEN)) || (access & write_access) || (createOptions & FILE_DELETE_ON_CLOSE)))
+    {
+        return { replay_result::skipped };
+    }
+
+    auto pathString = wide_value(*path);
+    UNICODE_STRING name;
+    name.Buffer = pathString.data();
+    name.Length = static_cast<USHORT>(pathString.length() * sizeof(wchar_t));
+    name.MaximumLength = name.Length;
+
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(&objectAttributes, &name, static_cast<ULONG>(number_value(record, "Object Attributes")), *root, nullptr);
+
+    HANDLE result = nullptr;
+    IO_STATUS_BLOCK ioStatus = {};
+    auto outcome = timed_call([&]
+    {
+        auto status = isCreate ?
+            NtCreateFileImpl(&result, access, &objectAttributes, &ioStatus, nullptr, static_cast<ULONG>(number_value(record, "File Attributes")),
+                share, disposition, createOptions, nullptr, 0) :
+            NtOpenFileImpl(&result, access, &objectAttributes, &ioStatus, share, createOptions);
+        return status >= 0;
+    });
+
+    if (!outcome.failed)
+    {
+        if (auto recorded = number_value(record, "Handle"))
+        {
+            handles.add_file(recorded, result);
+        }
+        else
+        {
+            ::CloseHandle(result);
+        }
+    }
+
+    return outcome;
+}
+
+static replay_outcome replay_reg_open_key(const trace_record& record, handle_table& handles)
+{
+    auto key = handles.key(number_value(record, "Key"));
+    if (!key)
+    {
+        return { replay_result::unresolved };
+    }
+
+    auto subKey = find_value(record, "Sub Key");
+    auto options = static_cast<DWORD>(number_value(record, "Options"));
+    auto access = static_cast<REGSAM>(number_value(record, "Access", KEY_READ));
+
+    HKEY result = nullptr;
+    replay_outcome outcome;
+    if (!subKey || is_wide(subKey))
+    {
+        auto wideSubKey = subKey ? wide_value(*subKey) : std::wstring();
+        outcome = timed_call([&] { return ::RegOpenKeyExW(*key, subKey ? wideSubKey.c_str() : nullptr, options, access, &result) == ERROR_SUCCESS; });
+    }
+    else
+    {
+        auto narrowSubKey = narrow_value(*subKey);
+        outcome = timed_call([&] { return ::RegOpenKeyExA(*key, narrowSubKey.c_str(), options, access, &result) == ERROR_SUCCESS; });
+    }
+
+    if (!outcome.failed)
+    {
+        if (auto recorded = number_value(record, "Result Key"))
+        {
+            handles.add_key(recorded, result);
+        }
+        else
+        {
+            ::RegCloseKey(result);
+        }
+    }
+
+    return outcome;
+}
+
+static replay_outcome replay_reg_query_value(const trace_record& record, handle_table& handles)
+{
+    auto key = handles.key(number_value(record, "Key"));
+    if (!key)
+    {
+        return { replay_result::unresolved };
+    }
+
+    // How big the application's buffer was isn't recorded; one that's big enough for most values keeps the replay from
+    // failing where the application's call didn't
+    thread_local std::vector<BYTE> buffer(64 * 1024);
+    DWORD type;
+    DWORD size = static_cast<DWORD>(buffer.size());
+    auto valueName = find_value(record, "Value Name");
+    if (!valueName || is_wide(valueName))
+    {
+        auto wideName = valueName ? wide_value(*valueName) : std::wstring();
+        return timed_call([&] { return ::RegQueryValueExW(*key, valueName ? wideName.c_str() : nullptr, nullptr, &type, buffer.data(), &size) == ERROR_SUCCESS; });
+    }
+
+    auto narrowName = narrow_value(*valueName);
+    return timed_call([&] { return ::RegQueryValueExA(*key, narrowName.c_str(), nullptr, &type, buffer.data(), &size) == ERROR_SUCCESS; });
+}
+
+static bool is_replayed(std::string_view api)
+{
+    return (api == "CreateFile") || (api == "CreateFile2") || (api == "GetFileAttributes") || (api == "GetFileAttributesEx") ||
+        (api == "NtCreateFile") || (api == "NtOpenFile") || (api == "RegOpenKeyEx") || (api == "RegQueryValueEx");
+}
+
+static std::optional<replay_outcome> replay(const trace_record& record, handle_table& handles, const replay_options& options)
+{
+    if ((record.name == "CreateFile") || (record.name == "CreateFile2"))
+    {
+        return replay_create_file(record, handles, options);
+    }
+    else if ((record.name == "GetFileAttributes") || (record.name == "GetFileAttributesEx"))
+    {
+        return replay_get_file_attributes(record);
+    }
+    else if ((record.name == "NtCreateFile") || (record.name == "NtOpenFile"))
+    {
+        return replay_nt_file(record, handles, options);
+    }
+    else if (record.name == "RegOpenKeyEx")
+    {
+        return replay_reg_open_key(record, handles);
+    }
+    else if (record.name == "RegQueryValueEx")
+    {
+        return replay_reg_query_value(record, handles);
+    }
+
+    return std::nullopt;
+}
+
+struct replay_call
+{
+    trace_record record;
+    std::int64_t offset; // From the first replayed call, in the replay's own ticks
+    double recorded_us;
+};
+
+static void wait_until(std::int64_t ticks, std::int64_t frequency)
+{
+    for (;;)
+    {
+        LARGE_INTEGER now;
+        ::QueryPerformanceCounter(&now);
+        auto remaining = ticks - now.QuadPart;
+        if (remaining <= 0)
+        {
+            return;
+        }
+
+        // Sleeping is only good to a few milliseconds; the rest of the way is a spin
+        if (remaining > frequency / 200)
+        {
+            ::Sleep(static_cast<DWORD>((remaining - frequency / 200) * 1000 / frequency));
+        }
+        else
+        {
+            ::YieldProcessor();
+        }
+    }
+}
+
+static void replay_calls(const std::vector<const replay_call*>& calls, std::int64_t start, handle_table& handles,
+    const replay_options& options, replay_stats& stats)
+{
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    for (auto call : calls)
+    {
+        if (options.original_timing)
+        {
+            wait_until(start + call->offset, frequency.QuadPart);
+        }
+
+        auto outcome = replay(call->record, handles, options);
+        if (!outcome)
+        {
+            continue;
+        }
+
+        auto& apiStats = stats[std::string(call->record.name)];
+        ++apiStats.calls;
+        if (outcome->result == replay_result::skipped)
+        {
+            ++apiStats.skipped;
+        }
+        else if (outcome->result == replay_result::unresolved)
+        {
+            ++apiStats.unresolved;
+        }
+        else
+        {
+            apiStats.recorded_us += call->recorded_us;
+            apiStats.replayed_us += outcome->ticks * 1000000.0 / frequency.QuadPart;
+            if (outcome->failed != function_failed(static_cast<function_result>(call->record.header->result)))
+            {
+                ++apiStats.mismatched;
+            }
+        }
+    }
+}
+
+// Only the replayed column of a report is used, as what the same calls cost without the fixups being measured
+static std::map<std::string, double> read_baseline(const std::filesystem::path& path)
+{
+    std::ifstream stream(path);
+    if (!stream)
+    {
+        throw std::runtime_error("Unable to open " + path.string());
+    }
+
+    std::map<std::string, double> result;
+    std::string line;
+    std::getline(stream, line);
+    while (std::getline(stream, line))
+    {
+        std::vector<std::string> fields;
+        std::istringstream lineStream(line);
+        for (std::string field; std::getline(lineStream, field, ','); )
+        {
+            fields.push_back(field);
+        }
+
+        if (fields.size() >= 7)
+        {
+            result[fields[0]] = std::stod(fields[6]);
+        }
+    }
+
+    return result;
+}
+
+static void report(const replay_stats& stats, const replay_options& options)
+{
+    std::map<std::string, double> baseline;
+    if (!options.baseline.empty())
+    {
+        baseline = read_baseline(options.baseline);
+    }
+
+    std::cout << std::left << std::setw(20) << "API" << std::right << std::setw(10) << "Calls" << std::setw(10) << "Skipped" <<
+        std::setw(12) << "Unresolved" << std::setw(12) << "Mismatched" << std::setw(16) << "Recorded (us)" <<
+        std::setw(16) << "Replayed (us)" << std::setw(14) << "Added (us)" << "\n";
+
+    std::ofstream csv;
+    if (!options.csv.empty())
+    {
+        csv.open(options.csv);
+        if (!csv)
+        {
+            throw std::runtime_error("Unable to create " + options.csv.string());
+        }
+        csv << "api,calls,skipped,unresolved,mismatched,recorded_us,replayed_us\n";
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    for (auto& entry : stats)
+    {
+        auto& api = entry.second;
+        auto replayedCount = api.calls - api.skipped - api.unresolved;
+        auto recorded = replayedCount ? (api.recorded_us / replayedCount) : 0.0;
+        auto replayed = replayedCount ? (api.replayed_us / replayedCount) : 0.0;
+
+        // Without a baseline, the added latency is against the traced run, which includes the TraceFixup's own cost
+        auto itr = baseline.find(entry.first);
+        auto added = replayed - ((itr != baseline.end()) ? itr->second : recorded);
+
+        std::cout << std::left << std::setw(20) << entry.first << std::right << std::setw(10) << api.calls << std::setw(10) << api.skipped <<
+            std::setw(12) << api.unresolved << std::setw(12) << api.mismatched << std::setw(16) << recorded <<
+            std::setw(16) << replayed << std::setw(14) << added << "\n";
+        if (csv)
+        {
+            csv << entry.first << "," << api.calls << "," << api.skipped << "," << api.unresolved << "," << api.mismatched << "," <<
+                recorded << "," << replayed << "\n";
+        }
+    }
+}
+
+static void print_usage(const wchar_t* exe)
+{
+    std::wcerr << L"Usage: " << std::filesystem::path(exe).filename().native() << L" <trace file> [options]\n";
+    std::wcerr << L"Replays the file and registry calls in a TraceFixup raw trace file, and reports their latency per API\n";
+    std::wcerr << L"    --threads original|single   Replay each recorded thread's calls on a thread of its own (default: single)\n";
+    std::wcerr << L"    --timing original|none      Make the calls at the times they were recorded at (default: none)\n";
+    std::wcerr << L"    --repeat <n>                Replay the trace n times (default: 1)\n";
+    std::wcerr << L"    --allow-writes              Also replay calls that can create or modify files\n";
+    std::wcerr << L"    --csv <file>                Also write the report to a file\n";
+    std::wcerr << L"    --baseline <file>           Report the added latency against a previous --csv report\n";
+}
+
+static bool parse_arguments(int argc, const wchar_t** argv, replay_options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::wstring_view arg = argv[i];
+        auto next = [&]() -> const wchar_t*
+        {
+            return (i + 1 < argc) ? argv[++i] : nullptr;
+        };
+
+        if (arg == L"--threads")
+        {
+            auto value = next();
+            if (!value || ((value != L"original"sv) && (value != L"single"sv)))
+            {
+                return false;
+            }
+            options.original_threads = (value == L"original"sv);
+        }
+        else if (arg == L"--timing")
+        {
+            auto value = next();
+            if (!value || ((value != L"original"sv) && (value != L"none"sv)))
+            {
+                return false;
+            }
+            options.original_timing = (value == L"original"sv);
+        }
+        else if (arg == L"--repeat")
+        {
+            auto value = next();
+            options.repeat = value ? std::wcstol(value, nullptr, 10) : 0;
+            if (options.repeat <= 0)
+            {
+                return false;
+            }
+        }
+        else if (arg == L"--allow-writes")
+        {
+            options.allow_writes = true;
+        }
+        else if ((arg == L"--csv") || (arg == L"--baseline"))
+        {
+            auto value = next();
+            if (!value)
+            {
+                return false;
+            }
+            ((arg == L"--csv") ? options.csv : options.baseline) = value;
+        }
+        else if (options.trace.empty() && (arg.substr(0, 2) != L"--"))
+        {
+            options.trace = argv[i];
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return !options.trace.empty();
+}
+
+int wmain(int argc, const wchar_t** argv) try
+{
+    replay_options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    auto contents = read_file(options.trace);
+    std::int64_t recordedFrequency = 0;
+    if (is_ring_file(contents))
+    {
+        auto ring = read_ring(contents);
+        recordedFrequency = ring.frequency;
+        contents = std::move(ring.records);
+    }
+
+    // A file that got cut short replays up to its last whole record
+    std::vector<replay_call> calls;
+    try
+    {
+        trace_record record;
+        std::string message;
+        for (trace_reader reader(contents); reader.next(record, message); )
+        {
+            if (!record.header)
+            {
+                continue;
+            }
+
+            if (record.header->kind == raw_trace::record_kind::file_header)
+            {
+                recordedFrequency = number_value(record, "Frequency");
+            }
+            else if ((record.header->kind == raw_trace::record_kind::call) && is_replayed(record.name))
+            {
+                calls.push_back({ record, 0, 0 });
+            }
+        }
+    }
+    catch (std::runtime_error& e)
+    {
+        std::cerr << "WARNING: " << e.what() << "; replaying the records before it\n";
+    }
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    if (recordedFrequency <= 0)
+    {
+        recordedFrequency = frequency.QuadPart;
+    }
+
+    // Records from different threads aren't in call order in the file, but their start times are
+    std::stable_sort(calls.begin(), calls.end(), [](auto& lhs, auto& rhs) { return lhs.record.header->start < rhs.record.header->start; });
+    auto firstStart = calls.empty() ? 0 : calls.front().record.header->start;
+    for (auto& call : calls)
+    {
+        auto& header = *call.record.header;
+        call.offset = static_cast<std::int64_t>(static_cast<double>(header.start - firstStart) * frequency.QuadPart / recordedFrequency);
+        call.recorded_us = (header.end - header.start) * 1000000.0 / recordedFrequency;
+    }
+
+    std::map<std::uint32_t, std::vector<const replay_call*>> threadCalls;
+    for (auto& call : calls)
+    {
+        threadCalls[options.original_threads ? call.record.header->thread_id : 0].push_back(&call);
+    }
+
+    std::cout << "Replaying " << calls.size() << " calls on " << threadCalls.size() << " thread(s)\n";
+    replay_stats stats;
+    auto wallStart = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < options.repeat; ++pass)
+    {
+        handle_table handles;
+        std::vector<replay_stats> threadStats(threadCalls.size());
+        std::vector<std::thread> threads;
+
+        LARGE_INTEGER start;
+        ::QueryPerformanceCounter(&start);
+        std::size_t index = 0;
+        for (auto& entry : threadCalls)
+        {
+            threads.emplace_back(replay_calls, std::cref(entry.second), start.QuadPart, std::ref(handles), std::cref(options), std::ref(threadStats[index++]));
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        for (auto& threadStat : threadStats)
+        {
+            for (auto& entry : threadStat)
+            {
+                auto& total = stats[entry.first];
+                total.calls += entry.second.calls;
+                total.skipped += entry.second.skipped;
+                total.unresolved += entry.second.unresolved;
+                total.mismatched += entry.second.mismatched;
+                total.recorded_us += entry.second.recorded_us;
+                total.replayed_us += entry.second.replayed_us;
+            }
+        }
+    }
+
+    auto wallTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wallStart);
+    std::cout << "Replayed in " << wallTime.count() << "ms\n\n";
+    report(stats, options);
+    return ERROR_SUCCESS;
+}
+catch (std::exception& e)
+{
+    std::cout.flush();
+    std::cerr << "ERROR: " << e.what() << "\n";
+    return win32_from_caught_exception();
+}
@@ -0,0 +1,255 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Stand-ins for the PsfRuntime exports that the File Redirection Fixup uses, so that benchmarks can link the fixup's
+// sources directly and run outside of a package. The package root is a path under Program Files that doesn't need to
+// exist, since nothing that gets measured touches the disk under it. Local AppData resolves to a scratch directory so
+// that the fixup never sees - or writes to - the real redirected location.
+
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <windows.h>
+#include <KnownFolders.h>
+#include <ShlObj.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/error/en.h>
+#include <dos_paths.h>
+#include <psf_runtime.h>
+#include <utilities.h>
+
+#include "JsonConfig.h"
+
+static std::wstring g_benchmarkPackageRootPath;
+static std::wstring g_benchmarkScratchPath;
+static json_document g_benchmarkConfig;
+
+static std::mutex g_knownFoldersMutex;
+static std::deque<std::pair<GUID, std::wstring>> g_knownFolders;
+
+static std::wstring known_folder(const GUID& id)
+{
+    wchar_t* path;
+    if (FAILED(::SHGetKnownFolderPath(id, KF_FLAG_DEFAULT, nullptr, &path)))
+    {
+        throw std::runtime_error("Failed to get known folder path");
+    }
+
+    std::wstring result = path;
+    ::CoTaskMemFree(path);
+    return result;
+}
+
+// Must be called before anything from the fixup gets initialized. 'configJson' is the File Redirection Fixup's
+// configuration, i.e. what would appear as its "config" value in config.json
+void InitializeBenchmarkRuntime(const std::string& configJson)
+{
+    g_benchmarkPackageRootPath = known_folder(FOLDERID_ProgramFiles) + LR"(\WindowsApps\PsfBenchmark_1.0.0.0_x64__8wekyb3d8bbwe)";
+
+    wchar_t tempPath[MAX_PATH + 1];
+    auto length = ::GetTempPathW(static_cast<DWORD>(std::size(tempPath)), tempPath);
+    if (!length || (length > std::size(tempPath)))
+    {
+        throw std::runtime_error("Failed to get temp path");
+    }
+    g_benchmarkScratchPath = std::wstring(tempPath, length) + L"PsfPathRedirectionBenchmark";
+
+    // Built the same way as the PsfRuntime builds config.json, so that the fixup sees the same DOM
+    rapidjson::StringStream stream(configJson.c_str());
+    rapidjson::Reader reader;
+    auto result = reader.Parse(stream, g_benchmarkConfig);
+    if (result.IsError())
+    {
+        throw std::runtime_error(std::string("Failed to parse configuration: ") + rapidjson::GetParseError_En(result.Code()));
+    }
+}
+
+PSFAPI DWORD __stdcall PSFRegister(_Inout_ void**, _In_ void*) noexcept
+{
+    // Nothing gets detoured; the benchmark calls into the fixup's implementation directly
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFUnregister(_Inout_ void**, _In_ void*) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFRegisterBatch(const psf_registration*, std::size_t) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterBatch(const psf_registration*, std::size_t) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFRegisterApis(const psf_api_info* const*, std::size_t) noexcept
+{
+    return ERROR_SUCCESS;
+}
+
+PSFAPI DWORD __stdcall PSFRegisterHandler(_Inout_ void**, _In_ void*, _In_ void*, _Out_ psf_handler_chain** chain) noexcept
+{
+    *chain = nullptr;
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterHandler(_Inout_ void**, _In_ void*, _In_ void*) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFRegisterOnModuleLoad(const psf_lazy_registration*, std::size_t) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterOnModuleLoad(const psf_lazy_registration*, std::size_t) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+PSFAPI const wchar_t* __stdcall PSFQueryPackageFullName() noexcept
+{
+    // Empty, same as an unpackaged process, so that nothing gets shared with processes of a real package
+    return L"";
+}
+
+PSFAPI const wchar_t* __stdcall PSFQueryPackageRootPath() noexcept
+{
+    return g_benchmarkPackageRootPath.c_str();
+}
+
+// Only drive-absolute and (root-)local device paths, which is all that the fixup passes
+PSFAPI BOOL __stdcall PSFIsPackagePath(_In_reads_(length) const wchar_t* path, std::size_t length) noexcept
+{
+    if ((length >= 4) && psf::is_path_separator(path[0]) && psf::is_path_separator(path[1]) &&
+        ((path[2] == L'?') || (path[2] == L'.')) && psf::is_path_separator(path[3]))
+    {
+        path += 4;
+        length -= 4;
+    }
+
+    std::wstring_view root = g_benchmarkPackageRootPath;
+    while (!root.empty() && psf::is_path_separator(root.back()))
+    {
+        root.remove_suffix(1);
+    }
+
+    return (length >= root.length()) && psf::path_equal(path, root.data(), root.length()) &&
+        ((length == root.length()) || psf::is_path_separator(path[root.length()]));
+}
+
+PSFAPI const wchar_t* __stdcall PSFQueryKnownFolderPath(_In_ const GUID& id) noexcept try
+{
+    std::lock_guard lock(g_knownFoldersMutex);
+    for (auto& [folderId, path] : g_knownFolders)
+    {
+        if (folderId == id)
+        {
+            return path.c_str();
+        }
+    }
+
+    auto path = (id == FOLDERID_LocalAppData) ? g_benchmarkScratchPath : known_folder(id);
+    return g_knownFolders.emplace_back(id, std::move(path)).second.c_str();
+}
+catch (...)
+{
+    return nullptr;
+}
+
+PSFAPI BOOL __stdcall PSFPublishSharedSection(_In_ const GUID&, _In_ HANDLE, std::uint64_t) noexcept
+{
+    ::SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+PSFAPI HANDLE __stdcall PSFQuerySharedSection(_In_ const GUID&, _Out_ std::uint64_t* size) noexcept
+{
+    *size = 0;
+    return nullptr;
+}
+
+// The benchmark has no PsfRuntime to create the private heap, so the process heap stands in for it
+PSFAPI void* __stdcall PSFAllocate(std::size_t size) noexcept
+{
+    return ::HeapAlloc(::GetProcessHeap(), 0, size);
+}
+
+PSFAPI void __stdcall PSFFree(_In_opt_ void* ptr) noexcept
+{
+    if (ptr)
+    {
+        ::HeapFree(::GetProcessHeap(), 0, ptr);
+    }
+}
+
+PSFAPI void __stdcall PSFQueryHeapUsage(_Out_ std::uint64_t* bytes, _Out_ std::uint64_t* allocations) noexcept
+{
+    *bytes = 0;
+    *allocations = 0;
+}
+
+PSFAPI const psf::json_value* __stdcall PSFQueryDllConfig(const wchar_t*) noexcept
+{
+    return g_benchmarkConfig.root();
+}
+
+PSFAPI const psf::json_value* __stdcall PSFQueryModuleConfig(HMODULE) noexcept
+{
+    return g_benchmarkConfig.root();
+}
+
+PSFAPI const psf::json_value* __stdcall PSFReloadDllConfig(const wchar_t*) noexcept
+{
+    return g_benchmarkConfig.root();
+}
+
+// A thread_local is good enough for the benchmark, so every thread's state comes from PSFQueryThreadState rather than
+// a TLS slot
+PSFAPI DWORD __stdcall PSFQueryThreadStateSlot() noexcept
+{
+    return TLS_OUT_OF_INDEXES;
+}
+
+PSFAPI psf_thread_state* __stdcall PSFQueryThreadState() noexcept
+{
+    thread_local psf_thread_state state{};
+    return &state;
+}
+
+// Nothing changes the current directory while the benchmark runs
+PSFAPI const std::atomic<std::uint32_t>* __stdcall PSFQueryCurrentDirectoryGeneration() noexcept
+{
+    static const std::atomic<std::uint32_t> generation = 0;
+    return &generation;
+}
+
+PSFAPI DWORD __stdcall PSFRegisterLiveCounters(_In_ PSFLiveCountersProc, _In_opt_ void*) noexcept
+{
+    return ERROR_SUCCESS;
+}
+
+PSFAPI DWORD __stdcall PSFUnregisterLiveCounters(_In_ PSFLiveCountersProc, _In_opt_ void*) noexcept
+{
+    return ERROR_SUCCESS;
+}
+
+// Callers that submit work help with it themselves, and fall back to doing all of it when there's no worker to be had
+PSFAPI DWORD __stdcall PSFSubmitWork(_In_ PSFWorkProc, _In_opt_ void*, psf_work_priority) noexcept
+{
+    return ERROR_NOT_SUPPORTED;
+}
@@ -0,0 +1,153 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// What the benchmarks have in common: timing, starting their threads together, and parsing their "--name value"
+// arguments. Each benchmark's options, and what it does with them, stay its own
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <windows.h>
+
+// For the benchmarks that compile in BenchmarkRuntime.cpp, which stands in for the PsfRuntime. Must be called before
+// anything from the fixup gets initialized
+void InitializeBenchmarkRuntime(const std::string& configJson);
+
+// Results get folded into this so that the compiler can't throw away the calls being measured
+inline std::atomic<std::size_t> g_benchmarkSink = 0;
+
+inline std::int64_t timestamp() noexcept
+{
+    LARGE_INTEGER value;
+    ::QueryPerformanceCounter(&value);
+    return value.QuadPart;
+}
+
+// The number of timestamp ticks in a second
+inline double timestamp_frequency() noexcept
+{
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(frequency.QuadPart);
+}
+
+inline double elapsed_milliseconds(std::int64_t start, std::int64_t end) noexcept
+{
+    return static_cast<double>(end - start) * 1000 / timestamp_frequency();
+}
+
+// Lets a benchmark's threads all start timing at the same moment, rather than as each of them gets created. Each thread
+// calls 'wait' once it's done whatever it needs to before being timed, and whoever created them calls 'release' to let
+// them go once all of them are waiting
+class benchmark_start_gate
+{
+public:
+
+    void wait() noexcept
+    {
+        ++m_ready;
+        while (!m_started)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    void release(std::uint32_t threadCount) noexcept
+    {
+        while (m_ready != threadCount)
+        {
+            std::this_thread::yield();
+        }
+        m_started = true;
+    }
+
+private:
+
+    std::atomic<std::uint32_t> m_ready = 0;
+    std::atomic<bool> m_started = false;
+};
+
+inline bool parse_unsigned(const wchar_t* str, std::uint64_t& value)
+{
+    wchar_t* end;
+    value = std::wcstoull(str, &end, 10);
+    return (*str != L'\0') && (*end == L'\0');
+}
+
+// Counts (e.g. of iterations or threads) need to be positive, and to fit in 'value'
+inline bool parse_count(const wchar_t* str, std::uint64_t& value)
+{
+    std::uint64_t number;
+    if (!parse_unsigned(str, number) || (number == 0))
+    {
+        return false;
+    }
+
+    value = number;
+    return true;
+}
+
+inline bool parse_count(const wchar_t* str, std::uint32_t& value)
+{
+    std::uint64_t number;
+    if (!parse_count(str, number) || (number > MAXDWORD))
+    {
+        return false;
+    }
+
+    value = static_cast<std::uint32_t>(number);
+    return true;
+}
+
+// Hands each of the arguments to 'parseOption' along with its value, which is null for the ones listed in 'switches',
+// since those don't take one. E.g:
+//      parse_benchmark_arguments(argc, argv, { L"--csv" }, [&](std::wstring_view arg, const wchar_t* value)
+//      {
+//          ...
+//      });
+// 'parseOption' returns false for an option that it doesn't know, or for a bad value, which fails the whole parse, as
+// does an option that's missing its value
+template <typename ParseOptionT>
+inline bool parse_benchmark_arguments(
+    int argc,
+    wchar_t** argv,
+    std::initializer_list<std::wstring_view> switches,
+    ParseOptionT&& parseOption)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::wstring_view arg = argv[i];
+        const wchar_t* value = nullptr;
+        bool isSwitch = false;
+        for (auto name : switches)
+        {
+            isSwitch = isSwitch || (arg == name);
+        }
+
+        if (!isSwitch)
+        {
+            if (i + 1 == argc)
+            {
+                return false;
+            }
+
+            value = argv[++i];
+        }
+
+        if (!parseOption(arg, value))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
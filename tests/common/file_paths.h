@@ -96,3 +96,17 @@ inline bool write_entire_file(const wchar_t* path, const char* contents)
     ::CloseHandle(file);
     return true;
 }
+
+// Creates the file, truncating it if it already exists. Unlike write_entire_file, nothing gets traced on failure, and
+// the last error is left for the caller, e.g. for benchmarks that time the call
+inline bool create_empty_file(const wchar_t* path)
+{
+    auto file = ::CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    ::CloseHandle(file);
+    return true;
+}
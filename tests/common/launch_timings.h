@@ -0,0 +1,52 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The LaunchTest application hands the times at which each phase of its launch happened to the LaunchBenchmark driver
+// through a small section that the driver creates, then signals the event so that the driver knows to read them. When
+// the section doesn't exist, the application was launched by hand, and just shows the times in its window
+static constexpr wchar_t launch_timings_section_name[] = LR"(Local\CentennialFixupsTests.LaunchTimings)";
+static constexpr wchar_t launch_timings_event_name[] = LR"(Local\CentennialFixupsTests.LaunchTimingsReady)";
+
+// In the order that they happen. Phases that didn't happen (e.g. the PsfRuntime ones when the application was launched
+// without PsfLauncher) are left at zero
+enum class launch_phase : std::uint32_t
+{
+    launcher_created,   // PsfLauncher's process was created
+    app_created,        // The application's process was created
+    runtime_attach,     // The PsfRuntime started attaching, i.e. the start of its 'load_config' startup phase
+    runtime_attached,   // ... and finished, i.e. the end of its 'attach_commit' startup phase
+    fixups_load,        // The PsfRuntime's hook of the application's entry point got called, and started loading fixups
+    fixups_loaded,      // ... and had them all in place
+    app_entry_point,    // The application's own entry point (i.e. wWinMain) got called
+    first_window,       // The application's first window finished painting
+
+    count
+};
+
+constexpr const wchar_t* launch_phase_name(launch_phase phase) noexcept
+{
+    switch (phase)
+    {
+    case launch_phase::launcher_created: return L"PsfLauncher Created";
+    case launch_phase::app_created: return L"Application Created";
+    case launch_phase::runtime_attach: return L"PsfRuntime Attach";
+    case launch_phase::runtime_attached: return L"PsfRuntime Attached";
+    case launch_phase::fixups_load: return L"FixupEntryPoint";
+    case launch_phase::fixups_loaded: return L"Fixups Loaded";
+    case launch_phase::app_entry_point: return L"Application Entry Point";
+    case launch_phase::first_window: return L"First Window";
+    default: return L"Unknown";
+    }
+}
+
+struct launch_timings
+{
+    // QueryPerformanceCounter values, which are the same for every process on the machine
+    std::int64_t phases[static_cast<std::size_t>(launch_phase::count)];
+};
@@ -4,9 +4,14 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <map>
+#include <mutex>
+#include <new>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <utilities.h>
 
@@ -18,6 +23,148 @@ inline std::int32_t g_testCount = 0;
 inline std::int32_t g_successCount = 0;
 inline std::int32_t g_failureCount = 0;
 
+// Messages to the test runner get buffered and sent in batches, rather than with a write or two each, since verbose tests
+// would otherwise spend most of their time waiting on the pipe. Trace messages get sent once enough of them have been
+// buffered, or shortly after the first one was. Every other message gets sent right away, along with what's buffered
+// ahead of it, so that the runner still sees them in order. Messages are framed the same either way (see 'test_message')
+class test_runner_batch
+{
+public:
+
+    static constexpr std::size_t flush_size = test_runner_batch_size;
+    static constexpr std::int64_t flush_delay_ms = 50;
+
+    ~test_runner_batch()
+    {
+        if (m_timer)
+        {
+            ::SetThreadpoolTimer(m_timer, nullptr, 0, 0);
+            ::WaitForThreadpoolTimerCallbacks(m_timer, true);
+            ::CloseThreadpoolTimer(m_timer);
+        }
+
+        flush();
+    }
+
+    // Returns false, with the last error set, if the batch couldn't be sent
+    bool send(const void* msg, std::size_t msgSize, const void* payload, std::size_t payloadSize, bool flushNow)
+    {
+        std::lock_guard lock(m_mutex);
+        auto bytes = static_cast<const std::uint8_t*>(msg);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + msgSize);
+        bytes = static_cast<const std::uint8_t*>(payload);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + payloadSize);
+
+        if (flushNow || (m_buffer.size() >= flush_size))
+        {
+            return flush_locked();
+        }
+
+        if (!m_timerPending)
+        {
+            if (!m_timer)
+            {
+                m_timer = ::CreateThreadpoolTimer(on_timer, this, nullptr);
+            }
+
+            // NOTE: If we can't get a timer, the batch still gets sent with the next message that isn't a trace
+            if (m_timer)
+            {
+                ULARGE_INTEGER dueTime;
+                dueTime.QuadPart = static_cast<ULONGLONG>(-flush_delay_ms * 10000); // Relative, in 100ns units
+                FILETIME dueFileTime = { dueTime.LowPart, dueTime.HighPart };
+                ::SetThreadpoolTimer(m_timer, &dueFileTime, 0, 0);
+                m_timerPending = true;
+            }
+        }
+
+        return true;
+    }
+
+    bool flush()
+    {
+        std::lock_guard lock(m_mutex);
+        return flush_locked();
+    }
+
+private:
+
+    bool flush_locked();
+
+    static void __stdcall on_timer(PTP_CALLBACK_INSTANCE, void* context, PTP_TIMER) noexcept
+    {
+        auto batch = static_cast<test_runner_batch*>(context);
+        std::lock_guard lock(batch->m_mutex);
+        batch->m_timerPending = false;
+        batch->flush_locked();
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::uint8_t> m_buffer;
+    PTP_TIMER m_timer = nullptr;
+    bool m_timerPending = false;
+};
+
+inline test_runner_batch g_testRunnerBatch;
+
+// The client's view of the runner's results region (see 'test_results_region_header'), which gets mapped the first time
+// that something is allocated from it
+class test_results_region
+{
+public:
+
+    ~test_results_region()
+    {
+        if (m_region)
+        {
+            ::UnmapViewOfFile(m_region);
+        }
+    }
+
+    // Returns null if the region is full, or if there isn't one (e.g. an older runner)
+    void* allocate(std::size_t size)
+    {
+        std::call_once(m_mapOnce, [&]()
+        {
+            unique_handle mapping(::OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, false, test_results_region_name));
+            if (mapping)
+            {
+                m_region = static_cast<test_results_region_header*>(
+                    ::MapViewOfFile(mapping.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, test_results_region_size));
+            }
+        });
+
+        return m_region ? test_results_region_allocate(m_region, size) : nullptr;
+    }
+
+    std::uint32_t offset_of(const void* ptr) const noexcept
+    {
+        return static_cast<std::uint32_t>(static_cast<const std::uint8_t*>(ptr) - reinterpret_cast<const std::uint8_t*>(m_region));
+    }
+
+private:
+
+    std::once_flag m_mapOnce;
+    test_results_region_header* m_region = nullptr;
+};
+
+inline test_results_region g_testResultsRegion;
+
+inline bool test_runner_batch::flush_locked()
+{
+    if (m_buffer.empty())
+    {
+        return true;
+    }
+
+    // NOTE: Writes to a byte mode pipe don't complete until all of the data has been written
+    DWORD bytesWritten;
+    auto result = !g_testRunnerPipe ||
+        ::WriteFile(g_testRunnerPipe.get(), m_buffer.data(), static_cast<DWORD>(m_buffer.size()), &bytesWritten, nullptr);
+    m_buffer.clear();
+    return result;
+}
+
 inline int parse_args(int argc, const wchar_t** argv, std::map<std::wstring_view, std::wstring>& allowedArgs)
 {
     using namespace std::literals;
@@ -120,12 +267,7 @@ inline int test_initialize(null_terminated_string_view name, std::int32_t testCo
         msg.count = testCount;
         msg.name.reset(reinterpret_cast<char*>(&msg + 1));
 
-        if (!::WriteFile(g_testRunnerPipe.get(), &msg, sizeof(msg), nullptr, nullptr))
-        {
-            return print_last_error("Failed to send init message to test server");
-        }
-
-        if (!::WriteFile(g_testRunnerPipe.get(), name.ptr, static_cast<DWORD>(name.length + 1), nullptr, nullptr))
+        if (!g_testRunnerBatch.send(&msg, sizeof(msg), name.ptr, name.length + 1, true))
         {
             return print_last_error("Failed to send init message to test server");
         }
@@ -151,7 +293,7 @@ inline int test_cleanup()
         cleanup_test_message msg = {};
         msg.header.size = sizeof(msg);
 
-        if (!::WriteFile(g_testRunnerPipe.get(), &msg, sizeof(msg), nullptr, nullptr))
+        if (!g_testRunnerBatch.send(&msg, sizeof(msg), nullptr, 0, true))
         {
             return print_last_error("Failed to send cleanup message to test server");
         }
@@ -178,12 +320,7 @@ inline int test_begin(null_terminated_string_view name)
         msg.header.size = static_cast<std::int32_t>(sizeof(msg) + name.length + 1);
         msg.name.reset(reinterpret_cast<char*>(&msg + 1));
 
-        if (!::WriteFile(g_testRunnerPipe.get(), &msg, sizeof(msg), nullptr, nullptr))
-        {
-            return print_last_error("Failed to send test begin message to test server");
-        }
-
-        if (!::WriteFile(g_testRunnerPipe.get(), name.ptr, static_cast<DWORD>(name.length + 1), nullptr, nullptr))
+        if (!g_testRunnerBatch.send(&msg, sizeof(msg), name.ptr, name.length + 1, true))
         {
             return print_last_error("Failed to send test begin message to test server");
         }
@@ -206,9 +343,9 @@ inline int test_end(std::int32_t result)
         msg.header.size = static_cast<std::int32_t>(sizeof(msg));
         msg.result = result;
 
-        if (!::WriteFile(g_testRunnerPipe.get(), &msg, sizeof(msg), nullptr, nullptr))
+        if (!g_testRunnerBatch.send(&msg, sizeof(msg), nullptr, 0, true))
         {
-            return print_last_error("Failed to send test begin message to test server");
+            return print_last_error("Failed to send test end message to test server");
         }
     }
     else
@@ -234,6 +371,72 @@ inline int test_end(std::int32_t result)
     return ERROR_SUCCESS;
 }
 
+// Reports the timing of an API for the active test. The test runner pairs up results for the same API across setups in
+// order to compute the overhead of the fixups. The latency histogram, if any, has 'benchmark_latency_bucket_count'
+// elements
+inline int test_benchmark(
+    null_terminated_string_view api,
+    benchmark_setup setup,
+    std::int32_t iterations,
+    double microsecondsPerCall,
+    const std::uint32_t* latencyHistogram = nullptr)
+{
+    constexpr auto histogramSize = benchmark_latency_bucket_count * sizeof(std::uint32_t);
+    auto regionMessageSize = sizeof(test_benchmark_message) + histogramSize + api.length + 1;
+    auto regionBuffer = (g_testRunnerPipe && latencyHistogram) ? g_testResultsRegion.allocate(regionMessageSize) : nullptr;
+    if (regionBuffer)
+    {
+        // The message, followed by the histogram and the API name, all in the region
+        auto msg = new (regionBuffer) test_benchmark_message{};
+        auto histogram = reinterpret_cast<std::uint32_t*>(msg + 1);
+        auto name = reinterpret_cast<char*>(histogram + benchmark_latency_bucket_count);
+        msg->header.size = static_cast<std::int32_t>(regionMessageSize);
+        msg->setup = setup;
+        msg->iterations = iterations;
+        msg->microseconds_per_call = microsecondsPerCall;
+        std::memcpy(histogram, latencyHistogram, histogramSize);
+        msg->latency_histogram.reset(histogram);
+        std::memcpy(name, api.ptr, api.length + 1);
+        msg->api.reset(name);
+
+        test_region_message regionMsg = {};
+        regionMsg.header.size = sizeof(regionMsg);
+        regionMsg.offset = g_testResultsRegion.offset_of(msg);
+        if (!g_testRunnerBatch.send(&regionMsg, sizeof(regionMsg), nullptr, 0, true))
+        {
+            return print_last_error("Failed to send benchmark message to test server");
+        }
+    }
+    else if (g_testRunnerPipe)
+    {
+        test_benchmark_message msg = {};
+        msg.header.size = static_cast<std::int32_t>(sizeof(msg) + api.length + 1);
+        msg.setup = setup;
+        msg.iterations = iterations;
+        msg.microseconds_per_call = microsecondsPerCall;
+        msg.api.reset(reinterpret_cast<char*>(&msg + 1));
+
+        if (!g_testRunnerBatch.send(&msg, sizeof(msg), api.ptr, api.length + 1, true))
+        {
+            return print_last_error("Failed to send benchmark message to test server");
+        }
+    }
+    else
+    {
+        std::wcout << "Benchmark:  " << info_text() << api.ptr << "\n";
+        std::wcout << "Setup:      " << info_text() << benchmark_setup_name(setup) << "\n";
+        std::wcout << "Iterations: " << info_text() << iterations << "\n";
+        std::wcout << "Time:       " << info_text() << microsecondsPerCall << L" \u00b5s/call\n";
+        if (latencyHistogram)
+        {
+            std::wcout << "Latency:    " << info_text() << "p50 < " << benchmark_latency_percentile(latencyHistogram, 0.5) <<
+                L" \u00b5s, p99 < " << benchmark_latency_percentile(latencyHistogram, 0.99) << L" \u00b5s\n";
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
 inline void trace_message(
     wnull_terminated_string_view message,
     console::color color = console::color::gray,
@@ -247,14 +450,9 @@ inline void trace_message(
         msg.print_new_line = newLine;
         msg.text.reset(reinterpret_cast<wchar_t*>(&msg + 1));
 
-        if (!::WriteFile(g_testRunnerPipe.get(), &msg, sizeof(msg), nullptr, nullptr))
-        {
-            throw_win32(print_last_error("Failed to send test begin message to test server"));
-        }
-
-        if (!::WriteFile(g_testRunnerPipe.get(), message.ptr, static_cast<DWORD>((message.length + 1) * 2), nullptr, nullptr))
+        if (!g_testRunnerBatch.send(&msg, sizeof(msg), message.ptr, (message.length + 1) * 2, false))
         {
-            throw_win32(print_last_error("Failed to send test begin message to test server"));
+            throw_win32(print_last_error("Failed to send trace message to test server"));
         }
     }
     else
@@ -16,7 +16,47 @@
 
 static constexpr wchar_t test_runner_pipe_name[] = LR"(\\.\pipe\CentennialFixupsTests)";
 
-using unique_handle = std::unique_ptr<void, psf::handle_deleter<::CloseHandle>>;
+// Clients send their trace messages in batches of about this size (see 'test_runner_batch')
+static constexpr std::size_t test_runner_batch_size = 16 * 1024;
+
+// Messages that are too large for the pipe (e.g. ones with benchmark latency histograms) get placed in a region of shared
+// memory that the runner creates, and that all of the test processes allocate from. The message on the pipe then only
+// says where to find it (see 'test_region_message'), and the runner reads it from the region where it is. What gets
+// allocated in the region is never freed, so that the runner can keep pointing into it. Since messages only ever use
+// 'offset_ptr', anything that they point to can be allocated along with them
+static constexpr wchar_t test_results_region_name[] = LR"(Local\CentennialFixupsTests.Results)";
+static constexpr std::uint32_t test_results_region_size = 64 * 1024 * 1024;
+
+struct test_results_region_header
+{
+    std::uint32_t size;     // Size, in bytes, of the complete region
+    volatile LONG used;     // Bytes allocated so far, including this header
+};
+
+// Returns null if there isn't enough space left
+inline void* test_results_region_allocate(test_results_region_header* region, std::size_t size) noexcept
+{
+    // NOTE: Keeping allocations 8 byte aligned, so that messages can be read in place
+    auto alignedSize = (size + 7) & ~static_cast<std::size_t>(7);
+    auto used = region->used;
+    while (true)
+    {
+        if (alignedSize > (region->size - static_cast<std::uint32_t>(used)))
+        {
+            return nullptr;
+        }
+
+        auto previous = ::InterlockedCompareExchange(&region->used, static_cast<LONG>(used + alignedSize), used);
+        if (previous == used)
+        {
+            return reinterpret_cast<std::uint8_t*>(region) + used;
+        }
+
+        used = previous;
+    }
+}
+
+using psf::unique_handle;
 
 inline unique_handle test_client_connect()
 {
@@ -58,6 +98,10 @@ enum class test_message_type : std::int16_t
     end,
 
     trace,
+
+    benchmark,
+
+    region,
 };
 
 struct test_message
@@ -102,3 +146,79 @@ struct test_trace_message
     console::color color = console::color::gray;
     std::int8_t print_new_line = false; // NOTE: Interpreted as a boolean value
 };
+
+// The configuration a benchmark ran under. The overhead of the fixups is the difference between the first and the last
+enum class benchmark_setup : std::int8_t
+{
+    fixups,         // Launched through PsfLauncher with the fixups loaded
+    runtime_only,   // Launched through PsfLauncher, but with no fixups configured for the process
+    unpackaged,     // Launched directly from outside of the package
+};
+
+inline const wchar_t* benchmark_setup_name(benchmark_setup setup) noexcept
+{
+    switch (setup)
+    {
+    case benchmark_setup::fixups: return L"Fixups";
+    case benchmark_setup::runtime_only: return L"PsfRuntime Only";
+    case benchmark_setup::unpackaged: return L"Unpackaged";
+    }
+
+    return L"Unknown";
+}
+
+// Bucket 'i' of a latency histogram counts the calls that took at least 2^i, but less than 2^(i+1), nanoseconds. The last
+// bucket counts everything slower than that, too
+static constexpr std::size_t benchmark_latency_bucket_count = 32;
+
+inline std::size_t benchmark_latency_bucket(std::uint64_t nanoseconds) noexcept
+{
+    std::size_t bucket = 0;
+    while (((bucket + 1) < benchmark_latency_bucket_count) && (nanoseconds >> (bucket + 1)))
+    {
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+// The upper bound, in microseconds, of the bucket that the given fraction of the calls fall in or under
+inline double benchmark_latency_percentile(const std::uint32_t* histogram, double fraction) noexcept
+{
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < benchmark_latency_bucket_count; ++i)
+    {
+        total += histogram[i];
+    }
+
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i < benchmark_latency_bucket_count; ++i)
+    {
+        count += histogram[i];
+        if (total && (static_cast<double>(count) >= (fraction * static_cast<double>(total))))
+        {
+            return static_cast<double>(std::uint64_t(1) << (i + 1)) / 1000.0;
+        }
+    }
+
+    return 0;
+}
+
+struct test_benchmark_message
+{
+    test_message header = { test_message_type::benchmark };
+    offset_ptr<char> api;
+    benchmark_setup setup = benchmark_setup::fixups;
+    std::int32_t iterations = 0;
+    double microseconds_per_call = 0;
+
+    // Only ever set for messages sent through the results region, since the histogram takes up too much room otherwise.
+    // Has 'benchmark_latency_bucket_count' elements
+    offset_ptr<std::uint32_t> latency_histogram;
+};
+
+struct test_region_message
+{
+    test_message header = { test_message_type::region };
+    std::uint32_t offset = 0; // Offset of the message from the start of the region
+};
@@ -0,0 +1,223 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Reading the records back out of a trace file from the TraceFixup's "raw" or "file" trace method. Only the format is
+// understood here; making sense of the records is up to the tool reading them
+//
+// NOTE: Shared with the TraceReplay benchmark
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <utilities.h>
+
+#include "..\TraceFixup\RawTrace.h"
+
+struct trace_module
+{
+    std::uint64_t base;
+    std::uint64_t size;
+    std::string path;
+};
+
+struct trace_value
+{
+    const raw_trace::value_header* header;
+    std::string_view name;
+    const std::uint8_t* payload;
+
+    std::uint64_t number() const
+    {
+        std::uint64_t result = 0;
+        std::memcpy(&result, payload, std::min<std::size_t>(header->length, sizeof(result)));
+        return result;
+    }
+
+    std::string string() const
+    {
+        if (header->kind == raw_trace::value_kind::wide_string)
+        {
+            return narrow(std::wstring_view(reinterpret_cast<const wchar_t*>(payload), header->length / sizeof(wchar_t)));
+        }
+        return std::string(reinterpret_cast<const char*>(payload), header->length);
+    }
+};
+
+struct trace_record
+{
+    const raw_trace::record_header* header = nullptr;
+    std::string_view name;
+    std::vector<trace_value> values;
+};
+
+inline std::vector<std::uint8_t> read_file(const std::filesystem::path& path)
+{
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream)
+    {
+        throw std::runtime_error("Unable to open " + path.string());
+    }
+
+    return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+class trace_reader
+{
+public:
+
+    trace_reader(const std::vector<std::uint8_t>& contents) : m_data(contents.data()), m_end(contents.data() + contents.size())
+    {
+    }
+
+    // Returns false at the end of the file. Messages that the PsfRuntime's logging puts in the file on its own (e.g. that
+    // some records got dropped because a thread produced them faster than they got written out) come back as text
+    bool next(trace_record& record, std::string& message)
+    {
+        message.clear();
+        record.header = nullptr;
+        record.values.clear();
+        if (m_data == m_end)
+        {
+            return false;
+        }
+
+        constexpr std::string_view logPrefix = "PSF: ";
+        auto remaining = static_cast<std::size_t>(m_end - m_data);
+        if ((remaining >= logPrefix.length()) && (std::memcmp(m_data, logPrefix.data(), logPrefix.length()) == 0))
+        {
+            auto lineEnd = std::find(m_data, m_end, static_cast<std::uint8_t>('\n'));
+            lineEnd = (lineEnd == m_end) ? m_end : (lineEnd + 1);
+            message.assign(m_data, lineEnd);
+            m_offset += lineEnd - m_data;
+            m_data = lineEnd;
+            return true;
+        }
+
+        auto header = reinterpret_cast<const raw_trace::record_header*>(m_data);
+        if ((remaining < sizeof(raw_trace::record_header)) || (header->size < sizeof(raw_trace::record_header)) ||
+            (header->size > remaining) || (header->size > raw_trace::max_record_size))
+        {
+            throw std::runtime_error("Corrupt record at offset " + std::to_string(m_offset));
+        }
+
+        auto pos = m_data + sizeof(raw_trace::record_header);
+        auto end = m_data + header->size;
+        auto take = [&](std::size_t length)
+        {
+            if (length > static_cast<std::size_t>(end - pos))
+            {
+                throw std::runtime_error("Corrupt record at offset " + std::to_string(m_offset));
+            }
+            auto result = pos;
+            pos += length;
+            return result;
+        };
+
+        record.header = header;
+        record.name = std::string_view(reinterpret_cast<const char*>(take(header->name_length)), header->name_length);
+        for (std::uint16_t i = 0; i < header->value_count; ++i)
+        {
+            trace_value value;
+            value.header = reinterpret_cast<const raw_trace::value_header*>(take(sizeof(raw_trace::value_header)));
+            value.name = std::string_view(reinterpret_cast<const char*>(take(value.header->name_length)), value.header->name_length);
+            value.payload = take(value.header->length);
+            record.values.push_back(value);
+        }
+
+        m_offset += header->size;
+        m_data = end;
+        return true;
+    }
+
+private:
+
+    const std::uint8_t* m_data;
+    const std::uint8_t* m_end;
+    std::size_t m_offset = 0;
+};
+
+// Files from the "file" trace method are a ring of records (see ring_file in TraceFixup/RawTrace.h). This puts the
+// complete ones back together in the order that they were written in, oldest first, the same as a raw trace file
+inline bool is_ring_file(const std::vector<std::uint8_t>& contents)
+{
+    return (contents.size() >= sizeof(raw_trace::ring_file_magic)) &&
+        (std::memcmp(contents.data(), raw_trace::ring_file_magic, sizeof(raw_trace::ring_file_magic)) == 0);
+}
+
+struct ring_contents
+{
+    std::vector<std::uint8_t> records;
+    std::vector<trace_module> modules;
+    std::int64_t frequency;
+};
+
+inline ring_contents read_ring(const std::vector<std::uint8_t>& contents)
+{
+    auto header = reinterpret_cast<const raw_trace::ring_file_header*>(contents.data());
+    if ((contents.size() < sizeof(raw_trace::ring_file_header)) || (header->version != raw_trace::ring_format_version) ||
+        (header->capacity == 0) || (header->capacity % raw_trace::ring_alignment) ||
+        (header->ring_offset < raw_trace::ring_modules_offset + raw_trace::ring_module_count * sizeof(raw_trace::ring_module)) ||
+        (header->ring_offset + header->capacity > contents.size()))
+    {
+        throw std::runtime_error("Unsupported or damaged trace file");
+    }
+
+    ring_contents result;
+    result.frequency = header->frequency;
+    auto modules = reinterpret_cast<const raw_trace::ring_module*>(contents.data() + raw_trace::ring_modules_offset);
+    for (std::size_t i = 0; i < raw_trace::ring_module_count; ++i)
+    {
+        if (modules[i].base)
+        {
+            auto pathLength = std::find(modules[i].path, std::end(modules[i].path), '\0') - modules[i].path;
+            result.modules.push_back({ modules[i].base, modules[i].size, std::string(modules[i].path, pathLength) });
+        }
+    }
+
+    auto ring = contents.data() + header->ring_offset;
+    auto capacity = header->capacity;
+    auto copy = [&](std::uint64_t position, std::size_t length, std::vector<std::uint8_t>& output)
+    {
+        position %= capacity;
+        auto first = static_cast<std::size_t>((std::min)(static_cast<std::uint64_t>(length), capacity - position));
+        output.insert(output.end(), ring + position, ring + position + first);
+        output.insert(output.end(), ring, ring + (length - first));
+    };
+
+    // Only what's been written since the last time around the ring is still there. Past that, entries that aren't
+    // complete get skipped over an alignment unit at a time, until the next one that is
+    auto writeOffset = header->write_offset;
+    auto offset = (writeOffset > capacity) ? (writeOffset - capacity) : 0;
+    offset = (offset + raw_trace::ring_alignment - 1) & ~static_cast<std::uint64_t>(raw_trace::ring_alignment - 1);
+    while (offset + sizeof(raw_trace::ring_entry_header) <= writeOffset)
+    {
+        raw_trace::ring_entry_header entry;
+        std::vector<std::uint8_t> entryBytes;
+        copy(offset, sizeof(entry), entryBytes);
+        std::memcpy(&entry, entryBytes.data(), sizeof(entry));
+
+        auto end = offset + raw_trace::ring_entry_size(entry.length);
+        if ((entry.length <= raw_trace::max_record_size) && (entry.end == end) && (end <= writeOffset))
+        {
+            copy(offset + sizeof(entry), entry.length, result.records);
+            offset = end;
+        }
+        else
+        {
+            offset += raw_trace::ring_alignment;
+        }
+    }
+
+    return result;
+}
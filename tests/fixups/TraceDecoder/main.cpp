@@ -0,0 +1,291 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Turns a trace file written by the TraceFixup's "raw" trace method into the same text that its "printf" method would
+// have written while the application ran. See readme.md for usage, and TraceFixup/RawTrace.h for the file format. All of
+// the interpretation (flag names, error descriptions, handle paths) happens here, with the same Log* functions that the
+// TraceFixup itself uses, writing to stdout
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+#include <utilities.h>
+#include <win32_error.h>
+
+#include "..\TraceFixup\Logging.h"
+#include "..\TraceFixup\WinternlLogging.h"
+#include "TraceReader.h"
+
+// What Logging.h expects the TraceFixup to define. Log writes to stdout, which is exactly what we want
+trace_method output_method = trace_method::printf;
+bool wait_for_debugger = false;
+bool trace_function_entry = false;
+bool trace_calling_module = true;
+bool ignore_dll_load = true;
+
+// Keys that RegOpenKeyEx and friends take without anyone having opened them
+static const char* predefined_key_name(std::uint64_t value)
+{
+    // Predefined keys are sign extended on 64-bit
+    if (((value >> 32) != 0) && ((value >> 32) != 0xFFFFFFFF))
+    {
+        return nullptr;
+    }
+
+    switch (static_cast<std::uint32_t>(value))
+    {
+    case 0x80000000: return "HKEY_CLASSES_ROOT";
+    case 0x80000001: return "HKEY_CURRENT_USER";
+    case 0x80000002: return "HKEY_LOCAL_MACHINE";
+    case 0x80000003: return "HKEY_USERS";
+    case 0x80000004: return "HKEY_PERFORMANCE_DATA";
+    case 0x80000005: return "HKEY_CURRENT_CONFIG";
+    case 0x80000006: return "HKEY_DYN_DATA";
+    case 0x80000007: return "HKEY_CURRENT_USER_LOCAL_SETTINGS";
+    }
+
+    return nullptr;
+}
+
+class trace_decoder
+{
+public:
+
+    void add_module(const trace_record& record)
+    {
+        trace_module module{ record.header->caller, 0, std::string(record.name) };
+        for (auto& value : record.values)
+        {
+            if (value.name == "Size")
+            {
+                module.size = value.number();
+            }
+        }
+
+        add_module(std::move(module));
+    }
+
+    void add_module(trace_module module)
+    {
+        m_modules.push_back(std::move(module));
+        std::sort(m_modules.begin(), m_modules.end(), [](auto& lhs, auto& rhs) { return lhs.base < rhs.base; });
+    }
+
+    void decode(const trace_record& record)
+    {
+        if (record.header->kind == raw_trace::record_kind::text)
+        {
+            for (auto& value : record.values)
+            {
+                std::cout << value.string();
+            }
+            return;
+        }
+        else if (record.header->kind != raw_trace::record_kind::call)
+        {
+            return;
+        }
+
+        Log("%.*s:\n", static_cast<int>(record.name.length()), record.name.data());
+
+        // Handles remember the path that they were opened with, so that later calls can show it
+        std::string path;
+        std::string rootPath;
+        DWORD regType = REG_NONE;
+        for (auto& value : record.values)
+        {
+            if ((value.header->kind == raw_trace::value_kind::string) || (value.header->kind == raw_trace::value_kind::wide_string))
+            {
+                auto str = value.string();
+                Log("\t%.*s=%s\n", static_cast<int>(value.name.length()), value.name.data(), str.c_str());
+                path = rootPath.empty() ? str : (str.empty() ? rootPath : (rootPath + "\\" + str));
+            }
+            else if ((value.header->kind == raw_trace::value_kind::blob) || (value.header->kind == raw_trace::value_kind::wide_blob))
+            {
+                decode_blob(value, regType);
+            }
+            else
+            {
+                decode_number(value, path, rootPath, regType);
+            }
+        }
+
+        if (record.header->caller)
+        {
+            auto itr = std::upper_bound(m_modules.begin(), m_modules.end(), record.header->caller,
+                [](std::uint64_t address, auto& module) { return address < module.base; });
+            if ((itr != m_modules.begin()) && (record.header->caller < std::prev(itr)->base + std::prev(itr)->size))
+            {
+                Log("\tCalling Module=%s\n", std::prev(itr)->path.c_str());
+            }
+        }
+    }
+
+private:
+
+    void decode_number(const trace_value& value, std::string& path, std::string& rootPath, DWORD& regType)
+    {
+        using raw_trace::decoder;
+
+        auto number = value.number();
+        auto dword = static_cast<DWORD>(number);
+        std::string name(value.name);
+        switch (value.header->how)
+        {
+        case decoder::hex: Log("\t%s=0x%llX\n", name.c_str(), number); break;
+        case decoder::decimal: Log("\t%s=%llu\n", name.c_str(), number); break;
+        case decoder::boolean: LogBool(name.c_str(), static_cast<BOOL>(number)); break;
+        case decoder::win32_error: LogWin32Error(dword, name.c_str()); break;
+        case decoder::ntstatus: LogNTStatus(static_cast<NTSTATUS>(dword)); break;
+        case decoder::hresult: LogHResult(static_cast<HRESULT>(dword)); break;
+        case decoder::generic_access: LogGenericAccess(dword, name.c_str()); break;
+        case decoder::file_access: LogFileAccess(dword, name.c_str()); break;
+        case decoder::directory_access: LogDirectoryAccess(dword, name.c_str()); break;
+        case decoder::share_mode: LogShareMode(dword, name.c_str()); break;
+        case decoder::creation_disposition: LogCreationDisposition(dword, name.c_str()); break;
+        case decoder::creation_disposition_internal: LogCreationDispositionInternal(dword); break;
+        case decoder::file_flags_and_attributes: LogFileFlagsAndAttributes(dword, name.c_str()); break;
+        case decoder::file_attributes: LogFileAttributes(dword, name.c_str()); break;
+        case decoder::file_flags: LogFileFlags(dword, name.c_str()); break;
+        case decoder::sqos: LogSQOS(dword, name.c_str()); break;
+        case decoder::file_info_level: LogInfoLevelId(static_cast<GET_FILEEX_INFO_LEVELS>(dword), name.c_str()); break;
+        case decoder::file_create_options: LogFileCreateOptions(dword); break;
+        case decoder::object_attributes: LogObjectAttributes(static_cast<ULONG>(dword)); break;
+        case decoder::reg_key_flags: LogRegKeyFlags(dword, name.c_str()); break;
+        case decoder::reg_key_access: LogRegKeyAccess(dword, name.c_str()); break;
+        case decoder::function_result: LogFunctionResult(static_cast<function_result>(number), name.c_str()); break;
+
+        case decoder::reg_key_type:
+            regType = dword;
+            LogRegKeyType(dword, name.c_str());
+            break;
+
+        case decoder::root_handle:
+            if (auto predefined = predefined_key_name(number))
+            {
+                rootPath = predefined;
+            }
+            else if (auto itr = m_handles.find(number); itr != m_handles.end())
+            {
+                rootPath = itr->second;
+            }
+            else if (number)
+            {
+                Log("\t%s=0x%llX\n", name.c_str(), number);
+                break;
+            }
+            else
+            {
+                break;
+            }
+
+            // Relative paths come before the handle that they're relative to
+            path = path.empty() ? rootPath : (rootPath + "\\" + path);
+            Log("\t%s=%s\n", name.c_str(), rootPath.c_str());
+            break;
+
+        case decoder::opened_handle:
+            Log("\t%s=0x%llX\n", name.c_str(), number);
+            if (!path.empty())
+            {
+                m_handles[number] = path;
+            }
+            break;
+
+        default:
+            Log("\t%s=0x%llX (unknown format %u)\n", name.c_str(), number, static_cast<unsigned>(value.header->how));
+            break;
+        }
+    }
+
+    void decode_blob(const trace_value& value, DWORD regType)
+    {
+        std::string name(value.name);
+        if (value.header->how != raw_trace::decoder::reg_value)
+        {
+            Log("\t%s=(%u bytes)\n", name.c_str(), value.header->length);
+        }
+        else if (value.header->kind == raw_trace::value_kind::wide_blob)
+        {
+            LogRegValue<wchar_t>(regType, value.payload, value.header->length, name.c_str());
+        }
+        else
+        {
+            LogRegValue<char>(regType, value.payload, value.header->length, name.c_str());
+        }
+    }
+
+    std::vector<trace_module> m_modules;
+    std::unordered_map<std::uint64_t, std::string> m_handles;
+};
+
+int wmain(int argc, const wchar_t** argv) try
+{
+    if (argc != 2)
+    {
+        std::wcerr << L"Usage: " << std::filesystem::path(argv[0]).filename().native() << L" <trace file>\n";
+        std::wcerr << L"Writes out the calls in a TraceFixup raw trace file as text\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    auto contents = read_file(argv[1]);
+
+    trace_decoder decoder;
+    if (is_ring_file(contents))
+    {
+        auto ring = read_ring(contents);
+        for (auto& module : ring.modules)
+        {
+            decoder.add_module(std::move(module));
+        }
+        contents = std::move(ring.records);
+    }
+
+    // Records from different threads aren't in order, so a call can come before the module it was made from. The file
+    // can end in a partial record if the application didn't get to exit normally; the second pass is what reports it
+    trace_record record;
+    std::string message;
+    try
+    {
+        for (trace_reader reader(contents); reader.next(record, message); )
+        {
+            if (record.header && (record.header->kind == raw_trace::record_kind::module))
+            {
+                decoder.add_module(record);
+            }
+        }
+    }
+    catch (std::runtime_error&)
+    {
+    }
+
+    for (trace_reader reader(contents); reader.next(record, message); )
+    {
+        if (!record.header)
+        {
+            std::cout << message;
+        }
+        else
+        {
+            decoder.decode(record);
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+catch (std::exception& e)
+{
+    std::cout.flush();
+    std::cerr << "ERROR: " << e.what() << "\n";
+    return win32_from_caught_exception();
+}
@@ -4,6 +4,10 @@
 //-------------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+
 #include <ntstatus.h>
 #include <windows.h>
 #include <winternl.h>
@@ -13,6 +17,12 @@ enum class trace_method
     printf,
     output_debug_string,
 	eventlog,
+
+    // Binary records for the TraceDecoder to format (see RawTrace.h)
+    raw,
+
+    // Nothing but counts and timings per API, path and result, reported when the process exits
+    summary,
 };
 
 enum class function_result
@@ -189,10 +199,112 @@ extern void Log_ETW_PostMsgA(const char *);
 extern void Log_ETW_PostMsgW(const wchar_t *);
 extern void Log_ETW_PostMsgOperationA(const char *operation, const char *inputs, const char *result, const char *outputs, const char *caller, LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd );
 
+// Typed events for the calls that get traced the most, so that arguments go into the event as they are instead of being
+// formatted into the "Inputs"/"Outputs" strings first. Each function_type has a keyword of its own, which the generic
+// "TraceEvent" events also carry, so that a consumer can enable only the kinds of calls it cares about. Implemented in
+// main.cpp, which is where the provider is
+extern bool Log_ETW_IsEnabled(function_type type);
+extern void Log_ETW_FileOperation(const char* operation, const wchar_t* path, std::size_t pathLength, DWORD access, DWORD share,
+    DWORD disposition, DWORD flagsAndAttributes, function_result result, DWORD error, HANDLE handle, const void* caller,
+    LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd);
+extern void Log_ETW_FileAttributesOperation(const char* operation, const wchar_t* path, std::size_t pathLength, DWORD infoLevel,
+    DWORD attributes, function_result result, DWORD error, const void* caller, LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd);
+extern void Log_ETW_NtFileOperation(const char* operation, const wchar_t* path, std::size_t pathLength, HANDLE root, ACCESS_MASK access,
+    ULONG share, ULONG disposition, ULONG options, function_result result, NTSTATUS status, HANDLE handle, const void* caller,
+    LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd);
+extern void Log_ETW_RegistryOperation(const char* operation, HKEY key, const wchar_t* name, std::size_t nameLength, DWORD options,
+    REGSAM access, DWORD type, DWORD dataSize, function_result result, LSTATUS error, HKEY resultKey, const void* caller,
+    LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd);
+
 struct result_configuration
 {
     bool should_log;
     bool should_break;
 };
 
-result_configuration configured_result(function_type type, function_result result);
+constexpr std::size_t function_type_count = static_cast<std::size_t>(function_type::dynamic_link_library) + 1;
+constexpr std::size_t function_result_count = static_cast<std::size_t>(function_result::failure) + 1;
+
+// The "traceLevels" and "breakOn" configuration, resolved for every combination once, when the fixup loads (see main.cpp)
+extern result_configuration g_resultConfigurations[function_type_count][function_result_count];
+
+inline result_configuration configured_result(function_type type, function_result result)
+{
+    return g_resultConfigurations[static_cast<std::size_t>(type)][static_cast<std::size_t>(result)];
+}
+
+// The "slowCalls" configuration, in QueryPerformanceCounter ticks (see main.cpp). With a threshold, calls that are any
+// faster than it don't get traced, and those that do get traced along with their call stack. Zero for no threshold
+extern std::int64_t g_slowCallThresholds[function_type_count];
+
+inline bool has_slow_call_threshold(function_type type)
+{
+    return g_slowCallThresholds[static_cast<std::size_t>(type)] != 0;
+}
+
+inline bool is_slow_call(function_type type, LARGE_INTEGER start, LARGE_INTEGER end)
+{
+    return (end.QuadPart - start.QuadPart) >= g_slowCallThresholds[static_cast<std::size_t>(type)];
+}
+
+extern void Log_ETW_CallStack(const char* api, void* const* frames, std::size_t frameCount);
+
+// What the summary trace method groups calls by, besides the API and its result: the path, or the registry key or value
+// name, that the call was for. Gets copied only when the summary trace method is in use
+struct summary_key
+{
+    static constexpr std::size_t null_terminated = static_cast<std::size_t>(-1);
+
+    const char* narrow = nullptr;
+    const wchar_t* wide = nullptr;
+    std::size_t length = null_terminated; // Of 'wide', in characters
+
+    summary_key() = default;
+    summary_key(const char* value) noexcept : narrow(value) {}
+    summary_key(const wchar_t* value) noexcept : wide(value) {}
+    summary_key(const UNICODE_STRING* value) noexcept :
+        wide(value ? value->Buffer : nullptr),
+        length(value ? value->Length / sizeof(wchar_t) : 0)
+    {
+    }
+};
+
+void add_to_summary(const char* api, const summary_key& key, function_result result, LARGE_INTEGER start, LARGE_INTEGER end) noexcept;
+
+// The "sampling" and "rateLimits" configuration (see main.cpp), for calls that the trace levels say to log. Calls that
+// don't make it through get counted per API, and the count goes out with the next call to the same API that does
+bool sampled_in(function_type type) noexcept;
+void count_untraced_call(const char* api) noexcept;
+std::uint64_t take_untraced_calls(const char* api) noexcept;
+
+// The "moduleTimeline" configuration (see ModuleTimeline.cpp). The LoadLibrary calls go into the timeline whatever their
+// trace level, along with the last error that they left
+extern bool module_timeline_enabled;
+void timeline_module_load(const char* api, const char* name, HMODULE result, DWORD error, const void* caller,
+    LARGE_INTEGER start, LARGE_INTEGER end) noexcept;
+void timeline_module_load(const char* api, const wchar_t* name, HMODULE result, DWORD error, const void* caller,
+    LARGE_INTEGER start, LARGE_INTEGER end) noexcept;
+
+// The "includePaths" and "excludePaths" configuration (see PathScope.cpp). File calls check their path argument as soon
+// as they're called, and calls for paths that are out of scope go straight to the traced function: they don't get timed,
+// captured, or counted, and don't take the output lock. Zero length and null paths are always in scope
+extern bool path_scope_enabled;
+bool path_in_scope(const wchar_t* path, std::size_t length) noexcept;
+bool path_in_scope(const char* path) noexcept;
+
+inline bool in_trace_scope(const wchar_t* path) noexcept
+{
+    return !path_scope_enabled || !path || path_in_scope(path, std::wcslen(path));
+}
+
+inline bool in_trace_scope(const char* path) noexcept
+{
+    return !path_scope_enabled || !path || path_in_scope(path);
+}
+
+// Object names that are relative to a root directory can't be placed without the directory's path, so those are in scope
+inline bool in_trace_scope(const OBJECT_ATTRIBUTES* objectAttributes) noexcept
+{
+    return !path_scope_enabled || !objectAttributes || objectAttributes->RootDirectory || !objectAttributes->ObjectName ||
+        path_in_scope(objectAttributes->ObjectName->Buffer, objectAttributes->ObjectName->Length / sizeof(wchar_t));
+}
@@ -75,6 +75,11 @@ HMODULE __stdcall LoadLibraryFixup(_In_ const CharT* libFileName)
     auto result = LoadLibraryImpl(libFileName);
     QueryPerformanceCounter(&TickEnd);
 
+    if (module_timeline_enabled)
+    {
+        timeline_module_load("LoadLibrary", libFileName, result, result ? ERROR_SUCCESS : ::GetLastError(), _ReturnAddress(), TickStart, TickEnd);
+    }
+
     auto functionResult = from_win32_bool(result != NULL);
     if (auto lock = acquire_output_lock(function_type::dynamic_link_library, functionResult))
     {
@@ -127,6 +132,11 @@ HMODULE __stdcall LoadLibraryExFixup(_In_ const CharT* libFileName, _Reserved_ H
     auto result = LoadLibraryExImpl(libFileName, file, flags);
     QueryPerformanceCounter(&TickEnd);
 
+    if (module_timeline_enabled)
+    {
+        timeline_module_load("LoadLibraryEx", libFileName, result, result ? ERROR_SUCCESS : ::GetLastError(), _ReturnAddress(), TickStart, TickEnd);
+    }
+
     auto functionResult = from_win32_bool(result != NULL);
     if (auto lock = acquire_output_lock(function_type::dynamic_link_library, functionResult))
     {
@@ -231,6 +241,11 @@ HMODULE __stdcall LoadPackagedLibraryFixup(_In_ LPCWSTR libFileName, _Reserved_
     auto result = LoadPackagedLibraryImpl(libFileName, reserved);
     QueryPerformanceCounter(&TickEnd);
 
+    if (module_timeline_enabled)
+    {
+        timeline_module_load("LoadPackagedLibrary", libFileName, result, result ? ERROR_SUCCESS : ::GetLastError(), _ReturnAddress(), TickStart, TickEnd);
+    }
+
     auto functionResult = from_win32_bool(result != NULL);
     if (auto lock = acquire_output_lock(function_type::dynamic_link_library, functionResult))
     {
@@ -24,6 +24,11 @@ HANDLE __stdcall CreateFileFixup(
     _In_ DWORD flagsAndAttributes,
     _In_opt_ HANDLE templateFile)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return CreateFileImpl(fileName, desiredAccess, shareMode, securityAttributes, creationDisposition, flagsAndAttributes, templateFile);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -32,39 +37,33 @@ HANDLE __stdcall CreateFileFixup(
     preserve_last_error preserveError;
 
     auto functionResult = from_win32_bool(result != INVALID_HANDLE_VALUE);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, fileName))
     {
-        if (output_method == trace_method::eventlog)
-        {
-            std::string inputs = "";
-            std::string outputs = "";
-            std::string results = "";
-
-            inputs = "Path=" + InterpretStringA(fileName);
-            inputs += "\n" + InterpretGenericAccess(desiredAccess);
-            inputs += "\n" + InterpretShareMode(shareMode);
-            if (securityAttributes)
-                inputs += "\nSecurityAttributes (unparsed)";
-            inputs += "\n" + InterpretCreationDisposition(creationDisposition);
-            inputs += "\n" + InterpretFileFlagsAndAttributes(flagsAndAttributes);
-            if (templateFile)
-                inputs += "\n" + InterpretAsHex("TemplateFile Handle", templateFile);
-
-            results = InterpretReturn(functionResult, result != INVALID_HANDLE_VALUE).c_str();
+        if (output_method == trace_method::raw)
+        {
+            raw_trace::record trace("CreateFile", functionResult, TickStart, TickEnd, _ReturnAddress());
+            trace.string("Path", fileName)
+                .number("Access", desiredAccess, raw_trace::decoder::generic_access)
+                .number("Share", shareMode, raw_trace::decoder::share_mode)
+                .number("Disposition", creationDisposition, raw_trace::decoder::creation_disposition)
+                .number("Flags and Attributes", flagsAndAttributes, raw_trace::decoder::file_flags_and_attributes)
+                .number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
             if (function_failed(functionResult))
             {
-                outputs += InterpretLastError();
+                trace.number("Last Error", ::GetLastError(), raw_trace::decoder::win32_error);
             }
             else
-                outputs += InterpretAsHex("Handle", result);
-
-            std::ostringstream sout;
-            InterpretCallingModulePart1()
-                sout << InterpretCallingModulePart2()
-                InterpretCallingModulePart3()
-                std::string cm = sout.str();
-
-            Log_ETW_PostMsgOperationA("CreateFile", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+            {
+                trace.handle("Handle", result, raw_trace::decoder::opened_handle);
+            }
+            trace.write();
+        }
+        else if (output_method == trace_method::eventlog)
+        {
+            auto path = widen_argument(fileName);
+            Log_ETW_FileOperation("CreateFile", path.c_str(), path.c_str() ? std::wcslen(path.c_str()) : 0, desiredAccess, shareMode,
+                creationDisposition, flagsAndAttributes, functionResult, function_failed(functionResult) ? ::GetLastError() : ERROR_SUCCESS,
+                result, _ReturnAddress(), TickStart, TickEnd);
         }
         else
         {
@@ -95,6 +94,11 @@ HANDLE __stdcall CreateFile2Fixup(
     _In_ DWORD creationDisposition,
     _In_opt_ LPCREATEFILE2_EXTENDED_PARAMETERS createExParams)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return CreateFile2Impl(fileName, desiredAccess, shareMode, creationDisposition, createExParams);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -103,42 +107,40 @@ HANDLE __stdcall CreateFile2Fixup(
     QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32_bool(result != INVALID_HANDLE_VALUE);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, fileName))
     {
-        if (output_method == trace_method::eventlog)
+        if (output_method == trace_method::raw)
         {
-            std::string inputs = "";
-            std::string outputs = "";
-            std::string results = "";
-            
-            inputs = "Path=" + InterpretStringA(fileName);
-            inputs += "\n" + InterpretGenericAccess(desiredAccess);
-            inputs += "\n" + InterpretShareMode(shareMode);
-            inputs += "\n" + InterpretCreationDisposition(creationDisposition);
+            raw_trace::record trace("CreateFile2", functionResult, TickStart, TickEnd, _ReturnAddress());
+            trace.string("Path", fileName)
+                .number("Access", desiredAccess, raw_trace::decoder::generic_access)
+                .number("Share", shareMode, raw_trace::decoder::share_mode)
+                .number("Disposition", creationDisposition, raw_trace::decoder::creation_disposition);
             if (createExParams)
             {
-                inputs += "\n" + InterpretFileAttributes(createExParams->dwFileAttributes);
-                inputs += "\n" + InterpretFileFlags(createExParams->dwFileFlags);
-                inputs += "\n" + InterpretSQOS(createExParams->dwSecurityQosFlags);
-                if (createExParams->lpSecurityAttributes)
-                    inputs += "\nSecurity (unparsed)";
+                trace.number("Attributes", createExParams->dwFileAttributes, raw_trace::decoder::file_attributes)
+                    .number("Flags", createExParams->dwFileFlags, raw_trace::decoder::file_flags)
+                    .number("Security Quality of Service", createExParams->dwSecurityQosFlags, raw_trace::decoder::sqos);
             }
-
-            results = InterpretReturn(functionResult, result != INVALID_HANDLE_VALUE).c_str();
+            trace.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
             if (function_failed(functionResult))
             {
-                outputs +=  InterpretLastError();
+                trace.number("Last Error", ::GetLastError(), raw_trace::decoder::win32_error);
             }
             else
-                outputs += InterpretAsHex("Handle", result);
-
-            std::ostringstream sout;
-            InterpretCallingModulePart1()
-                sout << InterpretCallingModulePart2()
-                InterpretCallingModulePart3()
-                std::string cm = sout.str();
-
-            Log_ETW_PostMsgOperationA("CreateFile2", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+            {
+                trace.handle("Handle", result, raw_trace::decoder::opened_handle);
+            }
+            trace.write();
+        }
+        else if (output_method == trace_method::eventlog)
+        {
+            // The same flags and attributes that CreateFile takes in a single value
+            auto flagsAndAttributes = createExParams ?
+                (createExParams->dwFileAttributes | createExParams->dwFileFlags | createExParams->dwSecurityQosFlags) : 0;
+            Log_ETW_FileOperation("CreateFile2", fileName, fileName ? std::wcslen(fileName) : 0, desiredAccess, shareMode,
+                creationDisposition, flagsAndAttributes, functionResult, function_failed(functionResult) ? ::GetLastError() : ERROR_SUCCESS,
+                result, _ReturnAddress(), TickStart, TickEnd);
         }
         else
         {
@@ -167,6 +169,11 @@ auto CopyFileImpl = psf::detoured_string_function(&::CopyFileA, &::CopyFileW);
 template <typename CharT>
 BOOL __stdcall CopyFileFixup(_In_ const CharT* existingFileName, _In_ const CharT* newFileName, _In_ BOOL failIfExists)
 {
+    if (!in_trace_scope(existingFileName) && !in_trace_scope(newFileName))
+    {
+        return CopyFileImpl(existingFileName, newFileName, failIfExists);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -227,6 +234,11 @@ HRESULT __stdcall CopyFile2Fixup(
     _In_ PCWSTR newFileName,
     _In_opt_ COPYFILE2_EXTENDED_PARAMETERS* extendedParameters)
 {
+    if (!in_trace_scope(existingFileName) && !in_trace_scope(newFileName))
+    {
+        return CopyFile2Impl(existingFileName, newFileName, extendedParameters);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -290,6 +302,11 @@ BOOL __stdcall CopyFileExFixup(
     _In_opt_ LPBOOL cancel,
     _In_ DWORD copyFlags)
 {
+    if (!in_trace_scope(existingFileName) && !in_trace_scope(newFileName))
+    {
+        return CopyFileExImpl(existingFileName, newFileName, progressRoutine, data, cancel, copyFlags);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -350,6 +367,11 @@ BOOL __stdcall CreateHardLinkFixup(
     _In_ const CharT* existingFileName,
     _Reserved_ LPSECURITY_ATTRIBUTES securityAttributes)
 {
+    if (!in_trace_scope(fileName) && !in_trace_scope(existingFileName))
+    {
+        return CreateHardLinkImpl(fileName, existingFileName, securityAttributes);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -408,6 +430,11 @@ BOOLEAN __stdcall CreateSymbolicLinkFixup(
     _In_ const CharT* targetFileName,
     _In_ DWORD flags)
 {
+    if (!in_trace_scope(symlinkFileName) && !in_trace_scope(targetFileName))
+    {
+        return CreateSymbolicLinkImpl(symlinkFileName, targetFileName, flags);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -465,6 +492,11 @@ auto DeleteFileImpl = psf::detoured_string_function(&::DeleteFileA, &::DeleteFil
 template <typename CharT>
 BOOL __stdcall DeleteFileFixup(_In_ const CharT* fileName)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return DeleteFileImpl(fileName);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -518,6 +550,11 @@ auto MoveFileImpl = psf::detoured_string_function(&::MoveFileA, &::MoveFileW);
 template <typename CharT>
 BOOL __stdcall MoveFileFixup(_In_ const CharT* existingFileName, _In_ const CharT* newFileName)
 {
+    if (!in_trace_scope(existingFileName) && !in_trace_scope(newFileName))
+    {
+        return MoveFileImpl(existingFileName, newFileName);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -573,6 +610,11 @@ auto MoveFileExImpl = psf::detoured_string_function(&::MoveFileExA, &::MoveFileE
 template <typename CharT>
 BOOL __stdcall MoveFileExFixup(_In_ const CharT* existingFileName, _In_opt_ const CharT* newFileName, _In_ DWORD flags)
 {
+    if (!in_trace_scope(existingFileName) && (!newFileName || !in_trace_scope(newFileName)))
+    {
+        return MoveFileExImpl(existingFileName, newFileName, flags);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -636,6 +678,11 @@ BOOL __stdcall ReplaceFileFixup(
     _Reserved_ LPVOID exclude,
     _Reserved_ LPVOID reserved)
 {
+    if (!in_trace_scope(replacedFileName) && !in_trace_scope(replacementFileName))
+    {
+        return ReplaceFileImpl(replacedFileName, replacementFileName, backupFileName, replaceFlags, exclude, reserved);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -701,6 +748,11 @@ HANDLE __stdcall FindFirstFileFixup(
     _In_ const CharT* fileName,
     _Out_ win32_find_data_t<CharT>* findFileData)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return FindFirstFileImpl(fileName, findFileData);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -776,6 +828,11 @@ HANDLE __stdcall FindFirstFileExFixup(
     _Reserved_ LPVOID searchFilter,
     _In_ DWORD additionalFlags)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return FindFirstFileExImpl(fileName, infoLevelId, findFileData, searchOp, searchFilter, additionalFlags);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -970,6 +1027,11 @@ auto CreateDirectoryImpl = psf::detoured_string_function(&::CreateDirectoryA, &:
 template <typename CharT>
 BOOL __stdcall CreateDirectoryFixup(_In_ const CharT* pathName, _In_opt_ LPSECURITY_ATTRIBUTES securityAttributes)
 {
+    if (!in_trace_scope(pathName))
+    {
+        return CreateDirectoryImpl(pathName, securityAttributes);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1028,6 +1090,11 @@ BOOL __stdcall CreateDirectoryExFixup(
     _In_ const CharT* newDirectory,
     _In_opt_ LPSECURITY_ATTRIBUTES securityAttributes)
 {
+    if (!in_trace_scope(templateDirectory) && !in_trace_scope(newDirectory))
+    {
+        return CreateDirectoryExImpl(templateDirectory, newDirectory, securityAttributes);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1085,6 +1152,11 @@ auto RemoveDirectoryImpl = psf::detoured_string_function(&::RemoveDirectoryA, &:
 template <typename CharT>
 BOOL __stdcall RemoveDirectoryFixup(_In_ const CharT* pathName)
 {
+    if (!in_trace_scope(pathName))
+    {
+        return RemoveDirectoryImpl(pathName);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1138,6 +1210,11 @@ auto SetCurrentDirectoryImpl = psf::detoured_string_function(&::SetCurrentDirect
 template <typename CharT>
 BOOL __stdcall SetCurrentDirectoryFixup(_In_ const CharT* pathName)
 {
+    if (!in_trace_scope(pathName))
+    {
+        return SetCurrentDirectoryImpl(pathName);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1251,6 +1328,11 @@ auto GetFileAttributesImpl = psf::detoured_string_function(&::GetFileAttributesA
 template <typename CharT>
 DWORD __stdcall GetFileAttributesFixup(_In_ const CharT* fileName)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return GetFileAttributesImpl(fileName);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1259,33 +1341,29 @@ DWORD __stdcall GetFileAttributesFixup(_In_ const CharT* fileName)
     QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32_bool(result != INVALID_FILE_ATTRIBUTES);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, fileName))
     {
-        if (output_method == trace_method::eventlog)
+        if (output_method == trace_method::raw)
         {
-            std::string inputs = "";
-            std::string outputs = "";
-            std::string results = "";
-
-            inputs = "Path=" + InterpretStringA(fileName);
-
-            results = InterpretReturn(functionResult, result != INVALID_FILE_ATTRIBUTES).c_str();
+            raw_trace::record trace("GetFileAttributes", functionResult, TickStart, TickEnd, _ReturnAddress());
+            trace.string("Path", fileName)
+                .number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
             if (function_failed(functionResult))
             {
-                outputs +=  InterpretLastError();
+                trace.number("Last Error", ::GetLastError(), raw_trace::decoder::win32_error);
             }
             else
             {
-                outputs += InterpretFileAttributes(result);
+                trace.number("Attributes", result, raw_trace::decoder::file_attributes);
             }
-
-            std::ostringstream sout;
-            InterpretCallingModulePart1()
-                sout << InterpretCallingModulePart2()
-                InterpretCallingModulePart3()
-                std::string cm = sout.str();
-
-            Log_ETW_PostMsgOperationA("GetFileAttributes", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+            trace.write();
+        }
+        else if (output_method == trace_method::eventlog)
+        {
+            auto path = widen_argument(fileName);
+            Log_ETW_FileAttributesOperation("GetFileAttributes", path.c_str(), path.c_str() ? std::wcslen(path.c_str()) : 0, 0,
+                function_failed(functionResult) ? 0 : result, functionResult,
+                function_failed(functionResult) ? ::GetLastError() : ERROR_SUCCESS, _ReturnAddress(), TickStart, TickEnd);
         }
         else
         {
@@ -1312,6 +1390,11 @@ auto SetFileAttributesImpl = psf::detoured_string_function(&::SetFileAttributesA
 template <typename CharT>
 BOOL __stdcall SetFileAttributesFixup(_In_ const CharT* fileName, _In_ DWORD fileAttributes)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return SetFileAttributesImpl(fileName, fileAttributes);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1370,6 +1453,11 @@ BOOL __stdcall GetFileAttributesExFixup(
     _In_ GET_FILEEX_INFO_LEVELS infoLevelId,
     _Out_writes_bytes_(sizeof(WIN32_FILE_ATTRIBUTE_DATA)) LPVOID fileInformation)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return GetFileAttributesExImpl(fileName, infoLevelId, fileInformation);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -1378,36 +1466,32 @@ BOOL __stdcall GetFileAttributesExFixup(
     QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32_bool(result);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, fileName))
     {
-        if (output_method == trace_method::eventlog)
+        if (output_method == trace_method::raw)
         {
-            std::string inputs = "";
-            std::string outputs = "";
-            std::string results = "";
-
-            inputs = "Path=" + InterpretStringA(fileName);
-            inputs += "\n" + InterpretInfoLevelId(infoLevelId);
-
-            results = InterpretReturn(functionResult, result).c_str();
+            raw_trace::record trace("GetFileAttributesEx", functionResult, TickStart, TickEnd, _ReturnAddress());
+            trace.string("Path", fileName)
+                .number("Level", infoLevelId, raw_trace::decoder::file_info_level)
+                .number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
             if (function_failed(functionResult))
             {
-                outputs +=  InterpretLastError();
+                trace.number("Last Error", ::GetLastError(), raw_trace::decoder::win32_error);
             }
             else
             {
                 auto data = reinterpret_cast<WIN32_FILE_ATTRIBUTE_DATA*>(fileInformation);
-                outputs +=  InterpretFileAttributes(data->dwFileAttributes);
-                // TODO: Dump out other elements of data...
+                trace.number("Attributes", data->dwFileAttributes, raw_trace::decoder::file_attributes);
             }
-
-            std::ostringstream sout;
-            InterpretCallingModulePart1()
-                sout << InterpretCallingModulePart2()
-                InterpretCallingModulePart3()
-                std::string cm = sout.str();
-
-            Log_ETW_PostMsgOperationA("GetFileAttributesEx", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+            trace.write();
+        }
+        else if (output_method == trace_method::eventlog)
+        {
+            auto path = widen_argument(fileName);
+            auto data = reinterpret_cast<WIN32_FILE_ATTRIBUTE_DATA*>(fileInformation);
+            Log_ETW_FileAttributesOperation("GetFileAttributesEx", path.c_str(), path.c_str() ? std::wcslen(path.c_str()) : 0, infoLevelId,
+                function_failed(functionResult) ? 0 : data->dwFileAttributes, functionResult,
+                function_failed(functionResult) ? ::GetLastError() : ERROR_SUCCESS, _ReturnAddress(), TickStart, TickEnd);
         }
         else
         {
@@ -1436,6 +1520,11 @@ auto LZOpenFileImpl = psf::detoured_string_function(&::LZOpenFileA, &::LZOpenFil
 template <typename CharT>
 INT __stdcall LZOpenFileFixup(_In_ CharT* fileName, _Inout_ LPOFSTRUCT reOpenBuf, _In_ WORD style)
 {
+    if (!in_trace_scope(fileName))
+    {
+        return LZOpenFileImpl(fileName, reOpenBuf, style);
+    }
+
     LARGE_INTEGER TickStart, TickEnd;
     QueryPerformanceCounter(&TickStart);
     auto entry = LogFunctionEntry();
@@ -5,19 +5,23 @@
 #pragma once
 
 #include <cassert>
+#include <cstdarg>
 #include <cstdio>
 #include <cwchar>
-#include <mutex>
 #include <string>
+#include <utility>
 
 #include <intrin.h>
 #include <windows.h>
 #include <lzexpand.h>
 #include <winternl.h>
 
+#include <psf_framework.h>
+#include <psf_logging.h>
 #include <psf_utils.h>
 
 #include "Config.h"
+#include "RawTrace.h"
 
 // Conditionally define flags introduced after RS1 (14393) SDK
 #ifndef FILE_ATTRIBUTE_PINNED
@@ -46,50 +50,81 @@
 #endif
 
 
-// Since consumers typically call 'Log' multiple times, make sure that we synchronize that output
-inline std::recursive_mutex g_outputMutex;
+// Consumers typically call 'Log' multiple times for a single traced call. Rather than having every thread wait on a lock
+// for as long as all of that takes (which changes the timing of multi-threaded applications beyond recognition), while
+// an output_lock is held the output goes into a buffer of the calling thread's, and the lock then writes it out all at
+// once. Null when nothing is being buffered
+inline thread_local std::string* g_callOutput = nullptr;
+
+inline void AppendOutput(std::string& output, const char* fmt, va_list args)
+{
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    auto count = std::vsnprintf(nullptr, 0, fmt, argsCopy);
+    va_end(argsCopy);
+    if (count <= 0)
+    {
+        return;
+    }
+
+    auto offset = output.size();
+    output.resize(offset + count);
+    std::vsnprintf(output.data() + offset, count + 1, fmt, args);
+}
+
+// Same conversion as OutputDebugStringW does it
+inline void AppendOutput(std::string& output, const wchar_t* text, std::size_t length)
+{
+    auto count = ::WideCharToMultiByte(CP_ACP, 0, text, static_cast<int>(length), nullptr, 0, nullptr, nullptr);
+    if (count <= 0)
+    {
+        return;
+    }
+
+    auto offset = output.size();
+    output.resize(offset + count);
+    ::WideCharToMultiByte(CP_ACP, 0, text, static_cast<int>(length), output.data() + offset, count, nullptr, nullptr);
+}
 
 // Logs output using a printf-like format
 inline void Log(const char* fmt, ...)
 {
-    if (output_method == trace_method::printf)
+    if (g_callOutput)
+    {
+        va_list args;
+        va_start(args, fmt);
+        AppendOutput(*g_callOutput, fmt, args);
+        va_end(args);
+    }
+    else if (output_method == trace_method::printf)
     {
         va_list args;
         va_start(args, fmt);
         std::vprintf(fmt, args);
         va_end(args);
     }
+    else if (output_method == trace_method::raw)
+    {
+        std::string text;
+        va_list args;
+        va_start(args, fmt);
+        AppendOutput(text, fmt, args);
+        va_end(args);
+        raw_trace::write_text(text.data(), text.size());
+    }
     else // trace_method::output_debug_string
     {
-        std::string str;
-        str.resize(256);
-
+        // psf_logging.h does the OutputDebugString on its own thread, so that tracing slows the application down less
         va_list args;
         va_start(args, fmt);
-        std::size_t count = std::vsnprintf(str.data(), str.size() + 1, fmt, args);
-        assert(count >= 0);
+        psf::log_vprintf(fmt, args);
         va_end(args);
-
-        if (count > str.size())
-        {
-            str.resize(count);
-
-            va_list args2;
-            va_start(args2, fmt);
-            count = std::vsnprintf(str.data(), str.size() + 1, fmt, args2);
-            assert(count >= 0);
-            va_end(args2);
-        }
-
-        str.resize(count);
-
-        ::OutputDebugStringA(str.c_str());
     }
 }
 
 inline void Log(const wchar_t* fmt, ...)
 {
-    if (output_method == trace_method::printf)
+    if ((output_method == trace_method::printf) && !g_callOutput)
     {
         va_list args;
         va_start(args, fmt);
@@ -116,7 +151,20 @@ inline void Log(const wchar_t* fmt, ...)
             str.resize(str.size() * 2);
         }
 
-        ::OutputDebugStringW(str.c_str());
+        if (g_callOutput)
+        {
+            AppendOutput(*g_callOutput, str.data(), str.size());
+        }
+        else if (output_method == trace_method::raw)
+        {
+            std::string text;
+            AppendOutput(text, str.data(), str.size());
+            raw_trace::write_text(text.data(), text.size());
+        }
+        else
+        {
+            psf::log_message(str.data(), str.size());
+        }
     }
 
 }
@@ -531,30 +579,84 @@ inline std::string InterpretLZError(INT err)
 //	return sout.str();
 //}
 
-// RAII type to acquire/release the output lock that also tracks/exposes whether or not the function result should be logged
+// RAII type that groups the output for a single call together (see g_callOutput) and that also tracks/exposes whether or
+// not the function result should be logged. Despite the name, it doesn't make other threads wait
 struct output_lock
 {
     // Don't let function calls made while processing output cause more output. This is effectively a "were we the first
-    // to acquire the lock" check
-    static inline bool processing_output = false;
+    // to acquire the lock" check. The calls that we make while processing output are made on the same thread
+    static inline thread_local bool processing_output = false;
 
-    output_lock(function_type type, function_result result)
+    // What the generic ETW events from the call being traced get their keyword from
+    static inline thread_local function_type current_type = function_type::filesystem;
+
+    output_lock(function_type type, function_result result, const char* api, LARGE_INTEGER start, LARGE_INTEGER end, const summary_key& key = {}) :
+        m_api(api)
     {
-        g_outputMutex.lock();
         m_inhibitOutput = std::exchange(processing_output, true);
 
         auto [shouldLog, shouldBreak] = configured_result(type, result);
         m_shouldLog = !m_inhibitOutput && shouldLog;
+        if (!m_inhibitOutput)
+        {
+            current_type = type;
+        }
+
+        if (m_shouldLog && !is_slow_call(type, start, end))
+        {
+            m_shouldLog = false;
+        }
+
+        // Calls only get counted, so there's nothing for the caller to write
+        if (m_shouldLog && (output_method == trace_method::summary))
+        {
+            add_to_summary(api, key, result, start, end);
+            m_shouldLog = false;
+        }
+
+        // Don't put an event together that nobody is listening for
+        if (m_shouldLog && (output_method == trace_method::eventlog))
+        {
+            m_shouldLog = Log_ETW_IsEnabled(type);
+        }
+
+        if (m_shouldLog && !sampled_in(type))
+        {
+            count_untraced_call(api);
+            m_shouldLog = false;
+        }
+        m_untracedCalls = m_shouldLog ? take_untraced_calls(api) : 0;
+
+        // Frames are left as addresses until the call is written out, which only happens for calls that get traced.
+        // Skip this frame; the traced function's own frame is what shows where the call came from
+        m_stackSize = (m_shouldLog && has_slow_call_threshold(type)) ? ::RtlCaptureStackBackTrace(1, max_stack_size, m_stack, nullptr) : 0;
         if (shouldBreak)
         {
             ::DebugBreak();
         }
+
+        // ETW events are written with a single call already
+        if (m_shouldLog && (output_method != trace_method::eventlog))
+        {
+            g_callOutput = &m_output;
+        }
     }
 
+    output_lock(const output_lock&) = delete;
+    output_lock& operator=(const output_lock&) = delete;
+
     ~output_lock()
     {
+        // Raw records get written as the call is traced, so these go out after the call's record, in their own
+        log_call_stack();
+        log_untraced_calls();
+        if (g_callOutput == &m_output)
+        {
+            g_callOutput = nullptr;
+            write_output();
+        }
+
         processing_output = m_inhibitOutput;
-        g_outputMutex.unlock();
     }
 
     explicit operator bool() const noexcept
@@ -564,13 +666,94 @@ struct output_lock
 
 private:
 
+    // As module+offset, which is what symbolizing needs, and the same whichever address the module got loaded at
+    void log_call_stack()
+    {
+        if (!m_stackSize)
+        {
+            return;
+        }
+        else if (output_method == trace_method::eventlog)
+        {
+            Log_ETW_CallStack(m_api, m_stack, m_stackSize);
+            return;
+        }
+
+        Log("\tCall Stack:\n");
+        for (USHORT i = 0; i < m_stackSize; ++i)
+        {
+            HMODULE moduleHandle;
+            if (::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                reinterpret_cast<const wchar_t*>(m_stack[i]), &moduleHandle))
+            {
+                auto offset = reinterpret_cast<std::uintptr_t>(m_stack[i]) - reinterpret_cast<std::uintptr_t>(moduleHandle);
+                Log(L"\t\t%ls+0x%llX\n", psf::get_module_path(moduleHandle).filename().c_str(), static_cast<unsigned long long>(offset));
+            }
+            else
+            {
+                Log("\t\t0x%llX\n", static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(m_stack[i])));
+            }
+        }
+    }
+
+    void log_untraced_calls()
+    {
+        if (!m_untracedCalls)
+        {
+            return;
+        }
+
+        if (output_method == trace_method::eventlog)
+        {
+            char message[256];
+            std::snprintf(message, sizeof(message), "%s: %llu call(s) not traced", m_api, m_untracedCalls);
+            Log_ETW_PostMsgA(message);
+        }
+        else
+        {
+            Log("\tNot Traced=%llu (earlier calls to %s left out by sampling or rate limits)\n", m_untracedCalls, m_api);
+        }
+    }
+
+    void write_output()
+    {
+        // Calls that write raw records don't have any text output
+        if (m_output.empty())
+        {
+            return;
+        }
+
+        if (output_method == trace_method::printf)
+        {
+            std::fwrite(m_output.data(), 1, m_output.size(), stdout);
+        }
+        else if (output_method == trace_method::raw)
+        {
+            raw_trace::write_text(m_output.data(), m_output.size());
+        }
+        else
+        {
+            // One message, so that it comes out in one piece
+            psf::log_message(m_output.c_str(), m_output.size());
+        }
+    }
+
     bool m_inhibitOutput;
     bool m_shouldLog;
+    const char* m_api;
+    unsigned long long m_untracedCalls;
+
+    static constexpr DWORD max_stack_size = 32;
+    void* m_stack[max_stack_size];
+    USHORT m_stackSize;
+    std::string m_output;
 };
-inline output_lock acquire_output_lock(function_type type, function_result result)
-{
-    return output_lock(type, result);
-}
+
+// NOTE: Macros so that each call keeps track of whichever API it's for, the same way as LogFunctionEntry. They also pick
+//       up the call's timing from the TickStart/TickEnd that every traced function has. The keyed version is for calls
+//       whose path or key the summary trace method groups them by
+#define acquire_output_lock(type, result) output_lock{ type, result, __FUNCTION__, TickStart, TickEnd }
+#define acquire_keyed_output_lock(type, result, key) output_lock{ type, result, __FUNCTION__, TickStart, TickEnd, summary_key(key) }
 
 // RAII helper for handling the 'traceFunctionEntry' configuration
 struct function_entry_tracker
@@ -578,11 +761,12 @@ struct function_entry_tracker
     // Used for printing function entry/exit separators
     static inline thread_local std::size_t function_call_depth = 0;
 
-    function_entry_tracker(const char* functionName)
+    // NOTE: 'apiName' is the traced API's name, without the "Fixup" suffix of the function that traces it, which the
+    //       macro below trims off at compile time the same way that DECLARE_FIXUP names APIs
+    function_entry_tracker(const char* apiName)
     {
         if (trace_function_entry)
         {
-            std::lock_guard<std::recursive_mutex> lock(g_outputMutex);
             if (!output_lock::processing_output)
             {
                 if (++function_call_depth == 1)
@@ -590,17 +774,7 @@ struct function_entry_tracker
                     Log("vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv\n");
                 }
 
-                // Most functions are named "SomeFunctionFixup" where the target API is "SomeFunction". Logging the API
-                // is much more helpful than the Fixup function name, so remove the "Fixup" suffix, if present
-                using namespace std::literals;
-                constexpr auto fixupSuffix = "Fixup"sv;
-                std::string name = functionName;
-                if ((name.length() >= fixupSuffix.length()) && (name.substr(name.length() - fixupSuffix.length()) == fixupSuffix))
-                {
-                    name.resize(name.length() - fixupSuffix.length());
-                }
-
-                Log("Function Entry: %s\n", name.c_str());
+                Log("Function Entry: %s\n", apiName);
             }
         }
     }
@@ -609,7 +783,6 @@ struct function_entry_tracker
     {
         if (trace_function_entry)
         {
-            std::lock_guard<std::recursive_mutex> lock(g_outputMutex);
             if (!output_lock::processing_output)
             {
                 if (--function_call_depth == 0)
@@ -620,7 +793,7 @@ struct function_entry_tracker
         }
     }
 };
-#define LogFunctionEntry() function_entry_tracker{ __FUNCTION__ }
+#define LogFunctionEntry() function_entry_tracker{ psf::details::make_api_name(__FUNCTION__, '\0').value }
 
 // Logging functions for enums, flags, and other defines
 template <typename T, typename U>
@@ -0,0 +1,420 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// With "moduleTimeline" set, the module loads that happen once the TraceFixup is loaded get recorded, and written out
+// when the process exits as a timeline in the Chrome trace event format (for chrome://tracing, or ui.perfetto.dev). Each
+// event is on the thread that it happened on:
+//      * The LoadLibrary calls, with their calling module and what the search for the module came up with
+//      * Each module getting mapped and unmapped, from the loader's DLL notifications
+//      * Each module's DllMain for DLL_PROCESS_ATTACH. The notification that a module got mapped comes before the loader
+//        calls its entry point, so the entry point that the loader is going to call gets swapped for one that times the
+//        call, and put back as soon as it's called
+//
+// NOTE: The swap goes through the loader's own (undocumented) data for the module, which the loader lock protects. All
+//       of it happens with the loader lock held: in the notifications, and in the entry point itself
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <windows.h>
+#include <winternl.h>
+
+#include <known_folders.h>
+#include <psf_framework.h>
+#include <psf_utils.h>
+#include <utilities.h>
+
+#include "Config.h"
+#include "PreserveError.h"
+
+// From the documentation for LdrRegisterDllNotification; these aren't in any SDK header
+constexpr ULONG LDR_DLL_NOTIFICATION_REASON_LOADED = 1;
+constexpr ULONG LDR_DLL_NOTIFICATION_REASON_UNLOADED = 2;
+
+struct LDR_DLL_NOTIFICATION_DATA
+{
+    ULONG Flags;
+    const UNICODE_STRING* FullDllName;
+    const UNICODE_STRING* BaseDllName;
+    void* DllBase;
+    ULONG SizeOfImage;
+};
+
+using LdrDllNotificationProc = void (CALLBACK*)(ULONG reason, const LDR_DLL_NOTIFICATION_DATA* data, void* context);
+using LdrRegisterDllNotificationProc = NTSTATUS (NTAPI*)(ULONG flags, LdrDllNotificationProc callback, void* context, void** cookie);
+using LdrUnregisterDllNotificationProc = NTSTATUS (NTAPI*)(void* cookie);
+
+using dll_entry_point = BOOL (WINAPI*)(HINSTANCE instance, DWORD reason, LPVOID reserved);
+
+enum class timeline_event_kind
+{
+    load_call,
+    mapped,
+    unmapped,
+    dll_main,
+};
+
+struct timeline_event
+{
+    timeline_event_kind kind;
+    DWORD thread_id;
+    std::int64_t start;
+    std::int64_t end; // Same as start for the notifications
+    const char* api; // load_call only
+    std::wstring name; // The name asked for, for load_call; the module's path otherwise
+    std::wstring module; // The module that load_call ended up with
+    std::wstring caller; // load_call only
+    DWORD error; // load_call's last error; whether DllMain failed, for dll_main
+};
+
+// Plenty for applications that load a few hundred modules; anything past it gets dropped
+constexpr std::size_t max_timeline_events = 64 * 1024;
+
+bool module_timeline_enabled = false;
+
+static SRWLOCK g_timelineLock = SRWLOCK_INIT;
+static std::vector<timeline_event> g_timeline;
+static std::wstring g_timelinePath;
+static std::int64_t g_timelineStart = 0;
+static void* g_timelineCookie = nullptr;
+
+// The entry points that have been swapped for timed_dll_main, by module. Only touched with the loader lock held
+struct swapped_entry_point
+{
+    LDR_DATA_TABLE_ENTRY* entry;
+    dll_entry_point original;
+};
+static std::unordered_map<void*, swapped_entry_point> g_swappedEntryPoints;
+
+// NOTE: winternl.h leaves the entry point as the first of 'Reserved3'
+static void*& entry_point_of(LDR_DATA_TABLE_ENTRY* entry) noexcept
+{
+    return entry->Reserved3[0];
+}
+
+static void add_event(timeline_event&& event) noexcept try
+{
+    ::AcquireSRWLockExclusive(&g_timelineLock);
+    if (g_timeline.size() < max_timeline_events)
+    {
+        g_timeline.push_back(std::move(event));
+    }
+    ::ReleaseSRWLockExclusive(&g_timelineLock);
+}
+catch (...)
+{
+    // Out of memory; the event just doesn't make it into the timeline
+    ::ReleaseSRWLockExclusive(&g_timelineLock);
+}
+
+static BOOL WINAPI timed_dll_main(HINSTANCE instance, DWORD reason, LPVOID reserved)
+{
+    auto itr = g_swappedEntryPoints.find(instance);
+    if (itr == g_swappedEntryPoints.end())
+    {
+        // Only ever the entry point of modules that are in the table
+        return TRUE;
+    }
+
+    // Calls for anything other than DLL_PROCESS_ATTACH go straight to the module from here on
+    auto [entry, original] = itr->second;
+    entry_point_of(entry) = reinterpret_cast<void*>(original);
+    g_swappedEntryPoints.erase(itr);
+
+    LARGE_INTEGER start, end;
+    ::QueryPerformanceCounter(&start);
+    auto result = original(instance, reason, reserved);
+    ::QueryPerformanceCounter(&end);
+
+    if (reason == DLL_PROCESS_ATTACH)
+    {
+        preserve_last_error preserveError;
+        timeline_event event{ timeline_event_kind::dll_main, ::GetCurrentThreadId(), start.QuadPart, end.QuadPart };
+        event.name.assign(entry->FullDllName.Buffer, entry->FullDllName.Length / sizeof(wchar_t));
+        event.error = result ? ERROR_SUCCESS : ERROR_DLL_INIT_FAILED;
+        add_event(std::move(event));
+    }
+
+    return result;
+}
+
+static void swap_entry_point(void* dllBase) noexcept try
+{
+    auto ldr = NtCurrentTeb()->ProcessEnvironmentBlock->Ldr;
+    auto head = &ldr->InMemoryOrderModuleList;
+    for (auto link = head->Flink; link != head; link = link->Flink)
+    {
+        auto entry = CONTAINING_RECORD(link, LDR_DATA_TABLE_ENTRY, InMemoryOrderLinks);
+        if (entry->DllBase == dllBase)
+        {
+            // Resource only modules have no entry point to time
+            if (auto original = entry_point_of(entry))
+            {
+                g_swappedEntryPoints[dllBase] = { entry, reinterpret_cast<dll_entry_point>(original) };
+                entry_point_of(entry) = reinterpret_cast<void*>(&timed_dll_main);
+            }
+            return;
+        }
+    }
+}
+catch (...)
+{
+    // Out of memory; the module's DllMain just doesn't get timed
+}
+
+static void CALLBACK timeline_dll_notification(ULONG reason, const LDR_DLL_NOTIFICATION_DATA* data, void*) noexcept try
+{
+    preserve_last_error preserveError;
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+
+    auto kind = (reason == LDR_DLL_NOTIFICATION_REASON_LOADED) ? timeline_event_kind::mapped : timeline_event_kind::unmapped;
+    timeline_event event{ kind, ::GetCurrentThreadId(), now.QuadPart, now.QuadPart };
+    event.name.assign(data->FullDllName->Buffer, data->FullDllName->Length / sizeof(wchar_t));
+    add_event(std::move(event));
+
+    if (reason == LDR_DLL_NOTIFICATION_REASON_LOADED)
+    {
+        swap_entry_point(data->DllBase);
+    }
+    else if (reason == LDR_DLL_NOTIFICATION_REASON_UNLOADED)
+    {
+        // E.g. a module that failed to load before getting initialized
+        g_swappedEntryPoints.erase(data->DllBase);
+    }
+}
+catch (...)
+{
+}
+
+// The timeline defaults to %LocalAppData%\PsfTraces\<executable>-<process id>-timeline.json
+void start_module_timeline(const psf::json_object& configObj)
+{
+    std::filesystem::path path;
+    if (auto timelineFile = configObj.try_get("moduleTimelineFile"))
+    {
+        path = timelineFile->as_string().wide();
+    }
+    else
+    {
+        path = ::PSFQueryKnownFolder(FOLDERID_LocalAppData) / L"PsfTraces" /
+            (psf::current_executable_path().stem().native() + L"-" + std::to_wstring(::GetCurrentProcessId()) + L"-timeline.json");
+    }
+    g_timelinePath = path.native();
+    g_timeline.reserve(1024);
+
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+    g_timelineStart = now.QuadPart;
+
+    // Without the notifications, there are still the LoadLibrary calls
+    auto ntdll = ::GetModuleHandleW(L"ntdll.dll");
+    auto registerNotification = reinterpret_cast<LdrRegisterDllNotificationProc>(::GetProcAddress(ntdll, "LdrRegisterDllNotification"));
+    if (!registerNotification || !NT_SUCCESS(registerNotification(0, timeline_dll_notification, nullptr, &g_timelineCookie)))
+    {
+        g_timelineCookie = nullptr;
+    }
+
+    module_timeline_enabled = true;
+}
+
+void timeline_module_load(const char* api, const wchar_t* name, HMODULE result, DWORD error, const void* caller,
+    LARGE_INTEGER start, LARGE_INTEGER end) noexcept try
+{
+    preserve_last_error preserveError;
+    timeline_event event{ timeline_event_kind::load_call, ::GetCurrentThreadId(), start.QuadPart, end.QuadPart, api };
+    event.name = name ? name : L"";
+    if (result)
+    {
+        event.module = psf::get_module_path(result).native();
+    }
+
+    HMODULE callerModule;
+    if (::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+        static_cast<const wchar_t*>(caller), &callerModule))
+    {
+        event.caller = psf::get_module_path(callerModule).native();
+    }
+
+    event.error = error;
+    add_event(std::move(event));
+}
+catch (...)
+{
+}
+
+void timeline_module_load(const char* api, const char* name, HMODULE result, DWORD error, const void* caller,
+    LARGE_INTEGER start, LARGE_INTEGER end) noexcept try
+{
+    timeline_module_load(api, name ? widen(name, CP_ACP).c_str() : nullptr, result, error, caller, start, end);
+}
+catch (...)
+{
+}
+
+static void append_json_string(std::string& json, std::wstring_view value)
+{
+    json += '"';
+    for (auto ch : narrow(value))
+    {
+        switch (ch)
+        {
+        case '"': json += "\\\""; break;
+        case '\\': json += "\\\\"; break;
+        case '\n': json += "\\n"; break;
+        case '\r': json += "\\r"; break;
+        case '\t': json += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(ch) < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                json += escaped;
+            }
+            else
+            {
+                json += ch;
+            }
+            break;
+        }
+    }
+    json += '"';
+}
+
+static std::wstring_view file_name_of(std::wstring_view path) noexcept
+{
+    auto pos = path.find_last_of(L"\\/");
+    return (pos == std::wstring_view::npos) ? path : path.substr(pos + 1);
+}
+
+// Ordered by when each event started. Called with the timeline lock held
+static std::string format_timeline()
+{
+    std::stable_sort(g_timeline.begin(), g_timeline.end(), [](auto& lhs, auto& rhs) { return lhs.start < rhs.start; });
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    auto microseconds = [&](std::int64_t ticks)
+    {
+        return static_cast<double>(ticks) * 1000000.0 / static_cast<double>(frequency.QuadPart);
+    };
+
+    auto processId = ::GetCurrentProcessId();
+    char buffer[256];
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    std::snprintf(buffer, sizeof(buffer), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":", processId);
+    json += buffer;
+    append_json_string(json, psf::current_executable_path().filename().native());
+    json += "}}";
+
+    for (auto& event : g_timeline)
+    {
+        const char* category = "";
+        const char* name = "";
+        switch (event.kind)
+        {
+        case timeline_event_kind::load_call: category = "LoadLibrary"; name = event.api; break;
+        case timeline_event_kind::mapped: category = "Loader"; name = "Mapped"; break;
+        case timeline_event_kind::unmapped: category = "Loader"; name = "Unmapped"; break;
+        case timeline_event_kind::dll_main: category = "DllMain"; name = "DllMain"; break;
+        }
+
+        json += ",\n{\"name\":";
+        append_json_string(json, widen(name) + L" " + std::wstring(file_name_of(event.name)));
+        if (event.end > event.start)
+        {
+            std::snprintf(buffer, sizeof(buffer), ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{",
+                category, microseconds(event.start - g_timelineStart), microseconds(event.end - event.start), processId, event.thread_id);
+        }
+        else
+        {
+            std::snprintf(buffer, sizeof(buffer), ",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{",
+                category, microseconds(event.start - g_timelineStart), processId, event.thread_id);
+        }
+        json += buffer;
+
+        json += (event.kind == timeline_event_kind::load_call) ? "\"Name\":" : "\"Path\":";
+        append_json_string(json, event.name);
+        if (!event.module.empty())
+        {
+            json += ",\"Module\":";
+            append_json_string(json, event.module);
+        }
+        if (!event.caller.empty())
+        {
+            json += ",\"Caller\":";
+            append_json_string(json, event.caller);
+        }
+
+        if ((event.kind == timeline_event_kind::load_call) || (event.kind == timeline_event_kind::dll_main))
+        {
+            std::snprintf(buffer, sizeof(buffer), ",\"Error\":%u", event.error);
+            json += buffer;
+        }
+        json += "}}";
+    }
+
+    json += "\n]}\n";
+    return json;
+}
+
+// Called when the process exits
+void write_module_timeline() noexcept try
+{
+    if (!module_timeline_enabled)
+    {
+        return;
+    }
+    module_timeline_enabled = false;
+
+    if (g_timelineCookie)
+    {
+        auto ntdll = ::GetModuleHandleW(L"ntdll.dll");
+        if (auto unregisterNotification = reinterpret_cast<LdrUnregisterDllNotificationProc>(::GetProcAddress(ntdll, "LdrUnregisterDllNotification")))
+        {
+            unregisterNotification(g_timelineCookie);
+        }
+    }
+
+    // Modules that got mapped but never initialized shouldn't be left calling into us once we're gone
+    for (auto& [dllBase, swapped] : g_swappedEntryPoints)
+    {
+        entry_point_of(swapped.entry) = reinterpret_cast<void*>(swapped.original);
+    }
+    g_swappedEntryPoints.clear();
+
+    std::string json;
+    ::AcquireSRWLockExclusive(&g_timelineLock);
+    try
+    {
+        json = format_timeline();
+    }
+    catch (...)
+    {
+    }
+    ::ReleaseSRWLockExclusive(&g_timelineLock);
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(g_timelinePath).parent_path(), ec);
+    auto file = ::CreateFileW(g_timelinePath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (!json.empty() && (file != INVALID_HANDLE_VALUE))
+    {
+        DWORD written;
+        ::WriteFile(file, json.data(), static_cast<DWORD>(json.size()), &written, nullptr);
+    }
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(file);
+    }
+}
+catch (...)
+{
+}
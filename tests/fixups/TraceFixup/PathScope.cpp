@@ -0,0 +1,236 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// With "includePaths" and/or "excludePaths", only the file calls for paths under an included path, and not under an
+// excluded one, get traced. The configured paths get compiled into a case-insensitive trie of path components, the same
+// as the FileRedirectionFixup does for its base paths, so deciding whether a call is in scope is a single walk of its
+// path argument, before the call gets timed, captured, or takes the output lock. E.g. including "C:\Contoso" and
+// excluding "C:\Contoso\Cache" gets represented as the node chain "C:" -> "Contoso" (included) -> "Cache" (excluded),
+// and whichever of those is the deepest one that a path goes through decides for it.
+//
+// Paths that can't be placed without normalizing them first (relative paths, and anything with a ".." component) are
+// always in scope, since it's better to trace a little too much than to miss the call that's being looked for
+
+#include <cwchar>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <windows.h>
+
+#include <dos_paths.h>
+#include <path_buffer.h>
+#include <psf_framework.h>
+#include <utilities.h>
+
+#include "Config.h"
+#include "Logging.h"
+
+enum class path_scope
+{
+    unspecified,
+    included,
+    excluded,
+};
+
+struct path_scope_node
+{
+    std::wstring name;
+    path_scope scope = path_scope::unspecified;
+    std::vector<path_scope_node> children;
+
+    const path_scope_node* try_get_child(std::wstring_view component) const noexcept
+    {
+        for (auto& child : children)
+        {
+            if ((child.name.length() == component.length()) &&
+                psf::path_equal(component.data(), child.name.c_str(), component.length()))
+            {
+                return &child;
+            }
+        }
+
+        return nullptr;
+    }
+
+    path_scope_node& get_or_add_child(std::wstring_view component)
+    {
+        for (auto& child : children)
+        {
+            if ((child.name.length() == component.length()) &&
+                psf::path_equal(component.data(), child.name.c_str(), component.length()))
+            {
+                return child;
+            }
+        }
+
+        return children.emplace_back(path_scope_node{ std::wstring(component) });
+    }
+};
+
+bool path_scope_enabled = false;
+
+// UNC paths hang off of a child with an empty name, since no drive's component can be empty
+static path_scope_node g_pathScopeRoot;
+static bool g_hasIncludedPaths = false;
+
+// Calls 'func' for each component of 'path', starting with the drive ("C:") or an empty component for UNC paths. Returns
+// false, possibly part way through, if 'path' isn't absolute or has a ".." component
+template <typename Func>
+static bool for_each_path_component(std::wstring_view path, Func&& func)
+{
+    // The Win32 and NT prefixes, e.g. "\\?\C:\..." and "\??\C:\...", don't change what the path is for
+    if ((path.length() >= 4) && psf::is_path_separator(path[0]) && ((path[1] == L'?') || psf::is_path_separator(path[1])) &&
+        ((path[2] == L'?') || (path[2] == L'.')) && psf::is_path_separator(path[3]))
+    {
+        path.remove_prefix(4);
+        if ((path.length() >= 4) && psf::path_equal(path.data(), L"UNC\\", 4))
+        {
+            path.remove_prefix(4);
+            if (!func(std::wstring_view{}))
+            {
+                return true;
+            }
+        }
+        else if ((path.length() < 2) || (path[1] != L':'))
+        {
+            return false;
+        }
+    }
+    else if ((path.length() >= 2) && psf::is_path_separator(path[0]) && psf::is_path_separator(path[1]))
+    {
+        path.remove_prefix(2);
+        if (!func(std::wstring_view{}))
+        {
+            return true;
+        }
+    }
+    else if ((path.length() < 2) || (path[1] != L':') || ((path.length() > 2) && !psf::is_path_separator(path[2])))
+    {
+        // Relative, rooted on the current drive, or drive-relative (e.g. "C:foo")
+        return false;
+    }
+
+    while (!path.empty())
+    {
+        std::size_t length = 0;
+        while ((length < path.length()) && !psf::is_path_separator(path[length]))
+        {
+            ++length;
+        }
+
+        auto component = path.substr(0, length);
+        path.remove_prefix((length < path.length()) ? length + 1 : length);
+        if (component.empty() || (component == L"."))
+        {
+            continue;
+        }
+        else if (component == L"..")
+        {
+            return false;
+        }
+        else if (!func(component))
+        {
+            return true;
+        }
+    }
+
+    return true;
+}
+
+static void add_scope_paths(const psf::json_object& configObj, const char* key, path_scope scope)
+{
+    auto value = configObj.try_get(key);
+    if (!value)
+    {
+        return;
+    }
+
+    for (auto& pathValue : value->as_array())
+    {
+        // E.g. "%LOCALAPPDATA%\Contoso". Anything still relative after that is relative to the package root
+        auto configuredPath = pathValue.as_string().wide();
+        std::wstring expandedPath(MAX_PATH, L'\0');
+        auto length = ::ExpandEnvironmentStringsW(configuredPath, expandedPath.data(), static_cast<DWORD>(expandedPath.size()));
+        if (length > expandedPath.size())
+        {
+            expandedPath.resize(length);
+            length = ::ExpandEnvironmentStringsW(configuredPath, expandedPath.data(), length);
+        }
+        expandedPath.resize(length ? length - 1 : 0);
+
+        std::filesystem::path path(expandedPath);
+        if (path.is_relative())
+        {
+            path = ::PSFQueryPackageRootPath() / path;
+        }
+
+        auto node = &g_pathScopeRoot;
+        if (!for_each_path_component(path.native(), [&](std::wstring_view component)
+        {
+            node = &node->get_or_add_child(component);
+            return true;
+        }))
+        {
+            Log(L"config %hs path \"%ls\" is ignored, since it is not absolute\n", key, path.c_str());
+            continue;
+        }
+
+        // NOTE: A path that's in both lists is excluded
+        if (node->scope != path_scope::excluded)
+        {
+            node->scope = scope;
+        }
+        g_hasIncludedPaths |= (scope == path_scope::included);
+        path_scope_enabled = true;
+    }
+}
+
+void configure_path_scope(const psf::json_object& configObj)
+{
+    add_scope_paths(configObj, "includePaths", path_scope::included);
+    add_scope_paths(configObj, "excludePaths", path_scope::excluded);
+}
+
+bool path_in_scope(const wchar_t* path, std::size_t length) noexcept try
+{
+    auto scope = g_hasIncludedPaths ? path_scope::excluded : path_scope::included;
+    auto node = &g_pathScopeRoot;
+    if (!for_each_path_component(std::wstring_view(path, length), [&](std::wstring_view component)
+    {
+        node = node->try_get_child(component);
+        if (!node)
+        {
+            return false;
+        }
+        else if (node->scope != path_scope::unspecified)
+        {
+            scope = node->scope;
+        }
+
+        return true;
+    }))
+    {
+        return true;
+    }
+
+    return scope == path_scope::included;
+}
+catch (...)
+{
+    return true;
+}
+
+bool path_in_scope(const char* path) noexcept
+{
+    psf::path_buffer widePath;
+    if (try_widen_into(path, widePath, CP_ACP) != ERROR_SUCCESS)
+    {
+        return true;
+    }
+
+    return path_in_scope(widePath.c_str(), widePath.length());
+}
@@ -0,0 +1,451 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// The "raw" trace method. Rather than turning every argument into text while the application waits (decoding flags,
+// looking up error messages, querying key and file paths), traced calls copy the raw argument values and strings into
+// a compact binary record, and the TraceDecoder tool turns a file of those records into the same output that the printf
+// method would have given. Each record is built in a buffer of the calling thread's and then goes through the same
+// per-thread lock-free rings as the rest of the logging (see psf_logging.h), which write them out to the trace file on a
+// background thread. The file is a sequence of records:
+//      record_header, operation name (UTF-8), then value_count times: value_header, value name, payload
+// Strings are copied as they are (narrow or UTF-16), numbers as 64-bit values, alongside how the decoder should show
+// them. Calls that haven't been converted to raw records still work; their text output gets wrapped in a text record.
+// Records from the same thread are in the order that they were written; records from different threads aren't.
+//
+// NOTE: This header is shared with the TraceDecoder, which only uses the format
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+
+#include <windows.h>
+
+#include <psf_logging.h>
+#include <psf_utils.h>
+#include <utilities.h>
+
+#include "Config.h"
+
+namespace raw_trace
+{
+    constexpr std::uint32_t format_version = 1;
+
+    enum class record_kind : std::uint8_t
+    {
+        // Written once, when the trace starts. Values are "Version", "ProcessId" and "Frequency" (of the tick counts)
+        file_header,
+
+        // A traced call
+        call,
+
+        // Text output from something that doesn't write raw records, in a single "Text" value
+        text,
+
+        // A module that call records' callers are in. The operation name is the module's path, 'caller' its base
+        // address, and there's a single "Size" value
+        module,
+    };
+
+    enum class value_kind : std::uint8_t
+    {
+        string, // Narrow characters, not null terminated
+        wide_string, // UTF-16, not null terminated
+        number, // std::uint64_t
+        blob, // Raw bytes; the decoder is what gives them meaning
+        wide_blob, // Same, but from the wide version of the function (e.g. registry data of the W functions)
+    };
+
+    // How the decoder should show a value. Each corresponds to one of the Log* functions in Logging.h/WinternlLogging.h
+    enum class decoder : std::uint8_t
+    {
+        hex,
+        decimal,
+        boolean,
+        win32_error,
+        ntstatus,
+        hresult,
+        generic_access,
+        file_access,
+        directory_access,
+        share_mode,
+        creation_disposition,
+        creation_disposition_internal,
+        file_flags_and_attributes,
+        file_attributes,
+        file_flags,
+        sqos,
+        file_info_level,
+        file_create_options,
+        object_attributes,
+        reg_key_flags,
+        reg_key_access,
+        reg_key_type,
+        reg_value, // Blob; needs the "Type" value that comes before it
+        function_result, // Where the call's result goes in the output, relative to the other values
+
+        // Handles, so that the decoder can show the paths that they were opened with instead of having the application
+        // look them up. A handle that a call returns gets the path of the call's "Path" value, plus the "Sub Key" value,
+        // if any, appended to the path of the "Root" or "Key" handle it was relative to
+        opened_handle,
+        root_handle,
+    };
+
+#pragma pack(push, 1)
+    struct record_header
+    {
+        std::uint32_t size; // Of the whole record, this header included
+        record_kind kind;
+        std::uint8_t result; // function_result, for calls
+        std::uint16_t name_length;
+        std::uint16_t value_count;
+        std::uint16_t reserved;
+        std::uint32_t thread_id;
+        std::int64_t start; // QueryPerformanceCounter ticks
+        std::int64_t end;
+        std::uint64_t caller; // Return address of the call, or zero when it isn't traced
+    };
+
+    struct value_header
+    {
+        value_kind kind;
+        decoder how;
+        std::uint8_t name_length;
+        std::uint8_t reserved;
+        std::uint32_t length; // Of the payload, in bytes
+    };
+#pragma pack(pop)
+
+    // Big enough for any call's arguments, while keeping the per-thread buffer small. Strings and blobs that don't fit get
+    // cut short
+    constexpr std::size_t max_record_size = 4096;
+
+    // The "file" trace method writes the same records into a file that's mapped into memory as a ring, rather than
+    // through the logging's rings and background thread. Writing a record is a single atomic add to reserve its space
+    // and a copy, with no system calls, and the pages get written out by the system even if the process crashes. Once
+    // the ring is full, new records overwrite the oldest. The file is laid out as:
+    //      ring_file_header, padded to ring_modules_offset
+    //      ring_module_count times ring_module, for the modules that calls come from (they'd get overwritten in the ring)
+    //      the ring itself, 'capacity' bytes of ring_entry_header + record, each aligned to ring_alignment
+    // An entry's 'end' gets written last, and only counts when it's where the entry ends in the file's total of bytes
+    // written, so that the decoder can tell complete entries from ones that are still being written, got cut short by a
+    // crash, or are left over from an earlier pass around the ring
+    constexpr char ring_file_magic[8] = { 'P', 'S', 'F', 'R', 'I', 'N', 'G', '\0' };
+    constexpr std::uint32_t ring_format_version = 1;
+    constexpr std::size_t ring_alignment = 16;
+    constexpr std::size_t ring_module_count = 512;
+    constexpr std::uint64_t ring_modules_offset = 4096;
+
+    // NOTE: Laid out the same for 32-bit and 64-bit processes
+    struct ring_file_header
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t process_id;
+        std::int64_t frequency;
+        std::uint64_t capacity;
+        std::uint64_t ring_offset; // From the start of the file
+        std::uint64_t write_offset; // Total bytes ever reserved in the ring
+    };
+
+    struct ring_module
+    {
+        std::uint64_t base; // Written last; zero for an unused entry
+        std::uint64_t size;
+        char path[496]; // Null terminated, cut short if need be
+    };
+
+    struct ring_entry_header
+    {
+        std::uint64_t end;
+        std::uint32_t length; // Of the record that follows
+        std::uint32_t reserved;
+    };
+
+    constexpr std::uint64_t ring_entry_size(std::size_t recordLength)
+    {
+        return (sizeof(ring_entry_header) + recordLength + ring_alignment - 1) & ~static_cast<std::uint64_t>(ring_alignment - 1);
+    }
+
+    class ring_file
+    {
+    public:
+
+        // Null unless the "file" trace method is in use
+        static ring_file* instance() noexcept
+        {
+            return s_instance;
+        }
+
+        // 'view' is the whole file, mapped, with the header already filled in. It stays mapped until the process exits
+        static void start(void* view) noexcept
+        {
+            static ring_file ring;
+            ring.m_header = static_cast<ring_file_header*>(view);
+            ring.m_modules = reinterpret_cast<ring_module*>(static_cast<char*>(view) + ring_modules_offset);
+            ring.m_ring = static_cast<char*>(view) + ring.m_header->ring_offset;
+            ring.m_capacity = ring.m_header->capacity;
+            s_instance = &ring;
+        }
+
+        void write(const void* data, std::size_t length) noexcept
+        {
+            auto size = ring_entry_size(length);
+            if (size > m_capacity)
+            {
+                return;
+            }
+
+            auto offset = static_cast<std::uint64_t>(::InterlockedExchangeAdd64(reinterpret_cast<volatile LONG64*>(&m_header->write_offset), size));
+            auto position = offset % m_capacity;
+            auto entry = reinterpret_cast<ring_entry_header*>(m_ring + position);
+            entry->length = static_cast<std::uint32_t>(length);
+            entry->reserved = 0;
+
+            // The entry header never wraps, since both it and the ring are multiples of the alignment, but the record can
+            auto start = (position + sizeof(ring_entry_header)) % m_capacity;
+            auto first = (std::min)(static_cast<std::uint64_t>(length), m_capacity - start);
+            std::memcpy(m_ring + start, data, static_cast<std::size_t>(first));
+            std::memcpy(m_ring, static_cast<const char*>(data) + first, static_cast<std::size_t>(length - first));
+
+            ::InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&entry->end), static_cast<LONG64>(offset + size));
+        }
+
+        void set_module(std::size_t index, std::uint64_t base, std::uint64_t size, const char* path, std::size_t pathLength) noexcept
+        {
+            auto& module = m_modules[index % ring_module_count];
+            pathLength = (std::min)(pathLength, sizeof(module.path) - 1);
+            std::memcpy(module.path, path, pathLength);
+            module.path[pathLength] = '\0';
+            module.size = size;
+            ::InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&module.base), static_cast<LONG64>(base));
+        }
+
+    private:
+
+        static inline ring_file* s_instance = nullptr;
+
+        ring_file_header* m_header = nullptr;
+        ring_module* m_modules = nullptr;
+        char* m_ring = nullptr;
+        std::uint64_t m_capacity = 0;
+    };
+
+    // Builds a record in the calling thread's buffer and logs it. Use might look like:
+    //      raw_trace::record("CreateFile", functionResult, TickStart, TickEnd, _ReturnAddress())
+    //          .string("Path", fileName)
+    //          .number("Access", desiredAccess, raw_trace::decoder::generic_access)
+    //          .write();
+    // Nothing here allocates or formats anything, and nothing fails; the worst that can happen is a truncated value
+    class record
+    {
+    public:
+
+        record(const char* operation, function_result result, LARGE_INTEGER start, LARGE_INTEGER end, const void* caller) noexcept :
+            record(s_buffer, record_kind::call, operation, std::strlen(operation), result, start, end, trace_calling_module ? caller : nullptr)
+        {
+        }
+
+        record(char* buffer, record_kind kind, const char* name, std::size_t nameLength, function_result result, LARGE_INTEGER start, LARGE_INTEGER end, const void* caller) noexcept :
+            m_buffer(buffer)
+        {
+            auto& header = this->header();
+            header.kind = kind;
+            header.result = static_cast<std::uint8_t>(result);
+            header.value_count = 0;
+            header.reserved = 0;
+            header.thread_id = ::GetCurrentThreadId();
+            header.start = start.QuadPart;
+            header.end = end.QuadPart;
+            header.caller = reinterpret_cast<std::uintptr_t>(caller);
+
+            m_size = sizeof(record_header);
+            header.name_length = static_cast<std::uint16_t>(append(name, nameLength));
+        }
+
+        record(const record&) = delete;
+        record& operator=(const record&) = delete;
+
+        static char* thread_buffer() noexcept
+        {
+            return s_buffer;
+        }
+
+        record& string(const char* name, const char* value) noexcept
+        {
+            return string(name, value, value ? std::strlen(value) : 0);
+        }
+
+        record& string(const char* name, const char* value, std::size_t length) noexcept
+        {
+            return add(value_kind::string, decoder::hex, name, value, length);
+        }
+
+        record& string(const char* name, const wchar_t* value) noexcept
+        {
+            return counted_string(name, value, value ? std::wcslen(value) : 0);
+        }
+
+        // E.g. UNICODE_STRINGs; 'length' is in characters
+        record& counted_string(const char* name, const wchar_t* value, std::size_t length) noexcept
+        {
+            return add(value_kind::wide_string, decoder::hex, name, value, length * sizeof(wchar_t));
+        }
+
+        record& number(const char* name, std::uint64_t value, decoder how = decoder::hex) noexcept
+        {
+            return add(value_kind::number, how, name, &value, sizeof(value));
+        }
+
+        record& handle(const char* name, const void* value, decoder how = decoder::hex) noexcept
+        {
+            return number(name, reinterpret_cast<std::uintptr_t>(value), how);
+        }
+
+        template <typename CharT>
+        record& blob(const char* name, const void* data, std::size_t size, decoder how) noexcept
+        {
+            constexpr auto kind = (sizeof(CharT) == sizeof(wchar_t)) ? value_kind::wide_blob : value_kind::blob;
+            return add(kind, how, name, data, data ? size : 0);
+        }
+
+        void write() noexcept
+        {
+            header().size = static_cast<std::uint32_t>(m_size);
+            if (auto caller = header().caller)
+            {
+                note_module(reinterpret_cast<const void*>(caller));
+            }
+
+            if (auto ring = ring_file::instance())
+            {
+                ring->write(m_buffer, m_size);
+            }
+            else
+            {
+                // NOTE: The log file is what the records go to; they're never null terminated text
+                psf::log_message(m_buffer, m_size);
+            }
+        }
+
+    private:
+
+        record_header& header() noexcept
+        {
+            return *reinterpret_cast<record_header*>(m_buffer);
+        }
+
+        std::size_t append(const void* data, std::size_t length) noexcept
+        {
+            length = (length < max_record_size - m_size) ? length : (max_record_size - m_size);
+            if (length)
+            {
+                std::memcpy(m_buffer + m_size, data, length);
+                m_size += length;
+            }
+            return length;
+        }
+
+        record& add(value_kind kind, decoder how, const char* name, const void* data, std::size_t length) noexcept
+        {
+            auto nameLength = std::strlen(name);
+            if (m_size + sizeof(value_header) + nameLength > max_record_size)
+            {
+                return *this;
+            }
+
+            auto valueOffset = m_size;
+            value_header value = { kind, how, static_cast<std::uint8_t>(nameLength), 0, 0 };
+            append(&value, sizeof(value));
+            append(name, nameLength);
+
+            // Keep UTF-16 strings whole characters when they get cut short
+            auto payloadLength = append(data, length);
+            if ((kind == value_kind::wide_string) && (payloadLength % sizeof(wchar_t)))
+            {
+                --m_size;
+                --payloadLength;
+            }
+            reinterpret_cast<value_header*>(m_buffer + valueOffset)->length = static_cast<std::uint32_t>(payloadLength);
+
+            ++header().value_count;
+            return *this;
+        }
+
+        // The decoder can't look up which module an address is in, so each module that calls come from gets a record of
+        // its own the first time that it's seen, ahead of the call record. Once the table is full, callers in modules that
+        // aren't in it just don't get a name
+        static void note_module(const void* caller) noexcept
+        {
+            HMODULE moduleHandle;
+            if (!::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                reinterpret_cast<const wchar_t*>(caller), &moduleHandle))
+            {
+                return;
+            }
+
+            auto base = reinterpret_cast<std::uintptr_t>(moduleHandle);
+            auto index = (base >> 16) % module_table_size;
+            for (std::size_t i = 0; ; ++i, index = (index + 1) % module_table_size)
+            {
+                if (i == module_table_size)
+                {
+                    return;
+                }
+
+                std::uintptr_t entry = 0;
+                if (s_modules[index].compare_exchange_strong(entry, base, std::memory_order_relaxed))
+                {
+                    break;
+                }
+                else if (entry == base)
+                {
+                    return;
+                }
+            }
+
+            try
+            {
+                auto path = narrow(psf::get_module_path(moduleHandle).native());
+                auto dosHeader = reinterpret_cast<const IMAGE_DOS_HEADER*>(moduleHandle);
+                auto ntHeaders = reinterpret_cast<const IMAGE_NT_HEADERS*>(reinterpret_cast<const std::uint8_t*>(moduleHandle) + dosHeader->e_lfanew);
+                if (auto ring = ring_file::instance())
+                {
+                    ring->set_module(index, base, ntHeaders->OptionalHeader.SizeOfImage, path.c_str(), path.length());
+                    return;
+                }
+
+                // Not the thread's buffer, since that's where the call record is waiting
+                char buffer[max_record_size];
+                record moduleRecord(buffer, record_kind::module, path.c_str(), path.length(), function_result::indeterminate, {}, {}, moduleHandle);
+                moduleRecord.number("Size", ntHeaders->OptionalHeader.SizeOfImage);
+                moduleRecord.header().size = static_cast<std::uint32_t>(moduleRecord.m_size);
+                psf::log_message(buffer, moduleRecord.m_size);
+            }
+            catch (...)
+            {
+            }
+        }
+
+        static constexpr std::size_t module_table_size = ring_module_count;
+        static inline std::atomic<std::uintptr_t> s_modules[module_table_size] = {};
+
+        static inline thread_local char s_buffer[max_record_size];
+
+        char* m_buffer;
+        std::size_t m_size;
+    };
+
+    // For output from everything that doesn't write records of its own
+    inline void write_text(const char* text, std::size_t length) noexcept
+    {
+        record(record::thread_buffer(), record_kind::text, "", 0, function_result::indeterminate, {}, {}, nullptr)
+            .string("Text", text, length)
+            .write();
+    }
+}
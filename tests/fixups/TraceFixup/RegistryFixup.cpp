@@ -3,30 +3,76 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <unordered_map>
+
 #include <psf_framework.h>
 
 #include "Config.h"
 #include "FunctionImplementations.h"
 #include "Logging.h"
 #include "PreserveError.h"
+#include "WinternlLogging.h"
+
+// Registry heavy applications read values far more often than they open keys, so the full paths of the keys opened or
+// created through the hooks get looked up once, when they're opened, instead of on every call made on them. Entries are
+// dropped when the key gets closed with RegCloseKey.
+// NOTE: A key closed some other way (e.g. CloseHandle) leaves its entry behind until a later open reuses the handle
+static SRWLOCK g_keyPathsLock = SRWLOCK_INIT;
+static std::unordered_map<HANDLE, std::wstring> g_keyPaths;
+
+void CacheKeyPath(HANDLE key)
+{
+    // Calls on the key only get traced when registry calls do; not when they've been left out with "ignore"
+    if (!key || !configured_result(function_type::registry, function_result::failure).should_log)
+    {
+        return;
+    }
+
+    std::wstring path;
+    if (QueryKeyPath(key, path))
+    {
+        ::AcquireSRWLockExclusive(&g_keyPathsLock);
+        g_keyPaths[key] = std::move(path);
+        ::ReleaseSRWLockExclusive(&g_keyPathsLock);
+    }
+}
+
+void UncacheKeyPath(HANDLE key)
+{
+    ::AcquireSRWLockExclusive(&g_keyPathsLock);
+    g_keyPaths.erase(key);
+    ::ReleaseSRWLockExclusive(&g_keyPathsLock);
+}
+
+bool TryGetCachedKeyPath(HANDLE key, std::wstring& result)
+{
+    ::AcquireSRWLockShared(&g_keyPathsLock);
+    auto itr = g_keyPaths.find(key);
+    auto found = (itr != g_keyPaths.end());
+    if (found)
+    {
+        result = itr->second;
+    }
+    ::ReleaseSRWLockShared(&g_keyPathsLock);
+    return found;
+}
 
 void LogKeyPath(HKEY key, const char* msg = "Key")
 {
-    ULONG size;
-    if (auto status = impl::NtQueryKey(key, winternl::KeyNameInformation, nullptr, 0, &size);
-        (status == STATUS_BUFFER_TOO_SMALL) || (status == STATUS_BUFFER_OVERFLOW))
+    std::wstring path;
+    if (TryGetKeyPath(key, path))
     {
-        auto buffer = std::make_unique<std::uint8_t[]>(size);
-        if (NT_SUCCESS(impl::NtQueryKey(key, winternl::KeyNameInformation, buffer.get(), size, &size)))
-        {
-            auto info = reinterpret_cast<winternl::PKEY_NAME_INFORMATION>(buffer.get());
-            LogCountedString(msg, info->Name, info->NameLength / 2);
-        }
+        LogCountedString(msg, path.c_str(), path.length());
     }
 }
 std::string InterpretKeyPath(HKEY key, const char* msg = "Key")
 {
 	std::string sret = "";
+	if (std::wstring path; TryGetCachedKeyPath(key, path))
+	{
+		return InterpretCountedString(msg, path.c_str(), path.length());
+	}
+
 	ULONG size;
 	auto status = impl::NtQueryKey(key, winternl::KeyNameInformation, nullptr, 0, &size);
 	if ((status == STATUS_BUFFER_TOO_SMALL) || (status == STATUS_BUFFER_OVERFLOW))
@@ -65,6 +111,11 @@ LSTATUS __stdcall RegCreateKeyFixup(_In_ HKEY key, _In_opt_ const CharT* subKey,
 	QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32(result);
+    if (function_succeeded(functionResult))
+    {
+        CacheKeyPath(*resultKey);
+    }
+
     if (auto lock = acquire_output_lock(function_type::registry, functionResult))
     {
 		if (output_method == trace_method::eventlog)
@@ -134,6 +185,11 @@ LSTATUS __stdcall RegCreateKeyExFixup(
 	QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32(result);
+    if (function_succeeded(functionResult))
+    {
+        CacheKeyPath(*resultKey);
+    }
+
     if (auto lock = acquire_output_lock(function_type::registry, functionResult))
     {
 		if (output_method == trace_method::eventlog)
@@ -206,6 +262,11 @@ LSTATUS __stdcall RegOpenKeyFixup(_In_ HKEY key, _In_opt_ const CharT* subKey, _
 	QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32(result);
+    if (function_succeeded(functionResult))
+    {
+        CacheKeyPath(*resultKey);
+    }
+
     if (auto lock = acquire_output_lock(function_type::registry, functionResult))
     {
 		if (output_method == trace_method::eventlog)
@@ -274,42 +335,39 @@ LSTATUS __stdcall RegOpenKeyExFixup(
 	QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32(result);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (function_succeeded(functionResult))
     {
-		if (output_method == trace_method::eventlog)
-		{
-			std::string inputs = ""; 
-			std::string outputs = "";
-			std::string results = "";
+        CacheKeyPath(*resultKey);
+    }
 
-			inputs = InterpretKeyPath(key);  
-			inputs += " (" + InterpretAsHex("", key) + ")";
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, subKey))
+    {
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("RegOpenKeyEx", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.handle("Key", key, raw_trace::decoder::root_handle);
 			if (subKey)
-				inputs += "\nSubkey=" + InterpretStringA(subKey);
-			if (options)
-				inputs += InterpretRegKeyFlags(options);
-			inputs += "\n" + InterpretRegKeyAccess(samDesired);
-
-			results = InterpretReturn(functionResult,result).c_str();
+			{
+				trace.string("Sub Key", subKey);
+			}
+			trace.number("Options", options, raw_trace::decoder::reg_key_flags)
+				.number("Access", samDesired, raw_trace::decoder::reg_key_access)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
 			if (function_failed(functionResult))
 			{
-				if (::GetLastError() == 0)
-					outputs += "Key Not Found";
-				else
-					outputs +=  InterpretLastError();
+				trace.number("Error", result, raw_trace::decoder::win32_error);
 			}
 			else
 			{
-				outputs +=  InterpretAsHex("Result Key", resultKey);
+				trace.handle("Result Key", *resultKey, raw_trace::decoder::opened_handle);
 			}
-
-			std::ostringstream sout;
-			InterpretCallingModulePart1()
-				sout <<  InterpretCallingModulePart2()
-				InterpretCallingModulePart3()
-				std::string cm = sout.str();
-
-			Log_ETW_PostMsgOperationA("RegOpenKeyEx", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
+		{
+			auto name = widen_argument(subKey);
+			Log_ETW_RegistryOperation("RegOpenKeyEx", key, name.c_str(), name.c_str() ? std::wcslen(name.c_str()) : 0, options, samDesired,
+				REG_NONE, 0, functionResult, result, function_failed(functionResult) ? nullptr : *resultKey, _ReturnAddress(), TickStart, TickEnd);
 		}
 		else
 		{
@@ -499,38 +557,39 @@ LSTATUS __stdcall RegQueryValueExFixup(
 	QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_win32(result);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, valueName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
 		{
-			std::string inputs = "";
-			std::string outputs = "";
-			std::string results = "";
-
-			inputs = InterpretKeyPath(key);
-			inputs += " (" + InterpretAsHex("", key) + ")";
+			raw_trace::record trace("RegQueryValueEx", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.handle("Key", key, raw_trace::decoder::root_handle);
 			if (valueName)
-				inputs += "\nValue Name=" + InterpretStringA(valueName);
-
-			results = InterpretReturn(functionResult, result).c_str();
+			{
+				trace.string("Value Name", valueName);
+			}
+			trace.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
 			if (function_failed(functionResult))
 			{
-				outputs +=  InterpretLastError();
+				trace.number("Error", result, raw_trace::decoder::win32_error);
 			}
 			else if (type)
 			{
-				outputs +=  InterpretRegKeyType(*type);
+				trace.number("Type", *type, raw_trace::decoder::reg_key_type);
 				if (data && dataSize)
-					outputs += "\n" + InterpretRegValueA<CharT>(*type, data, *dataSize);
+				{
+					trace.blob<CharT>("Data", data, *dataSize, raw_trace::decoder::reg_value);
+				}
 			}
-
-			std::ostringstream sout;
-			InterpretCallingModulePart1()
-				sout << InterpretCallingModulePart2()
-				InterpretCallingModulePart3()
-				std::string cm = sout.str();
-
-			Log_ETW_PostMsgOperationA("RegQueryValueEx", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
+		{
+			// The data itself stays out of the event; only its size goes in
+			auto name = widen_argument(valueName);
+			auto succeeded = !function_failed(functionResult);
+			Log_ETW_RegistryOperation("RegQueryValueEx", key, name.c_str(), name.c_str() ? std::wcslen(name.c_str()) : 0, 0, 0,
+				(succeeded && type) ? *type : REG_NONE, (succeeded && dataSize) ? *dataSize : 0, functionResult, result, nullptr,
+				_ReturnAddress(), TickStart, TickEnd);
 		}
 		else
 		{
@@ -1330,6 +1389,15 @@ LSTATUS __stdcall RegEnumValueFixup(
 }
 DECLARE_STRING_FIXUP(RegEnumValueImpl, RegEnumValueFixup);
 
+// NOTE: Only here to drop the key's cached path; closing keys isn't interesting enough to trace
+auto RegCloseKeyImpl = &::RegCloseKey;
+LSTATUS __stdcall RegCloseKeyFixup(_In_ HKEY key)
+{
+    UncacheKeyPath(key);
+    return RegCloseKeyImpl(key);
+}
+DECLARE_FIXUP(RegCloseKeyImpl, RegCloseKeyFixup);
+
 // NOTE: The following is a list of functions taken from https://msdn.microsoft.com/en-us/library/windows/desktop/ms724875(v=vs.85).aspx
 //       that are _not_ present above. This is just a convenient collection of what's missing; it is not a collection of
 //       future work.
@@ -1345,7 +1413,6 @@ DECLARE_STRING_FIXUP(RegEnumValueImpl, RegEnumValueFixup);
 //      RegUnLoadKey
 //
 // The following exclusively deal with HKEYs
-//      RegCloseKey
 //      RegConnectRegistry
 //      RegDisableReflectionKey
 //      RegEnableReflectionKey
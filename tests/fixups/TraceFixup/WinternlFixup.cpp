@@ -59,7 +59,7 @@ NTSTATUS __stdcall NtCreateFileFixup(
     IN PVOID eaBuffer OPTIONAL,
     IN ULONG eaLength)
 {
-    if (should_ignore(objectAttributes))
+    if (should_ignore(objectAttributes) || !in_trace_scope(objectAttributes))
     {
         return NtCreateFileImpl(
             fileHandle,
@@ -93,50 +93,37 @@ NTSTATUS __stdcall NtCreateFileFixup(
 	QueryPerformanceCounter(&TickEnd);
 
     auto functionResult = from_ntstatus(result);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, objectAttributes->ObjectName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
 		{
-			std::string inputs = "";
-			std::string outputs = "";
-			std::string results = "";
-
-			inputs =  InterpretObjectAttributes(objectAttributes);
-
-			inputs += "\n" + InterpretFileCreateOptions(createOptions);
-			if (createOptions & FILE_DIRECTORY_FILE)
-			{
-				inputs += "\n" + InterpretDirectoryAccess(desiredAccess);
-			}
-			else if (createOptions & FILE_NON_DIRECTORY_FILE)
-			{
-				inputs += "\n" + InterpretFileAccess(desiredAccess);
-			}
-			else
-			{
-				inputs += "\n" + InterpretGenericAccess(desiredAccess);
-			}
-			outputs =  InterpretFileAttributes(fileAttributes, "File Attributes");
-			outputs += "\n" + InterpretShareMode(shareAccess);
-			outputs += "\n" + InterpretCreationDispositionInternal(createDisposition);
-
-			results = InterpretReturnNT(functionResult, result).c_str();
+			auto access = (createOptions & FILE_DIRECTORY_FILE) ? raw_trace::decoder::directory_access :
+				(createOptions & FILE_NON_DIRECTORY_FILE) ? raw_trace::decoder::file_access : raw_trace::decoder::generic_access;
+			raw_trace::record trace("NtCreateFile", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.counted_string("Path", objectAttributes->ObjectName->Buffer, objectAttributes->ObjectName->Length / sizeof(wchar_t))
+				.handle("Root", objectAttributes->RootDirectory, raw_trace::decoder::root_handle)
+				.number("Object Attributes", objectAttributes->Attributes, raw_trace::decoder::object_attributes)
+				.number("Access", desiredAccess, access)
+				.number("File Attributes", fileAttributes, raw_trace::decoder::file_attributes)
+				.number("Share", shareAccess, raw_trace::decoder::share_mode)
+				.number("Creation Disposition", createDisposition, raw_trace::decoder::creation_disposition_internal)
+				.number("Create Options", createOptions, raw_trace::decoder::file_create_options)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
 			if (function_failed(functionResult))
 			{
-				outputs += "\n" + InterpretNTStatus(result);
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
 			}
 			else
 			{
-				outputs += "\n" + InterpretAsHex("Handle", fileHandle);
+				trace.handle("Handle", *fileHandle, raw_trace::decoder::opened_handle);
 			}
-
-			std::ostringstream sout;
-			InterpretCallingModulePart1()
-				sout << InterpretCallingModulePart2()
-				InterpretCallingModulePart3()
-				std::string cm = sout.str();
-
-			Log_ETW_PostMsgOperationA("NtCreateFile", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
+		{
+			Log_ETW_NtFileOperation("NtCreateFile", objectAttributes->ObjectName->Buffer, objectAttributes->ObjectName->Length / sizeof(wchar_t),
+				objectAttributes->RootDirectory, desiredAccess, shareAccess, createDisposition, createOptions, functionResult, result,
+				function_failed(functionResult) ? nullptr : *fileHandle, _ReturnAddress(), TickStart, TickEnd);
 		}
 		else
 		{
@@ -180,7 +167,7 @@ NTSTATUS __stdcall NtOpenFileFixup(
     IN ULONG shareAccess,
     IN ULONG openOptions)
 {
-    if (should_ignore(objectAttributes))
+    if (should_ignore(objectAttributes) || !in_trace_scope(objectAttributes))
     {
         return NtOpenFileImpl(fileHandle, desiredAccess, objectAttributes, ioStatusBlock, shareAccess, openOptions);
     }
@@ -192,48 +179,36 @@ NTSTATUS __stdcall NtOpenFileFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, objectAttributes->ObjectName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
 		{
-			std::string inputs = "";
-			std::string outputs = "";
-			std::string results = "";
-
-			inputs = InterpretObjectAttributes(objectAttributes);
-
-			if (openOptions & FILE_DIRECTORY_FILE)
-			{
-				inputs += "\n" + InterpretDirectoryAccess(desiredAccess);
-			}
-			else if (openOptions & FILE_NON_DIRECTORY_FILE)
-			{
-				inputs += "\n" + InterpretFileAccess(desiredAccess);
-			}
-			else
-			{
-				inputs += "\n" + InterpretGenericAccess(desiredAccess);
-			}
-			outputs  =        InterpretShareMode(shareAccess);
-			outputs += "\n" + InterpretFileCreateOptions(openOptions);
-
-			results = InterpretReturnNT(functionResult, result).c_str();
+			auto access = (openOptions & FILE_DIRECTORY_FILE) ? raw_trace::decoder::directory_access :
+				(openOptions & FILE_NON_DIRECTORY_FILE) ? raw_trace::decoder::file_access : raw_trace::decoder::generic_access;
+			raw_trace::record trace("NtOpenFile", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.counted_string("Path", objectAttributes->ObjectName->Buffer, objectAttributes->ObjectName->Length / sizeof(wchar_t))
+				.handle("Root", objectAttributes->RootDirectory, raw_trace::decoder::root_handle)
+				.number("Object Attributes", objectAttributes->Attributes, raw_trace::decoder::object_attributes)
+				.number("Access", desiredAccess, access)
+				.number("Share", shareAccess, raw_trace::decoder::share_mode)
+				.number("Create Options", openOptions, raw_trace::decoder::file_create_options)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
 			if (function_failed(functionResult))
 			{
-				outputs += "\n" + InterpretNTStatus(result);
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
 			}
 			else
 			{
-				outputs += "\n" + InterpretAsHex("Handle", fileHandle);
+				trace.handle("Handle", *fileHandle, raw_trace::decoder::opened_handle);
 			}
-
-			std::ostringstream sout;
-			InterpretCallingModulePart1()
-				sout << InterpretCallingModulePart2()
-				InterpretCallingModulePart3()
-				std::string cm = sout.str();
-
-			Log_ETW_PostMsgOperationA("NtOpenFile", inputs.c_str(), results.c_str(), outputs.c_str(), cm.c_str(), TickStart, TickEnd);
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
+		{
+			// NtOpenFile only ever opens what already exists
+			Log_ETW_NtFileOperation("NtOpenFile", objectAttributes->ObjectName->Buffer, objectAttributes->ObjectName->Length / sizeof(wchar_t),
+				objectAttributes->RootDirectory, desiredAccess, shareAccess, FILE_OPEN, openOptions, functionResult, result,
+				function_failed(functionResult) ? nullptr : *fileHandle, _ReturnAddress(), TickStart, TickEnd);
 		}
 		else
 		{
@@ -284,9 +259,25 @@ NTSTATUS __stdcall NtCreateDirectoryObjectFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, objectAttributes->ObjectName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtCreateDirectoryObject", functionResult, TickStart, TickEnd, _ReturnAddress());
+			TraceObjectAttributes(trace, objectAttributes)
+				.number("Access", desiredAccess, raw_trace::decoder::directory_access)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			else
+			{
+				trace.handle("Handle", *directoryHandle, raw_trace::decoder::opened_handle);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -349,9 +340,25 @@ NTSTATUS __stdcall NtOpenDirectoryObjectFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, objectAttributes->ObjectName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtOpenDirectoryObject", functionResult, TickStart, TickEnd, _ReturnAddress());
+			TraceObjectAttributes(trace, objectAttributes)
+				.number("Access", desiredAccess, raw_trace::decoder::directory_access)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			else
+			{
+				trace.handle("Handle", *directoryHandle, raw_trace::decoder::opened_handle);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -534,9 +541,25 @@ NTSTATUS __stdcall NtOpenSymbolicLinkObjectFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::filesystem, functionResult, objectAttributes->ObjectName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtOpenSymbolicLinkObject", functionResult, TickStart, TickEnd, _ReturnAddress());
+			TraceObjectAttributes(trace, objectAttributes)
+				.number("Access", desiredAccess, raw_trace::decoder::generic_access)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			else
+			{
+				trace.handle("Handle", *linkHandle, raw_trace::decoder::opened_handle);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -601,7 +624,26 @@ NTSTATUS WINAPI NtQuerySymbolicLinkObjectFixup(
 	QueryPerformanceCounter(&TickEnd);
     if (auto lock = acquire_output_lock(function_type::filesystem, functionResult))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtQuerySymbolicLinkObject", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.handle("Handle", linkHandle, raw_trace::decoder::root_handle)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+				if (returnedLength && (result == STATUS_BUFFER_TOO_SMALL))
+				{
+					trace.number("Required Length", *returnedLength, raw_trace::decoder::decimal);
+				}
+			}
+			else
+			{
+				TraceUnicodeString(trace, "Target", linkTarget);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -682,9 +724,39 @@ NTSTATUS __stdcall NtCreateKeyFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (function_succeeded(functionResult))
     {
-		if (output_method == trace_method::eventlog)
+        CacheKeyPath(*keyHandle);
+    }
+
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, objectAttributes->ObjectName))
+    {
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtCreateKey", functionResult, TickStart, TickEnd, _ReturnAddress());
+			TraceObjectAttributes(trace, objectAttributes)
+				.number("Access", desiredAccess, raw_trace::decoder::reg_key_access)
+				.number("Create Options", createOptions, raw_trace::decoder::reg_key_flags);
+			if (objectClass)
+			{
+				TraceUnicodeString(trace, "Class", objectClass);
+			}
+			trace.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			else
+			{
+				trace.handle("Handle", *keyHandle, raw_trace::decoder::opened_handle);
+				if (disposition)
+				{
+					trace.number("Disposition", *disposition, raw_trace::decoder::decimal);
+				}
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -749,9 +821,30 @@ NTSTATUS __stdcall NtOpenKeyFixup(_Out_ PHANDLE keyHandle, _In_ ACCESS_MASK desi
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (function_succeeded(functionResult))
     {
-		if (output_method == trace_method::eventlog)
+        CacheKeyPath(*keyHandle);
+    }
+
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, objectAttributes->ObjectName))
+    {
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtOpenKey", functionResult, TickStart, TickEnd, _ReturnAddress());
+			TraceObjectAttributes(trace, objectAttributes)
+				.number("Access", desiredAccess, raw_trace::decoder::reg_key_access)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			else
+			{
+				trace.handle("Handle", *keyHandle, raw_trace::decoder::opened_handle);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -816,9 +909,31 @@ NTSTATUS __stdcall NtOpenKeyExFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (function_succeeded(functionResult))
     {
-		if (output_method == trace_method::eventlog)
+        CacheKeyPath(*keyHandle);
+    }
+
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, objectAttributes->ObjectName))
+    {
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtOpenKeyEx", functionResult, TickStart, TickEnd, _ReturnAddress());
+			TraceObjectAttributes(trace, objectAttributes)
+				.number("Access", desiredAccess, raw_trace::decoder::reg_key_access)
+				.number("Open Options", openOptions, raw_trace::decoder::reg_key_flags)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			else
+			{
+				trace.handle("Handle", *keyHandle, raw_trace::decoder::opened_handle);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -889,9 +1004,23 @@ NTSTATUS __stdcall NtSetValueKeyFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, valueName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtSetValueKey", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.handle("Key", keyHandle, raw_trace::decoder::root_handle);
+			TraceUnicodeString(trace, "Value Name", valueName)
+				.number("Type", type, raw_trace::decoder::reg_key_type)
+				.blob<wchar_t>("Data", data, dataSize, raw_trace::decoder::reg_value)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -919,7 +1048,7 @@ NTSTATUS __stdcall NtSetValueKeyFixup(
 		else
 		{
         Log("NtSetValueKey:\n");
-        // TODO: Translate keyHandle to a name?
+        if (std::wstring path; TryGetCachedKeyPath(keyHandle, path)) LogCountedString("Key", path.c_str(), path.length());
         LogUnicodeString("Value Name", valueName);
         LogRegKeyType(type);
         LogRegValue<wchar_t>(type, data, dataSize);
@@ -952,9 +1081,39 @@ NTSTATUS __stdcall NtQueryValueKeyFixup(
 
     auto functionResult = from_ntstatus(result);
 	QueryPerformanceCounter(&TickEnd);
-    if (auto lock = acquire_output_lock(function_type::registry, functionResult))
+    if (auto lock = acquire_keyed_output_lock(function_type::registry, functionResult, valueName))
     {
-		if (output_method == trace_method::eventlog)
+		if (output_method == trace_method::raw)
+		{
+			raw_trace::record trace("NtQueryValueKey", functionResult, TickStart, TickEnd, _ReturnAddress());
+			trace.handle("Key", keyHandle, raw_trace::decoder::root_handle);
+			TraceUnicodeString(trace, "Value Name", valueName)
+				.number("Information Class", keyValueInformationClass, raw_trace::decoder::decimal)
+				.number("Result", static_cast<std::uint64_t>(functionResult), raw_trace::decoder::function_result);
+			if (function_failed(functionResult))
+			{
+				trace.number("Status", static_cast<ULONG>(result), raw_trace::decoder::ntstatus);
+				if (resultLength && ((result == STATUS_BUFFER_OVERFLOW) || (result == STATUS_BUFFER_TOO_SMALL)))
+				{
+					trace.number("Required Length", *resultLength, raw_trace::decoder::decimal);
+				}
+			}
+			else
+			{
+				auto info = GetKeyValueInformation(keyValueInformationClass, keyValueInformation);
+				if (!info.name.empty())
+				{
+					trace.counted_string("Name", info.name.data(), info.name.length());
+				}
+				trace.number("Type", info.type, raw_trace::decoder::reg_key_type);
+				if (info.data)
+				{
+					trace.blob<wchar_t>("Data", info.data, info.data_size, raw_trace::decoder::reg_value);
+				}
+			}
+			trace.write();
+		}
+		else if (output_method == trace_method::eventlog)
 		{
 			std::string inputs = "";
 			std::string outputs = "";
@@ -1050,6 +1209,7 @@ NTSTATUS __stdcall NtQueryValueKeyFixup(
 		else
 		{
         Log("NtQueryValueKey:\n");
+        if (std::wstring path; TryGetCachedKeyPath(keyHandle, path)) LogCountedString("Key", path.c_str(), path.length());
         LogUnicodeString("Value Name", valueName);
         LogFunctionResult(functionResult);
         if (function_failed(functionResult))
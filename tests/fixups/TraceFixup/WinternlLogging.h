@@ -407,7 +407,13 @@ inline bool TryGetDirectoryPath(HANDLE dir, std::wstring& result)
     return !result.empty();
 }
 
-inline bool TryGetKeyPath(HANDLE key, std::wstring& result)
+// Keys that get opened or created through the hooks have their full path cached until they get closed, so that tracing
+// the calls made on them doesn't have to ask for the name every time (see RegistryFixup.cpp)
+void CacheKeyPath(HANDLE key);
+void UncacheKeyPath(HANDLE key);
+bool TryGetCachedKeyPath(HANDLE key, std::wstring& result);
+
+inline bool QueryKeyPath(HANDLE key, std::wstring& result)
 {
     result.clear();
 
@@ -426,6 +432,11 @@ inline bool TryGetKeyPath(HANDLE key, std::wstring& result)
     return !result.empty();
 }
 
+inline bool TryGetKeyPath(HANDLE key, std::wstring& result)
+{
+    return TryGetCachedKeyPath(key, result) || QueryKeyPath(key, result);
+}
+
 inline void LogObjectAttributes(POBJECT_ATTRIBUTES objectAttributes)
 {
     // Get the root directory/registry/etc. path that the ObjectName is relative to
@@ -459,6 +470,84 @@ inline std::string InterpretObjectAttributes(POBJECT_ATTRIBUTES objectAttributes
 	return olog.str();
 }
 
+// The raw trace versions of LogUnicodeString/LogObjectAttributes. Strings go into the record as the counted strings that
+// they are, and the root directory as a handle for the decoder to resolve, so tracing a call doesn't have to look up or
+// convert anything
+inline raw_trace::record& TraceUnicodeString(raw_trace::record& trace, const char* msg, const UNICODE_STRING* string)
+{
+    return trace.counted_string(msg, string ? string->Buffer : nullptr, string ? string->Length / sizeof(wchar_t) : 0);
+}
+
+inline raw_trace::record& TraceObjectAttributes(raw_trace::record& trace, POBJECT_ATTRIBUTES objectAttributes)
+{
+    return TraceUnicodeString(trace, "Path", objectAttributes->ObjectName)
+        .handle("Root", objectAttributes->RootDirectory, raw_trace::decoder::root_handle)
+        .number("Object Attributes", objectAttributes->Attributes, raw_trace::decoder::object_attributes);
+}
+
+// The name, type and data out of whichever KEY_VALUE_*_INFORMATION structure NtQueryValueKey returned
+struct key_value_information
+{
+    std::wstring_view name;
+    ULONG type = REG_NONE;
+    const void* data = nullptr;
+    std::size_t data_size = 0;
+};
+
+inline key_value_information GetKeyValueInformation(winternl::KEY_VALUE_INFORMATION_CLASS infoClass, const void* buffer)
+{
+    key_value_information result;
+    switch (infoClass)
+    {
+    case winternl::KeyValueBasicInformation:
+    {
+        auto info = reinterpret_cast<const winternl::KEY_VALUE_BASIC_INFORMATION*>(buffer);
+        result.name = { info->Name, info->NameLength / 2 };
+        result.type = info->Type;
+    } break;
+
+    case winternl::KeyValueFullInformation:
+    case winternl::KeyValueFullInformationAlign64:
+    {
+        // NOTE: The Align64 version only differs in where the data starts, which DataOffset already says
+        auto info = reinterpret_cast<const winternl::KEY_VALUE_FULL_INFORMATION*>(buffer);
+        result.name = { info->Name, info->NameLength / 2 };
+        result.type = info->Type;
+        result.data = reinterpret_cast<const std::uint8_t*>(info) + info->DataOffset;
+        result.data_size = info->DataLength;
+    } break;
+
+    case winternl::KeyValuePartialInformation:
+    {
+        auto info = reinterpret_cast<const winternl::KEY_VALUE_PARTIAL_INFORMATION*>(buffer);
+        result.type = info->Type;
+        result.data = info->Data;
+        result.data_size = info->DataLength;
+    } break;
+
+    case winternl::KeyValuePartialInformationAlign64:
+    {
+        // NOTE: Only documented; same as KEY_VALUE_PARTIAL_INFORMATION, without the TitleIndex
+        struct KEY_VALUE_PARTIAL_INFORMATION_ALIGN64
+        {
+            ULONG Type;
+            ULONG DataLength;
+            UCHAR Data[1];
+        };
+
+        auto info = reinterpret_cast<const KEY_VALUE_PARTIAL_INFORMATION_ALIGN64*>(buffer);
+        result.type = info->Type;
+        result.data = info->Data;
+        result.data_size = info->DataLength;
+    } break;
+
+    default: // Invalid or undocumented
+        break;
+    }
+
+    return result;
+}
+
 inline std::string InterpretKeyValueInformationClass(winternl::KEY_VALUE_INFORMATION_CLASS infoclass)
 {
 	switch (infoclass)
@@ -3,9 +3,23 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cwctype>
+#include <iterator>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
 #include <Windows.h>
 
 #include <debug.h>
+#include <known_folders.h>
 
 #define PSF_DEFINE_EXPORTS
 #include <psf_framework.h>
@@ -31,6 +45,13 @@ static trace_level g_defaultTraceLevel = trace_level::unexpected_failures;
 static const psf::json_object* g_breakLevels = nullptr;
 static trace_level g_defaultBreakLevel = trace_level::ignore;
 
+// See ModuleTimeline.cpp
+void start_module_timeline(const psf::json_object& configObj);
+void write_module_timeline() noexcept;
+
+// See PathScope.cpp
+void configure_path_scope(const psf::json_object& configObj);
+
 
 
 // This handles event logging via ETW
@@ -68,6 +89,27 @@ static trace_level trace_level_from_configuration(std::string_view str, trace_le
     return defaultLevel;
 }
 
+// The name that each function_type goes by in the "traceLevels", "breakOn", "sampling" and "rateLimits" configuration
+static const char* function_type_config_key(function_type type)
+{
+    switch (type)
+    {
+    case function_type::filesystem:
+        return "filesystem";
+
+    case function_type::registry:
+        return "registry";
+
+    case function_type::process_and_thread:
+        return "processAndThread";
+
+    case function_type::dynamic_link_library:
+        return "dynamicLinkLibrary";
+    }
+
+    return "default";
+}
+
 static trace_level configured_level(function_type type, const psf::json_object* configuredLevels, trace_level defaultLevel)
 {
     if (!configuredLevels)
@@ -75,78 +117,410 @@ static trace_level configured_level(function_type type, const psf::json_object*
         return defaultLevel;
     }
 
-    auto impl = [&](const char* configKey)
+    if (auto config = configuredLevels->try_get(function_type_config_key(type)))
+    {
+        return trace_level_from_configuration(config->as_string().string(), defaultLevel);
+    }
+
+    // Fallback to default
+    return defaultLevel;
+}
+
+static bool trace_level_includes(trace_level level, function_result result)
+{
+    switch (level)
+    {
+    case trace_level::always:
+        return result >= function_result::success;
+
+    case trace_level::ignore_success:
+        return result >= function_result::indeterminate;
+
+    case trace_level::all_failures:
+        return result >= function_result::expected_failure;
+
+    case trace_level::unexpected_failures:
+        return result >= function_result::failure;
+
+    case trace_level::ignore:
+    default:
+        return false;
+    }
+}
+
+// Nothing gets traced until DllMain fills this in, which is before any of the functions get detoured
+result_configuration g_resultConfigurations[function_type_count][function_result_count] = {};
+
+static void resolve_result_configurations()
+{
+    for (std::size_t type = 0; type < function_type_count; ++type)
     {
-        if (auto config = configuredLevels->try_get(configKey))
+        auto traceLevel = configured_level(static_cast<function_type>(type), g_traceLevels, g_defaultTraceLevel);
+        auto breakLevel = configured_level(static_cast<function_type>(type), g_breakLevels, g_defaultBreakLevel);
+        for (std::size_t result = 0; result < function_result_count; ++result)
         {
-            return trace_level_from_configuration(config->as_string().string(), defaultLevel);
+            g_resultConfigurations[type][result] = {
+                trace_level_includes(traceLevel, static_cast<function_result>(result)),
+                trace_level_includes(breakLevel, static_cast<function_result>(result)) };
         }
+    }
+}
 
-        return defaultLevel;
+std::int64_t g_slowCallThresholds[function_type_count] = {};
+
+// Thresholds are configured in microseconds
+static void configure_slow_calls(const psf::json_object& slowCalls)
+{
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    for (std::size_t i = 0; i < function_type_count; ++i)
+    {
+        auto value = slowCalls.try_get(function_type_config_key(static_cast<function_type>(i)));
+        if (!value)
+        {
+            value = slowCalls.try_get("default");
+        }
+
+        if (value)
+        {
+            auto microseconds = static_cast<std::int64_t>(value->as_number().get_unsigned());
+            g_slowCallThresholds[i] = (std::max)(microseconds * frequency.QuadPart / 1000000, std::int64_t{ 1 });
+        }
+    }
+}
+
+// Sampling keeps one in every N calls. The rate limit is a token bucket that holds a second's worth of calls, kept as
+// the time that the bucket is next full (the "generic cell rate algorithm"), so that taking a token is a single
+// compare-exchange instead of a lock
+struct call_limits
+{
+    std::uint32_t sample_rate = 1;
+    std::atomic<std::uint32_t> sample_count = 0;
+
+    // In QueryPerformanceCounter ticks; a zero interval means no rate limit
+    std::int64_t interval = 0;
+    std::int64_t burst_tolerance = 0;
+    std::atomic<std::int64_t> next_arrival = 0;
+};
+
+static call_limits g_callLimits[function_type_count];
+
+bool sampled_in(function_type type) noexcept
+{
+    auto& limits = g_callLimits[static_cast<std::size_t>(type)];
+    if ((limits.sample_rate > 1) && ((limits.sample_count.fetch_add(1, std::memory_order_relaxed) % limits.sample_rate) != 0))
+    {
+        return false;
+    }
+
+    if (!limits.interval)
+    {
+        return true;
+    }
+
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+    auto arrival = limits.next_arrival.load(std::memory_order_relaxed);
+    while (true)
+    {
+        auto start = (std::max)(arrival, now.QuadPart);
+        if (start - now.QuadPart > limits.burst_tolerance)
+        {
+            return false;
+        }
+
+        if (limits.next_arrival.compare_exchange_weak(arrival, start + limits.interval, std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+}
+
+static void configure_call_limits(const psf::json_object* sampling, const psf::json_object* rateLimits)
+{
+    auto configured = [](const psf::json_object* config, function_type type) -> std::uint64_t
+    {
+        if (!config)
+        {
+            return 0;
+        }
+        else if (auto value = config->try_get(function_type_config_key(type)))
+        {
+            return value->as_number().get_unsigned();
+        }
+        else if (auto defaultValue = config->try_get("default"))
+        {
+            return defaultValue->as_number().get_unsigned();
+        }
+
+        return 0;
     };
 
-    switch (type)
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    for (std::size_t i = 0; i < std::size(g_callLimits); ++i)
     {
-    case function_type::filesystem:
-        return impl("filesystem");
+        auto type = static_cast<function_type>(i);
+        if (auto sampleRate = configured(sampling, type))
+        {
+            g_callLimits[i].sample_rate = static_cast<std::uint32_t>(sampleRate);
+        }
 
-    case function_type::registry:
-        return impl("registry");
+        if (auto callsPerSecond = configured(rateLimits, type))
+        {
+            g_callLimits[i].interval = (std::max)(frequency.QuadPart / static_cast<std::int64_t>(callsPerSecond), std::int64_t{ 1 });
+            g_callLimits[i].burst_tolerance = frequency.QuadPart - g_callLimits[i].interval;
+        }
+    }
+}
 
-    case function_type::process_and_thread:
-        return impl("processAndThread");
-        break;
+// Keyed by the address of the API's name, which is unique to the call site (see acquire_output_lock). Once the table is
+// full, calls to APIs that aren't in it just aren't counted
+struct untraced_calls
+{
+    std::atomic<const char*> api = nullptr;
+    std::atomic<std::uint64_t> count = 0;
+};
 
-    case function_type::dynamic_link_library:
-        return impl("dynamicLinkLibrary");
-        break;
+static constexpr std::size_t untraced_calls_table_size = 256;
+static untraced_calls g_untracedCalls[untraced_calls_table_size];
+
+static untraced_calls* find_untraced_calls(const char* api, bool add) noexcept
+{
+    auto index = (reinterpret_cast<std::uintptr_t>(api) >> 3) % untraced_calls_table_size;
+    for (std::size_t i = 0; i < untraced_calls_table_size; ++i, index = (index + 1) % untraced_calls_table_size)
+    {
+        const char* entry = g_untracedCalls[index].api.load(std::memory_order_acquire);
+        if (!entry && add && g_untracedCalls[index].api.compare_exchange_strong(entry, api, std::memory_order_acq_rel))
+        {
+            return &g_untracedCalls[index];
+        }
+        else if (entry == api)
+        {
+            return &g_untracedCalls[index];
+        }
+        else if (!entry)
+        {
+            return nullptr;
+        }
     }
 
-    // Fallback to default
-    return defaultLevel;
+    return nullptr;
 }
 
-static trace_level configured_trace_level(function_type type)
+void count_untraced_call(const char* api) noexcept
 {
-    return configured_level(type, g_traceLevels, g_defaultTraceLevel);
+    if (auto entry = find_untraced_calls(api, true))
+    {
+        entry->count.fetch_add(1, std::memory_order_relaxed);
+    }
 }
 
-static trace_level configured_break_level(function_type type)
+std::uint64_t take_untraced_calls(const char* api) noexcept
 {
-    return configured_level(type, g_breakLevels, g_defaultBreakLevel);
+    auto entry = find_untraced_calls(api, false);
+    return entry ? entry->count.exchange(0, std::memory_order_relaxed) : 0;
 }
 
-result_configuration configured_result(function_type type, function_result result)
+// What never got reported because no later call to the same API got traced
+static void report_untraced_calls()
 {
-    auto impl = [&](trace_level level)
+    for (auto& entry : g_untracedCalls)
     {
-        switch (level)
+        auto api = entry.api.load(std::memory_order_acquire);
+        if (auto count = api ? entry.count.exchange(0, std::memory_order_relaxed) : 0)
         {
-        case trace_level::always:
-            return result >= function_result::success;
-            break;
+            if (output_method == trace_method::eventlog)
+            {
+                char message[256];
+                std::snprintf(message, sizeof(message), "%s: %llu call(s) not traced", api, static_cast<unsigned long long>(count));
+                Log_ETW_PostMsgA(message);
+            }
+            else
+            {
+                Log("%s: %llu call(s) not traced (sampling or rate limits)\n", api, static_cast<unsigned long long>(count));
+            }
+        }
+    }
+}
 
-        case trace_level::ignore_success:
-            return result >= function_result::indeterminate;
-            break;
 
-        case trace_level::all_failures:
-            return result >= function_result::expected_failure;
-            break;
+// The summary trace method. Each thread aggregates into a table of its own, so that calls don't contend on a lock; the
+// table's lock only ever gets contended by the report. The tables outlive their threads, so that the report has
+// everything in it
+struct summary_entry_key
+{
+    const char* api;
+    std::wstring path;
+    function_result result;
 
-        case trace_level::unexpected_failures:
-            return result >= function_result::failure;
-            break;
+    bool operator==(const summary_entry_key& other) const noexcept
+    {
+        return (api == other.api) && (result == other.result) && (path == other.path);
+    }
+};
 
-        case trace_level::ignore:
-        default:
-            return false;
+struct summary_entry_key_hash
+{
+    std::size_t operator()(const summary_entry_key& key) const noexcept
+    {
+        return std::hash<std::wstring>{}(key.path) ^ (std::hash<const char*>{}(key.api) << 1) ^ static_cast<std::size_t>(key.result);
+    }
+};
+
+struct summary_statistics
+{
+    std::uint64_t count = 0;
+    std::int64_t total_ticks = 0;
+    std::int64_t max_ticks = 0;
+
+    void add(std::uint64_t calls, std::int64_t ticks, std::int64_t maxTicks) noexcept
+    {
+        count += calls;
+        total_ticks += ticks;
+        max_ticks = (std::max)(max_ticks, maxTicks);
+    }
+};
+
+struct summary_table
+{
+    SRWLOCK lock = SRWLOCK_INIT;
+    std::unordered_map<summary_entry_key, summary_statistics, summary_entry_key_hash> entries;
+};
+
+static SRWLOCK g_summaryTablesLock = SRWLOCK_INIT;
+static std::vector<summary_table*>* g_summaryTables = nullptr;
+
+static summary_table& thread_summary_table()
+{
+    // NOTE: Never freed, since the report can come after the thread has exited
+    static thread_local summary_table* table = nullptr;
+    if (!table)
+    {
+        auto newTable = new summary_table;
+        ::AcquireSRWLockExclusive(&g_summaryTablesLock);
+        if (!g_summaryTables)
+        {
+            g_summaryTables = new std::vector<summary_table*>;
         }
-    };
+        g_summaryTables->push_back(newTable);
+        ::ReleaseSRWLockExclusive(&g_summaryTablesLock);
+        table = newTable;
+    }
+
+    return *table;
+}
+
+// Paths that only differ in case, separators, or prefix all count as the same path
+static std::wstring normalize_summary_path(const summary_key& key)
+{
+    std::wstring result;
+    if (key.wide)
+    {
+        result.assign(key.wide, (key.length == summary_key::null_terminated) ? std::wcslen(key.wide) : key.length);
+    }
+    else if (key.narrow)
+    {
+        result = widen(key.narrow, CP_ACP);
+    }
+
+    for (auto prefix : { L"\\\\?\\"sv, L"\\??\\"sv })
+    {
+        if (std::wstring_view(result).substr(0, prefix.length()) == prefix)
+        {
+            result.erase(0, prefix.length());
+            break;
+        }
+    }
 
-    return { impl(configured_trace_level(type)), impl(configured_break_level(type)) };
+    for (auto& ch : result)
+    {
+        ch = (ch == L'/') ? L'\\' : static_cast<wchar_t>(std::towlower(ch));
+    }
+
+    return result;
 }
 
+void add_to_summary(const char* api, const summary_key& key, function_result result, LARGE_INTEGER start, LARGE_INTEGER end) noexcept try
+{
+    summary_entry_key entryKey{ api, normalize_summary_path(key), result };
+    auto ticks = end.QuadPart - start.QuadPart;
+
+    auto& table = thread_summary_table();
+    ::AcquireSRWLockExclusive(&table.lock);
+    table.entries[std::move(entryKey)].add(1, ticks, ticks);
+    ::ReleaseSRWLockExclusive(&table.lock);
+}
+catch (...)
+{
+    // Out of memory; the call just doesn't get counted
+}
+
+static const char* function_result_name(function_result result)
+{
+    switch (result)
+    {
+    case function_result::success: return "Success";
+    case function_result::indeterminate: return "Indeterminate";
+    case function_result::expected_failure: return "Expected Failure";
+    case function_result::failure: return "Failure";
+    }
+
+    return "Unknown";
+}
+
+// Sorted by the total time spent in each, so that what dominates comes first
+static void report_summary() noexcept try
+{
+    // Different call sites for the same API have names at different addresses; they count as one
+    std::map<std::tuple<std::string_view, std::wstring_view, function_result>, summary_statistics> merged;
+    ::AcquireSRWLockExclusive(&g_summaryTablesLock);
+    if (g_summaryTables)
+    {
+        for (auto table : *g_summaryTables)
+        {
+            ::AcquireSRWLockExclusive(&table->lock);
+            for (auto& [key, statistics] : table->entries)
+            {
+                merged[{ key.api, key.path, key.result }].add(statistics.count, statistics.total_ticks, statistics.max_ticks);
+            }
+            ::ReleaseSRWLockExclusive(&table->lock);
+        }
+    }
+
+    std::vector<std::pair<const std::tuple<std::string_view, std::wstring_view, function_result>, summary_statistics>*> sorted;
+    sorted.reserve(merged.size());
+    for (auto& entry : merged)
+    {
+        sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](auto lhs, auto rhs) { return lhs->second.total_ticks > rhs->second.total_ticks; });
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    auto milliseconds = [&](std::int64_t ticks) { return static_cast<double>(ticks) * 1000.0 / static_cast<double>(frequency.QuadPart); };
+
+    Log("Trace summary: %zu distinct calls\n", sorted.size());
+    Log("%12s %12s %12s  %-16s  %s\n", "Calls", "Total (ms)", "Max (ms)", "Result", "API and Path");
+    for (auto entry : sorted)
+    {
+        auto& [api, path, result] = entry->first;
+        auto path8 = narrow(path);
+        Log("%12llu %12.3f %12.3f  %-16s  %.*s %s\n",
+            static_cast<unsigned long long>(entry->second.count),
+            milliseconds(entry->second.total_ticks),
+            milliseconds(entry->second.max_ticks),
+            function_result_name(result),
+            static_cast<int>(api.length()), api.data(),
+            path8.c_str());
+    }
+
+    ::ReleaseSRWLockExclusive(&g_summaryTablesLock);
+}
+catch (...)
+{
+    ::ReleaseSRWLockExclusive(&g_summaryTablesLock);
+}
 
 // Set up the ETW Provider
 void Log_ETW_Register()
@@ -154,6 +528,117 @@ void Log_ETW_Register()
 	TraceLoggingRegister(g_Log_ETW_ComponentProvider);
 }
 
+// The trace file defaults to %LocalAppData%\PsfTraces\<executable>-<process id><extension>. Returns false if it can't be
+// created, in which case tracing falls back to OutputDebugString
+static bool open_trace_file(const psf::json_object& configObj, const wchar_t* extension)
+{
+    std::filesystem::path path;
+    if (auto traceFile = configObj.try_get("traceFile"))
+    {
+        path = traceFile->as_string().wide();
+    }
+    else
+    {
+        path = ::PSFQueryKnownFolder(FOLDERID_LocalAppData) / L"PsfTraces" /
+            (psf::current_executable_path().stem().native() + L"-" + std::to_wstring(::GetCurrentProcessId()) + extension);
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    auto file = ::CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // NOTE: The file stays open until the process exits, since the log's background thread may still be writing to it
+    psf::set_log_file(file);
+    return true;
+}
+
+static bool start_raw_trace(const psf::json_object& configObj)
+{
+    if (!open_trace_file(configObj, L".psftrace"))
+    {
+        return false;
+    }
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    raw_trace::record(raw_trace::record::thread_buffer(), raw_trace::record_kind::file_header, "", 0, function_result::indeterminate, {}, {}, nullptr)
+        .number("Version", raw_trace::format_version, raw_trace::decoder::decimal)
+        .number("ProcessId", ::GetCurrentProcessId(), raw_trace::decoder::decimal)
+        .number("Frequency", frequency.QuadPart, raw_trace::decoder::decimal)
+        .write();
+    return true;
+}
+
+// The "file" trace method (see ring_file in RawTrace.h). The ring defaults to 16 MB, and is rounded up to a multiple of
+// 64 KB. Returns false if the file can't be created or mapped, in which case tracing falls back to OutputDebugString
+static bool start_ring_trace(const psf::json_object& configObj)
+{
+    std::filesystem::path path;
+    if (auto traceFile = configObj.try_get("traceFile"))
+    {
+        path = traceFile->as_string().wide();
+    }
+    else
+    {
+        path = ::PSFQueryKnownFolder(FOLDERID_LocalAppData) / L"PsfTraces" /
+            (psf::current_executable_path().stem().native() + L"-" + std::to_wstring(::GetCurrentProcessId()) + L".psfring");
+    }
+
+    std::uint64_t capacity = 16 * 1024 * 1024;
+    if (auto traceFileSize = configObj.try_get("traceFileSize"))
+    {
+        capacity = traceFileSize->as_number().get_unsigned();
+    }
+    capacity = (std::max)((capacity + 0xFFFF) & ~std::uint64_t{ 0xFFFF }, std::uint64_t{ 0x10000 });
+
+    constexpr std::uint64_t ringOffset = raw_trace::ring_modules_offset + raw_trace::ring_module_count * sizeof(raw_trace::ring_module);
+    auto fileSize = ringOffset + capacity;
+    if (fileSize > SIZE_MAX)
+    {
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    auto file = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // The mapping is what keeps the file open from here on
+    auto mapping = ::CreateFileMappingW(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(fileSize >> 32), static_cast<DWORD>(fileSize), nullptr);
+    ::CloseHandle(file);
+    auto view = mapping ? ::MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(fileSize)) : nullptr;
+    if (mapping)
+    {
+        ::CloseHandle(mapping);
+    }
+
+    if (!view)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    auto header = static_cast<raw_trace::ring_file_header*>(view);
+    std::memcpy(header->magic, raw_trace::ring_file_magic, sizeof(header->magic));
+    header->version = raw_trace::ring_format_version;
+    header->process_id = ::GetCurrentProcessId();
+    header->frequency = frequency.QuadPart;
+    header->capacity = capacity;
+    header->ring_offset = ringOffset;
+    header->write_offset = 0;
+
+    raw_trace::ring_file::start(view);
+    return true;
+}
+
 void Log_ETW_PostMsgA(const char * s)
 {
 	TraceLoggingWrite(g_Log_ETW_ComponentProvider, // handle to my provider
@@ -161,18 +646,147 @@ void Log_ETW_PostMsgA(const char * s)
 		TraceLoggingValue(s, "Message")); // Field for your event in the form of (value, field name).
 }
 
+// Keywords are part of each event's metadata, so they have to be constants. One per function_type:
+//      filesystem = 0x1, registry = 0x2, process_and_thread = 0x4, dynamic_link_library = 0x8
+constexpr ULONGLONG etw_keyword(function_type type)
+{
+    return 1ull << static_cast<int>(type);
+}
+
+bool Log_ETW_IsEnabled(function_type type)
+{
+    return TraceLoggingProviderEnabled(g_Log_ETW_ComponentProvider, 0, etw_keyword(type));
+}
+
+#define LOG_ETW_OPERATION(type) \
+	TraceLoggingWrite(g_Log_ETW_ComponentProvider, \
+		"TraceEvent", \
+		TraceLoggingKeyword(etw_keyword(type)), \
+		TraceLoggingValue(operation, "Operation"), \
+		TraceLoggingValue(inputs, "Inputs"), \
+		TraceLoggingValue(result, "Result"), \
+		TraceLoggingValue(outputs, "Outputs"), \
+		TraceLoggingValue(callingmodule, "Caller"), \
+		TraceLoggingInt64(TickStart.QuadPart, "Start"), \
+		TraceLoggingInt64(TickEnd.QuadPart, "End"))
+
 void Log_ETW_PostMsgOperationA(const char *operation, const char *inputs, const char *result, const char *outputs, const char *callingmodule, LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd)
 {
-	TraceLoggingWrite(g_Log_ETW_ComponentProvider, // handle to my provider
-		"TraceEvent",              // Event Name that should uniquely identify your event.
-		TraceLoggingValue(operation, "Operation"),
-		TraceLoggingValue(inputs, "Inputs"),
-		TraceLoggingValue(result, "Result"),
-		TraceLoggingValue(outputs, "Outputs"),
-		TraceLoggingValue(callingmodule, "Caller"), 
+	switch (output_lock::current_type)
+	{
+	case function_type::filesystem: LOG_ETW_OPERATION(function_type::filesystem); break;
+	case function_type::registry: LOG_ETW_OPERATION(function_type::registry); break;
+	case function_type::process_and_thread: LOG_ETW_OPERATION(function_type::process_and_thread); break;
+	case function_type::dynamic_link_library: LOG_ETW_OPERATION(function_type::dynamic_link_library); break;
+	}
+}
+
+#undef LOG_ETW_OPERATION
+
+// For calls past their "slowCalls" threshold, right after the call's own event. Frames are left as addresses, the same as
+// the typed events' callers are
+#define LOG_ETW_CALL_STACK(type) \
+	TraceLoggingWrite(g_Log_ETW_ComponentProvider, \
+		"CallStack", \
+		TraceLoggingKeyword(etw_keyword(type)), \
+		TraceLoggingString(api, "Api"), \
+		TraceLoggingPointerArray(frames, static_cast<UINT16>(frameCount), "Frames"))
+
+void Log_ETW_CallStack(const char* api, void* const* frames, std::size_t frameCount)
+{
+	switch (output_lock::current_type)
+	{
+	case function_type::filesystem: LOG_ETW_CALL_STACK(function_type::filesystem); break;
+	case function_type::registry: LOG_ETW_CALL_STACK(function_type::registry); break;
+	case function_type::process_and_thread: LOG_ETW_CALL_STACK(function_type::process_and_thread); break;
+	case function_type::dynamic_link_library: LOG_ETW_CALL_STACK(function_type::dynamic_link_library); break;
+	}
+}
+
+#undef LOG_ETW_CALL_STACK
+
+// The typed events leave the calling module as an address; consumers resolve it from the image load events, the same
+// way that they do for stack walks
+void Log_ETW_FileOperation(const char* operation, const wchar_t* path, std::size_t pathLength, DWORD access, DWORD share,
+    DWORD disposition, DWORD flagsAndAttributes, function_result result, DWORD error, HANDLE handle, const void* caller,
+    LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd)
+{
+	TraceLoggingWrite(g_Log_ETW_ComponentProvider,
+		"FileOperation",
+		TraceLoggingKeyword(etw_keyword(function_type::filesystem)),
+		TraceLoggingString(operation, "Operation"),
+		TraceLoggingCountedWideString(path, static_cast<USHORT>(pathLength), "Path"),
+		TraceLoggingHexUInt32(access, "Access"),
+		TraceLoggingHexUInt32(share, "Share"),
+		TraceLoggingUInt32(disposition, "Disposition"),
+		TraceLoggingHexUInt32(flagsAndAttributes, "FlagsAndAttributes"),
+		TraceLoggingUInt32(static_cast<UINT32>(result), "Result"),
+		TraceLoggingWinError(error, "Error"),
+		TraceLoggingPointer(handle, "Handle"),
+		TraceLoggingPointer(caller, "Caller"),
 		TraceLoggingInt64(TickStart.QuadPart, "Start"),
-		TraceLoggingInt64(TickEnd.QuadPart, "End")
-	); // Field for your event in the form of (value, field name).
+		TraceLoggingInt64(TickEnd.QuadPart, "End"));
+}
+
+void Log_ETW_FileAttributesOperation(const char* operation, const wchar_t* path, std::size_t pathLength, DWORD infoLevel,
+    DWORD attributes, function_result result, DWORD error, const void* caller, LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd)
+{
+	TraceLoggingWrite(g_Log_ETW_ComponentProvider,
+		"FileAttributesOperation",
+		TraceLoggingKeyword(etw_keyword(function_type::filesystem)),
+		TraceLoggingString(operation, "Operation"),
+		TraceLoggingCountedWideString(path, static_cast<USHORT>(pathLength), "Path"),
+		TraceLoggingUInt32(infoLevel, "InfoLevel"),
+		TraceLoggingHexUInt32(attributes, "Attributes"),
+		TraceLoggingUInt32(static_cast<UINT32>(result), "Result"),
+		TraceLoggingWinError(error, "Error"),
+		TraceLoggingPointer(caller, "Caller"),
+		TraceLoggingInt64(TickStart.QuadPart, "Start"),
+		TraceLoggingInt64(TickEnd.QuadPart, "End"));
+}
+
+void Log_ETW_NtFileOperation(const char* operation, const wchar_t* path, std::size_t pathLength, HANDLE root, ACCESS_MASK access,
+    ULONG share, ULONG disposition, ULONG options, function_result result, NTSTATUS status, HANDLE handle, const void* caller,
+    LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd)
+{
+	TraceLoggingWrite(g_Log_ETW_ComponentProvider,
+		"NtFileOperation",
+		TraceLoggingKeyword(etw_keyword(function_type::filesystem)),
+		TraceLoggingString(operation, "Operation"),
+		TraceLoggingCountedWideString(path, static_cast<USHORT>(pathLength), "Path"),
+		TraceLoggingPointer(root, "Root"),
+		TraceLoggingHexUInt32(access, "Access"),
+		TraceLoggingHexUInt32(share, "Share"),
+		TraceLoggingUInt32(disposition, "Disposition"),
+		TraceLoggingHexUInt32(options, "Options"),
+		TraceLoggingUInt32(static_cast<UINT32>(result), "Result"),
+		TraceLoggingNTStatus(status, "Status"),
+		TraceLoggingPointer(handle, "Handle"),
+		TraceLoggingPointer(caller, "Caller"),
+		TraceLoggingInt64(TickStart.QuadPart, "Start"),
+		TraceLoggingInt64(TickEnd.QuadPart, "End"));
+}
+
+void Log_ETW_RegistryOperation(const char* operation, HKEY key, const wchar_t* name, std::size_t nameLength, DWORD options,
+    REGSAM access, DWORD type, DWORD dataSize, function_result result, LSTATUS error, HKEY resultKey, const void* caller,
+    LARGE_INTEGER TickStart, LARGE_INTEGER TickEnd)
+{
+	TraceLoggingWrite(g_Log_ETW_ComponentProvider,
+		"RegistryOperation",
+		TraceLoggingKeyword(etw_keyword(function_type::registry)),
+		TraceLoggingString(operation, "Operation"),
+		TraceLoggingPointer(key, "Key"),
+		TraceLoggingCountedWideString(name, static_cast<USHORT>(nameLength), "Name"),
+		TraceLoggingHexUInt32(options, "Options"),
+		TraceLoggingHexUInt32(access, "Access"),
+		TraceLoggingUInt32(type, "Type"),
+		TraceLoggingUInt32(dataSize, "DataSize"),
+		TraceLoggingUInt32(static_cast<UINT32>(result), "Result"),
+		TraceLoggingWinError(static_cast<DWORD>(error), "Error"),
+		TraceLoggingPointer(resultKey, "ResultKey"),
+		TraceLoggingPointer(caller, "Caller"),
+		TraceLoggingInt64(TickStart.QuadPart, "Start"),
+		TraceLoggingInt64(TickEnd.QuadPart, "End"));
 }
 
 void Log_ETW_PostMsgW(const wchar_t * s)
@@ -189,7 +803,7 @@ void Log_ETW_UnRegister()
 	TraceLoggingUnregister(g_Log_ETW_ComponentProvider);
 }
 
-BOOL __stdcall DllMain(HINSTANCE, DWORD reason, LPVOID) noexcept try
+BOOL __stdcall DllMain(HINSTANCE, DWORD reason, LPVOID reserved) noexcept try
 {
     if (reason == DLL_PROCESS_ATTACH)
     {
@@ -211,6 +825,22 @@ BOOL __stdcall DllMain(HINSTANCE, DWORD reason, LPVOID) noexcept try
 					Log_ETW_Register();
 					Log("config traceMethod is eventlog");
 				}
+                else if ((methodStr == "raw"sv) && start_raw_trace(configObj))
+                {
+                    output_method = trace_method::raw;
+                    Log("config traceMethod is raw");
+                }
+                else if ((methodStr == "file"sv) && start_ring_trace(configObj))
+                {
+                    // The same records as the raw method, written somewhere else
+                    output_method = trace_method::raw;
+                    Log("config traceMethod is file");
+                }
+                else if ((methodStr == "summary"sv) && open_trace_file(configObj, L"-summary.txt"))
+                {
+                    output_method = trace_method::summary;
+                    Log("config traceMethod is summary");
+                }
 				else {
                     // Otherwise, use the default (OutputDebugString)
 					Log("config traceMethod is default");
@@ -239,6 +869,17 @@ BOOL __stdcall DllMain(HINSTANCE, DWORD reason, LPVOID) noexcept try
                 }
             }
 
+            configure_path_scope(configObj);
+
+            if (auto slowCalls = configObj.try_get("slowCalls"))
+            {
+                configure_slow_calls(slowCalls->as_object());
+            }
+
+            auto sampling = configObj.try_get("sampling");
+            auto rateLimits = configObj.try_get("rateLimits");
+            configure_call_limits(sampling ? &sampling->as_object() : nullptr, rateLimits ? &rateLimits->as_object() : nullptr);
+
             if (auto debuggerConfig = configObj.try_get("waitForDebugger"))
             {
                 wait_for_debugger = static_cast<bool>(debuggerConfig->as_boolean());
@@ -258,13 +899,30 @@ BOOL __stdcall DllMain(HINSTANCE, DWORD reason, LPVOID) noexcept try
             {
                 ignore_dll_load = static_cast<bool>(ignoreDllConfig->as_boolean());
             }
+
+            if (auto timelineConfig = configObj.try_get("moduleTimeline"); timelineConfig && static_cast<bool>(timelineConfig->as_boolean()))
+            {
+                start_module_timeline(configObj);
+            }
         }
 
+        resolve_result_configurations();
+
         if (wait_for_debugger)
         {
             psf::wait_for_debugger();
         }
     }
+    else if (reason == DLL_PROCESS_DETACH)
+    {
+        if (output_method == trace_method::summary)
+        {
+            report_summary();
+        }
+        report_untraced_calls();
+        write_module_timeline();
+        psf::flush_log(reserved != nullptr);
+    }
 
     return TRUE;
 }
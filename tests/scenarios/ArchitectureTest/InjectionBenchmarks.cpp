@@ -0,0 +1,240 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Times launching a child process that exits as soon as it gets to run, both of our own architecture and of the other
+// one, to see what getting the PsfRuntime injected into it costs. Each launch takes one of three ways into the child:
+//  * Same Architecture, where the PsfRuntime calls DetourUpdateProcessWithDll itself
+//  * Helper, where the architecture differs and the PsfRuntime launches PsfRunDll to do it instead (see
+//    DetourProcessViaHelperDllsW), which also starts the injection broker
+//  * Broker, where the architecture differs and the injection broker that's already running does it (see
+//    InjectionBroker.cpp in the PsfRuntime)
+// Once started, a broker stays around for minutes, so only the first cross architecture launch of a run - if any - takes
+// the helper's way. Each launch gets reported on its own, along with the way it took, which is worked out by checking
+// for the broker's pipe before the launch.
+// NOTE: Everything that gets traced is wide, since the test fixup changes what MultiByteToWideChar gives back
+
+#include <cstdint>
+#include <string>
+
+#include <windows.h>
+#include <appmodel.h>
+
+#include <test_config.h>
+
+using namespace std::literals;
+
+#ifdef _M_IX86
+constexpr const wchar_t g_currentArchitectureExe[] = L"ArchitectureTest32.exe";
+constexpr const wchar_t g_otherArchitectureExe[] = L"ArchitectureTest64.exe";
+constexpr const wchar_t g_currentArchitectureName[] = L"x86";
+constexpr const wchar_t g_otherArchitectureName[] = L"x64";
+#else
+constexpr const wchar_t g_currentArchitectureExe[] = L"ArchitectureTest64.exe";
+constexpr const wchar_t g_otherArchitectureExe[] = L"ArchitectureTest32.exe";
+constexpr const wchar_t g_currentArchitectureName[] = L"x64";
+constexpr const wchar_t g_otherArchitectureName[] = L"x86";
+#endif
+
+// How long to give the broker that the first cross architecture launch started to show up. The PsfRuntime gives up on
+// the broker if a launch finds it still missing, so the launches after the first one wait for it
+constexpr DWORD broker_startup_timeout_ms = 5000;
+
+enum class injection_path
+{
+    same_architecture,
+    helper,
+    broker,
+    count
+};
+
+static const wchar_t* injection_path_name(injection_path path)
+{
+    switch (path)
+    {
+    case injection_path::same_architecture: return L"Same Architecture";
+    case injection_path::helper: return L"Helper";
+    case injection_path::broker: return L"Broker";
+    }
+
+    return L"Unknown";
+}
+
+// The same as the PsfRuntime's name for the broker of the other architecture
+static std::wstring injection_broker_pipe_name()
+{
+    UINT32 length = 0;
+    ::GetCurrentPackageFullName(&length, nullptr);
+    std::wstring packageFullName(length, L'\0');
+    if (::GetCurrentPackageFullName(&length, packageFullName.data()) != ERROR_SUCCESS)
+    {
+        return {};
+    }
+    packageFullName.resize(length - 1);
+
+    DWORD sessionId = 0;
+    ::ProcessIdToSessionId(::GetCurrentProcessId(), &sessionId);
+    return LR"(\\.\pipe\PsfInjectionBroker_)" + packageFullName + L"_" + std::to_wstring(sessionId) + L"_" +
+        ((sizeof(void*) == 4) ? L"64" : L"32");
+}
+
+static bool injection_broker_running(const std::wstring& pipeName)
+{
+    // Every instance of the pipe being busy still means that the broker is there
+    return ::WaitNamedPipeW(pipeName.c_str(), 1) || (::GetLastError() == ERROR_SEM_TIMEOUT);
+}
+
+static bool wait_for_injection_broker(const std::wstring& pipeName)
+{
+    auto start = ::GetTickCount64();
+    while (!injection_broker_running(pipeName))
+    {
+        if ((::GetTickCount64() - start) >= broker_startup_timeout_ms)
+        {
+            return false;
+        }
+        ::Sleep(10);
+    }
+
+    return true;
+}
+
+struct launch_timing
+{
+    std::int64_t create_ticks; // How long CreateProcess took, which includes the injection
+    std::int64_t exit_ticks;   // ... and until the child exited, which includes the PsfRuntime starting up in it
+};
+
+static int launch_child(const wchar_t* exe, launch_timing& timing)
+{
+    std::wstring commandLine = exe + L" /exitImmediately:true"s;
+    STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+    PROCESS_INFORMATION processInformation;
+
+    LARGE_INTEGER start, created, exited;
+    ::QueryPerformanceCounter(&start);
+    if (!::CreateProcessW(nullptr, commandLine.data(), nullptr, nullptr, false, 0, nullptr, nullptr, &startupInfo, &processInformation))
+    {
+        return trace_last_error(L"Failed to launch the child process");
+    }
+    ::QueryPerformanceCounter(&created);
+    ::WaitForSingleObject(processInformation.hProcess, INFINITE);
+    ::QueryPerformanceCounter(&exited);
+
+    DWORD exitCode = ERROR_SUCCESS;
+    ::GetExitCodeProcess(processInformation.hProcess, &exitCode);
+    ::CloseHandle(processInformation.hProcess);
+    ::CloseHandle(processInformation.hThread);
+    if (exitCode != ERROR_SUCCESS)
+    {
+        return trace_error(static_cast<int>(exitCode), L"The child process failed");
+    }
+
+    timing.create_ticks = created.QuadPart - start.QuadPart;
+    timing.exit_ticks = exited.QuadPart - start.QuadPart;
+    return ERROR_SUCCESS;
+}
+
+struct path_results
+{
+    std::int32_t launches = 0;
+    std::int64_t create_ticks = 0;
+    std::uint32_t histogram[benchmark_latency_bucket_count] = {};
+};
+
+static int DoInjectionBenchmark(bool crossArchitecture, int iterations)
+{
+    auto exe = crossArchitecture ? g_otherArchitectureExe : g_currentArchitectureExe;
+    auto pipeName = injection_broker_pipe_name();
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+    auto toMilliseconds = [&](std::int64_t ticks) { return static_cast<double>(ticks) * 1000.0 / frequency.QuadPart; };
+
+    // The first launch of the same architecture reads the child's files into the file cache, and has the PsfRuntime find
+    // out what to do with it, neither of which the cross architecture launches get to skip, so that they're comparable
+    launch_timing timing;
+    if (!crossArchitecture)
+    {
+        if (auto result = launch_child(exe, timing))
+        {
+            return result;
+        }
+    }
+
+    path_results results[static_cast<std::size_t>(injection_path::count)];
+    for (int i = 0; i < iterations; ++i)
+    {
+        auto path = injection_path::same_architecture;
+        if (crossArchitecture)
+        {
+            path = injection_broker_running(pipeName) ? injection_path::broker : injection_path::helper;
+        }
+
+        if (auto result = launch_child(exe, timing))
+        {
+            return result;
+        }
+
+        trace_messages(L"Launch ", info_color, std::to_wstring(i + 1), console::color::gray, L" (", info_color,
+            injection_path_name(path), console::color::gray, L"): CreateProcess ", info_color,
+            std::to_wstring(toMilliseconds(timing.create_ticks)), console::color::gray, L" ms, until exit ", info_color,
+            std::to_wstring(toMilliseconds(timing.exit_ticks)), console::color::gray, L" ms\n");
+
+        auto& pathResults = results[static_cast<std::size_t>(path)];
+        ++pathResults.launches;
+        pathResults.create_ticks += timing.create_ticks;
+        ++pathResults.histogram[benchmark_latency_bucket(static_cast<std::uint64_t>((timing.create_ticks * 1000000000.0) / frequency.QuadPart))];
+
+        if ((path == injection_path::helper) && !wait_for_injection_broker(pipeName))
+        {
+            trace_message(L"WARNING: The injection broker did not start, so every launch will use the helper\n", warning_color);
+        }
+    }
+
+    if (crossArchitecture && !results[static_cast<std::size_t>(injection_path::helper)].launches)
+    {
+        trace_message(L"NOTE: The injection broker was already running, so no launch used the helper\n", info_color);
+    }
+
+    for (std::size_t i = 0; i < std::size(results); ++i)
+    {
+        auto& pathResults = results[i];
+        if (!pathResults.launches)
+        {
+            continue;
+        }
+
+        auto name = L"CreateProcess ("s + g_currentArchitectureName + L" -> " +
+            (crossArchitecture ? g_otherArchitectureName : g_currentArchitectureName) + L", " +
+            injection_path_name(static_cast<injection_path>(i)) + L")";
+        auto microsecondsPerLaunch = (static_cast<double>(pathResults.create_ticks) * 1000000.0 / frequency.QuadPart) / pathResults.launches;
+        if (auto result = test_benchmark(narrow(name), benchmark_setup::fixups, pathResults.launches, microsecondsPerLaunch, pathResults.histogram))
+        {
+            return result;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+int InjectionBenchmarks(int iterations)
+{
+    if (iterations <= 0)
+    {
+        std::wcout << error_text() << "ERROR: The benchmark iteration count must be a positive number\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    int result = ERROR_SUCCESS;
+    for (auto crossArchitecture : { false, true })
+    {
+        test_begin(crossArchitecture ? "Cross Architecture Injection" : "Same Architecture Injection");
+        auto testResult = DoInjectionBenchmark(crossArchitecture, iterations);
+        result = result ? result : testResult;
+        test_end(testResult);
+    }
+
+    return result;
+}
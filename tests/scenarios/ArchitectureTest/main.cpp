@@ -3,6 +3,7 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 
@@ -12,11 +13,34 @@
 
 using namespace std::literals;
 
+int InjectionBenchmarks(int iterations);
+
 int wmain(int argc, const wchar_t** argv)
 {
     std::map<std::wstring_view, std::wstring> allowedArgs;
     allowedArgs.emplace(L"/launchChild"sv, L"true");
+    allowedArgs.emplace(L"/benchmark"sv, L"");
+    allowedArgs.emplace(L"/exitImmediately"sv, L"false");
     auto result = parse_args(argc, argv, allowedArgs);
+    if ((result == ERROR_SUCCESS) && (allowedArgs[L"/exitImmediately"sv] == L"true"))
+    {
+        // A child that the injection benchmarks launch, which only needs to get as far as its entry point
+        return ERROR_SUCCESS;
+    }
+    else if ((result == ERROR_SUCCESS) && !allowedArgs[L"/benchmark"sv].empty())
+    {
+        // The iteration count is the number of children to launch of each architecture
+        test_initialize("Architecture Benchmarks", 2);
+        result = InjectionBenchmarks(std::wcstol(allowedArgs[L"/benchmark"sv].c_str(), nullptr, 10));
+        test_cleanup();
+
+        if (!g_testRunnerPipe)
+        {
+            system("pause");
+        }
+
+        return result;
+    }
 
 #ifdef _M_IX86
     constexpr const wchar_t targetExe[] = L"ArchitectureTest64.exe";
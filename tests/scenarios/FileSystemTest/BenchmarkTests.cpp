@@ -0,0 +1,284 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Timed loops over the same filesystem APIs that the tests exercise. The same executable reports its timings from three
+// setups - with the fixups, with PsfRuntime but no fixups, and unpackaged - and the test runner lines them up to
+// compute the overhead. Unlike the tests, everything here happens in a directory that the benchmark creates itself,
+// since the package's files don't exist when running unpackaged.
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <known_folders.h>
+#include <psf_constants.h>
+#include <psf_utils.h>
+#include <test_config.h>
+
+#include "common_paths.h"
+
+using namespace std::literals;
+
+// Number of files in the directory that the enumeration benchmark walks
+constexpr int benchmark_enumeration_file_count = 100;
+
+struct benchmark
+{
+    const char* name;
+
+    // Called before each timed call, but not timed itself. Used to set up whatever state the timed call needs. Either
+    // may set the last error and return false on failure
+    std::function<bool(int)> prepare;
+    std::function<bool()> run;
+};
+
+static benchmark_setup current_setup()
+{
+    if (!psf::is_packaged())
+    {
+        return benchmark_setup::unpackaged;
+    }
+
+    // PsfRuntime is always present when launched through PsfLauncher, so the fixup dll is what distinguishes the two
+    auto fixupDll = L"FileRedirectionFixup"s + psf::warch_string + L".dll";
+    return ::GetModuleHandleW(fixupDll.c_str()) ? benchmark_setup::fixups : benchmark_setup::runtime_only;
+}
+
+static std::filesystem::path benchmark_root(benchmark_setup setup)
+{
+    switch (setup)
+    {
+    case benchmark_setup::fixups:
+        // Redirected by the "Benchmark" pattern in config.json
+        return psf::current_package_path() / L"Benchmark";
+
+    case benchmark_setup::runtime_only:
+        // Without fixups, nothing makes the package path writable
+        return psf::known_folder(FOLDERID_LocalAppData) / L"Benchmark";
+
+    default:
+        return psf::current_executable_path().parent_path() / L"Benchmark";
+    }
+}
+
+static void clean_benchmark_root(benchmark_setup setup, const std::filesystem::path& root)
+{
+    if (setup == benchmark_setup::fixups)
+    {
+        clean_redirection_path();
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+    if (ec)
+    {
+        trace_message(L"WARNING: Failed to clean the benchmark directory. Results may be impacted by this...\n", warning_color);
+        trace_messages(warning_color, L"WARNING: ", ec.message(), new_line);
+    }
+}
+
+static std::wstring indexed_path(const std::filesystem::path& root, const wchar_t* prefix, int index, const wchar_t* extension = L".txt")
+{
+    return (root / (prefix + std::to_wstring(index) + extension)).native();
+}
+
+static int run_benchmark(const benchmark& bench, benchmark_setup setup, int iterations)
+{
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+
+    // One untimed call first so that one-time costs (e.g. the fixup creating the redirected directory) don't skew the
+    // results. It uses an index that the timed calls never do, so it doesn't collide with them
+    std::int64_t ticks = 0;
+    std::uint32_t histogram[benchmark_latency_bucket_count] = {};
+    for (int i = -1; i < iterations; ++i)
+    {
+        if (bench.prepare && !bench.prepare(i))
+        {
+            return trace_last_error(L"Failed to prepare for the benchmark");
+        }
+
+        LARGE_INTEGER start, end;
+        ::QueryPerformanceCounter(&start);
+        auto succeeded = bench.run();
+        ::QueryPerformanceCounter(&end);
+
+        if (!succeeded)
+        {
+            return trace_last_error(L"The benchmarked call failed");
+        }
+
+        if (i >= 0)
+        {
+            auto callTicks = end.QuadPart - start.QuadPart;
+            ticks += callTicks;
+            ++histogram[benchmark_latency_bucket(static_cast<std::uint64_t>((callTicks * 1000000000.0) / frequency.QuadPart))];
+        }
+    }
+
+    auto microsecondsPerCall = (static_cast<double>(ticks) * 1000000.0) / (static_cast<double>(frequency.QuadPart) * iterations);
+    return test_benchmark(bench.name, setup, iterations, microsecondsPerCall, histogram);
+}
+
+static std::vector<benchmark> make_benchmarks(const std::filesystem::path& root)
+{
+    // The paths that the timed calls operate on get computed in 'prepare' so that building them isn't timed
+    auto sourcePath = std::make_shared<std::wstring>((root / L"Source.txt").native());
+    auto enumPattern = std::make_shared<std::wstring>((root / L"Enumerate" / L"*.txt").native());
+    auto path = std::make_shared<std::wstring>();
+    auto otherPath = std::make_shared<std::wstring>();
+
+    return {
+        {
+            "CreateFile (Open Existing)",
+            nullptr,
+            [=]
+            {
+                auto file = ::CreateFileW(sourcePath->c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file == INVALID_HANDLE_VALUE)
+                {
+                    return false;
+                }
+
+                ::CloseHandle(file);
+                return true;
+            }
+        },
+        {
+            "CreateFile (Create New)",
+            [=](int i) { *path = indexed_path(root, L"Created", i); return true; },
+            [=] { return create_empty_file(path->c_str()); }
+        },
+        {
+            "GetFileAttributes",
+            nullptr,
+            [=] { return ::GetFileAttributesW(sourcePath->c_str()) != INVALID_FILE_ATTRIBUTES; }
+        },
+        {
+            "GetFileAttributesEx",
+            nullptr,
+            [=]
+            {
+                WIN32_FILE_ATTRIBUTE_DATA data;
+                return !!::GetFileAttributesExW(sourcePath->c_str(), GetFileExInfoStandard, &data);
+            }
+        },
+        {
+            "CopyFile",
+            [=](int) { *path = (root / L"Copy.txt").native(); return true; },
+            [=] { return !!::CopyFileW(sourcePath->c_str(), path->c_str(), false); }
+        },
+        {
+            "MoveFile",
+            [=](int i)
+            {
+                *path = indexed_path(root, L"MoveFrom", i);
+                *otherPath = indexed_path(root, L"MoveTo", i);
+                return create_empty_file(path->c_str());
+            },
+            [=] { return !!::MoveFileW(path->c_str(), otherPath->c_str()); }
+        },
+        {
+            "DeleteFile",
+            [=](int i) { *path = indexed_path(root, L"Delete", i); return create_empty_file(path->c_str()); },
+            [=] { return !!::DeleteFileW(path->c_str()); }
+        },
+        {
+            "CreateDirectory",
+            [=](int i) { *path = indexed_path(root, L"CreatedDirectory", i, L""); return true; },
+            [=] { return !!::CreateDirectoryW(path->c_str(), nullptr); }
+        },
+        {
+            "RemoveDirectory",
+            [=](int i) { *path = indexed_path(root, L"RemovedDirectory", i, L""); return !!::CreateDirectoryW(path->c_str(), nullptr); },
+            [=] { return !!::RemoveDirectoryW(path->c_str()); }
+        },
+        {
+            "FindFirstFile/FindNextFile (100 Files)",
+            nullptr,
+            [=]
+            {
+                WIN32_FIND_DATAW findData;
+                auto findHandle = ::FindFirstFileW(enumPattern->c_str(), &findData);
+                if (findHandle == INVALID_HANDLE_VALUE)
+                {
+                    return false;
+                }
+
+                int count = 1;
+                while (::FindNextFileW(findHandle, &findData))
+                {
+                    ++count;
+                }
+
+                auto succeeded = (::GetLastError() == ERROR_NO_MORE_FILES);
+                ::FindClose(findHandle);
+                if (succeeded && (count != benchmark_enumeration_file_count))
+                {
+                    ::SetLastError(ERROR_ASSERTION_FAILURE);
+                    succeeded = false;
+                }
+
+                return succeeded;
+            }
+        },
+    };
+}
+
+std::int32_t BenchmarkCount()
+{
+    return static_cast<std::int32_t>(make_benchmarks({}).size());
+}
+
+int BenchmarkTests(int iterations)
+{
+    if (iterations <= 0)
+    {
+        std::wcout << error_text() << "ERROR: The benchmark iteration count must be a positive number\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    auto setup = current_setup();
+    auto root = benchmark_root(setup);
+    std::wcout << "Benchmark Setup: " << info_text() << benchmark_setup_name(setup) << "\n";
+    std::wcout << "Benchmark Path: " << info_text() << root.native() << "\n";
+
+    clean_benchmark_root(setup, root);
+    std::error_code ec;
+    std::filesystem::create_directories(root / L"Enumerate", ec);
+    if (ec)
+    {
+        std::wcout << error_text() << "ERROR: Failed to create the benchmark directory: " << error_info_text() << ec.message().c_str() << "\n";
+        return ec.value();
+    }
+
+    if (!write_entire_file((root / L"Source.txt").c_str(), "You are reading from the benchmark file"))
+    {
+        return ERROR_WRITE_FAULT;
+    }
+
+    for (int i = 0; i < benchmark_enumeration_file_count; ++i)
+    {
+        if (!create_empty_file(indexed_path(root / L"Enumerate", L"File", i).c_str()))
+        {
+            return print_last_error("Failed to create the files to enumerate");
+        }
+    }
+
+    int result = ERROR_SUCCESS;
+    for (auto& bench : make_benchmarks(root))
+    {
+        test_begin(bench.name);
+        auto testResult = run_benchmark(bench, setup, iterations);
+        result = result ? result : testResult;
+        test_end(testResult);
+    }
+
+    clean_benchmark_root(setup, root);
+    return result;
+}
@@ -92,6 +92,45 @@ static int ModifyFileTest(const std::wstring_view filename, const vfs_mapping& m
         return ERROR_SUCCESS;
     };
 
+    // Read-only opens of files that haven't yet been modified should be served from the package path without copying
+    auto readFile = [](DWORD creationDisposition, const std::filesystem::path& filePath, const char* expectedContents) -> int
+    {
+        trace_messages(L"Opening File for read: ", info_color, filePath.native(), new_line);
+
+        auto file = ::CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, creationDisposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return trace_last_error(L"Failed to open file for read");
+        }
+        else if ((creationDisposition == OPEN_ALWAYS) && (::GetLastError() != ERROR_ALREADY_EXISTS))
+        {
+            trace_message(L"ERROR: Last error should be ERROR_ALREADY_EXISTS when opening with OPEN_ALWAYS\n", error_color);
+            ::CloseHandle(file);
+            return ERROR_ASSERTION_FAILURE;
+        }
+
+        char buffer[256];
+        DWORD size;
+        if (!::ReadFile(file, buffer, sizeof(buffer) - 1, &size, nullptr))
+        {
+            ::CloseHandle(file);
+            return trace_last_error(L"Failed to read from file");
+        }
+
+        ::CloseHandle(file);
+        buffer[size] = '\0';
+        if (std::strcmp(buffer, expectedContents) != 0)
+        {
+            trace_messages(error_color,
+                L"ERROR: File contents did not match the expected value\n",
+                L"ERROR: Expected contents: ", error_info_color, expectedContents, new_line, error_color,
+                L"ERROR: Actual contents:   ", error_info_color, buffer, new_line);
+            return ERROR_ASSERTION_FAILURE;
+        }
+
+        return ERROR_SUCCESS;
+    };
+
     static const char* const initial_contents = "You are reading from the package path";
     static const char* const first_modify_contents = "You are reading the first write to the redirected file";
     static const char* const second_modify_contents = "You are reading the second write to the redirected file";
@@ -102,7 +141,17 @@ static int ModifyFileTest(const std::wstring_view filename, const vfs_mapping& m
         // Clean up the redirected path so that existing files don't impact this test
         clean_redirection_path();
 
-        auto result = modifyFile(createFunc, OPEN_ALWAYS, packagePath / filename, initial_contents, first_modify_contents);
+        auto result = readFile(OPEN_EXISTING, packagePath / filename, initial_contents);
+        if (result) return result;
+
+        result = readFile(OPEN_ALWAYS, path / filename, initial_contents);
+        if (result) return result;
+
+        result = modifyFile(createFunc, OPEN_ALWAYS, packagePath / filename, initial_contents, first_modify_contents);
+        if (result) return result;
+
+        // Now that the file has been modified, read-only opens need to see the redirected file
+        result = readFile(OPEN_EXISTING, packagePath / filename, first_modify_contents);
         if (result) return result;
 
         result = modifyFile(createFunc, OPEN_EXISTING, path / filename, first_modify_contents, second_modify_contents);
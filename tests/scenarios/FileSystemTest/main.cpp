@@ -14,6 +14,8 @@
 
 #include "common_paths.h"
 
+using namespace std::literals;
+
 void InitializeFolderMappings()
 {
     g_packageRootPath = psf::current_package_path();
@@ -64,6 +66,9 @@ int CreateDirectoryTests();
 int RemoveDirectoryTests();
 int EnumerateDirectoriesTests();
 
+std::int32_t BenchmarkCount();
+int BenchmarkTests(int iterations);
+
 int run()
 {
     int result = ERROR_SUCCESS;
@@ -116,8 +121,17 @@ int wmain(int argc, const wchar_t** argv)
     // Display UTF-16 correctly...
     _setmode(_fileno(stdout), _O_U16TEXT);
 
-    auto result = parse_args(argc, argv);
-    if (result == ERROR_SUCCESS)
+    std::map<std::wstring_view, std::wstring> allowedArgs;
+    allowedArgs.emplace(L"/benchmark"sv, L"");
+    auto result = parse_args(argc, argv, allowedArgs);
+    if ((result == ERROR_SUCCESS) && !allowedArgs[L"/benchmark"sv].empty())
+    {
+        // NOTE: The benchmarks also run unpackaged, so they don't depend on the package's VFS mappings
+        test_initialize("File System Benchmarks", BenchmarkCount());
+        result = BenchmarkTests(std::wcstol(allowedArgs[L"/benchmark"sv].c_str(), nullptr, 10));
+        test_cleanup();
+    }
+    else if (result == ERROR_SUCCESS)
     {
         // The number of file mappings is different in 32-bit vs 64-bit
 #if !_M_IX86
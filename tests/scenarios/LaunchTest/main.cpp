@@ -0,0 +1,278 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// An application that does nothing but show a window, and that works out when each phase of its own launch happened:
+// when PsfLauncher and the application's processes got created, the PsfRuntime's startup timings (see
+// PSFQueryStartupTimings), and when its entry point got called and its window painted. It hands them to the
+// LaunchBenchmark driver (see launch_timings.h) and exits, or shows them in the window when launched by hand.
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include <windows.h>
+#include <TlHelp32.h>
+
+#include <psf_constants.h>
+#include <psf_runtime.h>
+
+#include <launch_timings.h>
+#include <test_runner.h>
+
+using namespace std::literals;
+
+using PSFQueryStartupTimingsProc = const psf_startup_timing* (__stdcall*)(std::size_t* count) noexcept;
+
+static launch_timings g_timings = {};
+static bool g_launchedByDriver = false;
+
+static std::int64_t& phase_time(launch_phase phase)
+{
+    return g_timings.phases[static_cast<std::size_t>(phase)];
+}
+
+static std::int64_t query_performance_counter() noexcept
+{
+    LARGE_INTEGER value;
+    ::QueryPerformanceCounter(&value);
+    return value.QuadPart;
+}
+
+// Process creation times are only available as system times, so they get converted to QueryPerformanceCounter values by
+// way of the two clocks' current values
+static std::int64_t creation_time(HANDLE process)
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!::GetProcessTimes(process, &creationTime, &exitTime, &kernelTime, &userTime))
+    {
+        return 0;
+    }
+
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+
+    FILETIME now;
+    ::GetSystemTimePreciseAsFileTime(&now);
+    auto counter = query_performance_counter();
+
+    auto toInt = [](const FILETIME& time) { return (static_cast<std::int64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+    auto elapsed = toInt(now) - toInt(creationTime); // 100ns units
+    return counter - (elapsed * frequency.QuadPart / 10000000);
+}
+
+// PsfLauncher is the process that created us, unless we were launched directly
+static unique_handle open_launcher_process()
+{
+    unique_handle snapshot(::CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
+    if (!snapshot)
+    {
+        return {};
+    }
+
+    DWORD parentId = 0;
+    PROCESSENTRY32W entry = { sizeof(entry) };
+    for (auto found = ::Process32FirstW(snapshot.get(), &entry); found; found = ::Process32NextW(snapshot.get(), &entry))
+    {
+        if (entry.th32ProcessID == ::GetCurrentProcessId())
+        {
+            parentId = entry.th32ParentProcessID;
+            break;
+        }
+    }
+
+    unique_handle parent(::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, parentId));
+    if (!parent)
+    {
+        return {};
+    }
+
+    wchar_t path[MAX_PATH];
+    DWORD size = static_cast<DWORD>(std::size(path));
+    if (!::QueryFullProcessImageNameW(parent.get(), 0, path, &size))
+    {
+        return {};
+    }
+
+    std::wstring_view name(path, size);
+    if (auto pos = name.find_last_of(L'\\'); pos != std::wstring_view::npos)
+    {
+        name = name.substr(pos + 1);
+    }
+
+    constexpr auto launcherName = L"PsfLauncher.exe"sv;
+    auto isLauncher = ::CompareStringOrdinal(name.data(), static_cast<int>(name.length()),
+        launcherName.data(), static_cast<int>(launcherName.length()), true) == CSTR_EQUAL;
+    return isLauncher ? std::move(parent) : unique_handle{};
+}
+
+static void record_runtime_timings()
+{
+    auto runtime = ::GetModuleHandleW((L"PsfRuntime"s + psf::warch_string + L".dll").c_str());
+    if (!runtime)
+    {
+        return;
+    }
+
+#if _M_IX86
+    auto query = reinterpret_cast<PSFQueryStartupTimingsProc>(::GetProcAddress(runtime, "_PSFQueryStartupTimings@4"));
+#else
+    auto query = reinterpret_cast<PSFQueryStartupTimingsProc>(::GetProcAddress(runtime, "PSFQueryStartupTimings"));
+#endif
+    if (!query)
+    {
+        return;
+    }
+
+    std::size_t count;
+    auto timings = query(&count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        switch (timings[i].phase)
+        {
+        case psf_startup_phase::load_config:
+            phase_time(launch_phase::runtime_attach) = timings[i].start;
+            break;
+
+        case psf_startup_phase::attach_commit:
+            phase_time(launch_phase::runtime_attached) = timings[i].end;
+            break;
+
+        case psf_startup_phase::load_fixups:
+            phase_time(launch_phase::fixups_load) = timings[i].start;
+            phase_time(launch_phase::fixups_loaded) = timings[i].end;
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+// Times relative to the creation of the first process, for showing in the window
+static std::wstring format_timings()
+{
+    LARGE_INTEGER frequency;
+    ::QueryPerformanceFrequency(&frequency);
+
+    auto first = phase_time(launch_phase::launcher_created) ? phase_time(launch_phase::launcher_created) : phase_time(launch_phase::app_created);
+    std::wstring result;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(launch_phase::count); ++i)
+    {
+        result += launch_phase_name(static_cast<launch_phase>(i));
+        result += L": ";
+        if (g_timings.phases[i])
+        {
+            auto milliseconds = static_cast<double>(g_timings.phases[i] - first) * 1000.0 / frequency.QuadPart;
+            result += std::to_wstring(milliseconds) + L" ms\n";
+        }
+        else
+        {
+            result += L"-\n";
+        }
+    }
+
+    return result;
+}
+
+static void report_timings()
+{
+    unique_handle section(::OpenFileMappingW(FILE_MAP_WRITE, false, launch_timings_section_name));
+    unique_handle readyEvent(::OpenEventW(EVENT_MODIFY_STATE, false, launch_timings_event_name));
+    if (!section || !readyEvent)
+    {
+        return;
+    }
+
+    if (auto view = ::MapViewOfFile(section.get(), FILE_MAP_WRITE, 0, 0, sizeof(launch_timings)))
+    {
+        *static_cast<launch_timings*>(view) = g_timings;
+        ::UnmapViewOfFile(view);
+        ::SetEvent(readyEvent.get());
+        g_launchedByDriver = true;
+    }
+}
+
+static LRESULT __stdcall window_proc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
+{
+    switch (message)
+    {
+    case WM_PAINT:
+    {
+        PAINTSTRUCT paint;
+        auto dc = ::BeginPaint(window, &paint);
+        if (phase_time(launch_phase::first_window))
+        {
+            auto text = format_timings();
+            RECT rect;
+            ::GetClientRect(window, &rect);
+            ::DrawTextW(dc, text.c_str(), static_cast<int>(text.length()), &rect, DT_LEFT | DT_TOP);
+        }
+        ::EndPaint(window, &paint);
+
+        if (!phase_time(launch_phase::first_window))
+        {
+            phase_time(launch_phase::first_window) = query_performance_counter();
+            report_timings();
+            if (g_launchedByDriver)
+            {
+                ::DestroyWindow(window);
+            }
+            else
+            {
+                ::InvalidateRect(window, nullptr, true);
+            }
+        }
+        return 0;
+    }
+
+    case WM_DESTROY:
+        ::PostQuitMessage(0);
+        return 0;
+    }
+
+    return ::DefWindowProcW(window, message, wparam, lparam);
+}
+
+int __stdcall wWinMain(HINSTANCE instance, HINSTANCE, PWSTR, int showCommand)
+{
+    phase_time(launch_phase::app_entry_point) = query_performance_counter();
+    phase_time(launch_phase::app_created) = creation_time(::GetCurrentProcess());
+    if (auto launcher = open_launcher_process())
+    {
+        phase_time(launch_phase::launcher_created) = creation_time(launcher.get());
+    }
+    record_runtime_timings();
+
+    WNDCLASSEXW windowClass = { sizeof(windowClass) };
+    windowClass.lpfnWndProc = window_proc;
+    windowClass.hInstance = instance;
+    windowClass.hCursor = ::LoadCursorW(nullptr, IDC_ARROW);
+    windowClass.hbrBackground = reinterpret_cast<HBRUSH>(COLOR_WINDOW + 1);
+    windowClass.lpszClassName = L"LaunchTestWindow";
+    if (!::RegisterClassExW(&windowClass))
+    {
+        return ::GetLastError();
+    }
+
+    auto window = ::CreateWindowExW(0, windowClass.lpszClassName, L"Launch Test", WS_OVERLAPPEDWINDOW,
+        CW_USEDEFAULT, CW_USEDEFAULT, 480, 320, nullptr, nullptr, instance, nullptr);
+    if (!window)
+    {
+        return ::GetLastError();
+    }
+
+    ::ShowWindow(window, showCommand);
+    ::UpdateWindow(window);
+
+    MSG msg;
+    while (::GetMessageW(&msg, nullptr, 0, 0) > 0)
+    {
+        ::TranslateMessage(&msg);
+        ::DispatchMessageW(&msg);
+    }
+
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,299 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Benchmarks that show how the cost of the redirected filesystem APIs scales with the shape of the tree underneath the
+// redirected path. There are two sets of generated trees:
+//  * Deep trees, one directory per level, from 5 to 60 levels deep. Creating each level goes through the fixup's
+//    creation of the redirected directory structure, and everything at the leaf goes through path normalization with
+//    ever longer paths. GetFullPathName isn't redirected, so it gives a baseline for the cost of the path alone
+//  * Wide directories, from 1 to 10,000 files in the test directory. The test directory exists in the package too, so
+//    enumerating it goes through the merging of the package and redirected directories
+// Each is run with both short and long names. The iteration count is the number of calls to time per API, give or take,
+// so the trees get created and deleted as many times as it takes to reach it. Only meaningful when run through the
+// "Fixed" entry point
+//
+// NOTE: The deep trees quickly reach lengths far beyond MAX_PATH, even before redirection, so all paths are given in
+//       their local device ("\\?\") form
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <test_config.h>
+
+#include "paths.h"
+
+using namespace std::literals;
+
+constexpr int benchmark_depths[] = { 5, 10, 20, 40, 60 };
+constexpr int benchmark_fan_outs[] = { 1, 10, 100, 1000, 10000 };
+
+enum class name_length
+{
+    short_names,
+    long_names,
+};
+
+constexpr name_length benchmark_name_lengths[] = { name_length::short_names, name_length::long_names };
+
+static const char* name_length_description(name_length length)
+{
+    return (length == name_length::short_names) ? "Short Names" : "Long Names";
+}
+
+static std::wstring directory_name(name_length length, int index)
+{
+    return ((length == name_length::short_names) ? L"d" : L"this_directory_name_is_long_enough_to_dominate_the_path_") +
+        std::to_wstring(index);
+}
+
+static std::wstring file_name(name_length length, int index)
+{
+    return ((length == name_length::short_names) ? L"f" : L"this_file_name_is_long_enough_to_dominate_the_path_") +
+        std::to_wstring(index) + L".txt";
+}
+
+static const std::wstring& benchmark_path()
+{
+    static const std::wstring result = LR"(\\?\)" + g_testPath.native();
+    return result;
+}
+
+// Accumulates the time spent in a single API across however many calls get made to it
+class benchmark_timer
+{
+public:
+
+    benchmark_timer(const char* api) :
+        m_api(api)
+    {
+        ::QueryPerformanceFrequency(&m_frequency);
+    }
+
+    // Returns false, with the last error preserved, when the call fails. Failed calls aren't counted, since e.g. the
+    // final FindNextFile call is expected to fail
+    bool time(const std::function<bool()>& fn)
+    {
+        LARGE_INTEGER start, end;
+        ::QueryPerformanceCounter(&start);
+        auto succeeded = fn();
+        ::QueryPerformanceCounter(&end);
+
+        if (succeeded)
+        {
+            m_ticks += end.QuadPart - start.QuadPart;
+            ++m_calls;
+        }
+
+        return succeeded;
+    }
+
+    int report(const std::string& description) const
+    {
+        auto microsecondsPerCall = m_calls ?
+            (static_cast<double>(m_ticks) * 1000000.0) / (static_cast<double>(m_frequency.QuadPart) * m_calls) :
+            0.0;
+        return test_benchmark(m_api + (" (" + description + ")"), benchmark_setup::fixups, m_calls, microsecondsPerCall);
+    }
+
+private:
+
+    std::string m_api;
+    LARGE_INTEGER m_frequency;
+    std::int64_t m_ticks = 0;
+    std::int32_t m_calls = 0;
+};
+
+static int DoDeepTreeBenchmark(int depth, name_length length, int iterations)
+{
+    // Each cycle makes 'depth' calls to the directory APIs, so scale the number of cycles to keep the number of calls
+    // that get timed about the same for every depth
+    auto cycles = std::max(1, iterations / depth);
+
+    clean_redirection_path();
+
+    // The full path of each level gets computed ahead of time so that building them isn't timed
+    std::vector<std::wstring> levels;
+    auto path = benchmark_path() + L"\\DeepTree";
+    if (!::CreateDirectoryW(path.c_str(), nullptr))
+    {
+        return trace_last_error(L"Failed to create the root of the tree");
+    }
+
+    for (int i = 0; i < depth; ++i)
+    {
+        path += L"\\" + directory_name(length, i);
+        levels.push_back(path);
+    }
+
+    auto filePath = levels.back() + L"\\" + file_name(length, 0);
+    trace_messages(L"Leaf file path length: ", info_color, std::to_wstring(filePath.length()), new_line);
+
+    benchmark_timer createDirectory("CreateDirectory");
+    benchmark_timer createFile("CreateFile");
+    benchmark_timer getFileAttributes("GetFileAttributes");
+    benchmark_timer getFullPathName("GetFullPathName");
+    benchmark_timer deleteFile("DeleteFile");
+    benchmark_timer removeDirectory("RemoveDirectory");
+
+    wchar_t fullPathBuffer[32 * 1024];
+    for (int i = 0; i < cycles; ++i)
+    {
+        for (auto& level : levels)
+        {
+            if (!createDirectory.time([&] { return !!::CreateDirectoryW(level.c_str(), nullptr); }))
+            {
+                return trace_last_error(L"CreateDirectory failed");
+            }
+        }
+
+        if (!createFile.time([&] { return create_empty_file(filePath.c_str()); }) ||
+            !getFileAttributes.time([&] { return ::GetFileAttributesW(filePath.c_str()) != INVALID_FILE_ATTRIBUTES; }) ||
+            !getFullPathName.time([&] { return ::GetFullPathNameW(filePath.c_str(), static_cast<DWORD>(std::size(fullPathBuffer)), fullPathBuffer, nullptr) != 0; }) ||
+            !deleteFile.time([&] { return !!::DeleteFileW(filePath.c_str()); }))
+        {
+            return trace_last_error(L"Failed to create, query, or delete the leaf file");
+        }
+
+        for (auto itr = levels.rbegin(); itr != levels.rend(); ++itr)
+        {
+            if (!removeDirectory.time([&] { return !!::RemoveDirectoryW(itr->c_str()); }))
+            {
+                return trace_last_error(L"RemoveDirectory failed");
+            }
+        }
+    }
+
+    auto description = "Depth " + std::to_string(depth) + ", " + name_length_description(length);
+    for (auto timer : { &createDirectory, &createFile, &getFileAttributes, &getFullPathName, &deleteFile, &removeDirectory })
+    {
+        if (auto result = timer->report(description))
+        {
+            return result;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static int DoWideDirectoryBenchmark(int fanOut, name_length length, int iterations)
+{
+    // Same as above
+    auto cycles = std::max(1, iterations / fanOut);
+
+    clean_redirection_path();
+
+    std::vector<std::wstring> files;
+    for (int i = 0; i < fanOut; ++i)
+    {
+        files.push_back(benchmark_path() + L"\\" + file_name(length, i));
+    }
+
+    auto pattern = benchmark_path() + L"\\*";
+
+    benchmark_timer createFile("CreateFile");
+    benchmark_timer findFile("FindFirstFile/FindNextFile");
+    benchmark_timer deleteFile("DeleteFile");
+
+    for (int i = 0; i < cycles; ++i)
+    {
+        for (auto& file : files)
+        {
+            if (!createFile.time([&] { return create_empty_file(file.c_str()); }))
+            {
+                return trace_last_error(L"CreateFile failed");
+            }
+        }
+
+        // Each FindFirstFile/FindNextFile call is timed separately so that the time is per entry. The package's copy of
+        // the directory adds 'file.txt'
+        WIN32_FIND_DATAW data;
+        HANDLE findHandle;
+        if (!findFile.time([&] { findHandle = ::FindFirstFileW(pattern.c_str(), &data); return findHandle != INVALID_HANDLE_VALUE; }))
+        {
+            return trace_last_error(L"FindFirstFile failed");
+        }
+
+        int count = 0;
+        do
+        {
+            if ((data.cFileName != L"."sv) && (data.cFileName != L".."sv))
+            {
+                ++count;
+            }
+        } while (findFile.time([&] { return !!::FindNextFileW(findHandle, &data); }));
+
+        auto error = ::GetLastError();
+        ::FindClose(findHandle);
+        if (error != ERROR_NO_MORE_FILES)
+        {
+            return trace_error(error, L"FindNextFile failed");
+        }
+        else if (count != fanOut + 1)
+        {
+            trace_messages(error_color, L"ERROR: Expected to find ", error_info_color, std::to_wstring(fanOut + 1),
+                error_color, L" entries, but found ", error_info_color, std::to_wstring(count), new_line);
+            return ERROR_ASSERTION_FAILURE;
+        }
+
+        for (auto& file : files)
+        {
+            if (!deleteFile.time([&] { return !!::DeleteFileW(file.c_str()); }))
+            {
+                return trace_last_error(L"DeleteFile failed");
+            }
+        }
+    }
+
+    auto description = "Fan-Out " + std::to_string(fanOut) + ", " + name_length_description(length);
+    for (auto timer : { &createFile, &findFile, &deleteFile })
+    {
+        if (auto result = timer->report(description))
+        {
+            return result;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+std::int32_t ScalingBenchmarkCount()
+{
+    return static_cast<std::int32_t>((std::size(benchmark_depths) + std::size(benchmark_fan_outs)) * std::size(benchmark_name_lengths));
+}
+
+int ScalingBenchmarks(int iterations)
+{
+    if (iterations <= 0)
+    {
+        std::wcout << error_text() << "ERROR: The benchmark iteration count must be a positive number\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    int result = ERROR_SUCCESS;
+    for (auto length : benchmark_name_lengths)
+    {
+        for (auto depth : benchmark_depths)
+        {
+            test_begin("Deep Tree Benchmark (Depth " + std::to_string(depth) + ", " + name_length_description(length) + ")");
+            auto testResult = DoDeepTreeBenchmark(depth, length, iterations);
+            result = result ? result : testResult;
+            test_end(testResult);
+        }
+
+        for (auto fanOut : benchmark_fan_outs)
+        {
+            test_begin("Wide Directory Benchmark (Fan-Out " + std::to_string(fanOut) + ", " + name_length_description(length) + ")");
+            auto testResult = DoWideDirectoryBenchmark(fanOut, length, iterations);
+            result = result ? result : testResult;
+            test_end(testResult);
+        }
+    }
+
+    clean_redirection_path();
+    return result;
+}
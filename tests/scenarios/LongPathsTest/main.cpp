@@ -12,6 +12,8 @@
 
 #include "paths.h"
 
+using namespace std::literals;
+
 // NOTE: Not every function is tested here. We only try and ensure that all of the "interesting" scenarios are covered,
 //       which in general includes:
 //  * Copying an existing file to the redirected path (i.e. a copy-on-read operation), which is covered by (at least)
@@ -26,6 +28,9 @@ int CreateRemoveDirectoryTest();
 int CreateDeleteFileTest();
 int FileEnumerationTest();
 
+std::int32_t ScalingBenchmarkCount();
+int ScalingBenchmarks(int iterations);
+
 int RunTests()
 {
     int result = ERROR_SUCCESS;
@@ -48,8 +53,16 @@ int RunTests()
 
 int wmain(int argc, const wchar_t** argv)
 {
-    auto result = parse_args(argc, argv);
-    if (result == ERROR_SUCCESS)
+    std::map<std::wstring_view, std::wstring> allowedArgs;
+    allowedArgs.emplace(L"/benchmark"sv, L"");
+    auto result = parse_args(argc, argv, allowedArgs);
+    if ((result == ERROR_SUCCESS) && !allowedArgs[L"/benchmark"sv].empty())
+    {
+        test_initialize("Long Paths Scaling Benchmarks", ScalingBenchmarkCount());
+        result = ScalingBenchmarks(std::wcstol(allowedArgs[L"/benchmark"sv].c_str(), nullptr, 10));
+        test_cleanup();
+    }
+    else if (result == ERROR_SUCCESS)
     {
         test_initialize("Long Paths Tests", 4);
 
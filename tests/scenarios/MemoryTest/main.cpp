@@ -0,0 +1,254 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Checks what the PsfRuntime and each of the fixups cost in memory once they're loaded and have been used for a bit (see
+// PSFQueryMemoryUsage) against a budget for each of them. Only memory that's private to the process counts, i.e. the
+// pages of the image that got written to, what's allocated from the private heap, and what the fixup reports itself,
+// since that's what every process of every session on the machine pays for again.
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <windows.h>
+
+#include <error_logging.h>
+#include <file_paths.h>
+#include <psf_constants.h>
+#include <psf_runtime.h>
+#include <psf_utils.h>
+#include <test_config.h>
+
+using namespace std::literals;
+
+using PSFQueryMemoryUsageProc = std::size_t (__stdcall*)(psf_memory_usage* usage, std::size_t capacity) noexcept;
+
+// Debug builds use the debug heap and have bigger images, so they get twice as much
+#ifdef _DEBUG
+constexpr std::uint64_t budget_scale = 2;
+#else
+constexpr std::uint64_t budget_scale = 1;
+#endif
+
+struct memory_budget
+{
+    const wchar_t* module; // The dll's file name, without the architecture suffix or extension. Null for unattributed memory
+    std::uint64_t bytes;
+};
+
+// Generous enough that regular changes fit, so that whatever goes over is worth a look
+constexpr memory_budget g_budgets[] =
+{
+    { nullptr, 64 * 1024 },
+    { L"PsfRuntime", 1024 * 1024 },
+    { L"FileRedirectionFixup", 512 * 1024 },
+    { L"DynamicLibraryFixup", 256 * 1024 },
+    { L"TraceFixup", 256 * 1024 },
+};
+
+constexpr char g_expectedFileContents[] = "You are reading from the package path";
+
+static std::wstring module_name(HMODULE module)
+{
+    if (!module)
+    {
+        return L"(Unattributed)";
+    }
+
+    auto name = psf::get_module_path(module).stem().native();
+    for (auto suffix : { L"32"sv, L"64"sv })
+    {
+        if ((name.length() > suffix.length()) && (std::wstring_view(name).substr(name.length() - suffix.length()) == suffix))
+        {
+            name.resize(name.length() - suffix.length());
+            break;
+        }
+    }
+
+    return name;
+}
+
+static std::wstring format_bytes(std::uint64_t bytes)
+{
+    return std::to_wstring((bytes + 1023) / 1024) + L" KB";
+}
+
+static PSFQueryMemoryUsageProc query_memory_usage_proc()
+{
+    auto runtime = ::GetModuleHandleW((L"PsfRuntime"s + psf::warch_string + L".dll").c_str());
+    if (!runtime)
+    {
+        return nullptr;
+    }
+
+#if _M_IX86
+    return reinterpret_cast<PSFQueryMemoryUsageProc>(::GetProcAddress(runtime, "_PSFQueryMemoryUsage@8"));
+#else
+    return reinterpret_cast<PSFQueryMemoryUsageProc>(::GetProcAddress(runtime, "PSFQueryMemoryUsage"));
+#endif
+}
+
+static std::vector<psf_memory_usage> query_memory_usage(PSFQueryMemoryUsageProc query)
+{
+    std::vector<psf_memory_usage> result(16);
+    while (true)
+    {
+        auto count = query(result.data(), result.size());
+        if (count <= result.size())
+        {
+            result.resize(count);
+            return result;
+        }
+        result.resize(count);
+    }
+}
+
+// Gives the fixups something to fill their caches with before measuring, so that the budgets cover more than just
+// having been loaded
+static int exercise_fixups()
+{
+    auto packagePath = psf::current_package_path() / L"Memory";
+    auto filePath = packagePath / L"file.txt";
+    if (auto contents = read_entire_file(filePath.c_str()); contents != g_expectedFileContents)
+    {
+        trace_message(L"ERROR: The file's contents do not match expected contents\n", error_color);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    // Writing to it copies it to the redirected path
+    if (!write_entire_file(filePath.c_str(), g_expectedFileContents))
+    {
+        return trace_last_error(L"Failed to write to the file");
+    }
+
+    for (auto& entry : std::filesystem::directory_iterator(packagePath))
+    {
+        ::GetFileAttributesW(entry.path().c_str());
+    }
+
+    // Not in the package, so this only looks the name up in the fixup's index
+    if (auto module = ::LoadLibraryW(L"MemoryTestNotInPackage.dll"))
+    {
+        ::FreeLibrary(module);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static int QueryTest(PSFQueryMemoryUsageProc query)
+{
+    test_begin("Memory Usage Query Test");
+
+    int result = ERROR_SUCCESS;
+    auto usage = query_memory_usage(query);
+    if (usage.empty() || usage[0].module)
+    {
+        trace_message(L"ERROR: The first entry should be for unattributed memory\n", error_color);
+        result = ERROR_ASSERTION_FAILURE;
+    }
+
+    for (auto& budget : g_budgets)
+    {
+        if (!budget.module)
+        {
+            continue;
+        }
+
+        auto itr = std::find_if(usage.begin(), usage.end(), [&](auto& entry) { return entry.module && (module_name(entry.module) == budget.module); });
+        if (itr == usage.end())
+        {
+            trace_messages(error_color, L"ERROR: No entry for ", error_info_color, budget.module, new_line);
+            result = ERROR_ASSERTION_FAILURE;
+        }
+        else if (itr->image_size == 0)
+        {
+            trace_messages(error_color, L"ERROR: The image size of ", error_info_color, budget.module, error_color, L" is zero\n");
+            result = ERROR_ASSERTION_FAILURE;
+        }
+    }
+
+    test_end(result);
+    return result;
+}
+
+static int BudgetTest(PSFQueryMemoryUsageProc query)
+{
+    test_begin("Memory Budget Test");
+
+    auto result = exercise_fixups();
+    if (result == ERROR_SUCCESS)
+    {
+        for (auto& entry : query_memory_usage(query))
+        {
+            auto name = module_name(entry.module);
+            auto total = entry.image_private_bytes + entry.heap_bytes + entry.reported_bytes;
+            trace_messages(info_color, name, console::color::gray, L": ", info_color, format_bytes(total),
+                console::color::gray, L" (image ", format_bytes(entry.image_private_bytes), L" of ", format_bytes(entry.image_size),
+                L", heap ", format_bytes(entry.heap_bytes), L" in ", std::to_wstring(entry.heap_allocations),
+                L" allocations, reported ", format_bytes(entry.reported_bytes), L")\n");
+
+            auto budget = std::find_if(std::begin(g_budgets), std::end(g_budgets), [&](auto& budget)
+            {
+                return budget.module ? (entry.module && (name == budget.module)) : !entry.module;
+            });
+            if (budget == std::end(g_budgets))
+            {
+                continue;
+            }
+
+            auto limit = budget->bytes * budget_scale;
+            if (total > limit)
+            {
+                trace_messages(error_color, L"ERROR: ", error_info_color, name, error_color, L" uses ", error_info_color,
+                    format_bytes(total), error_color, L", which is over its budget of ", error_info_color, format_bytes(limit), new_line);
+                result = ERROR_ASSERTION_FAILURE;
+            }
+        }
+    }
+
+    test_end(result);
+    return result;
+}
+
+int run()
+{
+    auto query = query_memory_usage_proc();
+    if (!query)
+    {
+        test_begin("Memory Usage Query Test");
+        auto result = trace_last_error(L"Failed to find PSFQueryMemoryUsage");
+        test_end(result);
+        return result;
+    }
+
+    auto result = QueryTest(query);
+    auto budgetResult = BudgetTest(query);
+    result = result ? result : budgetResult;
+
+    clean_redirection_path();
+    return result;
+}
+
+int wmain(int argc, const wchar_t** argv)
+{
+    auto result = parse_args(argc, argv);
+    if (result == ERROR_SUCCESS)
+    {
+        test_initialize("Memory Tests", 2);
+        result = run();
+
+        test_cleanup();
+    }
+
+    if (!g_testRunnerPipe)
+    {
+        system("pause");
+    }
+
+    return result;
+}
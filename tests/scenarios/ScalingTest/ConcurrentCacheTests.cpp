@@ -0,0 +1,359 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Tests for psf::concurrent_cache (see concurrent_cache.h), which the fixups use for state that every thread looks up,
+// e.g. the File Redirection Fixup's table of redirected handles. The eviction tests use a single shard, so that the
+// order that the clock hand visits the entries in is the order that they were added in. The threaded tests have every
+// thread add and look up entries at once, both with room for all of them and with far more entries than fit
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <concurrent_cache.h>
+#include <test_config.h>
+
+using namespace std::literals;
+
+// The PsfRuntime's exports aren't linked into the test, so the process heap stands in for the private heap
+PSFAPI void* __stdcall PSFAllocate(std::size_t size) noexcept
+{
+    return ::HeapAlloc(::GetProcessHeap(), 0, size);
+}
+
+PSFAPI void __stdcall PSFFree(_In_opt_ void* ptr) noexcept
+{
+    if (ptr)
+    {
+        ::HeapFree(::GetProcessHeap(), 0, ptr);
+    }
+}
+
+using test_cache = psf::concurrent_cache<std::uint32_t, std::wstring>;
+
+// Values that are heap allocated, so that a value that got torn, or read after being freed, doesn't match
+static std::wstring cache_value(std::uint32_t key)
+{
+    return L"Value of key number " + std::to_wstring(key);
+}
+
+static int check_entries(const test_cache& cache, std::initializer_list<std::uint32_t> keys, bool expectPresent)
+{
+    for (auto key : keys)
+    {
+        std::wstring value;
+        auto present = cache.try_get(key, value);
+        if (present != expectPresent)
+        {
+            trace_messages(error_color, L"ERROR: Key ", error_info_color, std::to_wstring(key), error_color,
+                present ? L" is still in the cache\n" : L" is missing from the cache\n");
+            return ERROR_ASSERTION_FAILURE;
+        }
+        else if (present && (value != cache_value(key)))
+        {
+            trace_messages(error_color, L"ERROR: Key ", error_info_color, std::to_wstring(key), error_color,
+                L" has the wrong value: ", error_info_color, value, new_line);
+            return ERROR_ASSERTION_FAILURE;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static int check_size(const test_cache& cache, std::size_t expectedSize)
+{
+    if (auto size = cache.statistics().size; size != expectedSize)
+    {
+        trace_messages(error_color, L"ERROR: The cache has ", error_info_color, std::to_wstring(size), error_color,
+            L" entries instead of ", error_info_color, std::to_wstring(expectedSize), new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+    else if (cache.empty() != (expectedSize == 0))
+    {
+        trace_messages(error_color, L"ERROR: The cache says that it ", error_info_color,
+            cache.empty() ? L"is" : L"isn't", error_color, L" empty when it has ", error_info_color,
+            std::to_wstring(expectedSize), error_color, L" entries\n");
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static int EvictionTest()
+{
+    test_cache cache(8, 1);
+    if (cache.capacity() != 8)
+    {
+        trace_messages(error_color, L"ERROR: The cache's capacity is ", error_info_color,
+            std::to_wstring(cache.capacity()), error_color, L" instead of ", error_info_color, L"8", new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    for (std::uint32_t key = 0; key < 8; ++key)
+    {
+        cache.insert_or_assign(key, cache_value(key));
+    }
+
+    // Everything fits, and looking the first four up keeps them from being the next to go
+    if (auto error = check_entries(cache, { 0, 1, 2, 3 }, true))
+    {
+        return error;
+    }
+
+    // The hand passes over the four that were looked up, clearing their flags, and stops at the first that wasn't
+    trace_message(L"Adding a ninth entry to a cache that holds eight\n");
+    cache.insert_or_assign(8, cache_value(8));
+    if (auto error = check_entries(cache, { 4 }, false))
+    {
+        return error;
+    }
+
+    // ... and carries on from where it left off, so the next to go is the one after
+    cache.insert_or_assign(9, cache_value(9));
+    if (auto error = check_entries(cache, { 5 }, false))
+    {
+        return error;
+    }
+
+    if (auto error = check_entries(cache, { 0, 1, 2, 3, 6, 7, 8, 9 }, true))
+    {
+        return error;
+    }
+
+    // Assigning to a key that's already there replaces its value without evicting anything
+    cache.insert_or_assign(9, cache_value(9));
+    if (auto error = check_size(cache, 8))
+    {
+        return error;
+    }
+
+    auto statistics = cache.statistics();
+    if ((statistics.evictions != 2) || (statistics.insertions != 10))
+    {
+        trace_messages(error_color, L"ERROR: The cache counted ", error_info_color,
+            std::to_wstring(statistics.evictions), error_color, L" evictions and ", error_info_color,
+            std::to_wstring(statistics.insertions), error_color, L" insertions instead of ", error_info_color, L"2",
+            error_color, L" and ", error_info_color, L"10", new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static int EraseTest()
+{
+    test_cache cache(8, 1);
+    if (auto error = check_size(cache, 0))
+    {
+        return error;
+    }
+
+    for (std::uint32_t key = 0; key < 8; ++key)
+    {
+        cache.insert_or_assign(key, cache_value(key));
+    }
+
+    if (!cache.erase(3) || cache.erase(3))
+    {
+        trace_message(L"ERROR: Erasing a key should only succeed the first time\n", error_color);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    if (auto error = check_size(cache, 7))
+    {
+        return error;
+    }
+
+    auto isEven = [](std::uint32_t key, const std::wstring&) { return (key % 2) == 0; };
+    if (auto erased = cache.erase_if(isEven); erased != 4)
+    {
+        trace_messages(error_color, L"ERROR: Erased ", error_info_color, std::to_wstring(erased), error_color,
+            L" entries with even keys instead of ", error_info_color, L"4", new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    if (auto error = check_entries(cache, { 0, 2, 3, 4, 6 }, false))
+    {
+        return error;
+    }
+
+    if (auto error = check_entries(cache, { 1, 5, 7 }, true))
+    {
+        return error;
+    }
+
+    // Erasing moved the last entries into the erased ones' places, which the clock hand still has to be able to visit
+    for (std::uint32_t key = 8; key < 16; ++key)
+    {
+        cache.insert_or_assign(key, cache_value(key));
+    }
+
+    if (auto error = check_size(cache, 8))
+    {
+        return error;
+    }
+
+    auto updated = cache.update(15, [](std::wstring& value) { value = cache_value(16); });
+    if (!updated || cache.update(16, [](std::wstring&) {}))
+    {
+        trace_message(L"ERROR: Updating a key should only succeed when it's in the cache\n", error_color);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    if (std::wstring value; !cache.try_get(15, value) || (value != cache_value(16)))
+    {
+        trace_message(L"ERROR: The updated entry doesn't have its new value\n", error_color);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    cache.clear();
+    return check_size(cache, 0);
+}
+
+// Every thread adds keys of its own, and looks up its own as well as those of the other threads, any of which may be
+// gone by then if the cache is too small to hold all of them. With 'roomForAll', the cache has enough spare room that
+// even an unlucky spread of the keys over the shards doesn't fill any of them
+static int ConcurrentInsertFindTest(bool roomForAll)
+{
+    constexpr std::uint32_t thread_count = 16;
+    constexpr std::uint32_t keys_per_thread = 4096;
+
+    test_cache cache(roomForAll ? (4 * thread_count * keys_per_thread) : 256);
+    std::atomic<bool> started = false;
+    std::atomic<std::uint32_t> wrongValues = 0;
+    std::atomic<std::uint32_t> missingKeys = 0;
+    std::atomic<std::uint64_t> lookups = 0;
+
+    std::vector<std::thread> threads;
+    for (std::uint32_t index = 0; index < thread_count; ++index)
+    {
+        threads.emplace_back([&, index]()
+        {
+            while (!started)
+            {
+                std::this_thread::yield();
+            }
+
+            std::uint64_t threadLookups = 0;
+            for (std::uint32_t i = 0; i < keys_per_thread; ++i)
+            {
+                auto key = index * keys_per_thread + i;
+                cache.insert_or_assign(key, cache_value(key));
+
+                // The key that was just added, one that this thread added earlier, and one of another thread's
+                auto otherKey = ((index + 1) % thread_count) * keys_per_thread + i;
+                for (auto lookupKey : { key, index * keys_per_thread + (i / 2), otherKey })
+                {
+                    std::wstring value;
+                    if (cache.try_get(lookupKey, value) && (value != cache_value(lookupKey)))
+                    {
+                        ++wrongValues;
+                    }
+                    ++threadLookups;
+                }
+            }
+
+            // With room for every key, none of this thread's should have gone anywhere
+            if (roomForAll)
+            {
+                for (std::uint32_t i = 0; i < keys_per_thread; ++i)
+                {
+                    auto key = index * keys_per_thread + i;
+                    std::wstring value;
+                    if (!cache.try_get(key, value))
+                    {
+                        ++missingKeys;
+                    }
+                    else if (value != cache_value(key))
+                    {
+                        ++wrongValues;
+                    }
+                    ++threadLookups;
+                }
+            }
+
+            lookups += threadLookups;
+        });
+    }
+
+    started = true;
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (wrongValues || missingKeys)
+    {
+        trace_messages(error_color, L"ERROR: Lookups found ", error_info_color, std::to_wstring(wrongValues.load()),
+            error_color, L" wrong values and were missing ", error_info_color, std::to_wstring(missingKeys.load()),
+            error_color, L" keys\n");
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    auto statistics = cache.statistics();
+    trace_messages(L"Hits: ", info_color, std::to_wstring(statistics.hits), console::color::gray, L", Misses: ",
+        info_color, std::to_wstring(statistics.misses), console::color::gray, L", Evictions: ", info_color,
+        std::to_wstring(statistics.evictions), new_line);
+    if (statistics.size > cache.capacity())
+    {
+        trace_messages(error_color, L"ERROR: The cache holds ", error_info_color, std::to_wstring(statistics.size),
+            error_color, L" entries, which is more than its capacity of ", error_info_color,
+            std::to_wstring(cache.capacity()), new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+    else if (statistics.hits + statistics.misses != lookups.load())
+    {
+        trace_messages(error_color, L"ERROR: The cache counted ", error_info_color,
+            std::to_wstring(statistics.hits + statistics.misses), error_color, L" lookups instead of ",
+            error_info_color, std::to_wstring(lookups.load()), new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+    else if (statistics.size + statistics.evictions != thread_count * keys_per_thread)
+    {
+        // Every key is distinct, so every insertion either added to the cache or evicted something to make room
+        trace_messages(error_color, L"ERROR: The cache holds ", error_info_color, std::to_wstring(statistics.size),
+            error_color, L" entries after ", error_info_color, std::to_wstring(statistics.evictions), error_color,
+            L" evictions, which doesn't add up to the ", error_info_color,
+            std::to_wstring(thread_count * keys_per_thread), error_color, L" keys that were added\n");
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    return check_size(cache, statistics.size);
+}
+
+std::int32_t ConcurrentCacheTestCount()
+{
+    return 4;
+}
+
+int ConcurrentCacheTests()
+{
+    int result = ERROR_SUCCESS;
+
+    test_begin("Concurrent Cache Eviction Test");
+    auto testResult = EvictionTest();
+    result = result ? result : testResult;
+    test_end(testResult);
+
+    test_begin("Concurrent Cache Erase Test");
+    testResult = EraseTest();
+    result = result ? result : testResult;
+    test_end(testResult);
+
+    test_begin("Concurrent Cache Insert/Find Test");
+    testResult = ConcurrentInsertFindTest(true);
+    result = result ? result : testResult;
+    test_end(testResult);
+
+    test_begin("Concurrent Cache Insert/Find Eviction Test");
+    testResult = ConcurrentInsertFindTest(false);
+    result = result ? result : testResult;
+    test_end(testResult);
+
+    return result;
+}
@@ -0,0 +1,336 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+//
+// Calls the redirected filesystem APIs from 1 to 64 threads at once, to find the places where the fixups serialize
+// calls that could run in parallel (e.g. a lock around a cache, or around trace output). Each API gets called in two
+// ways:
+//  * Shared, where every thread uses the same package file and directory. The first calls race each other to copy the
+//    file to the redirected path
+//  * Disjoint, where every thread has a package directory of its own, so nothing that the threads do overlaps on disk
+// Every thread makes the same number of calls, so if the calls were fully serialized, the throughput would stay the same
+// as on a single thread. Throughput that drops well below that means that the threads slow each other down, which gets
+// flagged with a warning. Timings on a loaded machine are too noisy to fail the test over, so only failed calls and
+// corrupted files fail it
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <file_paths.h>
+#include <psf_utils.h>
+#include <test_config.h>
+
+using namespace std::literals;
+
+// The package has a 'Thread<N>' directory for each thread up to the last of these (see FileMapping.txt)
+constexpr int thread_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+// Calls made by each thread for every thread count when not benchmarking. Enough to make sure that the threads overlap
+constexpr int test_calls_per_thread = 50;
+
+// Throughput below this fraction of the single threaded throughput gets flagged. Anything less than 1.0 is worse than
+// running the calls one after another, but some slack keeps the noise from getting flagged
+constexpr double slowdown_threshold = 0.8;
+
+constexpr char g_expectedFileContents[] = "You are reading from the package path";
+
+enum class path_sharing
+{
+    shared,
+    disjoint,
+};
+
+static const char* path_sharing_description(path_sharing sharing)
+{
+    return (sharing == path_sharing::shared) ? "Shared" : "Disjoint";
+}
+
+// Redirected by the "Scaling" pattern in config.json. The package has 'file.txt' in it, as well as in each of the
+// 'Thread<N>' directories under it, all with the same contents
+static const std::wstring& scaling_path()
+{
+    static const std::wstring result = (psf::current_package_path() / L"Scaling").native();
+    return result;
+}
+
+struct thread_paths
+{
+    std::wstring file;
+    std::wstring pattern;
+    std::wstring copy;
+    std::wstring move_from;
+    std::wstring move_to;
+};
+
+static thread_paths make_thread_paths(path_sharing sharing, int index)
+{
+    auto dir = scaling_path();
+    if (sharing == path_sharing::disjoint)
+    {
+        dir += L"\\Thread" + std::to_wstring(index);
+    }
+
+    // Even when sharing the directory, the files that get written to are per-thread, since two threads can't move the
+    // same file at once
+    auto suffix = std::to_wstring(index) + L".txt";
+    return { dir + L"\\file.txt", dir + L"\\*", dir + L"\\Copy" + suffix, dir + L"\\MoveFrom" + suffix, dir + L"\\MoveTo" + suffix };
+}
+
+struct workload
+{
+    const char* api;
+
+    // Called once for each thread before any of them start, but not timed. May set the last error and return false
+    std::function<bool(const thread_paths&)> prepare;
+
+    // Makes the 'call'th call on the thread. Sets the last error and returns false on failure
+    std::function<bool(const thread_paths&, int call)> run;
+};
+
+static std::vector<workload> make_workloads()
+{
+    return {
+        {
+            "CreateFile",
+            nullptr,
+            [](const thread_paths& paths, int)
+            {
+                // Opened for writing so that the first call copies the file to the redirected path
+                auto file = ::CreateFileW(paths.file.c_str(), GENERIC_READ | GENERIC_WRITE,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file == INVALID_HANDLE_VALUE)
+                {
+                    return false;
+                }
+
+                ::CloseHandle(file);
+                return true;
+            }
+        },
+        {
+            "GetFileAttributes",
+            nullptr,
+            [](const thread_paths& paths, int) { return ::GetFileAttributesW(paths.file.c_str()) != INVALID_FILE_ATTRIBUTES; }
+        },
+        {
+            "FindFirstFile/FindNextFile",
+            nullptr,
+            [](const thread_paths& paths, int)
+            {
+                WIN32_FIND_DATAW data;
+                auto findHandle = ::FindFirstFileW(paths.pattern.c_str(), &data);
+                if (findHandle == INVALID_HANDLE_VALUE)
+                {
+                    return false;
+                }
+
+                while (::FindNextFileW(findHandle, &data))
+                {
+                }
+
+                auto error = ::GetLastError();
+                ::FindClose(findHandle);
+                ::SetLastError(error);
+                return error == ERROR_NO_MORE_FILES;
+            }
+        },
+        {
+            "CopyFile",
+            nullptr,
+            [](const thread_paths& paths, int) { return !!::CopyFileW(paths.file.c_str(), paths.copy.c_str(), false); }
+        },
+        {
+            "MoveFile",
+            [](const thread_paths& paths) { return create_empty_file(paths.move_from.c_str()); },
+            [](const thread_paths& paths, int call)
+            {
+                // Back and forth, so that there's always a file to move
+                return (call % 2) ?
+                    !!::MoveFileW(paths.move_to.c_str(), paths.move_from.c_str()) :
+                    !!::MoveFileW(paths.move_from.c_str(), paths.move_to.c_str());
+            }
+        },
+    };
+}
+
+struct scaling_result
+{
+    int error = ERROR_SUCCESS;
+    double calls_per_second = 0;
+};
+
+// Runs the workload on 'threadCount' threads, all of which start at once, and times the lot
+static scaling_result run_threads(const workload& work, path_sharing sharing, int threadCount, int callsPerThread)
+{
+    scaling_result result;
+
+    std::vector<thread_paths> paths;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        paths.push_back(make_thread_paths(sharing, i));
+        if (work.prepare && !work.prepare(paths.back()))
+        {
+            result.error = trace_last_error(L"Failed to prepare for the calls");
+            return result;
+        }
+    }
+
+    unique_handle startEvent(::CreateEventW(nullptr, true, false, nullptr));
+    if (!startEvent)
+    {
+        result.error = trace_last_error(L"Failed to create the event that starts the threads");
+        return result;
+    }
+
+    std::atomic<int> readyCount = 0;
+    std::atomic<int> firstError = ERROR_SUCCESS;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([&, i]
+        {
+            ++readyCount;
+            ::WaitForSingleObject(startEvent.get(), INFINITE);
+            for (int call = 0; call < callsPerThread; ++call)
+            {
+                if (!work.run(paths[i], call))
+                {
+                    int expected = ERROR_SUCCESS;
+                    auto error = ::GetLastError();
+                    firstError.compare_exchange_strong(expected, error ? static_cast<int>(error) : ERROR_ASSERTION_FAILURE);
+                    break;
+                }
+            }
+        });
+    }
+
+    // Creating the threads isn't part of the timing, so wait for all of them to get going before starting the clock
+    while (readyCount < threadCount)
+    {
+        ::Sleep(0);
+    }
+
+    LARGE_INTEGER frequency, start, end;
+    ::QueryPerformanceFrequency(&frequency);
+    ::QueryPerformanceCounter(&start);
+    ::SetEvent(startEvent.get());
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    ::QueryPerformanceCounter(&end);
+
+    if (firstError != ERROR_SUCCESS)
+    {
+        result.error = trace_error(firstError.load(), (std::wstring(widen(work.api)) + L" failed").c_str());
+        return result;
+    }
+
+    auto seconds = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    result.calls_per_second = (static_cast<double>(threadCount) * callsPerThread) / seconds;
+    return result;
+}
+
+// The copies of the shared file race each other, none of which should leave the file any different from the package's
+static int check_shared_file()
+{
+    if (auto contents = read_entire_file(make_thread_paths(path_sharing::shared, 0).file.c_str()); contents != g_expectedFileContents)
+    {
+        trace_message(L"ERROR: The shared file's contents do not match expected contents\n", error_color);
+        trace_messages(error_color, L"ERROR: Expected contents: ", error_info_color, g_expectedFileContents, new_line);
+        trace_messages(error_color, L"ERROR: File contents: ", error_info_color, contents, new_line);
+        return ERROR_ASSERTION_FAILURE;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static int DoScalingTest(const workload& work, path_sharing sharing, int callsPerThread, bool benchmarking)
+{
+    auto description = path_sharing_description(sharing);
+    double singleThreadedCallsPerSecond = 0;
+    for (auto threadCount : thread_counts)
+    {
+        // Every thread count starts from the package's files, so that the first calls copy them again
+        clean_redirection_path();
+
+        auto result = run_threads(work, sharing, threadCount, callsPerThread);
+        if (result.error)
+        {
+            return result.error;
+        }
+        else if (sharing == path_sharing::shared)
+        {
+            if (auto error = check_shared_file())
+            {
+                return error;
+            }
+        }
+
+        auto threadDescription = std::to_string(threadCount) + ((threadCount == 1) ? " Thread" : " Threads");
+        trace_messages(L"Calls per second with ", info_color, widen(threadDescription), console::color::gray, L": ",
+            info_color, std::to_wstring(static_cast<std::int64_t>(result.calls_per_second)), new_line);
+
+        if (threadCount == 1)
+        {
+            singleThreadedCallsPerSecond = result.calls_per_second;
+        }
+        else if (result.calls_per_second < singleThreadedCallsPerSecond * slowdown_threshold)
+        {
+            trace_messages(warning_color, L"WARNING: ", warning_info_color, std::to_wstring(threadCount), warning_color,
+                L" threads make fewer calls per second than a single thread, by a factor of ", warning_info_color,
+                std::to_wstring(singleThreadedCallsPerSecond / result.calls_per_second), new_line);
+        }
+
+        if (benchmarking)
+        {
+            // The time per call is that of the whole run, i.e. the inverse of the throughput
+            auto name = work.api + (" ("s + description + ", " + threadDescription + ")");
+            if (auto error = test_benchmark(name, benchmark_setup::fixups, threadCount * callsPerThread, 1000000.0 / result.calls_per_second))
+            {
+                return error;
+            }
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+std::int32_t ScalingTestCount()
+{
+    return static_cast<std::int32_t>(make_workloads().size() * 2);
+}
+
+int ScalingTests(int callsPerThread, bool benchmarking)
+{
+    if (callsPerThread <= 0)
+    {
+        std::wcout << error_text() << "ERROR: The benchmark iteration count must be a positive number\n";
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    int result = ERROR_SUCCESS;
+    for (auto& work : make_workloads())
+    {
+        for (auto sharing : { path_sharing::shared, path_sharing::disjoint })
+        {
+            test_begin(work.api + (" Scaling ("s + path_sharing_description(sharing) + ")"));
+            auto testResult = DoScalingTest(work, sharing, callsPerThread, benchmarking);
+            result = result ? result : testResult;
+            test_end(testResult);
+        }
+    }
+
+    clean_redirection_path();
+    return result;
+}
+
+int ScalingTests()
+{
+    return ScalingTests(test_calls_per_thread, false);
+}
@@ -0,0 +1,48 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <cstdlib>
+
+#include <windows.h>
+
+#include <test_config.h>
+
+using namespace std::literals;
+
+std::int32_t ScalingTestCount();
+int ScalingTests();
+int ScalingTests(int callsPerThread, bool benchmarking);
+
+std::int32_t ConcurrentCacheTestCount();
+int ConcurrentCacheTests();
+
+int wmain(int argc, const wchar_t** argv)
+{
+    std::map<std::wstring_view, std::wstring> allowedArgs;
+    allowedArgs.emplace(L"/benchmark"sv, L"");
+    auto result = parse_args(argc, argv, allowedArgs);
+    if ((result == ERROR_SUCCESS) && !allowedArgs[L"/benchmark"sv].empty())
+    {
+        // The iteration count is the number of calls that each thread makes
+        test_initialize("Scaling Benchmarks", ScalingTestCount());
+        result = ScalingTests(std::wcstol(allowedArgs[L"/benchmark"sv].c_str(), nullptr, 10), true);
+        test_cleanup();
+    }
+    else if (result == ERROR_SUCCESS)
+    {
+        test_initialize("Scaling Tests", ScalingTestCount() + ConcurrentCacheTestCount());
+        result = ScalingTests();
+        auto cacheResult = ConcurrentCacheTests();
+        result = result ? result : cacheResult;
+        test_cleanup();
+    }
+
+    if (!g_testRunnerPipe)
+    {
+        system("pause");
+    }
+
+    return result;
+}